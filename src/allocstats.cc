@@ -0,0 +1,106 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "allocstats.h"
+
+#include "common.h"
+
+namespace txmpp {
+
+volatile int AllocStats::enabled_ = 0;
+volatile uint64 AllocStats::allocations_[AS_COUNT];
+volatile uint64 AllocStats::bytes_[AS_COUNT];
+volatile uint64 AllocStats::stanzas_ = 0;
+
+void AllocStats::Enable(bool on) {
+  AtomicOps::RelaxedStore(&enabled_, on ? 1 : 0);
+}
+
+void AllocStats::Add(Subsystem subsystem, size_t bytes) {
+  AtomicOps::Add(&allocations_[subsystem], 1);
+  AtomicOps::Add(&bytes_[subsystem], bytes);
+}
+
+void AllocStats::GetSnapshot(Snapshot* snapshot) {
+  for (int i = 0; i < AS_COUNT; ++i) {
+    snapshot->subsystems[i].allocations =
+        AtomicOps::AcquireLoad(&allocations_[i]);
+    snapshot->subsystems[i].bytes = AtomicOps::AcquireLoad(&bytes_[i]);
+  }
+  snapshot->stanzas = AtomicOps::AcquireLoad(&stanzas_);
+}
+
+void AllocStats::Reset() {
+  for (int i = 0; i < AS_COUNT; ++i) {
+    AtomicOps::Exchange(&allocations_[i], 0);
+    AtomicOps::Exchange(&bytes_[i], 0);
+  }
+  AtomicOps::Exchange(&stanzas_, 0);
+}
+
+const char* AllocStats::Name(Subsystem subsystem) {
+  static const char* const kNames[AS_COUNT] = {
+    "xml_node",
+    "xml_attr",
+    "xml_text",
+    "message_data",
+    "byte_buffer",
+    "task",
+    "qname",
+  };
+  ASSERT(subsystem >= 0 && subsystem < AS_COUNT);
+  return kNames[subsystem];
+}
+
+AllocStats::Counts AllocStats::Snapshot::Total() const {
+  Counts total = { 0, 0 };
+  for (int i = 0; i < AS_COUNT; ++i) {
+    total.allocations += subsystems[i].allocations;
+    total.bytes += subsystems[i].bytes;
+  }
+  return total;
+}
+
+double AllocStats::Snapshot::AllocationsPerStanza(Subsystem subsystem) const {
+  return stanzas ?
+      static_cast<double>(subsystems[subsystem].allocations) / stanzas : 0;
+}
+
+double AllocStats::Snapshot::BytesPerStanza(Subsystem subsystem) const {
+  return stanzas ?
+      static_cast<double>(subsystems[subsystem].bytes) / stanzas : 0;
+}
+
+double AllocStats::Snapshot::AllocationsPerStanza() const {
+  return stanzas ? static_cast<double>(Total().allocations) / stanzas : 0;
+}
+
+double AllocStats::Snapshot::BytesPerStanza() const {
+  return stanzas ? static_cast<double>(Total().bytes) / stanzas : 0;
+}
+
+}  // namespace txmpp
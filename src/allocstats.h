@@ -0,0 +1,110 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_ALLOCSTATS_H_
+#define _TXMPP_ALLOCSTATS_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+
+#include "basictypes.h"
+#include "criticalsection.h"
+
+namespace txmpp {
+
+// Counts the allocations the hot-path types make, by subsystem, and the
+// stanzas XmppEngineImpl handles, so that heap churn can be put down to a
+// component and given per stanza.  An allocation is counted where the type
+// asks for memory, whether it then comes from the heap, a BlockPool or an
+// XmlArena; bytes are what was asked for.
+//
+// Off by default, when each hook is a load and a branch.  Once enabled, any
+// thread may count, with an atomic add on counters shared by all threads,
+// so enable it to measure rather than in production.
+class AllocStats {
+ public:
+  enum Subsystem {
+    AS_XML_NODE,      // XmlElement and XmlText objects, and shared bodies.
+    AS_XML_ATTR,      // Arrays of XmlAttr.
+    AS_XML_TEXT,      // Chunks of parsed text.
+    AS_MESSAGE_DATA,  // MessageData of posted messages.
+    AS_BYTE_BUFFER,   // ByteBuffer storage.
+    AS_TASK,          // Task objects.
+    AS_QNAME,         // QName::Data, with its strings.
+    AS_COUNT
+  };
+
+  struct Counts {
+    uint64 allocations;
+    uint64 bytes;
+  };
+
+  struct Snapshot {
+    Counts subsystems[AS_COUNT];
+    uint64 stanzas;
+
+    Counts Total() const;
+    // Divided by the stanzas handled, or 0 if none were.
+    double AllocationsPerStanza(Subsystem subsystem) const;
+    double BytesPerStanza(Subsystem subsystem) const;
+    double AllocationsPerStanza() const;
+    double BytesPerStanza() const;
+  };
+
+  static void Enable(bool on);
+  static bool enabled() { return AtomicOps::RelaxedLoad(&enabled_) != 0; }
+
+  static void Record(Subsystem subsystem, size_t bytes) {
+    if (enabled())
+      Add(subsystem, bytes);
+  }
+  static void RecordStanza() {
+    if (enabled())
+      AtomicOps::Add(&stanzas_, 1);
+  }
+
+  static void GetSnapshot(Snapshot* snapshot);
+  // Not atomic: counts recorded meanwhile may be partly kept.
+  static void Reset();
+
+  static const char* Name(Subsystem subsystem);
+
+ private:
+  static void Add(Subsystem subsystem, size_t bytes);
+
+  static volatile int enabled_;
+  static volatile uint64 allocations_[AS_COUNT];
+  static volatile uint64 bytes_[AS_COUNT];
+  static volatile uint64 stanzas_;
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_ALLOCSTATS_H_
@@ -114,6 +114,9 @@ class AsyncSocketAdapter : public AsyncSocket, public has_slots<> {
   virtual int SetOption(Option opt, int value) {
     return socket_->SetOption(opt, value);
   }
+  virtual bool StartKernelTls(const void* crypto_info, size_t len) {
+    return socket_->StartKernelTls(crypto_info, len);
+  }
 
  protected:
   virtual void OnConnectEvent(AsyncSocket* socket) {
@@ -66,6 +66,7 @@ AsyncTCPSocket::AsyncTCPSocket(AsyncSocket* socket, bool listen)
       insize_(BUF_SIZE),
       inpos_(0),
       outsize_(BUF_SIZE),
+      outstart_(0),
       outpos_(0) {
   inbuf_ = new char[insize_];
   outbuf_ = new char[outsize_];
@@ -124,7 +125,75 @@ int AsyncTCPSocket::SendTo(const void *pv, size_t cb,
   return -1;
 }
 
+int AsyncTCPSocket::SendPackets(const IoVec* packets, size_t count) {
+  // Each packet is a length and its bytes.
+  static const size_t kMaxBatch = 8;
+
+  // If we are blocking on send, then silently drop these packets
+  if (outpos_)
+    return static_cast<int>(count);
+
+  size_t taken = 0;
+  while (taken < count) {
+    PacketLength lengths[kMaxBatch];
+    IoVec vec[2 * kMaxBatch];
+    size_t batch = 0, bytes = 0;
+    while (batch < kMaxBatch && taken + batch < count) {
+      const IoVec& packet = packets[taken + batch];
+      if (packet.len > MAX_PACKET_SIZE) {
+        if (taken + batch == 0) {
+          socket_->SetError(EMSGSIZE);
+          return -1;
+        }
+        break;
+      }
+      if (bytes + PKT_LEN_SIZE + packet.len > outsize_)
+        break;
+      lengths[batch] = HostToNetwork16(static_cast<PacketLength>(packet.len));
+      vec[2 * batch].data = &lengths[batch];
+      vec[2 * batch].len = PKT_LEN_SIZE;
+      vec[2 * batch + 1] = packet;
+      bytes += PKT_LEN_SIZE + packet.len;
+      ++batch;
+    }
+    if (batch == 0)
+      break;
+
+    int res = socket_->SendV(vec, 2 * batch);
+    if (res <= 0)
+      return (taken > 0) ? static_cast<int>(taken) : res;
+
+    // Hold on to the rest of the last packet begun, so that the stream
+    // stays framed; the packets after it are not taken.
+    size_t sent = static_cast<size_t>(res);
+    size_t i = 0;
+    while (i < 2 * batch && sent >= vec[i].len) {
+      sent -= vec[i].len;
+      ++i;
+    }
+    if (i == 2 * batch) {
+      taken += batch;
+      continue;
+    }
+    size_t end = (i % 2 == 0) ? i + 2 : i + 1;
+    for (size_t j = i; j < end; ++j) {
+      size_t offset = (j == i) ? sent : 0;
+      memcpy(outbuf_ + outpos_,
+             static_cast<const char*>(vec[j].data) + offset,
+             vec[j].len - offset);
+      outpos_ += vec[j].len - offset;
+    }
+    return static_cast<int>(taken + end / 2);
+  }
+  return static_cast<int>(taken);
+}
+
 int AsyncTCPSocket::SendRaw(const void * pv, size_t cb) {
+  if (outpos_ + cb > outsize_ && outstart_ > 0) {
+    memmove(outbuf_, outbuf_ + outstart_, outpos_ - outstart_);
+    outpos_ -= outstart_;
+    outstart_ = 0;
+  }
   if (outpos_ + cb > outsize_) {
     socket_->SetError(EMSGSIZE);
     return -1;
@@ -139,39 +208,41 @@ int AsyncTCPSocket::SendRaw(const void * pv, size_t cb) {
 void AsyncTCPSocket::ProcessInput(char * data, size_t& len) {
   SocketAddress remote_addr(GetRemoteAddress());
 
-  while (true) {
-    if (len < PKT_LEN_SIZE)
-      return;
-
+  // Packets are signalled where they lie, and only the partial one left at
+  // the end is moved, once per read.
+  size_t pos = 0;
+  while (len - pos >= PKT_LEN_SIZE) {
     PacketLength pkt_len;
-    memcpy(&pkt_len, data, PKT_LEN_SIZE);
+    memcpy(&pkt_len, data + pos, PKT_LEN_SIZE);
     pkt_len = NetworkToHost16(pkt_len);
 
-    if (len < PKT_LEN_SIZE + pkt_len)
-      return;
+    if (len - pos < PKT_LEN_SIZE + pkt_len)
+      break;
 
-    SignalReadPacket(this, data + PKT_LEN_SIZE, pkt_len, remote_addr);
+    SignalReadPacket(this, data + pos + PKT_LEN_SIZE, pkt_len, remote_addr);
+    pos += PKT_LEN_SIZE + pkt_len;
+  }
 
-    len -= PKT_LEN_SIZE + pkt_len;
-    if (len > 0) {
-      memmove(data, data + PKT_LEN_SIZE + pkt_len, len);
-    }
+  len -= pos;
+  if (len > 0 && pos > 0) {
+    memmove(data, data + pos, len);
   }
 }
 
 int AsyncTCPSocket::Flush() {
-  int res = socket_->Send(outbuf_, outpos_);
+  int res = socket_->Send(outbuf_ + outstart_, outpos_ - outstart_);
   if (res <= 0) {
     return res;
   }
-  if (static_cast<size_t>(res) <= outpos_) {
-    outpos_ -= res;
+  if (static_cast<size_t>(res) <= outpos_ - outstart_) {
+    outstart_ += res;
   } else {
     ASSERT(false);
     return -1;
   }
-  if (outpos_ > 0) {
-    memmove(outbuf_, outbuf_ + res, outpos_);
+  // What is left stays where it is until it is all sent.
+  if (outstart_ == outpos_) {
+    outstart_ = outpos_ = 0;
   }
   return res;
 }
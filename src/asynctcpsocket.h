@@ -49,8 +49,17 @@ class AsyncTCPSocket : public AsyncPacketSocket {
   virtual int Send(const void* pv, size_t cb);
   virtual int SendTo(const void* pv, size_t cb, const SocketAddress& addr);
 
+  // Frames the |count| packets and sends them with as few gather writes as
+  // the output buffer allows, instead of a Send each. Returns the number of
+  // packets taken, which stops short after a write that blocks; the last
+  // packet taken may be partly held, and goes out before anything else.
+  // Nothing taken returns what Send would have.
+  int SendPackets(const IoVec* packets, size_t count);
+
  protected:
   int SendRaw(const void* pv, size_t cb);
+  // Signals each whole packet in the |len| bytes at |data|, then moves what
+  // is left of a partial one to the front, once, and sets |len| to it.
   virtual void ProcessInput(char* data, size_t& len);
 
  private:
@@ -64,7 +73,8 @@ class AsyncTCPSocket : public AsyncPacketSocket {
 
   bool listen_;
   char* inbuf_, * outbuf_;
-  size_t insize_, inpos_, outsize_, outpos_;
+  // The output not yet sent is from outstart_ to outpos_.
+  size_t insize_, inpos_, outsize_, outstart_, outpos_;
 
   DISALLOW_EVIL_CONSTRUCTORS(AsyncTCPSocket);
 };
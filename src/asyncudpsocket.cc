@@ -31,17 +31,25 @@
 #pragma warning(disable:4786)
 #endif
 
+#include <algorithm>
+
 #include "logging.h"
 
 namespace txmpp {
 
 const int BUF_SIZE = 64 * 1024;
 
+// The most datagrams read at a time.
+const size_t kMaxBatch = 32;
+
+// The most reads per read event while full batches come in.
+const int kReadBudget = 8;
+
 AsyncUDPSocket::AsyncUDPSocket(AsyncSocket* socket)
-    : AsyncPacketSocket(socket) {
+    : AsyncPacketSocket(socket), buf_(NULL), size_(0), packets_(NULL),
+      batch_(0) {
   ASSERT(socket_ != NULL);
-  size_ = BUF_SIZE;
-  buf_ = new char[size_];
+  SetReadBatch(1, BUF_SIZE);
 
   // The socket should start out readable but not writable.
   socket_->SignalReadEvent.connect(this, &AsyncUDPSocket::OnReadEvent);
@@ -49,27 +57,89 @@ AsyncUDPSocket::AsyncUDPSocket(AsyncSocket* socket)
 
 AsyncUDPSocket::~AsyncUDPSocket() {
   delete [] buf_;
+  delete [] packets_;
+}
+
+int AsyncUDPSocket::SendToMany(const Datagram* packets, size_t count) {
+  return socket_->SendToMany(packets, count);
+}
+
+void AsyncUDPSocket::SetReadBatch(size_t count, size_t max_size) {
+  ASSERT(count > 0 && max_size > 0);
+  count = std::max<size_t>(1, std::min(count, kMaxBatch));
+  delete [] buf_;
+  delete [] packets_;
+  size_ = count * max_size;
+  buf_ = new char[size_];
+  packets_ = new DatagramBuffer[count];
+  batch_ = count;
+  for (size_t i = 0; i < count; ++i) {
+    packets_[i].data = buf_ + i * max_size;
+    packets_[i].size = max_size;
+    packets_[i].len = 0;
+  }
 }
 
 void AsyncUDPSocket::OnReadEvent(AsyncSocket* socket) {
   ASSERT(socket == socket_);
 
-  SocketAddress remote_addr;
-  int len = socket_->RecvFrom(buf_, size_, &remote_addr);
-  if (len < 0) {
-    // An error here typically means we got an ICMP error in response to our
-    // send datagram, indicating the remote address was unreachable.
-    // When doing ICE, this kind of thing will often happen.
-    // TODO: Do something better like forwarding the error to the user.
-    SocketAddress local_addr = socket_->GetLocalAddress();
-    LOG(LS_INFO) << "AsyncUDPSocket[" << local_addr.ToString() << "] "
-                 << "receive failed with error " << socket_->GetError();
-    return;
+  for (int round = 0; round < kReadBudget; ++round) {
+    int received;
+    if (batch_ == 1) {
+      int len = socket_->RecvFrom(buf_, size_, &packets_[0].addr);
+      if (len >= 0)
+        packets_[0].len = len;
+      received = (len < 0) ? len : 1;
+    } else {
+      received = socket_->RecvFromMany(packets_, batch_);
+    }
+    if (received < 0) {
+      // An error here typically means we got an ICMP error in response to our
+      // send datagram, indicating the remote address was unreachable.
+      // When doing ICE, this kind of thing will often happen.
+      // TODO: Do something better like forwarding the error to the user.
+      // Later reads of an event are expected to run out.
+      if (round == 0 || !socket_->IsBlocking()) {
+        SocketAddress local_addr = socket_->GetLocalAddress();
+        LOG(LS_INFO) << "AsyncUDPSocket[" << local_addr.ToString() << "] "
+                     << "receive failed with error " << socket_->GetError();
+      }
+      return;
+    }
+
+    // TODO: Make sure that we got all of the packet when reading one at a
+    // time. If we did not, then we should resize our buffer to be large
+    // enough.
+    DeliverPackets(received);
+    if (batch_ == 1 || static_cast<size_t>(received) < batch_)
+      return;
   }
+}
 
-  // TODO: Make sure that we got all of the packet.
-  // If we did not, then we should resize our buffer to be large enough.
-  SignalReadPacket(this, buf_, (size_t)len, remote_addr);
+void AsyncUDPSocket::DeliverPackets(size_t count) {
+  // Drop the datagrams that were cut short. The buffers are swapped rather
+  // than copied so that each still has its own part of buf_.
+  size_t kept = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (packets_[i].len > packets_[i].size) {
+      LOG(LS_WARNING) << "AsyncUDPSocket[" << GetLocalAddress().ToString()
+                      << "] dropped a datagram of " << packets_[i].len
+                      << " bytes from " << packets_[i].addr.ToString();
+      continue;
+    }
+    if (kept != i)
+      std::swap(packets_[kept], packets_[i]);
+    ++kept;
+  }
+
+  if (!SignalReadPackets.is_empty()) {
+    SignalReadPackets(this, packets_, kept);
+    return;
+  }
+  for (size_t i = 0; i < kept; ++i) {
+    SignalReadPacket(this, static_cast<const char*>(packets_[i].data),
+                     packets_[i].len, packets_[i].addr);
+  }
 }
 
 }  // namespace txmpp
@@ -50,12 +50,33 @@ class AsyncUDPSocket : public AsyncPacketSocket {
   explicit AsyncUDPSocket(AsyncSocket* socket);
   virtual ~AsyncUDPSocket();
 
+  // Sends each datagram to its address, with one system call where the
+  // socket can, and returns how many were sent. With OPT_UDP_SEGMENT set,
+  // the kernel splits each larger datagram into datagrams of that size.
+  int SendToMany(const Datagram* packets, size_t count);
+
+  // Reads up to |count| datagrams of up to |max_size| bytes at a time, and
+  // keeps reading for as long as full batches come in, up to a budget per
+  // read event. Longer datagrams are dropped. The default, one datagram of
+  // up to 64K, reads once per event. Not to be called from a handler of the
+  // read signals.
+  void SetReadBatch(size_t count, size_t max_size);
+
+  // Emitted with each batch of datagrams read if connected, in which case
+  // SignalReadPacket is not. The buffers are only valid in the handler.
+  signal3<AsyncPacketSocket*, const DatagramBuffer*,
+          size_t> SignalReadPackets;
+
  private:
   // Called when the underlying socket is ready to be read from.
   void OnReadEvent(AsyncSocket* socket);
+  // Passes the |count| datagrams read into packets_ on.
+  void DeliverPackets(size_t count);
 
   char* buf_;
   size_t size_;
+  DatagramBuffer* packets_;
+  size_t batch_;
 };
 
 // TODO(juberti): This is now deprecated. Remove it.
@@ -27,9 +27,13 @@
 
 #include "autodetectproxy.h"
 
+#include <map>
+
+#include "criticalsection.h"
 #include "httpcommon.h"
 #include "httpcommon-inl.h"
 #include "proxydetect.h"
+#include "time.h"
 
 namespace txmpp {
 
@@ -39,13 +43,56 @@ static const ProxyType TEST_ORDER[] = {
   PROXY_HTTPS, PROXY_SOCKS5, PROXY_UNKNOWN
 };
 
+// How long all the probes together may take.
+static const int kProbeTimeout = 2000;
+// How long the type found for a proxy address is trusted.
+static const int kRememberTimeout = 10 * 60 * 1000;
+
+struct RememberedProxyType {
+  ProxyType type;
+  uint32 expires;
+};
+
+typedef std::map<std::string, RememberedProxyType> RememberedProxyTypes;
+
+static CriticalSection remembered_crit;
+static RememberedProxyTypes remembered_types;
+
+static bool AutoDetectProxy_Recall(const SocketAddress& address,
+                                   ProxyType* type) {
+  CritScope cs(&remembered_crit);
+  RememberedProxyTypes::iterator it =
+      remembered_types.find(address.ToString());
+  if (it == remembered_types.end())
+    return false;
+  if (TimeUntil(it->second.expires) <= 0) {
+    remembered_types.erase(it);
+    return false;
+  }
+  *type = it->second.type;
+  return true;
+}
+
+static void AutoDetectProxy_Remember(const SocketAddress& address,
+                                     ProxyType type) {
+  CritScope cs(&remembered_crit);
+  RememberedProxyType& remembered = remembered_types[address.ToString()];
+  remembered.type = type;
+  remembered.expires = TimeAfter(kRememberTimeout);
+}
+
 AutoDetectProxy::AutoDetectProxy(const std::string& user_agent)
-    : agent_(user_agent), socket_(NULL), next_(0) {
+    : agent_(user_agent), complete_(false) {
 }
 
 AutoDetectProxy::~AutoDetectProxy() {
 }
 
+void AutoDetectProxy::ForgetProxyTypes() {
+  CritScope cs(&remembered_crit);
+  remembered_types.clear();
+}
+
 void AutoDetectProxy::DoWork() {
   // TODO(oja): Try connecting to server_url without proxy first here?
   if (!server_url_.empty()) {
@@ -59,13 +106,20 @@ void AutoDetectProxy::DoWork() {
     proxy_.address.SetIP(url.host());
   }
   LOG(LS_INFO) << "AutoDetectProxy found proxy at " << proxy_.address;
+  if (proxy_.type == PROXY_UNKNOWN &&
+      AutoDetectProxy_Recall(proxy_.address, &proxy_.type)) {
+    LOG(LS_INFO) << "AutoDetectProxy remembered " << proxy_.address
+                 << " as type " << proxy_.type;
+  }
   if (proxy_.type == PROXY_UNKNOWN) {
     LOG(LS_INFO) << "AutoDetectProxy initiating proxy classification";
-    Next();
+    Probe();
     // Process I/O until Stop()
     Thread::Current()->ProcessMessages(kForever);
-    // Clean up the autodetect socket, from the thread that created it
-    delete socket_;
+    // Clean up the autodetect sockets, from the thread that created them
+    for (size_t i = 0; i < sockets_.size(); ++i)
+      delete sockets_[i];
+    sockets_.clear();
   }
   // TODO(oja): If we found a proxy, try to use it to verify that it
   // works by sending a request to server_url. This could either be
@@ -74,54 +128,97 @@ void AutoDetectProxy::DoWork() {
 
 void AutoDetectProxy::OnMessage(Message *msg) {
   if (MSG_TIMEOUT == msg->message_id) {
-    OnCloseEvent(socket_, ETIMEDOUT);
+    LOG(LS_VERBOSE) << "AutoDetectProxy timed out";
+    Complete(PROXY_UNKNOWN);
   } else {
     SignalThread::OnMessage(msg);
   }
 }
 
-void AutoDetectProxy::Next() {
-  if (TEST_ORDER[next_] >= PROXY_UNKNOWN) {
-    Complete(PROXY_UNKNOWN);
-    return;
-  }
-
+void AutoDetectProxy::Probe() {
   LOG(LS_VERBOSE) << "AutoDetectProxy connecting to "
                   << proxy_.address.ToString();
 
-  if (socket_) {
-    Thread::Current()->Clear(this, MSG_TIMEOUT);
-    socket_->Close();
-    Thread::Current()->Dispose(socket_);
-    socket_ = NULL;
+  // The probes share nothing but the proxy, so rather than waiting out
+  // each wrong guess in turn, they all run at once and the first answer
+  // that makes sense wins.
+  for (size_t i = 0; TEST_ORDER[i] < PROXY_UNKNOWN; ++i) {
+    AsyncSocket* socket =
+        Thread::Current()->socketserver()->CreateAsyncSocket(SOCK_STREAM);
+    sockets_.push_back(socket);
+    if (!socket)
+      continue;
+    socket->SignalConnectEvent.connect(this, &AutoDetectProxy::OnConnectEvent);
+    socket->SignalReadEvent.connect(this, &AutoDetectProxy::OnReadEvent);
+    socket->SignalCloseEvent.connect(this, &AutoDetectProxy::OnCloseEvent);
   }
+  for (size_t i = 0; i < sockets_.size(); ++i) {
+    if (sockets_[i] && sockets_[i]->Connect(proxy_.address) < 0 &&
+        !sockets_[i]->IsBlocking()) {
+      Fail(sockets_[i]);
+    }
+    if (complete_)
+      return;
+  }
+  Fail(NULL);
+  if (!complete_)
+    Thread::Current()->PostDelayed(kProbeTimeout, this, MSG_TIMEOUT);
+}
 
-  socket_ = Thread::Current()->socketserver()->CreateAsyncSocket(SOCK_STREAM);
-  socket_->SignalConnectEvent.connect(this, &AutoDetectProxy::OnConnectEvent);
-  socket_->SignalReadEvent.connect(this, &AutoDetectProxy::OnReadEvent);
-  socket_->SignalCloseEvent.connect(this, &AutoDetectProxy::OnCloseEvent);
-  socket_->Connect(proxy_.address);
-
-  // Timeout after 2 seconds
-  Thread::Current()->PostDelayed(2000, this, MSG_TIMEOUT);
+void AutoDetectProxy::Fail(AsyncSocket* socket) {
+  int index = ProbeIndex(socket);
+  if (index >= 0) {
+    LOG(LS_VERBOSE) << "AutoDetectProxy probing type " << TEST_ORDER[index]
+                    << " failed";
+    socket->Close();
+    Thread::Current()->Dispose(socket);
+    sockets_[index] = NULL;
+  }
+  for (size_t i = 0; i < sockets_.size(); ++i) {
+    if (sockets_[i])
+      return;
+  }
+  Complete(PROXY_UNKNOWN);
 }
 
 void AutoDetectProxy::Complete(ProxyType type) {
+  if (complete_)
+    return;
+  complete_ = true;
   Thread::Current()->Clear(this, MSG_TIMEOUT);
-  socket_->Close();
+  for (size_t i = 0; i < sockets_.size(); ++i) {
+    if (sockets_[i])
+      sockets_[i]->Close();
+  }
 
   proxy_.type = type;
   LoggingSeverity sev = (proxy_.type == PROXY_UNKNOWN) ? LS_ERROR : LS_INFO;
   LOG_V(sev) << "AutoDetectProxy detected " << proxy_.address.ToString()
              << " as type " << proxy_.type;
+  if (proxy_.type != PROXY_UNKNOWN)
+    AutoDetectProxy_Remember(proxy_.address, proxy_.type);
 
   Thread::Current()->Quit();
 }
 
+int AutoDetectProxy::ProbeIndex(AsyncSocket* socket) const {
+  if (!socket)
+    return -1;
+  for (size_t i = 0; i < sockets_.size(); ++i) {
+    if (sockets_[i] == socket)
+      return static_cast<int>(i);
+  }
+  return -1;
+}
+
 void AutoDetectProxy::OnConnectEvent(AsyncSocket * socket) {
+  int index = ProbeIndex(socket);
+  if (index < 0)
+    return;
+
   std::string probe;
 
-  switch (TEST_ORDER[next_]) {
+  switch (TEST_ORDER[index]) {
     case PROXY_HTTPS:
       probe.assign("CONNECT www.google.com:443 HTTP/1.0\r\n"
                    "User-Agent: ");
@@ -140,20 +237,24 @@ void AutoDetectProxy::OnConnectEvent(AsyncSocket * socket) {
       return;
   }
 
-  LOG(LS_VERBOSE) << "AutoDetectProxy probing type " << TEST_ORDER[next_]
+  LOG(LS_VERBOSE) << "AutoDetectProxy probing type " << TEST_ORDER[index]
                   << " sending " << probe.size() << " bytes";
-  socket_->Send(probe.data(), probe.size());
+  socket->Send(probe.data(), probe.size());
 }
 
 void AutoDetectProxy::OnReadEvent(AsyncSocket * socket) {
+  int index = ProbeIndex(socket);
+  if (index < 0)
+    return;
+
   char data[257];
-  int len = socket_->Recv(data, 256);
+  int len = socket->Recv(data, 256);
   if (len > 0) {
     data[len] = 0;
     LOG(LS_VERBOSE) << "AutoDetectProxy read " << len << " bytes";
   }
 
-  switch (TEST_ORDER[next_]) {
+  switch (TEST_ORDER[index]) {
     case PROXY_HTTPS:
       if ((len >= 2) && (data[0] == '\x05')) {
         Complete(PROXY_SOCKS5);
@@ -175,14 +276,12 @@ void AutoDetectProxy::OnReadEvent(AsyncSocket * socket) {
       return;
   }
 
-  ++next_;
-  Next();
+  Fail(socket);
 }
 
 void AutoDetectProxy::OnCloseEvent(AsyncSocket * socket, int error) {
   LOG(LS_VERBOSE) << "AutoDetectProxy closed with error: " << error;
-  ++next_;
-  Next();
+  Fail(socket);
 }
 
 }  // namespace txmpp
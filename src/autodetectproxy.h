@@ -33,6 +33,7 @@
 #endif
 
 #include <string>
+#include <vector>
 
 #include "cryptstring.h"
 #include "proxyinfo.h"
@@ -67,6 +68,12 @@ class AutoDetectProxy : public SignalThread {
     }
   }
 
+  // The type found for a proxy address is remembered for
+  // ten minutes, shared by all instances, so that later runs on the
+  // same network need not probe again. Forgets every type remembered, as
+  // when the network changes.
+  static void ForgetProxyTypes();
+
  protected:
   virtual ~AutoDetectProxy();
 
@@ -74,8 +81,13 @@ class AutoDetectProxy : public SignalThread {
   virtual void DoWork();
   virtual void OnMessage(Message *msg);
 
-  void Next();
+  // Starts one probe for each candidate type at once.
+  void Probe();
+  // Gives up on the probe on |socket|, completing if it was the last.
+  void Fail(AsyncSocket* socket);
   void Complete(ProxyType type);
+  // The index of the probe on |socket| in sockets_, or -1.
+  int ProbeIndex(AsyncSocket* socket) const;
 
   void OnConnectEvent(AsyncSocket * socket);
   void OnReadEvent(AsyncSocket * socket);
@@ -85,8 +97,9 @@ class AutoDetectProxy : public SignalThread {
   std::string agent_;
   std::string server_url_;
   ProxyInfo proxy_;
-  AsyncSocket* socket_;
-  int next_;
+  // The socket of each probe in TEST_ORDER, NULL once it has failed.
+  std::vector<AsyncSocket*> sockets_;
+  bool complete_;
 };
 
 }  // namespace txmpp
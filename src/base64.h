@@ -19,6 +19,19 @@
 #include <string>
 #include <vector>
 
+// Define BASE64_SIMD to 0 to encode and decode without the SSSE3 kernels,
+// which are otherwise used where the compiler can build them and the CPU
+// running them has SSSE3.
+#if !defined(BASE64_SIMD)
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || \
+     defined(__clang__))
+#define BASE64_SIMD 1
+#else
+#define BASE64_SIMD 0
+#endif
+#endif
+
 namespace txmpp {
 
 class Base64
@@ -83,6 +96,8 @@ public:
   }
 
 private:
+  friend class Base64Decoder;
+
   static const std::string Base64Table;
   static const unsigned char DecodeTable[];
 
@@ -95,6 +110,61 @@ private:
                                       size_t* data_used);
 };
 
+// Encodes a stream of bytes piecewise into buffers the caller provides.
+class Base64Encoder {
+public:
+  Base64Encoder() : pending_len_(0) {}
+
+  // The most chars Update writes for |len| bytes.
+  static size_t MaxEncodedSize(size_t len) { return (len + 2) / 3 * 4; }
+
+  // Encodes |len| more bytes of |data| into |out|, which must have room for
+  // MaxEncodedSize(len) chars, and returns how many it wrote.  Up to two
+  // bytes are held back for the next call.
+  size_t Update(const void* data, size_t len, char* out);
+  // Encodes the bytes held back, padded, into |out|, which must have room
+  // for 4 chars, and returns how many it wrote.  The encoder can then start
+  // on another stream.
+  size_t Finish(char* out);
+
+private:
+  unsigned char pending_[2];
+  size_t pending_len_;
+};
+
+// Decodes a stream of base64 piecewise into buffers the caller provides.
+// Whitespace is skipped and padding is optional, as with DO_PARSE_WHITE |
+// DO_PAD_ANY; any other char that isn't base64, data after the padding and
+// set unused bits are errors, which stick until Finish.
+class Base64Decoder {
+public:
+  Base64Decoder() : pending_len_(0), pad_len_(0), done_(false),
+                    failed_(false) {}
+
+  // The most bytes Update writes for |len| chars.
+  static size_t MaxDecodedSize(size_t len) { return (len + 3) / 4 * 3; }
+
+  // Decodes |len| more chars of |data| into |out|, which must have room for
+  // MaxDecodedSize(len) bytes, and sets |out_len| to how many it wrote.
+  // Returns false on an error.
+  bool Update(const char* data, size_t len, char* out, size_t* out_len);
+  // Decodes the chars held back from an unpadded end into |out|, which must
+  // have room for 2 bytes, and sets |out_len| to how many it wrote.  Returns
+  // false if there was an error or the stream ended within a byte.  The
+  // decoder can then start on another stream.
+  bool Finish(char* out, size_t* out_len);
+
+private:
+  // Decodes the full quantum in pending_, or the padded one, to |out|.
+  bool FlushQuantum(char* out, size_t* out_len);
+
+  unsigned char pending_[4];
+  size_t pending_len_;
+  size_t pad_len_;
+  bool done_;
+  bool failed_;
+};
+
 }  // namespace txmpp
 
 #endif  // TXMPP_BASE64_H_
@@ -119,4 +119,13 @@ inline void Unused(const void *) { }
 #define GCC_ATTR(x)
 #endif  // !__GNUC__
 
+// Fails to compile, with |msg| in the error, if |expr| is false at compile
+// time.  |msg| is a name, such as value_too_large.
+namespace txmpp {
+  template<bool> struct CompileAssert {};
+}
+#define COMPILE_ASSERT(expr, msg) \
+  typedef ::txmpp::CompileAssert<(bool(expr))> \
+      msg[bool(expr) ? 1 : -1] GCC_ATTR(unused)
+
 #endif  // _TXMPP_BASICTYPES_H_
@@ -0,0 +1,425 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "benchmark.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <new>
+#include <string>
+
+#include "../allocstats.h"
+#include "../criticalsection.h"
+#include "../time.h"
+
+// Counts every allocation made through operator new, by the library as well
+// as by the benchmarks, from any thread, and the bytes still allocated,
+// whose count is kept in front of each block. The replacements are kept out
+// of line, as GCC takes an inlined free of memory from operator new for a
+// mismatch.
+#if defined(__GNUC__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+// Dynamic exception specifications are gone from C++17, so the
+// replacements only carry them for C++98.
+#if __cplusplus < 201103L
+#define BENCH_THROWS_BAD_ALLOC throw(std::bad_alloc)
+#define BENCH_NOTHROW throw()
+#else
+#define BENCH_THROWS_BAD_ALLOC
+#define BENCH_NOTHROW noexcept
+#endif
+
+static volatile uint64 g_allocations = 0;
+static volatile uint64 g_live_bytes = 0;
+
+// Keeps the blocks as aligned as malloc does.
+static const size_t kBlockHeader = 16;
+
+BENCH_NOINLINE void* operator new(size_t size) BENCH_THROWS_BAD_ALLOC {
+  txmpp::AtomicOps::Add(&g_allocations, 1);
+  txmpp::AtomicOps::Add(&g_live_bytes, size);
+  char* p = static_cast<char*>(malloc(kBlockHeader + size));
+  if (!p)
+    throw std::bad_alloc();
+  *reinterpret_cast<size_t*>(p) = size;
+  return p + kBlockHeader;
+}
+
+BENCH_NOINLINE void* operator new[](size_t size) BENCH_THROWS_BAD_ALLOC {
+  return operator new(size);
+}
+
+BENCH_NOINLINE void operator delete(void* p) BENCH_NOTHROW {
+  if (!p)
+    return;
+  char* block = static_cast<char*>(p) - kBlockHeader;
+  txmpp::AtomicOps::Add(&g_live_bytes,
+                        0 - static_cast<uint64>(
+                            *reinterpret_cast<size_t*>(block)));
+  free(block);
+}
+
+BENCH_NOINLINE void operator delete[](void* p) BENCH_NOTHROW {
+  operator delete(p);
+}
+
+BENCH_NOINLINE void* operator new(size_t size,
+                                  const std::nothrow_t&) BENCH_NOTHROW {
+  try {
+    return operator new(size);
+  } catch (const std::bad_alloc&) {
+    return NULL;
+  }
+}
+
+BENCH_NOINLINE void* operator new[](size_t size,
+                                    const std::nothrow_t& nothrow)
+    BENCH_NOTHROW {
+  return operator new(size, nothrow);
+}
+
+BENCH_NOINLINE void operator delete(void* p,
+                                    const std::nothrow_t&) BENCH_NOTHROW {
+  operator delete(p);
+}
+
+BENCH_NOINLINE void operator delete[](void* p,
+                                      const std::nothrow_t&) BENCH_NOTHROW {
+  operator delete(p);
+}
+
+namespace bench {
+
+int64 LiveHeapBytes() {
+  return static_cast<int64>(txmpp::AtomicOps::AcquireLoad(&g_live_bytes));
+}
+
+// The AllocStats counts are for the library's own types only, and show
+// where the allocations counted above come from.
+struct Result {
+  double ns_per_op;
+  double allocations_per_op;
+  double subsystem_allocations_per_op[txmpp::AllocStats::AS_COUNT];
+  double subsystem_bytes_per_op[txmpp::AllocStats::AS_COUNT];
+
+  bool operator<(const Result& other) const {
+    return ns_per_op < other.ns_per_op;
+  }
+};
+
+static const int kRuns = 5;
+
+// The revision the benchmarks were built from, which the build passes in.
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+// Finds an iteration count that runs for at least |min_time_us|, then runs
+// that many kRuns times and returns the median run. |runs| is set to all of
+// them, in the order they ran.
+static Result Benchmark_Measure(Benchmark* benchmark, uint64 min_time_us,
+                                std::vector<Result>* runs) {
+  benchmark->Run(1);
+  int iterations = 1;
+  for (;;) {
+    uint64 start = txmpp::TimeMicros();
+    benchmark->Run(iterations);
+    uint64 elapsed = txmpp::TimeMicros() - start;
+    if (elapsed >= min_time_us / 4)
+      break;
+    iterations *= 2;
+  }
+  iterations *= 4;
+
+  std::vector<Result> results;
+  for (int run = 0; run < kRuns; ++run) {
+    txmpp::AllocStats::Snapshot before, after;
+    txmpp::AllocStats::GetSnapshot(&before);
+    uint64 allocations = txmpp::AtomicOps::AcquireLoad(&g_allocations);
+    uint64 start = txmpp::TimeMicros();
+    benchmark->Run(iterations);
+    uint64 elapsed = txmpp::TimeMicros() - start;
+    Result result;
+    result.ns_per_op = elapsed * 1000.0 / iterations;
+    result.allocations_per_op = static_cast<double>(
+        txmpp::AtomicOps::AcquireLoad(&g_allocations) - allocations) /
+        iterations;
+    txmpp::AllocStats::GetSnapshot(&after);
+    for (int i = 0; i < txmpp::AllocStats::AS_COUNT; ++i) {
+      result.subsystem_allocations_per_op[i] = static_cast<double>(
+          after.subsystems[i].allocations - before.subsystems[i].allocations) /
+          iterations;
+      result.subsystem_bytes_per_op[i] = static_cast<double>(
+          after.subsystems[i].bytes - before.subsystems[i].bytes) /
+          iterations;
+    }
+    results.push_back(result);
+  }
+  *runs = results;
+  std::sort(results.begin(), results.end());
+  return results[kRuns / 2];
+}
+
+// Appends |value| to |json| as a JSON string.
+static void Benchmark_AppendJsonString(std::string* json,
+                                       const std::string& value) {
+  json->push_back('"');
+  for (size_t i = 0; i < value.size(); ++i) {
+    unsigned char c = static_cast<unsigned char>(value[i]);
+    if (c == '"' || c == '\\') {
+      json->push_back('\\');
+      json->push_back(c);
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      json->append(escaped);
+    } else {
+      json->push_back(c);
+    }
+  }
+  json->push_back('"');
+}
+
+static void Benchmark_AppendJsonNumber(std::string* json, double value) {
+  char number[32];
+  snprintf(number, sizeof(number), "%.4f", value);
+  json->append(number);
+}
+
+// The processor's model name, where the system tells it.
+static std::string Benchmark_CpuModel() {
+  std::string model("unknown");
+#if defined(LINUX)
+  FILE* cpuinfo = fopen("/proc/cpuinfo", "r");
+  if (!cpuinfo)
+    return model;
+  char line[256];
+  while (fgets(line, sizeof(line), cpuinfo)) {
+    const char* colon = strchr(line, ':');
+    if (strncmp(line, "model name", 10) == 0 && colon) {
+      model = colon + 1;
+      size_t start = model.find_first_not_of(" \t");
+      size_t end = model.find_last_not_of(" \t\r\n");
+      model = (start == std::string::npos) ? "unknown"
+                                           : model.substr(start,
+                                                          end - start + 1);
+      break;
+    }
+  }
+  fclose(cpuinfo);
+#endif
+  return model;
+}
+
+static std::string Benchmark_Compiler() {
+#if defined(__clang__)
+  return "clang " __clang_version__;
+#elif defined(__GNUC__)
+  return "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+  char version[32];
+  snprintf(version, sizeof(version), "msvc %d", _MSC_VER);
+  return version;
+#else
+  return "unknown";
+#endif
+}
+
+// Starts the JSON document --json writes, with what the results depend on.
+static void Benchmark_StartJson(std::string* json, uint64 min_time_us) {
+  char date[32];
+  time_t now = time(NULL);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  json->append("{\n  \"context\": {\n    \"revision\": ");
+  Benchmark_AppendJsonString(json, BENCH_REVISION);
+  json->append(",\n    \"cpu\": ");
+  Benchmark_AppendJsonString(json, Benchmark_CpuModel());
+  json->append(",\n    \"compiler\": ");
+  Benchmark_AppendJsonString(json, Benchmark_Compiler());
+  json->append(",\n    \"date\": ");
+  Benchmark_AppendJsonString(json, date);
+  json->append(",\n    \"min_time_ms\": ");
+  Benchmark_AppendJsonNumber(json, min_time_us / 1000.0);
+  char runs[16];
+  snprintf(runs, sizeof(runs), "%d", kRuns);
+  json->append(",\n    \"runs\": ");
+  json->append(runs);
+  json->append("\n  },\n  \"benchmarks\": [");
+}
+
+// Appends a benchmark's results: the median run, and each run's time and
+// allocations, which a comparison needs to tell noise from a change.
+static void Benchmark_AppendJson(std::string* json, bool first,
+                                 const Benchmark* benchmark,
+                                 const Result& result,
+                                 const std::vector<Result>& runs) {
+  json->append(first ? "\n    {\"name\": " : ",\n    {\"name\": ");
+  Benchmark_AppendJsonString(json, benchmark->name());
+  json->append(", \"ns_per_op\": ");
+  Benchmark_AppendJsonNumber(json, result.ns_per_op);
+  if (benchmark->bytes_per_op()) {
+    json->append(", \"mb_per_s\": ");
+    Benchmark_AppendJsonNumber(json,
+                               benchmark->bytes_per_op() * 1000.0 /
+                               result.ns_per_op);
+  }
+  json->append(", \"allocs_per_op\": ");
+  Benchmark_AppendJsonNumber(json, result.allocations_per_op);
+  if (benchmark->live_bytes_per_op() >= 0) {
+    json->append(", \"live_bytes_per_op\": ");
+    Benchmark_AppendJsonNumber(json, benchmark->live_bytes_per_op());
+  }
+  json->append(",\n     \"runs_ns_per_op\": [");
+  for (size_t i = 0; i < runs.size(); ++i) {
+    if (i)
+      json->append(", ");
+    Benchmark_AppendJsonNumber(json, runs[i].ns_per_op);
+  }
+  json->append("],\n     \"runs_allocs_per_op\": [");
+  for (size_t i = 0; i < runs.size(); ++i) {
+    if (i)
+      json->append(", ");
+    Benchmark_AppendJsonNumber(json, runs[i].allocations_per_op);
+  }
+  json->append("]}");
+}
+
+// Prints a line for each subsystem that allocated, with its bytes per op
+// under MB/s.
+static void Benchmark_PrintSubsystems(const Result& result) {
+  for (int i = 0; i < txmpp::AllocStats::AS_COUNT; ++i) {
+    if (result.subsystem_allocations_per_op[i] > 0) {
+      printf("  %-42s %12s %10.1f %12.2f\n",
+             txmpp::AllocStats::Name(
+                 static_cast<txmpp::AllocStats::Subsystem>(i)),
+             "B/op:", result.subsystem_bytes_per_op[i],
+             result.subsystem_allocations_per_op[i]);
+    }
+  }
+}
+
+int RunBenchmarks(int argc, char* argv[], BenchmarkList* benchmarks) {
+  const char* filter = "";
+  const char* json_path = NULL;
+  uint64 min_time_us = 200000;
+  bool subsystems = false;
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--filter=", 9) == 0) {
+      filter = argv[i] + 9;
+    } else if (strncmp(argv[i], "--json=", 7) == 0) {
+      json_path = argv[i] + 7;
+    } else if (strncmp(argv[i], "--min-time-ms=", 14) == 0) {
+      min_time_us = strtoul(argv[i] + 14, NULL, 10) * 1000;
+    } else if (strcmp(argv[i], "--subsystems") == 0) {
+      subsystems = true;
+    } else {
+      fprintf(stderr, "usage: %s [--filter=SUBSTRING] [--min-time-ms=N]"
+              " [--subsystems] [--json=FILE]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (subsystems)
+    txmpp::AllocStats::Enable(true);
+
+  int status = 0;
+  std::string json;
+  bool first = true;
+  if (json_path)
+    Benchmark_StartJson(&json, min_time_us);
+
+  printf("%-44s %12s %10s %12s\n", "benchmark", "ns/op", "MB/s",
+         "allocs/op");
+  for (size_t i = 0; i < benchmarks->size(); ++i) {
+    Benchmark* benchmark = (*benchmarks)[i];
+    if (strstr(benchmark->name().c_str(), filter)) {
+      if (!benchmark->SetUp()) {
+        printf("%-44s %12s\n", benchmark->name().c_str(), "skipped");
+      } else {
+        std::vector<Result> runs;
+        Result result = Benchmark_Measure(benchmark, min_time_us, &runs);
+        benchmark->TearDown();
+        if (json_path) {
+          Benchmark_AppendJson(&json, first, benchmark, result, runs);
+          first = false;
+        }
+        if (benchmark->bytes_per_op()) {
+          printf("%-44s %12.1f %10.1f %12.2f\n", benchmark->name().c_str(),
+                 result.ns_per_op,
+                 benchmark->bytes_per_op() * 1000.0 / result.ns_per_op,
+                 result.allocations_per_op);
+        } else {
+          printf("%-44s %12.1f %10s %12.2f\n", benchmark->name().c_str(),
+                 result.ns_per_op, "-", result.allocations_per_op);
+        }
+        if (subsystems)
+          Benchmark_PrintSubsystems(result);
+        double limit = benchmark->max_allocations_per_op();
+        if (limit >= 0 && result.allocations_per_op > limit) {
+          printf("  FAILED: more than %.2f allocs/op\n", limit);
+          status = 1;
+        }
+        double live_bytes = benchmark->live_bytes_per_op();
+        if (live_bytes >= 0)
+          printf("  %-42s %12s %10.1f\n", "live", "B/op:", live_bytes);
+        limit = benchmark->max_live_bytes_per_op();
+        if (limit >= 0 && live_bytes > limit) {
+          printf("  FAILED: more than %.0f live B/op\n", limit);
+          status = 1;
+        }
+        if (!benchmark->failure().empty()) {
+          printf("  FAILED: %s\n", benchmark->failure().c_str());
+          status = 1;
+        }
+      }
+      fflush(stdout);
+    }
+    delete benchmark;
+  }
+  benchmarks->clear();
+
+  if (json_path) {
+    json.append("\n  ]\n}\n");
+    FILE* file = fopen(json_path, "w");
+    if (!file || fwrite(json.data(), 1, json.size(), file) != json.size()) {
+      fprintf(stderr, "couldn't write %s\n", json_path);
+      status = 1;
+    }
+    if (file)
+      fclose(file);
+  }
+  return status;
+}
+
+}  // namespace bench
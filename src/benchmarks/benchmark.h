@@ -0,0 +1,114 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BENCH_BENCHMARK_H_
+#define _BENCH_BENCHMARK_H_
+
+#include <string>
+#include <vector>
+
+#include "../basictypes.h"
+
+namespace bench {
+
+// Runs its operation |iterations| times per call to Run. State is set up
+// by the constructor where it is cheap, and otherwise by SetUp, which is
+// only called for the benchmarks that are run, as is TearDown after them.
+// bytes_per_op is the size of the data each operation handles, or 0.
+// max_allocations_per_op, if set, is the most heap allocations an operation
+// may make before the run fails, so that allocation regressions show.
+// A benchmark whose operations leave objects behind may measure them with
+// LiveHeapBytes and set live_bytes_per_op, which max_live_bytes_per_op
+// limits in the same way. A benchmark whose operations check what they did,
+// as for an ordering the code must keep, calls Fail when the check does not
+// hold, which fails the run too.
+class Benchmark {
+ public:
+  explicit Benchmark(const std::string& name)
+      : name_(name), bytes_per_op_(0), max_allocations_per_op_(-1),
+        live_bytes_per_op_(-1), max_live_bytes_per_op_(-1) {}
+  virtual ~Benchmark() {}
+
+  const std::string& name() const { return name_; }
+  size_t bytes_per_op() const { return bytes_per_op_; }
+  double max_allocations_per_op() const { return max_allocations_per_op_; }
+  double live_bytes_per_op() const { return live_bytes_per_op_; }
+  double max_live_bytes_per_op() const { return max_live_bytes_per_op_; }
+  // Why the benchmark failed, or empty.
+  const std::string& failure() const { return failure_; }
+
+  // Returns false if the benchmark can't run here, as when it needs more
+  // descriptors than the process may open.
+  virtual bool SetUp() { return true; }
+  virtual void Run(int iterations) = 0;
+  virtual void TearDown() {}
+
+ protected:
+  void set_bytes_per_op(size_t bytes) { bytes_per_op_ = bytes; }
+  void set_max_allocations_per_op(double allocations) {
+    max_allocations_per_op_ = allocations;
+  }
+  void set_live_bytes_per_op(double bytes) { live_bytes_per_op_ = bytes; }
+  void set_max_live_bytes_per_op(double bytes) {
+    max_live_bytes_per_op_ = bytes;
+  }
+  // Keeps the first failure.
+  void Fail(const std::string& why) {
+    if (failure_.empty())
+      failure_ = why;
+  }
+
+ private:
+  std::string name_;
+  size_t bytes_per_op_;
+  double max_allocations_per_op_;
+  double live_bytes_per_op_;
+  double max_live_bytes_per_op_;
+  std::string failure_;
+};
+
+typedef std::vector<Benchmark*> BenchmarkList;
+
+// The bytes asked of operator new and not yet deleted, by the whole
+// process. malloc is not counted, so neither is what expat holds.
+int64 LiveHeapBytes();
+
+// Parsing and printing stanzas, QNames and Jids.
+void AddXmlBenchmarks(BenchmarkList* benchmarks);
+// PhysicalSocketServer, MessageQueue and Thread.
+void AddReactorBenchmarks(BenchmarkList* benchmarks);
+// Logging in and keeping an XmppEngineImpl.
+void AddXmppBenchmarks(BenchmarkList* benchmarks);
+
+// Runs the benchmarks the command line selects, prints a line for each,
+// and deletes them all. Returns the exit status for main, which is 1 if a
+// benchmark went over its allocation limit or failed its check.
+int RunBenchmarks(int argc, char* argv[], BenchmarkList* benchmarks);
+
+}  // namespace bench
+
+#endif  // _BENCH_BENCHMARK_H_
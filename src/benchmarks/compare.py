@@ -0,0 +1,179 @@
+#!/usr/bin/env python
+#
+# txmpp
+# Copyright 2010, Silas Sewell
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#  1. Redistributions of source code must retain the above copyright notice,
+#     this list of conditions and the following disclaimer.
+#  2. Redistributions in binary form must reproduce the above copyright notice,
+#     this list of conditions and the following disclaimer in the documentation
+#     and/or other materials provided with the distribution.
+#  3. The name of the author may not be used to endorse or promote products
+#     derived from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+# WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+# EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+# PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+# OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+# WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+# OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+# ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+
+"""Compares two txmpp-bench --json results and reports regressions.
+
+  compare.py [--alpha=P] [--threshold=PERCENT] [--alloc-threshold=PERCENT]
+             BASELINE.json CANDIDATE.json
+
+A benchmark's time, and its MB/s with it, regresses when its runs are slower
+than the baseline's by a Mann-Whitney U test at --alpha (0.05), and its
+median is more than --threshold (5) percent slower. Allocations per op and
+live bytes per op regress when they grow by more than --alloc-threshold (1)
+percent, and for allocations, when the runs differ by the same test. The U
+test is exact over the runs' own values, so it holds for the few runs a
+benchmark makes and for ties. The exit status is 1 if anything regressed.
+"""
+
+from __future__ import print_function
+
+import itertools
+import json
+import sys
+
+
+def mann_whitney_p(a, b):
+    """The two-sided p-value of the U statistic of |a| against |b|, found by
+    trying every split of the pooled values into groups of their sizes."""
+    pooled = sorted(a + b)
+    ranks = {}
+    i = 0
+    while i < len(pooled):
+        j = i
+        while j < len(pooled) and pooled[j] == pooled[i]:
+            j += 1
+        ranks[pooled[i]] = (i + j + 1) / 2.0
+        i = j
+    values = [ranks[x] for x in a + b]
+    n = len(a)
+    mean = n * (len(values) + 1) / 2.0
+    observed = abs(sum(values[:n]) - mean)
+    extreme = 0
+    total = 0
+    for group in itertools.combinations(values, n):
+        total += 1
+        if abs(sum(group) - mean) >= observed - 1e-9:
+            extreme += 1
+    return float(extreme) / total
+
+
+def change(old, new):
+    if old == 0:
+        return 0.0 if new == 0 else float('inf')
+    return (new - old) / float(old)
+
+
+def load(path):
+    with open(path) as f:
+        document = json.load(f)
+    benchmarks = {}
+    order = []
+    for benchmark in document.get('benchmarks', []):
+        benchmarks[benchmark['name']] = benchmark
+        order.append(benchmark['name'])
+    return document.get('context', {}), benchmarks, order
+
+
+def usage():
+    print(__doc__.split('\n\n')[1], file=sys.stderr)
+    return 2
+
+
+def main(argv):
+    alpha = 0.05
+    threshold = 0.05
+    alloc_threshold = 0.01
+    paths = []
+    try:
+        for arg in argv[1:]:
+            if arg.startswith('--alpha='):
+                alpha = float(arg[8:])
+            elif arg.startswith('--threshold='):
+                threshold = float(arg[12:]) / 100
+            elif arg.startswith('--alloc-threshold='):
+                alloc_threshold = float(arg[18:]) / 100
+            elif arg.startswith('--'):
+                return usage()
+            else:
+                paths.append(arg)
+    except ValueError:
+        return usage()
+    if len(paths) != 2:
+        return usage()
+
+    old_context, old, _ = load(paths[0])
+    new_context, new, order = load(paths[1])
+    for key in ('revision', 'cpu', 'compiler'):
+        print('%-9s %s -> %s' % (key + ':', old_context.get(key, '?'),
+                                 new_context.get(key, '?')))
+    for key in ('cpu', 'compiler'):
+        if old_context.get(key) != new_context.get(key):
+            print('warning: the %s differs, so times may not compare' % key)
+    print()
+    print('%-40s %12s %12s %8s %7s' % ('benchmark', 'old', 'new', 'change',
+                                       'p'))
+
+    regressions = 0
+    for name in order:
+        if name not in old:
+            print('%-40s %12s' % (name, 'new'))
+            continue
+        a = old[name]
+        b = new[name]
+        notes = []
+
+        p = mann_whitney_p(a['runs_ns_per_op'], b['runs_ns_per_op'])
+        delta = change(a['ns_per_op'], b['ns_per_op'])
+        if p < alpha and delta > threshold:
+            notes.append('SLOWER')
+            if 'mb_per_s' in b:
+                notes.append('LESS MB/s')
+        elif p < alpha and delta < -threshold:
+            notes.append('faster')
+        line = '%-40s %12.1f %12.1f %+7.1f%% %7.3f %s' % (
+            name + ' ns/op', a['ns_per_op'], b['ns_per_op'], delta * 100, p,
+            ' '.join(notes))
+        print(line.rstrip())
+        regressions += notes.count('SLOWER')
+
+        p = mann_whitney_p(a['runs_allocs_per_op'], b['runs_allocs_per_op'])
+        delta = change(a['allocs_per_op'], b['allocs_per_op'])
+        if delta > alloc_threshold and p < alpha:
+            regressions += 1
+            print('%-40s %12.2f %12.2f %+7.1f%% %7.3f MORE ALLOCATIONS' % (
+                name + ' allocs/op', a['allocs_per_op'], b['allocs_per_op'],
+                delta * 100, p))
+
+        if 'live_bytes_per_op' in a and 'live_bytes_per_op' in b:
+            delta = change(a['live_bytes_per_op'], b['live_bytes_per_op'])
+            if delta > alloc_threshold:
+                regressions += 1
+                print('%-40s %12.1f %12.1f %+7.1f%% %7s MORE LIVE BYTES' % (
+                    name + ' live B/op', a['live_bytes_per_op'],
+                    b['live_bytes_per_op'], delta * 100, '-'))
+    for name in old:
+        if name not in new:
+            print('%-40s %12s' % (name, 'gone'))
+
+    print()
+    print('%d regression%s' % (regressions, '' if regressions == 1 else 's'))
+    return 1 if regressions else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,48 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Micro-benchmarks for the code on the stanza path. Each benchmark runs for
+// a fixed time, five times over, and the median run is reported as ns/op,
+// MB/s where the operation has a size, and heap allocations per op.
+// --subsystems adds the allocations of each AllocStats subsystem. The exit
+// status is 1 if a benchmark allocates more than its limit. --json writes
+// every run of every benchmark to FILE, with the revision, CPU and compiler,
+// for compare.py to check against another build's.
+//
+//   txmpp-bench [--filter=SUBSTRING] [--min-time-ms=N] [--subsystems]
+//               [--json=FILE]
+//   compare.py BASELINE.json CANDIDATE.json
+
+#include "benchmark.h"
+
+int main(int argc, char* argv[]) {
+  bench::BenchmarkList benchmarks;
+  bench::AddXmlBenchmarks(&benchmarks);
+  bench::AddReactorBenchmarks(&benchmarks);
+  bench::AddXmppBenchmarks(&benchmarks);
+  return bench::RunBenchmarks(argc, argv, &benchmarks);
+}
@@ -0,0 +1,752 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "benchmark.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef POSIX
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <string>
+#include <vector>
+
+#include "../asyncsocket.h"
+#include "../bufferallocator.h"
+#include "../bytebuffer.h"
+#include "../messagehandler.h"
+#include "../messagequeue.h"
+#include "../physicalsocketserver.h"
+#include "../scoped_ptr.h"
+#include "../sigslot.h"
+#include "../stream.h"
+#include "../thread.h"
+
+namespace bench {
+
+static std::string ReactorBenchmark_Number(int value) {
+  char buffer[16];
+  snprintf(buffer, sizeof(buffer), "%d", value);
+  return buffer;
+}
+
+class CountingHandler : public txmpp::MessageHandler {
+ public:
+  CountingHandler() : count_(0) {}
+  virtual void OnMessage(txmpp::Message* msg) { ++count_; }
+  int count() const { return count_; }
+
+ private:
+  int count_;
+};
+
+// Posts batches of messages to a queue and dispatches them, on one thread.
+class PostDispatchBenchmark : public Benchmark {
+ public:
+  PostDispatchBenchmark() : Benchmark("mq/post_dispatch") {}
+
+  virtual bool SetUp() {
+    queue_.reset(new txmpp::MessageQueue());
+    return true;
+  }
+
+  virtual void Run(int iterations) {
+    static const int kBatch = 1000;
+    txmpp::Message msg;
+    for (int done = 0; done < iterations; ) {
+      int batch = txmpp::_min(kBatch, iterations - done);
+      for (int i = 0; i < batch; ++i)
+        queue_->Post(&handler_);
+      while (queue_->Get(&msg, 0))
+        queue_->Dispatch(&msg);
+      done += batch;
+    }
+  }
+
+  virtual void TearDown() { queue_.reset(); }
+
+ private:
+  txmpp::scoped_ptr<txmpp::MessageQueue> queue_;
+  CountingHandler handler_;
+};
+
+// Posts a message, a delayed message that is already due and another
+// message, and dispatches them, in the timer wheel or the priority queue.
+// Get takes in due delayed messages after what was posted before, so the
+// order must be 1 3 2, as it always was.
+class PostOrderBenchmark : public Benchmark, public txmpp::MessageHandler {
+ public:
+  explicit PostOrderBenchmark(bool wheel)
+      : Benchmark(std::string("mq/post_order/") + (wheel ? "wheel" : "heap")),
+        wheel_(wheel) {}
+
+  virtual bool SetUp() {
+    queue_.reset(new txmpp::MessageQueue());
+    queue_->UseTimerWheel(wheel_);
+    return true;
+  }
+
+  virtual void Run(int iterations) {
+    static const char kExpected[] = "132";
+    txmpp::Message msg;
+    for (int i = 0; i < iterations; ++i) {
+      order_.clear();
+      queue_->Post(this, 1);
+      queue_->PostDelayed(0, this, 2);
+      queue_->Post(this, 3);
+      while (queue_->Get(&msg, 0))
+        queue_->Dispatch(&msg);
+      if (order_ != kExpected)
+        Fail("dispatched in the order " + order_ + ", not " + kExpected);
+    }
+  }
+
+  virtual void TearDown() { queue_.reset(); }
+
+  virtual void OnMessage(txmpp::Message* msg) {
+    order_.push_back(static_cast<char>('0' + msg->message_id));
+  }
+
+ private:
+  bool wheel_;
+  txmpp::scoped_ptr<txmpp::MessageQueue> queue_;
+  std::string order_;
+};
+
+// Deletes objects through the queue in batches of a thousand, with Dispose
+// or, as Dispose used to, with a DisposeData message each.
+class DisposeBenchmark : public Benchmark {
+ public:
+  explicit DisposeBenchmark(bool messages)
+      : Benchmark(messages ? "mq/dispose/messages" : "mq/dispose"),
+        messages_(messages) {}
+
+  virtual bool SetUp() {
+    queue_.reset(new txmpp::MessageQueue());
+    return true;
+  }
+
+  virtual void Run(int iterations) {
+    static const int kBatch = 1000;
+    txmpp::Message msg;
+    for (int done = 0; done < iterations; ) {
+      int batch = txmpp::_min(kBatch, iterations - done);
+      for (int i = 0; i < batch; ++i) {
+        Doomed* doomed = new Doomed;
+        if (messages_) {
+          queue_->Post(NULL, txmpp::MQID_DISPOSE,
+                       new txmpp::DisposeData<Doomed>(doomed));
+        } else {
+          queue_->Dispose(doomed);
+        }
+      }
+      while (!queue_->empty()) {
+        if (queue_->Get(&msg, 0))
+          queue_->Dispatch(&msg);
+      }
+      done += batch;
+    }
+  }
+
+  virtual void TearDown() { queue_.reset(); }
+
+ private:
+  struct Doomed {
+    char data[64];
+  };
+
+  bool messages_;
+  txmpp::scoped_ptr<txmpp::MessageQueue> queue_;
+};
+
+class Producer : public txmpp::Runnable {
+ public:
+  Producer() : queue_(NULL), handler_(NULL), count_(0) {}
+
+  void Init(txmpp::MessageQueue* queue, txmpp::MessageHandler* handler,
+            int count) {
+    queue_ = queue;
+    handler_ = handler;
+    count_ = count;
+  }
+
+  virtual void Run(txmpp::Thread* thread) {
+    for (int i = 0; i < count_; ++i)
+      queue_->Post(handler_);
+  }
+
+ private:
+  txmpp::MessageQueue* queue_;
+  txmpp::MessageHandler* handler_;
+  int count_;
+};
+
+// Posts from |producers| threads at once to a queue that this thread
+// dispatches as the messages come in.
+class MultiProducerBenchmark : public Benchmark {
+ public:
+  explicit MultiProducerBenchmark(int producers)
+      : Benchmark("mq/post_dispatch/producers" +
+                  ReactorBenchmark_Number(producers)),
+        producers_(producers) {}
+
+  virtual bool SetUp() {
+    queue_.reset(new txmpp::MessageQueue());
+    return true;
+  }
+
+  virtual void Run(int iterations) {
+    std::vector<Producer> producers(producers_);
+    std::vector<txmpp::Thread*> threads;
+    int target = handler_.count() + iterations;
+    for (int i = 0; i < producers_; ++i) {
+      int count = iterations / producers_;
+      if (i == 0)
+        count += iterations % producers_;
+      producers[i].Init(queue_.get(), &handler_, count);
+      threads.push_back(new txmpp::Thread());
+      threads[i]->Start(&producers[i]);
+    }
+    txmpp::Message msg;
+    while (handler_.count() < target) {
+      if (queue_->Get(&msg))
+        queue_->Dispatch(&msg);
+    }
+    for (int i = 0; i < producers_; ++i) {
+      threads[i]->Stop();
+      delete threads[i];
+    }
+  }
+
+  virtual void TearDown() { queue_.reset(); }
+
+ private:
+  int producers_;
+  txmpp::scoped_ptr<txmpp::MessageQueue> queue_;
+  CountingHandler handler_;
+};
+
+// Sends to another thread and waits for it to handle the message.  With
+// |spin_us|, the other thread busy polls for that long before it sleeps,
+// which only pays off when it has a core of its own.
+class SendBenchmark : public Benchmark {
+ public:
+  explicit SendBenchmark(int spin_us)
+      : Benchmark(spin_us ? "thread/send/busy_poll" : "thread/send"),
+        spin_us_(spin_us) {}
+
+  virtual bool SetUp() {
+    ss_.reset(new txmpp::PhysicalSocketServer());
+    ss_->SetBusyPoll(spin_us_);
+    thread_.reset(new txmpp::Thread(ss_.get()));
+    return thread_->Start();
+  }
+
+  virtual void Run(int iterations) {
+    for (int i = 0; i < iterations; ++i)
+      thread_->Send(&handler_);
+  }
+
+  virtual void TearDown() {
+    thread_->Stop();
+    thread_.reset();
+    ss_.reset();
+  }
+
+ private:
+  int spin_us_;
+  txmpp::scoped_ptr<txmpp::PhysicalSocketServer> ss_;
+  txmpp::scoped_ptr<txmpp::Thread> thread_;
+  CountingHandler handler_;
+};
+
+// Makes and drops the buffers a connection goes through: a ByteBuffer, a
+// FifoBuffer and a MemoryStream, each written to, from the heap or from
+// the per-thread pool, which should not touch the heap once it is warm.
+class BufferChurnBenchmark : public Benchmark {
+ public:
+  explicit BufferChurnBenchmark(bool pooled)
+      : Benchmark(std::string("buffers/churn/") +
+                  (pooled ? "pooled" : "heap")),
+        allocator_(pooled ? txmpp::BufferAllocator::Pooled()
+                          : txmpp::BufferAllocator::Heap()) {
+    memset(data_, 'x', sizeof(data_));
+    set_bytes_per_op(3 * sizeof(data_));
+    if (pooled)
+      set_max_allocations_per_op(0.01);
+  }
+
+  virtual void Run(int iterations) {
+    for (int i = 0; i < iterations; ++i) {
+      txmpp::ByteBuffer bytes(allocator_);
+      bytes.WriteBytes(data_, sizeof(data_));
+      txmpp::FifoBuffer fifo(16384, txmpp::FifoBuffer::MODE_LOCKED,
+                             allocator_);
+      // A Write would post SE_READ to this thread, which never handles it.
+      size_t room;
+      memcpy(fifo.GetWriteBuffer(&room), data_, sizeof(data_));
+      txmpp::MemoryStream memory(allocator_);
+      memory.ReserveSize(8192);
+      memory.Write(data_, sizeof(data_), NULL, NULL);
+    }
+  }
+
+ private:
+  txmpp::BufferAllocator* allocator_;
+  char data_[1024];
+};
+
+// Writes a message to a ByteBuffer that is kept nearly full, as a send
+// queue is behind a slow peer, and consumes as much again. The buffer
+// should grow to hold the backlog once and then only move bytes down, so
+// the writes make no allocations.
+class BufferQueueBenchmark : public Benchmark {
+ public:
+  static const size_t kBacklog = 3800;
+
+  BufferQueueBenchmark() : Benchmark("buffers/queue") {
+    memset(data_, 'x', sizeof(data_));
+    set_bytes_per_op(sizeof(data_));
+    set_max_allocations_per_op(0.01);
+  }
+
+  virtual bool SetUp() {
+    bytes_.reset(new txmpp::ByteBuffer(txmpp::BufferAllocator::Heap()));
+    for (size_t written = 0; written < kBacklog; written += sizeof(data_))
+      bytes_->WriteBytes(data_, sizeof(data_));
+    return true;
+  }
+
+  virtual void Run(int iterations) {
+    for (int i = 0; i < iterations; ++i) {
+      bytes_->WriteBytes(data_, sizeof(data_));
+      bytes_->Consume(sizeof(data_));
+    }
+  }
+
+  virtual void TearDown() {
+    bytes_.reset();
+  }
+
+ private:
+  txmpp::scoped_ptr<txmpp::ByteBuffer> bytes_;
+  char data_[100];
+};
+
+// Posts a delayed message and clears it again, with |pending| delayed
+// messages of another handler queued, in the timer wheel or the priority
+// queue.
+class TimerBenchmark : public Benchmark {
+ public:
+  TimerBenchmark(bool wheel, int pending)
+      : Benchmark(std::string("timers/") + (wheel ? "wheel" : "heap") +
+                  "/post_clear/pending" + ReactorBenchmark_Number(pending)),
+        wheel_(wheel), pending_(pending) {}
+
+  // Spreads the delays over ten minutes, the same way on every run.
+  static int Delay(int i) { return 1000 + (i * 7919) % 600000; }
+
+  virtual bool SetUp() {
+    queue_.reset(new txmpp::MessageQueue());
+    queue_->UseTimerWheel(wheel_);
+    for (int i = 0; i < pending_; ++i)
+      queue_->PostDelayed(Delay(i), &pending_handler_, i);
+    return true;
+  }
+
+  virtual void Run(int iterations) {
+    for (int i = 0; i < iterations; ++i) {
+      queue_->PostDelayed(Delay(i), &handler_);
+      queue_->Clear(&handler_);
+    }
+  }
+
+  virtual void TearDown() { queue_.reset(); }
+
+ private:
+  bool wheel_;
+  int pending_;
+  txmpp::scoped_ptr<txmpp::MessageQueue> queue_;
+  CountingHandler handler_;
+  CountingHandler pending_handler_;
+};
+
+// Re-arms one pending timer, as a debounce or idle timeout does, with
+// |pending| delayed messages of another handler queued: by Clear and
+// PostDelayed, or by Reschedule.
+class RearmBenchmark : public Benchmark {
+ public:
+  RearmBenchmark(bool wheel, int pending, bool reschedule)
+      : Benchmark(std::string("timers/") + (wheel ? "wheel" : "heap") +
+                  (reschedule ? "/reschedule" : "/clear_post") +
+                  "/pending" + ReactorBenchmark_Number(pending)),
+        wheel_(wheel), pending_(pending), reschedule_(reschedule) {}
+
+  virtual bool SetUp() {
+    queue_.reset(new txmpp::MessageQueue());
+    queue_->UseTimerWheel(wheel_);
+    for (int i = 0; i < pending_; ++i)
+      queue_->PostDelayed(TimerBenchmark::Delay(i), &pending_handler_, i);
+    queue_->PostDelayed(TimerBenchmark::Delay(0), &handler_, kId);
+    return true;
+  }
+
+  virtual void Run(int iterations) {
+    for (int i = 0; i < iterations; ++i) {
+      if (reschedule_) {
+        queue_->Reschedule(TimerBenchmark::Delay(i), &handler_, kId);
+      } else {
+        queue_->Clear(&handler_, kId);
+        queue_->PostDelayed(TimerBenchmark::Delay(i), &handler_, kId);
+      }
+    }
+  }
+
+  virtual void TearDown() { queue_.reset(); }
+
+ private:
+  static const uint32 kId = 1;
+
+  bool wheel_;
+  int pending_;
+  bool reschedule_;
+  txmpp::scoped_ptr<txmpp::MessageQueue> queue_;
+  CountingHandler handler_;
+  CountingHandler pending_handler_;
+};
+
+#ifdef POSIX
+
+struct PollerName {
+  txmpp::PollerType type;
+  const char* name;
+};
+
+static const PollerName kPollers[] = {
+  { txmpp::POLLER_SELECT, "select" },
+#if defined(LINUX)
+  { txmpp::POLLER_EPOLL, "epoll" },
+  { txmpp::POLLER_EPOLL_EDGE, "epoll_edge" },
+#elif defined(OSX) || defined(BSD)
+  { txmpp::POLLER_KQUEUE, "kqueue" },
+#endif
+};
+
+// Socketpairs with one end wrapped in a socket server, and the other kept
+// as a blocking descriptor for the benchmark to write to and read from.
+class SocketPairs {
+ public:
+  ~SocketPairs() { Close(); }
+
+  // Returns false if the process can't open |count| pairs, or if |type|
+  // is select and the descriptors wouldn't fit in an fd_set.
+  static bool CanOpen(txmpp::PollerType type, int count) {
+    // The socket server's own descriptors, and those already open.
+    rlim_t needed = 2 * count + 64;
+    if ((type == txmpp::POLLER_SELECT) && (needed > FD_SETSIZE))
+      return false;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+      return false;
+    if (limit.rlim_cur < needed) {
+      limit.rlim_cur = txmpp::_min(needed, limit.rlim_max);
+      setrlimit(RLIMIT_NOFILE, &limit);
+      getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    return limit.rlim_cur >= needed;
+  }
+
+  bool Open(txmpp::PhysicalSocketServer* ss, int count) {
+    for (int i = 0; i < count; ++i) {
+      int fds[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return false;
+      txmpp::AsyncSocket* socket = ss->WrapSocket(fds[0]);
+      if (!socket) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+      }
+      sockets.push_back(socket);
+      peers.push_back(fds[1]);
+    }
+    return true;
+  }
+
+  void Close() {
+    for (size_t i = 0; i < sockets.size(); ++i) {
+      delete sockets[i];
+      close(peers[i]);
+    }
+    sockets.clear();
+    peers.clear();
+  }
+
+  std::vector<txmpp::AsyncSocket*> sockets;
+  std::vector<int> peers;
+};
+
+static std::string ReactorBenchmark_Name(const PollerName& poller,
+                                         const char* what, int idle,
+                                         int active) {
+  char buffer[96];
+  if (active) {
+    snprintf(buffer, sizeof(buffer), "reactor/%s/%s/idle%d/active%d",
+             poller.name, what, idle, active);
+  } else {
+    snprintf(buffer, sizeof(buffer), "reactor/%s/%s/idle%d", poller.name,
+             what, idle);
+  }
+  return buffer;
+}
+
+// Makes |active| of |idle| + |active| sockets readable at once and handles
+// the events in Wait, on this thread. An operation is one event, so the
+// events per second are 1e9 / (ns/op).
+class ReactorEventsBenchmark : public Benchmark, public txmpp::has_slots<> {
+ public:
+  ReactorEventsBenchmark(const PollerName& poller, int idle, int active)
+      : Benchmark(ReactorBenchmark_Name(poller, "events", idle, active)),
+        poller_(poller.type), idle_(idle), active_(active), target_(0),
+        reads_(0) {}
+
+  virtual bool SetUp() {
+    if (!SocketPairs::CanOpen(poller_, idle_ + active_))
+      return false;
+    ss_.reset(new txmpp::PhysicalSocketServer(poller_));
+    if ((ss_->poller_type() != poller_) ||
+        !pairs_.Open(ss_.get(), idle_ + active_)) {
+      TearDown();
+      return false;
+    }
+    for (int i = idle_; i < idle_ + active_; ++i) {
+      pairs_.sockets[i]->SignalReadEvent.connect(
+          this, &ReactorEventsBenchmark::OnReadEvent);
+    }
+    return true;
+  }
+
+  virtual void Run(int iterations) {
+    for (int done = 0; done < iterations; ) {
+      target_ = txmpp::_min(active_, iterations - done);
+      reads_ = 0;
+      for (int i = 0; i < target_; ++i) {
+        if (write(pairs_.peers[idle_ + i], "x", 1) != 1)
+          abort();
+      }
+      while (reads_ < target_)
+        ss_->Wait(txmpp::kForever, true);
+      done += target_;
+    }
+  }
+
+  virtual void TearDown() {
+    pairs_.Close();
+    ss_.reset();
+  }
+
+ private:
+  void OnReadEvent(txmpp::AsyncSocket* socket) {
+    char buffer[16];
+    while (socket->Recv(buffer, sizeof(buffer)) > 0) {}
+    if (++reads_ == target_)
+      ss_->WakeUp();
+  }
+
+  txmpp::PollerType poller_;
+  int idle_;
+  int active_;
+  txmpp::scoped_ptr<txmpp::PhysicalSocketServer> ss_;
+  SocketPairs pairs_;
+  int target_;
+  int reads_;
+};
+
+// Writes a byte to a socket that a thread blocked in Wait echoes back, with
+// |idle| other sockets registered, and waits for the echo. An operation is
+// one round trip: two wakeups and the event dispatch in between.
+class ReactorWakeupBenchmark : public Benchmark, public txmpp::has_slots<> {
+ public:
+  ReactorWakeupBenchmark(const PollerName& poller, int idle)
+      : Benchmark(ReactorBenchmark_Name(poller, "wakeup_rtt", idle, 0)),
+        poller_(poller.type), idle_(idle) {}
+
+  virtual bool SetUp() {
+    if (!SocketPairs::CanOpen(poller_, idle_ + 1))
+      return false;
+    ss_.reset(new txmpp::PhysicalSocketServer(poller_));
+    if ((ss_->poller_type() != poller_) ||
+        !pairs_.Open(ss_.get(), idle_ + 1)) {
+      pairs_.Close();
+      ss_.reset();
+      return false;
+    }
+    pairs_.sockets[idle_]->SignalReadEvent.connect(
+        this, &ReactorWakeupBenchmark::OnReadEvent);
+    thread_.reset(new txmpp::Thread(ss_.get()));
+    return thread_->Start();
+  }
+
+  virtual void Run(int iterations) {
+    int peer = pairs_.peers[idle_];
+    for (int i = 0; i < iterations; ++i) {
+      char ch = 'x';
+      if ((write(peer, &ch, 1) != 1) || (read(peer, &ch, 1) != 1))
+        abort();
+    }
+  }
+
+  virtual void TearDown() {
+    thread_->Stop();
+    thread_.reset();
+    pairs_.Close();
+    ss_.reset();
+  }
+
+ private:
+  void OnReadEvent(txmpp::AsyncSocket* socket) {
+    char buffer[16];
+    int len;
+    while ((len = socket->Recv(buffer, sizeof(buffer))) > 0)
+      socket->Send(buffer, len);
+  }
+
+  txmpp::PollerType poller_;
+  int idle_;
+  txmpp::scoped_ptr<txmpp::PhysicalSocketServer> ss_;
+  SocketPairs pairs_;
+  txmpp::scoped_ptr<txmpp::Thread> thread_;
+};
+
+// Sends on a socket until it blocks, drains its peer, and waits for the
+// write event. An operation is one such round, in which a level-triggered
+// poller adds and removes the socket's write interest.
+class ReactorBackpressureBenchmark : public Benchmark,
+                                     public txmpp::has_slots<> {
+ public:
+  explicit ReactorBackpressureBenchmark(const PollerName& poller)
+      : Benchmark(ReactorBenchmark_Name(poller, "backpressure", 0, 0)),
+        poller_(poller.type), writable_(false) {}
+
+  virtual bool SetUp() {
+    ss_.reset(new txmpp::PhysicalSocketServer(poller_));
+    if ((ss_->poller_type() != poller_) || !pairs_.Open(ss_.get(), 1)) {
+      TearDown();
+      return false;
+    }
+    // A small buffer keeps the copying from hiding the rest of a round.
+    pairs_.sockets[0]->SetOption(txmpp::Socket::OPT_SNDBUF, kChunk);
+    int peer = pairs_.peers[0];
+    fcntl(peer, F_SETFL, fcntl(peer, F_GETFL, 0) | O_NONBLOCK);
+    pairs_.sockets[0]->SignalWriteEvent.connect(
+        this, &ReactorBackpressureBenchmark::OnWriteEvent);
+    return true;
+  }
+
+  virtual void Run(int iterations) {
+    txmpp::AsyncSocket* socket = pairs_.sockets[0];
+    int peer = pairs_.peers[0];
+    char buffer[kChunk];
+    memset(buffer, 'x', sizeof(buffer));
+    for (int i = 0; i < iterations; ++i) {
+      while (socket->Send(buffer, sizeof(buffer)) > 0) {}
+      while (read(peer, buffer, sizeof(buffer)) > 0) {}
+      writable_ = false;
+      while (!writable_)
+        ss_->Wait(txmpp::kForever, true);
+    }
+  }
+
+  virtual void TearDown() {
+    pairs_.Close();
+    ss_.reset();
+  }
+
+ private:
+  static const int kChunk = 4096;
+
+  void OnWriteEvent(txmpp::AsyncSocket* socket) {
+    writable_ = true;
+    ss_->WakeUp();
+  }
+
+  txmpp::PollerType poller_;
+  txmpp::scoped_ptr<txmpp::PhysicalSocketServer> ss_;
+  SocketPairs pairs_;
+  bool writable_;
+};
+
+#endif  // POSIX
+
+void AddReactorBenchmarks(BenchmarkList* benchmarks) {
+  benchmarks->push_back(new PostDispatchBenchmark());
+  benchmarks->push_back(new PostOrderBenchmark(false));
+  benchmarks->push_back(new PostOrderBenchmark(true));
+  benchmarks->push_back(new DisposeBenchmark(false));
+  benchmarks->push_back(new DisposeBenchmark(true));
+  benchmarks->push_back(new MultiProducerBenchmark(1));
+  benchmarks->push_back(new MultiProducerBenchmark(4));
+  benchmarks->push_back(new SendBenchmark(0));
+#ifdef POSIX
+  benchmarks->push_back(new SendBenchmark(50));
+#endif
+  benchmarks->push_back(new BufferChurnBenchmark(false));
+  benchmarks->push_back(new BufferChurnBenchmark(true));
+  benchmarks->push_back(new BufferQueueBenchmark());
+  static const int kPending[] = { 100, 10000, 100000 };
+  for (size_t i = 0; i < ARRAY_SIZE(kPending); ++i) {
+    benchmarks->push_back(new TimerBenchmark(true, kPending[i]));
+    benchmarks->push_back(new TimerBenchmark(false, kPending[i]));
+    benchmarks->push_back(new RearmBenchmark(true, kPending[i], false));
+    benchmarks->push_back(new RearmBenchmark(true, kPending[i], true));
+    benchmarks->push_back(new RearmBenchmark(false, kPending[i], false));
+    benchmarks->push_back(new RearmBenchmark(false, kPending[i], true));
+  }
+#ifdef POSIX
+  // Idle and active sockets: the select ones beyond FD_SETSIZE are skipped.
+  static const int kSockets[][2] = {
+    { 0, 1 }, { 100, 10 }, { 300, 100 }, { 10000, 100 }
+  };
+  for (size_t i = 0; i < ARRAY_SIZE(kPollers); ++i) {
+    for (size_t j = 0; j < ARRAY_SIZE(kSockets); ++j) {
+      benchmarks->push_back(new ReactorEventsBenchmark(
+          kPollers[i], kSockets[j][0], kSockets[j][1]));
+    }
+    benchmarks->push_back(new ReactorWakeupBenchmark(kPollers[i], 0));
+    benchmarks->push_back(new ReactorWakeupBenchmark(kPollers[i], 10000));
+    benchmarks->push_back(new ReactorBackpressureBenchmark(kPollers[i]));
+  }
+#endif
+}
+
+}  // namespace bench
@@ -0,0 +1,380 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "benchmark.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "../constants.h"
+#include "../jid.h"
+#include "../qname.h"
+#include "../xmlarena.h"
+#include "../xmlbuilder.h"
+#include "../xmlelement.h"
+#include "../xmlparser.h"
+#include "../xmlprinter.h"
+
+namespace bench {
+
+// Stanzas as a server sends them, each a document of its own so that it
+// can be parsed alone.
+static const char kMessage[] =
+    "<message xmlns='jabber:client' from='juliet@capulet.example/balcony'"
+    " to='romeo@montague.example/orchard' type='chat' id='ktx72v49'>"
+    "<body>Art thou not Romeo, and a Montague?</body>"
+    "<thread>e0ffe42b28561960c6b12b944a092794b9683a38</thread>"
+    "<active xmlns='http://jabber.org/protocol/chatstates'/>"
+    "</message>";
+
+static const char kPresence[] =
+    "<presence xmlns='jabber:client' from='juliet@capulet.example/balcony'"
+    " to='romeo@montague.example'>"
+    "<show>away</show><status>Wherefore art thou?</status>"
+    "<priority>5</priority>"
+    "<c xmlns='http://jabber.org/protocol/caps' hash='sha-1'"
+    " node='http://code.google.com/p/exodus'"
+    " ver='QgayPKawpkPSDYmwT/WM94uAlu0='/>"
+    "<x xmlns='vcard-temp:x:update'>"
+    "<photo>01b87fcd030b72895ff8e88db57ec525450f000d</photo></x>"
+    "</presence>";
+
+static const char kRosterPush[] =
+    "<iq xmlns='jabber:client' to='juliet@example.com/balcony'"
+    " type='set' id='a78b4q6ha463'>"
+    "<query xmlns='jabber:iq:roster' ver='ver14'>"
+    "<item jid='nurse@example.com' name='Nurse' subscription='both'>"
+    "<group>Servants</group></item>"
+    "<item jid='romeo@example.net' name='Romeo' subscription='to'"
+    " ask='subscribe'><group>Friends</group><group>Lovers</group></item>"
+    "<item jid='benvolio@example.net' subscription='from'/>"
+    "</query></iq>";
+
+static const char kPubsubEvent[] =
+    "<message xmlns='jabber:client' from='pubsub.shakespeare.example'"
+    " to='francisco@denmark.example' id='foo'>"
+    "<event xmlns='http://jabber.org/protocol/pubsub#event'>"
+    "<items node='princely_musings'>"
+    "<item id='ae890ac52d0df67ed7cfdf51b644e901'>"
+    "<entry xmlns='http://www.w3.org/2005/Atom'>"
+    "<title>Soliloquy</title>"
+    "<summary>To be, or not to be: that is the question: Whether 'tis"
+    " nobler in the mind to suffer The slings and arrows of outrageous"
+    " fortune, Or to take arms against a sea of troubles, And by opposing"
+    " end them?</summary>"
+    "<link rel='alternate' type='text/html'"
+    " href='http://denmark.example/2003/12/13/atom03'/>"
+    "<id>tag:denmark.example,2003:entry-32397</id>"
+    "<published>2003-12-13T18:30:02Z</published>"
+    "<updated>2003-12-13T18:30:02Z</updated>"
+    "</entry></item></items></event></message>";
+
+// A roster result as a server that pretty prints its output sends it,
+// parsed as it is and with the whitespace between elements stripped.
+static const char kPrettyRoster[] =
+    "<iq xmlns='jabber:client' to='juliet@example.com/balcony'\n"
+    "    type='result' id='bv1bs71f'>\n"
+    "  <query xmlns='jabber:iq:roster' ver='ver11'>\n"
+    "    <item jid='romeo@example.net' name='Romeo' subscription='both'>\n"
+    "      <group>Friends</group>\n"
+    "    </item>\n"
+    "    <item jid='mercutio@example.com' name='Mercutio'\n"
+    "        subscription='from'>\n"
+    "      <group>Friends</group>\n"
+    "    </item>\n"
+    "    <item jid='benvolio@example.net' name='Benvolio'\n"
+    "        subscription='both'>\n"
+    "      <group>Friends</group>\n"
+    "    </item>\n"
+    "  </query>\n"
+    "</iq>\n";
+
+// max_arena_allocations is the limit on heap allocations for a parse into
+// an arena, which is what a connection pays for each stanza it receives.
+struct Corpus {
+  const char* name;
+  const char* xml;
+  double max_arena_allocations;
+};
+
+static const Corpus kCorpora[] = {
+  { "message", kMessage, 10 },
+  { "presence_caps", kPresence, 19 },
+  { "roster_push", kRosterPush, 12 },
+  { "pubsub_event", kPubsubEvent, 38 }
+};
+
+static const Corpus kPrettyCorpus = { "roster_pretty", kPrettyRoster, 12 };
+
+// Parses a stanza into a tree built by XmlBuilder, reusing the parser and
+// the builder, and with |use_arena| building in an XmlArena, as
+// XmppStanzaParser does. With |strip|, the builder drops the whitespace
+// between elements.
+class ParseBenchmark : public Benchmark {
+ public:
+  ParseBenchmark(const Corpus& corpus, bool use_arena, bool strip = false)
+      : Benchmark(std::string("parse/") + corpus.name +
+                  (use_arena ? "/arena" : "") + (strip ? "/stripped" : "")),
+        xml_(corpus.xml), len_(strlen(corpus.xml)),
+        builder_(use_arena ? &arena_ : NULL), parser_(&builder_),
+        use_arena_(use_arena) {
+    set_bytes_per_op(len_);
+    if (use_arena)
+      set_max_allocations_per_op(corpus.max_arena_allocations);
+    builder_.SetStripWhitespace(strip);
+  }
+
+  virtual void Run(int iterations) {
+    for (int i = 0; i < iterations; ++i) {
+      if (!parser_.Parse(xml_, len_, true) || !builder_.BuiltElement())
+        abort();
+      builder_.Reset();
+      if (use_arena_)
+        arena_.Reset();
+      parser_.Reset();
+    }
+  }
+
+ private:
+  const char* xml_;
+  size_t len_;
+  txmpp::XmlArena arena_;
+  txmpp::XmlBuilder builder_;
+  txmpp::XmlParser parser_;
+  bool use_arena_;
+};
+
+// Parses a stanza with XmlElement::ForStr, as templated stanzas are, on the
+// heap or, with |use_arena|, into an XmlArena reset after each.
+class ForStrBenchmark : public Benchmark {
+ public:
+  ForStrBenchmark(const Corpus& corpus, bool use_arena)
+      : Benchmark(std::string("forstr/") + corpus.name +
+                  (use_arena ? "/arena" : "")),
+        xml_(corpus.xml), use_arena_(use_arena) {
+    set_bytes_per_op(xml_.size());
+  }
+
+  virtual void Run(int iterations) {
+    for (int i = 0; i < iterations; ++i) {
+      txmpp::XmlElement* element = txmpp::XmlElement::ForStr(
+          xml_, false, use_arena_ ? &arena_ : NULL);
+      if (!element)
+        abort();
+      delete element;
+      if (use_arena_)
+        arena_.Reset();
+    }
+  }
+
+ private:
+  std::string xml_;
+  txmpp::XmlArena arena_;
+  bool use_arena_;
+};
+
+static txmpp::XmlElement* ParseCorpus(const Corpus& corpus) {
+  txmpp::XmlBuilder builder;
+  txmpp::XmlParser parser(&builder);
+  parser.Parse(corpus.xml, strlen(corpus.xml), true);
+  txmpp::XmlElement* element = builder.CreateElement();
+  if (!element)
+    abort();
+  return element;
+}
+
+// Prints a parsed stanza with XmlElement::Str, which builds a new string
+// each time, or with |reuse| into a string kept across operations.
+class PrintBenchmark : public Benchmark {
+ public:
+  PrintBenchmark(const Corpus& corpus, bool reuse)
+      : Benchmark(std::string(reuse ? "print/" : "str/") + corpus.name),
+        element_(ParseCorpus(corpus)), reuse_(reuse) {
+    set_bytes_per_op(element_->Str().size());
+  }
+  virtual ~PrintBenchmark() { delete element_; }
+
+  virtual void Run(int iterations) {
+    for (int i = 0; i < iterations; ++i) {
+      if (reuse_) {
+        out_.clear();
+        txmpp::XmlPrinter::PrintXml(&out_, element_, NULL, 0);
+        if (out_.empty())
+          abort();
+      } else if (element_->Str().empty()) {
+        abort();
+      }
+    }
+  }
+
+ private:
+  txmpp::XmlElement* element_;
+  bool reuse_;
+  std::string out_;
+};
+
+// Builds the QNames of a stanza's elements and attributes from strings, as
+// the parser does for every tag. Most are interned names; with |unknown|
+// they are names nothing has interned.
+class QNameBenchmark : public Benchmark {
+ public:
+  explicit QNameBenchmark(bool unknown)
+      : Benchmark(unknown ? "qname/unknown" : "qname/interned"),
+        ns_(unknown ? "urn:example:benchmark" : "jabber:client") {
+    static const char* const kInterned[] = {
+      "message", "body", "thread", "from", "to", "type", "id", "presence"
+    };
+    static const char* const kUnknown[] = {
+      "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf",
+      "hotel"
+    };
+    const char* const* names = unknown ? kUnknown : kInterned;
+    for (size_t i = 0; i < ARRAY_SIZE(kInterned); ++i)
+      locals_.push_back(names[i]);
+  }
+
+  virtual void Run(int iterations) {
+    for (int i = 0; i < iterations; ++i) {
+      txmpp::QName name(ns_, locals_[i % locals_.size()].c_str());
+      if (name.LocalPart().empty())
+        abort();
+    }
+  }
+
+ private:
+  std::string ns_;
+  std::vector<std::string> locals_;
+};
+
+// Looks up the payload of a parsed pubsub event by names put together at
+// run time, from a namespace kept as a string, as a QName for each lookup
+// or, with |view|, as a QNameView, which must not allocate.
+class LookupBenchmark : public Benchmark {
+ public:
+  explicit LookupBenchmark(bool view)
+      : Benchmark(view ? "xml/lookup/view" : "xml/lookup/qname"),
+        element_(ParseCorpus(kCorpora[ARRAY_SIZE(kCorpora) - 1])),
+        view_(view), event_ns_("http://jabber.org/protocol/pubsub#event"),
+        atom_ns_("http://www.w3.org/2005/Atom") {
+    if (view)
+      set_max_allocations_per_op(0);
+  }
+  virtual ~LookupBenchmark() { delete element_; }
+
+  virtual void Run(int iterations) {
+    for (int i = 0; i < iterations; ++i) {
+      if ((view_ ? LookupView() : LookupQName()).empty())
+        abort();
+    }
+  }
+
+ private:
+  const std::string& LookupQName() const {
+    const txmpp::XmlElement* entry = element_;
+    entry = entry->FirstNamed(txmpp::QName(event_ns_, "event"));
+    entry = entry->FirstNamed(txmpp::QName(event_ns_, "items"));
+    entry = entry->FirstNamed(txmpp::QName(event_ns_, "item"));
+    entry = entry->FirstNamed(txmpp::QName(atom_ns_, "entry"));
+    const txmpp::XmlElement* link =
+        entry->FirstNamed(txmpp::QName(atom_ns_, "link"));
+    if (link->Attr(txmpp::QName(txmpp::STR_EMPTY, "rel")).empty())
+      abort();
+    return entry->TextNamed(txmpp::QName(atom_ns_, "title"));
+  }
+
+  const std::string& LookupView() const {
+    const txmpp::XmlElement* entry = element_;
+    entry = entry->FirstNamed(txmpp::QNameView(event_ns_, "event"));
+    entry = entry->FirstNamed(txmpp::QNameView(event_ns_, "items"));
+    entry = entry->FirstNamed(txmpp::QNameView(event_ns_, "item"));
+    entry = entry->FirstNamed(txmpp::QNameView(atom_ns_, "entry"));
+    const txmpp::XmlElement* link =
+        entry->FirstNamed(txmpp::QNameView(atom_ns_, "link"));
+    if (link->Attr(txmpp::QNameView(txmpp::STR_EMPTY, "rel")).empty())
+      abort();
+    return entry->TextNamed(txmpp::QNameView(atom_ns_, "title"));
+  }
+
+  txmpp::XmlElement* element_;
+  bool view_;
+  std::string event_ns_;
+  std::string atom_ns_;
+};
+
+// Parses Jids as they arrive in stanza addresses, already prepared or
+// needing case folding.
+class JidBenchmark : public Benchmark {
+ public:
+  explicit JidBenchmark(bool prepared)
+      : Benchmark(prepared ? "jid/prepared" : "jid/unprepared") {
+    if (prepared) {
+      jids_.push_back("juliet@capulet.example/balcony");
+      jids_.push_back("romeo@montague.example");
+      jids_.push_back("pubsub.shakespeare.example");
+    } else {
+      jids_.push_back("Juliet@Capulet.Example/balcony");
+      jids_.push_back("ROMEO@montague.example");
+      jids_.push_back("PubSub.Shakespeare.Example");
+    }
+  }
+
+  virtual void Run(int iterations) {
+    for (int i = 0; i < iterations; ++i) {
+      txmpp::Jid jid(jids_[i % jids_.size()]);
+      if (!jid.IsValid())
+        abort();
+    }
+  }
+
+ private:
+  std::vector<std::string> jids_;
+};
+
+void AddXmlBenchmarks(BenchmarkList* benchmarks) {
+  for (size_t i = 0; i < ARRAY_SIZE(kCorpora); ++i) {
+    const Corpus& corpus = kCorpora[i];
+    benchmarks->push_back(new ParseBenchmark(corpus, false));
+    benchmarks->push_back(new ParseBenchmark(corpus, true));
+    benchmarks->push_back(new ForStrBenchmark(corpus, false));
+    benchmarks->push_back(new ForStrBenchmark(corpus, true));
+    benchmarks->push_back(new PrintBenchmark(corpus, false));
+    benchmarks->push_back(new PrintBenchmark(corpus, true));
+  }
+  benchmarks->push_back(new ParseBenchmark(kPrettyCorpus, true));
+  benchmarks->push_back(new ParseBenchmark(kPrettyCorpus, true, true));
+  benchmarks->push_back(new QNameBenchmark(false));
+  benchmarks->push_back(new QNameBenchmark(true));
+  benchmarks->push_back(new LookupBenchmark(false));
+  benchmarks->push_back(new LookupBenchmark(true));
+  benchmarks->push_back(new JidBenchmark(true));
+  benchmarks->push_back(new JidBenchmark(false));
+}
+
+}  // namespace bench
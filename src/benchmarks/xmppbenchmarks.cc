@@ -0,0 +1,381 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "benchmark.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../chainbuffer.h"
+#include "../constants.h"
+#include "../jid.h"
+#include "../preparedstanza.h"
+#include "../saslhandler.h"
+#include "../saslmechanism.h"
+#include "../scoped_ptr.h"
+#include "../stringencode.h"
+#include "../threadpool.h"
+#include "../xmlelement.h"
+#include "../xmppengineimpl.h"
+
+namespace bench {
+
+// What a server sends an engine that logs in with PLAIN, binds and starts
+// a session, the engine's ids starting with kIdPrefix.
+static const char kIdPrefix[] = "abcd";
+static const char* const kLoginInput[] = {
+  "<stream:stream xmlns='jabber:client'"
+  " xmlns:stream='http://etherx.jabber.org/streams' id='s1'"
+  " from='example.org' version='1.0'>"
+  "<stream:features><mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>"
+  "<mechanism>PLAIN</mechanism></mechanisms></stream:features>",
+  "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>",
+  "<stream:stream xmlns='jabber:client'"
+  " xmlns:stream='http://etherx.jabber.org/streams' id='s2'"
+  " from='example.org' version='1.0'>"
+  "<stream:features><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/>"
+  "<session xmlns='urn:ietf:params:xml:ns:xmpp-session'/>"
+  "</stream:features>",
+  "<iq type='result' id='abcd0'>"
+  "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'>"
+  "<jid>juliet@example.org/balcony</jid></bind></iq>",
+  "<iq type='result' id='abcd1'/>",
+};
+
+class NullOutput : public txmpp::XmppOutputHandler {
+ public:
+  virtual void WriteOutput(const char* bytes, size_t len) {}
+  virtual void WriteOutputChain(txmpp::ChainBuffer* output) {
+    output->Clear();
+  }
+  virtual void StartTls(const std::string& domain) {}
+  virtual bool StartCompression(int level, int window_bits) { return true; }
+  virtual void CloseConnection() {}
+};
+
+// Keeps all the output, as a socket that cannot write would.
+class QueueOutput : public NullOutput {
+ public:
+  virtual void WriteOutputChain(txmpp::ChainBuffer* output) {
+    queue_.Append(output);
+  }
+  void Clear() { queue_.Clear(); }
+
+ private:
+  txmpp::ChainBuffer queue_;
+};
+
+class PlainSasl : public txmpp::SaslHandler {
+ public:
+  virtual std::string ChooseBestSaslMechanism(
+      const std::vector<std::string>& mechanisms, bool encrypted) {
+    return "PLAIN";
+  }
+  virtual txmpp::SaslMechanism* CreateSaslMechanism(
+      const std::string& mechanism) {
+    return new Mechanism();
+  }
+
+ private:
+  class Mechanism : public txmpp::SaslMechanism {
+   public:
+    virtual std::string GetMechanismName() { return "PLAIN"; }
+    virtual txmpp::XmlElement* StartSaslAuth() {
+      txmpp::XmlElement* auth =
+          new txmpp::XmlElement(txmpp::QN_SASL_AUTH, true);
+      auth->AddAttr(txmpp::QN_MECHANISM, "PLAIN");
+      return auth;
+    }
+  };
+};
+
+// Logs in |engine| with the script above.
+static void XmppBenchmark_Login(txmpp::XmppEngineImpl* engine,
+                                txmpp::XmppOutputHandler* output) {
+  engine->SetOutputHandler(output);
+  engine->SetSaslHandler(new PlainSasl());
+  engine->SetUser(txmpp::Jid("juliet", "example.org", ""));
+  engine->SetUseTls(false);
+  engine->SetIdPrefix(kIdPrefix);
+  engine->Connect();
+  for (int j = 0; j < ARRAY_SIZE(kLoginInput); ++j)
+    engine->HandleInput(kLoginInput[j], strlen(kLoginInput[j]));
+  if (engine->GetState() != txmpp::XmppEngine::STATE_OPEN)
+    abort();
+}
+
+// Logs in an XmppEngineImpl per operation and keeps them all until the
+// run is over, to measure what an idle, logged-in connection holds on to,
+// and with |trim| what it holds once TrimMemory has been called. The limits
+// are the targets for an engine, less its parser's expat state, which is
+// allocated with malloc.
+class LoginIdleBenchmark : public Benchmark {
+ public:
+  explicit LoginIdleBenchmark(bool trim)
+      : Benchmark(trim ? "xmpp/login_idle/trimmed" : "xmpp/login_idle"),
+        trim_(trim) {
+    set_max_live_bytes_per_op(trim ? kMaxTrimmedBytes : kMaxIdleBytes);
+  }
+
+  virtual void Run(int iterations) {
+    std::vector<txmpp::XmppEngineImpl*> engines;
+    engines.reserve(iterations);
+    int64 before = LiveHeapBytes();
+    for (int i = 0; i < iterations; ++i) {
+      txmpp::XmppEngineImpl* engine = new txmpp::XmppEngineImpl();
+      engines.push_back(engine);
+      XmppBenchmark_Login(engine, &output_);
+      if (trim_)
+        engine->TrimMemory();
+    }
+    set_live_bytes_per_op(
+        static_cast<double>(LiveHeapBytes() - before) / iterations);
+    for (int i = 0; i < iterations; ++i)
+      delete engines[i];
+  }
+
+ private:
+  static const int kMaxIdleBytes = 6144;
+  static const int kMaxTrimmedBytes = 2048;
+
+  NullOutput output_;
+  bool trim_;
+};
+
+// Sends a message with a 4 KB body to each of kRecipients engines in turn,
+// whose output queues up unsent, as a broadcast to slow readers does. An
+// operation is one recipient's send, and the bytes it leaves queued are
+// measured: a full copy of the stanza per recipient with SendStanza, and
+// only its head with |shared| SendSharedStanza.
+class FanOutBenchmark : public Benchmark {
+ public:
+  explicit FanOutBenchmark(bool shared)
+      : Benchmark(shared ? "xmpp/fan_out/shared" : "xmpp/fan_out/copied"),
+        shared_(shared) {
+    if (shared)
+      set_max_live_bytes_per_op(kMaxSharedBytes);
+  }
+
+  virtual bool SetUp() {
+    message_.reset(new txmpp::XmlElement(txmpp::QN_MESSAGE));
+    message_->AddAttr(txmpp::QN_TYPE, "chat");
+    message_->AddElement(new txmpp::XmlElement(txmpp::QN_BODY));
+    message_->AddText(std::string(4096, 'x'), 1);
+    payload_ = txmpp::XmppEngine::CreateSharedStanza(message_.get());
+    set_bytes_per_op(payload_->data().size());
+    for (int i = 0; i < kRecipients; ++i) {
+      engines_.push_back(new txmpp::XmppEngineImpl());
+      XmppBenchmark_Login(engines_.back(), &output_);
+      recipients_.push_back("user" + txmpp::ToString(i) + "@example.org");
+    }
+    return true;
+  }
+
+  virtual void Run(int iterations) {
+    int64 before = LiveHeapBytes();
+    for (int i = 0; i < iterations; ++i) {
+      int r = i % kRecipients;
+      txmpp::XmppId id = engines_[r]->NextId();
+      if (shared_) {
+        engines_[r]->SendSharedStanza(payload_, recipients_[r], id);
+      } else {
+        message_->SetAttr(txmpp::QN_TO, recipients_[r]);
+        message_->SetAttr(txmpp::QN_ID, id);
+        engines_[r]->SendStanza(message_.get());
+      }
+    }
+    set_live_bytes_per_op(
+        static_cast<double>(LiveHeapBytes() - before) / iterations);
+    output_.Clear();
+  }
+
+  virtual void TearDown() {
+    for (size_t i = 0; i < engines_.size(); ++i)
+      delete engines_[i];
+    engines_.clear();
+    recipients_.clear();
+    payload_->Release();
+    message_.reset();
+  }
+
+ private:
+  static const int kRecipients = 100;
+  static const int kMaxSharedBytes = 512;
+
+  bool shared_;
+  QueueOutput output_;
+  txmpp::scoped_ptr<txmpp::XmlElement> message_;
+  txmpp::SharedStanza* payload_;
+  std::vector<txmpp::XmppEngineImpl*> engines_;
+  std::vector<std::string> recipients_;
+};
+
+// Feeds a logged-in engine chat messages for a handler that keeps each
+// one, as a task queueing it does, and lets it go again. With |take| the
+// handler takes the parsed stanza with TakeIncomingStanza, which costs the
+// parser a new arena chunk, where a copy allocates every node again.  The
+// parse alone makes 9 allocations, for the strings longer than fit inline.
+class HandoffBenchmark : public Benchmark,
+                         public txmpp::XmppStanzaHandler {
+ public:
+  explicit HandoffBenchmark(bool take)
+      : Benchmark(take ? "xmpp/handoff/taken" : "xmpp/handoff/copied"),
+        take_(take) {
+    if (take)
+      set_max_allocations_per_op(kMaxTakenAllocations);
+  }
+
+  virtual bool SetUp() {
+    engine_.reset(new txmpp::XmppEngineImpl());
+    XmppBenchmark_Login(engine_.get(), &output_);
+    engine_->AddStanzaHandler(this, txmpp::XmppEngine::HL_ALL);
+    set_bytes_per_op(strlen(kMessage));
+    return true;
+  }
+
+  virtual void Run(int iterations) {
+    for (int i = 0; i < iterations; ++i)
+      engine_->HandleInput(kMessage, strlen(kMessage));
+  }
+
+  virtual void TearDown() {
+    engine_.reset();
+  }
+
+  virtual bool HandleStanza(const txmpp::XmlElement* stanza) {
+    txmpp::XmlArena* arena = NULL;
+    txmpp::XmlElement* kept = take_ ?
+        engine_->TakeIncomingStanza(stanza, &arena) : NULL;
+    if (!kept)
+      kept = new txmpp::XmlElement(*stanza);
+    delete kept;
+    delete arena;
+    return true;
+  }
+
+  static const char kMessage[];
+
+ private:
+  static const int kMaxTakenAllocations = 10;
+
+  bool take_;
+  NullOutput output_;
+  txmpp::scoped_ptr<txmpp::XmppEngineImpl> engine_;
+};
+
+const char HandoffBenchmark::kMessage[] =
+    "<message from='romeo@example.net/orchard' to='juliet@example.org/balcony'"
+    " type='chat' id='m1'><body>Neither, fair saint, if either thee dislike."
+    "</body><active xmlns='http://jabber.org/protocol/chatstates'/>"
+    "</message>";
+
+// Hands each message to an HL_PEEK handler that prints it and counts the
+// words of its body, as an archive with a search index would, on the
+// engine's thread or, with |pooled|, as an HC_ORDERED handler on a
+// ThreadPool. The time is what the engine's thread spends on a message,
+// which with |pooled| is taking it and posting it to the pool instead.
+class PeekHandlerBenchmark : public Benchmark,
+                             public txmpp::XmppStanzaHandler {
+ public:
+  explicit PeekHandlerBenchmark(bool pooled)
+      : Benchmark(pooled ? "xmpp/peek_handler/pooled"
+                         : "xmpp/peek_handler/inline"),
+        pooled_(pooled),
+        printed_(0) {
+  }
+
+  virtual bool SetUp() {
+    engine_.reset(new txmpp::XmppEngineImpl());
+    XmppBenchmark_Login(engine_.get(), &output_);
+    if (pooled_) {
+      pool_.reset(new txmpp::ThreadPool(1));
+      pool_->Start();
+      engine_->SetHandlerPool(pool_.get());
+    }
+    engine_->AddStanzaHandler(this, txmpp::XmppEngine::HL_PEEK);
+    set_bytes_per_op(strlen(HandoffBenchmark::kMessage));
+    return true;
+  }
+
+  virtual void Run(int iterations) {
+    for (int i = 0; i < iterations; ++i) {
+      engine_->HandleInput(HandoffBenchmark::kMessage,
+                           strlen(HandoffBenchmark::kMessage));
+    }
+  }
+
+  virtual void TearDown() {
+    // Drops what the handler has yet to be handed.
+    engine_->RemoveStanzaHandler(this);
+    engine_.reset();
+    pool_.reset();
+  }
+
+  virtual Concurrency GetConcurrency() const {
+    return pooled_ ? HC_ORDERED : HC_INLINE;
+  }
+
+  virtual bool HandleStanza(const txmpp::XmlElement* stanza) {
+    printed_ += stanza->Str().size();
+    const std::string& body = stanza->TextNamed(txmpp::QN_BODY);
+    size_t start = 0;
+    while (start < body.size()) {
+      size_t end = body.find_first_of(" ,.", start);
+      if (end == std::string::npos)
+        end = body.size();
+      if (end > start)
+        words_[body.substr(start, end - start)] += 1;
+      start = end + 1;
+    }
+    return false;
+  }
+
+ private:
+  bool pooled_;
+  size_t printed_;
+  std::map<std::string, int> words_;
+  NullOutput output_;
+  txmpp::scoped_ptr<txmpp::ThreadPool> pool_;
+  txmpp::scoped_ptr<txmpp::XmppEngineImpl> engine_;
+};
+
+void AddXmppBenchmarks(BenchmarkList* benchmarks) {
+  benchmarks->push_back(new LoginIdleBenchmark(false));
+  benchmarks->push_back(new LoginIdleBenchmark(true));
+  benchmarks->push_back(new FanOutBenchmark(false));
+  benchmarks->push_back(new FanOutBenchmark(true));
+  benchmarks->push_back(new HandoffBenchmark(false));
+  benchmarks->push_back(new HandoffBenchmark(true));
+  benchmarks->push_back(new PeekHandlerBenchmark(false));
+  benchmarks->push_back(new PeekHandlerBenchmark(true));
+}
+
+}  // namespace bench
@@ -0,0 +1,551 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include "binaryxml.h"
+
+#include <string.h>
+
+#include "common.h"
+#include "constants.h"
+#include "xmlconstants.h"
+#include "xmlelement.h"
+
+namespace txmpp {
+
+const char kBinaryXmlMethod[] = "x-txmpp-bxml";
+
+namespace {
+
+// The vocabulary of names, in table order. Only add to the end.
+const QName* const kVocabularyNames[] = {
+  &QN_STREAM_STREAM, &QN_STREAM_FEATURES, &QN_STREAM_ERROR,
+  &QN_XSTREAM_TEXT,
+  &QN_BIND_BIND, &QN_BIND_RESOURCE, &QN_BIND_JID,
+  &QN_SESSION_SESSION,
+  &QN_SM_SM, &QN_SM_ENABLE, &QN_SM_ENABLED, &QN_SM_RESUME,
+  &QN_SM_RESUMED, &QN_SM_FAILED, &QN_SM_R, &QN_SM_A,
+  &QN_MESSAGE, &QN_BODY, &QN_SUBJECT, &QN_THREAD,
+  &QN_PRESENCE, &QN_SHOW, &QN_STATUS, &QN_PRIORITY,
+  &QN_IQ, &QN_ERROR,
+  &QN_STANZA_BAD_REQUEST, &QN_STANZA_CONFLICT,
+  &QN_STANZA_FEATURE_NOT_IMPLEMENTED, &QN_STANZA_FORBIDDEN,
+  &QN_STANZA_GONE, &QN_STANZA_INTERNAL_SERVER_ERROR,
+  &QN_STANZA_ITEM_NOT_FOUND, &QN_STANZA_JID_MALFORMED,
+  &QN_STANZA_NOT_ACCEPTABLE, &QN_STANZA_NOT_ALLOWED,
+  &QN_STANZA_PAYMENT_REQUIRED, &QN_STANZA_RECIPIENT_UNAVAILABLE,
+  &QN_STANZA_REDIRECT, &QN_STANZA_REGISTRATION_REQUIRED,
+  &QN_STANZA_REMOTE_SERVER_NOT_FOUND, &QN_STANZA_REMOTE_SERVER_TIMEOUT,
+  &QN_STANZA_RESOURCE_CONSTRAINT, &QN_STANZA_SERVICE_UNAVAILABLE,
+  &QN_STANZA_SUBSCRIPTION_REQUIRED, &QN_STANZA_UNDEFINED_CONDITION,
+  &QN_STANZA_UNEXPECTED_REQUEST, &QN_STANZA_TEXT,
+  &QN_ROSTER_QUERY, &QN_ROSTER_ITEM, &QN_ROSTER_GROUP,
+  &QN_DISCO_INFO_QUERY, &QN_DISCO_IDENTITY, &QN_DISCO_FEATURE,
+  &QN_DISCO_ITEMS_QUERY, &QN_DISCO_ITEM,
+  &QN_CAPS_C, &QN_PING,
+  &QN_PUBSUB, &QN_PUBSUB_ITEMS, &QN_PUBSUB_ITEM,
+  &QN_PUBSUB_EVENT, &QN_PUBSUB_EVENT_ITEMS, &QN_PUBSUB_EVENT_ITEM,
+  &QN_PUBSUB_EVENT_RETRACT,
+  &QN_MUC_X, &QN_MUC_USER_X, &QN_MUC_USER_ITEM, &QN_MUC_USER_STATUS,
+  &QN_MUC_USER_INVITE,
+  &QN_CS_ACTIVE, &QN_CS_COMPOSING, &QN_CS_PAUSED, &QN_CS_INACTIVE,
+  &QN_CS_GONE,
+  &QN_XML_LANG, &QN_VERSION, &QN_TO, &QN_FROM, &QN_TYPE, &QN_ID,
+  &QN_CODE, &QN_NAME, &QN_VALUE, &QN_JID, &QN_NICK, &QN_SUBSCRIPTION,
+  &QN_ASK, &QN_AFFILIATION, &QN_ROLE, &QN_H, &QN_PREVID, &QN_RESUME,
+  &QN_NODE, &QN_CATEGORY, &QN_VAR, &QN_VER, &QN_EXT,
+};
+
+// The vocabulary of attribute values and text, in table order.
+const char* const kVocabularyStrings[] = {
+  "chat", "groupchat", "headline", "normal", "error",
+  "get", "set", "result",
+  "unavailable", "subscribe", "subscribed", "unsubscribe", "unsubscribed",
+  "probe", "away", "xa", "dnd",
+  "1.0", "true", "false", "both", "none", "remove",
+  "cancel", "continue", "modify", "auth", "wait",
+};
+
+const char kNameSeparator = '\x01';
+
+// The codes of the events, and the first of the names.
+const uint32 kEventEnd = 0;
+const uint32 kEventText = 1;
+const uint32 kEventStart = 2;
+const uint32 kFirstStartName = 3;
+const uint32 kFirstAttrName = 1;
+
+// The most attributes an element may have.
+const uint32 kMaxAttrs = 1024;
+
+void WriteVarint(uint32 value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+// Passes |name| to the handler as the namespace and local part with
+// kNameSeparator between them, which ResolveQName splits.
+std::string MergeName(const QName& name) {
+  if (name.Namespace().empty())
+    return name.LocalPart();
+  std::string merged(name.Namespace());
+  merged.push_back(kNameSeparator);
+  merged.append(name.LocalPart());
+  return merged;
+}
+
+// Whether |name| declares a namespace, which isn't written, the default
+// namespace aside if |keep_default|.
+bool IsXmlnsAttr(const QName& name, bool keep_default) {
+  if (name.Namespace() == NS_XMLNS)
+    return true;
+  return !keep_default && name.Namespace().empty() &&
+         name.LocalPart() == "xmlns";
+}
+
+}  // namespace
+
+struct BinaryXmlTables::Vocabulary {
+  std::vector<QName> names;
+  std::map<QName, int> name_index;
+  std::vector<std::string> strings;
+  std::map<std::string, int> string_index;
+};
+
+const BinaryXmlTables::Vocabulary&
+BinaryXmlTables::GetVocabulary() {
+  static Vocabulary* vocabulary = NULL;
+  if (!vocabulary) {
+    Vocabulary* v = new Vocabulary;
+    for (size_t i = 0; i < ARRAY_SIZE(kVocabularyNames); ++i) {
+      v->name_index[*kVocabularyNames[i]] = static_cast<int>(i);
+      v->names.push_back(*kVocabularyNames[i]);
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(kVocabularyStrings); ++i) {
+      v->string_index[kVocabularyStrings[i]] = static_cast<int>(i);
+      v->strings.push_back(kVocabularyStrings[i]);
+    }
+    vocabulary = v;
+  }
+  return *vocabulary;
+}
+
+BinaryXmlTables::BinaryXmlTables() : vocabulary_(GetVocabulary()) {
+}
+
+void BinaryXmlTables::Reset() {
+  names_.clear();
+  name_index_.clear();
+  strings_.clear();
+  string_index_.clear();
+}
+
+int BinaryXmlTables::FindName(const QName& name) const {
+  std::map<QName, int>::const_iterator it = vocabulary_.name_index.find(name);
+  if (it != vocabulary_.name_index.end())
+    return it->second;
+  it = name_index_.find(name);
+  return it != name_index_.end() ? it->second : -1;
+}
+
+int BinaryXmlTables::FindString(const std::string& value) const {
+  std::map<std::string, int>::const_iterator it =
+      vocabulary_.string_index.find(value);
+  if (it != vocabulary_.string_index.end())
+    return it->second;
+  it = string_index_.find(value);
+  return it != string_index_.end() ? it->second : -1;
+}
+
+void BinaryXmlTables::AddName(const QName& name) {
+  if (names_.size() >= kMaxTableSize)
+    return;
+  name_index_[name] = static_cast<int>(name_count());
+  names_.push_back(name);
+}
+
+void BinaryXmlTables::AddString(const std::string& value) {
+  if (value.empty() || value.size() > kMaxTableString ||
+      strings_.size() >= kMaxTableSize)
+    return;
+  string_index_[value] = static_cast<int>(string_count());
+  strings_.push_back(value);
+}
+
+const QName& BinaryXmlTables::Name(size_t index) const {
+  if (index < vocabulary_.names.size())
+    return vocabulary_.names[index];
+  return names_[index - vocabulary_.names.size()];
+}
+
+const std::string& BinaryXmlTables::String(size_t index) const {
+  if (index < vocabulary_.strings.size())
+    return vocabulary_.strings[index];
+  return strings_[index - vocabulary_.strings.size()];
+}
+
+size_t BinaryXmlTables::name_count() const {
+  return vocabulary_.names.size() + names_.size();
+}
+
+size_t BinaryXmlTables::string_count() const {
+  return vocabulary_.strings.size() + strings_.size();
+}
+
+void BinaryXmlTables::Truncate(size_t names, size_t strings) {
+  while (name_count() > names) {
+    name_index_.erase(names_.back());
+    names_.pop_back();
+  }
+  while (string_count() > strings) {
+    string_index_.erase(strings_.back());
+    strings_.pop_back();
+  }
+}
+
+//
+// BinaryXmlWriter
+//
+
+void BinaryXmlWriter::WriteStreamStart(const XmlElement* stream,
+                                       std::string* out) {
+  tables_.Reset();
+  WriteStart(stream, true, out);
+}
+
+void BinaryXmlWriter::WriteElement(const XmlElement* element,
+                                   std::string* out) {
+  tables_.Reset();
+  WriteStart(element, false, out);
+  WriteChildren(element, out);
+  WriteVarint(kEventEnd, out);
+}
+
+void BinaryXmlWriter::WriteStreamText(const std::string& text,
+                                      std::string* out) {
+  WriteVarint(kEventText, out);
+  WriteString(text, out);
+}
+
+void BinaryXmlWriter::WriteStreamEnd(std::string* out) {
+  WriteVarint(kEventEnd, out);
+}
+
+void BinaryXmlWriter::WriteStart(const XmlElement* element, bool keep_xmlns,
+                                 std::string* out) {
+  WriteName(element->Name(), kFirstStartName, out);
+  uint32 count = 0;
+  for (const XmlAttr* attr = element->FirstAttr(); attr;
+       attr = attr->NextAttr()) {
+    if (!IsXmlnsAttr(attr->Name(), keep_xmlns))
+      ++count;
+  }
+  WriteVarint(count, out);
+  for (const XmlAttr* attr = element->FirstAttr(); attr;
+       attr = attr->NextAttr()) {
+    if (IsXmlnsAttr(attr->Name(), keep_xmlns))
+      continue;
+    WriteName(attr->Name(), kFirstAttrName, out);
+    WriteString(attr->Value(), out);
+  }
+}
+
+void BinaryXmlWriter::WriteChildren(const XmlElement* element,
+                                    std::string* out) {
+  for (const XmlChild* child = element->FirstChild(); child;
+       child = child->NextChild()) {
+    if (child->IsText()) {
+      WriteVarint(kEventText, out);
+      WriteString(child->AsText()->Text(), out);
+    } else {
+      WriteStart(child->AsElement(), false, out);
+      WriteChildren(child->AsElement(), out);
+      WriteVarint(kEventEnd, out);
+    }
+  }
+}
+
+void BinaryXmlWriter::WriteName(const QName& name, uint32 table_base,
+                                std::string* out) {
+  int index = tables_.FindName(name);
+  if (index >= 0) {
+    WriteVarint(table_base + index, out);
+    return;
+  }
+  WriteVarint(table_base - 1, out);
+  WriteString(name.Namespace(), out);
+  WriteString(name.LocalPart(), out);
+  tables_.AddName(name);
+}
+
+void BinaryXmlWriter::WriteString(const std::string& value,
+                                  std::string* out) {
+  int index = tables_.FindString(value);
+  if (index >= 0) {
+    WriteVarint(0, out);
+    WriteVarint(index, out);
+    return;
+  }
+  WriteVarint(static_cast<uint32>(value.size()) + 1, out);
+  out->append(value);
+  tables_.AddString(value);
+}
+
+//
+// BinaryXmlReader
+//
+
+BinaryXmlReader::BinaryXmlReader(XmlParseHandler* handler)
+    : handler_(handler) {
+  Reset();
+}
+
+BinaryXmlReader::~BinaryXmlReader() {
+}
+
+void BinaryXmlReader::Reset() {
+  tables_.Reset();
+  input_.clear();
+  pos_ = 0;
+  base_ = 0;
+  event_start_ = 0;
+  event_len_ = 0;
+  depth_ = 0;
+  raised_ = XML_ERROR_NONE;
+  error_ = false;
+  open_.clear();
+}
+
+bool BinaryXmlReader::Parse(const char* data, size_t len) {
+  if (error_)
+    return false;
+  input_.append(data, len);
+  while (!error_ && pos_ < input_.size()) {
+    Status status = ReadEvent();
+    if (status == STATUS_MORE)
+      break;
+    if (status == STATUS_ERROR)
+      RaiseError(XML_ERROR_SYNTAX);
+    if (raised_ != XML_ERROR_NONE) {
+      error_ = true;
+      handler_->Error(this, raised_);
+    }
+  }
+  // A handler may have reset us.
+  if (pos_ > 0) {
+    input_.erase(0, pos_);
+    base_ += static_cast<unsigned long>(pos_);
+    pos_ = 0;
+  }
+  return !error_;
+}
+
+BinaryXmlReader::Status BinaryXmlReader::ReadEvent() {
+  size_t start = pos_;
+  size_t names = tables_.name_count();
+  size_t strings = tables_.string_count();
+  uint32 code;
+  Status status = ReadVarint(&code);
+  if (status != STATUS_DONE)
+    return status;
+
+  event_names_.clear();
+  event_strings_.clear();
+  atts_.clear();
+  if (code == kEventEnd) {
+    if (depth_ == 0)
+      return STATUS_ERROR;
+  } else if (code == kEventText) {
+    event_strings_.push_back(std::string());
+    status = ReadString(&event_strings_.back());
+    if (status == STATUS_DONE && depth_ == 0)
+      status = STATUS_ERROR;
+  } else {
+    // The stream and each stanza start with the vocabulary.
+    if (depth_ <= 1) {
+      tables_.Reset();
+      names = tables_.name_count();
+      strings = tables_.string_count();
+    }
+    QName name;
+    status = ReadName(code, kFirstStartName, &name);
+    uint32 count = 0;
+    if (status == STATUS_DONE)
+      status = ReadVarint(&count);
+    if (status == STATUS_DONE && count > kMaxAttrs)
+      status = STATUS_ERROR;
+    if (status == STATUS_DONE)
+      AddEventName(name);
+    for (uint32 i = 0; status == STATUS_DONE && i < count; ++i) {
+      uint32 attr_code;
+      status = ReadVarint(&attr_code);
+      QName attr;
+      if (status == STATUS_DONE)
+        status = ReadName(attr_code, kFirstAttrName, &attr);
+      if (status == STATUS_DONE) {
+        atts_.push_back(AddEventName(attr));
+        event_strings_.push_back(std::string());
+        status = ReadString(&event_strings_.back());
+        atts_.push_back(event_strings_.back().c_str());
+      }
+    }
+    if (status == STATUS_DONE) {
+      atts_.push_back(NULL);
+      open_.push_back(MergeName(name));
+    }
+  }
+
+  if (status != STATUS_DONE) {
+    pos_ = start;
+    tables_.Truncate(names, strings);
+    return status;
+  }
+
+  event_start_ = base_ + static_cast<unsigned long>(start);
+  event_len_ = static_cast<unsigned long>(pos_ - start);
+  if (code == kEventEnd) {
+    --depth_;
+    std::string name(open_.back());
+    open_.pop_back();
+    handler_->EndElement(this, name.c_str());
+  } else if (code == kEventText) {
+    handler_->CharacterData(this, event_strings_[0].data(),
+                            static_cast<int>(event_strings_[0].size()));
+  } else {
+    ++depth_;
+    handler_->StartElement(this, event_names_.front().first.c_str(),
+                           &atts_[0]);
+  }
+  return STATUS_DONE;
+}
+
+BinaryXmlReader::Status BinaryXmlReader::ReadVarint(uint32* value) {
+  uint32 result = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (pos_ >= input_.size())
+      return STATUS_MORE;
+    uint8 byte = static_cast<uint8>(input_[pos_++]);
+    if (shift == 28 && byte > 0x0f)
+      return STATUS_ERROR;
+    result |= static_cast<uint32>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return STATUS_DONE;
+    }
+  }
+  return STATUS_ERROR;
+}
+
+BinaryXmlReader::Status BinaryXmlReader::ReadString(std::string* value) {
+  uint32 len;
+  Status status = ReadVarint(&len);
+  if (status != STATUS_DONE)
+    return status;
+  if (len == 0) {
+    uint32 index;
+    status = ReadVarint(&index);
+    if (status != STATUS_DONE)
+      return status;
+    if (index >= tables_.string_count())
+      return STATUS_ERROR;
+    *value = tables_.String(index);
+    return STATUS_DONE;
+  }
+  --len;
+  if (len > kMaxString)
+    return STATUS_ERROR;
+  if (input_.size() - pos_ < len)
+    return STATUS_MORE;
+  value->assign(input_, pos_, len);
+  pos_ += len;
+  tables_.AddString(*value);
+  return STATUS_DONE;
+}
+
+BinaryXmlReader::Status BinaryXmlReader::ReadName(uint32 code,
+                                                  uint32 table_base,
+                                                  QName* name) {
+  if (code >= table_base) {
+    if (code - table_base >= tables_.name_count())
+      return STATUS_ERROR;
+    *name = tables_.Name(code - table_base);
+    return STATUS_DONE;
+  }
+  std::string ns, local;
+  Status status = ReadString(&ns);
+  if (status == STATUS_DONE)
+    status = ReadString(&local);
+  if (status != STATUS_DONE)
+    return status;
+  if (local.empty() || ns.find(kNameSeparator) != std::string::npos ||
+      local.find(kNameSeparator) != std::string::npos)
+    return STATUS_ERROR;
+  *name = QName(ns, local.c_str());
+  tables_.AddName(*name);
+  return STATUS_DONE;
+}
+
+const char* BinaryXmlReader::AddEventName(const QName& name) {
+  event_names_.push_back(std::make_pair(MergeName(name), name));
+  return event_names_.back().first.c_str();
+}
+
+QName BinaryXmlReader::ResolveQName(const char* qname, bool isAttr) {
+  for (size_t i = 0; i < event_names_.size(); ++i) {
+    if (event_names_[i].first.c_str() == qname)
+      return event_names_[i].second;
+  }
+  const char* separator = strchr(qname, kNameSeparator);
+  if (!separator)
+    return QName(STR_EMPTY, qname);
+  return QName(std::string(qname, separator), separator + 1);
+}
+
+void BinaryXmlReader::RaiseError(XML_Error err) {
+  if (raised_ == XML_ERROR_NONE)
+    raised_ = err;
+}
+
+void BinaryXmlReader::GetPosition(unsigned long* line,
+                                  unsigned long* column,
+                                  unsigned long* byte_index) {
+  *line = 1;
+  *column = event_start_;
+  *byte_index = event_start_;
+}
+
+unsigned long BinaryXmlReader::GetByteCount() {
+  return event_len_;
+}
+
+}  // namespace txmpp
@@ -0,0 +1,205 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_BINARYXML_H_
+#define _TXMPP_BINARYXML_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "qname.h"
+#include "xmlparser.h"
+
+namespace txmpp {
+
+class XmlElement;
+
+// A compact binary encoding of an XMPP stream, in the manner of EXI
+// (XEP-0322) but much simpler, for links where even compressed XML costs
+// too much to send and to parse.  It is not EXI, and is negotiated as the
+// XEP-0138 compression method kBinaryXmlMethod, so that only peers that
+// know it use it.
+//
+// The stream is a sequence of events, each led by a varint code:
+//
+//   0          end of element
+//   1 s        character data
+//   2 s s      start of element, by namespace and local name
+//   3 + k      start of element with the k-th name of the name table
+//
+// A start of element is followed by a varint count of attributes, each a
+// varint name code (0 and two strings for a literal name, or 1 + k for the
+// k-th name) and a string value.  A string is a varint n: 0 and a varint k
+// for the k-th string of the string table, or n - 1 bytes of UTF-8.
+//
+// Both tables start with a fixed vocabulary of the core XMPP names and
+// attribute values, which stands in for EXI's schema-informed grammars,
+// and each literal name and short string is added to its table as it is
+// seen.  The tables go back to the vocabulary at the start of the stream
+// and of each stanza, so that stanzas can be resent on their own, as on
+// stream resumption.  Namespace declarations aren't sent; names carry
+// their namespace.  The vocabularies are part of the encoding, and may
+// only ever be added to at the end.
+class BinaryXmlTables {
+ public:
+  BinaryXmlTables();
+
+  // Drops what was added since the vocabulary.
+  void Reset();
+
+  // The index of |name| or |value|, or -1.
+  int FindName(const QName& name) const;
+  int FindString(const std::string& value) const;
+  // Adds what the encoding adds to the tables, so both ends agree.
+  void AddName(const QName& name);
+  void AddString(const std::string& value);
+  const QName& Name(size_t index) const;
+  const std::string& String(size_t index) const;
+  size_t name_count() const;
+  size_t string_count() const;
+  // Drops what was added after the tables had these counts.
+  void Truncate(size_t names, size_t strings);
+
+  // The longest string added to the table, and the most the table holds.
+  static const size_t kMaxTableString = 64;
+  static const size_t kMaxTableSize = 1024;
+
+ private:
+  struct Vocabulary;
+  static const Vocabulary& GetVocabulary();
+
+  const Vocabulary& vocabulary_;
+  std::vector<QName> names_;
+  std::map<QName, int> name_index_;
+  std::vector<std::string> strings_;
+  std::map<std::string, int> string_index_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(BinaryXmlTables);
+};
+
+// Writes XmlElements in the binary encoding; the alternative to XmlPrinter.
+class BinaryXmlWriter {
+ public:
+  BinaryXmlWriter() {}
+
+  // Appends the start of the stream element |stream|, with its attributes
+  // but not its children. Its default namespace is kept, for the peer to
+  // check.
+  void WriteStreamStart(const XmlElement* stream, std::string* out);
+  // Appends a stanza, or any other child of the stream.
+  void WriteElement(const XmlElement* element, std::string* out);
+  // Appends text between stanzas, such as a whitespace keepalive.
+  void WriteStreamText(const std::string& text, std::string* out);
+  // Appends the end of the stream.
+  void WriteStreamEnd(std::string* out);
+
+ private:
+  void WriteStart(const XmlElement* element, bool keep_xmlns,
+                  std::string* out);
+  void WriteChildren(const XmlElement* element, std::string* out);
+  void WriteName(const QName& name, uint32 table_base, std::string* out);
+  void WriteString(const std::string& value, std::string* out);
+
+  BinaryXmlTables tables_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(BinaryXmlWriter);
+};
+
+// Reads the binary encoding and raises the events XmlParser would for the
+// same stream as XML, so that an XmlBuilder, or XmppStanzaParser, can take
+// either.  It is its own XmlParseContext: the names it passes resolve only
+// through it, and positions are byte offsets in the encoding.
+class BinaryXmlReader : public XmlParseContext {
+ public:
+  explicit BinaryXmlReader(XmlParseHandler* handler);
+  virtual ~BinaryXmlReader();
+
+  // Takes more of the stream, raising the events for what is complete.
+  // Returns false once the input is found to be bad.
+  bool Parse(const char* data, size_t len);
+  void Reset();
+
+  // XmlParseContext
+  virtual QName ResolveQName(const char* qname, bool isAttr);
+  virtual void RaiseError(XML_Error err);
+  virtual void GetPosition(unsigned long* line, unsigned long* column,
+                           unsigned long* byte_index);
+  virtual unsigned long GetByteCount();
+
+  // The most bytes a string may have.
+  static const size_t kMaxString = 16 * 1024 * 1024;
+
+ private:
+  enum Status { STATUS_DONE, STATUS_MORE, STATUS_ERROR };
+
+  // Reads one event from pos_, raising it if it is complete.
+  Status ReadEvent();
+  Status ReadVarint(uint32* value);
+  Status ReadString(std::string* value);
+  Status ReadName(uint32 code, uint32 table_base, QName* name);
+  // Adds |name| to the names passed with the event being raised.
+  const char* AddEventName(const QName& name);
+
+  XmlParseHandler* handler_;
+  BinaryXmlTables tables_;
+  std::string input_;
+  size_t pos_;
+  // The offset in the stream of input_[0], and of the event being raised
+  // and its length.
+  unsigned long base_;
+  unsigned long event_start_;
+  unsigned long event_len_;
+  int depth_;
+  // The names of the open elements, as passed to StartElement.
+  std::vector<std::string> open_;
+  // The first error raised by a handler, and whether the handler was told.
+  XML_Error raised_;
+  bool error_;
+  // The names passed with the event being raised, each with the name it
+  // resolves to, and the strings passed with it. A deque doesn't move its
+  // strings as it grows, so their c_str()s hold.
+  std::deque<std::pair<std::string, QName> > event_names_;
+  std::deque<std::string> event_strings_;
+  std::vector<const char*> atts_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(BinaryXmlReader);
+};
+
+// The XEP-0138 method name the encoding is negotiated as.
+extern const char kBinaryXmlMethod[];
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_BINARYXML_H_
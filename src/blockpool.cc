@@ -0,0 +1,109 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "blockpool.h"
+
+namespace txmpp {
+
+namespace {
+
+// Keeps every block aligned as well as operator new would.
+const size_t kBlockAlignment = 16;
+
+inline size_t RoundUp(size_t size) {
+  return (size + kBlockAlignment - 1) & ~(kBlockAlignment - 1);
+}
+
+}  // namespace
+
+BlockPool::BlockPool(size_t size)
+    : size_(size), stride_(RoundUp(kBlockAlignment + size)), free_(0),
+      chunk_count_(0) {
+}
+
+BlockPool::~BlockPool() {
+  for (int i = 0; i < chunk_count_; ++i)
+    delete [] chunks_[i];
+}
+
+void* BlockPool::Allocate() {
+  while (true) {
+    uint64 top = AtomicOps::AcquireLoad(&free_);
+    uint32 first = static_cast<uint32>(top);
+    if (first != 0) {
+      // If another thread takes this block first, its generation bump makes
+      // the swap fail, so a stale next is never installed.
+      Header* header = HeaderAt(first - 1);
+      uint64 rest = (((top >> 32) + 1) << 32) | header->next;
+      if (AtomicOps::CompareAndSwap(&free_, top, rest))
+        return reinterpret_cast<char*>(header) + kBlockAlignment;
+      continue;
+    }
+
+    CritScope cs(&grow_crit_);
+    if (static_cast<uint32>(AtomicOps::AcquireLoad(&free_)) != 0)
+      continue;
+    if (chunk_count_ == kMaxChunks) {
+      char* block = new char[stride_];
+      reinterpret_cast<Header*>(block)->index = kUnpooled;
+      return block + kBlockAlignment;
+    }
+    // new[] of char is aligned for any object that fits, stride_ keeps it so.
+    char* chunk = new char[stride_ * kBlocksPerChunk];
+    uint32 base = static_cast<uint32>(chunk_count_) * kBlocksPerChunk;
+    chunks_[chunk_count_++] = chunk;
+    for (int i = 0; i < kBlocksPerChunk; ++i)
+      reinterpret_cast<Header*>(chunk + i * stride_)->index = base + i;
+    for (int i = 1; i < kBlocksPerChunk; ++i)
+      Push(reinterpret_cast<Header*>(chunk + i * stride_));
+    return chunk + kBlockAlignment;
+  }
+}
+
+void BlockPool::Free(void* block) {
+  if (!block)
+    return;
+  Header* header = reinterpret_cast<Header*>(
+      static_cast<char*>(block) - kBlockAlignment);
+  if (header->index == kUnpooled) {
+    delete [] reinterpret_cast<char*>(header);
+  } else {
+    Push(header);
+  }
+}
+
+void BlockPool::Push(Header* header) {
+  while (true) {
+    uint64 top = AtomicOps::AcquireLoad(&free_);
+    header->next = static_cast<uint32>(top);
+    uint64 pushed = (((top >> 32) + 1) << 32) | (header->index + 1);
+    if (AtomicOps::CompareAndSwap(&free_, top, pushed))
+      return;
+  }
+}
+
+}  // namespace txmpp
@@ -0,0 +1,93 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_BLOCKPOOL_H_
+#define _TXMPP_BLOCKPOOL_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "criticalsection.h"
+
+namespace txmpp {
+
+// BlockPool hands out fixed-size blocks of memory and takes them back,
+// keeping freed blocks on a lock-free free list for reuse.  Allocate and Free
+// may be called from any thread without locking, except when the pool grows,
+// which takes a lock once per kBlocksPerChunk blocks.  Memory is only given
+// back to the system when the pool is destroyed.  Once kMaxChunks chunks are
+// in use further blocks come from the heap, and Free deletes them again.
+
+class BlockPool {
+ public:
+  explicit BlockPool(size_t size);
+  ~BlockPool();
+
+  size_t size() const { return size_; }
+
+  // Returns a block of size() bytes, aligned for any scalar type.
+  void* Allocate();
+  // |block| must have come from Allocate on this pool.
+  void Free(void* block);
+
+ private:
+  // Precedes every block.
+  struct Header {
+    uint32 index;  // In chunks_, or kUnpooled.
+    volatile uint32 next;  // index + 1 of the next free block, or 0.
+  };
+
+  static const int kBlocksPerChunk = 64;
+  static const int kMaxChunks = 256;
+  static const uint32 kUnpooled = static_cast<uint32>(-1);
+
+  Header* HeaderAt(uint32 index) {
+    return reinterpret_cast<Header*>(
+        chunks_[index / kBlocksPerChunk] + (index % kBlocksPerChunk) * stride_);
+  }
+  void Push(Header* header);
+
+  size_t size_;
+  size_t stride_;
+  // Top of the free list: a generation count in the high half against ABA,
+  // and index + 1 of the first free block, or 0, in the low half.
+  volatile uint64 free_;
+  char* chunks_[kMaxChunks];
+  int chunk_count_;
+  CriticalSection grow_crit_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(BlockPool);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_BLOCKPOOL_H_
@@ -28,31 +28,60 @@
 #ifndef _TXMPP_BUFFER_H_
 #define _TXMPP_BUFFER_H_
 
+#include <algorithm>
 #include <cstring>
 
-#include "scoped_ptr.h"
+#include "bufferallocator.h"
+#include "common.h"
 
 namespace txmpp {
 
 // Basic buffer class, can be grown and shrunk dynamically.
 // Unlike std::string/vector, does not initialize data when expanding capacity.
+// Storage comes from a BufferAllocator, Default() unless one is given; a copy
+// uses the allocator of the buffer it copies.
 class Buffer {
  public:
-  Buffer() {
+  Buffer() : allocator_(BufferAllocator::Default()), data_(NULL) {
     Construct(NULL, 0, 0);
   }
-  Buffer(const void* data, size_t length) {
+  explicit Buffer(BufferAllocator* allocator)
+      : allocator_(BufferAllocator::Resolve(allocator)), data_(NULL) {
+    Construct(NULL, 0, 0);
+  }
+  Buffer(const void* data, size_t length)
+      : allocator_(BufferAllocator::Default()), data_(NULL) {
     Construct(data, length, length);
   }
-  Buffer(const void* data, size_t length, size_t capacity) {
+  Buffer(const void* data, size_t length, size_t capacity,
+         BufferAllocator* allocator = NULL)
+      : allocator_(BufferAllocator::Resolve(allocator)), data_(NULL) {
     Construct(data, length, capacity);
   }
-  Buffer(const Buffer& buf) {
+  Buffer(const Buffer& buf) : allocator_(buf.allocator_), data_(NULL) {
     Construct(buf.data(), buf.length(), buf.length());
   }
+#if TXMPP_HAS_MOVE
+  // Takes the storage of |buf|, which is left empty, with no storage at all.
+  Buffer(Buffer&& buf) noexcept
+      : allocator_(buf.allocator_), data_(buf.data_), length_(buf.length_),
+        capacity_(buf.capacity_) {
+    buf.data_ = NULL;
+    buf.length_ = 0;
+    buf.capacity_ = 0;
+  }
+  Buffer& operator=(Buffer&& buf) noexcept {
+    Swap(&buf);
+    return *this;
+  }
+#endif
+  ~Buffer() {
+    allocator_->Free(data_, capacity_);
+  }
 
-  const char* data() const { return data_.get(); }
-  char* data() { return data_.get(); }
+  const char* data() const { return data_; }
+  char* data() { return data_; }
+  BufferAllocator* allocator() const { return allocator_; }
   // TODO: should this be size(), like STL?
   size_t length() const { return length_; }
   size_t capacity() const { return capacity_; }
@@ -65,7 +94,7 @@ class Buffer {
   }
   bool operator==(const Buffer& buf) const {
     return (length_ == buf.length() &&
-            memcmp(data_.get(), buf.data(), length_) == 0);
+            memcmp(data_, buf.data(), length_) == 0);
   }
   bool operator!=(const Buffer& buf) const {
     return !operator==(buf);
@@ -74,13 +103,13 @@ class Buffer {
   void SetData(const void* data, size_t length) {
     ASSERT(data != NULL || length == 0);
     SetLength(length);
-    memcpy(data_.get(), data, length);
+    memcpy(data_, data, length);
   }
   void AppendData(const void* data, size_t length) {
     ASSERT(data != NULL || length == 0);
     size_t old_length = length_;
     SetLength(length_ + length);
-    memcpy(data_.get() + old_length, data, length);
+    memcpy(data_ + old_length, data, length);
   }
   void SetLength(size_t length) {
     SetCapacity(length);
@@ -88,28 +117,48 @@ class Buffer {
   }
   void SetCapacity(size_t capacity) {
     if (capacity > capacity_) {
-      txmpp::scoped_array<char> data(new char[capacity]);
-      memcpy(data.get(), data_.get(), length_);
-      data_.swap(data);
+      char* data = allocator_->Allocate(capacity);
+      memcpy(data, data_, length_);
+      allocator_->Free(data_, capacity_);
+      data_ = data;
       capacity_ = capacity;
     }
   }
 
+  // Exchanges the storage, and the allocators with it.
+  void Swap(Buffer* buf) {
+    std::swap(allocator_, buf->allocator_);
+    std::swap(data_, buf->data_);
+    std::swap(length_, buf->length_);
+    std::swap(capacity_, buf->capacity_);
+  }
+
+  // |buf| takes the storage, and with it this buffer's allocator.
   void TransferTo(Buffer* buf) {
     ASSERT(buf != NULL);
-    buf->data_.reset(data_.release());
+    buf->allocator_->Free(buf->data_, buf->capacity_);
+    buf->allocator_ = allocator_;
+    buf->data_ = data_;
     buf->length_ = length_;
     buf->capacity_ = capacity_;
+    data_ = NULL;
     Construct(NULL, 0, 0);
   }
 
  protected:
   void Construct(const void* data, size_t length, size_t capacity) {
-    data_.reset(new char[capacity_ = capacity]);
+    char* old_data = data_;
+    size_t old_capacity = old_data ? capacity_ : 0;
+    data_ = allocator_->Allocate(capacity);
+    capacity_ = capacity;
+    length_ = 0;
     SetData(data, length);
+    if (old_data)
+      allocator_->Free(old_data, old_capacity);
   }
 
-  scoped_array<char> data_;
+  BufferAllocator* allocator_;
+  char* data_;
   size_t length_;
   size_t capacity_;
 };
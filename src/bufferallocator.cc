@@ -0,0 +1,207 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bufferallocator.h"
+
+#ifdef POSIX
+#include <pthread.h>
+#endif
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "criticalsection.h"
+
+#ifdef WIN32
+#include "win32.h"
+#endif
+
+namespace txmpp {
+
+class HeapBufferAllocator : public BufferAllocator {
+ public:
+  HeapBufferAllocator() {}
+
+  virtual char* Allocate(size_t size) {
+    return new char[size];
+  }
+  virtual void Free(char* block, size_t size) {
+    delete[] block;
+  }
+
+ private:
+  DISALLOW_EVIL_CONSTRUCTORS(HeapBufferAllocator);
+};
+
+class PooledBufferAllocator : public BufferAllocator {
+ public:
+  PooledBufferAllocator();
+
+  virtual char* Allocate(size_t size);
+  virtual void Free(char* block, size_t size);
+
+ private:
+  // Size classes are kMinClassSize << 0 .. kClasses - 1.
+  static const size_t kMinClassSize = 4096;
+  static const int kClasses = 5;
+  static const size_t kMaxCachedBytes = 128 * 1024;
+
+  // A thread's free lists.  A free block holds the next one in its first
+  // bytes.
+  struct Lists {
+    char* heads[kClasses];
+    size_t counts[kClasses];
+  };
+
+  // The class that serves |size|, or -1 if the heap does.
+  static int ClassOf(size_t size);
+  static size_t ClassSize(int c) { return kMinClassSize << c; }
+  // The calling thread's lists, made if |create| is set.
+  Lists* CurrentLists(bool create);
+#ifdef POSIX
+  static void OnThreadExit(void* lists);
+  pthread_key_t key_;
+#elif WIN32
+  DWORD key_;
+#endif
+
+  DISALLOW_EVIL_CONSTRUCTORS(PooledBufferAllocator);
+};
+
+// Like ThreadManager's key, the pool's is made by static construction.
+static HeapBufferAllocator g_heap_buffer_allocator;
+static PooledBufferAllocator g_pooled_buffer_allocator;
+static BufferAllocator* volatile g_default_buffer_allocator = NULL;
+
+PooledBufferAllocator::PooledBufferAllocator() {
+#ifdef POSIX
+  pthread_key_create(&key_, &PooledBufferAllocator::OnThreadExit);
+#elif WIN32
+  key_ = TlsAlloc();
+#endif
+}
+
+int PooledBufferAllocator::ClassOf(size_t size) {
+  if (size <= kMinClassSize / 2)
+    return -1;
+  for (int c = 0; c < kClasses; ++c) {
+    if (size <= ClassSize(c))
+      return c;
+  }
+  return -1;
+}
+
+PooledBufferAllocator::Lists* PooledBufferAllocator::CurrentLists(
+    bool create) {
+#ifdef POSIX
+  Lists* lists = static_cast<Lists*>(pthread_getspecific(key_));
+#elif WIN32
+  Lists* lists = static_cast<Lists*>(TlsGetValue(key_));
+#endif
+  if (lists || !create)
+    return lists;
+
+  lists = new Lists;
+  for (int c = 0; c < kClasses; ++c) {
+    lists->heads[c] = NULL;
+    lists->counts[c] = 0;
+  }
+#ifdef POSIX
+  pthread_setspecific(key_, lists);
+#elif WIN32
+  // There is no hook for a thread's exit here, so what a thread has cached
+  // when it ends stays allocated.
+  TlsSetValue(key_, lists);
+#endif
+  return lists;
+}
+
+#ifdef POSIX
+void PooledBufferAllocator::OnThreadExit(void* p) {
+  Lists* lists = static_cast<Lists*>(p);
+  for (int c = 0; c < kClasses; ++c) {
+    while (char* block = lists->heads[c]) {
+      lists->heads[c] = *reinterpret_cast<char**>(block);
+      delete[] block;
+    }
+  }
+  delete lists;
+}
+#endif
+
+char* PooledBufferAllocator::Allocate(size_t size) {
+  const int c = ClassOf(size);
+  if (c < 0)
+    return new char[size];
+
+  Lists* lists = CurrentLists(false);
+  if (lists && lists->heads[c]) {
+    char* block = lists->heads[c];
+    lists->heads[c] = *reinterpret_cast<char**>(block);
+    --lists->counts[c];
+    return block;
+  }
+  return new char[ClassSize(c)];
+}
+
+void PooledBufferAllocator::Free(char* block, size_t size) {
+  if (!block)
+    return;
+  const int c = ClassOf(size);
+  if (c < 0) {
+    delete[] block;
+    return;
+  }
+
+  Lists* lists = CurrentLists(true);
+  if ((lists->counts[c] + 1) * ClassSize(c) > kMaxCachedBytes) {
+    delete[] block;
+    return;
+  }
+  *reinterpret_cast<char**>(block) = lists->heads[c];
+  lists->heads[c] = block;
+  ++lists->counts[c];
+}
+
+BufferAllocator* BufferAllocator::Heap() {
+  return &g_heap_buffer_allocator;
+}
+
+BufferAllocator* BufferAllocator::Pooled() {
+  return &g_pooled_buffer_allocator;
+}
+
+BufferAllocator* BufferAllocator::Default() {
+  BufferAllocator* allocator =
+      AtomicOps::AcquireLoadPtr(&g_default_buffer_allocator);
+  return allocator ? allocator : Heap();
+}
+
+void BufferAllocator::SetDefault(BufferAllocator* allocator) {
+  AtomicOps::ReleaseStorePtr(&g_default_buffer_allocator, allocator);
+}
+
+}  // namespace txmpp
@@ -0,0 +1,79 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_BUFFERALLOCATOR_H_
+#define _TXMPP_BUFFERALLOCATOR_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+
+namespace txmpp {
+
+// Where Buffer, ByteBuffer, FifoBuffer and MemoryStream get their storage.
+// Each takes an allocator when it is made and keeps it for its life, so
+// that a block is always given back to the allocator it came from.  A NULL
+// allocator means Default(), which is Heap() unless SetDefault was called.
+//
+// Implementations must be safe to call from any thread, since a buffer may
+// be made on one thread and freed on another.
+class BufferAllocator {
+ public:
+  virtual ~BufferAllocator() {}
+
+  // Returns a block of |size| bytes, aligned as new[] aligns it.  Like
+  // new[], it does not return NULL.
+  virtual char* Allocate(size_t size) = 0;
+  // Gives back |block|, which Allocate returned for |size| bytes.  A NULL
+  // |block| is ignored.
+  virtual void Free(char* block, size_t size) = 0;
+
+  // new[] and delete[], as the buffers have always used.
+  static BufferAllocator* Heap();
+  // Keeps freed blocks of 2 KB to 64 KB on a free list per thread and size
+  // class (4, 8, 16, 32 and 64 KB), so that the buffers a connection makes
+  // and drops again and again are reused without a trip to the heap.  Other
+  // sizes go to the heap.  A block asked for on one thread and freed on
+  // another ends up on the second thread's list.  Each list keeps at most
+  // 128 KB; the rest is freed, as are a thread's lists when it exits.
+  static BufferAllocator* Pooled();
+
+  static BufferAllocator* Default();
+  // Sets what a NULL allocator means for buffers made from now on; NULL
+  // goes back to Heap().  Buffers already made keep the allocator they have.
+  static void SetDefault(BufferAllocator* allocator);
+  // |allocator|, or Default() for NULL.
+  static BufferAllocator* Resolve(BufferAllocator* allocator) {
+    return allocator ? allocator : Default();
+  }
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_BUFFERALLOCATOR_H_
@@ -31,6 +31,7 @@
 #include <cassert>
 #include <cstring>
 
+#include "allocstats.h"
 #include "basictypes.h"
 #include "byteorder.h"
 
@@ -39,31 +40,37 @@ namespace txmpp {
 static const int DEFAULT_SIZE = 4096;
 
 ByteBuffer::ByteBuffer() {
-  Construct(NULL, DEFAULT_SIZE, ORDER_NETWORK);
+  Construct(NULL, DEFAULT_SIZE, ORDER_NETWORK, NULL);
 }
 
 ByteBuffer::ByteBuffer(ByteOrder byte_order) {
-  Construct(NULL, DEFAULT_SIZE, byte_order);
+  Construct(NULL, DEFAULT_SIZE, byte_order, NULL);
 }
 
 ByteBuffer::ByteBuffer(const char* bytes, size_t len) {
-  Construct(bytes, len, ORDER_NETWORK);
+  Construct(bytes, len, ORDER_NETWORK, NULL);
 }
 
 ByteBuffer::ByteBuffer(const char* bytes, size_t len, ByteOrder byte_order) {
-  Construct(bytes, len, byte_order);
+  Construct(bytes, len, byte_order, NULL);
 }
 
 ByteBuffer::ByteBuffer(const char* bytes) {
-  Construct(bytes, strlen(bytes), ORDER_NETWORK);
+  Construct(bytes, strlen(bytes), ORDER_NETWORK, NULL);
+}
+
+ByteBuffer::ByteBuffer(BufferAllocator* allocator, ByteOrder byte_order) {
+  Construct(NULL, DEFAULT_SIZE, byte_order, allocator);
 }
 
 void ByteBuffer::Construct(const char* bytes, size_t len,
-                           ByteOrder byte_order) {
+                           ByteOrder byte_order, BufferAllocator* allocator) {
+  allocator_  = BufferAllocator::Resolve(allocator);
   start_      = 0;
   size_       = len;
   byte_order_ = byte_order;
-  bytes_      = new char[size_];
+  bytes_      = allocator_->Allocate(size_);
+  AllocStats::Record(AllocStats::AS_BYTE_BUFFER, size_);
 
   if (bytes) {
     end_ = len;
@@ -73,8 +80,31 @@ void ByteBuffer::Construct(const char* bytes, size_t len,
   }
 }
 
+#if TXMPP_HAS_MOVE
+ByteBuffer::ByteBuffer(ByteBuffer&& buf) noexcept
+    : allocator_(buf.allocator_), bytes_(buf.bytes_), size_(buf.size_),
+      start_(buf.start_), end_(buf.end_), byte_order_(buf.byte_order_) {
+  buf.bytes_ = NULL;
+  buf.size_ = buf.start_ = buf.end_ = 0;
+}
+
+ByteBuffer& ByteBuffer::operator=(ByteBuffer&& buf) noexcept {
+  Swap(&buf);
+  return *this;
+}
+#endif
+
 ByteBuffer::~ByteBuffer() {
-  delete[] bytes_;
+  allocator_->Free(bytes_, size_);
+}
+
+void ByteBuffer::Swap(ByteBuffer* buf) {
+  std::swap(allocator_, buf->allocator_);
+  std::swap(bytes_, buf->bytes_);
+  std::swap(size_, buf->size_);
+  std::swap(start_, buf->start_);
+  std::swap(end_, buf->end_);
+  std::swap(byte_order_, buf->byte_order_);
 }
 
 bool ByteBuffer::ReadUInt8(uint8* val) {
@@ -191,21 +221,44 @@ void ByteBuffer::WriteString(const std::string& val) {
 }
 
 void ByteBuffer::WriteBytes(const char* val, size_t len) {
-  if (Length() + len > Capacity())
-    Resize(Length() + len);
-
+  EnsureWritable(len);
   memcpy(bytes_ + end_, val, len);
   end_ += len;
 }
 
+char* ByteBuffer::ReserveWriteBuffer(size_t len) {
+  EnsureWritable(len);
+  char* start = bytes_ + end_;
+  end_ += len;
+  return start;
+}
+
+void ByteBuffer::EnsureWritable(size_t len) {
+  if (end_ + len <= size_)
+    return;
+
+  // Moving the bytes left down to the front costs no more than the bytes
+  // consumed to free it, so it is cheap over time; otherwise grow. Growing
+  // by at least a byte makes Resize grow by half even when the bytes would
+  // fit as they are, or a nearly full buffer would be copied on every write.
+  if (Length() + len <= size_ && start_ >= Length()) {
+    end_ = Length();
+    memmove(bytes_, bytes_ + start_, end_);
+    start_ = 0;
+    return;
+  }
+  Resize(_max(Length() + len, size_ + 1));
+}
+
 void ByteBuffer::Resize(size_t size) {
   if (size > size_)
     size = _max(size, 3 * size_ / 2);
 
   size_t len = _min(end_ - start_, size);
-  char* new_bytes = new char[size];
+  char* new_bytes = allocator_->Allocate(size);
+  AllocStats::Record(AllocStats::AS_BYTE_BUFFER, size);
   memcpy(new_bytes, bytes_ + start_, len);
-  delete [] bytes_;
+  allocator_->Free(bytes_, size_);
 
   start_ = 0;
   end_   = len;
@@ -218,15 +271,12 @@ void ByteBuffer::Consume(size_t size) {
     return;
 
   start_ += size;
+  if (start_ == end_)
+    start_ = end_ = 0;
 }
 
 void ByteBuffer::Shift(size_t size) {
-  if (size > Length())
-    return;
-
-  end_ = Length() - size;
-  memmove(bytes_, bytes_ + start_ + size, end_);
-  start_ = 0;
+  Consume(size);
 }
 
 }  // namespace txmpp
@@ -35,6 +35,7 @@
 #include <string>
 
 #include "basictypes.h"
+#include "bufferallocator.h"
 #include "constructormagic.h"
 
 namespace txmpp {
@@ -52,8 +53,22 @@ class ByteBuffer {
   ByteBuffer(const char* bytes, size_t len);
   ByteBuffer(const char* bytes, size_t len, ByteOrder byte_order);
   explicit ByteBuffer(const char* bytes);  // uses strlen
+  // Takes its storage from |allocator|, or BufferAllocator::Default() for
+  // NULL, as the other constructors do.
+  explicit ByteBuffer(BufferAllocator* allocator,
+                      ByteOrder byte_order = ORDER_NETWORK);
+#if TXMPP_HAS_MOVE
+  // Takes the storage of |buf|, which is left empty, with no storage at all.
+  ByteBuffer(ByteBuffer&& buf) noexcept;
+  ByteBuffer& operator=(ByteBuffer&& buf) noexcept;
+#endif
   ~ByteBuffer();
 
+  // Exchanges the contents, the storage and allocators with them.
+  void Swap(ByteBuffer* buf);
+
+  // The unread bytes are always one contiguous span, so they can be sent
+  // as they are, and Consume (or Shift) what was sent drops them in place.
   const char* Data() const { return bytes_ + start_; }
   size_t Length() const { return end_ - start_; }
   size_t Capacity() const { return size_ - start_; }
@@ -74,13 +89,23 @@ class ByteBuffer {
   void WriteString(const std::string& val);
   void WriteBytes(const char* val, size_t len);
 
+  // Appends |len| bytes for the caller to fill in place, as by a Recv, and
+  // returns where they start. The pointer lasts until the next write.
+  char* ReserveWriteBuffer(size_t len);
+
   void Resize(size_t size);
   void Consume(size_t size);
+  // Like Consume. Neither moves the bytes left; the room they free at the
+  // front is reused by later writes once it is worth moving them for.
   void Shift(size_t size);
 
  private:
-  void Construct(const char* bytes, size_t size, ByteOrder byte_order);
+  void Construct(const char* bytes, size_t size, ByteOrder byte_order,
+                 BufferAllocator* allocator);
+  // Makes room for |len| more bytes after the end.
+  void EnsureWritable(size_t len);
 
+  BufferAllocator* allocator_;
   char* bytes_;
   size_t size_;
   size_t start_;
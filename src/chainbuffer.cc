@@ -0,0 +1,218 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "chainbuffer.h"
+
+#include <algorithm>
+
+#include "common.h"
+#include "criticalsection.h"
+
+namespace txmpp {
+
+SharedBytes::SharedBytes(std::string* data) : refs_(1) {
+  data_.swap(*data);
+}
+
+SharedBytes::~SharedBytes() {
+}
+
+void SharedBytes::AddRef() const {
+  AtomicOps::Increment(&refs_);
+}
+
+void SharedBytes::Release() const {
+  if (AtomicOps::Decrement(&refs_) == 0)
+    delete this;
+}
+
+const size_t ChainBuffer::kCopyLimit;
+const size_t ChainBuffer::kSpareLimit;
+
+ChainBuffer::ChainBuffer()
+    : front_(0),
+      length_(0),
+      spare_(NULL) {
+}
+
+ChainBuffer::~ChainBuffer() {
+  for (size_t i = front_; i < blocks_.size(); ++i) {
+    if (blocks_[i]->shared)
+      blocks_[i]->shared->Release();
+    delete blocks_[i];
+  }
+  delete spare_;
+}
+
+void ChainBuffer::Append(const char* data, size_t len) {
+  if (len == 0)
+    return;
+  Chunk* chunk = Tail();
+  if (chunk == NULL) {
+    chunk = NewChunk();
+    blocks_.push_back(chunk);
+  }
+  chunk->data.append(data, len);
+  length_ += len;
+}
+
+void ChainBuffer::AppendString(std::string* str) {
+  if (str->size() < kCopyLimit && Tail() != NULL) {
+    Append(str->data(), str->size());
+    str->clear();
+    return;
+  }
+  if (str->empty())
+    return;
+  Chunk* chunk = NewChunk();
+  // The chunk's string, which may be a spare with room in it, goes back.
+  chunk->data.swap(*str);
+  str->clear();
+  length_ += chunk->data.size();
+  blocks_.push_back(chunk);
+}
+
+void ChainBuffer::Append(ChainBuffer* other) {
+  if (other == this)
+    return;
+  for (size_t i = other->front_; i < other->blocks_.size(); ++i)
+    blocks_.push_back(other->blocks_[i]);
+  length_ += other->length_;
+  other->blocks_.clear();
+  other->front_ = 0;
+  other->length_ = 0;
+}
+
+void ChainBuffer::AppendShared(const SharedBytes* shared, size_t offset,
+                               size_t len) {
+  ASSERT(offset + len <= shared->data().size());
+  if (len == 0)
+    return;
+  Chunk* chunk = NewChunk();
+  shared->AddRef();
+  chunk->shared = shared;
+  chunk->start = offset;
+  chunk->end = offset + len;
+  length_ += len;
+  blocks_.push_back(chunk);
+}
+
+IoVec ChainBuffer::Block(size_t index) const {
+  ASSERT(index < BlockCount());
+  const Chunk* chunk = blocks_[front_ + index];
+  IoVec vec;
+  vec.data = chunk->Bytes() + chunk->start;
+  vec.len = chunk->End() - chunk->start;
+  return vec;
+}
+
+size_t ChainBuffer::Peek(IoVec* vec, size_t count) const {
+  size_t filled = 0;
+  for (; filled < count && filled < BlockCount(); ++filled)
+    vec[filled] = Block(filled);
+  return filled;
+}
+
+void ChainBuffer::Consume(size_t len) {
+  ASSERT(len <= length_);
+  if (len > length_)
+    len = length_;
+  length_ -= len;
+  while (len > 0) {
+    Chunk* chunk = blocks_[front_];
+    size_t left = chunk->End() - chunk->start;
+    if (len < left) {
+      chunk->start += len;
+      break;
+    }
+    len -= left;
+    blocks_[front_++] = NULL;
+    FreeChunk(chunk);
+  }
+  if (front_ == blocks_.size()) {
+    blocks_.clear();
+    front_ = 0;
+  } else if (front_ >= 16 && front_ * 2 >= blocks_.size()) {
+    // Only the drained pointers move, never the bytes.
+    blocks_.erase(blocks_.begin(), blocks_.begin() + front_);
+    front_ = 0;
+  }
+}
+
+void ChainBuffer::Swap(ChainBuffer* other) {
+  blocks_.swap(other->blocks_);
+  std::swap(front_, other->front_);
+  std::swap(length_, other->length_);
+  std::swap(spare_, other->spare_);
+}
+
+size_t ChainBuffer::Trim() {
+  size_t freed = 0;
+  if (spare_) {
+    freed += sizeof(Chunk) + spare_->data.capacity();
+    delete spare_;
+    spare_ = NULL;
+  }
+  if (IsEmpty() && blocks_.capacity()) {
+    freed += blocks_.capacity() * sizeof(Chunk*);
+    std::vector<Chunk*>().swap(blocks_);
+    front_ = 0;
+  }
+  return freed;
+}
+
+ChainBuffer::Chunk* ChainBuffer::NewChunk() {
+  Chunk* chunk = spare_;
+  if (chunk != NULL)
+    spare_ = NULL;
+  else
+    chunk = new Chunk;
+  chunk->start = 0;
+  chunk->shared = NULL;
+  return chunk;
+}
+
+ChainBuffer::Chunk* ChainBuffer::Tail() {
+  if (BlockCount() == 0 || blocks_.back()->shared)
+    return NULL;
+  return blocks_.back();
+}
+
+void ChainBuffer::FreeChunk(Chunk* chunk) {
+  if (chunk->shared) {
+    chunk->shared->Release();
+    chunk->shared = NULL;
+  }
+  if (spare_ == NULL && chunk->data.capacity() <= kSpareLimit) {
+    chunk->data.clear();
+    spare_ = chunk;
+  } else {
+    delete chunk;
+  }
+}
+
+}  // namespace txmpp
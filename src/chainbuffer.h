@@ -0,0 +1,142 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_CHAINBUFFER_H_
+#define _TXMPP_CHAINBUFFER_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+#include <vector>
+
+#include "constructormagic.h"
+#include "socket.h"
+
+namespace txmpp {
+
+// Bytes that any number of ChainBuffers, on any threads, can hold without
+// copying them, as a stanza sent to many recipients is. They are fixed once
+// made, and freed with the last reference.
+class SharedBytes {
+ public:
+  // Takes the bytes of |data|, leaving it empty, with one reference.
+  explicit SharedBytes(std::string* data);
+
+  void AddRef() const;
+  void Release() const;
+
+  const std::string& data() const { return data_; }
+
+ protected:
+  virtual ~SharedBytes();
+
+ private:
+  mutable volatile int refs_;
+  std::string data_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(SharedBytes);
+};
+
+// A queue of bytes kept as a chain of blocks, for output on its way to a
+// socket. Strings are taken in without copying their bytes, and bytes are
+// taken off the front without moving the rest, so a partial send costs
+// nothing. The blocks at the front can be sent at once with Socket::SendV.
+// Not thread safe.
+class ChainBuffer {
+ public:
+  ChainBuffer();
+  ~ChainBuffer();
+
+  size_t Length() const { return length_; }
+  bool IsEmpty() const { return length_ == 0; }
+
+  // Copies |len| bytes onto the end.
+  void Append(const char* data, size_t len);
+  // Takes the bytes of |str| onto the end, leaving it empty. Short strings
+  // are copied onto the last block instead.
+  void AppendString(std::string* str);
+  // Moves the blocks of |other| onto the end, leaving it empty.
+  void Append(ChainBuffer* other);
+  // Puts |len| bytes of |shared| from |offset| on the end as a block of
+  // their own, holding a reference to |shared| until they are consumed.
+  void AppendShared(const SharedBytes* shared, size_t offset, size_t len);
+
+  // The number of blocks, and the bytes of the block at |index|, from the
+  // front.
+  size_t BlockCount() const { return blocks_.size() - front_; }
+  IoVec Block(size_t index) const;
+  // Fills in up to |count| of the blocks at the front, and returns how many.
+  size_t Peek(IoVec* vec, size_t count) const;
+
+  // Drops |len| bytes from the front.
+  void Consume(size_t len);
+  void Clear() { Consume(length_); }
+
+  void Swap(ChainBuffer* other);
+
+  // Frees the chunk kept for reuse, and the block list while it is empty,
+  // as for a connection gone idle. Returns the bytes freed.
+  size_t Trim();
+
+ private:
+  // A block of its own bytes, in |data|, or of a part of |shared|'s, which
+  // ends at |end|.
+  struct Chunk {
+    std::string data;
+    size_t start;  // bytes before this are consumed
+    const SharedBytes* shared;
+    size_t end;
+
+    const char* Bytes() const {
+      return shared ? shared->data().data() : data.data();
+    }
+    size_t End() const { return shared ? end : data.size(); }
+  };
+
+  // Strings shorter than this are copied by AppendString.
+  static const size_t kCopyLimit = 256;
+  // A drained chunk is kept for reuse if its string is no larger than this.
+  static const size_t kSpareLimit = 64 * 1024;
+
+  Chunk* NewChunk();
+  // The last block, if bytes can be copied onto it, or NULL.
+  Chunk* Tail();
+  void FreeChunk(Chunk* chunk);
+
+  std::vector<Chunk*> blocks_;
+  size_t front_;  // blocks_ before this are drained and NULL
+  size_t length_;
+  Chunk* spare_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(ChainBuffer);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_CHAINBUFFER_H_
@@ -48,6 +48,11 @@ const std::string & Constants::ns_server() {
   return ns_server_;
 }
 
+const std::string & Constants::ns_component_accept() {
+  static const std::string ns_component_accept_("jabber:component:accept");
+  return ns_component_accept_;
+}
+
 const std::string & Constants::ns_stream() {
   static const std::string ns_stream_("http://etherx.jabber.org/streams");
   return ns_stream_;
@@ -63,6 +68,17 @@ const std::string & Constants::ns_tls() {
   return ns_tls_;
 }
 
+const std::string & Constants::ns_compress_feature() {
+  static const std::string
+      ns_compress_feature_("http://jabber.org/features/compress");
+  return ns_compress_feature_;
+}
+
+const std::string & Constants::ns_compress() {
+  static const std::string ns_compress_("http://jabber.org/protocol/compress");
+  return ns_compress_;
+}
+
 const std::string & Constants::ns_sasl() {
   static const std::string ns_sasl_("urn:ietf:params:xml:ns:xmpp-sasl");
   return ns_sasl_;
@@ -88,6 +104,11 @@ const std::string & Constants::ns_stanza() {
   return ns_stanza_;
 }
 
+const std::string & Constants::ns_sm() {
+  static const std::string ns_sm_("urn:xmpp:sm:3");
+  return ns_sm_;
+}
+
 const std::string & Constants::ns_privacy() {
   static const std::string ns_privacy_("jabber:iq:privacy");
   return ns_privacy_;
@@ -162,172 +183,229 @@ const std::string STR_UNAVAILABLE("unavailable");
 
 const std::string STR_MUC_LOOKUP_DOMAIN("lookup.groupchat.google.com");
 
-const QName QN_STREAM_STREAM(true, NS_STREAM, STR_STREAM);
-const QName QN_STREAM_FEATURES(true, NS_STREAM, "features");
-const QName QN_STREAM_ERROR(true, NS_STREAM, "error");
-
-const QName QN_XSTREAM_BAD_FORMAT(true, NS_XSTREAM, "bad-format");
-const QName QN_XSTREAM_BAD_NAMESPACE_PREFIX(true, NS_XSTREAM, "bad-namespace-prefix");
-const QName QN_XSTREAM_CONFLICT(true, NS_XSTREAM, "conflict");
-const QName QN_XSTREAM_CONNECTION_TIMEOUT(true, NS_XSTREAM, "connection-timeout");
-const QName QN_XSTREAM_HOST_GONE(true, NS_XSTREAM, "host-gone");
-const QName QN_XSTREAM_HOST_UNKNOWN(true, NS_XSTREAM, "host-unknown");
-const QName QN_XSTREAM_IMPROPER_ADDRESSIING(true, NS_XSTREAM, "improper-addressing");
-const QName QN_XSTREAM_INTERNAL_SERVER_ERROR(true, NS_XSTREAM, "internal-server-error");
-const QName QN_XSTREAM_INVALID_FROM(true, NS_XSTREAM, "invalid-from");
-const QName QN_XSTREAM_INVALID_ID(true, NS_XSTREAM, "invalid-id");
-const QName QN_XSTREAM_INVALID_NAMESPACE(true, NS_XSTREAM, "invalid-namespace");
-const QName QN_XSTREAM_INVALID_XML(true, NS_XSTREAM, "invalid-xml");
-const QName QN_XSTREAM_NOT_AUTHORIZED(true, NS_XSTREAM, "not-authorized");
-const QName QN_XSTREAM_POLICY_VIOLATION(true, NS_XSTREAM, "policy-violation");
-const QName QN_XSTREAM_REMOTE_CONNECTION_FAILED(true, NS_XSTREAM, "remote-connection-failed");
-const QName QN_XSTREAM_RESOURCE_CONSTRAINT(true, NS_XSTREAM, "resource-constraint");
-const QName QN_XSTREAM_RESTRICTED_XML(true, NS_XSTREAM, "restricted-xml");
-const QName QN_XSTREAM_SEE_OTHER_HOST(true, NS_XSTREAM, "see-other-host");
-const QName QN_XSTREAM_SYSTEM_SHUTDOWN(true, NS_XSTREAM, "system-shutdown");
-const QName QN_XSTREAM_UNDEFINED_CONDITION(true, NS_XSTREAM, "undefined-condition");
-const QName QN_XSTREAM_UNSUPPORTED_ENCODING(true, NS_XSTREAM, "unsupported-encoding");
-const QName QN_XSTREAM_UNSUPPORTED_STANZA_TYPE(true, NS_XSTREAM, "unsupported-stanza-type");
-const QName QN_XSTREAM_UNSUPPORTED_VERSION(true, NS_XSTREAM, "unsupported-version");
-const QName QN_XSTREAM_XML_NOT_WELL_FORMED(true, NS_XSTREAM, "xml-not-well-formed");
-const QName QN_XSTREAM_TEXT(true, NS_XSTREAM, "text");
-
-const QName QN_TLS_STARTTLS(true, NS_TLS, "starttls");
-const QName QN_TLS_REQUIRED(true, NS_TLS, "required");
-const QName QN_TLS_PROCEED(true, NS_TLS, "proceed");
-const QName QN_TLS_FAILURE(true, NS_TLS, "failure");
-
-const QName QN_SASL_MECHANISMS(true, NS_SASL, "mechanisms");
-const QName QN_SASL_MECHANISM(true, NS_SASL, "mechanism");
-const QName QN_SASL_AUTH(true, NS_SASL, "auth");
-const QName QN_SASL_CHALLENGE(true, NS_SASL, "challenge");
-const QName QN_SASL_RESPONSE(true, NS_SASL, "response");
-const QName QN_SASL_ABORT(true, NS_SASL, "abort");
-const QName QN_SASL_SUCCESS(true, NS_SASL, "success");
-const QName QN_SASL_FAILURE(true, NS_SASL, "failure");
-const QName QN_SASL_ABORTED(true, NS_SASL, "aborted");
-const QName QN_SASL_INCORRECT_ENCODING(true, NS_SASL, "incorrect-encoding");
-const QName QN_SASL_INVALID_AUTHZID(true, NS_SASL, "invalid-authzid");
-const QName QN_SASL_INVALID_MECHANISM(true, NS_SASL, "invalid-mechanism");
-const QName QN_SASL_MECHANISM_TOO_WEAK(true, NS_SASL, "mechanism-too-weak");
-const QName QN_SASL_NOT_AUTHORIZED(true, NS_SASL, "not-authorized");
-const QName QN_SASL_TEMPORARY_AUTH_FAILURE(true, NS_SASL, "temporary-auth-failure");
-
-const QName QN_DIALBACK_RESULT(true, NS_DIALBACK, "result");
-const QName QN_DIALBACK_VERIFY(true, NS_DIALBACK, "verify");
-
-const QName QN_STANZA_BAD_REQUEST(true, NS_STANZA, "bad-request");
-const QName QN_STANZA_CONFLICT(true, NS_STANZA, "conflict");
-const QName QN_STANZA_FEATURE_NOT_IMPLEMENTED(true, NS_STANZA, "feature-not-implemented");
-const QName QN_STANZA_FORBIDDEN(true, NS_STANZA, "forbidden");
-const QName QN_STANZA_GONE(true, NS_STANZA, "gone");
-const QName QN_STANZA_INTERNAL_SERVER_ERROR(true, NS_STANZA, "internal-server-error");
-const QName QN_STANZA_ITEM_NOT_FOUND(true, NS_STANZA, "item-not-found");
-const QName QN_STANZA_JID_MALFORMED(true, NS_STANZA, "jid-malformed");
-const QName QN_STANZA_NOT_ACCEPTABLE(true, NS_STANZA, "not-acceptable");
-const QName QN_STANZA_NOT_ALLOWED(true, NS_STANZA, "not-allowed");
-const QName QN_STANZA_PAYMENT_REQUIRED(true, NS_STANZA, "payment-required");
-const QName QN_STANZA_RECIPIENT_UNAVAILABLE(true, NS_STANZA, "recipient-unavailable");
-const QName QN_STANZA_REDIRECT(true, NS_STANZA, "redirect");
-const QName QN_STANZA_REGISTRATION_REQUIRED(true, NS_STANZA, "registration-required");
-const QName QN_STANZA_REMOTE_SERVER_NOT_FOUND(true, NS_STANZA, "remote-server-not-found");
-const QName QN_STANZA_REMOTE_SERVER_TIMEOUT(true, NS_STANZA, "remote-server-timeout");
-const QName QN_STANZA_RESOURCE_CONSTRAINT(true, NS_STANZA, "resource-constraint");
-const QName QN_STANZA_SERVICE_UNAVAILABLE(true, NS_STANZA, "service-unavailable");
-const QName QN_STANZA_SUBSCRIPTION_REQUIRED(true, NS_STANZA, "subscription-required");
-const QName QN_STANZA_UNDEFINED_CONDITION(true, NS_STANZA, "undefined-condition");
-const QName QN_STANZA_UNEXPECTED_REQUEST(true, NS_STANZA, "unexpected-request");
-const QName QN_STANZA_TEXT(true, NS_STANZA, "text");
-
-const QName QN_BIND_BIND(true, NS_BIND, "bind");
-const QName QN_BIND_RESOURCE(true, NS_BIND, "resource");
-const QName QN_BIND_JID(true, NS_BIND, "jid");
-
-const QName QN_MESSAGE(true, NS_CLIENT, "message");
-const QName QN_BODY(true, NS_CLIENT, "body");
-const QName QN_SUBJECT(true, NS_CLIENT, "subject");
-const QName QN_THREAD(true, NS_CLIENT, "thread");
-const QName QN_PRESENCE(true, NS_CLIENT, "presence");
-const QName QN_SHOW(true, NS_CLIENT, "show");
-const QName QN_STATUS(true, NS_CLIENT, "status");
-const QName QN_LANG(true, NS_CLIENT, "lang");
-const QName QN_PRIORITY(true, NS_CLIENT, "priority");
-const QName QN_IQ(true, NS_CLIENT, "iq");
-const QName QN_ERROR(true, NS_CLIENT, "error");
-
-const QName QN_SERVER_MESSAGE(true, NS_SERVER, "message");
-const QName QN_SERVER_BODY(true, NS_SERVER, "body");
-const QName QN_SERVER_SUBJECT(true, NS_SERVER, "subject");
-const QName QN_SERVER_THREAD(true, NS_SERVER, "thread");
-const QName QN_SERVER_PRESENCE(true, NS_SERVER, "presence");
-const QName QN_SERVER_SHOW(true, NS_SERVER, "show");
-const QName QN_SERVER_STATUS(true, NS_SERVER, "status");
-const QName QN_SERVER_LANG(true, NS_SERVER, "lang");
-const QName QN_SERVER_PRIORITY(true, NS_SERVER, "priority");
-const QName QN_SERVER_IQ(true, NS_SERVER, "iq");
-const QName QN_SERVER_ERROR(true, NS_SERVER, "error");
-
-const QName QN_SESSION_SESSION(true, NS_SESSION, "session");
-
-const QName QN_PRIVACY_QUERY(true, NS_PRIVACY, "query");
-const QName QN_PRIVACY_ACTIVE(true, NS_PRIVACY, "active");
-const QName QN_PRIVACY_DEFAULT(true, NS_PRIVACY, "default");
-const QName QN_PRIVACY_LIST(true, NS_PRIVACY, "list");
-const QName QN_PRIVACY_ITEM(true, NS_PRIVACY, "item");
-const QName QN_PRIVACY_IQ(true, NS_PRIVACY, "iq");
-const QName QN_PRIVACY_MESSAGE(true, NS_PRIVACY, "message");
-const QName QN_PRIVACY_PRESENCE_IN(true, NS_PRIVACY, "presence-in");
-const QName QN_PRIVACY_PRESENCE_OUT(true, NS_PRIVACY, "presence-out");
-
-const QName QN_ROSTER_QUERY(true, NS_ROSTER, "query");
-const QName QN_ROSTER_ITEM(true, NS_ROSTER, "item");
-const QName QN_ROSTER_GROUP(true, NS_ROSTER, "group");
-
-const QName QN_VCARD(true, NS_VCARD, "vCard");
-const QName QN_VCARD_FN(true, NS_VCARD, "FN");
-const QName QN_VCARD_PHOTO(true, NS_VCARD, "PHOTO");
-const QName QN_VCARD_PHOTO_BINVAL(true, NS_VCARD, "BINVAL");
-const QName QN_VCARD_AVATAR_HASH(true, NS_AVATAR_HASH, "hash");
-const QName QN_VCARD_AVATAR_HASH_MODIFIED(true, NS_AVATAR_HASH, "modified");
-
-const QName QN_NAME(true, STR_EMPTY, "name");
-const QName QN_AFFILIATION(true, STR_EMPTY, "affiliation");
-const QName QN_ROLE(true, STR_EMPTY, "role");
+// The namespaces of the names below. Each name is a statically initialized
+// record that the QName table takes in as it is, when it is first used, so
+// that none of them costs anything when the library is loaded.
+static QName::Data ns_stream_data =
+    TXMPP_QNAME_NAMESPACE("http://etherx.jabber.org/streams");
+static QName::Data ns_xstream_data =
+    TXMPP_QNAME_NAMESPACE("urn:ietf:params:xml:ns:xmpp-streams");
+static QName::Data ns_tls_data =
+    TXMPP_QNAME_NAMESPACE("urn:ietf:params:xml:ns:xmpp-tls");
+static QName::Data ns_compress_feature_data =
+    TXMPP_QNAME_NAMESPACE("http://jabber.org/features/compress");
+static QName::Data ns_compress_data =
+    TXMPP_QNAME_NAMESPACE("http://jabber.org/protocol/compress");
+static QName::Data ns_sasl_data =
+    TXMPP_QNAME_NAMESPACE("urn:ietf:params:xml:ns:xmpp-sasl");
+static QName::Data ns_dialback_data =
+    TXMPP_QNAME_NAMESPACE("jabber:server:dialback");
+static QName::Data ns_stanza_data =
+    TXMPP_QNAME_NAMESPACE("urn:ietf:params:xml:ns:xmpp-stanzas");
+static QName::Data ns_bind_data =
+    TXMPP_QNAME_NAMESPACE("urn:ietf:params:xml:ns:xmpp-bind");
+static QName::Data ns_client_data = TXMPP_QNAME_NAMESPACE("jabber:client");
+static QName::Data ns_server_data = TXMPP_QNAME_NAMESPACE("jabber:server");
+static QName::Data ns_session_data =
+    TXMPP_QNAME_NAMESPACE("urn:ietf:params:xml:ns:xmpp-session");
+static QName::Data ns_sm_data = TXMPP_QNAME_NAMESPACE("urn:xmpp:sm:3");
+static QName::Data ns_privacy_data = TXMPP_QNAME_NAMESPACE("jabber:iq:privacy");
+static QName::Data ns_roster_data = TXMPP_QNAME_NAMESPACE("jabber:iq:roster");
+static QName::Data ns_vcard_data = TXMPP_QNAME_NAMESPACE("vcard-temp");
+static QName::Data ns_avatar_hash_data = TXMPP_QNAME_NAMESPACE("google:avatar");
+static QName::Data ns_xml_data =
+    TXMPP_QNAME_NAMESPACE("http://www.w3.org/XML/1998/namespace");
+static QName::Data ns_xmlns_data =
+    TXMPP_QNAME_NAMESPACE("http://www.w3.org/2000/xmlns/");
+
+TXMPP_DEFINE_QNAME(QN_STREAM_STREAM, ns_stream_data, "stream");
+TXMPP_DEFINE_QNAME(QN_STREAM_FEATURES, ns_stream_data, "features");
+TXMPP_DEFINE_QNAME(QN_STREAM_ERROR, ns_stream_data, "error");
+
+TXMPP_DEFINE_QNAME(QN_XSTREAM_BAD_FORMAT, ns_xstream_data, "bad-format");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_BAD_NAMESPACE_PREFIX, ns_xstream_data, "bad-namespace-prefix");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_CONFLICT, ns_xstream_data, "conflict");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_CONNECTION_TIMEOUT, ns_xstream_data, "connection-timeout");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_HOST_GONE, ns_xstream_data, "host-gone");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_HOST_UNKNOWN, ns_xstream_data, "host-unknown");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_IMPROPER_ADDRESSIING, ns_xstream_data, "improper-addressing");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_INTERNAL_SERVER_ERROR, ns_xstream_data, "internal-server-error");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_INVALID_FROM, ns_xstream_data, "invalid-from");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_INVALID_ID, ns_xstream_data, "invalid-id");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_INVALID_NAMESPACE, ns_xstream_data, "invalid-namespace");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_INVALID_XML, ns_xstream_data, "invalid-xml");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_NOT_AUTHORIZED, ns_xstream_data, "not-authorized");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_POLICY_VIOLATION, ns_xstream_data, "policy-violation");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_REMOTE_CONNECTION_FAILED, ns_xstream_data, "remote-connection-failed");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_RESOURCE_CONSTRAINT, ns_xstream_data, "resource-constraint");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_RESTRICTED_XML, ns_xstream_data, "restricted-xml");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_SEE_OTHER_HOST, ns_xstream_data, "see-other-host");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_SYSTEM_SHUTDOWN, ns_xstream_data, "system-shutdown");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_UNDEFINED_CONDITION, ns_xstream_data, "undefined-condition");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_UNSUPPORTED_ENCODING, ns_xstream_data, "unsupported-encoding");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_UNSUPPORTED_STANZA_TYPE, ns_xstream_data, "unsupported-stanza-type");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_UNSUPPORTED_VERSION, ns_xstream_data, "unsupported-version");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_XML_NOT_WELL_FORMED, ns_xstream_data, "xml-not-well-formed");
+TXMPP_DEFINE_QNAME(QN_XSTREAM_TEXT, ns_xstream_data, "text");
+
+TXMPP_DEFINE_QNAME(QN_TLS_STARTTLS, ns_tls_data, "starttls");
+TXMPP_DEFINE_QNAME(QN_TLS_REQUIRED, ns_tls_data, "required");
+TXMPP_DEFINE_QNAME(QN_TLS_PROCEED, ns_tls_data, "proceed");
+TXMPP_DEFINE_QNAME(QN_TLS_FAILURE, ns_tls_data, "failure");
+
+TXMPP_DEFINE_QNAME(QN_COMPRESS_FEATURE_COMPRESSION, ns_compress_feature_data, "compression");
+TXMPP_DEFINE_QNAME(QN_COMPRESS_FEATURE_METHOD, ns_compress_feature_data, "method");
+TXMPP_DEFINE_QNAME(QN_COMPRESS_COMPRESS, ns_compress_data, "compress");
+TXMPP_DEFINE_QNAME(QN_COMPRESS_METHOD, ns_compress_data, "method");
+TXMPP_DEFINE_QNAME(QN_COMPRESS_COMPRESSED, ns_compress_data, "compressed");
+TXMPP_DEFINE_QNAME(QN_COMPRESS_FAILURE, ns_compress_data, "failure");
+
+TXMPP_DEFINE_QNAME(QN_SASL_MECHANISMS, ns_sasl_data, "mechanisms");
+TXMPP_DEFINE_QNAME(QN_SASL_MECHANISM, ns_sasl_data, "mechanism");
+TXMPP_DEFINE_QNAME(QN_SASL_AUTH, ns_sasl_data, "auth");
+TXMPP_DEFINE_QNAME(QN_SASL_CHALLENGE, ns_sasl_data, "challenge");
+TXMPP_DEFINE_QNAME(QN_SASL_RESPONSE, ns_sasl_data, "response");
+TXMPP_DEFINE_QNAME(QN_SASL_ABORT, ns_sasl_data, "abort");
+TXMPP_DEFINE_QNAME(QN_SASL_SUCCESS, ns_sasl_data, "success");
+TXMPP_DEFINE_QNAME(QN_SASL_FAILURE, ns_sasl_data, "failure");
+TXMPP_DEFINE_QNAME(QN_SASL_ABORTED, ns_sasl_data, "aborted");
+TXMPP_DEFINE_QNAME(QN_SASL_INCORRECT_ENCODING, ns_sasl_data, "incorrect-encoding");
+TXMPP_DEFINE_QNAME(QN_SASL_INVALID_AUTHZID, ns_sasl_data, "invalid-authzid");
+TXMPP_DEFINE_QNAME(QN_SASL_INVALID_MECHANISM, ns_sasl_data, "invalid-mechanism");
+TXMPP_DEFINE_QNAME(QN_SASL_MECHANISM_TOO_WEAK, ns_sasl_data, "mechanism-too-weak");
+TXMPP_DEFINE_QNAME(QN_SASL_NOT_AUTHORIZED, ns_sasl_data, "not-authorized");
+TXMPP_DEFINE_QNAME(QN_SASL_TEMPORARY_AUTH_FAILURE, ns_sasl_data, "temporary-auth-failure");
+
+TXMPP_DEFINE_QNAME(QN_DIALBACK_RESULT, ns_dialback_data, "result");
+TXMPP_DEFINE_QNAME(QN_DIALBACK_VERIFY, ns_dialback_data, "verify");
+
+TXMPP_DEFINE_QNAME(QN_STANZA_BAD_REQUEST, ns_stanza_data, "bad-request");
+TXMPP_DEFINE_QNAME(QN_STANZA_CONFLICT, ns_stanza_data, "conflict");
+TXMPP_DEFINE_QNAME(QN_STANZA_FEATURE_NOT_IMPLEMENTED, ns_stanza_data, "feature-not-implemented");
+TXMPP_DEFINE_QNAME(QN_STANZA_FORBIDDEN, ns_stanza_data, "forbidden");
+TXMPP_DEFINE_QNAME(QN_STANZA_GONE, ns_stanza_data, "gone");
+TXMPP_DEFINE_QNAME(QN_STANZA_INTERNAL_SERVER_ERROR, ns_stanza_data, "internal-server-error");
+TXMPP_DEFINE_QNAME(QN_STANZA_ITEM_NOT_FOUND, ns_stanza_data, "item-not-found");
+TXMPP_DEFINE_QNAME(QN_STANZA_JID_MALFORMED, ns_stanza_data, "jid-malformed");
+TXMPP_DEFINE_QNAME(QN_STANZA_NOT_ACCEPTABLE, ns_stanza_data, "not-acceptable");
+TXMPP_DEFINE_QNAME(QN_STANZA_NOT_ALLOWED, ns_stanza_data, "not-allowed");
+TXMPP_DEFINE_QNAME(QN_STANZA_PAYMENT_REQUIRED, ns_stanza_data, "payment-required");
+TXMPP_DEFINE_QNAME(QN_STANZA_RECIPIENT_UNAVAILABLE, ns_stanza_data, "recipient-unavailable");
+TXMPP_DEFINE_QNAME(QN_STANZA_REDIRECT, ns_stanza_data, "redirect");
+TXMPP_DEFINE_QNAME(QN_STANZA_REGISTRATION_REQUIRED, ns_stanza_data, "registration-required");
+TXMPP_DEFINE_QNAME(QN_STANZA_REMOTE_SERVER_NOT_FOUND, ns_stanza_data, "remote-server-not-found");
+TXMPP_DEFINE_QNAME(QN_STANZA_REMOTE_SERVER_TIMEOUT, ns_stanza_data, "remote-server-timeout");
+TXMPP_DEFINE_QNAME(QN_STANZA_RESOURCE_CONSTRAINT, ns_stanza_data, "resource-constraint");
+TXMPP_DEFINE_QNAME(QN_STANZA_SERVICE_UNAVAILABLE, ns_stanza_data, "service-unavailable");
+TXMPP_DEFINE_QNAME(QN_STANZA_SUBSCRIPTION_REQUIRED, ns_stanza_data, "subscription-required");
+TXMPP_DEFINE_QNAME(QN_STANZA_UNDEFINED_CONDITION, ns_stanza_data, "undefined-condition");
+TXMPP_DEFINE_QNAME(QN_STANZA_UNEXPECTED_REQUEST, ns_stanza_data, "unexpected-request");
+TXMPP_DEFINE_QNAME(QN_STANZA_TEXT, ns_stanza_data, "text");
+
+TXMPP_DEFINE_QNAME(QN_BIND_BIND, ns_bind_data, "bind");
+TXMPP_DEFINE_QNAME(QN_BIND_RESOURCE, ns_bind_data, "resource");
+TXMPP_DEFINE_QNAME(QN_BIND_JID, ns_bind_data, "jid");
+
+TXMPP_DEFINE_QNAME(QN_MESSAGE, ns_client_data, "message");
+TXMPP_DEFINE_QNAME(QN_BODY, ns_client_data, "body");
+TXMPP_DEFINE_QNAME(QN_SUBJECT, ns_client_data, "subject");
+TXMPP_DEFINE_QNAME(QN_THREAD, ns_client_data, "thread");
+TXMPP_DEFINE_QNAME(QN_PRESENCE, ns_client_data, "presence");
+TXMPP_DEFINE_QNAME(QN_SHOW, ns_client_data, "show");
+TXMPP_DEFINE_QNAME(QN_STATUS, ns_client_data, "status");
+TXMPP_DEFINE_QNAME(QN_LANG, ns_client_data, "lang");
+TXMPP_DEFINE_QNAME(QN_PRIORITY, ns_client_data, "priority");
+TXMPP_DEFINE_QNAME(QN_IQ, ns_client_data, "iq");
+TXMPP_DEFINE_QNAME(QN_ERROR, ns_client_data, "error");
+
+TXMPP_DEFINE_QNAME(QN_COMPONENT_HANDSHAKE, ns_client_data, "handshake");
+
+TXMPP_DEFINE_QNAME(QN_SERVER_MESSAGE, ns_server_data, "message");
+TXMPP_DEFINE_QNAME(QN_SERVER_BODY, ns_server_data, "body");
+TXMPP_DEFINE_QNAME(QN_SERVER_SUBJECT, ns_server_data, "subject");
+TXMPP_DEFINE_QNAME(QN_SERVER_THREAD, ns_server_data, "thread");
+TXMPP_DEFINE_QNAME(QN_SERVER_PRESENCE, ns_server_data, "presence");
+TXMPP_DEFINE_QNAME(QN_SERVER_SHOW, ns_server_data, "show");
+TXMPP_DEFINE_QNAME(QN_SERVER_STATUS, ns_server_data, "status");
+TXMPP_DEFINE_QNAME(QN_SERVER_LANG, ns_server_data, "lang");
+TXMPP_DEFINE_QNAME(QN_SERVER_PRIORITY, ns_server_data, "priority");
+TXMPP_DEFINE_QNAME(QN_SERVER_IQ, ns_server_data, "iq");
+TXMPP_DEFINE_QNAME(QN_SERVER_ERROR, ns_server_data, "error");
+
+TXMPP_DEFINE_QNAME(QN_SESSION_SESSION, ns_session_data, "session");
+TXMPP_DEFINE_QNAME(QN_SESSION_OPTIONAL, ns_session_data, "optional");
+
+TXMPP_DEFINE_QNAME(QN_SM_SM, ns_sm_data, "sm");
+TXMPP_DEFINE_QNAME(QN_SM_ENABLE, ns_sm_data, "enable");
+TXMPP_DEFINE_QNAME(QN_SM_ENABLED, ns_sm_data, "enabled");
+TXMPP_DEFINE_QNAME(QN_SM_RESUME, ns_sm_data, "resume");
+TXMPP_DEFINE_QNAME(QN_SM_RESUMED, ns_sm_data, "resumed");
+TXMPP_DEFINE_QNAME(QN_SM_FAILED, ns_sm_data, "failed");
+TXMPP_DEFINE_QNAME(QN_SM_R, ns_sm_data, "r");
+TXMPP_DEFINE_QNAME(QN_SM_A, ns_sm_data, "a");
+
+TXMPP_DEFINE_QNAME(QN_PRIVACY_QUERY, ns_privacy_data, "query");
+TXMPP_DEFINE_QNAME(QN_PRIVACY_ACTIVE, ns_privacy_data, "active");
+TXMPP_DEFINE_QNAME(QN_PRIVACY_DEFAULT, ns_privacy_data, "default");
+TXMPP_DEFINE_QNAME(QN_PRIVACY_LIST, ns_privacy_data, "list");
+TXMPP_DEFINE_QNAME(QN_PRIVACY_ITEM, ns_privacy_data, "item");
+TXMPP_DEFINE_QNAME(QN_PRIVACY_IQ, ns_privacy_data, "iq");
+TXMPP_DEFINE_QNAME(QN_PRIVACY_MESSAGE, ns_privacy_data, "message");
+TXMPP_DEFINE_QNAME(QN_PRIVACY_PRESENCE_IN, ns_privacy_data, "presence-in");
+TXMPP_DEFINE_QNAME(QN_PRIVACY_PRESENCE_OUT, ns_privacy_data, "presence-out");
+
+TXMPP_DEFINE_QNAME(QN_ROSTER_QUERY, ns_roster_data, "query");
+TXMPP_DEFINE_QNAME(QN_ROSTER_ITEM, ns_roster_data, "item");
+TXMPP_DEFINE_QNAME(QN_ROSTER_GROUP, ns_roster_data, "group");
+
+TXMPP_DEFINE_QNAME(QN_VCARD, ns_vcard_data, "vCard");
+TXMPP_DEFINE_QNAME(QN_VCARD_FN, ns_vcard_data, "FN");
+TXMPP_DEFINE_QNAME(QN_VCARD_PHOTO, ns_vcard_data, "PHOTO");
+TXMPP_DEFINE_QNAME(QN_VCARD_PHOTO_BINVAL, ns_vcard_data, "BINVAL");
+TXMPP_DEFINE_QNAME(QN_VCARD_AVATAR_HASH, ns_avatar_hash_data, "hash");
+TXMPP_DEFINE_QNAME(QN_VCARD_AVATAR_HASH_MODIFIED, ns_avatar_hash_data, "modified");
+
+TXMPP_DEFINE_LOCAL_QNAME(QN_NAME, "name");
+TXMPP_DEFINE_LOCAL_QNAME(QN_AFFILIATION, "affiliation");
+TXMPP_DEFINE_LOCAL_QNAME(QN_ROLE, "role");
+TXMPP_DEFINE_LOCAL_QNAME(QN_H, "h");
+TXMPP_DEFINE_LOCAL_QNAME(QN_PREVID, "previd");
+TXMPP_DEFINE_LOCAL_QNAME(QN_RESUME, "resume");
 
 #if defined(FEATURE_ENABLE_PSTN)
-const QName QN_VCARD_TEL(true, NS_VCARD, "TEL");
-const QName QN_VCARD_VOICE(true, NS_VCARD, "VOICE");
-const QName QN_VCARD_HOME(true, NS_VCARD, "HOME");
-const QName QN_VCARD_WORK(true, NS_VCARD, "WORK");
-const QName QN_VCARD_CELL(true, NS_VCARD, "CELL");
-const QName QN_VCARD_NUMBER(true, NS_VCARD, "NUMBER");
+TXMPP_DEFINE_QNAME(QN_VCARD_TEL, ns_vcard_data, "TEL");
+TXMPP_DEFINE_QNAME(QN_VCARD_VOICE, ns_vcard_data, "VOICE");
+TXMPP_DEFINE_QNAME(QN_VCARD_HOME, ns_vcard_data, "HOME");
+TXMPP_DEFINE_QNAME(QN_VCARD_WORK, ns_vcard_data, "WORK");
+TXMPP_DEFINE_QNAME(QN_VCARD_CELL, ns_vcard_data, "CELL");
+TXMPP_DEFINE_QNAME(QN_VCARD_NUMBER, ns_vcard_data, "NUMBER");
 #endif
 
-const QName QN_XML_LANG(true, NS_XML, "lang");
-
-const QName QN_ENCODING(true, STR_EMPTY, STR_ENCODING);
-const QName QN_VERSION(true, STR_EMPTY, STR_VERSION);
-const QName QN_TO(true, STR_EMPTY, "to");
-const QName QN_FROM(true, STR_EMPTY, "from");
-const QName QN_TYPE(true, STR_EMPTY, "type");
-const QName QN_ID(true, STR_EMPTY, "id");
-const QName QN_CODE(true, STR_EMPTY, "code");
-
-const QName QN_VALUE(true, STR_EMPTY, "value");
-const QName QN_ACTION(true, STR_EMPTY, "action");
-const QName QN_ORDER(true, STR_EMPTY, "order");
-const QName QN_MECHANISM(true, STR_EMPTY, "mechanism");
-const QName QN_ASK(true, STR_EMPTY, "ask");
-const QName QN_JID(true, STR_EMPTY, "jid");
-const QName QN_NICK(true, STR_EMPTY, "nick");
-const QName QN_SUBSCRIPTION(true, STR_EMPTY, "subscription");
-const QName QN_TITLE1(true, STR_EMPTY, "title1");
-const QName QN_TITLE2(true, STR_EMPTY, "title2");
-const QName QN_SOURCE(true, STR_EMPTY, "source");
-
-const QName QN_XMLNS_CLIENT(true, NS_XMLNS, STR_CLIENT);
-const QName QN_XMLNS_SERVER(true, NS_XMLNS, STR_SERVER);
-const QName QN_XMLNS_STREAM(true, NS_XMLNS, STR_STREAM);
+TXMPP_DEFINE_QNAME(QN_XML_LANG, ns_xml_data, "lang");
+
+TXMPP_DEFINE_LOCAL_QNAME(QN_ENCODING, "encoding");
+TXMPP_DEFINE_LOCAL_QNAME(QN_VERSION, "version");
+TXMPP_DEFINE_LOCAL_QNAME(QN_TO, "to");
+TXMPP_DEFINE_LOCAL_QNAME(QN_FROM, "from");
+TXMPP_DEFINE_LOCAL_QNAME(QN_TYPE, "type");
+TXMPP_DEFINE_LOCAL_QNAME(QN_ID, "id");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CODE, "code");
+
+TXMPP_DEFINE_LOCAL_QNAME(QN_VALUE, "value");
+TXMPP_DEFINE_LOCAL_QNAME(QN_ACTION, "action");
+TXMPP_DEFINE_LOCAL_QNAME(QN_ORDER, "order");
+TXMPP_DEFINE_LOCAL_QNAME(QN_MECHANISM, "mechanism");
+TXMPP_DEFINE_LOCAL_QNAME(QN_ASK, "ask");
+TXMPP_DEFINE_LOCAL_QNAME(QN_JID, "jid");
+TXMPP_DEFINE_LOCAL_QNAME(QN_NICK, "nick");
+TXMPP_DEFINE_LOCAL_QNAME(QN_SUBSCRIPTION, "subscription");
+TXMPP_DEFINE_LOCAL_QNAME(QN_TITLE1, "title1");
+TXMPP_DEFINE_LOCAL_QNAME(QN_TITLE2, "title2");
+TXMPP_DEFINE_LOCAL_QNAME(QN_SOURCE, "source");
+
+TXMPP_DEFINE_QNAME(QN_XMLNS_CLIENT, ns_xmlns_data, "client");
+TXMPP_DEFINE_QNAME(QN_XMLNS_SERVER, ns_xmlns_data, "server");
+TXMPP_DEFINE_QNAME(QN_XMLNS_STREAM, ns_xmlns_data, "stream");
 
 
 // Presence
@@ -345,163 +423,213 @@ const std::string STR_UNSUBSCRIBED("unsubscribed");
 
 // Google Invite
 const std::string NS_GOOGLE_INVITE("google:subscribe");
-const QName QN_INVITATION(true, NS_GOOGLE_INVITE, "invitation");
-const QName QN_INVITE_NAME(true, NS_GOOGLE_INVITE, "name");
-const QName QN_INVITE_SUBJECT(true, NS_GOOGLE_INVITE, "subject");
-const QName QN_INVITE_MESSAGE(true, NS_GOOGLE_INVITE, "body");
+static QName::Data ns_google_invite_data =
+    TXMPP_QNAME_NAMESPACE("google:subscribe");
+TXMPP_DEFINE_QNAME(QN_INVITATION, ns_google_invite_data, "invitation");
+TXMPP_DEFINE_QNAME(QN_INVITE_NAME, ns_google_invite_data, "name");
+TXMPP_DEFINE_QNAME(QN_INVITE_SUBJECT, ns_google_invite_data, "subject");
+TXMPP_DEFINE_QNAME(QN_INVITE_MESSAGE, ns_google_invite_data, "body");
 
 // PubSub: http://xmpp.org/extensions/xep-0060.html
 const std::string NS_PUBSUB("http://jabber.org/protocol/pubsub");
-const QName QN_PUBSUB(true, NS_PUBSUB, "pubsub");
-const QName QN_PUBSUB_ITEMS(true, NS_PUBSUB, "items");
-const QName QN_PUBSUB_ITEM(true, NS_PUBSUB, "item");
+static QName::Data ns_pubsub_data =
+    TXMPP_QNAME_NAMESPACE("http://jabber.org/protocol/pubsub");
+TXMPP_DEFINE_QNAME(QN_PUBSUB, ns_pubsub_data, "pubsub");
+TXMPP_DEFINE_QNAME(QN_PUBSUB_ITEMS, ns_pubsub_data, "items");
+TXMPP_DEFINE_QNAME(QN_PUBSUB_ITEM, ns_pubsub_data, "item");
 
 const std::string NS_PUBSUB_EVENT("http://jabber.org/protocol/pubsub#event");
-const QName QN_NODE(true, STR_EMPTY, "node");
-const QName QN_PUBSUB_EVENT(true, NS_PUBSUB_EVENT, "event");
-const QName QN_PUBSUB_EVENT_ITEMS(true, NS_PUBSUB_EVENT, "items");
-const QName QN_PUBSUB_EVENT_ITEM(true, NS_PUBSUB_EVENT, "item");
-const QName QN_PUBSUB_EVENT_RETRACT(true, NS_PUBSUB_EVENT, "retract");
+static QName::Data ns_pubsub_event_data =
+    TXMPP_QNAME_NAMESPACE("http://jabber.org/protocol/pubsub#event");
+TXMPP_DEFINE_LOCAL_QNAME(QN_NODE, "node");
+TXMPP_DEFINE_QNAME(QN_PUBSUB_EVENT, ns_pubsub_event_data, "event");
+TXMPP_DEFINE_QNAME(QN_PUBSUB_EVENT_ITEMS, ns_pubsub_event_data, "items");
+TXMPP_DEFINE_QNAME(QN_PUBSUB_EVENT_ITEM, ns_pubsub_event_data, "item");
+TXMPP_DEFINE_QNAME(QN_PUBSUB_EVENT_RETRACT, ns_pubsub_event_data, "retract");
 
 
 
 
 // JEP 0030
-const QName QN_CATEGORY(true, STR_EMPTY, "category");
-const QName QN_VAR(true, STR_EMPTY, "var");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CATEGORY, "category");
+TXMPP_DEFINE_LOCAL_QNAME(QN_VAR, "var");
 const std::string NS_DISCO_INFO("http://jabber.org/protocol/disco#info");
+static QName::Data ns_disco_info_data =
+    TXMPP_QNAME_NAMESPACE("http://jabber.org/protocol/disco#info");
 const std::string NS_DISCO_ITEMS("http://jabber.org/protocol/disco#items");
-const QName QN_DISCO_INFO_QUERY(true, NS_DISCO_INFO, "query");
-const QName QN_DISCO_IDENTITY(true, NS_DISCO_INFO, "identity");
-const QName QN_DISCO_FEATURE(true, NS_DISCO_INFO, "feature");
+static QName::Data ns_disco_items_data =
+    TXMPP_QNAME_NAMESPACE("http://jabber.org/protocol/disco#items");
+TXMPP_DEFINE_QNAME(QN_DISCO_INFO_QUERY, ns_disco_info_data, "query");
+TXMPP_DEFINE_QNAME(QN_DISCO_IDENTITY, ns_disco_info_data, "identity");
+TXMPP_DEFINE_QNAME(QN_DISCO_FEATURE, ns_disco_info_data, "feature");
 
-const QName QN_DISCO_ITEMS_QUERY(true, NS_DISCO_ITEMS, "query");
-const QName QN_DISCO_ITEM(true, NS_DISCO_ITEMS, "item");
+TXMPP_DEFINE_QNAME(QN_DISCO_ITEMS_QUERY, ns_disco_items_data, "query");
+TXMPP_DEFINE_QNAME(QN_DISCO_ITEM, ns_disco_items_data, "item");
 
 
 // JEP 0045
 const std::string NS_MUC("http://jabber.org/protocol/muc");
-const QName QN_MUC_X(true, NS_MUC, "x");
-const QName QN_MUC_ITEM(true, NS_MUC, "item");
-const QName QN_MUC_AFFILIATION(true, NS_MUC, "affiliation");
-const QName QN_MUC_ROLE(true, NS_MUC, "role");
+static QName::Data ns_muc_data =
+    TXMPP_QNAME_NAMESPACE("http://jabber.org/protocol/muc");
+TXMPP_DEFINE_QNAME(QN_MUC_X, ns_muc_data, "x");
+TXMPP_DEFINE_QNAME(QN_MUC_ITEM, ns_muc_data, "item");
+TXMPP_DEFINE_QNAME(QN_MUC_AFFILIATION, ns_muc_data, "affiliation");
+TXMPP_DEFINE_QNAME(QN_MUC_ROLE, ns_muc_data, "role");
 const std::string STR_AFFILIATION_NONE("none");
 const std::string STR_ROLE_PARTICIPANT("participant");
 
 const std::string NS_MUC_OWNER("http://jabber.org/protocol/muc#owner");
-const QName QN_MUC_OWNER_QUERY(true, NS_MUC_OWNER, "query");
+static QName::Data ns_muc_owner_data =
+    TXMPP_QNAME_NAMESPACE("http://jabber.org/protocol/muc#owner");
+TXMPP_DEFINE_QNAME(QN_MUC_OWNER_QUERY, ns_muc_owner_data, "query");
 
 const std::string NS_MUC_USER("http://jabber.org/protocol/muc#user");
-const QName QN_MUC_USER_CONTINUE(true, NS_MUC_USER, "continue");
-const QName QN_MUC_USER_X(true, NS_MUC_USER, "x");
-const QName QN_MUC_USER_ITEM(true, NS_MUC_USER, "item");
-const QName QN_MUC_USER_STATUS(true, NS_MUC_USER, "status");
+static QName::Data ns_muc_user_data =
+    TXMPP_QNAME_NAMESPACE("http://jabber.org/protocol/muc#user");
+TXMPP_DEFINE_QNAME(QN_MUC_USER_CONTINUE, ns_muc_user_data, "continue");
+TXMPP_DEFINE_QNAME(QN_MUC_USER_X, ns_muc_user_data, "x");
+TXMPP_DEFINE_QNAME(QN_MUC_USER_ITEM, ns_muc_user_data, "item");
+TXMPP_DEFINE_QNAME(QN_MUC_USER_STATUS, ns_muc_user_data, "status");
 
 
 // JEP 0055 - Jabber Search
 const std::string NS_SEARCH("jabber:iq:search");
-const QName QN_SEARCH_QUERY(true, NS_SEARCH, "query");
-const QName QN_SEARCH_ITEM(true, NS_SEARCH, "item");
-const QName QN_SEARCH_ROOM_NAME(true, NS_SEARCH, "room-name");
-const QName QN_SEARCH_ORGANIZERS_DOMAIN(true, NS_SEARCH, "organizers-domain");
-const QName QN_SEARCH_ROOM_JID(true, NS_SEARCH, "room-jid");
+static QName::Data ns_search_data = TXMPP_QNAME_NAMESPACE("jabber:iq:search");
+TXMPP_DEFINE_QNAME(QN_SEARCH_QUERY, ns_search_data, "query");
+TXMPP_DEFINE_QNAME(QN_SEARCH_ITEM, ns_search_data, "item");
+TXMPP_DEFINE_QNAME(QN_SEARCH_ROOM_NAME, ns_search_data, "room-name");
+TXMPP_DEFINE_QNAME(QN_SEARCH_ORGANIZERS_DOMAIN, ns_search_data, "organizers-domain");
+TXMPP_DEFINE_QNAME(QN_SEARCH_ROOM_JID, ns_search_data, "room-jid");
 
 
 // JEP 0115
 const std::string NS_CAPS("http://jabber.org/protocol/caps");
-const QName QN_CAPS_C(true, NS_CAPS, "c");
-const QName QN_VER(true, STR_EMPTY, "ver");
-const QName QN_EXT(true, STR_EMPTY, "ext");
+static QName::Data ns_caps_data =
+    TXMPP_QNAME_NAMESPACE("http://jabber.org/protocol/caps");
+TXMPP_DEFINE_QNAME(QN_CAPS_C, ns_caps_data, "c");
+TXMPP_DEFINE_LOCAL_QNAME(QN_VER, "ver");
+TXMPP_DEFINE_LOCAL_QNAME(QN_EXT, "ext");
 
 // JEP 0153
 const std::string kNSVCard("vcard-temp:x:update");
-const QName kQnVCardX(true, kNSVCard, "x");
-const QName kQnVCardPhoto(true, kNSVCard, "photo");
+static QName::Data ns_vcard_update_data =
+    TXMPP_QNAME_NAMESPACE("vcard-temp:x:update");
+TXMPP_DEFINE_QNAME(kQnVCardX, ns_vcard_update_data, "x");
+TXMPP_DEFINE_QNAME(kQnVCardPhoto, ns_vcard_update_data, "photo");
 
 // JEP 0172 User Nickname
 const std::string kNSNickname("http://jabber.org/protocol/nick");
-const QName kQnNickname(true, kNSNickname, "nick");
+static QName::Data ns_nickname_data =
+    TXMPP_QNAME_NAMESPACE("http://jabber.org/protocol/nick");
+TXMPP_DEFINE_QNAME(kQnNickname, ns_nickname_data, "nick");
 
 
 // JEP 0085 chat state
 const std::string NS_CHATSTATE("http://jabber.org/protocol/chatstates");
-const QName QN_CS_ACTIVE(true, NS_CHATSTATE, "active");
-const QName QN_CS_COMPOSING(true, NS_CHATSTATE, "composing");
-const QName QN_CS_PAUSED(true, NS_CHATSTATE, "paused");
-const QName QN_CS_INACTIVE(true, NS_CHATSTATE, "inactive");
-const QName QN_CS_GONE(true, NS_CHATSTATE, "gone");
+static QName::Data ns_chatstate_data =
+    TXMPP_QNAME_NAMESPACE("http://jabber.org/protocol/chatstates");
+TXMPP_DEFINE_QNAME(QN_CS_ACTIVE, ns_chatstate_data, "active");
+TXMPP_DEFINE_QNAME(QN_CS_COMPOSING, ns_chatstate_data, "composing");
+TXMPP_DEFINE_QNAME(QN_CS_PAUSED, ns_chatstate_data, "paused");
+TXMPP_DEFINE_QNAME(QN_CS_INACTIVE, ns_chatstate_data, "inactive");
+TXMPP_DEFINE_QNAME(QN_CS_GONE, ns_chatstate_data, "gone");
 
 // JEP 0091 Delayed Delivery
 const std::string kNSDelay("jabber:x:delay");
-const QName kQnDelayX(true, kNSDelay, "x");
-const QName kQnStamp(true, STR_EMPTY, "stamp");
+static QName::Data ns_delay_data = TXMPP_QNAME_NAMESPACE("jabber:x:delay");
+TXMPP_DEFINE_QNAME(kQnDelayX, ns_delay_data, "x");
+TXMPP_DEFINE_LOCAL_QNAME(kQnStamp, "stamp");
 
 // Google time stamping (higher resolution)
 const std::string kNSTimestamp("google:timestamp");
-const QName kQnTime(true, kNSTimestamp, "time");
-const QName kQnMilliseconds(true, STR_EMPTY, "ms");
+static QName::Data ns_timestamp_data =
+    TXMPP_QNAME_NAMESPACE("google:timestamp");
+TXMPP_DEFINE_QNAME(kQnTime, ns_timestamp_data, "time");
+TXMPP_DEFINE_LOCAL_QNAME(kQnMilliseconds, "ms");
 
 
 // Event tracking
 #ifdef FEATURE_ENABLE_TRACKING
 const std::string NS_GOOGLE_EVENT_TRACKING("google:client-usability-testing");
-const QName QN_EVENT_TRACKING(true, NS_GOOGLE_EVENT_TRACKING, "usage-stats");
-const QName QN_EVENT_TRACKING_BRANDID(true, NS_GOOGLE_EVENT_TRACKING, "bid");
-const QName QN_EVENT_TRACKING_EVENT(true, NS_GOOGLE_EVENT_TRACKING, "event");
-const QName QN_EVENT_TRACKING_VARIABLE_KEY(true, STR_EMPTY, "key");
-const QName QN_EVENT_TRACKING_VARIABLE_VALUE(true, STR_EMPTY, "value");
-const QName QN_EVENT_TRACKING_VARIABLE_TIME(true, STR_EMPTY, "time");
-const QName QN_EVENT_TRACKING_EVENT_GROUP(true,
-                                          NS_GOOGLE_EVENT_TRACKING, "events");
+static QName::Data ns_google_event_tracking_data =
+    TXMPP_QNAME_NAMESPACE("google:client-usability-testing");
+TXMPP_DEFINE_QNAME(QN_EVENT_TRACKING, ns_google_event_tracking_data, "usage-stats");
+TXMPP_DEFINE_QNAME(QN_EVENT_TRACKING_BRANDID, ns_google_event_tracking_data, "bid");
+TXMPP_DEFINE_QNAME(QN_EVENT_TRACKING_EVENT, ns_google_event_tracking_data, "event");
+TXMPP_DEFINE_LOCAL_QNAME(QN_EVENT_TRACKING_VARIABLE_KEY, "key");
+const QName QN_EVENT_TRACKING_VARIABLE_VALUE(QN_VALUE);
+TXMPP_DEFINE_LOCAL_QNAME(QN_EVENT_TRACKING_VARIABLE_TIME, "time");
+TXMPP_DEFINE_QNAME(QN_EVENT_TRACKING_EVENT_GROUP, ns_google_event_tracking_data, "events");
 #endif
 
 
 // Jingle Info
 const std::string NS_JINGLE_INFO("google:jingleinfo");
-const QName QN_JINGLE_INFO_QUERY(true, NS_JINGLE_INFO, "query");
-const QName QN_JINGLE_INFO_STUN(true, NS_JINGLE_INFO, "stun");
-const QName QN_JINGLE_INFO_RELAY(true, NS_JINGLE_INFO, "relay");
-const QName QN_JINGLE_INFO_SERVER(true, NS_JINGLE_INFO, "server");
-const QName QN_JINGLE_INFO_TOKEN(true, NS_JINGLE_INFO, "token");
-const QName QN_JINGLE_INFO_HOST(true, STR_EMPTY, "host");
-const QName QN_JINGLE_INFO_TCP(true, STR_EMPTY, "tcp");
-const QName QN_JINGLE_INFO_UDP(true, STR_EMPTY, "udp");
-const QName QN_JINGLE_INFO_TCPSSL(true, STR_EMPTY, "tcpssl");
+static QName::Data ns_jingle_info_data =
+    TXMPP_QNAME_NAMESPACE("google:jingleinfo");
+TXMPP_DEFINE_QNAME(QN_JINGLE_INFO_QUERY, ns_jingle_info_data, "query");
+TXMPP_DEFINE_QNAME(QN_JINGLE_INFO_STUN, ns_jingle_info_data, "stun");
+TXMPP_DEFINE_QNAME(QN_JINGLE_INFO_RELAY, ns_jingle_info_data, "relay");
+TXMPP_DEFINE_QNAME(QN_JINGLE_INFO_SERVER, ns_jingle_info_data, "server");
+TXMPP_DEFINE_QNAME(QN_JINGLE_INFO_TOKEN, ns_jingle_info_data, "token");
+TXMPP_DEFINE_LOCAL_QNAME(QN_JINGLE_INFO_HOST, "host");
+TXMPP_DEFINE_LOCAL_QNAME(QN_JINGLE_INFO_TCP, "tcp");
+TXMPP_DEFINE_LOCAL_QNAME(QN_JINGLE_INFO_UDP, "udp");
+TXMPP_DEFINE_LOCAL_QNAME(QN_JINGLE_INFO_TCPSSL, "tcpssl");
 
 // Call Performance Logging
 const std::string NS_GOOGLE_CALLPERF_STATS("google:call-perf-stats");
-const QName QN_CALLPERF_STATS(true, NS_GOOGLE_CALLPERF_STATS, "callPerfStats");
-const QName QN_CALLPERF_SESSIONID(true, STR_EMPTY, "sessionId");
-const QName QN_CALLPERF_LOCALUSER(true, STR_EMPTY, "localUser");
-const QName QN_CALLPERF_REMOTEUSER(true, STR_EMPTY, "remoteUser");
-const QName QN_CALLPERF_STARTTIME(true, STR_EMPTY, "startTime");
-const QName QN_CALLPERF_CALL_LENGTH(true, STR_EMPTY, "callLength");
-const QName QN_CALLPERF_DATAPOINT(true, NS_GOOGLE_CALLPERF_STATS, "dataPoint");
-const QName QN_CALLPERF_DATAPOINT_TIME(true, STR_EMPTY, "timeStamp");
-const QName QN_CALLPERF_DATAPOINT_FRACTION_LOST(true, STR_EMPTY, "fraction_lost");
-const QName QN_CALLPERF_DATAPOINT_CUM_LOST(true, STR_EMPTY, "cum_lost");
-const QName QN_CALLPERF_DATAPOINT_EXT_MAX(true, STR_EMPTY, "ext_max");
-const QName QN_CALLPERF_DATAPOINT_JITTER(true, STR_EMPTY, "jitter");
-const QName QN_CALLPERF_DATAPOINT_RTT(true, STR_EMPTY, "RTT");
-const QName QN_CALLPERF_DATAPOINT_BYTES_R(true, STR_EMPTY, "bytesReceived");
-const QName QN_CALLPERF_DATAPOINT_PACKETS_R(true, STR_EMPTY, "packetsReceived");
-const QName QN_CALLPERF_DATAPOINT_BYTES_S(true, STR_EMPTY, "bytesSent");
-const QName QN_CALLPERF_DATAPOINT_PACKETS_S(true, STR_EMPTY, "packetsSent");
-const QName QN_CALLPERF_CONNECTION(true, NS_GOOGLE_CALLPERF_STATS, "connection");
-const QName QN_CALLPERF_CONNECTION_LOCAL_ADDRESS(true, STR_EMPTY, "localAddress");
-const QName QN_CALLPERF_CONNECTION_REMOTE_ADDRESS(true, STR_EMPTY, "remoteAddress");
+static QName::Data ns_google_callperf_stats_data =
+    TXMPP_QNAME_NAMESPACE("google:call-perf-stats");
+TXMPP_DEFINE_QNAME(QN_CALLPERF_STATS, ns_google_callperf_stats_data, "callPerfStats");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_SESSIONID, "sessionId");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_LOCALUSER, "localUser");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_REMOTEUSER, "remoteUser");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_STARTTIME, "startTime");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_CALL_LENGTH, "callLength");
+TXMPP_DEFINE_QNAME(QN_CALLPERF_DATAPOINT, ns_google_callperf_stats_data, "dataPoint");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_DATAPOINT_TIME, "timeStamp");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_DATAPOINT_FRACTION_LOST, "fraction_lost");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_DATAPOINT_CUM_LOST, "cum_lost");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_DATAPOINT_EXT_MAX, "ext_max");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_DATAPOINT_JITTER, "jitter");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_DATAPOINT_RTT, "RTT");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_DATAPOINT_BYTES_R, "bytesReceived");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_DATAPOINT_PACKETS_R, "packetsReceived");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_DATAPOINT_BYTES_S, "bytesSent");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_DATAPOINT_PACKETS_S, "packetsSent");
+TXMPP_DEFINE_QNAME(QN_CALLPERF_CONNECTION, ns_google_callperf_stats_data, "connection");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_CONNECTION_LOCAL_ADDRESS, "localAddress");
+TXMPP_DEFINE_LOCAL_QNAME(QN_CALLPERF_CONNECTION_REMOTE_ADDRESS, "remoteAddress");
 
 // Muc invites.
-const QName QN_MUC_USER_INVITE(true, NS_MUC_USER, "invite");
+TXMPP_DEFINE_QNAME(QN_MUC_USER_INVITE, ns_muc_user_data, "invite");
 
 // Multiway audio/video.
 const std::string NS_GOOGLE_MUC_USER("google:muc#user");
-const QName QN_GOOGLE_MUC_USER_AVAILABLE_MEDIA(true, NS_GOOGLE_MUC_USER, "available-media");
-const QName QN_GOOGLE_MUC_USER_ENTRY(true, NS_GOOGLE_MUC_USER, "entry");
-const QName QN_GOOGLE_MUC_USER_MEDIA(true, NS_GOOGLE_MUC_USER, "media");
-const QName QN_GOOGLE_MUC_USER_TYPE(true, NS_GOOGLE_MUC_USER, "type");
-const QName QN_GOOGLE_MUC_USER_SRC_ID(true, NS_GOOGLE_MUC_USER, "src-id");
-const QName QN_GOOGLE_MUC_USER_STATUS(true, NS_GOOGLE_MUC_USER, "status");
-const QName QN_LABEL(true, STR_EMPTY, "label");
+static QName::Data ns_google_muc_user_data =
+    TXMPP_QNAME_NAMESPACE("google:muc#user");
+TXMPP_DEFINE_QNAME(QN_GOOGLE_MUC_USER_AVAILABLE_MEDIA, ns_google_muc_user_data, "available-media");
+TXMPP_DEFINE_QNAME(QN_GOOGLE_MUC_USER_ENTRY, ns_google_muc_user_data, "entry");
+TXMPP_DEFINE_QNAME(QN_GOOGLE_MUC_USER_MEDIA, ns_google_muc_user_data, "media");
+TXMPP_DEFINE_QNAME(QN_GOOGLE_MUC_USER_TYPE, ns_google_muc_user_data, "type");
+TXMPP_DEFINE_QNAME(QN_GOOGLE_MUC_USER_SRC_ID, ns_google_muc_user_data, "src-id");
+TXMPP_DEFINE_QNAME(QN_GOOGLE_MUC_USER_STATUS, ns_google_muc_user_data, "status");
+TXMPP_DEFINE_LOCAL_QNAME(QN_LABEL, "label");
+
+const std::string NS_PING("urn:xmpp:ping");
+static QName::Data ns_ping_data = TXMPP_QNAME_NAMESPACE("urn:xmpp:ping");
+TXMPP_DEFINE_QNAME(QN_PING, ns_ping_data, "ping");
+
+const std::string NS_IBB("http://jabber.org/protocol/ibb");
+static QName::Data ns_ibb_data =
+    TXMPP_QNAME_NAMESPACE("http://jabber.org/protocol/ibb");
+TXMPP_DEFINE_QNAME(QN_IBB_OPEN, ns_ibb_data, "open");
+TXMPP_DEFINE_QNAME(QN_IBB_DATA, ns_ibb_data, "data");
+TXMPP_DEFINE_QNAME(QN_IBB_CLOSE, ns_ibb_data, "close");
+TXMPP_DEFINE_LOCAL_QNAME(QN_IBB_SID, "sid");
+TXMPP_DEFINE_LOCAL_QNAME(QN_IBB_SEQ, "seq");
+TXMPP_DEFINE_LOCAL_QNAME(QN_IBB_BLOCK_SIZE, "block-size");
+TXMPP_DEFINE_LOCAL_QNAME(QN_IBB_STANZA, "stanza");
 
 }  // namespace txmpp
@@ -38,14 +38,18 @@
 
 #define NS_CLIENT Constants::ns_client()
 #define NS_SERVER Constants::ns_server()
+#define NS_COMPONENT_ACCEPT Constants::ns_component_accept()
 #define NS_STREAM Constants::ns_stream()
 #define NS_XSTREAM Constants::ns_xstream()
 #define NS_TLS Constants::ns_tls()
+#define NS_COMPRESS_FEATURE Constants::ns_compress_feature()
+#define NS_COMPRESS Constants::ns_compress()
 #define NS_SASL Constants::ns_sasl()
 #define NS_BIND Constants::ns_bind()
 #define NS_DIALBACK Constants::ns_dialback()
 #define NS_SESSION Constants::ns_session()
 #define NS_STANZA Constants::ns_stanza()
+#define NS_SM Constants::ns_sm()
 #define NS_PRIVACY Constants::ns_privacy()
 #define NS_ROSTER Constants::ns_roster()
 #define NS_VCARD Constants::ns_vcard()
@@ -64,14 +68,18 @@ class Constants {
  public:
   static const std::string & ns_client();
   static const std::string & ns_server();
+  static const std::string & ns_component_accept();
   static const std::string & ns_stream();
   static const std::string & ns_xstream();
   static const std::string & ns_tls();
+  static const std::string & ns_compress_feature();
+  static const std::string & ns_compress();
   static const std::string & ns_sasl();
   static const std::string & ns_bind();
   static const std::string & ns_dialback();
   static const std::string & ns_session();
   static const std::string & ns_stanza();
+  static const std::string & ns_sm();
   static const std::string & ns_privacy();
   static const std::string & ns_roster();
   static const std::string & ns_vcard();
@@ -152,6 +160,13 @@ extern const QName QN_TLS_REQUIRED;
 extern const QName QN_TLS_PROCEED;
 extern const QName QN_TLS_FAILURE;
 
+extern const QName QN_COMPRESS_FEATURE_COMPRESSION;
+extern const QName QN_COMPRESS_FEATURE_METHOD;
+extern const QName QN_COMPRESS_COMPRESS;
+extern const QName QN_COMPRESS_METHOD;
+extern const QName QN_COMPRESS_COMPRESSED;
+extern const QName QN_COMPRESS_FAILURE;
+
 extern const QName QN_SASL_MECHANISMS;
 extern const QName QN_SASL_MECHANISM;
 extern const QName QN_SASL_AUTH;
@@ -210,6 +225,10 @@ extern const QName QN_PRIORITY;
 extern const QName QN_IQ;
 extern const QName QN_ERROR;
 
+// A component stream's stanzas are read as jabber:client, so its
+// handshake is too.
+extern const QName QN_COMPONENT_HANDSHAKE;
+
 extern const QName QN_SERVER_MESSAGE;
 extern const QName QN_SERVER_BODY;
 extern const QName QN_SERVER_SUBJECT;
@@ -223,6 +242,16 @@ extern const QName QN_SERVER_IQ;
 extern const QName QN_SERVER_ERROR;
 
 extern const QName QN_SESSION_SESSION;
+extern const QName QN_SESSION_OPTIONAL;
+
+extern const QName QN_SM_SM;
+extern const QName QN_SM_ENABLE;
+extern const QName QN_SM_ENABLED;
+extern const QName QN_SM_RESUME;
+extern const QName QN_SM_RESUMED;
+extern const QName QN_SM_FAILED;
+extern const QName QN_SM_R;
+extern const QName QN_SM_A;
 
 extern const QName QN_PRIVACY_QUERY;
 extern const QName QN_PRIVACY_ACTIVE;
@@ -290,6 +319,9 @@ extern const QName QN_TITLE1;
 extern const QName QN_TITLE2;
 extern const QName QN_AFFILIATION;
 extern const QName QN_ROLE;
+extern const QName QN_H;
+extern const QName QN_PREVID;
+extern const QName QN_RESUME;
 
 
 extern const QName QN_XMLNS_CLIENT;
@@ -456,6 +488,20 @@ extern const QName QN_GOOGLE_MUC_USER_SRC_ID;
 extern const QName QN_GOOGLE_MUC_USER_STATUS;
 extern const QName QN_LABEL;
 
+// XEP-0199 pings.
+extern const std::string NS_PING;
+extern const QName QN_PING;
+
+// XEP-0047 in-band bytestreams.
+extern const std::string NS_IBB;
+extern const QName QN_IBB_OPEN;
+extern const QName QN_IBB_DATA;
+extern const QName QN_IBB_CLOSE;
+extern const QName QN_IBB_SID;
+extern const QName QN_IBB_SEQ;
+extern const QName QN_IBB_BLOCK_SIZE;
+extern const QName QN_IBB_STANZA;
+
 }  // namespace txmpp
 
 #endif  // TXMPP_CONSTANTS_H_
@@ -55,5 +55,14 @@
   TypeName();                                    \
   DISALLOW_EVIL_CONSTRUCTORS(TypeName)
 
+// Defined when the compiler has rvalue references, for the move
+// constructors and assignments of the value types.  Each only stands in
+// for a copy or a Swap, so the tree still builds as C++98 without them.
+// They are noexcept, so that std::vector moves rather than copies when it
+// grows.
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+#define TXMPP_HAS_MOVE 1
+#endif
+
 
 #endif  // _TXMPP_CONSTRUCTORMAGIC_H_
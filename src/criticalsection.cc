@@ -0,0 +1,163 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "criticalsection.h"
+
+#include <algorithm>
+
+#include "common.h"
+#include "time.h"
+
+namespace txmpp {
+
+struct LockCounters {
+  const char* name;
+  volatile uint64 acquisitions;
+  volatile uint64 contended;
+  volatile uint64 wait_us;
+};
+
+static volatile int g_record_lock_stats = 0;
+
+// Guards the counters of the named sections alive.  A spin lock, as none
+// of the sections can be used to count themselves and it is rarely taken.
+static volatile int g_registry_lock = 0;
+
+static std::vector<LockCounters*>& CriticalSection_Registry() {
+  static std::vector<LockCounters*>* registry =
+      new std::vector<LockCounters*>;
+  return *registry;
+}
+
+// Tells the processor we are spinning, which lets a hyperthread sibling,
+// maybe the holder, run.
+static void CriticalSection_Pause() {
+#ifdef WIN32
+  YieldProcessor();
+#elif defined(__i386__) || defined(__x86_64__)
+  __asm__ __volatile__("pause" ::: "memory");
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield" ::: "memory");
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static void CriticalSection_LockRegistry() {
+  while (AtomicOps::Exchange(&g_registry_lock, 1) != 0)
+    CriticalSection_Pause();
+}
+
+static void CriticalSection_UnlockRegistry() {
+  AtomicOps::Exchange(&g_registry_lock, 0);
+}
+
+void CriticalSection::EnterContended() {
+  // As glibc's adaptive mutexes do, spin up to twice what it took lately,
+  // and move the estimate an eighth of the way to what it took now.
+  int spin = AtomicOps::RelaxedLoad(&spin_);
+  int limit = _min(2 * spin + 10, static_cast<int>(kMaxSpin));
+  for (int spins = 0; spins < limit; ++spins) {
+    CriticalSection_Pause();
+    if (TryEnter()) {
+      AtomicOps::RelaxedStore(&spin_, spin + (spins - spin) / 8);
+      if (counters_)
+        RecordEnter(true, 0);
+      return;
+    }
+  }
+  AtomicOps::RelaxedStore(&spin_, spin + (limit - spin) / 8);
+  if (counters_ && AtomicOps::RelaxedLoad(&g_record_lock_stats)) {
+    uint64 start = TimeMicros();
+    Block();
+    RecordEnter(true, TimeMicros() - start);
+  } else {
+    Block();
+  }
+}
+
+void CriticalSection::RecordEnter(bool contended, uint64 wait_us) {
+  if (!AtomicOps::RelaxedLoad(&g_record_lock_stats))
+    return;
+  // The section is held, but these may be read meanwhile.
+  AtomicOps::Add(&counters_->acquisitions, 1);
+  if (contended) {
+    AtomicOps::Add(&counters_->contended, 1);
+    if (wait_us)
+      AtomicOps::Add(&counters_->wait_us, wait_us);
+  }
+}
+
+void CriticalSection::SetName(const char* name) {
+  CriticalSection_LockRegistry();
+  if (!counters_) {
+    LockCounters* counters = new LockCounters;
+    counters->acquisitions = 0;
+    counters->contended = 0;
+    counters->wait_us = 0;
+    CriticalSection_Registry().push_back(counters);
+    counters_ = counters;
+  }
+  counters_->name = name;
+  CriticalSection_UnlockRegistry();
+}
+
+void CriticalSection::DeleteCounters() {
+  CriticalSection_LockRegistry();
+  std::vector<LockCounters*>& registry = CriticalSection_Registry();
+  std::vector<LockCounters*>::iterator it =
+      std::find(registry.begin(), registry.end(), counters_);
+  ASSERT(it != registry.end());
+  // Order doesn't matter, so fill the hole with the last one.
+  *it = registry.back();
+  registry.pop_back();
+  CriticalSection_UnlockRegistry();
+  delete counters_;
+  counters_ = NULL;
+}
+
+void CriticalSection::RecordLockStats(bool on) {
+  AtomicOps::RelaxedStore(&g_record_lock_stats, on ? 1 : 0);
+}
+
+void CriticalSection::GetLockStats(std::vector<LockStats>* stats) {
+  stats->clear();
+  CriticalSection_LockRegistry();
+  std::vector<LockCounters*>& registry = CriticalSection_Registry();
+  stats->reserve(registry.size());
+  for (size_t i = 0; i < registry.size(); ++i) {
+    LockStats s;
+    s.name = registry[i]->name;
+    s.acquisitions = AtomicOps::AcquireLoad(&registry[i]->acquisitions);
+    s.contended = AtomicOps::AcquireLoad(&registry[i]->contended);
+    s.wait_us = AtomicOps::AcquireLoad(&registry[i]->wait_us);
+    stats->push_back(s);
+  }
+  CriticalSection_UnlockRegistry();
+}
+
+}  // namespace txmpp
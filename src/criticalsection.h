@@ -32,6 +32,10 @@
 #include "config.h"
 #endif
 
+#include <vector>
+
+#include "basictypes.h"
+
 #ifdef WIN32
 #include "win32.h"
 #endif
@@ -52,19 +56,40 @@
 
 namespace txmpp {
 
+// The acquisitions of a named CriticalSection while lock stats are on: all
+// of them, those that found it held, and the microseconds these waited
+// once done spinning.
+struct LockStats {
+  const char* name;
+  uint64 acquisitions;
+  uint64 contended;
+  uint64 wait_us;
+};
+
+struct LockCounters;
+
+// A CriticalSection found held spins for a while, as its holder is likely
+// to be about to leave, before it blocks.  How long adapts to how long the
+// spinning took to succeed before, up to kMaxSpin.
+
 #ifdef WIN32
 class CriticalSection {
 public:
-  CriticalSection() {
+  CriticalSection() : counters_(NULL), spin_(0) {
     InitializeCriticalSection(&crit_);
     // Windows docs say 0 is not a valid thread id
     TRACK_OWNER(thread_ = 0);
   }
   ~CriticalSection() {
+    if (counters_)
+      DeleteCounters();
     DeleteCriticalSection(&crit_);
   }
   void Enter() {
-    EnterCriticalSection(&crit_);
+    if (!TryEnterCriticalSection(&crit_))
+      EnterContended();
+    else if (counters_)
+      RecordEnter(false, 0);
     TRACK_OWNER(thread_ = GetCurrentThreadId());
   }
   void Leave() {
@@ -76,16 +101,36 @@ public:
   bool CurrentThreadIsOwner() const { return thread_ == GetCurrentThreadId(); }
 #endif  // CS_TRACK_OWNER
 
+  // Gives the section a name to record its LockStats under.  |name| must
+  // live forever.
+  void SetName(const char* name);
+
+  // Turns the recording of LockStats for the named sections on or off.
+  // Off by default.
+  static void RecordLockStats(bool on);
+  // Fills in |stats| for each named section alive.
+  static void GetLockStats(std::vector<LockStats>* stats);
+
 private:
+  enum { kMaxSpin = 100 };
+
+  bool TryEnter() { return TryEnterCriticalSection(&crit_) != 0; }
+  void Block() { EnterCriticalSection(&crit_); }
+  void EnterContended();
+  void RecordEnter(bool contended, uint64 wait_us);
+  void DeleteCounters();
+
   CRITICAL_SECTION crit_;
   TRACK_OWNER(DWORD thread_);  // The section's owning thread id
+  LockCounters* counters_;
+  volatile int spin_;
 };
 #endif // WIN32
 
 #ifdef POSIX
 class CriticalSection {
 public:
-  CriticalSection() {
+  CriticalSection() : counters_(NULL), spin_(0) {
     pthread_mutexattr_t mutex_attribute;
     pthread_mutexattr_init(&mutex_attribute);
     pthread_mutexattr_settype(&mutex_attribute, PTHREAD_MUTEX_RECURSIVE);
@@ -94,10 +139,15 @@ public:
     TRACK_OWNER(thread_ = 0);
   }
   ~CriticalSection() {
+    if (counters_)
+      DeleteCounters();
     pthread_mutex_destroy(&mutex_);
   }
   void Enter() {
-    pthread_mutex_lock(&mutex_);
+    if (pthread_mutex_trylock(&mutex_) != 0)
+      EnterContended();
+    else if (counters_)
+      RecordEnter(false, 0);
     TRACK_OWNER(thread_ = pthread_self());
   }
   void Leave() {
@@ -109,9 +159,29 @@ public:
   bool CurrentThreadIsOwner() const { return pthread_equal(thread_, pthread_self()); }
 #endif  // CS_TRACK_OWNER
 
+  // Gives the section a name to record its LockStats under.  |name| must
+  // live forever.
+  void SetName(const char* name);
+
+  // Turns the recording of LockStats for the named sections on or off.
+  // Off by default.
+  static void RecordLockStats(bool on);
+  // Fills in |stats| for each named section alive.
+  static void GetLockStats(std::vector<LockStats>* stats);
+
 private:
+  enum { kMaxSpin = 100 };
+
+  bool TryEnter() { return pthread_mutex_trylock(&mutex_) == 0; }
+  void Block() { pthread_mutex_lock(&mutex_); }
+  void EnterContended();
+  void RecordEnter(bool contended, uint64 wait_us);
+  void DeleteCounters();
+
   pthread_mutex_t mutex_;
   TRACK_OWNER(pthread_t thread_);
+  LockCounters* counters_;
+  volatile int spin_;
 };
 #endif // POSIX
 
@@ -130,6 +200,151 @@ private:
   CriticalSection *pcrit_;
 };
 
+// Lock-free primitives for the few hot paths that avoid a CriticalSection.
+// Loads have acquire and stores release semantics; the read-modify-write
+// operations are full barriers.
+
+class AtomicOps {
+ public:
+#ifdef WIN32
+  static int Increment(volatile int* i) {
+    return ::InterlockedIncrement(reinterpret_cast<volatile LONG*>(i));
+  }
+  static int Decrement(volatile int* i) {
+    return ::InterlockedDecrement(reinterpret_cast<volatile LONG*>(i));
+  }
+  static int AcquireLoad(volatile const int* i) {
+    return *i;
+  }
+  static uint32 AcquireLoad(volatile const uint32* i) {
+    return *i;
+  }
+  // For flags read on every call whose changes need not be seen at once.
+  static int RelaxedLoad(volatile const int* i) {
+    return *i;
+  }
+  static void RelaxedStore(volatile int* i, int value) {
+    *i = value;
+  }
+  static void ReleaseStore(volatile uint32* i, uint32 value) {
+    *i = value;
+  }
+  static int Exchange(volatile int* i, int value) {
+    return ::InterlockedExchange(reinterpret_cast<volatile LONG*>(i), value);
+  }
+  static bool CompareAndSwap(volatile int* i, int old_value, int new_value) {
+    return ::InterlockedCompareExchange(reinterpret_cast<volatile LONG*>(i),
+                                        new_value, old_value) == old_value;
+  }
+  // Orders the stores before it against the loads after it.
+  static void Fence() {
+    ::MemoryBarrier();
+  }
+  static uint64 AcquireLoad(volatile const uint64* i) {
+    return static_cast<uint64>(::InterlockedCompareExchange64(
+        reinterpret_cast<volatile LONGLONG*>(const_cast<uint64*>(i)), 0, 0));
+  }
+  static bool CompareAndSwap(volatile uint64* i, uint64 old_value,
+                             uint64 new_value) {
+    return static_cast<uint64>(::InterlockedCompareExchange64(
+        reinterpret_cast<volatile LONGLONG*>(i), new_value, old_value))
+        == old_value;
+  }
+  static void Or(volatile uint64* i, uint64 bits) {
+    uint64 old_value = AcquireLoad(i);
+    while (!CompareAndSwap(i, old_value, old_value | bits))
+      old_value = AcquireLoad(i);
+  }
+  static uint64 Exchange(volatile uint64* i, uint64 value) {
+    uint64 old_value = AcquireLoad(i);
+    while (!CompareAndSwap(i, old_value, value))
+      old_value = AcquireLoad(i);
+    return old_value;
+  }
+  static void Add(volatile uint64* i, uint64 value) {
+    uint64 old_value = AcquireLoad(i);
+    while (!CompareAndSwap(i, old_value, old_value + value))
+      old_value = AcquireLoad(i);
+  }
+  template <class T>
+  static T* AcquireLoadPtr(T* volatile const* p) {
+    return *p;
+  }
+  template <class T>
+  static void ReleaseStorePtr(T* volatile* p, T* value) {
+    *p = value;
+  }
+  template <class T>
+  static T* ExchangePtr(T* volatile* p, T* value) {
+    return static_cast<T*>(::InterlockedExchangePointer(
+        reinterpret_cast<PVOID volatile*>(p), value));
+  }
+#else
+  static int Increment(volatile int* i) {
+    return __atomic_add_fetch(i, 1, __ATOMIC_SEQ_CST);
+  }
+  static int Decrement(volatile int* i) {
+    return __atomic_sub_fetch(i, 1, __ATOMIC_SEQ_CST);
+  }
+  static int AcquireLoad(volatile const int* i) {
+    return __atomic_load_n(i, __ATOMIC_ACQUIRE);
+  }
+  static uint32 AcquireLoad(volatile const uint32* i) {
+    return __atomic_load_n(i, __ATOMIC_ACQUIRE);
+  }
+  // For flags read on every call whose changes need not be seen at once.
+  static int RelaxedLoad(volatile const int* i) {
+    return __atomic_load_n(i, __ATOMIC_RELAXED);
+  }
+  static void RelaxedStore(volatile int* i, int value) {
+    __atomic_store_n(i, value, __ATOMIC_RELAXED);
+  }
+  static void ReleaseStore(volatile uint32* i, uint32 value) {
+    __atomic_store_n(i, value, __ATOMIC_RELEASE);
+  }
+  static int Exchange(volatile int* i, int value) {
+    return __atomic_exchange_n(i, value, __ATOMIC_SEQ_CST);
+  }
+  static bool CompareAndSwap(volatile int* i, int old_value, int new_value) {
+    return __atomic_compare_exchange_n(i, &old_value, new_value, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  }
+  // Orders the stores before it against the loads after it.
+  static void Fence() {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+  static uint64 AcquireLoad(volatile const uint64* i) {
+    return __atomic_load_n(i, __ATOMIC_ACQUIRE);
+  }
+  static bool CompareAndSwap(volatile uint64* i, uint64 old_value,
+                             uint64 new_value) {
+    return __atomic_compare_exchange_n(i, &old_value, new_value, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  }
+  static void Or(volatile uint64* i, uint64 bits) {
+    __atomic_fetch_or(i, bits, __ATOMIC_SEQ_CST);
+  }
+  static uint64 Exchange(volatile uint64* i, uint64 value) {
+    return __atomic_exchange_n(i, value, __ATOMIC_SEQ_CST);
+  }
+  static void Add(volatile uint64* i, uint64 value) {
+    __atomic_add_fetch(i, value, __ATOMIC_SEQ_CST);
+  }
+  template <class T>
+  static T* AcquireLoadPtr(T* volatile const* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+  }
+  template <class T>
+  static void ReleaseStorePtr(T* volatile* p, T* value) {
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+  }
+  template <class T>
+  static T* ExchangePtr(T* volatile* p, T* value) {
+    return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+  }
+#endif
+};
+
 }  // namespace txmpp
 
 #endif  // _TXMPP_CRITICALSECTION_H_
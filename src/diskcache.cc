@@ -27,18 +27,28 @@
 
 #include "diskcache.h"
 
+#include <string.h>
 #include <time.h>
 
+#include <algorithm>
+#include <vector>
+#include <zlib.h>
+
 #ifdef WIN32
 #include "win32.h"
 #endif
 
+#ifdef POSIX
+#include <unistd.h>
+#endif
+
 #include "common.h"
 #include "fileutils.h"
 #include "pathutils.h"
 #include "stream.h"
 #include "stringencode.h"
 #include "stringutils.h"
+#include "thread.h"
 
 #ifdef _DEBUG
 #define TRANSPARENT_CACHE_NAMES 1
@@ -65,21 +75,478 @@ public:
     cache_->ReleaseResource(id_, index_);
   }
 
+  // The cached bytes are passed on as they are, so the stream's own fast
+  // path can be used.
+  virtual StreamResult TransferTo(StreamInterface* sink, size_t* transferred,
+                                  int* error) {
+    return stream()->TransferTo(sink, transferred, error);
+  }
+
 private:
   const DiskCache* cache_;
   std::string id_;
   size_t index_;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// DiskCacheMemoryStream - Reads a stream kept in memory by the cache.
+///////////////////////////////////////////////////////////////////////////////
+
+class DiskCacheMemoryStream : public ExternalMemoryStream {
+public:
+  DiskCacheMemoryStream(const void* data, size_t length)
+  : ExternalMemoryStream(const_cast<void*>(data), length)
+  { }
+
+  // The memory is shared with the cache.
+  virtual StreamResult Write(const void* data, size_t data_len,
+                             size_t* written, int* error) {
+    if (error)
+      *error = -1;
+    return SR_ERROR;
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// DiskCacheCodecStream - A stream whose bytes are those of the stream under it
+// deflated or inflated, so that nothing about their size or position is
+// passed through.
+///////////////////////////////////////////////////////////////////////////////
+
+class DiskCacheCodecStream : public StreamAdapterInterface {
+public:
+  explicit DiskCacheCodecStream(StreamInterface* stream)
+  : StreamAdapterInterface(stream), initialized_(false), finished_(false)
+  {
+    memset(&zstream_, 0, sizeof(zstream_));
+  }
+
+  virtual bool SetPosition(size_t position) { return false; }
+  virtual bool GetPosition(size_t* position) const { return false; }
+  virtual bool GetSize(size_t* size) const { return false; }
+  virtual bool GetAvailable(size_t* size) const { return false; }
+  virtual bool GetWriteRemaining(size_t* size) const { return false; }
+  virtual bool ReserveSize(size_t size) { return true; }
+
+protected:
+  // Compressed bytes are moved through a buffer of this size.
+  static const size_t kBufferSize = 16 * 1024;
+
+  bool initialized_;
+  bool finished_;
+  z_stream zstream_;
+  char buffer_[kBufferSize];
+};
+
+const size_t DiskCacheCodecStream::kBufferSize;
+
+///////////////////////////////////////////////////////////////////////////////
+// DiskCacheDeflateStream - Compresses what is written to a cache file.  The
+// compressed bytes are followed by the length of the stream uncompressed, so
+// that a reader can tell it without inflating them all.
+///////////////////////////////////////////////////////////////////////////////
+
+class DiskCacheDeflateStream : public DiskCacheCodecStream {
+public:
+  DiskCacheDeflateStream(StreamInterface* stream, int level)
+  : DiskCacheCodecStream(stream)
+  {
+    initialized_ = (Z_OK == deflateInit(&zstream_, level));
+    if (!initialized_)
+      LOG_F(LS_ERROR) << "deflateInit failed";
+  }
+  virtual ~DiskCacheDeflateStream() {
+    Close();
+    if (initialized_)
+      deflateEnd(&zstream_);
+  }
+
+  virtual StreamResult Write(const void* data, size_t data_len,
+                             size_t* written, int* error) {
+    if (!initialized_ || finished_) {
+      if (error)
+        *error = -1;
+      return SR_ERROR;
+    }
+    zstream_.next_in = static_cast<Bytef*>(const_cast<void*>(data));
+    zstream_.avail_in = static_cast<uInt>(data_len);
+    StreamResult result = Deflate(Z_NO_FLUSH, error);
+    if ((SR_SUCCESS == result) && written)
+      *written = data_len;
+    return result;
+  }
+
+  // Ends the compressed bytes, and writes the length after them.
+  virtual void Close() {
+    if (initialized_ && !finished_) {
+      finished_ = true;
+      zstream_.avail_in = 0;
+      uint64 length = zstream_.total_in;
+      if ((SR_SUCCESS != Deflate(Z_FINISH, NULL))
+          || (SR_SUCCESS != stream()->WriteAll(&length, sizeof(length), NULL,
+                                               NULL)))
+        LOG_F(LS_ERROR) << "Couldn't finish compressed cache stream";
+    }
+    DiskCacheCodecStream::Close();
+  }
+
+private:
+  StreamResult Deflate(int flush, int* error) {
+    for (;;) {
+      zstream_.next_out = reinterpret_cast<Bytef*>(buffer_);
+      zstream_.avail_out = static_cast<uInt>(kBufferSize);
+      int status = deflate(&zstream_, flush);
+      if ((Z_OK != status) && (Z_STREAM_END != status)
+          && (Z_BUF_ERROR != status)) {
+        LOG_F(LS_ERROR) << "deflate failed: " << status;
+        if (error)
+          *error = status;
+        return SR_ERROR;
+      }
+      size_t length = kBufferSize - zstream_.avail_out;
+      if (length > 0) {
+        StreamResult result = stream()->WriteAll(buffer_, length, NULL,
+                                                 error);
+        if (SR_SUCCESS != result)
+          return result;
+      }
+      // With room left over, deflate has taken all it was given, and with
+      // Z_FINISH it has ended the stream.
+      if ((Z_FINISH == flush) ? (Z_STREAM_END == status)
+                              : (0 != zstream_.avail_out))
+        return SR_SUCCESS;
+    }
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// DiskCacheInflateStream - Reads a stream that DiskCacheDeflateStream wrote,
+// inflating it as it goes.
+///////////////////////////////////////////////////////////////////////////////
+
+class DiskCacheInflateStream : public DiskCacheCodecStream {
+public:
+  explicit DiskCacheInflateStream(StreamInterface* stream)
+  : DiskCacheCodecStream(stream), length_(0), compressed_left_(0),
+    output_begin_(0), output_end_(0)
+  { }
+  virtual ~DiskCacheInflateStream() {
+    if (initialized_)
+      inflateEnd(&zstream_);
+  }
+
+  // Reads the length from the end of the stream under.  Returns false if it
+  // isn't there, or zlib couldn't be set up.
+  bool Open() {
+    size_t size = 0;
+    if (!stream()->GetSize(&size) || (size < sizeof(length_))
+        || !stream()->SetPosition(size - sizeof(length_))
+        || (SR_SUCCESS != stream()->ReadAll(&length_, sizeof(length_), NULL,
+                                            NULL))
+        || !stream()->SetPosition(0))
+      return false;
+    compressed_left_ = size - sizeof(length_);
+    initialized_ = (Z_OK == inflateInit(&zstream_));
+    return initialized_;
+  }
+
+  virtual StreamResult Read(void* buffer, size_t buffer_len,
+                            size_t* read, int* error) {
+    if (output_begin_ < output_end_) {
+      size_t copied = _min(buffer_len, output_end_ - output_begin_);
+      memcpy(buffer, output_ + output_begin_, copied);
+      output_begin_ += copied;
+      if (read)
+        *read = copied;
+      return SR_SUCCESS;
+    }
+    return Inflate(static_cast<char*>(buffer), buffer_len, read, error);
+  }
+
+  virtual bool GetPosition(size_t* position) const {
+    if (position)
+      *position = static_cast<size_t>(zstream_.total_out)
+          - (output_end_ - output_begin_);
+    return true;
+  }
+  virtual bool GetSize(size_t* size) const {
+    if (size)
+      *size = static_cast<size_t>(length_);
+    return true;
+  }
+  virtual bool GetAvailable(size_t* size) const {
+    size_t position = 0;
+    GetPosition(&position);
+    if (size)
+      *size = static_cast<size_t>(length_) - position;
+    return true;
+  }
+
+  // Inflates through a buffer of its own, which keeps what the sink doesn't
+  // take for the next call, since the stream can't seek back.
+  virtual StreamResult TransferTo(StreamInterface* sink, size_t* transferred,
+                                  int* error) {
+    size_t total = 0;
+    StreamResult result = SR_SUCCESS;
+    for (;;) {
+      if (output_begin_ == output_end_) {
+        size_t read = 0;
+        result = Inflate(output_, kBufferSize, &read, error);
+        if (SR_SUCCESS != result)
+          break;
+        output_begin_ = 0;
+        output_end_ = read;
+      }
+      size_t written = 0;
+      result = sink->Write(output_ + output_begin_,
+                           output_end_ - output_begin_, &written, error);
+      if (SR_SUCCESS != result)
+        break;
+      output_begin_ += written;
+      total += written;
+    }
+    if (transferred)
+      *transferred = total;
+    return (SR_EOS == result) ? SR_SUCCESS : result;
+  }
+
+private:
+  // Inflates into |buffer|, taking compressed bytes from the stream under,
+  // in place where it can hand them out.
+  StreamResult Inflate(char* buffer, size_t buffer_len, size_t* read,
+                       int* error) {
+    if (finished_)
+      return SR_EOS;
+    zstream_.next_out = reinterpret_cast<Bytef*>(buffer);
+    zstream_.avail_out = static_cast<uInt>(buffer_len);
+    while (zstream_.avail_out == buffer_len) {
+      size_t in_place = 0;
+      if ((0 == zstream_.avail_in) && (compressed_left_ > 0)) {
+        size_t available = 0;
+        const void* data = stream()->GetReadData(&available);
+        if (data && (available > 0)) {
+          in_place = _min(available, compressed_left_);
+          zstream_.next_in =
+              static_cast<Bytef*>(const_cast<void*>(data));
+          zstream_.avail_in = static_cast<uInt>(in_place);
+        } else {
+          size_t input_len = 0;
+          StreamResult result = stream()->Read(
+              buffer_, _min(kBufferSize, compressed_left_), &input_len,
+              error);
+          if (SR_SUCCESS != result)
+            return (SR_EOS == result) ? Corrupt(error) : result;
+          zstream_.next_in = reinterpret_cast<Bytef*>(buffer_);
+          zstream_.avail_in = static_cast<uInt>(input_len);
+        }
+        compressed_left_ -= zstream_.avail_in;
+      }
+      uInt before = zstream_.avail_in;
+      int status = inflate(&zstream_, Z_NO_FLUSH);
+      if (in_place > 0) {
+        // Bytes handed out in place are given back as they are used, and
+        // the rest taken again on the next pass.
+        stream()->ConsumeReadData(before - zstream_.avail_in);
+        compressed_left_ += zstream_.avail_in;
+        zstream_.avail_in = 0;
+      }
+      if (Z_STREAM_END == status) {
+        finished_ = true;
+        if (zstream_.total_out != length_)
+          return Corrupt(error);
+        break;
+      }
+      if ((Z_OK != status)
+          && !((Z_BUF_ERROR == status) && (compressed_left_ > 0)))
+        return Corrupt(error);
+    }
+    size_t length = buffer_len - zstream_.avail_out;
+    if (0 == length)
+      return SR_EOS;
+    if (read)
+      *read = length;
+    return SR_SUCCESS;
+  }
+
+  StreamResult Corrupt(int* error) {
+    LOG_F(LS_ERROR) << "Compressed cache stream is damaged";
+    if (error)
+      *error = Z_DATA_ERROR;
+    return SR_ERROR;
+  }
+
+  uint64 length_;
+  size_t compressed_left_;
+  // Bytes inflated by TransferTo that the sink hasn't taken yet.
+  char output_[kBufferSize];
+  size_t output_begin_, output_end_;
+};
+
+// Streams at least this large are mapped rather than read through stdio.
+const size_t kMinMappedStream = 64 * 1024;
+// Files written behind are synced and closed at least this often.
+const size_t kMaxOpenWrites = 32;
+
+// The index files, next to the cache files.  Their extensions aren't
+// numbers, so FilenameToId rejects them.
+const char kSnapshotFile[] = "cache.index";
+const char kJournalFile[] = "cache.journal";
+// Both files start with these, in host byte order; a cache moved to a
+// machine of the other order is scanned instead.
+const uint32 kIndexMagic = 0x43445854;  // "TXDC"
+const uint32 kIndexVersion = 2;
+const size_t kIndexHeaderSize = 2 * sizeof(uint32);
+// A record is an operation, the id's length, the entry's streams, which of
+// them are compressed, its size and modification time, and then the id.
+const size_t kIndexRecordSize = 1 + 3 * sizeof(uint32) + 2 * sizeof(uint64);
+const char kIndexPut = 'P';
+const char kIndexDelete = 'D';
+// The journal is folded into a new snapshot once it has more records than
+// there are entries, and at least this many.
+const size_t kMinJournalRecords = 4096;
+
+static void DiskCache_AppendIndexHeader(std::string* data) {
+  data->append(reinterpret_cast<const char*>(&kIndexMagic), sizeof(uint32));
+  data->append(reinterpret_cast<const char*>(&kIndexVersion), sizeof(uint32));
+}
+
+static void DiskCache_AppendIndexRecord(std::string* data, char op,
+                                        const std::string& id, size_t streams,
+                                        uint32 compressed, size_t size,
+                                        time_t last_modified) {
+  uint32 id_length = static_cast<uint32>(id.size());
+  uint32 streams32 = static_cast<uint32>(streams);
+  uint64 size64 = size;
+  int64 modified64 = last_modified;
+  data->push_back(op);
+  data->append(reinterpret_cast<const char*>(&id_length), sizeof(id_length));
+  data->append(reinterpret_cast<const char*>(&streams32), sizeof(streams32));
+  data->append(reinterpret_cast<const char*>(&compressed),
+               sizeof(compressed));
+  data->append(reinterpret_cast<const char*>(&size64), sizeof(size64));
+  data->append(reinterpret_cast<const char*>(&modified64),
+               sizeof(modified64));
+  data->append(id);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SyncFileStream - A FileStream that can be synced to disk.
+///////////////////////////////////////////////////////////////////////////////
+
+class SyncFileStream : public FileStream {
+public:
+  bool Sync() {
+    if (!Flush())
+      return false;
+#ifdef POSIX
+    return (0 == fsync(fileno(file_)));
+#else  // !POSIX
+    return true;
+#endif  // !POSIX
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// DiskCache::Writer - Writes the streams written behind on a thread of its
+// own, and passes each batch back to the cache's thread once it is synced.
+///////////////////////////////////////////////////////////////////////////////
+
+class DiskCache::Writer : public MessageHandler {
+public:
+  enum { MSG_WRITE, MSG_WRITTEN };
+  typedef std::vector<WriteJob> JobList;
+
+  explicit Writer(DiskCache* cache)
+  : cache_(cache), owner_(Thread::Current())
+  {
+    thread_.Start();
+  }
+  virtual ~Writer() {
+    // Send waits for everything posted before it, and the batches it passes
+    // back are applied here.
+    thread_.Send(this, MSG_WRITE);
+    thread_.Stop();
+    MessageList removed;
+    owner_->Clear(this, MSG_WRITTEN, &removed);
+    for (MessageList::iterator it = removed.begin(); it != removed.end();
+         ++it) {
+      OnMessage(&*it);
+    }
+  }
+
+  void Add(const WriteJob& job) {
+    CritScope cs(&crit_);
+    if (jobs_.empty())
+      thread_.Post(this, MSG_WRITE);
+    jobs_.push_back(job);
+  }
+
+  virtual void OnMessage(Message* msg) {
+    if (MSG_WRITE == msg->message_id) {
+      WriteJobs();
+    } else {
+      TypedMessageData<JobList>* data =
+          static_cast<TypedMessageData<JobList>*>(msg->pdata);
+      cache_->OnWritten(data->data());
+      delete data;
+    }
+  }
+
+private:
+  void WriteJobs() {
+    JobList jobs;
+    {
+      CritScope cs(&crit_);
+      jobs.swap(jobs_);
+    }
+    if (jobs.empty())
+      return;
+    // The files are synced together, once they have all been written.
+    std::vector<SyncFileStream*> files;
+    size_t synced = 0;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      SyncFileStream* file = new SyncFileStream;
+      const std::string& data = *jobs[i].data;
+      jobs[i].success = file->Open(jobs[i].filename, "wb")
+          && (SR_SUCCESS == file->WriteAll(data.data(), data.size(), NULL,
+                                           NULL));
+      files.push_back(file);
+      if ((files.size() - synced >= kMaxOpenWrites) || (i + 1 == jobs.size())) {
+        for (; synced < files.size(); ++synced) {
+          if (jobs[synced].success && !files[synced]->Sync())
+            jobs[synced].success = false;
+          delete files[synced];
+        }
+      }
+    }
+    owner_->Post(this, MSG_WRITTEN, new TypedMessageData<JobList>(jobs));
+  }
+
+  DiskCache* cache_;
+  Thread* owner_;
+  Thread thread_;
+  CriticalSection crit_;
+  JobList jobs_;
+};
+
+const size_t DiskCache::kMaxMemoryStream;
+const size_t DiskCache::kMaxCompressedStreams;
+
 ///////////////////////////////////////////////////////////////////////////////
 // DiskCache
 ///////////////////////////////////////////////////////////////////////////////
 
-DiskCache::DiskCache() : max_cache_(0), total_size_(0), total_accessors_(0) {
+DiskCache::DiskCache() : max_cache_(0), total_size_(0), total_accessors_(0),
+                         memory_limit_(0), memory_size_(0),
+                         pending_writes_(0), use_index_(true),
+                         journal_records_(0) {
 }
 
 DiskCache::~DiskCache() {
   ASSERT(0 == total_accessors_);
+  // The writes still in flight are journaled as they are applied.
+  writer_.reset();
+  journal_.reset();
 }
 
 bool DiskCache::Initialize(const std::string& folder, size_t size) {
@@ -90,17 +557,59 @@ bool DiskCache::Initialize(const std::string& folder, size_t size) {
   max_cache_ = size;
   ASSERT(0 == total_size_);
 
-  if (!InitializeEntries())
-    return false;
+  if (!use_index_ || !LoadIndex()) {
+    if (!InitializeEntries())
+      return false;
+    // The scan is the slow path; the index spares the next start it.
+    if (use_index_)
+      WriteSnapshot();
+  }
 
+  SortEntries();
   return CheckLimit();
 }
 
+void DiskCache::set_memory_limit(size_t size) {
+  memory_limit_ = size;
+  TrimMemory(NULL);
+}
+
+void DiskCache::set_write_behind(bool write_behind) {
+  if (write_behind && !writer_.get()) {
+    writer_.reset(new Writer(this));
+  } else if (!write_behind) {
+    writer_.reset();
+  }
+}
+
+DiskCache::Compression
+DiskCache::CompressionFor(const std::string& content_type) {
+  // Parameters such as the charset don't matter, and types like
+  // "image/svg+xml" go by their suffix.
+  std::string type(string_trim(content_type.substr(0,
+                                                   content_type.find(';'))));
+  for (size_t i = 0; i < type.size(); ++i)
+    type[i] = tolowercase(type[i]);
+  size_t slash = type.find('/');
+  if (std::string::npos == slash)
+    return CC_NONE;
+  std::string subtype(type.substr(slash + 1));
+  size_t plus = subtype.rfind('+');
+  std::string suffix((std::string::npos == plus) ? subtype
+                                                 : subtype.substr(plus + 1));
+  if ((0 == type.compare(0, slash, "text"))
+      || ("json" == suffix) || ("xml" == suffix)
+      || ("javascript" == subtype) || ("x-javascript" == subtype)
+      || ("ecmascript" == subtype))
+    return CC_FAST;
+  return CC_NONE;
+}
+
 bool DiskCache::Purge() {
   if (folder_.empty())
     return false;
 
-  if (total_accessors_ > 0) {
+  if ((total_accessors_ > 0) || (pending_writes_ > 0)) {
     LOG_F(LS_WARNING) << "Cache files open";
     return false;
   }
@@ -109,6 +618,11 @@ bool DiskCache::Purge() {
     return false;
 
   map_.clear();
+  lru_.clear();
+  memory_lru_.clear();
+  memory_size_ = 0;
+  if (use_index_)
+    WriteSnapshot();
   return true;
 }
 
@@ -116,7 +630,8 @@ bool DiskCache::LockResource(const std::string& id) {
   Entry* entry = GetOrCreateEntry(id, true);
   if (LS_LOCKED == entry->lock_state)
     return false;
-  if ((LS_UNLOCKED == entry->lock_state) && (entry->accessors > 0))
+  if ((LS_UNLOCKED == entry->lock_state)
+      && ((entry->accessors > 0) || (entry->pending > 0)))
     return false;
   if ((total_size_ > max_cache_) && !CheckLimit()) {
     LOG_F(LS_WARNING) << "Cache overfull";
@@ -126,23 +641,51 @@ bool DiskCache::LockResource(const std::string& id) {
   return true;
 }
 
-StreamInterface* DiskCache::WriteResource(const std::string& id, size_t index) {
+StreamInterface* DiskCache::WriteResource(const std::string& id, size_t index,
+                                         Compression compression) {
   Entry* entry = GetOrCreateEntry(id, false);
   if (LS_LOCKED != entry->lock_state)
     return NULL;
+  if (index >= kMaxCompressedStreams)
+    compression = CC_NONE;
 
   size_t previous_size = 0;
-  std::string filename(IdToFilename(id, index));
-  FileStream::GetSize(filename, &previous_size);
+  std::string previous_filename(StreamFilename(id, index, entry));
+  FileStream::GetSize(previous_filename, &previous_size);
   ASSERT(previous_size <= entry->size);
   if (previous_size > entry->size) {
     previous_size = entry->size;
   }
+  std::string filename(IdToFilename(id, index, CC_NONE != compression));
 
-  scoped_ptr<FileStream> file(new FileStream);
-  if (!file->Open(filename, "wb")) {
-    LOG_F(LS_ERROR) << "Couldn't create cache file";
-    return NULL;
+  scoped_ptr<StreamInterface> stream;
+  DropMemory(entry, index);
+  if (writer_.get()) {
+    // The bytes go to memory, where readers find them until the writer is
+    // done with them.
+    if (entry->memory.empty()) {
+      entry->memory_lru = memory_lru_.insert(memory_lru_.end(), *entry->lru);
+    }
+    stream.reset(new StringStream(entry->memory[index]));
+  } else {
+    scoped_ptr<FileStream> file(new FileStream);
+    if (!file->Open(filename, "wb")) {
+      LOG_F(LS_ERROR) << "Couldn't create cache file";
+      return NULL;
+    }
+    stream.reset(file.release());
+  }
+  // A stream stored the other way before leaves a file that would go stale.
+  if ((filename != previous_filename) && FileExists(previous_filename)
+      && !DeleteFile(previous_filename))
+    LOG_F(LS_WARNING) << "Couldn't remove cache file: " << previous_filename;
+  if (CC_NONE != compression) {
+    entry->compressed |= (1u << index);
+    stream.reset(new DiskCacheDeflateStream(
+        stream.release(),
+        (CC_SMALL == compression) ? Z_BEST_COMPRESSION : Z_BEST_SPEED));
+  } else if (index < kMaxCompressedStreams) {
+    entry->compressed &= ~(1u << index);
   }
 
   entry->streams = stdmax(entry->streams, index + 1);
@@ -151,7 +694,7 @@ StreamInterface* DiskCache::WriteResource(const std::string& id, size_t index) {
 
   entry->accessors += 1;
   total_accessors_ += 1;
-  return new DiskCacheAdapter(this, id, index, file.release());
+  return new DiskCacheAdapter(this, id, index, stream.release());
 }
 
 bool DiskCache::UnlockResource(const std::string& id) {
@@ -164,6 +707,8 @@ bool DiskCache::UnlockResource(const std::string& id) {
   } else {
     entry->lock_state = LS_UNLOCKED;
     entry->last_modified = time(0);
+    TouchEntry(entry);
+    JournalEntry(id, entry);
     CheckLimit();
   }
   return true;
@@ -172,18 +717,28 @@ bool DiskCache::UnlockResource(const std::string& id) {
 StreamInterface* DiskCache::ReadResource(const std::string& id,
                                          size_t index) const {
   const Entry* entry = GetEntry(id);
-  if (LS_UNLOCKED != entry->lock_state)
+  if ((NULL == entry) || (LS_UNLOCKED != entry->lock_state))
     return NULL;
   if (index >= entry->streams)
     return NULL;
 
-  scoped_ptr<FileStream> file(new FileStream);
-  if (!file->Open(IdToFilename(id, index), "rb"))
+  StreamInterface* stream = OpenStream(id, index, entry);
+  if (!stream)
     return NULL;
+  if (IsCompressed(entry, index)) {
+    DiskCacheInflateStream* inflater = new DiskCacheInflateStream(stream);
+    if (!inflater->Open()) {
+      LOG_F(LS_ERROR) << "Couldn't open compressed cache stream";
+      delete inflater;
+      return NULL;
+    }
+    stream = inflater;
+  }
 
+  TouchEntry(entry);
   entry->accessors += 1;
   total_accessors_ += 1;
-  return new DiskCacheAdapter(this, id, index, file.release());
+  return new DiskCacheAdapter(this, id, index, stream);
 }
 
 bool DiskCache::HasResource(const std::string& id) const {
@@ -196,7 +751,7 @@ bool DiskCache::HasResourceStream(const std::string& id, size_t index) const {
   if ((NULL == entry) || (index >= entry->streams))
     return false;
 
-  std::string filename = IdToFilename(id, index);
+  std::string filename = StreamFilename(id, index, entry);
 
   return FileExists(filename);
 }
@@ -206,12 +761,13 @@ bool DiskCache::DeleteResource(const std::string& id) {
   if (!entry)
     return true;
 
-  if ((LS_UNLOCKED != entry->lock_state) || (entry->accessors > 0))
+  if ((LS_UNLOCKED != entry->lock_state) || (entry->accessors > 0)
+      || (entry->pending > 0))
     return false;
 
   bool success = true;
   for (size_t index = 0; index < entry->streams; ++index) {
-    std::string filename = IdToFilename(id, index);
+    std::string filename = StreamFilename(id, index, entry);
 
     if (!FileExists(filename))
       continue;
@@ -223,7 +779,10 @@ bool DiskCache::DeleteResource(const std::string& id) {
   }
 
   total_size_ -= entry->size;
+  DropMemory(entry);
+  lru_.erase(entry->lru);
   map_.erase(id);
+  JournalDelete(id);
   return success;
 }
 
@@ -237,34 +796,370 @@ bool DiskCache::CheckLimit() {
   ASSERT(cache_size == total_size_);
 #endif  // _DEBUG
 
-  // TODO: Replace this with a non-brain-dead algorithm for clearing out the
-  // oldest resources... something that isn't O(n^2)
+  // The least recently used resource that isn't in use goes first, which
+  // is usually the one at the front.
+  IdList::iterator it = lru_.begin();
   while (total_size_ > max_cache_) {
-    EntryMap::iterator oldest = map_.end();
-    for (EntryMap::iterator it = map_.begin(); it != map_.end(); ++it) {
-      if ((LS_UNLOCKED != it->second.lock_state) || (it->second.accessors > 0))
-        continue;
-      oldest = it;
-      break;
+    for (; it != lru_.end(); ++it) {
+      const Entry* entry = GetEntry(**it);
+      if ((LS_UNLOCKED == entry->lock_state) && (0 == entry->accessors)
+          && (0 == entry->pending))
+        break;
     }
-    if (oldest == map_.end()) {
+    if (it == lru_.end()) {
       LOG_F(LS_WARNING) << "All resources are locked!";
       return false;
     }
-    for (EntryMap::iterator it = oldest++; it != map_.end(); ++it) {
-      if (it->second.last_modified < oldest->second.last_modified) {
-        oldest = it;
+    // DeleteResource frees the key and the list node.
+    std::string id(**it);
+    ++it;
+    if (!DeleteResource(id)) {
+      LOG_F(LS_ERROR) << "Couldn't delete from cache!";
+      return false;
+    }
+  }
+  return true;
+}
+
+void DiskCache::TouchEntry(const Entry* entry) const {
+  lru_.splice(lru_.end(), lru_, entry->lru);
+}
+
+static bool
+DiskCache_OlderEntry(const std::pair<time_t, const std::string*>& a,
+                     const std::pair<time_t, const std::string*>& b) {
+  return a.first < b.first;
+}
+
+void DiskCache::SortEntries() {
+  std::vector<std::pair<time_t, const std::string*> > order;
+  order.reserve(map_.size());
+  for (EntryMap::iterator it = map_.begin(); it != map_.end(); ++it) {
+    order.push_back(std::make_pair(it->second.last_modified, &it->first));
+  }
+  std::stable_sort(order.begin(), order.end(), DiskCache_OlderEntry);
+  lru_.clear();
+  for (size_t i = 0; i < order.size(); ++i) {
+    GetEntry(*order[i].second)->lru = lru_.insert(lru_.end(), order[i].second);
+  }
+}
+
+StreamInterface* DiskCache::OpenStream(const std::string& id, size_t index,
+                                       const Entry* entry) const {
+  std::map<size_t, std::string>::const_iterator it = entry->memory.find(index);
+  if (it != entry->memory.end()) {
+    memory_lru_.splice(memory_lru_.end(), memory_lru_, entry->memory_lru);
+    return new DiskCacheMemoryStream(it->second.data(), it->second.size());
+  }
+
+  std::string filename(StreamFilename(id, index, entry));
+  size_t size = 0;
+  bool have_size = FileStream::GetSize(filename, &size);
+
+  if (have_size && (size <= kMaxMemoryStream) && (size <= memory_limit_)) {
+    std::string data(size, '\0');
+    FileStream file;
+    size_t read = 0;
+    if (file.Open(filename, "rb")
+        && ((0 == size)
+            || (SR_SUCCESS == file.ReadAll(&data[0], size, &read, NULL)))) {
+      if (entry->memory.empty()) {
+        entry->memory_lru = memory_lru_.insert(memory_lru_.end(),
+                                               *entry->lru);
+      } else {
+        memory_lru_.splice(memory_lru_.end(), memory_lru_, entry->memory_lru);
       }
+      std::string& stored = entry->memory[index];
+      stored.swap(data);
+      memory_size_ += size;
+      TrimMemory(entry);
+      return new DiskCacheMemoryStream(stored.data(), stored.size());
     }
-    if (!DeleteResource(oldest->first)) {
-      LOG_F(LS_ERROR) << "Couldn't delete from cache!";
+  }
+
+#ifdef POSIX
+  if (have_size && (size >= kMinMappedStream)) {
+    scoped_ptr<MappedFileStream> mapped(new MappedFileStream);
+    if (mapped->Open(filename))
+      return mapped.release();
+  }
+#endif  // POSIX
+
+  scoped_ptr<FileStream> file(new FileStream);
+  if (!file->Open(filename, "rb"))
+    return NULL;
+  return file.release();
+}
+
+void DiskCache::TrimMemory(const Entry* keep) const {
+  IdList::iterator it = memory_lru_.begin();
+  while ((memory_size_ > memory_limit_) && (it != memory_lru_.end())) {
+    const Entry* entry = GetEntry(**it);
+    ++it;
+    if ((entry != keep) && (0 == entry->accessors) && (0 == entry->pending))
+      DropMemory(entry);
+  }
+}
+
+void DiskCache::DropMemory(const Entry* entry) const {
+  if (entry->memory.empty())
+    return;
+  for (std::map<size_t, std::string>::const_iterator it =
+           entry->memory.begin(); it != entry->memory.end(); ++it) {
+    memory_size_ -= it->second.size();
+  }
+  entry->memory.clear();
+  memory_lru_.erase(entry->memory_lru);
+}
+
+void DiskCache::DropMemory(const Entry* entry, size_t index) const {
+  std::map<size_t, std::string>::iterator it = entry->memory.find(index);
+  if (it == entry->memory.end())
+    return;
+  memory_size_ -= it->second.size();
+  entry->memory.erase(it);
+  if (entry->memory.empty())
+    memory_lru_.erase(entry->memory_lru);
+}
+
+void DiskCache::OnWritten(const std::vector<WriteJob>& jobs) {
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    const WriteJob& job = jobs[i];
+    Entry* entry = GetOrCreateEntry(job.id, false);
+    ASSERT(NULL != entry);
+    pending_writes_ -= 1;
+    entry->pending -= 1;
+    if (!job.success) {
+      LOG_F(LS_ERROR) << "Couldn't write cache file: " << job.filename;
+      entry->write_failed = true;
+    }
+    if (0 == entry->pending) {
+      if (entry->write_failed) {
+        if (LS_UNLOCKED == entry->lock_state)
+          DeleteResource(job.id);
+        continue;
+      }
+      JournalEntry(job.id, entry);
+      // Only what would have been kept on reading stays in memory.
+      std::map<size_t, std::string>::iterator it = entry->memory.begin();
+      while (it != entry->memory.end()) {
+        size_t index = it->first, size = it->second.size();
+        ++it;
+        if ((size > kMaxMemoryStream) || (size > memory_limit_))
+          DropMemory(entry, index);
+      }
+    }
+  }
+  TrimMemory(NULL);
+  CheckLimit();
+}
+
+bool DiskCache::LoadIndex() {
+  size_t records = 0;
+  bool torn = false;
+  if (!ReadIndexFile(IndexFilename(kSnapshotFile), &records, &torn) || torn) {
+    if (!map_.empty())
+      LOG_F(LS_WARNING) << "Cache index is damaged; scanning the folder";
+    map_.clear();
+    lru_.clear();
+    total_size_ = 0;
+    return false;
+  }
+  // A journal that is missing, or ends in a record cut short by a crash,
+  // loses nothing that the snapshot and the records before that don't
+  // have, but can't be appended to.
+  records = 0;
+  torn = false;
+  if (!ReadIndexFile(IndexFilename(kJournalFile), &records, &torn) || torn
+      || (records > _max(kMinJournalRecords, map_.size()))) {
+    WriteSnapshot();
+    return true;
+  }
+  journal_.reset(new FileStream);
+  if (!journal_->Open(IndexFilename(kJournalFile), "ab")) {
+    LOG_F(LS_ERROR) << "Couldn't open cache journal";
+    DropIndex();
+  }
+  journal_records_ = records;
+  return true;
+}
+
+bool DiskCache::ReadIndexFile(const std::string& filename, size_t* records,
+                              bool* torn) {
+  const char* data = NULL;
+  size_t length = 0;
+#ifdef POSIX
+  // Mapped, so that a large index is read without copying it.
+  MappedFileStream file;
+  if (!file.Open(filename))
+    return false;
+  data = static_cast<const char*>(file.GetReadData(&length));
+#else  // !POSIX
+  std::string contents;
+  FileStream file;
+  if (!file.Open(filename, "rb") || !file.GetSize(&length))
+    return false;
+  contents.resize(length);
+  if ((length > 0)
+      && (SR_SUCCESS != file.ReadAll(&contents[0], length, NULL, NULL)))
+    return false;
+  data = contents.data();
+#endif  // !POSIX
+  uint32 magic, version;
+  if (!data || (length < kIndexHeaderSize))
+    return false;
+  memcpy(&magic, data, sizeof(magic));
+  memcpy(&version, data + sizeof(magic), sizeof(version));
+  if ((kIndexMagic != magic) || (kIndexVersion != version))
+    return false;
+
+  size_t pos = kIndexHeaderSize;
+  while (pos < length) {
+    if (length - pos < kIndexRecordSize) {
+      *torn = true;
+      break;
+    }
+    const char* record = data + pos;
+    uint32 id_length, streams, compressed;
+    uint64 size;
+    int64 last_modified;
+    memcpy(&id_length, record + 1, sizeof(id_length));
+    memcpy(&streams, record + 5, sizeof(streams));
+    memcpy(&compressed, record + 9, sizeof(compressed));
+    memcpy(&size, record + 13, sizeof(size));
+    memcpy(&last_modified, record + 21, sizeof(last_modified));
+    if ((length - pos - kIndexRecordSize < id_length)
+        || ((kIndexPut != record[0]) && (kIndexDelete != record[0]))) {
+      *torn = true;
+      break;
+    }
+    std::string id(record + kIndexRecordSize, id_length);
+    if (kIndexPut == record[0]) {
+      Entry* entry = GetOrCreateEntry(id, true);
+      total_size_ -= entry->size;
+      entry->size = static_cast<size_t>(size);
+      entry->streams = streams;
+      entry->compressed = compressed;
+      entry->last_modified = static_cast<time_t>(last_modified);
+      total_size_ += entry->size;
+    } else {
+      EntryMap::iterator it = map_.find(id);
+      if (it != map_.end()) {
+        total_size_ -= it->second.size;
+        lru_.erase(it->second.lru);
+        map_.erase(it);
+      }
+    }
+    pos += kIndexRecordSize + id_length;
+    *records += 1;
+  }
+  return true;
+}
+
+bool DiskCache::WriteSnapshot() {
+  journal_.reset();
+  journal_records_ = 0;
+  std::string data;
+  DiskCache_AppendIndexHeader(&data);
+  for (EntryMap::const_iterator it = map_.begin(); it != map_.end(); ++it) {
+    const Entry& entry = it->second;
+    // The others are journaled once they are stored.
+    if ((LS_UNLOCKED != entry.lock_state) || (entry.pending > 0)
+        || entry.write_failed)
+      continue;
+    DiskCache_AppendIndexRecord(&data, kIndexPut, it->first, entry.streams,
+                                entry.compressed, entry.size,
+                                entry.last_modified);
+  }
+
+  // The new snapshot replaces the old one whole, so that a crash leaves
+  // one or the other.
+  std::string snapshot(IndexFilename(kSnapshotFile));
+  std::string temp(snapshot + ".new");
+  {
+    SyncFileStream file;
+    if (!file.Open(temp, "wb")
+        || (SR_SUCCESS != file.WriteAll(data.data(), data.size(), NULL, NULL))
+        || !file.Sync()) {
+      LOG_F(LS_ERROR) << "Couldn't write cache index";
+      DropIndex();
       return false;
     }
   }
+#ifdef WIN32
+  Filesystem::DeleteFile(snapshot);
+#endif  // WIN32
+  if (!Filesystem::MoveFile(temp, snapshot)) {
+    LOG_F(LS_ERROR) << "Couldn't replace cache index";
+    Filesystem::DeleteFile(temp);
+    DropIndex();
+    return false;
+  }
+
+  data.clear();
+  DiskCache_AppendIndexHeader(&data);
+  journal_.reset(new FileStream);
+  if (!journal_->Open(IndexFilename(kJournalFile), "wb")
+      || (SR_SUCCESS != journal_->WriteAll(data.data(), data.size(), NULL,
+                                           NULL))
+      || !journal_->Flush()) {
+    LOG_F(LS_ERROR) << "Couldn't start cache journal";
+    DropIndex();
+    return false;
+  }
   return true;
 }
 
-std::string DiskCache::IdToFilename(const std::string& id, size_t index) const {
+void DiskCache::JournalEntry(const std::string& id, const Entry* entry) {
+  if ((LS_UNLOCKED != entry->lock_state) || (entry->pending > 0)
+      || entry->write_failed)
+    return;
+  std::string record;
+  DiskCache_AppendIndexRecord(&record, kIndexPut, id, entry->streams,
+                              entry->compressed, entry->size,
+                              entry->last_modified);
+  AppendJournal(record);
+}
+
+void DiskCache::JournalDelete(const std::string& id) {
+  std::string record;
+  DiskCache_AppendIndexRecord(&record, kIndexDelete, id, 0, 0, 0, 0);
+  AppendJournal(record);
+}
+
+void DiskCache::AppendJournal(const std::string& record) {
+  if (!journal_.get())
+    return;
+  // Each record is flushed whole, so that a crash can only cut the last.
+  if ((SR_SUCCESS != journal_->WriteAll(record.data(), record.size(), NULL,
+                                        NULL))
+      || !journal_->Flush()) {
+    LOG_F(LS_ERROR) << "Couldn't write cache journal";
+    DropIndex();
+    return;
+  }
+  journal_records_ += 1;
+  if (journal_records_ > _max(kMinJournalRecords, map_.size()))
+    WriteSnapshot();
+}
+
+void DiskCache::DropIndex() {
+  journal_.reset();
+  journal_records_ = 0;
+  std::string snapshot(IndexFilename(kSnapshotFile));
+  if (Filesystem::IsFile(snapshot) && !Filesystem::DeleteFile(snapshot))
+    LOG_F(LS_ERROR) << "Couldn't remove stale cache index";
+}
+
+std::string DiskCache::IndexFilename(const char* name) const {
+  Pathname pathname;
+  pathname.SetFolder(folder_);
+  pathname.SetFilename(name);
+  return pathname.pathname();
+}
+
+std::string DiskCache::IdToFilename(const std::string& id, size_t index,
+                                    bool compressed) const {
 #ifdef TRANSPARENT_CACHE_NAMES
   // This escapes colons and other filesystem characters, so the user can't open
   // special devices (like "COM1:"), or access other directories.
@@ -280,7 +1175,8 @@ std::string DiskCache::IdToFilename(const std::string& id, size_t index) const {
 #endif  // !TRANSPARENT_CACHE_NAMES
 
   char extension[32];
-  sprintfn(extension, ARRAY_SIZE(extension), ".%u", index);
+  sprintfn(extension, ARRAY_SIZE(extension), compressed ? ".%uz" : ".%u",
+           index);
 
   Pathname pathname;
   pathname.SetFolder(folder_);
@@ -295,13 +1191,18 @@ std::string DiskCache::IdToFilename(const std::string& id, size_t index) const {
 }
 
 bool DiskCache::FilenameToId(const std::string& filename, std::string* id,
-                             size_t* index) const {
+                             size_t* index, bool* compressed) const {
   Pathname pathname(filename);
   unsigned tempdex;
-  if (1 != sscanf(pathname.extension().c_str(), ".%u", &tempdex))
+  char suffix = 0;
+  int fields = sscanf(pathname.extension().c_str(), ".%u%c", &tempdex,
+                      &suffix);
+  if (fields < 1)
     return false;
 
   *index = static_cast<size_t>(tempdex);
+  if (compressed)
+    *compressed = (2 == fields) && ('z' == suffix);
 
   size_t buffer_size = pathname.basename().length() + 1;
   char* buffer = new char[buffer_size];
@@ -312,6 +1213,11 @@ bool DiskCache::FilenameToId(const std::string& filename, std::string* id,
   return true;
 }
 
+std::string DiskCache::StreamFilename(const std::string& id, size_t index,
+                                      const Entry* entry) const {
+  return IdToFilename(id, index, IsCompressed(entry, index));
+}
+
 DiskCache::Entry* DiskCache::GetOrCreateEntry(const std::string& id,
                                               bool create) {
   EntryMap::iterator it = map_.find(id);
@@ -324,8 +1230,12 @@ DiskCache::Entry* DiskCache::GetOrCreateEntry(const std::string& id,
   e.accessors = 0;
   e.size = 0;
   e.streams = 0;
+  e.compressed = 0;
   e.last_modified = time(0);
+  e.pending = 0;
+  e.write_failed = false;
   it = map_.insert(EntryMap::value_type(id, e)).first;
+  it->second.lru = lru_.insert(lru_.end(), &it->first);
   return &it->second;
 }
 
@@ -347,14 +1257,36 @@ void DiskCache::ReleaseResource(const std::string& id, size_t index) const {
     Entry* entry2 = this2->GetOrCreateEntry(id, false);
 
     size_t new_size = 0;
-    std::string filename(IdToFilename(id, index));
-    FileStream::GetSize(filename, &new_size);
+    std::string filename(StreamFilename(id, index, entry));
+    std::map<size_t, std::string>::const_iterator it;
+    if (writer_.get() && ((it = entry->memory.find(index))
+                          != entry->memory.end())) {
+      new_size = it->second.size();
+      memory_size_ += new_size;
+      WriteJob job;
+      job.id = id;
+      job.index = index;
+      job.filename = filename;
+      job.data = &it->second;
+      job.success = false;
+      entry2->pending += 1;
+      pending_writes_ += 1;
+      writer_->Add(job);
+    } else {
+      FileStream::GetSize(filename, &new_size);
+    }
     entry2->size += new_size;
     this2->total_size_ += new_size;
 
     if ((LS_UNLOCKING == entry->lock_state) && (0 == entry->accessors)) {
       entry2->last_modified = time(0);
       entry2->lock_state = LS_UNLOCKED;
+      TouchEntry(entry2);
+      if (entry2->write_failed && (0 == entry2->pending)) {
+        this2->DeleteResource(id);
+        return;
+      }
+      this2->JournalEntry(id, entry2);
       this2->CheckLimit();
     }
   }
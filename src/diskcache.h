@@ -32,8 +32,13 @@
 #include "config.h"
 #endif
 
+#include <list>
 #include <map>
 #include <string>
+#include <vector>
+
+#include "basictypes.h"
+#include "scoped_ptr.h"
 
 #ifdef WIN32
 #undef UnlockResource
@@ -41,6 +46,7 @@
 
 namespace txmpp {
 
+class FileStream;
 class StreamInterface;
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -53,6 +59,16 @@ class StreamInterface;
 // DiskCache is designed to persist across executions of the program.  It is
 // safe for use from an arbitrary number of users on a single thread, but not
 // from multiple threads or other processes.
+// Small streams that are read can also be kept in memory, up to a limit, so
+// that reading them again doesn't touch the disk.  Large ones are mapped into
+// memory where the platform allows.  Writes may be left to a thread of the
+// cache's own, so that a slow disk doesn't hold up the caller.
+// The entries are recorded in an index in the folder, a snapshot and a
+// journal of the changes since, so that Initialize needn't look at every
+// file.  Without a readable snapshot it scans the folder instead.
+// Streams can be stored compressed, so that text resources take less of the
+// cache's size, which counts the bytes on disk, and less I/O to read.  They
+// are inflated as they are read.
 ///////////////////////////////////////////////////////////////////////////////
 
 class DiskCache {
@@ -63,8 +79,45 @@ public:
   bool Initialize(const std::string& folder, size_t size);
   bool Purge();
 
+  // Whether Initialize loads the entries from the index, and the cache
+  // keeps the index up to date.  On by default; must be set before
+  // Initialize.
+  void set_use_index(bool use_index) { use_index_ = use_index; }
+  bool use_index() const { return use_index_; }
+
+  // Keeps up to |size| bytes of the streams read most recently in memory,
+  // for those of at most kMaxMemoryStream bytes.  The default is 0, which
+  // keeps none.
+  void set_memory_limit(size_t size);
+  size_t memory_limit() const { return memory_limit_; }
+  size_t memory_size() const { return memory_size_; }
+
+  static const size_t kMaxMemoryStream = 64 * 1024;
+
+  // How WriteResource stores a stream.  CC_FAST costs the least CPU to
+  // write, and CC_SMALL takes the least space, for resources kept long.
+  // Either is inflated by ReadResource as it is read.  Only the first
+  // kMaxCompressedStreams streams of a resource can be compressed; the
+  // others are stored as they are.
+  enum Compression { CC_NONE, CC_FAST, CC_SMALL };
+  static const size_t kMaxCompressedStreams = 32;
+
+  // The compression worth using for a resource of MIME type |content_type|.
+  // Text, JSON, XML, SVG and scripts compress well; images, audio, video and
+  // archives already are compressed, and are stored as they are.
+  static Compression CompressionFor(const std::string& content_type);
+
+  // While set, written streams are kept in memory and written to their files
+  // on the cache's own thread, which syncs each batch of them to disk at
+  // once.  Until then they are read from memory, and their resource can't
+  // be locked, deleted or purged.  Off by default.  Clearing it, like
+  // destroying the cache, waits for the writes in flight.
+  void set_write_behind(bool write_behind);
+  bool write_behind() const { return NULL != writer_.get(); }
+
   bool LockResource(const std::string& id);
-  StreamInterface* WriteResource(const std::string& id, size_t index);
+  StreamInterface* WriteResource(const std::string& id, size_t index,
+                                 Compression compression = CC_NONE);
   bool UnlockResource(const std::string& id);
 
   StreamInterface* ReadResource(const std::string& id, size_t index) const;
@@ -81,21 +134,87 @@ public:
   virtual bool DeleteFile(const std::string& filename) const = 0;
 
   enum LockState { LS_UNLOCKED, LS_LOCKED, LS_UNLOCKING };
+  // Resource ids, pointing at the keys of map_.
+  typedef std::list<const std::string*> IdList;
   struct Entry {
     LockState lock_state;
     mutable size_t accessors;
     size_t size;
     size_t streams;
     time_t last_modified;
+    // Bit i is set if stream i is stored compressed.
+    uint32 compressed;
+    // The entry's place in lru_, and in memory_lru_ while it has streams in
+    // memory.
+    mutable IdList::iterator lru, memory_lru;
+    // The streams kept in memory, by index.
+    mutable std::map<size_t, std::string> memory;
+    // Streams written behind that haven't reached their file yet.  Their
+    // bytes are in memory meanwhile.  An entry whose write failed goes once
+    // it is unlocked and nothing is pending.
+    size_t pending;
+    bool write_failed;
   };
   typedef std::map<std::string, Entry> EntryMap;
   friend class DiskCacheAdapter;
+  class Writer;
+  friend class Writer;
+  struct WriteJob {
+    std::string id;
+    size_t index;
+    std::string filename;
+    const std::string* data;
+    bool success;
+  };
 
   bool CheckLimit();
+  // Moves the entry to the most recently used end of lru_.
+  void TouchEntry(const Entry* entry) const;
+  // Orders lru_ by last_modified, for the entries InitializeEntries found.
+  void SortEntries();
+  // Opens stream |index| of |entry| from memory, a mapping or the file, as
+  // it is stored.
+  StreamInterface* OpenStream(const std::string& id, size_t index,
+                              const Entry* entry) const;
+  // Drops the streams in memory, least recently used first, until they fit
+  // the limit.  Streams being read, and those of |keep|, stay.
+  void TrimMemory(const Entry* keep) const;
+  void DropMemory(const Entry* entry) const;
+  void DropMemory(const Entry* entry, size_t index) const;
+  // Applies a batch of writes done behind, on the cache's thread.
+  void OnWritten(const std::vector<WriteJob>& jobs);
 
-  std::string IdToFilename(const std::string& id, size_t index) const;
+  // Rebuilds map_ from the snapshot and journal.  Returns false, leaving
+  // map_ empty, if there is no usable snapshot.
+  bool LoadIndex();
+  // Applies the records of an index file, counting them in |records|.
+  // |torn| is set if the file ends in an incomplete record.
+  bool ReadIndexFile(const std::string& filename, size_t* records,
+                     bool* torn);
+  // Writes every stored entry to a new snapshot and starts a new journal.
+  bool WriteSnapshot();
+  // Journals |entry| once its streams are all on disk and it is unlocked.
+  void JournalEntry(const std::string& id, const Entry* entry);
+  void JournalDelete(const std::string& id);
+  void AppendJournal(const std::string& record);
+  // Stops keeping the index, and removes the snapshot so that the next
+  // Initialize scans the folder rather than trust a stale one.
+  void DropIndex();
+  std::string IndexFilename(const char* name) const;
+
+  // Compressed streams are stored under a name of their own, so that a scan
+  // of the folder tells them apart; FilenameToId sets |compressed| for them.
+  std::string IdToFilename(const std::string& id, size_t index,
+                           bool compressed = false) const;
   bool FilenameToId(const std::string& filename, std::string* id,
-                    size_t* index) const;
+                    size_t* index, bool* compressed = NULL) const;
+  // The file of stream |index| of |entry|, as it is stored.
+  std::string StreamFilename(const std::string& id, size_t index,
+                             const Entry* entry) const;
+  static bool IsCompressed(const Entry* entry, size_t index) {
+    return (index < kMaxCompressedStreams)
+        && (0 != (entry->compressed & (1u << index)));
+  }
 
   const Entry* GetEntry(const std::string& id) const {
     return const_cast<DiskCache*>(this)->GetOrCreateEntry(id, false);
@@ -108,6 +227,16 @@ public:
   size_t max_cache_, total_size_;
   EntryMap map_;
   mutable size_t total_accessors_;
+  // All the entries, and those with streams in memory, from the least
+  // recently used to the most.
+  mutable IdList lru_, memory_lru_;
+  size_t memory_limit_;
+  mutable size_t memory_size_;
+  scoped_ptr<Writer> writer_;
+  mutable size_t pending_writes_;
+  bool use_index_;
+  scoped_ptr<FileStream> journal_;
+  size_t journal_records_;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
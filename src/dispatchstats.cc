@@ -0,0 +1,167 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "dispatchstats.h"
+
+#include "common.h"
+#include "criticalsection.h"
+
+namespace txmpp {
+
+//------------------------------------------------------------------
+// Histogram
+
+Histogram::Histogram() {
+  Reset();
+}
+
+void Histogram::Add(uint32 value) {
+  int bucket = 0;
+  for (uint32 v = value; v; v >>= 1)
+    ++bucket;
+  AtomicOps::Increment(&buckets_[bucket]);
+  AtomicOps::Increment(&count_);
+  AtomicOps::Add(&sum_, value);
+  uint64 max = AtomicOps::AcquireLoad(&max_);
+  while (value > max && !AtomicOps::CompareAndSwap(&max_, max, value))
+    max = AtomicOps::AcquireLoad(&max_);
+}
+
+void Histogram::GetSnapshot(Snapshot* snapshot) const {
+  snapshot->count = AtomicOps::AcquireLoad(&count_);
+  snapshot->sum = AtomicOps::AcquireLoad(&sum_);
+  snapshot->max = static_cast<uint32>(AtomicOps::AcquireLoad(&max_));
+  for (int i = 0; i < kBuckets; ++i)
+    snapshot->buckets[i] = AtomicOps::AcquireLoad(&buckets_[i]);
+}
+
+void Histogram::Reset() {
+  count_ = 0;
+  sum_ = 0;
+  max_ = 0;
+  for (int i = 0; i < kBuckets; ++i)
+    buckets_[i] = 0;
+}
+
+uint32 Histogram::Snapshot::Percentile(double fraction) const {
+  uint32 target = static_cast<uint32>(fraction * count);
+  uint32 seen = 0;
+  for (int i = 0; i < kBuckets; ++i) {
+    seen += buckets[i];
+    if (seen > target || (seen == count && seen)) {
+      // The top of bucket i, but never past the largest value seen.
+      uint32 top = (i == 0) ? 0 : (i == 32) ? 0xFFFFFFFF : (1u << i) - 1;
+      return _min(top, max);
+    }
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------
+// DispatchStats
+
+DispatchStats::DispatchStats()
+    : slots_(new Slot[kSlots]), untracked_(0) {
+  for (int i = 0; i < kSlots; ++i) {
+    slots_[i].key = 0;
+    slots_[i].type = NULL;
+    slots_[i].message_id = 0;
+  }
+}
+
+DispatchStats::~DispatchStats() {
+  delete [] slots_;
+}
+
+DispatchStats::Slot* DispatchStats::FindSlot(const char* type,
+                                             uint32 message_id) {
+  uint64 key = (static_cast<uint64>(reinterpret_cast<size_t>(type)) << 16 ^
+                message_id) * UINT64_C(0x9E3779B97F4A7C15) | 1;
+  for (int i = 0; i < kMaxProbes; ++i) {
+    Slot* slot = &slots_[(key >> 32 ^ i) % kSlots];
+    uint64 current = AtomicOps::AcquireLoad(&slot->key);
+    if (current == key)
+      return slot;
+    if (current == 0 && AtomicOps::CompareAndSwap(&slot->key, 0, key)) {
+      slot->message_id = message_id;
+      AtomicOps::ReleaseStorePtr(&slot->type, type);
+      return slot;
+    }
+    // Lost the race for the slot, possibly to the same key.
+    if (AtomicOps::AcquireLoad(&slot->key) == key)
+      return slot;
+  }
+  return NULL;
+}
+
+void DispatchStats::Record(const char* type, uint32 message_id, uint32 depth,
+                           int32 latency, uint32 run) {
+  depth_.Add(depth);
+  run_.Add(run);
+  if (latency >= 0)
+    latency_.Add(latency);
+  Slot* slot = FindSlot(type, message_id);
+  if (!slot) {
+    AtomicOps::Increment(&untracked_);
+    return;
+  }
+  slot->run.Add(run);
+  if (latency >= 0)
+    slot->latency.Add(latency);
+}
+
+void DispatchStats::GetSnapshot(Snapshot* snapshot) const {
+  depth_.GetSnapshot(&snapshot->depth);
+  latency_.GetSnapshot(&snapshot->latency);
+  run_.GetSnapshot(&snapshot->run);
+  snapshot->untracked = AtomicOps::AcquireLoad(&untracked_);
+  snapshot->handlers.clear();
+  for (int i = 0; i < kSlots; ++i) {
+    const char* type = AtomicOps::AcquireLoadPtr(&slots_[i].type);
+    if (!type)
+      continue;
+    snapshot->handlers.push_back(HandlerSnapshot());
+    HandlerSnapshot& handler = snapshot->handlers.back();
+    handler.type = type;
+    handler.message_id = slots_[i].message_id;
+    slots_[i].latency.GetSnapshot(&handler.latency);
+    slots_[i].run.GetSnapshot(&handler.run);
+  }
+}
+
+void DispatchStats::Reset() {
+  depth_.Reset();
+  latency_.Reset();
+  run_.Reset();
+  untracked_ = 0;
+  for (int i = 0; i < kSlots; ++i) {
+    slots_[i].latency.Reset();
+    slots_[i].run.Reset();
+  }
+}
+
+}  // namespace txmpp
@@ -0,0 +1,137 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_DISPATCHSTATS_H_
+#define _TXMPP_DISPATCHSTATS_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+
+namespace txmpp {
+
+// Counts of values in power-of-two buckets: bucket 0 holds 0, and bucket i
+// holds [2^(i-1), 2^i).  Add is lock-free, so that any thread may record
+// while another takes a snapshot.
+class Histogram {
+ public:
+  enum { kBuckets = 33 };
+
+  struct Snapshot {
+    uint32 count;
+    uint64 sum;
+    uint32 max;
+    uint32 buckets[kBuckets];
+
+    // An upper bound of the values below which |fraction| of them fall.
+    uint32 Percentile(double fraction) const;
+    uint32 Mean() const {
+      return count ? static_cast<uint32>(sum / count) : 0;
+    }
+  };
+
+  Histogram();
+
+  void Add(uint32 value);
+  void GetSnapshot(Snapshot* snapshot) const;
+  // Not atomic: values recorded meanwhile may be partly kept.
+  void Reset();
+
+ private:
+  volatile int count_;
+  volatile uint64 sum_;
+  volatile uint64 max_;
+  volatile int buckets_[kBuckets];
+
+  DISALLOW_EVIL_CONSTRUCTORS(Histogram);
+};
+
+// Dispatch statistics of a MessageQueue, enabled by passing one to
+// MessageQueue::SetDispatchStats.  Records, for each dispatched message, the
+// number of posted messages still waiting, the microseconds from the post
+// (or a delayed message's due time) to the dispatch, and the microseconds
+// the handler ran, overall and per handler type and message id.
+class DispatchStats {
+ public:
+  struct HandlerSnapshot {
+    std::string type;  // As given by typeid; mangled with GCC.
+    uint32 message_id;
+    Histogram::Snapshot latency;
+    Histogram::Snapshot run;
+  };
+
+  struct Snapshot {
+    Histogram::Snapshot depth;
+    Histogram::Snapshot latency;
+    Histogram::Snapshot run;
+    std::vector<HandlerSnapshot> handlers;
+    // Dispatches only counted overall, for lack of a handler slot.
+    uint32 untracked;
+  };
+
+  DispatchStats();
+  ~DispatchStats();
+
+  // |latency| is negative if the message was posted before the stats were
+  // enabled.  |type| must be a string that lives forever.
+  void Record(const char* type, uint32 message_id, uint32 depth,
+              int32 latency, uint32 run);
+
+  void GetSnapshot(Snapshot* snapshot) const;
+  void Reset();
+
+ private:
+  enum { kSlots = 256, kMaxProbes = 16 };
+
+  struct Slot {
+    volatile uint64 key;  // 0 while free.
+    const char* volatile type;
+    uint32 message_id;
+    Histogram latency;
+    Histogram run;
+  };
+
+  Slot* FindSlot(const char* type, uint32 message_id);
+
+  Histogram depth_;
+  Histogram latency_;
+  Histogram run_;
+  Slot* slots_;
+  volatile int untracked_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(DispatchStats);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_DISPATCHSTATS_H_
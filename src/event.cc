@@ -29,6 +29,14 @@
 
 #if defined(WIN32)
 #include <windows.h>
+#elif defined(LINUX)
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "criticalsection.h"
+#include "time.h"
 #elif defined(POSIX)
 #include <pthread.h>
 #include <sys/time.h>
@@ -43,6 +51,7 @@ namespace txmpp {
 
 Event::Event(bool manual_reset, bool initially_signaled)
     : is_manual_reset_(manual_reset),
+      spin_count_(0),
       is_initially_signaled_(initially_signaled),
       event_handle_(NULL) {
 }
@@ -90,10 +99,97 @@ bool Event::Wait(int cms) {
     return (WaitForSingleObject(event_handle_, ms) == WAIT_OBJECT_0);
 }
 
+#elif defined(LINUX)
+
+static void Event_Pause() {
+#if defined(__i386__) || defined(__x86_64__)
+  __asm__ __volatile__("pause" ::: "memory");
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield" ::: "memory");
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+Event::Event(bool manual_reset, bool initially_signaled)
+    : is_manual_reset_(manual_reset),
+      spin_count_(0),
+      state_(initially_signaled ? kSignaled : kUnsignaled) {
+}
+
+bool Event::EnsureInitialized() {
+  return true;
+}
+
+Event::~Event() {
+}
+
+bool Event::Set() {
+  // Only a waiter that found the event unsignaled and marked it kWaiters
+  // can be blocked, so otherwise this stays out of the kernel.
+  if (AtomicOps::Exchange(&state_, kSignaled) == kWaiters) {
+    syscall(SYS_futex, &state_, FUTEX_WAKE_PRIVATE,
+            is_manual_reset_ ? INT_MAX : 1, NULL, NULL, 0);
+  }
+  return true;
+}
+
+bool Event::Reset() {
+  // Any waiters are left marked.
+  AtomicOps::CompareAndSwap(&state_, kSignaled, kUnsignaled);
+  return true;
+}
+
+bool Event::Wait(int cms) {
+  int64 deadline = 0;
+  if (cms != kForever && cms != 0)
+    deadline = TimeMillis() + cms;
+  int spins = spin_count_;
+  // Once a waiter has blocked, it consumes an auto-reset signal by leaving
+  // the event kWaiters, as others may still be blocked behind it.
+  bool blocked = false;
+  while (true) {
+    int state = AtomicOps::AcquireLoad(&state_);
+    if (state == kSignaled) {
+      if (is_manual_reset_ ||
+          AtomicOps::CompareAndSwap(&state_, kSignaled,
+                                    blocked ? kWaiters : kUnsignaled))
+        return true;
+      continue;
+    }
+    if (cms == 0)
+      return false;
+    if (spins > 0) {
+      --spins;
+      Event_Pause();
+      continue;
+    }
+    if (state == kUnsignaled &&
+        !AtomicOps::CompareAndSwap(&state_, kUnsignaled, kWaiters))
+      continue;
+
+    struct timespec ts;
+    struct timespec* timeout = NULL;
+    if (cms != kForever) {
+      int64 left = deadline - TimeMillis();
+      if (left <= 0)
+        return false;
+      ts.tv_sec = static_cast<time_t>(left / 1000);
+      ts.tv_nsec = static_cast<long>(left % 1000) * 1000000;
+      timeout = &ts;
+    }
+    // Returns at once if the event is no longer kWaiters.
+    syscall(SYS_futex, &state_, FUTEX_WAIT_PRIVATE, kWaiters, timeout,
+            NULL, 0);
+    blocked = true;
+  }
+}
+
 #elif defined(POSIX)
 
 Event::Event(bool manual_reset, bool initially_signaled)
     : is_manual_reset_(manual_reset),
+      spin_count_(0),
       event_status_(initially_signaled),
       event_mutex_initialized_(false),
       event_cond_initialized_(false) {
@@ -53,14 +53,25 @@ class Event {
   bool Reset();
   bool Wait(int cms);
 
+  // Makes Wait check the event |count| times, pausing in between, before it
+  // blocks, for handoffs that are expected to be quick.  0, the default,
+  // blocks at once.  It only spins on Linux.
+  void SetSpinCount(int count) { spin_count_ = count; }
+
  private:
   bool EnsureInitialized();
 
   bool is_manual_reset_;
+  int spin_count_;
 
 #if defined(WIN32)
   bool is_initially_signaled_;
   HANDLE event_handle_;
+#elif defined(LINUX)
+  // A futex word: kUnsignaled, kSignaled, or kWaiters, unsignaled with
+  // waiters that may be blocked, which only then Set wakes.
+  enum { kUnsignaled = 0, kSignaled = 1, kWaiters = 2 };
+  volatile int state_;
 #elif defined(POSIX)
   bool event_status_;
   bool event_mutex_initialized_;
@@ -98,10 +98,6 @@ void XmppPump::WakeTasks() {
   txmpp::Thread::Current()->Post(this);
 }
 
-int64 XmppPump::CurrentTime() {
-  return (int64)txmpp::Time();
-}
-
 void XmppPump::OnMessage(txmpp::Message *pmsg) {
   RunTasks();
 }
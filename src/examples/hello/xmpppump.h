@@ -50,8 +50,6 @@ class XmppPump : public txmpp::MessageHandler, public txmpp::TaskRunner {
 
     txmpp::XmppClient *client() { return client_; }
     txmpp::XmppReturnStatus SendStanza(const txmpp::XmlElement *stanza);
-    int64 CurrentTime();
-
     void DoLogin(const txmpp::XmppClientSettings & xcs,
                  txmpp::XmppAsyncSocket* socket,
                  txmpp::PreXmppAuth* auth);
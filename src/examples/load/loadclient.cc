@@ -0,0 +1,207 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "loadclient.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../constants.h"
+#include "../../helpers.h"
+#include "../../logging.h"
+#include "../../prexmppauthimpl.h"
+#include "../../scoped_ptr.h"
+#include "../../thread.h"
+#include "../../time.h"
+#include "../../xmlelement.h"
+#include "../../xmppasyncsocketimpl.h"
+#include "../../xmpptask.h"
+
+namespace load {
+
+namespace {
+
+const uint32 MSG_WAKE_TASKS = 1;
+const uint32 MSG_SEND_NEXT = 2;
+
+const txmpp::QName QN_PING("urn:xmpp:ping", "ping");
+
+// Ids of the stanzas that are timed are the prefix and the send time in
+// microseconds.
+const char kMessageIdPrefix[] = "ldm";
+const char kIqIdPrefix[] = "ldi";
+const size_t kIdPrefixLength = 3;
+
+std::string LoadClient_MakeId(const char* prefix) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%s%llu", prefix,
+           static_cast<unsigned long long>(txmpp::TimeMicros()));
+  return buffer;
+}
+
+}  // namespace
+
+// Takes the replies to the timed stanzas, as soon as they are dispatched
+// rather than through the task queue, so that the round trip doesn't
+// include the wait for the task to run.
+class LoadClient::ReplyTask : public txmpp::XmppTask {
+ public:
+  ReplyTask(txmpp::TaskParent* parent, LoadStats* stats)
+      : txmpp::XmppTask(parent, txmpp::XmppEngine::HL_TYPE), stats_(stats) {}
+
+  virtual int ProcessStart() { return STATE_BLOCKED; }
+
+  virtual bool HandleStanza(const txmpp::XmlElement* stanza) {
+    const std::string& id = stanza->Attr(txmpp::QN_ID);
+    if (id.size() <= kIdPrefixLength)
+      return false;
+    LoadStats::Sample sample;
+    if (id.compare(0, kIdPrefixLength, kMessageIdPrefix) == 0 &&
+        stanza->Name() == txmpp::QN_MESSAGE) {
+      sample = LoadStats::MESSAGE_RTT_US;
+    } else if (id.compare(0, kIdPrefixLength, kIqIdPrefix) == 0 &&
+               stanza->Name() == txmpp::QN_IQ) {
+      if (stanza->Attr(txmpp::QN_TYPE) == txmpp::STR_ERROR) {
+        stats_->Increment(LoadStats::IQ_ERRORS);
+        return true;
+      }
+      sample = LoadStats::IQ_RTT_US;
+    } else {
+      return false;
+    }
+    uint64 sent = strtoull(id.c_str() + kIdPrefixLength, NULL, 10);
+    stats_->AddSample(sample,
+                      static_cast<uint32>(txmpp::TimeMicros() - sent));
+    return true;
+  }
+
+ private:
+  LoadStats* stats_;
+};
+
+LoadClient::LoadClient(const LoadMix& mix, LoadStats* stats)
+    : mix_(mix),
+      stats_(stats),
+      state_(txmpp::XmppEngine::STATE_NONE),
+      login_start_(0),
+      body_(mix.body_size, 'x') {
+  client_ = new txmpp::XmppClient(this);  // NOTE: deleted by TaskRunner
+  client_->SignalStateChange.connect(this, &LoadClient::OnStateChange);
+}
+
+LoadClient::~LoadClient() {
+  txmpp::Thread::Current()->Clear(this);
+}
+
+void LoadClient::Login(const txmpp::XmppClientSettings& xcs) {
+  login_start_ = txmpp::Time();
+  if (client_->Connect(xcs, "", new txmpp::XmppAsyncSocketImpl(true),
+                       new txmpp::PreXmppAuthImpl()) !=
+      txmpp::XMPP_RETURN_OK) {
+    LOG(LS_ERROR) << "Failed to connect.";
+    stats_->Increment(LoadStats::LOGIN_FAILURES);
+    return;
+  }
+  client_->Start();
+}
+
+void LoadClient::Disconnect() {
+  txmpp::Thread::Current()->Clear(this, MSG_SEND_NEXT);
+  if (!AllChildrenDone())
+    client_->Disconnect();
+}
+
+void LoadClient::WakeTasks() {
+  txmpp::Thread::Current()->Post(this, MSG_WAKE_TASKS);
+}
+
+void LoadClient::OnMessage(txmpp::Message* msg) {
+  switch (msg->message_id) {
+    case MSG_WAKE_TASKS:
+      RunTasks();
+      break;
+    case MSG_SEND_NEXT:
+      SendNext();
+      break;
+  }
+}
+
+void LoadClient::OnStateChange(txmpp::XmppEngine::State state) {
+  if (state == state_)
+    return;
+  txmpp::XmppEngine::State previous = state_;
+  state_ = state;
+  if (state == txmpp::XmppEngine::STATE_OPEN) {
+    stats_->Increment(LoadStats::LOGINS);
+    stats_->AddSample(LoadStats::LOGIN_MS,
+                      txmpp::TimeSince(login_start_));
+    (new ReplyTask(client_, stats_))->Start();
+    // Spread the clients' sends over the interval, so that clients which
+    // logged in together don't send together.
+    txmpp::Thread::Current()->PostDelayed(
+        txmpp::CreateRandomId() % mix_.interval_ms + 1, this, MSG_SEND_NEXT);
+  } else if (state == txmpp::XmppEngine::STATE_CLOSED) {
+    txmpp::Thread::Current()->Clear(this, MSG_SEND_NEXT);
+    if (previous == txmpp::XmppEngine::STATE_OPEN)
+      stats_->Increment(LoadStats::DISCONNECTS);
+    else
+      stats_->Increment(LoadStats::LOGIN_FAILURES);
+  }
+}
+
+void LoadClient::SendNext() {
+  if (!open())
+    return;
+  int total = mix_.message_weight + mix_.presence_weight + mix_.iq_weight;
+  int pick = total > 0 ? static_cast<int>(txmpp::CreateRandomId() % total) : 0;
+  if (pick < mix_.message_weight) {
+    txmpp::XmlElement message(txmpp::QN_MESSAGE);
+    message.SetAttr(txmpp::QN_TO, client_->jid().Str());
+    message.SetAttr(txmpp::QN_ID, LoadClient_MakeId(kMessageIdPrefix));
+    txmpp::XmlElement* body = new txmpp::XmlElement(txmpp::QN_BODY);
+    body->SetBodyText(body_);
+    message.AddElement(body);
+    client_->SendStanza(&message);
+    stats_->Increment(LoadStats::MESSAGES_SENT);
+  } else if (pick < mix_.message_weight + mix_.presence_weight) {
+    txmpp::XmlElement presence(txmpp::QN_PRESENCE);
+    client_->SendStanza(&presence);
+    stats_->Increment(LoadStats::PRESENCES_SENT);
+  } else {
+    txmpp::XmlElement iq(txmpp::QN_IQ);
+    iq.SetAttr(txmpp::QN_TYPE, txmpp::STR_GET);
+    iq.SetAttr(txmpp::QN_TO, client_->jid().domain());
+    iq.SetAttr(txmpp::QN_ID, LoadClient_MakeId(kIqIdPrefix));
+    iq.AddElement(new txmpp::XmlElement(QN_PING, true));
+    client_->SendStanza(&iq);
+    stats_->Increment(LoadStats::IQS_SENT);
+  }
+  txmpp::Thread::Current()->PostDelayed(mix_.interval_ms, this,
+                                        MSG_SEND_NEXT);
+}
+
+}  // namespace load
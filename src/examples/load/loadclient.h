@@ -0,0 +1,91 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LOAD_LOADCLIENT_H_
+#define _LOAD_LOADCLIENT_H_
+
+#include <string>
+
+#include "../../messagehandler.h"
+#include "../../taskrunner.h"
+#include "../../xmppclient.h"
+#include "../../xmppclientsettings.h"
+#include "../../xmppengine.h"
+#include "loadstats.h"
+
+namespace load {
+
+// What each client sends once it is logged in.  Every interval one stanza
+// is picked at random, with odds given by the weights: a message to the
+// client's own full JID, which the server routes back to it; an available
+// presence; or a XEP-0199 ping to the server.  Messages and pings carry
+// their send time in their id, so the reply gives the round trip.
+struct LoadMix {
+  LoadMix()
+      : message_weight(8), presence_weight(1), iq_weight(1),
+        interval_ms(1000), body_size(64) {}
+
+  int message_weight;
+  int presence_weight;
+  int iq_weight;
+  int interval_ms;
+  size_t body_size;
+};
+
+// One simulated user.  It is the TaskRunner for its XmppClient, as
+// hello::XmppPump is, and must be created, used and deleted on the thread
+// whose socket server carries its connection.
+class LoadClient : public txmpp::MessageHandler, public txmpp::TaskRunner {
+ public:
+  LoadClient(const LoadMix& mix, LoadStats* stats);
+  virtual ~LoadClient();
+
+  void Login(const txmpp::XmppClientSettings& xcs);
+  void Disconnect();
+
+  bool open() const { return state_ == txmpp::XmppEngine::STATE_OPEN; }
+
+  virtual void WakeTasks();
+  virtual void OnMessage(txmpp::Message* msg);
+
+ private:
+  class ReplyTask;
+
+  void OnStateChange(txmpp::XmppEngine::State state);
+  void SendNext();
+
+  LoadMix mix_;
+  LoadStats* stats_;
+  txmpp::XmppClient* client_;
+  txmpp::XmppEngine::State state_;
+  uint32 login_start_;
+  std::string body_;
+};
+
+}  // namespace load
+
+#endif  // _LOAD_LOADCLIENT_H_
@@ -0,0 +1,147 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "loadstats.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+#ifdef POSIX
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+namespace load {
+
+static const char* const kSampleNames[LoadStats::SAMPLE_COUNT] = {
+  "login (ms)",
+  "message rtt (us)",
+  "iq rtt (us)",
+};
+
+static const char* const kCounterNames[LoadStats::COUNTER_COUNT] = {
+  "logins",
+  "login failures",
+  "disconnects",
+  "messages sent",
+  "presences sent",
+  "iqs sent",
+  "iq errors",
+};
+
+LoadStats::LoadStats() {
+  for (int i = 0; i < COUNTER_COUNT; ++i)
+    counters_[i] = 0;
+}
+
+void LoadStats::AddSample(Sample sample, uint32 value) {
+  txmpp::CritScope cs(&crit_);
+  samples_[sample].push_back(value);
+}
+
+void LoadStats::Increment(Counter counter) {
+  txmpp::CritScope cs(&crit_);
+  ++counters_[counter];
+}
+
+int LoadStats::Get(Counter counter) {
+  txmpp::CritScope cs(&crit_);
+  return counters_[counter];
+}
+
+void LoadStats::Reset(bool logins) {
+  txmpp::CritScope cs(&crit_);
+  for (int i = 0; i < SAMPLE_COUNT; ++i) {
+    if (i != LOGIN_MS || logins)
+      samples_[i].clear();
+  }
+  for (int i = 0; i < COUNTER_COUNT; ++i) {
+    if ((i != LOGINS && i != LOGIN_FAILURES) || logins)
+      counters_[i] = 0;
+  }
+}
+
+static uint32 LoadStats_Percentile(const std::vector<uint32>& sorted,
+                                   double fraction) {
+  size_t index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+  return sorted[index];
+}
+
+void LoadStats::Print() {
+  txmpp::CritScope cs(&crit_);
+  printf("%-18s %8s %10s %10s %10s %10s %10s %10s\n", "sample", "count",
+         "mean", "p50", "p90", "p99", "p99.9", "max");
+  for (int i = 0; i < SAMPLE_COUNT; ++i) {
+    std::vector<uint32>& samples = samples_[i];
+    if (samples.empty()) {
+      printf("%-18s %8d\n", kSampleNames[i], 0);
+      continue;
+    }
+    std::sort(samples.begin(), samples.end());
+    double total = 0;
+    for (size_t j = 0; j < samples.size(); ++j)
+      total += samples[j];
+    printf("%-18s %8lu %10.0f %10u %10u %10u %10u %10u\n", kSampleNames[i],
+           static_cast<unsigned long>(samples.size()), total / samples.size(),
+           LoadStats_Percentile(samples, 0.5),
+           LoadStats_Percentile(samples, 0.9),
+           LoadStats_Percentile(samples, 0.99),
+           LoadStats_Percentile(samples, 0.999), samples.back());
+  }
+  for (int i = 0; i < COUNTER_COUNT; ++i)
+    printf("%-18s %8d\n", kCounterNames[i], counters_[i]);
+}
+
+ProcessUsage ProcessUsage::Now() {
+  ProcessUsage usage;
+  usage.cpu_us = 0;
+  usage.rss_bytes = 0;
+#ifdef POSIX
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0) {
+    usage.cpu_us =
+        static_cast<uint64>(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+        ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+  }
+#ifdef LINUX
+  // The current resident size; ru_maxrss only ever grows.
+  FILE* file = fopen("/proc/self/statm", "r");
+  if (file) {
+    unsigned long size = 0, resident = 0;
+    if (fscanf(file, "%lu %lu", &size, &resident) == 2)
+      usage.rss_bytes = static_cast<uint64>(resident) * sysconf(_SC_PAGESIZE);
+    fclose(file);
+  }
+#else
+  usage.rss_bytes = static_cast<uint64>(ru.ru_maxrss);
+#endif
+#endif
+  return usage;
+}
+
+}  // namespace load
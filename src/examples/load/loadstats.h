@@ -0,0 +1,92 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LOAD_LOADSTATS_H_
+#define _LOAD_LOADSTATS_H_
+
+#include <string>
+#include <vector>
+
+#include "../../basictypes.h"
+#include "../../criticalsection.h"
+
+namespace load {
+
+// Samples and counters shared by the clients on every reactor thread.
+class LoadStats {
+ public:
+  enum Sample {
+    LOGIN_MS,
+    MESSAGE_RTT_US,
+    IQ_RTT_US,
+    SAMPLE_COUNT,
+  };
+
+  enum Counter {
+    LOGINS,
+    LOGIN_FAILURES,
+    DISCONNECTS,
+    MESSAGES_SENT,
+    PRESENCES_SENT,
+    IQS_SENT,
+    IQ_ERRORS,
+    COUNTER_COUNT,
+  };
+
+  LoadStats();
+
+  void AddSample(Sample sample, uint32 value);
+  void Increment(Counter counter);
+  int Get(Counter counter);
+
+  // Drops the samples and counters gathered so far, as when the measured
+  // phase starts after all the clients have logged in.  Login samples are
+  // kept unless |logins| is true.
+  void Reset(bool logins);
+
+  // Writes the count, mean and percentiles of each sample, and the
+  // counters, to stdout.
+  void Print();
+
+ private:
+  txmpp::CriticalSection crit_;
+  std::vector<uint32> samples_[SAMPLE_COUNT];
+  int counters_[COUNTER_COUNT];
+};
+
+// Process CPU time and resident set size, for dividing by the number of
+// connections.
+struct ProcessUsage {
+  uint64 cpu_us;
+  uint64 rss_bytes;
+
+  static ProcessUsage Now();
+};
+
+}  // namespace load
+
+#endif  // _LOAD_LOADSTATS_H_
@@ -0,0 +1,277 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Logs in many clients against one server and drives a mix of stanzas
+// through them, as a baseline to compare library versions by.  Clients are
+// spread over reactor threads, each with its own socket server.  Reports
+// the login time and round-trip distributions, and the CPU time and
+// resident memory each connection costs.
+//
+//   load-example --server=HOST[:PORT] --domain=DOMAIN [--clients=N]
+//       [--threads=N] [--login-rate=N] [--duration=SECONDS]
+//       [--user-prefix=PREFIX] [--first=N] [--password=PASSWORD]
+//       [--interval-ms=N] [--message-weight=N] [--presence-weight=N]
+//       [--iq-weight=N] [--body-size=N] [--no-tls]
+//
+// Users are PREFIX<first> to PREFIX<first + clients - 1>, and all share
+// the password.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "../../cryptstring.h"
+#include "../../logging.h"
+#include "../../messagehandler.h"
+#include "../../scoped_ptr.h"
+#include "../../socketaddress.h"
+#include "../../thread.h"
+#include "../../time.h"
+#include "../../xmppclientsettings.h"
+#include "loadclient.h"
+#include "loadstats.h"
+
+namespace load {
+
+namespace {
+
+const uint32 MSG_LOGIN = 1;
+const uint32 MSG_CLOSE = 2;
+
+struct LoginData : public txmpp::MessageData {
+  explicit LoginData(const txmpp::XmppClientSettings& s) : xcs(s) {}
+  txmpp::XmppClientSettings xcs;
+};
+
+// The clients on one reactor thread.
+class LoadShard : public txmpp::MessageHandler {
+ public:
+  LoadShard(const LoadMix& mix, LoadStats* stats)
+      : mix_(mix), stats_(stats) {
+    thread_.Start();
+  }
+
+  ~LoadShard() {
+    thread_.Send(this, MSG_CLOSE);
+    thread_.Stop();
+  }
+
+  void Login(const txmpp::XmppClientSettings& xcs) {
+    thread_.Post(this, MSG_LOGIN, new LoginData(xcs));
+  }
+
+  virtual void OnMessage(txmpp::Message* msg) {
+    switch (msg->message_id) {
+      case MSG_LOGIN: {
+        LoginData* data = static_cast<LoginData*>(msg->pdata);
+        LoadClient* client = new LoadClient(mix_, stats_);
+        clients_.push_back(client);
+        client->Login(data->xcs);
+        delete data;
+        }
+        break;
+      case MSG_CLOSE:
+        for (size_t i = 0; i < clients_.size(); ++i)
+          clients_[i]->Disconnect();
+        for (size_t i = 0; i < clients_.size(); ++i)
+          delete clients_[i];
+        clients_.clear();
+        break;
+    }
+  }
+
+ private:
+  txmpp::Thread thread_;
+  LoadMix mix_;
+  LoadStats* stats_;
+  std::vector<LoadClient*> clients_;
+};
+
+bool Load_Option(const char* arg, const char* name, const char** value) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) != 0 || arg[length] != '=')
+    return false;
+  *value = arg + length + 1;
+  return true;
+}
+
+void Load_Usage(const char* program) {
+  fprintf(stderr,
+          "usage: %s --server=HOST[:PORT] --domain=DOMAIN [--clients=N]\n"
+          "    [--threads=N] [--login-rate=N] [--duration=SECONDS]\n"
+          "    [--user-prefix=PREFIX] [--first=N] [--password=PASSWORD]\n"
+          "    [--interval-ms=N] [--message-weight=N] [--presence-weight=N]\n"
+          "    [--iq-weight=N] [--body-size=N] [--no-tls]\n", program);
+}
+
+void Load_PrintUsage(const char* phase, const ProcessUsage& start,
+                     const ProcessUsage& end, int connections,
+                     uint32 elapsed_ms) {
+  if (connections <= 0 || elapsed_ms == 0)
+    return;
+  double cpu_us = static_cast<double>(end.cpu_us - start.cpu_us);
+  printf("%s: %d connections in %u ms, %.1f%% cpu, "
+         "%.1f us cpu/connection/s", phase, connections, elapsed_ms,
+         cpu_us / (elapsed_ms * 10.0),
+         cpu_us / connections / (elapsed_ms / 1000.0));
+  if (end.rss_bytes >= start.rss_bytes) {
+    printf(", %.1f KB rss/connection",
+           (end.rss_bytes - start.rss_bytes) / 1024.0 / connections);
+  }
+  printf("\n");
+}
+
+}  // namespace
+
+}  // namespace load
+
+int main(int argc, char* argv[]) {
+  std::string server;
+  std::string domain;
+  std::string user_prefix = "load";
+  std::string password = "test";
+  int clients = 100;
+  int threads = 0;
+  int login_rate = 100;
+  int duration = 30;
+  int first = 1;
+  bool tls = true;
+  load::LoadMix mix;
+
+  for (int i = 1; i < argc; ++i) {
+    const char* value;
+    if (load::Load_Option(argv[i], "--server", &value)) {
+      server = value;
+    } else if (load::Load_Option(argv[i], "--domain", &value)) {
+      domain = value;
+    } else if (load::Load_Option(argv[i], "--user-prefix", &value)) {
+      user_prefix = value;
+    } else if (load::Load_Option(argv[i], "--password", &value)) {
+      password = value;
+    } else if (load::Load_Option(argv[i], "--clients", &value)) {
+      clients = atoi(value);
+    } else if (load::Load_Option(argv[i], "--threads", &value)) {
+      threads = atoi(value);
+    } else if (load::Load_Option(argv[i], "--login-rate", &value)) {
+      login_rate = atoi(value);
+    } else if (load::Load_Option(argv[i], "--duration", &value)) {
+      duration = atoi(value);
+    } else if (load::Load_Option(argv[i], "--first", &value)) {
+      first = atoi(value);
+    } else if (load::Load_Option(argv[i], "--interval-ms", &value)) {
+      mix.interval_ms = atoi(value);
+    } else if (load::Load_Option(argv[i], "--message-weight", &value)) {
+      mix.message_weight = atoi(value);
+    } else if (load::Load_Option(argv[i], "--presence-weight", &value)) {
+      mix.presence_weight = atoi(value);
+    } else if (load::Load_Option(argv[i], "--iq-weight", &value)) {
+      mix.iq_weight = atoi(value);
+    } else if (load::Load_Option(argv[i], "--body-size", &value)) {
+      mix.body_size = strtoul(value, NULL, 10);
+    } else if (strcmp(argv[i], "--no-tls") == 0) {
+      tls = false;
+    } else {
+      load::Load_Usage(argv[0]);
+      return 1;
+    }
+  }
+  if (server.empty() || domain.empty() || clients <= 0 ||
+      mix.interval_ms <= 0) {
+    load::Load_Usage(argv[0]);
+    return 1;
+  }
+  if (threads <= 0)
+    threads = 4;
+  if (login_rate <= 0)
+    login_rate = clients;
+
+  txmpp::LogMessage::LogToDebug(txmpp::LS_ERROR);
+
+  txmpp::SocketAddress address;
+  address.FromString(server);
+  if (address.port() == 0)
+    address.SetPort(5222);
+
+  txmpp::InsecureCryptStringImpl secret;
+  secret.password() = password;
+
+  load::LoadStats stats;
+  std::vector<load::LoadShard*> shards;
+  for (int i = 0; i < threads; ++i)
+    shards.push_back(new load::LoadShard(mix, &stats));
+
+  // Logins are paced at |login_rate| a second, in steps of 10 ms.
+  load::ProcessUsage start = load::ProcessUsage::Now();
+  uint32 start_ms = txmpp::Time();
+  for (int i = 0; i < clients; ++i) {
+    int due_ms = static_cast<int>(static_cast<int64>(i) * 1000 / login_rate);
+    int wait_ms = due_ms - txmpp::TimeSince(start_ms);
+    if (wait_ms >= 10)
+      txmpp::Thread::SleepMs(wait_ms);
+    char user[64];
+    snprintf(user, sizeof(user), "%s%d", user_prefix.c_str(), first + i);
+    txmpp::XmppClientSettings xcs;
+    xcs.set_user(user);
+    xcs.set_pass(txmpp::CryptString(secret));
+    xcs.set_host(domain);
+    xcs.set_resource("load");
+    xcs.set_use_tls(tls);
+    xcs.set_server(address);
+    shards[i % threads]->Login(xcs);
+  }
+
+  // Waits for every login to finish, or to have had 30 s.
+  int settled = 0;
+  for (;;) {
+    settled = stats.Get(load::LoadStats::LOGINS) +
+              stats.Get(load::LoadStats::LOGIN_FAILURES);
+    if (settled >= clients || txmpp::TimeSince(start_ms) >
+        clients * 1000 / login_rate + 30000)
+      break;
+    txmpp::Thread::SleepMs(100);
+  }
+  int connections = stats.Get(load::LoadStats::LOGINS);
+  load::ProcessUsage logged_in = load::ProcessUsage::Now();
+  load::Load_PrintUsage("login", start, logged_in, connections,
+                        txmpp::TimeSince(start_ms));
+
+  // The measured phase leaves out the login traffic.
+  stats.Reset(false);
+  uint32 steady_ms = txmpp::Time();
+  txmpp::Thread::SleepMs(duration * 1000);
+  load::ProcessUsage end = load::ProcessUsage::Now();
+  load::Load_PrintUsage("steady", logged_in, end, connections,
+                        txmpp::TimeSince(steady_ms));
+  stats.Print();
+
+  for (size_t i = 0; i < shards.size(); ++i)
+    delete shards[i];
+  return 0;
+}
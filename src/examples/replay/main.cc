@@ -0,0 +1,101 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Replays the input of a connection captured by XmppCaptureTap into a new
+// engine, as fast as it will go or at the captured pace, and reports what
+// parsing and dispatching it cost.  With --repeat, the input is replayed
+// that many times over, for perf or flame graphs.
+//
+//   replay-example CAPTURE [--connection=N] [--paced] [--repeat=N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include "../../stream.h"
+#include "../../xmppreplay.h"
+
+int main(int argc, char* argv[]) {
+  const char* path = NULL;
+  uint32 connection = txmpp::XmppReplay::kFirstConnection;
+  bool paced = false;
+  int repeat = 1;
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--connection=", 13) == 0) {
+      connection = strtoul(argv[i] + 13, NULL, 10);
+    } else if (strcmp(argv[i], "--paced") == 0) {
+      paced = true;
+    } else if (strncmp(argv[i], "--repeat=", 9) == 0) {
+      repeat = atoi(argv[i] + 9);
+    } else if (argv[i][0] != '-' && !path) {
+      path = argv[i];
+    } else {
+      path = NULL;
+      break;
+    }
+  }
+  if (!path || repeat < 1) {
+    fprintf(stderr, "usage: %s CAPTURE [--connection=N] [--paced] "
+            "[--repeat=N]\n", argv[0]);
+    return 1;
+  }
+
+  txmpp::FileStream file;
+  txmpp::XmppReplay replay;
+  if (!file.Open(path, "rb") || !replay.Load(&file, connection)) {
+    fprintf(stderr, "%s: can't read a connection's input from %s\n",
+            argv[0], path);
+    return 1;
+  }
+
+  txmpp::XmppReplay::Stats stats;
+  for (int i = 0; i < repeat; ++i) {
+    if (!replay.Run(paced, &stats)) {
+      fprintf(stderr, "%s: the engine failed on the captured input\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  printf("inputs      %lu\n", static_cast<unsigned long>(stats.inputs));
+  printf("bytes       %lu\n", static_cast<unsigned long>(stats.bytes));
+  printf("stanzas     %lu\n", static_cast<unsigned long>(stats.stanzas));
+  printf("total       %.3f ms\n", stats.elapsed_us / 1000.0);
+  if (stats.stanzas) {
+    printf("per stanza  %.2f us\n",
+           static_cast<double>(stats.elapsed_us) / stats.stanzas);
+  }
+  if (stats.elapsed_us) {
+    printf("throughput  %.1f MB/s\n",
+           static_cast<double>(stats.bytes) / stats.elapsed_us);
+  }
+  printf("max input   %lu us\n",
+         static_cast<unsigned long>(stats.max_input_us));
+  return 0;
+}
@@ -0,0 +1,579 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "hpack.h"
+
+#include <string.h>
+
+#include "common.h"
+
+namespace txmpp {
+
+namespace {
+
+struct HpackStaticEntry {
+  const char* name;
+  const char* value;
+};
+
+// The static table (RFC 7541 Appendix A), in index order from 1.
+const HpackStaticEntry kStaticTable[] = {
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" },
+};
+
+// The Huffman code (RFC 7541 Appendix B), by symbol, right aligned.
+const uint32 kHuffmanCodes[256] = {
+  0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5,
+  0x0fffffe6, 0x0fffffe7, 0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9,
+  0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec, 0x0fffffed, 0x0fffffee,
+  0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+  0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9,
+  0x0ffffffa, 0x0ffffffb, 0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa,
+  0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa, 0x000003fa, 0x000003fb,
+  0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+  0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b,
+  0x0000001c, 0x0000001d, 0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb,
+  0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc, 0x00001ffa, 0x00000021,
+  0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+  0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068,
+  0x00000069, 0x0000006a, 0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e,
+  0x0000006f, 0x00000070, 0x00000071, 0x00000072, 0x000000fc, 0x00000073,
+  0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+  0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005,
+  0x00000025, 0x00000026, 0x00000027, 0x00000006, 0x00000074, 0x00000075,
+  0x00000028, 0x00000029, 0x0000002a, 0x00000007, 0x0000002b, 0x00000076,
+  0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+  0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd,
+  0x00001ffd, 0x0ffffffc, 0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8,
+  0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9, 0x003fffd6, 0x007fffda,
+  0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+  0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1,
+  0x007fffe2, 0x007fffe3, 0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5,
+  0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef, 0x003fffda, 0x001fffdd,
+  0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+  0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf,
+  0x007fffeb, 0x007fffec, 0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2,
+  0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef, 0x000fffea, 0x003fffe2,
+  0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+  0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2,
+  0x003fffe8, 0x01ffffec, 0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde,
+  0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed, 0x0007fff2, 0x001fffe3,
+  0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+  0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3,
+  0x07ffffe4, 0x07ffffe5, 0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6,
+  0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3, 0x003fffea, 0x003fffeb,
+  0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+  0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8,
+  0x07ffffe9, 0x07ffffea, 0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed,
+  0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee,
+};
+
+const uint8 kHuffmanLengths[256] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+// The code is canonical, so a code of n bits is the symbol at
+// kHuffmanSymbols[kHuffmanOffset[n] + code - kHuffmanFirst[n]], where there
+// are kHuffmanCount[n] codes of n bits.
+const uint8 kHuffmanSymbols[256] = {
+  48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+  45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+  95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+  58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+  77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+  106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+  88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+  0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+  195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+  167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+  132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+  173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+  233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+  151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+  183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+  171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+  200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+  255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+  246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+  6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+  21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+  249, 10, 13, 22,
+};
+
+const uint32 kHuffmanFirst[31] = {
+  0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+  0x00000014, 0x0000005c, 0x000000f8, 0x00000000, 0x000003f8, 0x000007fa,
+  0x00000ffa, 0x00001ff8, 0x00003ffc, 0x00007ffc, 0x00000000, 0x00000000,
+  0x00000000, 0x0007fff0, 0x000fffe6, 0x001fffdc, 0x003fffd2, 0x007fffd8,
+  0x00ffffea, 0x01ffffec, 0x03ffffe0, 0x07ffffde, 0x0fffffe2, 0x00000000,
+  0x3ffffffc,
+};
+
+const uint16 kHuffmanCount[31] = {
+  0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+  0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 3,
+};
+
+const uint16 kHuffmanOffset[31] = {
+  0, 0, 0, 0, 0, 0, 10, 36, 68, 74, 74, 79,
+  82, 84, 90, 92, 95, 95, 95, 95, 98, 106, 119, 145,
+  174, 186, 190, 205, 224, 253, 253,
+};
+
+const size_t kStaticTableSize = ARRAY_SIZE(kStaticTable);
+const uint32 kHuffmanEos = 0x3fffffff;
+const int kHuffmanEosLength = 30;
+
+// What an entry counts for against the table's size.
+const size_t kEntryOverhead = 32;
+
+inline size_t EntrySize(const std::string& name, const std::string& value) {
+  return name.size() + value.size() + kEntryOverhead;
+}
+
+const std::vector<HpackHeader>& StaticTable() {
+  static std::vector<HpackHeader>* table = NULL;
+  if (!table) {
+    std::vector<HpackHeader>* entries = new std::vector<HpackHeader>;
+    for (size_t i = 0; i < kStaticTableSize; ++i) {
+      entries->push_back(HpackHeader(kStaticTable[i].name,
+                                     kStaticTable[i].value));
+    }
+    table = entries;
+  }
+  return *table;
+}
+
+// Representations, by their first bits.
+const uint8 kIndexed = 0x80;             // 1xxxxxxx, 7 bit index
+const uint8 kLiteralIndexed = 0x40;      // 01xxxxxx, 6 bit name index
+const uint8 kSizeUpdate = 0x20;          // 001xxxxx, 5 bit size
+const uint8 kLiteralNeverIndexed = 0x10; // 0001xxxx, 4 bit name index
+const uint8 kLiteralNotIndexed = 0x00;   // 0000xxxx, 4 bit name index
+const uint8 kHuffmanFlag = 0x80;
+
+// Headers whose values seldom repeat aren't worth a table entry, and those
+// with credentials are sent so that no intermediary indexes them.
+bool IsVolatile(const std::string& name) {
+  static const char* const kVolatile[] = {
+    ":path", "content-length", "content-range", "date", "etag",
+    "if-modified-since", "if-none-match", "last-modified", "range",
+  };
+  for (size_t i = 0; i < ARRAY_SIZE(kVolatile); ++i) {
+    if (name == kVolatile[i])
+      return true;
+  }
+  return false;
+}
+
+bool IsSensitive(const std::string& name) {
+  return (name == "authorization") || (name == "proxy-authorization");
+}
+
+void EncodeString(const std::string& text, std::string* out) {
+  size_t huffman_length = HpackHuffmanLength(text);
+  if (huffman_length < text.size()) {
+    HpackEncodeInteger(huffman_length, 7, kHuffmanFlag, out);
+    HpackHuffmanEncode(text, out);
+  } else {
+    HpackEncodeInteger(text.size(), 7, 0, out);
+    out->append(text);
+  }
+}
+
+bool DecodeString(const uint8* data, size_t len, size_t* pos,
+                  std::string* text) {
+  if (*pos >= len)
+    return false;
+  bool huffman = (data[*pos] & kHuffmanFlag) != 0;
+  uint32 length;
+  if (!HpackDecodeInteger(data, len, pos, 7, &length)
+      || (length > len - *pos))
+    return false;
+  const uint8* begin = data + *pos;
+  *pos += length;
+  text->clear();
+  if (huffman)
+    return HpackHuffmanDecode(begin, length, text);
+  text->assign(reinterpret_cast<const char*>(begin), length);
+  return true;
+}
+
+}  // anonymous namespace
+
+//////////////////////////////////////////////////////////////////////
+// Primitives
+//////////////////////////////////////////////////////////////////////
+
+void HpackEncodeInteger(uint32 value, int prefix_bits, uint8 flags,
+                        std::string* out) {
+  uint32 max_prefix = (1u << prefix_bits) - 1;
+  if (value < max_prefix) {
+    out->push_back(static_cast<char>(flags | value));
+    return;
+  }
+  out->push_back(static_cast<char>(flags | max_prefix));
+  value -= max_prefix;
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+bool HpackDecodeInteger(const uint8* data, size_t len, size_t* pos,
+                        int prefix_bits, uint32* value) {
+  if (*pos >= len)
+    return false;
+  uint32 max_prefix = (1u << prefix_bits) - 1;
+  *value = data[(*pos)++] & max_prefix;
+  if (*value < max_prefix)
+    return true;
+  for (int shift = 0; *pos < len; shift += 7) {
+    uint8 byte = data[(*pos)++];
+    // Anything past 32 bits is an attack, not a header.
+    if ((shift > 28) || ((shift == 28) && (byte & 0x70)))
+      return false;
+    *value += static_cast<uint32>(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+size_t HpackHuffmanLength(const std::string& text) {
+  size_t bits = 0;
+  for (size_t i = 0; i < text.size(); ++i) {
+    bits += kHuffmanLengths[static_cast<uint8>(text[i])];
+  }
+  return (bits + 7) / 8;
+}
+
+void HpackHuffmanEncode(const std::string& text, std::string* out) {
+  uint64 pending = 0;
+  int bits = 0;
+  for (size_t i = 0; i < text.size(); ++i) {
+    uint8 symbol = static_cast<uint8>(text[i]);
+    pending = (pending << kHuffmanLengths[symbol]) | kHuffmanCodes[symbol];
+    bits += kHuffmanLengths[symbol];
+    while (bits >= 8) {
+      bits -= 8;
+      out->push_back(static_cast<char>(pending >> bits));
+    }
+  }
+  if (bits > 0) {
+    // Padded with the start of the EOS code, which is all ones.
+    out->push_back(static_cast<char>((pending << (8 - bits))
+                                     | (0xff >> bits)));
+  }
+}
+
+bool HpackHuffmanDecode(const uint8* data, size_t len, std::string* out) {
+  uint32 code = 0;
+  int bits = 0;
+  for (size_t i = 0; i < len; ++i) {
+    for (int bit = 7; bit >= 0; --bit) {
+      code = (code << 1) | ((data[i] >> bit) & 1);
+      ++bits;
+      if ((code >= kHuffmanFirst[bits])
+          && (code - kHuffmanFirst[bits] < kHuffmanCount[bits])) {
+        out->push_back(static_cast<char>(
+            kHuffmanSymbols[kHuffmanOffset[bits] + code
+                            - kHuffmanFirst[bits]]));
+        code = 0;
+        bits = 0;
+      } else if (bits == kHuffmanEosLength) {
+        // Only EOS is left, and it mayn't appear in a string.
+        return false;
+      }
+    }
+  }
+  // Padding is under a byte of ones.
+  return (bits < 8) && (code == (kHuffmanEos >> (kHuffmanEosLength - bits)));
+}
+
+//////////////////////////////////////////////////////////////////////
+// HpackTable
+//////////////////////////////////////////////////////////////////////
+
+HpackTable::HpackTable() : size_(0), max_size_(kDefaultSize) {
+}
+
+const HpackHeader* HpackTable::Get(size_t index) const {
+  if (index == 0)
+    return NULL;
+  if (index <= kStaticTableSize)
+    return &StaticTable()[index - 1];
+  index -= kStaticTableSize + 1;
+  if (index >= entries_.size())
+    return NULL;
+  return &entries_[index];
+}
+
+size_t HpackTable::Find(const std::string& name, const std::string& value,
+                        size_t* name_index) const {
+  *name_index = 0;
+  const std::vector<HpackHeader>& table = StaticTable();
+  for (size_t i = 0; i < table.size(); ++i) {
+    if (table[i].first != name)
+      continue;
+    if (table[i].second == value)
+      return i + 1;
+    if (!*name_index)
+      *name_index = i + 1;
+  }
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    if (entries_[i].first != name)
+      continue;
+    if (entries_[i].second == value)
+      return kStaticTableSize + 1 + i;
+    if (!*name_index)
+      *name_index = kStaticTableSize + 1 + i;
+  }
+  return 0;
+}
+
+void HpackTable::Add(const std::string& name, const std::string& value) {
+  size_t size = EntrySize(name, value);
+  if (size > max_size_) {
+    // An entry bigger than the table empties it, and isn't added.
+    Evict(max_size_);
+    return;
+  }
+  Evict(size);
+  entries_.push_front(HpackHeader(name, value));
+  size_ += size;
+}
+
+void HpackTable::SetMaxSize(size_t size) {
+  max_size_ = size;
+  Evict(0);
+}
+
+void HpackTable::Evict(size_t size) {
+  while (!entries_.empty() && (size_ + size > max_size_)) {
+    size_ -= EntrySize(entries_.back().first, entries_.back().second);
+    entries_.pop_back();
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// HpackEncoder
+//////////////////////////////////////////////////////////////////////
+
+HpackEncoder::HpackEncoder()
+    : max_size_(HpackTable::kDefaultSize),
+      min_size_(HpackTable::kDefaultSize), size_changed_(false) {
+}
+
+void HpackEncoder::SetMaxTableSize(size_t size) {
+  // A bigger table than the default costs memory on both sides for little.
+  size = _min(size, static_cast<size_t>(HpackTable::kDefaultSize));
+  if (size == max_size_)
+    return;
+  max_size_ = size;
+  min_size_ = _min(min_size_, size);
+  size_changed_ = true;
+}
+
+void HpackEncoder::Encode(const HpackHeaderList& headers,
+                          std::string* block) {
+  if (size_changed_) {
+    // The smallest size since the last block comes first, so the peer
+    // evicts what we did.
+    if (min_size_ < max_size_)
+      HpackEncodeInteger(min_size_, 5, kSizeUpdate, block);
+    HpackEncodeInteger(max_size_, 5, kSizeUpdate, block);
+    table_.SetMaxSize(max_size_);
+    min_size_ = max_size_;
+    size_changed_ = false;
+  }
+  for (size_t i = 0; i < headers.size(); ++i) {
+    EncodeHeader(headers[i].first, headers[i].second, block);
+  }
+}
+
+void HpackEncoder::EncodeHeader(const std::string& name,
+                                const std::string& value,
+                                std::string* block) {
+  size_t name_index;
+  bool sensitive = IsSensitive(name);
+  if (!sensitive) {
+    if (size_t index = table_.Find(name, value, &name_index)) {
+      HpackEncodeInteger(index, 7, kIndexed, block);
+      return;
+    }
+  } else {
+    table_.Find(name, std::string(), &name_index);
+  }
+  if (sensitive) {
+    HpackEncodeInteger(name_index, 4, kLiteralNeverIndexed, block);
+  } else if (IsVolatile(name)) {
+    HpackEncodeInteger(name_index, 4, kLiteralNotIndexed, block);
+  } else {
+    HpackEncodeInteger(name_index, 6, kLiteralIndexed, block);
+    table_.Add(name, value);
+  }
+  if (!name_index)
+    EncodeString(name, block);
+  EncodeString(value, block);
+}
+
+//////////////////////////////////////////////////////////////////////
+// HpackDecoder
+//////////////////////////////////////////////////////////////////////
+
+HpackDecoder::HpackDecoder()
+    : max_table_size_(HpackTable::kDefaultSize),
+      max_list_size_(64 * 1024) {
+}
+
+bool HpackDecoder::Decode(const char* block, size_t len,
+                          HpackHeaderList* headers) {
+  const uint8* data = reinterpret_cast<const uint8*>(block);
+  size_t pos = 0, list_size = 0;
+  bool fields = false;
+  while (pos < len) {
+    uint8 first = data[pos];
+    uint32 index;
+    if (first & kIndexed) {
+      if (!HpackDecodeInteger(data, len, &pos, 7, &index))
+        return false;
+      const HpackHeader* header = table_.Get(index);
+      if (!header)
+        return false;
+      headers->push_back(*header);
+    } else if ((first & 0xe0) == kSizeUpdate) {
+      // Only at the start of a block, and within our limit.
+      if (fields || !HpackDecodeInteger(data, len, &pos, 5, &index)
+          || (index > max_table_size_))
+        return false;
+      table_.SetMaxSize(index);
+      continue;
+    } else {
+      bool indexed = (first & 0xc0) == kLiteralIndexed;
+      if (!HpackDecodeInteger(data, len, &pos, indexed ? 6 : 4, &index))
+        return false;
+      HpackHeader header;
+      if (index) {
+        const HpackHeader* name = table_.Get(index);
+        if (!name)
+          return false;
+        header.first = name->first;
+      } else if (!DecodeString(data, len, &pos, &header.first)) {
+        return false;
+      }
+      if (!DecodeString(data, len, &pos, &header.second))
+        return false;
+      if (indexed)
+        table_.Add(header.first, header.second);
+      headers->push_back(header);
+    }
+    fields = true;
+    list_size += EntrySize(headers->back().first, headers->back().second);
+    if (list_size > max_list_size_)
+      return false;
+  }
+  return true;
+}
+
+}  // namespace txmpp
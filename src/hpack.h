@@ -0,0 +1,148 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_HPACK_H_
+#define _TXMPP_HPACK_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+
+namespace txmpp {
+
+// HPACK, the header compression of HTTP/2 (RFC 7541). An encoder and a
+// decoder each keep the dynamic table of one direction of one connection,
+// so the blocks of a connection must pass through them in order.
+
+typedef std::pair<std::string, std::string> HpackHeader;
+typedef std::vector<HpackHeader> HpackHeaderList;
+
+// The entries added to the table by literals with incremental indexing,
+// newest first, evicted as the table's size limit requires.
+class HpackTable {
+ public:
+  // The size limit both sides start with.
+  static const size_t kDefaultSize = 4096;
+
+  HpackTable();
+
+  // Entry |index| of the static table followed by this one, from 1.
+  // Returns NULL if there is none.
+  const HpackHeader* Get(size_t index) const;
+  // Returns the index of the entry with |name| and |value|, else 0, and
+  // sets *name_index to one with just |name|, else 0.
+  size_t Find(const std::string& name, const std::string& value,
+              size_t* name_index) const;
+  void Add(const std::string& name, const std::string& value);
+
+  void SetMaxSize(size_t size);
+  size_t max_size() const { return max_size_; }
+  size_t size() const { return size_; }
+
+ private:
+  void Evict(size_t size);
+
+  std::deque<HpackHeader> entries_;
+  size_t size_, max_size_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(HpackTable);
+};
+
+class HpackEncoder {
+ public:
+  HpackEncoder();
+
+  // Appends the block for |headers|, whose names must be lower case, to
+  // |block|. Headers worth keeping are added to the table; those that
+  // likely change on every request, or hold credentials, aren't.
+  void Encode(const HpackHeaderList& headers, std::string* block);
+
+  // The limit the peer allows for the table, from its settings. The next
+  // block tells it of the size used.
+  void SetMaxTableSize(size_t size);
+
+ private:
+  void EncodeHeader(const std::string& name, const std::string& value,
+                    std::string* block);
+
+  HpackTable table_;
+  // The limit to use, and the smallest since the last block, when they
+  // must be announced.
+  size_t max_size_, min_size_;
+  bool size_changed_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(HpackEncoder);
+};
+
+class HpackDecoder {
+ public:
+  HpackDecoder();
+
+  // Decodes the block |data| and appends its headers to |headers|. Returns
+  // false if it is malformed, which breaks the connection, or if its
+  // headers would take more than max_header_list_size.
+  bool Decode(const char* data, size_t len, HpackHeaderList* headers);
+
+  // The limit on the table given in our settings, which the peer may not
+  // exceed. The default is HpackTable::kDefaultSize.
+  void set_max_table_size(size_t size) { max_table_size_ = size; }
+  // The limit on the headers of one block, counted as in RFC 7540 6.5.2.
+  // The default is 64K.
+  void set_max_header_list_size(size_t size) { max_list_size_ = size; }
+
+ private:
+  HpackTable table_;
+  size_t max_table_size_, max_list_size_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(HpackDecoder);
+};
+
+// The primitives the encoder and decoder are built on.
+
+// Appends |value| as an integer with an |prefix_bits| prefix whose other
+// bits are |flags|.
+void HpackEncodeInteger(uint32 value, int prefix_bits, uint8 flags,
+                        std::string* out);
+// Reads an integer with an |prefix_bits| prefix from *pos, advancing it.
+bool HpackDecodeInteger(const uint8* data, size_t len, size_t* pos,
+                        int prefix_bits, uint32* value);
+// The length of |text| Huffman coded, in bytes.
+size_t HpackHuffmanLength(const std::string& text);
+void HpackHuffmanEncode(const std::string& text, std::string* out);
+bool HpackHuffmanDecode(const uint8* data, size_t len, std::string* out);
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_HPACK_H_
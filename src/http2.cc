@@ -0,0 +1,1166 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "http2.h"
+
+#include <stdlib.h>
+
+#include "asyncsocket.h"
+#include "common.h"
+#include "logging.h"
+#include "socketfactory.h"
+#include "socketstream.h"
+#include "ssladapter.h"
+#include "stringutils.h"
+#include "thread.h"
+#include "zlibstream.h"
+
+namespace txmpp {
+
+namespace {
+
+const char kConnectionPreface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const size_t kFrameHeaderSize = 9;
+
+enum FrameType {
+  FRAME_DATA = 0x0,
+  FRAME_HEADERS = 0x1,
+  FRAME_PRIORITY = 0x2,
+  FRAME_RST_STREAM = 0x3,
+  FRAME_SETTINGS = 0x4,
+  FRAME_PUSH_PROMISE = 0x5,
+  FRAME_PING = 0x6,
+  FRAME_GOAWAY = 0x7,
+  FRAME_WINDOW_UPDATE = 0x8,
+  FRAME_CONTINUATION = 0x9
+};
+
+const uint8 kFlagEndStream = 0x1;
+const uint8 kFlagAck = 0x1;
+const uint8 kFlagEndHeaders = 0x4;
+const uint8 kFlagPadded = 0x8;
+const uint8 kFlagPriority = 0x20;
+
+enum Setting {
+  SETTING_HEADER_TABLE_SIZE = 0x1,
+  SETTING_ENABLE_PUSH = 0x2,
+  SETTING_MAX_CONCURRENT_STREAMS = 0x3,
+  SETTING_INITIAL_WINDOW_SIZE = 0x4,
+  SETTING_MAX_FRAME_SIZE = 0x5,
+  SETTING_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+enum ErrorCode {
+  ERROR_NONE = 0x0,
+  ERROR_PROTOCOL = 0x1,
+  ERROR_FLOW_CONTROL = 0x3,
+  ERROR_FRAME_SIZE = 0x6,
+  ERROR_REFUSED_STREAM = 0x7,
+  ERROR_CANCEL = 0x8,
+  ERROR_COMPRESSION = 0x9
+};
+
+const int32 kMaxWindow = 0x7fffffff;
+// The window each side starts with, and the ones we give the server. A
+// stream's window bounds what waits for its document; the connection's is
+// credited back as data arrives, so a stalled document doesn't hold up the
+// other streams.
+const int32 kDefaultWindow = 65535;
+const int32 kStreamWindow = 1024 * 1024;
+const int32 kConnectionWindow = 16 * 1024 * 1024;
+// The largest frame either side may send until told otherwise, and the
+// largest we accept.
+const uint32 kDefaultFrameSize = 16384;
+const uint32 kMaxFrameSizeLimit = 16777215;
+const size_t kMaxHeaderListSize = 64 * 1024;
+// A header block spread over more CONTINUATION frames than this is refused.
+const size_t kMaxHeaderBlock = 256 * 1024;
+// Request documents are read no further ahead of the socket than this.
+const size_t kOutputLimit = 64 * 1024;
+const size_t kReadSize = 16 * 1024;
+
+enum { MSG_SEND };
+
+inline uint32 GetBE24(const char* data) {
+  const uint8* p = reinterpret_cast<const uint8*>(data);
+  return (p[0] << 16) | (p[1] << 8) | p[2];
+}
+
+inline uint32 GetBE32(const char* data) {
+  const uint8* p = reinterpret_cast<const uint8*>(data);
+  return (static_cast<uint32>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8)
+         | p[3];
+}
+
+inline void AppendBE32(uint32 value, std::string* out) {
+  out->push_back(static_cast<char>(value >> 24));
+  out->push_back(static_cast<char>(value >> 16));
+  out->push_back(static_cast<char>(value >> 8));
+  out->push_back(static_cast<char>(value));
+}
+
+inline void AppendSetting(uint16 id, uint32 value, std::string* out) {
+  out->push_back(static_cast<char>(id >> 8));
+  out->push_back(static_cast<char>(id));
+  AppendBE32(value, out);
+}
+
+// Headers that only mean something to an HTTP/1.1 connection, which
+// HTTP/2 forbids.
+bool IsConnectionHeader(const std::string& name) {
+  static const char* const kConnectionHeaders[] = {
+    "connection", "host", "keep-alive", "proxy-connection",
+    "transfer-encoding", "upgrade", "te",
+  };
+  for (size_t i = 0; i < ARRAY_SIZE(kConnectionHeaders); ++i) {
+    if (name == kConnectionHeaders[i])
+      return true;
+  }
+  return false;
+}
+
+}  // anonymous namespace
+
+//////////////////////////////////////////////////////////////////////
+// Http2Session::Stream
+//////////////////////////////////////////////////////////////////////
+
+struct Http2Session::Stream {
+  Stream(uint32 id, HttpTransaction* transaction, IHttp2Notify* notify,
+         bool decode_content, int32 send_window)
+      : id(id), transaction(transaction), notify(notify),
+        decode_content(decode_content), headers_sent(false),
+        body_sent(false), response_started(false), remote_closed(false),
+        ignore_data(false), decoding(false), send_window(send_window),
+        recv_window(kStreamWindow), consumed(0) { }
+
+  StreamInterface* request_document() {
+    return transaction->request.document.get();
+  }
+  StreamInterface* response_document() {
+    return transaction->response.document.get();
+  }
+
+  uint32 id;
+  HttpTransaction* transaction;
+  IHttp2Notify* notify;
+  bool decode_content;
+  // Set once the request's headers, and then all of its document, are
+  // queued.
+  bool headers_sent, body_sent;
+  // Set once the final response headers arrive, and once the server ends
+  // the stream.
+  bool response_started, remote_closed;
+  bool ignore_data, decoding;
+  int32 send_window, recv_window;
+  // Data received and not yet taken by the document, and the bytes taken
+  // since the window was last credited.
+  std::string pending;
+  size_t consumed;
+  scoped_ptr<ZlibInflater> inflater;
+};
+
+//////////////////////////////////////////////////////////////////////
+// Http2Session
+//////////////////////////////////////////////////////////////////////
+
+Http2Session::Http2Session(StreamInterface* stream, SSLAdapter* ssl)
+    : thread_(Thread::Current()), stream_(stream), ssl_(ssl),
+      started_(false), unavailable_(false), closed_(false),
+      going_away_(false), send_pending_(false), next_id_(1), last_id_(0),
+      continuation_id_(0), continuation_end_stream_(false),
+      settings_received_(false),
+      max_streams_(0xffffffff), max_frame_size_(kDefaultFrameSize),
+      initial_window_(kDefaultWindow), send_window_(kDefaultWindow),
+      recv_window_(kConnectionWindow) {
+  decoder_.set_max_header_list_size(kMaxHeaderListSize);
+  stream_->SignalEvent.connect(this, &Http2Session::OnStreamEvent);
+  if (stream_->GetState() == SS_OPEN)
+    Start();
+}
+
+Http2Session::~Http2Session() {
+  thread_->Clear(this);
+  for (StreamMap::iterator it = streams_.begin(); it != streams_.end();
+       ++it) {
+    Stream* s = it->second;
+    if (s->request_document())
+      s->request_document()->SignalEvent.disconnect(this);
+    if (s->response_document())
+      s->response_document()->SignalEvent.disconnect(this);
+    delete s;
+  }
+  delete stream_;
+}
+
+bool Http2Session::CanSubmit() const {
+  return !closed_ && !going_away_ && (next_id_ <= 0x7fffffff)
+         && (streams_.size() < max_streams_);
+}
+
+uint32 Http2Session::Submit(HttpTransaction* transaction,
+                            IHttp2Notify* notify, bool decode_content) {
+  if (!CanSubmit())
+    return 0;
+  uint32 id = next_id_;
+  next_id_ += 2;
+  last_id_ = id;
+  streams_[id] = new Stream(id, transaction, notify, decode_content,
+                            initial_window_);
+  if (started_)
+    PostSend();
+  return id;
+}
+
+void Http2Session::Cancel(uint32 id) {
+  Stream* s = FindStream(id);
+  if (!s)
+    return;
+  if (s->headers_sent && !closed_)
+    QueueRstStream(id, ERROR_CANCEL);
+  streams_.erase(id);
+  if (s->request_document())
+    s->request_document()->SignalEvent.disconnect(this);
+  if (s->response_document())
+    s->response_document()->SignalEvent.disconnect(this);
+  delete s;
+  CheckIdle();
+}
+
+void Http2Session::OnMessage(Message* msg) {
+  ASSERT(MSG_SEND == msg->message_id);
+  send_pending_ = false;
+  SendRequests();
+  Flush();
+}
+
+void Http2Session::PostSend() {
+  if (!send_pending_ && !closed_) {
+    send_pending_ = true;
+    thread_->Post(this, MSG_SEND);
+  }
+}
+
+void Http2Session::OnStreamEvent(StreamInterface* stream, int events,
+                                 int error) {
+  if ((events & SE_OPEN) && !started_ && !closed_)
+    Start();
+  if ((events & SE_READ) && started_ && !closed_)
+    ReadFrames();
+  if ((events & SE_WRITE) && started_ && !closed_) {
+    Flush();
+    SendRequests();
+    Flush();
+  }
+  if ((events & SE_CLOSE) && !closed_) {
+    LOG(LS_INFO) << "Http2Session: connection closed: " << error;
+    Close();
+  }
+}
+
+void Http2Session::OnDocumentEvent(StreamInterface* document, int events,
+                                   int error) {
+  for (StreamMap::iterator it = streams_.begin(); it != streams_.end();
+       ++it) {
+    Stream* s = it->second;
+    if ((document == s->response_document()) && (events & SE_WRITE)) {
+      FlushDocument(s);
+      return;
+    }
+    if ((document == s->request_document()) && (events & SE_READ)) {
+      PostSend();
+      return;
+    }
+  }
+}
+
+void Http2Session::Start() {
+  if (ssl_ && (ssl_->GetAlpnProtocol() != "h2")) {
+    LOG(LS_INFO) << "Http2Session: server declined HTTP/2";
+    unavailable_ = true;
+    closed_ = true;
+    stream_->Close();
+    GoAway();
+    while (!streams_.empty()) {
+      Stream* s = streams_.begin()->second;
+      streams_.erase(streams_.begin());
+      IHttp2Notify* notify = s->notify;
+      delete s;
+      notify->onHttp2Unavailable();
+    }
+    CheckIdle();
+    return;
+  }
+  started_ = true;
+  output_.append(kConnectionPreface, ARRAY_SIZE(kConnectionPreface) - 1);
+  QueueSettings();
+  QueueWindowUpdate(0, kConnectionWindow - kDefaultWindow);
+  SendRequests();
+  Flush();
+}
+
+void Http2Session::ReadFrames() {
+  bool eos = false;
+  for (;;) {
+    char buffer[kReadSize];
+    size_t read;
+    int error;
+    StreamResult result = stream_->Read(buffer, sizeof(buffer), &read,
+                                        &error);
+    if (SR_SUCCESS == result) {
+      input_.append(buffer, read);
+      continue;
+    }
+    eos = (SR_BLOCK != result);
+    break;
+  }
+
+  size_t pos = 0;
+  while (!closed_ && (input_.size() - pos >= kFrameHeaderSize)) {
+    const char* header = input_.data() + pos;
+    uint32 len = GetBE24(header);
+    if (len > kDefaultFrameSize) {
+      Fail(ERROR_FRAME_SIZE);
+      break;
+    }
+    if (input_.size() - pos < kFrameHeaderSize + len)
+      break;
+    pos += kFrameHeaderSize + len;
+    if (!ProcessFrame(header[3], header[4],
+                      GetBE32(header + 5) & 0x7fffffff,
+                      header + kFrameHeaderSize, len))
+      break;
+  }
+  if (closed_)
+    return;
+  input_.erase(0, pos);
+  if (eos) {
+    Close();
+    return;
+  }
+  Flush();
+}
+
+bool Http2Session::ProcessFrame(uint8 type, uint8 flags, uint32 id,
+                                const char* payload, size_t len) {
+  if (continuation_id_
+      && ((FRAME_CONTINUATION != type) || (id != continuation_id_))) {
+    Fail(ERROR_PROTOCOL);
+    return false;
+  }
+  switch (type) {
+  case FRAME_DATA:
+    if (0 == id) {
+      Fail(ERROR_PROTOCOL);
+      return false;
+    }
+    recv_window_ -= len;
+    if (recv_window_ < 0) {
+      Fail(ERROR_FLOW_CONTROL);
+      return false;
+    }
+    if (recv_window_ <= kConnectionWindow / 2) {
+      QueueWindowUpdate(0, kConnectionWindow - recv_window_);
+      recv_window_ = kConnectionWindow;
+    }
+    if (Stream* s = FindStream(id))
+      return ProcessData(s, flags, payload, len);
+    if ((id > last_id_) || !(id & 1)) {
+      Fail(ERROR_PROTOCOL);
+      return false;
+    }
+    // A stream we cancelled, or whose response ended.
+    return true;
+  case FRAME_HEADERS:
+    // The server can't open streams, since push is off.
+    if ((id > last_id_) || !(id & 1)) {
+      Fail(ERROR_PROTOCOL);
+      return false;
+    }
+    return ProcessHeaders(FindStream(id), flags, id, payload, len);
+  case FRAME_PRIORITY:
+    if (len != 5) {
+      Fail(ERROR_FRAME_SIZE);
+      return false;
+    }
+    return true;
+  case FRAME_RST_STREAM:
+    if ((0 == id) || (len != 4)) {
+      Fail((0 == id) ? ERROR_PROTOCOL : ERROR_FRAME_SIZE);
+      return false;
+    }
+    if (Stream* s = FindStream(id)) {
+      uint32 code = GetBE32(payload);
+      if ((ERROR_NONE == code) && s->remote_closed) {
+        // The response is all here; the server wants no more of the
+        // request.
+        s->body_sent = true;
+      } else {
+        LOG(LS_INFO) << "Http2Session: stream " << id << " reset: "
+                     << code;
+        // A refused stream, or one reset before its response began, keeps
+        // the default scode, so that it may be sent again.
+        CompleteStream(s, HE_DISCONNECTED);
+      }
+    }
+    return true;
+  case FRAME_SETTINGS:
+    return ProcessSettings(flags, id, payload, len);
+  case FRAME_PUSH_PROMISE:
+    // Our settings turned push off.
+    Fail(ERROR_PROTOCOL);
+    return false;
+  case FRAME_PING:
+    if ((0 != id) || (len != 8)) {
+      Fail((0 != id) ? ERROR_PROTOCOL : ERROR_FRAME_SIZE);
+      return false;
+    }
+    if (!(flags & kFlagAck))
+      QueueFrame(FRAME_PING, kFlagAck, 0, payload, len);
+    return true;
+  case FRAME_GOAWAY:
+    if ((0 != id) || (len < 8)) {
+      Fail((0 != id) ? ERROR_PROTOCOL : ERROR_FRAME_SIZE);
+      return false;
+    }
+    LOG(LS_INFO) << "Http2Session: GOAWAY " << GetBE32(payload + 4);
+    GoAway();
+    Abandon(GetBE32(payload) & 0x7fffffff);
+    CheckIdle();
+    return true;
+  case FRAME_WINDOW_UPDATE:
+    return ProcessWindowUpdate(FindStream(id), id, payload, len);
+  case FRAME_CONTINUATION:
+    if (!continuation_id_) {
+      Fail(ERROR_PROTOCOL);
+      return false;
+    }
+    if (header_block_.size() + len > kMaxHeaderBlock) {
+      Fail(ERROR_PROTOCOL);
+      return false;
+    }
+    header_block_.append(payload, len);
+    if (flags & kFlagEndHeaders) {
+      continuation_id_ = 0;
+      return ProcessHeaderBlock(id, continuation_end_stream_);
+    }
+    return true;
+  default:
+    // Unknown frames are ignored.
+    return true;
+  }
+}
+
+bool Http2Session::ProcessData(Stream* s, uint8 flags, const char* payload,
+                               size_t len) {
+  size_t begin = 0, padding = 0;
+  if (flags & kFlagPadded) {
+    if (len < 1) {
+      Fail(ERROR_PROTOCOL);
+      return false;
+    }
+    padding = static_cast<uint8>(payload[0]);
+    begin = 1;
+  }
+  if (begin + padding > len) {
+    Fail(ERROR_PROTOCOL);
+    return false;
+  }
+  if (!s->response_started || s->remote_closed) {
+    ResetStream(s, ERROR_PROTOCOL, HE_PROTOCOL);
+    return true;
+  }
+  s->recv_window -= len;
+  if (s->recv_window < 0) {
+    ResetStream(s, ERROR_FLOW_CONTROL, HE_PROTOCOL);
+    return true;
+  }
+  size_t data_len = len - begin - padding;
+  s->consumed += len - data_len;
+  if (s->ignore_data) {
+    s->consumed += data_len;
+  } else {
+    s->pending.append(payload + begin, data_len);
+  }
+  if (flags & kFlagEndStream)
+    s->remote_closed = true;
+  FlushDocument(s);
+  return true;
+}
+
+bool Http2Session::ProcessHeaders(Stream* s, uint8 flags, uint32 id,
+                                  const char* payload, size_t len) {
+  size_t begin = 0, padding = 0;
+  if (flags & kFlagPadded) {
+    if (len < 1) {
+      Fail(ERROR_PROTOCOL);
+      return false;
+    }
+    padding = static_cast<uint8>(payload[0]);
+    begin = 1;
+  }
+  if (flags & kFlagPriority)
+    begin += 5;
+  if (begin + padding > len) {
+    Fail(ERROR_PROTOCOL);
+    return false;
+  }
+  header_block_.assign(payload + begin, len - begin - padding);
+  bool end_stream = (flags & kFlagEndStream) != 0;
+  if (!(flags & kFlagEndHeaders)) {
+    continuation_id_ = id;
+    continuation_end_stream_ = end_stream;
+    return true;
+  }
+  return ProcessHeaderBlock(id, end_stream);
+}
+
+bool Http2Session::ProcessHeaderBlock(uint32 id, bool end_stream) {
+  // The block is decoded whatever became of its stream, to keep the table
+  // in step with the server's.
+  HpackHeaderList headers;
+  bool decoded = decoder_.Decode(header_block_.data(), header_block_.size(),
+                                 &headers);
+  header_block_.clear();
+  if (!decoded) {
+    Fail(ERROR_COMPRESSION);
+    return false;
+  }
+  Stream* s = FindStream(id);
+  if (!s)
+    return true;
+  if (s->remote_closed) {
+    ResetStream(s, ERROR_PROTOCOL, HE_PROTOCOL);
+    return true;
+  }
+
+  if (!s->response_started) {
+    std::string status;
+    for (size_t i = 0; i < headers.size(); ++i) {
+      if (headers[i].first == ":status") {
+        status = headers[i].second;
+        break;
+      }
+    }
+    char* end;
+    unsigned long scode = strtoul(status.c_str(), &end, 10);
+    if ((status.size() != 3) || (*end != '\0')) {
+      ResetStream(s, ERROR_PROTOCOL, HE_PROTOCOL);
+      return true;
+    }
+    if (HttpCodeIsInformational(scode) && !end_stream) {
+      // If you're interested in informational headers, say so.
+      return true;
+    }
+
+    HttpResponseData& response = s->transaction->response;
+    response.scode = scode;
+    response.version = HVER_1_1;
+    for (size_t i = 0; i < headers.size(); ++i) {
+      const HpackHeader& header = headers[i];
+      if (!header.first.empty() && (header.first[0] != ':')) {
+        response.addReceivedHeader(header.first.data(), header.first.size(),
+                                   header.second.data(),
+                                   header.second.size());
+      }
+    }
+    s->response_started = true;
+
+    size_t data_size = SIZE_UNKNOWN;
+    std::string value;
+    if (response.hasHeader(HH_CONTENT_LENGTH, &value)) {
+      unsigned long length = strtoul(value.c_str(), &end, 10);
+      if (!value.empty() && (*end == '\0'))
+        data_size = length;
+    }
+    std::string encoding;
+    if (s->decode_content
+        && response.hasHeader(HH_CONTENT_ENCODING, &encoding)) {
+      encoding = string_trim(encoding);
+      if ((_stricmp(encoding.c_str(), "gzip") == 0)
+          || (_stricmp(encoding.c_str(), "x-gzip") == 0)
+          || (_stricmp(encoding.c_str(), "deflate") == 0)) {
+        if (!s->inflater.get())
+          s->inflater.reset(new ZlibInflater);
+        if (s->inflater->Start()) {
+          s->decoding = true;
+          response.clearHeader(HH_CONTENT_ENCODING);
+          response.clearHeader(HH_CONTENT_LENGTH);
+          data_size = SIZE_UNKNOWN;
+        }
+      }
+    }
+
+    bool ignore_data = false;
+    HttpError error = s->notify->onHttp2Header(data_size, &ignore_data);
+    if (!(s = FindStream(id)))
+      return true;
+    if (HE_NONE != error) {
+      ResetStream(s, ERROR_CANCEL, error);
+      return true;
+    }
+    s->ignore_data = ignore_data;
+    // The document may have been replaced in response to the headers.
+    if (s->response_document()) {
+      s->response_document()->SignalEvent.connect(
+          this, &Http2Session::OnDocumentEvent);
+    }
+  }
+  // Trailers are dropped.
+
+  if (end_stream) {
+    s->remote_closed = true;
+    FlushDocument(s);
+  }
+  return true;
+}
+
+bool Http2Session::ProcessSettings(uint8 flags, uint32 id,
+                                   const char* payload, size_t len) {
+  if (0 != id) {
+    Fail(ERROR_PROTOCOL);
+    return false;
+  }
+  if (flags & kFlagAck) {
+    if (0 != len) {
+      Fail(ERROR_FRAME_SIZE);
+      return false;
+    }
+    return true;
+  }
+  if (len % 6) {
+    Fail(ERROR_FRAME_SIZE);
+    return false;
+  }
+  for (size_t pos = 0; pos < len; pos += 6) {
+    uint16 setting = (static_cast<uint8>(payload[pos]) << 8)
+                     | static_cast<uint8>(payload[pos + 1]);
+    uint32 value = GetBE32(payload + pos + 2);
+    switch (setting) {
+    case SETTING_HEADER_TABLE_SIZE:
+      encoder_.SetMaxTableSize(value);
+      break;
+    case SETTING_ENABLE_PUSH:
+      if (value > 1) {
+        Fail(ERROR_PROTOCOL);
+        return false;
+      }
+      break;
+    case SETTING_MAX_CONCURRENT_STREAMS:
+      max_streams_ = value;
+      break;
+    case SETTING_INITIAL_WINDOW_SIZE: {
+      if (value > static_cast<uint32>(kMaxWindow)) {
+        Fail(ERROR_FLOW_CONTROL);
+        return false;
+      }
+      // The change applies to the windows of open streams too.
+      int64 delta = static_cast<int64>(value) - initial_window_;
+      for (StreamMap::iterator it = streams_.begin(); it != streams_.end();
+           ++it) {
+        int64 window = it->second->send_window + delta;
+        if (window > kMaxWindow) {
+          Fail(ERROR_FLOW_CONTROL);
+          return false;
+        }
+        it->second->send_window = static_cast<int32>(window);
+      }
+      initial_window_ = static_cast<int32>(value);
+      break;
+    }
+    case SETTING_MAX_FRAME_SIZE:
+      if ((value < kDefaultFrameSize) || (value > kMaxFrameSizeLimit)) {
+        Fail(ERROR_PROTOCOL);
+        return false;
+      }
+      max_frame_size_ = value;
+      break;
+    default:
+      // Including SETTING_MAX_HEADER_LIST_SIZE, which is advisory.
+      break;
+    }
+  }
+  settings_received_ = true;
+  QueueFrame(FRAME_SETTINGS, kFlagAck, 0, NULL, 0);
+  // The windows, and the limit on streams, may have opened.
+  PostSend();
+  return true;
+}
+
+bool Http2Session::ProcessWindowUpdate(Stream* s, uint32 id,
+                                       const char* payload, size_t len) {
+  if (len != 4) {
+    Fail(ERROR_FRAME_SIZE);
+    return false;
+  }
+  int64 increment = GetBE32(payload) & 0x7fffffff;
+  if (0 == id) {
+    if ((0 == increment) || (send_window_ + increment > kMaxWindow)) {
+      Fail((0 == increment) ? ERROR_PROTOCOL : ERROR_FLOW_CONTROL);
+      return false;
+    }
+    send_window_ += static_cast<int32>(increment);
+  } else if (s) {
+    if (0 == increment) {
+      ResetStream(s, ERROR_PROTOCOL, HE_PROTOCOL);
+      return true;
+    }
+    if (s->send_window + increment > kMaxWindow) {
+      ResetStream(s, ERROR_FLOW_CONTROL, HE_PROTOCOL);
+      return true;
+    }
+    s->send_window += static_cast<int32>(increment);
+  }
+  PostSend();
+  return true;
+}
+
+void Http2Session::FlushDocument(Stream* s) {
+  StreamInterface* document = s->response_document();
+  size_t used = 0;
+  if (s->pending.empty() && !(s->decoding && s->inflater->output_len())) {
+    // Nothing waits.
+  } else if (!document) {
+    used = s->pending.size();
+  } else if (s->decoding) {
+    ZlibInflater* inflater = s->inflater.get();
+    for (;;) {
+      bool blocked = false;
+      while (inflater->output_len() > 0) {
+        size_t written;
+        int error;
+        StreamResult result = document->Write(inflater->output(),
+                                              inflater->output_len(),
+                                              &written, &error);
+        if (SR_BLOCK == result) {
+          blocked = true;
+          break;
+        }
+        if (SR_SUCCESS != result) {
+          ResetStream(s, ERROR_CANCEL, HE_STREAM);
+          return;
+        }
+        inflater->Consume(written);
+      }
+      if (blocked)
+        break;
+      if (inflater->finished()) {
+        // Anything after the end of the compressed data is dropped.
+        used = s->pending.size();
+        break;
+      }
+      if (used == s->pending.size())
+        break;
+      size_t taken = 0;
+      if (!inflater->Inflate(s->pending.data() + used,
+                             s->pending.size() - used, &taken)) {
+        ResetStream(s, ERROR_CANCEL, HE_STREAM);
+        return;
+      }
+      used += taken;
+    }
+  } else {
+    while (used < s->pending.size()) {
+      size_t written;
+      int error;
+      StreamResult result = document->Write(s->pending.data() + used,
+                                            s->pending.size() - used,
+                                            &written, &error);
+      if (SR_BLOCK == result)
+        break;
+      if (SR_SUCCESS != result) {
+        ResetStream(s, ERROR_CANCEL, HE_STREAM);
+        return;
+      }
+      used += written;
+    }
+  }
+  s->pending.erase(0, used);
+  s->consumed += used;
+
+  bool drained = s->pending.empty()
+                 && !(s->decoding && s->inflater->output_len());
+  if (s->remote_closed) {
+    if (drained)
+      CompleteStream(s, HE_NONE);
+    return;
+  }
+  if (s->consumed >= static_cast<size_t>(kStreamWindow / 2)) {
+    QueueWindowUpdate(s->id, s->consumed);
+    s->recv_window += s->consumed;
+    s->consumed = 0;
+  }
+}
+
+void Http2Session::SendRequests() {
+  if (!started_ || closed_)
+    return;
+  // Streams beyond the server's limit wait, in order, for others to end.
+  // Until its settings tell us the limit, only one is sent, since a server
+  // with a low one would refuse the others.
+  size_t limit = settings_received_ ? max_streams_ : 1;
+  size_t open = 0;
+  for (StreamMap::iterator it = streams_.begin(); it != streams_.end();
+       ++it) {
+    if (it->second->headers_sent)
+      ++open;
+  }
+  // Streams may end, and others begin, as documents are read.
+  uint32 id = 0;
+  StreamMap::iterator it;
+  while ((it = streams_.upper_bound(id)) != streams_.end()) {
+    id = it->first;
+    Stream* s = it->second;
+    if (!s->headers_sent) {
+      if (open >= limit)
+        break;
+      SendHeaders(s);
+      ++open;
+    }
+    if (!s->body_sent) {
+      if ((output_.size() >= kOutputLimit) || (send_window_ <= 0))
+        break;
+      SendBody(s);
+    }
+  }
+}
+
+void Http2Session::SendHeaders(Stream* s) {
+  const HttpRequestData& request = s->transaction->request;
+  // The path may be an absolute uri, as for a proxy.
+  std::string authority, path;
+  if (!request.getRelativeUri(&authority, &path))
+    path = request.path;
+
+  HpackHeaderList headers;
+  headers.push_back(HpackHeader(":method", ToString(request.verb)));
+  headers.push_back(HpackHeader(":scheme", ssl_ ? "https" : "http"));
+  headers.push_back(HpackHeader(":authority", authority));
+  headers.push_back(HpackHeader(":path", path.empty() ? "/" : path));
+  for (HttpData::const_iterator it = request.begin(); it != request.end();
+       ++it) {
+    std::string name(it->first);
+    std::transform(name.begin(), name.end(), name.begin(), tolower);
+    if (!IsConnectionHeader(name))
+      headers.push_back(HpackHeader(name, it->second));
+  }
+  std::string block;
+  encoder_.Encode(headers, &block);
+
+  bool end_stream = (NULL == s->request_document());
+  size_t pos = 0;
+  do {
+    size_t len = _min(block.size() - pos,
+                      static_cast<size_t>(max_frame_size_));
+    uint8 flags = (pos + len == block.size()) ? kFlagEndHeaders : 0;
+    if ((0 == pos) && end_stream)
+      flags |= kFlagEndStream;
+    QueueFrame((0 == pos) ? FRAME_HEADERS : FRAME_CONTINUATION, flags,
+               s->id, block.data() + pos, len);
+    pos += len;
+  } while (pos < block.size());
+
+  s->headers_sent = true;
+  if (end_stream) {
+    s->body_sent = true;
+  } else {
+    s->request_document()->SignalEvent.connect(
+        this, &Http2Session::OnDocumentEvent);
+  }
+}
+
+void Http2Session::SendBody(Stream* s) {
+  StreamInterface* document = s->request_document();
+  while (!s->body_sent && (output_.size() < kOutputLimit)) {
+    int32 window = _min(send_window_, s->send_window);
+    if (window <= 0)
+      return;
+    char buffer[kDefaultFrameSize];
+    size_t read;
+    int error;
+    StreamResult result = document->Read(
+        buffer, _min(sizeof(buffer), static_cast<size_t>(window)), &read,
+        &error);
+    if (SR_SUCCESS == result) {
+      QueueFrame(FRAME_DATA, 0, s->id, buffer, read);
+      send_window_ -= read;
+      s->send_window -= read;
+    } else if (SR_EOS == result) {
+      QueueFrame(FRAME_DATA, kFlagEndStream, s->id, NULL, 0);
+      s->body_sent = true;
+    } else if (SR_BLOCK == result) {
+      // OnDocumentEvent picks it up again.
+      return;
+    } else {
+      LOG(LS_WARNING) << "Http2Session: request document error " << error;
+      ResetStream(s, ERROR_CANCEL, HE_STREAM);
+      return;
+    }
+  }
+}
+
+void Http2Session::QueueFrame(uint8 type, uint8 flags, uint32 id,
+                              const char* payload, size_t len) {
+  ASSERT(len <= kMaxFrameSizeLimit);
+  output_.push_back(static_cast<char>(len >> 16));
+  output_.push_back(static_cast<char>(len >> 8));
+  output_.push_back(static_cast<char>(len));
+  output_.push_back(static_cast<char>(type));
+  output_.push_back(static_cast<char>(flags));
+  AppendBE32(id, &output_);
+  output_.append(payload, len);
+  PostSend();
+}
+
+void Http2Session::QueueSettings() {
+  std::string payload;
+  AppendSetting(SETTING_ENABLE_PUSH, 0, &payload);
+  AppendSetting(SETTING_INITIAL_WINDOW_SIZE, kStreamWindow, &payload);
+  AppendSetting(SETTING_MAX_HEADER_LIST_SIZE, kMaxHeaderListSize, &payload);
+  QueueFrame(FRAME_SETTINGS, 0, 0, payload.data(), payload.size());
+}
+
+void Http2Session::QueueWindowUpdate(uint32 id, uint32 increment) {
+  std::string payload;
+  AppendBE32(increment, &payload);
+  QueueFrame(FRAME_WINDOW_UPDATE, 0, id, payload.data(), payload.size());
+}
+
+void Http2Session::QueueRstStream(uint32 id, uint32 code) {
+  std::string payload;
+  AppendBE32(code, &payload);
+  QueueFrame(FRAME_RST_STREAM, 0, id, payload.data(), payload.size());
+}
+
+void Http2Session::Flush() {
+  if (!started_ || closed_)
+    return;
+  size_t pos = 0;
+  while (pos < output_.size()) {
+    size_t written;
+    int error;
+    StreamResult result = stream_->Write(output_.data() + pos,
+                                         output_.size() - pos, &written,
+                                         &error);
+    if (SR_SUCCESS == result) {
+      pos += written;
+    } else if (SR_BLOCK == result) {
+      break;
+    } else {
+      LOG(LS_WARNING) << "Http2Session: write error " << error;
+      output_.clear();
+      // The close event finishes the session.
+      stream_->Close();
+      return;
+    }
+  }
+  output_.erase(0, pos);
+}
+
+void Http2Session::CompleteStream(Stream* s, HttpError err) {
+  if (s->headers_sent && !s->body_sent && !closed_) {
+    // The response ended before the request did.
+    QueueRstStream(s->id, ERROR_CANCEL);
+  }
+  streams_.erase(s->id);
+  if (s->request_document())
+    s->request_document()->SignalEvent.disconnect(this);
+  if (s->response_document())
+    s->response_document()->SignalEvent.disconnect(this);
+  IHttp2Notify* notify = s->notify;
+  delete s;
+  // A stream waiting on the server's limit may go now.
+  PostSend();
+  notify->onHttp2Complete(err);
+  CheckIdle();
+}
+
+void Http2Session::ResetStream(Stream* s, uint32 code, HttpError err) {
+  if (!closed_)
+    QueueRstStream(s->id, code);
+  // The frame above says all there is to say.
+  s->body_sent = true;
+  CompleteStream(s, err);
+}
+
+void Http2Session::Fail(uint32 code) {
+  LOG(LS_WARNING) << "Http2Session: connection error " << code;
+  std::string payload;
+  AppendBE32(0, &payload);
+  AppendBE32(code, &payload);
+  QueueFrame(FRAME_GOAWAY, 0, 0, payload.data(), payload.size());
+  Flush();
+  Close();
+}
+
+void Http2Session::Abandon(uint32 last_id) {
+  uint32 id = last_id;
+  StreamMap::iterator it;
+  while ((it = streams_.upper_bound(id)) != streams_.end()) {
+    id = it->first;
+    // Never processed, so safe to send again.
+    it->second->body_sent = true;
+    CompleteStream(it->second, HE_DISCONNECTED);
+  }
+}
+
+void Http2Session::Close() {
+  if (closed_)
+    return;
+  HttpError err = started_ ? HE_DISCONNECTED : HE_CONNECT_FAILED;
+  closed_ = true;
+  stream_->Close();
+  GoAway();
+  while (!streams_.empty()) {
+    CompleteStream(streams_.begin()->second, err);
+  }
+}
+
+void Http2Session::GoAway() {
+  if (!going_away_) {
+    going_away_ = true;
+    SignalClosed(this);
+  }
+}
+
+void Http2Session::CheckIdle() {
+  if (streams_.empty())
+    SignalIdle(this);
+}
+
+Http2Session::Stream* Http2Session::FindStream(uint32 id) {
+  StreamMap::iterator it = streams_.find(id);
+  return (it != streams_.end()) ? it->second : NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Http2Pool
+//////////////////////////////////////////////////////////////////////
+
+Http2Pool::Http2Pool(SocketFactory* factory)
+    : thread_(Thread::Current()), factory_(factory), cleartext_(false) {
+}
+
+Http2Pool::~Http2Pool() {
+  for (SessionList::iterator it = sessions_.begin(); it != sessions_.end();
+       ++it) {
+    delete it->second;
+  }
+}
+
+Http2Session* Http2Pool::GetSession(const SocketAddress& remote,
+                                    bool secure) {
+  Key key(remote, secure);
+  if (!secure && !cleartext_)
+    return NULL;
+  if (std::find(http1_hosts_.begin(), http1_hosts_.end(), key)
+      != http1_hosts_.end())
+    return NULL;
+  for (SessionList::iterator it = sessions_.begin(); it != sessions_.end();
+       ++it) {
+    if ((it->first == key) && it->second->CanSubmit())
+      return it->second;
+  }
+  Http2Session* session = CreateSession(key);
+  if (session)
+    sessions_.push_back(std::make_pair(key, session));
+  return session;
+}
+
+Http2Session* Http2Pool::CreateSession(const Key& key) {
+  AsyncSocket* socket = factory_->CreateAsyncSocket(SOCK_STREAM);
+  if (!socket) {
+    ASSERT(false);
+    return NULL;
+  }
+  SSLAdapter* ssl_adapter = NULL;
+  if (key.secure) {
+    ssl_adapter = SSLAdapter::Create(socket);
+    if (!ssl_adapter) {
+      LOG_F(LS_ERROR) << "SSL unavailable";
+      delete socket;
+      return NULL;
+    }
+    // A server that picks http/1.1 costs this connection, but is then
+    // remembered.
+    std::vector<std::string> protocols;
+    protocols.push_back("h2");
+    protocols.push_back("http/1.1");
+    ssl_adapter->set_alpn_protocols(protocols);
+    const std::string& hostname = key.address.hostname();
+    ssl_adapter->StartSSL(hostname.empty() ? key.address.IPAsString().c_str()
+                                           : hostname.c_str(), false);
+    socket = ssl_adapter;
+  }
+  if ((socket->Connect(key.address) != 0) && !socket->IsBlocking()) {
+    LOG_F(LS_WARNING) << "Connect failed: " << socket->GetError();
+    delete socket;
+    return NULL;
+  }
+  Http2Session* session = new Http2Session(new SocketStream(socket),
+                                           ssl_adapter);
+  session->SignalClosed.connect(this, &Http2Pool::OnSessionClosed);
+  session->SignalIdle.connect(this, &Http2Pool::OnSessionIdle);
+  return session;
+}
+
+void Http2Pool::OnSessionClosed(Http2Session* session) {
+  for (SessionList::iterator it = sessions_.begin(); it != sessions_.end();
+       ++it) {
+    if (it->second != session)
+      continue;
+    if (session->unavailable()) {
+      LOG(LS_INFO) << "Http2Pool: " << it->first.address.ToString()
+                   << " speaks HTTP/1.1";
+      http1_hosts_.push_back(it->first);
+    }
+    break;
+  }
+  if (0 == session->active_streams())
+    Remove(session);
+}
+
+void Http2Pool::OnSessionIdle(Http2Session* session) {
+  if (!session->CanSubmit())
+    Remove(session);
+}
+
+void Http2Pool::Remove(Http2Session* session) {
+  for (SessionList::iterator it = sessions_.begin(); it != sessions_.end();
+       ++it) {
+    if (it->second == session) {
+      sessions_.erase(it);
+      // It may be calling us.
+      thread_->Dispose(session);
+      return;
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+}  // namespace txmpp
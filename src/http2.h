@@ -0,0 +1,270 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_HTTP2_H_
+#define _TXMPP_HTTP2_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "hpack.h"
+#include "httpcommon.h"
+#include "messagehandler.h"
+#include "scoped_ptr.h"
+#include "sigslot.h"
+#include "socketaddress.h"
+
+namespace txmpp {
+
+class SocketFactory;
+class SSLAdapter;
+class StreamInterface;
+class Thread;
+class ZlibInflater;
+
+//////////////////////////////////////////////////////////////////////
+// IHttp2Notify
+// What a transaction submitted to an Http2Session hears of it.
+//////////////////////////////////////////////////////////////////////
+
+class IHttp2Notify {
+ public:
+  virtual ~IHttp2Notify() {}
+  // The final response headers are in the transaction. |data_size| is the
+  // length of the document, or SIZE_UNKNOWN. Setting *ignore_data drops
+  // the document as it arrives; returning an error resets the stream.
+  virtual HttpError onHttp2Header(size_t data_size, bool* ignore_data) = 0;
+  // The transaction is over. A stream the server refused, or that the
+  // connection dropped before its response began, fails with
+  // HE_DISCONNECTED and the response's scode untouched, so it may be sent
+  // again.
+  virtual void onHttp2Complete(HttpError err) = 0;
+  // The server didn't agree to HTTP/2, so the transaction wasn't sent, and
+  // should go over HTTP/1.1 instead.
+  virtual void onHttp2Unavailable() = 0;
+};
+
+//////////////////////////////////////////////////////////////////////
+// Http2Session
+// One HTTP/2 connection (RFC 7540), over which any number of transactions
+// run at once, each on a stream of its own. Documents are written to as
+// they arrive, and a document that blocks holds up only its own stream,
+// through flow control. Request documents are read as flow control lets
+// them be sent.
+//////////////////////////////////////////////////////////////////////
+
+class Http2Session : public MessageHandler, public has_slots<> {
+ public:
+  // Takes |stream|, which must be opening or open. If it runs over TLS,
+  // |ssl| is the adapter under it, which must have offered "h2" by ALPN;
+  // if the server doesn't pick it, the session is unavailable. Without
+  // |ssl|, the server is assumed to speak HTTP/2 (prior knowledge).
+  Http2Session(StreamInterface* stream, SSLAdapter* ssl);
+  virtual ~Http2Session();
+
+  // Whether another transaction may be submitted: the connection isn't
+  // closing, and the server's limit on concurrent streams allows one.
+  bool CanSubmit() const;
+  // Starts |transaction| on a new stream, and returns its id, or 0 if
+  // CanSubmit is false. |notify| hears of it from then on, never from
+  // within Submit. The request's path may be relative or absolute, and
+  // its Host header gives the authority. With |decode_content|, gzip and
+  // deflate documents are inflated, as HttpBase does.
+  uint32 Submit(HttpTransaction* transaction, IHttp2Notify* notify,
+                bool decode_content);
+  // Resets stream |id|, whose notify hears no more.
+  void Cancel(uint32 id);
+
+  // The number of streams open.
+  size_t active_streams() const { return streams_.size(); }
+  // Set once the server declined HTTP/2.
+  bool unavailable() const { return unavailable_; }
+  bool closed() const { return closed_; }
+
+  // Signalled once the session can take no more transactions: the
+  // connection closed or was refused, or the server sent GOAWAY. Streams
+  // already running may go on.
+  signal1<Http2Session*> SignalClosed;
+  // Signalled when the last open stream ends.
+  signal1<Http2Session*> SignalIdle;
+
+ private:
+  struct Stream;
+  typedef std::map<uint32, Stream*> StreamMap;
+
+  // Frames are written, and requests sent, from a message, so that
+  // Submit never notifies, and frames queued together go out together.
+  virtual void OnMessage(Message* msg);
+  void PostSend();
+
+  void OnStreamEvent(StreamInterface* stream, int events, int error);
+  void OnDocumentEvent(StreamInterface* stream, int events, int error);
+
+  // Once the connection opens, checks ALPN and sends the preface.
+  void Start();
+  void ReadFrames();
+  // Returns false if the connection failed.
+  bool ProcessFrame(uint8 type, uint8 flags, uint32 id, const char* payload,
+                    size_t len);
+  bool ProcessData(Stream* s, uint8 flags, const char* payload, size_t len);
+  bool ProcessHeaders(Stream* s, uint8 flags, uint32 id, const char* payload,
+                      size_t len);
+  bool ProcessHeaderBlock(uint32 id, bool end_stream);
+  bool ProcessSettings(uint8 flags, uint32 id, const char* payload,
+                       size_t len);
+  bool ProcessWindowUpdate(Stream* s, uint32 id, const char* payload,
+                           size_t len);
+
+  // Writes what the document can take of the data received on |s|,
+  // crediting the stream's window for it, and ends the stream once all of
+  // it has been written.
+  void FlushDocument(Stream* s);
+  // Queues request headers and documents as flow control allows.
+  void SendRequests();
+  void SendHeaders(Stream* s);
+  void SendBody(Stream* s);
+
+  void QueueFrame(uint8 type, uint8 flags, uint32 id, const char* payload,
+                  size_t len);
+  void QueueSettings();
+  void QueueWindowUpdate(uint32 id, uint32 increment);
+  void QueueRstStream(uint32 id, uint32 code);
+  void Flush();
+
+  // Ends stream |s|, removing it before its notify hears of it.
+  void CompleteStream(Stream* s, HttpError err);
+  // Resets |s| with |code| and ends it with |err|.
+  void ResetStream(Stream* s, uint32 code, HttpError err);
+  // Sends GOAWAY with |code| and closes the connection, failing every
+  // stream.
+  void Fail(uint32 code);
+  // Fails the streams above |last_id|, which the server never processed,
+  // as retriable.
+  void Abandon(uint32 last_id);
+  void Close();
+  // Takes no more transactions, and signals SignalClosed once.
+  void GoAway();
+  void CheckIdle();
+
+  Stream* FindStream(uint32 id);
+
+  Thread* thread_;
+  StreamInterface* stream_;
+  SSLAdapter* ssl_;
+  bool started_, unavailable_, closed_, going_away_, send_pending_;
+  HpackEncoder encoder_;
+  HpackDecoder decoder_;
+  StreamMap streams_;
+  uint32 next_id_;
+  // The highest stream id we opened, for refusing frames from the server
+  // on streams that never existed.
+  uint32 last_id_;
+  // The stream whose header block continues in CONTINUATION frames, and
+  // the block so far.
+  uint32 continuation_id_;
+  bool continuation_end_stream_;
+  std::string header_block_;
+  // The server's settings, once they arrive.
+  bool settings_received_;
+  uint32 max_streams_, max_frame_size_;
+  int32 initial_window_;
+  // Flow control windows for the connection, each way. Received data is
+  // credited back to the connection as it arrives; each stream is only
+  // credited as its document takes the data.
+  int32 send_window_, recv_window_;
+  std::string input_, output_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(Http2Session);
+};
+
+//////////////////////////////////////////////////////////////////////
+// Http2Pool
+// Keeps an HTTP/2 session to each server, over which HttpClients set to
+// use the pool send their transactions. Servers reached over TLS are
+// asked for HTTP/2 by ALPN, and those that decline are remembered, to be
+// left to HTTP/1.1. Cleartext servers are only spoken to over HTTP/2 if
+// set_cleartext says they all understand it.
+//////////////////////////////////////////////////////////////////////
+
+class Http2Pool : public has_slots<> {
+ public:
+  explicit Http2Pool(SocketFactory* factory);
+  virtual ~Http2Pool();
+
+  // Whether servers without TLS are assumed to speak HTTP/2 (prior
+  // knowledge). The default is false.
+  void set_cleartext(bool cleartext) { cleartext_ = cleartext; }
+  bool cleartext() const { return cleartext_; }
+
+  // Returns a session to |remote| that can take a transaction, connecting
+  // a new one if none can, or NULL if the server is known not to speak
+  // HTTP/2 or couldn't be connected to.
+  Http2Session* GetSession(const SocketAddress& remote, bool secure);
+
+  // The sessions open, and the servers known to speak only HTTP/1.1.
+  size_t session_count() const { return sessions_.size(); }
+  size_t http1_count() const { return http1_hosts_.size(); }
+
+ private:
+  struct Key {
+    Key(const SocketAddress& address, bool secure)
+        : address(address), secure(secure) { }
+    bool operator==(const Key& key) const {
+      return (secure == key.secure) && (address == key.address);
+    }
+    SocketAddress address;
+    bool secure;
+  };
+  typedef std::list<std::pair<Key, Http2Session*> > SessionList;
+
+  Http2Session* CreateSession(const Key& key);
+  void OnSessionClosed(Http2Session* session);
+  void OnSessionIdle(Http2Session* session);
+  void Remove(Http2Session* session);
+
+  Thread* thread_;
+  SocketFactory* factory_;
+  bool cleartext_;
+  SessionList sessions_;
+  std::vector<Key> http1_hosts_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(Http2Pool);
+};
+
+//////////////////////////////////////////////////////////////////////
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_HTTP2_H_
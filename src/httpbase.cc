@@ -37,11 +37,14 @@
 #define SEC_E_CERT_EXPIRED (-2146893016)
 #endif  // !WIN32
 
+#include <string.h>
+
 #include "common.h"
 #include "logging.h"
 #include "socket.h"
 #include "stringutils.h"
 #include "thread.h"
+#include "zlibstream.h"
 
 namespace txmpp {
 
@@ -90,13 +93,12 @@ HttpParser::Process(const char* buffer, size_t len, size_t* processed,
 
   while (true) {
     if (state_ < ST_DATA) {
-      size_t pos = *processed;
-      while ((pos < len) && (buffer[pos] != '\n')) {
-        pos += 1;
-      }
-      if (pos >= len) {
+      const char* eol = static_cast<const char*>(
+          memchr(buffer + *processed, '\n', len - *processed));
+      if (!eol) {
         break;  // don't have a full header
       }
+      size_t pos = eol - buffer;
       const char* line = buffer + *processed;
       size_t len = (pos - *processed);
       *processed = pos + 1;
@@ -155,7 +157,7 @@ HttpParser::ProcessLine(const char* line, size_t len, HttpError* error) {
 
   case ST_HEADERS:
     if (len > 0) {
-      const char* value = strchrn(line, len, ':');
+      const char* value = static_cast<const char*>(memchr(line, ':', len));
       if (!value) {
         *error = HE_PROTOCOL;
         return PR_COMPLETE;
@@ -167,12 +169,24 @@ HttpParser::ProcessLine(const char* line, size_t len, HttpError* error) {
       } while ((value < eol) && isspace(static_cast<unsigned char>(*value)));
       size_t vlen = eol - value;
       if (MatchHeader(line, nlen, HH_CONTENT_LENGTH)) {
-	unsigned int temp_size;
-        if (sscanf(value, "%u", &temp_size) != 1) {
+        // The value isn't terminated, so it is parsed within its length
+        const size_t kMaxSize = (SIZE_UNKNOWN - 9) / 10;
+        size_t digits = 0;
+        size_t temp_size = 0;
+        while ((digits < vlen) &&
+               isdigit(static_cast<unsigned char>(value[digits]))) {
+          if (temp_size > kMaxSize) {
+            *error = HE_PROTOCOL;
+            return PR_COMPLETE;
+          }
+          temp_size = temp_size * 10 + (value[digits] - '0');
+          digits += 1;
+        }
+        if (digits == 0) {
           *error = HE_PROTOCOL;
           return PR_COMPLETE;
         }
-	data_size_ = static_cast<size_t>(temp_size);
+        data_size_ = temp_size;
       } else if (MatchHeader(line, nlen, HH_TRANSFER_ENCODING)) {
         if ((vlen == 7) && (_strnicmp(value, "chunked", 7) == 0)) {
           chunked_ = true;
@@ -374,7 +388,9 @@ private:
 //////////////////////////////////////////////////////////////////////
 
 HttpBase::HttpBase() : mode_(HM_NONE), data_(NULL), notify_(NULL),
-                       http_stream_(NULL), doc_stream_(NULL) {
+                       http_stream_(NULL), doc_stream_(NULL),
+                       decode_content_(false), decoding_(false),
+                       decode_ahead_(0), recv_buffered_(false) {
 }
 
 HttpBase::~HttpBase() {
@@ -394,6 +410,7 @@ HttpBase::attach(StreamInterface* stream) {
   }
   http_stream_ = stream;
   http_stream_->SignalEvent.connect(this, &HttpBase::OnHttpStreamEvent);
+  recv_buffered_ = false;
   mode_ = (http_stream_->GetState() == SS_OPENING) ? HM_CONNECT : HM_NONE;
   return true;
 }
@@ -412,6 +429,16 @@ HttpBase::detach() {
   return stream;
 }
 
+StreamInterface*
+HttpBase::detach(std::string* pending) {
+  if (recv_buffered_) {
+    pending->append(buffer_, len_);
+  }
+  len_ = 0;
+  recv_buffered_ = false;
+  return detach();
+}
+
 void
 HttpBase::send(HttpData* data) {
   ASSERT(HM_NONE == mode_);
@@ -425,6 +452,7 @@ HttpBase::send(HttpData* data) {
   mode_ = HM_SEND;
   data_ = data;
   len_ = 0;
+  recv_buffered_ = false;
   ignore_data_ = chunk_data_ = false;
 
   if (data_->document.get()) {
@@ -461,8 +489,12 @@ HttpBase::recv(HttpData* data) {
 
   mode_ = HM_RECV;
   data_ = data;
-  len_ = 0;
+  if (!recv_buffered_)
+    len_ = 0;
+  recv_buffered_ = false;
   ignore_data_ = chunk_data_ = false;
+  decoding_ = false;
+  decode_ahead_ = 0;
 
   reset();
   if (doc_stream_) {
@@ -746,6 +778,8 @@ HttpBase::do_complete(HttpError err) {
   ASSERT(mode_ != HM_NONE);
   HttpMode mode = mode_;
   mode_ = HM_NONE;
+  recv_buffered_ = (HM_RECV == mode) && (HE_NONE == err) && (len_ > 0);
+  decoding_ = false;
   if (data_ && data_->document.get()) {
     data_->document->SignalEvent.disconnect(this);
   }
@@ -833,8 +867,7 @@ HttpBase::ProcessLeader(const char* line, size_t len, HttpError* error) {
 HttpParser::ProcessResult
 HttpBase::ProcessHeader(const char* name, size_t nlen, const char* value,
                         size_t vlen, HttpError* error) {
-  std::string sname(name, nlen), svalue(value, vlen);
-  data_->addHeader(sname, svalue);
+  data_->addReceivedHeader(name, nlen, value, vlen);
   return PR_CONTINUE;
 }
 
@@ -842,6 +875,9 @@ HttpParser::ProcessResult
 HttpBase::ProcessHeaderComplete(bool chunked, size_t& data_size,
                                 HttpError* error) {
   StreamInterface* old_docstream = doc_stream_;
+  if (decode_content_ && (HM_RECV == mode_)) {
+    StartDecoding();
+  }
   if (notify_) {
     *error = notify_->onHttpHeaderComplete(chunked, data_size);
     // The request must not be aborted as a result of this callback.
@@ -868,8 +904,23 @@ HttpBase::ProcessData(const char* data, size_t len, size_t& read,
     read = len;
     return PR_CONTINUE;
   }
+  if (decoding_) {
+    return DecodeData(data, len, read, error);
+  }
+  return WriteDocument(data, len, &read, error);
+}
+
+void
+HttpBase::OnComplete(HttpError err) {
+  LOG_F(LS_VERBOSE);
+  do_complete(err);
+}
+
+HttpParser::ProcessResult
+HttpBase::WriteDocument(const char* data, size_t len, size_t* written,
+                        HttpError* error) {
   int write_error = 0;
-  switch (data_->document->Write(data, len, &read, &write_error)) {
+  switch (data_->document->Write(data, len, written, &write_error)) {
   case SR_SUCCESS:
     return PR_CONTINUE;
   case SR_BLOCK:
@@ -887,9 +938,67 @@ HttpBase::ProcessData(const char* data, size_t len, size_t& read,
 }
 
 void
-HttpBase::OnComplete(HttpError err) {
-  LOG_F(LS_VERBOSE);
-  do_complete(err);
+HttpBase::StartDecoding() {
+  std::string encoding;
+  if (!data_->hasHeader(HH_CONTENT_ENCODING, &encoding))
+    return;
+  encoding = string_trim(encoding);
+  if ((_stricmp(encoding.c_str(), "gzip") != 0)
+      && (_stricmp(encoding.c_str(), "x-gzip") != 0)
+      && (_stricmp(encoding.c_str(), "deflate") != 0)) {
+    // Others, and lists of several, are passed on as they are.
+    return;
+  }
+  if (!inflater_.get())
+    inflater_.reset(new ZlibInflater);
+  if (!inflater_->Start())
+    return;
+  decoding_ = true;
+  // The headers now describe the document as it will be written.
+  data_->clearHeader(HH_CONTENT_ENCODING);
+  data_->clearHeader(HH_CONTENT_LENGTH);
+}
+
+HttpParser::ProcessResult
+HttpBase::DecodeData(const char* data, size_t len, size_t& read,
+                     HttpError* error) {
+  // The first bytes may have been inflated on the last call.
+  size_t used = _min(decode_ahead_, len);
+  decode_ahead_ = 0;
+  for (;;) {
+    while (inflater_->output_len() > 0) {
+      size_t written = 0;
+      ProcessResult result = WriteDocument(inflater_->output(),
+                                           inflater_->output_len(),
+                                           &written, error);
+      if (PR_BLOCK == result) {
+        // Hold the last byte inflated back until the output is taken.  A
+        // blocked result is retried with all of the same data.
+        if (used <= 1) {
+          decode_ahead_ = used;
+          return PR_BLOCK;
+        }
+        decode_ahead_ = 1;
+        read = used - 1;
+        return PR_CONTINUE;
+      }
+      if (PR_CONTINUE != result)
+        return result;
+      inflater_->Consume(written);
+    }
+    if ((used == len) || inflater_->finished()) {
+      // Anything after the end of the compressed data is dropped.
+      break;
+    }
+    size_t taken = 0;
+    if (!inflater_->Inflate(data + used, len - used, &taken)) {
+      *error = HE_STREAM;
+      return PR_COMPLETE;
+    }
+    used += taken;
+  }
+  read = len;
+  return PR_CONTINUE;
 }
 
 }  // namespace txmpp
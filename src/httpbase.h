@@ -37,10 +37,12 @@
 #endif
 
 #include "httpcommon.h"
+#include "scoped_ptr.h"
 
 namespace txmpp {
 
 class StreamInterface;
+class ZlibInflater;
 
 ///////////////////////////////////////////////////////////////////////////////
 // HttpParser - Parses an HTTP stream provided via Process and end_of_input, and
@@ -124,9 +126,14 @@ public:
   bool attach(StreamInterface* stream);
   StreamInterface* stream() { return http_stream_; }
   StreamInterface* detach();
+  // Detaches the stream, and moves the bytes read past the end of the last
+  // response to |pending|, for a protocol taking the stream over.
+  StreamInterface* detach(std::string* pending);
   bool isConnected() const;
 
   void send(HttpData* data);
+  // Bytes read past the end of the last response are kept for the next
+  // recv, so that pipelined responses can be read one after another.
   void recv(HttpData* data);
   void abort(HttpError err);
 
@@ -135,6 +142,15 @@ public:
   void set_ignore_data(bool ignore) { ignore_data_ = ignore; }
   bool ignore_data() const { return ignore_data_; }
 
+  // Received documents with a Content-Encoding of gzip or deflate are then
+  // inflated on their way to the document, and their Content-Encoding and
+  // Content-Length headers are dropped before notify sees them.  Off by
+  // default.
+  void set_decode_content(bool decode) { decode_content_ = decode; }
+  bool decode_content() const { return decode_content_; }
+  // Set while the document being received is inflated.
+  bool decoding() const { return decoding_; }
+
   // Obtaining this stream puts HttpBase into stream mode until the stream
   // is closed.  HttpBase can only expose one open stream interface at a time.
   // Further calls will return NULL.
@@ -180,6 +196,14 @@ protected:
                                     HttpError* error);
   virtual void OnComplete(HttpError err);
 
+  // Writes document data, mapping the result as ProcessData returns it.
+  ProcessResult WriteDocument(const char* data, size_t len, size_t* written,
+                              HttpError* error);
+  // Sets decoding_ if the received headers call for it.
+  void StartDecoding();
+  ProcessResult DecodeData(const char* data, size_t len, size_t& read,
+                           HttpError* error);
+
 private:
   class DocumentStream;
   friend class DocumentStream;
@@ -195,6 +219,14 @@ private:
   size_t len_;
 
   bool ignore_data_, chunk_data_;
+  // While decoding_, the inflated bytes wait in inflater_ until the document
+  // takes them.  The last decode_ahead_ bytes inflated have not been counted
+  // as read, so that the document can't end while output is waiting.
+  bool decode_content_, decoding_;
+  size_t decode_ahead_;
+  scoped_ptr<ZlibInflater> inflater_;
+  // Set while buffer_ holds received bytes past the end of the last response.
+  bool recv_buffered_;
   HttpData::const_iterator header_;
 };
 
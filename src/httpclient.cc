@@ -28,11 +28,15 @@
 #include "httpclient.h"
 
 #include <time.h>
+#include <algorithm>
+#include <map>
+#include <vector>
 
 #include "httpcommon-inl.h"
 
 #include "asyncsocket.h"
 #include "common.h"
+#include "criticalsection.h"
 #include "diskcache.h"
 #include "logging.h"
 #include "pathutils.h"
@@ -103,7 +107,9 @@ enum HttpCacheState {
   HCS_NONE    // Not in cache
 };
 
-HttpCacheState HttpGetCacheState(const HttpTransaction& t) {
+// If the entry is stale, staleness is set to the seconds it has been so.
+HttpCacheState HttpGetCacheState(const HttpTransaction& t,
+                                 unsigned long* staleness) {
   // Temporaries
   std::string s_temp;
   unsigned long i_temp;
@@ -154,10 +160,39 @@ HttpCacheState HttpGetCacheState(const HttpTransaction& t) {
     // TODO: Issue warning 113 if age > 24 hours
     lifetime = (now - i_temp) / 10;
   } else {
-    return HCS_STALE;
+    lifetime = 0;
   }
 
-  return (lifetime > current_age) ? HCS_FRESH : HCS_STALE;
+  if (lifetime > current_age)
+    return HCS_FRESH;
+  *staleness = current_age - lifetime;
+  return HCS_STALE;
+}
+
+// Whether a response stale by |staleness| seconds may still be served, per
+// its stale-while-revalidate or stale-if-error directive (RFC 5861).
+bool HttpMayServeStale(const HttpResponseData& response, const char* directive,
+                       unsigned long staleness) {
+  std::string value;
+  if (!response.hasHeader(HH_CACHE_CONTROL, &value))
+    return false;
+  HttpAttributeList cache_control;
+  HttpParseAttributes(value.data(), value.size(), cache_control);
+  unsigned long allowance;
+  if (HttpHasAttribute(cache_control, "must-revalidate", NULL)
+      || HttpHasAttribute(cache_control, "no-cache", NULL)
+      || !HttpHasAttribute(cache_control, directive, &value)
+      || !HttpStringToInt(value, &allowance))
+    return false;
+  return (staleness <= allowance);
+}
+
+// Errors that leave the origin's answer unknown, so that a stale entry may
+// stand in for it.
+bool HttpIsTransportError(HttpError err) {
+  return (HE_DISCONNECTED == err) || (HE_CONNECT_FAILED == err)
+         || (HE_SOCKET_ERROR == err) || (HE_PROTOCOL == err)
+         || (HE_CERTIFICATE_EXPIRED == err) || (HE_DEFAULT == err);
 }
 
 enum HttpValidatorStrength {
@@ -204,6 +239,27 @@ std::string GetCacheID(const HttpRequestData& request) {
 
 }  // anonymous namespace
 
+// A GET being fetched by one client, with the clients waiting for it.
+// Waiters that give up leave a NULL in their place.
+struct HttpClient::PendingFetch {
+  typedef std::pair<DiskCache*, std::string> Key;
+  typedef std::map<Key, PendingFetch*> Map;
+
+  // Fetches in progress, by cache and id.  The lock guards only the map;
+  // the clients of one cache all run on one thread.
+  static CriticalSection& Lock() {
+    static CriticalSection* const crit = new CriticalSection;
+    return *crit;
+  }
+  static Map& All() {
+    static Map* const fetches = new Map;
+    return *fetches;
+  }
+
+  Key key;
+  std::vector<HttpClient*> waiters;
+};
+
 //////////////////////////////////////////////////////////////////////
 // Public Helpers
 //////////////////////////////////////////////////////////////////////
@@ -282,40 +338,83 @@ const size_t kMaxRedirects = 5;
 
 HttpClient::HttpClient(const std::string& agent, StreamPool* pool,
                        HttpTransaction* transaction)
-    : agent_(agent), pool_(pool),
+    : agent_(agent), pool_(pool), secure_(false),
       transaction_(transaction), free_transaction_(false),
+      pipeline_depth_(1), pipelined_(false), pipeline_ok_(true),
       retries_(kDefaultRetries), attempt_(0), redirects_(0),
       redirect_action_(REDIRECT_DEFAULT),
-      uri_form_(URI_DEFAULT), cache_(NULL), cache_state_(CS_READY) {
+      uri_form_(URI_DEFAULT), cache_(NULL), cache_state_(CS_READY),
+      stale_if_error_(false), force_validate_(false), coalesce_(true),
+      fetch_(NULL), http2_(NULL), h2_session_(NULL), h2_stream_(0),
+      upgraded_(false) {
   base_.notify(this);
+  base_.set_decode_content(true);
   if (NULL == transaction_) {
     free_transaction_ = true;
     transaction_ = new HttpTransaction;
   }
+  home_transaction_ = transaction_;
 }
 
 HttpClient::~HttpClient() {
   base_.notify(NULL);
   base_.abort(HE_SHUTDOWN);
+  if (h2_session_) {
+    h2_session_->Cancel(h2_stream_);
+    h2_session_ = NULL;
+  }
+  CancelWait();
+  EndFetch(false);
   release();
   if (free_transaction_)
-    delete transaction_;
+    delete home_transaction_;
 }
 
 void HttpClient::reset() {
+  // Drop the queue first, so that ending the active request doesn't start
+  // the next one.  The responses still due on the stream will never be read,
+  // so it can't be reused.
+  queued_.clear();
+  CancelWait();
+  if (!sent_.empty()) {
+    sent_.clear();
+    if (base_.stream())
+      base_.stream()->Close();
+  }
+  if (HM_NONE == base_.mode())
+    release();
+  if (transaction_ != home_transaction_) {
+    abort(HE_OPERATION_CANCELLED);
+    transaction_ = home_transaction_;
+  }
   server_.Clear();
+  secure_ = false;
   request().clear(true);
   response().clear(true);
   context_.reset();
   redirects_ = 0;
-  base_.abort(HE_OPERATION_CANCELLED);
+  abort(HE_OPERATION_CANCELLED);
+  EndFetch(false);
+}
+
+void HttpClient::abort(HttpError err) {
+  if (h2_session_) {
+    h2_session_->Cancel(h2_stream_);
+    h2_session_ = NULL;
+    h2_stream_ = 0;
+    onHttpComplete(HM_RECV, err);
+  } else {
+    base_.abort(err);
+  }
 }
 
 void HttpClient::set_server(const SocketAddress& address) {
+  if (address != server_)
+    pipeline_ok_ = true;
   server_ = address;
   // Setting 'Host' here allows it to be overridden before starting the request,
   // if necessary.
-  request().setHeader(HH_HOST, HttpAddress(server_, false), true);
+  request().setHeader(HH_HOST, HttpAddress(server_, secure_), true);
 }
 
 StreamInterface* HttpClient::GetDocumentStream() {
@@ -323,7 +422,7 @@ StreamInterface* HttpClient::GetDocumentStream() {
 }
 
 void HttpClient::start() {
-  if (base_.mode() != HM_NONE) {
+  if (busy()) {
     // call reset() to abort an in-progress request
     ASSERT(false);
     return;
@@ -339,56 +438,130 @@ void HttpClient::start() {
   }
 
   attempt_ = 0;
+  pipelined_ = false;
+  PrepareRequest(&request());
 
+  if ((NULL != cache_) && (CheckCache(false) || JoinFetch())) {
+    return;
+  }
+
+  connect();
+}
+
+StreamInterface* HttpClient::DetachUpgradedStream(std::string* pending) {
+  if (!upgraded_) {
+    return NULL;
+  }
+  upgraded_ = false;
+  return base_.detach(pending);
+}
+
+void HttpClient::queue(HttpTransaction* transaction) {
+  ASSERT(NULL != transaction);
+  transaction->request.setHeader(HH_HOST, HttpAddress(server_, secure_),
+                                 false);
+  transaction->response.clear(false);
+  queued_.push_back(transaction);
+}
+
+void HttpClient::PrepareRequest(HttpRequestData* request) {
   // If no content has been specified, using length of 0.
-  request().setHeader(HH_CONTENT_LENGTH, "0", false);
+  request->setHeader(HH_CONTENT_LENGTH, "0", false);
 
   if (!agent_.empty()) {
-    request().setHeader(HH_USER_AGENT, agent_, false);
+    request->setHeader(HH_USER_AGENT, agent_, false);
+  }
+
+  if (base_.decode_content()) {
+    request->setHeader(HH_ACCEPT_ENCODING, "gzip, deflate", false);
   }
 
   UriForm uri_form = uri_form_;
   if (PROXY_HTTPS == proxy_.type) {
     // Proxies require absolute form
     uri_form = URI_ABSOLUTE;
-    request().version = HVER_1_0;
-    request().setHeader(HH_PROXY_CONNECTION, "Keep-Alive", false);
+    request->version = HVER_1_0;
+    request->setHeader(HH_PROXY_CONNECTION, "Keep-Alive", false);
   } else {
-    request().setHeader(HH_CONNECTION, "Keep-Alive", false);
+    request->setHeader(HH_CONNECTION, "Keep-Alive", false);
   }
 
   if (URI_ABSOLUTE == uri_form) {
     // Convert to absolute uri form
     std::string url;
-    if (request().getAbsoluteUri(&url)) {
-      request().path = url;
+    if (request->getAbsoluteUri(&url)) {
+      request->path = url;
     } else {
       LOG(LS_WARNING) << "Couldn't obtain absolute uri";
     }
   } else if (URI_RELATIVE == uri_form) {
     // Convert to relative uri form
     std::string host, path;
-    if (request().getRelativeUri(&host, &path)) {
-      request().setHeader(HH_HOST, host);
-      request().path = path;
+    if (request->getRelativeUri(&host, &path)) {
+      request->setHeader(HH_HOST, host);
+      request->path = path;
     } else {
       LOG(LS_WARNING) << "Couldn't obtain relative uri";
     }
   }
+}
+
+bool HttpClient::CanPipeline(const HttpRequestData& request) const {
+  // Only idempotent requests may be sent again if the server drops them.
+  return ((HV_GET == request.verb) || (HV_HEAD == request.verb))
+         && !request.document.get()
+         && (HVER_1_1 == request.version)
+         && (PROXY_HTTPS != proxy_.type)
+         && (NULL == cache_)
+         && !request.hasHeader(HH_UPGRADE, NULL);
+}
 
-  if ((NULL != cache_) && CheckCache()) {
+bool HttpClient::SendPipelined() {
+  if (!pipeline_ok_ || queued_.empty()
+      || (sent_.size() + 1 >= pipeline_depth_)
+      || !CanPipeline(request()) || !CanPipeline(queued_.front()->request))
+    return false;
+  HttpTransaction* next = queued_.front();
+  queued_.pop_front();
+  PrepareRequest(&next->request);
+  sent_.push_back(next);
+  base_.send(&next->request);
+  return true;
+}
+
+void HttpClient::StartNext() {
+  if (busy()) {
+    // A request was started in response to SignalHttpClientComplete; the
+    // queue resumes after it.
     return;
   }
-
-  connect();
+  redirects_ = 0;
+  context_.reset();
+  if (!sent_.empty()) {
+    transaction_ = sent_.front();
+    sent_.pop_front();
+    attempt_ = 0;
+    pipelined_ = true;
+    base_.recv(&transaction_->response);
+  } else if (!queued_.empty()) {
+    transaction_ = queued_.front();
+    queued_.pop_front();
+    start();
+  }
 }
 
 void HttpClient::connect() {
+  // A stream kept for pipelined responses can't serve another request.
+  release();
+  if (ConnectHttp2()) {
+    return;
+  }
   int stream_err;
-  StreamInterface* stream = pool_->RequestConnectedStream(server_, &stream_err);
+  StreamInterface* stream = pool_->RequestStream(server_, secure_,
+                                                &stream_err);
   if (stream == NULL) {
     ASSERT(0 != stream_err);
-    LOG(LS_ERROR) << "RequestConnectedStream error: " << stream_err;
+    LOG(LS_ERROR) << "RequestStream error: " << stream_err;
     onHttpComplete(HM_CONNECT, HE_CONNECT_FAILED);
   } else {
     base_.attach(stream);
@@ -398,31 +571,76 @@ void HttpClient::connect() {
   }
 }
 
+bool HttpClient::ConnectHttp2() {
+  // HTTP/2 has no upgrade of a stream to another protocol.
+  if ((NULL == http2_) || (PROXY_NONE != proxy_.type)
+      || request().hasHeader(HH_UPGRADE, NULL)) {
+    return false;
+  }
+  Http2Session* session = http2_->GetSession(server_, secure_);
+  if (NULL == session) {
+    return false;
+  }
+  // Set as HttpBase would on a new response.
+  base_.set_ignore_data(false);
+  h2_stream_ = session->Submit(transaction_, this, decode_content());
+  if (0 == h2_stream_) {
+    return false;
+  }
+  h2_session_ = session;
+  return true;
+}
+
 void HttpClient::prepare_get(const std::string& url) {
   reset();
-  Url<char> purl(url);
-  set_server(SocketAddress(purl.host(), purl.port()));
+  UrlView<char> purl(url.data(), url.size());
+  secure_ = purl.secure();
+  set_server(SocketAddress(std::string(purl.host(), purl.host_length()),
+                           purl.port()));
   request().verb = HV_GET;
-  request().path = purl.full_path();
+  request().path.clear();
+  purl.append_full_path(&request().path);
 }
 
 void HttpClient::prepare_post(const std::string& url,
                               const std::string& content_type,
                               StreamInterface* request_doc) {
   reset();
-  Url<char> purl(url);
-  set_server(SocketAddress(purl.host(), purl.port()));
+  UrlView<char> purl(url.data(), url.size());
+  secure_ = purl.secure();
+  set_server(SocketAddress(std::string(purl.host(), purl.host_length()),
+                           purl.port()));
   request().verb = HV_POST;
-  request().path = purl.full_path();
+  request().path.clear();
+  purl.append_full_path(&request().path);
   request().setContent(content_type, request_doc);
 }
 
 void HttpClient::release() {
+  if (upgraded_) {
+    // It speaks another protocol now, so it can't go back to the pool.
+    upgraded_ = false;
+    if (base_.stream())
+      base_.stream()->Close();
+  }
+  if (!sent_.empty()) {
+    // The responses to these were never read, so the stream can't be reused.
+    // They are sent again on the next one.
+    if (base_.stream())
+      base_.stream()->Close();
+    queued_.insert(queued_.begin(), sent_.begin(), sent_.end());
+    sent_.clear();
+  }
   if (StreamInterface* stream = base_.detach()) {
     pool_->ReturnConnectedStream(stream);
   }
 }
 
+bool HttpClient::IsUpgrade() const {
+  return (HC_SWITCHING_PROTOCOLS == response().scode)
+         && request().hasHeader(HH_UPGRADE, NULL);
+}
+
 bool HttpClient::ShouldRedirect(std::string* location) const {
   // TODO: Unittest redirection.
   if ((REDIRECT_NEVER == redirect_action_)
@@ -451,7 +669,14 @@ bool HttpClient::BeginCacheFile() {
     return false;
   }
 
-  scoped_ptr<StreamInterface> stream(cache_->WriteResource(id, kCacheBody));
+  // Bodies still encoded some way HttpBase couldn't decode are left alone.
+  DiskCache::Compression compression = DiskCache::CC_NONE;
+  std::string content_type;
+  if (response().hasHeader(HH_CONTENT_TYPE, &content_type)
+      && !response().hasHeader(HH_CONTENT_ENCODING, NULL))
+    compression = DiskCache::CompressionFor(content_type);
+  scoped_ptr<StreamInterface> stream(cache_->WriteResource(id, kCacheBody,
+                                                           compression));
   if (!stream.get()) {
     LOG_F(LS_ERROR) << "Couldn't open body cache";
     return false;
@@ -484,7 +709,7 @@ HttpError HttpClient::WriteCacheHeaders(const std::string& id) {
   return HE_NONE;
 }
 
-void HttpClient::CompleteCacheFile() {
+bool HttpClient::CompleteCacheFile(HttpError err) {
   // Restore previous response document
   StreamTap* tap = static_cast<StreamTap*>(response().document.release());
   response().document.reset(tap->Detach());
@@ -497,14 +722,21 @@ void HttpClient::CompleteCacheFile() {
 
   if (SR_SUCCESS != result) {
     LOG(LS_ERROR) << "Cache file error: " << error;
-    cache_->DeleteResource(GetCacheID(request()));
+  } else if (HE_NONE != err) {
+    // Don't keep the part of a document that arrived before the failure.
+    LOG(LS_WARNING) << "Cache file incomplete: " << err;
+  } else {
+    return true;
   }
+  cache_->DeleteResource(GetCacheID(request()));
+  return false;
 }
 
-bool HttpClient::CheckCache() {
+bool HttpClient::CheckCache(bool any_age) {
   ASSERT(NULL != cache_);
   ASSERT(CS_READY == cache_state_);
 
+  stale_if_error_ = false;
   std::string id = GetCacheID(request());
   if (!cache_->HasResource(id)) {
     // No cache file available
@@ -513,16 +745,32 @@ bool HttpClient::CheckCache() {
 
   HttpError error = ReadCacheHeaders(id, true);
 
-  if (HE_NONE == error) {
-    switch (HttpGetCacheState(*transaction_)) {
+  bool revalidate = false;
+  if ((HE_NONE == error) && !any_age) {
+    unsigned long staleness = 0;
+    HttpCacheState state = HttpGetCacheState(*transaction_, &staleness);
+    if (force_validate_ && (HCS_FRESH == state)) {
+      state = HCS_STALE;
+    }
+    switch (state) {
     case HCS_FRESH:
       // Cache content is good, read from cache
       break;
     case HCS_STALE:
+      // Cache content may be served while it is checked in the background.
+      if (!force_validate_
+          && HttpMayServeStale(response(), "stale-while-revalidate",
+                               staleness)) {
+        revalidate = true;
+        break;
+      }
       // Cache content may be acceptable.  Issue a validation request.
+      stale_if_error_ =
+        HttpMayServeStale(response(), "stale-if-error", staleness);
       if (PrepareValidate()) {
         return false;
       }
+      stale_if_error_ = false;
       // Couldn't validate, fall through.
     case HCS_NONE:
       // Cache content is not useable.  Issue a regular request.
@@ -542,7 +790,14 @@ bool HttpClient::CheckCache() {
     return false;
   }
 
+  if (revalidate) {
+    Revalidate();
+  }
+  bool more = !queued_.empty();
   SignalHttpClientComplete(this, error);
+  if (more) {
+    StartNext();
+  }
   return true;
 }
 
@@ -621,17 +876,125 @@ HttpError HttpClient::CompleteValidate() {
 
   // Merge cached headers with new headers
   HttpError error = ReadCacheHeaders(id, false);
-  if (HE_NONE != error) {
+  if (HE_NONE == error) {
     // Rewrite merged headers to cache
     CacheLock lock(cache_, id);
     error = WriteCacheHeaders(id);
   }
-  if (HE_NONE != error) {
+  if (HE_NONE == error) {
+    error = ReadCacheBody(id);
+  }
+  return error;
+}
+
+HttpError HttpClient::ServeStale() {
+  ASSERT(CS_VALIDATING == cache_state_);
+  ASSERT(stale_if_error_);
+  stale_if_error_ = false;
+
+  std::string id = GetCacheID(request());
+  LOG(LS_INFO) << "HttpClient: validation failed, serving stale " << id;
+
+  response().clear(false);
+  HttpError error = ReadCacheHeaders(id, true);
+  if (HE_NONE == error) {
     error = ReadCacheBody(id);
   }
   return error;
 }
 
+void HttpClient::Revalidate() {
+  if (!revalidator_.get()) {
+    revalidator_.reset(new HttpClient(agent_, pool_));
+    revalidator_->force_validate_ = true;
+  } else if (revalidator_->busy() || revalidator_->IsCacheActive()) {
+    // The last one is still going; this entry waits for a later request.
+    return;
+  }
+  HttpClient* client = revalidator_.get();
+  client->reset();
+  client->set_pool(pool_);
+  client->set_proxy(proxy_);
+  client->set_uri_form(uri_form_);
+  client->set_decode_content(decode_content());
+  client->set_coalesce_requests(coalesce_);
+  client->set_cache(cache_);
+  client->set_secure(secure_);
+  client->set_server(server_);
+  // The request as sent, which has no document.  The response has none
+  // either, so a changed entry is only written to the cache.
+  client->request().copy(request());
+  client->start();
+}
+
+bool HttpClient::JoinFetch() {
+  ASSERT(NULL != cache_);
+  if (!coalesce_ || (NULL != fetch_)
+      || (HV_GET != request().verb) || request().document.get()
+      || request().hasHeader(HH_RANGE, NULL)) {
+    return false;
+  }
+  PendingFetch::Key key(cache_, GetCacheID(request()));
+  CritScope cs(&PendingFetch::Lock());
+  PendingFetch::Map& fetches = PendingFetch::All();
+  PendingFetch::Map::iterator it = fetches.find(key);
+  if (it != fetches.end()) {
+    fetch_ = it->second;
+    fetch_->waiters.push_back(this);
+    cache_state_ = CS_WAITING;
+    return true;
+  }
+  fetch_ = new PendingFetch;
+  fetch_->key = key;
+  fetches[key] = fetch_;
+  return false;
+}
+
+void HttpClient::EndFetch(bool stored) {
+  if ((NULL == fetch_) || (CS_WAITING == cache_state_)) {
+    return;
+  }
+  PendingFetch* fetch = fetch_;
+  fetch_ = NULL;
+  {
+    CritScope cs(&PendingFetch::Lock());
+    PendingFetch::All().erase(fetch->key);
+  }
+  // A waiter may finish, and so reset or delete other waiters, before the
+  // next is woken.
+  for (size_t i = 0; i < fetch->waiters.size(); ++i) {
+    HttpClient* waiter = fetch->waiters[i];
+    if (NULL == waiter)
+      continue;
+    fetch->waiters[i] = NULL;
+    waiter->fetch_ = NULL;
+    waiter->OnFetchDone(stored);
+  }
+  delete fetch;
+}
+
+void HttpClient::CancelWait() {
+  if ((NULL == fetch_) || (CS_WAITING != cache_state_)) {
+    return;
+  }
+  std::vector<HttpClient*>& waiters = fetch_->waiters;
+  std::replace(waiters.begin(), waiters.end(), this,
+               static_cast<HttpClient*>(NULL));
+  fetch_ = NULL;
+  cache_state_ = CS_READY;
+}
+
+void HttpClient::OnFetchDone(bool stored) {
+  ASSERT(CS_WAITING == cache_state_);
+  cache_state_ = CS_READY;
+  // If the fetch didn't leave an entry, this request may find a stale one
+  // to validate, or go to the network itself.
+  if (CheckCache(stored) || JoinFetch()) {
+    return;
+  }
+  connect();
+}
+
 HttpError HttpClient::OnHeaderAvailable(bool ignore_data, bool chunked,
                                         size_t data_size) {
   // If we are ignoring the data, this is an intermediate header.
@@ -658,6 +1021,11 @@ HttpError HttpClient::onHttpHeaderComplete(bool chunked, size_t& data_size) {
     if (HC_NOT_MODIFIED == response().scode) {
       return CompleteValidate();
     }
+    if (stale_if_error_ && HttpCodeIsServerError(response().scode)) {
+      // The error document is dropped in favour of the cached one.
+      base_.set_ignore_data(true);
+      return ServeStale();
+    }
     // Should we remove conditional headers from request?
     cache_state_ = CS_READY;
     cache_->DeleteResource(GetCacheID(request()));
@@ -676,7 +1044,10 @@ HttpError HttpClient::onHttpHeaderComplete(bool chunked, size_t& data_size) {
     base_.set_ignore_data(true);
   }
 
-  HttpError error = OnHeaderAvailable(base_.ignore_data(), chunked, data_size);
+  // The size of an inflated document isn't known until it ends.
+  HttpError error = OnHeaderAvailable(base_.ignore_data(), chunked,
+                                      base_.decoding() ? SIZE_UNKNOWN
+                                                       : data_size);
   if (HE_NONE != error) {
     return error;
   }
@@ -700,6 +1071,11 @@ void HttpClient::onHttpComplete(HttpMode mode, HttpError err) {
     // received anything meaningful from the server, so we are eligible for a
     // retry.
     ++attempt_;
+    if (pipelined_ || !sent_.empty()) {
+      LOG(LS_INFO) << "HttpClient: server dropped pipelined requests, "
+                   << "no longer pipelining";
+      pipeline_ok_ = false;
+    }
     if (request().document.get() && !request().document->Rewind()) {
       // Unable to replay the request document.
       err = HE_STREAM;
@@ -709,25 +1085,41 @@ void HttpClient::onHttpComplete(HttpMode mode, HttpError err) {
       return;
     }
   } else if (err != HE_NONE) {
-    // fall through
+    if ((CS_VALIDATING == cache_state_) && stale_if_error_
+        && HttpIsTransportError(err)) {
+      err = ServeStale();
+    }
   } else if (mode == HM_CONNECT) {
     base_.send(&transaction_->request);
     return;
-  } else if ((mode == HM_SEND) || HttpCodeIsInformational(response().scode)) {
+  } else if ((mode == HM_SEND) && SendPipelined()) {
+    return;
+  } else if ((mode == HM_SEND)
+             || (HttpCodeIsInformational(response().scode) && !IsUpgrade())) {
     // If you're interested in informational headers, catch
     // SignalHeaderAvailable.
     base_.recv(&transaction_->response);
     return;
+  } else if (IsUpgrade()) {
+    // Left attached for DetachUpgradedStream.
+    upgraded_ = true;
   } else {
-    if (!HttpShouldKeepAlive(response())) {
+    if (!HttpShouldKeepAlive(response()) && base_.stream()) {
       LOG(LS_VERBOSE) << "HttpClient: closing socket";
       base_.stream()->Close();
     }
+    if (HVER_1_0 == response().version) {
+      // HTTP/1.0 servers may not read past the first request.
+      pipeline_ok_ = false;
+    }
     std::string location;
     if (ShouldRedirect(&location)) {
-      Url<char> purl(location);
-      set_server(SocketAddress(purl.host(), purl.port()));
-      request().path = purl.full_path();
+      UrlView<char> purl(location.data(), location.size());
+      secure_ = purl.secure();
+      set_server(SocketAddress(std::string(purl.host(), purl.host_length()),
+                               purl.port()));
+      request().path.clear();
+      purl.append_full_path(&request().path);
       if (response().scode == HC_SEE_OTHER) {
         request().verb = HV_GET;
         request().clearHeader(HH_CONTENT_TYPE);
@@ -781,14 +1173,25 @@ void HttpClient::onHttpComplete(HttpMode mode, HttpError err) {
       }
     }
   }
+  bool stored = false;
   if (CS_WRITING == cache_state_) {
-    CompleteCacheFile();
-    cache_state_ = CS_READY;
+    stored = CompleteCacheFile(err);
   } else if (CS_READING == cache_state_) {
-    cache_state_ = CS_READY;
+    stored = (HE_NONE == err);
   }
-  release();
+  cache_state_ = CS_READY;
+  stale_if_error_ = false;
+  EndFetch(stored);
+  // Keep the stream while pipelined responses are due on it.
+  if (!upgraded_
+      && ((HE_NONE != err) || sent_.empty() || !base_.isConnected())) {
+    release();
+  }
+  bool more = !sent_.empty() || !queued_.empty();
   SignalHttpClientComplete(this, err);
+  if (more) {
+    StartNext();
+  }
 }
 
 void HttpClient::onHttpClosed(HttpError err) {
@@ -797,6 +1200,29 @@ void HttpClient::onHttpClosed(HttpError err) {
   ASSERT(false);
 }
 
+//
+// Http2Session Implementation
+//
+
+HttpError HttpClient::onHttp2Header(size_t data_size, bool* ignore_data) {
+  HttpError error = onHttpHeaderComplete(false, data_size);
+  *ignore_data = base_.ignore_data();
+  return error;
+}
+
+void HttpClient::onHttp2Complete(HttpError err) {
+  h2_session_ = NULL;
+  h2_stream_ = 0;
+  onHttpComplete(HM_RECV, err);
+}
+
+void HttpClient::onHttp2Unavailable() {
+  // The pool now knows to send this server HTTP/1.1.
+  h2_session_ = NULL;
+  h2_stream_ = 0;
+  connect();
+}
+
 //////////////////////////////////////////////////////////////////////
 // HttpClientDefault
 //////////////////////////////////////////////////////////////////////
@@ -32,7 +32,9 @@
 #include "config.h"
 #endif
 
+#include <deque>
 #include "common.h"
+#include "http2.h"
 #include "httpbase.h"
 #include "proxyinfo.h"
 #include "scoped_ptr.h"
@@ -75,7 +77,7 @@ typedef HttpError HttpErrorType;
 typedef int HttpErrorType;
 #endif  // !STRICT_HTTP_ERROR
 
-class HttpClient : private IHttpNotify {
+class HttpClient : private IHttpNotify, private IHttp2Notify {
 public:
   // If HttpRequestData and HttpResponseData objects are provided, they must
   // be freed by the caller.  Otherwise, an internal object is allocated.
@@ -112,15 +114,54 @@ public:
   void set_uri_form(UriForm form) { uri_form_ = form; }
   UriForm uri_form() const { return uri_form_; }
 
+  // Requests queued with queue() may be sent on the connection before the
+  // response to the one ahead of them arrives, up to |depth| at a time.  Only
+  // GET and HEAD requests without a document are sent that way, and only
+  // without a proxy or cache.  If the server closes the connection with
+  // requests unanswered, they are sent again, one at a time.  The default is
+  // 1, which waits for each response before sending the next request.
+  void set_pipeline_depth(size_t depth) { pipeline_depth_ = depth; }
+  size_t pipeline_depth() const { return pipeline_depth_; }
+
+  // Requests say they accept gzip and deflate unless they already have an
+  // Accept-Encoding header, and documents so encoded are inflated as they
+  // are received, with their Content-Encoding and Content-Length headers
+  // dropped.  The default is true.
+  void set_decode_content(bool decode) { base_.set_decode_content(decode); }
+  bool decode_content() const { return base_.decode_content(); }
+
+  // With an Http2Pool, requests to servers that speak HTTP/2 are sent as
+  // streams on a connection the pool shares among its clients, instead of
+  // on a connection of their own from the stream pool.  Servers reached
+  // through a proxy, and those that don't speak HTTP/2, are sent HTTP/1.1
+  // as before.  GetDocumentStream can't be used with it.  The pool must
+  // outlive the client.  The default is NULL.
+  void set_http2(Http2Pool* http2) { http2_ = http2; }
+  Http2Pool* http2() const { return http2_; }
+
   void set_cache(DiskCache* cache) { ASSERT(!IsCacheActive()); cache_ = cache; }
   bool cache_enabled() const { return (NULL != cache_); }
 
+  // With a cache, a GET that finds another client sharing the cache already
+  // fetching its url waits for that fetch, and is then answered from the
+  // cache instead of going to the network itself.  If the other fetch fails,
+  // or its response can't be cached, the waiting client makes its own
+  // request.  Clients sharing a cache must run on one thread.  The default
+  // is true.
+  void set_coalesce_requests(bool coalesce) { coalesce_ = coalesce; }
+  bool coalesce_requests() const { return coalesce_; }
+
   // reset clears the server, request, and response structures.  It will also
-  // abort an active request.
+  // abort an active request, and drop any queued ones.
   void reset();
   
   void set_server(const SocketAddress& address);
   const SocketAddress& server() const { return server_; }
+  // Whether the connection to the server uses TLS.  Pools that key streams
+  // by it, like ConnectionPool, make the TLS stream themselves.  Set by
+  // prepare_get and prepare_post from the url's scheme; reset clears it.
+  void set_secure(bool secure) { secure_ = secure; }
+  bool secure() const { return secure_; }
 
   // Note: in order for HttpClient to retry a POST in response to
   // an authentication challenge, a redirect response, or socket disconnection,
@@ -144,6 +185,20 @@ public:
 
   // After you finish setting up your request, call start.
   void start();
+
+  // Queues |transaction|, which the caller must free, to be started on the
+  // current server once those before it are done.  While it is active,
+  // transaction() returns it, and SignalHttpClientComplete is signalled for
+  // it in turn.  The client must not be deleted in response to that signal
+  // while transactions are queued; call reset() first.
+  void queue(HttpTransaction* transaction);
+
+  // A request with an Upgrade header that is answered with 101 Switching
+  // Protocols completes with the stream still attached.  This takes it, and
+  // appends any bytes already read past the response to |pending|.  Returns
+  // NULL unless the last request was upgraded.  If it isn't taken, the next
+  // request or reset closes it.
+  StreamInterface* DetachUpgradedStream(std::string* pending);
   
   // Signalled when the header has finished downloading, before the document
   // content is processed.  You may change the response document in response
@@ -159,20 +214,57 @@ public:
 
 protected:
   void connect();
+  // Submits the request on an HTTP/2 session, if there is one for the
+  // server.  Returns false if it should go over HTTP/1.1.
+  bool ConnectHttp2();
   void release();
+  // Whether a request is in progress, over either protocol.
+  bool busy() const { return (HM_NONE != base_.mode()) || h2_session_; }
+  // Ends the active request with err, as HttpBase::abort does.
+  void abort(HttpError err);
+
+  void PrepareRequest(HttpRequestData* request);
+  bool CanPipeline(const HttpRequestData& request) const;
+  // Sends the next queued request ahead of the current response, if it may
+  // be pipelined.  Returns false if nothing was sent.
+  bool SendPipelined();
+  // Makes the next pipelined or queued transaction the active one.
+  void StartNext();
 
   bool ShouldRedirect(std::string* location) const;
+  // Whether the response switches the stream to the protocol the request
+  // asked to upgrade to.
+  bool IsUpgrade() const;
 
   bool BeginCacheFile();
   HttpError WriteCacheHeaders(const std::string& id);
-  void CompleteCacheFile();
-
-  bool CheckCache();
+  // Returns false, and drops the entry, if it wasn't written in full.
+  bool CompleteCacheFile(HttpError err);
+
+  // Answers the request from the cache if possible.  A stale entry is served
+  // if its stale-while-revalidate allowance covers it, and then validated in
+  // the background; otherwise a validation request is prepared.  If any_age
+  // is set, the entry is served whatever its age.
+  bool CheckCache(bool any_age);
   HttpError ReadCacheHeaders(const std::string& id, bool override);
   HttpError ReadCacheBody(const std::string& id);
 
   bool PrepareValidate();
   HttpError CompleteValidate();
+  // Answers a failed validation with the cached entry, as its stale-if-error
+  // allowance permits.
+  HttpError ServeStale();
+  // Validates the entry just served from the cache on a client of its own.
+  void Revalidate();
+
+  // Returns true if the request waits on another client's fetch of the same
+  // url.  Otherwise, the request may become the fetch others wait on.
+  bool JoinFetch();
+  // Wakes those waiting on this client's fetch.  stored is true if the
+  // response is now in the cache.
+  void EndFetch(bool stored);
+  void CancelWait();
+  void OnFetchDone(bool stored);
 
   HttpError OnHeaderAvailable(bool ignore_data, bool chunked, size_t data_size);
 
@@ -180,24 +272,56 @@ protected:
   virtual HttpError onHttpHeaderComplete(bool chunked, size_t& data_size);
   virtual void onHttpComplete(HttpMode mode, HttpError err);
   virtual void onHttpClosed(HttpError err);
+
+  // IHttp2Notify Interface
+  virtual HttpError onHttp2Header(size_t data_size, bool* ignore_data);
+  virtual void onHttp2Complete(HttpError err);
+  virtual void onHttp2Unavailable();
   
 private:
-  enum CacheState { CS_READY, CS_WRITING, CS_READING, CS_VALIDATING };
+  enum CacheState { CS_READY, CS_WRITING, CS_READING, CS_VALIDATING,
+                    CS_WAITING };
+  struct PendingFetch;
   bool IsCacheActive() const { return (cache_state_ > CS_READY); }
 
   std::string agent_;
   StreamPool* pool_;
   HttpBase base_;
   SocketAddress server_;
+  bool secure_;
   ProxyInfo proxy_;
   HttpTransaction* transaction_;
+  // The transaction given to the constructor, or allocated there.
+  HttpTransaction* home_transaction_;
   bool free_transaction_;
+  // Transactions waiting to be sent, and those sent on the stream behind the
+  // active one, in order.  pipelined_ is set if the active transaction was
+  // sent behind another, and pipeline_ok_ is cleared once the server drops
+  // a connection with pipelined requests unanswered.
+  std::deque<HttpTransaction*> queued_, sent_;
+  size_t pipeline_depth_;
+  bool pipelined_, pipeline_ok_;
   size_t retries_, attempt_, redirects_;
   RedirectAction redirect_action_;
   UriForm uri_form_;
   scoped_ptr<HttpAuthContext> context_;
   DiskCache* cache_;
   CacheState cache_state_;
+  // Set while the cached entry may answer a failed validation.  A client
+  // made to revalidate in the background always validates.
+  bool stale_if_error_, force_validate_;
+  scoped_ptr<HttpClient> revalidator_;
+  bool coalesce_;
+  // The fetch this client leads, or waits on when cache_state_ is
+  // CS_WAITING.
+  PendingFetch* fetch_;
+  // The session and stream of the active request, while it goes over
+  // HTTP/2.
+  Http2Pool* http2_;
+  Http2Session* h2_session_;
+  uint32 h2_stream_;
+  // Set while the stream of an upgraded request waits to be taken.
+  bool upgraded_;
 };
 
 //////////////////////////////////////////////////////////////////////
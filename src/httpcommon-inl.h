@@ -32,6 +32,7 @@
 #include "config.h"
 #endif
 
+#include <climits>
 #include "common.h"
 #include "httpcommon.h"
 
@@ -41,25 +42,42 @@ namespace txmpp {
 // Url
 ///////////////////////////////////////////////////////////////////////////////
 
+template<class CTYPE>
+void Url_AppendScheme(bool secure, typename Traits<CTYPE>::string* val) {
+  CTYPE protocol[9];
+  asccpyn(protocol, ARRAY_SIZE(protocol), secure ? "https://" : "http://");
+  val->append(protocol);
+}
+
+template<class CTYPE>
+void Url_AppendAddress(const CTYPE* host, size_t host_length, uint16 port,
+                       bool secure, typename Traits<CTYPE>::string* val) {
+  if (host_length)
+    val->append(host, host_length);
+  if (port != HttpDefaultPort(secure)) {
+    CTYPE format[5], digits[32];
+    asccpyn(format, ARRAY_SIZE(format), ":%hu");
+    sprintfn(digits, ARRAY_SIZE(digits), format, port);
+    val->append(digits);
+  }
+}
+
 template<class CTYPE>
 void Url<CTYPE>::do_set_url(const CTYPE* val, size_t len) {
-  if (ascnicmp(val, "http://", 7) == 0) {
-    val += 7; len -= 7;
-    secure_ = false;
-  } else if (ascnicmp(val, "https://", 8) == 0) {
-    val += 8; len -= 8;
-    secure_ = true;
-  } else {
+  UrlView<CTYPE> view;
+  if (!view.parse(val, len)) {
     clear();
     return;
   }
-  const CTYPE* path = strchrn(val, len, static_cast<CTYPE>('/'));
-  if (!path) {
-    path = val + len;
+  secure_ = view.secure();
+  host_.assign(view.host(), view.host_length());
+  port_ = view.port();
+  if (0 == view.path_length()) {
+    path_.assign(1, static_cast<CTYPE>('/'));
+  } else {
+    path_.assign(view.path(), view.path_length());
   }
-  size_t address_length = (path - val);
-  do_set_address(val, address_length);
-  do_set_full_path(path, len - address_length);
+  query_.assign(view.query(), view.query_length());
 }
 
 template<class CTYPE>
@@ -94,27 +112,19 @@ void Url<CTYPE>::do_set_full_path(const CTYPE* val, size_t len) {
 }
 
 template<class CTYPE>
-void Url<CTYPE>::do_get_url(string* val) const {
-  CTYPE protocol[9];
-  asccpyn(protocol, ARRAY_SIZE(protocol), secure_ ? "https://" : "http://");
-  val->append(protocol);
-  do_get_address(val);
-  do_get_full_path(val);
+void Url<CTYPE>::append_url(string* val) const {
+  Url_AppendScheme<CTYPE>(secure_, val);
+  append_address(val);
+  append_full_path(val);
 }
 
 template<class CTYPE>
-void Url<CTYPE>::do_get_address(string* val) const {
-  val->append(host_);
-  if (port_ != HttpDefaultPort(secure_)) {
-    CTYPE format[5], port[32];
-    asccpyn(format, ARRAY_SIZE(format), ":%hu");
-    sprintfn(port, ARRAY_SIZE(port), format, port_);
-    val->append(port);
-  }
+void Url<CTYPE>::append_address(string* val) const {
+  Url_AppendAddress(host_.data(), host_.size(), port_, secure_, val);
 }
 
 template<class CTYPE>
-void Url<CTYPE>::do_get_full_path(string* val) const {
+void Url<CTYPE>::append_full_path(string* val) const {
   val->append(path_);
   val->append(query_);
 }
@@ -140,6 +150,90 @@ bool Url<CTYPE>::get_attribute(const string& name, string* value) const {
   return true;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// UrlView
+///////////////////////////////////////////////////////////////////////////////
+
+template<class CTYPE>
+bool UrlView<CTYPE>::parse(const CTYPE* val, size_t len) {
+  size_t pos;
+  if ((len >= 7) && (ascnicmp(val, "http://", 7) == 0)) {
+    pos = 7;
+    secure_ = false;
+  } else if ((len >= 8) && (ascnicmp(val, "https://", 8) == 0)) {
+    pos = 8;
+    secure_ = true;
+  } else {
+    clear();
+    return false;
+  }
+  data_ = val;
+  const CTYPE* path = strchrn(val + pos, len - pos, static_cast<CTYPE>('/'));
+  size_t path_pos = path ? (path - val) : len;
+
+  host_pos_ = pos;
+  const CTYPE* colon = strchrn(val + pos, path_pos - pos,
+                               static_cast<CTYPE>(':'));
+  if (colon) {
+    host_length_ = colon - (val + pos);
+    // Reads the digits after the colon as strtoul would, without going past
+    // the address, as the buffer needn't be terminated.
+    unsigned long port = 0;
+    for (size_t i = colon - val + 1; i < path_pos; ++i) {
+      if ((val[i] < static_cast<CTYPE>('0')) ||
+          (val[i] > static_cast<CTYPE>('9')))
+        break;
+      unsigned long digit = val[i] - static_cast<CTYPE>('0');
+      port = (port > (ULONG_MAX - digit) / 10) ? ULONG_MAX
+                                                 : port * 10 + digit;
+    }
+    port_ = static_cast<uint16>(port);
+  } else {
+    host_length_ = path_pos - pos;
+    port_ = HttpDefaultPort(secure_);
+  }
+
+  const CTYPE* query = strchrn(val + path_pos, len - path_pos,
+                               static_cast<CTYPE>('?'));
+  query_pos_ = query ? (query - val) : len;
+  query_length_ = len - query_pos_;
+  path_pos_ = path_pos;
+  path_length_ = query_pos_ - path_pos;
+  return true;
+}
+
+template<class CTYPE>
+void UrlView<CTYPE>::clear() {
+  data_ = NULL;
+  host_pos_ = host_length_ = 0;
+  path_pos_ = path_length_ = 0;
+  query_pos_ = query_length_ = 0;
+  port_ = HTTP_DEFAULT_PORT;
+  secure_ = false;
+}
+
+template<class CTYPE>
+void UrlView<CTYPE>::append_url(string* val) const {
+  Url_AppendScheme<CTYPE>(secure_, val);
+  append_address(val);
+  append_full_path(val);
+}
+
+template<class CTYPE>
+void UrlView<CTYPE>::append_address(string* val) const {
+  Url_AppendAddress(host(), host_length_, port_, secure_, val);
+}
+
+template<class CTYPE>
+void UrlView<CTYPE>::append_full_path(string* val) const {
+  if (0 == path_length_) {
+    val->append(1, static_cast<CTYPE>('/'));
+  } else {
+    val->append(path(), path_length_);
+  }
+  val->append(query(), query_length_);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 }  // namespace txmpp
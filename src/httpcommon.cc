@@ -27,6 +27,8 @@
 
 #include "httpcommon.h"
 
+#include <algorithm>
+#include <string.h>
 #include <time.h>
 
 #ifdef WIN32
@@ -111,10 +113,12 @@ static const char* kHttpVerbs[HV_LAST+1] = {
 ENUM(HttpVerb, kHttpVerbs);
 
 static const char* kHttpHeaders[HH_LAST+1] = {
+  "Accept-Encoding",
   "Age",
   "Cache-Control",
   "Connection",
   "Content-Disposition",
+  "Content-Encoding",
   "Content-Length",
   "Content-Range",
   "Content-Type",
@@ -227,7 +231,7 @@ namespace {
 inline bool IsEndOfAttributeName(size_t pos, size_t len, const char * data) {
   if (pos >= len)
     return true;
-  if (isspace(static_cast<unsigned char>(data[pos])))
+  if (isspace(static_cast<unsigned char>(data[pos])) || (data[pos] == ','))
     return true;
   // The reason for this complexity is that some attributes may contain trailing
   // equal signs (like base64 tokens in Negotiate auth headers)
@@ -418,11 +422,67 @@ std::string HttpAddress(const SocketAddress& address, bool secure) {
 // HttpData
 //////////////////////////////////////////////////////////////////////
 
+static uint32
+HttpData_HashHeaderName(const char* name, size_t len) {
+  // FNV-1a, over the name in lower case
+  uint32 result = 2166136261U;
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char c = static_cast<unsigned char>(name[i]);
+    if (c >= 'A' && c <= 'Z')
+      c += 'a' - 'A';
+    result ^= c;
+    result *= 16777619U;
+  }
+  return result;
+}
+
+// The hash and length of the name of each HttpHeader.
+struct HttpData_KnownHeader {
+  uint32 hash;
+  size_t len;
+};
+
+static HttpData_KnownHeader kKnownHeaders[HH_LAST+1];
+
+static struct HttpData_KnownHeaderInit {
+  HttpData_KnownHeaderInit() {
+    for (int i = 0; i <= HH_LAST; ++i) {
+      kKnownHeaders[i].len = strlen(kHttpHeaders[i]);
+      kKnownHeaders[i].hash = HttpData_HashHeaderName(kHttpHeaders[i],
+                                                      kKnownHeaders[i].len);
+    }
+  }
+} known_header_init;
+
+static bool
+HttpData_FindKnownHeader(const char* name, size_t len, uint32 hash,
+                         HttpHeader* header) {
+  for (int i = 0; i <= HH_LAST; ++i) {
+    if ((kKnownHeaders[i].hash == hash) && (kKnownHeaders[i].len == len) &&
+        (_strnicmp(kHttpHeaders[i], name, len) == 0)) {
+      *header = static_cast<HttpHeader>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool
+HttpData_IsCollapsible(const char* name, size_t len, uint32 hash) {
+  HttpHeader header;
+  // Unrecognized headers are collapsible
+  return !HttpData_FindKnownHeader(name, len, hash, &header) ||
+         HttpHeaderIsCollapsible(header);
+}
+
 void
 HttpData::clear(bool release_document) {
   // Clear headers first, since releasing a document may have far-reaching
   // effects.
   headers_.clear();
+  hashes_.clear();
+  received_.clear();
+  received_headers_.clear();
   if (release_document) {
     document.reset();
   }
@@ -430,56 +490,196 @@ HttpData::clear(bool release_document) {
 
 void
 HttpData::copy(const HttpData& src) {
-  headers_ = src.headers_;
+  headers_ = src.headers();
+  hashes_ = src.hashes_;
+  received_.clear();
+  received_headers_.clear();
+}
+
+void
+HttpData::swap(HttpData& other) {
+  std::swap(version, other.version);
+  document.swap(other.document);
+  headers_.swap(other.headers_);
+  hashes_.swap(other.hashes_);
+  received_.swap(other.received_);
+  received_headers_.swap(other.received_headers_);
+}
+
+size_t
+HttpData::findHeader(const char* name, size_t len, uint32 hash) const {
+  for (size_t i = 0; i < hashes_.size(); ++i) {
+    if ((hashes_[i] == hash) && (headers_[i].first.size() == len) &&
+        (_strnicmp(headers_[i].first.data(), name, len) == 0))
+      return i;
+  }
+  return headers_.size();
+}
+
+size_t
+HttpData::findHeader(const std::string& name) const {
+  headers();
+  return findHeader(name.data(), name.size(),
+                    HttpData_HashHeaderName(name.data(), name.size()));
+}
+
+size_t
+HttpData::findHeader(HttpHeader header) const {
+  headers();
+  return findHeader(kHttpHeaders[header], kKnownHeaders[header].len,
+                    kKnownHeaders[header].hash);
+}
+
+size_t
+HttpData::headerGroupEnd(size_t first) const {
+  size_t last = first;
+  while ((last < headers_.size()) && (hashes_[last] == hashes_[first]) &&
+         (_stricmp(headers_[last].first.c_str(),
+                   headers_[first].first.c_str()) == 0))
+    ++last;
+  return last;
+}
+
+size_t
+HttpData::eraseHeaders(size_t first) {
+  size_t last = headerGroupEnd(first);
+  headers_.erase(headers_.begin() + first, headers_.begin() + last);
+  hashes_.erase(hashes_.begin() + first, hashes_.begin() + last);
+  return last - first;
 }
 
 void
 HttpData::changeHeader(const std::string& name, const std::string& value,
                        HeaderCombine combine) {
+  headers();
+  changeHeader(name, HttpData_HashHeaderName(name.data(), name.size()), value,
+               combine);
+}
+
+void
+HttpData::changeHeader(HttpHeader header, const std::string& value,
+                       HeaderCombine combine) {
+  if (combine == HC_AUTO)
+    combine = HttpHeaderIsCollapsible(header) ? HC_YES : HC_NO;
+  headers();
+  changeHeader(kHttpHeaders[header], kKnownHeaders[header].hash, value,
+               combine);
+}
+
+void
+HttpData::changeHeader(const std::string& name, uint32 hash,
+                       const std::string& value, HeaderCombine combine) {
   if (combine == HC_AUTO) {
-    HttpHeader header;
-    // Unrecognized headers are collapsible
-    combine = !FromString(header, name) || HttpHeaderIsCollapsible(header)
+    combine = HttpData_IsCollapsible(name.data(), name.size(), hash)
               ? HC_YES : HC_NO;
-  } else if (combine == HC_REPLACE) {
-    headers_.erase(name);
+  }
+  size_t first = findHeader(name.data(), name.size(), hash);
+  if (combine == HC_REPLACE) {
+    eraseHeaders(first);
+    first = headers_.size();
     combine = HC_NO;
   }
   // At this point, combine is one of (YES, NO, NEW)
-  if (combine != HC_NO) {
-    HeaderMap::iterator it = headers_.find(name);
-    if (it != headers_.end()) {
-      if (combine == HC_YES) {
-        it->second.append(",");
-        it->second.append(value);
-	  }
-      return;
-	}
+  if (first == headers_.size()) {
+    headers_.push_back(HeaderList::value_type(name, value));
+    hashes_.push_back(hash);
+  } else if (combine == HC_YES) {
+    headers_[first].second.append(",");
+    headers_[first].second.append(value);
+  } else if (combine == HC_NO) {
+    size_t last = headerGroupEnd(first);
+    headers_.insert(headers_.begin() + last, HeaderList::value_type(name, value));
+    hashes_.insert(hashes_.begin() + last, hash);
   }
-  headers_.insert(HeaderMap::value_type(name, value));
-}
-
-size_t HttpData::clearHeader(const std::string& name) {
-  return headers_.erase(name);
 }
 
 HttpData::iterator HttpData::clearHeader(iterator header) {
-  iterator deprecated = header++;
-  headers_.erase(deprecated);
-  return header;
+  size_t index = header - headers_.begin();
+  hashes_.erase(hashes_.begin() + index);
+  return headers_.erase(header);
 }
 
 bool
 HttpData::hasHeader(const std::string& name, std::string* value) const {
-  HeaderMap::const_iterator it = headers_.find(name);
-  if (it == headers_.end()) {
+  return hasHeader(name.data(), name.size(),
+                   HttpData_HashHeaderName(name.data(), name.size()), value);
+}
+
+bool
+HttpData::hasHeader(HttpHeader header, std::string* value) const {
+  return hasHeader(kHttpHeaders[header], kKnownHeaders[header].len,
+                   kKnownHeaders[header].hash, value);
+}
+
+bool
+HttpData::hasHeader(const char* name, size_t len, uint32 hash,
+                    std::string* value) const {
+  if (!received_headers_.empty()) {
+    // As the header list would have them: the first of the name, with those
+    // after it that addHeader would have combined into it.
+    bool found = false, collapsible = false;
+    for (ReceivedList::const_iterator it = received_headers_.begin();
+         it != received_headers_.end(); ++it) {
+      if ((it->name_hash != hash) || (it->name_len != len) ||
+          (_strnicmp(received_.data() + it->name, name, len) != 0))
+        continue;
+      const char* rvalue = received_.data() + it->value;
+      if (!found) {
+        found = true;
+        if (!value)
+          return true;
+        value->assign(rvalue, it->value_len);
+        collapsible = HttpData_IsCollapsible(name, len, hash);
+      } else if (collapsible) {
+        value->append(",");
+        value->append(rvalue, it->value_len);
+      }
+    }
+    return found;
+  }
+
+  size_t index = findHeader(name, len, hash);
+  if (index == headers_.size()) {
     return false;
   } else if (value) {
-    *value = it->second;
+    *value = headers_[index].second;
   }
   return true;
 }
 
+void
+HttpData::addReceivedHeader(const char* name, size_t nlen,
+                            const char* value, size_t vlen) {
+  if (!headers_.empty()) {
+    addHeader(std::string(name, nlen), std::string(value, vlen));
+    return;
+  }
+  ReceivedHeader header;
+  header.name = received_.size();
+  header.name_len = nlen;
+  header.name_hash = HttpData_HashHeaderName(name, nlen);
+  received_.append(name, nlen);
+  header.value = received_.size();
+  header.value_len = vlen;
+  received_.append(value, vlen);
+  received_headers_.push_back(header);
+}
+
+void
+HttpData::materializeHeaders() const {
+  ReceivedList received;
+  received.swap(received_headers_);
+  // Only the mutable header members change.
+  HttpData* self = const_cast<HttpData*>(this);
+  for (ReceivedList::const_iterator it = received.begin();
+       it != received.end(); ++it) {
+    self->changeHeader(received_.substr(it->name, it->name_len),
+                       it->name_hash,
+                       received_.substr(it->value, it->value_len), HC_AUTO);
+  }
+  received_.clear();
+}
+
 void HttpData::setContent(const std::string& content_type,
                           StreamInterface* document) {
   setHeader(HH_CONTENT_TYPE, content_type);
@@ -520,6 +720,13 @@ HttpRequestData::copy(const HttpRequestData& src) {
   HttpData::copy(src);
 }
 
+void
+HttpRequestData::swap(HttpRequestData& other) {
+  std::swap(verb, other.verb);
+  path.swap(other.path);
+  HttpData::swap(other);
+}
+
 size_t
 HttpRequestData::formatLeader(char* buffer, size_t size) const {
   ASSERT(path.find(' ') == std::string::npos);
@@ -555,17 +762,18 @@ HttpRequestData::parseLeader(const char* line, size_t len) {
 bool HttpRequestData::getAbsoluteUri(std::string* uri) const {
   if (HV_CONNECT == verb)
     return false;
-  Url<char> url(path);
-  if (url.valid()) {
+  if (UrlView<char>(path.data(), path.size()).valid()) {
     uri->assign(path);
     return true;
   }
   std::string host;
   if (!hasHeader(HH_HOST, &host))
     return false;
+  Url<char> url(path);
   url.set_address(host);
   url.set_full_path(path);
-  uri->assign(url.url());
+  uri->clear();
+  url.append_url(uri);
   return url.valid();
 }
 
@@ -574,10 +782,12 @@ bool HttpRequestData::getRelativeUri(std::string* host,
 {
   if (HV_CONNECT == verb)
     return false;
-  Url<char> url(this->path);
+  UrlView<char> url(this->path.data(), this->path.size());
   if (url.valid()) {
-    host->assign(url.address());
-    path->assign(url.full_path());
+    host->clear();
+    url.append_address(host);
+    path->clear();
+    url.append_full_path(path);
     return true;
   }
   if (!hasHeader(HH_HOST, host))
@@ -604,6 +814,13 @@ HttpResponseData::copy(const HttpResponseData& src) {
   HttpData::copy(src);
 }
 
+void
+HttpResponseData::swap(HttpResponseData& other) {
+  std::swap(scode, other.scode);
+  message.swap(other.message);
+  HttpData::swap(other);
+}
+
 void
 HttpResponseData::set_success(uint32 scode) {
   this->scode = scode;
@@ -51,6 +51,8 @@ class SocketAddress;
 //////////////////////////////////////////////////////////////////////
 
 enum HttpCode { 
+  HC_SWITCHING_PROTOCOLS = 101,
+
   HC_OK = 200,
   HC_NON_AUTHORITATIVE = 203,
   HC_NO_CONTENT = 204,
@@ -102,10 +104,12 @@ enum HttpError {
 };
 
 enum HttpHeader {
+  HH_ACCEPT_ENCODING,
   HH_AGE,
   HH_CACHE_CONTROL,
   HH_CONNECTION,
   HH_CONTENT_DISPOSITION,
+  HH_CONTENT_ENCODING,
   HH_CONTENT_LENGTH,
   HH_CONTENT_RANGE,
   HH_CONTENT_TYPE,
@@ -234,23 +238,29 @@ public:
     do_set_url(val.c_str(), val.size());
   }
   string url() const {
-    string val; do_get_url(&val); return val;
+    string val; append_url(&val); return val;
   }
 
   void set_address(const string& val) {
     do_set_address(val.c_str(), val.size());
   }
   string address() const {
-    string val; do_get_address(&val); return val;
+    string val; append_address(&val); return val;
   }
 
   void set_full_path(const string& val) {
     do_set_full_path(val.c_str(), val.size());
   }
   string full_path() const {
-    string val; do_get_full_path(&val); return val;
+    string val; append_full_path(&val); return val;
   }
 
+  // Like url(), address() and full_path(), but append to |val|, so that a
+  // string kept from one call to the next is built into without allocating.
+  void append_url(string* val) const;
+  void append_address(string* val) const;
+  void append_full_path(string* val) const;
+
   void set_host(const string& val) { host_ = val; }
   const string& host() const { return host_; }
 
@@ -283,23 +293,63 @@ private:
   void do_set_address(const CTYPE* val, size_t len);
   void do_set_full_path(const CTYPE* val, size_t len);
 
-  void do_get_url(string* val) const;
-  void do_get_address(string* val) const;
-  void do_get_full_path(string* val) const;
-
   string host_, path_, query_;
   uint16 port_;
   bool secure_;
 };
 
+// The parts of a url, as offsets into the caller's buffer, so parsing one
+// copies and allocates nothing. The buffer must outlive the view, and need
+// not be terminated. Parses as Url does, for when only a part or two of a
+// url is wanted, as by HttpClient for each request and redirect.
+template<class CTYPE>
+class UrlView {
+public:
+  typedef typename Traits<CTYPE>::string string;
+
+  UrlView() { clear(); }
+  UrlView(const CTYPE* val, size_t len) { parse(val, len); }
+
+  // Returns false, and clears the view, if |val| isn't an http or https url.
+  bool parse(const CTYPE* val, size_t len);
+  void clear();
+
+  bool valid() const { return host_length_ != 0; }
+
+  const CTYPE* host() const { return data_ + host_pos_; }
+  size_t host_length() const { return host_length_; }
+  uint16 port() const { return port_; }
+  bool secure() const { return secure_; }
+  // Empty when the url has no path, which Url takes as "/".
+  const CTYPE* path() const { return data_ + path_pos_; }
+  size_t path_length() const { return path_length_; }
+  // Empty, or starting with '?'.
+  const CTYPE* query() const { return data_ + query_pos_; }
+  size_t query_length() const { return query_length_; }
+
+  void append_url(string* val) const;
+  void append_address(string* val) const;
+  void append_full_path(string* val) const;
+
+private:
+  const CTYPE* data_;
+  size_t host_pos_, host_length_;
+  size_t path_pos_, path_length_;
+  size_t query_pos_, query_length_;
+  uint16 port_;
+  bool secure_;
+};
+
 //////////////////////////////////////////////////////////////////////
 // HttpData
 //////////////////////////////////////////////////////////////////////
 
 struct HttpData {
-  typedef std::multimap<std::string, std::string, iless> HeaderMap;
-  typedef HeaderMap::const_iterator const_iterator;
-  typedef HeaderMap::iterator iterator;
+  // The headers in the order added, except that those of the same name are
+  // kept together. Names compare without regard to case.
+  typedef std::vector<std::pair<std::string, std::string> > HeaderList;
+  typedef HeaderList::const_iterator const_iterator;
+  typedef HeaderList::iterator iterator;
 
   HttpVersion version;
   scoped_ptr<StreamInterface> document;
@@ -318,43 +368,50 @@ struct HttpData {
     changeHeader(name, value, overwrite ? HC_REPLACE : HC_NEW);
   }
   // Returns count of erased headers
-  size_t clearHeader(const std::string& name);
+  size_t clearHeader(const std::string& name) {
+    return eraseHeaders(findHeader(name));
+  }
   // Returns iterator to next header
   iterator clearHeader(iterator header);
 
   // keep in mind, this may not do what you want in the face of multiple headers
   bool hasHeader(const std::string& name, std::string* value) const;
+  bool hasHeader(HttpHeader header, std::string* value) const;
+
+  // Adds a header as received, like addHeader. While there are no other
+  // headers, received ones are kept as they came, and hasHeader finds them
+  // there; they only go into the header list when it is first needed.
+  void addReceivedHeader(const char* name, size_t nlen,
+                         const char* value, size_t vlen);
 
   inline const_iterator begin() const {
-    return headers_.begin();
+    return headers().begin();
   }
   inline const_iterator end() const {
-    return headers_.end();
+    return headers().end();
   }
   inline iterator begin() {
-    return headers_.begin();
+    return headers().begin();
   }
   inline iterator end() {
-    return headers_.end();
+    return headers().end();
   }
   inline const_iterator begin(const std::string& name) const {
-    return headers_.lower_bound(name);
+    return headers().begin() + findHeader(name);
   }
   inline const_iterator end(const std::string& name) const {
-    return headers_.upper_bound(name);
+    return headers().begin() + headerGroupEnd(findHeader(name));
   }
   inline iterator begin(const std::string& name) {
-    return headers_.lower_bound(name);
+    return headers().begin() + findHeader(name);
   }
   inline iterator end(const std::string& name) {
-    return headers_.upper_bound(name);
+    return headers().begin() + headerGroupEnd(findHeader(name));
   }
 
-  // Convenience methods using HttpHeader
-  inline void changeHeader(HttpHeader header, const std::string& value,
-                           HeaderCombine combine) {
-    changeHeader(ToString(header), value, combine);
-  }
+  // Convenience methods using HttpHeader, which skip looking up the name.
+  void changeHeader(HttpHeader header, const std::string& value,
+                    HeaderCombine combine);
   inline void addHeader(HttpHeader header, const std::string& value,
                         bool append = true) {
     addHeader(ToString(header), value, append);
@@ -364,22 +421,19 @@ struct HttpData {
     setHeader(ToString(header), value, overwrite);
   }
   inline void clearHeader(HttpHeader header) {
-    clearHeader(ToString(header));
-  }
-  inline bool hasHeader(HttpHeader header, std::string* value) const {
-    return hasHeader(ToString(header), value);
+    eraseHeaders(findHeader(header));
   }
   inline const_iterator begin(HttpHeader header) const {
-    return headers_.lower_bound(ToString(header));
+    return headers().begin() + findHeader(header);
   }
   inline const_iterator end(HttpHeader header) const {
-    return headers_.upper_bound(ToString(header));
+    return headers().begin() + headerGroupEnd(findHeader(header));
   }
   inline iterator begin(HttpHeader header) {
-    return headers_.lower_bound(ToString(header));
+    return headers().begin() + findHeader(header);
   }
   inline iterator end(HttpHeader header) {
-    return headers_.upper_bound(ToString(header));
+    return headers().begin() + headerGroupEnd(findHeader(header));
   }
 
   void setContent(const std::string& content_type, StreamInterface* document);
@@ -392,9 +446,50 @@ protected:
   virtual ~HttpData() { }
   void clear(bool release_document);
   void copy(const HttpData& src);
+  // Exchanges everything with |other|, the document included, without
+  // copying any header.
+  void swap(HttpData& other);
 
 private:
-  HeaderMap headers_;
+  // The received headers, as offsets into received_, with the hash of each
+  // name.
+  struct ReceivedHeader {
+    size_t name, name_len, value, value_len;
+    uint32 name_hash;
+  };
+  typedef std::vector<ReceivedHeader> ReceivedList;
+
+  // Headers are found by the hash of their case-folded name, kept for each
+  // of headers_ in hashes_, before their names are compared.
+  // The index of the first header named |name|, whose hash is |hash|, or
+  // the number of headers if there is none. The headers must be in
+  // headers_.
+  size_t findHeader(const char* name, size_t len, uint32 hash) const;
+  // The same, for any headers.
+  size_t findHeader(const std::string& name) const;
+  size_t findHeader(HttpHeader header) const;
+  // The index just past the headers with the name of the one at |first|.
+  size_t headerGroupEnd(size_t first) const;
+  // Erases the header at |first| and those with its name, returning how
+  // many there were.
+  size_t eraseHeaders(size_t first);
+  // changeHeader on the headers in headers_.
+  void changeHeader(const std::string& name, uint32 hash,
+                    const std::string& value, HeaderCombine combine);
+  bool hasHeader(const char* name, size_t len, uint32 hash,
+                 std::string* value) const;
+  // Moves the received headers into headers_.
+  void materializeHeaders() const;
+  inline HeaderList& headers() const {
+    if (!received_headers_.empty())
+      materializeHeaders();
+    return headers_;
+  }
+
+  mutable HeaderList headers_;
+  mutable std::vector<uint32> hashes_;
+  mutable std::string received_;
+  mutable ReceivedList received_headers_;
 };
 
 struct HttpRequestData : public HttpData {
@@ -405,6 +500,7 @@ struct HttpRequestData : public HttpData {
 
   void clear(bool release_document);
   void copy(const HttpRequestData& src);
+  void swap(HttpRequestData& other);
 
   virtual size_t formatLeader(char* buffer, size_t size) const;
   virtual HttpError parseLeader(const char* line, size_t len);
@@ -420,6 +516,7 @@ struct HttpResponseData : public HttpData {
   HttpResponseData() : scode(HC_INTERNAL_SERVER_ERROR) { }
   void clear(bool release_document);
   void copy(const HttpResponseData& src);
+  void swap(HttpResponseData& other);
 
   // Convenience methods
   void set_success(uint32 scode = HC_OK);
@@ -28,16 +28,188 @@
 #include "jid.h"
 
 #include <ctype.h>
+#include <string.h>
 
 #include <algorithm>
 #include <string>
 
 #include "common.h"
+#include "criticalsection.h"
 #include "logging.h"
 #include "constants.h"
 
 namespace txmpp {
 
+// The longest part prepNode, prepDomain and prepResource accept.
+static const size_t kMaxPartLength = 1023;
+
+// Which parts of a JID each char can be in without the prep functions
+// changing it or rejecting it.  Non-ASCII chars are left to them.
+enum {
+  JID_CHAR_NODE = 1,
+  JID_CHAR_DOMAIN = 2,
+  JID_CHAR_RESOURCE = 4,
+};
+
+static struct JidCharClasses {
+  JidCharClasses() {
+    for (int ch = 0; ch < 256; ++ch) {
+      unsigned char c = 0;
+      if (ch >= 0x21 && ch <= 0x7E && !(ch >= 'A' && ch <= 'Z') &&
+          !strchr("&/:<>@\"'", ch))
+        c |= JID_CHAR_NODE;
+      if ((ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') ||
+          ch == '-' || ch == '.')
+        c |= JID_CHAR_DOMAIN;
+      if (ch >= 0x18 && ch != 0x7F)
+        c |= JID_CHAR_RESOURCE;
+      classes[ch] = c;
+    }
+  }
+  // All zero until the constructor has run, which only sends the JIDs
+  // made by static initializers before it down the slow path.
+  unsigned char classes[256];
+} g_jid_char_classes;
+
+// Whether all of the |len| chars at |p| can be in the part |part| as they
+// are.  The classes are ANDed over 8 chars at a time, with one branch each.
+static bool Jid_AllOfClass(const char * p, size_t len, unsigned char part) {
+  const unsigned char * classes = g_jid_char_classes.classes;
+  const unsigned char * u = reinterpret_cast<const unsigned char *>(p);
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    unsigned char all = classes[u[i]] & classes[u[i + 1]] &
+                        classes[u[i + 2]] & classes[u[i + 3]] &
+                        classes[u[i + 4]] & classes[u[i + 5]] &
+                        classes[u[i + 6]] & classes[u[i + 7]];
+    if (!(all & part))
+      return false;
+  }
+  unsigned char all = part;
+  for (; i < len; ++i)
+    all &= classes[u[i]];
+  return all != 0;
+}
+
+// Whether the domain at |p| is already as prepDomain would leave it: made
+// of labels of 1 to 63 lowercase letters, digits and inner hyphens.
+static bool Jid_IsPreparedDomain(const char * p, size_t len) {
+  if (len == 0 || len > kMaxPartLength ||
+      !Jid_AllOfClass(p, len, JID_CHAR_DOMAIN))
+    return false;
+  size_t label = 0;
+  for (size_t i = 0; i <= len; ++i) {
+    if (i < len && p[i] != '.')
+      continue;
+    size_t label_len = i - label;
+    if (label_len == 0 || label_len > 63 || p[label] == '-' ||
+        p[i - 1] == '-')
+      return false;
+    label = i + 1;
+  }
+  return true;
+}
+
+// Continues an FNV-1a hash over |str|.
+static uint32 Jid_Hash(uint32 hash, const std::string & str) {
+  for (size_t i = 0; i < str.size(); ++i) {
+    hash ^= static_cast<unsigned char>(str[i]);
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+// The interned domains.  The table is open addressed and fixed in size, and
+// looked up without locking: entries are only ever added, and never freed.
+// Adding takes the lock.
+static const size_t kDomainAtomSlots = 256;
+
+struct JidDomainAtoms {
+  JidDomainAtoms() : count(0) {
+    for (size_t i = 0; i < kDomainAtomSlots; ++i)
+      slots[i] = NULL;
+  }
+
+  const std::string * Find(const std::string & domain, uint32 hash) {
+    for (size_t i = hash; ; ++i) {
+      const std::string * atom = AtomicOps::AcquireLoadPtr(
+          &slots[i % kDomainAtomSlots]);
+      if (!atom || *atom == domain)
+        return atom;
+    }
+  }
+
+  CriticalSection crit;
+  size_t count;
+  const std::string * volatile slots[kDomainAtomSlots];
+};
+
+static JidDomainAtoms * Jid_DomainAtoms() {
+  // Never destroyed, for the static Jids that outlive it.
+  static JidDomainAtoms * atoms = new JidDomainAtoms;
+  return atoms;
+}
+
+Jid::Data::Data(const std::string & node, const std::string & domain,
+                const std::string & resource) :
+    node_name_(node),
+    domain_name_(domain),
+    resource_name_(resource),
+    refcount_(1) {
+  Init();
+}
+
+Jid::Data::Data(const std::string & jid, size_t node_len,
+                size_t domain_begin, size_t domain_len,
+                size_t resource_begin, size_t resource_len) :
+    node_name_(jid, 0, node_len),
+    domain_name_(jid, domain_begin, domain_len),
+    resource_name_(jid, resource_begin, resource_len),
+    refcount_(1) {
+  Init();
+}
+
+void Jid::Data::Init() {
+  uint32 domain_hash = Jid_Hash(2166136261U, domain_name_);
+  domain_atom_ = Jid_DomainAtoms()->Find(domain_name_, domain_hash);
+  bare_hash_ = Jid_Hash(domain_hash ^ '@', node_name_);
+  full_hash_ = Jid_Hash(bare_hash_ ^ '/', resource_name_);
+}
+
+bool Jid::InternDomain(const std::string & domain) {
+  Jid jid(STR_EMPTY, domain, STR_EMPTY);
+  if (!jid.IsValid())
+    return false;
+  const std::string & prepared = jid.domain();
+  uint32 hash = Jid_Hash(2166136261U, prepared);
+
+  JidDomainAtoms * atoms = Jid_DomainAtoms();
+  if (atoms->Find(prepared, hash))
+    return true;
+  CritScope cs(&atoms->crit);
+  if (atoms->Find(prepared, hash))
+    return true;
+  // Kept at most half full, so that probes stay short.
+  if (2 * (atoms->count + 1) > kDomainAtomSlots)
+    return false;
+  size_t i = hash;
+  while (atoms->slots[i % kDomainAtomSlots])
+    ++i;
+  ++atoms->count;
+  // The atom must be complete before it is stored, as readers take it as
+  // soon as they see it.
+  AtomicOps::ReleaseStorePtr(&atoms->slots[i % kDomainAtomSlots],
+                             static_cast<const std::string *>(
+                                 new std::string(prepared)));
+  return true;
+}
+
+bool Jid::DomainEquals(const Data * a, const Data * b) {
+  if (a->domain_atom_ && b->domain_atom_)
+    return a->domain_atom_ == b->domain_atom_;
+  return a->domain_name_ == b->domain_name_;
+}
+
 Jid::Jid() : data_(NULL) {
 }
 
@@ -53,41 +225,37 @@ Jid::Jid(const std::string & jid_string) {
 
   // First find the slash and slice of that part
   size_t slash = jid_string.find('/');
+  size_t at = jid_string.find('@');
+  bool has_node = at < slash && at != std::string::npos;
+  size_t node_length = has_node ? at : 0;
+  size_t domain_begin = has_node ? at + 1 : 0;
+  size_t domain_length = (slash == std::string::npos ?
+                          jid_string.length() : slash) - domain_begin;
+  size_t resource_begin = (slash == std::string::npos ?
+                           jid_string.length() : slash + 1);
+  size_t resource_length = jid_string.length() - resource_begin;
+
+  // Most JIDs are already prepared, and are taken as they are.
+  const char * p = jid_string.data();
+  if (node_length <= kMaxPartLength && resource_length <= kMaxPartLength &&
+      Jid_AllOfClass(p, node_length, JID_CHAR_NODE) &&
+      Jid_IsPreparedDomain(p + domain_begin, domain_length) &&
+      Jid_AllOfClass(p + resource_begin, resource_length,
+                     JID_CHAR_RESOURCE)) {
+    data_ = new Data(jid_string, node_length, domain_begin, domain_length,
+                     resource_begin, resource_length);
+    return;
+  }
+
+
   std::string resource_name = (slash == std::string::npos ? STR_EMPTY :
                     jid_string.substr(slash + 1));
 
   // Now look for the node
-  std::string node_name;
-  size_t at = jid_string.find('@');
-  size_t domain_begin;
-  if (at < slash && at != std::string::npos) {
-    node_name = jid_string.substr(0, at);
-    domain_begin = at + 1;
-  } else {
-    domain_begin = 0;
-  }
+  std::string node_name = jid_string.substr(0, node_length);
 
   // Now take what is left as the domain
-  size_t domain_length =
-    (  slash == std::string::npos
-     ? jid_string.length() - domain_begin
-     : slash - domain_begin);
-
-  // avoid allocating these constants repeatedly
-  std::string domain_name;
-
-  if (domain_length == 9  && jid_string.find("gmail.com", domain_begin) == domain_begin) {
-    domain_name = STR_GMAIL_COM;
-  }
-  else if (domain_length == 14 && jid_string.find("googlemail.com", domain_begin) == domain_begin) {
-    domain_name = STR_GOOGLEMAIL_COM;
-  }
-  else if (domain_length == 10 && jid_string.find("google.com", domain_begin) == domain_begin) {
-    domain_name = STR_GOOGLE_COM;
-  }
-  else {
-    domain_name = jid_string.substr(domain_begin, domain_length);
-  }
+  std::string domain_name = jid_string.substr(domain_begin, domain_length);
 
   // If the domain is empty we have a non-valid jid and we should empty
   // everything else out
@@ -100,8 +268,7 @@ Jid::Jid(const std::string & jid_string) {
   std::string validated_node = prepNode(node_name, 
       node_name.begin(), node_name.end(), &valid_node);
   bool valid_domain;
-  std::string validated_domain = prepDomain(domain_name,
-      domain_name.begin(), domain_name.end(), &valid_domain);
+  std::string validated_domain = prepDomainCached(domain_name, &valid_domain);
   bool valid_resource;
   std::string validated_resource = prepResource(resource_name,
       resource_name.begin(), resource_name.end(), &valid_resource);
@@ -122,12 +289,21 @@ Jid::Jid(const std::string & node_name,
     return;
   }
 
+  if (node_name.size() <= kMaxPartLength &&
+      resource_name.size() <= kMaxPartLength &&
+      Jid_AllOfClass(node_name.data(), node_name.size(), JID_CHAR_NODE) &&
+      Jid_IsPreparedDomain(domain_name.data(), domain_name.size()) &&
+      Jid_AllOfClass(resource_name.data(), resource_name.size(),
+                     JID_CHAR_RESOURCE)) {
+    data_ = new Data(node_name, domain_name, resource_name);
+    return;
+  }
+
   bool valid_node;
   std::string validated_node = prepNode(node_name, 
       node_name.begin(), node_name.end(), &valid_node);
   bool valid_domain;
-  std::string validated_domain = prepDomain(domain_name,
-      domain_name.begin(), domain_name.end(), &valid_domain);
+  std::string validated_domain = prepDomainCached(domain_name, &valid_domain);
   bool valid_resource;
   std::string validated_resource = prepResource(resource_name,
       resource_name.begin(), resource_name.end(), &valid_resource);
@@ -185,7 +361,8 @@ Jid::BareJid() const {
     return Jid();
   if (!IsFull())
     return *this;
-  return Jid(data_->node_name_, data_->domain_name_, STR_EMPTY);
+  // The parts are prepared already.
+  return Jid(new Data(data_->node_name_, data_->domain_name_, STR_EMPTY));
 }
 
 #if 0
@@ -208,8 +385,9 @@ Jid::BareEquals(const Jid & other) const {
   return (other.data_ == data_ ||
           (data_ != NULL &&
           other.data_ != NULL &&
+          other.data_->bare_hash_ == data_->bare_hash_ &&
           other.data_->node_name_ == data_->node_name_ &&
-          other.data_->domain_name_ == data_->domain_name_));
+          DomainEquals(data_, other.data_)));
 }
 
 bool
@@ -217,8 +395,9 @@ Jid::operator==(const Jid & other) const {
   return (other.data_ == data_ ||
           (data_ != NULL &&
           other.data_ != NULL &&
+          other.data_->full_hash_ == data_->full_hash_ &&
           other.data_->node_name_ == data_->node_name_ &&
-          other.data_->domain_name_ == data_->domain_name_ &&
+          DomainEquals(data_, other.data_) &&
           other.data_->resource_name_ == data_->resource_name_));
 }
 
@@ -235,9 +414,12 @@ Jid::Compare(const Jid & other) const {
   compare_result = data_->node_name_.compare(other.data_->node_name_);
   if (0 != compare_result)
     return compare_result;
-  compare_result = data_->domain_name_.compare(other.data_->domain_name_);
-  if (0 != compare_result)
-    return compare_result;
+  if (data_->domain_atom_ == NULL ||
+      data_->domain_atom_ != other.data_->domain_atom_) {
+    compare_result = data_->domain_name_.compare(other.data_->domain_name_);
+    if (0 != compare_result)
+      return compare_result;
+  }
   compare_result = data_->resource_name_.compare(other.data_->resource_name_);
   return compare_result;
 }
@@ -293,7 +475,7 @@ Jid::prepNode(const std::string str, std::string::const_iterator start,
     }
   }
 
-  if (result.length() > 1023) {
+  if (result.length() > kMaxPartLength) {
     return STR_EMPTY;
   }
   *valid = true;
@@ -347,7 +529,7 @@ Jid::prepResource(const std::string str, std::string::const_iterator start,
     }
   }
 
-  if (result.length() > 1023) {
+  if (result.length() > kMaxPartLength) {
     return STR_EMPTY;
   }
   *valid = true;
@@ -372,6 +554,44 @@ Jid::prepResourceAscii(char ch, bool *valid) {
   }
 }
 
+// The domains prepared lately, in a small direct mapped cache.
+static const size_t kDomainCacheSize = 64;
+
+struct JidDomainCache {
+  CriticalSection crit;
+  std::string raw[kDomainCacheSize];
+  std::string prepared[kDomainCacheSize];
+};
+
+static JidDomainCache * Jid_DomainCache() {
+  static JidDomainCache * cache = new JidDomainCache;
+  return cache;
+}
+
+std::string
+Jid::prepDomainCached(const std::string & str, bool *valid) {
+  uint32 hash = 2166136261u;
+  for (size_t i = 0; i < str.size(); ++i)
+    hash = (hash ^ static_cast<unsigned char>(str[i])) * 16777619u;
+  size_t slot = hash % kDomainCacheSize;
+
+  JidDomainCache * cache = Jid_DomainCache();
+  {
+    CritScope cs(&cache->crit);
+    if (cache->raw[slot] == str && !cache->prepared[slot].empty()) {
+      *valid = true;
+      return cache->prepared[slot];
+    }
+  }
+  std::string result = prepDomain(str, str.begin(), str.end(), valid);
+  if (*valid) {
+    CritScope cs(&cache->crit);
+    cache->raw[slot] = str;
+    cache->prepared[slot] = result;
+  }
+  return result;
+}
+
 // Checks and normalizes the domain part of a JID.
 std::string 
 Jid::prepDomain(const std::string str, std::string::const_iterator start, 
@@ -386,7 +606,7 @@ Jid::prepDomain(const std::string str, std::string::const_iterator start,
     return STR_EMPTY;
   }
 
-  if (result.length() > 1023) {
+  if (result.length() > kMaxPartLength) {
     return STR_EMPTY;
   }
   *valid = true;
@@ -68,11 +68,27 @@ public:
     data_ = jid.data_;
     return *this;
   }
+#if TXMPP_HAS_MOVE
+  Jid(Jid && jid) noexcept : data_(jid.data_) {
+    jid.data_ = NULL;
+  }
+  Jid & operator=(Jid && jid) noexcept {
+    Swap(&jid);
+    return *this;
+  }
+#endif
   ~Jid() {
     if (data_ != NULL) {
       data_->Release();
     }
   }
+
+  // Exchanges the jids without touching either's reference count.
+  void Swap(Jid * other) {
+    Data * data = data_;
+    data_ = other->data_;
+    other->data_ = data;
+  }
   
 
   const std::string & node() const { return !data_ ? STR_EMPTY : data_->node_name_; }
@@ -103,7 +119,32 @@ public:
   // distribution.
   uint32 ComputeLameHash() const;
 
+  // Hashes of the whole JID and of its bare part, computed once when it is
+  // parsed: equal JIDs, or JIDs with equal bare parts, hash the same.  0
+  // for the empty JID.
+  uint32 Hash() const { return !data_ ? 0 : data_->full_hash_; }
+  uint32 BareHash() const { return !data_ ? 0 : data_->bare_hash_; }
+
+  // Interns a domain served or routed to a lot, so that JIDs parsed with it
+  // from then on compare their domains by pointer.  Domains are kept for
+  // the life of the program, up to 128 of them; returns false if |domain|
+  // isn't valid or the table is full.  Parsed JIDs only look the table up,
+  // so that peers can't grow it.
+  static bool InternDomain(const std::string & domain);
+  // The interned copy of the domain, or NULL if it isn't interned.  Two
+  // atoms are the same domain if and only if they are the same pointer.
+  const std::string * DomainAtom() const {
+    return !data_ ? NULL : data_->domain_atom_;
+  }
+
 private:
+  class Data;
+
+  explicit Jid(Data * data) : data_(data) {}
+
+  // Returns the prepared form of the domain |str|, from a cache of the
+  // domains prepared lately where it can.
+  static std::string prepDomainCached(const std::string & str, bool *valid);
 
   static std::string prepNode(const std::string str, 
       std::string::const_iterator start, std::string::const_iterator end, 
@@ -124,27 +165,50 @@ private:
       std::string *buf, bool *valid);
   static char prepDomainLabelAscii(char ch, bool *valid);
 
+  // Whether the domains of two JIDs' Data are equal.
+  static bool DomainEquals(const Data * a, const Data * b);
+
   class Data {
   public:
-    Data() : refcount_(1) {}
-    Data(const std::string & node, const std::string &domain, const std::string & resource) :
-      node_name_(node),
-      domain_name_(domain),
-      resource_name_(resource),
-      refcount_(1) {}
+    Data(const std::string & node, const std::string &domain, const std::string & resource);
+    // Takes the parts straight from a JID string that is already prepared.
+    Data(const std::string & jid, size_t node_len, size_t domain_begin,
+         size_t domain_len, size_t resource_begin, size_t resource_len);
     const std::string node_name_;
     const std::string domain_name_;
     const std::string resource_name_;
+    const std::string * domain_atom_;
+    uint32 bare_hash_;
+    uint32 full_hash_;
 
     void AddRef() { refcount_++; }
     void Release() { if (!--refcount_) delete this; }
   private:
+    // Computes the hashes and finds the domain atom.
+    void Init();
+
     int refcount_;
   };
 
   Data * data_;
 };
 
+// Function objects for keying hash tables by Jid, as std::tr1::unordered_map
+// takes them, on the whole JID or on its bare part.
+struct JidHash {
+  size_t operator()(const Jid & jid) const { return jid.Hash(); }
+};
+
+struct JidBareHash {
+  size_t operator()(const Jid & jid) const { return jid.BareHash(); }
+};
+
+struct JidBareEqual {
+  bool operator()(const Jid & a, const Jid & b) const {
+    return a.BareEquals(b);
+  }
+};
+
 }  // namespace txmpp
 
 #endif  // _TXMPP_JID_H_
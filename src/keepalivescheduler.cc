@@ -0,0 +1,250 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "keepalivescheduler.h"
+
+#include <vector>
+#include "common.h"
+#include "logging.h"
+#include "thread.h"
+#include "time.h"
+
+namespace txmpp {
+
+namespace {
+
+enum { MSG_WAKE };
+
+// Each ping answered after a full interval of idle time grows the interval
+// by this fraction of it.
+const int kPingGrowthDivisor = 4;
+
+}  // namespace
+
+KeepAliveScheduler::KeepAliveScheduler(Thread* thread)
+    : thread_(thread ? thread : Thread::Current()),
+      whitespace_ms_(0),
+      ping_min_ms_(0),
+      ping_max_ms_(0),
+      ping_timeout_ms_(0),
+      ping_timeout_rtos_(0),
+      ping_timeout_min_ms_(0),
+      ping_interval_ms_(0),
+      nat_timeout_ms_(0),
+      batch_ms_(1000),
+      timer_pending_(false),
+      timer_at_(0) {
+}
+
+KeepAliveScheduler::~KeepAliveScheduler() {
+  thread_->Clear(this);
+}
+
+void KeepAliveScheduler::SetWhitespaceInterval(int idle_ms) {
+  whitespace_ms_ = _max(idle_ms, 0);
+  Reschedule();
+}
+
+void KeepAliveScheduler::SetPing(int min_ms, int max_ms, int timeout_ms) {
+  ping_min_ms_ = _max(min_ms, 0);
+  ping_max_ms_ = _max(max_ms, ping_min_ms_);
+  ping_timeout_ms_ = _max(timeout_ms, 1);
+  ping_interval_ms_ = ping_min_ms_;
+  nat_timeout_ms_ = 0;
+  Reschedule();
+}
+
+void KeepAliveScheduler::SetAdaptivePingTimeout(int rtos, int min_ms) {
+  ping_timeout_rtos_ = _max(rtos, 0);
+  ping_timeout_min_ms_ = _max(min_ms, 1);
+}
+
+void KeepAliveScheduler::SetBatchWindow(int window_ms) {
+  batch_ms_ = _max(window_ms, 0);
+}
+
+void KeepAliveScheduler::Add(Connection* connection) {
+  connections_[connection] = Entry();
+  int interval = ShortestInterval();
+  if (interval > 0)
+    Schedule(connection->LastWriteTime() + interval);
+}
+
+void KeepAliveScheduler::Remove(Connection* connection) {
+  connections_.erase(connection);
+  // The timer is left as it is; waking to nothing is cheaper than
+  // finding the next due time.
+}
+
+void KeepAliveScheduler::OnPingReply(Connection* connection) {
+  ConnectionMap::iterator it = connections_.find(connection);
+  if (it == connections_.end() || !it->second.ping_pending)
+    return;
+  it->second.ping_pending = false;
+  if (it->second.ping_idle_ms < ping_interval_ms_)
+    return;
+  // The connection lived through the whole interval; try a longer one,
+  // short of where pings were lost before.
+  int limit = ping_max_ms_;
+  if (nat_timeout_ms_ > 0)
+    limit = _min(limit, nat_timeout_ms_ * 3 / 4);
+  int grown = ping_interval_ms_ + ping_interval_ms_ / kPingGrowthDivisor;
+  ping_interval_ms_ = _max(ping_min_ms_, _min(grown, limit));
+}
+
+void KeepAliveScheduler::OnMessage(Message* msg) {
+  ASSERT(msg->message_id == MSG_WAKE);
+  timer_pending_ = false;
+  ++stats_.wakeups;
+  CheckConnections();
+}
+
+int KeepAliveScheduler::ShortestInterval() const {
+  if (ping_interval_ms_ > 0 && whitespace_ms_ > 0)
+    return _min(ping_interval_ms_, whitespace_ms_);
+  return _max(ping_interval_ms_, whitespace_ms_);
+}
+
+void KeepAliveScheduler::Schedule(uint32 when) {
+  if (timer_pending_) {
+    if (TimeIsLaterOrEqual(timer_at_, when))
+      return;
+    thread_->Clear(this, MSG_WAKE);
+  }
+  timer_pending_ = true;
+  timer_at_ = when;
+  // The slack lets the queue put this wakeup with other timers near it.
+  thread_->PostAt(when, this, MSG_WAKE, NULL, batch_ms_);
+}
+
+void KeepAliveScheduler::Reschedule() {
+  // Looks at every connection soon, which puts the timer right.
+  if (!connections_.empty())
+    Schedule(CachedTime());
+}
+
+void KeepAliveScheduler::CheckConnections() {
+  uint32 now = CachedTime();
+  int shortest = ShortestInterval();
+  bool have_next = false;
+  uint32 next = 0;
+  std::vector<Connection*> pings, whitespace, timeouts;
+
+  for (ConnectionMap::iterator it = connections_.begin();
+       it != connections_.end(); ++it) {
+    Entry& entry = it->second;
+    int32 left;
+    if (entry.ping_pending) {
+      left = entry.ping_timeout_ms - TimeDiff(now, entry.ping_sent);
+      if (left <= 0) {
+        timeouts.push_back(it->first);
+        continue;
+      }
+    } else {
+      if (shortest == 0)
+        continue;
+      int32 idle = TimeDiff(now, it->first->LastWriteTime());
+      if (ping_interval_ms_ > 0 && ping_interval_ms_ - idle <= batch_ms_) {
+        entry.ping_idle_ms = idle;
+        entry.ping_timeout_ms = PingTimeout(it->first);
+        pings.push_back(it->first);
+        // Woken to find the ping lost, if that comes before the next.
+        left = _min(shortest, entry.ping_timeout_ms);
+      } else if (whitespace_ms_ > 0 && whitespace_ms_ - idle <= batch_ms_) {
+        whitespace.push_back(it->first);
+        left = shortest;
+      } else {
+        left = shortest - idle;
+      }
+    }
+    uint32 due = now + left;
+    if (!have_next || TimeIsLater(due, next)) {
+      next = due;
+      have_next = true;
+    }
+  }
+
+  // Sending may close a connection, and closing removes it, so each is
+  // looked up again before it is used.
+  for (size_t i = 0; i < timeouts.size(); ++i) {
+    ConnectionMap::iterator it = connections_.find(timeouts[i]);
+    if (it == connections_.end())
+      continue;
+    ++stats_.ping_timeouts;
+    LearnNatTimeout(it->second.ping_idle_ms);
+    connections_.erase(it);
+    timeouts[i]->OnPingTimeout();
+  }
+  for (size_t i = 0; i < pings.size(); ++i) {
+    ConnectionMap::iterator it = connections_.find(pings[i]);
+    if (it == connections_.end())
+      continue;
+    it->second.ping_pending = true;
+    it->second.ping_sent = now;
+    ++stats_.pings;
+    if (!pings[i]->SendPing()) {
+      it = connections_.find(pings[i]);
+      if (it != connections_.end())
+        it->second.ping_pending = false;
+    }
+  }
+  for (size_t i = 0; i < whitespace.size(); ++i) {
+    if (connections_.find(whitespace[i]) == connections_.end())
+      continue;
+    ++stats_.whitespace;
+    whitespace[i]->SendWhitespace();
+  }
+
+  if (have_next)
+    Schedule(next);
+}
+
+int KeepAliveScheduler::PingTimeout(Connection* connection) const {
+  if (ping_timeout_rtos_ == 0)
+    return ping_timeout_ms_;
+  int rto = connection->RetransmitTimeoutMs();
+  if (rto <= 0)
+    return ping_timeout_ms_;
+  int64 timeout = static_cast<int64>(rto) * ping_timeout_rtos_;
+  return static_cast<int>(_min(static_cast<int64>(ping_timeout_ms_),
+      _max(timeout, static_cast<int64>(ping_timeout_min_ms_))));
+}
+
+void KeepAliveScheduler::LearnNatTimeout(int idle_ms) {
+  // A ping after a short idle time says more about the other end than the
+  // NAT; those are not learned from.
+  if (ping_interval_ms_ <= 0 || idle_ms < ping_min_ms_)
+    return;
+  if (nat_timeout_ms_ == 0 || idle_ms < nat_timeout_ms_)
+    nat_timeout_ms_ = idle_ms;
+  ping_interval_ms_ = _max(ping_min_ms_, nat_timeout_ms_ * 3 / 4);
+  LOG(LS_INFO) << "KeepAliveScheduler: a ping after " << idle_ms
+               << " ms idle was lost; pinging every " << ping_interval_ms_
+               << " ms";
+}
+
+}  // namespace txmpp
@@ -0,0 +1,170 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_KEEPALIVESCHEDULER_H_
+#define _TXMPP_KEEPALIVESCHEDULER_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+#include <map>
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "messagehandler.h"
+
+namespace txmpp {
+
+class Thread;
+
+// Keeps many connections alive from one timer.  A connection is sent a
+// keepalive only once it has written nothing for the interval, so a busy
+// one costs nothing, and the connections falling due within the batch
+// window of each other are all served by one wakeup.
+//
+// Keepalives are whitespace, XEP-0199 pings, or both.  Whitespace keeps a
+// NAT mapping open; a ping also finds out whether the other end is there.
+// Whitespace is a write too, so with both on, pings go out only while
+// their interval is the shorter.
+// The ping interval adapts: it grows while pings sent after that long an
+// idle time are answered, and when one is not, the idle time it followed
+// is taken as the NAT timeout and the interval stays under it.
+//
+// XmppClient::SetKeepAlive puts a client on a scheduler while its stream
+// is open.  A scheduler belongs to one thread.
+class KeepAliveScheduler : public MessageHandler {
+ public:
+  // What the scheduler keeps alive.
+  class Connection {
+   public:
+    virtual ~Connection() {}
+    // When it last wrote, as CachedTime() or Time() gives it.
+    virtual uint32 LastWriteTime() = 0;
+    virtual void SendWhitespace() = 0;
+    // Sends a ping, to be answered with OnPingReply.  Returns false if it
+    // could not be sent.
+    virtual bool SendPing() = 0;
+    // The last ping went unanswered for the ping timeout; the connection
+    // should be taken as lost.
+    virtual void OnPingTimeout() = 0;
+    // The retransmission timeout from the connection's measured round
+    // trip, in milliseconds, or 0 if it has none; see RttEstimator.
+    virtual int RetransmitTimeoutMs() { return 0; }
+  };
+
+  struct Stats {
+    Stats() : wakeups(0), whitespace(0), pings(0), ping_timeouts(0) {}
+
+    uint64 wakeups;
+    uint64 whitespace;
+    uint64 pings;
+    uint64 ping_timeouts;
+  };
+
+  // Runs on |thread|, or the current thread if it is NULL.
+  explicit KeepAliveScheduler(Thread* thread = NULL);
+  virtual ~KeepAliveScheduler();
+
+  // Sends whitespace after |idle_ms| without a write.  0, the default,
+  // turns it off.
+  void SetWhitespaceInterval(int idle_ms);
+  // Pings after an idle time that starts at |min_ms| and adapts up to
+  // |max_ms|, taking a ping as lost after |timeout_ms|.  A |min_ms| of 0,
+  // the default, turns pings off.
+  void SetPing(int min_ms, int max_ms, int timeout_ms);
+  // Takes a ping as lost after |rtos| of the connection's retransmission
+  // timeouts instead, but no sooner than |min_ms|, and no later than the
+  // ping timeout, which a connection without a measured round trip waits.
+  // A fast link then finds a dead peer soon.  0 |rtos|, the default,
+  // always waits the ping timeout.
+  void SetAdaptivePingTimeout(int rtos, int min_ms);
+  // Keepalives due within |window_ms| of each other are sent in one
+  // wakeup, early rather than late.  1000 by default.
+  void SetBatchWindow(int window_ms);
+
+  void Add(Connection* connection);
+  void Remove(Connection* connection);
+  // The ping sent to |connection| was answered.
+  void OnPingReply(Connection* connection);
+
+  // The idle time after which a connection is pinged now.
+  int ping_interval() const { return ping_interval_ms_; }
+  // The NAT timeout learned from lost pings, or 0 if none was lost.
+  int nat_timeout() const { return nat_timeout_ms_; }
+  size_t size() const { return connections_.size(); }
+  const Stats& stats() const { return stats_; }
+
+  virtual void OnMessage(Message* msg);
+
+ private:
+  struct Entry {
+    Entry() : ping_pending(false), ping_sent(0), ping_timeout_ms(0),
+              ping_idle_ms(0) {}
+
+    bool ping_pending;
+    uint32 ping_sent;
+    // How long the pending ping is waited for.
+    int ping_timeout_ms;
+    // How long the connection had been idle when the ping was sent.
+    int ping_idle_ms;
+  };
+  typedef std::map<Connection*, Entry> ConnectionMap;
+
+  // The idle time after which a connection gets a keepalive, or 0.
+  int ShortestInterval() const;
+  void Schedule(uint32 when);
+  void Reschedule();
+  void CheckConnections();
+  void LearnNatTimeout(int idle_ms);
+  int PingTimeout(Connection* connection) const;
+
+  Thread* thread_;
+  ConnectionMap connections_;
+
+  int whitespace_ms_;
+  int ping_min_ms_;
+  int ping_max_ms_;
+  int ping_timeout_ms_;
+  int ping_timeout_rtos_;
+  int ping_timeout_min_ms_;
+  int ping_interval_ms_;
+  int nat_timeout_ms_;
+  int batch_ms_;
+
+  // The wakeup posted, if timer_pending_.
+  bool timer_pending_;
+  uint32 timer_at_;
+
+  Stats stats_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(KeepAliveScheduler);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_KEEPALIVESCHEDULER_H_
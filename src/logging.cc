@@ -52,6 +52,7 @@ static const int kMaxLogLineSize = 1024 - 60;
 #include "stream.h"
 #include "stringencode.h"
 #include "stringutils.h"
+#include "thread.h"
 #include "time.h"
 
 namespace txmpp {
@@ -89,6 +90,20 @@ std::string ErrorName(int err, const ConstantLabel * err_table) {
 
 const int LogMessage::NO_LOGGING = LS_ERROR + 1;
 
+// Room for a message's "Severity(file.cc:line): ".
+static const size_t kContextSize = 128;
+
+// Writes |value| in decimal, in at least |width| digits, to end just before
+// |end|, and returns where it starts.
+static char* FormatDigits(uint32 value, int width, char* end) {
+  do {
+    *--end = static_cast<char>('0' + value % 10);
+    value /= 10;
+    --width;
+  } while (value > 0 || width > 0);
+  return end;
+}
+
 #if _DEBUG
 static const int LOG_DEFAULT = LS_INFO;
 #else  // !_DEBUG
@@ -99,7 +114,7 @@ static const int LOG_DEFAULT = LogMessage::NO_LOGGING;
 CriticalSection LogMessage::crit_;
 
 // By default, release builds don't log, debug builds at info level
-int LogMessage::min_sev_ = LOG_DEFAULT;
+volatile int LogMessage::min_sev_ = LOG_DEFAULT;
 int LogMessage::dbg_sev_ = LOG_DEFAULT;
 
 // Don't bother printing context for the ubiquitous INFO log messages
@@ -120,16 +135,314 @@ uint32 LogMessage::start_ = StartTime();
 // If we're in diagnostic mode, we'll be explicitly set that way; default=false.
 bool LogMessage::is_diagnostic_mode_ = false;
 
+// Logging is synchronous until LogAsync is called.
+AsyncLogWriter* volatile LogMessage::async_ = NULL;
+
+/////////////////////////////////////////////////////////////////////////////
+// AsyncLogWriter
+/////////////////////////////////////////////////////////////////////////////
+
+// Writes out the messages that logging threads leave in their rings. Each
+// ring has a single producer, its thread, and a single consumer, the
+// writer's thread, so neither side takes a lock: the producer publishes a
+// record by advancing head, and the consumer frees it by advancing tail.
+class AsyncLogWriter : public Runnable {
+ public:
+  AsyncLogWriter();
+
+  // Buffers |msg| in the calling thread's ring. Returns false if the
+  // caller should write it out itself.
+  bool Write(const std::string& msg, LoggingSeverity severity);
+
+  void Start(LogFullPolicy policy, size_t buffer_size);
+  void Stop();
+
+  virtual void Run(Thread* thread);
+
+ private:
+  // A record is a Header followed by the message, padded to kAlign. The
+  // ring's head and tail count bytes from its creation, and a record never
+  // wraps: a header with kWrap as its length skips to the buffer's start.
+  struct Header {
+    uint32 len;
+    int32 severity;
+  };
+
+  struct Ring {
+    char* buffer;
+    uint32 size;
+    volatile uint32 head;
+    volatile uint32 tail;
+    volatile int dropped;
+    // Set once the thread has exited, for the writer to free the ring.
+    volatile uint32 orphaned;
+    // Messages from the writer's own thread are written out directly.
+    bool direct;
+    LogFullPolicy policy;
+    Ring* next;
+  };
+
+  static const uint32 kAlign = 8;
+  static const uint32 kWrap = 0xFFFFFFFF;
+  static const uint32 kMinBufferSize = 4096;
+  // How long the writer sleeps when nothing wakes it.
+  static const int kIdleMs = 100;
+
+  static uint32 RecordSize(size_t len) {
+    return static_cast<uint32>(
+        (sizeof(Header) + len + kAlign - 1) & ~(kAlign - 1));
+  }
+
+  Ring* CurrentRing();
+  // Copies a record of |len| bytes into |ring| if there is room for it.
+  static bool Push(Ring* ring, const std::string& msg,
+                   LoggingSeverity severity);
+  // Writes out and frees what is in every ring, then the rings of threads
+  // that have exited.
+  void Drain();
+  void DrainRing(Ring* ring);
+  void Wake();
+
+#ifdef POSIX
+  static void OnThreadExit(void* ring);
+  pthread_key_t key_;
+#elif WIN32
+  DWORD key_;
+#endif
+
+  // The rings, newest first. Changed under LogMessage::crit_, and walked
+  // without it by the writer's thread.
+  Ring* volatile rings_;
+  LogFullPolicy policy_;
+  uint32 buffer_size_;
+  scoped_ptr<Thread> thread_;
+  Event wake_;
+  // Set when the writer has been woken, so that each burst of messages
+  // signals wake_ once.
+  volatile int wake_pending_;
+  std::string record_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(AsyncLogWriter);
+};
+
+AsyncLogWriter::AsyncLogWriter()
+    : rings_(NULL), policy_(LF_DROP), buffer_size_(kMinBufferSize),
+      wake_(false, false), wake_pending_(0) {
+#ifdef POSIX
+  pthread_key_create(&key_, &AsyncLogWriter::OnThreadExit);
+#elif WIN32
+  key_ = TlsAlloc();
+#endif
+}
+
+#ifdef POSIX
+void AsyncLogWriter::OnThreadExit(void* ring) {
+  AtomicOps::ReleaseStore(&static_cast<Ring*>(ring)->orphaned, 1);
+}
+#endif
+
+AsyncLogWriter::Ring* AsyncLogWriter::CurrentRing() {
+#ifdef POSIX
+  Ring* ring = static_cast<Ring*>(pthread_getspecific(key_));
+#elif WIN32
+  Ring* ring = static_cast<Ring*>(TlsGetValue(key_));
+#endif
+  if (ring)
+    return ring;
+
+  CritScope cs(&LogMessage::crit_);
+  ring = new Ring;
+  ring->size = buffer_size_;
+  ring->buffer = new char[ring->size];
+  ring->head = ring->tail = 0;
+  ring->dropped = 0;
+  ring->orphaned = 0;
+  ring->direct = false;
+  ring->policy = policy_;
+  ring->next = rings_;
+  AtomicOps::ReleaseStorePtr(&rings_, ring);
+#ifdef POSIX
+  pthread_setspecific(key_, ring);
+#elif WIN32
+  TlsSetValue(key_, ring);
+#endif
+  return ring;
+}
+
+bool AsyncLogWriter::Push(Ring* ring, const std::string& msg,
+                          LoggingSeverity severity) {
+  uint32 need = RecordSize(msg.size());
+  uint32 head = ring->head;
+  uint32 offset = head & (ring->size - 1);
+  uint32 contiguous = ring->size - offset;
+  uint32 skip = (contiguous < need) ? contiguous : 0;
+  if (head + skip + need - AtomicOps::AcquireLoad(&ring->tail) > ring->size)
+    return false;
+
+  if (skip) {
+    reinterpret_cast<Header*>(ring->buffer + offset)->len = kWrap;
+    head += skip;
+    offset = 0;
+  }
+  Header* header = reinterpret_cast<Header*>(ring->buffer + offset);
+  header->len = static_cast<uint32>(msg.size());
+  header->severity = severity;
+  memcpy(header + 1, msg.data(), msg.size());
+  AtomicOps::ReleaseStore(&ring->head, head + need);
+  return true;
+}
+
+bool AsyncLogWriter::Write(const std::string& msg, LoggingSeverity severity) {
+  Ring* ring = CurrentRing();
+  // A message that would take more than half the ring is written directly,
+  // rather than waiting for a ring that may never have room for it.
+  if (ring->direct || RecordSize(msg.size()) > ring->size / 2)
+    return false;
+
+  while (!Push(ring, msg, severity)) {
+    if (ring->policy == LF_DROP) {
+      AtomicOps::Increment(&ring->dropped);
+      return true;
+    }
+    Wake();
+    Thread::SleepMs(1);
+  }
+  Wake();
+  return true;
+}
+
+void AsyncLogWriter::Wake() {
+  if (!AtomicOps::AcquireLoad(&wake_pending_) &&
+      !AtomicOps::Exchange(&wake_pending_, 1)) {
+    wake_.Set();
+  }
+}
+
+void AsyncLogWriter::Start(LogFullPolicy policy, size_t buffer_size) {
+  policy_ = policy;
+  buffer_size_ = kMinBufferSize;
+  while (buffer_size_ < buffer_size && buffer_size_ < (1u << 30))
+    buffer_size_ <<= 1;
+  if (!thread_.get()) {
+    thread_.reset(new Thread);
+    thread_->SetName("AsyncLogWriter", this);
+    thread_->Start(this);
+  }
+}
+
+void AsyncLogWriter::Stop() {
+  if (thread_.get()) {
+    thread_->Quit();
+    wake_.Set();
+    thread_->Stop();
+    thread_.reset();
+  }
+  // Messages buffered by threads that had not yet seen the writer stop.
+  Drain();
+}
+
+void AsyncLogWriter::Run(Thread* thread) {
+  CurrentRing()->direct = true;
+  while (!thread->IsQuitting()) {
+    wake_.Wait(kIdleMs);
+    AtomicOps::Exchange(&wake_pending_, 0);
+    Drain();
+  }
+  Drain();
+}
+
+void AsyncLogWriter::Drain() {
+  for (Ring* ring = AtomicOps::AcquireLoadPtr(&rings_); ring;
+       ring = ring->next) {
+    DrainRing(ring);
+  }
+
+  CritScope cs(&LogMessage::crit_);
+  for (Ring* volatile* link = &rings_; *link; ) {
+    Ring* ring = *link;
+    if (AtomicOps::AcquireLoad(&ring->orphaned)) {
+      DrainRing(ring);
+      *link = ring->next;
+      delete [] ring->buffer;
+      delete ring;
+    } else {
+      link = &ring->next;
+    }
+  }
+}
+
+void AsyncLogWriter::DrainRing(Ring* ring) {
+  uint32 tail = ring->tail;
+  uint32 head = AtomicOps::AcquireLoad(&ring->head);
+  while (tail != head) {
+    uint32 offset = tail & (ring->size - 1);
+    const Header* header = reinterpret_cast<Header*>(ring->buffer + offset);
+    if (header->len == kWrap) {
+      tail += ring->size - offset;
+      continue;
+    }
+    LoggingSeverity severity = static_cast<LoggingSeverity>(header->severity);
+    record_.assign(reinterpret_cast<const char*>(header + 1), header->len);
+    tail += RecordSize(header->len);
+    AtomicOps::ReleaseStore(&ring->tail, tail);
+    LogMessage::Output(record_, severity);
+  }
+  AtomicOps::ReleaseStore(&ring->tail, tail);
+
+  if (int dropped = AtomicOps::Exchange(&ring->dropped, 0)) {
+    std::ostringstream os;
+    os << "[" << dropped << " log messages dropped]" << std::endl;
+    LogMessage::Output(os.str(), LS_WARNING);
+  }
+}
+
+// Created once and never destroyed, as threads may be logging to it while
+// it is stopped.
+static AsyncLogWriter* LogMessage_writer = NULL;
+static CriticalSection LogMessage_async_crit;
+
+/////////////////////////////////////////////////////////////////////////////
+// LogMessage
+/////////////////////////////////////////////////////////////////////////////
+
 LogMessage::LogMessage(const char* file, int line, LoggingSeverity sev,
                        LogErrorContext err_ctx, int err, const char* module)
     : severity_(sev) {
+  AppendTimeAndThread();
+  if (severity_ >= ctx_sev_) {
+    char context[kContextSize];
+    print_stream_.write(context,
+                        FormatContext(file, line, sev, context,
+                                      sizeof(context)));
+  }
+  AppendError(err_ctx, err, module);
+}
+
+LogMessage::LogMessage(LogCallSite* site, LogErrorContext err_ctx, int err,
+                       const char* module)
+    : severity_(site->severity) {
+  AppendTimeAndThread();
+  if (severity_ >= ctx_sev_)
+    print_stream_ << SitePrefix(site);
+  AppendError(err_ctx, err, module);
+}
+
+void LogMessage::AppendTimeAndThread() {
   // Android's logging facility keeps track of timestamp and thread.
 #ifndef ANDROID
   if (timestamp_) {
+    // "[sss:mmm] ", with as many more digits of seconds as it takes.
     uint32 time = TimeSince(start_);
-    print_stream_ << "[" << std::setfill('0') << std::setw(3) << (time / 1000)
-                  << ":" << std::setw(3) << (time % 1000) << std::setfill(' ')
-                  << "] ";
+    char stamp[24];
+    char* end = stamp + sizeof(stamp);
+    char* p = end;
+    *--p = ' ';
+    *--p = ']';
+    p = FormatDigits(time % 1000, 3, p);
+    *--p = ':';
+    p = FormatDigits(time / 1000, 3, p);
+    *--p = '[';
+    print_stream_.write(p, end - p);
   }
 
   if (thread_) {
@@ -139,12 +452,10 @@ LogMessage::LogMessage(const char* file, int line, LoggingSeverity sev,
 #endif  // WIN32
   }
 #endif  // !ANDROID
+}
 
-  if (severity_ >= ctx_sev_) {
-    print_stream_ << Describe(sev) << "(" << DescribeFile(file)
-                  << ":" << line << "): ";
-  }
-
+void LogMessage::AppendError(LogErrorContext err_ctx, int err,
+                             const char* module) {
   if (err_ctx != ERRCTX_NONE) {
     std::ostringstream tmp;
     tmp << "[0x" << std::setfill('0') << std::hex << std::setw(8) << err << "]";
@@ -194,14 +505,22 @@ LogMessage::~LogMessage() {
   print_stream_ << std::endl;
 
   const std::string& str = print_stream_.str();
-  if (severity_ >= dbg_sev_) {
-    OutputToDebug(str, severity_);
+  if (AsyncLogWriter* async = AtomicOps::AcquireLoadPtr(&async_)) {
+    if (async->Write(str, severity_))
+      return;
+  }
+  Output(str, severity_);
+}
+
+void LogMessage::Output(const std::string& str, LoggingSeverity severity) {
+  if (severity >= dbg_sev_) {
+    OutputToDebug(str, severity);
   }
 
   // Must lock streams_ before accessing
   CritScope cs(&crit_);
   for (StreamList::iterator it = streams_.begin(); it != streams_.end(); ++it) {
-    if (severity_ >= it->second) {
+    if (severity >= it->second) {
       OutputToStream(it->first, str);
     }
   }
@@ -224,6 +543,7 @@ void LogMessage::ResetTimestamps() {
 }
 
 void LogMessage::LogToDebug(int min_sev) {
+  CritScope cs(&crit_);
   dbg_sev_ = min_sev;
   UpdateMinLogSeverity();
 }
@@ -253,6 +573,9 @@ int LogMessage::GetLogToStream(StreamInterface* stream) {
 }
 
 void LogMessage::AddLogToStream(StreamInterface* stream, int min_sev) {
+  // Named here rather than by a static initializer of its own, which could
+  // run before the one of the lock stats registry.
+  crit_.SetName("LogMessage");
   CritScope cs(&crit_);
   streams_.push_back(std::make_pair(stream, min_sev));
   UpdateMinLogSeverity();
@@ -269,6 +592,20 @@ void LogMessage::RemoveLogToStream(StreamInterface* stream) {
   UpdateMinLogSeverity();
 }
 
+void LogMessage::LogAsync(bool on, LogFullPolicy policy, size_t buffer_size) {
+  // Not crit_, which the writer's thread needs to finish while stopping.
+  CritScope cs(&LogMessage_async_crit);
+  if (on) {
+    if (!LogMessage_writer)
+      LogMessage_writer = new AsyncLogWriter;
+    LogMessage_writer->Start(policy, buffer_size);
+    AtomicOps::ReleaseStorePtr(&async_, LogMessage_writer);
+  } else if (async_) {
+    AtomicOps::ReleaseStorePtr(&async_, static_cast<AsyncLogWriter*>(NULL));
+    LogMessage_writer->Stop();
+  }
+}
+
 void LogMessage::ConfigureLogging(const char* params, const char* filename) {
   int current_level = LS_VERBOSE;
   int debug_level = GetLogToDebug();
@@ -286,6 +623,8 @@ void LogMessage::ConfigureLogging(const char* params, const char* filename) {
       LogTimestamps();
     } else if (tokens[i] == "thread") {
       LogThreads();
+    } else if (tokens[i] == "async") {
+      LogAsync(true);
 
     // Logging levels
     } else if (tokens[i] == "sensitive") {
@@ -364,9 +703,9 @@ int LogMessage::ParseLogSeverity(const std::string& value) {
 void LogMessage::UpdateMinLogSeverity() {
   int min_sev = dbg_sev_;
   for (StreamList::iterator it = streams_.begin(); it != streams_.end(); ++it) {
-    min_sev = _min(dbg_sev_, it->second);
+    min_sev = _min(min_sev, it->second);
   }
-  min_sev_ = min_sev;
+  AtomicOps::RelaxedStore(&min_sev_, min_sev);
 }
 
 const char* LogMessage::Describe(LoggingSeverity sev) {
@@ -389,6 +728,38 @@ const char* LogMessage::DescribeFile(const char* file) {
     return (end1 > end2) ? end1 + 1 : end2 + 1;
 }
 
+size_t LogMessage::FormatContext(const char* file, int line,
+                                 LoggingSeverity sev, char* buffer,
+                                 size_t size) {
+  int len = snprintf(buffer, size, "%s(%s:%d): ", Describe(sev),
+                     DescribeFile(file), line);
+  // _snprintf neither terminates nor counts what it cuts off.
+  if (len < 0 || static_cast<size_t>(len) >= size) {
+    len = static_cast<int>(size) - 1;
+    buffer[len] = '\0';
+  }
+  return len;
+}
+
+const char* LogMessage::SitePrefix(LogCallSite* site) {
+  if (const char* prefix = AtomicOps::AcquireLoadPtr(&site->prefix))
+    return prefix;
+  // Only the first message of each statement gets here, or the few that
+  // race it.
+  CritScope cs(&crit_);
+  if (!site->prefix) {
+    char context[kContextSize];
+    size_t len = FormatContext(site->file, site->line, site->severity,
+                               context, sizeof(context));
+    char* prefix = new char[len + 1];
+    memcpy(prefix, context, len + 1);
+    // Kept for as long as the statement, which is to say never freed.
+    AtomicOps::ReleaseStorePtr(&site->prefix,
+                               static_cast<const char*>(prefix));
+  }
+  return site->prefix;
+}
+
 void LogMessage::OutputToDebug(const std::string& str,
                                LoggingSeverity severity) {
   bool log_to_stderr = true;
@@ -491,20 +862,59 @@ void LogMessage::OutputToStream(StreamInterface* stream,
 // Logging Helpers
 //////////////////////////////////////////////////////////////////////
 
-void LogMultiline(LoggingSeverity level, const char* label, bool input,
-                  const void* data, size_t len, bool hex_mode,
-                  LogMultilineState* state) {
-  if (!LOG_CHECK_LEVEL_V(level))
-    return;
+bool LogRateLimiter::EveryN(int n, LogRatePass* pass) {
+  n = _max(n, 1);
+  uint32 count = static_cast<uint32>(AtomicOps::Increment(&count_));
+  if ((count - 1) % n != 0)
+    return false;
+  pass->set_suppressed((count > 1) ? n - 1 : 0);
+  return true;
+}
+
+bool LogRateLimiter::FirstN(int n, LogRatePass* pass) {
+  // Stop counting once past n, so that the count never wraps.
+  if (AtomicOps::AcquireLoad(&count_) >= n)
+    return false;
+  return AtomicOps::Increment(&count_) <= n;
+}
+
+bool LogRateLimiter::EveryT(int ms, LogRatePass* pass) {
+  uint64 now = TimeMicros();
+  uint64 last = AtomicOps::AcquireLoad(&last_);
+  if ((last && now - last < static_cast<uint64>(ms) * 1000) ||
+      !AtomicOps::CompareAndSwap(&last_, last, now)) {
+    AtomicOps::Increment(&count_);
+    return false;
+  }
+  pass->set_suppressed(AtomicOps::Exchange(&count_, 0));
+  return true;
+}
+
+// Receives each line of a multiline dump.
+typedef void (*LogMultiline_Emit)(void* context, const std::string& line);
 
+static void LogMultiline_Log(void* level, const std::string& line) {
+  LOG_V(*static_cast<LoggingSeverity*>(level)) << line;
+}
+
+static void LogMultiline_Append(void* out, const std::string& line) {
+  static_cast<std::string*>(out)->append(line).append("\n");
+}
+
+static void LogMultiline_Format(const char* label, bool input,
+                                const void* data, size_t len, bool hex_mode,
+                                LogMultilineState* state,
+                                LogMultiline_Emit emit, void* context) {
+  std::ostringstream os;
   const char * direction = (input ? " << " : " >> ");
 
   // NULL data means to flush our count of unprintable characters.
   if (!data) {
     if (state && state->unprintable_count_[input]) {
-      LOG_V(level) << label << direction << "## "
-                   << state->unprintable_count_[input]
-                   << " consecutive unprintable ##";
+      os.str("");
+      os << label << direction << "## " << state->unprintable_count_[input]
+         << " consecutive unprintable ##";
+      emit(context, os.str());
       state->unprintable_count_[input] = 0;
     }
     return;
@@ -528,8 +938,9 @@ void LogMultiline(LoggingSeverity level, const char* label, bool input,
       }
       asc_line[sizeof(asc_line)-1] = 0;
       hex_line[sizeof(hex_line)-1] = 0;
-      LOG_V(level) << label << direction
-                   << asc_line << " " << hex_line << " ";
+      os.str("");
+      os << label << direction << asc_line << " " << hex_line << " ";
+      emit(context, os.str());
       udata += line_len;
       len -= line_len;
     }
@@ -582,8 +993,10 @@ void LogMultiline(LoggingSeverity level, const char* label, bool input,
     // Print out the current line, but prefix with a count of prior unprintable
     // characters.
     if (consecutive_unprintable) {
-      LOG_V(level) << label << direction << "## " << consecutive_unprintable
-                  << " consecutive unprintable ##";
+      os.str("");
+      os << label << direction << "## " << consecutive_unprintable
+         << " consecutive unprintable ##";
+      emit(context, os.str());
       consecutive_unprintable = 0;
     }
     // Strip off trailing whitespace.
@@ -597,9 +1010,13 @@ void LogMultiline(LoggingSeverity level, const char* label, bool input,
       pos_private = substr.find("Passwd");
     }
     if (pos_private == std::string::npos) {
-      LOG_V(level) << label << direction << substr;
+      os.str("");
+      os << label << direction << substr;
+      emit(context, os.str());
     } else {
-      LOG_V(level) << label << direction << "## omitted for privacy ##";
+      os.str("");
+      os << label << direction << "## omitted for privacy ##";
+      emit(context, os.str());
     }
   }
 
@@ -608,6 +1025,22 @@ void LogMultiline(LoggingSeverity level, const char* label, bool input,
   }
 }
 
+void LogMultiline(LoggingSeverity level, const char* label, bool input,
+                  const void* data, size_t len, bool hex_mode,
+                  LogMultilineState* state) {
+  if (!LOG_CHECK_LEVEL_V(level))
+    return;
+  LogMultiline_Format(label, input, data, len, hex_mode, state,
+                      &LogMultiline_Log, &level);
+}
+
+void FormatMultiline(const char* label, bool input, const void* data,
+                     size_t len, bool hex_mode, LogMultilineState* state,
+                     std::string* out) {
+  LogMultiline_Format(label, input, data, len, hex_mode, state,
+                      &LogMultiline_Append, out);
+}
+
 //////////////////////////////////////////////////////////////////////
 
 }  // namespace txmpp
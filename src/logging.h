@@ -56,7 +56,16 @@
 // LOG_CHECK_LEVEL(sev) (and LOG_CHECK_LEVEL_V(sev)) can be used as a test
 //     before performing expensive or sensitive operations whose sole purpose is
 //     to output logging data at the desired level.
+// LOG_EVERY_N(sev, n), LOG_FIRST_N(sev, n) and LOG_EVERY_T(sev, ms) limit a
+//     statement to every nth time it is reached, the first n times, or once
+//     every ms milliseconds, for error paths that can fire in a loop. The
+//     messages from LOG_EVERY_N and LOG_EVERY_T begin with the number of
+//     times the statement was skipped since it last logged. LOG_E_EVERY_T
+//     and LOG_ERR_EVERY_T are the equivalents of LOG_E and LOG_ERR.
 // Lastly, PLOG(sev, err) is an alias for LOG_ERR_EX.
+//   Building with LOG_MIN_SEVERITY set to a LoggingSeverity value compiles
+// out the LOG statements of constant severity below it, so that neither their
+// message nor their arguments cost anything.
 
 #ifndef _TXMPP_LOGGING_H_
 #define _TXMPP_LOGGING_H_
@@ -129,6 +138,26 @@ enum LogErrorContext {
   ERRCTX_OS = ERRCTX_OSSTATUS,  // LOG_E(sev, OS, x)
 };
 
+// What a thread logging asynchronously does when its buffer is full.
+enum LogFullPolicy {
+  LF_DROP,   // Discard the message; the number dropped is logged later.
+  LF_BLOCK,  // Wait for the background thread to make room.
+};
+
+class AsyncLogWriter;
+
+// What is constant about one LOG statement, which keeps it as a static. It
+// has no constructor, like LogRateLimiter, so that it is filled in before it
+// is first used, without a guard.
+struct LogCallSite {
+  const char* file;
+  int line;
+  LoggingSeverity severity;
+  // The statement's "Info(file.cc:12): ", formatted the first time it logs
+  // with context, and NULL before.
+  const char* volatile prefix;
+};
+
 class LogMessage {
  public:
   static const int NO_LOGGING;
@@ -136,9 +165,15 @@ class LogMessage {
   LogMessage(const char* file, int line, LoggingSeverity sev,
              LogErrorContext err_ctx = ERRCTX_NONE, int err = 0,
              const char* module = NULL);
+  // As above, for a LOG statement, whose file and line are formatted once.
+  explicit LogMessage(LogCallSite* site, LogErrorContext err_ctx = ERRCTX_NONE,
+                      int err = 0, const char* module = NULL);
   ~LogMessage();
 
-  static inline bool Loggable(LoggingSeverity sev) { return (sev >= min_sev_); }
+  // A single relaxed load, as it is checked before every message.
+  static inline bool Loggable(LoggingSeverity sev) {
+    return (sev >= AtomicOps::RelaxedLoad(&min_sev_));
+  }
   std::ostream& stream() { return print_stream_; }
 
   // These are attributes which apply to all logging channels
@@ -171,9 +206,21 @@ class LogMessage {
   static void AddLogToStream(StreamInterface* stream, int min_sev);
   static void RemoveLogToStream(StreamInterface* stream);
 
+  //  Async: Hands the formatted messages to a background thread, which
+  //   writes them to the targets above, so that logging threads neither
+  //   contend for the lock nor wait on a slow stream. Each thread keeps its
+  //   messages in a ring of |buffer_size| bytes until they are written, and
+  //   |policy| applies when the ring is full; both take effect for threads
+  //   that log for the first time afterwards. Messages from different
+  //   threads may be written out of order. LogAsync(false) writes out what
+  //   is buffered and stops the background thread.
+  static void LogAsync(bool on, LogFullPolicy policy = LF_DROP,
+                       size_t buffer_size = 64 * 1024);
+  static bool IsLogAsync() { return async_ != NULL; }
+
   // Testing against MinLogSeverity allows code to avoid potentially expensive
   // logging operations by pre-checking the logging level.
-  static int GetMinLogSeverity() { return min_sev_; }
+  static int GetMinLogSeverity() { return AtomicOps::RelaxedLoad(&min_sev_); }
 
   static void SetDiagnosticMode(bool f) { is_diagnostic_mode_ = f; }
   static bool IsDiagnosticMode() { return is_diagnostic_mode_; }
@@ -189,16 +236,30 @@ class LogMessage {
  private:
   typedef std::list<std::pair<StreamInterface*, int> > StreamList;
 
+  friend class AsyncLogWriter;
+
   // Updates min_sev_ appropriately when debug sinks change.
   static void UpdateMinLogSeverity();
 
   // These assist in formatting some parts of the debug output.
   static const char* Describe(LoggingSeverity sev);
   static const char* DescribeFile(const char* file);
+  // Writes "Info(file.cc:12): " into |buffer|, cut short to fit, and returns
+  // its length.
+  static size_t FormatContext(const char* file, int line, LoggingSeverity sev,
+                              char* buffer, size_t size);
+  // The prefix of |site|, formatted by the first message to need it.
+  static const char* SitePrefix(LogCallSite* site);
+
+  // The parts of the constructors before and after the context.
+  void AppendTimeAndThread();
+  void AppendError(LogErrorContext err_ctx, int err, const char* module);
 
   // These write out the actual log messages.
   static void OutputToDebug(const std::string& msg, LoggingSeverity severity_);
   static void OutputToStream(StreamInterface* stream, const std::string& msg);
+  // Writes the message to every target whose level it meets.
+  static void Output(const std::string& msg, LoggingSeverity severity);
 
   // The ostream that buffers the formatted message before output
   std::ostringstream print_stream_;
@@ -218,7 +279,8 @@ class LogMessage {
   //  as a short-circuit in the logging macros to identify messages that won't
   //  be logged.
   // ctx_sev_ is the minimum level at which file context is displayed
-  static int min_sev_, dbg_sev_, ctx_sev_;
+  static volatile int min_sev_;
+  static int dbg_sev_, ctx_sev_;
 
   // The output streams and their associated severities
   static StreamList streams_;
@@ -232,6 +294,9 @@ class LogMessage {
   // are we in diagnostic mode (as defined by the app)?
   static bool is_diagnostic_mode_;
 
+  // The background writer while logging is asynchronous, otherwise NULL.
+  static AsyncLogWriter* volatile async_;
+
   DISALLOW_EVIL_CONSTRUCTORS(LogMessage);
 };
 
@@ -239,6 +304,51 @@ class LogMessage {
 // Logging Helpers
 //////////////////////////////////////////////////////////////////////
 
+// One pass through a rate-limited logging statement; see LOG_EVERY_N.
+class LogRatePass {
+ public:
+  LogRatePass() : suppressed_(0), begun_(false) {}
+
+  // True until Begin has been called, which returns true only once.
+  bool Pending() const { return !begun_; }
+  bool Begin() {
+    bool first = !begun_;
+    begun_ = true;
+    return first;
+  }
+
+  int suppressed() const { return suppressed_; }
+  void set_suppressed(int suppressed) { suppressed_ = suppressed; }
+
+ private:
+  int suppressed_;
+  bool begun_;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const LogRatePass& pass) {
+  if (pass.suppressed() > 0)
+    os << "[" << pass.suppressed() << " suppressed] ";
+  return os;
+}
+
+// The state of one rate-limited logging statement. It has no constructor,
+// so that as a function-level static it is zeroed before it is first used,
+// without a guard. Each call records one time the statement is reached, and
+// returns true if it should log this time.
+class LogRateLimiter {
+ public:
+  bool EveryN(int n, LogRatePass* pass);
+  bool FirstN(int n, LogRatePass* pass);
+  bool EveryT(int ms, LogRatePass* pass);
+
+ private:
+  // The times reached: in all for EveryN and FirstN, or since the last
+  // message for EveryT.
+  volatile int count_;
+  // The TimeMicros of EveryT's last message, or 0 before the first.
+  volatile uint64 last_;
+};
+
 class LogMultilineState {
  public:
   size_t unprintable_count_[2];
@@ -253,6 +363,12 @@ void LogMultiline(LoggingSeverity level, const char* label, bool input,
                   const void* data, size_t len, bool hex_mode,
                   LogMultilineState* state);
 
+// Like LogMultiline, but appends the lines to |out|, each ending in a newline,
+// whatever the logging level.
+void FormatMultiline(const char* label, bool input, const void* data,
+                     size_t len, bool hex_mode, LogMultilineState* state,
+                     std::string* out);
+
 //////////////////////////////////////////////////////////////////////
 // Macros which automatically disable logging when LOGGING == 0
 //////////////////////////////////////////////////////////////////////
@@ -266,6 +382,11 @@ void LogMultiline(LoggingSeverity level, const char* label, bool input,
 #endif
 #endif  // !defined(LOGGING)
 
+// Statements below LOG_MIN_SEVERITY are compiled out; by default none are.
+#if !defined(LOG_MIN_SEVERITY)
+#define LOG_MIN_SEVERITY 0
+#endif  // !defined(LOG_MIN_SEVERITY)
+
 #ifndef LOG
 #if LOGGING
 
@@ -285,13 +406,28 @@ class LogMessageVoidify {
 };
 
 #define LOG_SEVERITY_PRECONDITION(sev) \
-  !(txmpp::LogMessage::Loggable(sev)) \
+  !(txmpp::LogCompiledIn(sev) && txmpp::LogMessage::Loggable(sev)) \
     ? (void) 0 \
     : txmpp::LogMessageVoidify() &
 
+// A constant for constant |sev|, so that the compiler drops the statements
+// below LOG_MIN_SEVERITY before Loggable is ever reached.
+inline bool LogCompiledIn(LoggingSeverity sev) {
+  return static_cast<int>(sev) >= static_cast<int>(LOG_MIN_SEVERITY);
+}
+
+// Runs the statement after it once if |sev| is logged, with log_site_, the
+// LogCallSite of the statement. As a whole it is one statement, safe under
+// an unbraced if.
+#define LOG_CALL_SITE(sev) \
+  for (bool log_once_ = true; log_once_; log_once_ = false) \
+    for (static txmpp::LogCallSite log_site_ = \
+             { __FILE__, __LINE__, sev, NULL }; \
+         log_once_ && txmpp::LogCheckLevel(sev); log_once_ = false)
+
 #define LOG(sev) \
-  LOG_SEVERITY_PRECONDITION(txmpp::sev) \
-    txmpp::LogMessage(__FILE__, __LINE__, txmpp::sev).stream()
+  LOG_CALL_SITE(txmpp::sev) \
+    txmpp::LogMessage(&log_site_).stream()
 
 // The _V version is for when a variable is passed in.  It doesn't do the
 // namespace concatination.
@@ -311,15 +447,37 @@ class LogMessageVoidify {
 #define LOG_CHECK_LEVEL_V(sev) \
   txmpp::LogCheckLevel(sev)
 inline bool LogCheckLevel(LoggingSeverity sev) {
-  return (LogMessage::GetMinLogSeverity() <= sev);
+  return LogCompiledIn(sev) && LogMessage::Loggable(sev);
 }
 
 #define LOG_E(sev, ctx, err, ...) \
-  LOG_SEVERITY_PRECONDITION(txmpp::sev) \
-    txmpp::LogMessage(__FILE__, __LINE__, txmpp::sev, \
-                          txmpp::ERRCTX_ ## ctx, err , ##__VA_ARGS__) \
+  LOG_CALL_SITE(txmpp::sev) \
+    txmpp::LogMessage(&log_site_, txmpp::ERRCTX_ ## ctx, err , ##__VA_ARGS__) \
         .stream()
 
+// The outer loop runs once and holds this pass's LogRatePass, and the inner
+// one runs its body at most once, if |check| allows; as a whole it is one
+// statement, safe under an unbraced if.
+#define LOG_RATE_PRECONDITION(sev, check) \
+  for (txmpp::LogRatePass log_pass_; log_pass_.Pending(); ) \
+    for (static txmpp::LogRateLimiter log_limiter_; \
+         log_pass_.Begin() && txmpp::LogCheckLevel(sev) && \
+         log_limiter_.check; )
+
+#define LOG_EVERY_N(sev, n) \
+  LOG_RATE_PRECONDITION(txmpp::sev, EveryN(n, &log_pass_)) \
+    txmpp::LogMessage(__FILE__, __LINE__, txmpp::sev).stream() << log_pass_
+#define LOG_FIRST_N(sev, n) \
+  LOG_RATE_PRECONDITION(txmpp::sev, FirstN(n, &log_pass_)) \
+    txmpp::LogMessage(__FILE__, __LINE__, txmpp::sev).stream()
+#define LOG_EVERY_T(sev, ms) \
+  LOG_RATE_PRECONDITION(txmpp::sev, EveryT(ms, &log_pass_)) \
+    txmpp::LogMessage(__FILE__, __LINE__, txmpp::sev).stream() << log_pass_
+#define LOG_E_EVERY_T(sev, ms, ctx, err) \
+  LOG_RATE_PRECONDITION(txmpp::sev, EveryT(ms, &log_pass_)) \
+    txmpp::LogMessage(__FILE__, __LINE__, txmpp::sev, \
+                      txmpp::ERRCTX_ ## ctx, err).stream() << log_pass_
+
 #else  // !LOGGING
 
 // Hopefully, the compiler will optimize away some of this code.
@@ -340,6 +498,11 @@ inline bool LogCheckLevel(LoggingSeverity sev) {
                           txmpp::ERRCTX_ ## ctx, err , ##__VA_ARGS__) \
       .stream()
 
+#define LOG_EVERY_N(sev, n) LOG(sev)
+#define LOG_FIRST_N(sev, n) LOG(sev)
+#define LOG_EVERY_T(sev, ms) LOG(sev)
+#define LOG_E_EVERY_T(sev, ms, ctx, err) LOG_E(sev, ctx, err)
+
 #endif  // !LOGGING
 
 #define LOG_ERRNO_EX(sev, err) \
@@ -360,6 +523,8 @@ inline bool LogCheckLevel(LoggingSeverity sev) {
   LOG_GLE(sev)
 #define LAST_SYSTEM_ERROR \
   (::GetLastError())
+#define LOG_ERR_EVERY_T(sev, ms) \
+  LOG_E_EVERY_T(sev, ms, HRESULT, GetLastError())
 #elif POSIX
 #define LOG_ERR_EX(sev, err) \
   LOG_ERRNO_EX(sev, err)
@@ -367,6 +532,8 @@ inline bool LogCheckLevel(LoggingSeverity sev) {
   LOG_ERRNO(sev)
 #define LAST_SYSTEM_ERROR \
   (errno)
+#define LOG_ERR_EVERY_T(sev, ms) \
+  LOG_E_EVERY_T(sev, ms, ERRNO, errno)
 #endif  // WIN32
 
 #define PLOG(sev, err) \
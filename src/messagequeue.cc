@@ -31,30 +31,37 @@
 #pragma warning(disable:4786)
 #endif
 
+#include <new>
+#include <typeinfo>
+
 #ifdef POSIX
 #include <sys/time.h>
 #endif
 
+#include "allocstats.h"
 #include "common.h"
 #include "logging.h"
+#include "metrics.h"
 #include "physicalsocketserver.h"
+#include "stalldetector.h"
+#include "tracepoints.h"
 
 
 namespace txmpp {
 
 const uint32 kMaxMsgLatency = 150;  // 150 ms
 
+// Times a lane with messages may be passed over before it gets a turn.
+const int kMaxLaneSkips = 16;
+
 //------------------------------------------------------------------
 // MessageQueueManager
 
-MessageQueueManager* MessageQueueManager::instance_;
-
 MessageQueueManager* MessageQueueManager::Instance() {
-  // Note: This is not thread safe, but it is first called before threads are
-  // spawned.
-  if (!instance_)
-    instance_ = new MessageQueueManager;
-  return instance_;
+  // Never destroyed, as queues may outlive static destruction.  Threads come
+  // and go all the time, so it is not torn down with the last queue either.
+  static MessageQueueManager* const instance = new MessageQueueManager;
+  return instance;
 }
 
 MessageQueueManager::MessageQueueManager() {
@@ -63,44 +70,529 @@ MessageQueueManager::MessageQueueManager() {
 MessageQueueManager::~MessageQueueManager() {
 }
 
+MessageQueueManager::Shard* MessageQueueManager::ShardOf(
+    MessageQueue *message_queue) {
+  size_t h = reinterpret_cast<size_t>(message_queue);
+  return &shards_[(h >> 4 ^ h >> 12) % kShards];
+}
+
 void MessageQueueManager::Add(MessageQueue *message_queue) {
+  Shard* shard = ShardOf(message_queue);
   // MessageQueueManager methods should be non-reentrant, so we
   // ASSERT that is the case.  If any of these ASSERT, please
   // contact bpm or jbeda.
-  ASSERT(!crit_.CurrentThreadIsOwner());
-  CritScope cs(&crit_);
-  message_queues_.push_back(message_queue);
+  ASSERT(!shard->crit.CurrentThreadIsOwner());
+  CritScope cs(&shard->crit);
+  message_queue->manager_index_ = shard->message_queues.size();
+  shard->message_queues.push_back(message_queue);
 }
 
 void MessageQueueManager::Remove(MessageQueue *message_queue) {
-  ASSERT(!crit_.CurrentThreadIsOwner());  // See note above.
-  // If this is the last MessageQueue, destroy the manager as well so that
-  // we don't leak this object at program shutdown. As mentioned above, this is
-  // not thread-safe, but this should only happen at program termination (when
-  // the ThreadManager is destroyed, and threads are no longer active).
-  bool destroy = false;
-  {
-    CritScope cs(&crit_);
+  Shard* shard = ShardOf(message_queue);
+  ASSERT(!shard->crit.CurrentThreadIsOwner());  // See note above.
+  CritScope cs(&shard->crit);
+  std::vector<MessageQueue *>& queues = shard->message_queues;
+  size_t index = message_queue->manager_index_;
+  ASSERT(index < queues.size() && queues[index] == message_queue);
+  if (index < queues.size() && queues[index] == message_queue) {
+    queues[index] = queues.back();
+    queues[index]->manager_index_ = index;
+    queues.pop_back();
+  }
+}
+
+void MessageQueueManager::Clear(MessageHandler *handler) {
+  for (int i = 0; i < kShards; ++i) {
+    Shard* shard = &shards_[i];
+    ASSERT(!shard->crit.CurrentThreadIsOwner());  // See note above.
+    CritScope cs(&shard->crit);
     std::vector<MessageQueue *>::iterator iter;
-    iter = std::find(message_queues_.begin(), message_queues_.end(),
-                     message_queue);
-    if (iter != message_queues_.end()) {
-      message_queues_.erase(iter);      
+    for (iter = shard->message_queues.begin();
+         iter != shard->message_queues.end(); iter++) {
+      if ((*iter)->MayHold(handler))
+        (*iter)->Clear(handler);
     }
-    destroy = message_queues_.empty();
   }
-  if (destroy) {
-    instance_ = NULL;
-    delete this;    
+}
+
+//------------------------------------------------------------------
+// MessageData
+
+namespace {
+
+// Size classes for MessageData. Larger ones come from the heap.
+const size_t kMessageDataSizes[] = { 32, 64, 128 };
+const int kMessageDataPools = ARRAY_SIZE(kMessageDataSizes);
+
+BlockPool* MessageDataPool(size_t size) {
+  // Never destroyed, as messages may outlive static destruction.
+  static BlockPool* pools[kMessageDataPools] = {
+    new BlockPool(kMessageDataSizes[0]),
+    new BlockPool(kMessageDataSizes[1]),
+    new BlockPool(kMessageDataSizes[2]),
+  };
+  for (int i = 0; i < kMessageDataPools; ++i) {
+    if (size <= kMessageDataSizes[i])
+      return pools[i];
   }
+  return NULL;
 }
 
-void MessageQueueManager::Clear(MessageHandler *handler) {
-  ASSERT(!crit_.CurrentThreadIsOwner());  // See note above.
-  CritScope cs(&crit_);
-  std::vector<MessageQueue *>::iterator iter;
-  for (iter = message_queues_.begin(); iter != message_queues_.end(); iter++)
-    (*iter)->Clear(handler);
+}  // namespace
+
+void* MessageData::operator new(size_t size) {
+  AllocStats::Record(AllocStats::AS_MESSAGE_DATA, size);
+  BlockPool* pool = MessageDataPool(size);
+  return pool ? pool->Allocate() : ::operator new(size);
+}
+
+void MessageData::operator delete(void* p, size_t size) {
+  BlockPool* pool = MessageDataPool(size);
+  if (pool) {
+    pool->Free(p);
+  } else {
+    ::operator delete(p);
+  }
+}
+
+//------------------------------------------------------------------
+// TimerWheel
+
+namespace {
+
+const int kWheelLevels = 5;
+// Level n holds ticks that share bits kWheelShift[n + 1] and up with the
+// current tick, in buckets of 1 << kWheelShift[n] ticks.
+const int kWheelShift[kWheelLevels + 1] = { 0, 8, 14, 20, 26, 32 };
+const int kWheelBase[kWheelLevels] = { 0, 256, 320, 384, 448 };
+const int kMaxWheelDelay = 0x3fffffff;
+
+inline int WheelMask(int level) {
+  return (1 << (kWheelShift[level + 1] - kWheelShift[level])) - 1;
+}
+
+inline uint64 WheelSpan(int level) {
+  return static_cast<uint64>(1) << kWheelShift[level];
+}
+
+}  // namespace
+
+struct TimerWheel::Node {
+  explicit Node(const DelayedMessage& d)
+      : dmsg(d), tick(0), slot(NULL), prev(NULL), next(NULL),
+        hprev(NULL), hnext(NULL) {}
+
+  DelayedMessage dmsg;
+  uint64 tick;
+  List* slot;
+  Node* prev;
+  Node* next;
+  HandlerMap::iterator owner;
+  Node* hprev;
+  Node* hnext;
+};
+
+TimerWheel::TimerWheel()
+    : tick_(0), time_(0), size_(0), nodes_(sizeof(Node)) {
+  memset(bits_, 0, sizeof(bits_));
+}
+
+TimerWheel::~TimerWheel() {
+  std::vector<DelayedMessage> dmsgs;
+  Release(&dmsgs);
+}
+
+void TimerWheel::Push(uint32 now, const DelayedMessage& dmsg) {
+  if (size_ == 0) {
+    // Nothing depends on the clock while the wheel is empty, so resync it
+    // rather than risk time_ being far enough behind to wrap.
+    time_ = now;
+  }
+  Node* node = new (nodes_.Allocate()) Node(dmsg);
+  Schedule(node);
+  Link(node);
+  ++size_;
+}
+
+int TimerWheel::PopTriggered(uint32 now, MessageList* msgs) {
+  Fire(&due_, msgs);
+  int32 elapsed = TimeDiff(now, time_);
+  if (elapsed >= 0) {
+    uint64 last = tick_ + elapsed;
+    uint64 next;
+    while (NextEvent(&next) && next <= last) {
+      // Any boundary skipped on the way to |next| has nothing to cascade.
+      SetTick(next);
+      Fire(&slots_[next & WheelMask(0)], msgs);
+      SetTick(next + 1);
+    }
+    if (tick_ <= last)
+      SetTick(last + 1);
+    time_ = now + 1;
+  }
+  return GetDelay(now);
+}
+
+int TimerWheel::GetDelay(uint32 now) const {
+  if (due_.head)
+    return 0;
+  uint64 next;
+  if (!NextEvent(&next))
+    return kForever;
+  int64 delay = static_cast<int64>(next - tick_) - TimeDiff(now, time_);
+  if (delay < 0)
+    return 0;
+  return static_cast<int>(_min<int64>(delay, kMaxWheelDelay));
+}
+
+void TimerWheel::Clear(MessageHandler* phandler, uint32 id,
+                       MessageList* removed) {
+  HandlerMap::iterator it, end;
+  if (phandler) {
+    it = handlers_.find(phandler);
+    if (it == handlers_.end())
+      return;
+    end = it;
+    ++end;
+  } else {
+    it = handlers_.begin();
+    end = handlers_.end();
+  }
+  while (it != end) {
+    // Unindexing the last node of a handler erases its entry.
+    Node* node = (it++)->second.head;
+    while (node) {
+      Node* hnext = node->hnext;
+      if (node->dmsg.msg_.Match(phandler, id)) {
+        if (removed) {
+          removed->push_back(node->dmsg.msg_);
+        } else {
+          delete node->dmsg.msg_.pdata;
+        }
+        Unlink(node);
+        Unindex(node);
+        Delete(node);
+        --size_;
+      }
+      node = hnext;
+    }
+  }
+}
+
+bool TimerWheel::Reschedule(const DelayedMessage& dmsg, uint32* trigger) {
+  const Message& msg = dmsg.msg_;
+  Node* node = Find(msg.phandler, msg.message_id);
+  if (!node)
+    return false;
+  // Any later copies go, as Clear would take them.  The handler keeps
+  // |node|, so its entry stays.
+  Node* other = node->hnext;
+  while (other) {
+    Node* hnext = other->hnext;
+    if (other->dmsg.msg_.Match(msg.phandler, msg.message_id)) {
+      delete other->dmsg.msg_.pdata;
+      Unlink(other);
+      Unindex(other);
+      Delete(other);
+      --size_;
+    }
+    other = hnext;
+  }
+  *trigger = node->dmsg.msTrigger_;
+  Unlink(node);
+  if (node->dmsg.msg_.pdata != msg.pdata)
+    delete node->dmsg.msg_.pdata;
+  node->dmsg = dmsg;
+  Schedule(node);
+  return true;
+}
+
+bool TimerWheel::Contains(MessageHandler* phandler, uint32 id) const {
+  return Find(phandler, id) != NULL;
+}
+
+TimerWheel::Node* TimerWheel::Find(MessageHandler* phandler,
+                                   uint32 id) const {
+  HandlerMap::const_iterator it = handlers_.find(phandler);
+  if (it == handlers_.end())
+    return NULL;
+  for (Node* node = it->second.head; node; node = node->hnext) {
+    if (node->dmsg.msg_.Match(phandler, id))
+      return node;
+  }
+  return NULL;
+}
+
+void TimerWheel::Release(std::vector<DelayedMessage>* dmsgs) {
+  for (HandlerMap::iterator it = handlers_.begin(); it != handlers_.end();
+       ++it) {
+    Node* node = it->second.head;
+    while (node) {
+      Node* hnext = node->hnext;
+      dmsgs->push_back(node->dmsg);
+      Delete(node);
+      node = hnext;
+    }
+  }
+  handlers_.clear();
+  for (int i = 0; i < kSlotCount; ++i)
+    slots_[i] = List();
+  memset(bits_, 0, sizeof(bits_));
+  due_ = List();
+  overflow_ = List();
+  size_ = 0;
+}
+
+void TimerWheel::Schedule(Node* node) {
+  int32 delay = TimeDiff(node->dmsg.msTrigger_, time_);
+  if (delay < 0) {
+    // Keep due_ in trigger order. It rarely holds more than a few messages,
+    // and those mostly posted with no delay, so the scan is short.
+    Node* prev = due_.tail;
+    while (prev && TimeIsLater(node->dmsg.msTrigger_, prev->dmsg.msTrigger_))
+      prev = prev->prev;
+    node->tick = tick_;
+    InsertAfter(&due_, prev, node);
+  } else {
+    node->tick = tick_ + delay;
+    Place(node);
+  }
+}
+
+void TimerWheel::Place(Node* node) {
+  ASSERT(node->tick >= tick_);
+  uint64 diff = node->tick ^ tick_;
+  for (int level = 0; level < kWheelLevels; ++level) {
+    if (diff < WheelSpan(level + 1)) {
+      int index = static_cast<int>(
+          (node->tick >> kWheelShift[level]) & WheelMask(level));
+      Append(&slots_[kWheelBase[level] + index], node);
+      return;
+    }
+  }
+  Append(&overflow_, node);
+}
+
+void TimerWheel::Cascade() {
+  // Entering a new bucket at some level: spread its messages over the levels
+  // below, highest first so that each lands before its own bucket is spread.
+  // Re-placing keeps each bucket in posting order.
+  if ((tick_ & (WheelSpan(kWheelLevels) - 1)) == 0) {
+    List list = Detach(&overflow_);
+    while (Node* node = list.head) {
+      list.head = node->next;
+      Place(node);
+    }
+  }
+  for (int level = kWheelLevels - 1; level > 0; --level) {
+    if ((tick_ & (WheelSpan(level) - 1)) != 0)
+      continue;
+    int index = static_cast<int>(
+        (tick_ >> kWheelShift[level]) & WheelMask(level));
+    List list = Detach(&slots_[kWheelBase[level] + index]);
+    while (Node* node = list.head) {
+      list.head = node->next;
+      Place(node);
+    }
+  }
+}
+
+void TimerWheel::SetTick(uint64 tick) {
+  tick_ = tick;
+  if ((tick_ & (WheelSpan(1) - 1)) == 0)
+    Cascade();
+}
+
+void TimerWheel::Fire(List* list, MessageList* msgs) {
+  List fired = Detach(list);
+  while (Node* node = fired.head) {
+    fired.head = node->next;
+    msgs->push_back(node->dmsg.msg_);
+    Unindex(node);
+    Delete(node);
+    --size_;
+  }
+}
+
+bool TimerWheel::NextEvent(uint64* tick) const {
+  // The first non-empty bucket at the lowest level that has one. Above level
+  // 0 that is the tick at which the bucket cascades.
+  for (int level = 0; level < kWheelLevels; ++level) {
+    int mask = WheelMask(level);
+    int current = static_cast<int>((tick_ >> kWheelShift[level]) & mask);
+    int slot = FindSlot(kWheelBase[level] + current,
+                        kWheelBase[level] + mask + 1);
+    if (slot >= 0) {
+      uint64 start = tick_ & ~(WheelSpan(level + 1) - 1);
+      start |= static_cast<uint64>(slot - kWheelBase[level])
+               << kWheelShift[level];
+      *tick = _max(start, tick_);
+      return true;
+    }
+  }
+  if (overflow_.head) {
+    *tick = (tick_ | (WheelSpan(kWheelLevels) - 1)) + 1;
+    return true;
+  }
+  return false;
+}
+
+int TimerWheel::FindSlot(int from, int end) const {
+  for (int i = from; i < end;) {
+    uint32 word = bits_[i >> 5] >> (i & 31);
+    if (word == 0) {
+      i = (i | 31) + 1;
+      continue;
+    }
+    while ((word & 1) == 0) {
+      word >>= 1;
+      ++i;
+    }
+    return (i < end) ? i : -1;
+  }
+  return -1;
+}
+
+void TimerWheel::Append(List* list, Node* node) {
+  InsertAfter(list, list->tail, node);
+}
+
+void TimerWheel::InsertAfter(List* list, Node* prev, Node* node) {
+  if (!list->head && list >= slots_ && list < slots_ + kSlotCount) {
+    int i = static_cast<int>(list - slots_);
+    bits_[i >> 5] |= 1u << (i & 31);
+  }
+  node->slot = list;
+  node->prev = prev;
+  node->next = prev ? prev->next : list->head;
+  if (node->next) {
+    node->next->prev = node;
+  } else {
+    list->tail = node;
+  }
+  if (prev) {
+    prev->next = node;
+  } else {
+    list->head = node;
+  }
+}
+
+void TimerWheel::Unlink(Node* node) {
+  List* list = node->slot;
+  if (node->prev) {
+    node->prev->next = node->next;
+  } else {
+    list->head = node->next;
+  }
+  if (node->next) {
+    node->next->prev = node->prev;
+  } else {
+    list->tail = node->prev;
+  }
+  if (!list->head && list >= slots_ && list < slots_ + kSlotCount) {
+    int i = static_cast<int>(list - slots_);
+    bits_[i >> 5] &= ~(1u << (i & 31));
+  }
+  node->slot = NULL;
+}
+
+void TimerWheel::Link(Node* node) {
+  node->owner = handlers_.insert(
+      std::make_pair(node->dmsg.msg_.phandler, List())).first;
+  List& list = node->owner->second;
+  node->hnext = NULL;
+  node->hprev = list.tail;
+  if (list.tail) {
+    list.tail->hnext = node;
+  } else {
+    list.head = node;
+  }
+  list.tail = node;
+}
+
+void TimerWheel::Unindex(Node* node) {
+  List& list = node->owner->second;
+  if (node->hprev) {
+    node->hprev->hnext = node->hnext;
+  } else {
+    list.head = node->hnext;
+  }
+  if (node->hnext) {
+    node->hnext->hprev = node->hprev;
+  } else {
+    list.tail = node->hprev;
+  }
+  if (!list.head)
+    handlers_.erase(node->owner);
+}
+
+void TimerWheel::Delete(Node* node) {
+  node->~Node();
+  nodes_.Free(node);
+}
+
+TimerWheel::List TimerWheel::Detach(List* list) {
+  List detached = *list;
+  *list = List();
+  if (list >= slots_ && list < slots_ + kSlotCount) {
+    int i = static_cast<int>(list - slots_);
+    bits_[i >> 5] &= ~(1u << (i & 31));
+  }
+  return detached;
+}
+
+//------------------------------------------------------------------
+// PostQueue
+
+PostQueue::PostQueue()
+    : tail_(&stub_), head_(&stub_), size_(0), nodes_(sizeof(Node)) {
+  stub_.next = NULL;
+}
+
+PostQueue::~PostQueue() {
+  // The owner has cleared the messages; this frees nodes from the heap.
+  Message msg;
+  while (Pop(&msg)) {}
+}
+
+void PostQueue::Push(const Message& msg) {
+  // Link at the tail first, then make the node reachable from its
+  // predecessor. Until then Pop sees the queue end just before it.
+  Node* node = new (nodes_.Allocate()) Node;
+  node->msg = msg;
+  node->next = NULL;
+  AtomicOps::Increment(&size_);
+  Node* prev = AtomicOps::ExchangePtr(&tail_, node);
+  AtomicOps::ReleaseStorePtr(&prev->next, node);
+}
+
+bool PostQueue::Pop(Message* msg) {
+  Node* head = head_;
+  Node* next = AtomicOps::AcquireLoadPtr(&head->next);
+  if (head == &stub_) {
+    if (!next)
+      return false;
+    head_ = head = next;
+    next = AtomicOps::AcquireLoadPtr(&head->next);
+  }
+  if (!next) {
+    // |head| is the last node, unless a Push is under way. Put the stub
+    // back behind it so that |head| can be taken without emptying the list.
+    if (head != AtomicOps::AcquireLoadPtr(&tail_))
+      return false;
+    stub_.next = NULL;
+    Node* prev = AtomicOps::ExchangePtr(&tail_, &stub_);
+    AtomicOps::ReleaseStorePtr(&prev->next, &stub_);
+    next = AtomicOps::AcquireLoadPtr(&head->next);
+    if (!next)
+      return false;
+  }
+  head_ = next;
+  *msg = head->msg;
+  AtomicOps::Decrement(&size_);
+  head->~Node();
+  nodes_.Free(head);
+  return true;
 }
 
 //------------------------------------------------------------------
@@ -108,7 +600,12 @@ void MessageQueueManager::Clear(MessageHandler *handler) {
 
 MessageQueue::MessageQueue(SocketServer* ss)
     : ss_(ss), fStop_(false), fPeekKeep_(false), active_(false),
-      dmsgq_next_num_(0) {
+      manager_index_(0), stats_(NULL),
+      stall_detector_(NULL), handlers_(0), fTimerWheel_(true),
+      dmsgq_next_num_(0), doomed_front_(0), doomed_count_(0) {
+  crit_.SetName("MessageQueue");
+  for (int i = 0; i < MQ_PRIORITY_COUNT; ++i)
+    skipped_[i] = 0;
   if (!ss_) {
     // Currently, MessageQueue holds a socket server, and is the base class for
     // Thread.  It seems like it makes more sense for Thread to hold the socket
@@ -130,6 +627,7 @@ MessageQueue::~MessageQueue() {
     MessageQueueManager::Instance()->Remove(this);
     Clear(NULL);
   }
+  while (DeleteDisposed(kDisposeBatch)) {}
   if (ss_) {
     ss_->SetMessageQueue(NULL);
   }
@@ -179,9 +677,16 @@ bool MessageQueue::Get(Message *pmsg, int cmsWait, bool process_io) {
 
   int cmsTotal = cmsWait;
   int cmsElapsed = 0;
-  uint32 msStart = Time();
+  // Each pass refreshes the thread's cached time, for what is posted while
+  // the message returned is dispatched.
+  uint32 msStart = static_cast<uint32>(UpdateCachedTime());
   uint32 msCurrent = msStart;
   while (true) {
+    // Delete what was disposed of, a batch at a time
+
+    bool disposing = AtomicOps::AcquireLoad(&doomed_count_) != 0 &&
+                     DeleteDisposed(kDisposeBatch);
+
     // Check for sent messages
 
     ReceiveSends();
@@ -195,39 +700,43 @@ bool MessageQueue::Get(Message *pmsg, int cmsWait, bool process_io) {
       // Check for delayed messages that have been triggered
       // Calc the next trigger too
 
-      while (!dmsgq_.empty()) {
-        if (TimeIsLater(msCurrent, dmsgq_.top().msTrigger_)) {
-          cmsDelayNext = TimeDiff(dmsgq_.top().msTrigger_, msCurrent);
-          break;
+      MessageList triggered;
+      if (fTimerWheel_) {
+        cmsDelayNext = dmsgw_.PopTriggered(msCurrent, &triggered);
+      } else {
+        while (!dmsgq_.empty()) {
+          if (TimeIsLater(msCurrent, dmsgq_.top().msTrigger_)) {
+            cmsDelayNext = TimeDiff(dmsgq_.top().msTrigger_, msCurrent);
+            break;
+          }
+          triggered.push_back(dmsgq_.top().msg_);
+          dmsgq_.pop();
         }
-        msgq_.push_back(dmsgq_.top().msg_);
-        dmsgq_.pop();
+      }
+      if (!triggered.empty()) {
+        // Triggered messages go after what was posted before them, which
+        // msgq_, being delivered first, would otherwise overtake.
+        MessageList& msgq = msgq_[MQ_PRIORITY_NORMAL];
+        Message msg;
+        while (postq_[MQ_PRIORITY_NORMAL].Pop(&msg))
+          msgq.push_back(msg);
+        msgq.splice(msgq.end(), triggered);
       }
 
       // Check for posted events
 
-      while (!msgq_.empty()) {
-        *pmsg = msgq_.front();
-        if (pmsg->ts_sensitive) {
-          long delay = TimeDiff(msCurrent, pmsg->ts_sensitive);
-          if (delay > 0) {
-            LOG_F(LS_WARNING) << "id: " << pmsg->message_id << "  delay: "
-                              << (delay + kMaxMsgLatency) << "ms";
-          }
-        }
-        msgq_.pop_front();
-        if (MQID_DISPOSE == pmsg->message_id) {
-          ASSERT(NULL == pmsg->phandler);
-          delete pmsg->pdata;
-          continue;
-        }
+      if (PopReady(pmsg, msCurrent))
         return true;
-      }
+      ResetHandlers();
     }
 
     if (fStop_)
       break;
 
+    // With objects left to delete, only polls for I/O.
+    if (disposing)
+      cmsDelayNext = 0;
+
     // Which is shorter, the delay wait or the asked wait?
 
     int cmsNext;
@@ -245,7 +754,7 @@ bool MessageQueue::Get(Message *pmsg, int cmsWait, bool process_io) {
 
     // If the specified timeout expired, return
 
-    msCurrent = Time();
+    msCurrent = static_cast<uint32>(UpdateCachedTime());
     cmsElapsed = TimeDiff(msCurrent, msStart);
     if (cmsWait != kForever) {
       if (cmsElapsed >= cmsWait)
@@ -255,33 +764,172 @@ bool MessageQueue::Get(Message *pmsg, int cmsWait, bool process_io) {
   return false;
 }
 
+void MessageQueue::DoDispose(void* doomed, Deleter deleter) {
+  Doomed entry;
+  entry.object = doomed;
+  entry.deleter = deleter;
+  bool was_empty;
+  {
+    CritScope cs(&crit_);
+    was_empty = doomed_count_ == 0;
+    doomed_.push_back(entry);
+    AtomicOps::ReleaseStore(&doomed_count_, doomed_count_ + 1);
+  }
+  // One wakeup does for a batch disposed of together.
+  if (was_empty)
+    ss_->WakeUp();
+}
+
+bool MessageQueue::DeleteDisposed(size_t budget) {
+  size_t left;
+  {
+    CritScope cs(&crit_);
+    size_t count = _min<size_t>(budget, doomed_.size() - doomed_front_);
+    dooming_.assign(doomed_.begin() + doomed_front_,
+                    doomed_.begin() + doomed_front_ + count);
+    doomed_front_ += count;
+    if (doomed_front_ == doomed_.size()) {
+      doomed_.clear();
+      doomed_front_ = 0;
+    } else if (doomed_front_ > doomed_.size() / 2) {
+      // Disposals keep coming; drop what has been taken.
+      doomed_.erase(doomed_.begin(), doomed_.begin() + doomed_front_);
+      doomed_front_ = 0;
+    }
+    left = doomed_.size() - doomed_front_;
+    AtomicOps::ReleaseStore(&doomed_count_, static_cast<uint32>(left));
+  }
+  // A destructor may dispose of more, or take crit_.
+  for (size_t i = 0; i < dooming_.size(); ++i)
+    dooming_[i].deleter(dooming_[i].object);
+  dooming_.clear();
+  return left != 0;
+}
+
+bool MessageQueue::GetReady(Message *pmsg) {
+  if (fPeekKeep_) {
+    *pmsg = msgPeek_;
+    fPeekKeep_ = false;
+    return true;
+  }
+  CritScope cs(&crit_);
+  return PopReady(pmsg, Time());
+}
+
+bool MessageQueue::PopReady(Message *pmsg, uint32 msCurrent) {
+  ASSERT(crit_.CurrentThreadIsOwner());
+  while (true) {
+    int lane = NextLane();
+    if (lane < 0)
+      return false;
+    if (!msgq_[lane].empty()) {
+      *pmsg = msgq_[lane].front();
+      msgq_[lane].pop_front();
+    } else if (!postq_[lane].Pop(pmsg)) {
+      // A Post to this lane is still under way; it wakes us when done.
+      return false;
+    }
+    if (pmsg->ts_sensitive) {
+      long delay = TimeDiff(msCurrent, pmsg->ts_sensitive);
+      if (delay > 0) {
+        LOG_F(LS_WARNING) << "id: " << pmsg->message_id << "  delay: "
+                          << (delay + kMaxMsgLatency) << "ms";
+      }
+    }
+    if (MQID_DISPOSE == pmsg->message_id) {
+      ASSERT(NULL == pmsg->phandler);
+      delete pmsg->pdata;
+      continue;
+    }
+    return true;
+  }
+}
+
+int MessageQueue::NextLane() {
+  int lane = -1;
+  for (int i = 0; i < MQ_PRIORITY_COUNT; ++i) {
+    if (msgq_[i].empty() && postq_[i].empty())
+      continue;
+    // The most urgent lane with messages, unless a less urgent one has been
+    // passed over too often and no more urgent one has.
+    if (lane < 0 || (skipped_[i] >= kMaxLaneSkips &&
+                     skipped_[lane] < kMaxLaneSkips)) {
+      if (lane >= 0)
+        ++skipped_[lane];
+      lane = i;
+    } else {
+      ++skipped_[i];
+    }
+  }
+  if (lane >= 0)
+    skipped_[lane] = 0;
+  return lane;
+}
+
 void MessageQueue::ReceiveSends() {
 }
 
 void MessageQueue::Post(MessageHandler *phandler, uint32 id,
     MessageData *pdata, bool time_sensitive) {
+  Message msg;
+  msg.phandler = phandler;
+  msg.message_id = id;
+  msg.pdata = pdata;
+  DoPost(msg, time_sensitive ? MQ_PRIORITY_HIGH : MQ_PRIORITY_NORMAL,
+         time_sensitive);
+}
+
+void MessageQueue::PostWithPriority(MessagePriority priority,
+    MessageHandler *phandler, uint32 id, MessageData *pdata) {
+  Message msg;
+  msg.phandler = phandler;
+  msg.message_id = id;
+  msg.pdata = pdata;
+  DoPost(msg, priority, false);
+}
+
+void MessageQueue::DoPost(const Message& msg, MessagePriority priority,
+                          bool time_sensitive) {
+  ASSERT(priority >= 0 && priority < MQ_PRIORITY_COUNT);
   if (fStop_)
     return;
 
   // Keep thread safe
-  // Add the message to the end of the queue
+  // Add the message to the end of the lock-free queue
   // Signal for the multiplexer to return
 
-  CritScope cs(&crit_);
-  EnsureActive();
+  if (!active_) {
+    CritScope cs(&crit_);
+    EnsureActive();
+  }
+  if (time_sensitive || dispatch_stats()) {
+    Message stamped(msg);
+    if (time_sensitive)
+      stamped.ts_sensitive = CachedTime() + kMaxMsgLatency;
+    if (dispatch_stats())
+      stamped.ts_posted = static_cast<uint32>(TimeMicros());
+    postq_[priority].Push(stamped);
+  } else {
+    postq_[priority].Push(msg);
+  }
+  // After the push, so that a ResetHandlers racing with it either sees the
+  // message or is followed by this.
+  NoteHandler(msg.phandler);
+  LibraryMetrics::Add(LibraryMetrics::LM_MESSAGES_POSTED);
+  ss_->WakeUp();
+}
+
+void MessageQueue::DoDelayPost(int cmsDelay, uint32 tstamp,
+    MessageHandler *phandler, uint32 id, MessageData* pdata) {
   Message msg;
   msg.phandler = phandler;
   msg.message_id = id;
   msg.pdata = pdata;
-  if (time_sensitive) {
-    msg.ts_sensitive = Time() + kMaxMsgLatency;
-  }
-  msgq_.push_back(msg);
-  ss_->WakeUp();
+  DoDelayPost(cmsDelay, tstamp, msg);
 }
 
 void MessageQueue::DoDelayPost(int cmsDelay, uint32 tstamp,
-    MessageHandler *phandler, uint32 id, MessageData* pdata) {
+                               const Message& msg) {
   if (fStop_)
     return;
 
@@ -291,24 +939,146 @@ void MessageQueue::DoDelayPost(int cmsDelay, uint32 tstamp,
 
   CritScope cs(&crit_);
   EnsureActive();
-  Message msg;
-  msg.phandler = phandler;
-  msg.message_id = id;
-  msg.pdata = pdata;
-  DelayedMessage dmsg(cmsDelay, tstamp, dmsgq_next_num_, msg);
-  dmsgq_.push(dmsg);
+  NoteHandler(msg.phandler);
+  DelayedMessage dmsg(MakeDelayed(cmsDelay, tstamp, msg));
+  if (fTimerWheel_) {
+    dmsgw_.Push(Time(), dmsg);
+  } else {
+    dmsgq_.push(dmsg);
+  }
   // If this message queue processes 1 message every millisecond for 50 days,
   // we will wrap this number.  Even then, only messages with identical times
   // will be misordered, and then only briefly.  This is probably ok.
   VERIFY(0 != ++dmsgq_next_num_);
+  LibraryMetrics::Add(LibraryMetrics::LM_MESSAGES_POSTED);
   ss_->WakeUp();
 }
 
+DelayedMessage MessageQueue::MakeDelayed(int cmsDelay, uint32 tstamp,
+                                         const Message& msg) {
+  DelayedMessage dmsg(cmsDelay, tstamp, dmsgq_next_num_, msg);
+  if (dispatch_stats()) {
+    dmsg.msg_.ts_posted = static_cast<uint32>(TimeMicros()) +
+        static_cast<uint32>(_max(cmsDelay, 0)) * 1000;
+  }
+  return dmsg;
+}
+
+bool MessageQueue::Reschedule(int cmsDelay, MessageHandler *phandler,
+                              uint32 id, MessageData *pdata) {
+  ASSERT(id != MQID_ANY);
+  Message msg;
+  msg.phandler = phandler;
+  msg.message_id = id;
+  msg.pdata = pdata;
+  uint32 tstamp = CachedTimeAfter(cmsDelay);
+  if (MayHold(phandler)) {
+    CritScope cs(&crit_);
+    uint32 trigger;
+    if (!fStop_ &&
+        MoveDelayed(MakeDelayed(cmsDelay, tstamp, msg), &trigger)) {
+      VERIFY(0 != ++dmsgq_next_num_);
+      // A timer put off, as a debounce or idle timeout is, needs no wakeup;
+      // the wait only ends early.
+      if (TimeIsLater(trigger, tstamp))
+        ss_->WakeUp();
+      return true;
+    }
+    // It may have come due.
+    Clear(phandler, id);
+  }
+  DoDelayPost(cmsDelay, tstamp, msg);
+  return false;
+}
+
+bool MessageQueue::PostDelayedUnique(int cmsDelay, MessageHandler *phandler,
+                                     uint32 id, MessageData *pdata) {
+  ASSERT(id != MQID_ANY);
+  // Held across the post, so that of two racing, one posts.
+  CritScope cs(&crit_);
+  if (MayHold(phandler) && HasMessage(phandler, id)) {
+    delete pdata;
+    return false;
+  }
+  PostDelayed(cmsDelay, phandler, id, pdata);
+  return true;
+}
+
+bool MessageQueue::MoveDelayed(const DelayedMessage& dmsg, uint32* trigger) {
+  if (fTimerWheel_)
+    return dmsgw_.Reschedule(dmsg, trigger);
+
+  const Message& msg = dmsg.msg_;
+  PriorityQueue::container_type& heap = dmsgq_.container();
+  bool found = false;
+  PriorityQueue::container_type::iterator new_end = heap.begin();
+  for (PriorityQueue::container_type::iterator it = heap.begin();
+       it != heap.end(); ++it) {
+    if (it->msg_.Match(msg.phandler, msg.message_id)) {
+      if (!found) {
+        // The first in heap order rather than posting order.
+        found = true;
+        *trigger = it->msTrigger_;
+        if (it->msg_.pdata != msg.pdata)
+          delete it->msg_.pdata;
+        *new_end++ = dmsg;
+        continue;
+      }
+      delete it->msg_.pdata;
+    } else {
+      *new_end++ = *it;
+    }
+  }
+  if (!found)
+    return false;
+  heap.erase(new_end, heap.end());
+  dmsgq_.reheap();
+  return true;
+}
+
+bool MessageQueue::HasMessage(MessageHandler *phandler, uint32 id) {
+  if (fPeekKeep_ && msgPeek_.Match(phandler, id))
+    return true;
+  if (dmsgw_.Contains(phandler, id))
+    return true;
+  for (size_t i = 0; i < dmsgq_.container().size(); ++i) {
+    if (dmsgq_.container()[i].msg_.Match(phandler, id))
+      return true;
+  }
+  for (int i = 0; i < MQ_PRIORITY_COUNT; ++i) {
+    // Takes in what has been posted so far, as Clear does.
+    MessageList& msgq = msgq_[i];
+    Message msg;
+    while (postq_[i].Pop(&msg))
+      msgq.push_back(msg);
+    for (MessageList::iterator it = msgq.begin(); it != msgq.end(); ++it) {
+      if (it->Match(phandler, id))
+        return true;
+    }
+  }
+  return false;
+}
+
+uint32 MessageQueue::CoalesceTime(uint32 tstamp, int cmsSlack) {
+  if (cmsSlack <= 0)
+    return tstamp;
+  uint32 granularity = 1;
+  while (granularity <= static_cast<uint32>(cmsSlack) / 2)
+    granularity *= 2;
+  // Wraps like the clock does, which stays a multiple of |granularity|.
+  return (tstamp + granularity - 1) & ~(granularity - 1);
+}
+
 int MessageQueue::GetDelay() {
   CritScope cs(&crit_);
 
-  if (!msgq_.empty())
-    return 0;
+  for (int i = 0; i < MQ_PRIORITY_COUNT; ++i) {
+    if (!msgq_[i].empty() || !postq_[i].empty())
+      return 0;
+  }
+
+  if (fTimerWheel_)
+    return dmsgw_.GetDelay(Time());
 
   if (!dmsgq_.empty()) {
     int delay = TimeUntil(dmsgq_.top().msTrigger_);
@@ -335,21 +1105,31 @@ void MessageQueue::Clear(MessageHandler *phandler, uint32 id,
     fPeekKeep_ = false;
   }
 
-  // Remove from ordered message queue
+  // Remove from ordered message queue, taking in what has been posted so far
 
-  for (MessageList::iterator it = msgq_.begin(); it != msgq_.end();) {
-    if (it->Match(phandler, id)) {
-      if (removed) {
-        removed->push_back(*it);
+  for (int i = 0; i < MQ_PRIORITY_COUNT; ++i) {
+    MessageList& msgq = msgq_[i];
+    Message msg;
+    while (postq_[i].Pop(&msg))
+      msgq.push_back(msg);
+    for (MessageList::iterator it = msgq.begin(); it != msgq.end();) {
+      if (it->Match(phandler, id)) {
+        if (removed) {
+          removed->push_back(*it);
+        } else {
+          delete it->pdata;
+        }
+        it = msgq.erase(it);
       } else {
-        delete it->pdata;
+        ++it;
       }
-      it = msgq_.erase(it);
-    } else {
-      ++it;
     }
   }
 
+  // Remove from the timer wheel, which indexes its messages by handler
+
+  dmsgw_.Clear(phandler, id, removed);
+
   // Remove from priority queue. Not directly iterable, so use this approach
 
   PriorityQueue::container_type::iterator new_end = dmsgq_.container().begin();
@@ -369,8 +1149,95 @@ void MessageQueue::Clear(MessageHandler *phandler, uint32 id,
   dmsgq_.reheap();
 }
 
+bool MessageQueue::empty() const {
+  for (int i = 0; i < MQ_PRIORITY_COUNT; ++i) {
+    if (!msgq_[i].empty() || !postq_[i].empty())
+      return false;
+  }
+  return dmsgq_.empty() && dmsgw_.empty() && !fPeekKeep_ &&
+         AtomicOps::AcquireLoad(&doomed_count_) == 0;
+}
+
+void MessageQueue::ResetHandlers() {
+  ASSERT(crit_.CurrentThreadIsOwner());
+  if (!AtomicOps::AcquireLoad(&handlers_) || !empty() || HasPendingSends())
+    return;
+  AtomicOps::Exchange(&handlers_, 0);
+  // A Post may have pushed and noted its handler between the check and the
+  // reset.  Its push is visible now, so look again.
+  if (!empty())
+    AtomicOps::Exchange(&handlers_, ~static_cast<uint64>(0));
+}
+
+size_t MessageQueue::size() const {
+  size_t size = dmsgq_.size() + dmsgw_.size() + fPeekKeep_ +
+                AtomicOps::AcquireLoad(&doomed_count_);
+  for (int i = 0; i < MQ_PRIORITY_COUNT; ++i)
+    size += msgq_[i].size() + postq_[i].size();
+  return size;
+}
+
+void MessageQueue::UseTimerWheel(bool enable) {
+  CritScope cs(&crit_);
+  if (enable == fTimerWheel_)
+    return;
+  fTimerWheel_ = enable;
+  if (enable) {
+    // Pop in trigger order, so that equal trigger times keep their order.
+    uint32 now = Time();
+    while (!dmsgq_.empty()) {
+      dmsgw_.Push(now, dmsgq_.top());
+      dmsgq_.pop();
+    }
+  } else {
+    std::vector<DelayedMessage> dmsgs;
+    dmsgw_.Release(&dmsgs);
+    for (size_t i = 0; i < dmsgs.size(); ++i)
+      dmsgq_.push(dmsgs[i]);
+  }
+  ss_->WakeUp();
+}
+
 void MessageQueue::Dispatch(Message *pmsg) {
-  pmsg->phandler->OnMessage(pmsg);
+  LibraryMetrics::Add(LibraryMetrics::LM_MESSAGES_DISPATCHED);
+  DispatchStats* stats = dispatch_stats();
+  StallDetector* detector = stall_detector();
+  if (!stats) {
+    MessageHandler* handler = pmsg->phandler;
+    uint32 id = pmsg->message_id;
+    TXMPP_TRACE2(message_dispatch_start, handler, id);
+    if (detector) {
+      detector->Begin(StallDetector::SK_MESSAGE, typeid(*handler).name(),
+                      id);
+    }
+    handler->OnMessage(pmsg);
+    if (detector)
+      detector->End();
+    TXMPP_TRACE2(message_dispatch_end, handler, id);
+    return;
+  }
+  // Taken first, as the handler may delete itself.
+  const char* type = typeid(*pmsg->phandler).name();
+  uint32 id = pmsg->message_id;
+  uint32 depth = 0;
+  for (int i = 0; i < MQ_PRIORITY_COUNT; ++i)
+    depth += postq_[i].size();
+  uint32 start = static_cast<uint32>(TimeMicros());
+  int32 latency = -1;
+  if (pmsg->ts_posted) {
+    // A delayed message dispatched a little before its due time is on time.
+    latency = _max(static_cast<int32>(start - pmsg->ts_posted), 0);
+  }
+  MessageHandler* handler = pmsg->phandler;
+  TXMPP_TRACE2(message_dispatch_start, handler, id);
+  if (detector)
+    detector->Begin(StallDetector::SK_MESSAGE, type, id);
+  handler->OnMessage(pmsg);
+  if (detector)
+    detector->End();
+  TXMPP_TRACE2(message_dispatch_end, handler, id);
+  uint32 run = static_cast<uint32>(TimeMicros()) - start;
+  stats->Record(type, id, depth, latency, run);
 }
 
 void MessageQueue::EnsureActive() {
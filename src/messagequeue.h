@@ -35,11 +35,15 @@
 #include <algorithm>
 #include <cstring>
 #include <list>
+#include <map>
 #include <queue>
 #include <vector>
 
 #include "basictypes.h"
+#include "blockpool.h"
+#include "constructormagic.h"
 #include "criticalsection.h"
+#include "dispatchstats.h"
 #include "messagehandler.h"
 #include "scoped_ptr.h"
 #include "sigslot.h"
@@ -50,6 +54,7 @@ namespace txmpp {
 
 struct Message;
 class MessageQueue;
+class StallDetector;
 
 // MessageQueueManager does cleanup of of message queues
 
@@ -59,25 +64,38 @@ class MessageQueueManager {
 
   void Add(MessageQueue *message_queue);
   void Remove(MessageQueue *message_queue);
+  // Clears |handler| from every queue that may have messages for it.
   void Clear(MessageHandler *handler);
 
  private:
   MessageQueueManager();
   ~MessageQueueManager();
 
-  static MessageQueueManager* instance_;
-  // This list contains 'active' MessageQueues.
-  std::vector<MessageQueue *> message_queues_;
-  CriticalSection crit_;
+  // Queues are spread over shards by address, so that threads coming and
+  // going seldom wait on each other.
+  enum { kShards = 16 };
+  struct Shard {
+    CriticalSection crit;
+    // This list contains 'active' MessageQueues.
+    std::vector<MessageQueue *> message_queues;
+  };
+  Shard* ShardOf(MessageQueue *message_queue);
+
+  Shard shards_[kShards];
 };
 
 // Derive from this for specialized data
 // App manages lifetime, except when messages are purged
+// Nearly every message with data creates and deletes one, so small ones are
+// allocated from pools rather than the heap.
 
 class MessageData {
  public:
   MessageData() {}
   virtual ~MessageData() {}
+
+  static void* operator new(size_t size);
+  static void operator delete(void* p, size_t size);
 };
 
 template <class T>
@@ -123,6 +141,19 @@ class DisposeData : public MessageData {
 const uint32 MQID_ANY = static_cast<uint32>(-1);
 const uint32 MQID_DISPOSE = static_cast<uint32>(-2);
 
+// Lanes for posted messages.  A queue delivers ready messages from the most
+// urgent lane that has any, except that a lane passed over too many times in
+// a row gets the next turn, so that no lane starves.  Triggered delayed
+// messages go to the normal lane.
+enum MessagePriority {
+  MQ_PRIORITY_HIGH,  // Latency-critical work, such as IQ responses.
+  MQ_PRIORITY_NORMAL,
+  MQ_PRIORITY_BACKGROUND,  // Bulk work, such as cache writes and log flushes.
+  MQ_PRIORITY_COUNT
+};
+
+const size_t kMessageValueSize = 16;
+
 // No destructor
 
 struct Message {
@@ -137,8 +168,32 @@ struct Message {
   uint32 message_id;
   MessageData *pdata;
   uint32 ts_sensitive;
+  // TimeMicros() when posted or due, set while DispatchStats are enabled.
+  uint32 ts_posted;
+  // A small payload carried in the message itself; see SetMessageValue.
+  union {
+    char data[kMessageValueSize];
+    uint64 align;
+  } value;
 };
 
+// Stores |value| in |msg|, so that it can be posted without allocating a
+// MessageData.  T must be at most kMessageValueSize bytes and safe to copy
+// with memcpy (integers, enums, pointers, and plain structs of them), as it
+// is never constructed or destroyed in the message.
+template<class T>
+inline void SetMessageValue(Message* msg, const T& value) {
+  COMPILE_ASSERT(sizeof(T) <= kMessageValueSize, message_value_too_large);
+  memcpy(msg->value.data, &value, sizeof(T));
+}
+
+template<class T>
+inline T UseMessageValue(const Message* msg) {
+  T value;
+  memcpy(&value, msg->value.data, sizeof(T));
+  return value;
+}
+
 typedef std::list<Message> MessageList;
 
 // DelayedMessage goes into a priority queue, sorted by trigger time.  Messages
@@ -160,6 +215,128 @@ class DelayedMessage {
   Message msg_;
 };
 
+// TimerWheel holds delayed messages in a hierarchical timing wheel, by
+// default in place of the priority queue.  Messages sit in buckets that widen with
+// distance (1 ms for the next 256 ms, 256 ms for the next 16 s, and so on)
+// and move down a level when their bucket comes due, so posting a message
+// costs O(1) however many are pending.  Pending messages are also indexed by
+// handler, which makes clearing a handler's messages cost O(its messages).
+// Messages with the same trigger time are delivered in the order they were
+// posted.  Not thread safe; MessageQueue guards it with its lock.
+
+class TimerWheel {
+ public:
+  TimerWheel();
+  ~TimerWheel();
+
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+
+  // |now| is the current Time().
+  void Push(uint32 now, const DelayedMessage& dmsg);
+
+  // Appends the messages triggered at or before |now| to |msgs| in trigger
+  // order, and returns GetDelay(now).
+  int PopTriggered(uint32 now, MessageList* msgs);
+
+  // Milliseconds from |now| until the next message may trigger, or kForever.
+  // May be early by up to a bucket's width, but never late.
+  int GetDelay(uint32 now) const;
+
+  void Clear(MessageHandler* phandler, uint32 id, MessageList* removed);
+
+  // Moves the first message pending for |dmsg|'s handler and id to |dmsg|'s
+  // trigger time in place, giving it |dmsg|'s data and deleting its own,
+  // and clears any others for them.  Sets |trigger| to the time it had.
+  // Returns false, doing nothing, if there is none.
+  bool Reschedule(const DelayedMessage& dmsg, uint32* trigger);
+  // True if a message for |phandler| and |id| is pending.
+  bool Contains(MessageHandler* phandler, uint32 id) const;
+
+  // Removes every message and appends it to |dmsgs|, in no particular order.
+  void Release(std::vector<DelayedMessage>* dmsgs);
+
+ private:
+  struct Node;
+  struct List {
+    List() : head(NULL), tail(NULL) {}
+    Node* head;
+    Node* tail;
+  };
+  typedef std::map<MessageHandler*, List> HandlerMap;
+
+  // 256 one-tick buckets, then four levels of 64.
+  static const int kSlotCount = 512;
+
+  // The first message pending for |phandler| and |id|, or NULL.
+  Node* Find(MessageHandler* phandler, uint32 id) const;
+  // Puts |node| where its trigger time falls.
+  void Schedule(Node* node);
+  void Place(Node* node);
+  void Cascade();
+  void SetTick(uint64 tick);
+  void Fire(List* list, MessageList* msgs);
+  bool NextEvent(uint64* tick) const;
+  int FindSlot(int from, int end) const;
+  void Append(List* list, Node* node);
+  void InsertAfter(List* list, Node* prev, Node* node);
+  void Unlink(Node* node);
+  void Link(Node* node);
+  void Unindex(Node* node);
+  List Detach(List* list);
+  void Delete(Node* node);
+
+  // Every message triggering before tick_ has been popped; tick_ corresponds
+  // to time_ on the Time() clock.
+  uint64 tick_;
+  uint32 time_;
+  size_t size_;
+  List slots_[kSlotCount];
+  uint32 bits_[kSlotCount / 32];  // Non-empty slots_.
+  List due_;  // Already due when pushed.
+  List overflow_;  // Beyond the top level.
+  HandlerMap handlers_;
+  BlockPool nodes_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(TimerWheel);
+};
+
+// PostQueue is the lock-free queue MessageQueue::Post appends to.  Any number
+// of threads may Push concurrently, but calls to Pop must be serialized by
+// the caller.  Nodes are intrusive and recycled through a BlockPool, so once
+// the queue has warmed up a Push neither locks nor allocates.
+
+class PostQueue {
+ public:
+  PostQueue();
+  ~PostQueue();
+
+  bool empty() const { return size() == 0; }
+  size_t size() const {
+    return static_cast<size_t>(AtomicOps::AcquireLoad(&size_));
+  }
+
+  void Push(const Message& msg);
+
+  // Returns false if the queue is empty.  A message whose Push has not
+  // returned yet may be missed; the pusher wakes the consumer afterwards.
+  bool Pop(Message* msg);
+
+ private:
+  struct Node {
+    Message msg;
+    Node* volatile next;
+  };
+
+  Node* volatile tail_;  // Last pushed, swapped in by producers.
+  Node* head_;  // Consumer side.
+  Node stub_;
+  volatile int size_;
+  BlockPool nodes_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(PostQueue);
+};
+
 class MessageQueue {
  public:
   explicit MessageQueue(SocketServer* ss = NULL);
@@ -185,16 +362,74 @@ class MessageQueue {
   virtual bool Get(Message *pmsg, int cmsWait = kForever,
                    bool process_io = true);
   virtual bool Peek(Message *pmsg, int cmsWait = 0);
+  // Returns a message that is already ready, without the checks of delayed
+  // messages, sends and I/O that Get makes first, or false if there is none.
+  // Lets a caller dispatch several messages per call to Get.
+  bool GetReady(Message *pmsg);
+  // Time sensitive messages are posted with high priority, and a warning is
+  // logged if they still wait more than 150 ms.
   virtual void Post(MessageHandler *phandler, uint32 id = 0,
                     MessageData *pdata = NULL, bool time_sensitive = false);
+  void PostWithPriority(MessagePriority priority, MessageHandler *phandler,
+                        uint32 id = 0, MessageData *pdata = NULL);
   virtual void PostDelayed(int cmsDelay, MessageHandler *phandler,
                            uint32 id = 0, MessageData *pdata = NULL) {
-    return DoDelayPost(cmsDelay, TimeAfter(cmsDelay), phandler, id, pdata);
+    return DoDelayPost(cmsDelay, CachedTimeAfter(cmsDelay), phandler, id, pdata);
   }
   virtual void PostAt(uint32 tstamp, MessageHandler *phandler,
                       uint32 id = 0, MessageData *pdata = NULL) {
-    return DoDelayPost(TimeUntil(tstamp), tstamp, phandler, id, pdata);
+    return DoDelayPost(TimeDiff(tstamp, CachedTime()), tstamp, phandler, id,
+                       pdata);
+  }
+  // Like PostDelayed and PostAt, but the message may be delivered up to
+  // |cmsSlack| milliseconds late.  Due times are rounded up to a multiple of
+  // the largest power of two within the slack, so that timers due at nearly
+  // the same time, on any thread, fire in one wakeup.
+  void PostDelayed(int cmsDelay, MessageHandler *phandler, uint32 id,
+                   MessageData *pdata, int cmsSlack) {
+    PostAt(CachedTimeAfter(cmsDelay), phandler, id, pdata, cmsSlack);
+  }
+  void PostAt(uint32 tstamp, MessageHandler *phandler, uint32 id,
+              MessageData *pdata, int cmsSlack) {
+    tstamp = CoalesceTime(tstamp, cmsSlack);
+    return DoDelayPost(TimeDiff(tstamp, CachedTime()), tstamp, phandler, id,
+                       pdata);
   }
+  // Like Post and PostDelayed, but with |value| stored in the message (see
+  // SetMessageValue) instead of a MessageData, so that nothing is allocated.
+  template<class T>
+  void PostValue(MessageHandler *phandler, uint32 id, const T& value,
+                 bool time_sensitive = false) {
+    Message msg;
+    msg.phandler = phandler;
+    msg.message_id = id;
+    SetMessageValue(&msg, value);
+    DoPost(msg, time_sensitive ? MQ_PRIORITY_HIGH : MQ_PRIORITY_NORMAL,
+           time_sensitive);
+  }
+  template<class T>
+  void PostDelayedValue(int cmsDelay, MessageHandler *phandler, uint32 id,
+                        const T& value) {
+    Message msg;
+    msg.phandler = phandler;
+    msg.message_id = id;
+    SetMessageValue(&msg, value);
+    DoDelayPost(cmsDelay, CachedTimeAfter(cmsDelay), msg);
+  }
+  // Re-arms a timer: moves the delayed message pending for |phandler| and
+  // |id| in place to trigger |cmsDelay| from now with |pdata|, deleting its
+  // old data, and returns true.  If none is pending, clears any that has
+  // come due and posts |pdata| as PostDelayed, returning false.  Either way
+  // it does what Clear(phandler, id) and PostDelayed would, without the
+  // scan of the ready messages or a new heap entry when the timer is still
+  // pending.  |id| may not be MQID_ANY.
+  bool Reschedule(int cmsDelay, MessageHandler *phandler, uint32 id,
+                  MessageData *pdata = NULL);
+  // Posts as PostDelayed unless a message for |phandler| and |id| is
+  // already pending or due, in which case |pdata| is deleted.  Returns true
+  // if it was posted.  |id| may not be MQID_ANY.
+  bool PostDelayedUnique(int cmsDelay, MessageHandler *phandler, uint32 id,
+                         MessageData *pdata = NULL);
   virtual void Clear(MessageHandler *phandler, uint32 id = MQID_ANY,
                      MessageList* removed = NULL);
   virtual void Dispatch(Message *pmsg);
@@ -203,16 +438,56 @@ class MessageQueue {
   // Amount of time until the next message can be retrieved
   virtual int GetDelay();
 
-  bool empty() const { return msgq_.empty() && dmsgq_.empty() && !fPeekKeep_; }
-  size_t size() const { return msgq_.size() + dmsgq_.size() + fPeekKeep_; }
+  // Delayed messages are kept in a TimerWheel, which finds a handler's
+  // messages for Clear without scanning the others.  Passing false keeps
+  // them in a priority queue instead.  Messages already pending are moved
+  // over.
+  void UseTimerWheel(bool enable);
+
+  bool empty() const;
+  size_t size() const;
 
-  // Internally posts a message which causes the doomed object to be deleted
+  // Records every Dispatch in |stats|, which must outlive the queue or be
+  // replaced first.  NULL, the default, turns recording off.  Messages
+  // posted while it is off are recorded without their latency.
+  void SetDispatchStats(DispatchStats* stats) {
+    AtomicOps::ReleaseStorePtr(&stats_, stats);
+  }
+  DispatchStats* dispatch_stats() const {
+    return AtomicOps::AcquireLoadPtr(&stats_);
+  }
+
+  // Watches the dispatches of the thread that runs the queue with
+  // |detector|, which must outlive the queue, or any dispatch running when
+  // it is replaced.  NULL, the default, turns watching off.
+  void SetStallDetector(StallDetector* detector) {
+    AtomicOps::ReleaseStorePtr(&stall_detector_, detector);
+  }
+  StallDetector* stall_detector() const {
+    return AtomicOps::AcquireLoadPtr(&stall_detector_);
+  }
+
+  // False if the queue certainly has no message for |phandler|, true if it
+  // may.  Lets MessageQueueManager skip most queues when a handler goes away.
+  bool MayHold(MessageHandler *phandler) const {
+    return !phandler ||
+        (AtomicOps::AcquireLoad(&handlers_) & HandlerBit(phandler)) != 0;
+  }
+
+  // Deletes the doomed object on the queue's thread, at the start of the
+  // next pass of Get, once the dispatch running now has returned.  Objects
+  // go on a list of the queue's that is emptied up to kDisposeBatch at a
+  // time, so that disposing of many costs neither a message nor an
+  // allocation each, nor one long stall.
   template<class T> void Dispose(T* doomed) {
-    if (doomed) {
-      Post(NULL, MQID_DISPOSE, new DisposeData<T>(doomed));
-    }
+    if (doomed)
+      DoDispose(doomed, &DeleteDoomed<T>);
   }
 
+  // The most objects deleted in a pass of Get.  The rest wait for the next
+  // pass, which doesn't wait for I/O.
+  static const size_t kDisposeBatch = 256;
+
   // When this signal is sent out, any references to this queue should
   // no longer be used.
   txmpp::signal0<> SignalQueueDestroyed;
@@ -224,9 +499,51 @@ class MessageQueue {
     void reheap() { make_heap(c.begin(), c.end(), comp); }
   };
 
+  typedef void (*Deleter)(void* doomed);
+  struct Doomed {
+    void* object;
+    Deleter deleter;
+  };
+  template<class T> static void DeleteDoomed(void* doomed) {
+    delete static_cast<T*>(doomed);
+  }
+  void DoDispose(void* doomed, Deleter deleter);
+  // Deletes up to |budget| of the disposed objects, outside crit_, and
+  // returns true if more are left.
+  bool DeleteDisposed(size_t budget);
+
   void EnsureActive();
+  // Rounds |tstamp| up for PostAt with |cmsSlack|.
+  static uint32 CoalesceTime(uint32 tstamp, int cmsSlack);
+  static uint64 HandlerBit(MessageHandler *phandler) {
+    uint64 h = (reinterpret_cast<size_t>(phandler) >> 4) *
+        UINT64_C(0x9E3779B97F4A7C15);
+    return static_cast<uint64>(1) << (h >> 58);
+  }
+  // Called after a message for |phandler| is queued, for MayHold.
+  void NoteHandler(MessageHandler *phandler) {
+    uint64 bit = HandlerBit(phandler);
+    if (!(AtomicOps::AcquireLoad(&handlers_) & bit))
+      AtomicOps::Or(&handlers_, bit);
+  }
+  // Forgets the handlers noted so far if nothing is queued.  Requires crit_.
+  void ResetHandlers();
+  // True if a Send is waiting to be received.  Requires crit_.
+  virtual bool HasPendingSends() { return false; }
+  // Takes the next ready message. Requires crit_.
+  bool PopReady(Message *pmsg, uint32 msCurrent);
+  // The lane PopReady takes from next, or -1 if none has messages.
+  int NextLane();
+  void DoPost(const Message& msg, MessagePriority priority,
+              bool time_sensitive);
   void DoDelayPost(int cmsDelay, uint32 tstamp, MessageHandler *phandler,
                    uint32 id, MessageData* pdata);
+  void DoDelayPost(int cmsDelay, uint32 tstamp, const Message& msg);
+  DelayedMessage MakeDelayed(int cmsDelay, uint32 tstamp, const Message& msg);
+  // Moves a pending delayed message for Reschedule.  Requires crit_.
+  bool MoveDelayed(const DelayedMessage& dmsg, uint32* trigger);
+  // True if a message for |phandler| and |id| is queued.  Requires crit_.
+  bool HasMessage(MessageHandler *phandler, uint32 id);
 
   // The SocketServer is not owned by MessageQueue.
   SocketServer* ss_;
@@ -238,9 +555,34 @@ class MessageQueue {
   // A message queue is active if it has ever had a message posted to it.
   // This also corresponds to being in MessageQueueManager's global list.
   bool active_;
-  MessageList msgq_;
+  // Index in the MessageQueueManager shard, while active.
+  size_t manager_index_;
+  friend class MessageQueueManager;
+  DispatchStats* volatile stats_;
+  StallDetector* volatile stall_detector_;
+  // A bloom filter of the handlers that may have messages queued: one bit
+  // per HandlerBit, cleared only when the queue is found empty.
+  volatile uint64 handlers_;
+  // Ready messages, per MessagePriority lane.  Post appends to postq_
+  // without taking crit_; msgq_ holds triggered delayed messages, and
+  // postq_'s contents while Clear runs, and is delivered first.  Get moves
+  // postq_ into msgq_ ahead of the triggered messages, so that they keep
+  // their place after what was posted before them.
+  MessageList msgq_[MQ_PRIORITY_COUNT];
+  PostQueue postq_[MQ_PRIORITY_COUNT];
+  // Turns each lane has been passed over while it had messages.
+  int skipped_[MQ_PRIORITY_COUNT];
   PriorityQueue dmsgq_;
+  TimerWheel dmsgw_;
+  bool fTimerWheel_;
   uint32 dmsgq_next_num_;
+  // Objects disposed of, oldest first from doomed_front_, and their count,
+  // which is read without crit_.  dooming_ holds those being deleted, and
+  // is only used on the queue's thread.
+  std::vector<Doomed> doomed_;
+  size_t doomed_front_;
+  volatile uint32 doomed_count_;
+  std::vector<Doomed> dooming_;
   CriticalSection crit_;
 };
 
@@ -0,0 +1,258 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "metrics.h"
+
+#ifdef POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif  // POSIX
+#include <string.h>
+
+#include "common.h"
+#include "logging.h"
+
+namespace txmpp {
+
+//------------------------------------------------------------------
+// MetricsRegistry
+
+MetricsRegistry::MetricsRegistry() : header_(NULL), size_(0) {
+}
+
+MetricsRegistry::~MetricsRegistry() {
+  if (!header_)
+    return;
+#ifdef POSIX
+  if (!shm_name_.empty()) {
+    munmap(header_, size_);
+    shm_unlink(shm_name_.c_str());
+    return;
+  }
+#endif  // POSIX
+  delete [] reinterpret_cast<uint64*>(header_);
+}
+
+bool MetricsRegistry::Init(size_t capacity, const std::string& shm_name) {
+  if (header_ || capacity == 0)
+    return false;
+  size_t size = sizeof(Header) + capacity * sizeof(Slot);
+
+  void* memory = NULL;
+  if (shm_name.empty()) {
+    // Zeroed, as a new shared memory object is.
+    uint64* words = new uint64[(size + 7) / 8];
+    memset(words, 0, size);
+    memory = words;
+  } else {
+#ifdef POSIX
+    int fd = shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      LOG_ERR(LS_ERROR) << "shm_open of " << shm_name << " failed";
+      return false;
+    }
+    if (ftruncate(fd, size) == 0)
+      memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (!memory || memory == MAP_FAILED) {
+      LOG_ERR(LS_ERROR) << "Mapping " << shm_name << " failed";
+      shm_unlink(shm_name.c_str());
+      return false;
+    }
+    shm_name_ = shm_name;
+#else  // !POSIX
+    return false;
+#endif  // !POSIX
+  }
+
+  CritScope cs(&crit_);
+  header_ = static_cast<Header*>(memory);
+  size_ = size;
+  header_->magic = kMagic;
+  header_->version = kVersion;
+  header_->capacity = static_cast<uint32>(capacity);
+  return true;
+}
+
+MetricsRegistry::Slot* MetricsRegistry::Register(const std::string& name,
+                                                 Kind kind) {
+  if (name.empty() || name.size() >= kNameSize || kind == KIND_NONE)
+    return NULL;
+
+  CritScope cs(&crit_);
+  if (!header_)
+    return NULL;
+  Slot* slots = this->slots();
+  uint32 count = header_->count;
+  for (uint32 i = 0; i < count; ++i) {
+    if (name == slots[i].name)
+      return slots[i].kind == static_cast<uint32>(kind) ? &slots[i] : NULL;
+  }
+  if (count == header_->capacity)
+    return NULL;
+
+  Slot* slot = &slots[count];
+  memcpy(slot->name, name.data(), name.size());
+  slot->name[name.size()] = '\0';
+  AtomicOps::ReleaseStore(&slot->kind, kind);
+  AtomicOps::ReleaseStore(&header_->count, count + 1);
+  return slot;
+}
+
+void MetricsRegistry::Record(Slot* slot, uint32 value) {
+  int bucket = 0;
+  for (uint32 v = value; v; v >>= 1)
+    ++bucket;
+  AtomicOps::Increment(&slot->buckets[bucket]);
+  AtomicOps::Add(&slot->value, 1);
+  AtomicOps::Add(&slot->sum, value);
+  uint64 max = AtomicOps::AcquireLoad(&slot->max);
+  while (value > max && !AtomicOps::CompareAndSwap(&slot->max, max, value))
+    max = AtomicOps::AcquireLoad(&slot->max);
+}
+
+void MetricsRegistry::GetSamples(std::vector<Sample>* samples) const {
+  CritScope cs(&crit_);
+  if (header_) {
+    ReadSamples(header_, size_, samples);
+  } else {
+    samples->clear();
+  }
+}
+
+bool MetricsRegistry::ReadSamples(const void* memory, size_t size,
+                                  std::vector<Sample>* samples) {
+  samples->clear();
+  const Header* header = static_cast<const Header*>(memory);
+  if (size < sizeof(Header) || header->magic != kMagic ||
+      header->version != kVersion ||
+      size < sizeof(Header) + header->capacity * sizeof(Slot))
+    return false;
+
+  const Slot* slots = reinterpret_cast<const Slot*>(header + 1);
+  uint32 count = _min(AtomicOps::AcquireLoad(&header->count),
+                      header->capacity);
+  for (uint32 i = 0; i < count; ++i) {
+    const Slot& slot = slots[i];
+    Kind kind = static_cast<Kind>(AtomicOps::AcquireLoad(&slot.kind));
+    if (kind == KIND_NONE || kind > KIND_HISTOGRAM)
+      continue;
+    samples->push_back(Sample());
+    Sample& sample = samples->back();
+    sample.name.assign(slot.name, strnlen(slot.name, kNameSize));
+    sample.kind = kind;
+    sample.value = static_cast<int64>(AtomicOps::AcquireLoad(&slot.value));
+    memset(&sample.histogram, 0, sizeof(sample.histogram));
+    if (kind != KIND_HISTOGRAM)
+      continue;
+    Histogram::Snapshot& histogram = sample.histogram;
+    histogram.count = static_cast<uint32>(sample.value);
+    histogram.sum = AtomicOps::AcquireLoad(&slot.sum);
+    histogram.max = static_cast<uint32>(AtomicOps::AcquireLoad(&slot.max));
+    for (int b = 0; b < kBuckets; ++b)
+      histogram.buckets[b] = AtomicOps::AcquireLoad(&slot.buckets[b]);
+  }
+  return true;
+}
+
+bool MetricsRegistry::ReadShared(const std::string& shm_name,
+                                 std::vector<Sample>* samples) {
+  samples->clear();
+#ifdef POSIX
+  int fd = shm_open(shm_name.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void* memory = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    memory = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED)
+    return false;
+  bool result = ReadSamples(memory, st.st_size, samples);
+  munmap(memory, st.st_size);
+  return result;
+#else  // !POSIX
+  return false;
+#endif  // !POSIX
+}
+
+//------------------------------------------------------------------
+// LibraryMetrics
+
+MetricsRegistry::Slot* volatile LibraryMetrics::slots_[LM_COUNT];
+
+bool LibraryMetrics::SetRegistry(MetricsRegistry* registry) {
+  bool result = true;
+  for (int i = 0; i < LM_COUNT; ++i) {
+    Metric metric = static_cast<Metric>(i);
+    MetricsRegistry::Slot* slot = NULL;
+    if (registry) {
+      slot = registry->Register(Name(metric), KindOf(metric));
+      if (!slot)
+        result = false;
+    }
+    AtomicOps::ReleaseStorePtr(&slots_[i], slot);
+  }
+  return result;
+}
+
+const char* LibraryMetrics::Name(Metric metric) {
+  switch (metric) {
+    case LM_SOCKET_EVENTS: return "txmpp.socket.events";
+    case LM_SOCKET_EVENT_US: return "txmpp.socket.event_us";
+    case LM_MESSAGES_POSTED: return "txmpp.queue.posted";
+    case LM_MESSAGES_DISPATCHED: return "txmpp.queue.dispatched";
+    case LM_XMPP_ENGINES: return "txmpp.xmpp.engines";
+    case LM_XMPP_STANZAS_IN: return "txmpp.xmpp.stanzas_in";
+    case LM_XMPP_STANZAS_OUT: return "txmpp.xmpp.stanzas_out";
+    case LM_XMPP_PRESENCE_COALESCED:
+      return "txmpp.xmpp.presence_coalesced";
+    case LM_TLS_FULL_HANDSHAKES: return "txmpp.tls.full_handshakes";
+    case LM_TLS_RESUMED_HANDSHAKES: return "txmpp.tls.resumed_handshakes";
+    case LM_HTTP_POOL_HITS: return "txmpp.http_pool.hits";
+    case LM_HTTP_POOL_MISSES: return "txmpp.http_pool.misses";
+    case LM_STALLS: return "txmpp.thread.stalls";
+    case LM_STALL_US: return "txmpp.thread.stall_us";
+    default: return "unknown";
+  }
+}
+
+MetricsRegistry::Kind LibraryMetrics::KindOf(Metric metric) {
+  switch (metric) {
+    case LM_SOCKET_EVENT_US:
+    case LM_STALL_US:
+      return MetricsRegistry::KIND_HISTOGRAM;
+    case LM_XMPP_ENGINES: return MetricsRegistry::KIND_GAUGE;
+    default: return MetricsRegistry::KIND_COUNTER;
+  }
+}
+
+}  // namespace txmpp
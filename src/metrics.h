@@ -0,0 +1,198 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_METRICS_H_
+#define _TXMPP_METRICS_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "criticalsection.h"
+#include "dispatchstats.h"
+
+namespace txmpp {
+
+// Counters, gauges and histograms by name, in one block of memory that can
+// be a POSIX shared memory object, so that an agent in another process can
+// map it and read them live, at no cost to the threads updating them.
+// Registering a metric takes a lock; updating one is an atomic add on its
+// slot, from any thread, without one.
+class MetricsRegistry {
+ public:
+  enum Kind {
+    KIND_NONE,
+    KIND_COUNTER,    // Only goes up.
+    KIND_GAUGE,      // Goes up and down, or is set.
+    KIND_HISTOGRAM,  // Values in power-of-two buckets, as Histogram has.
+  };
+
+  enum { kNameSize = 64, kBuckets = Histogram::kBuckets };
+  static const uint32 kMagic = 0x4d584d54;  // "TMXM" in little endian.
+  static const uint32 kVersion = 1;
+  static const size_t kDefaultCapacity = 256;
+
+  // The memory is a Header followed by |capacity| Slots, in the host's byte
+  // order.  A slot's name is written before its kind, and the kind before
+  // the header's count takes the slot in, each with a release store, so a
+  // reader that loads the count and then the kinds with acquire loads sees
+  // whole names.
+  struct Header {
+    uint32 magic;
+    uint32 version;
+    uint32 capacity;
+    volatile uint32 count;
+  };
+
+  struct Slot {
+    char name[kNameSize];
+    volatile uint32 kind;
+    uint32 reserved;
+    // A counter's or gauge's value, two's complement for a negative gauge,
+    // or the number of values in a histogram.
+    volatile uint64 value;
+    // A histogram's sum and maximum, and its buckets: bucket 0 holds 0, and
+    // bucket i holds [2^(i-1), 2^i).
+    volatile uint64 sum;
+    volatile uint64 max;
+    volatile int buckets[kBuckets];
+  };
+
+  struct Sample {
+    std::string name;
+    Kind kind;
+    int64 value;
+    Histogram::Snapshot histogram;
+  };
+
+  MetricsRegistry();
+  ~MetricsRegistry();
+
+  // Makes room for |capacity| metrics, on the heap, or if |shm_name| is not
+  // empty, in the POSIX shared memory object of that name, such as
+  // "/myapp-metrics", made afresh and unlinked by the destructor.  Returns
+  // false if it can't, or was already called.
+  bool Init(size_t capacity = kDefaultCapacity,
+            const std::string& shm_name = std::string());
+
+  // The metric named |name|, registered as |kind| if it is new.  NULL before
+  // Init, once the registry is full, if |name| is too long, or if it was
+  // registered as another kind.
+  Slot* Register(const std::string& name, Kind kind);
+
+  static void Add(Slot* slot, int64 delta) {
+    AtomicOps::Add(&slot->value, static_cast<uint64>(delta));
+  }
+  static void Set(Slot* slot, int64 value) {
+    AtomicOps::Exchange(&slot->value, static_cast<uint64>(value));
+  }
+  static void Record(Slot* slot, uint32 value);
+
+  // The metrics registered so far, with their values now.
+  void GetSamples(std::vector<Sample>* samples) const;
+  // Reads the samples from the |size| bytes of a registry's memory at
+  // |memory|.  Returns false if it isn't one.
+  static bool ReadSamples(const void* memory, size_t size,
+                          std::vector<Sample>* samples);
+  // Reads the samples of the registry in the shared memory object named
+  // |shm_name|, as an agent does.  Returns false if it can't.
+  static bool ReadShared(const std::string& shm_name,
+                         std::vector<Sample>* samples);
+
+ private:
+  Slot* slots() const {
+    return reinterpret_cast<Slot*>(header_ + 1);
+  }
+
+  mutable CriticalSection crit_;
+  Header* header_;
+  size_t size_;
+  std::string shm_name_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(MetricsRegistry);
+};
+
+// The library's own metrics, registered in the MetricsRegistry given to
+// SetRegistry.  Until then, and after it is set to NULL, each hook is a
+// load and a branch.  Counts start from when it is set, so a gauge may go
+// below what it measures.
+class LibraryMetrics {
+ public:
+  enum Metric {
+    LM_SOCKET_EVENTS,           // Socket events PhysicalSocketServer ran.
+    LM_SOCKET_EVENT_US,         // Their handlers' microseconds, with
+                                // SOCKETSERVER_TELEMETRY.
+    LM_MESSAGES_POSTED,         // Messages posted to MessageQueues,
+                                // delayed or not.
+    LM_MESSAGES_DISPATCHED,     // Messages dispatched by them.
+    LM_XMPP_ENGINES,            // XmppEngineImpls in existence.
+    LM_XMPP_STANZAS_IN,         // Stanzas the engines handled,
+    LM_XMPP_STANZAS_OUT,        // and sent, once their sessions were open.
+    LM_XMPP_PRESENCE_COALESCED, // Presence replaced by a later one.
+    LM_TLS_FULL_HANDSHAKES,     // TLS client handshakes through
+    LM_TLS_RESUMED_HANDSHAKES,  // OpenSSLSessionCache.
+    LM_HTTP_POOL_HITS,          // Requests a ConnectionPool gave an idle
+    LM_HTTP_POOL_MISSES,        // stream, and a new one.
+    LM_STALLS,                  // Dispatches StallDetectors reported,
+    LM_STALL_US,                // and how long they had run when found.
+    LM_COUNT
+  };
+
+  // Registers the metrics in |registry|, which must outlive their use, and
+  // starts counting.  NULL stops.  Returns false if any of them couldn't be
+  // registered; the rest are counted.
+  static bool SetRegistry(MetricsRegistry* registry);
+
+  static void Add(Metric metric, int64 delta = 1) {
+    MetricsRegistry::Slot* slot = AtomicOps::AcquireLoadPtr(&slots_[metric]);
+    if (slot)
+      MetricsRegistry::Add(slot, delta);
+  }
+  static void Record(Metric metric, uint32 value) {
+    MetricsRegistry::Slot* slot = AtomicOps::AcquireLoadPtr(&slots_[metric]);
+    if (slot)
+      MetricsRegistry::Record(slot, value);
+  }
+  static bool enabled(Metric metric) {
+    return AtomicOps::AcquireLoadPtr(&slots_[metric]) != NULL;
+  }
+
+  static const char* Name(Metric metric);
+  static MetricsRegistry::Kind KindOf(Metric metric);
+
+ private:
+  static MetricsRegistry::Slot* volatile slots_[LM_COUNT];
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_METRICS_H_
@@ -27,30 +27,216 @@
 
 #include "mucroomlookuptask.h"
 
+#include <algorithm>
+
 #include "logging.h"
 #include "scoped_ptr.h"
 #include "constants.h"
+#include "time.h"
 
 namespace txmpp {
 
 static const int kLookupTimeout = 15;
 
+//------------------------------------------------------------------
+// MucRoomLookupCache
+
+MucRoomLookupCache::MucRoomLookupCache(size_t capacity, int ttl_seconds)
+    : capacity_(capacity), ttl_ms_(ttl_seconds * 1000) {
+}
+
+MucRoomLookupCache* MucRoomLookupCache::Shared() {
+  static MucRoomLookupCache* cache = new MucRoomLookupCache(1024);
+  return cache;
+}
+
+std::string MucRoomLookupCache::NameKey(const std::string& room_name,
+                                        const std::string& organizer_domain) {
+  // A domain has no spaces, so the key can't be made another way.
+  return "name " + organizer_domain + " " + room_name;
+}
+
+std::string MucRoomLookupCache::JidKey(const Jid& room_jid) {
+  return "jid " + room_jid.Str();
+}
+
+bool MucRoomLookupCache::Find(const std::string& room_name,
+                              const std::string& organizer_domain,
+                              MucRoomInfo* info) {
+  return FindKey(NameKey(room_name, organizer_domain), info);
+}
+
+bool MucRoomLookupCache::Find(const Jid& room_jid, MucRoomInfo* info) {
+  return FindKey(JidKey(room_jid), info);
+}
+
+void MucRoomLookupCache::Invalidate(const std::string& room_name,
+                                    const std::string& organizer_domain) {
+  CritScope cs(&crit_);
+  RemoveKey(NameKey(room_name, organizer_domain));
+}
+
+void MucRoomLookupCache::Invalidate(const Jid& room_jid) {
+  CritScope cs(&crit_);
+  RemoveKey(JidKey(room_jid));
+  for (EntryMap::iterator it = entries_.begin(); it != entries_.end(); ) {
+    if (it->second.info.room_jid == room_jid) {
+      order_.remove(it->first);
+      entries_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void MucRoomLookupCache::Clear() {
+  CritScope cs(&crit_);
+  entries_.clear();
+  order_.clear();
+}
+
+bool MucRoomLookupCache::FindKey(const std::string& key, MucRoomInfo* info) {
+  CritScope cs(&crit_);
+  EntryMap::iterator it = entries_.find(key);
+  if (it == entries_.end())
+    return false;
+  if (TimeIsLater(it->second.expires, Time())) {
+    RemoveKey(key);
+    return false;
+  }
+  *info = it->second.info;
+  return true;
+}
+
+void MucRoomLookupCache::AddKey(const std::string& key,
+                                const MucRoomInfo& info) {
+  if (capacity_ == 0)
+    return;
+  Entry entry;
+  entry.info = info;
+  entry.expires = Time() + ttl_ms_;
+  std::pair<EntryMap::iterator, bool> added =
+      entries_.insert(std::make_pair(key, entry));
+  if (!added.second) {
+    // Renewed, so it moves to the back.
+    added.first->second = entry;
+    order_.remove(key);
+  }
+  order_.push_back(key);
+  while (entries_.size() > capacity_) {
+    entries_.erase(order_.front());
+    order_.pop_front();
+  }
+}
+
+void MucRoomLookupCache::RemoveKey(const std::string& key) {
+  if (entries_.erase(key))
+    order_.remove(key);
+}
+
+bool MucRoomLookupCache::Join(const std::string& key,
+                              MucRoomLookupTask* task) {
+  CritScope cs(&crit_);
+  FlightKey flight_key(task->GetRunner(), key);
+  FlightMap::iterator it = flights_.find(flight_key);
+  if (it == flights_.end()) {
+    flights_[flight_key].lookup = task;
+    return true;
+  }
+  it->second.waiters.push_back(task);
+  return false;
+}
+
+void MucRoomLookupCache::Land(const std::string& key,
+                              MucRoomLookupTask* task,
+                              const MucRoomInfo* info,
+                              const XmlElement* error) {
+  {
+    CritScope cs(&crit_);
+    if (info) {
+      AddKey(key, *info);
+      // Found by name, the room may be looked up by JID next.
+      if (key != JidKey(info->room_jid))
+        AddKey(JidKey(info->room_jid), *info);
+    }
+  }
+  std::vector<MucRoomLookupTask*> waiters;
+  if (!TakeFlight(key, task, &waiters))
+    return;
+  // The waiters run on this thread, so they can't go away meanwhile.
+  for (size_t i = 0; i < waiters.size(); ++i)
+    waiters[i]->Deliver(info, error, false);
+}
+
+void MucRoomLookupCache::Leave(const std::string& key,
+                               MucRoomLookupTask* task) {
+  std::vector<MucRoomLookupTask*> waiters;
+  if (!TakeFlight(key, task, &waiters))
+    return;
+  for (size_t i = 0; i < waiters.size(); ++i)
+    waiters[i]->Deliver(NULL, NULL, true);
+}
+
+bool MucRoomLookupCache::TakeFlight(const std::string& key,
+                                    MucRoomLookupTask* task,
+                                    std::vector<MucRoomLookupTask*>* waiters) {
+  CritScope cs(&crit_);
+  FlightMap::iterator it = flights_.find(FlightKey(task->GetRunner(), key));
+  if (it == flights_.end())
+    return false;
+  Flight& flight = it->second;
+  if (flight.lookup != task) {
+    flight.waiters.erase(std::remove(flight.waiters.begin(),
+                                     flight.waiters.end(), task),
+                         flight.waiters.end());
+    return false;
+  }
+  waiters->swap(flight.waiters);
+  flights_.erase(it);
+  return true;
+}
+
+//------------------------------------------------------------------
+// MucRoomLookupTask
+
 MucRoomLookupTask::MucRoomLookupTask(Task* parent,
                                      const std::string& room_name,
-                                     const std::string& organizer_domain)
+                                     const std::string& organizer_domain,
+                                     MucRoomLookupCache* cache)
     : XmppTask(parent, XmppEngine::HL_SINGLE),
       room_name_(room_name),
-      organizer_domain_(organizer_domain) {
+      organizer_domain_(organizer_domain),
+      cache_(cache), delivered_(false), restart_(false), found_(false) {
   set_timeout_seconds(kLookupTimeout);
 }
 
 MucRoomLookupTask::MucRoomLookupTask(Task* parent,
-                                     const Jid& room_jid)
-    : XmppTask(parent, XmppEngine::HL_SINGLE), room_jid_(room_jid) {
+                                     const Jid& room_jid,
+                                     MucRoomLookupCache* cache)
+    : XmppTask(parent, XmppEngine::HL_SINGLE), room_jid_(room_jid),
+      cache_(cache), delivered_(false), restart_(false), found_(false) {
   set_timeout_seconds(kLookupTimeout);
 }
 
+MucRoomLookupTask::~MucRoomLookupTask() {
+  LeaveFlight();
+}
+
 int MucRoomLookupTask::ProcessStart() {
+  if (cache_) {
+    std::string key = (room_jid_ != JID_EMPTY) ?
+        MucRoomLookupCache::JidKey(room_jid_) :
+        MucRoomLookupCache::NameKey(room_name_, organizer_domain_);
+    MucRoomInfo room_info;
+    if (cache_->FindKey(key, &room_info)) {
+      SignalRoomLookupResponse(room_info);
+      return STATE_DONE;
+    }
+    flight_key_ = key;
+    if (!cache_->Join(key, this))
+      return STATE_WAITING;
+  }
+
   scoped_ptr<XmlElement> lookup(MakeIq(STR_SET,
       Jid(STR_MUC_LOOKUP_DOMAIN), task_id()));
   if (room_jid_ != JID_EMPTY) {
@@ -64,6 +250,7 @@ int MucRoomLookupTask::ProcessStart() {
   }
 
   if (SendStanza(lookup.get()) != XMPP_RETURN_OK) {
+    Land(NULL, NULL);
     SignalRoomLookupError(NULL);
     return STATE_ERROR;
   }
@@ -77,7 +264,9 @@ int MucRoomLookupTask::ProcessResponse() {
     return STATE_BLOCKED;
 
   if (stanza->Attr(QN_TYPE) == STR_ERROR) {
-    SignalRoomLookupError(stanza->FirstNamed(QN_ERROR));
+    const XmlElement* error = stanza->FirstNamed(QN_ERROR);
+    Land(NULL, error);
+    SignalRoomLookupError(error);
     return STATE_DONE;
   }
 
@@ -88,21 +277,76 @@ int MucRoomLookupTask::ProcessResponse() {
     if (item_elem != NULL && item_elem->HasAttr(QN_JID)) {
       MucRoomInfo room_info;
       if (GetRoomInfoFromResponse(item_elem, &room_info)) {
+        Land(&room_info, NULL);
         SignalRoomLookupResponse(room_info);
         return STATE_DONE;
       }
     }
   }
 
+  Land(NULL, NULL);
   SignalRoomLookupError(NULL);
   return STATE_DONE;
 }
 
+int MucRoomLookupTask::ProcessWaiting() {
+  if (!delivered_)
+    return STATE_BLOCKED;
+  delivered_ = false;
+  if (restart_) {
+    restart_ = false;
+    return STATE_START;
+  }
+  if (found_) {
+    SignalRoomLookupResponse(info_);
+  } else {
+    SignalRoomLookupError(error_.get());
+  }
+  return STATE_DONE;
+}
+
 int MucRoomLookupTask::OnTimeout() {
+  Land(NULL, NULL);
   SignalRoomLookupError(NULL);
   return XmppTask::OnTimeout();
 }
 
+void MucRoomLookupTask::Land(const MucRoomInfo* info,
+                             const XmlElement* error) {
+  if (flight_key_.empty())
+    return;
+  std::string key;
+  key.swap(flight_key_);
+  cache_->Land(key, this, info, error);
+}
+
+void MucRoomLookupTask::Stop() {
+  // Aborted, the lookups waiting for this one start over at once.
+  LeaveFlight();
+  XmppTask::Stop();
+}
+
+void MucRoomLookupTask::LeaveFlight() {
+  if (flight_key_.empty())
+    return;
+  std::string key;
+  key.swap(flight_key_);
+  cache_->Leave(key, this);
+}
+
+void MucRoomLookupTask::Deliver(const MucRoomInfo* info,
+                                const XmlElement* error, bool restart) {
+  // Out of the flight, which is gone.
+  flight_key_.clear();
+  delivered_ = true;
+  restart_ = restart;
+  found_ = info != NULL;
+  if (info)
+    info_ = *info;
+  error_.reset(error ? new XmlElement(*error) : NULL);
+  Wake();
+}
+
 bool MucRoomLookupTask::HandleStanza(const XmlElement* stanza) {
   if (MatchResponseIq(stanza, Jid(STR_MUC_LOOKUP_DOMAIN), task_id())) {
     QueueStanza(stanza);
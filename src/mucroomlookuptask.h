@@ -28,22 +28,112 @@
 #ifndef _TXMPP_MUCROOMLOOKUPTASK_H_
 #define _TXMPP_MUCROOMLOOKUPTASK_H_
 
+#include <list>
+#include <map>
 #include <string>
+#include <vector>
+
+#include "criticalsection.h"
 #include "xmpptask.h"
 
 namespace txmpp {
 
+class MucRoomLookupTask;
+
 struct MucRoomInfo {
   Jid room_jid;
   std::string room_name;
   std::string organizer_domain;
 };
 
+// The rooms MucRoomLookupTasks have looked up, by room name and organizer
+// domain and by room JID, kept for a time so that joining the same rooms
+// again needs no IQ.  A lookup of a room already being looked up on the
+// same TaskRunner waits for that one's answer instead of sending an IQ of
+// its own.  Results are shared by all the threads, and the oldest are
+// dropped past the capacity.  Failures are not cached.
+class MucRoomLookupCache {
+ public:
+  static const int kDefaultTtlSeconds = 300;
+
+  MucRoomLookupCache(size_t capacity, int ttl_seconds = kDefaultTtlSeconds);
+
+  // The cache MucRoomLookupTask uses unless given another.
+  static MucRoomLookupCache* Shared();
+
+  bool Find(const std::string& room_name, const std::string& organizer_domain,
+            MucRoomInfo* info);
+  bool Find(const Jid& room_jid, MucRoomInfo* info);
+
+  // Forgets a room, as when it is known to have moved or gone, so that the
+  // next lookup asks the server.  By JID, this also forgets the name
+  // lookups that found the room.
+  void Invalidate(const std::string& room_name,
+                  const std::string& organizer_domain);
+  void Invalidate(const Jid& room_jid);
+  void Clear();
+
+ private:
+  friend class MucRoomLookupTask;
+
+  struct Entry {
+    MucRoomInfo info;
+    uint32 expires;  // Time() past which it is stale.
+  };
+  typedef std::map<std::string, Entry> EntryMap;
+
+  // A lookup in flight, and the lookups waiting for it.
+  struct Flight {
+    MucRoomLookupTask* lookup;
+    std::vector<MucRoomLookupTask*> waiters;
+  };
+  typedef std::pair<TaskRunner*, std::string> FlightKey;
+  typedef std::map<FlightKey, Flight> FlightMap;
+
+  static std::string NameKey(const std::string& room_name,
+                             const std::string& organizer_domain);
+  static std::string JidKey(const Jid& room_jid);
+
+  bool FindKey(const std::string& key, MucRoomInfo* info);
+  void AddKey(const std::string& key, const MucRoomInfo& info);
+  void RemoveKey(const std::string& key);
+
+  // Makes |task| the lookup of |key| on its runner and returns true, or if
+  // one is in flight already, makes |task| wait for it and returns false.
+  bool Join(const std::string& key, MucRoomLookupTask* task);
+  // Ends the flight of |task|, the lookup of |key|, caching |info| if it
+  // isn't NULL, and hands the waiters |info|, or else |error|.  A waiter
+  // just stops waiting.
+  void Land(const std::string& key, MucRoomLookupTask* task,
+            const MucRoomInfo* info, const XmlElement* error);
+  // Takes |task| out of the flight of |key| as it goes away.  If it was the
+  // lookup, the waiters start over.
+  void Leave(const std::string& key, MucRoomLookupTask* task);
+  // Ends the flight of |key| and returns true with its waiters in
+  // |waiters| if |task| is its lookup, or else takes |task| out of its
+  // waiters.
+  bool TakeFlight(const std::string& key, MucRoomLookupTask* task,
+                  std::vector<MucRoomLookupTask*>* waiters);
+
+  CriticalSection crit_;
+  size_t capacity_;
+  int ttl_ms_;
+  EntryMap entries_;
+  // The keys in entries_, oldest first.
+  std::list<std::string> order_;
+  FlightMap flights_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(MucRoomLookupCache);
+};
+
 class MucRoomLookupTask : public XmppTask {
  public:
   MucRoomLookupTask(Task* parent, const std::string& room_name,
-      const std::string& organizer_domain);
-  MucRoomLookupTask(Task* parent, const Jid& room_jid);
+      const std::string& organizer_domain,
+      MucRoomLookupCache* cache = MucRoomLookupCache::Shared());
+  MucRoomLookupTask(Task* parent, const Jid& room_jid,
+      MucRoomLookupCache* cache = MucRoomLookupCache::Shared());
+  virtual ~MucRoomLookupTask();
 
   signal1<const MucRoomInfo&> SignalRoomLookupResponse;
   signal1<const XmlElement*> SignalRoomLookupError;
@@ -53,15 +143,47 @@ class MucRoomLookupTask : public XmppTask {
   virtual int ProcessStart();
   virtual int ProcessResponse();
   virtual int OnTimeout();
+  virtual void Stop();
 
  private:
+  friend class MucRoomLookupCache;
+
+  enum {
+    STATE_WAITING = STATE_NEXT,  // For another lookup of the room.
+  };
+  int Process(int state) {
+    // A timeout is left to Task::Process.
+    if (state == STATE_WAITING && !TimedOut())
+      return ProcessWaiting();
+    return XmppTask::Process(state);
+  }
+
   XmlElement* MakeRoomQuery(const std::string& room_name,
       const std::string& org_domain);
   XmlElement* MakeJidQuery(const std::string& room_jid);
   bool GetRoomInfoFromResponse(const XmlElement* stanza, MucRoomInfo* info);
+  int ProcessWaiting();
+  // Ends this lookup's flight, if it is in one, with |info| or |error|.
+  void Land(const MucRoomInfo* info, const XmlElement* error);
+  // Leaves the flight, if in one, without an answer.
+  void LeaveFlight();
+  // Called by the cache on a waiting lookup.  Hands it the answer, if
+  // |info| isn't NULL, or the error, or if |restart|, has it start over.
+  void Deliver(const MucRoomInfo* info, const XmlElement* error,
+               bool restart);
+
   const std::string room_name_;
   const std::string organizer_domain_;
   const Jid room_jid_;
+  MucRoomLookupCache* cache_;
+  // The cache key of the room while in a flight, or else empty.
+  std::string flight_key_;
+  // What a waiting lookup was handed.
+  bool delivered_;
+  bool restart_;
+  bool found_;
+  MucRoomInfo info_;
+  scoped_ptr<XmlElement> error_;
 };
 
 }  // namespace txmpp
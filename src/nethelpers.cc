@@ -27,8 +27,27 @@
 
 #include "nethelpers.h"
 
+#ifdef POSIX
+#include <arpa/nameser.h>
+#include <resolv.h>
+#endif
+
+#ifdef WIN32
+#include <windns.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "dnsapi.lib")
+#endif
+#endif
+
+#include <algorithm>
+#include <cstring>
+
 #include "byteorder.h"
+#include "event.h"
+#include "helpers.h"
 #include "signalthread.h"
+#include "threadpool.h"
+#include "time.h"
 
 namespace txmpp {
 
@@ -37,23 +56,324 @@ static const size_t kInitHostentLen = 1024;
 static const size_t kMaxHostentLen = kInitHostentLen * 8;
 #endif
 
+// Threads to resolve on.  Lookups mostly wait on the network, so a few are
+// enough for any number of sockets.
+static const size_t kResolverThreads = 4;
+
+// HostResolver
+
+// A lookup in flight, which other lookups of the same name wait for.
+struct HostResolver::Pending {
+  Pending() : done(true, false), waiters(0), ip(0), error(0) {}
+  Event done;
+  int waiters;
+  uint32 ip;
+  int error;
+};
+
+HostResolver* HostResolver::Instance() {
+  // Never destroyed, as sockets may still resolve during static destruction.
+  static HostResolver* const instance = new HostResolver;
+  return instance;
+}
+
+HostResolver::HostResolver()
+    : pool_(new ThreadPool(kResolverThreads)),
+      positive_ttl_(kDefaultPositiveTtl),
+      negative_ttl_(kDefaultNegativeTtl) {
+  pool_->Start();
+}
+
+HostResolver::~HostResolver() {
+  delete pool_;
+}
+
+int HostResolver::Resolve(const std::string& hostname, uint32* ip) {
+  int error = 0;
+  Pending* pending = NULL;
+  {
+    CritScope cs(&crit_);
+    if (FindEntry(hostname, ip, &error)) {
+      stats_.hits += 1;
+      return error;
+    }
+    PendingMap::iterator it = pending_.find(hostname);
+    if (it != pending_.end()) {
+      stats_.coalesced += 1;
+      pending = it->second;
+      pending->waiters += 1;
+    } else {
+      stats_.misses += 1;
+      pending_[hostname] = new Pending;
+    }
+  }
+
+  if (pending) {
+    pending->done.Wait(kForever);
+    CritScope cs(&crit_);
+    *ip = pending->ip;
+    error = pending->error;
+    if (0 == --pending->waiters)
+      delete pending;
+    return error;
+  }
+
+  *ip = 0;
+  if (hostent* host = SafeGetHostByName(hostname.c_str(), &error)) {
+    *ip = NetworkToHost32(*reinterpret_cast<uint32*>(host->h_addr_list[0]));
+    FreeHostEnt(host);
+  } else if (0 == error) {
+    error = -1;
+  }
+
+  CritScope cs(&crit_);
+  AddEntry(hostname, *ip, error);
+  PendingMap::iterator it = pending_.find(hostname);
+  pending = it->second;
+  pending_.erase(it);
+  if (0 == pending->waiters) {
+    delete pending;
+  } else {
+    pending->ip = *ip;
+    pending->error = error;
+    pending->done.Set();
+  }
+  return error;
+}
+
+bool HostResolver::Lookup(const std::string& hostname, uint32* ip,
+                          int* error) {
+  CritScope cs(&crit_);
+  if (!FindEntry(hostname, ip, error))
+    return false;
+  stats_.hits += 1;
+  return true;
+}
+
+void HostResolver::Flush() {
+  CritScope cs(&crit_);
+  entries_.clear();
+}
+
+void HostResolver::set_positive_ttl(int ms) {
+  CritScope cs(&crit_);
+  positive_ttl_ = ms;
+}
+
+void HostResolver::set_negative_ttl(int ms) {
+  CritScope cs(&crit_);
+  negative_ttl_ = ms;
+}
+
+HostResolver::Stats HostResolver::stats() const {
+  CritScope cs(&crit_);
+  return stats_;
+}
+
+bool HostResolver::FindEntry(const std::string& hostname, uint32* ip,
+                             int* error) {
+  EntryMap::iterator it = entries_.find(hostname);
+  if (it == entries_.end())
+    return false;
+  if (TimeIsLater(it->second.expires, Time())) {
+    entries_.erase(it);
+    return false;
+  }
+  *ip = it->second.ip;
+  *error = it->second.error;
+  return true;
+}
+
+void HostResolver::AddEntry(const std::string& hostname, uint32 ip,
+                            int error) {
+#ifdef TRY_AGAIN
+  // A temporary failure says nothing about the name.
+  if (TRY_AGAIN == error)
+    return;
+#endif
+  int ttl = error ? negative_ttl_ : positive_ttl_;
+  if (ttl <= 0)
+    return;
+  if (entries_.size() >= kMaxEntries) {
+    uint32 now = Time();
+    for (EntryMap::iterator it = entries_.begin(); it != entries_.end(); ) {
+      if (TimeIsLater(it->second.expires, now)) {
+        entries_.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+    if (entries_.size() >= kMaxEntries)
+      entries_.erase(entries_.begin());
+  }
+  Entry& entry = entries_[hostname];
+  entry.ip = ip;
+  entry.error = error;
+  entry.expires = TimeAfter(ttl);
+}
+
 // AsyncResolver
 
-AsyncResolver::AsyncResolver() : result_(NULL), error_(0) {
+AsyncResolver::AsyncResolver() : ip_(0), error_(0) {
+  SetPool(HostResolver::Instance()->pool());
 }
 
 AsyncResolver::~AsyncResolver() {
-  FreeHostEnt(result_);
 }
 
 void AsyncResolver::DoWork() {
-  result_ = SafeGetHostByName(addr_.hostname().c_str(), &error_);
+  error_ = HostResolver::Instance()->Resolve(addr_.hostname(), &ip_);
 }
 
 void AsyncResolver::OnWorkDone() {
-  if (result_) {
-    addr_.SetIP(NetworkToHost32(
-        *reinterpret_cast<uint32*>(result_->h_addr_list[0])));
+  if (0 == error_) {
+    addr_.SetIP(ip_);
+  }
+}
+
+// AsyncSrvResolver
+
+AsyncSrvResolver::AsyncSrvResolver() : error_(0) {
+  SetPool(HostResolver::Instance()->pool());
+}
+
+AsyncSrvResolver::~AsyncSrvResolver() {
+}
+
+void AsyncSrvResolver::DoWork() {
+  records_.clear();
+  if (SafeGetSrvRecords(name_, &records_, &error_))
+    SortSrvRecords(&records_);
+}
+
+bool SafeGetSrvRecords(const std::string& name,
+                       std::vector<SrvRecord>* records, int* herrno) {
+  records->clear();
+#if defined(POSIX)
+  // res_nquery keeps its state in |res|, where res_query would share it
+  // with every other thread.
+  struct __res_state res;
+  memset(&res, 0, sizeof(res));
+  if (res_ninit(&res) != 0) {
+    *herrno = NO_RECOVERY;
+    return false;
+  }
+  unsigned char answer[4096];
+  int len = res_nquery(&res, name.c_str(), ns_c_in, ns_t_srv, answer,
+                       sizeof(answer));
+  *herrno = res.res_h_errno;
+  res_nclose(&res);
+  ns_msg msg;
+  // A truncated answer gives the length it would have had.
+  len = std::min(len, static_cast<int>(sizeof(answer)));
+  if ((len < 0) || (ns_initparse(answer, len, &msg) < 0)) {
+    if (0 == *herrno)
+      *herrno = NO_RECOVERY;
+    return false;
+  }
+  for (int i = 0; i < ns_msg_count(msg, ns_s_an); ++i) {
+    ns_rr rr;
+    if ((ns_parserr(&msg, ns_s_an, i, &rr) < 0)
+        || (ns_rr_type(rr) != ns_t_srv) || (ns_rr_rdlen(rr) < 7))
+      continue;
+    const unsigned char* rdata = ns_rr_rdata(rr);
+    char target[NS_MAXDNAME];
+    if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), rdata + 6, target,
+                  sizeof(target)) < 0)
+      continue;
+    // dn_expand gives the root as "".
+    if (target[0] == '\0' || (target[0] == '.' && target[1] == '\0'))
+      continue;
+    SrvRecord record;
+    record.priority = ns_get16(rdata);
+    record.weight = ns_get16(rdata + 2);
+    record.port = ns_get16(rdata + 4);
+    record.target = target;
+    records->push_back(record);
+  }
+  *herrno = records->empty() ? NO_DATA : 0;
+  return !records->empty();
+#elif defined(WIN32)
+  PDNS_RECORD results = NULL;
+  DNS_STATUS status = DnsQuery_A(name.c_str(), DNS_TYPE_SRV,
+                                 DNS_QUERY_STANDARD, NULL, &results, NULL);
+  if (status != 0) {
+    // The h_errno values, as winsock defines them.
+    if (status == DNS_ERROR_RCODE_NAME_ERROR)
+      *herrno = HOST_NOT_FOUND;
+    else if (status == DNS_INFO_NO_RECORDS)
+      *herrno = NO_DATA;
+    else if (status == ERROR_TIMEOUT ||
+             status == DNS_ERROR_RCODE_SERVER_FAILURE)
+      *herrno = TRY_AGAIN;
+    else
+      *herrno = NO_RECOVERY;
+    return false;
+  }
+  for (PDNS_RECORD rr = results; rr; rr = rr->pNext) {
+    if ((rr->wType != DNS_TYPE_SRV) ||
+        (rr->Flags.S.Section != DnsSectionAnswer))
+      continue;
+    // DnsQuery_A gives the names as narrow strings, whatever the types say.
+    const char* target = reinterpret_cast<const char*>(
+        rr->Data.SRV.pNameTarget);
+    if (!target || target[0] == '\0' ||
+        (target[0] == '.' && target[1] == '\0'))
+      continue;
+    SrvRecord record;
+    record.priority = rr->Data.SRV.wPriority;
+    record.weight = rr->Data.SRV.wWeight;
+    record.port = rr->Data.SRV.wPort;
+    record.target = target;
+    records->push_back(record);
+  }
+  DnsRecordListFree(results, DnsFreeRecordList);
+  *herrno = records->empty() ? NO_DATA : 0;
+  return !records->empty();
+#else
+  *herrno = NO_RECOVERY;
+  return false;
+#endif
+}
+
+static bool SrvRecord_LessPriority(const SrvRecord& a, const SrvRecord& b) {
+  return a.priority < b.priority;
+}
+
+static bool SrvRecord_ZeroWeight(const SrvRecord& record) {
+  return 0 == record.weight;
+}
+
+void SortSrvRecords(std::vector<SrvRecord>* records) {
+  std::stable_sort(records->begin(), records->end(), SrvRecord_LessPriority);
+  // Within a priority, each record in turn is picked with a chance in
+  // proportion to its weight, out of those not yet picked.
+  for (size_t start = 0; start < records->size(); ) {
+    size_t end = start;
+    uint32 total = 0;
+    while ((end < records->size())
+           && ((*records)[end].priority == (*records)[start].priority)) {
+      total += (*records)[end].weight;
+      ++end;
+    }
+    // Records of weight 0 go first, so that a roll of 0 picks them.
+    std::stable_partition(records->begin() + start, records->begin() + end,
+                          SrvRecord_ZeroWeight);
+    for (; start + 1 < end; ++start) {
+      size_t pick = start;
+      if (total > 0) {
+        uint32 roll = CreateRandomId() % (total + 1);
+        uint32 sum = 0;
+        for (pick = start; pick + 1 < end; ++pick) {
+          sum += (*records)[pick].weight;
+          if (sum >= roll)
+            break;
+        }
+      }
+      total -= (*records)[pick].weight;
+      std::swap((*records)[start], (*records)[pick]);
+    }
+    start = end;
   }
 }
 
@@ -40,15 +40,87 @@
 #endif
 
 #include <list>
+#include <map>
+#include <string>
+#include <vector>
 
+#include "constructormagic.h"
+#include "criticalsection.h"
 #include "signalthread.h"
 #include "sigslot.h"
 #include "socketaddress.h"
 
 namespace txmpp {
 
+class ThreadPool;
+
+// HostResolver looks up host names on a small pool of threads shared by the
+// whole process, and remembers the answers for a while: found addresses for
+// positive_ttl() milliseconds, and names that don't exist for negative_ttl().
+// A lookup of a name that is already being looked up waits for that one
+// instead of asking again.  gethostbyname doesn't tell the record's own TTL,
+// so the TTLs are fixed.
+class HostResolver {
+ public:
+  static const int kDefaultPositiveTtl = 60 * 1000;
+  static const int kDefaultNegativeTtl = 5 * 1000;
+  static const size_t kMaxEntries = 1024;
+
+  struct Stats {
+    Stats() : hits(0), misses(0), coalesced(0) {}
+    size_t hits, misses, coalesced;
+  };
+
+  static HostResolver* Instance();
+
+  // The pool that AsyncResolvers run on.
+  ThreadPool* pool() { return pool_; }
+
+  // Context: Any Thread.  Blocks until |hostname| is resolved, or comes from
+  // the cache.  Returns 0 and sets |ip|, in host order, or returns the
+  // resolver's error.
+  int Resolve(const std::string& hostname, uint32* ip);
+  // Context: Any Thread.  Like Resolve, but only answers from the cache.
+  bool Lookup(const std::string& hostname, uint32* ip, int* error);
+  // Context: Any Thread.  Forgets every answer.
+  void Flush();
+
+  void set_positive_ttl(int ms);
+  int positive_ttl() const { return positive_ttl_; }
+  void set_negative_ttl(int ms);
+  int negative_ttl() const { return negative_ttl_; }
+
+  Stats stats() const;
+
+ private:
+  struct Pending;
+  struct Entry {
+    uint32 ip;
+    int error;
+    uint32 expires;
+  };
+  typedef std::map<std::string, Entry> EntryMap;
+  typedef std::map<std::string, Pending*> PendingMap;
+
+  HostResolver();
+  ~HostResolver();
+
+  bool FindEntry(const std::string& hostname, uint32* ip, int* error);
+  void AddEntry(const std::string& hostname, uint32 ip, int error);
+
+  ThreadPool* pool_;
+  mutable CriticalSection crit_;
+  EntryMap entries_;
+  PendingMap pending_;
+  int positive_ttl_, negative_ttl_;
+  Stats stats_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(HostResolver);
+};
+
 // AsyncResolver will perform async DNS resolution, signaling the result on
-// the inherited SignalWorkDone when the operation completes.
+// the inherited SignalWorkDone when the operation completes.  The lookup
+// runs on HostResolver's pool, and is answered from its cache when it can.
 class AsyncResolver : public SignalThread {
  public:
   AsyncResolver();
@@ -65,10 +137,50 @@ class AsyncResolver : public SignalThread {
 
  private:
   SocketAddress addr_;
-  hostent* result_;
+  uint32 ip_;
   int error_;
 };
 
+// A DNS SRV record, as of RFC 2782.
+struct SrvRecord {
+  SrvRecord() : priority(0), weight(0), port(0) {}
+  int priority;
+  int weight;
+  int port;
+  std::string target;
+};
+
+// AsyncSrvResolver looks up the SRV records of name() on HostResolver's pool,
+// signaling SignalWorkDone with records() in the order to try them.
+class AsyncSrvResolver : public SignalThread {
+ public:
+  AsyncSrvResolver();
+
+  const std::string& name() const { return name_; }
+  void set_name(const std::string& name) { name_ = name; }
+  const std::vector<SrvRecord>& records() const { return records_; }
+  int error() const { return error_; }
+
+ protected:
+  ~AsyncSrvResolver();
+  virtual void DoWork();
+
+ private:
+  std::string name_;
+  std::vector<SrvRecord> records_;
+  int error_;
+};
+
+// Looks up the SRV records of |name|, such as "_xmpp-client._tcp.example.com".
+// Blocks.  Returns false and sets |herrno| if there are none, or the platform
+// can't look them up.  A record whose target is "." says the service isn't
+// offered, and is left out.
+bool SafeGetSrvRecords(const std::string& name,
+                       std::vector<SrvRecord>* records, int* herrno);
+// Orders |records| as RFC 2782 says to try them: by priority, and within
+// each priority at random, weighted by weight.
+void SortSrvRecords(std::vector<SrvRecord>* records);
+
 // SafeGetHostByName functions allocate and return their result, instead of
 // using a static variable like the normal gethostbyname.
 // FreeHostEnt frees the memory allocated by SafeGetHostByName.
@@ -38,6 +38,11 @@
 #include <errno.h>
 #endif  // POSIX
 
+#ifdef LINUX
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif  // LINUX
+
 #ifdef WIN32
 #include "win32.h"
 #include <Iphlpapi.h>
@@ -52,9 +57,11 @@
 #include <sstream>
 
 #include "logging.h"
+#include "physicalsocketserver.h"
 #include "scoped_ptr.h"
 #include "socket.h"  // includes something that makes windows happy
 #include "stringencode.h"
+#include "thread.h"
 #include "time.h"
 
 namespace {
@@ -356,6 +363,177 @@ bool NetworkManager::EnumNetworks(bool include_ignored,
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+// NetworkMonitor
+///////////////////////////////////////////////////////////////////////////////
+
+enum { MSG_NETWORKS_CHANGED, MSG_NETWORKS_POLL };
+
+static const int kDefaultPollInterval = 5000;
+
+#ifdef LINUX
+// NetworkMonitor::Watcher - Reads the kernel's link, address and route
+// messages on a thread of its own, and tells the monitor's thread about them.
+class NetworkMonitor::Watcher : public MessageHandler, public has_slots<> {
+ public:
+  enum { MSG_OPEN, MSG_CLOSE };
+
+  Watcher(NetworkMonitor* monitor)
+      : monitor_(monitor), owner_(monitor->owner_),
+        ss_(new PhysicalSocketServer), thread_(ss_.get()), opened_(false) {
+    thread_.Start();
+    thread_.Send(this, MSG_OPEN);
+  }
+  virtual ~Watcher() {
+    thread_.Send(this, MSG_CLOSE);
+    thread_.Stop();
+    owner_->Clear(monitor_, MSG_NETWORKS_CHANGED);
+  }
+
+  bool opened() const { return opened_; }
+
+  virtual void OnMessage(Message* msg) {
+    if (MSG_OPEN == msg->message_id) {
+      opened_ = Open();
+    } else {
+      socket_.reset();
+    }
+  }
+
+ private:
+  bool Open() {
+    int fd = ::socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (fd < 0) {
+      LOG_ERR(LS_WARNING) << "NetworkMonitor netlink socket";
+      return false;
+    }
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+                     RTMGRP_IPV4_ROUTE;
+    if (::bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+               sizeof(addr)) < 0) {
+      LOG_ERR(LS_WARNING) << "NetworkMonitor netlink bind";
+      ::close(fd);
+      return false;
+    }
+    socket_.reset(ss_->WrapSocket(fd));
+    if (!socket_.get()) {
+      ::close(fd);
+      return false;
+    }
+    socket_->SignalReadEvent.connect(this, &Watcher::OnReadEvent);
+    return true;
+  }
+
+  void OnReadEvent(AsyncSocket* socket) {
+    bool changed = false;
+    char buffer[8192];
+    int len;
+    while ((len = socket->Recv(buffer, sizeof(buffer))) > 0) {
+      const struct nlmsghdr* header =
+          reinterpret_cast<const struct nlmsghdr*>(buffer);
+      for (; NLMSG_OK(header, static_cast<unsigned int>(len));
+           header = NLMSG_NEXT(header, len)) {
+        switch (header->nlmsg_type) {
+          case RTM_NEWLINK:
+          case RTM_DELLINK:
+          case RTM_NEWADDR:
+          case RTM_DELADDR:
+          case RTM_NEWROUTE:
+          case RTM_DELROUTE:
+            changed = true;
+            break;
+        }
+      }
+    }
+    // The kernel drops what doesn't fit in the socket's buffer, and says so
+    // with ENOBUFS; whatever was dropped may have been a change.
+    if (len < 0 && socket->GetError() == ENOBUFS)
+      changed = true;
+    if (changed) {
+      owner_->Clear(monitor_, MSG_NETWORKS_CHANGED);
+      owner_->Post(monitor_, MSG_NETWORKS_CHANGED);
+    }
+  }
+
+  NetworkMonitor* monitor_;
+  Thread* owner_;
+  scoped_ptr<PhysicalSocketServer> ss_;
+  Thread thread_;
+  scoped_ptr<AsyncSocket> socket_;
+  bool opened_;
+};
+#else  // !LINUX
+// Nothing tells us about changes here, so the monitor polls.
+class NetworkMonitor::Watcher {
+ public:
+  Watcher(NetworkMonitor* monitor) { }
+  bool opened() const { return false; }
+};
+#endif  // !LINUX
+
+NetworkMonitor::NetworkMonitor()
+    : owner_(NULL), poll_interval_(kDefaultPollInterval) {
+}
+
+NetworkMonitor::~NetworkMonitor() {
+  Stop();
+}
+
+void NetworkMonitor::Start() {
+  if (started())
+    return;
+  owner_ = Thread::Current();
+  networks_ = DescribeNetworks();
+  watcher_.reset(new Watcher(this));
+  if (!watcher_->opened())
+    owner_->PostDelayed(poll_interval_, this, MSG_NETWORKS_POLL);
+}
+
+void NetworkMonitor::Stop() {
+  if (!started())
+    return;
+  watcher_.reset();
+  owner_->Clear(this);
+  owner_ = NULL;
+}
+
+void NetworkMonitor::OnMessage(Message* msg) {
+  CheckNetworks();
+  if (MSG_NETWORKS_POLL == msg->message_id && started())
+    owner_->PostDelayed(poll_interval_, this, MSG_NETWORKS_POLL);
+}
+
+void NetworkMonitor::CheckNetworks() {
+  std::string networks = DescribeNetworks();
+  if (networks == networks_)
+    return;
+  LOG(LS_INFO) << "NetworkMonitor networks changed";
+  networks_.swap(networks);
+  SignalNetworksChanged();
+}
+
+std::string NetworkMonitor::DescribeNetworks() {
+  std::vector<Network*> list;
+  NetworkManager::CreateNetworks(false, &list);
+  std::vector<std::string> descriptions;
+  for (size_t i = 0; i < list.size(); ++i) {
+    std::ostringstream ost;
+    ost << list[i]->name() << " " << list[i]->ip() << " "
+        << list[i]->gateway_ip() << ";";
+    descriptions.push_back(ost.str());
+    delete list[i];
+  }
+  // The order the system lists them in says nothing.
+  std::sort(descriptions.begin(), descriptions.end());
+  std::string networks;
+  for (size_t i = 0; i < descriptions.size(); ++i)
+    networks.append(descriptions[i]);
+  return networks;
+}
+
 Network::Network(const std::string& name, const std::string& desc,
                  uint32 ip, uint32 gateway_ip)
     : name_(name), description_(desc), ip_(ip), gateway_ip_(gateway_ip),
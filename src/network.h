@@ -38,11 +38,16 @@
 #include <vector>
 
 #include "basictypes.h"
+#include "constructormagic.h"
+#include "messagehandler.h"
+#include "scoped_ptr.h"
+#include "sigslot.h"
 
 namespace txmpp {
 
 class Network;
 class NetworkSession;
+class Thread;
 
 // Keeps track of the available network interfaces over time so that quality
 // information can be aggregated and recorded.
@@ -80,6 +85,49 @@ class NetworkManager {
   NetworkMap networks_;
 };
 
+// Watches the networks available on this machine, and raises
+// SignalNetworksChanged on the thread that started it whenever their names,
+// addresses or gateways change, so that connections over an interface that
+// went away can be given up at once. On Linux the kernel's routing netlink
+// messages are read on a thread of the monitor's own; elsewhere the networks
+// are enumerated again every poll_interval milliseconds.
+class NetworkMonitor : public MessageHandler, public has_slots<> {
+ public:
+  NetworkMonitor();
+  virtual ~NetworkMonitor();
+
+  // Starts watching from the current thread. The networks seen now are the
+  // ones later changes are measured against.
+  void Start();
+  void Stop();
+  bool started() const { return owner_ != NULL; }
+
+  int poll_interval() const { return poll_interval_; }
+  void set_poll_interval(int ms) { poll_interval_ = ms; }
+
+  signal0<> SignalNetworksChanged;
+
+  // MessageHandler Interface
+  virtual void OnMessage(Message* msg);
+
+ private:
+  class Watcher;
+  friend class Watcher;
+
+  // Enumerates the networks again, raising SignalNetworksChanged if they
+  // differ from the last ones seen.
+  void CheckNetworks();
+  static std::string DescribeNetworks();
+
+  Thread* owner_;
+  scoped_ptr<Watcher> watcher_;
+  // The name, address and gateway of each network last seen.
+  std::string networks_;
+  int poll_interval_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(NetworkMonitor);
+};
+
 // Represents a Unix-type network interface, with a name and single address.
 // It also includes the ability to track and estimate quality.
 class Network {
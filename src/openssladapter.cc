@@ -5,15 +5,30 @@
 #include <openssl/bio.h>
 #include <openssl/crypto.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/opensslv.h>
 #include <openssl/rand.h>
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
 
 #include "common.h"
+#include "criticalsection.h"
 #include "logging.h"
+#include "opensslcertstore.h"
+#include "opensslsessioncache.h"
 #include "stringutils.h"
-#include "Equifax_Secure_Global_eBusiness_CA-1.h"
+#include "threadpool.h"
+#include "tracepoints.h"
+
+// Kernel TLS needs the write key and sequence number of the session, which
+// only the structures of OpenSSL before 1.1 let us at.
+#if defined(LINUX) && defined(HAVE_LINUX_TLS_H) && \
+    (OPENSSL_VERSION_NUMBER < 0x10100000L)
+#define OPENSSL_KERNEL_TLS 1
+#include <string.h>
+#include <linux/tls.h>
+#endif
 
 // TODO: Use a nicer abstraction for mutex.
 
@@ -188,19 +203,105 @@ static void dyn_destroy_function(CRYPTO_dynlock_value* l,
 }
 
 VerificationCallback OpenSSLAdapter::custom_verify_callback_ = NULL;
+ThreadPool* OpenSSLAdapter::handshake_pool_default_ = NULL;
+bool OpenSSLAdapter::kernel_tls_ = false;
+bool OpenSSLAdapter::lean_memory_ = false;
+bool OpenSSLAdapter::memory_bio_ = false;
+const size_t OpenSSLAdapter::kLeanPairSize;
+const size_t OpenSSLAdapter::kBulkPairSize;
+
+// One call of SSL_connect on the handshake pool. The job is posted with
+// itself as the reply, so OnMessage runs first on a pool thread and then on
+// the adapter's. An adapter that goes away in between orphans the job, which
+// then frees the SSL object and the BIO pair itself; crit_ keeps that from
+// happening while the step, and so the verify callback, is running.
+class OpenSSLAdapter::HandshakeJob : public MessageHandler {
+ public:
+  HandshakeJob(OpenSSLAdapter* adapter, SSL* ssl, BIO* network_bio)
+    : adapter_(adapter), ssl_(ssl), network_bio_(network_bio),
+      ran_(false), code_(0), error_(SSL_ERROR_NONE) {
+  }
+
+  void Orphan() {
+    CritScope cs(&crit_);
+    adapter_ = NULL;
+  }
+
+  virtual void OnMessage(Message* msg) {
+    if (!ran_) {
+      CritScope cs(&crit_);
+      ran_ = true;
+      if (adapter_) {
+        // The error queue is per thread, so leave nothing for the next job.
+        ERR_clear_error();
+        code_ = SSL_connect(ssl_);
+        error_ = SSL_get_error(ssl_, code_);
+        ERR_clear_error();
+      }
+      return;
+    }
+    if (adapter_) {
+      adapter_->OnHandshakeStep(code_, error_);
+    } else {
+      SSL_free(ssl_);
+      BIO_free(network_bio_);
+    }
+    delete this;
+  }
+
+ private:
+  CriticalSection crit_;
+  OpenSSLAdapter* adapter_;
+  SSL* ssl_;
+  BIO* network_bio_;
+  bool ran_;
+  int code_;
+  int error_;
+};
+
+// Guards the setup below, which is done once. ssl_initialized is also read
+// without it, to make the check on each use cheap.
+static CriticalSection ssl_init_crit;
+static volatile uint32 ssl_initialized = 0;
 
 bool OpenSSLAdapter::InitializeSSL(VerificationCallback callback) {
+  custom_verify_callback_ = callback;
+  return EnsureInitialized();
+}
+
+bool OpenSSLAdapter::EnsureInitialized() {
+  if (AtomicOps::AcquireLoad(&ssl_initialized))
+    return true;
+  CritScope cs(&ssl_init_crit);
+  if (ssl_initialized)
+    return true;
   if (!InitializeSSLThread() || !SSL_library_init())
   	  return false;
   SSL_load_error_strings();
   ERR_load_BIO_strings();
   OpenSSL_add_all_algorithms();
   RAND_poll();
-  custom_verify_callback_ = callback;
+  AtomicOps::ReleaseStore(&ssl_initialized, 1);
   return true;
 }
 
+bool OpenSSLAdapter::Prewarm() {
+  if (!EnsureInitialized())
+    return false;
+  if (OpenSSLSessionCache::GetContext(OpenSSLSessionCache::ADAPTER_CONTEXT))
+    return true;
+  SSL_CTX* ctx = SetupSSLContext();
+  if (!ctx)
+    return false;
+  return OpenSSLSessionCache::ShareContext(
+      OpenSSLSessionCache::ADAPTER_CONTEXT, ctx) != NULL;
+}
+
 bool OpenSSLAdapter::InitializeSSLThread() {
+  // The locks are for the whole process, and only made once.
+  CritScope cs(&ssl_init_crit);
+  if (mutex_buf)
+    return true;
   mutex_buf = new MUTEX_TYPE[CRYPTO_num_locks()];
   if (!mutex_buf)
     return false;
@@ -217,8 +318,10 @@ bool OpenSSLAdapter::InitializeSSLThread() {
 }
 
 bool OpenSSLAdapter::CleanupSSL() {
+  CritScope cs(&ssl_init_crit);
   if (!mutex_buf)
     return false;
+  AtomicOps::ReleaseStore(&ssl_initialized, 0);
   CRYPTO_set_id_callback(NULL);
   CRYPTO_set_locking_callback(NULL);
   CRYPTO_set_dynlock_create_callback(NULL);
@@ -231,6 +334,59 @@ bool OpenSSLAdapter::CleanupSSL() {
   return true;
 }
 
+void OpenSSLAdapter::SetHandshakePool(ThreadPool* pool) {
+  handshake_pool_default_ = pool;
+}
+
+void OpenSSLAdapter::SetKernelTls(bool enable) {
+  kernel_tls_ = enable;
+}
+
+void OpenSSLAdapter::SetLeanMemory(bool enable) {
+  lean_memory_ = enable;
+}
+
+void OpenSSLAdapter::SetMemoryBio(bool enable) {
+  memory_bio_ = enable;
+}
+
+void OpenSSLAdapter::SetBufferModes(SSL* ssl) {
+  SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                    SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_MODE_RELEASE_BUFFERS
+  // The buffers go back to the free list of the context, which all client
+  // connections share, so an idle connection holds none.
+  if (lean_memory_)
+    SSL_set_mode(ssl, SSL_MODE_RELEASE_BUFFERS);
+#endif
+}
+
+size_t OpenSSLAdapter::RecordBufferMemory(const SSL* ssl) {
+  if (!ssl)
+    return 0;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  if (!ssl->s3)
+    return 0;
+  return (ssl->s3->rbuf.buf ? ssl->s3->rbuf.len : 0) +
+         (ssl->s3->wbuf.buf ? ssl->s3->wbuf.len : 0);
+#else
+  return 0;
+#endif
+}
+
+size_t OpenSSLAdapter::FreeRecordBuffers(SSL* ssl) {
+  if (!ssl)
+    return 0;
+  size_t before = RecordBufferMemory(ssl);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  // Fails, keeping them, while a record is part way through.
+  SSL_free_buffers(ssl);
+#elif defined(SSL_MODE_RELEASE_BUFFERS)
+  SSL_set_mode(ssl, SSL_MODE_RELEASE_BUFFERS);
+#endif
+  return before - RecordBufferMemory(ssl);
+}
+
 OpenSSLAdapter::OpenSSLAdapter(AsyncSocket* socket)
   : SSLAdapter(socket),
     state_(SSL_NONE),
@@ -238,6 +394,8 @@ OpenSSLAdapter::OpenSSLAdapter(AsyncSocket* socket)
     ssl_write_needs_read_(false),
     restartable_(false),
     ssl_(NULL), ssl_ctx_(NULL),
+    handshake_pool_(NULL), network_bio_(NULL), handshake_job_(NULL),
+    handshake_input_(false), kernel_tls_tx_(false),
     custom_verification_succeeded_(false) {
 }
 
@@ -271,20 +429,46 @@ int
 OpenSSLAdapter::BeginSSL() {
   LOG(LS_INFO) << "BeginSSL: " << ssl_host_name_;
   ASSERT(state_ == SSL_CONNECTING);
+  TXMPP_TRACE1(tls_handshake_start, this);
 
   int err = 0;
   BIO* bio = NULL;
 
-  // First set up the context
-  if (!ssl_ctx_)
-    ssl_ctx_ = SetupSSLContext();
+  // First set up OpenSSL and the context, which all connections share
+  if (!EnsureInitialized()) {
+    err = -1;
+    goto ssl_error;
+  }
+  if (!ssl_ctx_) {
+    ssl_ctx_ = OpenSSLSessionCache::GetContext(
+        OpenSSLSessionCache::ADAPTER_CONTEXT);
+    if (!ssl_ctx_) {
+      if (SSL_CTX* ctx = SetupSSLContext())
+        ssl_ctx_ = OpenSSLSessionCache::ShareContext(
+            OpenSSLSessionCache::ADAPTER_CONTEXT, ctx);
+    }
+  }
 
   if (!ssl_ctx_) {
     err = -1;
     goto ssl_error;
   }
 
-  bio = BIO_new_socket(static_cast<AsyncSocketAdapter*>(socket_));
+  // A step on the handshake pool mustn't touch the socket, so the SSL object
+  // is given one half of a BIO pair, and we move the bytes of the other. In
+  // memory BIO mode that is done for its own sake.
+  handshake_pool_ = handshake_pool_default_;
+  if (handshake_pool_ || memory_bio_) {
+    size_t pair_size = lean_memory_ ? kLeanPairSize : kBulkPairSize;
+    if (!BIO_new_bio_pair(&bio, pair_size, &network_bio_, pair_size)) {
+      bio = network_bio_ = NULL;
+      err = -1;
+      goto ssl_error;
+    }
+    handshake_input_ = true;
+  } else {
+    bio = BIO_new_socket(static_cast<AsyncSocketAdapter*>(socket_));
+  }
   if (!bio) {
     err = -1;
     goto ssl_error;
@@ -298,13 +482,35 @@ OpenSSLAdapter::BeginSSL() {
 
   SSL_set_app_data(ssl_, this);
 
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  if (!alpn_protocols().empty()) {
+    // Each protocol as a length byte and its name.
+    std::string protos;
+    for (size_t i = 0; i < alpn_protocols().size(); ++i) {
+      const std::string& protocol = alpn_protocols()[i];
+      ASSERT(!protocol.empty() && (protocol.size() < 256));
+      protos.push_back(static_cast<char>(protocol.size()));
+      protos.append(protocol);
+    }
+    if (SSL_set_alpn_protos(ssl_,
+                            reinterpret_cast<const unsigned char*>(
+                                protos.data()),
+                            protos.size()) != 0) {
+      err = -1;
+      goto ssl_error;
+    }
+  }
+#endif  // OPENSSL_VERSION_NUMBER >= 0x10002000L
+
   SSL_set_bio(ssl_, bio, bio);
-  SSL_set_mode(ssl_, SSL_MODE_ENABLE_PARTIAL_WRITE |
-                     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SetBufferModes(ssl_);
 
   // the SSL object owns the bio now
   bio = NULL;
 
+  // Resume the last session with this server, if there is one
+  OpenSSLSessionCache::Apply(ssl_, ssl_host_name_);
+
   // Do the connect
   err = ContinueSSL();
   if (err != 0)
@@ -325,8 +531,59 @@ OpenSSLAdapter::ContinueSSL() {
   LOG(LS_INFO) << "ContinueSSL";
   ASSERT(state_ == SSL_CONNECTING);
 
-  int code = SSL_connect(ssl_);
-  switch (SSL_get_error(ssl_, code)) {
+  if (!handshake_pool_) {
+    if (network_bio_) {
+      if (int err = PumpIn())
+        return err;
+    }
+    int code = SSL_connect(ssl_);
+    int error = SSL_get_error(ssl_, code);
+    if (network_bio_) {
+      if (int err = FlushOut())
+        return err;
+    }
+    return FinishHandshakeStep(code, error);
+  }
+
+  // Events that come while a step is running are picked up when it is done
+  if (handshake_job_)
+    return 0;
+
+  if (int err = FlushOut())
+    return err;
+  if (int err = PumpIn())
+    return err;
+  if (!handshake_input_)
+    return 0;
+
+  handshake_input_ = false;
+  handshake_job_ = new HandshakeJob(this, ssl_, network_bio_);
+  handshake_pool_->Post(handshake_job_, 0, NULL, handshake_job_);
+  return 0;
+}
+
+void
+OpenSSLAdapter::OnHandshakeStep(int code, int error) {
+  ASSERT(state_ == SSL_CONNECTING);
+  handshake_job_ = NULL;
+
+  if (error == SSL_ERROR_WANT_WRITE)
+    handshake_input_ = true;
+
+  int err = FlushOut();
+  if (!err)
+    err = FinishHandshakeStep(code, error);
+  // Once connected we may be gone already, so look at nothing but |error|
+  if (!err &&
+      ((error == SSL_ERROR_WANT_READ) || (error == SSL_ERROR_WANT_WRITE)))
+    err = ContinueSSL();
+  if (err)
+    Error("ContinueSSL", err);
+}
+
+int
+OpenSSLAdapter::FinishHandshakeStep(int code, int error) {
+  switch (error) {
   case SSL_ERROR_NONE:
     LOG(LS_INFO) << " -- success";
 
@@ -338,7 +595,11 @@ OpenSSLAdapter::ContinueSSL() {
       return -1;
     }
 
+    OpenSSLSessionCache::Store(ssl_, ssl_host_name_);
+    if (kernel_tls_ && StartKernelTls())
+      LOG(LS_INFO) << " -- kernel TLS";
     state_ = SSL_CONNECTED;
+    TXMPP_TRACE2(tls_handshake_end, this, 0);
     AsyncSocketAdapter::OnConnectEvent(this);
 #if 0  // TODO: worry about this
     // Don't let ourselves go away during the callbacks
@@ -371,6 +632,11 @@ void
 OpenSSLAdapter::Error(const char* context, int err, bool signal) {
   LOG(LS_WARNING) << "SChannelAdapter::Error("
                   << context << ", " << err << ")";
+  // A session that fails to resume shouldn't be offered again.
+  if (state_ == SSL_CONNECTING) {
+    OpenSSLSessionCache::Remove(ssl_host_name_);
+    TXMPP_TRACE2(tls_handshake_end, this, err);
+  }
   state_ = SSL_ERROR;
   SetError(err);
   if (signal)
@@ -386,15 +652,209 @@ OpenSSLAdapter::Cleanup() {
   ssl_write_needs_read_ = false;
   custom_verification_succeeded_ = false;
 
+  // A running step owns the SSL object and the BIO pair from now on
+  if (handshake_job_) {
+    handshake_job_->Orphan();
+    handshake_job_ = NULL;
+    ssl_ = NULL;
+    network_bio_ = NULL;
+  }
+
   if (ssl_) {
     SSL_free(ssl_);
     ssl_ = NULL;
   }
 
-  if (ssl_ctx_) {
-    SSL_CTX_free(ssl_ctx_);
-    ssl_ctx_ = NULL;
+  if (network_bio_) {
+    BIO_free(network_bio_);
+    network_bio_ = NULL;
   }
+  handshake_pool_ = NULL;
+  handshake_input_ = false;
+  kernel_tls_tx_ = false;
+
+  // The context is shared, and only OpenSSLSessionCache frees it.
+  ssl_ctx_ = NULL;
+}
+
+int
+OpenSSLAdapter::PumpIn() {
+  ASSERT(network_bio_ != NULL);
+  while (BIO_ctrl_get_write_guarantee(network_bio_) > 0) {
+    char* buf;
+    int len = BIO_nwrite0(network_bio_, &buf);
+    if (len <= 0)
+      break;
+    int result = AsyncSocketAdapter::Recv(buf, len);
+    if (result > 0) {
+      BIO_nwrite(network_bio_, &buf, result);
+      handshake_input_ = true;
+      // A short read most likely emptied the socket
+      if (result < len)
+        break;
+      continue;
+    }
+    if (result == 0) {
+      // Let OpenSSL see the end of the stream
+      BIO_shutdown_wr(network_bio_);
+      handshake_input_ = true;
+      break;
+    }
+    if (IsBlocking())
+      break;
+    return GetError() ? GetError() : -1;
+  }
+  return 0;
+}
+
+int
+OpenSSLAdapter::FlushOut() {
+  ASSERT(network_bio_ != NULL);
+  while (BIO_ctrl_pending(network_bio_) > 0) {
+    char* buf;
+    int len = BIO_nread0(network_bio_, &buf);
+    if (len <= 0)
+      break;
+    int result = AsyncSocketAdapter::Send(buf, len);
+    if (result > 0) {
+      BIO_nread(network_bio_, &buf, result);
+      continue;
+    }
+    if (IsBlocking())
+      break;
+    return GetError() ? GetError() : -1;
+  }
+  return 0;
+}
+
+#if OPENSSL_KERNEL_TLS
+
+// Computes the first |len| bytes of the key block of a TLS 1.2 session
+// (RFC 5246, sections 5 and 6.3), which OpenSSL doesn't keep.
+static bool TlsKeyBlock(SSL* ssl, const EVP_MD* md,
+                        unsigned char* out, size_t len) {
+  static const char kLabel[] = "key expansion";
+  unsigned char seed[sizeof(kLabel) - 1 + 2 * SSL3_RANDOM_SIZE];
+  memcpy(seed, kLabel, sizeof(kLabel) - 1);
+  memcpy(seed + sizeof(kLabel) - 1, ssl->s3->server_random,
+         SSL3_RANDOM_SIZE);
+  memcpy(seed + sizeof(kLabel) - 1 + SSL3_RANDOM_SIZE,
+         ssl->s3->client_random, SSL3_RANDOM_SIZE);
+
+  const unsigned char* secret = ssl->session->master_key;
+  int secret_len = ssl->session->master_key_length;
+  size_t md_len = EVP_MD_size(md);
+
+  // A(i) followed by the seed, so that both HMACs of P_hash can use it
+  unsigned char a[EVP_MAX_MD_SIZE + sizeof(seed)];
+  memcpy(a + md_len, seed, sizeof(seed));
+  if (!HMAC(md, secret, secret_len, seed, sizeof(seed), a, NULL))
+    return false;
+
+  unsigned char chunk[EVP_MAX_MD_SIZE];
+  while (len > 0) {
+    if (!HMAC(md, secret, secret_len, a, md_len + sizeof(seed), chunk, NULL))
+      return false;
+    size_t take = _min(len, md_len);
+    memcpy(out, chunk, take);
+    out += take;
+    len -= take;
+    if (!HMAC(md, secret, secret_len, a, md_len, a, NULL))
+      return false;
+  }
+  OPENSSL_cleanse(a, sizeof(a));
+  OPENSSL_cleanse(chunk, sizeof(chunk));
+  return true;
+}
+
+// Fills in one of the tls12_crypto_info_aes_gcm_* structures. The explicit
+// nonces only need to be unique, and the kernel counts them on from the
+// sequence number rather than from OpenSSL's random start.
+template <class CryptoInfo>
+static void FillCryptoInfo(CryptoInfo* info, int cipher_type,
+                           const unsigned char* key,
+                           const unsigned char* salt,
+                           const unsigned char* seq) {
+  memset(info, 0, sizeof(*info));
+  info->info.version = TLS_1_2_VERSION;
+  info->info.cipher_type = cipher_type;
+  memcpy(info->key, key, sizeof(info->key));
+  memcpy(info->salt, salt, sizeof(info->salt));
+  memcpy(info->iv, seq, sizeof(info->iv));
+  memcpy(info->rec_seq, seq, sizeof(info->rec_seq));
+}
+
+#endif  // OPENSSL_KERNEL_TLS
+
+bool
+OpenSSLAdapter::StartKernelTls() {
+#if OPENSSL_KERNEL_TLS
+  // Whatever OpenSSL still has to send must go before the kernel's records
+  if (network_bio_ && (BIO_ctrl_pending(network_bio_) > 0))
+    return false;
+  if ((SSL_version(ssl_) != TLS1_2_VERSION) ||
+      SSL_get_current_compression(ssl_) || !ssl_->enc_write_ctx)
+    return false;
+
+  size_t key_len = 0;
+  int cipher_type = 0;
+  switch (EVP_CIPHER_CTX_nid(ssl_->enc_write_ctx)) {
+  case NID_aes_128_gcm:
+    key_len = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+    cipher_type = TLS_CIPHER_AES_GCM_128;
+    break;
+#ifdef TLS_CIPHER_AES_GCM_256
+  case NID_aes_256_gcm:
+    key_len = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+    cipher_type = TLS_CIPHER_AES_GCM_256;
+    break;
+#endif
+  default:
+    return false;
+  }
+
+  // The GCM suites use the PRF of their name's hash, and the key block
+  // holds the client and server keys, then their implicit nonces.
+  const char* name = SSL_CIPHER_get_name(SSL_get_current_cipher(ssl_));
+  const EVP_MD* md = strstr(name, "SHA384") ? EVP_sha384() : EVP_sha256();
+  static const size_t kSaltSize = TLS_CIPHER_AES_GCM_128_SALT_SIZE;
+  unsigned char block[2 * 32 + 2 * kSaltSize];
+  if (!TlsKeyBlock(ssl_, md, block, 2 * key_len + 2 * kSaltSize))
+    return false;
+  const unsigned char* key = block;
+  const unsigned char* salt = block + 2 * key_len;
+  const unsigned char* seq = ssl_->s3->write_sequence;
+
+  bool started = false;
+  if (cipher_type == TLS_CIPHER_AES_GCM_128) {
+    tls12_crypto_info_aes_gcm_128 info;
+    FillCryptoInfo(&info, cipher_type, key, salt, seq);
+    started = socket_->StartKernelTls(&info, sizeof(info));
+    OPENSSL_cleanse(&info, sizeof(info));
+#ifdef TLS_CIPHER_AES_GCM_256
+  } else {
+    tls12_crypto_info_aes_gcm_256 info;
+    FillCryptoInfo(&info, cipher_type, key, salt, seq);
+    started = socket_->StartKernelTls(&info, sizeof(info));
+    OPENSSL_cleanse(&info, sizeof(info));
+#endif
+  }
+  OPENSSL_cleanse(block, sizeof(block));
+  if (!started)
+    return false;
+
+  // OpenSSL mustn't write records of its own any more. Anything it tries,
+  // such as answering a renegotiation, ends up in the null BIO, and Recv
+  // fails the connection when it sees that.
+  BIO* sink = BIO_new(BIO_s_null());
+  if (!sink)
+    return false;
+  SSL_set_bio(ssl_, SSL_get_rbio(ssl_), sink);
+  kernel_tls_tx_ = true;
+  return true;
+#else
+  return false;
+#endif  // OPENSSL_KERNEL_TLS
 }
 
 //
@@ -426,10 +886,21 @@ OpenSSLAdapter::Send(const void* pv, size_t cb) {
   if (cb == 0)
     return 0;
 
+  if (kernel_tls_tx_)
+    return AsyncSocketAdapter::Send(pv, cb);
+
   ssl_write_needs_read_ = false;
 
   int code = SSL_write(ssl_, pv, cb);
-  switch (SSL_get_error(ssl_, code)) {
+  int error = SSL_get_error(ssl_, code);
+  if (network_bio_) {
+    // What doesn't go out now waits in the pair for OnWriteEvent
+    if (int err = FlushOut()) {
+      Error("SSL_write", err, false);
+      return SOCKET_ERROR;
+    }
+  }
+  switch (error) {
   case SSL_ERROR_NONE:
     //LOG(LS_INFO) << " -- success";
     return code;
@@ -456,6 +927,46 @@ OpenSSLAdapter::Send(const void* pv, size_t cb) {
   return SOCKET_ERROR;
 }
 
+int
+OpenSSLAdapter::SendV(const IoVec* vec, size_t count) {
+  if (state_ != SSL_CONNECTED)
+    return SendEach(vec, count);
+
+  // The kernel encrypts, so the buffers can go out in one system call
+  if (kernel_tls_tx_)
+    return socket_->SendV(vec, count);
+
+  if (!network_bio_)
+    return SendEach(vec, count);
+
+  // Encrypt as many of the buffers as the pair takes, then send their
+  // records with one write. The pair starts over at the front of its buffer
+  // whenever it is drained, so they are usually all in one piece.
+  ssl_write_needs_read_ = false;
+  int total = 0;
+  size_t i = 0;
+  for (; i < count; ++i) {
+    if (vec[i].len == 0)
+      continue;
+    int code = SSL_write(ssl_, vec[i].data, vec[i].len);
+    if (code <= 0)
+      break;
+    total += code;
+    if (static_cast<size_t>(code) < vec[i].len)
+      break;
+  }
+
+  // Nothing went in, so let Send retry the buffer and sort out the error
+  if (total == 0)
+    return (i < count) ? Send(vec[i].data, vec[i].len) : 0;
+
+  if (int err = FlushOut()) {
+    Error("SSL_write", err, false);
+    return SOCKET_ERROR;
+  }
+  return total;
+}
+
 int
 OpenSSLAdapter::Recv(void* pv, size_t cb) {
   //LOG(LS_INFO) << "OpenSSLAdapter::Recv(" << cb << ")";
@@ -483,8 +994,29 @@ OpenSSLAdapter::Recv(void* pv, size_t cb) {
 
   ssl_read_needs_write_ = false;
 
+  // Only go to the socket once what the pair holds is used up
   int code = SSL_read(ssl_, pv, cb);
-  switch (SSL_get_error(ssl_, code)) {
+  int error = SSL_get_error(ssl_, code);
+  if (network_bio_ && (error == SSL_ERROR_WANT_READ)) {
+    if (int err = PumpIn()) {
+      Error("SSL_read", err, false);
+      return SOCKET_ERROR;
+    }
+    code = SSL_read(ssl_, pv, cb);
+    error = SSL_get_error(ssl_, code);
+  }
+  if (kernel_tls_tx_ && (BIO_number_written(SSL_get_wbio(ssl_)) > 0)) {
+    LOG(LS_WARNING) << "OpenSSL tried to send under kernel TLS";
+    Error("SSL_read", -1, false);
+    return SOCKET_ERROR;
+  }
+  if (network_bio_) {
+    if (int err = FlushOut()) {
+      Error("SSL_read", err, false);
+      return SOCKET_ERROR;
+    }
+  }
+  switch (error) {
   case SSL_ERROR_NONE:
     //LOG(LS_INFO) << " -- success";
     return code;
@@ -529,6 +1061,39 @@ OpenSSLAdapter::GetState() const {
   return state;
 }
 
+size_t
+OpenSSLAdapter::MemoryUsage() const {
+  // A step on the handshake pool may be changing the record buffers
+  size_t usage = handshake_job_ ? 0 : RecordBufferMemory(ssl_);
+  if (network_bio_) {
+    // Both halves of the pair, which are the same size
+    usage += 2 * BIO_get_write_buf_size(network_bio_, 0);
+  }
+  return usage;
+}
+
+size_t
+OpenSSLAdapter::TrimMemory() {
+  // A step on the handshake pool may be using the record buffers
+  if (state_ != SSL_CONNECTED || handshake_job_)
+    return 0;
+  return FreeRecordBuffers(ssl_);
+}
+
+std::string
+OpenSSLAdapter::GetAlpnProtocol() const {
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  if (state_ == SSL_CONNECTED) {
+    const unsigned char* protocol = NULL;
+    unsigned int len = 0;
+    SSL_get0_alpn_selected(ssl_, &protocol, &len);
+    if (protocol)
+      return std::string(reinterpret_cast<const char*>(protocol), len);
+  }
+#endif  // OPENSSL_VERSION_NUMBER >= 0x10002000L
+  return std::string();
+}
+
 void
 OpenSSLAdapter::OnConnectEvent(AsyncSocket* socket) {
   LOG(LS_INFO) << "OpenSSLAdapter::OnConnectEvent";
@@ -593,6 +1158,13 @@ OpenSSLAdapter::OnWriteEvent(AsyncSocket* socket) {
   if (state_ != SSL_CONNECTED)
     return;
 
+  if (network_bio_) {
+    if (int err = FlushOut()) {
+      Error("FlushOut", err);
+      return;
+    }
+  }
+
   // Don't let ourselves go away during the callbacks
   //PRefPtr<OpenSSLAdapter> lock(this); // TODO: fix this
 
@@ -819,21 +1391,8 @@ OpenSSLAdapter::SSLVerifyCallback(int ok, X509_STORE_CTX* store) {
 }
 
 bool OpenSSLAdapter::ConfigureTrustedRootCertificates(SSL_CTX* ctx) {
-  // Add the root cert to the SSL context
-  // TODO(sdoyon): this cert appears to be the wrong one.
-#if OPENSSL_VERSION_NUMBER >= 0x0090800fL
-   const unsigned char* cert_buffer
-#else
-   unsigned char* cert_buffer
-#endif
-    = EquifaxSecureGlobalEBusinessCA1_certificate;
-  size_t cert_buffer_len = sizeof(EquifaxSecureGlobalEBusinessCA1_certificate);
-  X509* cert = d2i_X509(NULL, &cert_buffer, cert_buffer_len);
-  if (cert == NULL)
-    return false;
-  bool success = X509_STORE_add_cert(SSL_CTX_get_cert_store(ctx), cert);
-  X509_free(cert);
-  return success;
+  // The roots are parsed once, and verified chains are remembered
+  return OpenSSLCertStore::Configure(ctx);
 }
 
 SSL_CTX*
@@ -847,6 +1406,10 @@ OpenSSLAdapter::SetupSSLContext() {
     return NULL;
   }
 
+  // Sessions are kept by OpenSSLSessionCache, by server name.
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                      SSL_SESS_CACHE_NO_INTERNAL_STORE);
+
 #ifdef _DEBUG
   SSL_CTX_set_info_callback(ctx, SSLInfoCallback);
 #endif
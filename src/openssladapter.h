@@ -35,12 +35,15 @@
 #include <string>
 #include "ssladapter.h"
 
+typedef struct bio_st BIO;
 typedef struct ssl_st SSL;
 typedef struct ssl_ctx_st SSL_CTX;
 typedef struct x509_store_ctx_st X509_STORE_CTX;
 
 namespace txmpp {
 
+class ThreadPool;
+
 ///////////////////////////////////////////////////////////////////////////////
 
 class OpenSSLAdapter : public SSLAdapter {
@@ -48,18 +51,57 @@ public:
   static bool InitializeSSL(VerificationCallback callback);
   static bool InitializeSSLThread();
   static bool CleanupSSL();
+  // Sets up OpenSSL the first time it is called, from any thread, and
+  // returns whether it is set up. The adapters, and key generation, call it
+  // as they first need OpenSSL, so a process that never does pays nothing.
+  static bool EnsureInitialized();
+  // Sets up OpenSSL, and the context client connections share with the
+  // trusted roots parsed into it, so that the first handshake doesn't wait
+  // on either. For long-running services, at startup.
+  static bool Prewarm();
+
+  // Runs the handshakes of adapters that begin SSL from now on as steps on
+  // |pool|, so the key exchange doesn't hold up the other sockets of their
+  // thread, which must be a Thread. NULL, the default, runs them inline.
+  // The pool must outlive those handshakes.
+  static void SetHandshakePool(ThreadPool* pool);
+  // Has connections established from now on hand the encryption of what
+  // they send to the kernel (Linux kTLS, for TLS 1.2 with AES-GCM), so that
+  // Send and SendV go straight to the socket. Reading stays with OpenSSL.
+  // Connections that can't, or whose socket can't, carry on as before.
+  static void SetKernelTls(bool enable);
+
+  // Has connections set up from now on, of this class and of
+  // OpenSSLStreamAdapter, let go of OpenSSL's record buffers whenever they
+  // are idle and take them from the shared context's free list again when
+  // a record comes or goes, and keep smaller buffers of their own.
+  static void SetLeanMemory(bool enable);
+
+  // Has connections set up from now on give OpenSSL memory BIOs instead of
+  // the socket. The adapter then reads from the socket in large chunks and
+  // sends the records of a Send, or of all the buffers of a SendV, with one
+  // write, which saves system calls and calls through the socket BIO.
+  static void SetMemoryBio(bool enable);
 
   OpenSSLAdapter(AsyncSocket* socket);
   virtual ~OpenSSLAdapter();
 
   virtual int StartSSL(const char* hostname, bool restartable);
   virtual int Send(const void* pv, size_t cb);
+  virtual int SendV(const IoVec* vec, size_t count);
   virtual int Recv(void* pv, size_t cb);
   virtual int Close();
 
   // Note that the socket returns ST_CONNECTING while SSL is being negotiated.
   virtual ConnState GetState() const;
 
+  // The bytes of TLS buffers the connection holds now: OpenSSL's record
+  // buffers and the BIO pair, if there is one.
+  size_t MemoryUsage() const;
+  // Frees OpenSSL's record buffers; the BIO pair stays.
+  virtual size_t TrimMemory();
+  virtual std::string GetAlpnProtocol() const;
+
 protected:
   virtual void OnConnectEvent(AsyncSocket* socket);
   virtual void OnReadEvent(AsyncSocket* socket);
@@ -71,8 +113,24 @@ private:
     SSL_NONE, SSL_WAIT, SSL_CONNECTING, SSL_CONNECTED, SSL_ERROR
   };
 
+  class HandshakeJob;
+  friend class HandshakeJob;
+
   int BeginSSL();
   int ContinueSSL();
+  // Acts on the result of SSL_connect.
+  int FinishHandshakeStep(int code, int error);
+  // Called back on our thread once a step posted by ContinueSSL has run.
+  void OnHandshakeStep(int code, int error);
+  // In memory BIO mode, and with a handshake pool, the SSL object talks to
+  // network_bio_ instead of the socket. PumpIn moves what the socket has
+  // into it, up to the first short read, and FlushOut sends what OpenSSL
+  // wrote to it; both return 0 or a socket error.
+  int PumpIn();
+  int FlushOut();
+  // Moves the write side of the established connection into the kernel.
+  // Returns false if the connection stays as it is.
+  bool StartKernelTls();
   void Error(const char* context, int err, bool signal = true);
   void Cleanup();
 
@@ -84,8 +142,27 @@ private:
 #endif  // !_DEBUG
   static int SSLVerifyCallback(int ok, X509_STORE_CTX* store);
   static VerificationCallback custom_verify_callback_;
+  static ThreadPool* handshake_pool_default_;
+  static bool kernel_tls_;
+  static bool lean_memory_;
+  static bool memory_bio_;
+  // The size of each half of the BIO pair in lean mode, through which
+  // records then pass in pieces.
+  static const size_t kLeanPairSize = 4096;
+  // Otherwise, room for a few full records each way.
+  static const size_t kBulkPairSize = 65536;
   friend class OpenSSLStreamAdapter;  // for custom_verify_callback_;
 
+  // Sets the buffer modes of |ssl|, as SetLeanMemory asks.
+  static void SetBufferModes(SSL* ssl);
+  // The bytes of record buffers |ssl| holds, where OpenSSL lets us see.
+  // OpenSSLStreamAdapter uses both as well.
+  static size_t RecordBufferMemory(const SSL* ssl);
+  // Has |ssl| free its record buffers, or with an OpenSSL too old for that,
+  // free them whenever they are empty from the next record on. Returns the
+  // bytes freed that RecordBufferMemory sees.
+  static size_t FreeRecordBuffers(SSL* ssl);
+
   static bool ConfigureTrustedRootCertificates(SSL_CTX* ctx);
   static SSL_CTX* SetupSSLContext();
 
@@ -99,6 +176,16 @@ private:
   SSL_CTX* ssl_ctx_;
   std::string ssl_host_name_;
 
+  // The handshake pool and the network half of the BIO pair, if this
+  // connection uses one, and the step running on it. handshake_input_ is
+  // set while there is something for the next step to work on.
+  ThreadPool* handshake_pool_;
+  BIO* network_bio_;
+  HandshakeJob* handshake_job_;
+  bool handshake_input_;
+  // Set once the kernel encrypts what we send.
+  bool kernel_tls_tx_;
+
   bool custom_verification_succeeded_;
 };
 
@@ -0,0 +1,167 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "opensslcertstore.h"
+
+#if HAVE_OPENSSL_SSL_H
+
+#include <map>
+#include <string>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "criticalsection.h"
+#include "logging.h"
+#include "time.h"
+#include "Equifax_Secure_Global_eBusiness_CA-1.h"
+
+namespace txmpp {
+
+const size_t OpenSSLCertStore::kMaxVerified;
+const int OpenSSLCertStore::kVerifiedLifetime;
+
+// When the chain of each leaf was last verified in full, by fingerprint.
+typedef std::map<std::string, uint32> VerifiedMap;
+
+static CriticalSection cert_store_crit;
+static X509_STORE* cert_store_store = NULL;
+static VerifiedMap* cert_store_verified = NULL;
+static OpenSSLCertStore::Stats cert_store_stats;
+
+static X509_STORE* BuildStore() {
+  X509_STORE* store = X509_STORE_new();
+  if (!store)
+    return NULL;
+
+  // TODO(sdoyon): this cert appears to be the wrong one.
+#if OPENSSL_VERSION_NUMBER >= 0x0090800fL
+  const unsigned char* cert_buffer
+#else
+  unsigned char* cert_buffer
+#endif
+    = EquifaxSecureGlobalEBusinessCA1_certificate;
+  size_t cert_buffer_len = sizeof(EquifaxSecureGlobalEBusinessCA1_certificate);
+  X509* cert = d2i_X509(NULL, &cert_buffer, cert_buffer_len);
+  bool success = cert && X509_STORE_add_cert(store, cert);
+  if (cert)
+    X509_free(cert);
+  if (!success) {
+    X509_STORE_free(store);
+    return NULL;
+  }
+  return store;
+}
+
+static std::string Fingerprint(X509* cert) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len = 0;
+  if (!cert || !X509_digest(cert, EVP_sha256(), digest, &digest_len))
+    return std::string();
+  return std::string(reinterpret_cast<char*>(digest), digest_len);
+}
+
+bool OpenSSLCertStore::Configure(SSL_CTX* ctx) {
+  CritScope cs(&cert_store_crit);
+  if (!cert_store_store) {
+    cert_store_store = BuildStore();
+    if (!cert_store_store)
+      return false;
+  }
+
+  // The context frees its store, so it gets a reference of its own
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  X509_STORE_up_ref(cert_store_store);
+#else
+  CRYPTO_add(&cert_store_store->references, 1, CRYPTO_LOCK_X509_STORE);
+#endif
+  SSL_CTX_set_cert_store(ctx, cert_store_store);
+  SSL_CTX_set_cert_verify_callback(ctx, VerifyChain, NULL);
+  return true;
+}
+
+int OpenSSLCertStore::VerifyChain(X509_STORE_CTX* store, void* arg) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  X509* leaf = X509_STORE_CTX_get0_cert(store);
+#else
+  X509* leaf = store->cert;
+#endif
+  std::string fingerprint = Fingerprint(leaf);
+
+  if (!fingerprint.empty() &&
+      (X509_cmp_current_time(X509_get_notAfter(leaf)) > 0)) {
+    CritScope cs(&cert_store_crit);
+    if (cert_store_verified) {
+      VerifiedMap::iterator it = cert_store_verified->find(fingerprint);
+      if (it != cert_store_verified->end()) {
+        if (TimeSince(it->second) < kVerifiedLifetime) {
+          ++cert_store_stats.hits;
+          X509_STORE_CTX_set_error(store, X509_V_OK);
+          return 1;
+        }
+        cert_store_verified->erase(it);
+      }
+    }
+  }
+
+  int ok = X509_verify_cert(store);
+
+  // A chain that only passed because the verify callback let an error go
+  // must be looked at again the next time.
+  bool clean = (ok > 0) && (X509_STORE_CTX_get_error(store) == X509_V_OK);
+
+  CritScope cs(&cert_store_crit);
+  ++cert_store_stats.misses;
+  if (clean && !fingerprint.empty()) {
+    if (!cert_store_verified)
+      cert_store_verified = new VerifiedMap;
+    if (cert_store_verified->size() >= kMaxVerified)
+      cert_store_verified->erase(cert_store_verified->begin());
+    (*cert_store_verified)[fingerprint] = Time();
+  }
+  return ok;
+}
+
+void OpenSSLCertStore::GetStats(Stats* stats) {
+  CritScope cs(&cert_store_crit);
+  *stats = cert_store_stats;
+}
+
+void OpenSSLCertStore::Clear() {
+  CritScope cs(&cert_store_crit);
+  delete cert_store_verified;
+  cert_store_verified = NULL;
+  if (cert_store_store) {
+    X509_STORE_free(cert_store_store);
+    cert_store_store = NULL;
+  }
+}
+
+}  // namespace txmpp
+
+#endif  // HAVE_OPENSSL_SSL_H
@@ -0,0 +1,81 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_OPENSSLCERTSTORE_H_
+#define _TXMPP_OPENSSLCERTSTORE_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+
+#include "basictypes.h"
+
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct x509_store_ctx_st X509_STORE_CTX;
+
+namespace txmpp {
+
+// The trusted roots, parsed once into an X509_STORE that every SSL_CTX of
+// OpenSSLAdapter and OpenSSLStreamAdapter shares, and the leaf
+// certificates whose chains it has lately verified, by SHA-256
+// fingerprint, so that connecting to the same server again skips building
+// and checking the path. All of it may be used from any thread.
+class OpenSSLCertStore {
+ public:
+  struct Stats {
+    uint32 hits;    // Chains taken as verified from the cache.
+    uint32 misses;  // Chains verified in full.
+  };
+
+  // Gives |ctx| the shared store, building it first if need be, and has it
+  // verify chains through the cache. Returns false if the store can't be
+  // built.
+  static bool Configure(SSL_CTX* ctx);
+
+  static void GetStats(Stats* stats);
+  // Forgets the verified chains and lets go of the store, which is built
+  // again by the next Configure. Contexts that have it keep it.
+  static void Clear();
+
+ private:
+  // The cert_verify_callback of the contexts.
+  static int VerifyChain(X509_STORE_CTX* store, void* arg);
+
+  // Past this many leaves, one is forgotten for each new one.
+  static const size_t kMaxVerified = 1024;
+  // A verified chain is verified in full again after this long, to notice
+  // an intermediate that has expired.
+  static const int kVerifiedLifetime = 60 * 60 * 1000;  // 1 hour
+
+  OpenSSLCertStore();
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_OPENSSLCERTSTORE_H_
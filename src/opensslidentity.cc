@@ -34,16 +34,25 @@
 #include <openssl/bn.h>
 #include <openssl/rsa.h>
 #include <openssl/crypto.h>
+#ifndef OPENSSL_NO_EC
+#include <openssl/ec.h>
+#include <openssl/obj_mac.h>
+#endif
+
+#include <vector>
 
+#include "criticalsection.h"
 #include "logging.h"
 #include "helpers.h"
+#include "openssladapter.h"
+#include "thread.h"
 
 namespace txmpp {
 
 // We could have exposed a myriad of parameters for the crypto stuff,
 // but keeping it simple seems best.
 
-// Strength of generated keys. Those are RSA.
+// Strength of generated RSA keys.
 static const int KEY_LENGTH = 1024;
 
 // Random bits for certificate serial number
@@ -52,8 +61,9 @@ static const int SERIAL_RAND_BITS = 64;
 // Certificate validity lifetime
 static const int CERTIFICATE_LIFETIME = 60*60*24*365;  // one year, arbitrarily
 
-// Generate a key pair. Caller is responsible for freeing the returned object.
-static EVP_PKEY* MakeKey() {
+// Generate an RSA key pair. Caller is responsible for freeing the returned
+// object.
+static EVP_PKEY* MakeRSAKey() {
   LOG(LS_INFO) << "Making key pair";
   EVP_PKEY* pkey = EVP_PKEY_new();
 #if OPENSSL_VERSION_NUMBER < 0x00908000l
@@ -84,9 +94,41 @@ static EVP_PKEY* MakeKey() {
   return pkey;
 }
 
+// Generate an ECDSA key pair on the P-256 curve. Caller is responsible for
+// freeing the returned object.
+static EVP_PKEY* MakeECKey() {
+#if OPENSSL_VERSION_NUMBER >= 0x00908000l && !defined(OPENSSL_NO_EC)
+  LOG(LS_INFO) << "Making ECDSA key pair";
+  EVP_PKEY* pkey = EVP_PKEY_new();
+  EC_KEY* ec_key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+  if (ec_key) {
+    // Certificates name the curve rather than spelling out its parameters.
+    EC_KEY_set_asn1_flag(ec_key, OPENSSL_EC_NAMED_CURVE);
+  }
+  if (!pkey || !ec_key ||
+      !EC_KEY_generate_key(ec_key) ||
+      !EVP_PKEY_assign_EC_KEY(pkey, ec_key)) {
+    EVP_PKEY_free(pkey);
+    EC_KEY_free(ec_key);
+    return NULL;
+  }
+  // ownership of ec_key struct was assigned, don't free it.
+  return pkey;
+#else
+  LOG(LS_ERROR) << "This OpenSSL has no ECDSA";
+  return NULL;
+#endif
+}
+
+static EVP_PKEY* MakeKey(KeyType key_type) {
+  return (key_type == KT_ECDSA) ? MakeECKey() : MakeRSAKey();
+}
+
 // Generate a self-signed certificate, with the public key from the
-// given key pair. Caller is responsible for freeing the returned object.
-static X509* MakeCertificate(EVP_PKEY* pkey, const char* common_name) {
+// given key pair, signed with |digest|. Caller is responsible for freeing
+// the returned object.
+static X509* MakeCertificate(EVP_PKEY* pkey, const char* common_name,
+                             const EVP_MD* digest) {
   LOG(LS_INFO) << "Making certificate for " << common_name;
   X509* x509 = NULL;
   BIGNUM* serial_number = NULL;
@@ -128,7 +170,7 @@ static X509* MakeCertificate(EVP_PKEY* pkey, const char* common_name) {
       !X509_gmtime_adj(X509_get_notAfter(x509), CERTIFICATE_LIFETIME))
     goto error;
 
-  if (!X509_sign(x509, pkey, EVP_sha1()))
+  if (!X509_sign(x509, pkey, digest))
     goto error;
 
   BN_free(serial_number);
@@ -153,13 +195,112 @@ static void LogSSLErrors(const std::string& prefix) {
   }
 }
 
-OpenSSLKeyPair* OpenSSLKeyPair::Generate() {
-  EVP_PKEY* pkey = MakeKey();
+// Spare keys for OpenSSLKeyPair::Generate, made on a thread of the pool's
+// own whenever it holds fewer than it should. Never destroyed, since that
+// thread may be making a key at exit. Like any use of OpenSSL from several
+// threads, it needs the locking OpenSSLAdapter::EnsureInitialized sets up,
+// which SetSize sees to before the thread starts.
+class KeyPool : public MessageHandler {
+ public:
+  static KeyPool* Instance() {
+    static KeyPool* const instance = new KeyPool;
+    return instance;
+  }
+
+  void SetSize(KeyType key_type, size_t count) {
+    if (count > 0)
+      OpenSSLAdapter::EnsureInitialized();
+    std::vector<EVP_PKEY*> freed;
+    {
+      CritScope cs(&crit_);
+      sizes_[key_type] = count;
+      std::vector<EVP_PKEY*>& keys = keys_[key_type];
+      while (keys.size() > count) {
+        freed.push_back(keys.back());
+        keys.pop_back();
+      }
+      if (count > 0 && !thread_.started())
+        thread_.Start();
+    }
+    for (size_t i = 0; i < freed.size(); ++i)
+      EVP_PKEY_free(freed[i]);
+    if (count > 0)
+      thread_.Post(this);
+  }
+
+  // Returns NULL if there is no spare key of |key_type|.
+  EVP_PKEY* Take(KeyType key_type) {
+    EVP_PKEY* pkey;
+    {
+      CritScope cs(&crit_);
+      std::vector<EVP_PKEY*>& keys = keys_[key_type];
+      if (keys.empty())
+        return NULL;
+      pkey = keys.back();
+      keys.pop_back();
+    }
+    thread_.Post(this);
+    return pkey;
+  }
+
+  // Tops up every key type. Posts that came in meanwhile find it full.
+  virtual void OnMessage(Message* msg) {
+    while (true) {
+      int key_type = -1;
+      {
+        CritScope cs(&crit_);
+        for (int i = 0; i <= KT_LAST && key_type < 0; ++i) {
+          if (keys_[i].size() < sizes_[i])
+            key_type = i;
+        }
+      }
+      if (key_type < 0)
+        return;
+      EVP_PKEY* pkey = MakeKey(static_cast<KeyType>(key_type));
+      if (!pkey) {
+        LogSSLErrors("Filling the key pool");
+        return;
+      }
+      {
+        CritScope cs(&crit_);
+        if (keys_[key_type].size() < sizes_[key_type]) {
+          keys_[key_type].push_back(pkey);
+          pkey = NULL;
+        }
+      }
+      // The pool shrank while the key was made.
+      if (pkey)
+        EVP_PKEY_free(pkey);
+    }
+  }
+
+ private:
+  KeyPool() {
+    thread_.SetName("KeyPool", this);
+    for (int i = 0; i <= KT_LAST; ++i)
+      sizes_[i] = 0;
+  }
+
+  Thread thread_;
+  CriticalSection crit_;
+  std::vector<EVP_PKEY*> keys_[KT_LAST + 1];
+  size_t sizes_[KT_LAST + 1];
+};
+
+OpenSSLKeyPair* OpenSSLKeyPair::Generate(KeyType key_type) {
+  OpenSSLAdapter::EnsureInitialized();
+  EVP_PKEY* pkey = KeyPool::Instance()->Take(key_type);
+  if (!pkey)
+    pkey = MakeKey(key_type);
   if (!pkey) {
     LogSSLErrors("Generating key pair");
     return NULL;
   }
-  return new OpenSSLKeyPair(pkey);
+  return new OpenSSLKeyPair(pkey, key_type);
+}
+
+void OpenSSLKeyPair::SetPoolSize(KeyType key_type, size_t count) {
+  KeyPool::Instance()->SetSize(key_type, count);
 }
 
 OpenSSLKeyPair::~OpenSSLKeyPair() {
@@ -193,7 +334,12 @@ OpenSSLCertificate* OpenSSLCertificate::Generate(
   if (actual_common_name.empty())
     // Use a random string, arbitrarily 8chars long.
     actual_common_name = CreateRandomString(8);
-  X509* x509 = MakeCertificate(key_pair->pkey(), actual_common_name.c_str());
+  // ECDSA certificates are signed with SHA-256, as ecdsa-with-SHA1 has
+  // fallen out of use.
+  const EVP_MD* digest =
+      (key_pair->key_type() == KT_ECDSA) ? EVP_sha256() : EVP_sha1();
+  X509* x509 = MakeCertificate(key_pair->pkey(), actual_common_name.c_str(),
+                               digest);
   if (!x509) {
     LogSSLErrors("Generating certificate");
     return NULL;
@@ -248,8 +394,9 @@ void OpenSSLCertificate::AddReference() {
   CRYPTO_add(&x509_->references, 1, CRYPTO_LOCK_X509);
 }
 
-OpenSSLIdentity* OpenSSLIdentity::Generate(const std::string& common_name) {
-  OpenSSLKeyPair *key_pair = OpenSSLKeyPair::Generate();
+OpenSSLIdentity* OpenSSLIdentity::Generate(const std::string& common_name,
+                                           KeyType key_type) {
+  OpenSSLKeyPair *key_pair = OpenSSLKeyPair::Generate(key_type);
   if (key_pair) {
     OpenSSLCertificate *certificate =
         OpenSSLCertificate::Generate(key_pair, common_name);
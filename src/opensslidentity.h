@@ -49,24 +49,31 @@ namespace txmpp {
 // which is reference counted inside the OpenSSL library.
 class OpenSSLKeyPair {
  public:
-  static OpenSSLKeyPair* Generate();
+  // Takes a spare key of |key_type| if the pool has one, and otherwise
+  // makes one.
+  static OpenSSLKeyPair* Generate(KeyType key_type = KT_DEFAULT);
+  // See SSLIdentity::SetKeyPoolSize.
+  static void SetPoolSize(KeyType key_type, size_t count);
 
   virtual ~OpenSSLKeyPair();
 
   virtual OpenSSLKeyPair* GetReference() {
     AddReference();
-    return new OpenSSLKeyPair(pkey_);
+    return new OpenSSLKeyPair(pkey_, key_type_);
   }
 
   EVP_PKEY* pkey() const { return pkey_; }
+  KeyType key_type() const { return key_type_; }
 
  private:
-  explicit OpenSSLKeyPair(EVP_PKEY* pkey) : pkey_(pkey) {
+  OpenSSLKeyPair(EVP_PKEY* pkey, KeyType key_type)
+      : pkey_(pkey), key_type_(key_type) {
     ASSERT(pkey_ != NULL);
   }
   void AddReference();
 
   EVP_PKEY* pkey_;
+  KeyType key_type_;
 
   DISALLOW_EVIL_CONSTRUCTORS(OpenSSLKeyPair);
 };
@@ -106,7 +113,8 @@ class OpenSSLCertificate : public SSLCertificate {
 // them consistently.
 class OpenSSLIdentity : public SSLIdentity {
  public:
-  static OpenSSLIdentity* Generate(const std::string& common_name);
+  static OpenSSLIdentity* Generate(const std::string& common_name,
+                                   KeyType key_type = KT_DEFAULT);
 
   virtual ~OpenSSLIdentity() { }
 
@@ -0,0 +1,147 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "opensslsessioncache.h"
+
+#if HAVE_OPENSSL_SSL_H
+
+#include <map>
+#include <openssl/ssl.h>
+
+#include "criticalsection.h"
+#include "logging.h"
+#include "metrics.h"
+
+namespace txmpp {
+
+const size_t OpenSSLSessionCache::kMaxSessions;
+
+typedef std::map<std::string, SSL_SESSION*> SessionMap;
+
+static CriticalSection session_cache_crit;
+static SessionMap* session_cache_sessions = NULL;
+static SSL_CTX* session_cache_contexts[OpenSSLSessionCache::CONTEXT_KINDS];
+static OpenSSLSessionCache::Stats session_cache_stats;
+
+SSL_CTX* OpenSSLSessionCache::GetContext(ContextKind kind) {
+  CritScope cs(&session_cache_crit);
+  return session_cache_contexts[kind];
+}
+
+SSL_CTX* OpenSSLSessionCache::ShareContext(ContextKind kind, SSL_CTX* ctx) {
+  CritScope cs(&session_cache_crit);
+  if (session_cache_contexts[kind]) {
+    SSL_CTX_free(ctx);
+  } else {
+    session_cache_contexts[kind] = ctx;
+  }
+  return session_cache_contexts[kind];
+}
+
+void OpenSSLSessionCache::Apply(SSL* ssl, const std::string& server_name) {
+  if (server_name.empty())
+    return;
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+  // Servers with several names may keep their tickets apart by it.
+  SSL_set_tlsext_host_name(ssl, const_cast<char*>(server_name.c_str()));
+#endif
+
+  CritScope cs(&session_cache_crit);
+  if (!session_cache_sessions)
+    return;
+  SessionMap::iterator it = session_cache_sessions->find(server_name);
+  if (it != session_cache_sessions->end())
+    SSL_set_session(ssl, it->second);
+}
+
+void OpenSSLSessionCache::Store(SSL* ssl, const std::string& server_name) {
+  bool resumed = SSL_session_reused(ssl) != 0;
+  LibraryMetrics::Add(resumed ? LibraryMetrics::LM_TLS_RESUMED_HANDSHAKES :
+                                LibraryMetrics::LM_TLS_FULL_HANDSHAKES);
+  SSL_SESSION* session = server_name.empty() ? NULL : SSL_get1_session(ssl);
+
+  CritScope cs(&session_cache_crit);
+  if (resumed) {
+    ++session_cache_stats.resumed;
+  } else {
+    ++session_cache_stats.full;
+  }
+  if (!session)
+    return;
+
+  if (!session_cache_sessions)
+    session_cache_sessions = new SessionMap();
+  SessionMap::iterator it = session_cache_sessions->find(server_name);
+  if (it != session_cache_sessions->end()) {
+    SSL_SESSION_free(it->second);
+    it->second = session;
+    return;
+  }
+  if (session_cache_sessions->size() >= kMaxSessions) {
+    SSL_SESSION_free(session_cache_sessions->begin()->second);
+    session_cache_sessions->erase(session_cache_sessions->begin());
+  }
+  session_cache_sessions->insert(std::make_pair(server_name, session));
+}
+
+void OpenSSLSessionCache::Remove(const std::string& server_name) {
+  CritScope cs(&session_cache_crit);
+  if (!session_cache_sessions)
+    return;
+  SessionMap::iterator it = session_cache_sessions->find(server_name);
+  if (it != session_cache_sessions->end()) {
+    SSL_SESSION_free(it->second);
+    session_cache_sessions->erase(it);
+  }
+}
+
+void OpenSSLSessionCache::GetStats(Stats* stats) {
+  CritScope cs(&session_cache_crit);
+  *stats = session_cache_stats;
+}
+
+void OpenSSLSessionCache::Clear() {
+  CritScope cs(&session_cache_crit);
+  if (session_cache_sessions) {
+    for (SessionMap::iterator it = session_cache_sessions->begin();
+         it != session_cache_sessions->end(); ++it) {
+      SSL_SESSION_free(it->second);
+    }
+    delete session_cache_sessions;
+    session_cache_sessions = NULL;
+  }
+  for (int i = 0; i < CONTEXT_KINDS; ++i) {
+    if (session_cache_contexts[i]) {
+      SSL_CTX_free(session_cache_contexts[i]);
+      session_cache_contexts[i] = NULL;
+    }
+  }
+}
+
+}  // namespace txmpp
+
+#endif  // HAVE_OPENSSL_SSL_H
@@ -0,0 +1,92 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_OPENSSLSESSIONCACHE_H_
+#define _TXMPP_OPENSSLSESSIONCACHE_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+
+#include "basictypes.h"
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+
+namespace txmpp {
+
+// The process's TLS client sessions, by server name, so that reconnecting
+// to a server resumes the last session, by its id or ticket, instead of
+// doing a full handshake; and the SSL_CTXs that all client connections of
+// OpenSSLAdapter and OpenSSLStreamAdapter share. All of it may be used
+// from any thread.
+class OpenSSLSessionCache {
+ public:
+  enum ContextKind {
+    ADAPTER_CONTEXT,  // OpenSSLAdapter's
+    STREAM_CONTEXT,   // OpenSSLStreamAdapter's, without identity or peer
+    CONTEXT_KINDS
+  };
+
+  struct Stats {
+    uint32 resumed;  // Handshakes that resumed a session.
+    uint32 full;     // Handshakes that didn't.
+  };
+
+  // The shared context of |kind|, or NULL if there isn't one yet.
+  static SSL_CTX* GetContext(ContextKind kind);
+  // Makes |ctx| the shared context of |kind|, unless another thread did so
+  // first, in which case |ctx| is freed. Returns the shared context. It is
+  // not freed until Clear, so connections must not free it.
+  static SSL_CTX* ShareContext(ContextKind kind, SSL_CTX* ctx);
+
+  // Offers |ssl|, before it connects, the session kept for |server_name|,
+  // and names the server to it for SNI.
+  static void Apply(SSL* ssl, const std::string& server_name);
+  // Keeps the session |ssl| has just connected with for |server_name|, and
+  // counts whether it was resumed.
+  static void Store(SSL* ssl, const std::string& server_name);
+  // Forgets the session for |server_name|, as after a failed handshake.
+  static void Remove(const std::string& server_name);
+
+  static void GetStats(Stats* stats);
+  // Frees the sessions and the shared contexts. No connection may still
+  // be using the contexts.
+  static void Clear();
+
+ private:
+  // Past this many servers, one is forgotten for each new one.
+  static const size_t kMaxSessions = 1024;
+
+  OpenSSLSessionCache();
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_OPENSSLSESSIONCACHE_H_
@@ -38,6 +38,7 @@
 
 #include "common.h"
 #include "logging.h"
+#include "opensslsessioncache.h"
 #include "stream.h"
 #include "openssladapter.h"
 #include "opensslidentity.h"
@@ -161,7 +162,7 @@ OpenSSLStreamAdapter::OpenSSLStreamAdapter(StreamInterface* stream)
       state_(SSL_NONE),
       role_(SSL_CLIENT),
       ssl_read_needs_write_(false), ssl_write_needs_read_(false),
-      ssl_(NULL), ssl_ctx_(NULL),
+      ssl_(NULL), ssl_ctx_(NULL), shared_ctx_(false),
       custom_verification_succeeded_(false) {
 }
 
@@ -341,6 +342,16 @@ StreamState OpenSSLStreamAdapter::GetState() const {
   // not reached
 }
 
+size_t OpenSSLStreamAdapter::MemoryUsage() const {
+  return OpenSSLAdapter::RecordBufferMemory(ssl_);
+}
+
+size_t OpenSSLStreamAdapter::TrimMemory() {
+  if (state_ != SSL_CONNECTED)
+    return 0;
+  return OpenSSLAdapter::FreeRecordBuffers(ssl_);
+}
+
 void OpenSSLStreamAdapter::OnEvent(StreamInterface* stream, int events,
                                    int err) {
   int events_to_signal = 0;
@@ -423,9 +434,22 @@ int OpenSSLStreamAdapter::BeginSSL() {
 
   BIO* bio = NULL;
 
-  // First set up the context
+  // First set up OpenSSL and the context, shared by the connections that can
   ASSERT(ssl_ctx_ == NULL);
-  ssl_ctx_ = SetupSSLContext();
+  if (!OpenSSLAdapter::EnsureInitialized())
+    return -1;
+  shared_ctx_ = UsesSessionCache();
+  if (shared_ctx_) {
+    ssl_ctx_ = OpenSSLSessionCache::GetContext(
+        OpenSSLSessionCache::STREAM_CONTEXT);
+    if (!ssl_ctx_) {
+      if (SSL_CTX* ctx = SetupSSLContext())
+        ssl_ctx_ = OpenSSLSessionCache::ShareContext(
+            OpenSSLSessionCache::STREAM_CONTEXT, ctx);
+    }
+  } else {
+    ssl_ctx_ = SetupSSLContext();
+  }
   if (!ssl_ctx_)
     return -1;
 
@@ -443,8 +467,11 @@ int OpenSSLStreamAdapter::BeginSSL() {
 
   SSL_set_bio(ssl_, bio, bio);  // the SSL object owns the bio now.
 
-  SSL_set_mode(ssl_, SSL_MODE_ENABLE_PARTIAL_WRITE |
-               SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  OpenSSLAdapter::SetBufferModes(ssl_);
+
+  // Resume the last session with this server, if there is one
+  if (shared_ctx_)
+    OpenSSLSessionCache::Apply(ssl_, ssl_server_name_);
 
   // Do the connect
   return ContinueSSL();
@@ -466,6 +493,8 @@ int OpenSSLStreamAdapter::ContinueSSL() {
         return -1;
       }
 
+      if (shared_ctx_)
+        OpenSSLSessionCache::Store(ssl_, ssl_server_name_);
       state_ = SSL_CONNECTED;
       StreamAdapterInterface::OnEvent(stream(), SE_OPEN|SE_READ|SE_WRITE, 0);
       break;
@@ -490,6 +519,9 @@ int OpenSSLStreamAdapter::ContinueSSL() {
 void OpenSSLStreamAdapter::Error(const char* context, int err, bool signal) {
   LOG(LS_WARNING) << "OpenSSLStreamAdapter::Error("
                   << context << ", " << err << ")";
+  // A session that fails to resume shouldn't be offered again.
+  if (state_ == SSL_CONNECTING && shared_ctx_)
+    OpenSSLSessionCache::Remove(ssl_server_name_);
   state_ = SSL_ERROR;
   ssl_error_code_ = err;
   Cleanup();
@@ -510,9 +542,11 @@ void OpenSSLStreamAdapter::Cleanup() {
     ssl_ = NULL;
   }
   if (ssl_ctx_) {
-    SSL_CTX_free(ssl_ctx_);
+    if (!shared_ctx_)
+      SSL_CTX_free(ssl_ctx_);
     ssl_ctx_ = NULL;
   }
+  shared_ctx_ = false;
   identity_.reset();
   peer_certificate_.reset();
 }
@@ -544,6 +578,12 @@ SSL_CTX* OpenSSLStreamAdapter::SetupSSLContext() {
     // we must specify which client cert to ask for
     SSL_CTX_add_client_CA(ctx, peer_certificate_->x509());
 
+  if (UsesSessionCache()) {
+    // Sessions are kept by OpenSSLSessionCache, by server name.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                        SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  }
+
 #ifdef _DEBUG
   SSL_CTX_set_info_callback(ctx, OpenSSLAdapter::SSLInfoCallback);
 #endif
@@ -556,6 +596,11 @@ SSL_CTX* OpenSSLStreamAdapter::SetupSSLContext() {
   return ctx;
 }
 
+bool OpenSSLStreamAdapter::UsesSessionCache() const {
+  return role_ == SSL_CLIENT && !ssl_server_name_.empty() &&
+         identity_.get() == NULL && peer_certificate_.get() == NULL;
+}
+
 int OpenSSLStreamAdapter::SSLVerifyCallback(int ok, X509_STORE_CTX* store) {
 #if _DEBUG
   if (!ok) {
@@ -92,6 +92,11 @@ class OpenSSLStreamAdapter : public SSLStreamAdapter {
   virtual void Close();
   virtual StreamState GetState() const;
 
+  // The bytes of TLS record buffers the connection holds now. See
+  // OpenSSLAdapter::SetLeanMemory for freeing them while idle.
+  size_t MemoryUsage() const;
+  virtual size_t TrimMemory();
+
  protected:
   virtual void OnEvent(StreamInterface* stream, int events, int err);
 
@@ -135,6 +140,10 @@ class OpenSSLStreamAdapter : public SSLStreamAdapter {
 
   // SSL library configuration
   SSL_CTX* SetupSSLContext();
+  // Whether the connection can use the context and sessions shared
+  // through OpenSSLSessionCache: a client's, in traditional mode, without
+  // an identity.
+  bool UsesSessionCache() const;
   // SSL verification check
   bool SSLPostConnectionCheck(SSL* ssl, const char* server_name,
                               const X509* peer_cert);
@@ -155,6 +164,8 @@ class OpenSSLStreamAdapter : public SSLStreamAdapter {
 
   SSL* ssl_;
   SSL_CTX* ssl_ctx_;
+  // Whether ssl_ctx_ is OpenSSLSessionCache's, which this mustn't free.
+  bool shared_ctx_;
   // in traditional mode, the server name that the server's certificate
   // must specify. Empty in peer-to-peer mode.
   // Our key and certificate, mostly useful in peer-to-peer mode.
@@ -37,9 +37,17 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <signal.h>
+#ifdef LINUX
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#if defined(HAVE_LINUX_TLS_H)
+#include <linux/tls.h>
+#endif
+#endif
 #endif
 
 #ifdef WIN32
@@ -47,18 +55,25 @@
 #include <windows.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mswsock.h>
 #undef SetPort
 #endif
 
 #include <algorithm>
 #include <map>
+#include <typeinfo>
 
 #include "basictypes.h"
+#include "buffer.h"
 #include "byteorder.h"
 #include "common.h"
 #include "logging.h"
+#include "metrics.h"
 #include "nethelpers.h"
+#include "poller.h"
+#include "stalldetector.h"
 #include "time.h"
+#include "tracepoints.h"
 #include "winping.h"
 #include "win32socketinit.h"
 
@@ -69,6 +84,23 @@
 
 #ifdef POSIX
 #include <netinet/tcp.h>  // for TCP_NODELAY
+#include <netinet/udp.h>
+#if defined(LINUX) && !defined(UDP_SEGMENT)
+// Older C libraries lack the UDP GSO option
+#define UDP_SEGMENT 103
+#endif
+#if defined(LINUX) && !defined(SO_BUSY_POLL)
+#define SO_BUSY_POLL 46
+#endif
+#if defined(LINUX) && defined(HAVE_LINUX_TLS_H)
+// Older C libraries lack the kernel TLS constants
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
 #define IP_MTU 14 // Until this is integrated from linux/in.h to netinet/in.h
 typedef void* SockOptArg;
 #endif  // POSIX
@@ -105,12 +137,23 @@ const uint16 PACKET_MAXIMUMS[] = {
 const uint32 IP_HEADER_SIZE = 20;
 const uint32 ICMP_HEADER_SIZE = 8;
 
+// The most buffers SendV and RecvV pass to the system at once.
+const size_t kMaxIoVecs = 16;
+
+// The most datagrams SendToMany and RecvFromMany pass to the system at once.
+const size_t kMaxDatagrams = 32;
+
+// The most connections accepted for one readiness event of a listening
+// socket.
+const int kAcceptBudget = 32;
+
 class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
  public:
   PhysicalSocket(PhysicalSocketServer* ss, SOCKET s = INVALID_SOCKET)
     : ss_(ss), s_(s), enabled_events_(0), error_(0),
       state_((s == INVALID_SOCKET) ? CS_CLOSED : CS_CONNECTED),
-      resolver_(NULL) {
+      resolver_(NULL), accept_count_(0), family_(AF_INET),
+      type_(SOCK_STREAM) {
 #ifdef WIN32
     // EnsureWinsockInit() ensures that winsock is initialized. The default
     // version of this function doesn't do anything because winsock is
@@ -126,6 +169,7 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
       socklen_t len = sizeof(type);
       VERIFY(0 == getsockopt(s_, SOL_SOCKET, SO_TYPE, (SockOptArg)&type, &len));
       udp_ = (SOCK_DGRAM == type);
+      type_ = type;
     }
   }
 
@@ -135,23 +179,37 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
 
   // Creates the underlying OS socket (same as the "socket" function).
   virtual bool Create(int type) {
+    return CreateT(AF_INET, type);
+  }
+
+  // Creates it of |family|, which Bind and Connect do again for an address
+  // of another family, as a Unix domain one.
+  virtual bool CreateT(int family, int type) {
     Close();
-    s_ = ::socket(AF_INET, type, 0);
+    s_ = ::socket(family, type, 0);
+    family_ = family;
+    type_ = type;
     udp_ = (SOCK_DGRAM == type);
     UpdateLastError();
     if (udp_)
-      enabled_events_ = DE_READ | DE_WRITE;
-    return s_ != INVALID_SOCKET;
+      SetEnabledEvents(DE_READ | DE_WRITE);
+    if (s_ == INVALID_SOCKET)
+      return false;
+    // Accepted sockets inherit the option from their listener.
+    int busy_poll = ss_->socket_busy_poll();
+    if (busy_poll > 0 && SetOption(OPT_BUSY_POLL, busy_poll) != 0)
+      LOG_ERR(LS_WARNING) << "SO_BUSY_POLL";
+    return true;
   }
 
   SocketAddress GetLocalAddress() const {
-    sockaddr_in addr;
+    sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
     socklen_t addrlen = sizeof(addr);
     int result = ::getsockname(s_, (sockaddr*)&addr, &addrlen);
     SocketAddress address;
     if (result >= 0) {
-      ASSERT(addrlen == sizeof(addr));
-      address.FromSockAddr(addr);
+      address.FromSockAddrStorage(addr);
     } else {
       LOG(LS_WARNING) << "GetLocalAddress: unable to get local addr, socket="
                       << s_;
@@ -160,13 +218,13 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
   }
 
   SocketAddress GetRemoteAddress() const {
-    sockaddr_in addr;
+    sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
     socklen_t addrlen = sizeof(addr);
     int result = ::getpeername(s_, (sockaddr*)&addr, &addrlen);
     SocketAddress address;
     if (result >= 0) {
-      ASSERT(addrlen == sizeof(addr));
-      address.FromSockAddr(addr);
+      address.FromSockAddrStorage(addr);
     } else {
       LOG(LS_WARNING) << "GetRemoteAddress: unable to get remote addr, socket="
                       << s_;
@@ -175,9 +233,12 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
   }
 
   int Bind(const SocketAddress& addr) {
-    sockaddr_in saddr;
-    addr.ToSockAddr(&saddr);
-    int err = ::bind(s_, (sockaddr*)&saddr, sizeof(saddr));
+    // Sockets are IPv4 or Unix domain, so an IPv6 address is refused here.
+    if (!EnsureFamily(addr))
+      return SOCKET_ERROR;
+    sockaddr_storage saddr;
+    size_t len = addr.ToSockAddrStorage(&saddr);
+    int err = ::bind(s_, (sockaddr*)&saddr, static_cast<socklen_t>(len));
     UpdateLastError();
 #ifdef _DEBUG
     if (0 == err) {
@@ -193,6 +254,8 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
     // ...but should we make it more explicit?
     if ((s_ == INVALID_SOCKET) && !Create(SOCK_STREAM))
       return SOCKET_ERROR;
+    if (!EnsureFamily(addr))
+      return SOCKET_ERROR;
     if (addr.IsUnresolved()) {
       if (state_ != CS_CLOSED) {
         SetError(EALREADY);
@@ -211,21 +274,25 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
     return DoConnect(addr);
   }
 
-  int DoConnect(const SocketAddress& addr) {
-    sockaddr_in saddr;
-    addr.ToSockAddr(&saddr);
-    int err = ::connect(s_, (sockaddr*)&saddr, sizeof(saddr));
+  virtual int DoConnect(const SocketAddress& addr) {
+    sockaddr_storage saddr;
+    size_t len = addr.ToSockAddrStorage(&saddr);
+    int err = ::connect(s_, (sockaddr*)&saddr, static_cast<socklen_t>(len));
     UpdateLastError();
+    uint8 events = DE_READ | DE_WRITE;
     if (err == 0) {
+      // A connect that is done at once, as a Unix domain one is, is still
+      // announced by a connect event, which the caller waits for.
       state_ = CS_CONNECTED;
+      events |= DE_CONNECT;
     } else if (IsBlockingError(error_)) {
       state_ = CS_CONNECTING;
-      enabled_events_ |= DE_CONNECT;
+      events |= DE_CONNECT;
     } else {
       return SOCKET_ERROR;
     }
 
-    enabled_events_ |= DE_READ | DE_WRITE;
+    EnableEvents(events);
     return 0;
   }
 
@@ -242,6 +309,17 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
   }
 
   int GetOption(Option opt, int* value) {
+#ifdef LINUX
+    if (opt == OPT_RTT || opt == OPT_RTTVAR) {
+      struct tcp_info info;
+      socklen_t infolen = sizeof(info);
+      if (::getsockopt(s_, IPPROTO_TCP, TCP_INFO, &info, &infolen) == -1)
+        return -1;
+      *value = static_cast<int>(opt == OPT_RTT ? info.tcpi_rtt
+                                               : info.tcpi_rttvar);
+      return 0;
+    }
+#endif
     int slevel;
     int sopt;
     if (TranslateOption(opt, &slevel, &sopt) == -1)
@@ -253,6 +331,12 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
       *value = (*value != IP_PMTUDISC_DONT) ? 1 : 0;
 #endif
     }
+#ifdef LINUX
+    if (ret != -1 && opt == OPT_KEEPALIVE && *value) {
+      ret = ::getsockopt(s_, IPPROTO_TCP, TCP_KEEPIDLE, (SockOptArg)value,
+                         &optlen);
+    }
+#endif
     return ret;
   }
 
@@ -266,6 +350,17 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
       value = (value) ? IP_PMTUDISC_DO : IP_PMTUDISC_DONT;
 #endif
     }
+    if (opt == OPT_KEEPALIVE) {
+#ifdef LINUX
+      if ((value > 0)
+          && ((::setsockopt(s_, IPPROTO_TCP, TCP_KEEPIDLE, (SockOptArg)&value,
+                            sizeof(value)) == -1)
+              || (::setsockopt(s_, IPPROTO_TCP, TCP_KEEPINTVL,
+                               (SockOptArg)&value, sizeof(value)) == -1)))
+        return -1;
+#endif
+      value = (value > 0) ? 1 : 0;
+    }
     return ::setsockopt(s_, slevel, sopt, (SockOptArg)&value, sizeof(value));
   }
 
@@ -286,14 +381,92 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
     // We have seen minidumps where this may be false.
     ASSERT(sent <= static_cast<int>(cb));
     if ((sent < 0) && IsBlockingError(error_)) {
-      enabled_events_ |= DE_WRITE;
+      EnableEvents(DE_WRITE);
+      OnBlocked(DE_WRITE);
+    }
+    return sent;
+  }
+
+  int SendV(const IoVec* vec, size_t count) {
+    if (count > kMaxIoVecs)
+      count = kMaxIoVecs;
+#ifdef POSIX
+    iovec iov[kMaxIoVecs];
+    for (size_t i = 0; i < count; ++i) {
+      iov[i].iov_base = const_cast<void *>(vec[i].data);
+      iov[i].iov_len = vec[i].len;
+    }
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    // As in Send, sendmsg rather than writev so as not to raise SIGPIPE.
+    int sent = ::sendmsg(s_, &msg,
+#ifdef LINUX
+        MSG_NOSIGNAL
+#else
+        0
+#endif
+        );
+#endif  // POSIX
+#ifdef WIN32
+    WSABUF bufs[kMaxIoVecs];
+    for (size_t i = 0; i < count; ++i) {
+      bufs[i].buf = const_cast<char *>(static_cast<const char *>(vec[i].data));
+      bufs[i].len = static_cast<ULONG>(vec[i].len);
+    }
+    DWORD sent_bytes = 0;
+    int sent = SOCKET_ERROR;
+    if (::WSASend(s_, bufs, static_cast<DWORD>(count), &sent_bytes, 0,
+                  NULL, NULL) == 0) {
+      sent = static_cast<int>(sent_bytes);
+    }
+#endif  // WIN32
+    UpdateLastError();
+    if ((sent < 0) && IsBlockingError(error_)) {
+      EnableEvents(DE_WRITE);
+      OnBlocked(DE_WRITE);
     }
     return sent;
   }
 
+#ifdef LINUX
+  int SendFile(int fd, size_t offset, size_t len) {
+    if (udp_)
+      return AsyncSocket::SendFile(fd, offset, len);
+    // At most what the result can count.
+    const size_t kMaxSendFile = 1 << 30;
+    off_t position = static_cast<off_t>(offset);
+    ssize_t sent = ::sendfile(s_, fd, &position, std::min(len, kMaxSendFile));
+    UpdateLastError();
+    if ((sent < 0) && IsBlockingError(error_)) {
+      EnableEvents(DE_WRITE);
+      OnBlocked(DE_WRITE);
+    }
+    return static_cast<int>(sent);
+  }
+#endif  // LINUX
+
+  bool StartKernelTls(const void* crypto_info, size_t len) {
+#if defined(LINUX) && defined(HAVE_LINUX_TLS_H)
+    if (udp_ || (s_ == INVALID_SOCKET))
+      return false;
+    // Records then go out as they are sent, encrypted with the keys given
+    if ((::setsockopt(s_, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) ||
+        (::setsockopt(s_, SOL_TLS, TLS_TX, crypto_info,
+                      static_cast<socklen_t>(len)) < 0)) {
+      LOG_F(LS_INFO) << "kernel TLS unavailable: " << errno;
+      return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+  }
+
   int SendTo(const void *pv, size_t cb, const SocketAddress& addr) {
-    sockaddr_in saddr;
-    addr.ToSockAddr(&saddr);
+    sockaddr_storage saddr;
+    size_t len = addr.ToSockAddrStorage(&saddr);
     int sent = ::sendto(
         s_, (const char *)pv, (int)cb,
 #ifdef LINUX
@@ -302,12 +475,13 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
 #else
         0,
 #endif
-        (sockaddr*)&saddr, sizeof(saddr));
+        (sockaddr*)&saddr, static_cast<socklen_t>(len));
     UpdateLastError();
     // We have seen minidumps where this may be false.
     ASSERT(sent <= static_cast<int>(cb));
     if ((sent < 0) && IsBlockingError(error_)) {
-      enabled_events_ |= DE_WRITE;
+      EnableEvents(DE_WRITE);
+      OnBlocked(DE_WRITE);
     }
     return sent;
   }
@@ -321,15 +495,70 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
       LOG(LS_WARNING) << "EOF from socket; deferring close event";
       // Must turn this back on so that the select() loop will notice the close
       // event.
-      enabled_events_ |= DE_READ;
+      EnableEvents(DE_READ);
+      error_ = EWOULDBLOCK;
+      return SOCKET_ERROR;
+    }
+    UpdateLastError();
+    bool success = (received >= 0) || IsBlockingError(error_);
+    if (udp_ || success) {
+      EnableEvents(DE_READ);
+    }
+    if ((received < 0) && IsBlockingError(error_))
+      OnBlocked(DE_READ);
+    if (!success) {
+      LOG_F(LS_VERBOSE) << "Error = " << error_;
+    }
+    return received;
+  }
+
+  int RecvV(const MutableIoVec* vec, size_t count) {
+    if (count > kMaxIoVecs)
+      count = kMaxIoVecs;
+    size_t wanted = 0;
+#ifdef POSIX
+    iovec iov[kMaxIoVecs];
+    for (size_t i = 0; i < count; ++i) {
+      iov[i].iov_base = vec[i].data;
+      iov[i].iov_len = vec[i].len;
+      wanted += vec[i].len;
+    }
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    int received = ::recvmsg(s_, &msg, 0);
+#endif  // POSIX
+#ifdef WIN32
+    WSABUF bufs[kMaxIoVecs];
+    for (size_t i = 0; i < count; ++i) {
+      bufs[i].buf = static_cast<char *>(vec[i].data);
+      bufs[i].len = static_cast<ULONG>(vec[i].len);
+      wanted += vec[i].len;
+    }
+    DWORD received_bytes = 0;
+    DWORD flags = 0;
+    int received = SOCKET_ERROR;
+    if (::WSARecv(s_, bufs, static_cast<DWORD>(count), &received_bytes,
+                  &flags, NULL, NULL) == 0) {
+      received = static_cast<int>(received_bytes);
+    }
+#endif  // WIN32
+    if ((received == 0) && (wanted != 0)) {
+      // As in Recv, end of stream is reported as blocking, and the close
+      // event follows.
+      LOG(LS_WARNING) << "EOF from socket; deferring close event";
+      EnableEvents(DE_READ);
       error_ = EWOULDBLOCK;
       return SOCKET_ERROR;
     }
     UpdateLastError();
     bool success = (received >= 0) || IsBlockingError(error_);
     if (udp_ || success) {
-      enabled_events_ |= DE_READ;
+      EnableEvents(DE_READ);
     }
+    if ((received < 0) && IsBlockingError(error_))
+      OnBlocked(DE_READ);
     if (!success) {
       LOG_F(LS_VERBOSE) << "Error = " << error_;
     }
@@ -346,20 +575,87 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
       paddr->FromSockAddr(saddr);
     bool success = (received >= 0) || IsBlockingError(error_);
     if (udp_ || success) {
-      enabled_events_ |= DE_READ;
+      EnableEvents(DE_READ);
+    }
+    if ((received < 0) && IsBlockingError(error_))
+      OnBlocked(DE_READ);
+    if (!success) {
+      LOG_F(LS_VERBOSE) << "Error = " << error_;
+    }
+    return received;
+  }
+
+#ifdef LINUX
+  int SendToMany(const Datagram* packets, size_t count) {
+    if (count > kMaxDatagrams)
+      count = kMaxDatagrams;
+    sockaddr_storage saddrs[kMaxDatagrams];
+    iovec iov[kMaxDatagrams];
+    mmsghdr msgs[kMaxDatagrams];
+    memset(msgs, 0, count * sizeof(msgs[0]));
+    for (size_t i = 0; i < count; ++i) {
+      iov[i].iov_base = const_cast<void *>(packets[i].data);
+      iov[i].iov_len = packets[i].len;
+      msgs[i].msg_hdr.msg_name = &saddrs[i];
+      msgs[i].msg_hdr.msg_namelen = static_cast<socklen_t>(
+          packets[i].addr.ToSockAddrStorage(&saddrs[i]));
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    // Suppress SIGPIPE, as in Send.
+    int sent = ::sendmmsg(s_, msgs, static_cast<unsigned int>(count),
+                          MSG_NOSIGNAL);
+    UpdateLastError();
+    if ((sent < 0) && IsBlockingError(error_)) {
+      EnableEvents(DE_WRITE);
+      OnBlocked(DE_WRITE);
+    }
+    return sent;
+  }
+
+  int RecvFromMany(DatagramBuffer* packets, size_t count) {
+    if (count > kMaxDatagrams)
+      count = kMaxDatagrams;
+    sockaddr_storage saddrs[kMaxDatagrams];
+    iovec iov[kMaxDatagrams];
+    mmsghdr msgs[kMaxDatagrams];
+    memset(msgs, 0, count * sizeof(msgs[0]));
+    for (size_t i = 0; i < count; ++i) {
+      iov[i].iov_base = packets[i].data;
+      iov[i].iov_len = packets[i].size;
+      msgs[i].msg_hdr.msg_name = &saddrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(saddrs[i]);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    // With MSG_TRUNC the length of a datagram that didn't fit is its whole
+    // length, so the caller can tell it was cut short.
+    int received = ::recvmmsg(s_, msgs, static_cast<unsigned int>(count),
+                              MSG_TRUNC, NULL);
+    UpdateLastError();
+    for (int i = 0; i < received; ++i) {
+      packets[i].len = msgs[i].msg_len;
+      packets[i].addr.FromSockAddrStorage(saddrs[i]);
+    }
+    bool success = (received >= 0) || IsBlockingError(error_);
+    if (udp_ || success) {
+      EnableEvents(DE_READ);
     }
+    if ((received < 0) && IsBlockingError(error_))
+      OnBlocked(DE_READ);
     if (!success) {
       LOG_F(LS_VERBOSE) << "Error = " << error_;
     }
     return received;
   }
+#endif  // LINUX
 
   int Listen(int backlog) {
     int err = ::listen(s_, backlog);
     UpdateLastError();
     if (err == 0) {
       state_ = CS_CONNECTING;
-      enabled_events_ |= DE_ACCEPT;
+      EnableEvents(DE_ACCEPT);
 #ifdef _DEBUG
       dbg_addr_ = "Listening @ ";
       dbg_addr_.append(GetLocalAddress().ToString());
@@ -369,15 +665,32 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
   }
 
   AsyncSocket* Accept(SocketAddress *paddr) {
-    sockaddr_in saddr;
+    // An unbound Unix client leaves sun_path untouched; zero it so the peer
+    // reads back as an empty path.
+    sockaddr_storage saddr;
+    memset(&saddr, 0, sizeof(saddr));
     socklen_t cbAddr = sizeof(saddr);
+#ifdef LINUX
+    // The socket is made non-blocking and close-on-exec as it is created, so
+    // that it is never inherited by a process started in between.
+    SOCKET s = ::accept4(s_, (sockaddr*)&saddr, &cbAddr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
     SOCKET s = ::accept(s_, (sockaddr*)&saddr, &cbAddr);
+#endif
     UpdateLastError();
-    if (s == INVALID_SOCKET)
+    if (s == INVALID_SOCKET) {
+      // Nothing left to accept; wait for the next connection.
+      if (IsBlockingError(error_)) {
+        EnableEvents(DE_ACCEPT);
+        OnBlocked(DE_ACCEPT);
+      }
       return NULL;
-    enabled_events_ |= DE_ACCEPT;
+    }
+    ++accept_count_;
+    EnableEvents(DE_ACCEPT);
     if (paddr != NULL)
-      paddr->FromSockAddr(saddr);
+      paddr->FromSockAddrStorage(saddr);
     return ss_->WrapSocket(s);
   }
 
@@ -388,7 +701,7 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
     UpdateLastError();
     s_ = INVALID_SOCKET;
     state_ = CS_CLOSED;
-    enabled_events_ = 0;
+    SetEnabledEvents(0);
     if (resolver_) {
       resolver_->Destroy(false);
       resolver_ = NULL;
@@ -473,6 +786,24 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
     error_ = LAST_SYSTEM_ERROR;
   }
 
+  // All changes to enabled_events_ go through SetEnabledEvents, so that
+  // SocketDispatcher can tell the socket server about them.
+  virtual void SetEnabledEvents(uint8 events) {
+    enabled_events_ = events;
+  }
+
+  void EnableEvents(uint8 events) {
+    SetEnabledEvents(enabled_events_ | events);
+  }
+
+  void DisableEvents(uint8 events) {
+    SetEnabledEvents(enabled_events_ & ~events);
+  }
+
+  // Called when a read (DE_READ), write (DE_WRITE) or accept (DE_ACCEPT)
+  // would block, after the event has been enabled again.
+  virtual void OnBlocked(uint8 events) {}
+
   static int TranslateOption(Option opt, int* slevel, int* sopt) {
     switch (opt) {
       case OPT_DONTFRAGMENT:
@@ -500,6 +831,33 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
         *slevel = IPPROTO_TCP;
         *sopt = TCP_NODELAY;
         break;
+      case OPT_UDP_SEGMENT:
+#ifdef LINUX
+        *slevel = IPPROTO_UDP;
+        *sopt = UDP_SEGMENT;
+        break;
+#else
+        LOG(LS_WARNING) << "Socket::OPT_UDP_SEGMENT not supported.";
+        return -1;
+#endif
+      case OPT_BUSY_POLL:
+#ifdef LINUX
+        *slevel = SOL_SOCKET;
+        *sopt = SO_BUSY_POLL;
+        break;
+#else
+        LOG(LS_WARNING) << "Socket::OPT_BUSY_POLL not supported.";
+        return -1;
+#endif
+      case OPT_KEEPALIVE:
+        *slevel = SOL_SOCKET;
+        *sopt = SO_KEEPALIVE;
+        break;
+      case OPT_RTT:
+      case OPT_RTTVAR:
+        LOG(LS_WARNING) << "Socket::OPT_RTT and OPT_RTTVAR can only be read,"
+                        << " on Linux.";
+        return -1;
       default:
         ASSERT(false);
         return -1;
@@ -507,6 +865,25 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
     return 0;
   }
 
+  // Makes the socket one of |addr|'s family, if it is a Unix domain
+  // address and the socket isn't, or the other way around.  The socket
+  // made by Create is replaced, which it can only be before it is used, and
+  // loses the options set on it.
+  bool EnsureFamily(const SocketAddress& addr) {
+#ifdef POSIX
+    int family = addr.IsUnix() ? AF_UNIX : AF_INET;
+    if ((family == family_) || (addr.family() == AF_INET6))
+      return true;
+    if (state_ != CS_CLOSED) {
+      SetError(EISCONN);
+      return false;
+    }
+    return CreateT(family, type_);
+#else
+    return true;
+#endif
+  }
+
   PhysicalSocketServer* ss_;
   SOCKET s_;
   uint8 enabled_events_;
@@ -514,6 +891,12 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
   int error_;
   ConnState state_;
   AsyncResolver* resolver_;
+  // The connections Accept has returned, for telling whether a handler
+  // took one.
+  uint32 accept_count_;
+  // What Create made the socket.
+  int family_;
+  int type_;
 
 #ifdef _DEBUG
   std::string dbg_addr_;
@@ -521,10 +904,23 @@ class PhysicalSocket : public AsyncSocket, public txmpp::has_slots<> {
 };
 
 #ifdef POSIX
+// Wakes up the socket server's poller when signaled. On Linux this is an
+// eventfd, elsewhere a pipe. Signals are coalesced: until the event is
+// handled, further calls to Signal cost nothing. If the server brackets its
+// blocking waits with PrepareToSleep and FinishSleep, signals that arrive
+// while it is awake skip the descriptor altogether and just make the next
+// wait return at once.
 class EventDispatcher : public Dispatcher {
  public:
-  EventDispatcher(PhysicalSocketServer* ss) : ss_(ss), fSignaled_(false) {
-    if (pipe(afd_) < 0)
+  EventDispatcher(PhysicalSocketServer* ss)
+      : ss_(ss), fSignaled_(false), fWritten_(false), fSleeping_(true) {
+    afd_[0] = afd_[1] = -1;
+#ifdef LINUX
+    afd_[0] = afd_[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (afd_[0] < 0)
+      LOG_ERR(LS_WARNING) << "eventfd failed; using a pipe";
+#endif
+    if (afd_[0] < 0 && pipe(afd_) < 0)
       LOG(LERROR) << "pipe failed";
     ss_->Add(this);
   }
@@ -532,17 +928,35 @@ class EventDispatcher : public Dispatcher {
   virtual ~EventDispatcher() {
     ss_->Remove(this);
     close(afd_[0]);
-    close(afd_[1]);
+    if (afd_[1] != afd_[0])
+      close(afd_[1]);
   }
 
   virtual void Signal() {
     CritScope cs(&crit_);
     if (!fSignaled_) {
-      const uint8 b[1] = { 0 };
-      if (VERIFY(1 == write(afd_[1], b, sizeof(b)))) {
-        fSignaled_ = true;
-      }
+      fSignaled_ = true;
+      if (fSleeping_)
+        Write();
+    }
+  }
+
+  // Returns false, and resets the event, if it was signaled while the server
+  // was awake; the server should then poll without blocking. Otherwise
+  // Signal writes to the descriptor until FinishSleep is called.
+  bool PrepareToSleep() {
+    CritScope cs(&crit_);
+    if (fSignaled_ && !fWritten_) {
+      fSignaled_ = false;
+      return false;
     }
+    fSleeping_ = true;
+    return true;
+  }
+
+  void FinishSleep() {
+    CritScope cs(&crit_);
+    fSleeping_ = false;
   }
 
   virtual uint32 GetRequestedEvents() {
@@ -554,11 +968,17 @@ class EventDispatcher : public Dispatcher {
     // pipes.  This simulates it by resetting before the event is handled.
 
     CritScope cs(&crit_);
-    if (fSignaled_) {
-      uint8 b[4];  // Allow for reading more than 1 byte, but expect 1.
-      VERIFY(1 == read(afd_[0], b, sizeof(b)));
-      fSignaled_ = false;
+    if (fWritten_) {
+      if (afd_[0] == afd_[1]) {
+        uint64 count;
+        VERIFY(sizeof(count) == read(afd_[0], &count, sizeof(count)));
+      } else {
+        uint8 b[4];  // Allow for reading more than 1 byte, but expect 1.
+        VERIFY(1 == read(afd_[0], b, sizeof(b)));
+      }
+      fWritten_ = false;
     }
+    fSignaled_ = false;
   }
 
   virtual void OnEvent(uint32 ff, int err) {
@@ -574,9 +994,25 @@ class EventDispatcher : public Dispatcher {
   }
 
  private:
+  void Write() {
+    if (fWritten_)
+      return;
+    bool written;
+    if (afd_[0] == afd_[1]) {
+      const uint64 count = 1;
+      written = VERIFY(sizeof(count) == write(afd_[1], &count, sizeof(count)));
+    } else {
+      const uint8 b[1] = { 0 };
+      written = VERIFY(1 == write(afd_[1], b, sizeof(b)));
+    }
+    fWritten_ = written;
+  }
+
   PhysicalSocketServer *ss_;
-  int afd_[2];
+  int afd_[2];  // Both the same eventfd, or the two ends of a pipe.
   bool fSignaled_;
+  bool fWritten_;
+  bool fSleeping_;
   CriticalSection crit_;
 };
 
@@ -771,9 +1207,11 @@ class PosixSignalDispatcher : public Dispatcher {
 
 class SocketDispatcher : public Dispatcher, public PhysicalSocket {
  public:
-  explicit SocketDispatcher(PhysicalSocketServer *ss) : PhysicalSocket(ss) {
+  explicit SocketDispatcher(PhysicalSocketServer *ss)
+      : PhysicalSocket(ss), in_event_(false), closed_in_event_(false) {
   }
-  SocketDispatcher(SOCKET s, PhysicalSocketServer *ss) : PhysicalSocket(ss, s) {
+  SocketDispatcher(SOCKET s, PhysicalSocketServer *ss)
+      : PhysicalSocket(ss, s), in_event_(false), closed_in_event_(false) {
   }
 
   virtual ~SocketDispatcher() {
@@ -786,9 +1224,9 @@ class SocketDispatcher : public Dispatcher, public PhysicalSocket {
     return true;
   }
 
-  virtual bool Create(int type) {
+  virtual bool CreateT(int family, int type) {
     // Change the socket to be non-blocking.
-    if (!PhysicalSocket::Create(type))
+    if (!PhysicalSocket::CreateT(family, type))
       return false;
 
     return Initialize();
@@ -837,6 +1275,10 @@ class SocketDispatcher : public Dispatcher, public PhysicalSocket {
     return enabled_events_;
   }
 
+  virtual bool ReportsBlocking() {
+    return true;
+  }
+
   virtual void OnPreEvent(uint32 ff) {
     if ((ff & DE_CONNECT) != 0)
       state_ = CS_CONNECTED;
@@ -845,25 +1287,48 @@ class SocketDispatcher : public Dispatcher, public PhysicalSocket {
   }
 
   virtual void OnEvent(uint32 ff, int err) {
+    // An event handler usually re-enables the event it was just told about by
+    // calling Recv, Send or Accept again. Rather than updating the poller
+    // twice per event, the net change is passed on once all handlers have run.
+    uint8 old_events = enabled_events_;
+    in_event_ = true;
+    closed_in_event_ = false;
     if ((ff & DE_READ) != 0) {
-      enabled_events_ &= ~DE_READ;
+      DisableEvents(DE_READ);
       SignalReadEvent(this);
     }
     if ((ff & DE_WRITE) != 0) {
-      enabled_events_ &= ~DE_WRITE;
+      DisableEvents(DE_WRITE);
       SignalWriteEvent(this);
     }
     if ((ff & DE_CONNECT) != 0) {
-      enabled_events_ &= ~DE_CONNECT;
+      DisableEvents(DE_CONNECT);
       SignalConnectEvent(this);
     }
     if ((ff & DE_ACCEPT) != 0) {
-      enabled_events_ &= ~DE_ACCEPT;
-      SignalReadEvent(this);
+      // The handler accepts one connection per signal, so while it gets one
+      // more may be waiting. Rather than go back to the poller for each,
+      // signal again until Accept runs out or the budget does.
+      for (int i = 0; i < kAcceptBudget; ++i) {
+        uint32 accepted = accept_count_;
+        DisableEvents(DE_ACCEPT);
+        SignalReadEvent(this);
+        if (closed_in_event_ || accept_count_ == accepted)
+          break;
+      }
     }
+    if (closed_in_event_) {
+      // A handler closed the socket, and may have connected it again. The
+      // rest of what was seen belonged to the old descriptor.
+      closed_in_event_ = false;
+      return;
+    }
+    in_event_ = false;
+    if (enabled_events_ != old_events)
+      ss_->Update(this);
     if ((ff & DE_CLOSE) != 0) {
       // The socket is now dead to us, so stop checking it.
-      enabled_events_ = 0;
+      SetEnabledEvents(0);
       SignalCloseEvent(this, err);
     }
   }
@@ -872,14 +1337,118 @@ class SocketDispatcher : public Dispatcher, public PhysicalSocket {
     if (s_ == INVALID_SOCKET)
       return 0;
 
+    // A descriptor created after this is registered afresh, so its events
+    // can't wait for the handler that closed this one to return.
+    if (in_event_) {
+      in_event_ = false;
+      closed_in_event_ = true;
+    }
     ss_->Remove(this);
     return PhysicalSocket::Close();
   }
+
+ protected:
+  virtual void SetEnabledEvents(uint8 events) {
+    uint8 old_events = enabled_events_;
+    PhysicalSocket::SetEnabledEvents(events);
+    if (!in_event_ && events != old_events)
+      ss_->Update(this);
+  }
+
+  virtual void OnBlocked(uint8 events) {
+    ss_->Blocked(this, events);
+  }
+
+ private:
+  bool in_event_, closed_in_event_;
+};
+
+// A SocketDispatcher for servers whose poller is a CompletionPoller. Stream
+// sockets hand their sends and receives to the poller, which submits them to
+// the kernel in batches; datagram sockets behave as usual.
+class CompletionSocketDispatcher : public SocketDispatcher {
+ public:
+  CompletionSocketDispatcher(CompletionPoller* poller,
+                             PhysicalSocketServer* ss)
+      : SocketDispatcher(ss), poller_(poller) {
+  }
+  CompletionSocketDispatcher(SOCKET s, CompletionPoller* poller,
+                             PhysicalSocketServer* ss)
+      : SocketDispatcher(s, ss), poller_(poller) {
+  }
+
+  virtual bool UsesPollerIo() {
+    return !udp_;
+  }
+
+  virtual bool ReportsBlocking() {
+    return udp_;
+  }
+
+  virtual bool IsDescriptorClosed() {
+    if (udp_)
+      return SocketDispatcher::IsDescriptorClosed();
+    return poller_->IsClosed(this);
+  }
+
+  virtual int Send(const void *pv, size_t cb) {
+    if (udp_)
+      return SocketDispatcher::Send(pv, cb);
+    int sent = poller_->Send(this, pv, cb, &error_);
+    if ((sent < 0) && IsBlockingError(error_)) {
+      EnableEvents(DE_WRITE);
+    }
+    return sent;
+  }
+
+  virtual int SendV(const IoVec* vec, size_t count) {
+    // Sends go through the poller, which takes one buffer at a time.
+    if (udp_)
+      return SocketDispatcher::SendV(vec, count);
+    return SendEach(vec, count);
+  }
+
+  virtual int RecvV(const MutableIoVec* vec, size_t count) {
+    // Receives complete in the poller, into one buffer at a time.
+    if (udp_)
+      return SocketDispatcher::RecvV(vec, count);
+    return RecvEach(vec, count);
+  }
+
+  virtual int SendFile(int fd, size_t offset, size_t len) {
+    // A send straight from the file could overtake those in the poller.
+    if (udp_)
+      return SocketDispatcher::SendFile(fd, offset, len);
+    return AsyncSocket::SendFile(fd, offset, len);
+  }
+
+  virtual int Recv(void *pv, size_t cb) {
+    if (udp_)
+      return SocketDispatcher::Recv(pv, cb);
+    int received = poller_->Recv(this, pv, cb, &error_);
+    if ((received == 0) && (cb != 0)) {
+      // As in PhysicalSocket::Recv, end of stream is reported as blocking and
+      // followed by a close event.
+      EnableEvents(DE_READ);
+      error_ = EWOULDBLOCK;
+      return SOCKET_ERROR;
+    }
+    if ((received >= 0) || IsBlockingError(error_)) {
+      EnableEvents(DE_READ);
+    } else {
+      LOG_F(LS_VERBOSE) << "Error = " << error_;
+    }
+    return received;
+  }
+
+ private:
+  CompletionPoller* poller_;
 };
 
 class FileDispatcher: public Dispatcher, public AsyncFile {
  public:
-  FileDispatcher(int fd, PhysicalSocketServer *ss) : ss_(ss), fd_(fd) {
+  FileDispatcher(int fd, PhysicalSocketServer *ss)
+      : ss_(ss), fd_(fd), flags_(0) {
     set_readable(true);
 
     ss_->Add(this);
@@ -923,6 +1492,7 @@ class FileDispatcher: public Dispatcher, public AsyncFile {
 
   virtual void set_readable(bool value) {
     flags_ = value ? (flags_ | DE_READ) : (flags_ & ~DE_READ);
+    ss_->Update(this);
   }
 
   virtual bool writable() {
@@ -931,6 +1501,7 @@ class FileDispatcher: public Dispatcher, public AsyncFile {
 
   virtual void set_writable(bool value) {
     flags_ = value ? (flags_ | DE_WRITE) : (flags_ & ~DE_WRITE);
+    ss_->Update(this);
   }
 
  private:
@@ -1126,31 +1697,528 @@ class SocketDispatcher : public Dispatcher, public PhysicalSocket {
 
 int SocketDispatcher::next_id_ = 0;
 
-#endif  // WIN32
+// I/O completion port support. Instead of having every socket's network
+// events looked at on each wakeup, an IocpSocketDispatcher keeps an
+// overlapped operation outstanding for each event it wants, and Wait only
+// hears about the ones that completed:
+//  - readability is a zero-byte WSARecv (peeking, for datagrams), followed
+//    by a peek to tell data apart from end-of-stream;
+//  - a stream send that would block is taken over by an overlapped WSASend,
+//    and the write event fires when it completes; while the socket is already
+//    known to be writable, the write event is posted to the port directly,
+//    as a notice of its own, so that it does not hold up a send;
+//  - connect and accept use ConnectEx and AcceptEx.
+// An operation can complete after its socket has been closed, so the requests
+// live in an IocpSocketState that is only freed once none of them is pending.
+
+static const ULONG_PTR kIocpWakeUpKey = 0;
+static const ULONG_PTR kIocpSocketKey = 1;
+
+class IocpSocketDispatcher;
+struct IocpSocketState;
+
+enum IocpRequestKind {
+  IOCP_READ,
+  IOCP_WRITE,
+  IOCP_WRITABLE,
+  IOCP_CONNECT,
+  IOCP_ACCEPT,
+};
 
-// Sets the value of a boolean value to false when signaled.
-class Signaler : public EventDispatcher {
- public:
-  Signaler(PhysicalSocketServer* ss, bool* pf)
-      : EventDispatcher(ss), pf_(pf) {
+struct IocpRequest {
+  OVERLAPPED overlapped;  // Must be first.
+  IocpSocketState* state;
+  IocpRequestKind kind;
+  bool pending;
+
+  void Reset() {
+    memset(&overlapped, 0, sizeof(overlapped));
   }
-  virtual ~Signaler() { }
+};
 
-  void OnEvent(uint32 ff, int err) {
-    if (pf_)
-      *pf_ = false;
+struct IocpSocketState {
+  explicit IocpSocketState(IocpSocketDispatcher* dispatcher)
+      : owner(dispatcher), send_offset(0), accept_socket(INVALID_SOCKET) {
+    IocpRequest* requests[] = { &read, &write, &writable, &connect, &accept };
+    IocpRequestKind kinds[] = { IOCP_READ, IOCP_WRITE, IOCP_WRITABLE,
+                                IOCP_CONNECT, IOCP_ACCEPT };
+    for (int i = 0; i < ARRAY_SIZE(requests); ++i) {
+      requests[i]->Reset();
+      requests[i]->state = this;
+      requests[i]->kind = kinds[i];
+      requests[i]->pending = false;
+    }
   }
 
- private:
-  bool *pf_;
+  ~IocpSocketState() {
+    if (accept_socket != INVALID_SOCKET)
+      closesocket(accept_socket);
+  }
+
+  bool IsPending() const {
+    return read.pending || write.pending || writable.pending ||
+           connect.pending || accept.pending;
+  }
+
+  IocpSocketDispatcher* owner;  // NULL once the dispatcher has let go.
+  IocpRequest read;
+  IocpRequest write;     // The outstanding WSASend.
+  IocpRequest writable;  // The write event posted while no send is.
+  IocpRequest connect;
+  IocpRequest accept;
+  Buffer send_buffer;       // Data owned by the outstanding WSASend.
+  size_t send_offset;
+  SOCKET accept_socket;     // The socket the outstanding AcceptEx fills in.
+  char accept_addresses[2 * (sizeof(sockaddr_in) + 16)];
 };
 
-PhysicalSocketServer::PhysicalSocketServer()
-    : fWait_(false),
-      last_tick_tracked_(0),
-      last_tick_dispatch_count_(0) {
+template <typename F>
+static F GetExtensionFunction(SOCKET s, GUID guid) {
+  F function = NULL;
+  DWORD bytes = 0;
+  if (WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid),
+               &function, sizeof(function), &bytes, NULL, NULL) != 0) {
+    LOG_ERR(LS_ERROR) << "WSAIoctl(SIO_GET_EXTENSION_FUNCTION_POINTER)";
+    return NULL;
+  }
+  return function;
+}
+
+class IocpSocketDispatcher : public Dispatcher, public PhysicalSocket {
+ public:
+  explicit IocpSocketDispatcher(PhysicalSocketServer* ss)
+      : PhysicalSocket(ss), iocp_(NULL), accepted_(INVALID_SOCKET),
+        in_event_(false) {
+  }
+
+  IocpSocketDispatcher(SOCKET s, PhysicalSocketServer* ss)
+      : PhysicalSocket(ss, s), iocp_(NULL), accepted_(INVALID_SOCKET),
+        in_event_(false) {
+  }
+
+  virtual ~IocpSocketDispatcher() {
+    Close();
+  }
+
+  bool Initialize() {
+    ASSERT(s_ != INVALID_SOCKET);
+    u_long argp = 1;
+    ioctlsocket(s_, FIONBIO, &argp);
+    if (CreateIoCompletionPort(reinterpret_cast<HANDLE>(s_), ss_->iocp(),
+                               kIocpSocketKey, 0) == NULL) {
+      LOG_GLE(LS_ERROR) << "CreateIoCompletionPort";
+      return false;
+    }
+    iocp_ = new IocpSocketState(this);
+    ss_->Add(this);
+    RequestEvents();
+    return true;
+  }
+
+  virtual bool Create(int type) {
+    if (!PhysicalSocket::Create(type))
+      return false;
+    return Initialize();
+  }
+
+  virtual int DoConnect(const SocketAddress& addr) {
+    // ConnectEx only works on a bound socket.
+    sockaddr_in saddr;
+    int len = sizeof(saddr);
+    if (::getsockname(s_, (sockaddr*)&saddr, &len) != 0) {
+      SocketAddress any;
+      any.ToSockAddr(&saddr);
+      if (::bind(s_, (sockaddr*)&saddr, sizeof(saddr)) != 0) {
+        UpdateLastError();
+        return SOCKET_ERROR;
+      }
+    }
+
+    GUID guid = WSAID_CONNECTEX;
+    LPFN_CONNECTEX connect_ex = GetExtensionFunction<LPFN_CONNECTEX>(s_, guid);
+    if (!connect_ex) {
+      UpdateLastError();
+      return SOCKET_ERROR;
+    }
+
+    addr.ToSockAddr(&saddr);
+    iocp_->connect.Reset();
+    if (!connect_ex(s_, (sockaddr*)&saddr, sizeof(saddr), NULL, 0, NULL,
+                    &iocp_->connect.overlapped) &&
+        WSAGetLastError() != ERROR_IO_PENDING) {
+      UpdateLastError();
+      return SOCKET_ERROR;
+    }
+    iocp_->connect.pending = true;
+    state_ = CS_CONNECTING;
+    EnableEvents(DE_CONNECT | DE_READ | DE_WRITE);
+    return 0;
+  }
+
+  virtual int Send(const void *pv, size_t cb) {
+    if (udp_)
+      return PhysicalSocket::Send(pv, cb);
+    if (iocp_->write.pending) {
+      // An overlapped send still owns the socket; the write event tells the
+      // caller when to try again.
+      SetError(WSAEWOULDBLOCK);
+      EnableEvents(DE_WRITE);
+      return SOCKET_ERROR;
+    }
+    int sent = ::send(s_, reinterpret_cast<const char *>(pv),
+                      static_cast<int>(cb), 0);
+    UpdateLastError();
+    if ((sent < 0) && IsBlockingError(error_)) {
+      iocp_->send_buffer.SetData(pv, cb);
+      iocp_->send_offset = 0;
+      if (!StartSend())
+        return SOCKET_ERROR;
+      error_ = 0;
+      sent = static_cast<int>(cb);
+    }
+    return sent;
+  }
+
+  virtual int SendV(const IoVec* vec, size_t count) {
+    // A blocked send is handed to an overlapped send of one buffer.
+    if (udp_)
+      return PhysicalSocket::SendV(vec, count);
+    return SendEach(vec, count);
+  }
+
+  virtual int Listen(int backlog) {
+    int err = PhysicalSocket::Listen(backlog);
+    if (err == 0)
+      StartAccept();
+    return err;
+  }
+
+  virtual AsyncSocket* Accept(SocketAddress *paddr) {
+    if (accepted_ == INVALID_SOCKET) {
+      SetError(WSAEWOULDBLOCK);
+      EnableEvents(DE_ACCEPT);
+      return NULL;
+    }
+    SOCKET s = accepted_;
+    accepted_ = INVALID_SOCKET;
+    if (paddr != NULL) {
+      sockaddr_in saddr;
+      int len = sizeof(saddr);
+      if (::getpeername(s, (sockaddr*)&saddr, &len) == 0)
+        paddr->FromSockAddr(saddr);
+    }
+    EnableEvents(DE_ACCEPT);
+    StartAccept();
+    return ss_->WrapSocket(s);
+  }
+
+  virtual int Close() {
+    if (s_ == INVALID_SOCKET)
+      return 0;
+
+    ss_->Remove(this);
+    if (accepted_ != INVALID_SOCKET) {
+      closesocket(accepted_);
+      accepted_ = INVALID_SOCKET;
+    }
+    // Closing the socket aborts whatever is outstanding on it; the aborted
+    // requests still come back through the port, and free the state then.
+    int err = PhysicalSocket::Close();
+    if (iocp_) {
+      iocp_->owner = NULL;
+      if (!iocp_->IsPending())
+        delete iocp_;
+      iocp_ = NULL;
+    }
+    return err;
+  }
+
+  virtual uint32 GetRequestedEvents() {
+    return enabled_events_;
+  }
+
+  virtual void OnPreEvent(uint32 ff) {
+    if ((ff & DE_CONNECT) != 0)
+      state_ = CS_CONNECTED;
+    if ((ff & DE_CLOSE) != 0)
+      state_ = CS_CLOSED;
+  }
+
+  virtual void OnEvent(uint32 ff, int err) {
+    // As with the POSIX SocketDispatcher, re-enabled events are only acted on
+    // once all the handlers have run.
+    in_event_ = true;
+    if ((ff & DE_READ) != 0) {
+      DisableEvents(DE_READ);
+      SignalReadEvent(this);
+    }
+    if ((ff & DE_WRITE) != 0) {
+      DisableEvents(DE_WRITE);
+      SignalWriteEvent(this);
+    }
+    if ((ff & DE_CONNECT) != 0) {
+      DisableEvents(DE_CONNECT);
+      SignalConnectEvent(this);
+    }
+    if ((ff & DE_ACCEPT) != 0) {
+      DisableEvents(DE_ACCEPT);
+      SignalReadEvent(this);
+    }
+    in_event_ = false;
+    RequestEvents();
+    if ((ff & DE_CLOSE) != 0) {
+      SetEnabledEvents(0);
+      SignalCloseEvent(this, err);
+    }
+  }
+
+  virtual WSAEVENT GetWSAEvent() {
+    return WSA_INVALID_EVENT;
+  }
+
+  virtual SOCKET GetSocket() {
+    return s_;
+  }
+
+  virtual bool CheckSignalClose() {
+    return false;
+  }
+
+  // Called by the socket server for every completion of one of our requests.
+  void OnIoCompleted(IocpRequest* request, DWORD bytes, DWORD error) {
+    request->pending = false;
+    uint32 ff = 0;
+    int err = static_cast<int>(error);
+    switch (request->kind) {
+      case IOCP_READ:
+        if ((enabled_events_ & DE_READ) == 0)
+          break;
+        if (error != 0) {
+          ff = DE_CLOSE;
+        } else if (udp_) {
+          ff = DE_READ;
+        } else {
+          char ch;
+          int res = ::recv(s_, &ch, 1, MSG_PEEK);
+          if (res > 0) {
+            ff = DE_READ;
+          } else if (res == 0) {
+            ff = DE_CLOSE;
+          } else if (IsBlockingError(WSAGetLastError())) {
+            // Spurious; wait for the next one.
+            RequestEvents();
+          } else {
+            ff = DE_CLOSE;
+            err = WSAGetLastError();
+          }
+        }
+        break;
+
+      case IOCP_WRITE:
+        if (error != 0) {
+          iocp_->send_buffer.SetLength(0);
+          ff = DE_CLOSE;
+          break;
+        }
+        if (iocp_->send_buffer.length() != 0) {
+          iocp_->send_offset += bytes;
+          if (iocp_->send_offset < iocp_->send_buffer.length()) {
+            if (!StartSend()) {
+              ff = DE_CLOSE;
+              err = error_;
+            }
+            break;
+          }
+          iocp_->send_buffer.SetLength(0);
+        }
+        if (enabled_events_ & DE_WRITE)
+          ff = DE_WRITE;
+        break;
+
+      case IOCP_WRITABLE:
+        // A send started since this was posted signals when it completes.
+        if ((enabled_events_ & DE_WRITE) && !iocp_->write.pending)
+          ff = DE_WRITE;
+        break;
+
+      case IOCP_CONNECT:
+        if (error != 0) {
+          ff = DE_CLOSE;
+        } else {
+          ::setsockopt(s_, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0);
+          ff = DE_CONNECT;
+        }
+        break;
+
+      case IOCP_ACCEPT:
+        if (error != 0) {
+          LOG_ERR_EX(LS_WARNING, error) << "AcceptEx";
+          closesocket(iocp_->accept_socket);
+          iocp_->accept_socket = INVALID_SOCKET;
+          StartAccept();
+          break;
+        }
+        ::setsockopt(iocp_->accept_socket, SOL_SOCKET,
+                     SO_UPDATE_ACCEPT_CONTEXT,
+                     reinterpret_cast<char*>(&s_), sizeof(s_));
+        accepted_ = iocp_->accept_socket;
+        iocp_->accept_socket = INVALID_SOCKET;
+        if (enabled_events_ & DE_ACCEPT)
+          ff = DE_ACCEPT;
+        break;
+    }
+
+    if (ff != 0) {
+      OnPreEvent(ff);
+      OnEvent(ff, err);
+    }
+  }
+
+ protected:
+  virtual void SetEnabledEvents(uint8 events) {
+    PhysicalSocket::SetEnabledEvents(events);
+    if (!in_event_)
+      RequestEvents();
+  }
+
+ private:
+  // Makes sure an operation is outstanding for every event that is enabled.
+  void RequestEvents() {
+    if (!iocp_ || s_ == INVALID_SOCKET)
+      return;
+    if (!udp_ && state_ != CS_CONNECTED)
+      return;
+    if ((enabled_events_ & DE_READ) && !iocp_->read.pending) {
+      WSABUF buf = { 0, NULL };
+      DWORD flags = udp_ ? MSG_PEEK : 0;
+      iocp_->read.Reset();
+      iocp_->read.pending = true;
+      if (WSARecv(s_, &buf, 1, NULL, &flags, &iocp_->read.overlapped, NULL)
+          != 0 && WSAGetLastError() != WSA_IO_PENDING) {
+        // Let the failure surface through the completion like any other.
+        PostQueuedCompletionStatus(ss_->iocp(), 0, kIocpSocketKey,
+                                   &iocp_->read.overlapped);
+      }
+    }
+    if ((enabled_events_ & DE_WRITE) && !iocp_->write.pending &&
+        !iocp_->writable.pending) {
+      iocp_->writable.Reset();
+      iocp_->writable.pending = true;
+      PostQueuedCompletionStatus(ss_->iocp(), 0, kIocpSocketKey,
+                                 &iocp_->writable.overlapped);
+    }
+  }
+
+  bool StartSend() {
+    WSABUF buf;
+    buf.buf = iocp_->send_buffer.data() + iocp_->send_offset;
+    buf.len = static_cast<u_long>(iocp_->send_buffer.length() -
+                                  iocp_->send_offset);
+    iocp_->write.Reset();
+    if (WSASend(s_, &buf, 1, NULL, 0, &iocp_->write.overlapped, NULL) != 0 &&
+        WSAGetLastError() != WSA_IO_PENDING) {
+      UpdateLastError();
+      iocp_->send_buffer.SetLength(0);
+      return false;
+    }
+    iocp_->write.pending = true;
+    return true;
+  }
+
+  void StartAccept() {
+    if (iocp_->accept.pending || accepted_ != INVALID_SOCKET)
+      return;
+    GUID guid = WSAID_ACCEPTEX;
+    LPFN_ACCEPTEX accept_ex = GetExtensionFunction<LPFN_ACCEPTEX>(s_, guid);
+    if (!accept_ex)
+      return;
+    iocp_->accept_socket = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL,
+                                     0, WSA_FLAG_OVERLAPPED);
+    if (iocp_->accept_socket == INVALID_SOCKET) {
+      LOG_ERR(LS_ERROR) << "WSASocket";
+      return;
+    }
+    DWORD bytes = 0;
+    iocp_->accept.Reset();
+    if (!accept_ex(s_, iocp_->accept_socket, iocp_->accept_addresses, 0,
+                   sizeof(sockaddr_in) + 16, sizeof(sockaddr_in) + 16,
+                   &bytes, &iocp_->accept.overlapped) &&
+        WSAGetLastError() != ERROR_IO_PENDING) {
+      LOG_ERR(LS_ERROR) << "AcceptEx";
+      closesocket(iocp_->accept_socket);
+      iocp_->accept_socket = INVALID_SOCKET;
+      return;
+    }
+    iocp_->accept.pending = true;
+  }
+
+  IocpSocketState* iocp_;
+  SOCKET accepted_;  // Accepted by AcceptEx, not yet picked up by Accept.
+  bool in_event_;
+};
+
+static void ProcessIocpCompletion(OVERLAPPED* overlapped, DWORD bytes,
+                                  DWORD error) {
+  IocpRequest* request = reinterpret_cast<IocpRequest*>(overlapped);
+  IocpSocketState* state = request->state;
+  if (state->owner == NULL) {
+    // The socket was closed while this was outstanding.
+    request->pending = false;
+    if (!state->IsPending())
+      delete state;
+    return;
+  }
+  state->owner->OnIoCompleted(request, bytes, error);
+}
+
+#endif  // WIN32
+
+// Sets the value of a boolean value to false when signaled.
+class Signaler : public EventDispatcher {
+ public:
+  Signaler(PhysicalSocketServer* ss, bool* pf)
+      : EventDispatcher(ss), pf_(pf) {
+  }
+  virtual ~Signaler() { }
+
+  void OnEvent(uint32 ff, int err) {
+    if (pf_)
+      *pf_ = false;
+  }
+
+ private:
+  bool *pf_;
+};
+
+PhysicalSocketServer::PhysicalSocketServer(PollerType poller_type)
+    : dispatcher_count_(0),
+      iterating_(0),
+      fWait_(false),
+      last_tick_tracked_(0),
+      last_tick_dispatch_count_(0),
+      spin_us_(0),
+      socket_busy_poll_us_(0) {
+  crit_.SetName("PhysicalSocketServer");
+#ifdef POSIX
+  poller_.reset(Poller::Create(poller_type, &crit_));
+  if (!poller_.get() && poller_type != POLLER_DEFAULT) {
+    LOG(LS_WARNING) << "Falling back to the default poller";
+    poller_.reset(Poller::Create(POLLER_DEFAULT, &crit_));
+  }
+  if (!poller_.get()) {
+    LOG(LS_WARNING) << "Falling back to select()";
+    poller_.reset(Poller::Create(POLLER_SELECT, &crit_));
+  }
+  ASSERT(poller_.get() != NULL);
+#endif
   signal_wakeup_ = new Signaler(this, &fWait_);
 #ifdef WIN32
+  iocp_ = NULL;
+  if (poller_type == POLLER_IOCP) {
+    iocp_ = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    if (iocp_ == NULL)
+      LOG_GLE(LS_WARNING) << "CreateIoCompletionPort; using WSAEventSelect";
+  }
   socket_ev_ = WSACreateEvent();
 #endif
 }
@@ -1158,16 +2226,22 @@ PhysicalSocketServer::PhysicalSocketServer()
 PhysicalSocketServer::~PhysicalSocketServer() {
 #ifdef WIN32
   WSACloseEvent(socket_ev_);
+  if (iocp_ != NULL)
+    CloseHandle(iocp_);
 #endif
 #ifdef POSIX
   signal_dispatcher_.reset();
 #endif
   delete signal_wakeup_;
-  ASSERT(dispatchers_.empty());
+  ASSERT(dispatcher_count_ == 0);
 }
 
 void PhysicalSocketServer::WakeUp() {
   signal_wakeup_->Signal();
+#ifdef WIN32
+  if (iocp_ != NULL)
+    PostQueuedCompletionStatus(iocp_, 0, kIocpWakeUpKey, NULL);
+#endif
 }
 
 Socket* PhysicalSocketServer::CreateSocket(int type) {
@@ -1181,6 +2255,29 @@ Socket* PhysicalSocketServer::CreateSocket(int type) {
 }
 
 AsyncSocket* PhysicalSocketServer::CreateAsyncSocket(int type) {
+#ifdef WIN32
+  if (iocp_ != NULL) {
+    IocpSocketDispatcher* dispatcher = new IocpSocketDispatcher(this);
+    if (dispatcher->Create(type)) {
+      return dispatcher;
+    } else {
+      delete dispatcher;
+      return 0;
+    }
+  }
+#endif
+#ifdef POSIX
+  if (poller_->type() == POLLER_IO_URING) {
+    CompletionSocketDispatcher* dispatcher = new CompletionSocketDispatcher(
+        static_cast<CompletionPoller*>(poller_.get()), this);
+    if (dispatcher->Create(type)) {
+      return dispatcher;
+    } else {
+      delete dispatcher;
+      return 0;
+    }
+  }
+#endif
   SocketDispatcher* dispatcher = new SocketDispatcher(this);
   if (dispatcher->Create(type)) {
     return dispatcher;
@@ -1191,6 +2288,29 @@ AsyncSocket* PhysicalSocketServer::CreateAsyncSocket(int type) {
 }
 
 AsyncSocket* PhysicalSocketServer::WrapSocket(SOCKET s) {
+#ifdef WIN32
+  if (iocp_ != NULL) {
+    IocpSocketDispatcher* dispatcher = new IocpSocketDispatcher(s, this);
+    if (dispatcher->Initialize()) {
+      return dispatcher;
+    } else {
+      delete dispatcher;
+      return 0;
+    }
+  }
+#endif
+#ifdef POSIX
+  if (poller_->type() == POLLER_IO_URING) {
+    CompletionSocketDispatcher* dispatcher = new CompletionSocketDispatcher(
+        s, static_cast<CompletionPoller*>(poller_.get()), this);
+    if (dispatcher->Initialize()) {
+      return dispatcher;
+    } else {
+      delete dispatcher;
+      return 0;
+    }
+  }
+#endif
   SocketDispatcher* dispatcher = new SocketDispatcher(s, this);
   if (dispatcher->Initialize()) {
     return dispatcher;
@@ -1203,95 +2323,287 @@ AsyncSocket* PhysicalSocketServer::WrapSocket(SOCKET s) {
 void PhysicalSocketServer::Add(Dispatcher *pdispatcher) {
   CritScope cs(&crit_);
   // Prevent duplicates. This can cause dead dispatchers to stick around.
-  DispatcherList::iterator pos = std::find(dispatchers_.begin(),
-                                           dispatchers_.end(),
-                                           pdispatcher);
-  if (pos != dispatchers_.end())
+  if (pdispatcher->slot_ != Dispatcher::kNoSlot)
     return;
-  dispatchers_.push_back(pdispatcher);
+  if (free_slots_.empty()) {
+    pdispatcher->slot_ = dispatchers_.size();
+    dispatchers_.push_back(pdispatcher);
+  } else {
+    pdispatcher->slot_ = free_slots_.back();
+    free_slots_.pop_back();
+    dispatchers_[pdispatcher->slot_] = pdispatcher;
+  }
+  ++dispatcher_count_;
+#ifdef POSIX
+  poller_->Add(pdispatcher);
+#endif
 }
 
 void PhysicalSocketServer::Remove(Dispatcher *pdispatcher) {
   CritScope cs(&crit_);
-  DispatcherList::iterator pos = std::find(dispatchers_.begin(),
-                                           dispatchers_.end(),
-                                           pdispatcher);
-  ASSERT(pos != dispatchers_.end());
-  size_t index = pos - dispatchers_.begin();
-  dispatchers_.erase(pos);
-  for (IteratorList::iterator it = iterators_.begin(); it != iterators_.end();
+  size_t slot = pdispatcher->slot_;
+  ASSERT(slot < dispatchers_.size() && dispatchers_[slot] == pdispatcher);
+  if (slot >= dispatchers_.size() || dispatchers_[slot] != pdispatcher)
+    return;
+#ifdef POSIX
+  poller_->Remove(pdispatcher);
+  for (PendingEventList::iterator it = pending_.begin(); it != pending_.end();
        ++it) {
-    if (index < **it) {
-      --**it;
+    for (size_t i = 0; i < (*it)->size(); ++i) {
+      if ((**it)[i].dispatcher == pdispatcher)
+        (**it)[i].dispatcher = NULL;
+    }
+  }
+#endif
+  dispatchers_[slot] = NULL;
+  pdispatcher->slot_ = Dispatcher::kNoSlot;
+  --dispatcher_count_;
+  if (iterating_ > 0) {
+    retired_slots_.push_back(slot);
+  } else {
+    free_slots_.push_back(slot);
+  }
+}
+
+size_t PhysicalSocketServer::dispatcher_count() {
+  CritScope cs(&crit_);
+  return dispatcher_count_;
+}
+
+void PhysicalSocketServer::GetDispatcherTelemetry(
+    std::vector<DispatcherStat>* dispatchers) {
+  CritScope cs(&crit_);
+  for (size_t i = 0; i < dispatchers_.size(); ++i) {
+    if (dispatchers_[i]) {
+      dispatchers->push_back(DispatcherStat(dispatchers_[i],
+                                            dispatchers_[i]->telemetry_));
     }
   }
 }
 
+void PhysicalSocketServer::SetBusyPoll(int spin_us, int socket_busy_poll_us) {
+  spin_us_ = _max(0, spin_us);
+  socket_busy_poll_us_ = _max(0, socket_busy_poll_us);
+}
+
+void PhysicalSocketServer::DispatchEvent(Dispatcher* dispatcher, uint32 ff,
+                                         int err) {
+  dispatcher->OnPreEvent(ff);
+  LibraryMetrics::Add(LibraryMetrics::LM_SOCKET_EVENTS);
+  TXMPP_TRACE2(socket_event_start, dispatcher, ff);
+  StallDetector* detector = StallDetector::Current();
+#if SOCKETSERVER_TELEMETRY
+  uint64 start = TimeMicros();
+  // Counted first, as the handler may delete the dispatcher.
+  DispatcherTelemetry* telemetry = &dispatcher->telemetry_;
+  ++telemetry->events;
+  size_t slot = dispatcher->slot_;
+  telemetry_.event_start = start;
+  if (detector) {
+    detector->Begin(StallDetector::SK_SOCKET_EVENT,
+                    typeid(*dispatcher).name(), ff);
+  }
+  dispatcher->OnEvent(ff, err);
+  if (detector)
+    detector->End();
+  telemetry_.event_start = 0;
+  TXMPP_TRACE1(socket_event_end, dispatcher);
+  uint64 elapsed = TimeMicros() - start;
+  telemetry_.callback.Add(static_cast<uint32>(elapsed));
+  LibraryMetrics::Record(LibraryMetrics::LM_SOCKET_EVENT_US,
+                         static_cast<uint32>(elapsed));
+  if (slot < dispatchers_.size() && dispatchers_[slot] == dispatcher)
+    telemetry->micros += elapsed;
+#else
+  if (detector) {
+    detector->Begin(StallDetector::SK_SOCKET_EVENT,
+                    typeid(*dispatcher).name(), ff);
+  }
+  dispatcher->OnEvent(ff, err);
+  if (detector)
+    detector->End();
+  TXMPP_TRACE1(socket_event_end, dispatcher);
+#endif
+}
+
+void PhysicalSocketServer::BeginIteration() {
+  ++iterating_;
+}
+
+void PhysicalSocketServer::EndIteration() {
+  ASSERT(iterating_ > 0);
+  if (--iterating_ == 0) {
+    free_slots_.insert(free_slots_.end(), retired_slots_.begin(),
+                       retired_slots_.end());
+    retired_slots_.clear();
+  }
+}
+
+void PhysicalSocketServer::Update(Dispatcher *pdispatcher) {
 #ifdef POSIX
-bool PhysicalSocketServer::Wait(int cmsWait, bool process_io) {
-  // Calculate timing information
+  CritScope cs(&crit_);
+  poller_->Update(pdispatcher);
+#endif
+}
 
-  struct timeval *ptvWait = NULL;
-  struct timeval tvWait;
-  struct timeval tvStop;
-  if (cmsWait != kForever) {
-    // Calculate wait timeval
-    tvWait.tv_sec = cmsWait / 1000;
-    tvWait.tv_usec = (cmsWait % 1000) * 1000;
-    ptvWait = &tvWait;
+void PhysicalSocketServer::Blocked(Dispatcher *pdispatcher, uint32 events) {
+#ifdef POSIX
+  CritScope cs(&crit_);
+  poller_->Blocked(pdispatcher, events);
+#endif
+}
 
-    // Calculate when to return in a timeval
-    gettimeofday(&tvStop, NULL);
-    tvStop.tv_sec += tvWait.tv_sec;
-    tvStop.tv_usec += tvWait.tv_usec;
-    if (tvStop.tv_usec >= 1000000) {
-      tvStop.tv_usec -= 1000000;
-      tvStop.tv_sec += 1;
+#ifdef POSIX
+PollerType PhysicalSocketServer::poller_type() const {
+  return poller_->type();
+}
+#endif
+
+#ifdef POSIX
+// Translates what the poller saw on a descriptor into dispatcher events,
+// returned with the error code in |perr|.
+// Unless |probe| is set, the poller has reported errors and hangups through
+// PF_ERROR and PF_HANGUP, and the descriptor is only examined when it did.
+static uint32 ProcessPollerEvent(Dispatcher* pdispatcher, uint32 flags,
+                                 bool probe, int* perr) {
+  int fd = pdispatcher->GetDescriptor();
+  uint32 requested = pdispatcher->GetRequestedEvents();
+  uint32 ff = 0;
+  int errcode = 0;
+  bool suspect = probe || (flags & (PF_ERROR | PF_HANGUP)) != 0;
+
+  // Reap any error code, which can be signaled through reads or writes.
+  // TODO: Should we set errcode if getsockopt fails?
+  if (suspect) {
+    socklen_t len = sizeof(errcode);
+    ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &errcode, &len);
+  }
+
+  // Check readable descriptors. If we're waiting on an accept, signal
+  // that. Otherwise we're waiting for data, check to see if we're
+  // readable or really closed.
+  // TODO: Only peek at TCP descriptors.
+  if ((flags & PF_READ) && (requested & (DE_READ | DE_ACCEPT))) {
+    if (requested & DE_ACCEPT) {
+      ff |= DE_ACCEPT;
+    } else if (errcode || (suspect && pdispatcher->IsDescriptorClosed())) {
+      ff |= DE_CLOSE;
+    } else {
+      ff |= DE_READ;
+    }
+  }
+
+  // Check writable descriptors. If we're waiting on a connect, detect
+  // success versus failure by the reaped error code.
+  if ((flags & PF_WRITE) && (requested & (DE_WRITE | DE_CONNECT))) {
+    if (requested & DE_CONNECT) {
+      if (!errcode) {
+        ff |= DE_CONNECT;
+      } else {
+        ff |= DE_CLOSE;
+      }
+    } else {
+      ff |= DE_WRITE;
     }
   }
 
-  // Zero all fd_sets. Don't need to do this inside the loop since
-  // select() zeros the descriptors not signaled
+  *perr = errcode;
+  return ff;
+}
 
-  fd_set fdsRead;
-  FD_ZERO(&fdsRead);
-  fd_set fdsWrite;
-  FD_ZERO(&fdsWrite);
+// Used while I/O processing is disabled, when only the wakeup signaler needs
+// to be watched and the poller's interest set does not apply.
+int PhysicalSocketServer::WaitForWakeUp(int cms, PollerEventList* events) {
+  struct pollfd pfd;
+  pfd.fd = signal_wakeup_->GetDescriptor();
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  int n = poll(&pfd, 1, cms);
+  if (n > 0 && (pfd.revents & (POLLIN | POLLERR | POLLHUP))) {
+    PollerEvent event;
+    event.dispatcher = signal_wakeup_;
+    event.flags = PF_READ;
+    if (pfd.revents & POLLERR)
+      event.flags |= PF_ERROR;
+    if (pfd.revents & POLLHUP)
+      event.flags |= PF_HANGUP;
+    events->push_back(event);
+  }
+  return n;
+}
 
+bool PhysicalSocketServer::Wait(int cmsWait, bool process_io) {
+  // Calculate when to return
+  uint32 msStop = 0;
+  if (cmsWait != kForever)
+    msStop = TimeAfter(cmsWait);
+
+  PollerEventList events;
+  // WaitForWakeUp reports hangups on its own.
+  bool probe = process_io && !poller_->ReportsHangups();
   fWait_ = true;
 
   while (fWait_) {
-    int fdmax = -1;
-    {
-      CritScope cr(&crit_);
-      for (size_t i = 0; i < dispatchers_.size(); ++i) {
-        // Query dispatchers for read and write wait state
-        Dispatcher *pdispatcher = dispatchers_[i];
-        ASSERT(pdispatcher);
-        if (!process_io && (pdispatcher != signal_wakeup_))
-          continue;
-        int fd = pdispatcher->GetDescriptor();
-        if (fd > fdmax)
-          fdmax = fd;
-
-        uint32 ff = pdispatcher->GetRequestedEvents();
-        if (ff & (DE_READ | DE_ACCEPT))
-          FD_SET(fd, &fdsRead);
-        if (ff & (DE_WRITE | DE_CONNECT))
-          FD_SET(fd, &fdsWrite);
-      }
-    }
+    int cmsNext = kForever;
+    if (cmsWait != kForever)
+      cmsNext = _max(0, TimeUntil(msStop));
 
     // Wait then call handlers as appropriate
     // < 0 means error
     // 0 means timeout
-    // > 0 means count of descriptors ready
-    int n = select(fdmax + 1, &fdsRead, &fdsWrite, NULL, ptvWait);
+    // > 0 means descriptors are ready
+    // A WakeUp that came while we were busy needs no system call: look for
+    // I/O without blocking and then return.
+    if (!signal_wakeup_->PrepareToSleep()) {
+      cmsNext = 0;
+      fWait_ = false;
+    }
+
+    events.clear();
+    int n = 0;
+    // Spin first, if asked to.  The wakeup descriptor is armed already, so
+    // a WakeUp ends the spin as well.
+    if (process_io && spin_us_ > 0 && cmsNext != 0) {
+      uint64 spin_start = TimeMicros();
+      uint64 spin_stop = spin_start + spin_us_;
+      if (cmsNext != kForever)
+        spin_stop = _min(spin_stop, spin_start + cmsNext * 1000ULL);
+      uint64 now;
+      do {
+        n = poller_->Wait(0, &events);
+        now = TimeMicros();
+      } while (n == 0 && now < spin_stop);
+#if SOCKETSERVER_TELEMETRY
+      telemetry_.spin.Add(static_cast<uint32>(now - spin_start));
+#endif
+      if (n == 0 && cmsWait != kForever)
+        cmsNext = _max(0, TimeUntil(msStop));
+    }
+    if (n == 0) {
+#if SOCKETSERVER_TELEMETRY
+      uint64 start = TimeMicros();
+#endif
+      TXMPP_TRACE1(socket_wait_start, cmsNext);
+      if (process_io) {
+        n = poller_->Wait(cmsNext, &events);
+      } else {
+        n = WaitForWakeUp(cmsNext, &events);
+      }
+      TXMPP_TRACE1(socket_wait_end, n);
+#if SOCKETSERVER_TELEMETRY
+      telemetry_.wait.Add(static_cast<uint32>(TimeMicros() - start));
+#endif
+    }
+    signal_wakeup_->FinishSleep();
+#if SOCKETSERVER_TELEMETRY
+    if (n > 0)
+      telemetry_.ready.Add(static_cast<uint32>(events.size()));
+#endif
 
     // If error, return error.
     if (n < 0) {
       if (errno != EINTR) {
-        LOG_E(LS_ERROR, EN, errno) << "select";
+        LOG_E_EVERY_T(LS_ERROR, 1000, EN, errno) << "Wait";
         return false;
       }
       // Else ignore the error and keep going. If this EINTR was for one of the
@@ -1304,76 +2616,23 @@ bool PhysicalSocketServer::Wait(int cmsWait, bool process_io) {
     } else {
       // We have signaled descriptors
       CritScope cr(&crit_);
-      for (size_t i = 0; i < dispatchers_.size(); ++i) {
-        Dispatcher *pdispatcher = dispatchers_[i];
-        int fd = pdispatcher->GetDescriptor();
-        uint32 ff = 0;
-        int errcode = 0;
-
-        // Reap any error code, which can be signaled through reads or writes.
-        // TODO: Should we set errcode if getsockopt fails?
-        if (FD_ISSET(fd, &fdsRead) || FD_ISSET(fd, &fdsWrite)) {
-          socklen_t len = sizeof(errcode);
-          ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &errcode, &len);
-        }
-
-        // Check readable descriptors. If we're waiting on an accept, signal
-        // that. Otherwise we're waiting for data, check to see if we're
-        // readable or really closed.
-        // TODO: Only peek at TCP descriptors.
-        if (FD_ISSET(fd, &fdsRead)) {
-          FD_CLR(fd, &fdsRead);
-          if (pdispatcher->GetRequestedEvents() & DE_ACCEPT) {
-            ff |= DE_ACCEPT;
-          } else if (errcode || pdispatcher->IsDescriptorClosed()) {
-            ff |= DE_CLOSE;
-          } else {
-            ff |= DE_READ;
-          }
-        }
-
-        // Check writable descriptors. If we're waiting on a connect, detect
-        // success versus failure by the reaped error code.
-        if (FD_ISSET(fd, &fdsWrite)) {
-          FD_CLR(fd, &fdsWrite);
-          if (pdispatcher->GetRequestedEvents() & DE_CONNECT) {
-            if (!errcode) {
-              ff |= DE_CONNECT;
-            } else {
-              ff |= DE_CLOSE;
-            }
-          } else {
-            ff |= DE_WRITE;
-          }
-        }
-
+      pending_.push_back(&events);
+      poller_->BeginDispatch();
+      for (size_t i = 0; i < events.size(); ++i) {
+        // Skip dispatchers removed by an earlier handler.
+        Dispatcher* pdispatcher = events[i].dispatcher;
+        if (!pdispatcher)
+          continue;
+        int errcode;
+        uint32 ff = ProcessPollerEvent(pdispatcher, events[i].flags, probe,
+                                       &errcode);
         // Tell the descriptor about the event.
-        if (ff != 0) {
-          pdispatcher->OnPreEvent(ff);
-          pdispatcher->OnEvent(ff, errcode);
-        }
-      }
-    }
-
-    // Recalc the time remaining to wait. Doing it here means it doesn't get
-    // calced twice the first time through the loop
-
-    if (cmsWait != kForever) {
-      ptvWait->tv_sec = 0;
-      ptvWait->tv_usec = 0;
-      struct timeval tvT;
-      gettimeofday(&tvT, NULL);
-      if ((tvStop.tv_sec > tvT.tv_sec)
-          || ((tvStop.tv_sec == tvT.tv_sec)
-              && (tvStop.tv_usec > tvT.tv_usec))) {
-        ptvWait->tv_sec = tvStop.tv_sec - tvT.tv_sec;
-        ptvWait->tv_usec = tvStop.tv_usec - tvT.tv_usec;
-        if (ptvWait->tv_usec < 0) {
-          ASSERT(ptvWait->tv_sec > 0);
-          ptvWait->tv_usec += 1000000;
-          ptvWait->tv_sec -= 1;
-        }
+        if (ff != 0)
+          DispatchEvent(pdispatcher, ff, errcode);
       }
+      poller_->EndDispatch();
+      ASSERT(pending_.back() == &events);
+      pending_.pop_back();
     }
   }
 
@@ -1431,7 +2690,88 @@ bool PhysicalSocketServer::InstallSignal(int signum, void (*handler)(int)) {
 #endif  // POSIX
 
 #ifdef WIN32
+bool PhysicalSocketServer::WaitIocp(int cmsWait, bool process_io) {
+  if (!process_io) {
+    // Socket completions must stay queued until I/O may be processed again,
+    // so only the wakeup event is waited on.
+    DWORD dw = WaitForSingleObject(signal_wakeup_->GetWSAEvent(),
+        (cmsWait == kForever) ? INFINITE : static_cast<DWORD>(cmsWait));
+    if (dw == WAIT_FAILED) {
+      LOG_GLE(LS_ERROR) << "WaitForSingleObject";
+      return false;
+    }
+    if (dw == WAIT_OBJECT_0)
+      signal_wakeup_->OnPreEvent(0);
+    return true;
+  }
+
+  uint32 msStart = Time();
+  fWait_ = true;
+  while (fWait_) {
+    int cmsNext = kForever;
+    if (cmsWait != kForever)
+      cmsNext = _max(0, cmsWait - TimeSince(msStart));
+
+    DWORD bytes = 0;
+    ULONG_PTR key = 0;
+    OVERLAPPED* overlapped = NULL;
+#if SOCKETSERVER_TELEMETRY
+    uint64 start = TimeMicros();
+#endif
+    TXMPP_TRACE1(socket_wait_start, cmsNext);
+    BOOL ok = GetQueuedCompletionStatus(iocp_, &bytes, &key, &overlapped,
+        (cmsNext == kForever) ? INFINITE : static_cast<DWORD>(cmsNext));
+    DWORD error = ok ? 0 : GetLastError();
+    TXMPP_TRACE1(socket_wait_end, overlapped ? 1 : 0);
+#if SOCKETSERVER_TELEMETRY
+    telemetry_.wait.Add(static_cast<uint32>(TimeMicros() - start));
+    if (overlapped)
+      telemetry_.ready.Add(1);
+#endif
+
+    if (overlapped == NULL) {
+      if (!ok) {
+        if (error == WAIT_TIMEOUT)
+          return true;
+        LOG_GLE(LS_ERROR) << "GetQueuedCompletionStatus";
+        return false;
+      }
+      // Posted by WakeUp.
+      ASSERT(key == kIocpWakeUpKey);
+      signal_wakeup_->OnPreEvent(0);
+      break;
+    }
+
+    CritScope cr(&crit_);
+#if SOCKETSERVER_TELEMETRY
+    start = TimeMicros();
+#endif
+    // The socket's handler runs in here, so this is its callback time.
+#if SOCKETSERVER_TELEMETRY
+    telemetry_.event_start = start;
+#endif
+    LibraryMetrics::Add(LibraryMetrics::LM_SOCKET_EVENTS);
+    StallDetector* detector = StallDetector::Current();
+    if (detector)
+      detector->Begin(StallDetector::SK_SOCKET_EVENT, "IocpCompletion", error);
+    ProcessIocpCompletion(overlapped, bytes, error);
+    if (detector)
+      detector->End();
+#if SOCKETSERVER_TELEMETRY
+    telemetry_.event_start = 0;
+    uint32 elapsed = static_cast<uint32>(TimeMicros() - start);
+    telemetry_.callback.Add(elapsed);
+    LibraryMetrics::Record(LibraryMetrics::LM_SOCKET_EVENT_US, elapsed);
+#endif
+  }
+
+  return true;
+}
+
 bool PhysicalSocketServer::Wait(int cmsWait, bool process_io) {
+  if (iocp_ != NULL)
+    return WaitIocp(cmsWait, process_io);
+
   int cmsTotal = cmsWait;
   int cmsElapsed = 0;
   uint32 msStart = Time();
@@ -1452,12 +2792,12 @@ bool PhysicalSocketServer::Wait(int cmsWait, bool process_io) {
     {
       CritScope cr(&crit_);
       size_t i = 0;
-      iterators_.push_back(&i);
+      BeginIteration();
       // Don't track dispatchers_.size(), because we want to pick up any new
       // dispatchers that were added while processing the loop.
       while (i < dispatchers_.size()) {
         Dispatcher* disp = dispatchers_[i++];
-        if (!process_io && (disp != signal_wakeup_))
+        if (!disp || (!process_io && (disp != signal_wakeup_)))
           continue;
         SOCKET s = disp->GetSocket();
         if (disp->CheckSignalClose()) {
@@ -1471,8 +2811,7 @@ bool PhysicalSocketServer::Wait(int cmsWait, bool process_io) {
           event_owners.push_back(disp);
         }
       }
-      ASSERT(iterators_.back() == &i);
-      iterators_.pop_back();
+      EndIteration();
     }
 
     // Which is shorter, the delay wait or the asked wait?
@@ -1485,11 +2824,20 @@ bool PhysicalSocketServer::Wait(int cmsWait, bool process_io) {
     }
 
     // Wait for one of the events to signal
+#if SOCKETSERVER_TELEMETRY
+    uint64 start = TimeMicros();
+#endif
+    TXMPP_TRACE1(socket_wait_start, cmsNext);
     DWORD dw = WSAWaitForMultipleEvents(static_cast<DWORD>(events.size()),
                                         &events[0],
                                         false,
                                         cmsNext,
                                         false);
+    TXMPP_TRACE1(socket_wait_end, dw == WSA_WAIT_TIMEOUT ? 0 : 1);
+#if SOCKETSERVER_TELEMETRY
+    telemetry_.wait.Add(static_cast<uint32>(TimeMicros() - start));
+    uint32 ready = 0;
+#endif
 
 #if 0  // LOGGING
     // we track this information purely for logging purposes.
@@ -1523,14 +2871,17 @@ bool PhysicalSocketServer::Wait(int cmsWait, bool process_io) {
       int index = dw - WSA_WAIT_EVENT_0;
       if (index > 0) {
         --index; // The first event is the socket event
-        event_owners[index]->OnPreEvent(0);
-        event_owners[index]->OnEvent(0, 0);
+        DispatchEvent(event_owners[index], 0, 0);
+#if SOCKETSERVER_TELEMETRY
+        ready = 1;
+#endif
       } else if (process_io) {
         size_t i = 0, end = dispatchers_.size();
-        iterators_.push_back(&i);
-        iterators_.push_back(&end);  // Don't iterate over new dispatchers.
+        BeginIteration();  // Don't iterate over new dispatchers.
         while (i < end) {
           Dispatcher* disp = dispatchers_[i++];
+          if (!disp)
+            continue;
           SOCKET s = disp->GetSocket();
           if (s == INVALID_SOCKET)
             continue;
@@ -1589,19 +2940,21 @@ bool PhysicalSocketServer::Wait(int cmsWait, bool process_io) {
               errcode = wsaEvents.iErrorCode[FD_CLOSE_BIT];
             }
             if (ff != 0) {
-              disp->OnPreEvent(ff);
-              disp->OnEvent(ff, errcode);
+#if SOCKETSERVER_TELEMETRY
+              ++ready;
+#endif
+              DispatchEvent(disp, ff, errcode);
             }
           }
         }
-        ASSERT(iterators_.back() == &end);
-        iterators_.pop_back();
-        ASSERT(iterators_.back() == &i);
-        iterators_.pop_back();
+        EndIteration();
       }
 
       // Reset the network event until new activity occurs
       WSAResetEvent(socket_ev_);
+#if SOCKETSERVER_TELEMETRY
+      telemetry_.ready.Add(ready);
+#endif
     }
 
     // Break?
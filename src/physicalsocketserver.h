@@ -32,6 +32,7 @@
 #include "config.h"
 #endif
 
+#include <utility>
 #include <vector>
 
 #include "asyncfile.h"
@@ -45,6 +46,11 @@ typedef int SOCKET;
 
 namespace txmpp {
 
+#ifdef POSIX
+struct PollerEvent;
+typedef std::vector<PollerEvent> PollerEventList;
+#endif
+
 // Event constants for the Dispatcher class.
 enum DispatcherEvent {
   DE_READ    = 0x0001,
@@ -54,13 +60,39 @@ enum DispatcherEvent {
   DE_ACCEPT  = 0x0010,
 };
 
+// The mechanism PhysicalSocketServer::Wait uses to find out which sockets
+// are ready.
+enum PollerType {
+  POLLER_DEFAULT,  // The most scalable mechanism available on POSIX; the
+                   // WSAEventSelect loop on Windows.
+  POLLER_SELECT,
+  POLLER_EPOLL,    // Linux only.
+  POLLER_KQUEUE,   // OS X and BSD only.
+  POLLER_IOCP,     // Windows only. Use overlapped I/O on a completion port.
+  POLLER_IO_URING, // Linux only. Submit sends and receives through io_uring.
+  POLLER_EPOLL_EDGE,  // Linux only. epoll, edge-triggered for sockets, so
+                      // that their interest set is left alone as they
+                      // block and unblock.
+};
+
 class Signaler;
 #ifdef POSIX
+class Poller;
 class PosixSignalDispatcher;
 #endif
 
+// Per-dispatcher SocketServerTelemetry.
+struct DispatcherTelemetry {
+  DispatcherTelemetry() : events(0), micros(0) {}
+  uint32 events;  // OnEvent calls.
+  uint64 micros;  // Time spent in them.
+};
+
 class Dispatcher {
  public:
+  static const size_t kNoSlot = static_cast<size_t>(-1);
+
+  Dispatcher() : slot_(kNoSlot) {}
   virtual ~Dispatcher() {}
   virtual uint32 GetRequestedEvents() = 0;
   virtual void OnPreEvent(uint32 ff) = 0;
@@ -72,13 +104,37 @@ class Dispatcher {
 #elif POSIX
   virtual int GetDescriptor() = 0;
   virtual bool IsDescriptorClosed() = 0;
+  // True if the poller performs this dispatcher's reads and writes (see
+  // CompletionPoller) and only has to watch it for connects and accepts.
+  virtual bool UsesPollerIo() { return false; }
+  // True if the dispatcher calls PhysicalSocketServer::Blocked whenever a
+  // read, write or accept on its descriptor would block. An edge-triggered
+  // poller then takes the descriptor to be ready until it is told so, and
+  // leaves its interest set alone.
+  virtual bool ReportsBlocking() { return false; }
 #endif
+
+  // The dispatcher's index in its socket server's registry, or kNoSlot if it
+  // is not registered. Pollers use it to find their own state in O(1).
+  size_t slot() const { return slot_; }
+
+  // Only updated by the socket server's thread.
+  const DispatcherTelemetry& telemetry() const { return telemetry_; }
+
+ private:
+  friend class PhysicalSocketServer;
+
+  size_t slot_;
+  DispatcherTelemetry telemetry_;
 };
 
 // A socket server that provides the real sockets of the underlying OS.
 class PhysicalSocketServer : public SocketServer {
 public:
-  PhysicalSocketServer();
+  // |poller_type| selects how Wait() finds ready sockets. If the requested
+  // poller is unavailable, select() (or WSAEventSelect on Windows) is used
+  // instead.
+  explicit PhysicalSocketServer(PollerType poller_type = POLLER_DEFAULT);
   virtual ~PhysicalSocketServer();
 
   // SocketFactory:
@@ -94,8 +150,44 @@ public:
 
   void Add(Dispatcher* dispatcher);
   void Remove(Dispatcher* dispatcher);
+  // Must be called when the value returned by dispatcher's
+  // GetRequestedEvents() changes, so that the poller can pick it up.
+  void Update(Dispatcher* dispatcher);
+  // Must be called by a dispatcher whose ReportsBlocking() is true when a
+  // read (DE_READ), write (DE_WRITE) or accept (DE_ACCEPT) would block.
+  void Blocked(Dispatcher* dispatcher, uint32 events);
+
+  // The number of registered dispatchers, which includes every live socket.
+  size_t dispatcher_count();
+
+  // Appends the registered dispatchers and their telemetry to |dispatchers|,
+  // for finding the ones whose handlers hold up the others.  The pointers
+  // are only good for telling dispatchers apart.
+  typedef std::pair<Dispatcher*, DispatcherTelemetry> DispatcherStat;
+  void GetDispatcherTelemetry(std::vector<DispatcherStat>* dispatchers);
+
+  // Makes Wait poll without blocking for up to |spin_us| microseconds
+  // before it sleeps in the OS, so that I/O or a message arriving meanwhile
+  // is picked up without a kernel wakeup.  It costs a core, so it is meant
+  // for a thread that does nothing but run this server.  Sockets created
+  // afterwards also get Socket::OPT_BUSY_POLL of |socket_busy_poll_us|, if
+  // positive, which needs CAP_NET_ADMIN.  The time spun is recorded in
+  // telemetry().spin, to set against the time in handlers in
+  // telemetry().callback.  A |spin_us| of 0 turns it off.  Call it on the
+  // server's thread, or before the server runs.  POSIX only.
+  void SetBusyPoll(int spin_us, int socket_busy_poll_us = 0);
+  int busy_poll() const { return spin_us_; }
+  int socket_busy_poll() const { return socket_busy_poll_us_; }
+
+#ifdef WIN32
+  // The completion port sockets are attached to, or NULL if the server is not
+  // in POLLER_IOCP mode.
+  HANDLE iocp() const { return iocp_; }
+#endif
 
 #ifdef POSIX
+  PollerType poller_type() const;
+
   AsyncFile* CreateFile(int fd);
 
   // Sets the function to be executed in response to the specified POSIX signal.
@@ -113,22 +205,50 @@ public:
 
 private:
   typedef std::vector<Dispatcher*> DispatcherList;
-  typedef std::vector<size_t*> IteratorList;
+  typedef std::vector<size_t> SlotList;
+
+  // Brackets a loop over dispatchers_. Slots freed in between are not reused
+  // until the outermost loop is done, so it never sees a new dispatcher in
+  // place of one it has already visited.
+  void BeginIteration();
+  void EndIteration();
+
+  // Delivers |ff| to |dispatcher|, recording the time spent.  Requires crit_.
+  void DispatchEvent(Dispatcher* dispatcher, uint32 ff, int err);
 
 #ifdef POSIX
+  typedef std::vector<PollerEventList*> PendingEventList;
+
   static bool InstallSignal(int signum, void (*handler)(int));
 
+  int WaitForWakeUp(int cms, PollerEventList* events);
+
+  scoped_ptr<Poller> poller_;
+  // Events being dispatched by Wait (there can be more than one list if Wait
+  // is re-entered). Remove clears the entries of a removed dispatcher.
+  PendingEventList pending_;
   scoped_ptr<PosixSignalDispatcher> signal_dispatcher_;
 #endif
+  // Registered dispatchers, indexed by Dispatcher::slot(). Remove leaves a
+  // NULL behind and recycles the slot, so Add and Remove are O(1) and loops
+  // over the list by index stay valid while handlers add and remove.
   DispatcherList dispatchers_;
-  IteratorList iterators_;
+  SlotList free_slots_;
+  SlotList retired_slots_;  // Freed while a loop is in progress.
+  size_t dispatcher_count_;
+  int iterating_;
   Signaler* signal_wakeup_;
   CriticalSection crit_;
   bool fWait_;
   uint32 last_tick_tracked_;
   int last_tick_dispatch_count_;
+  int spin_us_;
+  int socket_busy_poll_us_;
 #ifdef WIN32
+  bool WaitIocp(int cms, bool process_io);
+
   WSAEVENT socket_ev_;
+  HANDLE iocp_;
 #endif
 };
 
@@ -34,6 +34,10 @@
 
 #include <algorithm>
 #include "saslhandler.h"
+#include "saslplainmechanism.h"
+#if SSL_USE_OPENSSL
+#include "saslscrammechanism.h"
+#endif
 
 namespace txmpp {
 
@@ -48,7 +52,18 @@ public:
   // Should pick the best method according to this handler
   // returns the empty string if none are suitable
   virtual std::string ChooseBestSaslMechanism(const std::vector<std::string> & mechanisms, bool encrypted) {
-  
+
+#if SSL_USE_OPENSSL
+    // SCRAM never gives the password away, so it is preferred, and fine
+    // even without encryption.
+    if (std::find(mechanisms.begin(), mechanisms.end(), "SCRAM-SHA-256") !=
+        mechanisms.end())
+      return "SCRAM-SHA-256";
+    if (std::find(mechanisms.begin(), mechanisms.end(), "SCRAM-SHA-1") !=
+        mechanisms.end())
+      return "SCRAM-SHA-1";
+#endif
+
     if (!encrypted && !allow_plain_) {
       return "";
     }
@@ -68,6 +83,14 @@ public:
     if (mechanism == "PLAIN") {
       return new SaslPlainMechanism(jid_, password_);
     }
+#if SSL_USE_OPENSSL
+    if (mechanism == "SCRAM-SHA-256") {
+      return new SaslScramMechanism(DIGEST_SHA256, jid_, password_);
+    }
+    if (mechanism == "SCRAM-SHA-1") {
+      return new SaslScramMechanism(DIGEST_SHA1, jid_, password_);
+    }
+#endif
     return NULL;
   }
   
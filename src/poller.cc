@@ -0,0 +1,1449 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "poller.h"
+
+#ifdef POSIX
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifdef LINUX
+#include <sys/epoll.h>
+#ifndef EPOLLRDHUP
+#define EPOLLRDHUP 0x2000
+#endif
+#endif
+
+#if HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(OSX) || defined(BSD)
+#define HAVE_KQUEUE 1
+#include <sys/types.h>
+#include <sys/event.h>
+#endif
+
+#include <vector>
+
+#include "buffer.h"
+#include "common.h"
+#include "logging.h"
+#include "scoped_ptr.h"
+
+namespace txmpp {
+
+// Scans every registered dispatcher on each call. Works everywhere, but costs
+// O(registered descriptors) per wakeup and cannot watch descriptors at or
+// above FD_SETSIZE.
+class SelectPoller : public Poller {
+ public:
+  explicit SelectPoller(CriticalSection* crit) : crit_(crit) {
+  }
+
+  virtual PollerType type() const {
+    return POLLER_SELECT;
+  }
+
+  virtual void Add(Dispatcher* dispatcher) {
+    size_t slot = dispatcher->slot();
+    if (slot >= dispatchers_.size())
+      dispatchers_.resize(slot + 1, NULL);
+    dispatchers_[slot] = dispatcher;
+  }
+
+  virtual void Remove(Dispatcher* dispatcher) {
+    size_t slot = dispatcher->slot();
+    if (slot < dispatchers_.size() && dispatchers_[slot] == dispatcher)
+      dispatchers_[slot] = NULL;
+  }
+
+  virtual void Update(Dispatcher* dispatcher) {
+    // The descriptor sets are rebuilt from scratch on every Wait.
+  }
+
+  virtual int Wait(int cms, PollerEventList* events) {
+    size_t first = events->size();
+    fd_set fdsRead;
+    FD_ZERO(&fdsRead);
+    fd_set fdsWrite;
+    FD_ZERO(&fdsWrite);
+
+    int fdmax = -1;
+    {
+      CritScope cs(crit_);
+      for (size_t i = 0; i < dispatchers_.size(); ++i) {
+        Dispatcher* pdispatcher = dispatchers_[i];
+        if (!pdispatcher)
+          continue;
+        uint32 ff = pdispatcher->GetRequestedEvents();
+        if ((ff & (DE_READ | DE_ACCEPT | DE_WRITE | DE_CONNECT)) == 0)
+          continue;
+        int fd = pdispatcher->GetDescriptor();
+        if (fd >= FD_SETSIZE) {
+          LOG(LS_ERROR) << "Descriptor " << fd << " exceeds FD_SETSIZE";
+          continue;
+        }
+        if (fd > fdmax)
+          fdmax = fd;
+        if (ff & (DE_READ | DE_ACCEPT))
+          FD_SET(fd, &fdsRead);
+        if (ff & (DE_WRITE | DE_CONNECT))
+          FD_SET(fd, &fdsWrite);
+      }
+    }
+
+    struct timeval* ptvWait = NULL;
+    struct timeval tvWait;
+    if (cms != kForever) {
+      tvWait.tv_sec = cms / 1000;
+      tvWait.tv_usec = (cms % 1000) * 1000;
+      ptvWait = &tvWait;
+    }
+
+    int n = select(fdmax + 1, &fdsRead, &fdsWrite, NULL, ptvWait);
+    if (n <= 0)
+      return n;
+
+    CritScope cs(crit_);
+    for (size_t i = 0; i < dispatchers_.size(); ++i) {
+      Dispatcher* pdispatcher = dispatchers_[i];
+      if (!pdispatcher)
+        continue;
+      int fd = pdispatcher->GetDescriptor();
+      if (fd < 0 || fd >= FD_SETSIZE)
+        continue;
+      PollerEvent event;
+      event.dispatcher = pdispatcher;
+      event.flags = 0;
+      if (FD_ISSET(fd, &fdsRead)) {
+        FD_CLR(fd, &fdsRead);
+        event.flags |= PF_READ;
+      }
+      if (FD_ISSET(fd, &fdsWrite)) {
+        FD_CLR(fd, &fdsWrite);
+        event.flags |= PF_WRITE;
+      }
+      if (event.flags != 0)
+        events->push_back(event);
+    }
+    // select counts read and write readiness apart, and counts dispatchers
+    // removed since, so only what was appended is reported.
+    return static_cast<int>(events->size() - first);
+  }
+
+ private:
+  // Indexed by Dispatcher::slot(), with NULL in unused slots.
+  typedef std::vector<Dispatcher*> DispatcherList;
+
+  CriticalSection* crit_;
+  DispatcherList dispatchers_;
+};
+
+#ifdef LINUX
+
+// Keeps the interest set in the kernel and only updates it when a
+// dispatcher's requested events change, so a wakeup costs O(ready
+// descriptors) no matter how many are registered.
+//
+// When |edge| is set, dispatchers that report blocking are registered
+// edge-triggered for both reading and writing, once, and left alone. A
+// direction the kernel has reported is taken to be ready until Blocked says
+// otherwise, and Wait reports it again, without a system call, for as long
+// as the dispatcher asks for it; so a handler that stops short of draining
+// the descriptor is treated as it is level-triggered.
+class EpollPoller : public Poller {
+ public:
+  EpollPoller(CriticalSection* crit, bool edge)
+      : crit_(crit), epoll_fd_(-1), edge_(edge) {
+  }
+
+  virtual ~EpollPoller() {
+    if (epoll_fd_ >= 0)
+      close(epoll_fd_);
+  }
+
+  virtual PollerType type() const {
+    return edge_ ? POLLER_EPOLL_EDGE : POLLER_EPOLL;
+  }
+
+  virtual bool ReportsHangups() const {
+    return true;
+  }
+
+  virtual bool Initialize() {
+    // The size argument is only a hint, and is ignored by recent kernels.
+    epoll_fd_ = epoll_create(FD_SETSIZE);
+    if (epoll_fd_ < 0) {
+      LOG_ERR(LS_ERROR) << "epoll_create failed";
+      return false;
+    }
+    fcntl(epoll_fd_, F_SETFD, fcntl(epoll_fd_, F_GETFD) | FD_CLOEXEC);
+    return true;
+  }
+
+  virtual void Add(Dispatcher* dispatcher) {
+    size_t slot = dispatcher->slot();
+    if (slot >= registrations_.size())
+      registrations_.resize(slot + 1);
+    Registration& reg = registrations_[slot];
+    reg.dispatcher = dispatcher;
+    reg.fd = dispatcher->GetDescriptor();
+    reg.events = 0;
+    reg.edge = edge_ && dispatcher->ReportsBlocking();
+    reg.ready = 0;
+    reg.requested = 0;
+    reg.due = false;
+    ++reg.generation;
+    Update(dispatcher);
+  }
+
+  virtual void Remove(Dispatcher* dispatcher) {
+    Registration* reg = Find(dispatcher);
+    if (!reg)
+      return;
+    if (reg->events != 0)
+      Control(EPOLL_CTL_DEL, dispatcher->slot(), reg->fd, 0);
+    reg->dispatcher = NULL;
+    reg->events = 0;
+  }
+
+  virtual void Update(Dispatcher* dispatcher) {
+    Registration* reg = Find(dispatcher);
+    if (!reg)
+      return;
+    if (reg->edge) {
+      UpdateEdge(dispatcher, reg);
+      return;
+    }
+    size_t slot = dispatcher->slot();
+    int fd = dispatcher->GetDescriptor();
+    uint32 events = ToEpollEvents(dispatcher->GetRequestedEvents());
+    if (fd == reg->fd && events == reg->events)
+      return;
+
+    if (fd != reg->fd && reg->events != 0) {
+      Control(EPOLL_CTL_DEL, slot, reg->fd, 0);
+      reg->events = 0;
+    }
+    reg->fd = fd;
+    if (fd < 0) {
+      reg->events = 0;
+      return;
+    }
+
+    // A descriptor with no requested events is taken out of the interest set
+    // entirely. Otherwise EPOLLHUP and EPOLLERR, which cannot be masked, would
+    // keep waking us up for a socket nobody is listening to.
+    if (events == 0) {
+      if (reg->events != 0)
+        Control(EPOLL_CTL_DEL, slot, fd, 0);
+    } else if (reg->events == 0) {
+      Control(EPOLL_CTL_ADD, slot, fd, events);
+    } else {
+      Control(EPOLL_CTL_MOD, slot, fd, events);
+    }
+    reg->events = events;
+  }
+
+  virtual void Blocked(Dispatcher* dispatcher, uint32 events) {
+    Registration* reg = Find(dispatcher);
+    if (reg && reg->edge)
+      reg->ready &= ~ToPollerFlags(events);
+  }
+
+  virtual int Wait(int cms, PollerEventList* events) {
+    size_t first = events->size();
+    if (edge_) {
+      CritScope cs(crit_);
+      // What was reported last time and is still ready and asked for is
+      // due again: its handler didn't read or write until it blocked.
+      for (size_t i = 0; i < reported_.size(); ++i) {
+        Registration* reg = Find(reported_[i]);
+        if (reg && !reg->due && Wanted(*reg) != 0)
+          MakeDue(reported_[i].slot);
+      }
+      reported_.clear();
+      if (!due_.empty())
+        cms = 0;
+    }
+
+    epoll_event ready[kMaxEvents];
+    int n = epoll_wait(epoll_fd_, ready, kMaxEvents, cms);
+    if (n < 0 || (n == 0 && !edge_))
+      return n;
+
+    CritScope cs(crit_);
+    for (int i = 0; i < n; ++i) {
+      // An event that was already queued when its dispatcher was removed
+      // carries the generation of the old registration, even if the slot has
+      // been taken over since.
+      Ticket ticket;
+      ticket.slot = static_cast<uint32>(ready[i].data.u64);
+      ticket.generation = static_cast<uint32>(ready[i].data.u64 >> 32);
+      Registration* reg = Find(ticket);
+      if (!reg || reg->events == 0)
+        continue;
+      uint32 ev = ready[i].events;
+      if (reg->edge) {
+        reg->ready |= ToEdgeFlags(ev);
+        if (!reg->due)
+          MakeDue(ticket.slot);
+        continue;
+      }
+      // Errors and hangups are reported through whichever of read and write
+      // the dispatcher is waiting for, just as select() would.
+      if (ev & (EPOLLERR | EPOLLHUP))
+        ev |= reg->events & (EPOLLIN | EPOLLOUT);
+      if (ev & EPOLLRDHUP)
+        ev |= reg->events & EPOLLIN;
+      PollerEvent event;
+      event.dispatcher = reg->dispatcher;
+      event.flags = 0;
+      if (ev & EPOLLIN)
+        event.flags |= PF_READ;
+      if (ev & EPOLLOUT)
+        event.flags |= PF_WRITE;
+      if (event.flags == 0)
+        continue;
+      if (ev & EPOLLERR)
+        event.flags |= PF_ERROR;
+      if (ev & (EPOLLHUP | EPOLLRDHUP))
+        event.flags |= PF_HANGUP;
+      events->push_back(event);
+    }
+
+    for (size_t i = 0; i < due_.size(); ++i) {
+      Registration* reg = Find(due_[i]);
+      if (!reg)
+        continue;
+      reg->due = false;
+      uint32 flags = Wanted(*reg);
+      if (flags == 0)
+        continue;
+      PollerEvent event;
+      event.dispatcher = reg->dispatcher;
+      event.flags = flags | (reg->ready & (PF_ERROR | PF_HANGUP));
+      events->push_back(event);
+      // An error is reported once, as level-triggered epoll would after
+      // the socket server reads it; end of stream stays.
+      reg->ready &= ~PF_ERROR;
+      reported_.push_back(due_[i]);
+    }
+    due_.clear();
+    // Stale and edge-triggered events are left out of n.
+    return static_cast<int>(events->size() - first);
+  }
+
+ private:
+  static const int kMaxEvents = 128;
+  static const uint32 kEdgeEvents = EPOLLIN | EPOLLRDHUP | EPOLLOUT | EPOLLET;
+
+  struct Registration {
+    Registration()
+        : dispatcher(NULL), fd(-1), events(0), generation(0), edge(false),
+          ready(0), requested(0), due(false) {
+    }
+    Dispatcher* dispatcher;  // NULL if the slot is unused.
+    int fd;
+    uint32 events;  // The epoll events currently in the kernel interest set.
+    uint32 generation;  // Bumped each time the slot is reused.
+    // The rest is for edge-triggered registrations. |ready| holds the
+    // PollerFlags seen since the dispatcher last blocked, and |requested|
+    // those it asked for at the last Update. |due| is set while the slot is
+    // in due_.
+    bool edge;
+    uint32 ready;
+    uint32 requested;
+    bool due;
+  };
+  // Indexed by Dispatcher::slot().
+  typedef std::vector<Registration> RegistrationList;
+
+  // A registration as it was when it was put on a list.
+  struct Ticket {
+    uint32 slot;
+    uint32 generation;
+  };
+  typedef std::vector<Ticket> TicketList;
+
+  static uint32 ToEpollEvents(uint32 ff) {
+    uint32 events = 0;
+    // EPOLLRDHUP tells an orderly close apart from plain readability.
+    if (ff & (DE_READ | DE_ACCEPT))
+      events |= EPOLLIN | EPOLLRDHUP;
+    if (ff & (DE_WRITE | DE_CONNECT))
+      events |= EPOLLOUT;
+    return events;
+  }
+
+  static uint32 ToPollerFlags(uint32 ff) {
+    uint32 flags = 0;
+    if (ff & (DE_READ | DE_ACCEPT))
+      flags |= PF_READ;
+    if (ff & (DE_WRITE | DE_CONNECT))
+      flags |= PF_WRITE;
+    return flags;
+  }
+
+  // What an edge says is ready. Errors and hangups make both directions
+  // ready, as a read or write would then fail rather than block.
+  static uint32 ToEdgeFlags(uint32 ev) {
+    uint32 flags = 0;
+    if (ev & EPOLLIN)
+      flags |= PF_READ;
+    if (ev & EPOLLOUT)
+      flags |= PF_WRITE;
+    if (ev & (EPOLLERR | EPOLLHUP))
+      flags |= PF_READ | PF_WRITE;
+    if (ev & EPOLLRDHUP)
+      flags |= PF_READ;
+    if (ev & EPOLLERR)
+      flags |= PF_ERROR;
+    if (ev & (EPOLLHUP | EPOLLRDHUP))
+      flags |= PF_HANGUP;
+    return flags;
+  }
+
+  // The directions of an edge-triggered registration that are both ready
+  // and asked for.
+  static uint32 Wanted(const Registration& reg) {
+    uint32 requested =
+        ToPollerFlags(reg.dispatcher->GetRequestedEvents());
+    return reg.ready & requested & (PF_READ | PF_WRITE);
+  }
+
+  Registration* Find(Dispatcher* dispatcher) {
+    size_t slot = dispatcher->slot();
+    if (slot >= registrations_.size() ||
+        registrations_[slot].dispatcher != dispatcher)
+      return NULL;
+    return &registrations_[slot];
+  }
+
+  Registration* Find(const Ticket& ticket) {
+    if (ticket.slot >= registrations_.size())
+      return NULL;
+    Registration* reg = &registrations_[ticket.slot];
+    if (!reg->dispatcher || reg->generation != ticket.generation)
+      return NULL;
+    return reg;
+  }
+
+  // An edge-triggered registration goes into the kernel the first time the
+  // dispatcher asks for something, as a socket before then may report a
+  // hangup for not being connected yet, and stays there. What is asked for
+  // later only decides what Wait reports.
+  void UpdateEdge(Dispatcher* dispatcher, Registration* reg) {
+    size_t slot = dispatcher->slot();
+    int fd = dispatcher->GetDescriptor();
+    uint32 requested = ToPollerFlags(dispatcher->GetRequestedEvents());
+    if (fd != reg->fd) {
+      if (reg->events != 0)
+        Control(EPOLL_CTL_DEL, slot, reg->fd, 0);
+      reg->fd = fd;
+      reg->events = 0;
+      reg->ready = 0;
+    }
+    uint32 added = requested & ~reg->requested;
+    reg->requested = requested;
+    if (fd < 0 || requested == 0)
+      return;
+    if (reg->events == 0) {
+      reg->events = kEdgeEvents;
+      Control(EPOLL_CTL_ADD, slot, fd, kEdgeEvents);
+    } else if ((reg->ready & added) != 0 && !reg->due) {
+      // Asked for again while still ready, which no edge will announce.
+      // Modifying the registration makes the kernel queue one, waking a
+      // Wait blocked on another thread.
+      MakeDue(slot);
+      Control(EPOLL_CTL_MOD, slot, fd, kEdgeEvents);
+    }
+  }
+
+  void MakeDue(size_t slot) {
+    Registration& reg = registrations_[slot];
+    reg.due = true;
+    Ticket ticket;
+    ticket.slot = static_cast<uint32>(slot);
+    ticket.generation = reg.generation;
+    due_.push_back(ticket);
+  }
+
+  void Control(int op, size_t slot, int fd, uint32 events) {
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.u64 = (static_cast<uint64>(registrations_[slot].generation)
+                      << 32) | slot;
+    if (epoll_ctl(epoll_fd_, op, fd, &event) < 0) {
+      // The descriptor may already have been closed underneath us, in which
+      // case the kernel has dropped it from the interest set on its own.
+      if (op != EPOLL_CTL_DEL || (errno != EBADF && errno != ENOENT))
+        LOG_ERR(LS_ERROR) << "epoll_ctl(" << op << ", " << fd << ") failed";
+    }
+  }
+
+  CriticalSection* crit_;
+  int epoll_fd_;
+  bool edge_;
+  RegistrationList registrations_;
+  // Edge-triggered registrations to report in the next Wait, and those the
+  // last one reported.
+  TicketList due_;
+  TicketList reported_;
+};
+
+#endif  // LINUX
+
+#if HAVE_KQUEUE
+
+// The kqueue equivalent of EpollPoller. Reads and writes are separate
+// filters, so a descriptor can show up twice in one batch; the two are
+// merged into a single event before they are handed to the socket server.
+class KqueuePoller : public Poller {
+ public:
+  explicit KqueuePoller(CriticalSection* crit) : crit_(crit), kqueue_fd_(-1) {
+  }
+
+  virtual ~KqueuePoller() {
+    if (kqueue_fd_ >= 0)
+      close(kqueue_fd_);
+  }
+
+  virtual PollerType type() const {
+    return POLLER_KQUEUE;
+  }
+
+  virtual bool ReportsHangups() const {
+    return true;
+  }
+
+  virtual bool Initialize() {
+    kqueue_fd_ = kqueue();
+    if (kqueue_fd_ < 0) {
+      LOG_ERR(LS_ERROR) << "kqueue failed";
+      return false;
+    }
+    fcntl(kqueue_fd_, F_SETFD, fcntl(kqueue_fd_, F_GETFD) | FD_CLOEXEC);
+    return true;
+  }
+
+  virtual void Add(Dispatcher* dispatcher) {
+    size_t slot = dispatcher->slot();
+    if (slot >= registrations_.size())
+      registrations_.resize(slot + 1);
+    Registration& reg = registrations_[slot];
+    reg.dispatcher = dispatcher;
+    reg.fd = dispatcher->GetDescriptor();
+    reg.events = 0;
+    Update(dispatcher);
+  }
+
+  virtual void Remove(Dispatcher* dispatcher) {
+    Registration* reg = Find(dispatcher);
+    if (!reg)
+      return;
+    Change(dispatcher->slot(), reg->fd, reg->events, 0);
+    reg->dispatcher = NULL;
+    reg->events = 0;
+  }
+
+  virtual void Update(Dispatcher* dispatcher) {
+    Registration* reg = Find(dispatcher);
+    if (!reg)
+      return;
+    size_t slot = dispatcher->slot();
+    int fd = dispatcher->GetDescriptor();
+    uint32 events = ToPollerFlags(dispatcher->GetRequestedEvents());
+    if (fd == reg->fd && events == reg->events)
+      return;
+
+    if (fd != reg->fd) {
+      Change(slot, reg->fd, reg->events, 0);
+      reg->events = 0;
+      reg->fd = fd;
+    }
+    if (fd < 0) {
+      reg->events = 0;
+      return;
+    }
+    Change(slot, fd, reg->events, events);
+    reg->events = events;
+  }
+
+  virtual int Wait(int cms, PollerEventList* events) {
+    struct timespec* pts = NULL;
+    struct timespec ts;
+    if (cms != kForever) {
+      ts.tv_sec = cms / 1000;
+      ts.tv_nsec = (cms % 1000) * 1000000;
+      pts = &ts;
+    }
+
+    struct kevent ready[kMaxEvents];
+    int n = kevent(kqueue_fd_, NULL, 0, ready, kMaxEvents, pts);
+    if (n <= 0)
+      return n;
+
+    CritScope cs(crit_);
+    size_t first = events->size();
+    for (int i = 0; i < n; ++i) {
+      if (ready[i].flags & EV_ERROR)
+        continue;
+      // The descriptor check catches events queued for a dispatcher that
+      // was removed before its slot was taken over.
+      size_t slot = (size_t)(ready[i].udata);
+      if (slot >= registrations_.size())
+        continue;
+      const Registration& reg = registrations_[slot];
+      if (!reg.dispatcher || reg.fd != static_cast<int>(ready[i].ident))
+        continue;
+      Dispatcher* pdispatcher = reg.dispatcher;
+      uint32 flags = 0;
+      if (ready[i].filter == EVFILT_READ)
+        flags = PF_READ;
+      else if (ready[i].filter == EVFILT_WRITE)
+        flags = PF_WRITE;
+      flags &= reg.events;
+      if (flags == 0)
+        continue;
+      // On EOF, fflags holds the socket error, if any.
+      if (ready[i].flags & EV_EOF) {
+        flags |= PF_HANGUP;
+        if (ready[i].fflags != 0)
+          flags |= PF_ERROR;
+      }
+
+      size_t j = first;
+      while (j < events->size() && (*events)[j].dispatcher != pdispatcher)
+        ++j;
+      if (j < events->size()) {
+        (*events)[j].flags |= flags;
+      } else {
+        PollerEvent event;
+        event.dispatcher = pdispatcher;
+        event.flags = flags;
+        events->push_back(event);
+      }
+    }
+    // A read and a write on the same descriptor count once.
+    return static_cast<int>(events->size() - first);
+  }
+
+ private:
+  static const int kMaxEvents = 128;
+
+  struct Registration {
+    Registration() : dispatcher(NULL), fd(-1), events(0) {
+    }
+    Dispatcher* dispatcher;  // NULL if the slot is unused.
+    int fd;
+    uint32 events;  // The PollerFlags whose filters are in the kqueue.
+  };
+  // Indexed by Dispatcher::slot().
+  typedef std::vector<Registration> RegistrationList;
+
+  static uint32 ToPollerFlags(uint32 ff) {
+    uint32 flags = 0;
+    if (ff & (DE_READ | DE_ACCEPT))
+      flags |= PF_READ;
+    if (ff & (DE_WRITE | DE_CONNECT))
+      flags |= PF_WRITE;
+    return flags;
+  }
+
+  Registration* Find(Dispatcher* dispatcher) {
+    size_t slot = dispatcher->slot();
+    if (slot >= registrations_.size() ||
+        registrations_[slot].dispatcher != dispatcher)
+      return NULL;
+    return &registrations_[slot];
+  }
+
+  // Adds and deletes filters for |fd| to go from |from| to |to|, in a single
+  // kevent call.
+  void Change(size_t slot, int fd, uint32 from, uint32 to) {
+    struct kevent changes[2];
+    int count = 0;
+    if ((from ^ to) & PF_READ) {
+      EV_SET(&changes[count++], fd, EVFILT_READ,
+             (to & PF_READ) ? EV_ADD : EV_DELETE, 0, 0, (void*)slot);
+    }
+    if ((from ^ to) & PF_WRITE) {
+      EV_SET(&changes[count++], fd, EVFILT_WRITE,
+             (to & PF_WRITE) ? EV_ADD : EV_DELETE, 0, 0, (void*)slot);
+    }
+    if (count == 0)
+      return;
+    if (kevent(kqueue_fd_, changes, count, NULL, 0, NULL) < 0) {
+      // As with epoll, closing a descriptor drops its filters on its own.
+      if (to != 0 || (errno != EBADF && errno != ENOENT))
+        LOG_ERR(LS_ERROR) << "kevent(" << fd << ") failed";
+    }
+  }
+
+  CriticalSection* crit_;
+  int kqueue_fd_;
+  RegistrationList registrations_;
+};
+
+#endif  // HAVE_KQUEUE
+
+#if HAVE_IO_URING
+
+// Drives everything through an io_uring. Dispatchers that UsesPollerIo()
+// have their receives and sends submitted as ring requests, and the rest are
+// watched with one-shot poll requests that are re-armed as needed. Requests
+// queued while the socket server dispatches a batch of events reach the
+// kernel together, so a wakeup serving many sockets costs a couple of system
+// calls rather than a recv and a send apiece.
+class IoUringPoller : public CompletionPoller {
+ public:
+  explicit IoUringPoller(CriticalSection* crit)
+      : crit_(crit), ring_fd_(-1), ring_(NULL), ring_size_(0), sqes_(NULL),
+        sqes_size_(0), sq_tail_(0), pending_(0), dispatching_(0),
+        waiting_(false), wakeup_pending_(false) {
+  }
+
+  virtual ~IoUringPoller() {
+    if (ring_fd_ >= 0) {
+      // The kernel writes into receive buffers until the requests using them
+      // complete, so give cancelled requests a chance to finish before the
+      // buffers are freed.
+      PollerEventList discarded;
+      for (int i = 0; pending_ > 0 && i < kDrainAttempts; ++i) {
+        Enter(sq_tail_ - Load(sq_head_), 1, kDrainIntervalMs);
+        Reap(&discarded);
+      }
+      if (pending_ > 0)
+        LOG(LS_WARNING) << pending_ << " io_uring requests still in flight";
+      close(ring_fd_);
+    }
+    if (sqes_)
+      munmap(sqes_, sqes_size_);
+    if (ring_)
+      munmap(ring_, ring_size_);
+    for (size_t i = 0; i < registrations_.size(); ++i)
+      delete registrations_[i];
+  }
+
+  virtual PollerType type() const {
+    return POLLER_IO_URING;
+  }
+
+  virtual bool ReportsHangups() const {
+    return true;
+  }
+
+  virtual bool Initialize() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = kCompletionEntries;
+    ring_fd_ = syscall(__NR_io_uring_setup, kSubmissionEntries, &params);
+    if (ring_fd_ < 0) {
+      LOG_ERR(LS_WARNING) << "io_uring_setup failed";
+      return false;
+    }
+    fcntl(ring_fd_, F_SETFD, fcntl(ring_fd_, F_GETFD) | FD_CLOEXEC);
+
+    // Waiting with a timeout relies on IORING_FEAT_EXT_ARG (Linux 5.11), which
+    // implies the other two.
+    const uint32 kRequired = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                             IORING_FEAT_EXT_ARG;
+    if ((params.features & kRequired) != kRequired) {
+      LOG(LS_WARNING) << "io_uring is missing required features";
+      return false;
+    }
+
+    // With IORING_FEAT_SINGLE_MMAP both rings live in one mapping.
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32);
+    size_t cq_size = params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe);
+    ring_size_ = _max(sq_size, cq_size);
+    void* ring = mmap(NULL, ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+      LOG_ERR(LS_ERROR) << "mmap of io_uring rings failed";
+      return false;
+    }
+    ring_ = static_cast<char*>(ring);
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      LOG_ERR(LS_ERROR) << "mmap of io_uring submission entries failed";
+      return false;
+    }
+    sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+    sq_head_ = reinterpret_cast<uint32*>(ring_ + params.sq_off.head);
+    sq_ktail_ = reinterpret_cast<uint32*>(ring_ + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<uint32*>(ring_ + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<uint32*>(ring_ + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+    sq_tail_ = *sq_ktail_;
+    cq_head_ = reinterpret_cast<uint32*>(ring_ + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<uint32*>(ring_ + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<uint32*>(ring_ + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(ring_ + params.cq_off.cqes);
+    return true;
+  }
+
+  virtual void Add(Dispatcher* dispatcher) {
+    size_t slot = dispatcher->slot();
+    if (slot >= registrations_.size())
+      registrations_.resize(slot + 1, NULL);
+    if (registrations_[slot])
+      return;
+    Registration* reg = new Registration(dispatcher);
+    registrations_[slot] = reg;
+    QueueArm(reg);
+    if (!dispatching_)
+      Flush();
+  }
+
+  virtual void Remove(Dispatcher* dispatcher) {
+    Registration* reg = Find(dispatcher);
+    if (!reg)
+      return;
+    registrations_[dispatcher->slot()] = NULL;
+    reg->dispatcher = NULL;
+
+    if (reg->poll.pending && !reg->poll_cancelled)
+      QueueCancel(IORING_OP_POLL_REMOVE, &reg->poll);
+    if (reg->recv.pending)
+      QueueCancel(IORING_OP_ASYNC_CANCEL, &reg->recv);
+    // A send in flight is left to finish, as it would be with send(2). The
+    // caller is about to close the descriptor, so keep a copy of our own in
+    // case the rest of the data has to be resubmitted.
+    reg->fd = reg->send.pending ? dup(reg->fd) : -1;
+    // Requests naming the descriptor must reach the kernel before it is
+    // closed and its number reused.
+    Flush();
+    MaybeDelete(reg);
+  }
+
+  virtual void Update(Dispatcher* dispatcher) {
+    Registration* reg = Find(dispatcher);
+    if (!reg)
+      return;
+    QueueArm(reg);
+    if (!dispatching_)
+      Flush();
+  }
+
+  virtual int Wait(int cms, PollerEventList* events) {
+    uint32 to_submit;
+    {
+      CritScope cs(crit_);
+      ArmQueued();
+      // Buffered data and idle senders are ready without asking the kernel.
+      if (!ready_.empty())
+        cms = 0;
+      to_submit = sq_tail_ - Load(sq_head_);
+      waiting_ = true;
+    }
+    size_t first = events->size();
+
+    int result = Enter(to_submit, (cms == 0) ? 0 : 1, cms);
+    int error = errno;
+
+    CritScope cs(crit_);
+    waiting_ = false;
+    if (result < 0 && error != ETIME && error != EINTR && error != EBUSY) {
+      errno = error;
+      return -1;
+    }
+    Reap(events);
+
+    ReadyList ready;
+    ready.swap(ready_);
+    for (size_t i = 0; i < ready.size(); ++i) {
+      Registration* reg = ready[i];
+      uint32 flags = reg->ready_flags;
+      reg->ready_flags = 0;
+      if (!reg->dispatcher) {
+        MaybeDelete(reg);
+        continue;
+      }
+      PollerEvent event;
+      event.dispatcher = reg->dispatcher;
+      event.flags = flags;
+      events->push_back(event);
+      QueueArm(reg);
+    }
+
+    // Wakeups and completions of ignored operations append nothing.
+    int n = static_cast<int>(events->size() - first);
+    if (n == 0 && result < 0 && error == EINTR) {
+      errno = EINTR;
+      return -1;
+    }
+    return n;
+  }
+
+  virtual void BeginDispatch() {
+    ++dispatching_;
+  }
+
+  virtual void EndDispatch() {
+    ASSERT(dispatching_ > 0);
+    // Everything the handlers queued goes to the kernel in one call.
+    if (--dispatching_ == 0)
+      Flush();
+  }
+
+  virtual int Send(Dispatcher* dispatcher, const void* pv, size_t cb,
+                   int* error) {
+    CritScope cs(crit_);
+    Registration* reg = Find(dispatcher);
+    if (!reg) {
+      *error = EBADF;
+      return -1;
+    }
+    if (reg->send_error) {
+      *error = reg->send_error;
+      return -1;
+    }
+    if (reg->send.pending) {
+      *error = EWOULDBLOCK;
+      return -1;
+    }
+    if (cb == 0)
+      return 0;
+    reg->send_buffer.SetData(pv, cb);
+    reg->send_offset = 0;
+    QueueSend(reg);
+    if (!dispatching_)
+      Flush();
+    return static_cast<int>(cb);
+  }
+
+  virtual int Recv(Dispatcher* dispatcher, void* pv, size_t cb, int* error) {
+    CritScope cs(crit_);
+    Registration* reg = Find(dispatcher);
+    if (!reg) {
+      *error = EBADF;
+      return -1;
+    }
+    size_t available = reg->recv_end - reg->recv_start;
+    if (available > 0) {
+      size_t read = _min(cb, available);
+      memcpy(pv, reg->recv_buffer.get() + reg->recv_start, read);
+      reg->recv_start += read;
+      if (reg->recv_start == reg->recv_end) {
+        reg->recv_start = reg->recv_end = 0;
+        QueueArm(reg);
+      }
+      return static_cast<int>(read);
+    }
+    if (reg->recv_closed) {
+      if (reg->recv_error) {
+        *error = reg->recv_error;
+        return -1;
+      }
+      return 0;
+    }
+    *error = EWOULDBLOCK;
+    return -1;
+  }
+
+  virtual bool IsClosed(Dispatcher* dispatcher) {
+    CritScope cs(crit_);
+    Registration* reg = Find(dispatcher);
+    if (!reg)
+      return true;
+    if (reg->send_error)
+      return true;
+    return reg->recv_closed && reg->recv_start == reg->recv_end;
+  }
+
+ private:
+  static const uint32 kSubmissionEntries = 256;
+  static const uint32 kCompletionEntries = 4096;
+  static const size_t kRecvBufferSize = 4096;
+  static const int kDrainAttempts = 10;
+  static const int kDrainIntervalMs = 10;
+  // user_data of requests whose completions need no handling, and of the
+  // no-op that wakes up a blocked Wait.
+  static const uint64 kIgnoredTag = 0;
+  static const uint64 kWakeUpTag = 1;
+
+  enum OperationType { OP_POLL, OP_RECV, OP_SEND };
+
+  struct Registration;
+
+  // The user_data of each request is the Operation it was submitted for.
+  struct Operation {
+    Operation(Registration* r, OperationType t)
+        : reg(r), type(t), pending(false) {
+    }
+    Registration* reg;
+    OperationType type;
+    bool pending;
+  };
+
+  // Outlives its dispatcher until the kernel is done with its requests.
+  struct Registration {
+    explicit Registration(Dispatcher* d)
+        : dispatcher(d), fd(d->GetDescriptor()), io(d->UsesPollerIo()),
+          queued(false), ready_flags(0),
+          poll(this, OP_POLL), polled(0), poll_cancelled(false),
+          recv(this, OP_RECV), recv_start(0), recv_end(0),
+          recv_closed(false), recv_error(0),
+          send(this, OP_SEND), send_offset(0), send_error(0) {
+    }
+
+    Dispatcher* dispatcher;  // NULL once removed.
+    int fd;                  // Owned by us once the dispatcher is removed.
+    bool io;                 // Whether reads and writes are ours to do.
+    bool queued;             // On arm_.
+    uint32 ready_flags;      // PollerFlags to report without the kernel.
+
+    Operation poll;
+    uint32 polled;           // The PollerFlags being polled for.
+    bool poll_cancelled;
+
+    Operation recv;
+    scoped_array<char> recv_buffer;
+    size_t recv_start;       // Unread data is [recv_start, recv_end).
+    size_t recv_end;
+    bool recv_closed;
+    int recv_error;
+
+    Operation send;
+    Buffer send_buffer;
+    size_t send_offset;      // How much of send_buffer has gone out.
+    int send_error;
+  };
+
+  // Indexed by Dispatcher::slot(). Removed registrations are dropped from
+  // here, and freed once their requests have completed.
+  typedef std::vector<Registration*> RegistrationList;
+  typedef std::vector<Registration*> ReadyList;
+
+  static uint32 Load(const uint32* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+  }
+
+  static void Store(uint32* p, uint32 value) {
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+  }
+
+  static uint32 ToPollerFlags(uint32 ff) {
+    uint32 flags = 0;
+    if (ff & (DE_READ | DE_ACCEPT))
+      flags |= PF_READ;
+    if (ff & (DE_WRITE | DE_CONNECT))
+      flags |= PF_WRITE;
+    return flags;
+  }
+
+  Registration* Find(Dispatcher* dispatcher) {
+    size_t slot = dispatcher->slot();
+    if (slot >= registrations_.size())
+      return NULL;
+    Registration* reg = registrations_[slot];
+    return (reg && reg->dispatcher == dispatcher) ? reg : NULL;
+  }
+
+  // Submits |to_submit| queued entries and, if |min_complete| is non-zero,
+  // waits up to |cms| milliseconds for that many completions.
+  int Enter(uint32 to_submit, uint32 min_complete, int cms) {
+    uint32 flags = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    memset(&arg, 0, sizeof(arg));
+    if (min_complete > 0) {
+      flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+      if (cms != kForever) {
+        ts.tv_sec = cms / 1000;
+        ts.tv_nsec = (cms % 1000) * 1000000;
+        arg.ts = reinterpret_cast<uintptr_t>(&ts);
+      }
+    } else if (to_submit == 0) {
+      return 0;
+    }
+    return syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete,
+                   flags, (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+                   sizeof(arg));
+  }
+
+  // Hands every queued entry to the kernel without waiting.
+  void Submit() {
+    uint32 to_submit = sq_tail_ - Load(sq_head_);
+    if (to_submit > 0 && Enter(to_submit, 0, 0) < 0 && errno != EBUSY)
+      LOG_ERR(LS_ERROR) << "io_uring_enter failed";
+  }
+
+  // Arms whatever became due, then submits it. A Wait blocked in another
+  // thread is woken up if that made any dispatcher ready.
+  void Flush() {
+    ArmQueued();
+    if (waiting_ && !ready_.empty() && !wakeup_pending_) {
+      struct io_uring_sqe* sqe = NextSqe();
+      if (sqe) {
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = kWakeUpTag;
+        Publish();
+        wakeup_pending_ = true;
+      }
+    }
+    Submit();
+  }
+
+  // Returns a cleared submission entry, which goes to the kernel with the
+  // next Submit once Publish has been called. Returns NULL if the queue is
+  // full even after submitting what is in it.
+  struct io_uring_sqe* NextSqe() {
+    if (sq_tail_ - Load(sq_head_) >= sq_entries_) {
+      Submit();
+      if (sq_tail_ - Load(sq_head_) >= sq_entries_) {
+        LOG(LS_ERROR) << "io_uring submission queue is full";
+        return NULL;
+      }
+    }
+    uint32 index = sq_tail_ & sq_mask_;
+    struct io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    return sqe;
+  }
+
+  void Publish() {
+    Store(sq_ktail_, ++sq_tail_);
+  }
+
+  bool QueueOperation(Operation* op, uint8 opcode, int fd, void* addr,
+                      uint32 len, uint32 op_flags) {
+    struct io_uring_sqe* sqe = NextSqe();
+    if (!sqe)
+      return false;
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(addr);
+    sqe->len = len;
+    sqe->msg_flags = op_flags;
+    sqe->user_data = reinterpret_cast<uintptr_t>(op);
+    Publish();
+    op->pending = true;
+    ++pending_;
+    return true;
+  }
+
+  void QueueCancel(uint8 opcode, Operation* op) {
+    struct io_uring_sqe* sqe = NextSqe();
+    if (!sqe)
+      return;
+    sqe->opcode = opcode;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uintptr_t>(op);
+    sqe->user_data = kIgnoredTag;
+    Publish();
+    if (op->type == OP_POLL)
+      op->reg->poll_cancelled = true;
+  }
+
+  void QueuePoll(Registration* reg, uint32 flags) {
+    uint32 events = 0;
+    if (flags & PF_READ)
+      events |= POLLIN | POLLRDHUP;
+    if (flags & PF_WRITE)
+      events |= POLLOUT;
+    // poll32_events shares its storage with msg_flags.
+    if (QueueOperation(&reg->poll, IORING_OP_POLL_ADD, reg->fd, NULL, 0,
+                       events)) {
+      reg->polled = flags;
+    }
+  }
+
+  void QueueSend(Registration* reg) {
+    QueueOperation(&reg->send, IORING_OP_SEND, reg->fd,
+                   reg->send_buffer.data() + reg->send_offset,
+                   reg->send_buffer.length() - reg->send_offset,
+                   MSG_NOSIGNAL);
+  }
+
+  void QueueRecv(Registration* reg) {
+    if (!reg->recv_buffer.get())
+      reg->recv_buffer.reset(new char[kRecvBufferSize]);
+    QueueOperation(&reg->recv, IORING_OP_RECV, reg->fd,
+                   reg->recv_buffer.get(), kRecvBufferSize, 0);
+  }
+
+  // Marks |reg| to have its requests brought in line with its dispatcher's
+  // requested events before the next submission.
+  void QueueArm(Registration* reg) {
+    if (!reg->queued) {
+      reg->queued = true;
+      arm_.push_back(reg);
+    }
+  }
+
+  void ArmQueued() {
+    ReadyList arm;
+    arm.swap(arm_);
+    for (size_t i = 0; i < arm.size(); ++i) {
+      Registration* reg = arm[i];
+      reg->queued = false;
+      if (reg->dispatcher)
+        Arm(reg);
+      else
+        MaybeDelete(reg);
+    }
+  }
+
+  void Arm(Registration* reg) {
+    Dispatcher* dispatcher = reg->dispatcher;
+    int fd = dispatcher->GetDescriptor();
+    uint32 requested = (fd >= 0) ? dispatcher->GetRequestedEvents() : 0;
+    if (fd >= 0)
+      reg->fd = fd;
+
+    // Reads and writes done by the ring need no polling; only accepts and
+    // connects do.
+    uint32 polled = ToPollerFlags(
+        reg->io ? (requested & (DE_ACCEPT | DE_CONNECT)) : requested);
+    if (reg->poll.pending) {
+      // Poll requests cannot be modified; cancel and re-arm on completion.
+      if (polled != reg->polled && !reg->poll_cancelled)
+        QueueCancel(IORING_OP_POLL_REMOVE, &reg->poll);
+    } else if (polled != 0) {
+      QueuePoll(reg, polled);
+    }
+
+    if (!reg->io || (requested & DE_CONNECT))
+      return;
+    if (requested & DE_READ) {
+      if (reg->recv_start != reg->recv_end)
+        SetReady(reg, PF_READ);
+      else if (reg->recv_closed || reg->send_error)
+        SetReady(reg, PF_READ | PF_HANGUP);
+      else if (!reg->recv.pending)
+        QueueRecv(reg);
+    }
+    if ((requested & DE_WRITE) && !reg->send.pending)
+      SetReady(reg, PF_WRITE);
+  }
+
+  void SetReady(Registration* reg, uint32 flags) {
+    if (reg->ready_flags == 0)
+      ready_.push_back(reg);
+    reg->ready_flags |= flags;
+  }
+
+  // Consumes the completion queue, appending events for |events|. Returns
+  // the number of completions seen.
+  int Reap(PollerEventList* events) {
+    uint32 head = *cq_head_;
+    uint32 tail = Load(cq_tail_);
+    int n = 0;
+    while (head != tail) {
+      struct io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+      uint64 user_data = cqe->user_data;
+      int result = cqe->res;
+      ++head;
+      ++n;
+      if (user_data == kWakeUpTag) {
+        wakeup_pending_ = false;
+      } else if (user_data != kIgnoredTag) {
+        Operation* op = reinterpret_cast<Operation*>(
+            static_cast<uintptr_t>(user_data));
+        Complete(op, result, events);
+      }
+    }
+    Store(cq_head_, head);
+    return n;
+  }
+
+  void Complete(Operation* op, int result, PollerEventList* events) {
+    Registration* reg = op->reg;
+    op->pending = false;
+    --pending_;
+    uint32 flags = 0;
+    switch (op->type) {
+      case OP_POLL:
+        if (result > 0) {
+          if (result & (POLLIN | POLLRDHUP))
+            flags |= PF_READ;
+          if (result & POLLOUT)
+            flags |= PF_WRITE;
+          // As with select(), errors and hangups show up as readiness for
+          // whatever was being waited for.
+          if (result & (POLLERR | POLLHUP))
+            flags |= reg->polled;
+          flags &= reg->polled;
+          if (flags && (result & POLLERR))
+            flags |= PF_ERROR;
+          if (flags && (result & (POLLHUP | POLLRDHUP)))
+            flags |= PF_HANGUP;
+        }
+        reg->polled = 0;
+        reg->poll_cancelled = false;
+        break;
+      case OP_RECV:
+        if (result > 0) {
+          reg->recv_start = 0;
+          reg->recv_end = result;
+          flags = PF_READ;
+        } else if (result == 0) {
+          reg->recv_closed = true;
+          flags = PF_READ | PF_HANGUP;
+        } else if (result != -EAGAIN && result != -EINTR &&
+                   result != -ECANCELED) {
+          reg->recv_closed = true;
+          reg->recv_error = -result;
+          flags = PF_READ | PF_HANGUP;
+        }
+        break;
+      case OP_SEND:
+        if (result >= 0) {
+          reg->send_offset += result;
+        } else if (result != -EAGAIN && result != -EINTR) {
+          reg->send_error = -result;
+          reg->send_buffer.SetLength(0);
+          reg->send_offset = 0;
+          flags = PF_READ | PF_WRITE | PF_HANGUP;
+          break;
+        }
+        if (reg->send_offset < reg->send_buffer.length() && reg->fd >= 0) {
+          QueueSend(reg);
+        } else {
+          reg->send_buffer.SetLength(0);
+          reg->send_offset = 0;
+          flags = PF_WRITE;
+        }
+        break;
+    }
+
+    if (!reg->dispatcher) {
+      MaybeDelete(reg);
+      return;
+    }
+    if (flags != 0) {
+      PollerEvent event;
+      event.dispatcher = reg->dispatcher;
+      event.flags = flags;
+      events->push_back(event);
+    }
+    QueueArm(reg);
+  }
+
+  void MaybeDelete(Registration* reg) {
+    if (reg->dispatcher || reg->queued || reg->ready_flags ||
+        reg->poll.pending || reg->recv.pending || reg->send.pending)
+      return;
+    if (reg->fd >= 0)
+      close(reg->fd);
+    delete reg;
+  }
+
+  CriticalSection* crit_;
+  int ring_fd_;
+  char* ring_;
+  size_t ring_size_;
+  struct io_uring_sqe* sqes_;
+  size_t sqes_size_;
+  uint32* sq_head_;
+  uint32* sq_ktail_;
+  uint32 sq_mask_;
+  uint32* sq_array_;
+  uint32 sq_entries_;
+  uint32 sq_tail_;          // Our copy of the tail, ahead of the kernel's.
+  uint32* cq_head_;
+  uint32* cq_tail_;
+  uint32 cq_mask_;
+  struct io_uring_cqe* cqes_;
+  int pending_;             // Requests the kernel has not completed yet.
+  int dispatching_;
+  bool waiting_;
+  bool wakeup_pending_;
+  RegistrationList registrations_;
+  ReadyList arm_;
+  ReadyList ready_;
+};
+
+#endif  // HAVE_IO_URING
+
+Poller* Poller::Create(PollerType type, CriticalSection* crit) {
+  if (type == POLLER_DEFAULT) {
+#if defined(LINUX)
+    type = POLLER_EPOLL;
+#elif HAVE_KQUEUE
+    type = POLLER_KQUEUE;
+#else
+    type = POLLER_SELECT;
+#endif
+  }
+
+  Poller* poller = NULL;
+  switch (type) {
+    case POLLER_SELECT:
+      poller = new SelectPoller(crit);
+      break;
+#ifdef LINUX
+    case POLLER_EPOLL:
+    case POLLER_EPOLL_EDGE:
+      poller = new EpollPoller(crit, type == POLLER_EPOLL_EDGE);
+      break;
+#endif
+#if HAVE_KQUEUE
+    case POLLER_KQUEUE:
+      poller = new KqueuePoller(crit);
+      break;
+#endif
+#if HAVE_IO_URING
+    case POLLER_IO_URING:
+      poller = new IoUringPoller(crit);
+      break;
+#endif
+    default:
+      LOG(LS_WARNING) << "Poller type " << type << " not available";
+      return NULL;
+  }
+
+  if (!poller->Initialize()) {
+    delete poller;
+    return NULL;
+  }
+  return poller;
+}
+
+}  // namespace txmpp
+
+#endif  // POSIX
@@ -0,0 +1,138 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_POLLER_H_
+#define _TXMPP_POLLER_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef POSIX
+
+#include <vector>
+
+#include "basictypes.h"
+#include "criticalsection.h"
+#include "physicalsocketserver.h"
+
+#if defined(LINUX) && defined(HAVE_LINUX_IO_URING_H)
+#define HAVE_IO_URING 1
+#endif
+
+namespace txmpp {
+
+// Readiness flags reported by a Poller for a descriptor. PF_ERROR and
+// PF_HANGUP come on top of PF_READ or PF_WRITE, never on their own.
+enum PollerFlag {
+  PF_READ   = 0x0001,
+  PF_WRITE  = 0x0002,
+  PF_ERROR  = 0x0004,  // An error is pending on the descriptor.
+  PF_HANGUP = 0x0008,  // The peer has closed its end, or the stream failed.
+};
+
+// PollerEventList is declared in physicalsocketserver.h.
+struct PollerEvent {
+  Dispatcher* dispatcher;
+  uint32 flags;
+};
+
+// The readiness notification mechanism behind PhysicalSocketServer::Wait on
+// POSIX. A Poller tracks the descriptors of registered dispatchers and the
+// events they request, and reports which of them are ready.
+//
+// Add, Remove and Update are called with the socket server's critical
+// section held. Wait is called without it, and must take it around any
+// access to its registration state, so that a dispatcher removed while the
+// poller was blocked is never reported.
+class Poller {
+ public:
+  virtual ~Poller() {}
+
+  virtual PollerType type() const = 0;
+
+  // Returns false if the poller could not be set up, in which case the
+  // socket server falls back to select().
+  virtual bool Initialize() { return true; }
+
+  // True if Wait sets PF_ERROR and PF_HANGUP whenever they apply. The socket
+  // server then only probes a descriptor for its error and end-of-stream
+  // state when one of them is set, instead of on every event.
+  virtual bool ReportsHangups() const { return false; }
+
+  virtual void Add(Dispatcher* dispatcher) = 0;
+  virtual void Remove(Dispatcher* dispatcher) = 0;
+
+  // Called whenever the value returned by GetRequestedEvents() of a
+  // registered dispatcher may have changed.
+  virtual void Update(Dispatcher* dispatcher) = 0;
+
+  // Called when a read, write or accept on the descriptor of a dispatcher
+  // whose ReportsBlocking() is true would block, with the DE_ flag of it.
+  virtual void Blocked(Dispatcher* dispatcher, uint32 events) {}
+
+  // Waits up to |cms| milliseconds (or kForever) for registered descriptors to
+  // become ready and appends them to |events|. Returns the number of events
+  // appended, 0 on timeout, or -1 with errno set on failure.
+  virtual int Wait(int cms, PollerEventList* events) = 0;
+
+  // Creates a poller of the given type, or NULL if it is not available on this
+  // platform. POLLER_DEFAULT picks the most scalable one available.
+  static Poller* Create(PollerType type, CriticalSection* crit);
+
+  // Called by the socket server around dispatching the events returned by
+  // Wait, with its critical section held. Pollers that hand work to the
+  // kernel in batches hold it back until the end of the dispatch.
+  virtual void BeginDispatch() {}
+  virtual void EndDispatch() {}
+};
+
+// A poller that carries out the reads and writes of stream sockets itself,
+// for dispatchers whose UsesPollerIo() returns true. Received data is
+// buffered by the poller and reported through PF_READ; a send is accepted
+// whole and PF_WRITE is reported once it has gone out. These methods take
+// the socket server's critical section themselves.
+class CompletionPoller : public Poller {
+ public:
+  // Like send(2) and recv(2) on a non-blocking socket, except that a
+  // successful Send always takes all |cb| bytes. On failure they return -1
+  // and store the error in |*error|; Recv returns 0 at end of stream.
+  virtual int Send(Dispatcher* dispatcher, const void* pv, size_t cb,
+                   int* error) = 0;
+  virtual int Recv(Dispatcher* dispatcher, void* pv, size_t cb,
+                   int* error) = 0;
+
+  // True once the peer has closed the stream (or it failed) and every byte
+  // received before that has been read.
+  virtual bool IsClosed(Dispatcher* dispatcher) = 0;
+};
+
+}  // namespace txmpp
+
+#endif  // POSIX
+
+#endif  // _TXMPP_POLLER_H_
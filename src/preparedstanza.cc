@@ -0,0 +1,141 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "preparedstanza.h"
+
+#include "common.h"
+#include "constants.h"
+#include "xmlelement.h"
+#include "xmlprinter.h"
+
+namespace txmpp {
+
+PreparedStanza::PreparedStanza(XmlElement * stanza)
+    : stanza_(stanza),
+      slot_(0),
+      prepared_(false) {
+}
+
+PreparedStanza::~PreparedStanza() {
+}
+
+XmlElement *
+PreparedStanza::MutableStanza() {
+  prepared_ = false;
+  bytes_.clear();
+  return stanza_.get();
+}
+
+// Prints |stanza| to |out| without "to" and "id", and returns the offset
+// where they go back, at the end of the name in its start tag.
+static size_t
+PrintWithoutSlots(std::string * out, const XmlElement * stanza,
+                  const std::string * const xmlns, int xmlnsCount) {
+  if (stanza->HasAttr(QN_TO) || stanza->HasAttr(QN_ID)) {
+    XmlElement stripped(*stanza);
+    stripped.ClearAttr(QN_TO);
+    stripped.ClearAttr(QN_ID);
+    XmlPrinter::PrintXml(out, &stripped, xmlns, xmlnsCount);
+  } else {
+    XmlPrinter::PrintXml(out, stanza, xmlns, xmlnsCount);
+  }
+
+  // The start tag begins with '<' and the name, which ends at the first
+  // space, or at the '/' or '>' closing the tag.
+  size_t slot = 1;
+  while (slot < out->size() && (*out)[slot] != ' ' &&
+         (*out)[slot] != '/' && (*out)[slot] != '>')
+    ++slot;
+  return slot;
+}
+
+void
+PreparedStanza::Prepare(const std::string * const xmlns,
+                        int xmlnsCount) const {
+  bytes_.clear();
+  slot_ = PrintWithoutSlots(&bytes_, stanza_.get(), xmlns, xmlnsCount);
+  prepared_ = true;
+}
+
+static void
+PrintSlot(std::string * out, const char * attr, const std::string & value) {
+  if (value.empty())
+    return;
+  out->append(attr);
+  XmlPrinter::PrintQuotedValue(out, value);
+  out->push_back('"');
+}
+
+void
+PreparedStanza::Print(std::string * out, const std::string & to,
+                      const std::string & id, const std::string * const xmlns,
+                      int xmlnsCount) const {
+  if (!prepared_)
+    Prepare(xmlns, xmlnsCount);
+
+  out->append(bytes_.data(), slot_);
+  PrintSlot(out, " to=\"", to.empty() ? stanza_->Attr(QN_TO) : to);
+  PrintSlot(out, " id=\"", id.empty() ? stanza_->Attr(QN_ID) : id);
+  out->append(bytes_.data() + slot_, bytes_.size() - slot_);
+}
+
+SharedStanza *
+SharedStanza::Create(const XmlElement * stanza,
+                     const std::string * const xmlns, int xmlnsCount) {
+  std::string bytes;
+  size_t slot = PrintWithoutSlots(&bytes, stanza, xmlns, xmlnsCount);
+  return new SharedStanza(&bytes, slot);
+}
+
+SharedStanza::SharedStanza(std::string * bytes, size_t slot)
+    : SharedBytes(bytes),
+      slot_(slot) {
+}
+
+SharedStanza::~SharedStanza() {
+}
+
+void
+SharedStanza::PrintHead(std::string * out, const std::string & to,
+                        const std::string & id) const {
+  out->append(data().data(), slot_);
+  PrintSlot(out, " to=\"", to);
+  PrintSlot(out, " id=\"", id);
+}
+
+XmlElement *
+PreparedStanza::CreateElement(const std::string & to,
+                              const std::string & id) const {
+  XmlElement * element = new XmlElement(*stanza_);
+  if (!to.empty())
+    element->SetAttr(QN_TO, to);
+  if (!id.empty())
+    element->SetAttr(QN_ID, id);
+  return element;
+}
+
+}  // namespace txmpp
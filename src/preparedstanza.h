@@ -0,0 +1,121 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_PREPAREDSTANZA_H_
+#define _TXMPP_PREPAREDSTANZA_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+#include "chainbuffer.h"
+#include "constructormagic.h"
+#include "scoped_ptr.h"
+
+namespace txmpp {
+
+class XmlElement;
+
+//! A stanza that is sent many times over, such as a presence rebroadcast
+//! after every reconnect.  It is printed once and the bytes are kept, with
+//! slots for the "to" and "id" attributes that are filled in on each send.
+//!
+//! Modifying the stanza through MutableStanza drops the kept bytes, and
+//! they are printed again on the next send.  A PreparedStanza is not
+//! thread-safe, even for sending, as printing fills its cache.
+class PreparedStanza {
+public:
+  //! Takes ownership of |stanza|.  Its own "to" and "id", if any, are used
+  //! on sends that leave those slots empty.
+  explicit PreparedStanza(XmlElement * stanza);
+  ~PreparedStanza();
+
+  const XmlElement * stanza() const { return stanza_.get(); }
+  XmlElement * MutableStanza();
+
+  //! Appends the stanza to |out| with "to" and "id" set to |to| and |id|,
+  //! or to the stanza's own values where they are empty.  The bytes are
+  //! printed with the |xmlns| declarations in scope, which must be the same
+  //! on every call.
+  void Print(std::string * out, const std::string & to, const std::string & id,
+             const std::string * const xmlns, int xmlnsCount) const;
+
+  //! Returns a new copy of the stanza with the slots filled in as by Print.
+  XmlElement * CreateElement(const std::string & to,
+                             const std::string & id) const;
+
+private:
+  void Prepare(const std::string * const xmlns, int xmlnsCount) const;
+
+  scoped_ptr<XmlElement> stanza_;
+  // The stanza printed without "to" and "id", and the offset at the end of
+  // the name in its start tag, where they are put back.
+  mutable std::string bytes_;
+  mutable size_t slot_;
+  mutable bool prepared_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(PreparedStanza);
+};
+
+//! The printed bytes of a stanza sent to many recipients, such as a
+//! broadcast message, shared by every engine that sends it.  A send prints
+//! the stanza's name and the "to" and "id" slots, and queues a reference to
+//! the rest of the bytes rather than a copy of them, so the memory and time
+//! a fan-out takes do not grow with the payload times the recipients.
+//!
+//! Made by XmppEngine::CreateSharedStanza.  Immutable and refcounted: any
+//! thread may send it or drop a reference.
+class SharedStanza : public SharedBytes {
+public:
+  //! Prints |stanza| without its "to" and "id", with the |xmlns|
+  //! declarations in scope.  Returned with one reference.
+  static SharedStanza * Create(const XmlElement * stanza,
+                               const std::string * const xmlns,
+                               int xmlnsCount);
+
+  //! The bytes before the slots, the start tag's '<' and name.
+  size_t slot() const { return slot_; }
+
+  //! Appends the bytes before the slots to |out|, with "to" and "id" set to
+  //! |to| and |id| where they are not empty.  The rest of the stanza is
+  //! data() from slot() on.
+  void PrintHead(std::string * out, const std::string & to,
+                 const std::string & id) const;
+
+private:
+  SharedStanza(std::string * bytes, size_t slot);
+  virtual ~SharedStanza();
+
+  size_t slot_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(SharedStanza);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_PREPAREDSTANZA_H_
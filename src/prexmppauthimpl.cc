@@ -30,6 +30,9 @@
 #include <algorithm>
 #include "saslcookiemechanism.h"
 #include "saslplainmechanism.h"
+#if SSL_USE_OPENSSL
+#include "saslscrammechanism.h"
+#endif
 
 namespace txmpp {
 
@@ -56,6 +59,18 @@ std::string PreXmppAuthImpl::ChooseBestSaslMechanism(
     bool encrypted) {
   std::vector<std::string>::const_iterator it;
 
+#if SSL_USE_OPENSSL
+  it = std::find(mechanisms.begin(), mechanisms.end(), "SCRAM-SHA-256");
+  if (it != mechanisms.end()) {
+    return "SCRAM-SHA-256";
+  }
+
+  it = std::find(mechanisms.begin(), mechanisms.end(), "SCRAM-SHA-1");
+  if (it != mechanisms.end()) {
+    return "SCRAM-SHA-1";
+  }
+#endif
+
   it = std::find(mechanisms.begin(), mechanisms.end(), "PLAIN");
   if (it != mechanisms.end()) {
     return "PLAIN";
@@ -68,6 +83,12 @@ SaslMechanism* PreXmppAuthImpl::CreateSaslMechanism(
     const std::string & mechanism) {
   if (mechanism == "PLAIN") {
     return new SaslPlainMechanism(jid_, passwd_);
+#if SSL_USE_OPENSSL
+  } else if (mechanism == "SCRAM-SHA-256") {
+    return new SaslScramMechanism(DIGEST_SHA256, jid_, passwd_);
+  } else if (mechanism == "SCRAM-SHA-1") {
+    return new SaslScramMechanism(DIGEST_SHA1, jid_, passwd_);
+#endif
   } else {
     return NULL;
   }
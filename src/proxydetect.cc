@@ -46,11 +46,14 @@
 
 #include <map>
 
+#include "criticalsection.h"
 #include "fileutils.h"
 #include "httpcommon.h"
 #include "httpcommon-inl.h"
 #include "pathutils.h"
+#include "stringencode.h"
 #include "stringutils.h"
+#include "time.h"
 
 #ifdef WIN32
 #define _TRY_WINHTTP 1
@@ -67,6 +70,7 @@
 #define USE_FIREFOX_PROFILES_INI 1
 
 static const size_t kMaxLineLength = 1024;
+static const int kDefaultProxyCacheTtl = 5 * 60 * 1000;
 static const char kFirefoxPattern[] = "Firefox";
 static const char kInternetExplorerPattern[] = "MSIE";
 
@@ -1214,8 +1218,8 @@ bool GetSystemDefaultProxySettings(const char* agent, const char* url,
 #endif
 }
 
-bool GetProxySettingsForUrl(const char* agent, const char* url,
-                            ProxyInfo& proxy, bool long_operation) {
+static bool DetectProxySettingsForUrl(const char* agent, const char* url,
+                                      ProxyInfo& proxy) {
   UserAgent a = GetAgent(agent);
   bool result;
   switch (a) {
@@ -1256,4 +1260,94 @@ bool GetProxySettingsForUrl(const char* agent, const char* url,
   return result;
 }
 
+// The cached results, by agent, scheme and host.  Each keeps the time the
+// Firefox prefs.js had, if there was one, to notice when it changes.
+struct ProxyCacheEntry {
+  bool result;
+  ProxyInfo proxy;
+  uint32 expires;
+  std::string prefs_path;
+  time_t prefs_time;
+};
+typedef std::map<std::string, ProxyCacheEntry> ProxyCache;
+
+static CriticalSection proxy_cache_crit;
+static ProxyCache proxy_cache;
+static int proxy_cache_ttl = kDefaultProxyCacheTtl;
+
+static bool ProxyCache_PrefsTime(Pathname* path, time_t* time) {
+  if (!GetDefaultFirefoxProfile(path))
+    return false;
+  path->SetFilename("prefs.js");
+  return Filesystem::GetFileTime(*path, FTT_MODIFIED, time);
+}
+
+void SetProxySettingsCacheTtl(int ttl_ms) {
+  CritScope cs(&proxy_cache_crit);
+  proxy_cache_ttl = ttl_ms;
+  if (ttl_ms <= 0)
+    proxy_cache.clear();
+}
+
+void FlushProxySettingsCache() {
+  CritScope cs(&proxy_cache_crit);
+  proxy_cache.clear();
+}
+
+bool GetProxySettingsForUrl(const char* agent, const char* url,
+                            ProxyInfo& proxy, bool long_operation) {
+  Url<char> purl(url);
+  std::string key(ToString(static_cast<int>(GetAgent(agent))));
+  key.append(purl.secure() ? " https://" : " http://");
+  key.append(purl.address());
+
+  int ttl;
+  std::string prefs_path;
+  {
+    CritScope cs(&proxy_cache_crit);
+    ttl = proxy_cache_ttl;
+    ProxyCache::iterator it = proxy_cache.find(key);
+    if (it != proxy_cache.end()) {
+      if (TimeIsLater(it->second.expires, Time())) {
+        proxy_cache.erase(it);
+      } else {
+        prefs_path = it->second.prefs_path;
+        if (prefs_path.empty()) {
+          proxy = it->second.proxy;
+          return it->second.result;
+        }
+      }
+    }
+  }
+
+  // The prefs.js time is checked outside the lock, as it touches the disk.
+  if (!prefs_path.empty()) {
+    time_t prefs_time = 0;
+    Filesystem::GetFileTime(Pathname(prefs_path), FTT_MODIFIED, &prefs_time);
+    CritScope cs(&proxy_cache_crit);
+    ProxyCache::iterator it = proxy_cache.find(key);
+    if (it != proxy_cache.end()) {
+      if (it->second.prefs_time == prefs_time) {
+        proxy = it->second.proxy;
+        return it->second.result;
+      }
+      proxy_cache.erase(it);
+    }
+  }
+
+  ProxyCacheEntry entry;
+  Pathname path;
+  entry.prefs_time = 0;
+  if (ProxyCache_PrefsTime(&path, &entry.prefs_time))
+    entry.prefs_path = path.pathname();
+  entry.result = DetectProxySettingsForUrl(agent, url, proxy);
+  if (ttl > 0) {
+    entry.proxy = proxy;
+    entry.expires = TimeAfter(ttl);
+    CritScope cs(&proxy_cache_crit);
+    proxy_cache[key] = entry;
+  }
+  return entry.result;
+}
+
 }  // namespace txmpp
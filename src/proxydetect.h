@@ -38,11 +38,20 @@ namespace txmpp {
 // Auto-detect the proxy server.  Returns true if a proxy is configured,
 // although hostname may be empty if the proxy is not required for
 // the given URL.
+// Results are cached by agent, scheme and host for the cache's TTL, and
+// shared by all threads.  One that came from a Firefox prefs.js is dropped
+// once the file changes.
 
 bool GetProxySettingsForUrl(const char* agent, const char* url,
                             txmpp::ProxyInfo& proxy,
                             bool long_operation = false);
 
+// How long results are cached, in milliseconds; 0 stops the caching.
+void SetProxySettingsCacheTtl(int ttl_ms);
+
+// Forgets every cached result, as is needed when the network changes.
+void FlushProxySettingsCache();
+
 }  // namespace txmpp
 
 #endif  // _TXMPP_PROXYDETECT_H_
@@ -28,77 +28,313 @@
 #include "qname.h"
 
 #include <string>
+#include "allocstats.h"
 #include "common.h"
 #include "xmlelement.h"
 #include "xmlconstants.h"
 
 namespace txmpp {
 
-static int QName_Hash(const std::string & ns, const char * local) {
-  int result = static_cast<int>(ns.size()) * 101;
-  while (*local) {
-    result *= 19;
-    result += *local;
-    local += 1;
+// FNV-1a, over the namespace and then the local part, so that the hash of
+// the namespace can be kept and reused for the names in it.
+static uint32 QName_Hash(uint32 hash, const char * s, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= static_cast<unsigned char>(s[i]);
+    hash *= 16777619U;
   }
-  return result;
+  return hash;
 }
 
-static const int bits = 9;
-static QName::Data * get_qname_table() {
-  static QName::Data qname_table[1 << bits];
-  return qname_table;
+uint32
+QName::HashNamespace(const std::string & ns) {
+  return QName_Hash(2166136261U, ns.data(), ns.size());
 }
 
-static QName::Data *
-AllocateOrFind(const std::string & ns, const char * local) {
-  int index = QName_Hash(ns, local);
-  int increment = index >> (bits - 1) | 1;
-  QName::Data * qname_table = get_qname_table();
-  for (;;) {
-    index &= ((1 << bits) - 1);
-    if (!qname_table[index].Occupied()) {
-      return new QName::Data(ns, local);
+static uint32 QName_Hash(const QName::Data * data) {
+  return QName_Hash(QName_Hash(2166136261U, data->ns, data->ns_len),
+                    data->local, data->local_len);
+}
+
+// Compares as std::string::compare would.
+static int QName_Compare(const char * a, size_t a_len,
+                         const char * b, size_t b_len) {
+  int result = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (result)
+    return result;
+  return a_len < b_len ? -1 : (a_len > b_len ? 1 : 0);
+}
+
+// The Data of names made at run time, which holds its own strings.
+struct QName_OwnedData : public QName::Data {
+  QName_OwnedData(const std::string & ns_part, const char * local_part,
+                  uint32 name_id) :
+    owned_ns(ns_part),
+    owned_local(local_part) {
+    ns = owned_ns.data();
+    ns_len = owned_ns.size();
+    local = owned_local.data();
+    local_len = owned_local.size();
+    atom = NULL;
+    id = name_id;
+    refcount = 1;
+    ns_string = &owned_ns;
+    local_string = &owned_local;
+    next = NULL;
+  }
+
+  std::string owned_ns;
+  std::string owned_local;
+};
+
+void
+QName::Data::Destroy() {
+  delete static_cast<QName_OwnedData *>(this);
+}
+
+// Counts the Data with the strings it holds, which is most of the cost.
+static void QName_RecordAllocation(const QName_OwnedData * data) {
+  AllocStats::Record(AllocStats::AS_QNAME,
+                     sizeof(*data) + data->owned_ns.capacity() +
+                     data->owned_local.capacity());
+}
+
+// Interned names are numbered in the order they are defined or added. The
+// empty name, which is defined first, is 1.
+static volatile int qname_ids_ = 1;
+
+static uint32 QName_NextId() {
+  return static_cast<uint32>(AtomicOps::Increment(&qname_ids_));
+}
+
+QName::Data QName::empty_ =
+    { "", 0, "", 0, &QName::empty_, 1, 0, NULL, NULL, NULL };
+
+// The static records defined before the table was made, and the table
+// once it is. Both are only written while the program is being initialized, or
+// under the guard of get_qname_table.
+class QNameTable;
+static QName::Data * qname_pending_ = NULL;
+static QNameTable * volatile qname_table_ = NULL;
+
+// The table of interned names. It is open addressed, and looked up without
+// locking: entries are only ever added, and never freed, so a reader can't
+// see one go away. Adding takes the lock. When the table gets half full, a
+// table of twice the size is filled and published in its place; the old
+// one is kept, since readers may still be probing it.
+//
+// The static records are taken in as they are, and only hashed when the
+// table is made, the first time a QName needs it.
+class QNameTable {
+public:
+  // Takes in the static records defined so far.
+  QNameTable() : slots_(NULL), count_(0) {
+    size_t count = 1;
+    for (QName::Data * data = qname_pending_; data; data = data->next)
+      ++count;
+    int bits = 9;
+    while (static_cast<size_t>(1) << bits < 2 * (count + 1))
+      ++bits;
+    slots_ = new Slots(bits, NULL);
+
+    AddStatic(&QName::empty_);
+    while (qname_pending_) {
+      QName::Data * data = qname_pending_;
+      qname_pending_ = data->next;
+      data->next = NULL;
+      // Each name has only one record, and nothing else is interned yet.
+      VERIFY(AddStatic(data) == data);
     }
-    if (qname_table[index].localPart_ == local &&
-        qname_table[index].namespace_ == ns) {
-      qname_table[index].AddRef();
-      return qname_table + index;
+    AtomicOps::ReleaseStorePtr(&qname_table_, this);
+  }
+
+  QName::Data * Find(const std::string & ns, const char * local,
+                     size_t local_len, uint32 hash) {
+    return Probe(AtomicOps::AcquireLoadPtr(&slots_), ns.data(), ns.size(),
+                 local, local_len, hash);
+  }
+
+  QName::Data * Intern(const std::string & ns, uint32 ns_hash,
+                       const char * local) {
+    size_t local_len = strlen(local);
+    uint32 hash = QName_Hash(ns_hash, local, local_len);
+    QName::Data * data = Find(ns, local, local_len, hash);
+    if (data)
+      return data;
+
+    // The namespace goes in first, outside the lock.
+    QName::Data * atom = NULL;
+    if (local_len)
+      atom = Intern(ns, ns_hash, "");
+
+    CritScope cs(&crit_);
+    data = Probe(slots_, ns.data(), ns.size(), local, local_len, hash);
+    if (data)
+      return data;
+
+    QName_OwnedData * owned = new QName_OwnedData(ns, local, QName_NextId());
+    QName_RecordAllocation(owned);
+    owned->atom = atom ? atom : owned;
+    Add(owned, hash);
+    return owned;
+  }
+
+  // Adds a static record, or returns the Data already there for its name.
+  QName::Data * AddStatic(QName::Data * data) {
+    uint32 hash = QName_Hash(data);
+    CritScope cs(&crit_);
+    QName::Data * found = Probe(slots_, data->ns, data->ns_len, data->local,
+                                data->local_len, hash);
+    if (found)
+      return found;
+    Add(data, hash);
+    return data;
+  }
+
+  // Guards making the strings of the static records.
+  CriticalSection * crit() { return &crit_; }
+
+private:
+  struct Slots {
+    Slots(int b, Slots * p) :
+      bits(b),
+      mask((1 << b) - 1),
+      entries(new QName::Data * volatile[1 << b]),
+      previous(p) {
+      for (size_t i = 0; i <= mask; ++i)
+        entries[i] = NULL;
+    }
+
+    int bits;
+    size_t mask;
+    QName::Data * volatile * entries;
+    Slots * previous;
+  };
+
+  static QName::Data * Probe(Slots * slots, const char * ns, size_t ns_len,
+                             const char * local, size_t local_len,
+                             uint32 hash) {
+    for (size_t i = hash; ; ++i) {
+      QName::Data * entry = AtomicOps::AcquireLoadPtr(
+          &slots->entries[i & slots->mask]);
+      if (!entry)
+        return NULL;
+      if (entry->local_len == local_len && entry->ns_len == ns_len &&
+          memcmp(entry->local, local, local_len) == 0 &&
+          memcmp(entry->ns, ns, ns_len) == 0)
+        return entry;
     }
-    index += increment;
   }
+
+  // Called with the lock held.
+  void Add(QName::Data * data, uint32 hash) {
+    Slots * slots = slots_;
+    if (2 * (count_ + 1) > slots->mask + 1) {
+      slots = new Slots(slots->bits + 1, slots);
+      for (size_t i = 0; i <= slots->previous->mask; ++i) {
+        QName::Data * entry = slots->previous->entries[i];
+        if (entry)
+          Insert(slots, entry, QName_Hash(entry));
+      }
+      AtomicOps::ReleaseStorePtr(&slots_, slots);
+    }
+    ++count_;
+    Insert(slots, data, hash);
+  }
+
+  // The entry must be complete before it is stored, as readers take it as
+  // soon as they see it.
+  static void Insert(Slots * slots, QName::Data * data, uint32 hash) {
+    size_t i = hash;
+    while (slots->entries[i & slots->mask])
+      ++i;
+    AtomicOps::ReleaseStorePtr(&slots->entries[i & slots->mask], data);
+  }
+
+  CriticalSection crit_;
+  Slots * volatile slots_;
+  size_t count_;
+};
+
+static QNameTable * get_qname_table() {
+  // Never destroyed, for the static QNames that outlive it.
+  static QNameTable * qname_table = new QNameTable();
+  return qname_table;
+}
+
+static QName::Data *
+AllocateOrFind(const std::string & ns, uint32 ns_hash, const char * local) {
+#if QNAME_CANONICAL
+  return get_qname_table()->Intern(ns, ns_hash, local);
+#else
+  size_t local_len = strlen(local);
+  QName::Data * data = get_qname_table()->Find(
+      ns, local, local_len, QName_Hash(ns_hash, local, local_len));
+  if (data)
+    return data;
+  QName_OwnedData * owned = new QName_OwnedData(ns, local, 0);
+  QName_RecordAllocation(owned);
+  owned->atom = const_cast<QName::Data *>(
+      QName::FindNamespaceAtom(ns, ns_hash));
+  return owned;
+#endif
+}
+
+static QName::Data *
+AllocateOrFind(const std::string & ns, const char * local) {
+  return AllocateOrFind(ns, QName::HashNamespace(ns), local);
 }
 
 static QName::Data *
 Add(const std::string & ns, const char * local) {
-  int index = QName_Hash(ns, local);
-  int increment = index >> (bits - 1) | 1;
-  QName::Data * qname_table = get_qname_table();
-  for (;;) {
-    index &= ((1 << bits) - 1);
-    if (!qname_table[index].Occupied()) {
-      qname_table[index].namespace_ = ns;
-      qname_table[index].localPart_ = local;
-      qname_table[index].AddRef(); // AddRef twice so it's never deleted
-      qname_table[index].AddRef();
-      return qname_table + index;
-    }
-    if (qname_table[index].localPart_ == local &&
-        qname_table[index].namespace_ == ns) {
-      qname_table[index].AddRef();
-      return qname_table + index;
-    }
-    index += increment;
+  return get_qname_table()->Intern(ns, QName::HashNamespace(ns), local);
+}
+
+// Interns a static record, or, if the table already has its name, returns
+// the Data there, which is what its QName then uses.
+static QName::Data *
+AddStatic(QName::Data * data, QName::Data * empty) {
+  if (!data->local_len) {
+    // A namespace record, whose atom is whatever went into the table.
+    if (data->atom)
+      return data->atom;
+    data->atom = data;
+  } else {
+    data->atom = data->atom ? AddStatic(data->atom, empty) : empty;
+    data->ns = data->atom->ns;
+    data->ns_len = data->atom->ns_len;
+  }
+  data->id = QName_NextId();
+
+  QNameTable * table = AtomicOps::AcquireLoadPtr(&qname_table_);
+  if (!table) {
+    data->next = qname_pending_;
+    qname_pending_ = data;
+    return data;
   }
+  QName::Data * found = table->AddStatic(data);
+  if (!data->local_len)
+    data->atom = found;
+  return found;
+}
+
+const QName::Data *
+QName::FindNamespaceAtom(const std::string & ns, uint32 ns_hash) {
+  QName::Data * data = get_qname_table()->Find(ns, "", 0, ns_hash);
+  return data ? data->atom : NULL;
 }
 
 QName::~QName() {
   data_->Release();
 }
 
-QName::QName() : data_(QN_EMPTY.data_) {
-  data_->AddRef();
+QName::QName() : data_(&empty_) {}
+
+#if TXMPP_HAS_MOVE
+QName::QName(QName && qn) noexcept : data_(qn.data_) {
+  // The empty name is interned, so it needs no reference.
+  qn.data_ = &empty_;
 }
+#endif
 
 QName::QName(bool add, const std::string & ns, const char * local) :
   data_(add ? Add(ns, local) : AllocateOrFind(ns, local)) {}
@@ -109,6 +345,12 @@ QName::QName(bool add, const std::string & ns, const std::string & local) :
 QName::QName(const std::string & ns, const char * local) :
   data_(AllocateOrFind(ns, local)) {}
 
+QName::QName(const std::string & ns, uint32 ns_hash, const char * local) :
+  data_(AllocateOrFind(ns, ns_hash, local)) {}
+
+QName::QName(Data * static_data) :
+  data_(AddStatic(static_data, &empty_)) {}
+
 static std::string
 QName_LocalPart(const std::string & name) {
   size_t i = name.rfind(':');
@@ -129,35 +371,58 @@ QName::QName(const std::string & mergedOrLocal) :
   data_(AllocateOrFind(QName_Namespace(mergedOrLocal),
                  QName_LocalPart(mergedOrLocal).c_str())) {}
 
+// Only static records get here, as the others make their strings when they
+// are made. A name shares the string of its namespace.
+const std::string &
+QName::MakeNamespace(Data * data) {
+  Data * atom = data->atom;
+  CritScope cs(get_qname_table()->crit());
+  if (!atom->ns_string) {
+    std::string * ns = new std::string(atom->ns, atom->ns_len);
+    AllocStats::Record(AllocStats::AS_QNAME, sizeof(*ns) + ns->capacity());
+    AtomicOps::ReleaseStorePtr(&atom->ns_string, ns);
+  }
+  AtomicOps::ReleaseStorePtr(&data->ns_string, atom->ns_string);
+  return *data->ns_string;
+}
+
+const std::string &
+QName::MakeLocalPart(Data * data) {
+  CritScope cs(get_qname_table()->crit());
+  if (!data->local_string) {
+    std::string * local = new std::string(data->local, data->local_len);
+    AllocStats::Record(AllocStats::AS_QNAME,
+                       sizeof(*local) + local->capacity());
+    AtomicOps::ReleaseStorePtr(&data->local_string, local);
+  }
+  return *data->local_string;
+}
+
 std::string
 QName::Merged() const {
-  if (data_->namespace_ == STR_EMPTY)
-    return data_->localPart_;
+  if (!data_->ns_len)
+    return std::string(data_->local, data_->local_len);
 
-  std::string result(data_->namespace_);
-  result.reserve(result.length() + 1 + data_->localPart_.length());
+  std::string result;
+  result.reserve(data_->ns_len + 1 + data_->local_len);
+  result.append(data_->ns, data_->ns_len);
   result += ':';
-  result += data_->localPart_;
+  result.append(data_->local, data_->local_len);
   return result;
 }
 
-bool
-QName::operator==(const QName & other) const {
-  return other.data_ == data_ ||
-      (data_->localPart_ == other.data_->localPart_ &&
-       data_->namespace_ == other.data_->namespace_);
-}
-
 int
 QName::Compare(const QName & other) const {
   if (data_ == other.data_)
     return 0;
 
-  int result = data_->localPart_.compare(other.data_->localPart_);
+  int result = QName_Compare(data_->local, data_->local_len,
+                             other.data_->local, other.data_->local_len);
   if (result)
     return result;
 
-  return data_->namespace_.compare(other.data_->namespace_);
+  return QName_Compare(data_->ns, data_->ns_len,
+                       other.data_->ns, other.data_->ns_len);
 }
 
 }  // namespace txmpp
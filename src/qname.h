@@ -32,56 +32,199 @@
 #include "config.h"
 #endif
 
+#include <string.h>
 #include <string>
 
+#include "basictypes.h"
+#include "criticalsection.h"
+
+// Define QNAME_CANONICAL to 1 to intern every QName, parsed ones included.
+// == is then a pointer compare, and < orders by interning order instead of
+// by name, at the cost of the table keeping every name a peer sends.
+#if !defined(QNAME_CANONICAL)
+#define QNAME_CANONICAL 0
+#endif
+
+// Statically initialized records for QName(Data *), so that the names a
+// library defines cost nothing when it is loaded. |ns| and |local| must be
+// string literals, and |ns_data| a namespace record.
+#define TXMPP_QNAME_NAMESPACE(ns) \
+  { ns, sizeof(ns) - 1, "", 0, NULL, 0, 0, NULL, NULL, NULL }
+#define TXMPP_QNAME_NAME(ns_data, local) \
+  { NULL, 0, local, sizeof(local) - 1, &ns_data, 0, 0, NULL, NULL, NULL }
+#define TXMPP_QNAME_LOCAL(local) \
+  { "", 0, local, sizeof(local) - 1, NULL, 0, 0, NULL, NULL, NULL }
+
+// Defines the constant |name|, with a record of its own.
+#define TXMPP_DEFINE_QNAME(name, ns_data, local) \
+  static QName::Data name##_data = TXMPP_QNAME_NAME(ns_data, local); \
+  const QName name(&name##_data)
+#define TXMPP_DEFINE_LOCAL_QNAME(name, local) \
+  static QName::Data name##_data = TXMPP_QNAME_LOCAL(local); \
+  const QName name(&name##_data)
+
 namespace txmpp {
 
 
+// The parts of a name, for looking one up without making a QName: nothing
+// is interned, counted or copied, so the parts must outlive the view. For
+// names put together at run time, as from a namespace in a setting.
+class QNameView {
+public:
+  QNameView(const std::string & ns, const char * local) :
+    ns_(ns.data()), ns_len_(ns.size()), local_(local),
+    local_len_(strlen(local)) {}
+  QNameView(const std::string & ns, const std::string & local) :
+    ns_(ns.data()), ns_len_(ns.size()), local_(local.data()),
+    local_len_(local.size()) {}
+  QNameView(const char * ns, size_t ns_len,
+            const char * local, size_t local_len) :
+    ns_(ns), ns_len_(ns_len), local_(local), local_len_(local_len) {}
+
+  const char * ns() const { return ns_; }
+  size_t ns_len() const { return ns_len_; }
+  const char * local() const { return local_; }
+  size_t local_len() const { return local_len_; }
+
+private:
+  const char * ns_;
+  size_t ns_len_;
+  const char * local_;
+  size_t local_len_;
+};
+
 class QName
 {
 public:
+  struct Data;
+
   explicit QName();
   QName(const QName & qname) : data_(qname.data_) { data_->AddRef(); }
   explicit QName(bool add, const std::string & ns, const char * local);
   explicit QName(bool add, const std::string & ns, const std::string & local);
   explicit QName(const std::string & ns, const char * local);
+  // Like QName(ns, local), for callers that look up many names in one
+  // namespace. |ns_hash| must be HashNamespace(ns).
+  explicit QName(const std::string & ns, uint32 ns_hash, const char * local);
   explicit QName(const std::string & mergedOrLocal);
+  // Interns a statically initialized record, made with the macros above,
+  // without copying it. Only for objects of static storage duration, while
+  // they are being initialized; there may be one record for each name.
+  explicit QName(Data * static_data);
   QName & operator=(const QName & qn) {
     qn.data_->AddRef();
     data_->Release();
     data_ = qn.data_;
     return *this;
   }
+#if TXMPP_HAS_MOVE
+  // Leaves |qn| as QN_EMPTY.
+  QName(QName && qn) noexcept;
+  QName & operator=(QName && qn) noexcept {
+    Swap(&qn);
+    return *this;
+  }
+#endif
   ~QName();
+
+  // Exchanges the names without touching either's reference count.
+  void Swap(QName * other) {
+    Data * data = data_;
+    data_ = other->data_;
+    other->data_ = data;
+  }
   
-  const std::string & Namespace() const { return data_->namespace_; }
-  const std::string & LocalPart() const { return data_->localPart_; }
+  const std::string & Namespace() const {
+    std::string * ns = AtomicOps::AcquireLoadPtr(&data_->ns_string);
+    return ns ? *ns : MakeNamespace(data_);
+  }
+  const std::string & LocalPart() const {
+    std::string * local = AtomicOps::AcquireLoadPtr(&data_->local_string);
+    return local ? *local : MakeLocalPart(data_);
+  }
+  // The interned Data of the namespace, or NULL if it isn't interned. Two
+  // atoms are the same namespace if and only if they are the same pointer.
+  const Data * NamespaceAtom() const { return data_->atom; }
   std::string Merged() const;
   int Compare(const QName & other) const;
-  bool operator==(const QName & other) const;
+  bool operator==(const QName & other) const {
+    if (data_ == other.data_)
+      return true;
+#if QNAME_CANONICAL
+    return false;
+#else
+    // There is only one Data for each interned name.
+    if (data_->Interned() && other.data_->Interned())
+      return false;
+    return data_->local_len == other.data_->local_len &&
+        data_->ns_len == other.data_->ns_len &&
+        memcmp(data_->local, other.data_->local, data_->local_len) == 0 &&
+        memcmp(data_->ns, other.data_->ns, data_->ns_len) == 0;
+#endif
+  }
   bool operator!=(const QName & other) const { return !operator==(other); }
-  bool operator<(const QName & other) const { return Compare(other) < 0; }
+  bool operator==(const QNameView & view) const {
+    return data_->local_len == view.local_len() &&
+        data_->ns_len == view.ns_len() &&
+        memcmp(data_->local, view.local(), view.local_len()) == 0 &&
+        memcmp(data_->ns, view.ns(), view.ns_len()) == 0;
+  }
+  bool operator!=(const QNameView & view) const { return !operator==(view); }
+
+  static uint32 HashNamespace(const std::string & ns);
+  // The atom of |ns|, as NamespaceAtom would return for a name in it.
+  static const Data * FindNamespaceAtom(const std::string & ns,
+                                        uint32 ns_hash);
+  bool operator<(const QName & other) const {
+#if QNAME_CANONICAL
+    return data_->id < other.data_->id;
+#else
+    return Compare(other) < 0;
+#endif
+  }
   
-  class Data {
-  public:
-    Data(const std::string & ns, const std::string & local) :
-      namespace_(ns),
-      localPart_(local),
-      refcount_(1) {}
-
-    Data() : refcount_(0) {}
-      
-    std::string namespace_;
-    std::string localPart_;
-    void AddRef() { refcount_++; }
-    void Release() { if (!--refcount_) { delete this; } }
-    bool Occupied() { return !!refcount_; }
-
-  private:
-    int refcount_;
+  // Names created with add set to true are interned: they are kept in a
+  // shared table for the life of the program, and other QNames with the
+  // same parts share their Data. Parsed names only look the table up, so
+  // that peers can't grow it, and get Data of their own if not found.
+  // Interning a name also interns its namespace, as the name with an empty
+  // local part, which is then the atom of the names in it.
+  //
+  // Data is an aggregate so that it can be statically initialized. The
+  // records the library defines point to their literals, and only make the
+  // strings for Namespace and LocalPart when they are first asked for.
+  struct Data {
+    const char * ns;
+    size_t ns_len;
+    const char * local;
+    size_t local_len;
+    Data * atom;
+    // 0 for names that aren't interned. Interned names are numbered from 1
+    // in the order they were defined or added.
+    uint32 id;
+    volatile int refcount;
+    std::string * volatile ns_string;
+    std::string * volatile local_string;
+    // Links the static records defined before the table was made.
+    Data * next;
+
+    // Interned Data is never freed, so it isn't counted, and can be shared
+    // between threads without touching a shared counter.
+    void AddRef() { if (!id) AtomicOps::Increment(&refcount); }
+    void Release() {
+      if (!id && !AtomicOps::Decrement(&refcount)) { Destroy(); }
+    }
+    bool Interned() const { return id != 0; }
+    void Destroy();
   };
 
 private:
+  static const std::string & MakeNamespace(Data * data);
+  static const std::string & MakeLocalPart(Data * data);
+
+  // The empty name, which is also the empty namespace.
+  friend class QNameTable;
+  static Data empty_;
   Data * data_;
 };
 
@@ -27,53 +27,152 @@
 
 #include "ratelimitmanager.h"
 
-#include <list>
+#include "common.h"
+#include "time.h"
 
 namespace txmpp {
 
-RateLimitManager::RateLimit* RateLimitManager::GetRateLimit(
-    const std::string event_name) {
-  RateLimitMap::iterator it = rate_limits_.find(event_name);
-  if (it != rate_limits_.end()) {
-    return it->second;
+//------------------------------------------------------------------
+// TokenBucket
+
+static uint64 TokenBucket_State(int64 milli_tokens, uint32 time) {
+  return static_cast<uint64>(static_cast<uint32>(milli_tokens)) << 32 | time;
+}
+
+static int32 TokenBucket_MilliTokens(uint64 state) {
+  return static_cast<int32>(state >> 32);
+}
+
+TokenBucket::TokenBucket(int burst, double per_second)
+    : burst_(_min(_max(burst, 1), 1 << 20)),
+      per_second_(_max(per_second, 0.0)),
+      state_(TokenBucket_State(static_cast<int64>(burst_) * 1000,
+                               CachedTime())) {
+}
+
+uint64 TokenBucket::Refill(uint64 state, uint32 now) const {
+  int64 milli_tokens = TokenBucket_MilliTokens(state);
+  uint32 last = static_cast<uint32>(state);
+  int64 full = static_cast<int64>(burst_) * 1000;
+  int32 elapsed = TimeDiff(now, last);
+  if (elapsed <= 0)
+    return state;
+  // A token a second is a milli-token a millisecond.
+  int64 gained = static_cast<int64>(elapsed * per_second_);
+  if (milli_tokens + gained >= full)
+    return TokenBucket_State(full, now);
+  // Leave the time where it was until there is something to gain, so
+  // that slow rates refill even when asked every millisecond.
+  if (gained == 0)
+    return state;
+  return TokenBucket_State(milli_tokens + gained, now);
+}
+
+bool TokenBucket::Update(uint32 now, int tokens, bool force) {
+  int64 cost = static_cast<int64>(tokens) * 1000;
+  int64 floor = -static_cast<int64>(burst_) * 1000;
+  uint64 state = AtomicOps::AcquireLoad(&state_);
+  for (;;) {
+    uint64 refilled = Refill(state, now);
+    int64 milli_tokens = TokenBucket_MilliTokens(refilled);
+    bool enough = milli_tokens >= cost;
+    if (!enough && !force)
+      return false;
+    uint64 next = TokenBucket_State(_max(milli_tokens - cost, floor),
+                                    static_cast<uint32>(refilled));
+    if (AtomicOps::CompareAndSwap(&state_, state, next))
+      return enough;
+    state = AtomicOps::AcquireLoad(&state_);
   }
-  return NULL;
 }
 
-bool RateLimitManager::IsWithinRateLimit(const std::string event_name) {
-  RateLimit* current_rate = GetRateLimit(event_name);
-  if (current_rate) {
-    return current_rate->IsWithinRateLimit();
+bool TokenBucket::Take(uint32 now, int tokens) {
+  return Update(now, tokens, false);
+}
+
+void TokenBucket::Charge(uint32 now, int tokens) {
+  Update(now, tokens, true);
+}
+
+int TokenBucket::TimeUntil(uint32 now, int tokens) const {
+  uint64 state = Refill(AtomicOps::AcquireLoad(&state_), now);
+  int64 missing = static_cast<int64>(tokens) * 1000 -
+                  TokenBucket_MilliTokens(state);
+  if (missing <= 0)
+    return 0;
+  if (per_second_ <= 0)
+    return kForever;
+  // Counted from the time last figured, which may be before |now|.
+  int64 wait = static_cast<int64>(missing / per_second_ + 0.999) -
+               _max(TimeDiff(now, static_cast<uint32>(state)), 0);
+  return static_cast<int>(_min<int64>(_max<int64>(wait, 1), 0x7FFFFFFF));
+}
+
+//------------------------------------------------------------------
+// RateLimitManager
+
+static uint32 RateLimitManager_Hash(const std::string& name) {
+  uint32 result = 2166136261U;
+  for (size_t i = 0; i < name.size(); ++i) {
+    result ^= static_cast<unsigned char>(name[i]);
+    result *= 16777619U;
   }
-  return true; // If no rate limit is set, then you must be under the limit
+  return result;
 }
 
-void RateLimitManager::UpdateRateLimit(const std::string event_name, 
-                                       int max_count, 
-                                       int per_x_seconds) {
-  RateLimit* current_rate = GetRateLimit(event_name);
-  if (!current_rate) {
-    current_rate = new RateLimit(max_count, per_x_seconds);
-    rate_limits_[event_name] = current_rate;
+RateLimitManager::RateLimitManager() {
+}
+
+RateLimitManager::~RateLimitManager() {
+  for (int i = 0; i < kShards; ++i) {
+    std::map<uint32, Limiter*>& limiters = shards_[i].limiters;
+    for (std::map<uint32, Limiter*>::iterator it = limiters.begin();
+         it != limiters.end(); ++it) {
+      while (it->second) {
+        Limiter* next = it->second->next;
+        delete it->second;
+        it->second = next;
+      }
+    }
   }
-  current_rate->UpdateRateLimit();
-}                            
+}
+
+TokenBucket* RateLimitManager::GetLimiter(const std::string& event_name,
+                                          int burst, double per_second) {
+  uint32 hash = RateLimitManager_Hash(event_name);
+  Shard& shard = shards_[hash >> (32 - kShardBits)];
+  CritScope cs(&shard.crit);
+  Limiter*& head = shard.limiters[hash];
+  for (Limiter* limiter = head; limiter; limiter = limiter->next) {
+    if (limiter->name == event_name)
+      return &limiter->bucket;
+  }
+  Limiter* limiter = new Limiter(event_name, burst, per_second);
+  limiter->next = head;
+  head = limiter;
+  return &limiter->bucket;
+}
 
-bool RateLimitManager::VerifyRateLimit(const std::string event_name, 
-                                       int max_count, 
+bool RateLimitManager::VerifyRateLimit(const std::string& event_name,
+                                       int max_count,
                                        int per_x_seconds) {
   return VerifyRateLimit(event_name, max_count, per_x_seconds, false);
 }
 
-bool RateLimitManager::VerifyRateLimit(const std::string event_name, 
-                                       int max_count, 
-                                       int per_x_seconds, 
+bool RateLimitManager::VerifyRateLimit(const std::string& event_name,
+                                       int max_count,
+                                       int per_x_seconds,
                                        bool always_update) {
-  bool within_rate_limit = IsWithinRateLimit(event_name);
-  if (within_rate_limit || always_update) {
-    UpdateRateLimit(event_name, max_count, per_x_seconds);
+  TokenBucket* bucket = GetLimiter(
+      event_name, max_count,
+      static_cast<double>(max_count) / _max(per_x_seconds, 1));
+  uint32 now = CachedTime();
+  if (always_update) {
+    bool within_rate_limit = bucket->TimeUntil(now) == 0;
+    bucket->Charge(now);
+    return within_rate_limit;
   }
-  return within_rate_limit;
+  return bucket->Take(now);
 }
 
 }  // namespace txmpp
@@ -32,13 +32,48 @@
 #include "config.h"
 #endif
 
-#include "time.h"
-#include "taskrunner.h"
 #include <map>
 #include <string>
 
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "criticalsection.h"
+
 namespace txmpp {
 
+// A token bucket holding up to |burst| tokens, refilled at |per_second|
+// tokens a second.  Take and the other calls are lock-free, so one bucket
+// may be shared between threads.
+class TokenBucket {
+ public:
+  TokenBucket(int burst, double per_second);
+
+  int burst() const { return burst_; }
+  double per_second() const { return per_second_; }
+
+  // Takes |tokens| and returns true if the bucket holds as many at |now|,
+  // in milliseconds.
+  bool Take(uint32 now, int tokens = 1);
+  // Takes |tokens| whether or not the bucket holds them, going up to a
+  // full burst into debt.
+  void Charge(uint32 now, int tokens = 1);
+  // The milliseconds from |now| until the bucket holds |tokens|, 0 if it
+  // does already, or kForever if it never will.
+  int TimeUntil(uint32 now, int tokens = 1) const;
+
+ private:
+  // Returns the state at |now|: the milli-tokens held in the high half,
+  // and in the low half the time the refill was last figured at.
+  uint64 Refill(uint64 state, uint32 now) const;
+  bool Update(uint32 now, int tokens, bool force);
+
+  int burst_;
+  double per_second_;
+  volatile uint64 state_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(TokenBucket);
+};
+
 /////////////////////////////////////////////////////////////////////
 //
 // RATELIMITMANAGER
@@ -46,99 +81,56 @@ namespace txmpp {
 /////////////////////////////////////////////////////////////////////
 //
 // RateLimitManager imposes client-side rate limiting for xmpp tasks and
-// other events.  It ensures that no more than i events with a given name 
-// can occur within k seconds. 
+// other events.  Each event name has a TokenBucket, created the first time
+// the name is seen, which allows a burst of max_count events and refills
+// so that max_count more may occur every per_x_seconds.
 //
-// A buffer tracks the previous max_count events.  Before an event is allowed
-// to occur, it can check its rate limit with a call to VerifyRateLimit.  
-// VerifyRateLimit will look up the i-th to last event and if more than
-// k seconds have passed since then, it will return true and update the 
-// appropriate rate limits.  Else, it will return false. 
+// Names are kept by hash in shards, each with its own lock.  Callers that
+// limit the same event over and over should look its bucket up once with
+// GetLimiter and keep it, saving the hashing and the lookup.
 //
 /////////////////////////////////////////////////////////////////////
 
 class RateLimitManager {
  public:
+  RateLimitManager();
+  ~RateLimitManager();
 
-  RateLimitManager() { };
-  ~RateLimitManager() { 
-    for (RateLimitMap::iterator it = rate_limits_.begin();
-         it != rate_limits_.end(); ++it) {
-      delete it->second;
-    }
-  };
+  // Returns the bucket for |event_name|, created with |burst| and
+  // |per_second| if it is new.  It lives as long as the manager.
+  TokenBucket* GetLimiter(const std::string& event_name, int burst,
+                          double per_second);
 
   // Checks if the event is under the defined rate limit and updates the
   // rate limit if so.  Returns true if it's under the rate limit.
-  bool VerifyRateLimit(const std::string event_name, int max_count, 
+  bool VerifyRateLimit(const std::string& event_name, int max_count,
                        int per_x_seconds);
 
   // Checks if the event is under the defined rate limit and updates the
-  // rate limit if so *or* if always_update = true.  
-  bool VerifyRateLimit(const std::string event_name, int max_count, 
+  // rate limit if so *or* if always_update = true.
+  bool VerifyRateLimit(const std::string& event_name, int max_count,
                        int per_x_seconds, bool always_update);
 
  private:
-  class RateLimit {
-   public:
-    RateLimit(int max, int per_x_secs) : counter_(0), max_count_(max),
-                                         per_x_seconds_(per_x_secs) {
-      event_times_ = new uint32[max_count_];                                                 
-      for (int i = 0; i < max_count_; i++) {
-        event_times_[i] = 0;
-      }
-    }
-
-    ~RateLimit() {
-      if (event_times_) {
-        delete[] event_times_;
-      }
-    }
-
-    // True iff the current time >= to the next song allowed time
-    bool IsWithinRateLimit() {
-      return (TimeSince(NextTimeAllowedForCounter()) >= 0);
-    }
-    
-    // Updates time and counter for rate limit
-    void UpdateRateLimit() {
-      event_times_[counter_] = Time();
-      counter_ = (counter_ + 1) % max_count_;
-    }
-
-   private:
-
-    // The time at which the i-th (where i = max_count) event occured
-    uint32 PreviousTimeAtCounter() {
-      return event_times_[counter_];
-    }
-
-    // The time that the next event is allowed to occur
-    uint32 NextTimeAllowedForCounter() {
-      return PreviousTimeAtCounter() + per_x_seconds_ * kSecToMsec;
-    }
-
-    int counter_; // count modulo max_count of the current event
-    int max_count_; // max number of events that can occur within per_x_seconds
-    int per_x_seconds_; // interval size for rate limit
-    uint32* event_times_; // buffer of previous max_count event
-  };
+  enum { kShardBits = 4, kShards = 1 << kShardBits };
 
-  typedef std::map<const std::string, RateLimit*> RateLimitMap;
+  struct Limiter {
+    Limiter(const std::string& name, int burst, double per_second)
+        : name(name), bucket(burst, per_second), next(NULL) {}
 
-  // Maps from event name to its rate limit
-  RateLimitMap rate_limits_;
-
-  // Returns rate limit for event with specified name
-  RateLimit* GetRateLimit(const std::string event_name);
+    std::string name;
+    TokenBucket bucket;
+    Limiter* next;  // With the same hash.
+  };
 
-  // True iff the current time >= to the next song allowed time
-  bool IsWithinRateLimit(const std::string event_name);
+  struct Shard {
+    CriticalSection crit;
+    std::map<uint32, Limiter*> limiters;
+  };
 
-  // Updates time and counter for rate limit
-  void UpdateRateLimit(const std::string event_name, int max_count, 
-                       int per_x_seconds); 
+  Shard shards_[kShards];
 
+  DISALLOW_EVIL_CONSTRUCTORS(RateLimitManager);
 };
 
 }  // namespace txmpp
@@ -26,55 +26,170 @@
  */
 
 #include "ratetracker.h"
+
+#include <math.h>
+
+#include "common.h"
+#include "criticalsection.h"
 #include "time.h"
 
 namespace txmpp {
 
-RateTracker::RateTracker()
-    : total_units_(0), units_second_(0),
-      last_units_second_time_(static_cast<uint32>(-1)),
-      last_units_second_calc_(0) {
+//------------------------------------------------------------------
+// RateTracker
+
+RateTracker::RateTracker(int bucket_ms, int buckets)
+    : bucket_ms_(_max(bucket_ms, 1)),
+      bucket_count_(_min(_max(buckets, 1), static_cast<int>(kMaxBuckets))),
+      total_units_(0) {
+  ASSERT(buckets <= kMaxBuckets);
+  for (int i = 0; i < kMaxBuckets; ++i)
+    buckets_[i] = 0;
 }
 
 size_t RateTracker::total_units() const {
-  return total_units_;
+  return static_cast<size_t>(AtomicOps::AcquireLoad(&total_units_));
 }
 
-size_t RateTracker::units_second() {
-  // Snapshot units / second calculator. Determine how many seconds have
-  // elapsed since our last reference point. If over 1 second, establish
-  // a new reference point that is an integer number of seconds since the
-  // last one, and compute the units over that interval.
-  uint32 current_time = Time();
-  if (last_units_second_time_ != static_cast<uint32>(-1)) {
-    int delta = txmpp::TimeDiff(current_time, last_units_second_time_);
-    if (delta >= 1000) {
-      int fraction_time = delta % 1000;
-      int seconds = delta / 1000;
-      int fraction_units =
-          static_cast<int>(total_units_ - last_units_second_calc_) *
-              fraction_time / delta;
-      // Compute "units received during the interval" / "seconds in interval"
-      units_second_ =
-          (total_units_ - last_units_second_calc_ - fraction_units) / seconds;
-      last_units_second_time_ = current_time - fraction_time;
-      last_units_second_calc_ = total_units_ - fraction_units;
-    }
+void RateTracker::Update(size_t units) {
+  AtomicOps::Add(&total_units_, units);
+  uint32 epoch = Time() / bucket_ms_;
+  volatile uint64* bucket = &buckets_[epoch % bucket_count_];
+  uint64 tag = static_cast<uint64>(epoch & kEpochMask) << kUnitsBits;
+  uint64 old_value = AtomicOps::AcquireLoad(bucket);
+  for (;;) {
+    // A bucket left from an earlier lap of the window starts over.
+    uint64 value = (old_value & ~kUnitsMask) == tag ?
+        old_value + units : tag | (units & kUnitsMask);
+    if (AtomicOps::CompareAndSwap(bucket, old_value, value))
+      break;
+    old_value = AtomicOps::AcquireLoad(bucket);
   }
-  if (last_units_second_time_ == static_cast<uint32>(-1)) {
-    last_units_second_time_ = current_time;
-    last_units_second_calc_ = total_units_;
+}
+
+template <class Visitor>
+void RateTracker::VisitWindow(uint32 now, Visitor* visit) const {
+  uint32 epoch = now / bucket_ms_;
+  for (int age = 0; age < bucket_count_; ++age) {
+    uint32 bucket_epoch = epoch - age;
+    uint64 value =
+        AtomicOps::AcquireLoad(&buckets_[bucket_epoch % bucket_count_]);
+    if ((value >> kUnitsBits) == (bucket_epoch & kEpochMask))
+      (*visit)(value & kUnitsMask, age);
   }
+}
+
+namespace {
 
-  return units_second_;
+struct SumVisitor {
+  SumVisitor() : units(0) {}
+  void operator()(uint64 bucket_units, int age) { units += bucket_units; }
+  uint64 units;
+};
+
+struct WeightedVisitor {
+  WeightedVisitor(double decay) : decay(decay), units(0) {}
+  void operator()(uint64 bucket_units, int age) {
+    units += bucket_units * pow(decay, age);
+  }
+  double decay;
+  double units;
+};
+
+}  // namespace
+
+size_t RateTracker::units_second() const {
+  // The window ends part way into the current bucket.
+  uint32 now = Time();
+  SumVisitor sum;
+  VisitWindow(now, &sum);
+  uint64 window_ms = static_cast<uint64>(bucket_count_ - 1) * bucket_ms_ +
+                     now % bucket_ms_ + 1;
+  return static_cast<size_t>(sum.units * 1000 / window_ms);
 }
 
-void RateTracker::Update(size_t units) {
-  total_units_ += units;
+double RateTracker::weighted_units_second(int half_life_ms) const {
+  uint32 now = Time();
+  double decay = pow(0.5, static_cast<double>(bucket_ms_) /
+                          _max(half_life_ms, 1));
+  WeightedVisitor weighted(decay);
+  VisitWindow(now, &weighted);
+  // The weights of the buckets' durations, the current one partial.
+  double weight_ms = now % bucket_ms_ + 1;
+  for (int age = 1; age < bucket_count_; ++age)
+    weight_ms += bucket_ms_ * pow(decay, age);
+  return weighted.units * 1000 / weight_ms;
 }
 
 uint32 RateTracker::Time() const {
-  return txmpp::Time();
+  return CachedTime();
+}
+
+//------------------------------------------------------------------
+// LatencyHistogram
+
+static int LatencyHistogram_BucketOf(uint32 value) {
+  const int kSubBits = LatencyHistogram::kSubBits;
+  const int kSubBuckets = LatencyHistogram::kSubBuckets;
+  if (value < kSubBuckets)
+    return value;
+  int bits = 0;
+  for (uint32 v = value >> kSubBits; v; v >>= 1)
+    ++bits;
+  // |value| has kSubBits + bits significant bits; its top kSubBits + 1
+  // pick the sub-bucket.
+  return bits * kSubBuckets + ((value >> (bits - 1)) & (kSubBuckets - 1));
+}
+
+// The largest value in |bucket|.
+static uint32 LatencyHistogram_BucketTop(int bucket) {
+  const int kSubBuckets = LatencyHistogram::kSubBuckets;
+  if (bucket < kSubBuckets)
+    return bucket;
+  int bits = bucket / kSubBuckets;
+  uint64 bottom = static_cast<uint64>(kSubBuckets + bucket % kSubBuckets) <<
+                  (bits - 1);
+  return static_cast<uint32>(bottom + (UINT64_C(1) << (bits - 1)) - 1);
+}
+
+LatencyHistogram::LatencyHistogram() {
+  Reset();
+}
+
+void LatencyHistogram::Add(uint32 value) {
+  AtomicOps::Increment(&buckets_[LatencyHistogram_BucketOf(value)]);
+  AtomicOps::Increment(&count_);
+  AtomicOps::Add(&sum_, value);
+  uint64 max = AtomicOps::AcquireLoad(&max_);
+  while (value > max && !AtomicOps::CompareAndSwap(&max_, max, value))
+    max = AtomicOps::AcquireLoad(&max_);
+}
+
+void LatencyHistogram::GetSnapshot(Snapshot* snapshot) const {
+  snapshot->count = AtomicOps::AcquireLoad(&count_);
+  snapshot->sum = AtomicOps::AcquireLoad(&sum_);
+  snapshot->max = static_cast<uint32>(AtomicOps::AcquireLoad(&max_));
+  for (int i = 0; i < kBuckets; ++i)
+    snapshot->buckets[i] = AtomicOps::AcquireLoad(&buckets_[i]);
+}
+
+void LatencyHistogram::Reset() {
+  count_ = 0;
+  sum_ = 0;
+  max_ = 0;
+  for (int i = 0; i < kBuckets; ++i)
+    buckets_[i] = 0;
+}
+
+uint32 LatencyHistogram::Snapshot::Percentile(double fraction) const {
+  uint32 target = static_cast<uint32>(fraction * count);
+  uint32 seen = 0;
+  for (int i = 0; i < kBuckets; ++i) {
+    seen += buckets[i];
+    if (seen > target || (seen == count && seen))
+      return _min(LatencyHistogram_BucketTop(i), max);
+  }
+  return 0;
 }
 
 }  // namespace txmpp
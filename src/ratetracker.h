@@ -30,17 +30,28 @@
 
 #include <stdlib.h>
 #include "basictypes.h"
+#include "constructormagic.h"
 
 namespace txmpp {
 
-// Computes instantaneous units per second.
+// Computes units per second over a sliding window of sub-second buckets.
+// Update and the rates may be called from any thread without locking.
 class RateTracker {
  public:
-  RateTracker();
+  // The window is |buckets| buckets of |bucket_ms| each, by default a
+  // second in tenths.  |buckets| is at most kMaxBuckets.
+  explicit RateTracker(int bucket_ms = 100, int buckets = 10);
   virtual ~RateTracker() {}
 
+  enum { kMaxBuckets = 64 };
+
   size_t total_units() const;
-  size_t units_second();
+  // The units per second over the window up to now.
+  size_t units_second() const;
+  // The units per second over the window, each bucket weighted down by
+  // half for every |half_life_ms| of its age, so that recent units count
+  // for more.
+  double weighted_units_second(int half_life_ms) const;
   void Update(size_t units);
 
  protected:
@@ -48,10 +59,63 @@ class RateTracker {
   virtual uint32 Time() const;
 
  private:
-  size_t total_units_;
-  size_t units_second_;
-  uint32 last_units_second_time_;
-  size_t last_units_second_calc_;
+  // Each bucket holds the low bits of its epoch, Time() / bucket_ms_, above
+  // its units, so that a CAS both starts it anew and adds to it.
+  static const int kUnitsBits = 40;
+  static const uint64 kUnitsMask = (UINT64_C(1) << kUnitsBits) - 1;
+  static const uint32 kEpochMask = (1 << (64 - kUnitsBits)) - 1;
+
+  // Calls |visit| with the units and the age, in buckets, of each bucket
+  // in the window as of |now|.
+  template <class Visitor>
+  void VisitWindow(uint32 now, Visitor* visit) const;
+
+  int bucket_ms_;
+  int bucket_count_;
+  volatile uint64 total_units_;
+  volatile uint64 buckets_[kMaxBuckets];
+
+  DISALLOW_EVIL_CONSTRUCTORS(RateTracker);
+};
+
+// Counts of values in log-linear buckets, as in HdrHistogram: exact below
+// kSubBuckets, and above that each power of two is split into kSubBuckets,
+// for percentiles within 1/kSubBuckets of the truth.  Add is lock-free.
+class LatencyHistogram {
+ public:
+  enum { kSubBits = 4, kSubBuckets = 1 << kSubBits };
+  enum { kBuckets = kSubBuckets + (32 - kSubBits) * kSubBuckets };
+
+  struct Snapshot {
+    uint32 count;
+    uint64 sum;
+    uint32 max;
+    uint32 buckets[kBuckets];
+
+    // An upper bound of the values below which |fraction| of them fall.
+    uint32 Percentile(double fraction) const;
+    uint32 p50() const { return Percentile(0.5); }
+    uint32 p99() const { return Percentile(0.99); }
+    uint32 p999() const { return Percentile(0.999); }
+    uint32 Mean() const {
+      return count ? static_cast<uint32>(sum / count) : 0;
+    }
+  };
+
+  LatencyHistogram();
+
+  void Add(uint32 value);
+  void GetSnapshot(Snapshot* snapshot) const;
+  // Not atomic: values recorded meanwhile may be partly kept.
+  void Reset();
+
+ private:
+  volatile int count_;
+  volatile uint64 sum_;
+  volatile uint64 max_;
+  volatile int buckets_[kBuckets];
+
+  DISALLOW_EVIL_CONSTRUCTORS(LatencyHistogram);
 };
 
 }  // namespace txmpp
@@ -0,0 +1,181 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "reactorpool.h"
+
+#ifdef POSIX
+#include <unistd.h>
+#endif
+
+#ifdef WIN32
+#include "win32.h"
+#endif
+
+#include <algorithm>
+
+#include "asyncsocket.h"
+#include "common.h"
+#include "logging.h"
+
+namespace txmpp {
+
+class ReactorPool::Reactor {
+ public:
+  explicit Reactor(PollerType poller_type)
+      : ss_(poller_type), thread_(&ss_) {
+    thread_.SetName("ReactorPool", this);
+  }
+
+  ~Reactor() {
+    thread_.Stop();
+  }
+
+  // The thread is placed before it runs, so that the buffers it allocates
+  // come from the node of the processor it is pinned to.  Where the
+  // platform can't pin, it runs unpinned.
+  bool Start(int processor) {
+    std::vector<int> processors;
+    if (processor >= 0)
+      processors.push_back(processor);
+    thread_.SetAffinity(processors);
+    thread_.SetNumaNode((processor >= 0) ? Thread::NumaNodeOf(processor) : -1);
+    return thread_.Start();
+  }
+
+  void Stop() {
+    thread_.Stop();
+  }
+
+  PhysicalSocketServer* socketserver() { return &ss_; }
+  Thread* thread() { return &thread_; }
+
+ private:
+  PhysicalSocketServer ss_;
+  Thread thread_;
+};
+
+ReactorPool::ReactorPool(size_t count, PollerType poller_type)
+    : pinned_(false), next_(0) {
+  if (count == 0)
+    count = ProcessorCount();
+  for (size_t i = 0; i < count; ++i)
+    reactors_.push_back(new Reactor(poller_type));
+}
+
+ReactorPool::~ReactorPool() {
+  Stop();
+  for (size_t i = 0; i < reactors_.size(); ++i)
+    delete reactors_[i];
+}
+
+bool ReactorPool::Start(bool pin) {
+  pinned_ = pin;
+  for (size_t i = 0; i < reactors_.size(); ++i) {
+    int processor = pin ? ProcessorFor(i) : -1;
+    if (!reactors_[i]->Start(processor)) {
+      LOG(LS_ERROR) << "Unable to start reactor " << i;
+      Stop();
+      return false;
+    }
+  }
+  return true;
+}
+
+void ReactorPool::Stop() {
+  for (size_t i = 0; i < reactors_.size(); ++i)
+    reactors_[i]->Stop();
+}
+
+void ReactorPool::SetProcessors(const std::vector<int>& processors) {
+  processors_ = processors;
+}
+
+void ReactorPool::GetFreeProcessors(std::vector<int>* processors) const {
+  std::vector<int> used;
+  for (size_t i = 0; pinned_ && i < reactors_.size(); ++i)
+    used.push_back(ProcessorFor(i));
+  int count = static_cast<int>(ProcessorCount());
+  for (int processor = 0; processor < count; ++processor) {
+    if (std::find(used.begin(), used.end(), processor) == used.end())
+      processors->push_back(processor);
+  }
+}
+
+int ReactorPool::ProcessorFor(size_t index) const {
+  if (!processors_.empty())
+    return processors_[index % processors_.size()];
+  return static_cast<int>(index % ProcessorCount());
+}
+
+Thread* ReactorPool::reactor(size_t index) const {
+  ASSERT(index < reactors_.size());
+  return reactors_[index]->thread();
+}
+
+Thread* ReactorPool::LeastLoaded() {
+  return PickReactor()->thread();
+}
+
+AsyncSocket* ReactorPool::CreateAsyncSocket(int type, Thread** reactor) {
+  Reactor* picked = PickReactor();
+  if (reactor)
+    *reactor = picked->thread();
+  return picked->socketserver()->CreateAsyncSocket(type);
+}
+
+ReactorPool::Reactor* ReactorPool::PickReactor() {
+  ASSERT(!reactors_.empty());
+  CritScope cs(&crit_);
+  size_t count = reactors_.size();
+  size_t best = next_ % count;
+  size_t best_load = reactors_[best]->socketserver()->dispatcher_count();
+  for (size_t i = 1; i < count && best_load > 0; ++i) {
+    size_t index = (next_ + i) % count;
+    size_t load = reactors_[index]->socketserver()->dispatcher_count();
+    if (load < best_load) {
+      best = index;
+      best_load = load;
+    }
+  }
+  next_ = best + 1;
+  return reactors_[best];
+}
+
+size_t ReactorPool::ProcessorCount() {
+#if defined(WIN32)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return _max<size_t>(1, info.dwNumberOfProcessors);
+#elif defined(_SC_NPROCESSORS_ONLN)
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return (count > 0) ? static_cast<size_t>(count) : 1;
+#else
+  return 1;
+#endif
+}
+
+}  // namespace txmpp
@@ -0,0 +1,113 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_REACTORPOOL_H_
+#define _TXMPP_REACTORPOOL_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <vector>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "criticalsection.h"
+#include "physicalsocketserver.h"
+#include "thread.h"
+
+namespace txmpp {
+
+class AsyncSocket;
+
+// Runs a number of reactor threads, each with its own PhysicalSocketServer
+// and message queue, so that socket I/O can be spread over several cores
+// without any locking between the shards. New sockets go to the reactor
+// with the fewest live sockets, and belong to it: their signals are emitted
+// on its thread, and they must only be used and destroyed there.
+//
+// Objects that create their sockets through Thread::Current(), such as
+// XmppAsyncSocketImpl and everything built on it, are placed on a reactor
+// by constructing them on its thread, e.g. from a handler invoked with
+// LeastLoaded()->Send(...).
+class ReactorPool {
+ public:
+  // |count| of 0 means one reactor per online processor.
+  explicit ReactorPool(size_t count = 0,
+                       PollerType poller_type = POLLER_DEFAULT);
+  // Stops the reactors. All of their sockets must have been destroyed.
+  ~ReactorPool();
+
+  // Starts the reactor threads. With |pin|, reactor i is bound to processor
+  // i modulo the number of processors, where the platform supports it, and
+  // takes its memory from that processor's NUMA node.
+  bool Start(bool pin = true);
+  void Stop();
+
+  // Makes Start pin reactor i to processors[i] modulo their number instead.
+  // Must be called before Start().
+  void SetProcessors(const std::vector<int>& processors);
+  // Appends the online processors that no reactor is pinned to, as the
+  // affinity for other threads, such as a ThreadPool's, that are to stay
+  // off the reactors' cores.  Appends none if the reactors take them all.
+  void GetFreeProcessors(std::vector<int>* processors) const;
+
+  size_t size() const { return reactors_.size(); }
+  Thread* reactor(size_t index) const;
+
+  // Returns the reactor with the fewest live sockets. Ties are broken round
+  // robin, so that a burst of assignments does not pile onto one reactor.
+  Thread* LeastLoaded();
+
+  // Creates a socket on the least loaded reactor, which is returned through
+  // |reactor| if it is not NULL. Sockets accepted by a listening socket stay
+  // on the listener's reactor.
+  AsyncSocket* CreateAsyncSocket(int type, Thread** reactor = NULL);
+
+  // The number of processors currently online, at least 1.
+  static size_t ProcessorCount();
+
+ private:
+  class Reactor;
+  typedef std::vector<Reactor*> ReactorList;
+
+  Reactor* PickReactor();
+  // The processor reactor |index| is pinned to.
+  int ProcessorFor(size_t index) const;
+
+  ReactorList reactors_;
+  std::vector<int> processors_;
+  bool pinned_;
+  size_t next_;
+  CriticalSection crit_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(ReactorPool);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_REACTORPOOL_H_
@@ -0,0 +1,87 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rttestimator.h"
+
+#include "common.h"
+
+namespace txmpp {
+
+RttEstimator::RttEstimator() {
+  Reset();
+}
+
+void RttEstimator::Reset() {
+  has_estimate_ = false;
+  samples_ = 0;
+  srtt_us_ = 0;
+  rttvar_us_ = 0;
+}
+
+void RttEstimator::AddSample(uint32 rtt_us) {
+  ++samples_;
+  if (!has_estimate_) {
+    has_estimate_ = true;
+    srtt_us_ = rtt_us;
+    rttvar_us_ = rtt_us / 2;
+    return;
+  }
+  // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, then SRTT = 7/8 SRTT + 1/8 R.
+  uint32 delta = rtt_us > srtt_us_ ? rtt_us - srtt_us_ : srtt_us_ - rtt_us;
+  rttvar_us_ = rttvar_us_ - rttvar_us_ / 4 + delta / 4;
+  srtt_us_ = srtt_us_ - srtt_us_ / 8 + rtt_us / 8;
+}
+
+void RttEstimator::Seed(uint32 srtt_us, uint32 rttvar_us) {
+  if (has_estimate_)
+    return;
+  has_estimate_ = true;
+  srtt_us_ = srtt_us;
+  rttvar_us_ = rttvar_us;
+}
+
+int RttEstimator::RtoMs() const {
+  if (!has_estimate_)
+    return kInitialRtoMs;
+  // SRTT + max(G, 4 RTTVAR), with a clock granularity G of a millisecond.
+  uint64 rto_us = static_cast<uint64>(srtt_us_) +
+                  _max(static_cast<uint64>(1000),
+                       4 * static_cast<uint64>(rttvar_us_));
+  int rto_ms = static_cast<int>(_min(rto_us / 1000,
+                                     static_cast<uint64>(kMaxRtoMs)));
+  return _max(rto_ms, kMinRtoMs);
+}
+
+int RttEstimator::TimeoutMs(int rtos, int min_ms, int max_ms) const {
+  if (!has_estimate_)
+    return max_ms;
+  int64 timeout = static_cast<int64>(RtoMs()) * _max(rtos, 1);
+  return static_cast<int>(_max(static_cast<int64>(min_ms),
+                               _min(timeout, static_cast<int64>(max_ms))));
+}
+
+}  // namespace txmpp
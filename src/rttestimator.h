@@ -0,0 +1,79 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_RTTESTIMATOR_H_
+#define _TXMPP_RTTESTIMATOR_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include "basictypes.h"
+
+namespace txmpp {
+
+// A connection's round trip time, smoothed as TCP smooths its own (RFC
+// 6298), and the retransmission timeout that comes of it: the smoothed
+// time plus four times its mean deviation, so that timeouts are short on
+// a steady fast link and long on a slow or jittery one.  Not thread safe.
+class RttEstimator {
+ public:
+  // The bounds of the RTO, as Linux has them for TCP, and the RTO before
+  // any sample.
+  static const int kMinRtoMs = 200;
+  static const int kMaxRtoMs = 120000;
+  static const int kInitialRtoMs = 1000;
+
+  RttEstimator();
+
+  // Takes in a round trip of |rtt_us| microseconds.
+  void AddSample(uint32 rtt_us);
+  // Starts from an estimate made elsewhere, as the kernel's TCP_INFO, if
+  // there is none yet.
+  void Seed(uint32 srtt_us, uint32 rttvar_us);
+  void Reset();
+
+  bool HasEstimate() const { return has_estimate_; }
+  uint32 samples() const { return samples_; }
+  uint32 srtt_us() const { return srtt_us_; }
+  uint32 rttvar_us() const { return rttvar_us_; }
+  // The retransmission timeout, within the bounds above.
+  int RtoMs() const;
+  // |rtos| RTOs, within [|min_ms|, |max_ms|], or |max_ms| without an
+  // estimate, as for a timeout that would otherwise be fixed at |max_ms|.
+  int TimeoutMs(int rtos, int min_ms, int max_ms) const;
+
+ private:
+  bool has_estimate_;
+  uint32 samples_;
+  uint32 srtt_us_;
+  uint32 rttvar_us_;
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_RTTESTIMATOR_H_
@@ -60,6 +60,8 @@ public:
       token_service_("") {}
 
   virtual std::string GetMechanismName() { return mechanism_; }
+
+  virtual bool ExpectsChallenge() { return false; }
     
   virtual XmlElement * StartSaslAuth() {
     // send initial request
@@ -54,10 +54,20 @@ public:
   // Should generate the initial "auth" request.  Default is just <auth/>.
   virtual XmlElement * StartSaslAuth();
 
+  // Whether the server may answer the "auth" request with a challenge.
+  // If not, its answer is success or failure, and what follows can be
+  // sent before it comes.  Default is true.
+  virtual bool ExpectsChallenge() { return true; }
+
   // Should respond to a SASL "<challenge>" request.  Default is
   // to abort (for mechanisms that do not do challenge-response)
   virtual XmlElement * HandleSaslChallenge(const XmlElement * challenge);
 
+  // Whether a SASL "<success>" proves the server knew the credentials,
+  // for mechanisms that can tell.  If not, the login fails.  Default is
+  // true.
+  virtual bool VerifySaslSuccess(const XmlElement * success) { return true; }
+
   // Notification of a SASL "<success>".  Sometimes information
   // is passed on success.
   virtual void HandleSaslSuccess(const XmlElement * success);
@@ -44,6 +44,8 @@ public:
     user_jid_(user_jid), password_(password) {}
 
   virtual std::string GetMechanismName() { return "PLAIN"; }
+
+  virtual bool ExpectsChallenge() { return false; }
     
   virtual XmlElement * StartSaslAuth() {
     // send initial request
@@ -0,0 +1,295 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "saslscrammechanism.h"
+
+#include <string.h>
+#include <vector>
+#include "constants.h"
+#include "helpers.h"
+#include "logging.h"
+#include "stringencode.h"
+#include "xmlelement.h"
+
+namespace txmpp {
+
+// Enough for any account a server means to keep; more only burns CPU.
+static const int kMaxIterations = 1 << 20;
+static const size_t kNonceLength = 24;
+// The GS2 header for no channel binding and no authzid, and its base64.
+static const char kGs2Header[] = "n,,";
+static const char kGs2HeaderBase64[] = "biws";
+
+ScramKeyCache::ScramKeyCache(size_t capacity) : capacity_(capacity) {
+}
+
+ScramKeyCache* ScramKeyCache::Shared() {
+  static ScramKeyCache* cache = new ScramKeyCache(16384);
+  return cache;
+}
+
+bool ScramKeyCache::Find(const std::string & id, Keys * keys) {
+  CritScope cs(&crit_);
+  KeyMap::const_iterator it = keys_.find(id);
+  if (it == keys_.end())
+    return false;
+  *keys = it->second;
+  return true;
+}
+
+void ScramKeyCache::Add(const std::string & id, const Keys & keys) {
+  CritScope cs(&crit_);
+  if (capacity_ == 0)
+    return;
+  std::pair<KeyMap::iterator, bool> added =
+      keys_.insert(std::make_pair(id, keys));
+  if (!added.second) {
+    added.first->second = keys;
+    return;
+  }
+  order_.push_back(id);
+  while (keys_.size() > capacity_) {
+    keys_.erase(order_.front());
+    order_.pop_front();
+  }
+}
+
+void ScramKeyCache::Remove(const std::string & id) {
+  CritScope cs(&crit_);
+  if (keys_.erase(id))
+    order_.remove(id);
+}
+
+void ScramKeyCache::Clear() {
+  CritScope cs(&crit_);
+  keys_.clear();
+  order_.clear();
+}
+
+// Escapes ',' and '=' in a user name, as a SCRAM saslname.
+static std::string SaslScramMechanism_SaslName(const std::string & name) {
+  std::string escaped;
+  for (size_t i = 0; i < name.size(); ++i) {
+    if (name[i] == ',')
+      escaped.append("=2C");
+    else if (name[i] == '=')
+      escaped.append("=3D");
+    else
+      escaped.push_back(name[i]);
+  }
+  return escaped;
+}
+
+// Finds the value of the attribute |name| of a SCRAM message, and returns
+// false if there is none.
+static bool SaslScramMechanism_Attr(const std::string & message, char name,
+                                    std::string * value) {
+  size_t start = 0;
+  while (start < message.size()) {
+    size_t end = message.find(',', start);
+    if (end == std::string::npos)
+      end = message.size();
+    if (end - start >= 2 && message[start] == name &&
+        message[start + 1] == '=') {
+      value->assign(message, start + 2, end - start - 2);
+      return true;
+    }
+    start = end + 1;
+  }
+  return false;
+}
+
+SaslScramMechanism::SaslScramMechanism(DigestType type, const Jid & user_jid,
+                                       const CryptString & password,
+                                       ScramKeyCache * cache)
+    : type_(type), user_jid_(user_jid), password_(password), cache_(cache),
+      sent_proof_(false), verified_(false) {
+  memset(&keys_, 0, sizeof(keys_));
+}
+
+SaslScramMechanism::~SaslScramMechanism() {
+  memset(&keys_, 0, sizeof(keys_));
+}
+
+std::string SaslScramMechanism::MechanismName(DigestType type) {
+  return (type == DIGEST_SHA1) ? "SCRAM-SHA-1" : "SCRAM-SHA-256";
+}
+
+XmlElement * SaslScramMechanism::StartSaslAuth() {
+  client_nonce_ = CreateRandomString(kNonceLength);
+  client_first_bare_ = "n=" + SaslScramMechanism_SaslName(user_jid_.node()) +
+                       ",r=" + client_nonce_;
+  sent_proof_ = false;
+  verified_ = false;
+
+  XmlElement * el = new XmlElement(QN_SASL_AUTH, true);
+  el->AddAttr(QN_MECHANISM, GetMechanismName());
+  el->AddText(Base64Encode(kGs2Header + client_first_bare_));
+  return el;
+}
+
+XmlElement *
+SaslScramMechanism::HandleSaslChallenge(const XmlElement * challenge) {
+  std::string message = Base64Decode(challenge->BodyText());
+
+  if (sent_proof_) {
+    // Some servers send the server-final-message as a challenge, and then
+    // an empty success.
+    if (!VerifyServerFinal(message))
+      return NULL;
+    return new XmlElement(QN_SASL_RESPONSE, true);
+  }
+
+  std::string nonce, salt, iterations_str, extension;
+  if (!SaslScramMechanism_Attr(message, 'r', &nonce) ||
+      !SaslScramMechanism_Attr(message, 's', &salt) ||
+      !SaslScramMechanism_Attr(message, 'i', &iterations_str) ||
+      SaslScramMechanism_Attr(message, 'm', &extension)) {
+    LOG(LS_WARNING) << "Bad SCRAM server-first-message";
+    return NULL;
+  }
+  // The server's nonce must extend ours.
+  if (nonce.size() <= client_nonce_.size() ||
+      nonce.compare(0, client_nonce_.size(), client_nonce_) != 0) {
+    LOG(LS_WARNING) << "Bad SCRAM nonce";
+    return NULL;
+  }
+  int iterations = 0;
+  if (!FromString(iterations_str, &iterations) || iterations <= 0 ||
+      iterations > kMaxIterations) {
+    LOG(LS_WARNING) << "Bad SCRAM iteration count " << iterations_str;
+    return NULL;
+  }
+  if (!GetKeys(Base64Decode(salt), iterations))
+    return NULL;
+
+  std::string client_final = std::string("c=") + kGs2HeaderBase64 +
+                             ",r=" + nonce;
+  auth_message_ = client_first_bare_ + "," + message + "," + client_final;
+
+  // ClientProof = ClientKey XOR HMAC(H(ClientKey), AuthMessage)
+  size_t size = DigestSize(type_);
+  unsigned char stored_key[kMaxDigestSize];
+  unsigned char proof[kMaxDigestSize];
+  ComputeDigest(type_, keys_.client_key, size, stored_key);
+  ComputeHmac(type_, stored_key, size, auth_message_.data(),
+              auth_message_.size(), proof);
+  for (size_t i = 0; i < size; ++i)
+    proof[i] ^= keys_.client_key[i];
+
+  client_final.append(",p=");
+  client_final.append(Base64EncodeFromArray(reinterpret_cast<char *>(proof),
+                                            size));
+  sent_proof_ = true;
+
+  XmlElement * el = new XmlElement(QN_SASL_RESPONSE, true);
+  el->AddText(Base64Encode(client_final));
+  return el;
+}
+
+bool SaslScramMechanism::VerifySaslSuccess(const XmlElement * success) {
+  if (verified_)
+    return true;
+  return sent_proof_ && VerifyServerFinal(Base64Decode(success->BodyText()));
+}
+
+void SaslScramMechanism::HandleSaslFailure(const XmlElement * failure) {
+  // The keys may be stale, for a password changed since.
+  if (cache_ && !keys_id_.empty())
+    cache_->Remove(keys_id_);
+}
+
+bool SaslScramMechanism::GetKeys(const std::string & salt, int iterations) {
+  std::vector<unsigned char> password;
+  password_.CopyRawTo(&password);
+
+  // The keys are cached under a digest of what they derive from, which
+  // keeps the password out of the cache.
+  MessageDigest id_digest(DIGEST_SHA256);
+  std::string prefix = GetMechanismName() + '\0' + user_jid_.node() + '\0';
+  id_digest.Update(prefix.data(), prefix.size());
+  if (!password.empty())
+    id_digest.Update(&password[0], password.size());
+  std::string suffix = '\0' + salt + '\0' + ToString(iterations);
+  id_digest.Update(suffix.data(), suffix.size());
+  unsigned char id[kMaxDigestSize];
+  id_digest.Finish(id);
+  keys_id_.assign(reinterpret_cast<char *>(id), id_digest.Size());
+
+  bool found = cache_ && cache_->Find(keys_id_, &keys_);
+  if (!found) {
+    size_t size = DigestSize(type_);
+    unsigned char salted_password[kMaxDigestSize];
+    bool derived = DerivePbkdf2(type_,
+                                password.empty() ? NULL : &password[0],
+                                password.size(), salt.data(), salt.size(),
+                                iterations, salted_password, size);
+    if (derived) {
+      ComputeHmac(type_, salted_password, size, "Client Key", 10,
+                  keys_.client_key);
+      ComputeHmac(type_, salted_password, size, "Server Key", 10,
+                  keys_.server_key);
+      if (cache_)
+        cache_->Add(keys_id_, keys_);
+    } else {
+      LOG(LS_ERROR) << "SCRAM key derivation failed";
+      keys_id_.clear();
+    }
+    memset(salted_password, 0, sizeof(salted_password));
+    found = derived;
+  }
+  if (!password.empty())
+    memset(&password[0], 0, password.size());
+  return found;
+}
+
+bool SaslScramMechanism::VerifyServerFinal(const std::string & message) {
+  std::string signature;
+  if (!SaslScramMechanism_Attr(message, 'v', &signature)) {
+    std::string error;
+    if (SaslScramMechanism_Attr(message, 'e', &error))
+      LOG(LS_WARNING) << "SCRAM server error " << error;
+    return false;
+  }
+  signature = Base64Decode(signature);
+
+  size_t size = DigestSize(type_);
+  unsigned char expected[kMaxDigestSize];
+  ComputeHmac(type_, keys_.server_key, size, auth_message_.data(),
+              auth_message_.size(), expected);
+  if (signature.size() != size)
+    return false;
+  unsigned char diff = 0;
+  for (size_t i = 0; i < size; ++i)
+    diff |= expected[i] ^ static_cast<unsigned char>(signature[i]);
+  verified_ = (diff == 0);
+  if (!verified_)
+    LOG(LS_WARNING) << "SCRAM server signature mismatch";
+  return verified_;
+}
+
+}  // namespace txmpp
@@ -0,0 +1,123 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_SASLSCRAMMECHANISM_H_
+#define _TXMPP_SASLSCRAMMECHANISM_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <list>
+#include <map>
+#include <string>
+#include "criticalsection.h"
+#include "cryptstring.h"
+#include "jid.h"
+#include "saslmechanism.h"
+#include "stringdigest.h"
+
+namespace txmpp {
+
+// The keys SCRAM derives from a password, which take the thousands of
+// PBKDF2 iterations the server asks for.  They only depend on the user, the
+// password, the mechanism and the salt and iteration count the server
+// keeps for the account, so they are cached across logins on those.  The
+// cache is shared by all the threads and accounts, and drops the oldest
+// keys past its capacity.
+class ScramKeyCache {
+public:
+  struct Keys {
+    unsigned char client_key[kMaxDigestSize];
+    unsigned char server_key[kMaxDigestSize];
+  };
+
+  explicit ScramKeyCache(size_t capacity);
+
+  // The cache SaslScramMechanism uses unless given another.
+  static ScramKeyCache* Shared();
+
+  // Fills in |keys| and returns true if keys are cached under |id|.
+  bool Find(const std::string & id, Keys * keys);
+  void Add(const std::string & id, const Keys & keys);
+  void Remove(const std::string & id);
+  void Clear();
+
+private:
+  typedef std::map<std::string, Keys> KeyMap;
+
+  CriticalSection crit_;
+  size_t capacity_;
+  KeyMap keys_;
+  // The ids in keys_, oldest first.
+  std::list<std::string> order_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(ScramKeyCache);
+};
+
+// SCRAM-SHA-1 and SCRAM-SHA-256 (RFC 5802, RFC 7677), without channel
+// binding.  The password is used as is, without SASLprep.
+class SaslScramMechanism : public SaslMechanism {
+public:
+  SaslScramMechanism(DigestType type, const Jid & user_jid,
+                     const CryptString & password,
+                     ScramKeyCache * cache = ScramKeyCache::Shared());
+  virtual ~SaslScramMechanism();
+
+  // Returns the name of the mechanism for |type|.
+  static std::string MechanismName(DigestType type);
+
+  virtual std::string GetMechanismName() { return MechanismName(type_); }
+  virtual XmlElement * StartSaslAuth();
+  virtual XmlElement * HandleSaslChallenge(const XmlElement * challenge);
+  virtual bool VerifySaslSuccess(const XmlElement * success);
+  virtual void HandleSaslFailure(const XmlElement * failure);
+
+private:
+  // Derives or finds the keys for |salt| and |iterations|.
+  bool GetKeys(const std::string & salt, int iterations);
+  // Checks a server-final-message, and returns whether it proves the server
+  // knew the keys.
+  bool VerifyServerFinal(const std::string & message);
+
+  DigestType type_;
+  Jid user_jid_;
+  CryptString password_;
+  ScramKeyCache * cache_;
+  std::string client_nonce_;
+  std::string client_first_bare_;
+  std::string auth_message_;
+  // The id of the cached keys in use, and them.
+  std::string keys_id_;
+  ScramKeyCache::Keys keys_;
+  bool sent_proof_;
+  bool verified_;
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_SASLSCRAMMECHANISM_H_
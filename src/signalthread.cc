@@ -28,6 +28,7 @@
 #include "signalthread.h"
 
 #include "common.h"
+#include "threadpool.h"
 
 namespace txmpp {
 
@@ -35,12 +36,15 @@ namespace txmpp {
 // SignalThread
 ///////////////////////////////////////////////////////////////////////////////
 
-SignalThread::SignalThread() : main_(Thread::Current()), state_(kInit) {
+SignalThread::SignalThread()
+    : main_(Thread::Current()), pool_(NULL), done_(false, false),
+      state_(kInit) {
   main_->SignalQueueDestroyed.connect(this,
                                       &SignalThread::OnMainThreadDestroyed);
   refcount_ = 1;
   worker_.parent_ = this;
   worker_.SetName("SignalThread", this);
+  task_.parent_ = this;
 }
 
 SignalThread::~SignalThread() {
@@ -61,13 +65,25 @@ bool SignalThread::SetPriority(ThreadPriority priority) {
   return worker_.SetPriority(priority);
 }
 
+void SignalThread::SetPool(ThreadPool* pool) {
+  EnterExit ee(this);
+  ASSERT(main_->IsCurrent());
+  ASSERT(kInit == state_ || kComplete == state_);
+  pool_ = pool;
+}
+
 void SignalThread::Start() {
   EnterExit ee(this);
   ASSERT(main_->IsCurrent());
   if (kInit == state_ || kComplete == state_) {
     state_ = kRunning;
     OnWorkStart();
-    worker_.Start();
+    if (pool_) {
+      done_.Reset();
+      pool_->Post(&task_);
+    } else {
+      worker_.Start();
+    }
   } else {
     ASSERT(false);
   }
@@ -87,7 +103,11 @@ void SignalThread::Destroy(bool wait) {
     if (wait) {
       // Release the thread's lock so that it can return from ::Run.
       cs_.Leave();
-      worker_.Stop();
+      if (pool_) {
+        done_.Wait(kForever);
+      } else {
+        worker_.Stop();
+      }
       cs_.Enter();
       refcount_--;
     }
@@ -111,6 +131,10 @@ void SignalThread::Release() {
 
 bool SignalThread::ContinueWork() {
   EnterExit ee(this);
+  if (pool_) {
+    // Destroy sets the state under cs_ before calling OnWorkStop.
+    return kStopping != state_;
+  }
   ASSERT(worker_.IsCurrent());
   return worker_.ProcessMessages(0);
 }
@@ -137,7 +161,8 @@ void SignalThread::OnMessage(Message *msg) {
       // Calling Stop() on the worker ensures that the OS thread that underlies
       // the worker will finish, and will be set to NULL, enabling us to call
       // Start() again.
-      worker_.Stop();
+      if (!pool_)
+        worker_.Stop();
       SignalWorkDone(this);
     }
     if (do_delete) {
@@ -153,6 +178,10 @@ void SignalThread::Run() {
     if (main_) {
       main_->Post(this, ST_MSG_WORKER_DONE);
     }
+    // Set under cs_, so that a Destroy waiting for it cannot delete this
+    // before we are done with it.
+    if (pool_)
+      done_.Set();
   }
 }
 
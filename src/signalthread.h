@@ -32,11 +32,14 @@
 #include "config.h"
 #endif
 
+#include "event.h"
 #include "thread.h"
 #include "sigslot.h"
 
 namespace txmpp {
 
+class ThreadPool;
+
 ///////////////////////////////////////////////////////////////////////////////
 // SignalThread - Base class for worker threads.  The main thread should call
 //  Start() to begin work, and then follow one of these models:
@@ -52,6 +55,9 @@ namespace txmpp {
 //   periodically calling ContinueWork(), it can check for cancellation.
 //   OnWorkStart and OnWorkDone can be overridden to do pre- or post-work
 //   tasks in the context of the main thread.
+//  With SetPool, DoWork runs as a task of a ThreadPool instead of on a thread
+//   of its own.  worker() is then not running, so subclasses that pump the
+//   worker's message queue from DoWork must not use a pool.
 ///////////////////////////////////////////////////////////////////////////////
 
 class SignalThread : public has_slots<>, protected MessageHandler {
@@ -64,6 +70,10 @@ class SignalThread : public has_slots<>, protected MessageHandler {
   // Context: Main Thread.  Call before Start to change the worker's priority.
   bool SetPriority(ThreadPriority priority);
 
+  // Context: Main Thread.  Call before Start to run DoWork on |pool|, which
+  // must outlive the work.  NULL goes back to a dedicated worker thread.
+  void SetPool(ThreadPool* pool);
+
   // Context: Main Thread.  Call to begin the worker thread.
   void Start();
 
@@ -126,6 +136,13 @@ class SignalThread : public has_slots<>, protected MessageHandler {
     virtual void Run() { parent_->Run(); }
   };
 
+  friend class PoolTask;
+  class PoolTask : public Runnable {
+   public:
+    SignalThread* parent_;
+    virtual void Run(Thread* thread) { parent_->Run(); }
+  };
+
   friend class EnterExit;
   class EnterExit {
    public:
@@ -148,6 +165,10 @@ class SignalThread : public has_slots<>, protected MessageHandler {
 
   Thread* main_;
   Worker worker_;
+  ThreadPool* pool_;
+  PoolTask task_;
+  // Set when DoWork has returned on the pool.
+  Event done_;
   CriticalSection cs_;
   State state_;
   int refcount_;
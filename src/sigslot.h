@@ -69,6 +69,14 @@
 //										  absolutely essential. However, on some platforms, creating a lot of 
 //										  mutexes can slow down the whole OS, so use this option with care.
 //
+//			multi_threaded_cow			- Like multi_threaded_local, except that emitting a signal takes no lock.
+//										  Connections are kept in a copy-on-write array that emission reads a
+//										  snapshot of; connect and disconnect pay for the copy, and disconnect
+//										  waits for the emissions already under way on other threads, as
+//										  multi_threaded_local waits for the lock, unless it is made by a slot
+//										  of the same signal. Available even when the other modes are
+//										  compiled out.
+//
 //		USING THE LIBRARY
 //
 //			See the full documentation at http://sigslot.sourceforge.net/
@@ -84,7 +92,13 @@
 
 #include <list>
 #include <set>
+#include <vector>
 #include <stdlib.h>
+#ifndef WIN32
+#include <sched.h>
+#endif
+
+#include "criticalsection.h"
 
 // On our copy of sigslot.h, we force single threading
 #define SIGSLOT_PURE_ISO
@@ -284,6 +298,48 @@ namespace txmpp {
 	};
 #endif // _SIGSLOT_HAS_POSIX_THREADS
 
+	// Locks like multi_threaded_local for connecting and disconnecting, but
+	// signals emit without taking the lock. Emission reads a copy-on-write
+	// array of the connections, and connect and disconnect pay for the copy
+	// instead. A slot disconnected by a slot during emission is not called.
+	// Disconnecting on another thread, as ~has_slots does, returns once the
+	// emissions that may still call the slot are done, so a slot may be
+	// deleted when it is disconnected, as with the locking policies. The
+	// exception is a disconnect made by a slot of the same signal: it can't
+	// wait for the emissions on other threads, which may be waiting for it,
+	// so what it disconnects must outlive those.
+	class multi_threaded_cow
+	{
+	public:
+		multi_threaded_cow()
+		{
+			;
+		}
+
+		multi_threaded_cow(const multi_threaded_cow&)
+		{
+			;
+		}
+
+		virtual ~multi_threaded_cow()
+		{
+			;
+		}
+
+		virtual void lock()
+		{
+			m_crit.Enter();
+		}
+
+		virtual void unlock()
+		{
+			m_crit.Leave();
+		}
+
+	private:
+		CriticalSection m_crit;
+	};
+
 	template<class mt_policy>
 	class lock_block
 	{
@@ -306,789 +362,800 @@ namespace txmpp {
 	class has_slots;
 
 	template<class mt_policy>
-	class _connection_base0
+	class _signal_base;
+
+	// Fills the unused argument positions of the generic classes below, which
+	// take eight arguments and serve every arity.
+	class _nil
 	{
-	public:
-		virtual ~_connection_base0() {}
-		virtual has_slots<mt_policy>* getdest() const = 0;
-		virtual void emit() = 0;
-		virtual _connection_base0* clone() = 0;
-		virtual _connection_base0* duplicate(has_slots<mt_policy>* pnewdest) = 0;
 	};
 
-	template<class arg1_type, class mt_policy>
-	class _connection_base1
+	// The slot member function type for the arguments other than _nil, and
+	// how to call one.
+	template<class dest_type, class arg1_type = _nil, class arg2_type = _nil,
+	class arg3_type = _nil, class arg4_type = _nil, class arg5_type = _nil,
+	class arg6_type = _nil, class arg7_type = _nil, class arg8_type = _nil>
+	struct _memfun
 	{
-	public:
-		virtual ~_connection_base1() {}
-		virtual has_slots<mt_policy>* getdest() const = 0;
-		virtual void emit(arg1_type) = 0;
-		virtual _connection_base1<arg1_type, mt_policy>* clone() = 0;
-		virtual _connection_base1<arg1_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest) = 0;
+		typedef void (dest_type::*type)(arg1_type, arg2_type, arg3_type,
+			arg4_type, arg5_type, arg6_type, arg7_type, arg8_type);
+		static void call(dest_type* pobject, type pmemfun, arg1_type a1,
+			arg2_type a2, arg3_type a3, arg4_type a4, arg5_type a5,
+			arg6_type a6, arg7_type a7, arg8_type a8)
+		{
+			(pobject->*pmemfun)(a1, a2, a3, a4, a5, a6, a7, a8);
+		}
 	};
 
-	template<class arg1_type, class arg2_type, class mt_policy>
-	class _connection_base2
+	template<class dest_type, class arg1_type, class arg2_type,
+	class arg3_type, class arg4_type, class arg5_type, class arg6_type,
+	class arg7_type>
+	struct _memfun<dest_type, arg1_type, arg2_type, arg3_type, arg4_type,
+		arg5_type, arg6_type, arg7_type, _nil>
 	{
-	public:
-		virtual ~_connection_base2() {}
-		virtual has_slots<mt_policy>* getdest() const = 0;
-		virtual void emit(arg1_type, arg2_type) = 0;
-		virtual _connection_base2<arg1_type, arg2_type, mt_policy>* clone() = 0;
-		virtual _connection_base2<arg1_type, arg2_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest) = 0;
+		typedef void (dest_type::*type)(arg1_type, arg2_type, arg3_type,
+			arg4_type, arg5_type, arg6_type, arg7_type);
+		static void call(dest_type* pobject, type pmemfun, arg1_type a1,
+			arg2_type a2, arg3_type a3, arg4_type a4, arg5_type a5,
+			arg6_type a6, arg7_type a7, _nil)
+		{
+			(pobject->*pmemfun)(a1, a2, a3, a4, a5, a6, a7);
+		}
 	};
 
-	template<class arg1_type, class arg2_type, class arg3_type, class mt_policy>
-	class _connection_base3
+	template<class dest_type, class arg1_type, class arg2_type,
+	class arg3_type, class arg4_type, class arg5_type, class arg6_type>
+	struct _memfun<dest_type, arg1_type, arg2_type, arg3_type, arg4_type,
+		arg5_type, arg6_type, _nil, _nil>
 	{
-	public:
-		virtual ~_connection_base3() {}
-		virtual has_slots<mt_policy>* getdest() const = 0;
-		virtual void emit(arg1_type, arg2_type, arg3_type) = 0;
-		virtual _connection_base3<arg1_type, arg2_type, arg3_type, mt_policy>* clone() = 0;
-		virtual _connection_base3<arg1_type, arg2_type, arg3_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest) = 0;
+		typedef void (dest_type::*type)(arg1_type, arg2_type, arg3_type,
+			arg4_type, arg5_type, arg6_type);
+		static void call(dest_type* pobject, type pmemfun, arg1_type a1,
+			arg2_type a2, arg3_type a3, arg4_type a4, arg5_type a5,
+			arg6_type a6, _nil, _nil)
+		{
+			(pobject->*pmemfun)(a1, a2, a3, a4, a5, a6);
+		}
 	};
 
-	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type, class mt_policy>
-	class _connection_base4
+	template<class dest_type, class arg1_type, class arg2_type,
+	class arg3_type, class arg4_type, class arg5_type>
+	struct _memfun<dest_type, arg1_type, arg2_type, arg3_type, arg4_type,
+		arg5_type, _nil, _nil, _nil>
 	{
-	public:
-		virtual ~_connection_base4() {}
-		virtual has_slots<mt_policy>* getdest() const = 0;
-		virtual void emit(arg1_type, arg2_type, arg3_type, arg4_type) = 0;
-		virtual _connection_base4<arg1_type, arg2_type, arg3_type, arg4_type, mt_policy>* clone() = 0;
-		virtual _connection_base4<arg1_type, arg2_type, arg3_type, arg4_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest) = 0;
+		typedef void (dest_type::*type)(arg1_type, arg2_type, arg3_type,
+			arg4_type, arg5_type);
+		static void call(dest_type* pobject, type pmemfun, arg1_type a1,
+			arg2_type a2, arg3_type a3, arg4_type a4, arg5_type a5,
+			_nil, _nil, _nil)
+		{
+			(pobject->*pmemfun)(a1, a2, a3, a4, a5);
+		}
 	};
 
-	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type,
-	class arg5_type, class mt_policy>
-	class _connection_base5
+	template<class dest_type, class arg1_type, class arg2_type,
+	class arg3_type, class arg4_type>
+	struct _memfun<dest_type, arg1_type, arg2_type, arg3_type, arg4_type,
+		_nil, _nil, _nil, _nil>
 	{
-	public:
-		virtual ~_connection_base5() {}
-		virtual has_slots<mt_policy>* getdest() const = 0;
-		virtual void emit(arg1_type, arg2_type, arg3_type, arg4_type, 
-			arg5_type) = 0;
-		virtual _connection_base5<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, mt_policy>* clone() = 0;
-		virtual _connection_base5<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest) = 0;
+		typedef void (dest_type::*type)(arg1_type, arg2_type, arg3_type,
+			arg4_type);
+		static void call(dest_type* pobject, type pmemfun, arg1_type a1,
+			arg2_type a2, arg3_type a3, arg4_type a4, _nil, _nil, _nil, _nil)
+		{
+			(pobject->*pmemfun)(a1, a2, a3, a4);
+		}
 	};
 
-	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type,
-	class arg5_type, class arg6_type, class mt_policy>
-	class _connection_base6
+	template<class dest_type, class arg1_type, class arg2_type,
+	class arg3_type>
+	struct _memfun<dest_type, arg1_type, arg2_type, arg3_type, _nil, _nil,
+		_nil, _nil, _nil>
 	{
-	public:
-		virtual ~_connection_base6() {}
-		virtual has_slots<mt_policy>* getdest() const = 0;
-		virtual void emit(arg1_type, arg2_type, arg3_type, arg4_type, arg5_type,
-			arg6_type) = 0;
-		virtual _connection_base6<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, mt_policy>* clone() = 0;
-		virtual _connection_base6<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest) = 0;
+		typedef void (dest_type::*type)(arg1_type, arg2_type, arg3_type);
+		static void call(dest_type* pobject, type pmemfun, arg1_type a1,
+			arg2_type a2, arg3_type a3, _nil, _nil, _nil, _nil, _nil)
+		{
+			(pobject->*pmemfun)(a1, a2, a3);
+		}
 	};
 
-	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type,
-	class arg5_type, class arg6_type, class arg7_type, class mt_policy>
-	class _connection_base7
+	template<class dest_type, class arg1_type, class arg2_type>
+	struct _memfun<dest_type, arg1_type, arg2_type, _nil, _nil, _nil, _nil,
+		_nil, _nil>
 	{
-	public:
-		virtual ~_connection_base7() {}
-		virtual has_slots<mt_policy>* getdest() const = 0;
-		virtual void emit(arg1_type, arg2_type, arg3_type, arg4_type, arg5_type,
-			arg6_type, arg7_type) = 0;
-		virtual _connection_base7<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, arg7_type, mt_policy>* clone() = 0;
-		virtual _connection_base7<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, arg7_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest) = 0;
+		typedef void (dest_type::*type)(arg1_type, arg2_type);
+		static void call(dest_type* pobject, type pmemfun, arg1_type a1,
+			arg2_type a2, _nil, _nil, _nil, _nil, _nil, _nil)
+		{
+			(pobject->*pmemfun)(a1, a2);
+		}
 	};
 
-	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type,
-	class arg5_type, class arg6_type, class arg7_type, class arg8_type, class mt_policy>
-	class _connection_base8
+	template<class dest_type, class arg1_type>
+	struct _memfun<dest_type, arg1_type, _nil, _nil, _nil, _nil, _nil, _nil,
+		_nil>
 	{
-	public:
-		virtual ~_connection_base8() {}
-		virtual has_slots<mt_policy>* getdest() const = 0;
-		virtual void emit(arg1_type, arg2_type, arg3_type, arg4_type, arg5_type,
-			arg6_type, arg7_type, arg8_type) = 0;
-		virtual _connection_base8<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, arg7_type, arg8_type, mt_policy>* clone() = 0;
-		virtual _connection_base8<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, arg7_type, arg8_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest) = 0;
+		typedef void (dest_type::*type)(arg1_type);
+		static void call(dest_type* pobject, type pmemfun, arg1_type a1,
+			_nil, _nil, _nil, _nil, _nil, _nil, _nil)
+		{
+			(pobject->*pmemfun)(a1);
+		}
 	};
 
-	template<class mt_policy>
-	class _signal_base : public mt_policy
+	template<class dest_type>
+	struct _memfun<dest_type, _nil, _nil, _nil, _nil, _nil, _nil, _nil, _nil>
 	{
-	public:
-		virtual void slot_disconnect(has_slots<mt_policy>* pslot) = 0;
-		virtual void slot_duplicate(const has_slots<mt_policy>* poldslot, has_slots<mt_policy>* pnewslot) = 0;
+		typedef void (dest_type::*type)();
+		static void call(dest_type* pobject, type pmemfun, _nil, _nil, _nil,
+			_nil, _nil, _nil, _nil, _nil)
+		{
+			(pobject->*pmemfun)();
+		}
 	};
 
-	template<class mt_policy = SIGSLOT_DEFAULT_MT_POLICY>
-	class has_slots : public mt_policy 
+	// A connection, as its signal base manages it without knowing the
+	// arguments.
+	template<class mt_policy>
+	class _connection_base
 	{
+	public:
+		virtual ~_connection_base() {}
+
+		has_slots<mt_policy>* getdest() const
+		{
+			return m_pdest;
+		}
+
+		virtual _connection_base* clone() const = 0;
+		virtual _connection_base* duplicate(has_slots<mt_policy>* pnewdest) const = 0;
+
+		// Set once disconnected, for emissions that still hold the connection.
+		volatile bool m_dead;
+
+	protected:
+		explicit _connection_base(has_slots<mt_policy>* pdest)
+			: m_dead(false), m_pdest(pdest)
+		{
+			;
+		}
+
 	private:
-		typedef typename std::set<_signal_base<mt_policy> *> sender_set;
-		typedef typename sender_set::const_iterator const_iterator;
+		has_slots<mt_policy>* m_pdest;
+	};
 
+	// A connection as emit sees it. The slot is called through a plain
+	// function pointer set by _connection, rather than a virtual function.
+	template<class mt_policy, class arg1_type, class arg2_type,
+	class arg3_type, class arg4_type, class arg5_type, class arg6_type,
+	class arg7_type, class arg8_type>
+	class _connection_args : public _connection_base<mt_policy>
+	{
 	public:
-		has_slots()
+		typedef void (*caller)(const _connection_args*, arg1_type, arg2_type,
+			arg3_type, arg4_type, arg5_type, arg6_type, arg7_type, arg8_type);
+
+		// Only the overload of the signal's arity is ever instantiated.
+		void emit() const
 		{
-			;
+			m_caller(this, _nil(), _nil(), _nil(), _nil(), _nil(), _nil(),
+				_nil(), _nil());
 		}
 
-		has_slots(const has_slots& hs)
-			: mt_policy(hs)
+		void emit(arg1_type a1) const
 		{
-			lock_block<mt_policy> lock(this);
-			const_iterator it = hs.m_senders.begin();
-			const_iterator itEnd = hs.m_senders.end();
+			m_caller(this, a1, _nil(), _nil(), _nil(), _nil(), _nil(), _nil(),
+				_nil());
+		}
 
-			while(it != itEnd)
-			{
-				(*it)->slot_duplicate(&hs, this);
-				m_senders.insert(*it);
-				++it;
-			}
-		} 
+		void emit(arg1_type a1, arg2_type a2) const
+		{
+			m_caller(this, a1, a2, _nil(), _nil(), _nil(), _nil(), _nil(),
+				_nil());
+		}
 
-		void signal_connect(_signal_base<mt_policy>* sender)
+		void emit(arg1_type a1, arg2_type a2, arg3_type a3) const
 		{
-			lock_block<mt_policy> lock(this);
-			m_senders.insert(sender);
+			m_caller(this, a1, a2, a3, _nil(), _nil(), _nil(), _nil(), _nil());
 		}
 
-		void signal_disconnect(_signal_base<mt_policy>* sender)
+		void emit(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4) const
 		{
-			lock_block<mt_policy> lock(this);
-			m_senders.erase(sender);
+			m_caller(this, a1, a2, a3, a4, _nil(), _nil(), _nil(), _nil());
 		}
 
-		virtual ~has_slots()
+		void emit(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
+			arg5_type a5) const
 		{
-			disconnect_all();
+			m_caller(this, a1, a2, a3, a4, a5, _nil(), _nil(), _nil());
 		}
 
-		void disconnect_all()
+		void emit(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
+			arg5_type a5, arg6_type a6) const
 		{
-			lock_block<mt_policy> lock(this);
-			const_iterator it = m_senders.begin();
-			const_iterator itEnd = m_senders.end();
+			m_caller(this, a1, a2, a3, a4, a5, a6, _nil(), _nil());
+		}
 
-			while(it != itEnd)
-			{
-				(*it)->slot_disconnect(this);
-				++it;
-			}
+		void emit(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
+			arg5_type a5, arg6_type a6, arg7_type a7) const
+		{
+			m_caller(this, a1, a2, a3, a4, a5, a6, a7, _nil());
+		}
 
-			m_senders.erase(m_senders.begin(), m_senders.end());
+		void emit(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
+			arg5_type a5, arg6_type a6, arg7_type a7, arg8_type a8) const
+		{
+			m_caller(this, a1, a2, a3, a4, a5, a6, a7, a8);
+		}
+
+	protected:
+		_connection_args(has_slots<mt_policy>* pdest, caller pcaller)
+			: _connection_base<mt_policy>(pdest), m_caller(pcaller)
+		{
+			;
 		}
 
 	private:
-		sender_set m_senders;
+		caller m_caller;
 	};
 
-	template<class mt_policy>
-	class _signal_base0 : public _signal_base<mt_policy>
+	template<class dest_type, class mt_policy, class arg1_type,
+	class arg2_type, class arg3_type, class arg4_type, class arg5_type,
+	class arg6_type, class arg7_type, class arg8_type>
+	class _connection : public _connection_args<mt_policy, arg1_type,
+		arg2_type, arg3_type, arg4_type, arg5_type, arg6_type, arg7_type,
+		arg8_type>
 	{
 	public:
-		typedef std::list<_connection_base0<mt_policy> *>  connections_list;
+		typedef _connection_args<mt_policy, arg1_type, arg2_type, arg3_type,
+			arg4_type, arg5_type, arg6_type, arg7_type, arg8_type> base;
+		typedef _memfun<dest_type, arg1_type, arg2_type, arg3_type,
+			arg4_type, arg5_type, arg6_type, arg7_type, arg8_type> memfun;
 
-		_signal_base0()
+		_connection(dest_type* pobject, typename memfun::type pmemfun)
+			: base(pobject, &call), m_pobject(pobject), m_pmemfun(pmemfun)
 		{
 			;
 		}
 
-		_signal_base0(const _signal_base0& s)
-			: _signal_base<mt_policy>(s)
+		virtual _connection_base<mt_policy>* clone() const
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = s.m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = s.m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				(*it)->getdest()->signal_connect(this);
-				m_connected_slots.push_back((*it)->clone());
-
-				++it;
-			}
+			return new _connection(*this);
 		}
 
-		~_signal_base0()
+		virtual _connection_base<mt_policy>* duplicate(has_slots<mt_policy>* pnewdest) const
 		{
-			disconnect_all();
+			return new _connection(static_cast<dest_type*>(pnewdest), m_pmemfun);
 		}
 
-		bool is_empty()
+	private:
+		static void call(const base* conn, arg1_type a1, arg2_type a2,
+			arg3_type a3, arg4_type a4, arg5_type a5, arg6_type a6,
+			arg7_type a7, arg8_type a8)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			return it == itEnd;
+			const _connection* self = static_cast<const _connection*>(conn);
+			memfun::call(self->m_pobject, self->m_pmemfun, a1, a2, a3, a4, a5,
+				a6, a7, a8);
 		}
 
-		void disconnect_all()
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
+		dest_type* m_pobject;
+		typename memfun::type m_pmemfun;
+	};
 
-			while(it != itEnd)
-			{
-				(*it)->getdest()->signal_disconnect(this);
-				delete *it;
+	// A vector of connections that keeps the first few inline, as most
+	// signals only ever have one or two.
+	template<class mt_policy>
+	class _connection_vector
+	{
+	public:
+		typedef _connection_base<mt_policy>* value_type;
+		typedef value_type const* const_iterator;
 
-				++it;
-			}
+		_connection_vector()
+			: m_data(m_inline), m_size(0), m_capacity(kInline)
+		{
+			;
+		}
 
-			m_connected_slots.erase(m_connected_slots.begin(), m_connected_slots.end());
+		~_connection_vector()
+		{
+			if(m_data != m_inline)
+				delete [] m_data;
 		}
 
-#ifdef _DEBUG
-			bool connected(has_slots<mt_policy>* pclass)
+		size_t size() const
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-				if ((*it)->getdest() == pclass)
-					return true;
-				it = itNext;
-			}
-			return false;
+			return m_size;
 		}
-#endif
 
-		void disconnect(has_slots<mt_policy>* pclass)
+		bool empty() const
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
+			return m_size == 0;
+		}
 
-			while(it != itEnd)
-			{
-				if((*it)->getdest() == pclass)
-				{
-					delete *it;
-					m_connected_slots.erase(it);
-					pclass->signal_disconnect(this);
-					return;
-				}
+		value_type operator[](size_t i) const
+		{
+			return m_data[i];
+		}
 
-				++it;
-			}
+		const_iterator begin() const
+		{
+			return m_data;
 		}
 
-		void slot_disconnect(has_slots<mt_policy>* pslot)
+		const_iterator end() const
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
+			return m_data + m_size;
+		}
 
-			while(it != itEnd)
+		void push_back(value_type conn)
+		{
+			if(m_size == m_capacity)
 			{
-				typename connections_list::iterator itNext = it;
-				++itNext;
-
-				if((*it)->getdest() == pslot)
-				{
-					delete *it;
-					m_connected_slots.erase(it);
-				}
-
-				it = itNext;
+				value_type* data = new value_type[m_capacity * 2];
+				for(size_t i = 0; i < m_size; ++i)
+					data[i] = m_data[i];
+				if(m_data != m_inline)
+					delete [] m_data;
+				m_data = data;
+				m_capacity *= 2;
 			}
+			m_data[m_size++] = conn;
 		}
 
-		void slot_duplicate(const has_slots<mt_policy>* oldtarget, has_slots<mt_policy>* newtarget)
+		// Keeps the order, which is the order slots are called in.
+		void erase(size_t i)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				if((*it)->getdest() == oldtarget)
-				{
-					m_connected_slots.push_back((*it)->duplicate(newtarget));
-				}
+			for(--m_size; i < m_size; ++i)
+				m_data[i] = m_data[i + 1];
+		}
 
-				++it;
-			}
+		void clear()
+		{
+			m_size = 0;
 		}
 
-	protected:
-		connections_list m_connected_slots;   
+	private:
+		enum { kInline = 2 };
+
+		value_type m_inline[kInline];
+		value_type* m_data;
+		size_t m_size;
+		size_t m_capacity;
+
+		_connection_vector(const _connection_vector&);
+		void operator=(const _connection_vector&);
 	};
 
-	template<class arg1_type, class mt_policy>
-	class _signal_base1 : public _signal_base<mt_policy>
+	// How a signal stores its connections and walks them for emit. With the
+	// locking policies, an emission holds the lock, and connections removed
+	// meanwhile are only marked dead until the outermost emission is done.
+	template<class mt_policy>
+	class _signal_storage : public mt_policy
 	{
 	public:
-		typedef std::list<_connection_base1<arg1_type, mt_policy> *>  connections_list;
-
-		_signal_base1()
-		{
-			;
-		}
-
-		_signal_base1(const _signal_base1<arg1_type, mt_policy>& s)
-			: _signal_base<mt_policy>(s)
+		class emitter
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = s.m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = s.m_connected_slots.end();
-
-			while(it != itEnd)
+		public:
+			explicit emitter(_signal_storage* signal)
+				: m_lock(signal), m_signal(signal), m_index(0),
+				  m_end(signal->m_connected_slots.size())
 			{
-				(*it)->getdest()->signal_connect(this);
-				m_connected_slots.push_back((*it)->clone());
-
-				++it;
+				++m_signal->m_emitting;
 			}
-		}
 
-		void slot_duplicate(const has_slots<mt_policy>* oldtarget, has_slots<mt_policy>* newtarget)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
+			~emitter()
+			{
+				if(--m_signal->m_emitting == 0 && m_signal->m_has_dead)
+					m_signal->compact();
+			}
 
-			while(it != itEnd)
+			_connection_base<mt_policy>* next()
 			{
-				if((*it)->getdest() == oldtarget)
+				// Connections made by the slots are only called from the
+				// next emission, as with a snapshot. Nothing is erased while
+				// emitting, so the first m_end are the ones there were.
+				while(m_index < m_end)
 				{
-					m_connected_slots.push_back((*it)->duplicate(newtarget));
+					_connection_base<mt_policy>* conn =
+						m_signal->m_connected_slots[m_index++];
+					if(!conn->m_dead)
+						return conn;
 				}
-
-				++it;
+				return NULL;
 			}
-		}
 
-		~_signal_base1()
+		private:
+			lock_block<mt_policy> m_lock;
+			_signal_storage* m_signal;
+			size_t m_index;
+			size_t m_end;
+		};
+
+		_signal_storage()
+			: m_emitting(0), m_has_dead(false)
 		{
-			disconnect_all();
+			;
 		}
 
-		bool is_empty()
+		_signal_storage(const _signal_storage& s)
+			: mt_policy(s), m_emitting(0), m_has_dead(false)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			return it == itEnd;
+			;
 		}
 
-		void disconnect_all()
+	protected:
+		void remove_connection(size_t i)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
+			_connection_base<mt_policy>* conn = m_connected_slots[i];
+			if(m_emitting)
 			{
-				(*it)->getdest()->signal_disconnect(this);
-				delete *it;
-
-				++it;
+				conn->m_dead = true;
+				m_has_dead = true;
+			}
+			else
+			{
+				m_connected_slots.erase(i);
+				delete conn;
 			}
+		}
 
-			m_connected_slots.erase(m_connected_slots.begin(), m_connected_slots.end());
+		void connections_changed()
+		{
+			;
 		}
 
-#ifdef _DEBUG
-			bool connected(has_slots<mt_policy>* pclass)
+		// Called with the lock held, after connections were removed, for
+		// wait_for_emitters to be given once it is released. Emissions hold
+		// the lock here, so there is nothing to wait for.
+		int retire_epoch()
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-				if ((*it)->getdest() == pclass)
-					return true;
-				it = itNext;
-			}
-			return false;
+			return -1;
 		}
-#endif
 
-		void disconnect(has_slots<mt_policy>* pclass)
+		void wait_for_emitters(int)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
+			;
+		}
 
-			while(it != itEnd)
-			{
-				if((*it)->getdest() == pclass)
-				{
-					delete *it;
-					m_connected_slots.erase(it);
-					pclass->signal_disconnect(this);
-					return;
-				}
-
-				++it;
-			}
-		}
+		_connection_vector<mt_policy> m_connected_slots;
 
-		void slot_disconnect(has_slots<mt_policy>* pslot)
+	private:
+		void compact()
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
+			size_t i = 0;
+			while(i < m_connected_slots.size())
 			{
-				typename connections_list::iterator itNext = it;
-				++itNext;
-
-				if((*it)->getdest() == pslot)
+				_connection_base<mt_policy>* conn = m_connected_slots[i];
+				if(conn->m_dead)
 				{
-					delete *it;
-					m_connected_slots.erase(it);
+					m_connected_slots.erase(i);
+					delete conn;
+				}
+				else
+				{
+					++i;
 				}
-
-				it = itNext;
 			}
+			m_has_dead = false;
 		}
 
+		int m_emitting;
+		bool m_has_dead;
+	};
 
-	protected:
-		connections_list m_connected_slots;   
+	// The multi_threaded_cow emissions under way on the calling thread,
+	// innermost first, so that a disconnect made by a slot does not wait for
+	// emissions of the signal it is called from.
+	struct _cow_emission
+	{
+		const void* signal;
+		int parity;
+		_cow_emission* next;
 	};
 
-	template<class arg1_type, class arg2_type, class mt_policy>
-	class _signal_base2 : public _signal_base<mt_policy>
+	inline _cow_emission*& _cow_emissions()
+	{
+#ifdef WIN32
+		static __declspec(thread) _cow_emission* head = NULL;
+#else
+		static __thread _cow_emission* head = NULL;
+#endif
+		return head;
+	}
+
+	// With multi_threaded_cow, an emission walks an immutable snapshot of the
+	// connections without the lock. Connections and snapshots that are
+	// replaced are retired, and freed once no emission is under way.
+	//
+	// Emissions count themselves under the parity of an epoch, which each
+	// disconnect advances once the snapshot without the connection is in
+	// place. Emissions that start after that count under the new parity and
+	// can only find the new snapshot, so the disconnect only waits for the
+	// count under the old one to drain.
+	template<>
+	class _signal_storage<multi_threaded_cow> : public multi_threaded_cow
 	{
 	public:
-		typedef std::list<_connection_base2<arg1_type, arg2_type, mt_policy> *>
-			connections_list;
-
-		_signal_base2()
+		struct snapshot
 		{
-			;
-		}
+			std::vector<_connection_base<multi_threaded_cow>*> connections;
+			snapshot* next;
+		};
 
-		_signal_base2(const _signal_base2<arg1_type, arg2_type, mt_policy>& s)
-			: _signal_base<mt_policy>(s)
+		class emitter
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = s.m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = s.m_connected_slots.end();
-
-			while(it != itEnd)
+		public:
+			explicit emitter(_signal_storage* signal)
+				: m_signal(signal), m_snapshot(signal->begin_emit(&m_emission)),
+				  m_index(0)
 			{
-				(*it)->getdest()->signal_connect(this);
-				m_connected_slots.push_back((*it)->clone());
-
-				++it;
+				;
 			}
-		}
 
-		void slot_duplicate(const has_slots<mt_policy>* oldtarget, has_slots<mt_policy>* newtarget)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
+			~emitter()
+			{
+				m_signal->end_emit(&m_emission);
+			}
 
-			while(it != itEnd)
+			_connection_base<multi_threaded_cow>* next()
 			{
-				if((*it)->getdest() == oldtarget)
+				if(!m_snapshot)
+					return NULL;
+				while(m_index < m_snapshot->connections.size())
 				{
-					m_connected_slots.push_back((*it)->duplicate(newtarget));
+					_connection_base<multi_threaded_cow>* conn =
+						m_snapshot->connections[m_index++];
+					if(!conn->m_dead)
+						return conn;
 				}
-
-				++it;
+				return NULL;
 			}
+
+		private:
+			_cow_emission m_emission;
+			_signal_storage* m_signal;
+			snapshot* m_snapshot;
+			size_t m_index;
+		};
+
+		_signal_storage()
+			: m_snapshot(NULL), m_epoch(0), m_garbage(0), m_removed(false),
+			  m_retired_snapshots(NULL)
+		{
+			m_emitting[0] = m_emitting[1] = 0;
 		}
 
-		~_signal_base2()
+		_signal_storage(const _signal_storage& s)
+			: multi_threaded_cow(s), m_snapshot(NULL), m_epoch(0),
+			  m_garbage(0), m_removed(false), m_retired_snapshots(NULL)
 		{
-			disconnect_all();
+			m_emitting[0] = m_emitting[1] = 0;
 		}
 
-		bool is_empty()
+		~_signal_storage()
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			return it == itEnd;
+			delete m_snapshot;
+			reclaim();
 		}
 
-		void disconnect_all()
+	protected:
+		void remove_connection(size_t i)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
+			_connection_base<multi_threaded_cow>* conn = m_connected_slots[i];
+			conn->m_dead = true;
+			m_connected_slots.erase(i);
+			m_retired_connections.push_back(conn);
+			m_garbage = 1;
+			m_removed = true;
+		}
 
-			while(it != itEnd)
+		void connections_changed()
+		{
+			snapshot* s = NULL;
+			if(!m_connected_slots.empty())
 			{
-				(*it)->getdest()->signal_disconnect(this);
-				delete *it;
-
-				++it;
+				s = new snapshot;
+				s->connections.assign(m_connected_slots.begin(),
+					m_connected_slots.end());
+			}
+			snapshot* old = AtomicOps::ExchangePtr(&m_snapshot, s);
+			if(old)
+			{
+				old->next = m_retired_snapshots;
+				m_retired_snapshots = old;
+				m_garbage = 1;
 			}
+			reclaim();
+		}
 
-			m_connected_slots.erase(m_connected_slots.begin(), m_connected_slots.end());
+		// Advances the epoch if connections were removed, and returns the
+		// parity the emissions that may still call them count under.
+		int retire_epoch()
+		{
+			if(!m_removed)
+				return -1;
+			m_removed = false;
+			return (AtomicOps::Increment(&m_epoch) - 1) & 1;
 		}
 
-#ifdef _DEBUG
-			bool connected(has_slots<mt_policy>* pclass)
+		void wait_for_emitters(int parity)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			while(it != itEnd)
+			if(parity < 0)
+				return;
+			// Within an emission of this signal, another thread's emission
+			// may be waiting for this one in turn.
+			for(_cow_emission* e = _cow_emissions(); e; e = e->next)
 			{
-				itNext = it;
-				++itNext;
-				if ((*it)->getdest() == pclass)
-					return true;
-				it = itNext;
+				if(e->signal == this)
+					return;
 			}
-			return false;
-		}
+			while(AtomicOps::AcquireLoad(&m_emitting[parity]) != 0)
+			{
+#ifdef WIN32
+				SwitchToThread();
+#else
+				sched_yield();
 #endif
+			}
+		}
 
-		void disconnect(has_slots<mt_policy>* pclass)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
+		_connection_vector<multi_threaded_cow> m_connected_slots;
 
-			while(it != itEnd)
+	private:
+		snapshot* begin_emit(_cow_emission* emission)
+		{
+			// Counts under the epoch's parity, checking that the epoch did
+			// not advance before the count could be seen.
+			while(true)
 			{
-				if((*it)->getdest() == pclass)
+				int epoch = AtomicOps::AcquireLoad(&m_epoch);
+				AtomicOps::Increment(&m_emitting[epoch & 1]);
+				if(AtomicOps::AcquireLoad(&m_epoch) == epoch)
 				{
-					delete *it;
-					m_connected_slots.erase(it);
-					pclass->signal_disconnect(this);
-					return;
+					emission->parity = epoch & 1;
+					break;
 				}
-
-				++it;
+				AtomicOps::Decrement(&m_emitting[epoch & 1]);
 			}
+			emission->signal = this;
+			emission->next = _cow_emissions();
+			_cow_emissions() = emission;
+			return AtomicOps::AcquireLoadPtr(&m_snapshot);
 		}
 
-		void slot_disconnect(has_slots<mt_policy>* pslot)
+		void end_emit(_cow_emission* emission)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
+			_cow_emissions() = emission->next;
+			if(AtomicOps::Decrement(&m_emitting[emission->parity]) == 0 &&
+			   AtomicOps::AcquireLoad(&m_garbage))
 			{
-				typename connections_list::iterator itNext = it;
-				++itNext;
-
-				if((*it)->getdest() == pslot)
-				{
-					delete *it;
-					m_connected_slots.erase(it);
-				}
+				lock_block<multi_threaded_cow> lock(this);
+				reclaim();
+			}
+		}
 
-				it = itNext;
+		// Frees what was retired, unless an emission may still be using it.
+		// An emission counts itself before loading the snapshot, so once the
+		// counts are seen at zero, later ones only find the current one.
+		void reclaim()
+		{
+			if(AtomicOps::AcquireLoad(&m_emitting[0]) != 0 ||
+			   AtomicOps::AcquireLoad(&m_emitting[1]) != 0)
+				return;
+			while(snapshot* s = m_retired_snapshots)
+			{
+				m_retired_snapshots = s->next;
+				delete s;
 			}
+			for(size_t i = 0; i < m_retired_connections.size(); ++i)
+				delete m_retired_connections[i];
+			m_retired_connections.clear();
+			m_garbage = 0;
 		}
 
-	protected:
-		connections_list m_connected_slots;   
+		snapshot* volatile m_snapshot;
+		volatile int m_epoch;
+		volatile int m_emitting[2];
+		volatile int m_garbage;
+		bool m_removed;
+		snapshot* m_retired_snapshots;
+		std::vector<_connection_base<multi_threaded_cow>*> m_retired_connections;
 	};
 
-	template<class arg1_type, class arg2_type, class arg3_type, class mt_policy>
-	class _signal_base3 : public _signal_base<mt_policy>
+	template<class mt_policy = SIGSLOT_DEFAULT_MT_POLICY>
+	class has_slots : public mt_policy
 	{
-	public:
-		typedef std::list<_connection_base3<arg1_type, arg2_type, arg3_type, mt_policy> *>
-			connections_list;
+	private:
+		typedef typename std::set<_signal_base<mt_policy> *> sender_set;
+		typedef typename sender_set::const_iterator const_iterator;
 
-		_signal_base3()
+	public:
+		has_slots()
 		{
 			;
 		}
 
-		_signal_base3(const _signal_base3<arg1_type, arg2_type, arg3_type, mt_policy>& s)
-			: _signal_base<mt_policy>(s)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = s.m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = s.m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				(*it)->getdest()->signal_connect(this);
-				m_connected_slots.push_back((*it)->clone());
-
-				++it;
-			}
-		}
-
-		void slot_duplicate(const has_slots<mt_policy>* oldtarget, has_slots<mt_policy>* newtarget)
+		has_slots(const has_slots& hs)
+			: mt_policy(hs)
 		{
 			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
+			const_iterator it = hs.m_senders.begin();
+			const_iterator itEnd = hs.m_senders.end();
 
 			while(it != itEnd)
 			{
-				if((*it)->getdest() == oldtarget)
-				{
-					m_connected_slots.push_back((*it)->duplicate(newtarget));
-				}
-
+				(*it)->slot_duplicate(&hs, this);
+				m_senders.insert(*it);
 				++it;
 			}
 		}
 
-		~_signal_base3()
-		{
-			disconnect_all();
-		}
-
-		bool is_empty()
+		void signal_connect(_signal_base<mt_policy>* sender)
 		{
 			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			return it == itEnd;
+			m_senders.insert(sender);
 		}
 
-		void disconnect_all()
+		void signal_disconnect(_signal_base<mt_policy>* sender)
 		{
 			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				(*it)->getdest()->signal_disconnect(this);
-				delete *it;
-
-				++it;
-			}
-
-			m_connected_slots.erase(m_connected_slots.begin(), m_connected_slots.end());
+			m_senders.erase(sender);
 		}
 
-#ifdef _DEBUG
-			bool connected(has_slots<mt_policy>* pclass)
+		virtual ~has_slots()
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-				if ((*it)->getdest() == pclass)
-					return true;
-				it = itNext;
-			}
-			return false;
+			disconnect_all();
 		}
-#endif
 
-		void disconnect(has_slots<mt_policy>* pclass)
+		void disconnect_all()
 		{
 			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
+			const_iterator it = m_senders.begin();
+			const_iterator itEnd = m_senders.end();
 
 			while(it != itEnd)
 			{
-				if((*it)->getdest() == pclass)
-				{
-					delete *it;
-					m_connected_slots.erase(it);
-					pclass->signal_disconnect(this);
-					return;
-				}
-
+				(*it)->slot_disconnect(this);
 				++it;
 			}
-		}
-
-		void slot_disconnect(has_slots<mt_policy>* pslot)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				typename connections_list::iterator itNext = it;
-				++itNext;
 
-				if((*it)->getdest() == pslot)
-				{
-					delete *it;
-					m_connected_slots.erase(it);
-				}
-
-				it = itNext;
-			}
+			m_senders.erase(m_senders.begin(), m_senders.end());
 		}
 
-	protected:
-		connections_list m_connected_slots;   
+	private:
+		sender_set m_senders;
 	};
 
-	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type, class mt_policy>
-	class _signal_base4 : public _signal_base<mt_policy>
+	// Everything about a signal that does not depend on its arguments.
+	template<class mt_policy>
+	class _signal_base : public _signal_storage<mt_policy>
 	{
 	public:
-		typedef std::list<_connection_base4<arg1_type, arg2_type, arg3_type,
-			arg4_type, mt_policy> *>  connections_list;
+		using _signal_storage<mt_policy>::m_connected_slots;
 
-		_signal_base4()
+		_signal_base()
 		{
 			;
 		}
 
-		_signal_base4(const _signal_base4<arg1_type, arg2_type, arg3_type, arg4_type, mt_policy>& s)
-			: _signal_base<mt_policy>(s)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = s.m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = s.m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				(*it)->getdest()->signal_connect(this);
-				m_connected_slots.push_back((*it)->clone());
-
-				++it;
-			}
-		}
-
-		void slot_duplicate(const has_slots<mt_policy>* oldtarget, has_slots<mt_policy>* newtarget)
+		_signal_base(const _signal_base& s)
+			: _signal_storage<mt_policy>(s)
 		{
 			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
+			for(size_t i = 0; i < s.m_connected_slots.size(); ++i)
 			{
-				if((*it)->getdest() == oldtarget)
-				{
-					m_connected_slots.push_back((*it)->duplicate(newtarget));
-				}
-
-				++it;
+				_connection_base<mt_policy>* conn = s.m_connected_slots[i];
+				if(conn->m_dead)
+					continue;
+				conn->getdest()->signal_connect(this);
+				m_connected_slots.push_back(conn->clone());
 			}
+			this->connections_changed();
 		}
 
-		~_signal_base4()
+		~_signal_base()
 		{
 			disconnect_all();
 		}
@@ -1096,41 +1163,43 @@ namespace txmpp {
 		bool is_empty()
 		{
 			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			return it == itEnd;
+			for(size_t i = 0; i < m_connected_slots.size(); ++i)
+			{
+				if(!m_connected_slots[i]->m_dead)
+					return false;
+			}
+			return true;
 		}
 
 		void disconnect_all()
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
+			int epoch;
 			{
-				(*it)->getdest()->signal_disconnect(this);
-				delete *it;
-
-				++it;
+				lock_block<mt_policy> lock(this);
+				size_t i = m_connected_slots.size();
+				while(i-- > 0)
+				{
+					_connection_base<mt_policy>* conn = m_connected_slots[i];
+					if(conn->m_dead)
+						continue;
+					conn->getdest()->signal_disconnect(this);
+					this->remove_connection(i);
+				}
+				this->connections_changed();
+				epoch = this->retire_epoch();
 			}
-
-			m_connected_slots.erase(m_connected_slots.begin(), m_connected_slots.end());
+			this->wait_for_emitters(epoch);
 		}
 
 #ifdef _DEBUG
-			bool connected(has_slots<mt_policy>* pclass)
+		bool connected(has_slots<mt_policy>* pclass)
 		{
 			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			while(it != itEnd)
+			for(size_t i = 0; i < m_connected_slots.size(); ++i)
 			{
-				itNext = it;
-				++itNext;
-				if ((*it)->getdest() == pclass)
+				_connection_base<mt_policy>* conn = m_connected_slots[i];
+				if(!conn->m_dead && conn->getdest() == pclass)
 					return true;
-				it = itNext;
 			}
 			return false;
 		}
@@ -1138,1681 +1207,299 @@ namespace txmpp {
 
 		void disconnect(has_slots<mt_policy>* pclass)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
+			int epoch = -1;
 			{
-				if((*it)->getdest() == pclass)
+				lock_block<mt_policy> lock(this);
+				for(size_t i = 0; i < m_connected_slots.size(); ++i)
 				{
-					delete *it;
-					m_connected_slots.erase(it);
-					pclass->signal_disconnect(this);
-					return;
+					_connection_base<mt_policy>* conn = m_connected_slots[i];
+					if(!conn->m_dead && conn->getdest() == pclass)
+					{
+						this->remove_connection(i);
+						this->connections_changed();
+						pclass->signal_disconnect(this);
+						epoch = this->retire_epoch();
+						break;
+					}
 				}
-
-				++it;
 			}
+			this->wait_for_emitters(epoch);
 		}
 
 		void slot_disconnect(has_slots<mt_policy>* pslot)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
+			int epoch;
 			{
-				typename connections_list::iterator itNext = it;
-				++itNext;
-
-				if((*it)->getdest() == pslot)
+				lock_block<mt_policy> lock(this);
+				size_t i = m_connected_slots.size();
+				while(i-- > 0)
 				{
-					delete *it;
-					m_connected_slots.erase(it);
+					_connection_base<mt_policy>* conn = m_connected_slots[i];
+					if(!conn->m_dead && conn->getdest() == pslot)
+						this->remove_connection(i);
 				}
+				this->connections_changed();
+				epoch = this->retire_epoch();
+			}
+			this->wait_for_emitters(epoch);
+		}
 
-				it = itNext;
+		void slot_duplicate(const has_slots<mt_policy>* oldtarget, has_slots<mt_policy>* newtarget)
+		{
+			lock_block<mt_policy> lock(this);
+			size_t count = m_connected_slots.size();
+			for(size_t i = 0; i < count; ++i)
+			{
+				_connection_base<mt_policy>* conn = m_connected_slots[i];
+				if(!conn->m_dead && conn->getdest() == oldtarget)
+					m_connected_slots.push_back(conn->duplicate(newtarget));
 			}
+			this->connections_changed();
 		}
 
 	protected:
-		connections_list m_connected_slots;   
+		void add_connection(_connection_base<mt_policy>* conn)
+		{
+			lock_block<mt_policy> lock(this);
+			m_connected_slots.push_back(conn);
+			this->connections_changed();
+			conn->getdest()->signal_connect(this);
+		}
 	};
 
-	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type,
-	class arg5_type, class mt_policy>
-	class _signal_base5 : public _signal_base<mt_policy>
+	// The implementation behind signal0 to signal8, with _nil for the
+	// arguments a signal does not have.
+	template<class mt_policy, class arg1_type = _nil, class arg2_type = _nil,
+	class arg3_type = _nil, class arg4_type = _nil, class arg5_type = _nil,
+	class arg6_type = _nil, class arg7_type = _nil, class arg8_type = _nil>
+	class _signal : public _signal_base<mt_policy>
 	{
 	public:
-		typedef std::list<_connection_base5<arg1_type, arg2_type, arg3_type,
-			arg4_type, arg5_type, mt_policy> *>  connections_list;
+		typedef _connection_args<mt_policy, arg1_type, arg2_type, arg3_type,
+			arg4_type, arg5_type, arg6_type, arg7_type, arg8_type>
+			connection_type;
 
-		_signal_base5()
+		template<class desttype>
+			void connect(desttype* pclass, typename _memfun<desttype,
+			arg1_type, arg2_type, arg3_type, arg4_type, arg5_type, arg6_type,
+			arg7_type, arg8_type>::type pmemfun)
 		{
-			;
+			this->add_connection(new _connection<desttype, mt_policy,
+				arg1_type, arg2_type, arg3_type, arg4_type, arg5_type,
+				arg6_type, arg7_type, arg8_type>(pclass, pmemfun));
 		}
 
-		_signal_base5(const _signal_base5<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, mt_policy>& s)
-			: _signal_base<mt_policy>(s)
+	protected:
+		// Walks the connections for emit. The next connection is only looked
+		// up after the current one has been called, so a slot may disconnect
+		// itself or others.
+		class iterator : public _signal_storage<mt_policy>::emitter
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = s.m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = s.m_connected_slots.end();
-
-			while(it != itEnd)
+		public:
+			explicit iterator(_signal* signal)
+				: _signal_storage<mt_policy>::emitter(signal)
 			{
-				(*it)->getdest()->signal_connect(this);
-				m_connected_slots.push_back((*it)->clone());
-
-				++it;
+				;
 			}
-		}
-
-		void slot_duplicate(const has_slots<mt_policy>* oldtarget, has_slots<mt_policy>* newtarget)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
 
-			while(it != itEnd)
+			const connection_type* next()
 			{
-				if((*it)->getdest() == oldtarget)
-				{
-					m_connected_slots.push_back((*it)->duplicate(newtarget));
-				}
-
-				++it;
+				return static_cast<const connection_type*>(
+					_signal_storage<mt_policy>::emitter::next());
 			}
-		}
+		};
+	};
+
+	template<class mt_policy = SIGSLOT_DEFAULT_MT_POLICY>
+	class signal0 : public _signal<mt_policy>
+	{
+	public:
+		typedef _signal<mt_policy> base;
 
-		~_signal_base5()
+		void emit()
 		{
-			disconnect_all();
+			typename base::iterator it(this);
+			while(const typename base::connection_type* conn = it.next())
+				conn->emit();
 		}
 
-		bool is_empty()
+		void operator()()
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			return it == itEnd;
+			emit();
 		}
+	};
 
-		void disconnect_all()
+	template<class arg1_type, class mt_policy = SIGSLOT_DEFAULT_MT_POLICY>
+	class signal1 : public _signal<mt_policy, arg1_type>
+	{
+	public:
+		typedef _signal<mt_policy, arg1_type> base;
+
+		void emit(arg1_type a1)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				(*it)->getdest()->signal_disconnect(this);
-				delete *it;
-
-				++it;
-			}
-
-			m_connected_slots.erase(m_connected_slots.begin(), m_connected_slots.end());
-		}
-
-#ifdef _DEBUG
-			bool connected(has_slots<mt_policy>* pclass)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-				if ((*it)->getdest() == pclass)
-					return true;
-				it = itNext;
-			}
-			return false;
-		}
-#endif
-
-		void disconnect(has_slots<mt_policy>* pclass)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				if((*it)->getdest() == pclass)
-				{
-					delete *it;
-					m_connected_slots.erase(it);
-					pclass->signal_disconnect(this);
-					return;
-				}
-
-				++it;
-			}
-		}
-
-		void slot_disconnect(has_slots<mt_policy>* pslot)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				typename connections_list::iterator itNext = it;
-				++itNext;
-
-				if((*it)->getdest() == pslot)
-				{
-					delete *it;
-					m_connected_slots.erase(it);
-				}
-
-				it = itNext;
-			}
-		}
-
-	protected:
-		connections_list m_connected_slots;   
-	};
-
-	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type,
-	class arg5_type, class arg6_type, class mt_policy>
-	class _signal_base6 : public _signal_base<mt_policy>
-	{
-	public:
-		typedef std::list<_connection_base6<arg1_type, arg2_type, arg3_type, 
-			arg4_type, arg5_type, arg6_type, mt_policy> *>  connections_list;
-
-		_signal_base6()
-		{
-			;
-		}
-
-		_signal_base6(const _signal_base6<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, mt_policy>& s)
-			: _signal_base<mt_policy>(s)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = s.m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = s.m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				(*it)->getdest()->signal_connect(this);
-				m_connected_slots.push_back((*it)->clone());
-
-				++it;
-			}
-		}
-
-		void slot_duplicate(const has_slots<mt_policy>* oldtarget, has_slots<mt_policy>* newtarget)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				if((*it)->getdest() == oldtarget)
-				{
-					m_connected_slots.push_back((*it)->duplicate(newtarget));
-				}
-
-				++it;
-			}
-		}
-
-		~_signal_base6()
-		{
-			disconnect_all();
-		}
-
-		bool is_empty()
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			return it == itEnd;
-		}
-
-		void disconnect_all()
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				(*it)->getdest()->signal_disconnect(this);
-				delete *it;
-
-				++it;
-			}
-
-			m_connected_slots.erase(m_connected_slots.begin(), m_connected_slots.end());
-		}
-
-#ifdef _DEBUG
-			bool connected(has_slots<mt_policy>* pclass)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-				if ((*it)->getdest() == pclass)
-					return true;
-				it = itNext;
-			}
-			return false;
-		}
-#endif
-
-		void disconnect(has_slots<mt_policy>* pclass)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				if((*it)->getdest() == pclass)
-				{
-					delete *it;
-					m_connected_slots.erase(it);
-					pclass->signal_disconnect(this);
-					return;
-				}
-
-				++it;
-			}
-		}
-
-		void slot_disconnect(has_slots<mt_policy>* pslot)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				typename connections_list::iterator itNext = it;
-				++itNext;
-
-				if((*it)->getdest() == pslot)
-				{
-					delete *it;
-					m_connected_slots.erase(it);
-				}
-
-				it = itNext;
-			}
-		}
-
-	protected:
-		connections_list m_connected_slots;   
-	};
-
-	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type,
-	class arg5_type, class arg6_type, class arg7_type, class mt_policy>
-	class _signal_base7 : public _signal_base<mt_policy>
-	{
-	public:
-		typedef std::list<_connection_base7<arg1_type, arg2_type, arg3_type, 
-			arg4_type, arg5_type, arg6_type, arg7_type, mt_policy> *>  connections_list;
-
-		_signal_base7()
-		{
-			;
-		}
-
-		_signal_base7(const _signal_base7<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, arg7_type, mt_policy>& s)
-			: _signal_base<mt_policy>(s)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = s.m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = s.m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				(*it)->getdest()->signal_connect(this);
-				m_connected_slots.push_back((*it)->clone());
-
-				++it;
-			}
-		}
-
-		void slot_duplicate(const has_slots<mt_policy>* oldtarget, has_slots<mt_policy>* newtarget)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				if((*it)->getdest() == oldtarget)
-				{
-					m_connected_slots.push_back((*it)->duplicate(newtarget));
-				}
-
-				++it;
-			}
-		}
-
-		~_signal_base7()
-		{
-			disconnect_all();
-		}
-
-		bool is_empty()
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			return it == itEnd;
-		}
-
-		void disconnect_all()
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				(*it)->getdest()->signal_disconnect(this);
-				delete *it;
-
-				++it;
-			}
-
-			m_connected_slots.erase(m_connected_slots.begin(), m_connected_slots.end());
-		}
-
-#ifdef _DEBUG
-			bool connected(has_slots<mt_policy>* pclass)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-				if ((*it)->getdest() == pclass)
-					return true;
-				it = itNext;
-			}
-			return false;
-		}
-#endif
-
-		void disconnect(has_slots<mt_policy>* pclass)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				if((*it)->getdest() == pclass)
-				{
-					delete *it;
-					m_connected_slots.erase(it);
-					pclass->signal_disconnect(this);
-					return;
-				}
-
-				++it;
-			}
-		}
-
-		void slot_disconnect(has_slots<mt_policy>* pslot)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				typename connections_list::iterator itNext = it;
-				++itNext;
-
-				if((*it)->getdest() == pslot)
-				{
-					delete *it;
-					m_connected_slots.erase(it);
-				}
-
-				it = itNext;
-			}
-		}
-
-	protected:
-		connections_list m_connected_slots;   
-	};
-
-	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type,
-	class arg5_type, class arg6_type, class arg7_type, class arg8_type, class mt_policy>
-	class _signal_base8 : public _signal_base<mt_policy>
-	{
-	public:
-		typedef std::list<_connection_base8<arg1_type, arg2_type, arg3_type, 
-			arg4_type, arg5_type, arg6_type, arg7_type, arg8_type, mt_policy> *>
-			connections_list;
-
-		_signal_base8()
-		{
-			;
-		}
-
-		_signal_base8(const _signal_base8<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, arg7_type, arg8_type, mt_policy>& s)
-			: _signal_base<mt_policy>(s)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = s.m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = s.m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				(*it)->getdest()->signal_connect(this);
-				m_connected_slots.push_back((*it)->clone());
-
-				++it;
-			}
-		}
-
-		void slot_duplicate(const has_slots<mt_policy>* oldtarget, has_slots<mt_policy>* newtarget)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				if((*it)->getdest() == oldtarget)
-				{
-					m_connected_slots.push_back((*it)->duplicate(newtarget));
-				}
-
-				++it;
-			}
-		}
-
-		~_signal_base8()
-		{
-			disconnect_all();
-		}
-
-		bool is_empty()
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			return it == itEnd;
-		}
-
-		void disconnect_all()
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				(*it)->getdest()->signal_disconnect(this);
-				delete *it;
-
-				++it;
-			}
-
-			m_connected_slots.erase(m_connected_slots.begin(), m_connected_slots.end());
-		}
-
-#ifdef _DEBUG
-			bool connected(has_slots<mt_policy>* pclass)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-				if ((*it)->getdest() == pclass)
-					return true;
-				it = itNext;
-			}
-			return false;
-		}
-#endif
-
-		void disconnect(has_slots<mt_policy>* pclass)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				if((*it)->getdest() == pclass)
-				{
-					delete *it;
-					m_connected_slots.erase(it);
-					pclass->signal_disconnect(this);
-					return;
-				}
-
-				++it;
-			}
-		}
-
-		void slot_disconnect(has_slots<mt_policy>* pslot)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::iterator it = m_connected_slots.begin();
-			typename connections_list::iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				typename connections_list::iterator itNext = it;
-				++itNext;
-
-				if((*it)->getdest() == pslot)
-				{
-					delete *it;
-					m_connected_slots.erase(it);
-				}
-
-				it = itNext;
-			}
-		}
-
-	protected:
-		connections_list m_connected_slots;   
-	};
-
-
-	template<class dest_type, class mt_policy>
-	class _connection0 : public _connection_base0<mt_policy>
-	{
-	public:
-		_connection0()
-		{
-			m_pobject = NULL;
-			m_pmemfun = NULL;
-		}
-
-		_connection0(dest_type* pobject, void (dest_type::*pmemfun)())
-		{
-			m_pobject = pobject;
-			m_pmemfun = pmemfun;
-		}
-
-		virtual ~_connection0()
-		{
-                }
-
-		virtual _connection_base0<mt_policy>* clone()
-		{
-			return new _connection0<dest_type, mt_policy>(*this);
-		}
-
-		virtual _connection_base0<mt_policy>* duplicate(has_slots<mt_policy>* pnewdest)
-		{
-			return new _connection0<dest_type, mt_policy>((dest_type *)pnewdest, m_pmemfun);
-		}
-
-		virtual void emit()
-		{
-			(m_pobject->*m_pmemfun)();
-		}
-
-		virtual has_slots<mt_policy>* getdest() const
-		{
-			return m_pobject;
-		}
-
-	private:
-		dest_type* m_pobject;
-		void (dest_type::* m_pmemfun)();
-	};
-
-	template<class dest_type, class arg1_type, class mt_policy>
-	class _connection1 : public _connection_base1<arg1_type, mt_policy>
-	{
-	public:
-		_connection1()
-		{
-			m_pobject = NULL;
-			m_pmemfun = NULL;
-		}
-
-		_connection1(dest_type* pobject, void (dest_type::*pmemfun)(arg1_type))
-		{
-			m_pobject = pobject;
-			m_pmemfun = pmemfun;
-		}
-
-		virtual ~_connection1()
-		{
-                }
-
-		virtual _connection_base1<arg1_type, mt_policy>* clone()
-		{
-			return new _connection1<dest_type, arg1_type, mt_policy>(*this);
-		}
-
-		virtual _connection_base1<arg1_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest)
-		{
-			return new _connection1<dest_type, arg1_type, mt_policy>((dest_type *)pnewdest, m_pmemfun);
-		}
-
-		virtual void emit(arg1_type a1)
-		{
-			(m_pobject->*m_pmemfun)(a1);
-		}
-
-		virtual has_slots<mt_policy>* getdest() const
-		{
-			return m_pobject;
-		}
-
-	private:
-		dest_type* m_pobject;
-		void (dest_type::* m_pmemfun)(arg1_type);
-	};
-
-	template<class dest_type, class arg1_type, class arg2_type, class mt_policy>
-	class _connection2 : public _connection_base2<arg1_type, arg2_type, mt_policy>
-	{
-	public:
-		_connection2()
-		{
-			m_pobject = NULL;
-			m_pmemfun = NULL;
-		}
-
-		_connection2(dest_type* pobject, void (dest_type::*pmemfun)(arg1_type,
-			arg2_type))
-		{
-			m_pobject = pobject;
-			m_pmemfun = pmemfun;
-		}
-
-		virtual ~_connection2()
-		{
-                }
-
-		virtual _connection_base2<arg1_type, arg2_type, mt_policy>* clone()
-		{
-			return new _connection2<dest_type, arg1_type, arg2_type, mt_policy>(*this);
-		}
-
-		virtual _connection_base2<arg1_type, arg2_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest)
-		{
-			return new _connection2<dest_type, arg1_type, arg2_type, mt_policy>((dest_type *)pnewdest, m_pmemfun);
-		}
-
-		virtual void emit(arg1_type a1, arg2_type a2)
-		{
-			(m_pobject->*m_pmemfun)(a1, a2);
-		}
-
-		virtual has_slots<mt_policy>* getdest() const
-		{
-			return m_pobject;
-		}
-
-	private:
-		dest_type* m_pobject;
-		void (dest_type::* m_pmemfun)(arg1_type, arg2_type);
-	};
-
-	template<class dest_type, class arg1_type, class arg2_type, class arg3_type, class mt_policy>
-	class _connection3 : public _connection_base3<arg1_type, arg2_type, arg3_type, mt_policy>
-	{
-	public:
-		_connection3()
-		{
-			m_pobject = NULL;
-			m_pmemfun = NULL;
-		}
-
-		_connection3(dest_type* pobject, void (dest_type::*pmemfun)(arg1_type,
-			arg2_type, arg3_type))
-		{
-			m_pobject = pobject;
-			m_pmemfun = pmemfun;
-		}
-
-		virtual ~_connection3()
-		{
-                }
-
-		virtual _connection_base3<arg1_type, arg2_type, arg3_type, mt_policy>* clone()
-		{
-			return new _connection3<dest_type, arg1_type, arg2_type, arg3_type, mt_policy>(*this);
-		}
-
-		virtual _connection_base3<arg1_type, arg2_type, arg3_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest)
-		{
-			return new _connection3<dest_type, arg1_type, arg2_type, arg3_type, mt_policy>((dest_type *)pnewdest, m_pmemfun);
-		}
-
-		virtual void emit(arg1_type a1, arg2_type a2, arg3_type a3)
-		{
-			(m_pobject->*m_pmemfun)(a1, a2, a3);
-		}
-
-		virtual has_slots<mt_policy>* getdest() const
-		{
-			return m_pobject;
-		}
-
-	private:
-		dest_type* m_pobject;
-		void (dest_type::* m_pmemfun)(arg1_type, arg2_type, arg3_type);
-	};
-
-	template<class dest_type, class arg1_type, class arg2_type, class arg3_type,
-	class arg4_type, class mt_policy>
-	class _connection4 : public _connection_base4<arg1_type, arg2_type,
-		arg3_type, arg4_type, mt_policy>
-	{
-	public:
-		_connection4()
-		{
-			m_pobject = NULL;
-			m_pmemfun = NULL;
-		}
-
-		_connection4(dest_type* pobject, void (dest_type::*pmemfun)(arg1_type,
-			arg2_type, arg3_type, arg4_type))
-		{
-			m_pobject = pobject;
-			m_pmemfun = pmemfun;
-		}
-
-		virtual ~_connection4()
-		{
-                }
-
-		virtual _connection_base4<arg1_type, arg2_type, arg3_type, arg4_type, mt_policy>* clone()
-		{
-			return new _connection4<dest_type, arg1_type, arg2_type, arg3_type, arg4_type, mt_policy>(*this);
-		}
-
-		virtual _connection_base4<arg1_type, arg2_type, arg3_type, arg4_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest)
-		{
-			return new _connection4<dest_type, arg1_type, arg2_type, arg3_type, arg4_type, mt_policy>((dest_type *)pnewdest, m_pmemfun);
-		}
-
-		virtual void emit(arg1_type a1, arg2_type a2, arg3_type a3, 
-			arg4_type a4)
-		{
-			(m_pobject->*m_pmemfun)(a1, a2, a3, a4);
-		}
-
-		virtual has_slots<mt_policy>* getdest() const
-		{
-			return m_pobject;
-		}
-
-	private:
-		dest_type* m_pobject;
-		void (dest_type::* m_pmemfun)(arg1_type, arg2_type, arg3_type,
-			arg4_type);
-	};
-
-	template<class dest_type, class arg1_type, class arg2_type, class arg3_type,
-	class arg4_type, class arg5_type, class mt_policy>
-	class _connection5 : public _connection_base5<arg1_type, arg2_type,
-		arg3_type, arg4_type, arg5_type, mt_policy>
-	{
-	public:
-		_connection5()
-		{
-			m_pobject = NULL;
-			m_pmemfun = NULL;
-		}
-
-		_connection5(dest_type* pobject, void (dest_type::*pmemfun)(arg1_type,
-			arg2_type, arg3_type, arg4_type, arg5_type))
-		{
-			m_pobject = pobject;
-			m_pmemfun = pmemfun;
-		}
-
-		virtual ~_connection5()
-		{
-                }
-
-		virtual _connection_base5<arg1_type, arg2_type, arg3_type, arg4_type, 
-			arg5_type, mt_policy>* clone()
-		{
-			return new _connection5<dest_type, arg1_type, arg2_type, arg3_type, arg4_type, 
-				arg5_type, mt_policy>(*this);
-		}
-
-		virtual _connection_base5<arg1_type, arg2_type, arg3_type, arg4_type, 
-			arg5_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest)
-		{
-			return new _connection5<dest_type, arg1_type, arg2_type, arg3_type, arg4_type, 
-				arg5_type, mt_policy>((dest_type *)pnewdest, m_pmemfun);
-		}
-
-		virtual void emit(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
-			arg5_type a5)
-		{
-			(m_pobject->*m_pmemfun)(a1, a2, a3, a4, a5);
-		}
-
-		virtual has_slots<mt_policy>* getdest() const
-		{
-			return m_pobject;
-		}
-
-	private:
-		dest_type* m_pobject;
-		void (dest_type::* m_pmemfun)(arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type);
-	};
-
-	template<class dest_type, class arg1_type, class arg2_type, class arg3_type,
-	class arg4_type, class arg5_type, class arg6_type, class mt_policy>
-	class _connection6 : public _connection_base6<arg1_type, arg2_type,
-		arg3_type, arg4_type, arg5_type, arg6_type, mt_policy>
-	{
-	public:
-		_connection6()
-		{
-			m_pobject = NULL;
-			m_pmemfun = NULL;
-		}
-
-		_connection6(dest_type* pobject, void (dest_type::*pmemfun)(arg1_type,
-			arg2_type, arg3_type, arg4_type, arg5_type, arg6_type))
-		{
-			m_pobject = pobject;
-			m_pmemfun = pmemfun;
-		}
-
-		virtual ~_connection6()
-		{
-                }
-
-		virtual _connection_base6<arg1_type, arg2_type, arg3_type, arg4_type, 
-			arg5_type, arg6_type, mt_policy>* clone()
-		{
-			return new _connection6<dest_type, arg1_type, arg2_type, arg3_type, arg4_type, 
-				arg5_type, arg6_type, mt_policy>(*this);
-		}
-
-		virtual _connection_base6<arg1_type, arg2_type, arg3_type, arg4_type, 
-			arg5_type, arg6_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest)
-		{
-			return new _connection6<dest_type, arg1_type, arg2_type, arg3_type, arg4_type, 
-				arg5_type, arg6_type, mt_policy>((dest_type *)pnewdest, m_pmemfun);
-		}
-
-		virtual void emit(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
-			arg5_type a5, arg6_type a6)
-		{
-			(m_pobject->*m_pmemfun)(a1, a2, a3, a4, a5, a6);
-		}
-
-		virtual has_slots<mt_policy>* getdest() const
-		{
-			return m_pobject;
-		}
-
-	private:
-		dest_type* m_pobject;
-		void (dest_type::* m_pmemfun)(arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type);
-	};
-
-	template<class dest_type, class arg1_type, class arg2_type, class arg3_type,
-	class arg4_type, class arg5_type, class arg6_type, class arg7_type, class mt_policy>
-	class _connection7 : public _connection_base7<arg1_type, arg2_type,
-		arg3_type, arg4_type, arg5_type, arg6_type, arg7_type, mt_policy>
-	{
-	public:
-		_connection7()
-		{
-			m_pobject = NULL;
-			m_pmemfun = NULL;
-		}
-
-		_connection7(dest_type* pobject, void (dest_type::*pmemfun)(arg1_type,
-			arg2_type, arg3_type, arg4_type, arg5_type, arg6_type, arg7_type))
-		{
-			m_pobject = pobject;
-			m_pmemfun = pmemfun;
-		}
-
-		virtual ~_connection7()
-		{
-                }
-
-		virtual _connection_base7<arg1_type, arg2_type, arg3_type, arg4_type, 
-			arg5_type, arg6_type, arg7_type, mt_policy>* clone()
-		{
-			return new _connection7<dest_type, arg1_type, arg2_type, arg3_type, arg4_type, 
-				arg5_type, arg6_type, arg7_type, mt_policy>(*this);
-		}
-
-		virtual _connection_base7<arg1_type, arg2_type, arg3_type, arg4_type, 
-			arg5_type, arg6_type, arg7_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest)
-		{
-			return new _connection7<dest_type, arg1_type, arg2_type, arg3_type, arg4_type, 
-				arg5_type, arg6_type, arg7_type, mt_policy>((dest_type *)pnewdest, m_pmemfun);
-		}
-
-		virtual void emit(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
-			arg5_type a5, arg6_type a6, arg7_type a7)
-		{
-			(m_pobject->*m_pmemfun)(a1, a2, a3, a4, a5, a6, a7);
-		}
-
-		virtual has_slots<mt_policy>* getdest() const
-		{
-			return m_pobject;
-		}
-
-	private:
-		dest_type* m_pobject;
-		void (dest_type::* m_pmemfun)(arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, arg7_type);
-	};
-
-	template<class dest_type, class arg1_type, class arg2_type, class arg3_type,
-	class arg4_type, class arg5_type, class arg6_type, class arg7_type, 
-	class arg8_type, class mt_policy>
-	class _connection8 : public _connection_base8<arg1_type, arg2_type,
-		arg3_type, arg4_type, arg5_type, arg6_type, arg7_type, arg8_type, mt_policy>
-	{
-	public:
-		_connection8()
-		{
-			m_pobject = NULL;
-			m_pmemfun = NULL;
-		}
-
-		_connection8(dest_type* pobject, void (dest_type::*pmemfun)(arg1_type,
-			arg2_type, arg3_type, arg4_type, arg5_type, arg6_type, 
-			arg7_type, arg8_type))
-		{
-			m_pobject = pobject;
-			m_pmemfun = pmemfun;
-		}
-
-		virtual ~_connection8()
-		{
-                }
-
-		virtual _connection_base8<arg1_type, arg2_type, arg3_type, arg4_type, 
-			arg5_type, arg6_type, arg7_type, arg8_type, mt_policy>* clone()
-		{
-			return new _connection8<dest_type, arg1_type, arg2_type, arg3_type, arg4_type, 
-				arg5_type, arg6_type, arg7_type, arg8_type, mt_policy>(*this);
-		}
-
-		virtual _connection_base8<arg1_type, arg2_type, arg3_type, arg4_type, 
-			arg5_type, arg6_type, arg7_type, arg8_type, mt_policy>* duplicate(has_slots<mt_policy>* pnewdest)
-		{
-			return new _connection8<dest_type, arg1_type, arg2_type, arg3_type, arg4_type, 
-				arg5_type, arg6_type, arg7_type, arg8_type, mt_policy>((dest_type *)pnewdest, m_pmemfun);
-		}
-
-		virtual void emit(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
-			arg5_type a5, arg6_type a6, arg7_type a7, arg8_type a8)
-		{
-			(m_pobject->*m_pmemfun)(a1, a2, a3, a4, a5, a6, a7, a8);
-		}
-
-		virtual has_slots<mt_policy>* getdest() const
-		{
-			return m_pobject;
-		}
-
-	private:
-		dest_type* m_pobject;
-		void (dest_type::* m_pmemfun)(arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, arg7_type, arg8_type);
-	};
-
-	template<class mt_policy = SIGSLOT_DEFAULT_MT_POLICY>
-	class signal0 : public _signal_base0<mt_policy>
-	{
-	public:
-		typedef _signal_base0<mt_policy> base;
-		typedef typename base::connections_list connections_list;
-		using base::m_connected_slots;
-
-		signal0()
-		{
-			;
-		}
-
-		signal0(const signal0<mt_policy>& s)
-			: _signal_base0<mt_policy>(s)
-		{
-			;
-		}
-
-		template<class desttype>
-			void connect(desttype* pclass, void (desttype::*pmemfun)())
-		{
-			lock_block<mt_policy> lock(this);
-			_connection0<desttype, mt_policy>* conn = 
-				new _connection0<desttype, mt_policy>(pclass, pmemfun);
-			m_connected_slots.push_back(conn);
-			pclass->signal_connect(this);
-		}
-
-		void emit()
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit();
-
-				it = itNext;
-			}
-		}
-
-		void operator()()
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit();
-
-				it = itNext;
-			}
-		}
-	};
-
-	template<class arg1_type, class mt_policy = SIGSLOT_DEFAULT_MT_POLICY>
-	class signal1 : public _signal_base1<arg1_type, mt_policy>
-	{
-	public:
-		typedef _signal_base1<arg1_type, mt_policy> base;
-		typedef typename base::connections_list connections_list;
-		using base::m_connected_slots;
-
-		signal1()
-		{
-			;
-		}
-
-		signal1(const signal1<arg1_type, mt_policy>& s)
-			: _signal_base1<arg1_type, mt_policy>(s)
-		{
-			;
-		}
-
-		template<class desttype>
-			void connect(desttype* pclass, void (desttype::*pmemfun)(arg1_type))
-		{
-			lock_block<mt_policy> lock(this);
-			_connection1<desttype, arg1_type, mt_policy>* conn = 
-				new _connection1<desttype, arg1_type, mt_policy>(pclass, pmemfun);
-			m_connected_slots.push_back(conn);
-			pclass->signal_connect(this);
-		}
-
-		void emit(arg1_type a1)
-		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1);
-
-				it = itNext;
-			}
-		}
+			typename base::iterator it(this);
+			while(const typename base::connection_type* conn = it.next())
+				conn->emit(a1);
+		}
 
 		void operator()(arg1_type a1)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1);
-
-				it = itNext;
-			}
+			emit(a1);
 		}
 	};
 
 	template<class arg1_type, class arg2_type, class mt_policy = SIGSLOT_DEFAULT_MT_POLICY>
-	class signal2 : public _signal_base2<arg1_type, arg2_type, mt_policy>
+	class signal2 : public _signal<mt_policy, arg1_type, arg2_type>
 	{
 	public:
-		typedef _signal_base2<arg1_type, arg2_type, mt_policy> base;
-		typedef typename base::connections_list connections_list;
-		using base::m_connected_slots;
-
-		signal2()
-		{
-			;
-		}
-
-		signal2(const signal2<arg1_type, arg2_type, mt_policy>& s)
-			: _signal_base2<arg1_type, arg2_type, mt_policy>(s)
-		{
-			;
-		}
-
-		template<class desttype>
-			void connect(desttype* pclass, void (desttype::*pmemfun)(arg1_type,
-			arg2_type))
-		{
-			lock_block<mt_policy> lock(this);
-			_connection2<desttype, arg1_type, arg2_type, mt_policy>* conn = new
-				_connection2<desttype, arg1_type, arg2_type, mt_policy>(pclass, pmemfun);
-			m_connected_slots.push_back(conn);
-			pclass->signal_connect(this);
-		}
+		typedef _signal<mt_policy, arg1_type, arg2_type> base;
 
 		void emit(arg1_type a1, arg2_type a2)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1, a2);
-
-				it = itNext;
-			}
+			typename base::iterator it(this);
+			while(const typename base::connection_type* conn = it.next())
+				conn->emit(a1, a2);
 		}
 
 		void operator()(arg1_type a1, arg2_type a2)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1, a2);
-
-				it = itNext;
-			}
+			emit(a1, a2);
 		}
 	};
 
 	template<class arg1_type, class arg2_type, class arg3_type, class mt_policy = SIGSLOT_DEFAULT_MT_POLICY>
-	class signal3 : public _signal_base3<arg1_type, arg2_type, arg3_type, mt_policy>
+	class signal3 : public _signal<mt_policy, arg1_type, arg2_type, arg3_type>
 	{
 	public:
-		typedef _signal_base3<arg1_type, arg2_type, arg3_type, mt_policy> base;
-		typedef typename base::connections_list connections_list;
-		using base::m_connected_slots;
-
-		signal3()
-		{
-			;
-		}
-
-		signal3(const signal3<arg1_type, arg2_type, arg3_type, mt_policy>& s)
-			: _signal_base3<arg1_type, arg2_type, arg3_type, mt_policy>(s)
-		{
-			;
-		}
-
-		template<class desttype>
-			void connect(desttype* pclass, void (desttype::*pmemfun)(arg1_type,
-			arg2_type, arg3_type))
-		{
-			lock_block<mt_policy> lock(this);
-			_connection3<desttype, arg1_type, arg2_type, arg3_type, mt_policy>* conn = 
-				new _connection3<desttype, arg1_type, arg2_type, arg3_type, mt_policy>(pclass,
-				pmemfun);
-			m_connected_slots.push_back(conn);
-			pclass->signal_connect(this);
-		}
+		typedef _signal<mt_policy, arg1_type, arg2_type, arg3_type> base;
 
 		void emit(arg1_type a1, arg2_type a2, arg3_type a3)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1, a2, a3);
-
-				it = itNext;
-			}
+			typename base::iterator it(this);
+			while(const typename base::connection_type* conn = it.next())
+				conn->emit(a1, a2, a3);
 		}
 
 		void operator()(arg1_type a1, arg2_type a2, arg3_type a3)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1, a2, a3);
-
-				it = itNext;
-			}
+			emit(a1, a2, a3);
 		}
 	};
 
 	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type, class mt_policy = SIGSLOT_DEFAULT_MT_POLICY>
-	class signal4 : public _signal_base4<arg1_type, arg2_type, arg3_type,
-		arg4_type, mt_policy>
+	class signal4 : public _signal<mt_policy, arg1_type, arg2_type, arg3_type,
+		arg4_type>
 	{
 	public:
-		typedef _signal_base4<arg1_type, arg2_type, arg3_type, arg4_type, mt_policy> base;
-		typedef typename base::connections_list connections_list;
-		using base::m_connected_slots;
-
-		signal4()
-		{
-			;
-		}
-
-		signal4(const signal4<arg1_type, arg2_type, arg3_type, arg4_type, mt_policy>& s)
-			: _signal_base4<arg1_type, arg2_type, arg3_type, arg4_type, mt_policy>(s)
-		{
-			;
-		}
-
-		template<class desttype>
-			void connect(desttype* pclass, void (desttype::*pmemfun)(arg1_type,
-			arg2_type, arg3_type, arg4_type))
-		{
-			lock_block<mt_policy> lock(this);
-			_connection4<desttype, arg1_type, arg2_type, arg3_type, arg4_type, mt_policy>*
-				conn = new _connection4<desttype, arg1_type, arg2_type, arg3_type,
-				arg4_type, mt_policy>(pclass, pmemfun);
-			m_connected_slots.push_back(conn);
-			pclass->signal_connect(this);
-		}
+		typedef _signal<mt_policy, arg1_type, arg2_type, arg3_type,
+			arg4_type> base;
 
 		void emit(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1, a2, a3, a4);
-
-				it = itNext;
-			}
+			typename base::iterator it(this);
+			while(const typename base::connection_type* conn = it.next())
+				conn->emit(a1, a2, a3, a4);
 		}
 
 		void operator()(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1, a2, a3, a4);
-
-				it = itNext;
-			}
+			emit(a1, a2, a3, a4);
 		}
 	};
 
 	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type,
 	class arg5_type, class mt_policy = SIGSLOT_DEFAULT_MT_POLICY>
-	class signal5 : public _signal_base5<arg1_type, arg2_type, arg3_type,
-		arg4_type, arg5_type, mt_policy>
+	class signal5 : public _signal<mt_policy, arg1_type, arg2_type, arg3_type,
+		arg4_type, arg5_type>
 	{
 	public:
-		typedef _signal_base5<arg1_type, arg2_type, arg3_type, arg4_type, arg5_type, mt_policy> base;
-		typedef typename base::connections_list connections_list;
-		using base::m_connected_slots;
-
-		signal5()
-		{
-			;
-		}
-
-		signal5(const signal5<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, mt_policy>& s)
-			: _signal_base5<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, mt_policy>(s)
-		{
-			;
-		}
-
-		template<class desttype>
-			void connect(desttype* pclass, void (desttype::*pmemfun)(arg1_type,
-			arg2_type, arg3_type, arg4_type, arg5_type))
-		{
-			lock_block<mt_policy> lock(this);
-			_connection5<desttype, arg1_type, arg2_type, arg3_type, arg4_type,
-				arg5_type, mt_policy>* conn = new _connection5<desttype, arg1_type, arg2_type,
-				arg3_type, arg4_type, arg5_type, mt_policy>(pclass, pmemfun);
-			m_connected_slots.push_back(conn);
-			pclass->signal_connect(this);
-		}
+		typedef _signal<mt_policy, arg1_type, arg2_type, arg3_type,
+			arg4_type, arg5_type> base;
 
 		void emit(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
 			arg5_type a5)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1, a2, a3, a4, a5);
-
-				it = itNext;
-			}
+			typename base::iterator it(this);
+			while(const typename base::connection_type* conn = it.next())
+				conn->emit(a1, a2, a3, a4, a5);
 		}
 
 		void operator()(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
 			arg5_type a5)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1, a2, a3, a4, a5);
-
-				it = itNext;
-			}
+			emit(a1, a2, a3, a4, a5);
 		}
 	};
 
-
 	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type,
 	class arg5_type, class arg6_type, class mt_policy = SIGSLOT_DEFAULT_MT_POLICY>
-	class signal6 : public _signal_base6<arg1_type, arg2_type, arg3_type,
-		arg4_type, arg5_type, arg6_type, mt_policy>
+	class signal6 : public _signal<mt_policy, arg1_type, arg2_type, arg3_type,
+		arg4_type, arg5_type, arg6_type>
 	{
 	public:
-		typedef _signal_base6<arg1_type, arg2_type, arg3_type, arg4_type, arg5_type, arg6_type, mt_policy> base;
-		typedef typename base::connections_list connections_list;
-		using base::m_connected_slots;
-
-		signal6()
-		{
-			;
-		}
-
-		signal6(const signal6<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, mt_policy>& s)
-			: _signal_base6<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, mt_policy>(s)
-		{
-			;
-		}
-
-		template<class desttype>
-			void connect(desttype* pclass, void (desttype::*pmemfun)(arg1_type,
-			arg2_type, arg3_type, arg4_type, arg5_type, arg6_type))
-		{
-			lock_block<mt_policy> lock(this);
-			_connection6<desttype, arg1_type, arg2_type, arg3_type, arg4_type,
-				arg5_type, arg6_type, mt_policy>* conn = 
-				new _connection6<desttype, arg1_type, arg2_type, arg3_type,
-				arg4_type, arg5_type, arg6_type, mt_policy>(pclass, pmemfun);
-			m_connected_slots.push_back(conn);
-			pclass->signal_connect(this);
-		}
+		typedef _signal<mt_policy, arg1_type, arg2_type, arg3_type,
+			arg4_type, arg5_type, arg6_type> base;
 
 		void emit(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
 			arg5_type a5, arg6_type a6)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1, a2, a3, a4, a5, a6);
-
-				it = itNext;
-			}
+			typename base::iterator it(this);
+			while(const typename base::connection_type* conn = it.next())
+				conn->emit(a1, a2, a3, a4, a5, a6);
 		}
 
 		void operator()(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
 			arg5_type a5, arg6_type a6)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1, a2, a3, a4, a5, a6);
-
-				it = itNext;
-			}
+			emit(a1, a2, a3, a4, a5, a6);
 		}
 	};
 
 	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type,
 	class arg5_type, class arg6_type, class arg7_type, class mt_policy = SIGSLOT_DEFAULT_MT_POLICY>
-	class signal7 : public _signal_base7<arg1_type, arg2_type, arg3_type,
-		arg4_type, arg5_type, arg6_type, arg7_type, mt_policy>
+	class signal7 : public _signal<mt_policy, arg1_type, arg2_type, arg3_type,
+		arg4_type, arg5_type, arg6_type, arg7_type>
 	{
 	public:
-		typedef _signal_base7<arg1_type, arg2_type, arg3_type, arg4_type, 
-			arg5_type, arg6_type, arg7_type, mt_policy> base;
-		typedef typename base::connections_list connections_list;
-		using base::m_connected_slots;
-
-		signal7()
-		{
-			;
-		}
-
-		signal7(const signal7<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, arg7_type, mt_policy>& s)
-			: _signal_base7<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, arg7_type, mt_policy>(s)
-		{
-			;
-		}
-
-		template<class desttype>
-			void connect(desttype* pclass, void (desttype::*pmemfun)(arg1_type,
-			arg2_type, arg3_type, arg4_type, arg5_type, arg6_type, 
-			arg7_type))
-		{
-			lock_block<mt_policy> lock(this);
-			_connection7<desttype, arg1_type, arg2_type, arg3_type, arg4_type,
-				arg5_type, arg6_type, arg7_type, mt_policy>* conn = 
-				new _connection7<desttype, arg1_type, arg2_type, arg3_type,
-				arg4_type, arg5_type, arg6_type, arg7_type, mt_policy>(pclass, pmemfun);
-			m_connected_slots.push_back(conn);
-			pclass->signal_connect(this);
-		}
+		typedef _signal<mt_policy, arg1_type, arg2_type, arg3_type,
+			arg4_type, arg5_type, arg6_type, arg7_type> base;
 
 		void emit(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
 			arg5_type a5, arg6_type a6, arg7_type a7)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1, a2, a3, a4, a5, a6, a7);
-
-				it = itNext;
-			}
+			typename base::iterator it(this);
+			while(const typename base::connection_type* conn = it.next())
+				conn->emit(a1, a2, a3, a4, a5, a6, a7);
 		}
 
 		void operator()(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
 			arg5_type a5, arg6_type a6, arg7_type a7)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1, a2, a3, a4, a5, a6, a7);
-
-				it = itNext;
-			}
+			emit(a1, a2, a3, a4, a5, a6, a7);
 		}
 	};
 
 	template<class arg1_type, class arg2_type, class arg3_type, class arg4_type,
 	class arg5_type, class arg6_type, class arg7_type, class arg8_type, class mt_policy = SIGSLOT_DEFAULT_MT_POLICY>
-	class signal8 : public _signal_base8<arg1_type, arg2_type, arg3_type,
-		arg4_type, arg5_type, arg6_type, arg7_type, arg8_type, mt_policy>
+	class signal8 : public _signal<mt_policy, arg1_type, arg2_type, arg3_type,
+		arg4_type, arg5_type, arg6_type, arg7_type, arg8_type>
 	{
 	public:
-		typedef _signal_base8<arg1_type, arg2_type, arg3_type, arg4_type, 
-			arg5_type, arg6_type, arg7_type, arg8_type, mt_policy> base;
-		typedef typename base::connections_list connections_list;
-		using base::m_connected_slots;
-
-		signal8()
-		{
-			;
-		}
-
-		signal8(const signal8<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, arg7_type, arg8_type, mt_policy>& s)
-			: _signal_base8<arg1_type, arg2_type, arg3_type, arg4_type,
-			arg5_type, arg6_type, arg7_type, arg8_type, mt_policy>(s)
-		{
-			;
-		}
-
-		template<class desttype>
-			void connect(desttype* pclass, void (desttype::*pmemfun)(arg1_type,
-			arg2_type, arg3_type, arg4_type, arg5_type, arg6_type, 
-			arg7_type, arg8_type))
-		{
-			lock_block<mt_policy> lock(this);
-			_connection8<desttype, arg1_type, arg2_type, arg3_type, arg4_type,
-				arg5_type, arg6_type, arg7_type, arg8_type, mt_policy>* conn = 
-				new _connection8<desttype, arg1_type, arg2_type, arg3_type,
-				arg4_type, arg5_type, arg6_type, arg7_type, 
-				arg8_type, mt_policy>(pclass, pmemfun);
-			m_connected_slots.push_back(conn);
-			pclass->signal_connect(this);
-		}
+		typedef _signal<mt_policy, arg1_type, arg2_type, arg3_type,
+			arg4_type, arg5_type, arg6_type, arg7_type, arg8_type> base;
 
 		void emit(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
 			arg5_type a5, arg6_type a6, arg7_type a7, arg8_type a8)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1, a2, a3, a4, a5, a6, a7, a8);
-
-				it = itNext;
-			}
+			typename base::iterator it(this);
+			while(const typename base::connection_type* conn = it.next())
+				conn->emit(a1, a2, a3, a4, a5, a6, a7, a8);
 		}
 
 		void operator()(arg1_type a1, arg2_type a2, arg3_type a3, arg4_type a4,
 			arg5_type a5, arg6_type a6, arg7_type a7, arg8_type a8)
 		{
-			lock_block<mt_policy> lock(this);
-			typename connections_list::const_iterator itNext, it = m_connected_slots.begin();
-			typename connections_list::const_iterator itEnd = m_connected_slots.end();
-
-			while(it != itEnd)
-			{
-				itNext = it;
-				++itNext;
-
-				(*it)->emit(a1, a2, a3, a4, a5, a6, a7, a8);
-
-				it = itNext;
-			}
+			emit(a1, a2, a3, a4, a5, a6, a7, a8);
 		}
 	};
 
@@ -144,6 +144,35 @@ inline bool IsBlockingError(int e) {
   return (e == EWOULDBLOCK) || (e == EAGAIN) || (e == EINPROGRESS);
 }
 
+// One of the buffers passed to Socket::SendV.
+struct IoVec {
+  const void* data;
+  size_t len;
+};
+
+// One of the buffers filled by Socket::RecvV.
+struct MutableIoVec {
+  void* data;
+  size_t len;
+};
+
+// One of the datagrams passed to Socket::SendToMany, with its destination.
+struct Datagram {
+  const void* data;
+  size_t len;
+  SocketAddress addr;
+};
+
+// One of the buffers filled by Socket::RecvFromMany. |len| is set to the
+// length of the datagram received into the |size| bytes at |data|, and
+// |addr| to where it came from.
+struct DatagramBuffer {
+  void* data;
+  size_t size;
+  size_t len;
+  SocketAddress addr;
+};
+
 // General interface for the socket implementations of various networks.  The
 // methods match those of normal UNIX sockets very closely.
 class Socket {
@@ -161,9 +190,41 @@ class Socket {
   virtual int Bind(const SocketAddress& addr) = 0;
   virtual int Connect(const SocketAddress& addr) = 0;
   virtual int Send(const void *pv, size_t cb) = 0;
+  // Sends the |count| buffers one after the other, like one Send of them
+  // all, and returns the bytes sent. Sockets that can gather them into one
+  // system call do; the default sends them one at a time.
+  virtual int SendV(const IoVec* vec, size_t count) {
+    return SendEach(vec, count);
+  }
   virtual int SendTo(const void *pv, size_t cb, const SocketAddress& addr) = 0;
   virtual int Recv(void *pv, size_t cb) = 0;
+  // Receives into the |count| buffers one after the other, like one Recv
+  // into them all, and returns the bytes received. The default receives
+  // into them one at a time.
+  virtual int RecvV(const MutableIoVec* vec, size_t count) {
+    return RecvEach(vec, count);
+  }
   virtual int RecvFrom(void *pv, size_t cb, SocketAddress *paddr) = 0;
+  // Sends up to |len| bytes of the open file |fd| from |offset| on, as a
+  // Send of them would, and returns the bytes sent. Sockets that can send
+  // straight from the file do; the default fails with EOPNOTSUPP.
+  virtual int SendFile(int fd, size_t offset, size_t len) {
+    SetError(EOPNOTSUPP);
+    return -1;
+  }
+  // Sends each of the |count| datagrams to its address, and returns how
+  // many were sent. Sockets that can send several with one system call do;
+  // the default calls SendTo for each, stopping at the first that fails.
+  virtual int SendToMany(const Datagram* packets, size_t count) {
+    return SendToEach(packets, count);
+  }
+  // Receives up to |count| datagrams, one into each buffer, and returns how
+  // many were received. A |len| more than |size| means the datagram was cut
+  // short, which only sockets that receive several at once can tell; the
+  // default calls RecvFrom until it would block.
+  virtual int RecvFromMany(DatagramBuffer* packets, size_t count) {
+    return RecvFromEach(packets, count);
+  }
   virtual int Listen(int backlog) = 0;
   virtual Socket *Accept(SocketAddress *paddr) = 0;
   virtual int Close() = 0;
@@ -186,14 +247,85 @@ class Socket {
     OPT_DONTFRAGMENT,
     OPT_RCVBUF,  // receive buffer size
     OPT_SNDBUF,  // send buffer size
-    OPT_NODELAY  // whether Nagle algorithm is enabled
+    OPT_NODELAY,  // whether Nagle algorithm is enabled
+    OPT_UDP_SEGMENT,  // size the kernel splits larger UDP sends into, or 0
+    OPT_BUSY_POLL,  // microseconds the kernel polls the device on an empty
+                    // read before sleeping (Linux only)
+    OPT_KEEPALIVE,  // seconds a TCP connection is idle before, and
+                    // between, keepalive probes, or 0 for none.  Where the
+                    // timing can't be set, any other value uses the
+                    // system's.
+    OPT_RTT,  // the smoothed round trip time the kernel has measured for a
+              // TCP connection, in microseconds, and its mean deviation;
+    OPT_RTTVAR  // only read, from TCP_INFO (Linux only)
   };
   virtual int GetOption(Option opt, int* value) = 0;
   virtual int SetOption(Option opt, int value) = 0;
 
+  // Has the kernel encrypt what is sent from now on as TLS records (Linux
+  // kTLS). |crypto_info| is one of the struct tls12_crypto_info_* of
+  // linux/tls.h, with the write key and sequence number of the session.
+  // Sockets that can't, the default, return false.
+  virtual bool StartKernelTls(const void* crypto_info, size_t len) {
+    return false;
+  }
+
  protected:
   Socket() {}
 
+  // SendV as a Send of each buffer, stopping at the first short one.
+  int SendEach(const IoVec* vec, size_t count) {
+    int total = 0;
+    for (size_t i = 0; i < count; ++i) {
+      int sent = Send(vec[i].data, vec[i].len);
+      if (sent < 0)
+        return (total > 0) ? total : sent;
+      total += sent;
+      if (static_cast<size_t>(sent) < vec[i].len)
+        break;
+    }
+    return total;
+  }
+
+  // RecvV as a Recv into each buffer, stopping at the first short one.
+  int RecvEach(const MutableIoVec* vec, size_t count) {
+    int total = 0;
+    for (size_t i = 0; i < count; ++i) {
+      int received = Recv(vec[i].data, vec[i].len);
+      if (received < 0)
+        return (total > 0) ? total : received;
+      total += received;
+      if (static_cast<size_t>(received) < vec[i].len)
+        break;
+    }
+    return total;
+  }
+
+  // SendToMany as a SendTo of each datagram, stopping at the first that
+  // fails.
+  int SendToEach(const Datagram* packets, size_t count) {
+    size_t sent = 0;
+    for (; sent < count; ++sent) {
+      if (SendTo(packets[sent].data, packets[sent].len,
+                 packets[sent].addr) < 0)
+        return (sent > 0) ? static_cast<int>(sent) : -1;
+    }
+    return static_cast<int>(sent);
+  }
+
+  // RecvFromMany as a RecvFrom into each buffer, until one fails.
+  int RecvFromEach(DatagramBuffer* packets, size_t count) {
+    size_t received = 0;
+    for (; received < count; ++received) {
+      int len = RecvFrom(packets[received].data, packets[received].size,
+                         &packets[received].addr);
+      if (len < 0)
+        return (received > 0) ? static_cast<int>(received) : -1;
+      packets[received].len = len;
+    }
+    return static_cast<int>(received);
+  }
+
  private:
   DISALLOW_EVIL_CONSTRUCTORS(Socket);
 };
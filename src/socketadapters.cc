@@ -34,6 +34,8 @@
 #include <time.h>
 #include <errno.h>
 
+#include <algorithm>
+
 #ifdef WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -45,10 +47,14 @@
 
 #include "bytebuffer.h"
 #include "common.h"
+#include "criticalsection.h"
 #include "httpcommon.h"
 #include "logging.h"
+#include "socketfactory.h"
 #include "stringencode.h"
 #include "stringutils.h"
+#include "thread.h"
+#include "wirecapture.h"
 
 #ifdef WIN32
 #include "sec_buffer.h"
@@ -56,14 +62,20 @@
 
 namespace txmpp {
 
+// A negotiation buffer given back by an adapter that is done with it. The
+// adapters of a chain negotiate one after the other, so the next one can
+// take it rather than allocate its own.
+static CriticalSection BufferedReadAdapter_crit;
+static char* BufferedReadAdapter_spare = NULL;
+static size_t BufferedReadAdapter_spare_size = 0;
+
 BufferedReadAdapter::BufferedReadAdapter(AsyncSocket* socket, size_t size)
-    : AsyncSocketAdapter(socket), buffer_size_(size),
-      data_len_(0), buffering_(false) {
-  buffer_ = new char[buffer_size_];
+    : AsyncSocketAdapter(socket), buffer_(NULL), buffer_size_(size),
+      data_start_(0), data_len_(0), buffering_(false) {
 }
 
 BufferedReadAdapter::~BufferedReadAdapter() {
-  delete [] buffer_;
+  ReleaseBuffer();
 }
 
 int BufferedReadAdapter::Send(const void *pv, size_t cb) {
@@ -85,26 +97,68 @@ int BufferedReadAdapter::Recv(void *pv, size_t cb) {
 
   if (data_len_) {
     read = _min(cb, data_len_);
-    memcpy(pv, buffer_, read);
+    memcpy(pv, buffer_ + data_start_, read);
     data_len_ -= read;
-    if (data_len_ > 0) {
-      memmove(buffer_, buffer_ + read, data_len_);
-    }
+    data_start_ = (data_len_ > 0) ? data_start_ + read : 0;
     pv = static_cast<char *>(pv) + read;
     cb -= read;
+    // What was read past the negotiation is all passed on; from here on the
+    // adapter only passes reads through.
+    if (data_len_ == 0)
+      ReleaseBuffer();
   }
 
   // FIX: If cb == 0, we won't generate another read event
 
   int res = AsyncSocketAdapter::Recv(pv, cb);
   if (res < 0)
-    return res;
+    return (read > 0) ? static_cast<int>(read) : res;
 
   return res + static_cast<int>(read);
 }
 
 void BufferedReadAdapter::BufferInput(bool on) {
   buffering_ = on;
+  if (on) {
+    AcquireBuffer();
+  } else if (data_len_ == 0) {
+    ReleaseBuffer();
+  }
+}
+
+void BufferedReadAdapter::AcquireBuffer() {
+  if (buffer_)
+    return;
+  {
+    CritScope cs(&BufferedReadAdapter_crit);
+    if (BufferedReadAdapter_spare &&
+        (BufferedReadAdapter_spare_size >= buffer_size_)) {
+      buffer_ = BufferedReadAdapter_spare;
+      buffer_size_ = BufferedReadAdapter_spare_size;
+      BufferedReadAdapter_spare = NULL;
+      BufferedReadAdapter_spare_size = 0;
+    }
+  }
+  if (!buffer_)
+    buffer_ = new char[buffer_size_];
+  data_start_ = data_len_ = 0;
+}
+
+void BufferedReadAdapter::ReleaseBuffer() {
+  if (!buffer_)
+    return;
+  char* unused = buffer_;
+  {
+    CritScope cs(&BufferedReadAdapter_crit);
+    // Keep the larger of the two, which fits more of the adapters.
+    if (buffer_size_ > BufferedReadAdapter_spare_size) {
+      std::swap(unused, BufferedReadAdapter_spare);
+      BufferedReadAdapter_spare_size = buffer_size_;
+    }
+  }
+  delete [] unused;
+  buffer_ = NULL;
+  data_start_ = data_len_ = 0;
 }
 
 void BufferedReadAdapter::OnReadEvent(AsyncSocket * socket) {
@@ -115,6 +169,12 @@ void BufferedReadAdapter::OnReadEvent(AsyncSocket * socket) {
     return;
   }
 
+  AcquireBuffer();
+  if (data_start_ > 0) {
+    memmove(buffer_, buffer_ + data_start_, data_len_);
+    data_start_ = 0;
+  }
+
   if (data_len_ >= buffer_size_) {
     LOG(INFO) << "Input buffer overflow";
     ASSERT(false);
@@ -852,16 +912,33 @@ void AsyncSocksProxyServerSocket::Error(int error) {
 LoggingSocketAdapter::LoggingSocketAdapter(AsyncSocket* socket,
                                            LoggingSeverity level,
                                            const char * label, bool hex_mode)
-    : AsyncSocketAdapter(socket), level_(level), hex_mode_(hex_mode) {
+    : AsyncSocketAdapter(socket), level_(level), hex_mode_(hex_mode),
+      capture_(NULL), connection_(0) {
   label_.append("[");
   label_.append(label);
   label_.append("]");
 }
 
+void LoggingSocketAdapter::set_capture(WireCapture* capture) {
+  capture_ = capture;
+  if (capture_)
+    connection_ = capture_->AddConnection(label_);
+}
+
+void LoggingSocketAdapter::LogData(bool input, const void* data, size_t len) {
+  if (capture_) {
+    capture_->Write(connection_,
+                    input ? WireCapture::WR_INPUT : WireCapture::WR_OUTPUT,
+                    data, len);
+  } else {
+    LogMultiline(level_, label_.c_str(), input, data, len, hex_mode_, &lms_);
+  }
+}
+
 int LoggingSocketAdapter::Send(const void *pv, size_t cb) {
   int res = AsyncSocketAdapter::Send(pv, cb);
   if (res > 0)
-    LogMultiline(level_, label_.c_str(), false, pv, res, hex_mode_, &lms_);
+    LogData(false, pv, res);
   return res;
 }
 
@@ -869,43 +946,220 @@ int LoggingSocketAdapter::SendTo(const void *pv, size_t cb,
                              const SocketAddress& addr) {
   int res = AsyncSocketAdapter::SendTo(pv, cb, addr);
   if (res > 0)
-    LogMultiline(level_, label_.c_str(), false, pv, res, hex_mode_, &lms_);
+    LogData(false, pv, res);
   return res;
 }
 
 int LoggingSocketAdapter::Recv(void *pv, size_t cb) {
   int res = AsyncSocketAdapter::Recv(pv, cb);
   if (res > 0)
-    LogMultiline(level_, label_.c_str(), true, pv, res, hex_mode_, &lms_);
+    LogData(true, pv, res);
   return res;
 }
 
 int LoggingSocketAdapter::RecvFrom(void *pv, size_t cb, SocketAddress *paddr) {
   int res = AsyncSocketAdapter::RecvFrom(pv, cb, paddr);
   if (res > 0)
-    LogMultiline(level_, label_.c_str(), true, pv, res, hex_mode_, &lms_);
+    LogData(true, pv, res);
   return res;
 }
 
 int LoggingSocketAdapter::Close() {
-  LogMultiline(level_, label_.c_str(), false, NULL, 0, hex_mode_, &lms_);
-  LogMultiline(level_, label_.c_str(), true, NULL, 0, hex_mode_, &lms_);
-  LOG_V(level_) << label_ << " Closed locally";
+  if (capture_) {
+    capture_->Write(connection_, WireCapture::WR_CLOSE_LOCAL, NULL, 0);
+  } else {
+    LogMultiline(level_, label_.c_str(), false, NULL, 0, hex_mode_, &lms_);
+    LogMultiline(level_, label_.c_str(), true, NULL, 0, hex_mode_, &lms_);
+    LOG_V(level_) << label_ << " Closed locally";
+  }
   return socket_->Close();
 }
 
 void LoggingSocketAdapter::OnConnectEvent(AsyncSocket * socket) {
-  LOG_V(level_) << label_ << " Connected";
+  if (capture_) {
+    capture_->Write(connection_, WireCapture::WR_CONNECT, NULL, 0);
+  } else {
+    LOG_V(level_) << label_ << " Connected";
+  }
   AsyncSocketAdapter::OnConnectEvent(socket);
 }
 
 void LoggingSocketAdapter::OnCloseEvent(AsyncSocket * socket, int err) {
-  LogMultiline(level_, label_.c_str(), false, NULL, 0, hex_mode_, &lms_);
-  LogMultiline(level_, label_.c_str(), true, NULL, 0, hex_mode_, &lms_);
-  LOG_V(level_) << label_ << " Closed with error: " << err;
+  if (capture_) {
+    capture_->WriteClose(connection_, err);
+  } else {
+    LogMultiline(level_, label_.c_str(), false, NULL, 0, hex_mode_, &lms_);
+    LogMultiline(level_, label_.c_str(), true, NULL, 0, hex_mode_, &lms_);
+    LOG_V(level_) << label_ << " Closed with error: " << err;
+  }
   AsyncSocketAdapter::OnCloseEvent(socket, err);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
+RacingSocketAdapter::RacingSocketAdapter(SocketFactory* factory, int stagger)
+    : AsyncSocketAdapter(NULL), factory_(factory), stagger_(stagger),
+      next_(0), connecting_(false), error_(0), bytes_sent_(0),
+      bytes_received_(0) {
+}
+
+RacingSocketAdapter::~RacingSocketAdapter() {
+  StopAttempts();
+}
+
+void RacingSocketAdapter::AddAddress(const SocketAddress& addr) {
+  addresses_.push_back(addr);
+}
+
+int RacingSocketAdapter::Connect(const SocketAddress& addr) {
+  if (connecting_ || (socket_ && (socket_->GetState() != CS_CLOSED))) {
+    SetError(EALREADY);
+    return SOCKET_ERROR;
+  }
+  // A socket left from an earlier connection is not used again.
+  delete socket_;
+  socket_ = NULL;
+  race_.clear();
+  race_.push_back(addr);
+  for (size_t i = 0; i < addresses_.size(); ++i) {
+    if (addresses_[i] != addr)
+      race_.push_back(addresses_[i]);
+  }
+  next_ = 0;
+  error_ = 0;
+  connecting_ = true;
+  StartAttempt();
+  if (!connecting_) {
+    // Every address failed straight away.
+    return SOCKET_ERROR;
+  }
+  return 0;
+}
+
+int RacingSocketAdapter::Close() {
+  if (socket_)
+    return socket_->Close();
+  StopAttempts();
+  connecting_ = false;
+  return 0;
+}
+
+int RacingSocketAdapter::GetError() const {
+  return socket_ ? socket_->GetError() : error_;
+}
+
+void RacingSocketAdapter::SetError(int error) {
+  if (socket_) {
+    socket_->SetError(error);
+  } else {
+    error_ = error;
+  }
+}
+
+AsyncSocket::ConnState RacingSocketAdapter::GetState() const {
+  if (socket_)
+    return socket_->GetState();
+  return connecting_ ? CS_CONNECTING : CS_CLOSED;
+}
+
+SocketAddress RacingSocketAdapter::GetRemoteAddress() const {
+  if (socket_)
+    return socket_->GetRemoteAddress();
+  return SocketAddress();
+}
+
+int RacingSocketAdapter::Send(const void* pv, size_t cb) {
+  int sent = AsyncSocketAdapter::Send(pv, cb);
+  if (sent > 0)
+    bytes_sent_ += sent;
+  return sent;
+}
+
+int RacingSocketAdapter::Recv(void* pv, size_t cb) {
+  int received = AsyncSocketAdapter::Recv(pv, cb);
+  if (received > 0)
+    bytes_received_ += received;
+  return received;
+}
+
+void RacingSocketAdapter::OnMessage(Message* msg) {
+  ASSERT(MSG_NEXT_ATTEMPT == msg->message_id);
+  StartAttempt();
+}
+
+void RacingSocketAdapter::StartAttempt() {
+  Thread::Current()->Clear(this, MSG_NEXT_ATTEMPT);
+  while (next_ < race_.size()) {
+    const SocketAddress& addr = race_[next_++];
+    AsyncSocket* socket = factory_->CreateAsyncSocket(SOCK_STREAM);
+    if (!socket) {
+      error_ = SOCKET_EACCES;
+      continue;
+    }
+    if ((socket->Connect(addr) < 0) && !socket->IsBlocking()) {
+      LOG(LS_INFO) << "Couldn't start connecting to " << addr.ToString();
+      error_ = socket->GetError();
+      delete socket;
+      continue;
+    }
+    socket->SignalConnectEvent.connect(this,
+        &RacingSocketAdapter::OnAttemptConnect);
+    socket->SignalCloseEvent.connect(this,
+        &RacingSocketAdapter::OnAttemptClose);
+    attempts_.push_back(socket);
+    if (next_ < race_.size())
+      Thread::Current()->PostDelayed(stagger_, this, MSG_NEXT_ATTEMPT);
+    return;
+  }
+  if (attempts_.empty() && connecting_) {
+    connecting_ = false;
+    SignalCloseEvent(this, error_);
+  }
+}
+
+void RacingSocketAdapter::StopAttempts() {
+  Thread::Current()->Clear(this, MSG_NEXT_ATTEMPT);
+  for (size_t i = 0; i < attempts_.size(); ++i) {
+    attempts_[i]->SignalConnectEvent.disconnect(this);
+    attempts_[i]->SignalCloseEvent.disconnect(this);
+    attempts_[i]->Close();
+    // One of them may be signaling.
+    Thread::Current()->Dispose(attempts_[i]);
+  }
+  attempts_.clear();
+}
+
+void RacingSocketAdapter::OnAttemptConnect(AsyncSocket* socket) {
+  std::vector<AsyncSocket*>::iterator it =
+      std::find(attempts_.begin(), attempts_.end(), socket);
+  ASSERT(it != attempts_.end());
+  attempts_.erase(it);
+  socket->SignalConnectEvent.disconnect(this);
+  socket->SignalCloseEvent.disconnect(this);
+  StopAttempts();
+  connecting_ = false;
+  Attach(socket);
+  SignalConnectEvent(this);
+}
+
+void RacingSocketAdapter::OnAttemptClose(AsyncSocket* socket, int err) {
+  std::vector<AsyncSocket*>::iterator it =
+      std::find(attempts_.begin(), attempts_.end(), socket);
+  ASSERT(it != attempts_.end());
+  attempts_.erase(it);
+  socket->SignalConnectEvent.disconnect(this);
+  socket->SignalCloseEvent.disconnect(this);
+  Thread::Current()->Dispose(socket);
+  error_ = err;
+  // The next address needn't wait for the stagger once this one failed.
+  if (next_ < race_.size()) {
+    StartAttempt();
+  } else if (attempts_.empty()) {
+    connecting_ = false;
+    SignalCloseEvent(this, error_);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
 }  // namespace txmpp
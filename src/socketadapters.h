@@ -34,15 +34,20 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include "asyncsocket.h"
 #include "cryptstring.h"
 #include "logging.h"
+#include "messagehandler.h"
+#include "socketaddress.h"
 
 namespace txmpp {
 
 struct HttpAuthContext;
 class ByteBuffer;
+class SocketFactory;
+class WireCapture;
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -62,14 +67,23 @@ class BufferedReadAdapter : public AsyncSocketAdapter {
     return AsyncSocketAdapter::Send(pv, cb);
   }
 
+  // The buffer is only held while input is buffered, and after that until
+  // what was read past the negotiation is passed on, so a negotiated
+  // adapter passes reads straight through.
   void BufferInput(bool on = true);
   virtual void ProcessInput(char* data, size_t* len) = 0;
 
   virtual void OnReadEvent(AsyncSocket * socket);
 
  private:
+  // Takes the buffer, from one another adapter gave back where it can.
+  void AcquireBuffer();
+  void ReleaseBuffer();
+
+  // The data_len_ bytes buffered start data_start_ bytes in, so that Recv
+  // need not move the rest down each time.
   char * buffer_;
-  size_t buffer_size_, data_len_;
+  size_t buffer_size_, data_start_, data_len_;
   bool buffering_;
   DISALLOW_EVIL_CONSTRUCTORS(BufferedReadAdapter);
 };
@@ -240,6 +254,10 @@ class LoggingSocketAdapter : public AsyncSocketAdapter {
   LoggingSocketAdapter(AsyncSocket* socket, LoggingSeverity level,
                  const char * label, bool hex_mode = false);
 
+  // Records the data in |capture| rather than logging it. |capture| must
+  // outlive the adapter.
+  void set_capture(WireCapture* capture);
+
   virtual int Send(const void *pv, size_t cb);
   virtual int SendTo(const void *pv, size_t cb, const SocketAddress& addr);
   virtual int Recv(void *pv, size_t cb);
@@ -251,15 +269,80 @@ class LoggingSocketAdapter : public AsyncSocketAdapter {
   virtual void OnCloseEvent(AsyncSocket * socket, int err);
 
  private:
+  void LogData(bool input, const void* data, size_t len);
+
   LoggingSeverity level_;
   std::string label_;
   bool hex_mode_;
   LogMultilineState lms_;
+  WireCapture* capture_;
+  uint32 connection_;
   DISALLOW_EVIL_CONSTRUCTORS(LoggingSocketAdapter);
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// Implements a socket adapter that connects to whichever of several addresses
+// answers first.  Connect tries its address, and then each address added
+// with AddAddress in turn, starting the next attempt after |stagger|
+// milliseconds or as soon as one fails, as in Happy Eyeballs (RFC 6555).  The
+// first socket to connect is attached and the rest are closed.  Until then
+// the adapter is detached, and only Connect, GetState, GetError and Close
+// may be called.
+class RacingSocketAdapter : public AsyncSocketAdapter, public MessageHandler {
+ public:
+  static const int kDefaultStagger = 250;
+
+  explicit RacingSocketAdapter(SocketFactory* factory,
+                               int stagger = kDefaultStagger);
+  virtual ~RacingSocketAdapter();
+
+  void set_stagger(int stagger) { stagger_ = stagger; }
+  // The addresses raced after the one passed to the next Connect.
+  void AddAddress(const SocketAddress& addr);
+  void ClearAddresses() { addresses_.clear(); }
+
+  virtual int Connect(const SocketAddress& addr);
+  virtual int Close();
+  virtual int GetError() const;
+  virtual void SetError(int error);
+  virtual ConnState GetState() const;
+  // The address of the attempt that connected, or nil before one has.
+  virtual SocketAddress GetRemoteAddress() const;
+  virtual int Send(const void* pv, size_t cb);
+  virtual int Recv(void* pv, size_t cb);
+
+  // The bytes sent and received, over every connection.
+  uint64 bytes_sent() const { return bytes_sent_; }
+  uint64 bytes_received() const { return bytes_received_; }
+
+  virtual void OnMessage(Message* msg);
+
+ private:
+  enum { MSG_NEXT_ATTEMPT };
+
+  // Starts attempts until one is under way, and schedules the next.
+  void StartAttempt();
+  void StopAttempts();
+  void OnAttemptConnect(AsyncSocket* socket);
+  void OnAttemptClose(AsyncSocket* socket, int err);
+
+  SocketFactory* factory_;
+  int stagger_;
+  std::vector<SocketAddress> addresses_;
+  // The addresses of the current Connect, and the next one to try.
+  std::vector<SocketAddress> race_;
+  size_t next_;
+  std::vector<AsyncSocket*> attempts_;
+  bool connecting_;
+  int error_;
+  uint64 bytes_sent_;
+  uint64 bytes_received_;
+  DISALLOW_EVIL_CONSTRUCTORS(RacingSocketAdapter);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
 }  // namespace txmpp
 
 #endif  // _TXMPP_SOCKETADAPTERS_H_
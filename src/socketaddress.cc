@@ -34,9 +34,18 @@
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <sys/un.h>
 #include <unistd.h>
 #endif
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
+#include <stddef.h>
+#include <string.h>
 
+#include <algorithm>
 #include <sstream>
 
 #include "byteorder.h"
@@ -58,57 +67,137 @@ int inet_aton(const char* cp, struct in_addr* inp) {
 
 namespace txmpp {
 
-SocketAddress::SocketAddress() {
+SocketAddress::SocketAddress() : hostname_(NULL) {
   Clear();
 }
 
-SocketAddress::SocketAddress(const std::string& hostname, int port) {
+SocketAddress::SocketAddress(const std::string& hostname, int port)
+    : hostname_(NULL) {
   SetIP(hostname);
   SetPort(port);
 }
 
-SocketAddress::SocketAddress(uint32 ip, int port) {
+SocketAddress::SocketAddress(uint32 ip, int port) : hostname_(NULL) {
   SetIP(ip);
   SetPort(port);
 }
 
-SocketAddress::SocketAddress(const SocketAddress& addr) {
+SocketAddress::SocketAddress(const SocketAddress& addr) : hostname_(NULL) {
   this->operator=(addr);
 }
 
+#if TXMPP_HAS_MOVE
+SocketAddress::SocketAddress(SocketAddress&& addr) noexcept
+    : hostname_(NULL), port_(0), ipv6_(false), unix_(false) {
+  memset(ip_, 0, sizeof(ip_));
+  Swap(&addr);
+}
+
+SocketAddress& SocketAddress::operator=(SocketAddress&& addr) noexcept {
+  Swap(&addr);
+  return *this;
+}
+#endif
+
+SocketAddress::~SocketAddress() {
+  delete hostname_;
+}
+
 void SocketAddress::Clear() {
-  hostname_.clear();
-  ip_ = 0;
+  SetHostname(std::string());
+  memset(ip_, 0, sizeof(ip_));
   port_ = 0;
+  ipv6_ = false;
+  unix_ = false;
 }
 
 bool SocketAddress::IsNil() const {
-  return hostname_.empty() && (0 == ip_) && (0 == port_);
+  return !hostname_ && IsAnyIP() && (0 == port_) && !unix_;
 }
 
 bool SocketAddress::IsComplete() const {
-  return (0 != ip_) && (0 != port_);
+  return unix_ ? (NULL != hostname_) : (!IsAnyIP() && (0 != port_));
 }
 
 SocketAddress& SocketAddress::operator=(const SocketAddress& addr) {
-  hostname_ = addr.hostname_;
-  ip_ = addr.ip_;
-  port_ = addr.port_;
+  if (this != &addr) {
+    SetHostname(addr.hostname());
+    memcpy(ip_, addr.ip_, sizeof(ip_));
+    port_ = addr.port_;
+    ipv6_ = addr.ipv6_;
+    unix_ = addr.unix_;
+  }
   return *this;
 }
 
+void SocketAddress::Swap(SocketAddress* other) {
+  std::swap(hostname_, other->hostname_);
+  for (int i = 0; i < 4; ++i)
+    std::swap(ip_[i], other->ip_[i]);
+  std::swap(port_, other->port_);
+  std::swap(ipv6_, other->ipv6_);
+  std::swap(unix_, other->unix_);
+}
+
 void SocketAddress::SetIP(uint32 ip) {
-  hostname_.clear();
-  ip_ = ip;
+  SetHostname(std::string());
+  SetResolvedIP(ip);
 }
 
 void SocketAddress::SetIP(const std::string& hostname) {
-  hostname_ = hostname;
-  ip_ = StringToIP(hostname);
+  SetHostname(hostname);
+  uint8 bytes[16];
+  std::string::size_type len = hostname.size();
+  // An IPv6 literal isn't kept as the hostname, which would be printed
+  // without its brackets.
+  if (StringToIPv6(hostname, bytes)) {
+    SetIPv6(bytes);
+  } else if ((len > 2) && (hostname[0] == '[') && (hostname[len - 1] == ']')
+             && StringToIPv6(hostname.substr(1, len - 2), bytes)) {
+    SetIPv6(bytes);
+  } else {
+    SetResolvedIP(StringToIP(hostname));
+  }
 }
 
 void SocketAddress::SetResolvedIP(uint32 ip) {
-  ip_ = ip;
+  memset(ip_, 0, sizeof(ip_));
+  ip_[0] = ip;
+  ipv6_ = false;
+  unix_ = false;
+}
+
+void SocketAddress::SetIPv6(const uint8 bytes[16]) {
+  SetHostname(std::string());
+  for (int i = 0; i < 4; ++i)
+    ip_[i] = GetBE32(bytes + 4 * i);
+  ipv6_ = true;
+  unix_ = false;
+}
+
+void SocketAddress::SetUnixPath(const std::string& path) {
+  SetHostname(path);
+  memset(ip_, 0, sizeof(ip_));
+  port_ = 0;
+  ipv6_ = false;
+  unix_ = true;
+}
+
+int SocketAddress::family() const {
+  if (unix_)
+    return AF_UNIX;
+  return ipv6_ ? AF_INET6 : AF_INET;
+}
+
+void SocketAddress::GetIPv6(uint8 bytes[16]) const {
+  if (ipv6_) {
+    for (int i = 0; i < 4; ++i)
+      SetBE32(bytes + 4 * i, ip_[i]);
+  } else {
+    memset(bytes, 0, 10);
+    bytes[10] = bytes[11] = 0xff;
+    SetBE32(bytes + 12, ip_[0]);
+  }
 }
 
 void SocketAddress::SetPort(int port) {
@@ -116,8 +205,13 @@ void SocketAddress::SetPort(int port) {
   port_ = port;
 }
 
+const std::string& SocketAddress::hostname() const {
+  static const std::string kEmpty;
+  return hostname_ ? *hostname_ : kEmpty;
+}
+
 uint32 SocketAddress::ip() const {
-  return ip_;
+  return ipv6_ ? 0 : ip_[0];
 }
 
 uint16 SocketAddress::port() const {
@@ -125,9 +219,43 @@ uint16 SocketAddress::port() const {
 }
 
 std::string SocketAddress::IPAsString() const {
-  if (!hostname_.empty())
-    return hostname_;
-  return IPToString(ip_);
+  if (hostname_)
+    return *hostname_;
+  if (!ipv6_)
+    return IPToString(ip_[0]);
+
+  // RFC 5952: lower case, no leading zeros, and the longest run of two or
+  // more zero groups, the first if tied, as "::".  A mapped IPv4 address
+  // keeps its dotted form.
+  if ((0 == (ip_[0] | ip_[1])) && (0xffff == ip_[2]))
+    return "::ffff:" + IPToString(ip_[3]);
+  uint16 groups[8];
+  for (int i = 0; i < 8; ++i)
+    groups[i] = static_cast<uint16>(ip_[i / 2] >> ((i % 2) ? 0 : 16));
+  int best = -1, best_len = 1;
+  for (int i = 0; i < 8; ) {
+    int j = i;
+    while ((j < 8) && (0 == groups[j]))
+      ++j;
+    if (j - i > best_len) {
+      best = i;
+      best_len = j - i;
+    }
+    i = (j > i) ? j : i + 1;
+  }
+  std::ostringstream ost;
+  ost << std::hex;
+  for (int i = 0; i < 8; ++i) {
+    if (i == best) {
+      ost << "::";
+      i += best_len - 1;
+      continue;
+    }
+    if ((i > 0) && (i != best + best_len))
+      ost << ':';
+    ost << groups[i];
+  }
+  return ost.str();
 }
 
 std::string SocketAddress::PortAsString() const {
@@ -138,14 +266,27 @@ std::string SocketAddress::PortAsString() const {
 
 std::string SocketAddress::ToString() const {
   std::ostringstream ost;
-  ost << IPAsString();
-  ost << ":";
-  ost << port();
+  ost << *this;
   return ost.str();
 }
 
 bool SocketAddress::FromString(const std::string& str) {
-  std::string::size_type pos = str.find(':');
+  std::string::size_type pos;
+  // A path is told from a host named "unix" by how it starts.
+  if ((str.compare(0, 5, "unix:") == 0) && (str.size() > 5) &&
+      ((str[5] == '/') || (str[5] == '.') || (str[5] == '@'))) {
+    SetUnixPath(str.substr(5));
+    return true;
+  }
+  if (!str.empty() && (str[0] == '[')) {
+    pos = str.find("]:");
+    if (std::string::npos == pos)
+      return false;
+    SetPort(strtoul(str.substr(pos + 2).c_str(), NULL, 10));
+    SetIP(str.substr(0, pos + 1));
+    return true;
+  }
+  pos = str.find(':');
   if (std::string::npos == pos)
     return false;
   SetPort(strtoul(str.substr(pos + 1).c_str(), NULL, 10));
@@ -154,19 +295,30 @@ bool SocketAddress::FromString(const std::string& str) {
 }
 
 std::ostream& operator<<(std::ostream& os, const SocketAddress& addr) {
-  os << addr.IPAsString() << ":" << addr.port();
+  if (addr.unix_) {
+    os << "unix:" << addr.hostname();
+  } else if (addr.ipv6_) {
+    os << "[" << addr.IPAsString() << "]:" << addr.port();
+  } else {
+    os << addr.IPAsString() << ":" << addr.port();
+  }
   return os;
 }
 
 bool SocketAddress::IsAnyIP() const {
-  return (ip_ == 0);
+  return (0 == (ip_[0] | ip_[1] | ip_[2] | ip_[3]));
 }
 
 bool SocketAddress::IsLoopbackIP() const {
-  if (0 == ip_) {
-    return (0 == stricmp(hostname_.c_str(), "localhost"));
+  if (unix_) {
+    return true;
+  } else if (IsAnyIP()) {
+    return (NULL != hostname_)
+        && (0 == stricmp(hostname_->c_str(), "localhost"));
+  } else if (ipv6_) {
+    return (0 == (ip_[0] | ip_[1] | ip_[2])) && (1 == ip_[3]);
   } else {
-    return ((ip_ >> 24) == 127);
+    return ((ip_[0] >> 24) == 127);
   }
 }
 
@@ -175,14 +327,14 @@ bool SocketAddress::IsLocalIP() const {
     return true;
 
   std::vector<uint32> ips;
-  if (0 == ip_) {
-    if (!hostname_.empty()
-        && (0 == stricmp(hostname_.c_str(), GetHostname().c_str()))) {
+  if (IsAnyIP()) {
+    if (hostname_
+        && (0 == stricmp(hostname_->c_str(), GetHostname().c_str()))) {
       return true;
     }
-  } else if (GetLocalIPs(ips)) {
+  } else if (!ipv6_ && GetLocalIPs(ips)) {
     for (size_t i = 0; i < ips.size(); ++i) {
-      if (ips[i] == ip_) {
+      if (ips[i] == ip_[0]) {
         return true;
       }
     }
@@ -191,38 +343,47 @@ bool SocketAddress::IsLocalIP() const {
 }
 
 bool SocketAddress::IsPrivateIP() const {
-  return ((ip_ >> 24) == 127) ||
-         ((ip_ >> 24) == 10) ||
-         ((ip_ >> 20) == ((172 << 4) | 1)) ||
-         ((ip_ >> 16) == ((192 << 8) | 168)) ||
-         ((ip_ >> 16) == ((169 << 8) | 254));
+  if (ipv6_) {
+    return IsLoopbackIP() ||
+           ((ip_[0] >> 25) == (0xfc00 >> 9)) ||
+           ((ip_[0] >> 22) == (0xfe80 >> 6));
+  }
+  uint32 ip = ip_[0];
+  return ((ip >> 24) == 127) ||
+         ((ip >> 24) == 10) ||
+         ((ip >> 20) == ((172 << 4) | 1)) ||
+         ((ip >> 16) == ((192 << 8) | 168)) ||
+         ((ip >> 16) == ((169 << 8) | 254));
 }
 
 bool SocketAddress::IsUnresolvedIP() const {
-  return IsAny() && !hostname_.empty();
+  return !unix_ && IsAny() && (NULL != hostname_);
 }
 
 bool SocketAddress::ResolveIP(bool force, int* error) {
-  if (hostname_.empty()) {
+  if (unix_) {
+    return true;
+  } else if (!hostname_) {
     // nothing to resolve
   } else if (!force && !IsAny()) {
     // already resolved
   } else {
-    LOG_F(LS_VERBOSE) << "(" << hostname_ << ")";
+    LOG_F(LS_VERBOSE) << "(" << *hostname_ << ")";
     int errcode = 0;
-    if (hostent* pHost = SafeGetHostByName(hostname_.c_str(), &errcode)) {
-      ip_ = NetworkToHost32(*reinterpret_cast<uint32*>(pHost->h_addr_list[0]));
-      LOG_F(LS_VERBOSE) << "(" << hostname_ << ") resolved to: "
-                        << IPToString(ip_);
+    if (hostent* pHost = SafeGetHostByName(hostname_->c_str(), &errcode)) {
+      SetResolvedIP(
+          NetworkToHost32(*reinterpret_cast<uint32*>(pHost->h_addr_list[0])));
+      LOG_F(LS_VERBOSE) << "(" << *hostname_ << ") resolved to: "
+                        << IPToString(ip_[0]);
       FreeHostEnt(pHost);
     } else {
-      LOG_F(LS_ERROR) << "(" << hostname_ << ") err: " << errcode;
+      LOG_F(LS_ERROR) << "(" << *hostname_ << ") err: " << errcode;
     }
     if (error) {
       *error = errcode;
     }
   }
-  return (ip_ != 0);
+  return !IsAnyIP();
 }
 
 bool SocketAddress::operator==(const SocketAddress& addr) const {
@@ -230,16 +391,22 @@ bool SocketAddress::operator==(const SocketAddress& addr) const {
 }
 
 bool SocketAddress::operator<(const SocketAddress& addr) const {
-  if (ip_ < addr.ip_)
-    return true;
-  else if (addr.ip_ < ip_)
-    return false;
+  if (unix_ != addr.unix_)
+    return !unix_;
+  if (ipv6_ != addr.ipv6_)
+    return !ipv6_;
+  for (int i = 0; i < 4; ++i) {
+    if (ip_[i] < addr.ip_[i])
+      return true;
+    else if (addr.ip_[i] < ip_[i])
+      return false;
+  }
 
   // We only check hostnames if both IPs are zero.  This matches EqualIPs()
-  if (addr.ip_ == 0) {
-    if (hostname_ < addr.hostname_)
+  if (addr.IsAnyIP()) {
+    if (hostname() < addr.hostname())
       return true;
-    else if (addr.hostname_ < hostname_)
+    else if (addr.hostname() < hostname())
       return false;
   }
 
@@ -247,7 +414,9 @@ bool SocketAddress::operator<(const SocketAddress& addr) const {
 }
 
 bool SocketAddress::EqualIPs(const SocketAddress& addr) const {
-  return (ip_ == addr.ip_) && ((ip_ != 0) || (hostname_ == addr.hostname_));
+  return (ipv6_ == addr.ipv6_) && (unix_ == addr.unix_)
+      && (0 == memcmp(ip_, addr.ip_, sizeof(ip_)))
+      && (!IsAnyIP() || EqualHostnames(addr));
 }
 
 bool SocketAddress::EqualPorts(const SocketAddress& addr) const {
@@ -255,23 +424,35 @@ bool SocketAddress::EqualPorts(const SocketAddress& addr) const {
 }
 
 size_t SocketAddress::Hash() const {
-  size_t h = 0;
-  h ^= ip_;
-  h ^= port_ | (port_ << 16);
+  // Each word is mixed in with a multiply by 2^32 / phi, and the high bits
+  // folded back down, which spreads addresses that differ only in their low
+  // bits, as neighbouring hosts and ports do.
+  uint32 h = port_ | (ipv6_ ? 0x10000 : 0) | (unix_ ? 0x20000 : 0);
+  for (int i = 0; i < 4; ++i) {
+    h = (h ^ ip_[i]) * 0x9e3779b1;
+    h ^= h >> 16;
+  }
+  if (hostname_ && IsAnyIP()) {
+    for (std::string::const_iterator it = hostname_->begin();
+         it != hostname_->end(); ++it) {
+      h = (h ^ static_cast<uint8>(*it)) * 0x01000193;
+    }
+    h ^= h >> 16;
+  }
   return h;
 }
 
 size_t SocketAddress::Size_() const {
-  return sizeof(ip_) + sizeof(port_) + 2;
+  return sizeof(ip_[0]) + sizeof(port_) + 2;
 }
 
 bool SocketAddress::Write_(char* buf, int len) const {
-  if (len < static_cast<int>(Size_()))
+  if (ipv6_ || unix_ || (len < static_cast<int>(Size_())))
     return false;
   buf[0] = 0;
   buf[1] = AF_INET;
   SetBE16(buf + 2, port_);
-  SetBE32(buf + 4, ip_);
+  SetBE32(buf + 4, ip_[0]);
   return true;
 }
 
@@ -279,18 +460,22 @@ bool SocketAddress::Read_(const char* buf, int len) {
   if (len < static_cast<int>(Size_()) || buf[1] != AF_INET)
     return false;
   port_ = GetBE16(buf + 2);
-  ip_ = GetBE32(buf + 4);
+  SetResolvedIP(GetBE32(buf + 4));
   return true;
 }
 
 void SocketAddress::ToSockAddr(sockaddr_in* saddr) const {
+  // Only an IPv4 address fits; an IPv6 or Unix one is left as the any
+  // address of no family, which nothing will connect to.
   memset(saddr, 0, sizeof(*saddr));
+  if (ipv6_ || unix_)
+    return;
   saddr->sin_family = AF_INET;
   saddr->sin_port = HostToNetwork16(port_);
-  if (0 == ip_) {
+  if (IsAnyIP()) {
     saddr->sin_addr.s_addr = INADDR_ANY;
   } else {
-    saddr->sin_addr.s_addr = HostToNetwork32(ip_);
+    saddr->sin_addr.s_addr = HostToNetwork32(ip_[0]);
   }
 }
 
@@ -302,6 +487,81 @@ bool SocketAddress::FromSockAddr(const sockaddr_in& saddr) {
   return true;
 }
 
+size_t SocketAddress::ToSockAddrStorage(sockaddr_storage* saddr) const {
+  memset(saddr, 0, sizeof(*saddr));
+#ifdef POSIX
+  if (unix_) {
+    // A path too long for sun_path is cut short, and won't be found.
+    sockaddr_un* saddr_un = reinterpret_cast<sockaddr_un*>(saddr);
+    saddr_un->sun_family = AF_UNIX;
+    const std::string& path = hostname();
+    size_t len = _min(path.size(), sizeof(saddr_un->sun_path) - 1);
+    memcpy(saddr_un->sun_path, path.data(), len);
+#ifdef LINUX
+    // An abstract name is as long as it is, and isn't terminated.
+    if (len > 0 && path[0] == '@') {
+      saddr_un->sun_path[0] = '\0';
+      return offsetof(sockaddr_un, sun_path) + len;
+    }
+#endif
+    return offsetof(sockaddr_un, sun_path) + len + 1;
+  }
+#endif
+  if (!ipv6_) {
+    ToSockAddr(reinterpret_cast<sockaddr_in*>(saddr));
+    return sizeof(sockaddr_in);
+  }
+  sockaddr_in6* saddr6 = reinterpret_cast<sockaddr_in6*>(saddr);
+  saddr6->sin6_family = AF_INET6;
+  saddr6->sin6_port = HostToNetwork16(port_);
+  GetIPv6(reinterpret_cast<uint8*>(&saddr6->sin6_addr));
+  return sizeof(sockaddr_in6);
+}
+
+bool SocketAddress::FromSockAddrStorage(const sockaddr_storage& saddr) {
+  if (saddr.ss_family == AF_INET)
+    return FromSockAddr(reinterpret_cast<const sockaddr_in&>(saddr));
+#ifdef POSIX
+  if (saddr.ss_family == AF_UNIX) {
+    // An unbound socket, as a client's usually is, has an empty path.
+    const sockaddr_un& saddr_un = reinterpret_cast<const sockaddr_un&>(saddr);
+    const char* path = saddr_un.sun_path;
+    size_t max = sizeof(saddr_un.sun_path);
+    if (path[0] == '\0' && path[1] != '\0') {
+      std::string name("@");
+      name.append(path + 1, strnlen(path + 1, max - 1));
+      SetUnixPath(name);
+    } else {
+      SetUnixPath(std::string(path, strnlen(path, max)));
+    }
+    return true;
+  }
+#endif
+  if (saddr.ss_family != AF_INET6)
+    return false;
+  const sockaddr_in6& saddr6 = reinterpret_cast<const sockaddr_in6&>(saddr);
+  SetIPv6(reinterpret_cast<const uint8*>(&saddr6.sin6_addr));
+  SetPort(NetworkToHost16(saddr6.sin6_port));
+  return true;
+}
+
+void SocketAddress::SetHostname(const std::string& hostname) {
+  if (hostname.empty()) {
+    delete hostname_;
+    hostname_ = NULL;
+  } else if (hostname_) {
+    hostname_->assign(hostname);
+  } else {
+    hostname_ = new std::string(hostname);
+  }
+}
+
+bool SocketAddress::EqualHostnames(const SocketAddress& addr) const {
+  if (!hostname_ || !addr.hostname_)
+    return hostname_ == addr.hostname_;
+  return *hostname_ == *addr.hostname_;
+}
+
 std::string SocketAddress::IPToString(uint32 ip) {
   std::ostringstream ost;
   ost << ((ip >> 24) & 0xff);
@@ -328,6 +588,76 @@ uint32 SocketAddress::StringToIP(const std::string& hostname) {
   return ip;
 }
 
+static int SocketAddress_HexValue(char c) {
+  if ((c >= '0') && (c <= '9'))
+    return c - '0';
+  if ((c >= 'a') && (c <= 'f'))
+    return c - 'a' + 10;
+  if ((c >= 'A') && (c <= 'F'))
+    return c - 'A' + 10;
+  return -1;
+}
+
+bool SocketAddress::StringToIPv6(const std::string& str, uint8 bytes[16]) {
+  // Groups of up to four hex digits, at most one "::" for a run of zero
+  // groups, and optionally a dotted IPv4 address for the last 32 bits.
+  uint16 groups[8];
+  int count = 0, gap = -1;
+  size_t i = 0, len = str.size();
+  if ((len >= 2) && (str[0] == ':') && (str[1] == ':')) {
+    gap = 0;
+    i = 2;
+  } else if ((len > 0) && (str[0] == ':')) {
+    return false;
+  }
+  while (i < len) {
+    size_t start = i;
+    uint32 value = 0;
+    while ((i < len) && (i - start < 5) && (SocketAddress_HexValue(str[i]) >= 0))
+      value = (value << 4) | SocketAddress_HexValue(str[i++]);
+    if ((i < len) && (str[i] == '.')) {
+      uint32 ip;
+      if ((count > 6) || !StringToIP(str.substr(start), &ip)
+          || (std::count(str.begin() + start, str.end(), '.') != 3))
+        return false;
+      groups[count++] = static_cast<uint16>(ip >> 16);
+      groups[count++] = static_cast<uint16>(ip);
+      i = len;
+      break;
+    }
+    if ((i == start) || (i - start > 4) || (count == 8))
+      return false;
+    groups[count++] = static_cast<uint16>(value);
+    if (i == len)
+      break;
+    if (str[i] != ':')
+      return false;
+    ++i;
+    if ((i < len) && (str[i] == ':')) {
+      if (gap >= 0)
+        return false;
+      gap = count;
+      ++i;
+    } else if (i == len) {
+      return false;
+    }
+  }
+  if ((gap < 0) ? (count != 8) : (count > 7))
+    return false;
+  int zeros = 8 - count;
+  for (int g = 0, k = 0; g < 8; ++g) {
+    uint16 value = 0;
+    if ((gap >= 0) && (g >= gap) && (g < gap + zeros)) {
+      value = 0;
+    } else {
+      value = groups[k++];
+    }
+    bytes[2 * g] = static_cast<uint8>(value >> 8);
+    bytes[2 * g + 1] = static_cast<uint8>(value);
+  }
+  return true;
+}
+
 std::string SocketAddress::GetHostname() {
   char hostname[256];
   if (gethostname(hostname, ARRAY_SIZE(hostname)) == 0)
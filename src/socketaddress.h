@@ -39,11 +39,15 @@
 #undef SetPort
 
 struct sockaddr_in;
+struct sockaddr_storage;
 
 namespace txmpp {
 
-// Records an IP address and port, which are 32 and 16 bit integers,
-// respectively, both in <b>host byte-order</b>.
+// Records an IP address and port, both in <b>host byte-order</b>.  The IP is
+// IPv4, a 32 bit integer, or IPv6.  A hostname is kept only while one is set,
+// so that copying a resolved address allocates nothing.  An address may
+// instead be the path of a Unix domain socket, kept as the hostname, with
+// no IP or port.
 class SocketAddress {
  public:
   // Creates a nil address.
@@ -61,6 +65,13 @@ class SocketAddress {
 
   // Creates a copy of the given address.
   SocketAddress(const SocketAddress& addr);
+#if TXMPP_HAS_MOVE
+  // Takes the hostname of |addr|, which is left nil.
+  SocketAddress(SocketAddress&& addr) noexcept;
+  SocketAddress& operator=(SocketAddress&& addr) noexcept;
+#endif
+
+  ~SocketAddress();
 
   // Resets to the nil address.
   void Clear();
@@ -74,6 +85,9 @@ class SocketAddress {
   // Replaces our address with the given one.
   SocketAddress& operator=(const SocketAddress& addr);
 
+  // Exchanges the addresses without copying either hostname.
+  void Swap(SocketAddress* other);
+
   // Changes the IP of this address to the given one, and clears the hostname.
   void SetIP(uint32 ip);
 
@@ -85,28 +99,47 @@ class SocketAddress {
   // DNS for a pre-resolved IP.
   void SetResolvedIP(uint32 ip);
 
+  // Changes the IP of this address to the IPv6 one in |bytes|, in network
+  // order, and clears the hostname.
+  void SetIPv6(const uint8 bytes[16]);
+
+  // Changes this to the Unix domain socket at |path|; on Linux, one whose
+  // path starts with '@' is in the abstract namespace.  POSIX only.
+  void SetUnixPath(const std::string& path);
+  bool IsUnix() const { return unix_; }
+  // The socket's path, if IsUnix.
+  const std::string& unix_path() const { return hostname(); }
+
+  // Returns the address family, AF_INET, AF_INET6 or AF_UNIX.
+  int family() const;
+  bool IsIPv6() const { return ipv6_; }
+
+  // Copies the IP, in network order, to |bytes|; an IPv4 one as it maps to
+  // IPv6 (::ffff:a.b.c.d).
+  void GetIPv6(uint8 bytes[16]) const;
+
   // Changes the port of this address to the given one.
   void SetPort(int port);
 
   // Returns the hostname
-  const std::string& hostname() const { return hostname_; }
+  const std::string& hostname() const;
 
-  // Returns the IP address.
+  // Returns the IPv4 address, or 0 for an IPv6 one.
   uint32 ip() const;
 
   // Returns the port part of this address.
   uint16 port() const;
 
-  // Returns the IP address in dotted form.
+  // Returns the IP address in dotted form, or in IPv6 text form.
   std::string IPAsString() const;
 
   // Returns the port as a string
   std::string PortAsString() const;
 
-  // Returns hostname:port
+  // Returns hostname:port, with an IPv6 IP in brackets, or unix:path.
   std::string ToString() const;
 
-  // Parses hostname:port
+  // Parses hostname:port, [IPv6]:port or unix:path.
   bool FromString(const std::string& str);
 
   friend std::ostream& operator<<(std::ostream& os, const SocketAddress& addr);
@@ -117,7 +150,7 @@ class SocketAddress {
   inline bool IsAny() const { return IsAnyIP(); }  // deprecated
 
   // Determines whether the IP address refers to a loopback address, i.e. within
-  // the range 127.0.0.0/8.
+  // the range 127.0.0.0/8.  A Unix domain socket counts as one.
   bool IsLoopbackIP() const;
 
   // Determines wither the IP address refers to any adapter on the local
@@ -125,7 +158,8 @@ class SocketAddress {
   bool IsLocalIP() const;
 
   // Determines whether the IP address is in one of the private ranges:
-  // 127.0.0.0/8 10.0.0.0/8 192.168.0.0/16 172.16.0.0/12.
+  // 127.0.0.0/8 10.0.0.0/8 192.168.0.0/16 172.16.0.0/12, or for IPv6 ::1,
+  // fc00::/7 and fe80::/10.
   bool IsPrivateIP() const;
 
   // Determines whether the hostname has been resolved to an IP.
@@ -152,7 +186,7 @@ class SocketAddress {
   // Determines whether this address has the same port as the one given.
   bool EqualPorts(const SocketAddress& addr) const;
 
-  // Hashes this address into a small number.
+  // Hashes this address into a small number, consistent with ==.
   size_t Hash() const;
 
   // Returns the size of this address when written.
@@ -170,6 +204,13 @@ class SocketAddress {
   // Read this address from a sockaddr_in.
   bool FromSockAddr(const sockaddr_in& saddr);
 
+  // Write this address to a sockaddr_in, sockaddr_in6 or sockaddr_un, as
+  // the family says, and return the size of the one written.
+  size_t ToSockAddrStorage(sockaddr_storage* saddr) const;
+
+  // Read this address from a sockaddr_in, sockaddr_in6 or sockaddr_un.
+  bool FromSockAddrStorage(const sockaddr_storage& saddr);
+
   // Converts the IP address given in compact form into dotted form.
   static std::string IPToString(uint32 ip);
 
@@ -178,6 +219,10 @@ class SocketAddress {
   static bool StringToIP(const std::string& str, uint32* ip);
   static uint32 StringToIP(const std::string& str);  // deprecated
 
+  // Converts the IPv6 address given in text form, without brackets, into
+  // |bytes|, in network order.
+  static bool StringToIPv6(const std::string& str, uint8 bytes[16]);
+
   // Get local machine's hostname
   static std::string GetHostname();
 
@@ -185,9 +230,22 @@ class SocketAddress {
   static bool GetLocalIPs(std::vector<uint32>& ips);
 
  private:
-  std::string hostname_;
-  uint32 ip_;
+  void SetHostname(const std::string& hostname);
+  bool EqualHostnames(const SocketAddress& addr) const;
+
+  // NULL while there is no hostname.
+  std::string* hostname_;
+  // An IPv4 IP is in ip_[0] with the rest 0; an IPv6 one fills all four,
+  // the most significant first.
+  uint32 ip_[4];
   uint16 port_;
+  bool ipv6_;
+  bool unix_;
+};
+
+// For hashed containers keyed by address.
+struct SocketAddressHash {
+  size_t operator()(const SocketAddress& addr) const { return addr.Hash(); }
 };
 
 }  // namespace txmpp
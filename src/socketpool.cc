@@ -31,9 +31,12 @@
 
 #include "asyncsocket.h"
 #include "logging.h"
+#include "metrics.h"
 #include "socketfactory.h"
 #include "socketstream.h"
+#include "ssladapter.h"
 #include "thread.h"
+#include "time.h"
 
 namespace txmpp {
 
@@ -241,6 +244,335 @@ ReuseSocketPool::OnStreamEvent(StreamInterface* stream, int events, int err) {
   stream_->Close();
 }
 
+//////////////////////////////////////////////////////////////////////
+// ConnectionPool
+//////////////////////////////////////////////////////////////////////
+
+// Idle streams may be closed this much after their timeout, so that the
+// timeouts of streams returned at about the same time fire together.
+const int kIdleTimeoutSlack = 1000;
+// A warm host whose streams fail to connect, or close this soon after
+// opening, isn't tried again for this long.
+const int kWarmRetryDelay = 5 * 1000;
+
+enum { MSG_IDLE_TIMEOUT, MSG_REFILL, MSG_REFILL_RETRY };
+
+ConnectionPool::ConnectionPool(SocketFactory* factory)
+    : factory_(factory), thread_(Thread::Current()), max_per_host_(4),
+      max_idle_(32), idle_timeout_(60 * 1000), keepalive_(0),
+      timeout_pending_(false), refill_pending_(false), stats_() {
+}
+
+ConnectionPool::~ConnectionPool() {
+  ASSERT(active_.empty());
+  thread_->Clear(this);
+  for (IdleList::iterator it = idle_.begin(); it != idle_.end(); ++it) {
+    delete it->stream;
+  }
+}
+
+void
+ConnectionPool::Flush() {
+  while (!idle_.empty()) {
+    Evict(--idle_.end(), &Stats::evictions);
+  }
+}
+
+void
+ConnectionPool::Prewarm(const SocketAddress& remote, bool secure,
+                        size_t count) {
+  Key key(remote, secure);
+  count = _min(count, max_per_host_);
+  for (WarmList::iterator it = warm_.begin(); it != warm_.end(); ++it) {
+    if (it->key == key) {
+      if (0 == count) {
+        // Its idle streams are left to the idle timeout.
+        warm_.erase(it);
+        return;
+      }
+      it->count = count;
+      ScheduleRefill(0);
+      return;
+    }
+  }
+  if (0 == count)
+    return;
+  warm_.push_back(WarmHost(key, count));
+  ScheduleRefill(0);
+}
+
+bool
+ConnectionPool::GetHostStats(const SocketAddress& remote, bool secure,
+                             Stats* stats) const {
+  Key key(remote, secure);
+  for (WarmList::const_iterator it = warm_.begin(); it != warm_.end(); ++it) {
+    if (it->key == key) {
+      *stats = it->stats;
+      return true;
+    }
+  }
+  return false;
+}
+
+StreamInterface*
+ConnectionPool::RequestConnectedStream(const SocketAddress& remote, int* err) {
+  return RequestStream(remote, false, err);
+}
+
+StreamInterface*
+ConnectionPool::RequestStream(const SocketAddress& remote, bool secure,
+                              int* err) {
+  Key key(remote, secure);
+  for (IdleList::iterator it = idle_.begin(); it != idle_.end(); ++it) {
+    if (!(it->key == key))
+      continue;
+    // The timeout may not have fired yet.
+    if (TimeSince(it->since) >= idle_timeout_)
+      break;
+    StreamInterface* stream = it->stream;
+    stream->SignalEvent.disconnect(this);
+    idle_.erase(it);
+    active_.insert(ActiveMap::value_type(stream, key));
+    Count(key, &Stats::hits);
+    if (FindWarmHost(key))
+      ScheduleRefill(0);
+    if (err)
+      *err = 0;
+    LOG_F(LS_VERBOSE) << "Reusing connection to: " << remote;
+    return stream;
+  }
+  StreamInterface* stream = CreateStream(key, err);
+  if (!stream)
+    return NULL;
+  active_.insert(ActiveMap::value_type(stream, key));
+  Count(key, &Stats::misses);
+  LOG_F(LS_VERBOSE) << "Opening connection to: " << remote;
+  return stream;
+}
+
+void
+ConnectionPool::ReturnConnectedStream(StreamInterface* stream) {
+  ActiveMap::iterator it = active_.find(stream);
+  if (it == active_.end()) {
+    ASSERT(false);
+    return;
+  }
+  Key key(it->second);
+  active_.erase(it);
+  if ((stream->GetState() == SS_CLOSED) || (0 == max_per_host_)
+      || (0 == max_idle_)) {
+    stream->Close();
+    thread_->Dispose(stream);
+    return;
+  }
+  // Until the stream is reused, watch for the peer closing it.
+  stream->SignalEvent.connect(this, &ConnectionPool::OnStreamEvent);
+  idle_.push_front(IdleStream(key, stream, Time()));
+  Trim(key);
+  ScheduleTimeout();
+}
+
+void
+ConnectionPool::OnMessage(Message* msg) {
+  switch (msg->message_id) {
+  case MSG_IDLE_TIMEOUT:
+    timeout_pending_ = false;
+    while (!idle_.empty()
+           && (TimeSince(idle_.back().since) >= idle_timeout_)) {
+      Evict(--idle_.end(), &Stats::evictions);
+    }
+    ScheduleTimeout();
+    break;
+  case MSG_REFILL:
+    refill_pending_ = false;
+    Refill();
+    break;
+  case MSG_REFILL_RETRY:
+    Refill();
+    break;
+  }
+}
+
+StreamInterface*
+ConnectionPool::CreateStream(const Key& key, int* err) {
+  AsyncSocket* socket = factory_->CreateAsyncSocket(SOCK_STREAM);
+  if (!socket) {
+    ASSERT(false);
+    if (err)
+      *err = -1;
+    return NULL;
+  }
+  if (key.secure) {
+    SSLAdapter* ssl_adapter = SSLAdapter::Create(socket);
+    if (!ssl_adapter) {
+      LOG_F(LS_ERROR) << "SSL unavailable";
+      delete socket;
+      if (err)
+        *err = -1;
+      return NULL;
+    }
+    const std::string& hostname = key.address.hostname();
+    ssl_adapter->StartSSL(hostname.empty() ? key.address.IPAsString().c_str()
+                                           : hostname.c_str(), false);
+    socket = ssl_adapter;
+  }
+  if ((keepalive_ > 0)
+      && (socket->SetOption(Socket::OPT_KEEPALIVE, keepalive_) != 0)) {
+    LOG_F(LS_WARNING) << "Couldn't set keepalive";
+  }
+  if ((socket->Connect(key.address) != 0) && !socket->IsBlocking()) {
+    if (err)
+      *err = socket->GetError();
+    delete socket;
+    return NULL;
+  }
+  if (err)
+    *err = 0;
+  return new SocketStream(socket);
+}
+
+void
+ConnectionPool::Trim(const Key& key) {
+  size_t count = 0;
+  IdleList::iterator it = idle_.begin();
+  while (it != idle_.end()) {
+    IdleList::iterator current = it++;
+    if ((current->key == key) && (++count > max_per_host_)) {
+      Evict(current, &Stats::evictions);
+    }
+  }
+  while (idle_.size() > max_idle_) {
+    Evict(--idle_.end(), &Stats::evictions);
+  }
+}
+
+void
+ConnectionPool::Evict(IdleList::iterator it, size_t Stats::* field) {
+  Key key(it->key);
+  StreamInterface* stream = it->stream;
+  if (it->warm)
+    Count(key, &Stats::unused);
+  Count(key, field);
+  idle_.erase(it);
+  stream->SignalEvent.disconnect(this);
+  stream->Close();
+  thread_->Dispose(stream);
+  if (FindWarmHost(key))
+    ScheduleRefill(0);
+}
+
+ConnectionPool::WarmHost*
+ConnectionPool::FindWarmHost(const Key& key) {
+  for (WarmList::iterator it = warm_.begin(); it != warm_.end(); ++it) {
+    if (it->key == key)
+      return &*it;
+  }
+  return NULL;
+}
+
+void
+ConnectionPool::Count(const Key& key, size_t Stats::* field) {
+  ++(stats_.*field);
+  if (field == &Stats::hits) {
+    LibraryMetrics::Add(LibraryMetrics::LM_HTTP_POOL_HITS);
+  } else if (field == &Stats::misses) {
+    LibraryMetrics::Add(LibraryMetrics::LM_HTTP_POOL_MISSES);
+  }
+  if (WarmHost* host = FindWarmHost(key))
+    ++(host->stats.*field);
+}
+
+void
+ConnectionPool::Refill() {
+  uint32 now = Time();
+  int retry = -1;
+  for (WarmList::iterator host = warm_.begin(); host != warm_.end(); ++host) {
+    if (host->backoff) {
+      int wait = TimeDiff(host->retry_at, now);
+      if (wait > 0) {
+        retry = (retry < 0) ? wait : _min(retry, wait);
+        continue;
+      }
+      host->backoff = false;
+    }
+    size_t have = 0;
+    for (IdleList::iterator it = idle_.begin(); it != idle_.end(); ++it) {
+      if (it->key == host->key)
+        ++have;
+    }
+    for (; (have < host->count) && (idle_.size() < max_idle_); ++have) {
+      int err;
+      StreamInterface* stream = CreateStream(host->key, &err);
+      if (!stream) {
+        LOG_F(LS_WARNING) << "Couldn't open connection to "
+                          << host->key.address << ": " << err;
+        host->backoff = true;
+        host->retry_at = now + kWarmRetryDelay;
+        retry = (retry < 0) ? kWarmRetryDelay : _min(retry, kWarmRetryDelay);
+        break;
+      }
+      LOG_F(LS_VERBOSE) << "Warming connection to: " << host->key.address;
+      stream->SignalEvent.connect(this, &ConnectionPool::OnStreamEvent);
+      idle_.push_front(IdleStream(host->key, stream, now, true,
+                                  SS_OPENING == stream->GetState()));
+      Count(host->key, &Stats::warmed);
+    }
+  }
+  if (retry >= 0)
+    ScheduleRefill(retry);
+  ScheduleTimeout();
+}
+
+void
+ConnectionPool::ScheduleRefill(int delay) {
+  if (delay > 0) {
+    thread_->Reschedule(delay, this, MSG_REFILL_RETRY);
+  } else if (!refill_pending_) {
+    refill_pending_ = true;
+    thread_->Post(this, MSG_REFILL);
+  }
+}
+
+void
+ConnectionPool::ScheduleTimeout() {
+  if (timeout_pending_ || idle_.empty())
+    return;
+  timeout_pending_ = true;
+  thread_->PostAt(idle_.back().since + idle_timeout_, this, MSG_IDLE_TIMEOUT,
+                  NULL, kIdleTimeoutSlack);
+}
+
+void
+ConnectionPool::OnStreamEvent(StreamInterface* stream, int events, int err) {
+  // A write event may follow a request that was written just before the
+  // stream was returned.
+  if (events == SE_WRITE)
+    return;
+  for (IdleList::iterator it = idle_.begin(); it != idle_.end(); ++it) {
+    if (stream != it->stream)
+      continue;
+    if (it->connecting && !(events & SE_CLOSE)) {
+      // A warmed stream finished connecting.
+      if (events & SE_OPEN)
+        it->connecting = false;
+      return;
+    }
+    // The peer closed the stream, or sent data nobody will read.
+    LOG_F(LS_VERBOSE) << "Idle connection to " << it->key.address
+                      << " closed: " << events << ", " << err;
+    if (it->warm && (TimeSince(it->since) < kWarmRetryDelay)) {
+      // Don't keep reopening streams the server won't keep.
+      if (WarmHost* host = FindWarmHost(it->key)) {
+        host->backoff = true;
+        host->retry_at = TimeAfter(kWarmRetryDelay);
+      }
+    }
+    Evict(it, &Stats::closed);
+    return;
+  }
+  ASSERT(false);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // LoggingPoolAdapter - Adapts a StreamPool to supply streams with attached
 // LoggingAdapters.
@@ -261,7 +593,12 @@ LoggingPoolAdapter::~LoggingPoolAdapter() {
 
 StreamInterface* LoggingPoolAdapter::RequestConnectedStream(
     const SocketAddress& remote, int* err) {
-  if (StreamInterface* stream = pool_->RequestConnectedStream(remote, err)) {
+  return RequestStream(remote, false, err);
+}
+
+StreamInterface* LoggingPoolAdapter::RequestStream(
+    const SocketAddress& remote, bool secure, int* err) {
+  if (StreamInterface* stream = pool_->RequestStream(remote, secure, err)) {
     ASSERT(SS_CLOSED != stream->GetState());
     std::stringstream ss;
     ss << label_ << "(0x" << std::setfill('0') << std::hex << std::setw(8)
@@ -34,7 +34,9 @@
 
 #include <deque>
 #include <list>
+#include <map>
 #include "logging.h"
+#include "messagehandler.h"
 #include "sigslot.h"
 #include "socketaddress.h"
 
@@ -45,6 +47,7 @@ class LoggingAdapter;
 class SocketFactory;
 class SocketStream;
 class StreamInterface;
+class Thread;
 
 //////////////////////////////////////////////////////////////////////
 // StreamPool
@@ -56,6 +59,13 @@ public:
 
   virtual StreamInterface* RequestConnectedStream(const SocketAddress& remote,
                                                   int* err) = 0;
+  // Like RequestConnectedStream, for a stream that uses TLS if |secure| is
+  // set.  Pools that don't make TLS streams themselves leave that to their
+  // socket factory, as before.
+  virtual StreamInterface* RequestStream(const SocketAddress& remote,
+                                         bool secure, int* err) {
+    return RequestConnectedStream(remote, err);
+  }
   virtual void ReturnConnectedStream(StreamInterface* stream) = 0;
 };
 
@@ -132,6 +142,141 @@ private:
   bool checked_out_;  // Whether the stream is currently checked out
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// ConnectionPool
+// Keeps idle streams to any number of servers, keyed by address and by
+// whether they use TLS, and hands out the most recently returned first.
+// Streams to servers named with Prewarm are opened before they are asked for.
+// One pool may be shared by the HttpClients on its thread.
+///////////////////////////////////////////////////////////////////////////////
+
+class ConnectionPool : public StreamPool, public MessageHandler,
+                       public txmpp::has_slots<> {
+public:
+  struct Stats {
+    size_t hits;       // Requests given an idle stream
+    size_t misses;     // Requests given a new stream
+    size_t evictions;  // Idle streams closed for a limit or the idle timeout
+    size_t closed;     // Idle streams the peer closed or wrote to
+    size_t warmed;     // Streams opened by Prewarm
+    size_t unused;     // Of those, the ones closed before a request took them
+  };
+
+  explicit ConnectionPool(SocketFactory* factory);
+  virtual ~ConnectionPool();
+
+  // At most this many idle streams are kept for one server, and at most
+  // max_idle in all; the least recently returned are closed first.  The
+  // defaults are 4 and 32.
+  void set_max_per_host(size_t max) { max_per_host_ = max; }
+  size_t max_per_host() const { return max_per_host_; }
+  void set_max_idle(size_t max) { max_idle_ = max; }
+  size_t max_idle() const { return max_idle_; }
+  // Idle streams are closed after this many milliseconds.  The default is a
+  // minute.
+  void set_idle_timeout(int timeout) { idle_timeout_ = timeout; }
+  int idle_timeout() const { return idle_timeout_; }
+
+  // Keeps |count| streams to |remote| open, or opening, before they are
+  // asked for, and opens others as requests take them or they close.  At
+  // most max_per_host are kept, and none past max_idle; a server that can't
+  // be reached is tried again after a few seconds.  A count of 0 stops.
+  // Warmed streams still idle at the idle timeout are replaced, so one a
+  // little under the server's keeps them ready.
+  void Prewarm(const SocketAddress& remote, bool secure, size_t count);
+  // Idle streams this pool opens afterwards send TCP keepalive probes after
+  // this many seconds, so that a peer or middlebox that has gone away is
+  // noticed before a request is sent on the stream.  The default is 0, none.
+  void set_keepalive(int seconds) { keepalive_ = seconds; }
+  int keepalive() const { return keepalive_; }
+
+  const Stats& stats() const { return stats_; }
+  // Fills |stats| with the counts for a server named with Prewarm.  Returns
+  // false for others.
+  bool GetHostStats(const SocketAddress& remote, bool secure,
+                    Stats* stats) const;
+  // The share of requests given an idle stream, or 0 before any.
+  static double HitRate(const Stats& stats) {
+    size_t requests = stats.hits + stats.misses;
+    return requests ? static_cast<double>(stats.hits) / requests : 0;
+  }
+  size_t active_count() const { return active_.size(); }
+  size_t idle_count() const { return idle_.size(); }
+  // Closes all the idle streams.
+  void Flush();
+
+  // StreamPool Interface
+  virtual StreamInterface* RequestConnectedStream(const SocketAddress& remote,
+                                                  int* err);
+  virtual StreamInterface* RequestStream(const SocketAddress& remote,
+                                         bool secure, int* err);
+  virtual void ReturnConnectedStream(StreamInterface* stream);
+
+  // MessageHandler Interface
+  virtual void OnMessage(Message* msg);
+
+private:
+  struct Key {
+    Key(const SocketAddress& address, bool secure)
+        : address(address), secure(secure) { }
+    bool operator==(const Key& key) const {
+      return (secure == key.secure) && (address == key.address);
+    }
+    SocketAddress address;
+    bool secure;
+  };
+  struct IdleStream {
+    IdleStream(const Key& key, StreamInterface* stream, uint32 since,
+               bool warm = false, bool connecting = false)
+        : key(key), stream(stream), since(since), warm(warm),
+          connecting(connecting) { }
+    Key key;
+    StreamInterface* stream;
+    uint32 since;
+    // Opened by Prewarm and not yet used, and still connecting.
+    bool warm, connecting;
+  };
+  struct WarmHost {
+    WarmHost(const Key& key, size_t count)
+        : key(key), count(count), stats(), retry_at(0), backoff(false) { }
+    Key key;
+    size_t count;
+    Stats stats;
+    // After a failed connect, no more are opened before retry_at.
+    uint32 retry_at;
+    bool backoff;
+  };
+  // Most recently returned first, so the oldest is at the back.
+  typedef std::list<IdleStream> IdleList;
+  typedef std::map<StreamInterface*, Key> ActiveMap;
+  typedef std::list<WarmHost> WarmList;
+
+  StreamInterface* CreateStream(const Key& key, int* err);
+  WarmHost* FindWarmHost(const Key& key);
+  // Adds to the counter |field| of stats_, and of the host's, if warm.
+  void Count(const Key& key, size_t Stats::* field);
+  // Opens streams for the warm hosts that are short of them.
+  void Refill();
+  void ScheduleRefill(int delay);
+  // Closes the idle streams over the limits, once one for |key| is added.
+  void Trim(const Key& key);
+  // Closes an idle stream, drops it from the list, and counts it under
+  // |field|.
+  void Evict(IdleList::iterator it, size_t Stats::* field);
+  void ScheduleTimeout();
+  void OnStreamEvent(StreamInterface* stream, int events, int err);
+
+  SocketFactory* factory_;
+  Thread* thread_;
+  size_t max_per_host_, max_idle_;
+  int idle_timeout_, keepalive_;
+  bool timeout_pending_, refill_pending_;
+  ActiveMap active_;
+  IdleList idle_;
+  WarmList warm_;
+  Stats stats_;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // LoggingPoolAdapter - Adapts a StreamPool to supply streams with attached
 // LoggingAdapters.
@@ -146,6 +291,8 @@ public:
   // StreamPool Interface
   virtual StreamInterface* RequestConnectedStream(const SocketAddress& remote,
                                                   int* err);
+  virtual StreamInterface* RequestStream(const SocketAddress& remote,
+                                         bool secure, int* err);
   virtual void ReturnConnectedStream(StreamInterface* stream);
 
 private:
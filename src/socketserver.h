@@ -32,12 +32,55 @@
 #include "config.h"
 #endif
 
+#include "dispatchstats.h"
 #include "socketfactory.h"
 
+// Define SOCKETSERVER_TELEMETRY to 0 to compile out the recording of
+// SocketServerTelemetry; the counters then stay zero.
+#if !defined(SOCKETSERVER_TELEMETRY)
+#define SOCKETSERVER_TELEMETRY 1
+#endif
+
 namespace txmpp {
 
 class MessageQueue;
 
+// What a socket server's Wait loop spends its time on.  Recorded by the
+// thread in Wait, and readable from any thread.
+struct SocketServerTelemetry {
+  SocketServerTelemetry() : event_start(0) {}
+
+  struct Snapshot {
+    Histogram::Snapshot wait;
+    Histogram::Snapshot ready;
+    Histogram::Snapshot callback;
+    Histogram::Snapshot spin;
+  };
+
+  void GetSnapshot(Snapshot* snapshot) const {
+    wait.GetSnapshot(&snapshot->wait);
+    ready.GetSnapshot(&snapshot->ready);
+    callback.GetSnapshot(&snapshot->callback);
+    spin.GetSnapshot(&snapshot->spin);
+  }
+  void Reset() {
+    wait.Reset();
+    ready.Reset();
+    callback.Reset();
+    spin.Reset();
+  }
+
+  Histogram wait;      // Microseconds blocked in the OS, per system call.
+  Histogram ready;     // Descriptors or completions ready, per wakeup.
+  Histogram callback;  // Microseconds in each socket event handler.
+  Histogram spin;      // Microseconds busy polling, per wait that spun
+                       // (see PhysicalSocketServer::SetBusyPoll).
+  // The TimeMicros() the socket event being handled was dispatched at, or
+  // 0 outside one, for StanzaStats to time input from.  Only read on the
+  // thread in Wait.
+  uint64 event_start;
+};
+
 // Provides the ability to wait for activity on a set of sockets.  The Thread
 // class provides a nice wrapper on a socket server.
 //
@@ -58,6 +101,13 @@ class SocketServer : public SocketFactory {
 
   // Causes the current wait (if one is in progress) to wake up.
   virtual void WakeUp() = 0;
+
+  // Servers that do not wait on the OS leave it empty.
+  const SocketServerTelemetry& telemetry() const { return telemetry_; }
+  SocketServerTelemetry& telemetry() { return telemetry_; }
+
+ protected:
+  SocketServerTelemetry telemetry_;
 };
 
 }  // namespace txmpp
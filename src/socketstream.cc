@@ -109,6 +109,60 @@ StreamResult SocketStream::Write(const void* data, size_t data_len,
   return SR_SUCCESS;
 }
 
+StreamResult SocketStream::ReadV(const MutableIoVec* vec, size_t count,
+                                 size_t* read, int* error) {
+  ASSERT(socket_ != NULL);
+  int result = socket_->RecvV(vec, count);
+  if (result < 0) {
+    if (socket_->IsBlocking())
+      return SR_BLOCK;
+    if (error)
+      *error = socket_->GetError();
+    return SR_ERROR;
+  }
+  size_t wanted = 0;
+  for (size_t i = 0; i < count; ++i)
+    wanted += vec[i].len;
+  if ((result > 0) || (wanted == 0)) {
+    if (read)
+      *read = result;
+    return SR_SUCCESS;
+  }
+  return SR_EOS;
+}
+
+StreamResult SocketStream::WriteV(const IoVec* vec, size_t count,
+                                  size_t* written, int* error) {
+  ASSERT(socket_ != NULL);
+  int result = socket_->SendV(vec, count);
+  if (result < 0) {
+    if (socket_->IsBlocking())
+      return SR_BLOCK;
+    if (error)
+      *error = socket_->GetError();
+    return SR_ERROR;
+  }
+  if (written)
+    *written = result;
+  return SR_SUCCESS;
+}
+
+StreamResult SocketStream::WriteFile(int fd, size_t offset, size_t len,
+                                     size_t* written, int* error) {
+  ASSERT(socket_ != NULL);
+  int result = socket_->SendFile(fd, offset, len);
+  if (result < 0) {
+    if (socket_->IsBlocking())
+      return SR_BLOCK;
+    if (error)
+      *error = socket_->GetError();
+    return SR_ERROR;
+  }
+  if (written)
+    *written = result;
+  return SR_SUCCESS;
+}
+
 void SocketStream::Close() {
   ASSERT(socket_ != NULL);
   socket_->Close();
@@ -58,6 +58,15 @@ class SocketStream : public StreamInterface, public has_slots<> {
   virtual StreamResult Write(const void* data, size_t data_len,
                              size_t* written, int* error);
 
+  // Go to the socket's RecvV and SendV.
+  virtual StreamResult ReadV(const MutableIoVec* vec, size_t count,
+                             size_t* read, int* error);
+  virtual StreamResult WriteV(const IoVec* vec, size_t count,
+                              size_t* written, int* error);
+  // Goes to the socket's SendFile.
+  virtual StreamResult WriteFile(int fd, size_t offset, size_t len,
+                                 size_t* written, int* error);
+
   virtual void Close();
 
  private:
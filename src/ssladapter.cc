@@ -77,6 +77,10 @@ bool CleanupSSL() {
   return OpenSSLAdapter::CleanupSSL();
 }
 
+bool PrewarmSSL() {
+  return OpenSSLAdapter::Prewarm();
+}
+
 #else  // !SSL_USE_OPENSSL
 
 bool InitializeSSL(VerificationCallback callback) {
@@ -91,6 +95,10 @@ bool CleanupSSL() {
   return true;
 }
 
+bool PrewarmSSL() {
+  return true;
+}
+
 #endif  // !SSL_USE_OPENSSL
 
 ///////////////////////////////////////////////////////////////////////////////
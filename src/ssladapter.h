@@ -32,6 +32,9 @@
 #include "config.h"
 #endif
 
+#include <string>
+#include <vector>
+
 #include "asyncsocket.h"
 
 namespace txmpp {
@@ -51,28 +54,54 @@ public:
   // negotiation will begin as soon as the socket connects.
   virtual int StartSSL(const char* hostname, bool restartable) = 0;
 
+  // The protocols offered to the server by ALPN, most preferred first, such
+  // as "h2" and "http/1.1". Must be set before the negotiation begins.
+  // None are offered by default.
+  void set_alpn_protocols(const std::vector<std::string>& protocols) {
+    alpn_protocols_ = protocols;
+  }
+  const std::vector<std::string>& alpn_protocols() const {
+    return alpn_protocols_;
+  }
+  // The protocol the server picked from those offered, once connected, or
+  // empty if it picked none or the implementation can't offer any.
+  virtual std::string GetAlpnProtocol() const { return std::string(); }
+
+  // Frees the buffers the connection keeps between records, as for one gone
+  // idle, where the implementation can. Returns the bytes freed, as far as
+  // it can tell.
+  virtual size_t TrimMemory() { return 0; }
+
   // Create the default SSL adapter for this platform
   static SSLAdapter* Create(AsyncSocket* socket);
 
 private:
   // If true, the server certificate need not match the configured hostname.
   bool ignore_bad_cert_;
+  std::vector<std::string> alpn_protocols_;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
 typedef bool (*VerificationCallback)(void* cert);
 
-// Call this on the main thread, before using SSL.
-// Call CleanupSSLThread when finished with SSL.
+// Sets the callback that verifies server certificates, and sets up SSL if
+// it isn't yet. Setting up is otherwise done on first use, from whichever
+// thread gets there first, so there is no need to call this without a
+// callback. Call CleanupSSL when finished with SSL.
 bool InitializeSSL(VerificationCallback callback = NULL);
 
 // Call to initialize additional threads.
 bool InitializeSSLThread();
 
-// Call to cleanup additional threads, and also the main thread.
+// Call to cleanup additional threads, and also the main thread. No
+// connection may still be using SSL.
 bool CleanupSSL();
 
+// Does the setup that the first connection would otherwise wait on, as a
+// long-running service may want to at startup. Short-lived tools need not.
+bool PrewarmSSL();
+
 ///////////////////////////////////////////////////////////////////////////////
 
 }  // namespace txmpp
@@ -55,8 +55,33 @@ SSLCertificate* SSLCertificate::FromPEMString(const std::string& pem_string,
   return OpenSSLCertificate::FromPEMString(pem_string, pem_length);
 }
 
-SSLIdentity* SSLIdentity::Generate(const std::string& common_name) {
-  return OpenSSLIdentity::Generate(common_name);
+SSLIdentity* SSLIdentity::Generate(const std::string& common_name,
+                                   KeyType key_type) {
+  return OpenSSLIdentity::Generate(common_name, key_type);
+}
+
+void SSLIdentity::SetKeyPoolSize(KeyType key_type, size_t count) {
+  OpenSSLKeyPair::SetPoolSize(key_type, count);
+}
+
+SSLIdentityGenerator::SSLIdentityGenerator(const std::string& common_name,
+                                           KeyType key_type)
+    : common_name_(common_name), key_type_(key_type), identity_(NULL) {
+  SetName("SSLIdentityGenerator", this);
+}
+
+SSLIdentityGenerator::~SSLIdentityGenerator() {
+  delete identity_;
+}
+
+SSLIdentity* SSLIdentityGenerator::ReleaseIdentity() {
+  SSLIdentity* identity = identity_;
+  identity_ = NULL;
+  return identity;
+}
+
+void SSLIdentityGenerator::DoWork() {
+  identity_ = SSLIdentity::Generate(common_name_, key_type_);
 }
 
 }  // namespace txmpp
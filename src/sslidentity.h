@@ -36,11 +36,21 @@
 
 #include <string>
 
+#include "signalthread.h"
+
 namespace txmpp {
 
 // Abstract interface overridden by SSL library specific
 // implementations.
 
+// The kind of key an identity is generated with.
+enum KeyType {
+  KT_RSA,    // 1024 bits, which takes up to hundreds of milliseconds.
+  KT_ECDSA,  // On the P-256 curve, which takes well under a millisecond.
+  KT_LAST = KT_ECDSA,
+  KT_DEFAULT = KT_RSA
+};
+
 // A somewhat opaque type used to encapsulate a certificate.
 // Wraps the SSL library's notion of a certificate, with reference counting.
 // The SSLCertificate object is pretty much immutable once created.
@@ -77,7 +87,13 @@ class SSLIdentity {
   // subject and issuer name, otherwise a random string will be used.
   // Returns NULL on failure.
   // Caller is responsible for freeing the returned object.
-  static SSLIdentity* Generate(const std::string& common_name);
+  static SSLIdentity* Generate(const std::string& common_name,
+                               KeyType key_type = KT_DEFAULT);
+
+  // Keeps up to |count| keys of |key_type| made ahead of time by a
+  // background thread, for Generate to take instead of making one while
+  // the caller waits.  A |count| of 0, the default, frees the spare keys.
+  static void SetKeyPoolSize(KeyType key_type, size_t count);
 
   virtual ~SSLIdentity() {}
 
@@ -90,6 +106,26 @@ class SSLIdentity {
   virtual SSLCertificate& certificate() const = 0;
 };
 
+// Generates an SSLIdentity on a worker thread, for callers that can't wait
+// for the key, such as the network thread.  Start it, and on SignalWorkDone
+// take the result with ReleaseIdentity before calling Release.
+class SSLIdentityGenerator : public SignalThread {
+ public:
+  SSLIdentityGenerator(const std::string& common_name, KeyType key_type);
+
+  // The identity generated, or NULL if that failed.  The caller owns it.
+  SSLIdentity* ReleaseIdentity();
+
+ protected:
+  virtual ~SSLIdentityGenerator();
+  virtual void DoWork();
+
+ private:
+  std::string common_name_;
+  KeyType key_type_;
+  SSLIdentity* identity_;
+};
+
 }  // namespace txmpp
 
 #endif  // _TXMPP_SSLIDENTITY_H_
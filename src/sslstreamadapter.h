@@ -116,6 +116,11 @@ class SSLStreamAdapter : public StreamAdapterInterface {
   // given SSLStream instance.
   virtual void SetPeerCertificate(SSLCertificate* cert) = 0;
 
+  // Frees the buffers the stream keeps between records, as for one gone
+  // idle, where the implementation can. Returns the bytes freed, as far as
+  // it can tell.
+  virtual size_t TrimMemory() { return 0; }
+
   // If true, the server certificate need not match the configured
   // server_name, and in fact missing certificate authority and other
   // verification errors are ignored.
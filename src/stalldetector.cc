@@ -0,0 +1,283 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stalldetector.h"
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef POSIX
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+#endif
+
+#include "common.h"
+#include "criticalsection.h"
+#include "logging.h"
+#include "metrics.h"
+#include "time.h"
+
+namespace txmpp {
+
+#if defined(POSIX) && defined(HAVE_EXECINFO_H)
+
+// One stack is sampled at a time, by any detector, into these.  The
+// signal handler only fills in a sample for the request and thread it was
+// sent for, so that one delivered late is dropped.
+namespace {
+
+enum { kMaxSampleFrames = 48 };
+// The signal handler's frame and the signal trampoline's.
+const int kHandlerFrames = 2;
+
+CriticalSection g_sample_crit;
+bool g_handler_installed = false;
+uint32 g_sample_gen = 0;
+volatile uint32 g_sample_request = 0;
+volatile uint32 g_sample_done = 0;
+pthread_t g_sample_thread;
+void* g_sample_frames[kMaxSampleFrames];
+volatile int g_sample_size = 0;
+
+void OnSampleSignal(int) {
+  uint32 request = AtomicOps::AcquireLoad(&g_sample_request);
+  if (!request || !pthread_equal(pthread_self(), g_sample_thread))
+    return;
+  int saved_errno = errno;
+  g_sample_size = backtrace(g_sample_frames, kMaxSampleFrames);
+  AtomicOps::ReleaseStore(&g_sample_done, request);
+  errno = saved_errno;
+}
+
+// Installs the handler once.  backtrace is called first, here, as its first
+// call loads libgcc, which a signal handler must not do.
+bool InstallSampleHandler() {
+  CritScope cs(&g_sample_crit);
+  if (g_handler_installed)
+    return true;
+  void* frame;
+  backtrace(&frame, 1);
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  sigemptyset(&act.sa_mask);
+  act.sa_handler = OnSampleSignal;
+  // As with PhysicalSocketServer's signals, so that the sampled thread's
+  // system calls don't fail with EINTR.
+  act.sa_flags = SA_RESTART;
+  if (sigaction(StallDetector::SampleSignal(), &act, NULL) != 0) {
+    LOG_ERR(LS_ERROR) << "Couldn't install the stall sampling handler";
+    return false;
+  }
+  g_handler_installed = true;
+  return true;
+}
+
+}  // namespace
+
+#endif  // POSIX && HAVE_EXECINFO_H
+
+StallDetector::StallDetector(int threshold_ms)
+    : threshold_ms_(_max(threshold_ms, 1)), depth_(0), next_seq_(0),
+      reported_seq_(0), stalls_(0), wake_(false, false) {
+  for (int i = 0; i < kMaxDepth; ++i) {
+    frames_[i].seq = 0;
+    frames_[i].kind = SK_MESSAGE;
+    frames_[i].type = NULL;
+    frames_[i].id = 0;
+    frames_[i].start = 0;
+  }
+#ifdef POSIX
+  thread_ = pthread_self();
+#endif
+}
+
+StallDetector::~StallDetector() {
+  Stop();
+}
+
+const char* StallDetector::KindName(Kind kind) {
+  switch (kind) {
+    case SK_MESSAGE: return "message";
+    case SK_SOCKET_EVENT: return "socket event";
+    case SK_TASK: return "task";
+    default: return "unknown";
+  }
+}
+
+#ifdef POSIX
+int StallDetector::SampleSignal() {
+#ifdef SIGRTMIN
+  return SIGRTMIN + 5;
+#else
+  return SIGUSR2;
+#endif
+}
+#endif
+
+bool StallDetector::Start() {
+#if defined(POSIX) && defined(HAVE_EXECINFO_H)
+  InstallSampleHandler();
+#endif
+  if (!watchdog_.get()) {
+    watchdog_.reset(new Thread);
+    watchdog_->SetName("StallDetector", this);
+    if (!watchdog_->Start(this)) {
+      watchdog_.reset();
+      return false;
+    }
+  }
+  return true;
+}
+
+void StallDetector::Stop() {
+  if (watchdog_.get()) {
+    watchdog_->Quit();
+    wake_.Set();
+    watchdog_->Stop();
+    watchdog_.reset();
+  }
+}
+
+void StallDetector::Begin(Kind kind, const char* type, uint32 id) {
+  uint32 depth = depth_;
+  if (depth < kMaxDepth) {
+    Frame* frame = &frames_[depth];
+#ifdef POSIX
+    if (depth == 0)
+      thread_ = pthread_self();
+#endif
+    frame->kind = kind;
+    frame->type = type;
+    frame->id = id;
+    frame->start = TimeMicros();
+    if (++next_seq_ == 0)
+      ++next_seq_;
+    AtomicOps::ReleaseStore(&frame->seq, next_seq_);
+  }
+  AtomicOps::ReleaseStore(&depth_, depth + 1);
+}
+
+void StallDetector::End() {
+  uint32 depth = depth_ - 1;
+  if (depth < kMaxDepth)
+    AtomicOps::ReleaseStore(&frames_[depth].seq, 0);
+  AtomicOps::ReleaseStore(&depth_, depth);
+}
+
+void StallDetector::Run(Thread* thread) {
+  int interval = _max(threshold_ms_ / 4, 1);
+  while (!thread->IsQuitting()) {
+    wake_.Wait(interval);
+    Check();
+  }
+}
+
+void StallDetector::Check() {
+  uint64 now = TimeMicros();
+  uint64 threshold = static_cast<uint64>(threshold_ms_) * 1000;
+  int depth = static_cast<int>(
+      _min<uint32>(AtomicOps::AcquireLoad(&depth_), kMaxDepth));
+  // The innermost dispatch past the threshold is the one to blame.
+  for (int i = depth - 1; i >= 0; --i) {
+    Frame* frame = &frames_[i];
+    uint32 seq = AtomicOps::AcquireLoad(&frame->seq);
+    if (!seq)
+      continue;
+    Stall stall;
+    stall.kind = static_cast<Kind>(frame->kind);
+    stall.type = frame->type;
+    stall.id = frame->id;
+    stall.depth = i;
+    uint64 start = frame->start;
+    // Read again, in case the thread reused the frame meanwhile.
+    if (AtomicOps::AcquireLoad(&frame->seq) != seq || start > now ||
+        now - start < threshold)
+      continue;
+    if (seq == reported_seq_)
+      return;
+    reported_seq_ = seq;
+    stall.micros = static_cast<uint32>(_min<uint64>(now - start, 0xFFFFFFFF));
+    SampleStack(&stall);
+    if (AtomicOps::AcquireLoad(&frame->seq) != seq)
+      stall.stack.clear();
+    AtomicOps::ReleaseStore(&stalls_, stalls_ + 1);
+    LibraryMetrics::Add(LibraryMetrics::LM_STALLS);
+    LibraryMetrics::Record(LibraryMetrics::LM_STALL_US, stall.micros);
+    OnStall(stall);
+    return;
+  }
+}
+
+void StallDetector::SampleStack(Stall* stall) {
+#if defined(POSIX) && defined(HAVE_EXECINFO_H)
+  CritScope cs(&g_sample_crit);
+  if (!g_handler_installed)
+    return;
+  if (++g_sample_gen == 0)
+    ++g_sample_gen;
+  uint32 request = g_sample_gen;
+  g_sample_thread = thread_;
+  AtomicOps::ReleaseStore(&g_sample_done, 0);
+  AtomicOps::ReleaseStore(&g_sample_request, request);
+  bool done = false;
+  if (pthread_kill(thread_, SampleSignal()) == 0) {
+    uint32 deadline = Time() + kSampleTimeoutMs;
+    while (!(done = AtomicOps::AcquireLoad(&g_sample_done) == request) &&
+           TimeIsLater(Time(), deadline)) {
+      Thread::SleepMs(1);
+    }
+  }
+  AtomicOps::ReleaseStore(&g_sample_request, 0);
+  if (!done)
+    return;
+  int size = g_sample_size;
+  if (size <= kHandlerFrames)
+    return;
+  char** symbols = backtrace_symbols(g_sample_frames + kHandlerFrames,
+                                     size - kHandlerFrames);
+  if (!symbols)
+    return;
+  stall->stack.assign(symbols, symbols + size - kHandlerFrames);
+  free(symbols);
+#endif
+}
+
+void StallDetector::OnStall(const Stall& stall) {
+  LOG(LS_WARNING) << "Stall: " << KindName(stall.kind) << " handler "
+                  << (stall.type ? stall.type : "?") << " (" << stall.id
+                  << ") has run for " << stall.micros / 1000 << " ms";
+  for (size_t i = 0; i < stall.stack.size(); ++i)
+    LOG(LS_WARNING) << "  #" << i << " " << stall.stack[i];
+}
+
+}  // namespace txmpp
@@ -0,0 +1,159 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_STALLDETECTOR_H_
+#define _TXMPP_STALLDETECTOR_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+#include <vector>
+
+#ifdef POSIX
+#include <pthread.h>
+#endif
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "event.h"
+#include "scoped_ptr.h"
+#include "thread.h"
+
+namespace txmpp {
+
+// Flags the handlers that hold up a thread: a message handler's OnMessage,
+// a socket event handler or a Task step that runs past a threshold, while
+// every other connection on the thread waits.  Enabled for a thread by
+// passing one to its SetStallDetector.
+//
+// The thread marks each dispatch as it begins and ends, which is a few
+// stores; a watchdog thread, started by Start, looks at the marks four
+// times per threshold.  A dispatch found running past the threshold is
+// reported once, to OnStall, with a sample of the thread's stack where
+// <execinfo.h> is available, and counted in the LM_STALLS and LM_STALL_US
+// library metrics.
+//
+// The stack is sampled by sending the thread StallDetector::SampleSignal(),
+// whose handler the first Start installs for the whole process.  Like any
+// signal, it cuts short a sleep the stalled handler is in.
+class StallDetector : public Runnable {
+ public:
+  enum Kind {
+    SK_MESSAGE,       // MessageHandler::OnMessage, posted or sent.
+    SK_SOCKET_EVENT,  // A socket server's event handler.
+    SK_TASK,          // One Task::Step.
+    SK_COUNT
+  };
+
+  struct Stall {
+    Kind kind;
+    // The handler's type as given by typeid; mangled with GCC.
+    const char* type;
+    // The message id, the socket event flags, or the task's state.
+    uint32 id;
+    // How many dispatches it runs inside of.
+    int depth;
+    // How long it had run when found.
+    uint32 micros;
+    // Symbolized frames, innermost first, or none if the stack couldn't be
+    // sampled, or the dispatch had ended by the time it was.
+    std::vector<std::string> stack;
+  };
+
+  explicit StallDetector(int threshold_ms);
+  // Stops the watchdog.
+  virtual ~StallDetector();
+
+  // The detector of the calling thread, if it has one.
+  static StallDetector* Current() {
+    Thread* thread = Thread::Current();
+    return thread ? thread->stall_detector() : NULL;
+  }
+
+  static const char* KindName(Kind kind);
+#ifdef POSIX
+  static int SampleSignal();
+#endif
+
+  int threshold_ms() const { return threshold_ms_; }
+  // The dispatches reported so far.
+  uint32 stalls() const { return AtomicOps::AcquireLoad(&stalls_); }
+
+  bool Start();
+  void Stop();
+
+  // Called on the watched thread around each dispatch.  |type| must be a
+  // string that lives forever.
+  void Begin(Kind kind, const char* type, uint32 id);
+  void End();
+
+  virtual void Run(Thread* thread);
+
+ protected:
+  // Called on the watchdog's thread.  Logs |stall| as a warning.
+  virtual void OnStall(const Stall& stall);
+
+ private:
+  // A dispatch in progress, or a free one while |seq| is 0.
+  struct Frame {
+    volatile uint32 seq;
+    volatile int kind;
+    const char* volatile type;
+    volatile uint32 id;
+    volatile uint64 start;
+  };
+
+  // Dispatches nested deeper than this are not watched.
+  enum { kMaxDepth = 8 };
+  // How long the watchdog waits for a stack sample.
+  static const int kSampleTimeoutMs = 100;
+
+  void Check();
+  void SampleStack(Stall* stall);
+
+  int threshold_ms_;
+  Frame frames_[kMaxDepth];
+  volatile uint32 depth_;
+  uint32 next_seq_;
+#ifdef POSIX
+  // The watched thread, as of the outermost Begin.
+  pthread_t thread_;
+#endif
+  // The last frame reported, which is only reported once.
+  uint32 reported_seq_;
+  volatile uint32 stalls_;
+  scoped_ptr<Thread> watchdog_;
+  Event wake_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(StallDetector);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_STALLDETECTOR_H_
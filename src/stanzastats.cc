@@ -0,0 +1,230 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stanzastats.h"
+
+#include "common.h"
+#include "qname.h"
+#include "socketserver.h"
+#include "stringutils.h"
+#include "thread.h"
+#include "time.h"
+
+namespace txmpp {
+
+//------------------------------------------------------------------
+// StanzaStats
+
+StanzaStats::StanzaStats()
+    : sample_interval_(1), trace_next_(0), trace_full_(false) {
+}
+
+StanzaStats::~StanzaStats() {
+}
+
+const char* StanzaStats::StageName(Stage stage) {
+  switch (stage) {
+    case STAGE_READ: return "read";
+    case STAGE_PARSE: return "parse";
+    case STAGE_QUEUE: return "queue";
+    case STAGE_HANDLE: return "handle";
+    case STAGE_SEND: return "send";
+    case STAGE_WRITE: return "write";
+    default: return "unknown";
+  }
+}
+
+void StanzaStats::SetSampleInterval(int interval) {
+  sample_interval_ = _max(interval, 1);
+}
+
+void StanzaStats::Record(const std::string& name, Stage first, Stage last,
+                         const uint64* times) {
+  ASSERT(last - first + 2 <= kMaxTimes);
+  for (int stage = first; stage <= last; ++stage) {
+    const uint64* begin = &times[stage - first];
+    if (*begin && begin[1] >= *begin)
+      stages_[stage].Add(static_cast<uint32>(begin[1] - *begin));
+  }
+
+  CritScope cs(&trace_crit_);
+  if (trace_.empty())
+    return;
+  Trace& trace = trace_[trace_next_];
+  trace.name = name;
+  trace.first = first;
+  trace.last = last;
+  for (int i = 0; i < last - first + 2; ++i)
+    trace.times[i] = times[i];
+  if (++trace_next_ == trace_.size()) {
+    trace_next_ = 0;
+    trace_full_ = true;
+  }
+}
+
+void StanzaStats::GetSnapshot(Snapshot* snapshot) const {
+  for (int i = 0; i < STAGE_COUNT; ++i)
+    stages_[i].GetSnapshot(&snapshot->stages[i]);
+}
+
+void StanzaStats::Reset() {
+  for (int i = 0; i < STAGE_COUNT; ++i)
+    stages_[i].Reset();
+  CritScope cs(&trace_crit_);
+  trace_next_ = 0;
+  trace_full_ = false;
+}
+
+void StanzaStats::SetTraceCapacity(size_t stanzas) {
+  CritScope cs(&trace_crit_);
+  std::vector<Trace>(stanzas).swap(trace_);
+  trace_next_ = 0;
+  trace_full_ = false;
+}
+
+void StanzaStats::WriteTrace(std::string* out) const {
+  out->append("{\"traceEvents\":[");
+  CritScope cs(&trace_crit_);
+  size_t count = trace_full_ ? trace_.size() : trace_next_;
+  size_t first = trace_full_ ? trace_next_ : 0;
+  bool comma = false;
+  for (size_t i = 0; i < count; ++i) {
+    const Trace& trace = trace_[(first + i) % trace_.size()];
+    // Inbound stanzas on one track and outbound on another.
+    int tid = (trace.first == STAGE_SEND) ? 2 : 1;
+    for (int stage = trace.first; stage <= trace.last; ++stage) {
+      const uint64* begin = &trace.times[stage - trace.first];
+      if (!*begin || begin[1] < *begin)
+        continue;
+      if (comma)
+        out->push_back(',');
+      comma = true;
+      // Stanza names are XML names, which need no escaping.
+      out->append("{\"name\":\"");
+      out->append(StageName(static_cast<Stage>(stage)));
+      out->append("\",\"cat\":\"stanza\",\"ph\":\"X\"");
+      char buffer[96];
+      sprintfn(buffer, sizeof(buffer),
+               ",\"ts\":%llu,\"dur\":%u,\"pid\":0,\"tid\":%d",
+               static_cast<unsigned long long>(*begin),
+               static_cast<uint32>(begin[1] - *begin), tid);
+      out->append(buffer);
+      out->append(",\"args\":{\"stanza\":\"");
+      out->append(trace.name);
+      out->append("\"}}");
+    }
+  }
+  out->append("],\"displayTimeUnit\":\"ms\"}");
+}
+
+//------------------------------------------------------------------
+// StanzaSampler
+
+StanzaSampler::StanzaSampler(StanzaStats* stats)
+    : stats_(stats), in_countdown_(0), out_countdown_(0) {
+  input_times_[0] = input_times_[1] = 0;
+}
+
+void StanzaSampler::InputStart() {
+  if (in_countdown_ || !in_name_.empty())
+    return;
+  Thread* thread = Thread::Current();
+  input_times_[0] = (thread && thread->socketserver()) ?
+      thread->socketserver()->telemetry().event_start : 0;
+  input_times_[1] = TimeMicros();
+}
+
+void StanzaSampler::StanzaStart(const QName& name, bool queued) {
+  if (!in_name_.empty())
+    return;
+  if (in_countdown_) {
+    --in_countdown_;
+    return;
+  }
+  // Behind queued stanzas, there is no telling which one HandleStart is
+  // for, so the next one is timed instead.
+  if (queued || !input_times_[1])
+    return;
+  in_name_ = name.LocalPart();
+  in_times_[0] = input_times_[0];
+  in_times_[1] = input_times_[1];
+  for (int i = 2; i < ARRAY_SIZE(in_times_); ++i)
+    in_times_[i] = 0;
+}
+
+void StanzaSampler::StanzaParsed() {
+  if (!in_name_.empty() && !in_times_[2])
+    in_times_[2] = TimeMicros();
+}
+
+void StanzaSampler::HandleStart() {
+  if (!in_name_.empty() && in_times_[2] && !in_times_[3])
+    in_times_[3] = TimeMicros();
+}
+
+void StanzaSampler::HandleEnd() {
+  if (!in_name_.empty() && in_times_[3])
+    FinishInbound();
+}
+
+void StanzaSampler::FinishInbound() {
+  in_times_[4] = TimeMicros();
+  stats_->Record(in_name_, StanzaStats::STAGE_READ,
+                 StanzaStats::STAGE_HANDLE, in_times_);
+  in_name_.clear();
+  input_times_[1] = 0;
+  in_countdown_ = stats_->sample_interval() - 1;
+}
+
+void StanzaSampler::SendStart(const QName& name) {
+  if (!out_name_.empty())
+    return;
+  if (out_countdown_) {
+    --out_countdown_;
+    return;
+  }
+  out_name_ = name.LocalPart();
+  out_times_[0] = TimeMicros();
+  out_times_[1] = out_times_[2] = 0;
+}
+
+void StanzaSampler::OutputStart() {
+  if (!out_name_.empty())
+    out_times_[1] = TimeMicros();
+}
+
+void StanzaSampler::OutputEnd() {
+  if (out_name_.empty() || !out_times_[1])
+    return;
+  out_times_[2] = TimeMicros();
+  stats_->Record(out_name_, StanzaStats::STAGE_SEND,
+                 StanzaStats::STAGE_WRITE, out_times_);
+  out_name_.clear();
+  out_countdown_ = stats_->sample_interval() - 1;
+}
+
+}  // namespace txmpp
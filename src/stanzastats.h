@@ -0,0 +1,172 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_STANZASTATS_H_
+#define _TXMPP_STANZASTATS_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "criticalsection.h"
+#include "dispatchstats.h"
+
+namespace txmpp {
+
+class QName;
+
+// Where the time goes for stanzas through XmppEngines, enabled by passing
+// one to XmppEngine::SetStanzaStats.  One stanza in every sample interval
+// each way is timed, and only those read the clock.  Records, for each,
+// the microseconds of every stage it went through, and optionally keeps
+// the latest as a trace.  Any number of engines, on any threads, may share
+// one.
+class StanzaStats {
+ public:
+  enum Stage {
+    // Inbound: from the socket event the stanza's start was read in to
+    // HandleInput getting it.  Not known for input read outside a socket
+    // event, or without SOCKETSERVER_TELEMETRY.
+    STAGE_READ,
+    // From HandleInput to the end of the stanza being parsed.
+    STAGE_PARSE,
+    // From then to its handlers being called, which is a wait behind any
+    // stanza being built off the engine's thread.
+    STAGE_QUEUE,
+    // The handlers' run.
+    STAGE_HANDLE,
+    // Outbound: from SendStanza to the output being handed to the output
+    // handler, which is a wait while the engine is corked or is already
+    // entered, as by a handler.
+    STAGE_SEND,
+    // The output handler's write: XmppClient's goes to the socket.
+    STAGE_WRITE,
+    STAGE_COUNT
+  };
+
+  struct Snapshot {
+    Histogram::Snapshot stages[STAGE_COUNT];
+  };
+
+  StanzaStats();
+  ~StanzaStats();
+
+  static const char* StageName(Stage stage);
+
+  // Times one stanza in |interval| each way; 1, the default, times them
+  // all.
+  void SetSampleInterval(int interval);
+  int sample_interval() const { return sample_interval_; }
+
+  // Records a timed stanza named |name|, which went through the stages
+  // from |first| on: |times| holds the TimeMicros() each began at, and
+  // the one the last ended at.  A stage beginning at 0 is not known.
+  void Record(const std::string& name, Stage first, Stage last,
+              const uint64* times);
+
+  void GetSnapshot(Snapshot* snapshot) const;
+  void Reset();
+
+  // Keeps the last |stanzas| timed for WriteTrace; 0, the default, keeps
+  // none.  Clears the ones kept so far.
+  void SetTraceCapacity(size_t stanzas);
+  // Writes the stanzas kept as JSON in the Trace Event Format, which
+  // chrome://tracing loads, with a track each way.
+  void WriteTrace(std::string* out) const;
+
+ private:
+  enum { kMaxTimes = STAGE_HANDLE - STAGE_READ + 2 };
+
+  struct Trace {
+    std::string name;
+    Stage first;
+    Stage last;
+    uint64 times[kMaxTimes];
+  };
+
+  volatile int sample_interval_;
+  Histogram stages_[STAGE_COUNT];
+  mutable CriticalSection trace_crit_;
+  std::vector<Trace> trace_;
+  size_t trace_next_;
+  bool trace_full_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(StanzaStats);
+};
+
+// Picks the stanzas an engine times for its StanzaStats, and times them,
+// as the engine tells it where each one is.  Not thread safe.
+class StanzaSampler {
+ public:
+  explicit StanzaSampler(StanzaStats* stats);
+
+  StanzaStats* stats() const { return stats_; }
+
+  // Input is passed to the engine.
+  void InputStart();
+  // A stanza named |name| starts in it, which will be handled.  |queued|
+  // is whether stanzas are waiting to be handled ahead of it.
+  void StanzaStart(const QName& name, bool queued);
+  // The stanza is parsed.
+  void StanzaParsed();
+  // Its handlers are called, and return.
+  void HandleStart();
+  void HandleEnd();
+
+  // A stanza named |name| is written to the output.
+  void SendStart(const QName& name);
+  // The output is handed to the output handler, which returns.
+  void OutputStart();
+  void OutputEnd();
+
+ private:
+  void FinishInbound();
+
+  StanzaStats* stats_;
+  // Stanzas to go each way before the next one is timed.
+  int in_countdown_;
+  int out_countdown_;
+  // The socket event and HandleInput times of the latest input, while the
+  // next stanza in is to be timed.
+  uint64 input_times_[2];
+  // The stanzas being timed, if their names are not empty.
+  std::string in_name_;
+  uint64 in_times_[StanzaStats::STAGE_HANDLE - StanzaStats::STAGE_READ + 2];
+  std::string out_name_;
+  uint64 out_times_[StanzaStats::STAGE_WRITE - StanzaStats::STAGE_SEND + 2];
+
+  DISALLOW_EVIL_CONSTRUCTORS(StanzaSampler);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_STANZASTATS_H_
@@ -28,7 +28,11 @@
 #include "stream.h"
 
 #if defined(POSIX)
+#include <fcntl.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #endif  // POSIX
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -37,9 +41,11 @@
 #include "basictypes.h"
 #include "common.h"
 #include "messagequeue.h"
+#include "socket.h"
 #include "stringencode.h"
 #include "stringutils.h"
 #include "thread.h"
+#include "wirecapture.h"
 
 #ifdef WIN32
 #include "win32.h"
@@ -64,6 +70,88 @@ struct PostEventData : public MessageData {
   PostEventData(int ev, int er) : events(ev), error(er) { }
 };
 
+StreamResult StreamInterface::ReadV(const MutableIoVec* vec, size_t count,
+                                    size_t* read, int* error) {
+  size_t total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    size_t current = 0;
+    StreamResult result = Read(vec[i].data, vec[i].len, &current, error);
+    if (result != SR_SUCCESS) {
+      if (total == 0)
+        return result;
+      break;
+    }
+    total += current;
+    if (current < vec[i].len)
+      break;
+  }
+  if (read)
+    *read = total;
+  return SR_SUCCESS;
+}
+
+StreamResult StreamInterface::WriteV(const IoVec* vec, size_t count,
+                                     size_t* written, int* error) {
+  size_t total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    size_t current = 0;
+    StreamResult result = Write(vec[i].data, vec[i].len, &current, error);
+    if (result != SR_SUCCESS) {
+      if (total == 0)
+        return result;
+      break;
+    }
+    total += current;
+    if (current < vec[i].len)
+      break;
+  }
+  if (written)
+    *written = total;
+  return SR_SUCCESS;
+}
+
+StreamResult StreamInterface::WriteFile(int fd, size_t offset, size_t len,
+                                        size_t* written, int* error) {
+  if (error)
+    *error = EOPNOTSUPP;
+  return SR_ERROR;
+}
+
+StreamResult StreamInterface::TransferTo(StreamInterface* sink,
+                                         size_t* transferred, int* error) {
+  char buffer[4096];
+  size_t total = 0;
+  StreamResult result = SR_SUCCESS;
+  while (result == SR_SUCCESS) {
+    size_t position;
+    if (!GetPosition(&position)) {
+      // There would be no way to put back what the sink doesn't take.
+      if (error)
+        *error = EOPNOTSUPP;
+      result = SR_ERROR;
+      break;
+    }
+    size_t read = 0, written = 0;
+    result = Read(buffer, sizeof(buffer), &read, error);
+    if (result == SR_EOS) {
+      result = SR_SUCCESS;
+      break;
+    }
+    if (result != SR_SUCCESS)
+      break;
+    result = sink->WriteAll(buffer, read, &written, error);
+    if ((written < read) && !SetPosition(position + written)) {
+      if (error)
+        *error = EOPNOTSUPP;
+      result = SR_ERROR;
+    }
+    total += written;
+  }
+  if (transferred)
+    *transferred = total;
+  return result;
+}
+
 StreamResult StreamInterface::WriteAll(const void* data, size_t data_len,
                                        size_t* written, int* error) {
   StreamResult result = SR_SUCCESS;
@@ -224,6 +312,43 @@ StreamResult StreamTap::Write(const void* data, size_t data_len,
   return res;
 }
 
+StreamResult StreamTap::ReadV(const MutableIoVec* vec, size_t count,
+                              size_t* read, int* error) {
+  size_t backup_read;
+  if (!read) {
+    read = &backup_read;
+  }
+  StreamResult res = stream()->ReadV(vec, count, read, error);
+  if (res == SR_SUCCESS) {
+    TapV(vec, count, *read);
+  }
+  return res;
+}
+
+StreamResult StreamTap::WriteV(const IoVec* vec, size_t count,
+                               size_t* written, int* error) {
+  size_t backup_written;
+  if (!written) {
+    written = &backup_written;
+  }
+  StreamResult res = stream()->WriteV(vec, count, written, error);
+  if (res == SR_SUCCESS) {
+    TapV(vec, count, *written);
+  }
+  return res;
+}
+
+template<class V>
+void StreamTap::TapV(const V* vec, size_t count, size_t len) {
+  for (size_t i = 0; (i < count) && (len > 0); ++i) {
+    if (tap_result_ != SR_SUCCESS)
+      return;
+    size_t tapped = _min(len, vec[i].len);
+    tap_result_ = tap_->WriteAll(vec[i].data, tapped, NULL, &tap_error_);
+    len -= tapped;
+  }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // StreamSegment
 ///////////////////////////////////////////////////////////////////////////////
@@ -423,6 +548,48 @@ StreamResult FileStream::Write(const void* data, size_t data_len,
   return SR_SUCCESS;
 }
 
+StreamResult FileStream::WriteV(const IoVec* vec, size_t count,
+                                size_t* written, int* error) {
+#if defined(POSIX)
+  if (!file_)
+    return SR_EOS;
+  const size_t kMaxVecs = 16;
+  if (count > kMaxVecs)
+    count = kMaxVecs;
+  size_t total = 0;
+  for (size_t i = 0; i < count; ++i)
+    total += vec[i].len;
+  if (total >= BUFSIZ) {
+    // What stdio holds has to go out first, and then the buffers can go
+    // straight to the file in one call instead of a copy and a write each.
+    if (fflush(file_) != 0) {
+      if (error)
+        *error = errno;
+      return SR_ERROR;
+    }
+    iovec iov[kMaxVecs];
+    for (size_t i = 0; i < count; ++i) {
+      iov[i].iov_base = const_cast<void*>(vec[i].data);
+      iov[i].iov_len = vec[i].len;
+    }
+    ssize_t result = ::writev(fileno(file_), iov, static_cast<int>(count));
+    if (result <= 0) {
+      if (error)
+        *error = errno;
+      return SR_ERROR;
+    }
+    // stdio may have cached the position the write has moved on from.
+    off_t position = lseek(fileno(file_), 0, SEEK_CUR);
+    if (position >= 0)
+      fseeko(file_, position, SEEK_SET);
+    if (written)
+      *written = result;
+    return SR_SUCCESS;
+  }
+#endif  // POSIX
+  return StreamInterface::WriteV(vec, count, written, error);
+}
+
 void FileStream::Close() {
   if (file_) {
     DoClose();
@@ -430,6 +597,39 @@ void FileStream::Close() {
   }
 }
 
+StreamResult FileStream::TransferTo(StreamInterface* sink,
+                                    size_t* transferred, int* error) {
+#if defined(POSIX)
+  size_t position, size;
+  // Flushing also puts the file offset where stdio's read position is.
+  if (file_ && (fflush(file_) == 0) && GetPosition(&position) &&
+      GetSize(&size)) {
+    size_t total = 0;
+    int err = 0;
+    StreamResult result = SR_SUCCESS;
+    while (position + total < size) {
+      size_t written = 0;
+      result = sink->WriteFile(fileno(file_), position + total,
+                               size - position - total, &written, &err);
+      if ((result != SR_SUCCESS) || (written == 0))
+        break;
+      total += written;
+    }
+    if ((result != SR_ERROR) || (err != EOPNOTSUPP) || (total > 0)) {
+      // The kernel read past stdio, which has to be told where it went.
+      if (total > 0)
+        SetPosition(position + total);
+      if (transferred)
+        *transferred = total;
+      if ((result == SR_ERROR) && error)
+        *error = err;
+      return result;
+    }
+  }
+#endif  // POSIX
+  return StreamInterface::TransferTo(sink, transferred, error);
+}
+
 bool FileStream::SetPosition(size_t position) {
   if (!file_)
     return false;
@@ -578,6 +778,20 @@ StreamResult MemoryStreamBase::Read(void* buffer, size_t bytes,
   return SR_SUCCESS;
 }
 
+StreamResult MemoryStreamBase::TransferTo(StreamInterface* sink,
+                                          size_t* transferred, int* error) {
+  size_t written = 0;
+  StreamResult result = SR_SUCCESS;
+  if (seek_position_ < data_length_) {
+    result = sink->WriteAll(&buffer_[seek_position_],
+                            data_length_ - seek_position_, &written, error);
+    seek_position_ += written;
+  }
+  if (transferred)
+    *transferred = written;
+  return result;
+}
+
 StreamResult MemoryStreamBase::Write(const void* buffer, size_t bytes,
                                      size_t* bytes_written, int* error) {
   size_t available = buffer_length_ - seek_position_;
@@ -649,27 +863,31 @@ StreamResult MemoryStreamBase::DoReserve(size_t size, int* error) {
 ///////////////////////////////////////////////////////////////////////////////
 
 MemoryStream::MemoryStream()
-  : buffer_alloc_(NULL) {
+  : allocator_(BufferAllocator::Default()), buffer_alloc_(NULL) {
 }
 
 MemoryStream::MemoryStream(const char* data)
-  : buffer_alloc_(NULL) {
+  : allocator_(BufferAllocator::Default()), buffer_alloc_(NULL) {
   SetData(data, strlen(data));
 }
 
 MemoryStream::MemoryStream(const void* data, size_t length)
-  : buffer_alloc_(NULL) {
+  : allocator_(BufferAllocator::Default()), buffer_alloc_(NULL) {
   SetData(data, length);
 }
 
+MemoryStream::MemoryStream(BufferAllocator* allocator)
+  : allocator_(BufferAllocator::Resolve(allocator)), buffer_alloc_(NULL) {
+}
+
 MemoryStream::~MemoryStream() {
-  delete [] buffer_alloc_;
+  allocator_->Free(buffer_alloc_, buffer_length_ + kAlignment);
 }
 
 void MemoryStream::SetData(const void* data, size_t length) {
+  allocator_->Free(buffer_alloc_, buffer_length_ + kAlignment);
   data_length_ = buffer_length_ = length;
-  delete [] buffer_alloc_;
-  buffer_alloc_ = new char[buffer_length_ + kAlignment];
+  buffer_alloc_ = allocator_->Allocate(buffer_length_ + kAlignment);
   buffer_ = reinterpret_cast<char*>(ALIGNP(buffer_alloc_, kAlignment));
   memcpy(buffer_, data, data_length_);
   seek_position_ = 0;
@@ -679,11 +897,11 @@ StreamResult MemoryStream::DoReserve(size_t size, int* error) {
   if (buffer_length_ >= size)
     return SR_SUCCESS;
 
-  if (char* new_buffer_alloc = new char[size + kAlignment]) {
+  if (char* new_buffer_alloc = allocator_->Allocate(size + kAlignment)) {
     char* new_buffer = reinterpret_cast<char*>(
         ALIGNP(new_buffer_alloc, kAlignment));
     memcpy(new_buffer, buffer_, data_length_);
-    delete [] buffer_alloc_;
+    allocator_->Free(buffer_alloc_, buffer_length_ + kAlignment);
     buffer_alloc_ = new_buffer_alloc;
     buffer_ = new_buffer;
     buffer_length_ = size;
@@ -714,38 +932,136 @@ void ExternalMemoryStream::SetData(void* data, size_t length) {
   seek_position_ = 0;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef POSIX
+MappedFileStream::MappedFileStream() : open_(false), sequential_(true) {
+}
+
+MappedFileStream::~MappedFileStream() {
+  Close();
+}
+
+bool MappedFileStream::Open(const std::string& filename) {
+  Close();
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat file_stats;
+  if ((fstat(fd, &file_stats) != 0) || !S_ISREG(file_stats.st_mode)) {
+    ::close(fd);
+    return false;
+  }
+  size_t size = static_cast<size_t>(file_stats.st_size);
+  void* data = NULL;
+  // An empty file can't be mapped, and has nothing to read anyway.
+  if (size > 0)
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED)
+    return false;
+  buffer_ = static_cast<char*>(data);
+  buffer_length_ = data_length_ = size;
+  seek_position_ = 0;
+  open_ = true;
+  Advise();
+  return true;
+}
+
+void MappedFileStream::SetSequential(bool sequential) {
+  sequential_ = sequential;
+  Advise();
+}
+
+void MappedFileStream::Advise() {
+  if (buffer_)
+    madvise(buffer_, buffer_length_,
+            sequential_ ? MADV_SEQUENTIAL : MADV_NORMAL);
+}
+
+StreamState MappedFileStream::GetState() const {
+  return open_ ? SS_OPEN : SS_CLOSED;
+}
+
+StreamResult MappedFileStream::Write(const void* buffer, size_t bytes,
+                                     size_t* bytes_written, int* error) {
+  // The file is mapped read only.
+  if (error)
+    *error = EBADF;
+  return SR_ERROR;
+}
+
+void MappedFileStream::Close() {
+  if (buffer_)
+    munmap(buffer_, buffer_length_);
+  buffer_ = NULL;
+  buffer_length_ = data_length_ = seek_position_ = 0;
+  open_ = false;
+}
+
+const void* MappedFileStream::GetReadData(size_t* data_len) {
+  if (seek_position_ >= data_length_)
+    return NULL;
+  *data_len = data_length_ - seek_position_;
+  return buffer_ + seek_position_;
+}
+
+void MappedFileStream::ConsumeReadData(size_t used) {
+  seek_position_ += _min(used, data_length_ - seek_position_);
+}
+#endif  // POSIX
+
 ///////////////////////////////////////////////////////////////////////////////
 // FifoBuffer
 ///////////////////////////////////////////////////////////////////////////////
 
-FifoBuffer::FifoBuffer(size_t size)
-    : state_(SS_OPEN), buffer_(new char[size]), buffer_length_(size),
-      data_length_(0), read_position_(0), owner_(Thread::Current()) {
+// The capacity of a MODE_SPSC buffer of at least |size| bytes.
+static size_t FifoBuffer_SpscLength(size_t size) {
+  size_t length = 1;
+  while (length < size && length < (static_cast<size_t>(1) << 31))
+    length <<= 1;
+  return length;
+}
+
+FifoBuffer::FifoBuffer(size_t size, Mode mode, BufferAllocator* allocator)
+    : state_(SS_OPEN), allocator_(BufferAllocator::Resolve(allocator)),
+      buffer_length_((mode == MODE_SPSC) ? FifoBuffer_SpscLength(size) : size),
+      data_length_(0), read_position_(0), owner_(Thread::Current()),
+      spsc_(mode == MODE_SPSC), read_count_(0), write_count_(0),
+      read_waiting_(0), write_waiting_(0), closed_(0) {
   // all events are done on the owner_ thread
+  buffer_ = allocator_->Allocate(buffer_length_);
 }
 
 FifoBuffer::~FifoBuffer() {
+  allocator_->Free(buffer_, buffer_length_);
 }
 
 bool FifoBuffer::GetBuffered(size_t* size) const {
+  if (spsc_) {
+    const uint32 read = AtomicOps::AcquireLoad(&read_count_);
+    *size = AtomicOps::AcquireLoad(&write_count_) - read;
+    return true;
+  }
   CritScope cs(&crit_);
   *size = data_length_;
   return true;
 }
 
 bool FifoBuffer::SetCapacity(size_t size) {
+  if (spsc_) {
+    return false;
+  }
   CritScope cs(&crit_);
   if (data_length_ > size) {
     return false;
   }
 
   if (size != buffer_length_) {
-    char* buffer = new char[size];
-    const size_t copy = data_length_;
-    const size_t tail_copy = _min(copy, buffer_length_ - read_position_);
-    memcpy(buffer, &buffer_[read_position_], tail_copy);
-    memcpy(buffer + tail_copy, &buffer_[0], copy - tail_copy);
-    buffer_.reset(buffer);
+    char* buffer = allocator_->Allocate(size);
+    CopyOut(read_position_, buffer, data_length_);
+    allocator_->Free(buffer_, buffer_length_);
+    buffer_ = buffer;
     read_position_ = 0;
     buffer_length_ = size;
   }
@@ -758,20 +1074,49 @@ StreamState FifoBuffer::GetState() const {
 
 StreamResult FifoBuffer::Read(void* buffer, size_t bytes,
                               size_t* bytes_read, int* error) {
+  MutableIoVec vec = { buffer, bytes };
+  return ReadV(&vec, 1, bytes_read, error);
+}
+
+StreamResult FifoBuffer::Write(const void* buffer, size_t bytes,
+                               size_t* bytes_written, int* error) {
+  IoVec vec = { buffer, bytes };
+  return WriteV(&vec, 1, bytes_written, error);
+}
+
+StreamResult FifoBuffer::ReadV(const MutableIoVec* vec, size_t count,
+                               size_t* bytes_read, int* error) {
+  if (spsc_) {
+    // What was written before Close is there to read after it.
+    const bool closed = (AtomicOps::AcquireLoad(&closed_) != 0);
+    const size_t available = ReadableSpsc(!closed);
+    if (0 == available) {
+      return closed ? SR_EOS : SR_BLOCK;
+    }
+    const size_t position = read_count_;
+    size_t copy = 0;
+    for (size_t i = 0; (i < count) && (copy < available); ++i) {
+      const size_t part = _min(vec[i].len, available - copy);
+      CopyOut(position + copy, vec[i].data, part);
+      copy += part;
+    }
+    ConsumeSpsc(copy);
+    if (bytes_read) {
+      *bytes_read = copy;
+    }
+    return SR_SUCCESS;
+  }
+
   CritScope cs(&crit_);
-  const size_t available = data_length_;
-  if (0 == available) {
+  if (0 == data_length_) {
     return (state_ != SS_CLOSED) ? SR_BLOCK : SR_EOS;
   }
 
   const bool was_writable = data_length_ < buffer_length_;
-  const size_t copy = _min(bytes, available);
-  const size_t tail_copy = _min(copy, buffer_length_ - read_position_);
-  char* const p = static_cast<char*>(buffer);
-  memcpy(p, &buffer_[read_position_], tail_copy);
-  memcpy(p + tail_copy, &buffer_[0], copy - tail_copy);
-  read_position_ = (read_position_ + copy) % buffer_length_;
-  data_length_ -= copy;
+  size_t copy = 0;
+  for (size_t i = 0; (i < count) && (data_length_ > 0); ++i) {
+    copy += ReadLocked(vec[i].data, vec[i].len);
+  }
   if (bytes_read) {
     *bytes_read = copy;
   }
@@ -783,27 +1128,44 @@ StreamResult FifoBuffer::Read(void* buffer, size_t bytes,
   return SR_SUCCESS;
 }
 
-StreamResult FifoBuffer::Write(const void* buffer, size_t bytes,
-                               size_t* bytes_written, int* error) {
+StreamResult FifoBuffer::WriteV(const IoVec* vec, size_t count,
+                                size_t* bytes_written, int* error) {
+  if (spsc_) {
+    if (AtomicOps::AcquireLoad(&closed_) != 0) {
+      return SR_EOS;
+    }
+    const size_t available = WritableSpsc(true);
+    if (0 == available) {
+      return SR_BLOCK;
+    }
+    const size_t position = write_count_;
+    size_t copy = 0;
+    for (size_t i = 0; (i < count) && (copy < available); ++i) {
+      const size_t part = _min(vec[i].len, available - copy);
+      CopyIn(position + copy, vec[i].data, part);
+      copy += part;
+    }
+    ProduceSpsc(copy);
+    if (bytes_written) {
+      *bytes_written = copy;
+    }
+    return SR_SUCCESS;
+  }
+
   CritScope cs(&crit_);
   if (state_ == SS_CLOSED) {
     return SR_EOS;
   }
 
-  const size_t available = buffer_length_ - data_length_;
-  if (0 == available) {
+  if (data_length_ == buffer_length_) {
     return SR_BLOCK;
   }
 
   const bool was_readable = (data_length_ > 0);
-  const size_t write_position = (read_position_ + data_length_)
-      % buffer_length_;
-  const size_t copy = _min(bytes, available);
-  const size_t tail_copy = _min(copy, buffer_length_ - write_position);
-  const char* const p = static_cast<const char*>(buffer);
-  memcpy(&buffer_[write_position], p, tail_copy);
-  memcpy(&buffer_[0], p + tail_copy, copy - tail_copy);
-  data_length_ += copy;
+  size_t copy = 0;
+  for (size_t i = 0; (i < count) && (data_length_ < buffer_length_); ++i) {
+    copy += WriteLocked(vec[i].data, vec[i].len);
+  }
   if (bytes_written) {
     *bytes_written = copy;
   }
@@ -815,12 +1177,104 @@ StreamResult FifoBuffer::Write(const void* buffer, size_t bytes,
   return SR_SUCCESS;
 }
 
+size_t FifoBuffer::ReadLocked(void* buffer, size_t bytes) {
+  const size_t copy = _min(bytes, data_length_);
+  CopyOut(read_position_, buffer, copy);
+  read_position_ = (read_position_ + copy) % buffer_length_;
+  data_length_ -= copy;
+  return copy;
+}
+
+size_t FifoBuffer::WriteLocked(const void* buffer, size_t bytes) {
+  const size_t write_position = (read_position_ + data_length_)
+      % buffer_length_;
+  const size_t copy = _min(bytes, buffer_length_ - data_length_);
+  CopyIn(write_position, buffer, copy);
+  data_length_ += copy;
+  return copy;
+}
+
+void FifoBuffer::CopyOut(size_t position, void* buffer, size_t bytes) const {
+  position %= buffer_length_;
+  const size_t tail_copy = _min(bytes, buffer_length_ - position);
+  char* const p = static_cast<char*>(buffer);
+  memcpy(p, &buffer_[position], tail_copy);
+  memcpy(p + tail_copy, &buffer_[0], bytes - tail_copy);
+}
+
+void FifoBuffer::CopyIn(size_t position, const void* buffer, size_t bytes) {
+  position %= buffer_length_;
+  const size_t tail_copy = _min(bytes, buffer_length_ - position);
+  const char* const p = static_cast<const char*>(buffer);
+  memcpy(&buffer_[position], p, tail_copy);
+  memcpy(&buffer_[0], p + tail_copy, bytes - tail_copy);
+}
+
+size_t FifoBuffer::ReadableSpsc(bool wait) {
+  size_t available = AtomicOps::AcquireLoad(&write_count_) - read_count_;
+  if (0 == available && wait) {
+    // The exchange orders the flag before the second look, and the writer
+    // looks at the flag after storing its index, so either the writer sees
+    // the flag or this sees the data.
+    AtomicOps::Exchange(&read_waiting_, 1);
+    available = AtomicOps::AcquireLoad(&write_count_) - read_count_;
+  }
+  return available;
+}
+
+size_t FifoBuffer::WritableSpsc(bool wait) {
+  size_t available = buffer_length_ -
+      (write_count_ - AtomicOps::AcquireLoad(&read_count_));
+  if (0 == available && wait) {
+    AtomicOps::Exchange(&write_waiting_, 1);
+    available = buffer_length_ -
+        (write_count_ - AtomicOps::AcquireLoad(&read_count_));
+  }
+  return available;
+}
+
+void FifoBuffer::ConsumeSpsc(size_t bytes) {
+  if (0 == bytes) {
+    return;
+  }
+  AtomicOps::ReleaseStore(&read_count_,
+                          read_count_ + static_cast<uint32>(bytes));
+  AtomicOps::Fence();
+  if (AtomicOps::AcquireLoad(&write_waiting_) != 0 &&
+      AtomicOps::Exchange(&write_waiting_, 0) != 0) {
+    PostEvent(owner_, SE_WRITE, 0);
+  }
+}
+
+void FifoBuffer::ProduceSpsc(size_t bytes) {
+  if (0 == bytes) {
+    return;
+  }
+  AtomicOps::ReleaseStore(&write_count_,
+                          write_count_ + static_cast<uint32>(bytes));
+  AtomicOps::Fence();
+  if (AtomicOps::AcquireLoad(&read_waiting_) != 0 &&
+      AtomicOps::Exchange(&read_waiting_, 0) != 0) {
+    PostEvent(owner_, SE_READ, 0);
+  }
+}
+
 void FifoBuffer::Close() {
+  if (spsc_) {
+    state_ = SS_CLOSED;
+    AtomicOps::Exchange(&closed_, 1);
+    return;
+  }
   CritScope cs(&crit_);
   state_ = SS_CLOSED;
 }
 
 const void* FifoBuffer::GetReadData(size_t* size) {
+  if (spsc_) {
+    const size_t position = read_count_ & (buffer_length_ - 1);
+    *size = _min(ReadableSpsc(true), buffer_length_ - position);
+    return &buffer_[position];
+  }
   CritScope cs(&crit_);
   *size = (read_position_ + data_length_ <= buffer_length_) ?
       data_length_ : buffer_length_ - read_position_;
@@ -828,6 +1282,11 @@ const void* FifoBuffer::GetReadData(size_t* size) {
 }
 
 void FifoBuffer::ConsumeReadData(size_t size) {
+  if (spsc_) {
+    ASSERT(size <= ReadableSpsc(false));
+    ConsumeSpsc(size);
+    return;
+  }
   CritScope cs(&crit_);
   ASSERT(size <= data_length_);
   const bool was_writable = data_length_ < buffer_length_;
@@ -839,6 +1298,14 @@ void FifoBuffer::ConsumeReadData(size_t size) {
 }
 
 void* FifoBuffer::GetWriteBuffer(size_t* size) {
+  if (spsc_) {
+    if (AtomicOps::AcquireLoad(&closed_) != 0) {
+      return NULL;
+    }
+    const size_t position = write_count_ & (buffer_length_ - 1);
+    *size = _min(WritableSpsc(true), buffer_length_ - position);
+    return &buffer_[position];
+  }
   CritScope cs(&crit_);
   if (state_ == SS_CLOSED) {
     return NULL;
@@ -858,6 +1325,11 @@ void* FifoBuffer::GetWriteBuffer(size_t* size) {
 }
 
 void FifoBuffer::ConsumeWriteBuffer(size_t size) {
+  if (spsc_) {
+    ASSERT(size <= WritableSpsc(false));
+    ProduceSpsc(size);
+    return;
+  }
   CritScope cs(&crit_);
   ASSERT(size <= buffer_length_ - data_length_);
   const bool was_readable = (data_length_ > 0);
@@ -873,7 +1345,8 @@ void FifoBuffer::ConsumeWriteBuffer(size_t size) {
 
 LoggingAdapter::LoggingAdapter(StreamInterface* stream, LoggingSeverity level,
                                const std::string& label, bool hex_mode)
-: StreamAdapterInterface(stream), level_(level), hex_mode_(hex_mode)
+: StreamAdapterInterface(stream), level_(level), hex_mode_(hex_mode),
+  capture_(NULL), connection_(0)
 {
   set_label(label);
 }
@@ -884,13 +1357,24 @@ void LoggingAdapter::set_label(const std::string& label) {
   label_.append("]");
 }
 
+void LoggingAdapter::set_capture(WireCapture* capture) {
+  capture_ = capture;
+  if (capture_)
+    connection_ = capture_->AddConnection(label_);
+}
+
 StreamResult LoggingAdapter::Read(void* buffer, size_t buffer_len,
                                   size_t* read, int* error) {
   size_t local_read; if (!read) read = &local_read;
   StreamResult result = StreamAdapterInterface::Read(buffer, buffer_len, read,
                                                      error);
   if (result == SR_SUCCESS) {
-    LogMultiline(level_, label_.c_str(), true, buffer, *read, hex_mode_, &lms_);
+    if (capture_) {
+      capture_->Write(connection_, WireCapture::WR_INPUT, buffer, *read);
+    } else {
+      LogMultiline(level_, label_.c_str(), true, buffer, *read, hex_mode_,
+                   &lms_);
+    }
   }
   return result;
 }
@@ -901,21 +1385,35 @@ StreamResult LoggingAdapter::Write(const void* data, size_t data_len,
   StreamResult result = StreamAdapterInterface::Write(data, data_len, written,
                                                       error);
   if (result == SR_SUCCESS) {
-    LogMultiline(level_, label_.c_str(), false, data, *written, hex_mode_,
-                 &lms_);
+    if (capture_) {
+      capture_->Write(connection_, WireCapture::WR_OUTPUT, data, *written);
+    } else {
+      LogMultiline(level_, label_.c_str(), false, data, *written, hex_mode_,
+                   &lms_);
+    }
   }
   return result;
 }
 
 void LoggingAdapter::Close() {
-  LogMultiline(level_, label_.c_str(), false, NULL, 0, hex_mode_, &lms_);
-  LogMultiline(level_, label_.c_str(), true, NULL, 0, hex_mode_, &lms_);
-  LOG_V(level_) << label_ << " Closed locally";
+  if (capture_) {
+    capture_->Write(connection_, WireCapture::WR_CLOSE_LOCAL, NULL, 0);
+  } else {
+    LogMultiline(level_, label_.c_str(), false, NULL, 0, hex_mode_, &lms_);
+    LogMultiline(level_, label_.c_str(), true, NULL, 0, hex_mode_, &lms_);
+    LOG_V(level_) << label_ << " Closed locally";
+  }
   StreamAdapterInterface::Close();
 }
 
 void LoggingAdapter::OnEvent(StreamInterface* stream, int events, int err) {
-  if (events & SE_OPEN) {
+  if (capture_) {
+    if (events & SE_OPEN) {
+      capture_->Write(connection_, WireCapture::WR_OPEN, NULL, 0);
+    } else if (events & SE_CLOSE) {
+      capture_->WriteClose(connection_, err);
+    }
+  } else if (events & SE_OPEN) {
     LOG_V(level_) << label_ << " Open";
   } else if (events & SE_CLOSE) {
     LogMultiline(level_, label_.c_str(), false, NULL, 0, hex_mode_, &lms_);
@@ -33,6 +33,7 @@
 #endif
 
 #include "basictypes.h"
+#include "bufferallocator.h"
 #include "criticalsection.h"
 #include "logging.h"
 #include "messagehandler.h"
@@ -68,6 +69,9 @@ enum StreamResult { SR_ERROR, SR_SUCCESS, SR_BLOCK, SR_EOS };
 enum StreamEvent { SE_OPEN = 1, SE_READ = 2, SE_WRITE = 4, SE_CLOSE = 8 };
 
 class Thread;
+class WireCapture;
+struct IoVec;
+struct MutableIoVec;
 
 class StreamInterface : public MessageHandler {
  public:
@@ -92,6 +96,21 @@ class StreamInterface : public MessageHandler {
                             size_t* read, int* error) = 0;
   virtual StreamResult Write(const void* data, size_t data_len,
                              size_t* written, int* error) = 0;
+  // ReadV fills the |count| buffers in |vec| one after the other, as one Read
+  // into them all would, and WriteV writes them as one Write of them all
+  // would; |read| and |written| count the bytes over all of the buffers.
+  // Streams that can move them at once do.  The default is a Read or Write
+  // of each buffer, stopping at the first one that comes up short.
+  virtual StreamResult ReadV(const MutableIoVec* vec, size_t count,
+                             size_t* read, int* error);
+  virtual StreamResult WriteV(const IoVec* vec, size_t count,
+                              size_t* written, int* error);
+  // WriteFile writes up to |len| bytes of the open file |fd| from |offset|
+  // on, as a Write of them would, but straight from the file where the
+  // stream can, as a socket can with sendfile.  Streams that can't return
+  // SR_ERROR with EOPNOTSUPP, which is the default.
+  virtual StreamResult WriteFile(int fd, size_t offset, size_t len,
+                                 size_t* written, int* error);
   // Attempt to transition to the SS_CLOSED state.  SE_CLOSE will not be
   // signalled as a result of this call.
   virtual void Close() = 0;
@@ -220,6 +239,17 @@ class StreamInterface : public MessageHandler {
   StreamResult ReadAll(void* buffer, size_t buffer_len,
                        size_t* read, int* error);
 
+  // TransferTo moves what is left of this stream to |sink|, setting
+  // |transferred| to the bytes moved.  It returns SR_SUCCESS once this
+  // stream has reached end-of-stream and all of it is written, and otherwise
+  // what the sink or this stream returned; after SR_BLOCK from the sink, call
+  // it again once the sink is writable.  A file going to a socket is moved by
+  // the kernel where it can be.  The default copies through a buffer, and
+  // needs a stream that can seek back over what the sink doesn't take; for
+  // others it returns SR_ERROR with EOPNOTSUPP, and Flow should be used.
+  virtual StreamResult TransferTo(StreamInterface* sink, size_t* transferred,
+                                  int* error);
+
   // ReadLine is a helper function which repeatedly calls Read until it hits
   // the end-of-line character, or something other than SR_SUCCESS.
   // TODO: this is too inefficient to keep here.  Break this out into a buffered
@@ -264,6 +294,9 @@ class StreamAdapterInterface : public StreamInterface,
   virtual void Close() {
     stream_->Close();
   }
+  // ReadV and WriteV are not passed through, but fall back on Read and
+  // Write, so that adapters which change the data in those see all of it.
+  // Adapters that leave the data alone can pass them through.
 
   // Optional Stream Interface
   /*  Note: Many stream adapters were implemented prior to this Read/Write
@@ -349,8 +382,15 @@ class StreamTap : public StreamAdapterInterface {
                             size_t* read, int* error);
   virtual StreamResult Write(const void* data, size_t data_len,
                              size_t* written, int* error);
+  virtual StreamResult ReadV(const MutableIoVec* vec, size_t count,
+                             size_t* read, int* error);
+  virtual StreamResult WriteV(const IoVec* vec, size_t count,
+                              size_t* written, int* error);
 
  private:
+  // Copies the first |len| bytes of the buffers in |vec| to the tap.
+  template<class V> void TapV(const V* vec, size_t count, size_t len);
+
   scoped_ptr<StreamInterface> tap_;
   StreamResult tap_result_;
   int tap_error_;
@@ -427,12 +467,19 @@ class FileStream : public StreamInterface {
                             size_t* read, int* error);
   virtual StreamResult Write(const void* data, size_t data_len,
                              size_t* written, int* error);
+  // Small buffers are left to stdio to gather; large ones are written past
+  // it with one writev where there is one.
+  virtual StreamResult WriteV(const IoVec* vec, size_t count,
+                              size_t* written, int* error);
   virtual void Close();
   virtual bool SetPosition(size_t position);
   virtual bool GetPosition(size_t* position) const;
   virtual bool GetSize(size_t* size) const;
   virtual bool GetAvailable(size_t* size) const;
   virtual bool ReserveSize(size_t size);
+  // Hands the rest of the file to the sink's WriteFile where there is one.
+  virtual StreamResult TransferTo(StreamInterface* sink, size_t* transferred,
+                                  int* error);
 
   bool Flush();
 
@@ -502,6 +549,9 @@ class MemoryStreamBase : public StreamInterface {
   virtual bool GetSize(size_t* size) const;
   virtual bool GetAvailable(size_t* size) const;
   virtual bool ReserveSize(size_t size);
+  // Writes the rest of the buffer to the sink as it is, without a copy.
+  virtual StreamResult TransferTo(StreamInterface* sink, size_t* transferred,
+                                  int* error);
 
   char* GetBuffer() { return buffer_; }
   const char* GetBuffer() const { return buffer_; }
@@ -528,6 +578,9 @@ class MemoryStream : public MemoryStreamBase {
   MemoryStream();
   explicit MemoryStream(const char* data);  // Calls SetData(data, strlen(data))
   MemoryStream(const void* data, size_t length);  // Calls SetData(data, length)
+  // Takes its storage from |allocator|, where the others take it from
+  // BufferAllocator::Default().
+  explicit MemoryStream(BufferAllocator* allocator);
   virtual ~MemoryStream();
 
   void SetData(const void* data, size_t length);
@@ -536,6 +589,7 @@ class MemoryStream : public MemoryStreamBase {
   virtual StreamResult DoReserve(size_t size, int* error);
   // Memory Streams are aligned for efficiency.
   static const int kAlignment = 16;
+  BufferAllocator* allocator_;
   char* buffer_alloc_;
 };
 
@@ -551,18 +605,60 @@ class ExternalMemoryStream : public MemoryStreamBase {
   void SetData(void* data, size_t length);
 };
 
+#ifdef POSIX
+// MappedFileStream reads a file through a read-only mapping of it.  Reads
+// skip stdio's copy, and GetReadData hands out the file's bytes in place.
+// The file's length is fixed when it is opened, and writes fail.
+
+class MappedFileStream : public MemoryStreamBase {
+ public:
+  MappedFileStream();
+  virtual ~MappedFileStream();
+
+  bool Open(const std::string& filename);
+  // Whether the file will be read in order, as it is by default, which lets
+  // the kernel read ahead further and drop the pages behind sooner.
+  void SetSequential(bool sequential);
+
+  virtual StreamState GetState() const;
+  virtual StreamResult Write(const void* buffer, size_t bytes,
+                             size_t* bytes_written, int* error);
+  virtual void Close();
+  virtual const void* GetReadData(size_t* data_len);
+  virtual void ConsumeReadData(size_t used);
+
+ private:
+  void Advise();
+
+  bool open_;
+  bool sequential_;
+  DISALLOW_EVIL_CONSTRUCTORS(MappedFileStream);
+};
+#endif  // POSIX
+
 // FifoBuffer allows for efficient, thread-safe buffering of data between
 // writer and reader. As the data can wrap around the end of the buffer,
 // MemoryStreamBase can't help us here.
 
 class FifoBuffer : public StreamInterface {
  public:
-  // Creates a FIFO buffer with the specified capacity.
-  explicit FifoBuffer(size_t length);
+  // MODE_LOCKED lets any number of threads read and write, under a lock.
+  // MODE_SPSC is for one thread writing and one other reading, as a pipe
+  // between them: each side only moves its own index, so neither takes a
+  // lock, and only a side that found the buffer empty (or full) is told of
+  // data (or room) by SE_READ (or SE_WRITE). The capacity is rounded up to
+  // a power of two.
+  enum Mode { MODE_LOCKED, MODE_SPSC };
+
+  // Creates a FIFO buffer with the specified capacity, taking its storage
+  // from |allocator|, or BufferAllocator::Default() for NULL.
+  explicit FifoBuffer(size_t length, Mode mode = MODE_LOCKED,
+                      BufferAllocator* allocator = NULL);
   virtual ~FifoBuffer();
   // Gets the amount of data currently readable from the buffer.
   bool GetBuffered(size_t* data_len) const;
-  // Resizes the buffer to the specified capacity. Fails if data_length_ > size
+  // Resizes the buffer to the specified capacity. Fails if data_length_ > size,
+  // and in MODE_SPSC, where the other side may be using the buffer.
   bool SetCapacity(size_t length);
 
   // StreamInterface methods
@@ -571,6 +667,11 @@ class FifoBuffer : public StreamInterface {
                             size_t* bytes_read, int* error);
   virtual StreamResult Write(const void* buffer, size_t bytes,
                              size_t* bytes_written, int* error);
+  // Move all of the buffers under one lock, with at most one event.
+  virtual StreamResult ReadV(const MutableIoVec* vec, size_t count,
+                             size_t* bytes_read, int* error);
+  virtual StreamResult WriteV(const IoVec* vec, size_t count,
+                              size_t* bytes_written, int* error);
   virtual void Close();
   virtual const void* GetReadData(size_t* data_len);
   virtual void ConsumeReadData(size_t used);
@@ -579,12 +680,44 @@ class FifoBuffer : public StreamInterface {
 
  private:
   StreamState state_;  // keeps the opened/closed state of the stream
-  scoped_array<char> buffer_;  // the allocated buffer
+  BufferAllocator* allocator_;  // where buffer_ comes from
+  char* buffer_;  // the allocated buffer
   size_t buffer_length_;  // size of the allocated buffer
   size_t data_length_;  // amount of readable data in the buffer
   size_t read_position_;  // offset to the readable data
   Thread* owner_;  // stream callbacks are dispatched on this thread
   mutable CriticalSection crit_;  // object lock
+
+  // Copy out of and into the buffer, with crit_ held, returning the bytes
+  // copied.
+  size_t ReadLocked(void* buffer, size_t bytes);
+  size_t WriteLocked(const void* buffer, size_t bytes);
+  // Copy |bytes| out of and into the buffer from |position| on, wrapping.
+  void CopyOut(size_t position, void* buffer, size_t bytes) const;
+  void CopyIn(size_t position, const void* buffer, size_t bytes);
+
+  // In MODE_SPSC, the bytes the reader can read and the writer can write.
+  // With |wait| set, a side that finds none asks the other to post it an
+  // event when there are some.
+  size_t ReadableSpsc(bool wait);
+  size_t WritableSpsc(bool wait);
+  // Move the index of the reader or the writer on by |bytes|, posting the
+  // event the other side is waiting for.
+  void ConsumeSpsc(size_t bytes);
+  void ProduceSpsc(size_t bytes);
+
+  const bool spsc_;
+  // With spsc_, the bytes ever read and written, masked by buffer_length_ - 1
+  // for positions; read_count_ is only stored by the reader and
+  // write_count_ by the writer. A side that found nothing to do sets its
+  // waiting flag for the other to clear when it posts the event.
+  volatile uint32 read_count_;
+  volatile uint32 write_count_;
+  volatile int read_waiting_;
+  volatile int write_waiting_;
+  // With spsc_, set by Close for the reader to see after the last write.
+  volatile int closed_;
+
   DISALLOW_EVIL_CONSTRUCTORS(FifoBuffer);
 };
 
@@ -596,6 +729,9 @@ class LoggingAdapter : public StreamAdapterInterface {
                  const std::string& label, bool hex_mode = false);
 
   void set_label(const std::string& label);
+  // Records the data in |capture|, under the current label, rather than
+  // logging it. |capture| must outlive the adapter.
+  void set_capture(WireCapture* capture);
 
   virtual StreamResult Read(void* buffer, size_t buffer_len,
                             size_t* read, int* error);
@@ -611,6 +747,8 @@ class LoggingAdapter : public StreamAdapterInterface {
   std::string label_;
   bool hex_mode_;
   LogMultilineState lms_;
+  WireCapture* capture_;
+  uint32 connection_;
 
   DISALLOW_EVIL_CONSTRUCTORS(LoggingAdapter);
 };
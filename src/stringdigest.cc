@@ -28,23 +28,154 @@
 
 #include "stringdigest.h"
 
+#if SSL_USE_OPENSSL
+#include <openssl/evp.h>
+#include <string.h>
+#endif
+
+#include "common.h"
 #include "md5.h"
 #include "stringencode.h"
 
+#if SSL_USE_OPENSSL && (OPENSSL_VERSION_NUMBER < 0x10100000L)
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
 namespace txmpp {
 
+static std::string StringDigest_Hex(const unsigned char* digest, size_t len) {
+  std::string hex_digest;
+  hex_digest.reserve(2 * len);
+  for (size_t i = 0; i < len; ++i) {
+    hex_digest += hex_encode(digest[i] >> 4);
+    hex_digest += hex_encode(digest[i] & 0xf);
+  }
+  return hex_digest;
+}
+
 std::string MD5(const std::string& data) {
   MD5_CTX ctx;
   MD5Init(&ctx);
   MD5Update(&ctx, const_cast<unsigned char *>(reinterpret_cast<const unsigned char *>(data.data())), static_cast<unsigned int>(data.size()));
   unsigned char digest[16];
   MD5Final(digest, &ctx);
-  std::string hex_digest;
-  for (int i=0; i<16; ++i) {
-    hex_digest += hex_encode(digest[i] >> 4);
-    hex_digest += hex_encode(digest[i] & 0xf);
-  }
-  return hex_digest;
+  return StringDigest_Hex(digest, sizeof(digest));
+}
+
+#if SSL_USE_OPENSSL
+
+// Both digests take their input in 64 byte blocks.
+static const size_t kDigestBlockSize = 64;
+
+static const EVP_MD* StringDigest_Md(DigestType type) {
+  return (type == DIGEST_SHA1) ? EVP_sha1() : EVP_sha256();
+}
+
+size_t DigestSize(DigestType type) {
+  return (type == DIGEST_SHA1) ? 20 : 32;
+}
+
+MessageDigest::MessageDigest(DigestType type)
+    : type_(type), ctx_(EVP_MD_CTX_new()) {
+  Reset();
+}
+
+MessageDigest::~MessageDigest() {
+  EVP_MD_CTX_free(ctx_);
+}
+
+void MessageDigest::Update(const void* data, size_t len) {
+  EVP_DigestUpdate(ctx_, data, len);
 }
 
+void MessageDigest::Finish(unsigned char* digest) {
+  EVP_DigestFinal_ex(ctx_, digest, NULL);
+  Reset();
+}
+
+void MessageDigest::Reset() {
+  EVP_DigestInit_ex(ctx_, StringDigest_Md(type_), NULL);
+}
+
+HmacDigest::HmacDigest(DigestType type, const void* key, size_t key_len)
+    : type_(type), inner_key_(type), outer_key_(type), inner_(type),
+      outer_(type) {
+  // A key longer than a block is replaced by its digest.
+  unsigned char block[kDigestBlockSize];
+  memset(block, 0, sizeof(block));
+  if (key_len > kDigestBlockSize)
+    ComputeDigest(type, key, key_len, block);
+  else
+    memcpy(block, key, key_len);
+
+  for (size_t i = 0; i < kDigestBlockSize; ++i)
+    block[i] ^= 0x36;
+  inner_key_.Update(block, sizeof(block));
+  for (size_t i = 0; i < kDigestBlockSize; ++i)
+    block[i] ^= 0x36 ^ 0x5c;
+  outer_key_.Update(block, sizeof(block));
+  memset(block, 0, sizeof(block));
+  Reset();
+}
+
+HmacDigest::~HmacDigest() {
+}
+
+void HmacDigest::Update(const void* data, size_t len) {
+  inner_.Update(data, len);
+}
+
+void HmacDigest::Finish(unsigned char* digest) {
+  unsigned char inner_digest[kMaxDigestSize];
+  EVP_DigestFinal_ex(inner_.ctx_, inner_digest, NULL);
+  EVP_MD_CTX_copy_ex(outer_.ctx_, outer_key_.ctx_);
+  outer_.Update(inner_digest, Size());
+  EVP_DigestFinal_ex(outer_.ctx_, digest, NULL);
+  Reset();
+}
+
+void HmacDigest::Reset() {
+  EVP_MD_CTX_copy_ex(inner_.ctx_, inner_key_.ctx_);
+}
+
+size_t ComputeDigest(DigestType type, const void* data, size_t len,
+                     unsigned char* digest) {
+  EVP_Digest(data, len, digest, NULL, StringDigest_Md(type), NULL);
+  return DigestSize(type);
+}
+
+size_t ComputeHmac(DigestType type, const void* key, size_t key_len,
+                   const void* data, size_t len, unsigned char* digest) {
+  HmacDigest hmac(type, key, key_len);
+  hmac.Update(data, len);
+  hmac.Finish(digest);
+  return DigestSize(type);
+}
+
+bool DerivePbkdf2(DigestType type, const void* password, size_t password_len,
+                  const void* salt, size_t salt_len, int iterations,
+                  unsigned char* out, size_t out_len) {
+  return PKCS5_PBKDF2_HMAC(static_cast<const char*>(password),
+                           static_cast<int>(password_len),
+                           static_cast<const unsigned char*>(salt),
+                           static_cast<int>(salt_len), iterations,
+                           StringDigest_Md(type), static_cast<int>(out_len),
+                           out) == 1;
+}
+
+std::string SHA1(const std::string& data) {
+  unsigned char digest[kMaxDigestSize];
+  size_t len = ComputeDigest(DIGEST_SHA1, data.data(), data.size(), digest);
+  return StringDigest_Hex(digest, len);
+}
+
+std::string SHA256(const std::string& data) {
+  unsigned char digest[kMaxDigestSize];
+  size_t len = ComputeDigest(DIGEST_SHA256, data.data(), data.size(), digest);
+  return StringDigest_Hex(digest, len);
+}
+
+#endif  // SSL_USE_OPENSSL
+
 }  // namespace txmpp
@@ -32,8 +32,15 @@
 #include "config.h"
 #endif
 
+#include <stddef.h>
 #include <string>
 
+#include "constructormagic.h"
+
+#if SSL_USE_OPENSSL
+struct evp_md_ctx_st;
+#endif
+
 namespace txmpp {
 
 //////////////////////////////////////////////////////////////////////
@@ -43,6 +50,93 @@ namespace txmpp {
 // Compute the MD5 message digest of data, and return it in 
 std::string MD5(const std::string& data);
 
+#if SSL_USE_OPENSSL
+
+// The digests below are OpenSSL's, which use the SHA extensions of x86 and
+// ARMv8 where the CPU has them.
+
+enum DigestType {
+  DIGEST_SHA1,
+  DIGEST_SHA256
+};
+
+// The size of the largest digest, for sizing buffers.
+const size_t kMaxDigestSize = 32;
+
+// Returns the size of a |type| digest.
+size_t DigestSize(DigestType type);
+
+// Computes a message digest incrementally.
+class MessageDigest {
+ public:
+  explicit MessageDigest(DigestType type);
+  ~MessageDigest();
+
+  DigestType type() const { return type_; }
+  size_t Size() const { return DigestSize(type_); }
+
+  void Update(const void* data, size_t len);
+  // Writes the Size() bytes of the digest of what was passed to Update to
+  // |digest|, and starts over.
+  void Finish(unsigned char* digest);
+  void Reset();
+
+ private:
+  friend class HmacDigest;
+
+  DigestType type_;
+  evp_md_ctx_st* ctx_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(MessageDigest);
+};
+
+// Computes an HMAC (RFC 2104) incrementally.  The keyed state is computed
+// once, so that Finish and Reset are cheap for SCRAM's many iterations.
+class HmacDigest {
+ public:
+  HmacDigest(DigestType type, const void* key, size_t key_len);
+  ~HmacDigest();
+
+  size_t Size() const { return DigestSize(type_); }
+
+  void Update(const void* data, size_t len);
+  // Writes the Size() bytes of the HMAC of what was passed to Update to
+  // |digest|, and starts over with the same key.
+  void Finish(unsigned char* digest);
+  void Reset();
+
+ private:
+  DigestType type_;
+  // The digest states after the inner and outer padded keys, and the
+  // current inner one.
+  MessageDigest inner_key_;
+  MessageDigest outer_key_;
+  MessageDigest inner_;
+  MessageDigest outer_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(HmacDigest);
+};
+
+// Write the |type| digest or HMAC of |data| to |digest|, which must have
+// room for DigestSize(type) bytes, and return that size.
+size_t ComputeDigest(DigestType type, const void* data, size_t len,
+                     unsigned char* digest);
+size_t ComputeHmac(DigestType type, const void* key, size_t key_len,
+                   const void* data, size_t len, unsigned char* digest);
+
+// Derives |out_len| bytes from |password| and |salt| with PBKDF2 (RFC 2898)
+// over a |type| HMAC.  Returns false if OpenSSL fails.
+bool DerivePbkdf2(DigestType type, const void* password, size_t password_len,
+                  const void* salt, size_t salt_len, int iterations,
+                  unsigned char* out, size_t out_len);
+
+// Compute the SHA-1 or SHA-256 message digest of data, and return it in
+// hex, as MD5 does.
+std::string SHA1(const std::string& data);
+std::string SHA256(const std::string& data);
+
+#endif  // SSL_USE_OPENSSL
+
 //////////////////////////////////////////////////////////////////////
 
 }  // namespace txmpp
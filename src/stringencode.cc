@@ -30,6 +30,15 @@
 #include <cstdio>
 #include <cstdlib>
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ENCODE_SCAN_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define ENCODE_SCAN_NEON 1
+#endif
+
 #include "basictypes.h"
 #include "common.h"
 #include "stringutils.h"
@@ -60,6 +69,92 @@ bool hex_decode(char ch, unsigned char* val) {
   return true;
 }
 
+#if ENCODE_SCAN_SSE2 || ENCODE_SCAN_NEON
+static inline size_t LowestSetBit(uint64 mask) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(mask);
+#else
+  size_t bit = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    ++bit;
+  }
+  return bit;
+#endif
+}
+#endif
+
+#if ENCODE_SCAN_NEON
+// Narrows each byte of a comparison to 4 bits of a 64-bit mask, as NEON has
+// no movemask.
+static inline uint64 StringEncode_NeonMask(uint8x16_t hits) {
+  uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(hits), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+}
+#endif
+
+// The most bytes StringEncode_FindAny compares each block against.
+static const size_t kMaxScanSet = 16;
+
+// Returns the offset of the first byte of source that is one of the setlen
+// bytes of set, or srclen if there is none.
+static size_t StringEncode_FindAny(const char * source, size_t srclen,
+                                   const char * set, size_t setlen) {
+  ASSERT(setlen <= kMaxScanSet);
+  size_t pos = 0;
+#if ENCODE_SCAN_SSE2
+  if (setlen > 0) {
+    __m128i needles[kMaxScanSet];
+    for (size_t i = 0; i < setlen; ++i)
+      needles[i] = _mm_set1_epi8(set[i]);
+    for (; pos + 16 <= srclen; pos += 16) {
+      __m128i v =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + pos));
+      __m128i hits = _mm_cmpeq_epi8(v, needles[0]);
+      for (size_t i = 1; i < setlen; ++i)
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(v, needles[i]));
+      int mask = _mm_movemask_epi8(hits);
+      if (mask)
+        return pos + LowestSetBit(static_cast<uint64>(mask));
+    }
+  }
+#elif ENCODE_SCAN_NEON
+  if (setlen > 0) {
+    uint8x16_t needles[kMaxScanSet];
+    for (size_t i = 0; i < setlen; ++i)
+      needles[i] = vdupq_n_u8(static_cast<uint8_t>(set[i]));
+    for (; pos + 16 <= srclen; pos += 16) {
+      uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(source + pos));
+      uint8x16_t hits = vceqq_u8(v, needles[0]);
+      for (size_t i = 1; i < setlen; ++i)
+        hits = vorrq_u8(hits, vceqq_u8(v, needles[i]));
+      uint64 mask = StringEncode_NeonMask(hits);
+      if (mask)
+        return pos + LowestSetBit(mask) / 4;
+    }
+  }
+#endif
+  for (; pos < srclen; ++pos) {
+    if (memchr(set, source[pos], setlen))
+      return pos;
+  }
+  return srclen;
+}
+
+// Fills set with the bytes escape and encode replace: the escape character,
+// those of illegal, and the NUL that strchr finds in any string. Returns
+// the number of bytes, or 0 if there are too many to scan for.
+static size_t StringEncode_EscapeSet(const char * illegal, char escape,
+                                     char * set) {
+  size_t illegal_len = strlen(illegal);
+  if (illegal_len + 2 > kMaxScanSet)
+    return 0;
+  set[0] = escape;
+  set[1] = '\0';
+  memcpy(set + 2, illegal, illegal_len);
+  return illegal_len + 2;
+}
+
 size_t escape(char * buffer, size_t buflen,
               const char * source, size_t srclen,
               const char * illegal, char escape) {
@@ -67,8 +162,20 @@ size_t escape(char * buffer, size_t buflen,
   if (buflen <= 0)
     return 0;
 
+  char set[kMaxScanSet];
+  size_t setlen = StringEncode_EscapeSet(illegal, escape, set);
   size_t srcpos = 0, bufpos = 0;
   while ((srcpos < srclen) && (bufpos + 1 < buflen)) {
+    if (setlen) {
+      size_t run = StringEncode_FindAny(source + srcpos, srclen - srcpos,
+                                        set, setlen);
+      run = _min(run, buflen - 1 - bufpos);
+      memcpy(buffer + bufpos, source + srcpos, run);
+      srcpos += run;
+      bufpos += run;
+      if ((srcpos == srclen) || (bufpos + 1 == buflen))
+        break;
+    }
     char ch = source[srcpos++];
     if ((ch == escape) || ::strchr(illegal, ch)) {
       if (bufpos + 2 >= buflen)
@@ -91,6 +198,15 @@ size_t unescape(char * buffer, size_t buflen,
 
   size_t srcpos = 0, bufpos = 0;
   while ((srcpos < srclen) && (bufpos + 1 < buflen)) {
+    // The run may overlap its destination when unescaping in place.
+    size_t run = StringEncode_FindAny(source + srcpos, srclen - srcpos,
+                                      &escape, 1);
+    run = _min(run, buflen - 1 - bufpos);
+    memmove(buffer + bufpos, source + srcpos, run);
+    srcpos += run;
+    bufpos += run;
+    if ((srcpos == srclen) || (bufpos + 1 == buflen))
+      break;
     char ch = source[srcpos++];
     if ((ch == escape) && (srcpos < srclen)) {
       ch = source[srcpos++];
@@ -108,8 +224,20 @@ size_t encode(char * buffer, size_t buflen,
   if (buflen <= 0)
     return 0;
 
+  char set[kMaxScanSet];
+  size_t setlen = StringEncode_EscapeSet(illegal, escape, set);
   size_t srcpos = 0, bufpos = 0;
   while ((srcpos < srclen) && (bufpos + 1 < buflen)) {
+    if (setlen) {
+      size_t run = StringEncode_FindAny(source + srcpos, srclen - srcpos,
+                                        set, setlen);
+      run = _min(run, buflen - 1 - bufpos);
+      memcpy(buffer + bufpos, source + srcpos, run);
+      srcpos += run;
+      bufpos += run;
+      if ((srcpos == srclen) || (bufpos + 1 == buflen))
+        break;
+    }
     char ch = source[srcpos++];
     if ((ch != escape) && !::strchr(illegal, ch)) {
       buffer[bufpos++] = ch;
@@ -135,6 +263,15 @@ size_t decode(char * buffer, size_t buflen,
   unsigned char h1, h2;
   size_t srcpos = 0, bufpos = 0;
   while ((srcpos < srclen) && (bufpos + 1 < buflen)) {
+    // The run may overlap its destination when decoding in place.
+    size_t run = StringEncode_FindAny(source + srcpos, srclen - srcpos,
+                                      &escape, 1);
+    run = _min(run, buflen - 1 - bufpos);
+    memmove(buffer + bufpos, source + srcpos, run);
+    srcpos += run;
+    bufpos += run;
+    if ((srcpos == srclen) || (bufpos + 1 == buflen))
+      break;
     char ch = source[srcpos++];
     if ((ch == escape)
         && (srcpos + 1 < srclen)
@@ -156,9 +293,8 @@ const char* unsafe_filename_characters() {
 #ifdef WIN32
   return "\\/:*?\"<>|";
 #else  // !WIN32
-  // TODO
-  ASSERT(false);
-  return "";
+  // Only the folder delimiter can't appear in a POSIX filename.
+  return "/";
 #endif  // !WIN23
 }
 
@@ -177,6 +313,75 @@ const unsigned char ASCII_CLASS[128] = {
   1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,0,1,
 };
 
+// Returns the offset of the first byte of source that url_encode escapes,
+// or srclen if there is none. Those are the ASCII bytes other than letters,
+// digits and !'()*-._~, which the vector loops test as ranges.
+static size_t StringEncode_FindUrlUnsafe(const char * source, size_t srclen) {
+  size_t pos = 0;
+#if ENCODE_SCAN_SSE2
+  const __m128i case_bit = _mm_set1_epi8(0x20);
+  const __m128i before_a = _mm_set1_epi8('a' - 1);
+  const __m128i after_z = _mm_set1_epi8('z' + 1);
+  const __m128i before_0 = _mm_set1_epi8('0' - 1);
+  const __m128i after_9 = _mm_set1_epi8('9' + 1);
+  const __m128i before_apos = _mm_set1_epi8('\'' - 1);
+  const __m128i after_star = _mm_set1_epi8('*' + 1);
+  const __m128i before_dash = _mm_set1_epi8('-' - 1);
+  const __m128i after_dot = _mm_set1_epi8('.' + 1);
+  const __m128i bang = _mm_set1_epi8('!');
+  const __m128i underscore = _mm_set1_epi8('_');
+  const __m128i tilde = _mm_set1_epi8('~');
+  for (; pos + 16 <= srclen; pos += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + pos));
+    // Folds upper case onto lower case; no other byte lands in a to z.
+    __m128i folded = _mm_or_si128(v, case_bit);
+    __m128i safe = _mm_and_si128(_mm_cmpgt_epi8(folded, before_a),
+                                 _mm_cmplt_epi8(folded, after_z));
+    safe = _mm_or_si128(safe, _mm_and_si128(_mm_cmpgt_epi8(v, before_0),
+                                            _mm_cmplt_epi8(v, after_9)));
+    safe = _mm_or_si128(safe, _mm_and_si128(_mm_cmpgt_epi8(v, before_apos),
+                                            _mm_cmplt_epi8(v, after_star)));
+    safe = _mm_or_si128(safe, _mm_and_si128(_mm_cmpgt_epi8(v, before_dash),
+                                            _mm_cmplt_epi8(v, after_dot)));
+    safe = _mm_or_si128(safe, _mm_or_si128(_mm_cmpeq_epi8(v, bang),
+        _mm_or_si128(_mm_cmpeq_epi8(v, underscore),
+                     _mm_cmpeq_epi8(v, tilde))));
+    // Bytes from 128 up are negative here, and passed through unescaped.
+    int mask = ~(_mm_movemask_epi8(safe) | _mm_movemask_epi8(v)) & 0xFFFF;
+    if (mask)
+      return pos + LowestSetBit(static_cast<uint64>(mask));
+  }
+#elif ENCODE_SCAN_NEON
+  const uint8x16_t case_bit = vdupq_n_u8(0x20);
+  const uint8x16_t high = vdupq_n_u8(0x80);
+  for (; pos + 16 <= srclen; pos += 16) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(source + pos));
+    uint8x16_t folded = vorrq_u8(v, case_bit);
+    uint8x16_t safe = vandq_u8(vcgeq_u8(folded, vdupq_n_u8('a')),
+                               vcleq_u8(folded, vdupq_n_u8('z')));
+    safe = vorrq_u8(safe, vandq_u8(vcgeq_u8(v, vdupq_n_u8('0')),
+                                   vcleq_u8(v, vdupq_n_u8('9'))));
+    safe = vorrq_u8(safe, vandq_u8(vcgeq_u8(v, vdupq_n_u8('\'')),
+                                   vcleq_u8(v, vdupq_n_u8('*'))));
+    safe = vorrq_u8(safe, vandq_u8(vcgeq_u8(v, vdupq_n_u8('-')),
+                                   vcleq_u8(v, vdupq_n_u8('.'))));
+    safe = vorrq_u8(safe, vorrq_u8(vceqq_u8(v, vdupq_n_u8('!')),
+        vorrq_u8(vceqq_u8(v, vdupq_n_u8('_')),
+                 vceqq_u8(v, vdupq_n_u8('~')))));
+    safe = vorrq_u8(safe, vcgeq_u8(v, high));
+    uint64 mask = ~StringEncode_NeonMask(safe);
+    if (mask)
+      return pos + LowestSetBit(mask) / 4;
+  }
+#endif
+  for (; pos < srclen; ++pos) {
+    unsigned char ch = source[pos];
+    if ((ch < 128) && (ASCII_CLASS[ch] & URL_UNSAFE))
+      return pos;
+  }
+  return srclen;
+}
+
 size_t url_encode(char * buffer, size_t buflen,
                   const char * source, size_t srclen) {
   if (NULL == buffer)
@@ -186,6 +391,13 @@ size_t url_encode(char * buffer, size_t buflen,
 
   size_t srcpos = 0, bufpos = 0;
   while ((srcpos < srclen) && (bufpos + 1 < buflen)) {
+    size_t run = StringEncode_FindUrlUnsafe(source + srcpos, srclen - srcpos);
+    run = _min(run, buflen - 1 - bufpos);
+    memcpy(buffer + bufpos, source + srcpos, run);
+    srcpos += run;
+    bufpos += run;
+    if ((srcpos == srclen) || (bufpos + 1 == buflen))
+      break;
     unsigned char ch = source[srcpos++];
     if ((ch < 128) && (ASCII_CLASS[ch] & URL_UNSAFE)) {
       if (bufpos + 3 >= buflen) {
@@ -210,9 +422,19 @@ size_t url_decode(char * buffer, size_t buflen,
   if (buflen <= 0)
     return 0;
 
+  static const char kUrlEscapes[] = { '%', '+' };
   unsigned char h1, h2;
   size_t srcpos = 0, bufpos = 0;
   while ((srcpos < srclen) && (bufpos + 1 < buflen)) {
+    // The run may overlap its destination when decoding in place.
+    size_t run = StringEncode_FindAny(source + srcpos, srclen - srcpos,
+                                      kUrlEscapes, ARRAY_SIZE(kUrlEscapes));
+    run = _min(run, buflen - 1 - bufpos);
+    memmove(buffer + bufpos, source + srcpos, run);
+    srcpos += run;
+    bufpos += run;
+    if ((srcpos == srclen) || (bufpos + 1 == buflen))
+      break;
     unsigned char ch = source[srcpos++];
     if (ch == '+') {
       buffer[bufpos++] = ' ';
@@ -292,6 +514,63 @@ size_t utf8_encode(char* buffer, size_t buflen, unsigned long value) {
   return 0;
 }
 
+// Returns the offset of the first byte of source that xml_encode escapes,
+// or with stop_at_non_ascii the first that html_encode may, which takes in
+// the bytes from 128 up as well. srclen if there is none.
+static size_t StringEncode_FindXmlUnsafe(const char * source, size_t srclen,
+                                         bool stop_at_non_ascii) {
+  size_t pos = 0;
+#if ENCODE_SCAN_SSE2
+  const __m128i lt = _mm_set1_epi8('<');
+  const __m128i gt = _mm_set1_epi8('>');
+  const __m128i amp = _mm_set1_epi8('&');
+  const __m128i apos = _mm_set1_epi8('\'');
+  const __m128i quot = _mm_set1_epi8('\"');
+  for (; pos + 16 <= srclen; pos += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + pos));
+    __m128i hits = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, amp),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, apos),
+                                  _mm_cmpeq_epi8(v, quot))));
+    int mask = _mm_movemask_epi8(hits);
+    if (stop_at_non_ascii)
+      mask |= _mm_movemask_epi8(v);
+    if (mask)
+      return pos + LowestSetBit(static_cast<uint64>(mask));
+  }
+#elif ENCODE_SCAN_NEON
+  const uint8x16_t lt = vdupq_n_u8('<');
+  const uint8x16_t gt = vdupq_n_u8('>');
+  const uint8x16_t amp = vdupq_n_u8('&');
+  const uint8x16_t apos = vdupq_n_u8('\'');
+  const uint8x16_t quot = vdupq_n_u8('\"');
+  const uint8x16_t high = vdupq_n_u8(0x80);
+  for (; pos + 16 <= srclen; pos += 16) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(source + pos));
+    uint8x16_t hits = vorrq_u8(
+        vorrq_u8(vceqq_u8(v, lt), vceqq_u8(v, gt)),
+        vorrq_u8(vceqq_u8(v, amp),
+                 vorrq_u8(vceqq_u8(v, apos), vceqq_u8(v, quot))));
+    if (stop_at_non_ascii)
+      hits = vorrq_u8(hits, vcgeq_u8(v, high));
+    uint64 mask = StringEncode_NeonMask(hits);
+    if (mask)
+      return pos + LowestSetBit(mask) / 4;
+  }
+#endif
+  for (; pos < srclen; ++pos) {
+    unsigned char ch = source[pos];
+    if (ch >= 128) {
+      if (stop_at_non_ascii)
+        return pos;
+    } else if (ASCII_CLASS[ch] & XML_UNSAFE) {
+      return pos;
+    }
+  }
+  return srclen;
+}
+
 size_t html_encode(char * buffer, size_t buflen,
                    const char * source, size_t srclen) {
   ASSERT(NULL != buffer);  // TODO: estimate output size
@@ -300,6 +579,15 @@ size_t html_encode(char * buffer, size_t buflen,
 
   size_t srcpos = 0, bufpos = 0;
   while ((srcpos < srclen) && (bufpos + 1 < buflen)) {
+    // Copies the run of plain ASCII up to the next character to escape.
+    size_t run = StringEncode_FindXmlUnsafe(source + srcpos, srclen - srcpos,
+                                            true);
+    run = _min(run, buflen - 1 - bufpos);
+    memcpy(buffer + bufpos, source + srcpos, run);
+    srcpos += run;
+    bufpos += run;
+    if ((srcpos == srclen) || (bufpos + 1 == buflen))
+      break;
     unsigned char ch = source[srcpos];
     if (ch < 128) {
       srcpos += 1;
@@ -350,6 +638,10 @@ size_t html_decode(char * buffer, size_t buflen,
   return xml_decode(buffer, buflen, source, srclen);
 }
 
+size_t xml_find_unsafe(const char * source, size_t srclen) {
+  return StringEncode_FindXmlUnsafe(source, srclen, false);
+}
+
 size_t xml_encode(char * buffer, size_t buflen,
                   const char * source, size_t srclen) {
   ASSERT(NULL != buffer);  // TODO: estimate output size
@@ -358,26 +650,30 @@ size_t xml_encode(char * buffer, size_t buflen,
 
   size_t srcpos = 0, bufpos = 0;
   while ((srcpos < srclen) && (bufpos + 1 < buflen)) {
-    unsigned char ch = source[srcpos++];
-    if ((ch < 128) && (ASCII_CLASS[ch] & XML_UNSAFE)) {
-      const char * escseq = 0;
-      size_t esclen = 0;
-      switch (ch) {
-        case '<':  escseq = "&lt;";   esclen = 4; break;
-        case '>':  escseq = "&gt;";   esclen = 4; break;
-        case '\'': escseq = "&apos;"; esclen = 6; break;
-        case '\"': escseq = "&quot;"; esclen = 6; break;
-        case '&':  escseq = "&amp;";  esclen = 5; break;
-        default: ASSERT(false);
-      }
-      if (bufpos + esclen >= buflen) {
-        break;
-      }
-      memcpy(buffer + bufpos, escseq, esclen);
-      bufpos += esclen;
-    } else {
-      buffer[bufpos++] = ch;
+    // Copies the run up to the next character to escape in one go.
+    size_t run = xml_find_unsafe(source + srcpos, srclen - srcpos);
+    run = _min(run, buflen - 1 - bufpos);
+    memcpy(buffer + bufpos, source + srcpos, run);
+    srcpos += run;
+    bufpos += run;
+    if ((srcpos == srclen) || (bufpos + 1 == buflen))
+      break;
+
+    const char * escseq = 0;
+    size_t esclen = 0;
+    switch (source[srcpos++]) {
+      case '<':  escseq = "&lt;";   esclen = 4; break;
+      case '>':  escseq = "&gt;";   esclen = 4; break;
+      case '\'': escseq = "&apos;"; esclen = 6; break;
+      case '\"': escseq = "&quot;"; esclen = 6; break;
+      case '&':  escseq = "&amp;";  esclen = 5; break;
+      default: ASSERT(false);
+    }
+    if (bufpos + esclen >= buflen) {
+      break;
     }
+    memcpy(buffer + bufpos, escseq, esclen);
+    bufpos += esclen;
   }
   buffer[bufpos] = '\0';
   return bufpos;
@@ -462,6 +758,44 @@ size_t hex_encode(char * buffer, size_t buflen,
 
   size_t srcpos = 0, bufpos = 0;
   srclen = _min(srclen, (buflen - 1) / 2);
+  // Splits 16 bytes into their nibbles, interleaves them high first, and
+  // maps each to its digit with a compare instead of a lookup.
+#if ENCODE_SCAN_SSE2
+  const __m128i low_nibble = _mm_set1_epi8(0x0F);
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i letter_gap = _mm_set1_epi8('a' - '0' - 10);
+  for (; srcpos + 16 <= srclen; srcpos += 16, bufpos += 32) {
+    __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(bsource + srcpos));
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low_nibble);
+    __m128i lo = _mm_and_si128(v, low_nibble);
+    __m128i first = _mm_unpacklo_epi8(hi, lo);
+    __m128i second = _mm_unpackhi_epi8(hi, lo);
+    first = _mm_add_epi8(_mm_add_epi8(first, zero),
+        _mm_and_si128(_mm_cmpgt_epi8(first, nine), letter_gap));
+    second = _mm_add_epi8(_mm_add_epi8(second, zero),
+        _mm_and_si128(_mm_cmpgt_epi8(second, nine), letter_gap));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(buffer + bufpos), first);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(buffer + bufpos + 16),
+                     second);
+  }
+#elif ENCODE_SCAN_NEON
+  const uint8x16_t low_nibble = vdupq_n_u8(0x0F);
+  const uint8x16_t zero = vdupq_n_u8('0');
+  const uint8x16_t nine = vdupq_n_u8(9);
+  const uint8x16_t letter_gap = vdupq_n_u8('a' - '0' - 10);
+  for (; srcpos + 16 <= srclen; srcpos += 16, bufpos += 32) {
+    uint8x16_t v = vld1q_u8(bsource + srcpos);
+    uint8x16x2_t digits = vzipq_u8(vshrq_n_u8(v, 4), vandq_u8(v, low_nibble));
+    for (int i = 0; i < 2; ++i) {
+      digits.val[i] = vaddq_u8(vaddq_u8(digits.val[i], zero),
+          vandq_u8(vcgtq_u8(digits.val[i], nine), letter_gap));
+    }
+    vst1q_u8(reinterpret_cast<uint8_t *>(buffer + bufpos), digits.val[0]);
+    vst1q_u8(reinterpret_cast<uint8_t *>(buffer + bufpos + 16), digits.val[1]);
+  }
+#endif
   while (srcpos < srclen) {
     unsigned char ch = bsource[srcpos++];
     buffer[bufpos  ] = hex_encode((ch >> 4) & 0xF);
@@ -98,6 +98,10 @@ size_t html_decode(char * buffer, size_t buflen,
 // xml_encode makes data suitable for inside xml attributes and values.
 size_t xml_encode(char * buffer, size_t buflen,
                   const char * source, size_t srclen);
+// Returns the offset of the first character in source that xml_encode
+// escapes, or srclen if there is none. Scans 16 bytes at a time with SSE2
+// or NEON where the target has them.
+size_t xml_find_unsafe(const char * source, size_t srclen);
 // Note: in-place decoding (buffer == source) is allowed.
 size_t xml_decode(char * buffer, size_t buflen,
                   const char * source, size_t srclen);
@@ -27,6 +27,8 @@
 
 #include "task.h"
 
+#include "allocstats.h"
+#include "blockpool.h"
 #include "common.h"
 #include "taskrunner.h"
 
@@ -34,6 +36,39 @@ namespace txmpp {
 
 int32 Task::unique_id_seed_ = 0;
 
+// Size classes for Tasks. Larger ones come from the heap.
+static const size_t kTaskSizes[] = { 256, 512, 1024 };
+static const int kTaskPools = ARRAY_SIZE(kTaskSizes);
+
+static BlockPool* Task_Pool(size_t size) {
+  // Never destroyed, as tasks may outlive static destruction.
+  static BlockPool* pools[kTaskPools] = {
+    new BlockPool(kTaskSizes[0]),
+    new BlockPool(kTaskSizes[1]),
+    new BlockPool(kTaskSizes[2]),
+  };
+  for (int i = 0; i < kTaskPools; ++i) {
+    if (size <= kTaskSizes[i])
+      return pools[i];
+  }
+  return NULL;
+}
+
+void* Task::operator new(size_t size) {
+  AllocStats::Record(AllocStats::AS_TASK, size);
+  BlockPool* pool = Task_Pool(size);
+  return pool ? pool->Allocate() : ::operator new(size);
+}
+
+void Task::operator delete(void* p, size_t size) {
+  BlockPool* pool = Task_Pool(size);
+  if (pool) {
+    pool->Free(p);
+  } else {
+    ::operator delete(p);
+  }
+}
+
 Task::Task(TaskParent *parent)
     : TaskParent(this, parent),
       state_(STATE_INIT),
@@ -42,10 +77,14 @@ Task::Task(TaskParent *parent)
       aborted_(false),
       busy_(false),
       error_(false),
+      started_(false),
+      queued_(false),
+      queued_time_(0),
       start_time_(0),
       timeout_time_(0),
       timeout_seconds_(0),
-      timeout_suspended_(false)  {
+      timeout_suspended_(false),
+      timeout_index_(TaskRunner::kNoTimeoutIndex)  {
   unique_id_ = unique_id_seed_++;
 
   // sanity check that we didn't roll-over our id seed
@@ -57,6 +96,7 @@ Task::~Task() {
   ASSERT(!done_ || GetRunner()->is_ok_to_delete(this));
   ASSERT(state_ == STATE_INIT || done_);
   ASSERT(state_ == STATE_INIT || blocked_);
+  ASSERT(!queued_);
 
   // If the task is being deleted without being done, it
   // means that it hasn't been removed from its parent.
@@ -64,6 +104,8 @@ Task::~Task() {
   if (!done_) {
     Stop();
   }
+  if (timeout_index_ != TaskRunner::kNoTimeoutIndex)
+    GetRunner()->RemoveTimeout(this);
 }
 
 int64 Task::CurrentTime() {
@@ -81,6 +123,7 @@ void Task::Start() {
   // finishes quickly and deletes the Task object, setting start_time_
   // will crash.
   start_time_ = CurrentTime();
+  started_ = true;
   GetRunner()->StartTask(this);
 }
 
@@ -172,6 +215,9 @@ void Task::Abort(bool nowake) {
     // verify that stop removed this from its parent
     ASSERT(!parent()->IsChildTask(this));
 #endif
+    // Queue the task for its runner to delete.
+    if (started_)
+      GetRunner()->QueueTask(this);
     if (!nowake) {
       // WakeTasks to self-delete.
       // Don't call Wake() because it is a no-op after "done_" is set.
@@ -182,12 +228,16 @@ void Task::Abort(bool nowake) {
 }
 
 void Task::Wake() {
-  if (done_)
-    return;
-  if (blocked_) {
-    blocked_ = false;
+  if (Unblock())
     GetRunner()->WakeTasks();
-  }
+}
+
+bool Task::Unblock() {
+  if (done_ || !blocked_)
+    return false;
+  blocked_ = false;
+  GetRunner()->QueueTask(this);
+  return true;
 }
 
 void Task::Error() {
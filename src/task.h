@@ -116,6 +116,11 @@ class Task : public TaskParent {
   Task(TaskParent *parent);
   virtual ~Task();
 
+  // Tasks of the common sizes come from pools, as short-lived ones such as
+  // IQ tasks are made and deleted at high rates.
+  static void* operator new(size_t size);
+  static void operator delete(void* p, size_t size);
+
   int32 unique_id() { return unique_id_; }
 
   void Start();
@@ -176,7 +181,13 @@ class Task : public TaskParent {
   }
 
  private:
+  friend class TaskRunner;
+  friend class TaskStats;
+
   void Done();
+  // Clears blocked_ unless the task is done, queueing the task to run, and
+  // returns true if it did.
+  bool Unblock();
 
   int state_;
   bool blocked_;
@@ -184,10 +195,18 @@ class Task : public TaskParent {
   bool aborted_;
   bool busy_;
   bool error_;
+  // Set once the task is handed to its runner, and while it is in the
+  // runner's ready queue.
+  bool started_;
+  bool queued_;
+  // The TimeMicros() the task was queued at, while its runner has stats.
+  uint64 queued_time_;
   int64 start_time_;
   int64 timeout_time_;
   int timeout_seconds_;
   bool timeout_suspended_;
+  // The task's position in its runner's timeout heap, or kNoTimeoutIndex.
+  size_t timeout_index_;
   int32 unique_id_;
   
   static int32 unique_id_seed_;
@@ -34,8 +34,40 @@
 
 namespace txmpp {
 
+TaskParent::ChildList::ChildList(const ChildList &other)
+    : items_(inline_), size_(0), capacity_(kInlineChildren) {
+  if (other.size_ > capacity_) {
+    items_ = new Task*[other.size_];
+    capacity_ = other.size_;
+  }
+  std::copy(other.items_, other.items_ + other.size_, items_);
+  size_ = other.size_;
+}
+
+size_t TaskParent::ChildList::Add(Task *task) {
+  if (size_ == capacity_) {
+    Task **items = new Task*[capacity_ * 2];
+    std::copy(items_, items_ + size_, items);
+    if (items_ != inline_)
+      delete [] items_;
+    items_ = items;
+    capacity_ *= 2;
+  }
+  items_[size_] = task;
+  return size_++;
+}
+
+Task *TaskParent::ChildList::RemoveAt(size_t index) {
+  ASSERT(index < size_);
+  if (index == --size_)
+    return NULL;
+  items_[index] = items_[size_];
+  return items_[index];
+}
+
 TaskParent::TaskParent(Task* derived_instance, TaskParent *parent)
-    : parent_(parent) {
+    : parent_(parent),
+      child_index_(kNotAChild) {
   ASSERT(derived_instance != NULL);
   ASSERT(parent != NULL);
   runner_ = parent->GetRunner();
@@ -45,33 +77,32 @@ TaskParent::TaskParent(Task* derived_instance, TaskParent *parent)
 
 TaskParent::TaskParent(TaskRunner *derived_instance)
     : parent_(NULL),
-      runner_(derived_instance) {
+      runner_(derived_instance),
+      child_index_(kNotAChild) {
   ASSERT(derived_instance != NULL);
   Initialize();
 }
 
 // Does common initialization of member variables
 void TaskParent::Initialize() {
-  children_.reset(new ChildSet());
   child_error_ = false;
 }
 
 void TaskParent::AddChild(Task *child) {
-  children_->insert(child);
+  child->child_index_ = children_.Add(child);
 }
 
 #ifdef _DEBUG
 bool TaskParent::IsChildTask(Task *task) {
   ASSERT(task != NULL);
-  return task->parent_ == this && children_->find(task) != children_->end();
+  return task->parent_ == this && task->child_index_ != kNotAChild &&
+         children_.at(task->child_index_) == task;
 }
 #endif
 
 bool TaskParent::AllChildrenDone() {
-  for (ChildSet::iterator it = children_->begin();
-       it != children_->end();
-       ++it) {
-    if (!(*it)->IsDone())
+  for (size_t i = 0; i < children_.size(); ++i) {
+    if (!children_.at(i)->IsDone())
       return false;
   }
   return true;
@@ -82,14 +113,14 @@ bool TaskParent::AnyChildError() {
 }
 
 void TaskParent::AbortAllChildren() {
-  if (children_->size() > 0) {
+  if (children_.size() > 0) {
 #ifdef _DEBUG
     runner_->IncrementAbortCount();
 #endif
 
-    ChildSet copy = *children_;
-    for (ChildSet::iterator it = copy.begin(); it != copy.end(); ++it) {
-      (*it)->Abort(true);  // Note we do not wake
+    ChildList copy(children_);
+    for (size_t i = 0; i < copy.size(); ++i) {
+      copy.at(i)->Abort(true);  // Note we do not wake
     }
 
 #ifdef _DEBUG
@@ -106,7 +137,14 @@ void TaskParent::OnStopped(Task *task) {
 void TaskParent::OnChildStopped(Task *child) {
   if (child->HasError())
     child_error_ = true;
-  children_->erase(child);
+  size_t index = child->child_index_;
+  if (index == kNotAChild)
+    return;
+  ASSERT(children_.at(index) == child);
+  Task* moved = children_.RemoveAt(index);
+  if (moved)
+    moved->child_index_ = index;
+  child->child_index_ = kNotAChild;
 }
 
 }  // namespace txmpp
@@ -32,10 +32,10 @@
 #include "config.h"
 #endif
 
-#include <set>
+#include <stddef.h>
 
 #include "basictypes.h"
-#include "scoped_ptr.h"
+#include "constructormagic.h"
 
 namespace txmpp {
 
@@ -75,6 +75,39 @@ class TaskParent {
   }
 
  private:
+  // The children, in no particular order.  The first few are kept inline,
+  // so that most tasks never allocate for them; each child knows its index
+  // for removal in O(1).
+  class ChildList {
+   public:
+    ChildList() : items_(inline_), size_(0), capacity_(kInlineChildren) {}
+    ChildList(const ChildList &other);
+    ~ChildList() {
+      if (items_ != inline_)
+        delete [] items_;
+    }
+
+    size_t size() const { return size_; }
+    Task *at(size_t index) const { return items_[index]; }
+    // Returns the index of |task|.
+    size_t Add(Task *task);
+    // Moves the last child to |index| and returns it, or NULL if |index|
+    // held the last child.
+    Task *RemoveAt(size_t index);
+
+   private:
+    enum { kInlineChildren = 4 };
+
+    Task *inline_[kInlineChildren];
+    Task **items_;
+    size_t size_;
+    size_t capacity_;
+
+    void operator=(const ChildList &);
+  };
+
+  static const size_t kNotAChild = static_cast<size_t>(-1);
+
   void Initialize();
   void OnChildStopped(Task *child);
   void AddChild(Task *child);
@@ -82,8 +115,9 @@ class TaskParent {
   TaskParent *parent_;
   TaskRunner *runner_;
   bool child_error_;
-  typedef std::set<Task *> ChildSet;
-  scoped_ptr<ChildSet> children_;
+  ChildList children_;
+  // The position of this task in its parent's children_, or kNotAChild.
+  size_t child_index_;
   DISALLOW_EVIL_CONSTRUCTORS(TaskParent);
 };
 
@@ -27,19 +27,24 @@
 
 #include "taskrunner.h"
 
-#include <algorithm>
+#include <typeinfo>
 
 #include "common.h"
 #include "scoped_ptr.h"
+#include "stalldetector.h"
 #include "task.h"
+#include "taskstats.h"
 #include "logging.h"
+#include "time.h"
+#include "tracepoints.h"
 
 namespace txmpp {
 
 TaskRunner::TaskRunner()
   : TaskParent(this),
     next_timeout_task_(NULL),
-    tasks_running_(false)
+    tasks_running_(false),
+    stats_(NULL)
 #ifdef _DEBUG
     , abort_count_(0),
     deleting_task_(NULL)
@@ -53,8 +58,12 @@ TaskRunner::~TaskRunner() {
   InternalRunTasks(true);
 }
 
+int64 TaskRunner::CurrentTime() {
+  return CachedTimeMillis() * kMsecTo100ns;
+}
+
 void TaskRunner::StartTask(Task * task) {
-  tasks_.push_back(task);
+  QueueTask(task);
 
   // the task we just started could be about to timeout --
   // make sure our "next timeout task" is correct
@@ -63,6 +72,14 @@ void TaskRunner::StartTask(Task * task) {
   WakeTasks();
 }
 
+void TaskRunner::QueueTask(Task * task) {
+  if (task->queued_)
+    return;
+  task->queued_ = true;
+  task->queued_time_ = stats_ ? TimeMicros() : 0;
+  ready_.push_back(task);
+}
+
 void TaskRunner::RunTasks() {
   InternalRunTasks(false);
 }
@@ -71,60 +88,56 @@ void TaskRunner::InternalRunTasks(bool in_destructor) {
   // This shouldn't run while an abort is happening.
   // If that occurs, then tasks may be deleted in this method,
   // but pointers to them will still be in the
-  // "ChildSet copy" in TaskParent::AbortAllChildren.
+  // "ChildList copy" in TaskParent::AbortAllChildren.
   // Subsequent use of those task may cause data corruption or crashes.  
   ASSERT(!abort_count_);
-  // Running continues until all tasks are Blocked (ok for a small # of tasks)
+  // Running continues until no task is ready; tasks woken meanwhile,
+  // including by the tasks run, are queued behind.
   if (tasks_running_) {
     return;  // don't reenter
   }
 
   tasks_running_ = true;
+  TXMPP_TRACE1(tasks_run_start, this);
 
   int64 previous_timeout_time = next_task_timeout();
+  StallDetector* detector = StallDetector::Current();
 
-  int did_run = true;
-  while (did_run) {
-    did_run = false;
-    // use indexing instead of iterators because tasks_ may grow
-    for (size_t i = 0; i < tasks_.size(); ++i) {
-      while (!tasks_[i]->Blocked()) {
-        tasks_[i]->Step();
-        did_run = true;
+  while (!ready_.empty()) {
+    Task* task = ready_.front();
+    ready_.pop_front();
+    task->queued_ = false;
+    if (stats_) {
+      RunTaskWithStats(task, detector);
+    } else if (detector) {
+      while (!task->Blocked()) {
+        detector->Begin(StallDetector::SK_TASK, typeid(*task).name(),
+                        task->GetState());
+        task->Step();
+        detector->End();
+      }
+    } else {
+      while (!task->Blocked()) {
+        task->Step();
       }
     }
+    // A done task can't be woken or aborted again, so it is only queued
+    // again if it aborted itself in Step; it is collected when last seen.
+    if (task->IsDone() && !task->queued_)
+      done_tasks_.push_back(task);
   }
   // Tasks are deleted when running has paused
-  bool need_timeout_recalc = false;
-  for (size_t i = 0; i < tasks_.size(); ++i) {
-    if (tasks_[i]->IsDone()) {
-      Task* task = tasks_[i];
-      if (next_timeout_task_ &&
-          task->unique_id() == next_timeout_task_->unique_id()) {
-        next_timeout_task_ = NULL;
-        need_timeout_recalc = true;
-      }
-
+  for (size_t i = 0; i < done_tasks_.size(); ++i) {
+    Task* task = done_tasks_[i];
 #ifdef _DEBUG
-      deleting_task_ = task;
+    deleting_task_ = task;
 #endif
-      delete task;
+    delete task;
 #ifdef _DEBUG
-      deleting_task_ = NULL;
+    deleting_task_ = NULL;
 #endif
-      tasks_[i] = NULL;
-    }
   }
-  // Finally, remove nulls
-  std::vector<Task *>::iterator it;
-  it = std::remove(tasks_.begin(),
-                   tasks_.end(),
-                   reinterpret_cast<Task *>(NULL));
-
-  tasks_.erase(it, tasks_.end());
-
-  if (need_timeout_recalc)
-    RecalcNextTimeout(NULL);
+  done_tasks_.clear();
 
   // Make sure that adjustments are done to account
   // for any timeout changes (but don't call this
@@ -132,24 +145,46 @@ void TaskRunner::InternalRunTasks(bool in_destructor) {
   if (!in_destructor)
     CheckForTimeoutChange(previous_timeout_time);
 
+  TXMPP_TRACE1(tasks_run_end, this);
   tasks_running_ = false;
 }
 
+void TaskRunner::RunTaskWithStats(Task *task, StallDetector* detector) {
+  uint64 queued_time = task->queued_time_;
+  while (!task->Blocked()) {
+    int state = task->GetState();
+    uint64 start = TimeMicros();
+    int32 wait = -1;
+    if (queued_time) {
+      wait = static_cast<int32>(_min<uint64>(start - queued_time, 0x7FFFFFFF));
+      queued_time = 0;
+    }
+    if (detector)
+      detector->Begin(StallDetector::SK_TASK, typeid(*task).name(), state);
+    task->Step();
+    if (detector)
+      detector->End();
+    uint32 run = static_cast<uint32>(TimeMicros() - start);
+    // The task may have turned the stats off, but is not deleted yet.
+    if (stats_)
+      stats_->RecordStep(task, state, wait, start, run);
+  }
+}
+
 void TaskRunner::PollTasks() {
-  // see if our "next potentially timed-out task" has indeed timed out.
-  // If it has, wake it up, then queue up the next task in line
-  // Repeat while we have new timed-out tasks.
-  // TODO(juberti): We need to guard against WakeTasks not updating
-  // next_timeout_task_. Maybe also add documentation in the header file once
-  // we understand this code better.
-  Task* old_timeout_task = NULL;
-  while (next_timeout_task_ &&
-      old_timeout_task != next_timeout_task_ &&
-      next_timeout_task_->TimedOut()) {
-    old_timeout_task = next_timeout_task_;
-    next_timeout_task_->Wake();
+  // Wake every task that has timed out, which are those at the top of the
+  // heap, and run them together.
+  if (!timeouts_.empty() && UnblockTimedOut(0, CurrentTime()))
     WakeTasks();
-  }
+}
+
+bool TaskRunner::UnblockTimedOut(size_t index, int64 now) {
+  if (index >= timeouts_.size() || timeouts_[index]->timeout_time() > now)
+    return false;
+  bool woke = timeouts_[index]->Unblock();
+  woke |= UnblockTimedOut(2 * index + 1, now);
+  woke |= UnblockTimedOut(2 * index + 2, now);
+  return woke;
 }
 
 int64 TaskRunner::next_task_timeout() const {
@@ -159,38 +194,32 @@ int64 TaskRunner::next_task_timeout() const {
   return 0;
 }
 
-// this function gets called frequently -- when each task changes
+// This function gets called frequently -- when each task changes
 // state to something other than DONE, ERROR or BLOCKED, it calls
-// ResetTimeout(), which will call this function to make sure that
-// the next timeout-able task hasn't changed.  The logic in this function
-// prevents RecalcNextTimeout() from getting called in most cases,
-// effectively making the task scheduler O-1 instead of O-N
+// ResetTimeout(), which will call this function to move the task in
+// the timeout heap.
 
 void TaskRunner::UpdateTaskTimeout(Task* task,
                                    int64 previous_task_timeout_time) {
   ASSERT(task != NULL);
   int64 previous_timeout_time = next_task_timeout();
-  bool task_is_timeout_task = next_timeout_task_ != NULL &&
-      task->unique_id() == next_timeout_task_->unique_id();
-  if (task_is_timeout_task) {
+  if (task == next_timeout_task_) {
     previous_timeout_time = previous_task_timeout_time;
   }
 
-  // if the relevant task has a timeout, then
-  // check to see if it's closer than the current
-  // "about to timeout" task
-  if (task->timeout_time()) {
-    if (next_timeout_task_ == NULL ||
-        (task->timeout_time() <= next_timeout_task_->timeout_time())) {
-      next_timeout_task_ = task;
+  size_t index = task->timeout_index_;
+  if (task->timeout_time() && !task->IsDone()) {
+    if (index == kNoTimeoutIndex) {
+      index = timeouts_.size();
+      timeouts_.push_back(task);
+      task->timeout_index_ = index;
     }
-  } else if (task_is_timeout_task) {
-    // otherwise, if the task doesn't have a timeout,
-    // and it used to be our "about to timeout" task,
-    // walk through all the tasks looking for the real
-    // "about to timeout" task
-    RecalcNextTimeout(task);
+    SiftUpTimeout(index);
+    SiftDownTimeout(task->timeout_index_);
+  } else if (index != kNoTimeoutIndex) {
+    RemoveTimeout(task);
   }
+  next_timeout_task_ = timeouts_.empty() ? NULL : timeouts_.front();
 
   // Note when task_running_, then the running routine
   // (TaskRunner::InternalRunTasks) is responsible for calling
@@ -200,31 +229,51 @@ void TaskRunner::UpdateTaskTimeout(Task* task,
   }
 }
 
-void TaskRunner::RecalcNextTimeout(Task *exclude_task) {
-  // walk through all the tasks looking for the one
-  // which satisfies the following:
-  //   it's not finished already
-  //   we're not excluding it
-  //   it has the closest timeout time
-
-  int64 next_timeout_time = 0;
-  next_timeout_task_ = NULL;
-
-  for (size_t i = 0; i < tasks_.size(); ++i) {
-    Task *task = tasks_[i];
-    // if the task isn't complete, and it actually has a timeout time
-    if (!task->IsDone() && (task->timeout_time() > 0))
-      // if it doesn't match our "exclude" task
-      if (exclude_task == NULL ||
-          exclude_task->unique_id() != task->unique_id())
-        // if its timeout time is sooner than our current timeout time
-        if (next_timeout_time == 0 ||
-            task->timeout_time() <= next_timeout_time) {
-          // set this task as our next-to-timeout
-          next_timeout_time = task->timeout_time();
-          next_timeout_task_ = task;
-        }
+void TaskRunner::RemoveTimeout(Task *task) {
+  size_t index = task->timeout_index_;
+  ASSERT(index < timeouts_.size() && timeouts_[index] == task);
+  task->timeout_index_ = kNoTimeoutIndex;
+  Task* last = timeouts_.back();
+  timeouts_.pop_back();
+  if (last != task) {
+    SetTimeoutIndex(index, last);
+    SiftUpTimeout(index);
+    SiftDownTimeout(last->timeout_index_);
+  }
+  next_timeout_task_ = timeouts_.empty() ? NULL : timeouts_.front();
+}
+
+void TaskRunner::SetTimeoutIndex(size_t index, Task *task) {
+  timeouts_[index] = task;
+  task->timeout_index_ = index;
+}
+
+void TaskRunner::SiftUpTimeout(size_t index) {
+  Task* task = timeouts_[index];
+  while (index > 0) {
+    size_t parent = (index - 1) / 2;
+    if (timeouts_[parent]->timeout_time() <= task->timeout_time())
+      break;
+    SetTimeoutIndex(index, timeouts_[parent]);
+    index = parent;
+  }
+  SetTimeoutIndex(index, task);
+}
+
+void TaskRunner::SiftDownTimeout(size_t index) {
+  Task* task = timeouts_[index];
+  size_t size = timeouts_.size();
+  while (2 * index + 1 < size) {
+    size_t child = 2 * index + 1;
+    if (child + 1 < size &&
+        timeouts_[child + 1]->timeout_time() < timeouts_[child]->timeout_time())
+      ++child;
+    if (task->timeout_time() <= timeouts_[child]->timeout_time())
+      break;
+    SetTimeoutIndex(index, timeouts_[child]);
+    index = child;
   }
+  SetTimeoutIndex(index, task);
 }
 
 void TaskRunner::CheckForTimeoutChange(int64 previous_timeout_time) {
@@ -32,6 +32,7 @@
 #include "config.h"
 #endif
 
+#include <deque>
 #include <vector>
 
 #include "basictypes.h"
@@ -39,7 +40,9 @@
 #include "taskparent.h"
 
 namespace txmpp {
+class StallDetector;
 class Task;
+class TaskStats;
 
 const int64 kSecToMsec = 1000;
 const int64 kMsecTo100ns = 10000;
@@ -47,6 +50,8 @@ const int64 kSecTo100ns = kSecToMsec * kMsecTo100ns;
 
 class TaskRunner : public TaskParent, public txmpp::has_slots<> {
  public:
+  static const size_t kNoTimeoutIndex = static_cast<size_t>(-1);
+
   TaskRunner();
   virtual ~TaskRunner();
 
@@ -56,13 +61,16 @@ class TaskRunner : public TaskParent, public txmpp::has_slots<> {
   // determining timeouts.  The origin is not important, only
   // the units and that rollover while the computer is running.
   //
-  // On Windows, GetSystemTimeAsFileTime is the typical implementation.
-  virtual int64 CurrentTime() = 0 ;
+  // By default it is the thread's cached time, which is monotonic and
+  // shared with the message loop running the tasks.
+  virtual int64 CurrentTime();
 
   void StartTask(Task *task);
   void RunTasks();
   void PollTasks();
 
+  // Keeps the timeout heap in step with |task|'s timeout_time(), in
+  // O(log N); the task had |previous_task_timeout_time| before.
   void UpdateTaskTimeout(Task *task, int64 previous_task_timeout_time);
 
 #ifdef _DEBUG
@@ -83,6 +91,17 @@ class TaskRunner : public TaskParent, public txmpp::has_slots<> {
   // OR "0" if there is no next timeout.
   int64 next_task_timeout() const;
 
+  // Takes |task| out of the timeout heap, as it is deleted.
+  void RemoveTimeout(Task *task);
+
+  // Adds |task| to the ready queue unless it is there already.
+  void QueueTask(Task *task);
+
+  // Records every step in |stats|, which must outlive the runner or be
+  // replaced first.  NULL, the default, turns recording off.
+  void SetTaskStats(TaskStats *stats) { stats_ = stats; }
+  TaskStats *task_stats() const { return stats_; }
+
  protected:
   // The primary usage of this method is to know if
   // a callback timer needs to be set-up or adjusted.
@@ -103,17 +122,34 @@ class TaskRunner : public TaskParent, public txmpp::has_slots<> {
 
  private:
   void InternalRunTasks(bool in_destructor);
+  // Steps |task| until it blocks, recording each step in stats_, and
+  // marking it for |detector| if that isn't NULL.
+  void RunTaskWithStats(Task *task, StallDetector* detector);
   void CheckForTimeoutChange(int64 previous_timeout_time);
 
-  std::vector<Task *> tasks_;
+  // Timeout heap maintenance; each task knows its index in timeouts_.
+  void SetTimeoutIndex(size_t index, Task *task);
+  void SiftUpTimeout(size_t index);
+  void SiftDownTimeout(size_t index);
+  // Unblocks the tasks in the subheap at |index| that have timed out by
+  // |now|, and returns true if any were.
+  bool UnblockTimedOut(size_t index, int64 now);
+
+  // The tasks that were woken or are done, in the order they were; running
+  // visits only these, never the blocked tasks.
+  std::deque<Task *> ready_;
+  // The done tasks seen by the current run, to be deleted at its end.
+  std::vector<Task *> done_tasks_;
+  // A binary min-heap of the tasks with a timeout, soonest first; the
+  // front is next_timeout_task_.
+  std::vector<Task *> timeouts_;
   Task *next_timeout_task_;
   bool tasks_running_;
+  TaskStats *stats_;
 #ifdef _DEBUG
   int abort_count_;
   Task* deleting_task_;
 #endif
-
-  void RecalcNextTimeout(Task *exclude_task);
 };
 
 } // namespace txmpp
@@ -0,0 +1,194 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "taskstats.h"
+
+#include <typeinfo>
+
+#include "common.h"
+#include "stringutils.h"
+#include "task.h"
+
+namespace txmpp {
+
+TaskStats::TaskStats()
+    : slots_(new Slot[kSlots]), untracked_(0), trace_next_(0),
+      trace_full_(false) {
+  for (int i = 0; i < kSlots; ++i) {
+    slots_[i].key = 0;
+    slots_[i].type = NULL;
+    slots_[i].state = 0;
+  }
+}
+
+TaskStats::~TaskStats() {
+  delete [] slots_;
+}
+
+TaskStats::Slot* TaskStats::FindSlot(Task* task, int state) {
+  const char* type = typeid(*task).name();
+  uint64 key = (static_cast<uint64>(reinterpret_cast<size_t>(type)) << 16 ^
+                static_cast<uint32>(state)) * UINT64_C(0x9E3779B97F4A7C15) | 1;
+  for (int i = 0; i < kMaxProbes; ++i) {
+    Slot* slot = &slots_[(key >> 32 ^ i) % kSlots];
+    uint64 current = AtomicOps::AcquireLoad(&slot->key);
+    if (current == key)
+      return slot;
+    if (current == 0 && AtomicOps::CompareAndSwap(&slot->key, 0, key)) {
+      slot->state = state;
+      slot->state_name = task->GetStateName(state);
+      AtomicOps::ReleaseStorePtr(&slot->type, type);
+      return slot;
+    }
+    // Lost the race for the slot, possibly to the same key.
+    if (AtomicOps::AcquireLoad(&slot->key) == key)
+      return slot;
+  }
+  return NULL;
+}
+
+void TaskStats::RecordStep(Task* task, int state, int32 wait, uint64 start,
+                           uint32 run) {
+  Slot* slot = FindSlot(task, state);
+  if (!slot) {
+    AtomicOps::Increment(&untracked_);
+    return;
+  }
+  slot->run.Add(run);
+  if (wait >= 0)
+    slot->wait.Add(wait);
+
+  CritScope cs(&trace_crit_);
+  if (trace_.empty())
+    return;
+  Event& event = trace_[trace_next_];
+  event.slot = slot;
+  event.task_id = task->unique_id();
+  event.wait = wait;
+  event.start = start;
+  event.run = run;
+  if (++trace_next_ == trace_.size()) {
+    trace_next_ = 0;
+    trace_full_ = true;
+  }
+}
+
+void TaskStats::RecordStanza(Task* task, uint32 latency) {
+  Slot* slot = FindSlot(task, task->GetState());
+  if (!slot) {
+    AtomicOps::Increment(&untracked_);
+    return;
+  }
+  slot->stanza.Add(latency);
+}
+
+void TaskStats::GetSnapshot(Snapshot* snapshot) const {
+  snapshot->untracked = AtomicOps::AcquireLoad(&untracked_);
+  snapshot->tasks.clear();
+  for (int i = 0; i < kSlots; ++i) {
+    const char* type = AtomicOps::AcquireLoadPtr(&slots_[i].type);
+    if (!type)
+      continue;
+    snapshot->tasks.push_back(TaskSnapshot());
+    TaskSnapshot& task = snapshot->tasks.back();
+    task.type = type;
+    task.state = slots_[i].state;
+    task.state_name = slots_[i].state_name;
+    slots_[i].run.GetSnapshot(&task.run);
+    slots_[i].wait.GetSnapshot(&task.wait);
+    slots_[i].stanza.GetSnapshot(&task.stanza);
+  }
+}
+
+void TaskStats::Reset() {
+  untracked_ = 0;
+  for (int i = 0; i < kSlots; ++i) {
+    slots_[i].run.Reset();
+    slots_[i].wait.Reset();
+    slots_[i].stanza.Reset();
+  }
+  CritScope cs(&trace_crit_);
+  trace_next_ = 0;
+  trace_full_ = false;
+}
+
+void TaskStats::SetTraceCapacity(size_t events) {
+  CritScope cs(&trace_crit_);
+  std::vector<Event>(events).swap(trace_);
+  trace_next_ = 0;
+  trace_full_ = false;
+}
+
+static void TaskStats_AppendJsonString(const std::string& str,
+                                       std::string* out) {
+  out->push_back('"');
+  for (size_t i = 0; i < str.size(); ++i) {
+    unsigned char ch = str[i];
+    if (ch == '"' || ch == '\\') {
+      out->push_back('\\');
+      out->push_back(ch);
+    } else if (ch < 0x20) {
+      char escaped[8];
+      sprintfn(escaped, sizeof(escaped), "\\u%04x", ch);
+      out->append(escaped);
+    } else {
+      out->push_back(ch);
+    }
+  }
+  out->push_back('"');
+}
+
+void TaskStats::WriteTrace(std::string* out) const {
+  out->append("{\"traceEvents\":[");
+  CritScope cs(&trace_crit_);
+  size_t count = trace_full_ ? trace_.size() : trace_next_;
+  size_t first = trace_full_ ? trace_next_ : 0;
+  for (size_t i = 0; i < count; ++i) {
+    const Event& event = trace_[(first + i) % trace_.size()];
+    if (i)
+      out->push_back(',');
+    out->append("{\"name\":");
+    TaskStats_AppendJsonString(event.slot->type, out);
+    out->append(",\"cat\":\"task\",\"ph\":\"X\"");
+    char buffer[96];
+    sprintfn(buffer, sizeof(buffer),
+             ",\"ts\":%llu,\"dur\":%u,\"pid\":0,\"tid\":%d",
+             static_cast<unsigned long long>(event.start), event.run,
+             event.task_id);
+    out->append(buffer);
+    out->append(",\"args\":{\"state\":");
+    TaskStats_AppendJsonString(event.slot->state_name, out);
+    if (event.wait >= 0) {
+      sprintfn(buffer, sizeof(buffer), ",\"wait_us\":%d", event.wait);
+      out->append(buffer);
+    }
+    out->append("}}");
+  }
+  out->append("],\"displayTimeUnit\":\"ms\"}");
+}
+
+}  // namespace txmpp
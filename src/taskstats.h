@@ -0,0 +1,125 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_TASKSTATS_H_
+#define _TXMPP_TASKSTATS_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "criticalsection.h"
+#include "dispatchstats.h"
+
+namespace txmpp {
+
+class Task;
+
+// Profile of the tasks run by a TaskRunner, enabled by passing one to
+// TaskRunner::SetTaskStats.  Records, per task type and the state a step
+// started in, the microseconds each step ran, the microseconds a task was
+// ready before it was run, and for XmppTasks the microseconds a stanza
+// was queued by HandleStanza before the task took it.  Optionally keeps the
+// latest steps as a trace.
+class TaskStats {
+ public:
+  struct TaskSnapshot {
+    std::string type;  // As given by typeid; mangled with GCC.
+    int state;
+    std::string state_name;  // As given by GetStateName.
+    Histogram::Snapshot run;  // Its count is the number of steps.
+    Histogram::Snapshot wait;
+    Histogram::Snapshot stanza;
+  };
+
+  struct Snapshot {
+    std::vector<TaskSnapshot> tasks;
+    // Steps not counted, for lack of a slot.
+    uint32 untracked;
+  };
+
+  TaskStats();
+  ~TaskStats();
+
+  // |wait| is negative if the step followed another without the task
+  // blocking, or the task was queued before the stats were enabled.
+  // |start| is the TimeMicros() the step started at.
+  void RecordStep(Task* task, int state, int32 wait, uint64 start,
+                  uint32 run);
+  void RecordStanza(Task* task, uint32 latency);
+
+  void GetSnapshot(Snapshot* snapshot) const;
+  void Reset();
+
+  // Keeps the last |events| steps for WriteTrace; 0, the default, keeps
+  // none.  Clears the steps kept so far.
+  void SetTraceCapacity(size_t events);
+  // Writes the steps kept as JSON in the Trace Event Format, which
+  // chrome://tracing loads, with a track per task.
+  void WriteTrace(std::string* out) const;
+
+ private:
+  enum { kSlots = 256, kMaxProbes = 16 };
+
+  struct Slot {
+    volatile uint64 key;  // 0 while free.
+    const char* volatile type;
+    int state;
+    std::string state_name;
+    Histogram run;
+    Histogram wait;
+    Histogram stanza;
+  };
+
+  struct Event {
+    const Slot* slot;
+    int32 task_id;
+    int32 wait;
+    uint64 start;
+    uint32 run;
+  };
+
+  Slot* FindSlot(Task* task, int state);
+
+  Slot* slots_;
+  volatile int untracked_;
+  mutable CriticalSection trace_crit_;
+  std::vector<Event> trace_;
+  size_t trace_next_;
+  bool trace_full_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(TaskStats);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_TASKSTATS_H_
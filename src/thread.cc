@@ -27,14 +27,29 @@
 
 #include "thread.h"
 
+#include <typeinfo>
+
 #if defined(WIN32)
 #include <comdef.h>
 #elif defined(POSIX)
 #include <time.h>
 #endif
 
+#ifdef LINUX
+#include <ctype.h>
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #include "common.h"
 #include "logging.h"
+#include "stalldetector.h"
 #include "stringutils.h"
 #include "time.h"
 
@@ -48,13 +63,97 @@
 
 namespace txmpp {
 
+// How many times a Send checks for its reply before it blocks.
+static const int kSendSpinCount = 200;
+
+#ifdef LINUX
+// The set_mempolicy mode that prefers a node, falling back to others when
+// it runs out.  Defined here so that libnuma is not needed for one call.
+static const int kMempolicyPreferred = 1;
+// The most NUMA nodes a thread can be placed on.
+static const int kMaxNumaNodes = 1024;
+
+// Appends the processors of NUMA node |node| to |processors|.
+static bool ReadNodeProcessors(int node, std::vector<int>* processors) {
+  char path[64];
+  sprintfn(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+           node);
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return false;
+  char line[1024];
+  bool read = (fgets(line, sizeof(line), file) != NULL);
+  fclose(file);
+  if (!read)
+    return false;
+  // A list of ranges, as in "0-3,8-11".
+  const char* pos = line;
+  while (isdigit(*pos)) {
+    char* end;
+    long first = strtol(pos, &end, 10);
+    long last = first;
+    if (*end == '-')
+      last = strtol(end + 1, &end, 10);
+    for (long i = first; i <= last; ++i)
+      processors->push_back(static_cast<int>(i));
+    pos = (*end == ',') ? end + 1 : end;
+  }
+  return true;
+}
+#endif
+
+#if defined(LINUX) || defined(WIN32)
+#if defined(LINUX)
+typedef pthread_t ThreadHandle;
+#else
+typedef HANDLE ThreadHandle;
+#endif
+
+// Restricts |thread| to |processors|, or to all of them if that is empty.
+static bool SetProcessorAffinity(ThreadHandle thread,
+                                 const std::vector<int>& processors) {
+#if defined(LINUX)
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  if (processors.empty()) {
+    for (int i = 0; i < CPU_SETSIZE; ++i)
+      CPU_SET(i, &cpus);
+  }
+  for (size_t i = 0; i < processors.size(); ++i) {
+    if (processors[i] >= 0 && processors[i] < CPU_SETSIZE)
+      CPU_SET(processors[i], &cpus);
+  }
+  int error = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+  if (error != 0) {
+    LOG_E(LS_WARNING, EN, error) << "pthread_setaffinity_np";
+    return false;
+  }
+  return true;
+#else
+  DWORD_PTR mask = 0;
+  if (processors.empty()) {
+    DWORD_PTR system_mask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &mask, &system_mask))
+      return false;
+  }
+  for (size_t i = 0; i < processors.size(); ++i) {
+    if (processors[i] >= 0 && processors[i] < static_cast<int>(8 * sizeof(mask)))
+      mask |= static_cast<DWORD_PTR>(1) << processors[i];
+  }
+  if (SetThreadAffinityMask(thread, mask) == 0) {
+    LOG_GLE(LS_WARNING) << "SetThreadAffinityMask";
+    return false;
+  }
+  return true;
+#endif
+}
+#endif
+
 ThreadManager g_thmgr;
 
-#ifdef POSIX
-pthread_key_t ThreadManager::key_;
+TXMPP_THREAD_LOCAL Thread *ThreadManager::current_ = NULL;
 
 ThreadManager::ThreadManager() {
-  pthread_key_create(&key_, NULL);
   main_thread_ = WrapCurrentThread();
 #ifdef USE_COCOA_THREADING
   InitCocoaMultiThreading();
@@ -70,39 +169,7 @@ ThreadManager::~ThreadManager() {
 #endif
   UnwrapCurrentThread();
   // Unwrap deletes main_thread_ automatically.
-  pthread_key_delete(key_);
-}
-
-Thread *ThreadManager::CurrentThread() {
-  return static_cast<Thread *>(pthread_getspecific(key_));
-}
-
-void ThreadManager::SetCurrent(Thread *thread) {
-  pthread_setspecific(key_, thread);
-}
-#endif
-
-#ifdef WIN32
-DWORD ThreadManager::key_;
-
-ThreadManager::ThreadManager() {
-  key_ = TlsAlloc();
-  main_thread_ = WrapCurrentThread();
-}
-
-ThreadManager::~ThreadManager() {
-  UnwrapCurrentThread();
-  TlsFree(key_);
-}
-
-Thread *ThreadManager::CurrentThread() {
-  return static_cast<Thread *>(TlsGetValue(key_));
-}
-
-void ThreadManager::SetCurrent(Thread *thread) {
-  TlsSetValue(key_, thread);
 }
-#endif
 
 // static
 Thread *ThreadManager::WrapCurrentThread() {
@@ -130,7 +197,7 @@ Thread *ThreadManager::WrapCurrentThread() {
 void ThreadManager::UnwrapCurrentThread() {
   Thread* t = CurrentThread();
   if (t && !(t->IsOwned())) {
-    // Clears the platform-specific thread-specific storage.
+    // Clears the thread-local current thread.
     SetCurrent(NULL);
 #ifdef WIN32
     if (!CloseHandle(t->thread_)) {
@@ -168,13 +235,23 @@ struct ThreadInit {
 
 Thread::Thread(SocketServer* ss)
     : MessageQueue(ss),
+      sendlist_(NULL),
+      sendlist_tail_(NULL),
+      send_event_(false, false),
       priority_(PRIORITY_NORMAL),
+      niceness_(0),
+      numa_node_(-1),
       started_(false),
       has_sends_(false),
+      dispatch_count_(1),
+      dispatch_cms_(kForever),
 #if defined(WIN32)
       thread_(NULL),
 #endif
       owned_(true) {
+  // Most replies to a Send come back within a few microseconds, sooner
+  // than blocking and being woken would take.
+  send_event_.SetSpinCount(kSendSpinCount);
   g_thmgr.Add(this);
   SetName("Thread", this);  // default name
 }
@@ -243,6 +320,89 @@ bool Thread::SetPriority(ThreadPriority priority) {
 #endif
 }
 
+bool Thread::SetNiceness(int niceness) {
+  if (started_ || niceness < -20 || niceness > 19)
+    return false;
+#if defined(LINUX)
+  niceness_ = niceness;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool Thread::SetAffinity(const std::vector<int>& processors) {
+#if defined(LINUX) || defined(WIN32)
+  affinity_ = processors;
+  if (!started_)
+    return true;
+  return SetProcessorAffinity(thread_, affinity_);
+#else
+  return false;
+#endif
+}
+
+bool Thread::SetNumaNode(int node) {
+  if (started_ || node < -1 || node >= kMaxNumaNodes)
+    return false;
+#if defined(LINUX)
+  numa_node_ = node;
+  return true;
+#else
+  return false;
+#endif
+}
+
+// static
+int Thread::NumaNodeOf(int processor) {
+#if defined(LINUX)
+  char path[64];
+  sprintfn(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", processor);
+  DIR* dir = opendir(path);
+  if (!dir)
+    return -1;
+  // The processor's directory links to its node as "node<n>".
+  int node = -1;
+  while (dirent* entry = readdir(dir)) {
+    if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4])) {
+      node = atoi(entry->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+#else
+  return -1;
+#endif
+}
+
+void Thread::ApplyPlacement() {
+#if defined(LINUX)
+  // The memory policy goes first, so that nothing this thread allocates
+  // comes from another node.
+  std::vector<int> processors(affinity_);
+  if (numa_node_ >= 0) {
+    const size_t kBits = 8 * sizeof(unsigned long);
+    unsigned long nodes[kMaxNumaNodes / (8 * sizeof(unsigned long))];
+    memset(nodes, 0, sizeof(nodes));
+    nodes[numa_node_ / kBits] |= 1UL << (numa_node_ % kBits);
+    if (syscall(SYS_set_mempolicy, kMempolicyPreferred, nodes,
+                static_cast<unsigned long>(kMaxNumaNodes)) != 0)
+      LOG_ERR(LS_WARNING) << "set_mempolicy";
+    if (processors.empty() && !ReadNodeProcessors(numa_node_, &processors))
+      LOG(LS_WARNING) << "No processors found for NUMA node " << numa_node_;
+  }
+  if (!processors.empty())
+    SetProcessorAffinity(pthread_self(), processors);
+  int niceness = niceness_;
+  if (niceness == 0 && priority_ == PRIORITY_IDLE)
+    niceness = 19;
+  if (niceness != 0 &&
+      setpriority(PRIO_PROCESS, syscall(SYS_gettid), niceness) != 0)
+    LOG_ERR(LS_WARNING) << "setpriority";
+#endif
+}
+
 bool Thread::Start(Runnable* runnable) {
   ASSERT(owned_);
   if (!owned_) return false;
@@ -254,15 +414,17 @@ bool Thread::Start(Runnable* runnable) {
   init->runnable = runnable;
 #if defined(WIN32)
   DWORD flags = 0;
-  if (priority_ != PRIORITY_NORMAL) {
+  if (priority_ != PRIORITY_NORMAL || !affinity_.empty()) {
     flags = CREATE_SUSPENDED;
   }
   thread_ = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)PreRun, init, flags,
                          NULL);
   if (thread_) {
     started_ = true;
-    if (priority_ != PRIORITY_NORMAL) {
+    if (flags & CREATE_SUSPENDED) {
       SetPriority(priority_);
+      if (!affinity_.empty())
+        SetProcessorAffinity(thread_, affinity_);
       ::ResumeThread(thread_);
     }
   } else {
@@ -275,7 +437,10 @@ bool Thread::Start(Runnable* runnable) {
     if (priority_ == PRIORITY_IDLE) {
       // There is no POSIX-standard way to set a below-normal priority for an
       // individual thread (only whole process), so let's not support it.
+      // Linux has per-thread nice values, which ApplyPlacement sets.
+#ifndef LINUX
       LOG(LS_WARNING) << "PRIORITY_IDLE not supported";
+#endif
     } else {
       // Set real-time round-robin policy.
       if (pthread_attr_setschedpolicy(&attr, SCHED_RR) != 0) {
@@ -353,6 +518,7 @@ void SetThreadName(DWORD dwThreadID, LPCSTR szThreadName) {
 void* Thread::PreRun(void* pv) {
   ThreadInit* init = static_cast<ThreadInit*>(pv);
   ThreadManager::SetCurrent(init->thread);
+  init->thread->ApplyPlacement();
 #if defined(WIN32)
   SetThreadName(GetCurrentThreadId(), init->thread->name_.c_str());
 #elif defined(POSIX)
@@ -384,6 +550,12 @@ void Thread::Stop() {
   Join();
 }
 
+void Thread::SetDispatchBudget(int count, int cms) {
+  ASSERT(count >= 1);
+  dispatch_count_ = _max(count, 1);
+  dispatch_cms_ = cms;
+}
+
 void Thread::Send(MessageHandler *phandler, uint32 id, MessageData *pdata) {
   if (fStop_)
     return;
@@ -405,42 +577,40 @@ void Thread::Send(MessageHandler *phandler, uint32 id, MessageData *pdata) {
   Thread *current_thread = Thread::Current();
   ASSERT(current_thread != NULL);  // AutoThread ensures this
 
-  bool ready = false;
+  _SendMessage smsg;
+  smsg.thread = current_thread;
+  smsg.msg = msg;
   {
     CritScope cs(&crit_);
     EnsureActive();
-    _SendMessage smsg;
-    smsg.thread = current_thread;
-    smsg.msg = msg;
-    smsg.ready = &ready;
-    sendlist_.push_back(smsg);
+    if (sendlist_tail_) {
+      sendlist_tail_->next = &smsg;
+    } else {
+      sendlist_ = &smsg;
+    }
+    sendlist_tail_ = &smsg;
     has_sends_ = true;
+    NoteHandler(msg.phandler);
   }
 
-  // Wait for a reply
+  // Wake this thread whether it is waiting for I/O or is itself blocked in a
+  // Send, then wait for a reply. The sending thread keeps receiving sends
+  // meanwhile, or two threads sending to each other would deadlock. Waiting
+  // on send_event_ rather than the socket server leaves the socket server's
+  // wakeups for the messages they were meant for.
 
   ss_->WakeUp();
+  send_event_.Set();
 
-  bool waited = false;
-  while (!ready) {
+  while (true) {
     current_thread->ReceiveSends();
-    current_thread->socketserver()->Wait(kForever, false);
-    waited = true;
-  }
-
-  // Our Wait loop above may have consumed some WakeUp events for this
-  // MessageQueue, that weren't relevant to this Send.  Losing these WakeUps can
-  // cause problems for some SocketServers.
-  //
-  // Concrete example:
-  // Win32SocketServer on thread A calls Send on thread B.  While processing the
-  // message, thread B Posts a message to A.  We consume the wakeup for that
-  // Post while waiting for the Send to complete, which means that when we exit
-  // this loop, we need to issue another WakeUp, or else the Posted message
-  // won't be processed in a timely manner.
-
-  if (waited) {
-    current_thread->socketserver()->WakeUp();
+    {
+      // Also keeps |smsg| alive until the receiver is done with it.
+      CritScope cs(&crit_);
+      if (smsg.ready)
+        break;
+    }
+    current_thread->send_event_.Wait(kForever);
   }
 }
 
@@ -456,14 +626,23 @@ void Thread::ReceiveSends() {
   // - thread receiving exits: Wakeup/set ready in Thread::Clear()
   // - object target cleared: Wakeup/set ready in Thread::Clear()
   crit_.Enter();
-  while (!sendlist_.empty()) {
-    _SendMessage smsg = sendlist_.front();
-    sendlist_.pop_front();
+  while (_SendMessage* smsg = sendlist_) {
+    sendlist_ = smsg->next;
+    if (!sendlist_)
+      sendlist_tail_ = NULL;
     crit_.Leave();
-    smsg.msg.phandler->OnMessage(&smsg.msg);
+    MessageHandler* handler = smsg->msg.phandler;
+    StallDetector* detector = stall_detector();
+    if (detector) {
+      detector->Begin(StallDetector::SK_MESSAGE, typeid(*handler).name(),
+                      smsg->msg.message_id);
+    }
+    handler->OnMessage(&smsg->msg);
+    if (detector)
+      detector->End();
     crit_.Enter();
-    *smsg.ready = true;
-    smsg.thread->socketserver()->WakeUp();
+    smsg->ready = true;
+    smsg->thread->send_event_.Set();
   }
   has_sends_ = false;
   crit_.Leave();
@@ -477,27 +656,36 @@ void Thread::Clear(MessageHandler *phandler, uint32 id,
   // Object target cleared: remove from send list, wakeup/set ready
   // if sender not NULL.
 
-  std::list<_SendMessage>::iterator iter = sendlist_.begin();
-  while (iter != sendlist_.end()) {
-    _SendMessage smsg = *iter;
-    if (smsg.msg.Match(phandler, id)) {
+  _SendMessage* prev = NULL;
+  _SendMessage* smsg = sendlist_;
+  while (smsg) {
+    _SendMessage* next = smsg->next;
+    if (smsg->msg.Match(phandler, id)) {
       if (removed) {
-        removed->push_back(smsg.msg);
+        removed->push_back(smsg->msg);
       } else {
-        delete smsg.msg.pdata;
+        delete smsg->msg.pdata;
       }
-      iter = sendlist_.erase(iter);
-      *smsg.ready = true;
-      smsg.thread->socketserver()->WakeUp();
-      continue;
+      if (prev) {
+        prev->next = next;
+      } else {
+        sendlist_ = next;
+      }
+      if (sendlist_tail_ == smsg)
+        sendlist_tail_ = prev;
+      smsg->ready = true;
+      smsg->thread->send_event_.Set();
+    } else {
+      prev = smsg;
     }
-    ++iter;
+    smsg = next;
   }
 
   MessageQueue::Clear(phandler, id, removed);
 }
 
 bool Thread::ProcessMessages(int cmsLoop) {
+  CachedTimeScope time_scope;
   uint32 msEnd = (kForever == cmsLoop) ? 0 : TimeAfter(cmsLoop);
   int cmsNext = cmsLoop;
 
@@ -514,6 +702,21 @@ bool Thread::ProcessMessages(int cmsLoop) {
       return !IsQuitting();
     Dispatch(&msg);
 
+    if (dispatch_count_ > 1) {
+      // Drain what is already queued, within the budget and the loop time.
+      uint32 msStart = Time();
+      for (int i = 1; i < dispatch_count_; ++i) {
+        if (dispatch_cms_ != kForever &&
+            TimeSince(msStart) >= dispatch_cms_)
+          break;
+        if (cmsLoop != kForever && TimeUntil(msEnd) <= 0)
+          break;
+        if (!GetReady(&msg))
+          break;
+        Dispatch(&msg);
+      }
+    }
+
     if (cmsLoop != kForever) {
       cmsNext = TimeUntil(msEnd);
       if (cmsNext < 0)
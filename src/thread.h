@@ -41,12 +41,21 @@
 #include <pthread.h>
 #endif
 
+#include "event.h"
 #include "messagequeue.h"
 
 #ifdef WIN32
 #include "win32.h"
 #endif
 
+// Compiler thread-local storage, which is a plain load instead of a call
+// through pthread_getspecific or TlsGetValue.
+#ifdef WIN32
+#define TXMPP_THREAD_LOCAL __declspec(thread)
+#else
+#define TXMPP_THREAD_LOCAL __thread
+#endif
+
 namespace txmpp {
 
 class Thread;
@@ -56,8 +65,8 @@ public:
   ThreadManager();
   ~ThreadManager();
 
-  static Thread *CurrentThread();
-  static void SetCurrent(Thread *thread);
+  static Thread *CurrentThread() { return current_; }
+  static void SetCurrent(Thread *thread) { current_ = thread; }
   void Add(Thread *thread);
   void Remove(Thread *thread);
 
@@ -84,22 +93,19 @@ private:
   std::vector<Thread *> threads_;
   CriticalSection crit_;
 
-#ifdef POSIX
-  static pthread_key_t key_;
-#endif
-
-#ifdef WIN32
-  static DWORD key_;
-#endif
+  static TXMPP_THREAD_LOCAL Thread *current_;
 };
 
 class Thread;
 
+// Lives on the sending thread's stack for the duration of a Send, linked
+// into the target's send list, so that a Send allocates nothing.
 struct _SendMessage {
-  _SendMessage() {}
+  _SendMessage() : thread(NULL), ready(false), next(NULL) {}
   Thread *thread;
   Message msg;
-  bool *ready;
+  bool ready;  // Guarded by the target thread's crit_.
+  _SendMessage *next;
 };
 
 enum ThreadPriority {
@@ -120,6 +126,9 @@ public:
   Thread(SocketServer* ss = NULL);
   virtual ~Thread();
 
+  // One thread-local load, but code that runs on one thread for its whole
+  // life can keep the result (and its socketserver()) instead of asking
+  // again on every event.
   static inline Thread* Current() {
     return ThreadManager::CurrentThread();
   }
@@ -142,6 +151,29 @@ public:
   ThreadPriority priority() const { return priority_; }
   bool SetPriority(ThreadPriority priority);
 
+  // Sets the nice value of the thread, from -20 (most favoured) to 19, for
+  // finer control than SetPriority on POSIX, where PRIORITY_IDLE means 19.
+  // Must be called before Start().  Linux only.
+  int niceness() const { return niceness_; }
+  bool SetNiceness(int niceness);
+
+  // Restricts the thread to |processors|, or lets it run anywhere if that
+  // is empty.  Takes effect at once if the thread is running, and otherwise
+  // before it runs anything.  Linux and Windows only.
+  const std::vector<int>& affinity() const { return affinity_; }
+  bool SetAffinity(const std::vector<int>& processors);
+
+  // Makes the thread take its memory from NUMA node |node| while the node
+  // has any, and if it has no affinity, keeps it on the node's processors.
+  // Buffers the thread allocates are then local to where it runs.  -1, the
+  // default, leaves both to the system.  Must be called before Start().
+  // Linux only.
+  int numa_node() const { return numa_node_; }
+  bool SetNumaNode(int node);
+
+  // The NUMA node of |processor|, or -1 if that is unknown.
+  static int NumaNodeOf(int processor);
+
   // Starts the execution of the thread.
   bool started() const { return started_; }
   bool Start(Runnable* runnable = NULL);
@@ -170,6 +202,15 @@ public:
   //  2) Stop() is called (returns false)
   bool ProcessMessages(int cms);
 
+  // By default ProcessMessages checks sends, delayed messages and I/O before
+  // every message it dispatches.  With a budget it dispatches up to |count|
+  // ready messages in a row, stopping early after |cms| milliseconds (or
+  // never, with kForever), before checking again.  Larger budgets favour
+  // message throughput over I/O and timer latency.
+  void SetDispatchBudget(int count, int cms);
+  int dispatch_count() const { return dispatch_count_; }
+  int dispatch_cms() const { return dispatch_cms_; }
+
   // Returns true if this is a thread that we created using the standard
   // constructor, false if it was created by a call to
   // ThreadManager::WrapCurrentThread().  The main thread of an application
@@ -190,14 +231,28 @@ public:
 
 private:
   static void *PreRun(void *pv);
+  // Applies the affinity, NUMA node and niceness from the thread itself.
+  void ApplyPlacement();
   // Blocks the calling thread until this thread has terminated.
   void Join();
 
-  std::list<_SendMessage> sendlist_;
+  // From MessageQueue
+  virtual bool HasPendingSends() { return sendlist_ != NULL; }
+
+  _SendMessage *sendlist_;
+  _SendMessage *sendlist_tail_;
+  // Signaled when a Send from this thread completes, or another thread sends
+  // to it, while a Send from this thread may be blocked.
+  Event send_event_;
   std::string name_;
   ThreadPriority priority_;
+  int niceness_;
+  std::vector<int> affinity_;
+  int numa_node_;
   bool started_;
   bool has_sends_;
+  int dispatch_count_;
+  int dispatch_cms_;
 
 #ifdef POSIX
   pthread_t thread_;
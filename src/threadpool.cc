@@ -0,0 +1,262 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "threadpool.h"
+
+#include <deque>
+
+#include "common.h"
+#include "logging.h"
+#include "reactorpool.h"
+
+namespace txmpp {
+
+class ThreadPool::PoolThread : public Thread, public MessageHandler {
+ public:
+  PoolThread(ThreadPool* pool, size_t index) : pool_(pool), index_(index) {
+    SetName("ThreadPool", pool);
+  }
+  virtual ~PoolThread() {
+    Stop();
+  }
+
+  virtual void Run();
+  // Only wake-ups are posted to the thread itself.
+  virtual void OnMessage(Message* msg) {}
+
+  CriticalSection tasks_crit_;
+  std::deque<Task> tasks_;
+
+ private:
+  ThreadPool* pool_;
+  size_t index_;
+};
+
+void ThreadPool::PoolThread::Run() {
+  Message msg;
+  while (true) {
+    Task task;
+    if (pool_->Take(index_, &task)) {
+      pool_->Execute(task, this);
+      // Messages posted to this thread must not wait for the pool to run dry.
+      ReceiveSends();
+      while (GetReady(&msg))
+        Dispatch(&msg);
+      continue;
+    }
+    // Tasks still queued when the pool stops are run first.
+    if (IsQuitting())
+      break;
+    if (pool_->Idle(index_)) {
+      if (Get(&msg))
+        Dispatch(&msg);
+      pool_->Busy(index_);
+    }
+  }
+}
+
+ThreadPool::ThreadPool(size_t count)
+    : next_(0), idle_count_(0), started_(false) {
+  if (count == 0)
+    count = ReactorPool::ProcessorCount();
+  for (size_t i = 0; i < count; ++i)
+    threads_.push_back(new PoolThread(this, i));
+}
+
+ThreadPool::~ThreadPool() {
+  Stop();
+  for (size_t i = 0; i < threads_.size(); ++i)
+    delete threads_[i];
+}
+
+bool ThreadPool::Start() {
+  ASSERT(!started_);
+  if (started_)
+    return false;
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    if (!threads_[i]->Start()) {
+      LOG(LS_ERROR) << "Unable to start pool thread " << i;
+      for (size_t j = 0; j < i; ++j)
+        threads_[j]->Quit();
+      for (size_t j = 0; j < i; ++j) {
+        threads_[j]->Stop();
+        threads_[j]->Restart();
+      }
+      return false;
+    }
+  }
+  started_ = true;
+  return true;
+}
+
+bool ThreadPool::SetAffinity(const std::vector<int>& processors) {
+  bool result = true;
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    if (!threads_[i]->SetAffinity(processors))
+      result = false;
+  }
+  return result;
+}
+
+void ThreadPool::Stop() {
+  if (!started_)
+    return;
+  // Let every thread drain before joining any of them.
+  for (size_t i = 0; i < threads_.size(); ++i)
+    threads_[i]->Quit();
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    threads_[i]->Stop();
+    threads_[i]->Restart();
+  }
+  idle_.clear();
+  idle_count_ = 0;
+  started_ = false;
+}
+
+void ThreadPool::Post(MessageHandler* phandler, uint32 id, MessageData* pdata,
+                      MessageHandler* reply) {
+  Task task;
+  task.msg.phandler = phandler;
+  task.msg.message_id = id;
+  task.msg.pdata = pdata;
+  task.reply = reply;
+  if (reply) {
+    task.origin = Thread::Current();
+    ASSERT(task.origin != NULL);
+  }
+  Push(task);
+}
+
+void ThreadPool::Post(Runnable* runnable) {
+  Task task;
+  task.runnable = runnable;
+  Push(task);
+}
+
+void ThreadPool::Push(const Task& task) {
+  ASSERT(started_);
+  PoolThread* thread = NULL;
+  Thread* current = Thread::Current();
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    if (threads_[i] == current) {
+      thread = threads_[i];
+      break;
+    }
+  }
+  if (thread) {
+    // Tasks spawned by a task are likely to share its data, so run them next.
+    CritScope cs(&thread->tasks_crit_);
+    thread->tasks_.push_front(task);
+  } else {
+    size_t i = static_cast<unsigned int>(AtomicOps::Increment(&next_));
+    thread = threads_[i % threads_.size()];
+    CritScope cs(&thread->tasks_crit_);
+    thread->tasks_.push_back(task);
+  }
+  WakeOne();
+}
+
+bool ThreadPool::Take(size_t index, Task* task) {
+  PoolThread* own = threads_[index];
+  {
+    CritScope cs(&own->tasks_crit_);
+    if (!own->tasks_.empty()) {
+      *task = own->tasks_.front();
+      own->tasks_.pop_front();
+      return true;
+    }
+  }
+  // Steal from the next busy thread the task it would run last, at the back
+  // of its queue: the newest of the tasks posted from outside the pool, or,
+  // failing those, the oldest of those its tasks spawned.  Its owner keeps
+  // the tasks it is about to run, which are the likeliest to share its data.
+  for (size_t i = 1; i < threads_.size(); ++i) {
+    PoolThread* victim = threads_[(index + i) % threads_.size()];
+    CritScope cs(&victim->tasks_crit_);
+    if (!victim->tasks_.empty()) {
+      *task = victim->tasks_.back();
+      victim->tasks_.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::Execute(const Task& task, Thread* thread) {
+  if (task.runnable) {
+    task.runnable->Run(thread);
+    return;
+  }
+  Message msg = task.msg;
+  msg.phandler->OnMessage(&msg);
+  if (task.reply)
+    task.origin->Post(task.reply, msg.message_id, msg.pdata);
+}
+
+bool ThreadPool::Idle(size_t index) {
+  CritScope cs(&crit_);
+  // Counted before looking at the deques, so that a Push either leaves a task
+  // for the check below or sees the count and wakes this thread.
+  AtomicOps::Increment(&idle_count_);
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    CritScope cs2(&threads_[i]->tasks_crit_);
+    if (!threads_[i]->tasks_.empty()) {
+      AtomicOps::Decrement(&idle_count_);
+      return false;
+    }
+  }
+  idle_.push_back(index);
+  return true;
+}
+
+void ThreadPool::Busy(size_t index) {
+  CritScope cs(&crit_);
+  for (size_t i = 0; i < idle_.size(); ++i) {
+    if (idle_[i] == index) {
+      idle_.erase(idle_.begin() + i);
+      AtomicOps::Decrement(&idle_count_);
+      break;
+    }
+  }
+}
+
+void ThreadPool::WakeOne() {
+  if (AtomicOps::AcquireLoad(&idle_count_) == 0)
+    return;
+  PoolThread* thread;
+  {
+    CritScope cs(&crit_);
+    if (idle_.empty())
+      return;
+    thread = threads_[idle_.back()];
+    idle_.pop_back();
+    AtomicOps::Decrement(&idle_count_);
+  }
+  thread->Post(thread);
+}
+
+}  // namespace txmpp
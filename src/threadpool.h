@@ -0,0 +1,113 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_THREADPOOL_H_
+#define _TXMPP_THREADPOOL_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <vector>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "criticalsection.h"
+#include "messagequeue.h"
+#include "thread.h"
+
+namespace txmpp {
+
+// A fixed set of threads for blocking jobs (DNS lookups, disk I/O and the
+// like), so that each job does not need a thread of its own.  Every pool
+// thread has a deque of tasks: a task posted from a pool thread goes on the
+// front of its own deque, others are dealt round robin, and a thread that
+// runs out of tasks steals from the back of the others' deques.
+//
+// Pool threads are ordinary Threads.  While idle they dispatch their own
+// message queues, so a task may post or PostDelayed to Thread::Current(), or
+// start a Worker there.
+class ThreadPool {
+ public:
+  // |count| of 0 means one thread per online processor.
+  explicit ThreadPool(size_t count = 0);
+  // Stops the pool.
+  ~ThreadPool();
+
+  bool Start();
+  // Runs the tasks already posted, then joins the threads.
+  void Stop();
+
+  size_t size() const { return threads_.size(); }
+
+  // Restricts the pool threads to |processors|, such as those a ReactorPool
+  // leaves free, or lets them run anywhere if it is empty.  May be called
+  // while the pool runs.  See Thread::SetAffinity.
+  bool SetAffinity(const std::vector<int>& processors);
+
+  // Calls phandler->OnMessage on a pool thread.  With |reply|, the message is
+  // then posted to |reply| on the calling thread, which must outlive the
+  // task; |reply| then owns |pdata|, otherwise |phandler| does.
+  void Post(MessageHandler* phandler, uint32 id = 0, MessageData* pdata = NULL,
+            MessageHandler* reply = NULL);
+  // Calls runnable->Run with the pool thread that runs it.
+  void Post(Runnable* runnable);
+
+ private:
+  class PoolThread;
+  struct Task {
+    Task() : runnable(NULL), reply(NULL), origin(NULL) {}
+    Runnable* runnable;
+    Message msg;
+    MessageHandler* reply;
+    Thread* origin;
+  };
+  typedef std::vector<PoolThread*> ThreadList;
+
+  void Push(const Task& task);
+  // Pops a task of thread |index|, or steals one from another thread.
+  bool Take(size_t index, Task* task);
+  void Execute(const Task& task, Thread* thread);
+  // Marks thread |index| idle.  Returns false, and leaves it busy, if a task
+  // turned up meanwhile.
+  bool Idle(size_t index);
+  void Busy(size_t index);
+  void WakeOne();
+
+  ThreadList threads_;
+  volatile int next_;
+  volatile int idle_count_;
+  bool started_;
+  CriticalSection crit_;
+  std::vector<size_t> idle_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(ThreadPool);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_THREADPOOL_H_
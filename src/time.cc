@@ -31,34 +31,164 @@
 #include <sys/time.h>
 #endif
 
+#ifdef OSX
+#include <mach/mach_time.h>
+#endif
+
 #ifdef WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #endif
 
 #include "common.h"
+#include "criticalsection.h"
 
 #define EFFICIENT_IMPLEMENTATION 1
 
+#ifdef WIN32
+#define TIME_THREAD_LOCAL __declspec(thread)
+#else
+#define TIME_THREAD_LOCAL __thread
+#endif
+
 namespace txmpp {
 
 const uint32 LAST = 0xFFFFFFFF;
 const uint32 HALF = 0x80000000;
 
+static bool Time_coarse = false;
+
+// The virtual clock in microseconds, or 0 when the real clocks are read.
+static volatile uint64 Time_virtual_us = 0;
+
 #ifdef POSIX
-uint32 Time() {
-  struct timeval tv;
-  gettimeofday(&tv, 0);
-  return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#ifdef OSX
+static uint64 Time_Nanos() {
+  static mach_timebase_info_data_t timebase = { 0, 0 };
+  if (!timebase.denom)
+    mach_timebase_info(&timebase);
+  return mach_absolute_time() * timebase.numer / timebase.denom;
+}
+#else
+static uint64 Time_Nanos(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return static_cast<uint64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+static int64 Time_RealMillis() {
+#if defined(OSX)
+  return static_cast<int64>(Time_Nanos() / 1000000);
+#elif defined(CLOCK_MONOTONIC_COARSE)
+  return static_cast<int64>(Time_Nanos(Time_coarse ? CLOCK_MONOTONIC_COARSE :
+                                       CLOCK_MONOTONIC) / 1000000);
+#else
+  return static_cast<int64>(Time_Nanos(CLOCK_MONOTONIC) / 1000000);
+#endif
+}
+
+static uint64 Time_RealMicros() {
+#ifdef OSX
+  return Time_Nanos() / 1000;
+#else
+  return Time_Nanos(CLOCK_MONOTONIC) / 1000;
+#endif
 }
 #endif
 
 #ifdef WIN32
-uint32 Time() {
-  return GetTickCount();
+static uint64 Time_RealMicros();
+
+static int64 Time_RealMillis() {
+  if (Time_coarse)
+    return static_cast<int64>(GetTickCount64());
+  return static_cast<int64>(Time_RealMicros() / 1000);
+}
+
+static uint64 Time_RealMicros() {
+  static LARGE_INTEGER frequency = { 0 };
+  if (!frequency.QuadPart)
+    QueryPerformanceFrequency(&frequency);
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return static_cast<uint64>(now.QuadPart / frequency.QuadPart) * 1000000 +
+      (now.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
 }
 #endif
 
+int64 TimeMillis() {
+  uint64 virtual_us = AtomicOps::AcquireLoad(&Time_virtual_us);
+  if (virtual_us)
+    return static_cast<int64>(virtual_us / 1000);
+  return Time_RealMillis();
+}
+
+uint64 TimeMicros() {
+  uint64 virtual_us = AtomicOps::AcquireLoad(&Time_virtual_us);
+  if (virtual_us)
+    return virtual_us;
+  return Time_RealMicros();
+}
+
+uint32 Time() {
+  return static_cast<uint32>(TimeMillis());
+}
+
+void SetVirtualClock(bool enable) {
+  // The virtual clock starts from the real one, so that neither goes back
+  // when switching.
+  AtomicOps::Exchange(&Time_virtual_us,
+                      enable ? _max<uint64>(Time_RealMicros(), 1) : 0);
+}
+
+bool IsVirtualClock() {
+  return AtomicOps::AcquireLoad(&Time_virtual_us) != 0;
+}
+
+void AdvanceVirtualClock(int64 us) {
+  ASSERT(us >= 0);
+  if (us > 0 && IsVirtualClock())
+    AtomicOps::Add(&Time_virtual_us, static_cast<uint64>(us));
+}
+
+void SetCoarseClock(bool coarse) {
+  Time_coarse = coarse;
+}
+
+// The current thread's cached time, valid while Time_cache_depth is
+// positive.
+static TIME_THREAD_LOCAL int64 Time_cache_now;
+static TIME_THREAD_LOCAL int Time_cache_depth;
+
+int64 CachedTimeMillis() {
+  return Time_cache_depth ? Time_cache_now : TimeMillis();
+}
+
+uint32 CachedTime() {
+  return static_cast<uint32>(CachedTimeMillis());
+}
+
+int64 UpdateCachedTime() {
+  Time_cache_now = TimeMillis();
+  return Time_cache_now;
+}
+
+uint32 CachedTimeAfter(int32 elapsed) {
+  ASSERT(elapsed >= 0);
+  ASSERT(static_cast<uint32>(elapsed) < HALF);
+  return CachedTime() + elapsed;
+}
+
+CachedTimeScope::CachedTimeScope() {
+  UpdateCachedTime();
+  ++Time_cache_depth;
+}
+
+CachedTimeScope::~CachedTimeScope() {
+  --Time_cache_depth;
+}
+
 uint32 StartTime() {
   // Close to program execution time
   static const uint32 g_start = Time();
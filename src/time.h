@@ -42,9 +42,52 @@ namespace txmpp {
 
 typedef uint32 TimeStamp;
 
-// Returns the current time in milliseconds.
+// Returns the current time in milliseconds.  The clock is monotonic, so that
+// timers don't jump with the wall clock; its origin is arbitrary, and this
+// 32-bit view of it wraps every 49 days.
 uint32 Time();
 
+// The same clock as Time, in 64 bits, which don't wrap.
+int64 TimeMillis();
+
+// Returns the current time in microseconds, on a monotonic clock of its own,
+// for measuring short intervals.
+uint64 TimeMicros();
+
+// Makes Time and TimeMillis read a clock that is cheaper to read but only
+// advances with the scheduler tick, a few milliseconds, where the platform
+// has one (CLOCK_MONOTONIC_COARSE on Linux).  Off by default.
+void SetCoarseClock(bool coarse);
+
+// Makes Time, TimeMillis and TimeMicros, on every thread, read a clock that
+// only moves by AdvanceVirtualClock, so that simulations such as
+// VirtualSocketServer run as fast as they can and the same way each time.
+// Meant for tests and benchmarks.  Off by default.
+void SetVirtualClock(bool enable);
+bool IsVirtualClock();
+// Moves the virtual clock |us| microseconds forward, if it is on.
+void AdvanceVirtualClock(int64 us);
+
+// A "now" cached per thread, which the message loop of Thread refreshes once
+// per iteration, so that the Posts, task timeouts and rates computed while
+// it dispatches share one clock reading.  It lags the clock by as long as
+// the current message has been running.  On a thread that isn't running a
+// loop, these read the clock.
+uint32 CachedTime();
+int64 CachedTimeMillis();
+// Reads the clock into the current thread's cache, and returns it.
+int64 UpdateCachedTime();
+// Like TimeAfter, from the cached time.
+uint32 CachedTimeAfter(int32 elapsed);
+
+// Makes the current thread's cached time valid while in scope, reading the
+// clock on construction. Scopes may nest.
+class CachedTimeScope {
+ public:
+  CachedTimeScope();
+  ~CachedTimeScope();
+};
+
 // Approximate time when the program started.
 uint32 StartTime();
 
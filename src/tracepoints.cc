@@ -0,0 +1,55 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "tracepoints.h"
+
+#if defined(WIN32) && !defined(TXMPP_NO_TRACELOGGING)
+
+// {5a3c6f1e-8d2b-4b7a-9e41-2c7d0f6b9a13}
+TRACELOGGING_DEFINE_PROVIDER(
+    g_txmpp_trace_provider, "txmpp",
+    (0x5a3c6f1e, 0x8d2b, 0x4b7a,
+     0x9e, 0x41, 0x2c, 0x7d, 0x0f, 0x6b, 0x9a, 0x13));
+
+namespace txmpp {
+
+// Registers the provider while the library is loaded.
+class TraceProviderRegistration {
+ public:
+  TraceProviderRegistration() {
+    TraceLoggingRegister(g_txmpp_trace_provider);
+  }
+  ~TraceProviderRegistration() {
+    TraceLoggingUnregister(g_txmpp_trace_provider);
+  }
+};
+
+static TraceProviderRegistration trace_provider_registration;
+
+}  // namespace txmpp
+
+#endif  // WIN32 && !TXMPP_NO_TRACELOGGING
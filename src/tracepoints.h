@@ -0,0 +1,97 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_TRACEPOINTS_H_
+#define _TXMPP_TRACEPOINTS_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+// Static tracepoints on the hot paths, for profiling a running process
+// without rebuilding it.  Each is named, as TXMPP_TRACE2(name, arg1, arg2),
+// and takes up to two integer or pointer arguments, which should be cheap
+// to compute, as they are computed whether or not anything listens.
+//
+// On Linux, with <sys/sdt.h> (HAVE_SYS_SDT_H), they are USDT probes of
+// provider "txmpp": a nop in the code and a note in the binary, listed by
+//   bpftrace -l 'usdt:/path/to/libtxmpp.so:txmpp:*'
+// On Windows they are TraceLogging events of provider "txmpp", which cost
+// a check of the provider's enabled flag while no session listens, unless
+// TXMPP_NO_TRACELOGGING is defined.  Elsewhere they compile away.
+//
+// The probes:
+//   socket_wait_start(timeout_ms), socket_wait_end(ready)
+//       PhysicalSocketServer::Wait blocking for I/O.
+//   socket_event_start(dispatcher, flags), socket_event_end(dispatcher)
+//       A socket's handler running.
+//   message_dispatch_start(handler, id), message_dispatch_end(handler, id)
+//       MessageQueue::Dispatch running a message's handler.
+//   xmpp_stanza_in(engine, name), xmpp_stanza_out(engine, name)
+//       A stanza parsed by XmppEngineImpl, or passed to its SendStanza,
+//       with its local name as a C string.
+//   tls_handshake_start(adapter), tls_handshake_end(adapter, error)
+//       An OpenSSLAdapter handshake, which ended well if error is 0.
+//   tasks_run_start(runner), tasks_run_end(runner)
+//       TaskRunner running the tasks that are ready.
+
+#if defined(LINUX) && defined(HAVE_SYS_SDT_H)
+
+#include <sys/sdt.h>
+
+#define TXMPP_TRACE0(name) DTRACE_PROBE(txmpp, name)
+#define TXMPP_TRACE1(name, a1) DTRACE_PROBE1(txmpp, name, a1)
+#define TXMPP_TRACE2(name, a1, a2) DTRACE_PROBE2(txmpp, name, a1, a2)
+
+#elif defined(WIN32) && !defined(TXMPP_NO_TRACELOGGING)
+
+#include <windows.h>
+#include <TraceLoggingProvider.h>
+
+TRACELOGGING_DECLARE_PROVIDER(g_txmpp_trace_provider);
+
+#define TXMPP_TRACE0(name) \
+    TraceLoggingWrite(g_txmpp_trace_provider, #name)
+#define TXMPP_TRACE1(name, a1) \
+    TraceLoggingWrite(g_txmpp_trace_provider, #name, \
+                      TraceLoggingValue(a1, "arg1"))
+#define TXMPP_TRACE2(name, a1, a2) \
+    TraceLoggingWrite(g_txmpp_trace_provider, #name, \
+                      TraceLoggingValue(a1, "arg1"), \
+                      TraceLoggingValue(a2, "arg2"))
+
+#else
+
+// The arguments are named, but not computed.
+#define TXMPP_TRACE0(name) do {} while (0)
+#define TXMPP_TRACE1(name, a1) do { (void)sizeof(a1); } while (0)
+#define TXMPP_TRACE2(name, a1, a2) \
+    do { (void)sizeof(a1); (void)sizeof(a2); } while (0)
+
+#endif
+
+#endif  // _TXMPP_TRACEPOINTS_H_
@@ -99,12 +99,29 @@ int UrlDecodeWithoutEncodingSpaceAsPlus(const char *source, char *dest) {
   return InternalUrlDecode(source, dest, false);
 }
 
+// The ASCII characters UrlEncode leaves as they are, alphas, numbers and
+// -_.!~*'(), have URL_VALID set, and those that UrlEncodeOnlyUnsafeChars
+// leaves, all but space, controls and \"^&`<>[]{}, URL_SAFE. Both encode
+// every byte from 128 up. NUL keeps the URL_VALID it had from strchr
+// finding the terminator, though the encoders stop before it.
+static const unsigned char URL_VALID = 0x1;
+static const unsigned char URL_SAFE  = 0x2;
+
+//  ! " # $ % & ' ( ) * + , - . / 0 1 2 3 4 6 5 7 8 9 : ; < = > ?
+//@ A B C D E F G H I J K L M N O P Q R S T U V W X Y Z [ \ ] ^ _
+//` a b c d e f g h i j k l m n o p q r s t u v w x y z { | } ~
+
+static const unsigned char URL_CHAR_CLASS[128] = {
+  1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,3,0,2,2,2,0,3,3,3,3,2,2,3,3,2,3,3,3,3,3,3,3,3,3,3,2,2,0,2,0,2,
+  2,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,0,0,0,0,3,
+  0,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,0,2,0,3,2,
+};
+
 bool IsValidUrlChar(char ch, bool unsafe_only) {
-  if (unsafe_only) {
-    return !(ch <= ' ' || strchr("\\\"^&`<>[]{}", ch));
-  } else {
-    return isalnum(ch) || strchr("-_.!~*'()", ch);
-  }
+  unsigned char uch = static_cast<unsigned char>(ch);
+  return (uch < 128) &&
+         (URL_CHAR_CLASS[uch] & (unsafe_only ? URL_SAFE : URL_VALID));
 }
 
 int InternalUrlEncode(const char *source, char *dest, unsigned int max,
@@ -0,0 +1,588 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "virtualsocketserver.h"
+
+#include <errno.h>
+
+#include <deque>
+#include <string>
+
+#include "asyncsocket.h"
+#include "common.h"
+#include "logging.h"
+#include "messagequeue.h"
+#include "time.h"
+
+namespace txmpp {
+
+namespace {
+
+enum {
+  MSG_CONNECT = 1,  // to a listener
+  MSG_ACCEPTED,     // to the connecting socket, from the accepted one
+  MSG_REFUSED,      // to the connecting socket
+  MSG_DATA,         // stream data, from the peer
+  MSG_DATAGRAM,
+  MSG_CLOSE,        // from the peer
+  MSG_READABLE,     // data is left after a Recv
+  MSG_WRITABLE,     // a blocked Send may go on
+};
+
+// Roughly the IP and TCP or UDP headers that each packet carries.
+const size_t kStreamHeaderSize = 40;
+const size_t kDatagramHeaderSize = 28;
+
+const uint16 kFirstEphemeralPort = 49152;
+
+struct VirtualPacket : public MessageData {
+  VirtualPacket(uint32 sender, const SocketAddress& from)
+      : sender(sender), from(from) {}
+  uint32 sender;
+  SocketAddress from;
+  std::string data;
+};
+
+}  // namespace
+
+class VirtualSocket : public AsyncSocket, public MessageHandler {
+ public:
+  VirtualSocket(VirtualSocketServer* server, int type)
+      : server_(server), type_(type), state_(CS_CLOSED), error_(0),
+        listening_(false), bound_(false), peer_(0), remote_closed_(false),
+        read_pending_(false), write_blocked_(false), link_free_(0),
+        last_arrival_(0), in_flight_(0), read_pos_(0) {
+    id_ = server_->Add(this);
+  }
+
+  virtual ~VirtualSocket() {
+    Close();
+    server_->Remove(id_);
+    for (size_t i = 0; i < accept_queue_.size(); ++i)
+      delete accept_queue_[i];
+  }
+
+  uint32 id() const { return id_; }
+
+  virtual SocketAddress GetLocalAddress() const { return local_addr_; }
+  virtual SocketAddress GetRemoteAddress() const { return remote_addr_; }
+
+  virtual int Bind(const SocketAddress& addr) {
+    if (bound_) {
+      error_ = EINVAL;
+      return -1;
+    }
+    SocketAddress local(addr);
+    if (!server_->Bind(this, &local)) {
+      error_ = EADDRINUSE;
+      return -1;
+    }
+    local_addr_ = local;
+    bound_ = true;
+    return 0;
+  }
+
+  virtual int Connect(const SocketAddress& addr) {
+    if (state_ != CS_CLOSED || listening_) {
+      error_ = EINVAL;
+      return -1;
+    }
+    if (!bound_ && Bind(SocketAddress()) < 0)
+      return -1;
+    remote_addr_ = addr;
+    if (type_ == SOCK_DGRAM) {
+      state_ = CS_CONNECTED;
+      return 0;
+    }
+    state_ = CS_CONNECTING;
+    VirtualSocket* listener = server_->FindBinding(addr);
+    if (listener && listener->listening_) {
+      PostPacket(listener, MSG_CONNECT, new VirtualPacket(id_, local_addr_),
+                 0);
+    } else {
+      PostPacket(this, MSG_REFUSED, NULL, 0);
+    }
+    error_ = EINPROGRESS;
+    return -1;
+  }
+
+  virtual int Send(const void* pv, size_t cb) {
+    if (type_ == SOCK_DGRAM)
+      return SendTo(pv, cb, remote_addr_);
+    if (state_ != CS_CONNECTED) {
+      error_ = ENOTCONN;
+      return -1;
+    }
+    VirtualSocket* peer = server_->Find(peer_);
+    if (!peer) {
+      error_ = EPIPE;
+      return -1;
+    }
+    const VirtualNetwork& network = server_->network();
+    size_t room = network.send_buffer > in_flight_ ?
+        network.send_buffer - in_flight_ : 0;
+    if (room == 0) {
+      write_blocked_ = true;
+      error_ = EWOULDBLOCK;
+      return -1;
+    }
+    size_t size = _min(cb, room);
+    size_t segment = network.mtu > kStreamHeaderSize ?
+        network.mtu - kStreamHeaderSize : 1;
+    const char* data = static_cast<const char*>(pv);
+    for (size_t offset = 0; offset < size; offset += segment) {
+      VirtualPacket* packet = new VirtualPacket(id_, local_addr_);
+      packet->data.assign(data + offset, _min(segment, size - offset));
+      PostPacket(peer, MSG_DATA, packet,
+                 packet->data.size() + kStreamHeaderSize);
+    }
+    in_flight_ += size;
+    return static_cast<int>(size);
+  }
+
+  virtual int SendTo(const void* pv, size_t cb, const SocketAddress& addr) {
+    if (type_ != SOCK_DGRAM)
+      return Send(pv, cb);
+    if (!bound_ && Bind(SocketAddress()) < 0)
+      return -1;
+    if (cb + kDatagramHeaderSize > server_->network().mtu) {
+      error_ = EMSGSIZE;
+      return -1;
+    }
+    VirtualSocket* receiver = server_->FindBinding(addr);
+    if (receiver && receiver->type_ == SOCK_DGRAM) {
+      VirtualPacket* packet = new VirtualPacket(id_, local_addr_);
+      packet->data.assign(static_cast<const char*>(pv), cb);
+      PostPacket(receiver, MSG_DATAGRAM, packet, cb + kDatagramHeaderSize);
+    }
+    return static_cast<int>(cb);
+  }
+
+  virtual int Recv(void* pv, size_t cb) {
+    if (type_ == SOCK_DGRAM)
+      return RecvFrom(pv, cb, NULL);
+    size_t available = recv_buffer_.size() - read_pos_;
+    if (available == 0) {
+      if (remote_closed_)
+        return 0;
+      error_ = EWOULDBLOCK;
+      return -1;
+    }
+    size_t size = _min(cb, available);
+    memcpy(pv, recv_buffer_.data() + read_pos_, size);
+    read_pos_ += size;
+    if (read_pos_ == recv_buffer_.size()) {
+      recv_buffer_.clear();
+      read_pos_ = 0;
+    } else {
+      if (read_pos_ > recv_buffer_.size() / 2) {
+        recv_buffer_.erase(0, read_pos_);
+        read_pos_ = 0;
+      }
+      SignalReadableLater();
+    }
+    return static_cast<int>(size);
+  }
+
+  virtual int RecvFrom(void* pv, size_t cb, SocketAddress* paddr) {
+    if (type_ != SOCK_DGRAM) {
+      if (paddr)
+        *paddr = remote_addr_;
+      return Recv(pv, cb);
+    }
+    if (datagrams_.empty()) {
+      error_ = EWOULDBLOCK;
+      return -1;
+    }
+    VirtualPacket* packet = datagrams_.front();
+    datagrams_.pop_front();
+    size_t size = _min(cb, packet->data.size());
+    memcpy(pv, packet->data.data(), size);
+    if (paddr)
+      *paddr = packet->from;
+    delete packet;
+    if (!datagrams_.empty())
+      SignalReadableLater();
+    return static_cast<int>(size);
+  }
+
+  virtual int Listen(int backlog) {
+    if (type_ != SOCK_STREAM || state_ != CS_CLOSED) {
+      error_ = EINVAL;
+      return -1;
+    }
+    if (!bound_ && Bind(SocketAddress()) < 0)
+      return -1;
+    listening_ = true;
+    state_ = CS_CONNECTING;
+    return 0;
+  }
+
+  virtual VirtualSocket* Accept(SocketAddress* paddr) {
+    if (accept_queue_.empty()) {
+      error_ = EWOULDBLOCK;
+      return NULL;
+    }
+    VirtualSocket* socket = accept_queue_.front();
+    accept_queue_.pop_front();
+    if (paddr)
+      *paddr = socket->remote_addr_;
+    if (!accept_queue_.empty())
+      SignalReadableLater();
+    return socket;
+  }
+
+  virtual int Close() {
+    if (state_ == CS_CONNECTED && type_ == SOCK_STREAM) {
+      VirtualSocket* peer = server_->Find(peer_);
+      if (peer)
+        PostPacket(peer, MSG_CLOSE, NULL, 0);
+    }
+    if (bound_) {
+      server_->Unbind(local_addr_, this);
+      bound_ = false;
+    }
+    if (server_->msg_queue_)
+      server_->msg_queue_->Clear(this);
+    state_ = CS_CLOSED;
+    listening_ = false;
+    peer_ = 0;
+    read_pending_ = false;
+    return 0;
+  }
+
+  virtual int GetError() const { return error_; }
+  virtual void SetError(int error) { error_ = error; }
+  virtual ConnState GetState() const { return state_; }
+
+  virtual int EstimateMTU(uint16* mtu) {
+    if (state_ != CS_CONNECTED) {
+      error_ = ENOTCONN;
+      return -1;
+    }
+    *mtu = server_->network().mtu;
+    return 0;
+  }
+
+  virtual int GetOption(Option opt, int* value) {
+    std::map<Option, int>::const_iterator it = options_.find(opt);
+    if (it == options_.end())
+      return -1;
+    *value = it->second;
+    return 0;
+  }
+
+  virtual int SetOption(Option opt, int value) {
+    options_[opt] = value;
+    return 0;
+  }
+
+  virtual void OnMessage(Message* msg) {
+    VirtualPacket* packet = static_cast<VirtualPacket*>(msg->pdata);
+    switch (msg->message_id) {
+      case MSG_CONNECT:
+        OnConnectRequest(packet);
+        break;
+      case MSG_ACCEPTED:
+        if (state_ == CS_CONNECTING) {
+          peer_ = packet->sender;
+          state_ = CS_CONNECTED;
+          SignalConnectEvent(this);
+        }
+        break;
+      case MSG_REFUSED:
+        state_ = CS_CLOSED;
+        error_ = ECONNREFUSED;
+        SignalCloseEvent(this, ECONNREFUSED);
+        break;
+      case MSG_DATA: {
+        VirtualSocket* sender = server_->Find(packet->sender);
+        if (sender)
+          sender->OnDelivered(packet->data.size());
+        bool was_empty = recv_buffer_.size() == read_pos_;
+        recv_buffer_.append(packet->data);
+        if (was_empty)
+          SignalReadEvent(this);
+        }
+        break;
+      case MSG_DATAGRAM:
+        datagrams_.push_back(packet);
+        packet = NULL;
+        if (datagrams_.size() == 1)
+          SignalReadEvent(this);
+        break;
+      case MSG_CLOSE:
+        remote_closed_ = true;
+        state_ = CS_CLOSED;
+        peer_ = 0;
+        SignalCloseEvent(this, 0);
+        break;
+      case MSG_READABLE:
+        read_pending_ = false;
+        if (recv_buffer_.size() > read_pos_ || !datagrams_.empty() ||
+            !accept_queue_.empty()) {
+          SignalReadEvent(this);
+        }
+        break;
+      case MSG_WRITABLE:
+        SignalWriteEvent(this);
+        break;
+    }
+    delete packet;
+  }
+
+ private:
+  // Sends |msg_id| to |to| over this socket's link, delayed by the
+  // network.  |size| 0 is a control message, which takes the delay but no
+  // bandwidth, and is never lost.
+  void PostPacket(VirtualSocket* to, uint32 msg_id, VirtualPacket* packet,
+                  size_t size) {
+    MessageQueue* queue = server_->msg_queue_;
+    if (!queue) {
+      delete packet;
+      return;
+    }
+    int delay = server_->PacketDelay(size, type_ == SOCK_STREAM || size == 0,
+                                     &link_free_);
+    if (delay < 0) {
+      delete packet;
+      return;
+    }
+    // Stream data may not overtake what was sent before it.
+    int64 now = TimeMillis();
+    if (type_ == SOCK_STREAM) {
+      int64 arrival = _max(now + delay, last_arrival_);
+      last_arrival_ = arrival;
+      delay = static_cast<int>(arrival - now);
+    }
+    queue->PostDelayed(delay, to, msg_id, packet);
+  }
+
+  void OnConnectRequest(VirtualPacket* request) {
+    VirtualSocket* client = server_->Find(request->sender);
+    if (!client || !listening_)
+      return;
+    VirtualSocket* socket = new VirtualSocket(server_, SOCK_STREAM);
+    socket->local_addr_ = local_addr_;
+    socket->remote_addr_ = request->from;
+    socket->peer_ = client->id();
+    socket->state_ = CS_CONNECTED;
+    socket->PostPacket(client, MSG_ACCEPTED,
+                       new VirtualPacket(socket->id(), local_addr_), 0);
+    accept_queue_.push_back(socket);
+    if (accept_queue_.size() == 1)
+      SignalReadEvent(this);
+  }
+
+  void OnDelivered(size_t size) {
+    in_flight_ -= _min(size, in_flight_);
+    if (write_blocked_ && in_flight_ < server_->network().send_buffer) {
+      write_blocked_ = false;
+      server_->msg_queue_->Post(this, MSG_WRITABLE);
+    }
+  }
+
+  // Sockets are level triggered, so a read event follows a Recv that
+  // leaves data behind, as poll would have reported it again.
+  void SignalReadableLater() {
+    if (read_pending_ || !server_->msg_queue_)
+      return;
+    read_pending_ = true;
+    server_->msg_queue_->Post(this, MSG_READABLE);
+  }
+
+  VirtualSocketServer* server_;
+  uint32 id_;
+  int type_;
+  ConnState state_;
+  int error_;
+  bool listening_;
+  bool bound_;
+  SocketAddress local_addr_;
+  SocketAddress remote_addr_;
+  // The connected stream socket at the other end, by id.
+  uint32 peer_;
+  bool remote_closed_;
+  bool read_pending_;
+  bool write_blocked_;
+  // When this socket's link is next free, and when the last packet sent on
+  // it arrives, in TimeMillis.
+  int64 link_free_;
+  int64 last_arrival_;
+  // Stream bytes sent but not yet delivered.
+  size_t in_flight_;
+  std::string recv_buffer_;
+  size_t read_pos_;
+  std::deque<VirtualPacket*> datagrams_;
+  std::deque<VirtualSocket*> accept_queue_;
+  std::map<Option, int> options_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(VirtualSocket);
+};
+
+VirtualSocketServer::VirtualSocketServer(SocketServer* ss)
+    : server_(ss),
+      msg_queue_(NULL),
+      random_state_(1),
+      next_id_(1),
+      next_port_(kFirstEphemeralPort),
+      wakeup_(false, false) {
+  if (!server_)
+    SetVirtualClock(true);
+}
+
+VirtualSocketServer::~VirtualSocketServer() {
+  if (!sockets_.empty())
+    LOG(LS_WARNING) << sockets_.size() << " virtual sockets left open";
+  if (!server_)
+    SetVirtualClock(false);
+}
+
+Socket* VirtualSocketServer::CreateSocket(int type) {
+  return CreateAsyncSocket(type);
+}
+
+AsyncSocket* VirtualSocketServer::CreateAsyncSocket(int type) {
+  if (type != SOCK_STREAM && type != SOCK_DGRAM)
+    return NULL;
+  return new VirtualSocket(this, type);
+}
+
+void VirtualSocketServer::SetMessageQueue(MessageQueue* queue) {
+  msg_queue_ = queue;
+  if (server_)
+    server_->SetMessageQueue(queue);
+}
+
+bool VirtualSocketServer::Wait(int cms, bool process_io) {
+  if (server_)
+    return server_->Wait(cms, process_io);
+  // The message queue asks to wait until its next delayed message, packets
+  // included, so moving the clock there is as good as sleeping.
+  if (cms == kForever)
+    return wakeup_.Wait(kForever);
+  if (!wakeup_.Wait(0))
+    AdvanceVirtualClock(static_cast<int64>(cms) * 1000);
+  return true;
+}
+
+void VirtualSocketServer::WakeUp() {
+  if (server_)
+    server_->WakeUp();
+  else
+    wakeup_.Set();
+}
+
+uint32 VirtualSocketServer::Add(VirtualSocket* socket) {
+  uint32 id = next_id_++;
+  sockets_[id] = socket;
+  return id;
+}
+
+void VirtualSocketServer::Remove(uint32 id) {
+  sockets_.erase(id);
+}
+
+VirtualSocket* VirtualSocketServer::Find(uint32 id) const {
+  SocketMap::const_iterator it = sockets_.find(id);
+  return it != sockets_.end() ? it->second : NULL;
+}
+
+// Bindings are keyed without hostnames, which SocketAddress compares
+// between any addresses.
+static SocketAddress VirtualSocketServer_Key(const SocketAddress& addr) {
+  if (addr.IsIPv6())
+    return addr;
+  return SocketAddress(addr.ip(), addr.port());
+}
+
+bool VirtualSocketServer::Bind(VirtualSocket* socket, SocketAddress* addr) {
+  *addr = VirtualSocketServer_Key(*addr);
+  if (addr->IsAnyIP() && addr->port() == 0)
+    addr->SetIP(INADDR_LOOPBACK);
+  if (addr->port() == 0) {
+    for (int tries = 0; tries < 65536 - kFirstEphemeralPort; ++tries) {
+      addr->SetPort(next_port_);
+      next_port_ = next_port_ == 65535 ? kFirstEphemeralPort : next_port_ + 1;
+      if (bindings_.find(*addr) == bindings_.end())
+        break;
+    }
+  }
+  if (bindings_.find(*addr) != bindings_.end())
+    return false;
+  bindings_[*addr] = socket;
+  return true;
+}
+
+void VirtualSocketServer::Unbind(const SocketAddress& addr,
+                                 VirtualSocket* socket) {
+  BindingMap::iterator it = bindings_.find(VirtualSocketServer_Key(addr));
+  if (it != bindings_.end() && it->second == socket)
+    bindings_.erase(it);
+}
+
+VirtualSocket* VirtualSocketServer::FindBinding(
+    const SocketAddress& addr) const {
+  BindingMap::const_iterator it =
+      bindings_.find(VirtualSocketServer_Key(addr));
+  if (it == bindings_.end())
+    it = bindings_.find(SocketAddress(static_cast<uint32>(0), addr.port()));
+  return it != bindings_.end() ? it->second : NULL;
+}
+
+int VirtualSocketServer::PacketDelay(size_t size, bool reliable,
+                                     int64* link_free) {
+  int64 now = TimeMillis();
+  int64 start = _max(now, *link_free);
+  if (size > 0) {
+    int64 transmit = network_.bandwidth ?
+        (static_cast<int64>(size) * 1000 + network_.bandwidth - 1) /
+        network_.bandwidth : 0;
+    *link_free = start + transmit;
+  }
+  int64 delay = _max(now, *link_free) - now + network_.delay_ms;
+  if (network_.jitter_ms > 0)
+    delay += Random() % (network_.jitter_ms + 1);
+  if (size > 0 && network_.loss > 0 &&
+      Random() < network_.loss * 4294967295.0) {
+    if (!reliable)
+      return -1;
+    delay += network_.retransmit_ms;
+  }
+  return static_cast<int>(delay);
+}
+
+uint32 VirtualSocketServer::Random() {
+  // xorshift32, which is plenty for picking delays, and the same on every
+  // platform.
+  random_state_ ^= random_state_ << 13;
+  random_state_ ^= random_state_ >> 17;
+  random_state_ ^= random_state_ << 5;
+  return random_state_;
+}
+
+}  // namespace txmpp
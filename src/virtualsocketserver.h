@@ -0,0 +1,148 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_VIRTUALSOCKETSERVER_H_
+#define _TXMPP_VIRTUALSOCKETSERVER_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <map>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "event.h"
+#include "messagehandler.h"
+#include "socketaddress.h"
+#include "socketserver.h"
+
+namespace txmpp {
+
+class VirtualSocket;
+
+// The link that VirtualSocketServer simulates between any two of its
+// sockets.  Each direction of each connection, and each datagram socket,
+// sends over a link of its own.
+struct VirtualNetwork {
+  VirtualNetwork()
+      : delay_ms(0), jitter_ms(0), bandwidth(0), loss(0.0),
+        retransmit_ms(200), mtu(1500), send_buffer(64 * 1024) {}
+
+  // One-way delay of each packet, plus up to |jitter_ms| more at random.
+  // Stream data still arrives in order.
+  int delay_ms;
+  int jitter_ms;
+  // Bytes a second that a link carries, headers included, or 0 for no
+  // limit.
+  uint32 bandwidth;
+  // The chance, from 0 to 1, that a packet is lost.  Lost datagrams are
+  // gone; a lost stream segment arrives |retransmit_ms| late instead, and
+  // holds up the data behind it.
+  double loss;
+  int retransmit_ms;
+  // The largest packet, headers included.  Streams are cut into segments
+  // that fit; larger datagrams fail with EMSGSIZE.
+  uint16 mtu;
+  // Bytes that a stream socket may have sent but not yet delivered before
+  // Send would block.
+  size_t send_buffer;
+};
+
+// A SocketServer whose sockets connect to each other in process, over a
+// simulated network with latency, jitter, bandwidth, loss and MTU, like
+// FirewallSocketServer for the rules but with no real sockets under it.
+// Packets are messages delayed on the thread's queue, so the server and all
+// its sockets must be used on the one thread that it is installed in.
+//
+// Given a socket server, the server waits on it, in real time.  Without
+// one, it switches on the virtual clock (see SetVirtualClock) and Wait
+// skips straight ahead instead of sleeping, so that a simulated session
+// runs as fast as the CPU allows, and, with the same seed, identically
+// every time.  Only a Wait with no timeout blocks, until WakeUp.
+//
+// Sockets bound to no address get 127.0.0.1 and a port from 49152 up.
+// Connect reaches the socket listening on that address, or on that port of
+// the any address.  The sockets never block: those from CreateSocket fail
+// with EWOULDBLOCK as the async ones do.
+class VirtualSocketServer : public SocketServer {
+ public:
+  explicit VirtualSocketServer(SocketServer* ss = NULL);
+  virtual ~VirtualSocketServer();
+
+  const VirtualNetwork& network() const { return network_; }
+  // Applies to the packets sent from now on.
+  void set_network(const VirtualNetwork& network) { network_ = network; }
+
+  // Seeds the choices of jitter and loss.
+  void set_random_seed(uint32 seed) { random_state_ = seed ? seed : 1; }
+
+  virtual Socket* CreateSocket(int type);
+  virtual AsyncSocket* CreateAsyncSocket(int type);
+  virtual void SetMessageQueue(MessageQueue* queue);
+  virtual bool Wait(int cms, bool process_io);
+  virtual void WakeUp();
+
+ private:
+  friend class VirtualSocket;
+
+  typedef std::map<uint32, VirtualSocket*> SocketMap;
+  typedef std::map<SocketAddress, VirtualSocket*> BindingMap;
+
+  // Registers a new socket, and returns its id.
+  uint32 Add(VirtualSocket* socket);
+  void Remove(uint32 id);
+  VirtualSocket* Find(uint32 id) const;
+
+  // Binds |addr| to |socket|, choosing the IP and port where they are
+  // left out. Returns false if |addr| is taken.
+  bool Bind(VirtualSocket* socket, SocketAddress* addr);
+  void Unbind(const SocketAddress& addr, VirtualSocket* socket);
+  VirtualSocket* FindBinding(const SocketAddress& addr) const;
+
+  // Milliseconds from now until |size| bytes sent on a link that is free
+  // from |*link_free| arrive, updating |*link_free|.  Returns -1 if the
+  // packet is lost, which only |reliable| packets are not.
+  int PacketDelay(size_t size, bool reliable, int64* link_free);
+  uint32 Random();
+
+  SocketServer* server_;
+  MessageQueue* msg_queue_;
+  VirtualNetwork network_;
+  uint32 random_state_;
+  uint32 next_id_;
+  uint16 next_port_;
+  SocketMap sockets_;
+  BindingMap bindings_;
+  Event wakeup_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(VirtualSocketServer);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_VIRTUALSOCKETSERVER_H_
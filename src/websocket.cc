@@ -0,0 +1,409 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "websocket.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WS_MASK_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define WS_MASK_NEON 1
+#endif
+
+#include <vector>
+
+#include "common.h"
+#include "helpers.h"
+#include "logging.h"
+#include "stringencode.h"
+#include "stringutils.h"
+
+namespace txmpp {
+
+namespace {
+
+const uint8 kFin = 0x80;
+const uint8 kRsv1 = 0x40;
+const uint8 kRsvMask = 0x70;
+const uint8 kOpcodeMask = 0x0F;
+const uint8 kMasked = 0x80;
+const uint8 kLengthMask = 0x7F;
+const size_t kMaxControlPayload = 125;
+
+// permessage-deflate leaves off the end of each message's final sync flush.
+const char kDeflateTail[] = { '\x00', '\x00', '\xff', '\xff' };
+
+const size_t kDeflateChunk = 16 * 1024;
+
+bool IsControl(uint8 opcode) {
+  return (opcode & 0x8) != 0;
+}
+
+}  // anonymous namespace
+
+size_t WebSocketMask(char* data, size_t len, const uint8 key[4],
+                     size_t offset) {
+  // The key as it lines up with data[0]; every block below is a multiple
+  // of 4 bytes, so it lines up with each of them too.
+  uint8 rotated[8];
+  for (size_t i = 0; i < 8; ++i)
+    rotated[i] = key[(offset + i) & 3];
+  size_t pos = 0;
+#if WS_MASK_SSE2
+  if (len >= 16) {
+    uint32 word;
+    memcpy(&word, rotated, sizeof(word));
+    __m128i k = _mm_set1_epi32(static_cast<int>(word));
+    for (; pos + 16 <= len; pos += 16) {
+      __m128i* p = reinterpret_cast<__m128i*>(data + pos);
+      _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), k));
+    }
+  }
+#elif WS_MASK_NEON
+  if (len >= 16) {
+    uint32 word;
+    memcpy(&word, rotated, sizeof(word));
+    uint8x16_t k = vreinterpretq_u8_u32(vdupq_n_u32(word));
+    for (; pos + 16 <= len; pos += 16) {
+      uint8_t* p = reinterpret_cast<uint8_t*>(data + pos);
+      vst1q_u8(p, veorq_u8(vld1q_u8(p), k));
+    }
+  }
+#endif
+  if (pos + 8 <= len) {
+    uint64 k;
+    memcpy(&k, rotated, sizeof(k));
+    for (; pos + 8 <= len; pos += 8) {
+      uint64 v;
+      memcpy(&v, data + pos, sizeof(v));
+      v ^= k;
+      memcpy(data + pos, &v, sizeof(v));
+    }
+  }
+  for (; pos < len; ++pos)
+    data[pos] ^= rotated[pos & 3];
+  return (offset + len) & 3;
+}
+
+const char WebSocketCodec::kDeflateOffer[] = "permessage-deflate";
+const size_t WebSocketCodec::kDefaultMaxMessageSize;
+
+WebSocketCodec::WebSocketCodec()
+    : deflate_(false), reset_deflate_(false), deflate_init_(false),
+      inflate_init_(false), max_message_size_(kDefaultMaxMessageSize),
+      input_start_(0), in_message_(false), message_compressed_(false),
+      message_opcode_(WS_TEXT), close_code_(0), bytes_sent_(0),
+      compressed_bytes_sent_(0) {
+  memset(&deflater_, 0, sizeof(deflater_));
+  memset(&inflater_, 0, sizeof(inflater_));
+}
+
+WebSocketCodec::~WebSocketCodec() {
+  if (deflate_init_)
+    deflateEnd(&deflater_);
+  if (inflate_init_)
+    inflateEnd(&inflater_);
+}
+
+bool WebSocketCodec::Negotiate(const std::string& extensions) {
+  std::vector<std::string> accepted;
+  tokenize(extensions, ',', &accepted);
+  for (size_t i = 0; i < accepted.size(); ++i) {
+    std::vector<std::string> params;
+    tokenize(accepted[i], ';', &params);
+    if (params.empty())
+      continue;
+    if (deflate_ || (_stricmp(string_trim(params[0]).c_str(),
+                              kDeflateOffer) != 0)) {
+      LOG(LS_WARNING) << "WebSocketCodec: not offered: " << accepted[i];
+      return false;
+    }
+    for (size_t j = 1; j < params.size(); ++j) {
+      std::string param = string_trim(params[j]);
+      std::string name = string_trim(param.substr(0, param.find('=')));
+      if (_stricmp(name.c_str(), "client_no_context_takeover") == 0) {
+        reset_deflate_ = true;
+      } else if ((_stricmp(name.c_str(), "server_no_context_takeover") != 0)
+                 && (_stricmp(name.c_str(), "server_max_window_bits") != 0)) {
+        // Inflating with the largest window takes whatever the server
+        // chose; client_max_window_bits wasn't offered.
+        LOG(LS_WARNING) << "WebSocketCodec: bad parameter: " << param;
+        return false;
+      }
+    }
+    deflate_ = true;
+  }
+  return true;
+}
+
+void WebSocketCodec::Encode(WebSocketOpcode opcode, const char* data,
+                            size_t len, std::string* out) {
+  std::string compressed;
+  uint8 first = kFin | opcode;
+  if (deflate_ && !IsControl(opcode)) {
+    if (Deflate(data, len, &compressed)) {
+      first |= kRsv1;
+      bytes_sent_ += len;
+      data = compressed.data();
+      len = compressed.size();
+    } else {
+      bytes_sent_ += len;
+    }
+    compressed_bytes_sent_ += len;
+  } else if (!IsControl(opcode)) {
+    bytes_sent_ += len;
+    compressed_bytes_sent_ += len;
+  }
+
+  char header[14];
+  size_t header_len = 0;
+  header[header_len++] = static_cast<char>(first);
+  if (len < 126) {
+    header[header_len++] = static_cast<char>(kMasked | len);
+  } else if (len <= 0xFFFF) {
+    header[header_len++] = static_cast<char>(kMasked | 126);
+    header[header_len++] = static_cast<char>(len >> 8);
+    header[header_len++] = static_cast<char>(len);
+  } else {
+    header[header_len++] = static_cast<char>(kMasked | 127);
+    uint64 len64 = len;
+    for (int shift = 56; shift >= 0; shift -= 8)
+      header[header_len++] = static_cast<char>(len64 >> shift);
+  }
+  uint32 id = CreateRandomId();
+  uint8 key[4];
+  memcpy(key, &id, sizeof(key));
+  memcpy(header + header_len, key, sizeof(key));
+  header_len += sizeof(key);
+
+  size_t start = out->size();
+  out->reserve(start + header_len + len);
+  out->append(header, header_len);
+  out->append(data, len);
+  WebSocketMask(&(*out)[start + header_len], len, key, 0);
+}
+
+void WebSocketCodec::EncodeClose(uint16 code, const std::string& reason,
+                                 std::string* out) {
+  std::string payload;
+  payload.push_back(static_cast<char>(code >> 8));
+  payload.push_back(static_cast<char>(code));
+  payload.append(reason, 0, kMaxControlPayload - 2);
+  Encode(WS_CLOSE, payload.data(), payload.size(), out);
+}
+
+void WebSocketCodec::ParseClose(const std::string& payload, uint16* code,
+                                std::string* reason) {
+  if (payload.size() >= 2) {
+    *code = (static_cast<uint8>(payload[0]) << 8)
+            | static_cast<uint8>(payload[1]);
+    reason->assign(payload, 2, std::string::npos);
+  } else {
+    // 1005, no status code present.
+    *code = 1005;
+    reason->clear();
+  }
+}
+
+void WebSocketCodec::Write(const char* data, size_t len) {
+  if (input_start_ == input_.size()) {
+    input_.clear();
+    input_start_ = 0;
+  } else if (input_start_ > kDeflateChunk) {
+    input_.erase(0, input_start_);
+    input_start_ = 0;
+  }
+  input_.append(data, len);
+}
+
+WebSocketCodec::Result WebSocketCodec::Next(WebSocketOpcode* opcode,
+                                            std::string* payload) {
+  if (close_code_)
+    return RESULT_ERROR;
+  while (true) {
+    const uint8* p = reinterpret_cast<const uint8*>(input_.data())
+                     + input_start_;
+    size_t avail = input_.size() - input_start_;
+    if (avail < 2)
+      return RESULT_NONE;
+    uint8 first = p[0];
+    uint8 second = p[1];
+    uint8 op = first & kOpcodeMask;
+    size_t header_len = 2;
+    uint64 len = second & kLengthMask;
+    if (len == 126) {
+      if (avail < 4)
+        return RESULT_NONE;
+      len = (p[2] << 8) | p[3];
+      header_len = 4;
+    } else if (len == 127) {
+      if (avail < 10)
+        return RESULT_NONE;
+      len = 0;
+      for (size_t i = 2; i < 10; ++i)
+        len = (len << 8) | p[i];
+      header_len = 10;
+    }
+
+    // Servers don't mask, and only permessage-deflate has a reserved bit.
+    if ((second & kMasked) || (first & (kRsvMask & ~kRsv1)))
+      return Fail(WS_CLOSE_PROTOCOL_ERROR);
+    if (IsControl(op)) {
+      if (!(first & kFin) || (first & kRsv1) || (len > kMaxControlPayload)
+          || ((op != WS_CLOSE) && (op != WS_PING) && (op != WS_PONG)))
+        return Fail(WS_CLOSE_PROTOCOL_ERROR);
+    } else if (op == WS_CONTINUATION) {
+      if (!in_message_ || (first & kRsv1))
+        return Fail(WS_CLOSE_PROTOCOL_ERROR);
+    } else if ((op != WS_TEXT) && (op != WS_BINARY)) {
+      return Fail(WS_CLOSE_PROTOCOL_ERROR);
+    } else if (in_message_ || ((first & kRsv1) && !deflate_)) {
+      return Fail(WS_CLOSE_PROTOCOL_ERROR);
+    }
+    if (!IsControl(op) && (message_.size() + len > max_message_size_))
+      return Fail(WS_CLOSE_TOO_BIG);
+    if (avail - header_len < len)
+      return RESULT_NONE;
+
+    const char* data = reinterpret_cast<const char*>(p + header_len);
+    input_start_ += header_len + static_cast<size_t>(len);
+    if (IsControl(op)) {
+      *opcode = static_cast<WebSocketOpcode>(op);
+      payload->assign(data, static_cast<size_t>(len));
+      return RESULT_MESSAGE;
+    }
+    if (op != WS_CONTINUATION) {
+      in_message_ = true;
+      message_compressed_ = (first & kRsv1) != 0;
+      message_opcode_ = static_cast<WebSocketOpcode>(op);
+    }
+    message_.append(data, static_cast<size_t>(len));
+    if (!(first & kFin))
+      continue;
+
+    in_message_ = false;
+    *opcode = message_opcode_;
+    if (message_compressed_) {
+      message_.append(kDeflateTail, sizeof(kDeflateTail));
+      payload->clear();
+      bool ok = Inflate(message_, payload);
+      message_.clear();
+      if (!ok)
+        return Fail(WS_CLOSE_INVALID_DATA);
+      if (payload->size() > max_message_size_)
+        return Fail(WS_CLOSE_TOO_BIG);
+    } else {
+      payload->swap(message_);
+      message_.clear();
+    }
+    return RESULT_MESSAGE;
+  }
+}
+
+WebSocketCodec::Result WebSocketCodec::Fail(uint16 code) {
+  LOG(LS_WARNING) << "WebSocketCodec: closing with " << code;
+  close_code_ = code;
+  return RESULT_ERROR;
+}
+
+bool WebSocketCodec::Deflate(const char* data, size_t len,
+                             std::string* out) {
+  if (!deflate_init_) {
+    if (deflateInit2(&deflater_, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      LOG(LS_ERROR) << "WebSocketCodec: deflateInit2 failed";
+      deflate_ = false;
+      return false;
+    }
+    deflate_init_ = true;
+  }
+  deflater_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  deflater_.avail_in = static_cast<uInt>(len);
+  size_t used = 0;
+  do {
+    out->resize(used + _max(deflateBound(&deflater_, len) + 8,
+                            kDeflateChunk / 4));
+    deflater_.next_out = reinterpret_cast<Bytef*>(&(*out)[used]);
+    deflater_.avail_out = static_cast<uInt>(out->size() - used);
+    ::deflate(&deflater_, Z_SYNC_FLUSH);
+    used = out->size() - deflater_.avail_out;
+  } while (deflater_.avail_out == 0);
+  out->resize(used);
+  // The flush always ends in the four bytes the peer adds back.
+  if ((used >= sizeof(kDeflateTail))
+      && (memcmp(out->data() + used - sizeof(kDeflateTail), kDeflateTail,
+                 sizeof(kDeflateTail)) == 0)) {
+    out->resize(used - sizeof(kDeflateTail));
+  }
+  if (reset_deflate_)
+    deflateReset(&deflater_);
+  return true;
+}
+
+bool WebSocketCodec::Inflate(const std::string& data, std::string* out) {
+  if (!inflate_init_) {
+    if (inflateInit2(&inflater_, -MAX_WBITS) != Z_OK) {
+      LOG(LS_ERROR) << "WebSocketCodec: inflateInit2 failed";
+      return false;
+    }
+    inflate_init_ = true;
+  }
+  // The server's context carries over, unless it said otherwise, in which
+  // case its messages start afresh anyway.
+  inflater_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  inflater_.avail_in = static_cast<uInt>(data.size());
+  size_t used = out->size();
+  while (true) {
+    out->resize(used + kDeflateChunk);
+    inflater_.next_out = reinterpret_cast<Bytef*>(&(*out)[used]);
+    inflater_.avail_out = static_cast<uInt>(kDeflateChunk);
+    int result = inflate(&inflater_, Z_SYNC_FLUSH);
+    used = out->size() - inflater_.avail_out;
+    if (result == Z_STREAM_END) {
+      // A final block; what follows it is only the tail we added.
+      inflateReset(&inflater_);
+      break;
+    }
+    if ((result != Z_OK) && (result != Z_BUF_ERROR)) {
+      out->resize(used);
+      return false;
+    }
+    if ((inflater_.avail_in == 0) && (inflater_.avail_out != 0))
+      break;
+    // Caught by the caller, before it is all inflated.
+    if (used > max_message_size_)
+      break;
+  }
+  out->resize(used);
+  return true;
+}
+
+}  // namespace txmpp
@@ -0,0 +1,148 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_WEBSOCKET_H_
+#define _TXMPP_WEBSOCKET_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+#include <zlib.h>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+
+namespace txmpp {
+
+enum WebSocketOpcode {
+  WS_CONTINUATION = 0x0,
+  WS_TEXT = 0x1,
+  WS_BINARY = 0x2,
+  WS_CLOSE = 0x8,
+  WS_PING = 0x9,
+  WS_PONG = 0xA
+};
+
+// Status codes of a close frame.
+enum WebSocketCloseCode {
+  WS_CLOSE_NORMAL = 1000,
+  WS_CLOSE_GOING_AWAY = 1001,
+  WS_CLOSE_PROTOCOL_ERROR = 1002,
+  WS_CLOSE_UNSUPPORTED = 1003,
+  WS_CLOSE_INVALID_DATA = 1007,
+  WS_CLOSE_TOO_BIG = 1009
+};
+
+// XORs the |len| bytes of |data| with the 4-byte |key|, repeated, starting
+// |offset| bytes into it, which masks and unmasks alike.  Returns the offset
+// for the bytes that follow.  Runs 16 bytes at a time with SSE2 or NEON.
+size_t WebSocketMask(char* data, size_t len, const uint8 key[4],
+                     size_t offset);
+
+// Frames messages for the client end of a WebSocket (RFC 6455), and
+// reassembles those the server sends, with the permessage-deflate
+// extension (RFC 7692) once it is negotiated.  Frames sent are masked, each
+// with a key of its own; a message is sent as one frame.
+class WebSocketCodec {
+ public:
+  enum Result { RESULT_NONE, RESULT_MESSAGE, RESULT_ERROR };
+
+  // What the client offers in Sec-WebSocket-Extensions to get
+  // permessage-deflate.  The server's windows and whether it keeps its
+  // context are up to it.
+  static const char kDeflateOffer[];
+  // The largest message taken by default, after inflating.
+  static const size_t kDefaultMaxMessageSize = 4 * 1024 * 1024;
+
+  WebSocketCodec();
+  ~WebSocketCodec();
+
+  // Takes the server's Sec-WebSocket-Extensions, which may be empty.
+  // Returns false if it accepts something that wasn't offered.
+  bool Negotiate(const std::string& extensions);
+  bool deflate() const { return deflate_; }
+
+  void set_max_message_size(size_t size) { max_message_size_ = size; }
+  size_t max_message_size() const { return max_message_size_; }
+
+  // Appends a frame holding the message to |out|.  Text and binary messages
+  // are compressed if permessage-deflate is on.
+  void Encode(WebSocketOpcode opcode, const char* data, size_t len,
+              std::string* out);
+  void EncodeClose(uint16 code, const std::string& reason, std::string* out);
+
+  // Takes bytes received from the server.
+  void Write(const char* data, size_t len);
+  // Sets |opcode| and |payload| to the next whole message: control frames
+  // as they come, and data messages once their last fragment is in.  Returns
+  // RESULT_NONE if more bytes are needed, and RESULT_ERROR once the server
+  // has broken the protocol, after which close_code says why.
+  Result Next(WebSocketOpcode* opcode, std::string* payload);
+  uint16 close_code() const { return close_code_; }
+
+  // The payload bytes of the data messages sent, and what they came to on
+  // the wire.
+  size_t bytes_sent() const { return bytes_sent_; }
+  size_t compressed_bytes_sent() const { return compressed_bytes_sent_; }
+
+  // Parses the status code and reason of a close frame's |payload|, which
+  // may have neither.
+  static void ParseClose(const std::string& payload, uint16* code,
+                         std::string* reason);
+
+ private:
+  Result Fail(uint16 code);
+  bool Deflate(const char* data, size_t len, std::string* out);
+  bool Inflate(const std::string& data, std::string* out);
+
+  bool deflate_;
+  // Set if the server told us not to keep our context between messages.
+  bool reset_deflate_;
+  bool deflate_init_, inflate_init_;
+  z_stream deflater_;
+  z_stream inflater_;
+  size_t max_message_size_;
+
+  // Received bytes not yet framed, from input_start_ on.
+  std::string input_;
+  size_t input_start_;
+  // The data message being reassembled.
+  bool in_message_, message_compressed_;
+  WebSocketOpcode message_opcode_;
+  std::string message_;
+  uint16 close_code_;
+
+  size_t bytes_sent_, compressed_bytes_sent_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(WebSocketCodec);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_WEBSOCKET_H_
@@ -410,6 +410,9 @@ int Win32Socket::SetOption(Option opt, int value) {
   if (TranslateOption(opt, &slevel, &sopt) == -1)
     return -1;
 
+  if (opt == OPT_KEEPALIVE) {
+    value = (value > 0) ? 1 : 0;
+  }
   const char* p = reinterpret_cast<const char*>(&value);
   return ::setsockopt(socket_, slevel, sopt, p, sizeof(value));
 }
@@ -588,6 +591,20 @@ int Win32Socket::TranslateOption(Option opt, int* slevel, int* sopt) {
       *slevel = IPPROTO_TCP;
       *sopt = TCP_NODELAY;
       break;
+    case OPT_UDP_SEGMENT:
+      LOG(LS_WARNING) << "Socket::OPT_UDP_SEGMENT not supported.";
+      return -1;
+    case OPT_BUSY_POLL:
+      LOG(LS_WARNING) << "Socket::OPT_BUSY_POLL not supported.";
+      return -1;
+    case OPT_KEEPALIVE:
+      *slevel = SOL_SOCKET;
+      *sopt = SO_KEEPALIVE;
+      break;
+    case OPT_RTT:
+    case OPT_RTTVAR:
+      LOG(LS_WARNING) << "Socket::OPT_RTT and OPT_RTTVAR not supported.";
+      return -1;
     default:
       ASSERT(false);
       return -1;
@@ -0,0 +1,230 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "wirecapture.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <map>
+
+#include "byteorder.h"
+#include "logging.h"
+#include "stream.h"
+#include "time.h"
+
+namespace txmpp {
+
+const char WireCapture::kMagic[8] = { 'T', 'X', 'W', 'I', 'R', 'E', '1', '\n' };
+
+WireCapture::WireCapture(StreamInterface* stream, size_t buffer_size)
+    : stream_(stream),
+      buffer_size_(_max(buffer_size, kHeaderSize + 256)),
+      buffer_len_(0), failed_(false), next_connection_(0), dropped_(0) {
+  buffer_.reset(new char[buffer_size_]);
+  memcpy(buffer_.get(), kMagic, sizeof(kMagic));
+  buffer_len_ = sizeof(kMagic);
+}
+
+WireCapture::~WireCapture() {
+  Flush();
+}
+
+uint32 WireCapture::AddConnection(const std::string& label) {
+  CritScope cs(&crit_);
+  uint32 connection = next_connection_++;
+  Append(connection, WR_LABEL, label.data(), label.size());
+  return connection;
+}
+
+void WireCapture::Write(uint32 connection, RecordType type, const void* data,
+                        size_t len) {
+  CritScope cs(&crit_);
+  Append(connection, type, data, len);
+}
+
+void WireCapture::WriteClose(uint32 connection, int error) {
+  char data[4];
+  SetBE32(data, static_cast<uint32>(error));
+  Write(connection, WR_CLOSE, data, sizeof(data));
+}
+
+void WireCapture::Append(uint32 connection, RecordType type, const void* data,
+                         size_t len) {
+  // Each record fits in an empty buffer.
+  const size_t max_data = _min(buffer_size_ - kHeaderSize, kMaxRecordData);
+  uint64 now = TimeMicros();
+  const char* p = static_cast<const char*>(data);
+  do {
+    size_t chunk = _min(len, max_data);
+    if (buffer_size_ - buffer_len_ < kHeaderSize + chunk &&
+        (!FlushLocked() || buffer_size_ - buffer_len_ < kHeaderSize + chunk)) {
+      ++dropped_;
+    } else {
+      char* header = buffer_.get() + buffer_len_;
+      SetBE64(header, now);
+      SetBE32(header + 8, connection);
+      SetBE32(header + 12, (static_cast<uint32>(type) << 24) |
+                           static_cast<uint32>(chunk));
+      memcpy(header + kHeaderSize, p, chunk);
+      buffer_len_ += kHeaderSize + chunk;
+    }
+    p += chunk;
+    len -= chunk;
+  } while (len > 0);
+}
+
+bool WireCapture::Flush() {
+  CritScope cs(&crit_);
+  return FlushLocked();
+}
+
+bool WireCapture::FlushLocked() {
+  if (failed_)
+    return false;
+  size_t written = 0;
+  while (written < buffer_len_) {
+    size_t count;
+    int error;
+    StreamResult result = stream_->Write(buffer_.get() + written,
+                                         buffer_len_ - written, &count, &error);
+    if (result == SR_SUCCESS) {
+      written += count;
+    } else {
+      // Keep what is left, so that the capture stays whole if the stream
+      // unblocks.
+      failed_ = (result != SR_BLOCK);
+      break;
+    }
+  }
+  memmove(buffer_.get(), buffer_.get() + written, buffer_len_ - written);
+  buffer_len_ -= written;
+  return buffer_len_ == 0;
+}
+
+// The rendering state of one connection.
+struct WireCapture_Connection {
+  std::string label;
+  LogMultilineState state;
+};
+
+bool WireCapture::ReadStart(StreamInterface* capture) {
+  char magic[sizeof(kMagic)];
+  return capture->ReadAll(magic, sizeof(magic), NULL, NULL) == SR_SUCCESS &&
+         memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+}
+
+StreamResult WireCapture::ReadRecord(StreamInterface* capture,
+                                     Record* record) {
+  char header[kHeaderSize];
+  StreamResult result = capture->ReadAll(header, sizeof(header), NULL, NULL);
+  if (result != SR_SUCCESS)
+    return result == SR_EOS ? SR_EOS : SR_ERROR;
+  record->time = GetBE64(header);
+  record->connection = GetBE32(header + 8);
+  record->type = static_cast<RecordType>(Get8(header, 12));
+  size_t len = GetBE32(header + 12) & kMaxRecordData;
+  record->data.resize(len);
+  if (len && capture->ReadAll(&record->data[0], len, NULL, NULL) != SR_SUCCESS)
+    return SR_ERROR;
+  return SR_SUCCESS;
+}
+
+bool WireCapture::Render(StreamInterface* capture, StreamInterface* text,
+                         bool hex_mode, bool timestamps) {
+  if (!ReadStart(capture))
+    return false;
+
+  std::map<uint32, WireCapture_Connection> connections;
+  std::string out;
+  uint64 start = 0;
+  bool first = true;
+  Record record;
+  StreamResult result;
+  while ((result = ReadRecord(capture, &record)) == SR_SUCCESS) {
+    uint64 time = record.time;
+    uint32 connection = record.connection;
+    RecordType type = record.type;
+    const std::string& data = record.data;
+    size_t len = data.size();
+    if (first) {
+      start = time;
+      first = false;
+    }
+
+    WireCapture_Connection& conn = connections[connection];
+    const char* label = conn.label.c_str();
+    out.clear();
+    switch (type) {
+      case WR_LABEL:
+        conn.label = data;
+        break;
+      case WR_INPUT:
+      case WR_OUTPUT:
+        FormatMultiline(label, type == WR_INPUT, data.data(), len, hex_mode,
+                        &conn.state, &out);
+        break;
+      case WR_OPEN:
+        out.append(conn.label).append(" Open\n");
+        break;
+      case WR_CONNECT:
+        out.append(conn.label).append(" Connected\n");
+        break;
+      case WR_CLOSE_LOCAL:
+      case WR_CLOSE:
+        FormatMultiline(label, false, NULL, 0, hex_mode, &conn.state, &out);
+        FormatMultiline(label, true, NULL, 0, hex_mode, &conn.state, &out);
+        if (type == WR_CLOSE_LOCAL) {
+          out.append(conn.label).append(" Closed locally\n");
+        } else if (len == 4) {
+          char error[16];
+          snprintf(error, sizeof(error), "%d",
+                   static_cast<int>(GetBE32(data.data())));
+          out.append(conn.label).append(" Closed with error: ")
+             .append(error).append("\n");
+        } else {
+          return false;
+        }
+        break;
+      default:
+        return false;
+    }
+
+    if (timestamps && !out.empty()) {
+      uint32 ms = static_cast<uint32>((time - start) / 1000);
+      char stamp[32];
+      snprintf(stamp, sizeof(stamp), "[%03u:%03u] ", ms / 1000, ms % 1000);
+      for (size_t pos = 0; pos < out.size(); pos = out.find('\n', pos) + 1)
+        out.insert(pos, stamp);
+    }
+    if (!out.empty() &&
+        text->WriteAll(out.data(), out.size(), NULL, NULL) != SR_SUCCESS)
+      return false;
+  }
+  return result == SR_EOS;
+}
+
+}  // namespace txmpp
@@ -0,0 +1,129 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_WIRECAPTURE_H_
+#define _TXMPP_WIRECAPTURE_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "criticalsection.h"
+#include "scoped_ptr.h"
+#include "stream.h"
+
+namespace txmpp {
+
+// Records the bytes that pass through LoggingAdapter and LoggingSocketAdapter
+// in a compact binary form, so that production captures cost a copy per
+// record on the I/O thread rather than formatting every byte as text.
+// Render turns a capture into the text that LogMultiline would have logged.
+//
+// A capture starts with kMagic, followed by records: a big-endian header of
+// the TimeMicros at which it was taken (8 bytes), the connection id (4), and
+// the type in the top byte and the length of the data in the low 24 bits of
+// the last 4, followed by the data. Several connections may share a capture.
+class WireCapture {
+ public:
+  enum RecordType {
+    WR_LABEL,          // The connection's label, when it is added.
+    WR_INPUT,          // Bytes read.
+    WR_OUTPUT,         // Bytes written.
+    WR_OPEN,           // A stream opened.
+    WR_CONNECT,        // A socket connected.
+    WR_CLOSE_LOCAL,    // Closed locally.
+    WR_CLOSE,          // Closed by the other side, with a 4-byte error.
+  };
+
+  static const char kMagic[8];
+  static const size_t kHeaderSize = 16;
+  static const size_t kMaxRecordData = (1 << 24) - 1;
+
+  // Takes ownership of |stream|. Records are kept in a buffer of
+  // |buffer_size| bytes, and written to the stream when it fills.
+  explicit WireCapture(StreamInterface* stream, size_t buffer_size = 64 * 1024);
+  // Writes out the records still buffered.
+  ~WireCapture();
+
+  // Returns the id of a new connection, whose lines are labelled |label|.
+  uint32 AddConnection(const std::string& label);
+  // Records |len| bytes of |data|, split over as many records as needed.
+  void Write(uint32 connection, RecordType type, const void* data,
+             size_t len);
+  void WriteClose(uint32 connection, int error);
+
+  // Writes out the buffered records. Returns false if the stream failed or
+  // blocked, after which the records that don't fit are dropped.
+  bool Flush();
+  // The number of records dropped.
+  size_t dropped() const { return dropped_; }
+
+  // A record as read back from a capture.
+  struct Record {
+    uint64 time;
+    uint32 connection;
+    RecordType type;
+    std::string data;
+  };
+
+  // Reads and checks the magic that starts a capture.
+  static bool ReadStart(StreamInterface* capture);
+  // Reads the next record into |record|. Returns SR_EOS at the end of the
+  // capture, and SR_ERROR if it is corrupt or can't be read.
+  static StreamResult ReadRecord(StreamInterface* capture, Record* record);
+
+  // Reads the capture from |capture| and writes the lines that the adapters
+  // would have logged to |text|, each preceded by the time since the first
+  // record if |timestamps| is set. Returns false if the capture is corrupt.
+  static bool Render(StreamInterface* capture, StreamInterface* text,
+                     bool hex_mode, bool timestamps);
+
+ private:
+  // Appends a record; crit_ must be held.
+  void Append(uint32 connection, RecordType type, const void* data,
+              size_t len);
+  bool FlushLocked();
+
+  CriticalSection crit_;
+  scoped_ptr<StreamInterface> stream_;
+  scoped_array<char> buffer_;
+  size_t buffer_size_;
+  size_t buffer_len_;
+  bool failed_;
+  uint32 next_connection_;
+  size_t dropped_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(WireCapture);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_WIRECAPTURE_H_
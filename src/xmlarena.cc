@@ -0,0 +1,171 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmlarena.h"
+
+#include <new>
+
+#include "allocstats.h"
+#include "blockpool.h"
+#include "common.h"
+
+namespace txmpp {
+
+namespace {
+
+// Put in front of each XmlArenaAllocated object. Its size is also the
+// alignment of arena allocations.
+union ObjectHeader {
+  XmlArena* arena;
+  double align;
+};
+
+const size_t kAlignment = sizeof(ObjectHeader);
+
+// Never destroyed, as arenas may outlive static destruction.
+BlockPool* Arena_Pool() {
+  static BlockPool* pool = new BlockPool(sizeof(XmlArena));
+  return pool;
+}
+
+}  // namespace
+
+void* XmlArena::operator new(size_t size) {
+  ASSERT(size == sizeof(XmlArena));
+  return Arena_Pool()->Allocate();
+}
+
+void XmlArena::operator delete(void* p) {
+  if (p)
+    Arena_Pool()->Free(p);
+}
+
+XmlArena::XmlArena(size_t chunk_size)
+    : chunk_size_(chunk_size), chunks_(NULL), next_(NULL), end_(NULL),
+      allocated_(0) {
+}
+
+XmlArena::~XmlArena() {
+  while (Chunk* chunk = chunks_) {
+    chunks_ = chunk->next;
+    delete [] reinterpret_cast<char*>(chunk);
+  }
+}
+
+void* XmlArena::Allocate(size_t size) {
+  size = (size + kAlignment - 1) & ~(kAlignment - 1);
+  if (static_cast<size_t>(end_ - next_) < size)
+    AddChunk(size);
+  void* p = next_;
+  next_ += size;
+  allocated_ += size;
+  return p;
+}
+
+void XmlArena::AddChunk(size_t size) {
+  size = _max(size, chunk_size_);
+  // sizeof(Chunk) is a multiple of kAlignment, so the data stays aligned.
+  char* block = new char[sizeof(Chunk) + size];
+  Chunk* chunk = reinterpret_cast<Chunk*>(block);
+  chunk->size = size;
+  chunk->next = chunks_;
+  chunks_ = chunk;
+  next_ = block + sizeof(Chunk);
+  end_ = next_ + size;
+}
+
+void XmlArena::Reset() {
+  // Keeps a chunk of the usual size, and frees the rest, including any
+  // oversized ones.
+  Chunk* keep = NULL;
+  while (Chunk* chunk = chunks_) {
+    chunks_ = chunk->next;
+    if (!keep && chunk->size == chunk_size_) {
+      keep = chunk;
+    } else {
+      delete [] reinterpret_cast<char*>(chunk);
+    }
+  }
+  if (keep) {
+    keep->next = NULL;
+    chunks_ = keep;
+    next_ = reinterpret_cast<char*>(keep) + sizeof(Chunk);
+    end_ = next_ + keep->size;
+  } else {
+    next_ = end_ = NULL;
+  }
+  allocated_ = 0;
+}
+
+size_t XmlArena::Trim() {
+  if (allocated_ != 0)
+    return 0;
+  size_t freed = 0;
+  while (Chunk* chunk = chunks_) {
+    chunks_ = chunk->next;
+    freed += sizeof(Chunk) + chunk->size;
+    delete [] reinterpret_cast<char*>(chunk);
+  }
+  next_ = end_ = NULL;
+  return freed;
+}
+
+size_t XmlArena::ChunkBytes() const {
+  size_t bytes = 0;
+  for (Chunk* chunk = chunks_; chunk; chunk = chunk->next)
+    bytes += sizeof(Chunk) + chunk->size;
+  return bytes;
+}
+
+void* XmlArenaAllocated::operator new(size_t size) {
+  return XmlArenaAllocated::operator new(size, static_cast<XmlArena*>(NULL));
+}
+
+void* XmlArenaAllocated::operator new(size_t size, XmlArena* arena) {
+  size_t cb = sizeof(ObjectHeader) + size;
+  AllocStats::Record(AllocStats::AS_XML_NODE, cb);
+  ObjectHeader* header = static_cast<ObjectHeader*>(
+      arena ? arena->Allocate(cb) : ::operator new(cb));
+  header->arena = arena;
+  return header + 1;
+}
+
+void XmlArenaAllocated::operator delete(void* p) {
+  if (!p)
+    return;
+  ObjectHeader* header = static_cast<ObjectHeader*>(p) - 1;
+  // Arena memory is reclaimed by XmlArena::Reset.
+  if (!header->arena)
+    ::operator delete(header);
+}
+
+void XmlArenaAllocated::operator delete(void* p, XmlArena* arena) {
+  UNUSED(arena);
+  XmlArenaAllocated::operator delete(p);
+}
+
+}  // namespace txmpp
@@ -0,0 +1,103 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMLARENA_H_
+#define _TXMPP_XMLARENA_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+
+namespace txmpp {
+
+// A bump allocator for the nodes of parsed XML trees, which are built and
+// thrown away together. Memory is handed out from large chunks and is only
+// given back by Reset, which keeps one chunk around for the next tree.
+// XmlArena objects come from a pool shared by all threads, as a stanza's
+// arena may be handed to whoever keeps the stanza (see
+// XmppStanzaParser::TakeStanza).  An arena itself is not thread safe.
+class XmlArena {
+ public:
+  explicit XmlArena(size_t chunk_size = kDefaultChunkSize);
+  ~XmlArena();
+
+  static void* operator new(size_t size);
+  static void operator delete(void* p);
+
+  void* Allocate(size_t size);
+
+  // Reclaims everything allocated so far. The objects placed in the arena
+  // must have been destroyed by then.
+  void Reset();
+  // Frees the chunk Reset keeps, if nothing has been allocated since, as for
+  // a connection gone idle. Returns the bytes freed.
+  size_t Trim();
+
+  // Bytes handed out since the last Reset.
+  size_t allocated() const { return allocated_; }
+  // Bytes held in chunks, used or not.
+  size_t ChunkBytes() const;
+
+  static const size_t kDefaultChunkSize = 4096;
+
+ private:
+  struct Chunk {
+    Chunk* next;
+    size_t size;
+  };
+
+  void AddChunk(size_t size);
+
+  size_t chunk_size_;
+  Chunk* chunks_;
+  char* next_;
+  char* end_;
+  size_t allocated_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(XmlArena);
+};
+
+// A base for classes whose objects can be created either on the heap or in
+// an XmlArena, with new (arena) T(...), and destroyed with delete either way.
+// Each object records where it came from, so arena and heap objects can be
+// linked into the same tree. A NULL arena means the heap.
+class XmlArenaAllocated {
+ public:
+  static void* operator new(size_t size);
+  static void* operator new(size_t size, XmlArena* arena);
+  static void operator delete(void* p);
+  static void operator delete(void* p, XmlArena* arena);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMLARENA_H_
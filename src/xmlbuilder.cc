@@ -36,30 +36,70 @@
 namespace txmpp {
 
 XmlBuilder::XmlBuilder() :
-  pelCurrent_(NULL),
+  arena_(NULL),
   pelRoot_(NULL),
-  pvParents_(new std::vector<XmlElement *>()) {
+  pvOpen_(new std::vector<XmlElement *>()) {
+}
+
+XmlBuilder::XmlBuilder(XmlArena * arena) :
+  arena_(arena),
+  pelRoot_(NULL),
+  pvOpen_(new std::vector<XmlElement *>()) {
 }
 
 void
 XmlBuilder::Reset() {
   pelRoot_.reset();
-  pelCurrent_ = NULL;
-  pvParents_->clear();
+  pvOpen_->clear();
+  if (stripping_.get())
+    *stripping_ = Stripping();
+}
+
+void
+XmlBuilder::SetStripWhitespace(bool strip) {
+  if (!strip)
+    stripping_.reset();
+  else if (!stripping_.get())
+    stripping_.reset(new Stripping);
+}
+
+bool
+XmlBuilder::IsMixedContent(const XmlElement * element) {
+  // The message body, and XHTML-IM's, whose spaces between inline elements
+  // are part of the text.
+  return element->Name().LocalPart() == "body";
+}
+
+void
+XmlBuilder::EndText(bool keep_space) {
+  Stripping & s = *stripping_;
+  if (!s.space.empty()) {
+    if (keep_space)
+      pvOpen_->back()->AddParsedText(s.space.data(),
+                                     static_cast<int>(s.space.size()));
+    s.space.clear();
+  }
+  s.text = false;
 }
 
 XmlElement *
 XmlBuilder::BuildElement(XmlParseContext * pctx,
-                              const char * name, const char ** atts) {
+                              const char * name, const char ** atts,
+                              XmlArena * arena) {
   QName tagName(pctx->ResolveQName(name, false));
   if (tagName == QN_EMPTY)
     return NULL;
 
-  XmlElement * pelNew = new XmlElement(tagName);
+  XmlElement * pelNew = new (arena) XmlElement(tagName, arena);
 
   if (!*atts)
     return pelNew;
 
+  size_t count = 0;
+  while (atts[2 * count])
+    ++count;
+  pelNew->ReserveAttrs(count);
+
   std::set<QName> seenNonlocalAtts;
 
   while (*atts) {
@@ -88,20 +128,26 @@ XmlBuilder::BuildElement(XmlParseContext * pctx,
 void
 XmlBuilder::StartElement(XmlParseContext * pctx,
                               const char * name, const char ** atts) {
-  XmlElement * pelNew = BuildElement(pctx, name, atts);
+  XmlElement * pelNew = BuildElement(pctx, name, atts, arena_);
   if (pelNew == NULL) {
     pctx->RaiseError(XML_ERROR_SYNTAX);
     return;
   }
 
-  if (!pelCurrent_) {
-    pelCurrent_ = pelNew;
+  if (pvOpen_->empty()) {
     pelRoot_.reset(pelNew);
-    pvParents_->push_back(NULL);
   } else {
-    pelCurrent_->AddElement(pelNew);
-    pvParents_->push_back(pelCurrent_);
-    pelCurrent_ = pelNew;
+    // Whitespace before a child is between elements.
+    if (stripping_.get())
+      EndText(false);
+    pvOpen_->back()->AddElement(pelNew);
+  }
+  pvOpen_->push_back(pelNew);
+
+  if (stripping_.get()) {
+    stripping_->after_start = true;
+    if (!stripping_->mixed_depth && IsMixedContent(pelNew))
+      stripping_->mixed_depth = pvOpen_->size();
   }
 }
 
@@ -109,17 +155,41 @@ void
 XmlBuilder::EndElement(XmlParseContext * pctx, const char * name) {
   UNUSED(pctx);
   UNUSED(name);
-  pelCurrent_ = pvParents_->back();
-  pvParents_->pop_back();
+  if (stripping_.get()) {
+    Stripping & s = *stripping_;
+    // Whitespace after a child is between elements, but in an element with
+    // none it is the element's text.
+    EndText(s.after_start);
+    s.after_start = false;
+    if (s.mixed_depth == pvOpen_->size())
+      s.mixed_depth = 0;
+  }
+  pvOpen_->pop_back();
 }
 
 void
 XmlBuilder::CharacterData(XmlParseContext * pctx,
                                const char * text, int len) {
   UNUSED(pctx);
-  if (pelCurrent_) {
-    pelCurrent_->AddParsedText(text, len);
+  if (pvOpen_->empty())
+    return;
+  XmlElement * pelCurrent = pvOpen_->back();
+  if (stripping_.get() && !stripping_->mixed_depth && !stripping_->text) {
+    // Expat may split text anywhere, so whitespace is held until the text
+    // around it is known to be more than that.
+    Stripping & s = *stripping_;
+    int i = 0;
+    while (i < len && (text[i] == ' ' || text[i] == '\t' ||
+                       text[i] == '\n' || text[i] == '\r'))
+      ++i;
+    if (i == len) {
+      s.space.append(text, len);
+      return;
+    }
+    EndText(true);
+    s.text = true;
   }
+  pelCurrent->AddParsedText(text, len);
 }
 
 void
@@ -127,12 +197,18 @@ XmlBuilder::Error(XmlParseContext * pctx, XML_Error err) {
   UNUSED(pctx);
   UNUSED(err);
   pelRoot_.reset(NULL);
-  pelCurrent_ = NULL;
-  pvParents_->clear();
+  pvOpen_->clear();
+  if (stripping_.get())
+    *stripping_ = Stripping();
 }
 
 XmlElement *
 XmlBuilder::CreateElement() {
+  if (arena_ && pelRoot_.get()) {
+    XmlElement * pelCopy = new XmlElement(*pelRoot_);
+    pelRoot_.reset();
+    return pelCopy;
+  }
   return pelRoot_.release();
 }
 
@@ -141,6 +217,14 @@ XmlBuilder::BuiltElement() {
   return pelRoot_.get();
 }
 
+XmlElement *
+XmlBuilder::ReleaseElement(XmlArena * next_arena) {
+  XmlElement * pelRoot = pelRoot_.release();
+  Reset();
+  arena_ = next_arena;
+  return pelRoot;
+}
+
 XmlBuilder::~XmlBuilder() {
 }
 
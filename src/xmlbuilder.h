@@ -40,6 +40,7 @@
 
 namespace txmpp {
 
+class XmlArena;
 class XmlElement;
 class XmlParseContext;
 
@@ -47,9 +48,13 @@ class XmlParseContext;
 class XmlBuilder : public XmlParseHandler {
 public:
   XmlBuilder();
+  // Builds the element tree in |arena|, which the caller resets once done
+  // with it (after Reset() or deleting the built element).
+  explicit XmlBuilder(XmlArena * arena);
 
   static XmlElement * BuildElement(XmlParseContext * pctx,
-                                  const char * name, const char ** atts);
+                                  const char * name, const char ** atts,
+                                  XmlArena * arena = NULL);
   virtual void StartElement(XmlParseContext * pctx,
                             const char * name, const char ** atts);
   virtual void EndElement(XmlParseContext * pctx, const char * name);
@@ -60,16 +65,56 @@ public:
 
   void Reset();
 
-  // Take ownership of the built element; second call returns NULL
+  // Take ownership of the built element; second call returns NULL. With an
+  // arena, this returns a heap copy and releases the arena's tree.
   XmlElement * CreateElement();
 
   // Peek at the built element without taking ownership
   XmlElement * BuiltElement();
 
+  // Take the built element as it is, in the arena, which the caller then
+  // keeps for as long as the element; second call returns NULL. The next
+  // tree is built in |next_arena|.
+  XmlElement * ReleaseElement(XmlArena * next_arena);
+
+  // The element whose children are being built, or NULL.
+  XmlElement * CurrentElement() {
+    return pvOpen_->empty() ? NULL : pvOpen_->back();
+  }
+
+  // Drops the whitespace between elements, as pretty printed XML is full
+  // of, rather than building it as text. The text of an element with no
+  // children is kept, whitespace or not, and so is all of the text within
+  // an element of mixed content, such as a message body or XHTML. Set it
+  // between trees.
+  void SetStripWhitespace(bool strip);
+  bool StripWhitespace() const { return stripping_.get() != NULL; }
+
+  // Builds the next tree in |arena|, or on the heap if it is NULL. Set it
+  // between trees.
+  void SetArena(XmlArena * arena) { arena_ = arena; }
+
 private:
-  XmlElement * pelCurrent_;
+  // While stripping, the whitespace read since the last tag, held back
+  // until the text turns out to be more than that; whether it did; whether
+  // the last tag was a start tag; and the depth of the mixed content
+  // element being built, or 0.
+  struct Stripping {
+    Stripping() : text(false), after_start(false), mixed_depth(0) {}
+    std::string space;
+    bool text;
+    bool after_start;
+    size_t mixed_depth;
+  };
+  static bool IsMixedContent(const XmlElement * element);
+  void EndText(bool keep_space);
+
+  XmlArena * arena_;
   txmpp::scoped_ptr<XmlElement> pelRoot_;
-  txmpp::scoped_ptr<std::vector<XmlElement*> > pvParents_;
+  // The elements not yet ended, the one being built last.
+  txmpp::scoped_ptr<std::vector<XmlElement*> > pvOpen_;
+  // Made by SetStripWhitespace, as most builders keep everything.
+  txmpp::scoped_ptr<Stripping> stripping_;
 };
 
 }  // namespace txmpp
@@ -27,22 +27,33 @@
 
 #include "xmlelement.h"
 
+#include <cstring>
 #include <string>
+#ifdef POSIX
+#include <pthread.h>
+#endif
 #include <iostream>
+#include <new>
 #include <vector>
 #include <sstream>
 
+#include "allocstats.h"
 #include "common.h"
+#include "criticalsection.h"
 #include "qname.h"
 #include "xmlparser.h"
 #include "xmlbuilder.h"
 #include "xmlprinter.h"
 #include "xmlconstants.h"
 
+#ifdef WIN32
+#include "win32.h"
+#endif
+
 namespace txmpp {
 
-const QName QN_EMPTY(true, STR_EMPTY, STR_EMPTY);
-const QName QN_XMLNS(true, STR_EMPTY, STR_XMLNS);
+const QName QN_EMPTY;
+TXMPP_DEFINE_LOCAL_QNAME(QN_XMLNS, "xmlns");
 
 
 XmlChild::~XmlChild() {
@@ -63,79 +74,196 @@ XmlText::AsTextImpl() const {
   return const_cast<XmlText *>(this);
 }
 
+// Parsed text stays in text_ up to this size, and goes in chunks of at
+// least this size after that.
+static const size_t kTextChunkSize = 64 * 1024;
+
+XmlText::XmlText(const XmlText & t) :
+    XmlChild(),
+    first_chunk_(NULL),
+    last_chunk_(NULL) {
+  text_.reserve(t.Size());
+  for (ChunkIterator it(&t); !it.Done(); it.Next())
+    text_.append(it.Data(), it.Size());
+}
+
+const std::string &
+XmlText::Text() const {
+  if (first_chunk_)
+    Flatten();
+  return text_;
+}
+
+size_t
+XmlText::Size() const {
+  size_t size = text_.size();
+  for (const Chunk * chunk = first_chunk_; chunk; chunk = chunk->next)
+    size += chunk->size;
+  return size;
+}
+
 void
 XmlText::SetText(const std::string & text) {
+  FreeChunks(first_chunk_);
+  first_chunk_ = last_chunk_ = NULL;
   text_ = text;
 }
 
 void
 XmlText::AddParsedText(const char * buf, int len) {
-  text_.append(buf, len);
+  size_t size = static_cast<size_t>(len);
+  if (!first_chunk_ && text_.size() + size <= kTextChunkSize) {
+    text_.append(buf, size);
+    return;
+  }
+  Chunk * chunk = last_chunk_;
+  if (!chunk || chunk->capacity - chunk->size < size) {
+    size_t capacity = _max(kTextChunkSize, size);
+    AllocStats::Record(AllocStats::AS_XML_TEXT, sizeof(Chunk) + capacity);
+    chunk = reinterpret_cast<Chunk *>(new char[sizeof(Chunk) + capacity]);
+    chunk->next = NULL;
+    chunk->size = 0;
+    chunk->capacity = capacity;
+    if (last_chunk_)
+      last_chunk_->next = chunk;
+    else
+      first_chunk_ = chunk;
+    last_chunk_ = chunk;
+  }
+  memcpy(chunk->Data() + chunk->size, buf, size);
+  chunk->size += size;
 }
 
 void
 XmlText::AddText(const std::string & text) {
+  if (first_chunk_)
+    Flatten();
   text_ += text;
 }
 
+void
+XmlText::Flatten() const {
+  text_.reserve(Size());
+  for (Chunk * chunk = first_chunk_; chunk; chunk = chunk->next)
+    text_.append(chunk->Data(), chunk->size);
+  FreeChunks(first_chunk_);
+  first_chunk_ = last_chunk_ = NULL;
+}
+
+void
+XmlText::FreeChunks(Chunk * chunk) {
+  while (chunk) {
+    Chunk * next = chunk->next;
+    delete [] reinterpret_cast<char *>(chunk);
+    chunk = next;
+  }
+}
+
 XmlText::~XmlText() {
+  FreeChunks(first_chunk_);
+}
+
+XmlText::ChunkIterator::ChunkIterator(const XmlText * text) :
+    next_(text->first_chunk_),
+    data_(text->text_.data()),
+    size_(text->text_.size()) {
+  if (size_ == 0)
+    Next();
+}
+
+void
+XmlText::ChunkIterator::Next() {
+  const Chunk * chunk = static_cast<const Chunk *>(next_);
+  if (!chunk) {
+    data_ = NULL;
+    size_ = 0;
+    return;
+  }
+  next_ = chunk->next;
+  data_ = reinterpret_cast<const char *>(chunk + 1);
+  size_ = chunk->size;
 }
 
 XmlElement::XmlElement(const QName & name) :
     name_(name),
-    pFirstAttr_(NULL),
-    pLastAttr_(NULL),
-    pFirstChild_(NULL),
-    pLastChild_(NULL),
-    cdata_(false) {
+    body_(),
+    shared_(NULL),
+    arena_(NULL),
+    lazy_(NULL),
+    lazy_len_(0) {
+}
+
+XmlElement::XmlElement(const QName & name, XmlArena * arena) :
+    name_(name),
+    body_(),
+    shared_(NULL),
+    arena_(arena),
+    lazy_(NULL),
+    lazy_len_(0) {
 }
 
 XmlElement::XmlElement(const XmlElement & elt) :
     XmlChild(),
     name_(elt.name_),
-    pFirstAttr_(NULL),
-    pLastAttr_(NULL),
-    pFirstChild_(NULL),
-    pLastChild_(NULL),
-    cdata_(false) {
-
-  // copy attributes
-  XmlAttr * pAttr;
-  XmlAttr ** ppLastAttr = &pFirstAttr_;
-  XmlAttr * newAttr = NULL;
-  for (pAttr = elt.pFirstAttr_; pAttr; pAttr = pAttr->NextAttr()) {
-    newAttr = new XmlAttr(*pAttr);
-    *ppLastAttr = newAttr;
-    ppLastAttr = &(newAttr->pNextAttr_);
-  }
-  pLastAttr_ = newAttr;
-
-  // copy children
-  XmlChild * pChild;
-  XmlChild ** ppLast = &pFirstChild_;
-  XmlChild * newChild = NULL;
-
-  for (pChild = elt.pFirstChild_; pChild; pChild = pChild->NextChild()) {
-    if (pChild->IsText()) {
-      newChild = new XmlText(*(pChild->AsText()));
-    } else {
-      newChild = new XmlElement(*(pChild->AsElement()));
-    }
-    *ppLast = newChild;
-    ppLast = &(newChild->pNextChild_);
+    body_(),
+    shared_(NULL),
+    arena_(NULL),
+    lazy_(NULL),
+    lazy_len_(0) {
+  elt.ExpandChildren();
+  if (elt.shared_) {
+    AtomicOps::Increment(&elt.shared_->refs);
+    shared_ = elt.shared_;
+    return;
   }
-  pLastChild_ = newChild;
-
-  cdata_ = elt.cdata_;
+  CopyBody(elt.body_);
 }
 
+#if TXMPP_HAS_MOVE
+XmlElement::XmlElement(XmlElement && elt) noexcept :
+    XmlChild(),
+    name_(elt.name_),
+    body_(elt.body_),
+    shared_(elt.shared_),
+    arena_(elt.arena_),
+    lazy_(elt.lazy_),
+    lazy_len_(elt.lazy_len_) {
+  elt.body_ = Body();
+  elt.shared_ = NULL;
+  elt.lazy_ = NULL;
+  elt.lazy_len_ = 0;
+}
+
+XmlElement & XmlElement::operator=(XmlElement && elt) noexcept {
+  if (this == &elt)
+    return *this;
+  if (shared_)
+    Release(shared_);
+  else
+    DestroyBody(body_, arena_);
+  name_.Swap(&elt.name_);
+  body_ = elt.body_;
+  shared_ = elt.shared_;
+  arena_ = elt.arena_;
+  lazy_ = elt.lazy_;
+  lazy_len_ = elt.lazy_len_;
+  elt.body_ = Body();
+  elt.shared_ = NULL;
+  elt.lazy_ = NULL;
+  elt.lazy_len_ = 0;
+  return *this;
+}
+#endif
+
 XmlElement::XmlElement(const QName & name, bool useDefaultNs) :
   name_(name),
-  pFirstAttr_(useDefaultNs ? new XmlAttr(QN_XMLNS, name.Namespace()) : NULL),
-  pLastAttr_(pFirstAttr_),
-  pFirstChild_(NULL),
-  pLastChild_(NULL),
-  cdata_(false) {
+  body_(),
+  shared_(NULL),
+  arena_(NULL),
+  lazy_(NULL),
+  lazy_len_(0) {
+  if (useDefaultNs)
+    AppendAttr(QN_XMLNS, name.Namespace());
 }
 
 bool
@@ -153,10 +281,143 @@ XmlElement::AsTextImpl() const {
   return NULL;
 }
 
+XmlElement::Body &
+XmlElement::MutableBody() {
+  ExpandChildren();
+  if (!shared_)
+    return body_;
+  if (AtomicOps::AcquireLoad(&shared_->refs) > 1) {
+    SharedBody * shared = shared_;
+    shared_ = NULL;
+    CopyBody(shared->body);
+    Release(shared);
+    return body_;
+  }
+  return shared_->body;
+}
+
+// Copies |from| into body_, which is empty. The child elements are copied
+// with the copy constructor, so shared ones take O(1) each.
+void
+XmlElement::CopyBody(const Body & from) {
+  ReserveAttrs(from.attr_count);
+  for (size_t i = 0; i < from.attr_count; ++i) {
+    ::new (body_.attrs + i) XmlAttr(from.attrs[i]);
+    if (i > 0)
+      body_.attrs[i - 1].pNextAttr_ = body_.attrs + i;
+  }
+  body_.attr_count = from.attr_count;
+
+  XmlChild * pChild;
+  XmlChild ** ppLast = &body_.first_child;
+  XmlChild * newChild = NULL;
+
+  for (pChild = from.first_child; pChild; pChild = pChild->NextChild()) {
+    if (pChild->IsText()) {
+      newChild = new XmlText(*(pChild->AsText()));
+    } else {
+      newChild = new XmlElement(*(pChild->AsElement()));
+    }
+    *ppLast = newChild;
+    ppLast = &(newChild->pNextChild_);
+  }
+  body_.last_child = newChild;
+
+  body_.cdata = from.cdata;
+}
+
+void
+XmlElement::DestroyBody(Body & body, XmlArena * arena) {
+  for (size_t i = 0; i < body.attr_count; ++i)
+    body.attrs[i].~XmlAttr();
+  if (!arena)
+    ::operator delete(body.attrs);
+
+  XmlChild * pchild;
+  for (pchild = body.first_child; pchild; ) {
+    XmlChild * pToDelete = pchild;
+    pchild = pchild->pNextChild_;
+    delete pToDelete;
+  }
+}
+
+void
+XmlElement::Release(SharedBody * shared) {
+  if (AtomicOps::Decrement(&shared->refs) == 0) {
+    DestroyBody(shared->body, NULL);
+    delete shared;
+  }
+}
+
+void
+XmlElement::SetLazyChildren(const char * xml, size_t len) {
+  ExpandChildren();
+  lazy_ = xml;
+  lazy_len_ = len;
+}
+
+void
+XmlElement::ParseLazyChildren() const {
+  XmlElement * self = const_cast<XmlElement *>(this);
+  const char * xml = lazy_;
+  size_t len = lazy_len_;
+  lazy_ = NULL;
+
+  XmlBuilder builder(arena_);
+  XmlParser parser(&builder);
+  parser.Parse(xml, len, true);
+  XmlElement * root = builder.BuiltElement();
+  if (root == NULL || root->body().first_child == NULL)
+    return;
+
+  // Moves the root's children over, leaving it none to delete.
+  Body & b = self->MutableBody();
+  Body & from = root->MutableBody();
+  XmlChild ** pprev = b.last_child ? &(b.last_child->pNextChild_) :
+                                     &b.first_child;
+  if (b.last_child && b.last_child->IsText() && from.first_child->IsText()) {
+    b.last_child->AsText()->AddText(from.first_child->AsText()->Text());
+    XmlChild * merged = from.first_child;
+    from.first_child = merged->pNextChild_;
+    if (from.last_child == merged)
+      from.last_child = NULL;
+    delete merged;
+    if (from.first_child == NULL)
+      return;
+  }
+  *pprev = from.first_child;
+  b.last_child = from.last_child;
+  from.first_child = from.last_child = NULL;
+}
+
+void
+XmlElement::MakeShared() {
+  if (arena_)
+    return;
+  if (!shared_) {
+    AllocStats::Record(AllocStats::AS_XML_NODE, sizeof(SharedBody));
+    shared_ = new SharedBody;
+    shared_->refs = 1;
+    shared_->body = body_;
+    body_ = Body();
+  }
+  XmlChild * pChild;
+  for (pChild = shared_->body.first_child; pChild;
+       pChild = pChild->pNextChild_) {
+    if (!pChild->IsText())
+      pChild->AsElement()->MakeShared();
+    else
+      pChild->AsText()->Text();  // Joins up the text before it is shared.
+  }
+}
+
 const std::string &
 XmlElement::BodyText() const {
-  if (pFirstChild_ && pFirstChild_->IsText() && pLastChild_ == pFirstChild_) {
-    return pFirstChild_->AsText()->Text();
+  ExpandChildren();
+  const Body & b = body();
+  if (b.first_child && b.first_child->IsText() &&
+      b.last_child == b.first_child) {
+    return b.first_child->AsText()->Text();
   }
 
   return STR_EMPTY;
@@ -164,12 +425,14 @@ XmlElement::BodyText() const {
 
 void
 XmlElement::SetBodyText(const std::string & text) {
+  ExpandChildren();
+  const Body & b = body();
   if (text == STR_EMPTY) {
     ClearChildren();
-  } else if (pFirstChild_ == NULL) {
+  } else if (b.first_child == NULL) {
     AddText(text);
-  } else if (pFirstChild_->IsText() && pLastChild_ == pFirstChild_) {
-    pFirstChild_->AsText()->SetText(text);
+  } else if (b.first_child->IsText() && b.last_child == b.first_child) {
+    MutableBody().first_child->AsText()->SetText(text);
   } else {
     ClearChildren();
     AddText(text);
@@ -186,43 +449,92 @@ XmlElement::FirstElementName() const {
 
 XmlAttr *
 XmlElement::FirstAttr() {
-  return pFirstAttr_;
+  Body & b = MutableBody();
+  return b.attr_count ? b.attrs : NULL;
+}
+
+const XmlAttr *
+XmlElement::FirstAttr() const {
+  const Body & b = body();
+  return b.attr_count ? b.attrs : NULL;
+}
+
+void
+XmlElement::ReserveAttrs(size_t count) {
+  Body & b = MutableBody();
+  if (count <= b.attr_capacity)
+    return;
+
+  size_t capacity = b.attr_capacity ? b.attr_capacity * 2 : 4;
+  while (capacity < count)
+    capacity *= 2;
+  size_t cb = capacity * sizeof(XmlAttr);
+  AllocStats::Record(AllocStats::AS_XML_ATTR, cb);
+  XmlAttr * attrs = static_cast<XmlAttr *>(
+      arena_ ? arena_->Allocate(cb) : ::operator new(cb));
+
+  // Moves the values across by swapping, rather than copying them.
+  for (size_t i = 0; i < b.attr_count; ++i) {
+    ::new (attrs + i) XmlAttr(b.attrs[i].name_, STR_EMPTY);
+    attrs[i].value_.swap(b.attrs[i].value_);
+    if (i > 0)
+      attrs[i - 1].pNextAttr_ = attrs + i;
+    b.attrs[i].~XmlAttr();
+  }
+  if (!arena_)
+    ::operator delete(b.attrs);
+  b.attrs = attrs;
+  b.attr_capacity = capacity;
+}
+
+template <class QNameType>
+XmlAttr *
+XmlElement::FindAttr(const Body & body, const QNameType & name) {
+  for (size_t i = 0; i < body.attr_count; ++i) {
+    if (body.attrs[i].name_ == name)
+      return body.attrs + i;
+  }
+  return NULL;
+}
+
+XmlAttr *
+XmlElement::AppendAttr(const QName & name, const std::string & value) {
+  ReserveAttrs(MutableBody().attr_count + 1);
+  Body & b = MutableBody();
+  XmlAttr * pattr = ::new (b.attrs + b.attr_count) XmlAttr(name, value);
+  if (b.attr_count > 0)
+    b.attrs[b.attr_count - 1].pNextAttr_ = pattr;
+  ++b.attr_count;
+  return pattr;
 }
 
 const std::string &
 XmlElement::Attr(const QName & name) const {
-  XmlAttr * pattr;
-  for (pattr = pFirstAttr_; pattr; pattr = pattr->pNextAttr_) {
-    if (pattr->name_ == name)
-      return pattr->value_;
-  }
-  return STR_EMPTY;
+  XmlAttr * pattr = FindAttr(body(), name);
+  return pattr ? pattr->value_ : STR_EMPTY;
 }
 
 bool
 XmlElement::HasAttr(const QName & name) const {
-  XmlAttr * pattr;
-  for (pattr = pFirstAttr_; pattr; pattr = pattr->pNextAttr_) {
-    if (pattr->name_ == name)
-      return true;
-  }
-  return false;
+  return FindAttr(body(), name) != NULL;
+}
+
+const std::string &
+XmlElement::Attr(const QNameView & name) const {
+  XmlAttr * pattr = FindAttr(body(), name);
+  return pattr ? pattr->value_ : STR_EMPTY;
+}
+
+bool
+XmlElement::HasAttr(const QNameView & name) const {
+  return FindAttr(body(), name) != NULL;
 }
 
 void
 XmlElement::SetAttr(const QName & name, const std::string & value) {
-  XmlAttr * pattr;
-  for (pattr = pFirstAttr_; pattr; pattr = pattr->pNextAttr_) {
-    if (pattr->name_ == name)
-      break;
-  }
+  XmlAttr * pattr = FindAttr(MutableBody(), name);
   if (!pattr) {
-    pattr = new XmlAttr(name, value);
-    if (pLastAttr_)
-      pLastAttr_->pNextAttr_ = pattr;
-    else
-      pFirstAttr_ = pattr;
-    pLastAttr_ = pattr;
+    AppendAttr(name, value);
     return;
   }
   pattr->value_ = value;
@@ -230,87 +542,124 @@ XmlElement::SetAttr(const QName & name, const std::string & value) {
 
 void
 XmlElement::ClearAttr(const QName & name) {
-  XmlAttr * pattr;
-  XmlAttr *pLastAttr = NULL;
-  for (pattr = pFirstAttr_; pattr; pattr = pattr->pNextAttr_) {
-    if (pattr->name_ == name)
-      break;
-    pLastAttr = pattr;
-  }
-  if (!pattr)
+  if (!FindAttr(body(), name))
     return;
-  if (!pLastAttr)
-    pFirstAttr_ = pattr->pNextAttr_;
-  else
-    pLastAttr->pNextAttr_ = pattr->pNextAttr_;
-  if (pLastAttr_ == pattr)
-    pLastAttr_ = pLastAttr;
-  delete pattr;
-}
-
-XmlChild *
-XmlElement::FirstChild() {
-  return pFirstChild_;
+  Body & b = MutableBody();
+  XmlAttr * pattr = FindAttr(b, name);
+  // Shifts the later attributes down, keeping their order.
+  XmlAttr * plast = b.attrs + b.attr_count - 1;
+  for (; pattr < plast; ++pattr) {
+    pattr->name_ = pattr[1].name_;
+    pattr->value_.swap(pattr[1].value_);
+  }
+  plast->~XmlAttr();
+  if (--b.attr_count > 0)
+    b.attrs[b.attr_count - 1].pNextAttr_ = NULL;
 }
 
-XmlElement *
-XmlElement::FirstElement() {
-  XmlChild * pChild;
-  for (pChild = pFirstChild_; pChild; pChild = pChild->pNextChild_) {
+// The first element at or after |pChild| that matches, for the First and
+// Next lookups.
+static XmlElement *
+ElementFrom(XmlChild * pChild) {
+  for (; pChild; pChild = pChild->NextChild()) {
     if (!pChild->IsText())
       return pChild->AsElement();
   }
   return NULL;
 }
 
-XmlElement *
-XmlElement::NextElement() {
-  XmlChild * pChild;
-  for (pChild = pNextChild_; pChild; pChild = pChild->pNextChild_) {
-    if (!pChild->IsText())
+static XmlElement *
+WithNamespaceFrom(XmlChild * pChild, const std::string & ns) {
+  for (; pChild; pChild = pChild->NextChild()) {
+    if (!pChild->IsText() && pChild->AsElement()->Name().Namespace() == ns)
       return pChild->AsElement();
   }
   return NULL;
 }
 
-XmlElement *
-XmlElement::FirstWithNamespace(const std::string & ns) {
-  XmlChild * pChild;
-  for (pChild = pFirstChild_; pChild; pChild = pChild->pNextChild_) {
-    if (!pChild->IsText() && pChild->AsElement()->Name().Namespace() == ns)
+template <class QNameType>
+static XmlElement *
+NamedFrom(XmlChild * pChild, const QNameType & name) {
+  for (; pChild; pChild = pChild->NextChild()) {
+    if (!pChild->IsText() && pChild->AsElement()->Name() == name)
       return pChild->AsElement();
   }
   return NULL;
 }
 
+XmlChild *
+XmlElement::FirstChild() {
+  return MutableBody().first_child;
+}
+
+const XmlChild *
+XmlElement::FirstChild() const {
+  ExpandChildren();
+  return body().first_child;
+}
+
+XmlElement *
+XmlElement::FirstElement() {
+  return ElementFrom(MutableBody().first_child);
+}
+
+const XmlElement *
+XmlElement::FirstElement() const {
+  ExpandChildren();
+  return ElementFrom(body().first_child);
+}
+
+XmlElement *
+XmlElement::NextElement() {
+  return ElementFrom(pNextChild_);
+}
+
+XmlElement *
+XmlElement::FirstWithNamespace(const std::string & ns) {
+  return WithNamespaceFrom(MutableBody().first_child, ns);
+}
+
+const XmlElement *
+XmlElement::FirstWithNamespace(const std::string & ns) const {
+  ExpandChildren();
+  return WithNamespaceFrom(body().first_child, ns);
+}
+
 XmlElement *
 XmlElement::NextWithNamespace(const std::string & ns) {
-  XmlChild * pChild;
-  for (pChild = pNextChild_; pChild; pChild = pChild->pNextChild_) {
-    if (!pChild->IsText() && pChild->AsElement()->Name().Namespace() == ns)
-      return pChild->AsElement();
-  }
-  return NULL;
+  return WithNamespaceFrom(pNextChild_, ns);
 }
 
 XmlElement *
 XmlElement::FirstNamed(const QName & name) {
-  XmlChild * pChild;
-  for (pChild = pFirstChild_; pChild; pChild = pChild->pNextChild_) {
-    if (!pChild->IsText() && pChild->AsElement()->Name() == name)
-      return pChild->AsElement();
-  }
-  return NULL;
+  return NamedFrom(MutableBody().first_child, name);
+}
+
+const XmlElement *
+XmlElement::FirstNamed(const QName & name) const {
+  ExpandChildren();
+  return NamedFrom(body().first_child, name);
 }
 
 XmlElement *
 XmlElement::NextNamed(const QName & name) {
-  XmlChild * pChild;
-  for (pChild = pNextChild_; pChild; pChild = pChild->pNextChild_) {
-    if (!pChild->IsText() && pChild->AsElement()->Name() == name)
-      return pChild->AsElement();
-  }
-  return NULL;
+  return NamedFrom(pNextChild_, name);
+}
+
+XmlElement *
+XmlElement::FirstNamed(const QNameView & name) {
+  return NamedFrom(MutableBody().first_child, name);
+}
+
+const XmlElement *
+XmlElement::FirstNamed(const QNameView & name) const {
+  ExpandChildren();
+  return NamedFrom(body().first_child, name);
+}
+
+XmlElement *
+XmlElement::NextNamed(const QNameView & name) {
+  return NamedFrom(pNextChild_, name);
 }
 
 XmlElement* XmlElement::FindOrAddNamedChild(const QName& name) {
@@ -325,19 +674,22 @@ XmlElement* XmlElement::FindOrAddNamedChild(const QName& name) {
 
 const std::string &
 XmlElement::TextNamed(const QName & name) const {
-  XmlChild * pChild;
-  for (pChild = pFirstChild_; pChild; pChild = pChild->pNextChild_) {
-    if (!pChild->IsText() && pChild->AsElement()->Name() == name)
-      return pChild->AsElement()->BodyText();
-  }
-  return STR_EMPTY;
+  const XmlElement * element = FirstNamed(name);
+  return element ? element->BodyText() : STR_EMPTY;
+}
+
+const std::string &
+XmlElement::TextNamed(const QNameView & name) const {
+  const XmlElement * element = FirstNamed(name);
+  return element ? element->BodyText() : STR_EMPTY;
 }
 
 void
 XmlElement::InsertChildAfter(XmlChild * pPredecessor, XmlChild * pNext) {
+  Body & b = MutableBody();
   if (pPredecessor == NULL) {
-    pNext->pNextChild_ = pFirstChild_;
-    pFirstChild_ = pNext;
+    pNext->pNextChild_ = b.first_child;
+    b.first_child = pNext;
   }
   else {
     pNext->pNextChild_ = pPredecessor->pNextChild_;
@@ -347,19 +699,20 @@ XmlElement::InsertChildAfter(XmlChild * pPredecessor, XmlChild * pNext) {
 
 void
 XmlElement::RemoveChildAfter(XmlChild * pPredecessor) {
+  Body & b = MutableBody();
   XmlChild * pNext;
 
   if (pPredecessor == NULL) {
-    pNext = pFirstChild_;
-    pFirstChild_ = pNext->pNextChild_;
+    pNext = b.first_child;
+    b.first_child = pNext->pNextChild_;
   }
   else {
     pNext = pPredecessor->pNextChild_;
     pPredecessor->pNextChild_ = pNext->pNextChild_;
   }
 
-  if (pLastChild_ == pNext)
-    pLastChild_ = pPredecessor;
+  if (b.last_child == pNext)
+    b.last_child = pPredecessor;
 
   delete pNext;
 }
@@ -367,9 +720,7 @@ XmlElement::RemoveChildAfter(XmlChild * pPredecessor) {
 void
 XmlElement::AddAttr(const QName & name, const std::string & value) {
   ASSERT(!HasAttr(name));
-
-  XmlAttr ** pprev = pLastAttr_ ? &(pLastAttr_->pNextAttr_) : &pFirstAttr_;
-  pLastAttr_ = (*pprev = new XmlAttr(name, value));
+  AppendAttr(name, value);
 }
 
 void
@@ -377,7 +728,7 @@ XmlElement::AddAttr(const QName & name, const std::string & value,
                          int depth) {
   XmlElement * element = this;
   while (depth--) {
-    element = element->pLastChild_->AsElement();
+    element = element->MutableBody().last_child->AsElement();
   }
   element->AddAttr(name, value);
 }
@@ -387,17 +738,19 @@ XmlElement::AddParsedText(const char * cstr, int len) {
   if (len == 0)
     return;
 
-  if (pLastChild_ && pLastChild_->IsText()) {
-    pLastChild_->AsText()->AddParsedText(cstr, len);
+  Body & b = MutableBody();
+  if (b.last_child && b.last_child->IsText()) {
+    b.last_child->AsText()->AddParsedText(cstr, len);
     return;
   }
-  XmlChild ** pprev = pLastChild_ ? &(pLastChild_->pNextChild_) : &pFirstChild_;
-  pLastChild_ = *pprev = new XmlText(cstr, len);
+  XmlChild ** pprev = b.last_child ? &(b.last_child->pNextChild_) :
+                                     &b.first_child;
+  b.last_child = *pprev = new (arena_) XmlText(cstr, len);
 }
 
 void
 XmlElement::AddCDATAText(const char * buf, int len) {
-  cdata_ = true;
+  MutableBody().cdata = true;
   AddParsedText(buf, len);
 }
 
@@ -406,12 +759,14 @@ XmlElement::AddText(const std::string & text) {
   if (text == STR_EMPTY)
     return;
 
-  if (pLastChild_ && pLastChild_->IsText()) {
-    pLastChild_->AsText()->AddText(text);
+  Body & b = MutableBody();
+  if (b.last_child && b.last_child->IsText()) {
+    b.last_child->AsText()->AddText(text);
     return;
   }
-  XmlChild ** pprev = pLastChild_ ? &(pLastChild_->pNextChild_) : &pFirstChild_;
-  pLastChild_ = *pprev = new XmlText(text);
+  XmlChild ** pprev = b.last_child ? &(b.last_child->pNextChild_) :
+                                     &b.first_child;
+  b.last_child = *pprev = new (arena_) XmlText(text);
 }
 
 void
@@ -420,7 +775,7 @@ XmlElement::AddText(const std::string & text, int depth) {
   // XmlElement * pel(this);
   XmlElement * element = this;
   while (depth--) {
-    element = element->pLastChild_->AsElement();
+    element = element->MutableBody().last_child->AsElement();
   }
   element->AddText(text);
 }
@@ -430,8 +785,10 @@ XmlElement::AddElement(XmlElement *pelChild) {
   if (pelChild == NULL)
     return;
 
-  XmlChild ** pprev = pLastChild_ ? &(pLastChild_->pNextChild_) : &pFirstChild_;
-  pLastChild_ = *pprev = pelChild;
+  Body & b = MutableBody();
+  XmlChild ** pprev = b.last_child ? &(b.last_child->pNextChild_) :
+                                     &b.first_child;
+  b.last_child = *pprev = pelChild;
   pelChild->pNextChild_ = NULL;
 }
 
@@ -439,13 +796,15 @@ void
 XmlElement::AddElement(XmlElement *pelChild, int depth) {
   XmlElement * element = this;
   while (depth--) {
-    element = element->pLastChild_->AsElement();
+    element = element->MutableBody().last_child->AsElement();
   }
   element->AddElement(pelChild);
 }
 
 void
 XmlElement::ClearNamedChildren(const QName & name) {
+  if (!FirstNamed(name))
+    return;
   XmlChild * prev_child = NULL;
   XmlChild * next_child;
   XmlChild * child;
@@ -462,38 +821,131 @@ XmlElement::ClearNamedChildren(const QName & name) {
 
 void
 XmlElement::ClearAttributes() {
-  XmlAttr * pattr;
-  for (pattr = pFirstAttr_; pattr; ) {
-    XmlAttr * pToDelete = pattr;
-    pattr = pattr->pNextAttr_;
-    delete pToDelete;
-  }
-  pFirstAttr_ = pLastAttr_ = NULL;
+  if (body().attr_count == 0)
+    return;
+  Body & b = MutableBody();
+  for (size_t i = 0; i < b.attr_count; ++i)
+    b.attrs[i].~XmlAttr();
+  b.attr_count = 0;
 }
 
 void
 XmlElement::ClearChildren() {
+  lazy_ = NULL;
+  if (shared_ && AtomicOps::AcquireLoad(&shared_->refs) > 1) {
+    // Leaves the children to the other copies, without copying them first.
+    SharedBody * shared = shared_;
+    shared_ = NULL;
+    Body & from = shared->body;
+    ReserveAttrs(from.attr_count);
+    for (size_t i = 0; i < from.attr_count; ++i)
+      AppendAttr(from.attrs[i].name_, from.attrs[i].value_);
+    body_.cdata = from.cdata;
+    Release(shared);
+    return;
+  }
+  Body & b = MutableBody();
   XmlChild * pchild;
-  for (pchild = pFirstChild_; pchild; ) {
+  for (pchild = b.first_child; pchild; ) {
     XmlChild * pToDelete = pchild;
     pchild = pchild->pNextChild_;
     delete pToDelete;
   }
-  pFirstChild_ = pLastChild_ = NULL;
+  b.first_child = b.last_child = NULL;
 }
 
 std::string
 XmlElement::Str() const {
-  std::stringstream ss;
-  Print(&ss, NULL, 0);
-  return ss.str();
+  std::string result;
+  XmlPrinter::PrintXml(&result, this, NULL, 0);
+  return result;
 }
 
-XmlElement *
-XmlElement::ForStr(const std::string & str) {
+namespace {
+
+// The parser and builder a thread keeps for ForStr, and whether a ForStr
+// is using them, which a parse handler calling ForStr again would find.
+struct StrParser {
+  StrParser() : parser(&builder), busy(false) {}
   XmlBuilder builder;
-  XmlParser::ParseXml(&builder, str);
-  return builder.CreateElement();
+  XmlParser parser;
+  bool busy;
+};
+
+class StrParserKey {
+ public:
+  StrParserKey() {
+#ifdef POSIX
+    pthread_key_create(&key_, &StrParserKey::OnThreadExit);
+#elif WIN32
+    key_ = TlsAlloc();
+#endif
+  }
+
+  // The calling thread's parser, made on first use.
+  StrParser * Get() {
+#ifdef POSIX
+    StrParser * str_parser =
+        static_cast<StrParser *>(pthread_getspecific(key_));
+#elif WIN32
+    StrParser * str_parser = static_cast<StrParser *>(TlsGetValue(key_));
+#endif
+    if (str_parser)
+      return str_parser;
+    str_parser = new StrParser;
+#ifdef POSIX
+    pthread_setspecific(key_, str_parser);
+#elif WIN32
+    // There is no hook for a thread's exit here, so the parser of a thread
+    // that ends stays allocated.
+    TlsSetValue(key_, str_parser);
+#endif
+    return str_parser;
+  }
+
+ private:
+#ifdef POSIX
+  static void OnThreadExit(void * str_parser) {
+    delete static_cast<StrParser *>(str_parser);
+  }
+  pthread_key_t key_;
+#elif WIN32
+  DWORD key_;
+#endif
+};
+
+// Made by static construction, like ThreadManager's key.
+StrParserKey g_str_parser_key;
+
+// Longer strings get a parser of their own, so that the one kept doesn't
+// hold on to the buffers they grew, as the offloaded large stanzas would.
+const size_t kPooledParseLimit = 16 * 1024;
+
+}  // namespace
+
+XmlElement *
+XmlElement::ForStr(const std::string & str, bool strip_whitespace,
+                   XmlArena * arena) {
+  StrParser * str_parser = NULL;
+  if (str.length() <= kPooledParseLimit)
+    str_parser = g_str_parser_key.Get();
+  if (!str_parser || str_parser->busy) {
+    XmlBuilder builder(arena);
+    builder.SetStripWhitespace(strip_whitespace);
+    XmlParser::ParseXml(&builder, str);
+    return arena ? builder.ReleaseElement(NULL) : builder.CreateElement();
+  }
+
+  str_parser->busy = true;
+  XmlBuilder & builder = str_parser->builder;
+  builder.SetStripWhitespace(strip_whitespace);
+  builder.SetArena(arena);
+  str_parser->parser.Parse(str.data(), str.length(), true);
+  // ReleaseElement resets the builder, and leaves it building on the heap.
+  XmlElement * element = builder.ReleaseElement(NULL);
+  str_parser->parser.Reset();
+  str_parser->busy = false;
+  return element;
 }
 
 void
@@ -503,19 +955,10 @@ XmlElement::Print(
 }
 
 XmlElement::~XmlElement() {
-  XmlAttr * pattr;
-  for (pattr = pFirstAttr_; pattr; ) {
-    XmlAttr * pToDelete = pattr;
-    pattr = pattr->pNextAttr_;
-    delete pToDelete;
-  }
-
-  XmlChild * pchild;
-  for (pchild = pFirstChild_; pchild; ) {
-    XmlChild * pToDelete = pchild;
-    pchild = pchild->pNextChild_;
-    delete pToDelete;
-  }
+  if (shared_)
+    Release(shared_);
+  else
+    DestroyBody(body_, arena_);
 }
 
 }  // namespace txmpp
@@ -36,6 +36,7 @@
 #include <string>
 #include "scoped_ptr.h"
 #include "qname.h"
+#include "xmlarena.h"
 
 namespace txmpp {
 
@@ -48,7 +49,7 @@ class XmlText;
 class XmlElement;
 class XmlAttr;
 
-class XmlChild {
+class XmlChild : public XmlArenaAllocated {
 friend class XmlElement;
 
 public:
@@ -89,30 +90,69 @@ class XmlText : public XmlChild {
 public:
   explicit XmlText(const std::string & text) :
     XmlChild(),
-    text_(text) {
-  }
-  explicit XmlText(const XmlText & t) :
-    XmlChild(),
-    text_(t.text_) {
+    text_(text),
+    first_chunk_(NULL),
+    last_chunk_(NULL) {
   }
+  explicit XmlText(const XmlText & t);
   explicit XmlText(const char * cstr, size_t len) :
     XmlChild(),
-    text_(cstr, len) {
+    text_(cstr, len),
+    first_chunk_(NULL),
+    last_chunk_(NULL) {
   }
   virtual ~XmlText();
 
-  const std::string & Text() const { return text_; }
+  // Joins up the chunks the text was parsed into, if there are any.
+  const std::string & Text() const;
+  // The length of the text, without joining it up.
+  size_t Size() const;
   void SetText(const std::string & text);
+  // Once parsed text gets long, the rest of it is kept in chunks rather
+  // than appended, so that large bodies aren't copied over and over as
+  // they grow.
   void AddParsedText(const char * buf, int len);
   void AddText(const std::string & text);
 
+  // Walks the text in the pieces it is kept in, for consumers that can
+  // take it a piece at a time without having it joined up.
+  class ChunkIterator {
+  public:
+    explicit ChunkIterator(const XmlText * text);
+    bool Done() const { return data_ == NULL; }
+    const char * Data() const { return data_; }
+    size_t Size() const { return size_; }
+    void Next();
+
+  private:
+    const void * next_;
+    const char * data_;
+    size_t size_;
+  };
+
 protected:
   virtual bool IsTextImpl() const;
   virtual XmlElement * AsElementImpl() const;
   virtual XmlText * AsTextImpl() const;
 
 private:
-  std::string text_;
+  friend class ChunkIterator;
+
+  struct Chunk {
+    Chunk * next;
+    size_t size;
+    size_t capacity;
+    char * Data() { return reinterpret_cast<char *>(this + 1); }
+  };
+
+  void Flatten() const;
+  static void FreeChunks(Chunk * chunk);
+
+  // The text is text_ followed by the chunks, if there are any; Text()
+  // moves them onto text_.
+  mutable std::string text_;
+  mutable Chunk * first_chunk_;
+  mutable Chunk * last_chunk_;
 };
 
 class XmlAttr {
@@ -140,11 +180,28 @@ private:
   std::string value_;
 };
 
+// XmlElement, XmlText and XmlAttr objects may be placed in an XmlArena
+// (see XmlBuilder). An element created with an arena also puts the text and
+// attributes it adds there, so such a tree is only valid until the arena is
+// reset. Copying an element, as in new XmlElement(*elt), always makes a heap
+// copy, and is how such a tree is detached from its arena for keeping.
+//
+// A heap tree that is sent or kept many times over can be made shared with
+// MakeShared. A copy of a shared element then takes O(1): it points to the
+// same refcounted attributes and children, and only takes a copy of them,
+// one level at a time, when it is first modified.
 class XmlElement : public XmlChild {
 public:
   explicit XmlElement(const QName & name);
   explicit XmlElement(const QName & name, bool useDefaultNs);
+  XmlElement(const QName & name, XmlArena * arena);
   explicit XmlElement(const XmlElement & elt);
+#if TXMPP_HAS_MOVE
+  // Takes the name, attributes and children of |elt| without copying them,
+  // leaving |elt| empty. The body stays in |elt|'s arena, if it had one.
+  XmlElement(XmlElement && elt) noexcept;
+  XmlElement & operator=(XmlElement && elt) noexcept;
+#endif
 
   virtual ~XmlElement();
 
@@ -157,49 +214,60 @@ public:
   const QName & FirstElementName() const;
 
   XmlAttr * FirstAttr();
-  const XmlAttr * FirstAttr() const
-    { return const_cast<XmlElement *>(this)->FirstAttr(); }
+  const XmlAttr * FirstAttr() const;
+
+  // Makes room for |count| attributes in all, for callers that know how
+  // many they are about to add.
+  void ReserveAttrs(size_t count);
 
   //! Attr will return STR_EMPTY if the attribute isn't there:
   //! use HasAttr to test presence of an attribute. 
   const std::string & Attr(const QName & name) const;
   bool HasAttr(const QName & name) const;
+  // The same, comparing the parts of |name| without making a QName.
+  const std::string & Attr(const QNameView & name) const;
+  bool HasAttr(const QNameView & name) const;
   void SetAttr(const QName & name, const std::string & value);
   void ClearAttr(const QName & name);
 
   XmlChild * FirstChild();
-  const XmlChild * FirstChild() const
-    { return const_cast<XmlElement *>(this)->FirstChild(); }
+  const XmlChild * FirstChild() const;
 
   XmlElement * FirstElement();
-  const XmlElement * FirstElement() const
-    { return const_cast<XmlElement *>(this)->FirstElement(); }
+  const XmlElement * FirstElement() const;
 
   XmlElement * NextElement();
   const XmlElement * NextElement() const
     { return const_cast<XmlElement *>(this)->NextElement(); }
 
   XmlElement * FirstWithNamespace(const std::string & ns);
-  const XmlElement * FirstWithNamespace(const std::string & ns) const
-    { return const_cast<XmlElement *>(this)->FirstWithNamespace(ns); }
+  const XmlElement * FirstWithNamespace(const std::string & ns) const;
 
   XmlElement * NextWithNamespace(const std::string & ns);
   const XmlElement * NextWithNamespace(const std::string & ns) const
     { return const_cast<XmlElement *>(this)->NextWithNamespace(ns); }
 
   XmlElement * FirstNamed(const QName & name);
-  const XmlElement * FirstNamed(const QName & name) const
-    { return const_cast<XmlElement *>(this)->FirstNamed(name); }
+  const XmlElement * FirstNamed(const QName & name) const;
 
   XmlElement * NextNamed(const QName & name);
   const XmlElement * NextNamed(const QName & name) const
     { return const_cast<XmlElement *>(this)->NextNamed(name); }
 
+  // The same, comparing the parts of |name| without making a QName.
+  XmlElement * FirstNamed(const QNameView & name);
+  const XmlElement * FirstNamed(const QNameView & name) const;
+
+  XmlElement * NextNamed(const QNameView & name);
+  const XmlElement * NextNamed(const QNameView & name) const
+    { return const_cast<XmlElement *>(this)->NextNamed(name); }
+
   // Finds the first element named 'name'.  If that element can't be found then
   // adds one and returns it.
   XmlElement* FindOrAddNamedChild(const QName& name);
 
   const std::string & TextNamed(const QName & name) const;
+  const std::string & TextNamed(const QNameView & name) const;
 
   void InsertChildAfter(XmlChild * pPredecessor, XmlChild * pNewChild);
   void RemoveChildAfter(XmlChild * pPredecessor);
@@ -218,12 +286,39 @@ public:
   void ClearAttributes();
   void ClearChildren();
 
-  static XmlElement * ForStr(const std::string & str);
+  // Parses |str|, or returns NULL if it is not well formed. With
+  // |strip_whitespace|, as XmlBuilder::SetStripWhitespace. The tree is
+  // built in |arena| if it is given, which then has to outlive it, and is
+  // deleted after it, as a stanza taken with XmppStanzaParser::TakeStanza.
+  // Each thread keeps a parser for these, reset between uses, so a short
+  // string costs no more than its tree.
+  static XmlElement * ForStr(const std::string & str,
+                             bool strip_whitespace = false,
+                             XmlArena * arena = NULL);
   std::string Str() const;
 
   void Print(std::ostream * pout, std::string xmlns[], int xmlnsCount) const;
 
-  bool IsCDATA() const { return cdata_; }
+  bool IsCDATA() const { return body().cdata; }
+
+  // Defers the rest of this element's children to |xml|, the text of a
+  // document whose root's children follow those already added. They are
+  // parsed into the element's arena the first time its children are looked
+  // at or modified, so |xml| must live as long as the arena.
+  void SetLazyChildren(const char * xml, size_t len);
+  bool HasLazyChildren() const { return lazy_ != NULL; }
+
+  // Makes this element and everything under it shared, so that copying any
+  // of them no longer copies what is under it. The non-const accessors of a
+  // copy that is still shared take its own copy first, so that children got
+  // from them can be modified; but a child pointer got before the call must
+  // not be used to modify the child afterwards, as it is now shared too.
+  // Does nothing for an element in an arena.
+  void MakeShared();
+  bool IsShared() const { return shared_ != NULL; }
+
+  // The arena this element's text and attributes are created in, or NULL.
+  XmlArena * arena() const { return arena_; }
 
 protected:
   virtual bool IsTextImpl() const;
@@ -231,12 +326,46 @@ protected:
   virtual XmlText * AsTextImpl() const;
 
 private:
+  // The attributes are kept in order in one array, allocated in the arena
+  // if there is one, and linked to each other for FirstAttr and NextAttr.
+  // Looking one up is a scan that, for interned names, only compares
+  // pointers.
+  struct Body {
+    Body() : attrs(NULL), attr_count(0), attr_capacity(0),
+             first_child(NULL), last_child(NULL), cdata(false) {}
+    XmlAttr * attrs;
+    size_t attr_count;
+    size_t attr_capacity;
+    XmlChild * first_child;
+    XmlChild * last_child;
+    bool cdata;
+  };
+
+  // The body of a shared element, and the number of elements using it.
+  struct SharedBody {
+    volatile int refs;
+    Body body;
+  };
+
+  const Body & body() const { return shared_ ? shared_->body : body_; }
+  // Takes a copy of the body first if other elements are using it.
+  Body & MutableBody();
+  // Parses the lazy children, if any, before the children are used.
+  void ExpandChildren() const { if (lazy_) ParseLazyChildren(); }
+  void ParseLazyChildren() const;
+  void CopyBody(const Body & from);
+  static void DestroyBody(Body & body, XmlArena * arena);
+  static void Release(SharedBody * shared);
+  template <class QNameType>
+  static XmlAttr * FindAttr(const Body & body, const QNameType & name);
+  XmlAttr * AppendAttr(const QName & name, const std::string & value);
+
   QName name_;
-  XmlAttr * pFirstAttr_;
-  XmlAttr * pLastAttr_;
-  XmlChild * pFirstChild_;
-  XmlChild * pLastChild_;
-  bool cdata_;
+  Body body_;
+  SharedBody * shared_;
+  XmlArena * arena_;
+  mutable const char * lazy_;
+  mutable size_t lazy_len_;
 };
 
 }  // namespace txmpp
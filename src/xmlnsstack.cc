@@ -27,6 +27,8 @@
 
 #include "xmlnsstack.h"
 
+#include <string.h>
+
 #include <string>
 #include <iostream>
 #include <vector>
@@ -37,12 +39,26 @@
 namespace txmpp {
 
 XmlnsStack::XmlnsStack() :
-  pxmlnsStack_(new std::vector<std::string>),
-  pxmlnsDepthStack_(new std::vector<size_t>) {
+  pxmlnsStack_(new std::vector<Entry>),
+  pxmlnsDepthStack_(new std::vector<size_t>),
+  cache_atom_(NULL),
+  cache_is_attr_(false),
+  cache_prefix_(NULL) {
 }
 
 XmlnsStack::~XmlnsStack() {}
 
+static uint32
+XmlnsStack_HashPrefix(const char * prefix, size_t len) {
+  // FNV-1a
+  uint32 result = 2166136261U;
+  for (size_t i = 0; i < len; ++i) {
+    result ^= static_cast<unsigned char>(prefix[i]);
+    result *= 16777619U;
+  }
+  return result;
+}
+
 void
 XmlnsStack::PushFrame() {
   pxmlnsDepthStack_->push_back(pxmlnsStack_->size());
@@ -55,34 +71,60 @@ XmlnsStack::PopFrame() {
   if (prev_size < pxmlnsStack_->size()) {
     pxmlnsStack_->erase(pxmlnsStack_->begin() + prev_size,
                         pxmlnsStack_->end());
+    cache_atom_ = NULL;
   }
 }
 const std::pair<std::string, bool> NS_NOT_FOUND(STR_EMPTY, false);
 const std::pair<std::string, bool> EMPTY_NS_FOUND(STR_EMPTY, true);
 const std::pair<std::string, bool> XMLNS_DEFINITION_FOUND(NS_XMLNS, true);
 
+const XmlnsStack::Entry *
+XmlnsStack::FindPrefix(const char * prefix, size_t len,
+                       uint32 prefix_hash) const {
+  std::vector<Entry>::const_iterator pos;
+  for (pos = pxmlnsStack_->end(); pos > pxmlnsStack_->begin(); ) {
+    --pos;
+    if (pos->prefix_hash == prefix_hash && pos->prefix.size() == len &&
+        pos->prefix.compare(0, len, prefix, len) == 0)
+      return &(*pos);
+  }
+  return NULL;
+}
+
 const std::string *
 XmlnsStack::NsForPrefix(const std::string & prefix) {
-  if (prefix.length() >= 3 &&
+  uint32 ns_hash;
+  return NsForPrefix(prefix.data(), prefix.size(), &ns_hash);
+}
+
+const std::string *
+XmlnsStack::NsForPrefix(const char * prefix, size_t len, uint32 * ns_hash) {
+  if (len >= 3 &&
       (prefix[0] == 'x' || prefix[0] == 'X') &&
       (prefix[1] == 'm' || prefix[1] == 'M') &&
       (prefix[2] == 'l' || prefix[2] == 'L')) {
-    if (prefix == "xml")
+    if (len == 3 && strncmp(prefix, "xml", 3) == 0) {
+      *ns_hash = QName::HashNamespace(NS_XML);
       return &(NS_XML);
-    if (prefix == "xmlns")
+    }
+    if (len == 5 && strncmp(prefix, "xmlns", 5) == 0) {
+      *ns_hash = QName::HashNamespace(NS_XMLNS);
       return &(NS_XMLNS);
+    }
     return NULL;
   }
 
-  std::vector<std::string>::iterator pos;
-  for (pos = pxmlnsStack_->end(); pos > pxmlnsStack_->begin(); ) {
-    pos -= 2;
-    if (*pos == prefix)
-      return &(*(pos + 1));
+  const Entry * entry = FindPrefix(prefix, len,
+                                   XmlnsStack_HashPrefix(prefix, len));
+  if (entry) {
+    *ns_hash = entry->ns_hash;
+    return &entry->ns;
   }
 
-  if (prefix == STR_EMPTY)
+  if (len == 0) {
+    *ns_hash = QName::HashNamespace(STR_EMPTY);
     return &(STR_EMPTY); // default namespace
+  }
 
   return NULL; // none found
 }
@@ -95,45 +137,94 @@ XmlnsStack::PrefixMatchesNs(const std::string & prefix, const std::string & ns)
   return (*match == ns);
 }
 
-std::pair<std::string, bool>
-XmlnsStack::PrefixForNs(const std::string & ns, bool isattr) {
-  if (ns == NS_XML)
-    return std::make_pair(std::string("xml"), true);
-  if (ns == NS_XMLNS)
-    return std::make_pair(std::string("xmlns"), true);
-  if (isattr ? ns == STR_EMPTY : PrefixMatchesNs(STR_EMPTY, ns))
-    return std::make_pair(STR_EMPTY, true);
-
-  std::vector<std::string>::iterator pos;
-  for (pos = pxmlnsStack_->end(); pos > pxmlnsStack_->begin(); ) {
-    pos -= 2;
-    if (*(pos + 1) == ns &&
-        (!isattr || !pos->empty()) && PrefixMatchesNs(*pos, ns))
-      return std::make_pair(*pos, true);
+// True if a later declaration of the same prefix hides the one at |index|.
+bool
+XmlnsStack::IsShadowed(size_t index) const {
+  const Entry & entry = (*pxmlnsStack_)[index];
+  for (size_t i = index + 1; i < pxmlnsStack_->size(); ++i) {
+    const Entry & later = (*pxmlnsStack_)[i];
+    if (later.prefix_hash == entry.prefix_hash && later.prefix == entry.prefix)
+      return true;
+  }
+  return false;
+}
+
+const std::string *
+XmlnsStack::FindPrefixForNs(const std::string & ns, const QName::Data * atom,
+                            bool isattr) {
+  if (atom && atom == cache_atom_ && isattr == cache_is_attr_)
+    return cache_prefix_;
+
+  const std::string * result = NULL;
+  if (ns == NS_XML) {
+    result = &STR_XML;
+  } else if (ns == NS_XMLNS) {
+    result = &STR_XMLNS;
+  } else if (isattr ? ns == STR_EMPTY : PrefixMatchesNs(STR_EMPTY, ns)) {
+    result = &STR_EMPTY;
+  } else {
+    for (size_t i = pxmlnsStack_->size(); i > 0; ) {
+      const Entry & entry = (*pxmlnsStack_)[--i];
+      bool matches = (atom && entry.ns_atom) ? atom == entry.ns_atom
+                                             : entry.ns == ns;
+      if (matches && (!isattr || !entry.prefix.empty()) && !IsShadowed(i)) {
+        result = &entry.prefix;
+        break;
+      }
+    }
   }
 
-  return std::make_pair(STR_EMPTY, false); // none found
+  if (atom) {
+    cache_atom_ = atom;
+    cache_is_attr_ = isattr;
+    cache_prefix_ = result;
+  }
+  return result;
+}
+
+std::pair<std::string, bool>
+XmlnsStack::PrefixForNs(const std::string & ns, bool isattr) {
+  const std::string * prefix = FindPrefixForNs(ns, NULL, isattr);
+  if (prefix == NULL)
+    return std::make_pair(STR_EMPTY, false);
+  return std::make_pair(*prefix, true);
 }
 
 std::string
 XmlnsStack::FormatQName(const QName & name, bool isAttr) {
-  std::string prefix(PrefixForNs(name.Namespace(), isAttr).first);
-  if (prefix == STR_EMPTY)
-    return name.LocalPart();
-  else
-    return prefix + ':' + name.LocalPart();
+  std::string result;
+  AppendQName(name, isAttr, &result);
+  return result;
+}
+
+void
+XmlnsStack::AppendQName(const QName & name, bool isAttr, std::string * out) {
+  const std::string * prefix =
+      FindPrefixForNs(name.Namespace(), name.NamespaceAtom(), isAttr);
+  if (prefix != NULL && !prefix->empty()) {
+    out->append(*prefix);
+    out->push_back(':');
+  }
+  out->append(name.LocalPart());
 }
 
 void
 XmlnsStack::AddXmlns(const std::string & prefix, const std::string & ns) {
-  pxmlnsStack_->push_back(prefix);
-  pxmlnsStack_->push_back(ns);
+  Entry entry;
+  pxmlnsStack_->push_back(entry);
+  Entry & added = pxmlnsStack_->back();
+  added.prefix = prefix;
+  added.prefix_hash = XmlnsStack_HashPrefix(prefix.data(), prefix.size());
+  added.ns = ns;
+  added.ns_hash = QName::HashNamespace(ns);
+  added.ns_atom = QName::FindNamespaceAtom(ns, added.ns_hash);
+  cache_atom_ = NULL;
 }
 
 void
 XmlnsStack::RemoveXmlns() {
   pxmlnsStack_->pop_back();
-  pxmlnsStack_->pop_back();
+  cache_atom_ = NULL;
 }
 
 static bool IsAsciiLetter(char ch) {
@@ -179,9 +270,16 @@ static std::string SuggestPrefix(const std::string & ns) {
 }
 
 
+std::pair<std::string, bool>
+XmlnsStack::AddNewPrefix(const QName & name, bool isAttr) {
+  if (FindPrefixForNs(name.Namespace(), name.NamespaceAtom(), isAttr) != NULL)
+    return std::make_pair(STR_EMPTY, false);
+  return AddNewPrefix(name.Namespace(), isAttr);
+}
+
 std::pair<std::string, bool>
 XmlnsStack::AddNewPrefix(const std::string & ns, bool isAttr) {
-  if (PrefixForNs(ns, isAttr).second)
+  if (FindPrefixForNs(ns, NULL, isAttr) != NULL)
     return std::make_pair(STR_EMPTY, false);
 
   std::string base(SuggestPrefix(ns));
@@ -200,6 +298,7 @@ XmlnsStack::AddNewPrefix(const std::string & ns, bool isAttr) {
 void XmlnsStack::Reset() {
   pxmlnsStack_->clear();
   pxmlnsDepthStack_->clear();
+  cache_atom_ = NULL;
 }
 
 }  // namespace txmpp
@@ -51,15 +51,46 @@ public:
   void Reset();
 
   const std::string * NsForPrefix(const std::string & prefix);
+  // Like NsForPrefix, also setting |ns_hash| to QName::HashNamespace of the
+  // namespace found, for building QNames in it.
+  const std::string * NsForPrefix(const char * prefix, size_t len,
+                                  uint32 * ns_hash);
   bool PrefixMatchesNs(const std::string & prefix, const std::string & ns);
   std::pair<std::string, bool> PrefixForNs(const std::string & ns, bool isAttr);
   std::pair<std::string, bool> AddNewPrefix(const std::string & ns, bool isAttr);
+  // Like AddNewPrefix for the namespace of |name|.
+  std::pair<std::string, bool> AddNewPrefix(const QName & name, bool isAttr);
   std::string FormatQName(const QName & name, bool isAttr);
+  // Like FormatQName, but appends to |out| without building temporaries.
+  void AppendQName(const QName & name, bool isAttr, std::string * out);
 
 private:
+  // A declaration. Prefixes are compared by hash first, and namespaces by
+  // atom where both sides have one.
+  struct Entry {
+    std::string prefix;
+    uint32 prefix_hash;
+    std::string ns;
+    uint32 ns_hash;
+    const QName::Data * ns_atom;
+  };
 
-  scoped_ptr<std::vector<std::string> > pxmlnsStack_;
+  // The prefix PrefixForNs would return, or NULL if there is none. |atom|
+  // is the atom of |ns|, or NULL.
+  const std::string * FindPrefixForNs(const std::string & ns,
+                                      const QName::Data * atom, bool isAttr);
+  const Entry * FindPrefix(const char * prefix, size_t len,
+                           uint32 prefix_hash) const;
+  bool IsShadowed(size_t index) const;
+
+  scoped_ptr<std::vector<Entry> > pxmlnsStack_;
   scoped_ptr<std::vector<size_t> > pxmlnsDepthStack_;
+  // The last prefix found for a namespace atom, as the printer looks up the
+  // same namespace for the start tag, the end tag and often the children.
+  // Cleared whenever a declaration is added or removed.
+  const QName::Data * cache_atom_;
+  bool cache_is_attr_;
+  const std::string * cache_prefix_;
 };
 
 }  // namespace txmpp
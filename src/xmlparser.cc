@@ -39,7 +39,7 @@
 
 namespace txmpp {
 
-
+#if !XMLPARSER_BUILTIN
 static void
 StartElementCallback(void * userData, const char *name, const char **atts) {
   (static_cast<XmlParser *>(userData))->ExpatStartElement(name, atts);
@@ -60,25 +60,43 @@ XmlDeclCallback(void * userData, const char * ver, const char * enc, int st) {
   (static_cast<XmlParser *>(userData))->ExpatXmlDecl(ver, enc, st);
 }
 
+#endif
+
 XmlParser::XmlParser(XmlParseHandler *pxph) :
-    context_(this), pxph_(pxph), sentError_(false) {
+    context_(this),
+#if XMLPARSER_BUILTIN
+    tokenizer_(this),
+#endif
+    pxph_(pxph), sentError_(false) {
+#if !XMLPARSER_BUILTIN
   expat_ = XML_ParserCreate(NULL);
+#endif
+  InstallHandlers();
+}
+
+void
+XmlParser::InstallHandlers() {
+#if !XMLPARSER_BUILTIN
   XML_SetUserData(expat_, this);
   XML_SetElementHandler(expat_, StartElementCallback, EndElementCallback);
   XML_SetCharacterDataHandler(expat_, CharacterDataCallback);
   XML_SetXmlDeclHandler(expat_, XmlDeclCallback);
+#endif
 }
 
 void
 XmlParser::Reset() {
+#if XMLPARSER_BUILTIN
+  tokenizer_.Reset();
+#else
+  // XML_ParserReset keeps the parser's buffers and frees nothing we would
+  // only allocate again, but it clears the handlers.
   if (!XML_ParserReset(expat_, NULL)) {
     XML_ParserFree(expat_);
     expat_ = XML_ParserCreate(NULL);
   }
-  XML_SetUserData(expat_, this);
-  XML_SetElementHandler(expat_, StartElementCallback, EndElementCallback);
-  XML_SetCharacterDataHandler(expat_, CharacterDataCallback);
-  XML_SetXmlDeclHandler(expat_, XmlDeclCallback);
+  InstallHandlers();
+#endif
   context_.Reset();
   sentError_ = false;
 }
@@ -113,9 +131,7 @@ XmlParser::ExpatStartElement(const char *name, const char **atts) {
       }
     }
   }
-  context_.SetPosition(XML_GetCurrentLineNumber(expat_),
-                       XML_GetCurrentColumnNumber(expat_),
-                       XML_GetCurrentByteIndex(expat_));
+  UpdatePosition();
   pxph_->StartElement(&context_, name, atts);
 }
 
@@ -124,9 +140,7 @@ XmlParser::ExpatEndElement(const char *name) {
   if (context_.RaisedError() != XML_ERROR_NONE)
     return;
   context_.EndElement();
-  context_.SetPosition(XML_GetCurrentLineNumber(expat_),
-                       XML_GetCurrentColumnNumber(expat_),
-                       XML_GetCurrentByteIndex(expat_));
+  UpdatePosition();
   pxph_->EndElement(&context_, name);
 }
 
@@ -134,9 +148,7 @@ void
 XmlParser::ExpatCharacterData(const char *text, int len) {
   if (context_.RaisedError() != XML_ERROR_NONE)
     return;
-  context_.SetPosition(XML_GetCurrentLineNumber(expat_),
-                       XML_GetCurrentColumnNumber(expat_),
-                       XML_GetCurrentByteIndex(expat_));
+  UpdatePosition();
   pxph_->CharacterData(&context_, text, len);
 }
 
@@ -170,12 +182,61 @@ XmlParser::Parse(const char *data, size_t len, bool isFinal) {
   if (sentError_)
     return false;
 
-  if (XML_Parse(expat_, data, static_cast<int>(len), isFinal) !=
-      XML_STATUS_OK) {
-    context_.SetPosition(XML_GetCurrentLineNumber(expat_),
-                         XML_GetCurrentColumnNumber(expat_),
-                         XML_GetCurrentByteIndex(expat_));
+#if XMLPARSER_BUILTIN
+  return HandleStatus(tokenizer_.Parse(data, len, isFinal));
+#else
+  return HandleStatus(XML_Parse(expat_, data, static_cast<int>(len), isFinal));
+#endif
+}
+
+char *
+XmlParser::GetBuffer(size_t len) {
+  if (sentError_)
+    return NULL;
+
+#if XMLPARSER_BUILTIN
+  return tokenizer_.GetBuffer(len);
+#else
+  return static_cast<char *>(XML_GetBuffer(expat_, static_cast<int>(len)));
+#endif
+}
+
+bool
+XmlParser::ParseBuffer(size_t len, bool isFinal) {
+  if (sentError_)
+    return false;
+
+#if XMLPARSER_BUILTIN
+  return HandleStatus(tokenizer_.ParseBuffer(len, isFinal));
+#else
+  return HandleStatus(XML_ParseBuffer(expat_, static_cast<int>(len), isFinal));
+#endif
+}
+
+void
+XmlParser::UpdatePosition() {
+#if XMLPARSER_BUILTIN
+  context_.SetPosition(tokenizer_.CurrentLineNumber(),
+                       tokenizer_.CurrentColumnNumber(),
+                       tokenizer_.CurrentByteIndex(),
+                       tokenizer_.CurrentByteCount());
+#else
+  context_.SetPosition(XML_GetCurrentLineNumber(expat_),
+                       XML_GetCurrentColumnNumber(expat_),
+                       XML_GetCurrentByteIndex(expat_),
+                       XML_GetCurrentByteCount(expat_));
+#endif
+}
+
+bool
+XmlParser::HandleStatus(XML_Status status) {
+  if (status != XML_STATUS_OK) {
+    UpdatePosition();
+#if XMLPARSER_BUILTIN
+    context_.RaiseError(tokenizer_.ErrorCode());
+#else
     context_.RaiseError(XML_GetErrorCode(expat_));
+#endif
   }
 
   if (context_.RaisedError() != XML_ERROR_NONE) {
@@ -188,7 +249,15 @@ XmlParser::Parse(const char *data, size_t len, bool isFinal) {
 }
 
 XmlParser::~XmlParser() {
+#if !XMLPARSER_BUILTIN
   XML_ParserFree(expat_);
+#endif
+}
+
+void
+XmlParser::SetNamespaceAlias(const std::string & ns,
+                             const std::string & alias) {
+  context_.SetNamespaceAlias(ns, alias);
 }
 
 void
@@ -203,7 +272,8 @@ XmlParser::ParseContext::ParseContext(XmlParser *parser) :
     raised_(XML_ERROR_NONE),
     line_number_(0),
     column_number_(0),
-    byte_index_(0) {
+    byte_index_(0),
+    byte_count_(0) {
 }
 
 void
@@ -213,7 +283,7 @@ XmlParser::ParseContext::StartNamespace(const char *prefix, const char *ns) {
 //    ns == NS_CLIENT ? NS_CLIENT :
 //    ns == NS_ROSTER ? NS_ROSTER :
 //    ns == NS_GR ? NS_GR :
-    std::string(ns));
+    !alias_ns_.empty() && alias_ns_ == ns ? alias_ : std::string(ns));
 }
 
 void
@@ -232,11 +302,12 @@ XmlParser::ParseContext::ResolveQName(const char *qname, bool isAttr) {
   for (c = qname; *c; ++c) {
     if (*c == ':') {
       const std::string * result;
-      result = xmlnsstack_.NsForPrefix(std::string(qname, c - qname));
+      uint32 ns_hash;
+      result = xmlnsstack_.NsForPrefix(qname, c - qname, &ns_hash);
       if (result == NULL)
         return QN_EMPTY;
       const char * localname = c + 1;
-      return QName(*result, localname);
+      return QName(*result, ns_hash, localname);
     }
   }
   if (isAttr) {
@@ -244,11 +315,12 @@ XmlParser::ParseContext::ResolveQName(const char *qname, bool isAttr) {
   }
 
   const std::string * result;
-  result = xmlnsstack_.NsForPrefix(STR_EMPTY);
+  uint32 ns_hash;
+  result = xmlnsstack_.NsForPrefix(qname, 0, &ns_hash);
   if (result == NULL)
     return QN_EMPTY;
 
-  return QName(*result, qname);
+  return QName(*result, ns_hash, qname);
 }
 
 void
@@ -259,10 +331,12 @@ XmlParser::ParseContext::Reset() {
 
 void
 XmlParser::ParseContext::SetPosition(int line, int column,
-                                          long byte_index) {
+                                          long byte_index,
+                                          int byte_count) {
   line_number_ = line;
   column_number_ = column;
   byte_index_ = byte_index;
+  byte_count_ = byte_count;
 }
 
 void
@@ -282,6 +356,11 @@ XmlParser::ParseContext::GetPosition(unsigned long * line,
   }
 }
 
+unsigned long
+XmlParser::ParseContext::GetByteCount() {
+  return static_cast<unsigned long>(byte_count_);
+}
+
 XmlParser::ParseContext::~ParseContext() {
 }
 
@@ -34,8 +34,15 @@
 
 #include <string>
 #include "xmlnsstack.h"
+#include "xmltokenizer.h"
 #include <expat.h>
 
+// Define XMLPARSER_BUILTIN to 1 to parse with XmlTokenizer, which takes
+// only the XML that XMPP allows, instead of Expat.
+#if !defined(XMLPARSER_BUILTIN)
+#define XMLPARSER_BUILTIN 0
+#endif
+
 struct XML_ParserStruct;
 typedef struct XML_ParserStruct* XML_Parser;
 
@@ -52,6 +59,9 @@ public:
   virtual void RaiseError(XML_Error err) = 0;
   virtual void GetPosition(unsigned long * line, unsigned long * column,
                            unsigned long * byte_index) = 0;
+  // The number of input bytes the current event was parsed from, starting
+  // at the byte index: the whole tag for a start or end element.
+  virtual unsigned long GetByteCount() = 0;
 };
 
 class XmlParseHandler {
@@ -73,9 +83,21 @@ public:
 
   explicit XmlParser(XmlParseHandler * pxph);
   bool Parse(const char * data, size_t len, bool isFinal);
+  // Returns the parser's own buffer for the next |len| bytes of input,
+  // or NULL after an error. Filling it and calling ParseBuffer with the
+  // number of bytes stored saves the copy Parse makes.
+  char * GetBuffer(size_t len);
+  bool ParseBuffer(size_t len, bool isFinal);
+  // Readies the parser for a new document, reusing the Expat parser or the
+  // tokenizer and their buffers. Must not be called from within a callback.
   void Reset();
   virtual ~XmlParser();
 
+  // Reads the namespace |ns| as |alias| wherever it is declared, as a
+  // component stream's jabber:component:accept is read as jabber:client.
+  // One alias is kept, through Reset; an empty |ns| drops it.
+  void SetNamespaceAlias(const std::string & ns, const std::string & alias);
+
   // expat callbacks
   void ExpatStartElement(const char * name, const char ** atts);
   void ExpatEndElement(const char * name);
@@ -83,6 +105,10 @@ public:
   void ExpatXmlDecl(const char * ver, const char * enc, int standalone);
 
 private:
+  void InstallHandlers();
+  // Passes the position of the current event on to the context.
+  void UpdatePosition();
+  bool HandleStatus(XML_Status status);
 
   class ParseContext : public XmlParseContext {
   public:
@@ -92,25 +118,38 @@ private:
     virtual void RaiseError(XML_Error err) { if (!raised_) raised_ = err; }
     virtual void GetPosition(unsigned long * line, unsigned long * column,
                              unsigned long * byte_index);
+    virtual unsigned long GetByteCount();
     XML_Error RaisedError() { return raised_; }
     void Reset();
 
     void StartElement();
     void EndElement();
     void StartNamespace(const char * prefix, const char * ns);
-    void SetPosition(int line, int column, long byte_index);
+    void SetNamespaceAlias(const std::string & ns, const std::string & alias) {
+      alias_ns_ = ns;
+      alias_ = alias;
+    }
+    void SetPosition(int line, int column, long byte_index,
+                     int byte_count);
 
   private:
     const XmlParser * parser_;
     XmlnsStack xmlnsstack_;
+    std::string alias_ns_;
+    std::string alias_;
     XML_Error raised_;
     XML_Size line_number_;
     XML_Size column_number_;
     XML_Index byte_index_;
+    int byte_count_;
   };
 
   ParseContext context_;
+#if XMLPARSER_BUILTIN
+  XmlTokenizer tokenizer_;
+#else
   XML_Parser expat_;
+#endif
   XmlParseHandler * pxph_;
   bool sentError_;
 };
@@ -31,6 +31,7 @@
 #include <iostream>
 #include <vector>
 #include <sstream>
+#include "stringencode.h"
 #include "xmlelement.h"
 #include "xmlnsstack.h"
 #include "xmlconstants.h"
@@ -39,15 +40,15 @@ namespace txmpp {
 
 class XmlPrinterImpl {
 public:
-  XmlPrinterImpl(std::ostream * pout,
+  XmlPrinterImpl(std::string * out,
     const std::string * const xmlns, int xmlnsCount);
   void PrintElement(const XmlElement * element);
   void PrintQuotedValue(const std::string & text);
-  void PrintBodyText(const std::string & text);
-  void PrintCDATAText(const std::string & text);
+  void PrintBodyText(const XmlText * text);
+  void PrintCDATAText(const XmlText * text);
 
 private:
-  std::ostream *pout_;
+  std::string *out_;
   XmlnsStack xmlnsStack_;
 };
 
@@ -59,13 +60,43 @@ XmlPrinter::PrintXml(std::ostream * pout, const XmlElement * element) {
 void
 XmlPrinter::PrintXml(std::ostream * pout, const XmlElement * element,
     const std::string * const xmlns, int xmlnsCount) {
-  XmlPrinterImpl printer(pout, xmlns, xmlnsCount);
+  std::string out;
+  PrintXml(&out, element, xmlns, xmlnsCount);
+  pout->write(out.data(), out.size());
+}
+
+void
+XmlPrinter::PrintXml(std::string * out, const XmlElement * element,
+    const std::string * const xmlns, int xmlnsCount) {
+  XmlPrinterImpl printer(out, xmlns, xmlnsCount);
   printer.PrintElement(element);
 }
 
-XmlPrinterImpl::XmlPrinterImpl(std::ostream * pout,
+void
+XmlPrinter::PrintQuotedValue(std::string * out, const std::string & text) {
+  const char * data = text.data();
+  size_t length = text.length();
+  size_t safe = 0;
+  while (safe < length) {
+    // Also stops at apostrophes, which are copied as they are.
+    size_t unsafe = safe + xml_find_unsafe(data + safe, length - safe);
+    out->append(data + safe, unsafe - safe);
+    if (unsafe == length)
+      return;
+    switch (data[unsafe]) {
+      case '<': out->append("&lt;", 4); break;
+      case '>': out->append("&gt;", 4); break;
+      case '&': out->append("&amp;", 5); break;
+      case '"': out->append("&quot;", 6); break;
+      default: out->push_back(data[unsafe]); break;
+    }
+    safe = unsafe + 1;
+  }
+}
+
+XmlPrinterImpl::XmlPrinterImpl(std::string * out,
     const std::string * const xmlns, int xmlnsCount) :
-  pout_(pout),
+  out_(out),
   xmlnsStack_() {
   int i;
   for (i = 0; i < xmlnsCount; i += 2) {
@@ -90,37 +121,47 @@ XmlPrinterImpl::PrintElement(const XmlElement * element) {
   // then go through qnames to make sure needed xmlns definitons are added
   std::vector<std::string> newXmlns;
   std::pair<std::string, bool> prefix;
-  prefix = xmlnsStack_.AddNewPrefix(element->Name().Namespace(), false);
+  prefix = xmlnsStack_.AddNewPrefix(element->Name(), false);
   if (prefix.second) {
     newXmlns.push_back(prefix.first);
     newXmlns.push_back(element->Name().Namespace());
   }
 
   for (pattr = element->FirstAttr(); pattr; pattr = pattr->NextAttr()) {
-    prefix = xmlnsStack_.AddNewPrefix(pattr->Name().Namespace(), true);
+    prefix = xmlnsStack_.AddNewPrefix(pattr->Name(), true);
     if (prefix.second) {
       newXmlns.push_back(prefix.first);
       newXmlns.push_back(pattr->Name().Namespace());
     }
   }
 
-  // print the element name
-  *pout_ << '<' << xmlnsStack_.FormatQName(element->Name(), false);
+  // print the element name, remembering where it is for the end tag
+  out_->push_back('<');
+  size_t name_start = out_->size();
+  xmlnsStack_.AppendQName(element->Name(), false, out_);
+  size_t name_length = out_->size() - name_start;
 
   // and the attributes
   for (pattr = element->FirstAttr(); pattr; pattr = pattr->NextAttr()) {
-    *pout_ << ' ' << xmlnsStack_.FormatQName(pattr->Name(), true) << "=\"";
+    out_->push_back(' ');
+    xmlnsStack_.AppendQName(pattr->Name(), true, out_);
+    out_->append("=\"", 2);
     PrintQuotedValue(pattr->Value());
-    *pout_ << '"';
+    out_->push_back('"');
   }
 
   // and the extra xmlns declarations
   std::vector<std::string>::iterator i(newXmlns.begin());
   while (i < newXmlns.end()) {
-    if (*i == STR_EMPTY)
-      *pout_ << " xmlns=\"" << *(i + 1) << '"';
-    else
-      *pout_ << " xmlns:" << *i << "=\"" << *(i + 1) << '"';
+    if (*i == STR_EMPTY) {
+      out_->append(" xmlns=\"", 8);
+    } else {
+      out_->append(" xmlns:", 7);
+      out_->append(*i);
+      out_->append("=\"", 2);
+    }
+    out_->append(*(i + 1));
+    out_->push_back('"');
     i += 2;
   }
 
@@ -128,21 +169,23 @@ XmlPrinterImpl::PrintElement(const XmlElement * element) {
   const XmlChild * pchild = element->FirstChild();
 
   if (pchild == NULL)
-    *pout_ << "/>";
+    out_->append("/>", 2);
   else {
-    *pout_ << '>';
+    out_->push_back('>');
     while (pchild) {
       if (pchild->IsText()) {
         if (element->IsCDATA()) {
-          PrintCDATAText(pchild->AsText()->Text());
+          PrintCDATAText(pchild->AsText());
         } else {
-          PrintBodyText(pchild->AsText()->Text());
+          PrintBodyText(pchild->AsText());
         }
       } else
         PrintElement(pchild->AsElement());
       pchild = pchild->NextChild();
     }
-    *pout_ << "</" << xmlnsStack_.FormatQName(element->Name(), false) << '>';
+    out_->append("</", 2);
+    out_->append(*out_, name_start, name_length);
+    out_->push_back('>');
   }
 
   xmlnsStack_.PopFrame();
@@ -150,50 +193,40 @@ XmlPrinterImpl::PrintElement(const XmlElement * element) {
 
 void
 XmlPrinterImpl::PrintQuotedValue(const std::string & text) {
-  size_t safe = 0;
-  for (;;) {
-    size_t unsafe = text.find_first_of("<>&\"", safe);
-    if (unsafe == std::string::npos)
-      unsafe = text.length();
-    *pout_ << text.substr(safe, unsafe - safe);
-    if (unsafe == text.length())
-      return;
-    switch (text[unsafe]) {
-      case '<': *pout_ << "&lt;"; break;
-      case '>': *pout_ << "&gt;"; break;
-      case '&': *pout_ << "&amp;"; break;
-      case '"': *pout_ << "&quot;"; break;
-    }
-    safe = unsafe + 1;
-    if (safe == text.length())
-      return;
-  }
+  XmlPrinter::PrintQuotedValue(out_, text);
 }
 
 void
-XmlPrinterImpl::PrintBodyText(const std::string & text) {
-  size_t safe = 0;
-  for (;;) {
-    size_t unsafe = text.find_first_of("<>&", safe);
-    if (unsafe == std::string::npos)
-      unsafe = text.length();
-    *pout_ << text.substr(safe, unsafe - safe);
-    if (unsafe == text.length())
-      return;
-    switch (text[unsafe]) {
-      case '<': *pout_ << "&lt;"; break;
-      case '>': *pout_ << "&gt;"; break;
-      case '&': *pout_ << "&amp;"; break;
+XmlPrinterImpl::PrintBodyText(const XmlText * text) {
+  // Goes through the text as it is kept, since what is escaped is ASCII
+  // and can't be split between chunks.
+  for (XmlText::ChunkIterator it(text); !it.Done(); it.Next()) {
+    const char * data = it.Data();
+    size_t length = it.Size();
+    size_t safe = 0;
+    while (safe < length) {
+      // Also stops at quotes, which are copied as they are.
+      size_t unsafe = safe + xml_find_unsafe(data + safe, length - safe);
+      out_->append(data + safe, unsafe - safe);
+      if (unsafe == length)
+        break;
+      switch (data[unsafe]) {
+        case '<': out_->append("&lt;", 4); break;
+        case '>': out_->append("&gt;", 4); break;
+        case '&': out_->append("&amp;", 5); break;
+        default: out_->push_back(data[unsafe]); break;
+      }
+      safe = unsafe + 1;
     }
-    safe = unsafe + 1;
-    if (safe == text.length())
-      return;
   }
 }
 
 void
-XmlPrinterImpl::PrintCDATAText(const std::string & text) {
-  *pout_ << "<![CDATA[" << text << "]]>";
+XmlPrinterImpl::PrintCDATAText(const XmlText * text) {
+  out_->append("<![CDATA[", 9);
+  for (XmlText::ChunkIterator it(text); !it.Done(); it.Next())
+    out_->append(it.Data(), it.Size());
+  out_->append("]]>", 3);
 }
 
 }  // namespace txmpp
@@ -46,6 +46,15 @@ public:
 
   static void PrintXml(std::ostream * pout, const XmlElement * pelt,
     const std::string * const xmlns, int xmlnsCount);
+
+  // Appends the XML for |pelt| to |out|. This is what the ostream versions
+  // are built on, and avoids the stream formatting.
+  static void PrintXml(std::string * out, const XmlElement * pelt,
+    const std::string * const xmlns, int xmlnsCount);
+
+  // Appends |text| to |out| escaped as PrintXml escapes attribute values,
+  // for use between double quotes.
+  static void PrintQuotedValue(std::string * out, const std::string & text);
 };
 
 }  // namespace txmpp
@@ -0,0 +1,955 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmltokenizer.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define XML_TOKENIZE_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define XML_TOKENIZE_NEON 1
+#endif
+
+#include "basictypes.h"
+#include "common.h"
+#include "stringencode.h"
+#include "xmlparser.h"
+
+namespace txmpp {
+
+// Longer than any reference to a character XML allows, or to one of the
+// predefined entities, even with a few leading zeros.
+static const size_t kMaxReference = 16;
+static const size_t kMinBuffer = 1024;
+
+static inline bool IsSpace(unsigned char c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+static inline bool IsNameStart(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         c == '_' || c == ':' || c >= 0x80;
+}
+
+static inline bool IsNameChar(unsigned char c) {
+  return IsNameStart(c) || (c >= '0' && c <= '9') || c == '-' || c == '.';
+}
+
+static inline bool IsXmlChar(unsigned long c) {
+  if (c < 0x20)
+    return c == '\t' || c == '\n' || c == '\r';
+  return c <= 0xD7FF || (c >= 0xE000 && c <= 0xFFFD) ||
+         (c >= 0x10000 && c <= 0x10FFFF);
+}
+
+static bool IsEncodingName(const char* name) {
+  if (!((*name >= 'a' && *name <= 'z') || (*name >= 'A' && *name <= 'Z')))
+    return false;
+  for (++name; *name; ++name) {
+    if (!IsNameChar(*name) || *name == ':' ||
+        static_cast<unsigned char>(*name) >= 0x80)
+      return false;
+  }
+  return true;
+}
+
+// The length of the UTF-8 sequence the lead byte |c| starts.
+static inline size_t Utf8SequenceLength(unsigned char c) {
+  return c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+}
+
+// The length of the multibyte UTF-8 sequence at |s|, or 0 if it is cut
+// short, malformed or not an XML character.
+static size_t Utf8Length(const unsigned char* s, size_t n) {
+  unsigned char c = s[0];
+  if (c < 0xC2 || c > 0xF4)
+    return 0;
+  if (c < 0xE0)
+    return (n >= 2 && (s[1] & 0xC0) == 0x80) ? 2 : 0;
+  if (n < 3 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80)
+    return 0;
+  if (c < 0xF0) {
+    if ((c == 0xE0 && s[1] < 0xA0) ||                  // Overlong
+        (c == 0xED && s[1] >= 0xA0) ||                 // Surrogates
+        (c == 0xEF && s[1] == 0xBF && s[2] >= 0xBE))   // U+FFFE and U+FFFF
+      return 0;
+    return 3;
+  }
+  if (n < 4 || (s[3] & 0xC0) != 0x80)
+    return 0;
+  if ((c == 0xF0 && s[1] < 0x90) || (c == 0xF4 && s[1] >= 0x90))
+    return 0;
+  return 4;
+}
+
+static inline int DigitValue(char c, bool hex) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (hex && c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (hex && c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Decodes the reference at |p|, returning its length, or 0 with |error|
+// set if it is not one.
+static size_t DecodeReference(const char* p, size_t n, unsigned long* c,
+                              XML_Error* error) {
+  *error = XML_ERROR_INVALID_TOKEN;
+  const char* semi = static_cast<const char*>(
+      memchr(p + 1, ';', _min(n, kMaxReference) - 1));
+  if (semi == NULL || semi == p + 1)
+    return 0;
+  const char* name = p + 1;
+  size_t len = semi - name;
+  if (name[0] == '#') {
+    bool hex = len > 1 && name[1] == 'x';
+    size_t i = hex ? 2 : 1;
+    if (i == len)
+      return 0;
+    unsigned long value = 0;
+    for (; i < len; ++i) {
+      int digit = DigitValue(name[i], hex);
+      if (digit < 0)
+        return 0;
+      value = value * (hex ? 16 : 10) + digit;
+      // Stops the value from wrapping around into the valid range.
+      if (value > 0x10FFFF)
+        value = 0x110000;
+    }
+    if (!IsXmlChar(value)) {
+      *error = XML_ERROR_BAD_CHAR_REF;
+      return 0;
+    }
+    *c = value;
+    return len + 2;
+  }
+  static const struct {
+    const char* name;
+    size_t len;
+    char value;
+  } kEntities[] = {
+    { "lt", 2, '<' },
+    { "gt", 2, '>' },
+    { "amp", 3, '&' },
+    { "quot", 4, '"' },
+    { "apos", 4, '\'' },
+  };
+  for (size_t i = 0; i < ARRAY_SIZE(kEntities); ++i) {
+    if (kEntities[i].len == len && memcmp(kEntities[i].name, name, len) == 0) {
+      *c = kEntities[i].value;
+      return len + 2;
+    }
+  }
+  if (!IsNameStart(name[0]))
+    return 0;
+  for (size_t i = 1; i < len; ++i) {
+    if (!IsNameChar(name[i]))
+      return 0;
+  }
+  *error = XML_ERROR_UNDEFINED_ENTITY;
+  return 0;
+}
+
+// Like memcmp with a literal, but returns 0 if |p| matches as far as its
+// |n| bytes go and is shorter.
+static int StartsWith(const char* p, size_t n, const char* literal,
+                      size_t len) {
+  if (memcmp(p, literal, _min(n, len)) != 0)
+    return -1;
+  return n >= len ? 1 : 0;
+}
+
+#if XML_TOKENIZE_SSE2 || XML_TOKENIZE_NEON
+static inline size_t LowestSetBit(uint64 mask) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(mask);
+#else
+  size_t bit = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    ++bit;
+  }
+  return bit;
+#endif
+}
+
+static inline size_t CountSetBits(uint64 mask) {
+#if defined(__GNUC__)
+  return __builtin_popcountll(mask);
+#else
+  size_t count = 0;
+  for (; mask; mask &= mask - 1)
+    ++count;
+  return count;
+#endif
+}
+#endif
+
+#if XML_TOKENIZE_NEON
+// Narrows each byte of a comparison to 4 bits of a 64-bit mask.
+static inline uint64 NarrowMask(uint8x16_t hits) {
+  uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(hits), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+}
+#endif
+
+// The first of '<', '>', '"' and '\'' in [p, p + n), or n.
+static size_t TagLength(const char* p, size_t n) {
+  size_t pos = 0;
+#if XML_TOKENIZE_SSE2
+  const __m128i lt = _mm_set1_epi8('<');
+  const __m128i gt = _mm_set1_epi8('>');
+  const __m128i quot = _mm_set1_epi8('"');
+  const __m128i apos = _mm_set1_epi8('\'');
+  for (; pos + 16 <= n; pos += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + pos));
+    __m128i hits = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, quot), _mm_cmpeq_epi8(v, apos)));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask)
+      return pos + LowestSetBit(static_cast<uint64>(mask));
+  }
+#elif XML_TOKENIZE_NEON
+  const uint8x16_t lt = vdupq_n_u8('<');
+  const uint8x16_t gt = vdupq_n_u8('>');
+  const uint8x16_t quot = vdupq_n_u8('"');
+  const uint8x16_t apos = vdupq_n_u8('\'');
+  for (; pos + 16 <= n; pos += 16) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(p + pos));
+    uint8x16_t hits = vorrq_u8(vorrq_u8(vceqq_u8(v, lt), vceqq_u8(v, gt)),
+        vorrq_u8(vceqq_u8(v, quot), vceqq_u8(v, apos)));
+    uint64 mask = NarrowMask(hits);
+    if (mask)
+      return pos + LowestSetBit(mask) / 4;
+  }
+#endif
+  for (; pos < n; ++pos) {
+    char c = p[pos];
+    if (c == '<' || c == '>' || c == '"' || c == '\'')
+      return pos;
+  }
+  return n;
+}
+
+size_t XmlTokenizer::PlainLength(const char* p, size_t n, Scan scan) {
+  size_t pos = 0;
+#if XML_TOKENIZE_SSE2
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i amp = _mm_set1_epi8('&');
+  const __m128i lt = _mm_set1_epi8('<');
+  const __m128i rsqb = _mm_set1_epi8(']');
+  for (; pos + 16 <= n; pos += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + pos));
+    // Bytes from 0x80 up compare as negative, so this finds them too.
+    __m128i hits = _mm_cmplt_epi8(v, space);
+    if (scan == SCAN_ATTR) {
+      hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(v, amp),
+                                             _mm_cmpeq_epi8(v, lt)));
+    } else {
+      hits = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, tab),
+                                           _mm_cmpeq_epi8(v, lf)), hits);
+      if (scan == SCAN_TEXT)
+        hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(v, amp),
+                                               _mm_cmpeq_epi8(v, rsqb)));
+    }
+    int mask = _mm_movemask_epi8(hits);
+    if (mask)
+      return pos + LowestSetBit(static_cast<uint64>(mask));
+  }
+#elif XML_TOKENIZE_NEON
+  const int8x16_t space = vdupq_n_s8(0x20);
+  const uint8x16_t tab = vdupq_n_u8('\t');
+  const uint8x16_t lf = vdupq_n_u8('\n');
+  const uint8x16_t amp = vdupq_n_u8('&');
+  const uint8x16_t lt = vdupq_n_u8('<');
+  const uint8x16_t rsqb = vdupq_n_u8(']');
+  for (; pos + 16 <= n; pos += 16) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(p + pos));
+    // Bytes from 0x80 up compare as negative, so this finds them too.
+    uint8x16_t hits = vcltq_s8(vreinterpretq_s8_u8(v), space);
+    if (scan == SCAN_ATTR) {
+      hits = vorrq_u8(hits, vorrq_u8(vceqq_u8(v, amp), vceqq_u8(v, lt)));
+    } else {
+      hits = vbicq_u8(hits, vorrq_u8(vceqq_u8(v, tab), vceqq_u8(v, lf)));
+      if (scan == SCAN_TEXT)
+        hits = vorrq_u8(hits, vorrq_u8(vceqq_u8(v, amp),
+                                       vceqq_u8(v, rsqb)));
+    }
+    uint64 mask = NarrowMask(hits);
+    if (mask)
+      return pos + LowestSetBit(mask) / 4;
+  }
+#endif
+  for (; pos < n; ++pos) {
+    unsigned char c = p[pos];
+    if (c >= 0x80)
+      return pos;
+    if (c < 0x20) {
+      if (scan == SCAN_ATTR || (c != '\t' && c != '\n'))
+        return pos;
+    } else if (scan == SCAN_TEXT) {
+      if (c == '&' || c == ']')
+        return pos;
+    } else if (scan == SCAN_ATTR) {
+      if (c == '&' || c == '<')
+        return pos;
+    }
+  }
+  return n;
+}
+
+XmlTokenizer::XmlTokenizer(XmlParser* parser) : parser_(parser) {
+  Reset();
+}
+
+XmlTokenizer::~XmlTokenizer() {
+}
+
+void XmlTokenizer::Reset() {
+  begin_ = 0;
+  end_ = 0;
+  base_ = 0;
+  scanned_ = 0;
+  quote_ = '\0';
+  mark_ = 0;
+  line_ = 1;
+  column_ = 0;
+  after_cr_ = false;
+  open_names_.clear();
+  open_ends_.clear();
+  seen_root_ = false;
+  decl_allowed_ = true;
+  finished_ = false;
+  error_ = XML_ERROR_NONE;
+  event_line_ = 1;
+  event_column_ = 0;
+  event_index_ = 0;
+  event_count_ = 0;
+}
+
+char* XmlTokenizer::GetBuffer(size_t len) {
+  if (begin_ > 0 && (begin_ == end_ || buffer_.size() - end_ < len)) {
+    // Takes the line and column up to begin_ before its bytes go.
+    Advance(begin_);
+    memmove(&buffer_[0], &buffer_[begin_], end_ - begin_);
+    base_ += begin_;
+    end_ -= begin_;
+    mark_ -= begin_;
+    begin_ = 0;
+  }
+  if (buffer_.size() - end_ < len || buffer_.empty())
+    buffer_.resize(_max(end_ + len, _max(2 * buffer_.size(), kMinBuffer)));
+  return &buffer_[end_];
+}
+
+XML_Status XmlTokenizer::ParseBuffer(size_t len, bool is_final) {
+  ASSERT(end_ + len <= buffer_.size());
+  end_ += len;
+  return Run(is_final);
+}
+
+XML_Status XmlTokenizer::Parse(const char* data, size_t len, bool is_final) {
+  memcpy(GetBuffer(len), data, len);
+  return ParseBuffer(len, is_final);
+}
+
+XML_Status XmlTokenizer::Run(bool is_final) {
+  if (error_ != XML_ERROR_NONE)
+    return XML_STATUS_ERROR;
+  if (finished_) {
+    Fail(XML_ERROR_FINISHED);
+    return XML_STATUS_ERROR;
+  }
+  while (begin_ < end_) {
+    Result result;
+    if (buffer_[begin_] == '<')
+      result = Markup(is_final);
+    else if (open_ends_.empty())
+      result = Space(is_final);
+    else
+      result = Text(is_final);
+    if (result == FAILED)
+      return XML_STATUS_ERROR;
+    if (result == MORE)
+      break;
+  }
+  if (is_final) {
+    finished_ = true;
+    StartEvent();
+    if (begin_ < end_) {
+      Fail(XML_ERROR_UNCLOSED_TOKEN);
+      return XML_STATUS_ERROR;
+    }
+    if (!seen_root_ || !open_ends_.empty()) {
+      Fail(XML_ERROR_NO_ELEMENTS);
+      return XML_STATUS_ERROR;
+    }
+  }
+  return XML_STATUS_OK;
+}
+
+XmlTokenizer::Result XmlTokenizer::Space(bool is_final) {
+  StartEvent();
+  const char* b = &buffer_[0];
+  if (event_index_ == 0 && static_cast<unsigned char>(b[begin_]) == 0xEF) {
+    // A byte order mark, which doesn't stop an XML declaration following.
+    int bom = StartsWith(b + begin_, end_ - begin_, "\xEF\xBB\xBF", 3);
+    if (bom == 0)
+      return is_final ? Fail(XML_ERROR_INVALID_TOKEN) : MORE;
+    if (bom > 0) {
+      begin_ += 3;
+      return DONE;
+    }
+  }
+  size_t pos = begin_;
+  while (pos < end_ && IsSpace(b[pos]))
+    ++pos;
+  if (pos == begin_)
+    return Fail(seen_root_ ? XML_ERROR_JUNK_AFTER_DOC_ELEMENT
+                           : XML_ERROR_INVALID_TOKEN);
+  Consume(pos);
+  return DONE;
+}
+
+XmlTokenizer::Result XmlTokenizer::Text(bool is_final) {
+  StartEvent();
+  const char* b = &buffer_[0];
+  const void* lt = memchr(b + begin_, '<', end_ - begin_);
+  size_t end = lt ? static_cast<const char*>(lt) - b : end_;
+  if (!lt && !is_final)
+    end = CompleteText(end);
+  if (end == begin_)
+    return MORE;
+  // The bytes are rewritten below, so they are counted first.
+  Advance(end);
+  size_t len;
+  if (!Rewrite(begin_, end, SCAN_TEXT, &len))
+    return FAILED;
+  SetEventEnd(end);
+  parser_->ExpatCharacterData(b + begin_, static_cast<int>(len));
+  Consume(end);
+  return DONE;
+}
+
+size_t XmlTokenizer::CompleteText(size_t end) const {
+  const char* b = &buffer_[0];
+  // A reference cut short.
+  for (size_t i = end; i > begin_ && end - i < kMaxReference; ) {
+    --i;
+    if (b[i] == ';')
+      break;
+    if (b[i] == '&')
+      return i;
+  }
+  // A line end that may be "\r\n", or what may be the start of "]]>".
+  if (b[end - 1] == '\r')
+    return end - 1;
+  if (b[end - 1] == ']') {
+    --end;
+    if (end > begin_ && b[end - 1] == ']')
+      --end;
+    return end;
+  }
+  // A character cut short.
+  for (size_t i = end; i > begin_ && end - i < 4; ) {
+    unsigned char c = b[--i];
+    if (c >= 0xC0)
+      return Utf8SequenceLength(c) > end - i ? i : end;
+    if (c < 0x80)
+      break;
+  }
+  return end;
+}
+
+XmlTokenizer::Result XmlTokenizer::Markup(bool is_final) {
+  StartEvent();
+  const char* b = &buffer_[0];
+  size_t avail = end_ - begin_;
+  if (avail < 2)
+    return MORE;
+  char c = b[begin_ + 1];
+  if (c == '/') {
+    size_t end = FindTagEnd();
+    return end ? EndTag(end) : MORE;
+  }
+  if (c == '?') {
+    size_t end = FindSequence(begin_ + 2, "?>", 2);
+    return end ? Declaration(end + 2) : MORE;
+  }
+  if (c != '!') {
+    size_t end = FindTagEnd();
+    return end ? StartTag(end) : MORE;
+  }
+
+  int comment = StartsWith(b + begin_, avail, "<!--", 4);
+  int cdata = StartsWith(b + begin_, avail, "<![CDATA[", 9);
+  if (comment == 0 || cdata == 0)
+    return MORE;
+  if (comment > 0) {
+    // The first "--" must end the comment.
+    size_t end = FindSequence(begin_ + 4, "--", 2);
+    if (!end || end + 2 >= end_)
+      return MORE;
+    if (b[end + 2] != '>')
+      return Fail(XML_ERROR_INVALID_TOKEN);
+    // Checking the characters rewrites them, which is harmless as the
+    // comment is dropped.
+    Advance(end + 3);
+    size_t len;
+    if (!Rewrite(begin_ + 4, end, SCAN_CDATA, &len))
+      return FAILED;
+    Consume(end + 3);
+    return DONE;
+  }
+  if (cdata > 0) {
+    if (open_ends_.empty())
+      return Fail(XML_ERROR_INVALID_TOKEN);
+    size_t end = FindSequence(begin_ + 9, "]]>", 3);
+    if (!end)
+      return MORE;
+    Advance(end + 3);
+    size_t len;
+    if (!Rewrite(begin_ + 9, end, SCAN_CDATA, &len))
+      return FAILED;
+    SetEventEnd(end + 3);
+    if (len > 0)
+      parser_->ExpatCharacterData(b + begin_ + 9, static_cast<int>(len));
+    Consume(end + 3);
+    return DONE;
+  }
+  // Document type declarations, and anything else.
+  return Fail(XML_ERROR_INVALID_TOKEN);
+}
+
+size_t XmlTokenizer::FindTagEnd() {
+  const char* b = &buffer_[0];
+  size_t pos = begin_ + (scanned_ ? scanned_ : 1);
+  char quote = quote_;
+  while (pos < end_) {
+    pos += TagLength(b + pos, end_ - pos);
+    if (pos == end_)
+      break;
+    char c = b[pos];
+    if (c == '<')
+      return pos;
+    if (quote) {
+      if (c == quote)
+        quote = '\0';
+    } else if (c == '>') {
+      return pos;
+    } else {
+      quote = c;
+    }
+    ++pos;
+  }
+  scanned_ = pos - begin_;
+  quote_ = quote;
+  return 0;
+}
+
+size_t XmlTokenizer::FindSequence(size_t from, const char* pattern,
+                                  size_t len) {
+  const char* b = &buffer_[0];
+  size_t pos = _max(from, begin_ + scanned_);
+  while (pos + len <= end_) {
+    const void* hit = memchr(b + pos, pattern[0], end_ - pos - len + 1);
+    if (hit == NULL)
+      break;
+    pos = static_cast<const char*>(hit) - b;
+    if (memcmp(b + pos, pattern, len) == 0)
+      return pos;
+    ++pos;
+  }
+  // Only the last len - 1 bytes can start a match once more arrives.
+  scanned_ = _max(pos, end_ + 1 - len) - begin_;
+  return 0;
+}
+
+size_t XmlTokenizer::NameEnd(size_t pos) const {
+  const unsigned char* b = reinterpret_cast<const unsigned char*>(&buffer_[0]);
+  if (!IsNameStart(b[pos]))
+    return pos;
+  for (;;) {
+    unsigned char c = b[pos];
+    if (c >= 0x80) {
+      size_t len = Utf8Length(b + pos, end_ - pos);
+      if (len == 0)
+        return pos;
+      pos += len;
+    } else if (IsNameChar(c)) {
+      ++pos;
+    } else {
+      return pos;
+    }
+  }
+}
+
+XmlTokenizer::Result XmlTokenizer::StartTag(size_t end) {
+  if (buffer_[end] != '>')
+    return Fail(XML_ERROR_INVALID_TOKEN);
+  if (seen_root_ && open_ends_.empty())
+    return Fail(XML_ERROR_JUNK_AFTER_DOC_ELEMENT);
+  // The names and values are terminated and unescaped in place below, so
+  // the tag is counted first.
+  Advance(end + 1);
+  char* b = &buffer_[0];
+  size_t name = begin_ + 1;
+  size_t pos = NameEnd(name);
+  if (pos == name)
+    return Fail(XML_ERROR_INVALID_TOKEN);
+  size_t name_len = pos - name;
+  char c = b[pos];
+  b[pos] = '\0';
+  bool empty = false;
+  atts_.clear();
+  for (;;) {
+    bool space = false;
+    while (IsSpace(c)) {
+      space = true;
+      c = b[++pos];
+    }
+    if (c == '>')
+      break;
+    if (c == '/') {
+      if (pos + 1 != end)
+        return Fail(XML_ERROR_INVALID_TOKEN);
+      empty = true;
+      break;
+    }
+    size_t att = pos;
+    pos = NameEnd(att);
+    if (!space || pos == att)
+      return Fail(XML_ERROR_INVALID_TOKEN);
+    c = b[pos];
+    b[pos] = '\0';
+    while (IsSpace(c))
+      c = b[++pos];
+    if (c != '=')
+      return Fail(XML_ERROR_INVALID_TOKEN);
+    c = b[++pos];
+    while (IsSpace(c))
+      c = b[++pos];
+    if (c != '"' && c != '\'')
+      return Fail(XML_ERROR_INVALID_TOKEN);
+    // FindTagEnd saw this quote open, so it is closed before the end.
+    size_t value = pos + 1;
+    size_t quote = static_cast<const char*>(
+        memchr(b + value, c, end - value)) - b;
+    size_t len;
+    if (!Rewrite(value, quote, SCAN_ATTR, &len))
+      return FAILED;
+    b[value + len] = '\0';
+    for (size_t i = 0; i < atts_.size(); i += 2) {
+      if (strcmp(atts_[i], b + att) == 0)
+        return Fail(XML_ERROR_DUPLICATE_ATTRIBUTE);
+    }
+    atts_.push_back(b + att);
+    atts_.push_back(b + value);
+    pos = quote + 1;
+    c = b[pos];
+  }
+  atts_.push_back(NULL);
+
+  SetEventEnd(end + 1);
+  seen_root_ = true;
+  if (!empty) {
+    open_names_.append(b + name, name_len);
+    open_ends_.push_back(open_names_.size());
+  }
+  parser_->ExpatStartElement(b + name, &atts_[0]);
+  if (empty) {
+    // Expat reports the end of an empty element as an empty event after it.
+    Consume(end + 1);
+    StartEvent();
+    parser_->ExpatEndElement(b + name);
+    return DONE;
+  }
+  Consume(end + 1);
+  return DONE;
+}
+
+XmlTokenizer::Result XmlTokenizer::EndTag(size_t end) {
+  if (buffer_[end] != '>')
+    return Fail(XML_ERROR_INVALID_TOKEN);
+  Advance(end + 1);
+  char* b = &buffer_[0];
+  size_t name = begin_ + 2;
+  size_t pos = NameEnd(name);
+  size_t name_len = pos - name;
+  while (IsSpace(b[pos]))
+    ++pos;
+  if (name_len == 0 || pos != end)
+    return Fail(XML_ERROR_INVALID_TOKEN);
+  if (open_ends_.empty())
+    return Fail(XML_ERROR_INVALID_TOKEN);
+  size_t start = open_ends_.size() > 1 ? open_ends_[open_ends_.size() - 2]
+                                       : 0;
+  if (open_ends_.back() - start != name_len ||
+      memcmp(open_names_.data() + start, b + name, name_len) != 0)
+    return Fail(XML_ERROR_TAG_MISMATCH);
+  b[name + name_len] = '\0';
+  open_ends_.pop_back();
+  open_names_.resize(start);
+
+  SetEventEnd(end + 1);
+  parser_->ExpatEndElement(b + name);
+  Consume(end + 1);
+  return DONE;
+}
+
+XmlTokenizer::Result XmlTokenizer::Declaration(size_t end) {
+  char* b = &buffer_[0];
+  size_t target = begin_ + 2;
+  size_t pos = NameEnd(target);
+  size_t close = end - 2;
+  if (pos == target || (pos != close && !IsSpace(b[pos])))
+    return Fail(XML_ERROR_INVALID_TOKEN);
+  Advance(end);
+  if (pos - target != 3 || memcmp(b + target, "xml", 3) != 0) {
+    // Processing instructions are checked like comments, and skipped.
+    size_t len;
+    if (!Rewrite(pos, close, SCAN_CDATA, &len))
+      return FAILED;
+    Consume(end);
+    return DONE;
+  }
+  if (!decl_allowed_)
+    return Fail(XML_ERROR_MISPLACED_XML_PI);
+
+  static const char* const kNames[] = { "version", "encoding", "standalone" };
+  const char* values[ARRAY_SIZE(kNames)] = { NULL, NULL, NULL };
+  size_t next = 0;
+  char c = b[pos];
+  for (;;) {
+    bool space = false;
+    while (IsSpace(c)) {
+      space = true;
+      c = b[++pos];
+    }
+    if (pos == close)
+      break;
+    size_t att = pos;
+    pos = NameEnd(att);
+    if (!space || pos == att)
+      return Fail(XML_ERROR_XML_DECL);
+    c = b[pos];
+    b[pos] = '\0';
+    while (IsSpace(c))
+      c = b[++pos];
+    if (c != '=')
+      return Fail(XML_ERROR_XML_DECL);
+    c = b[++pos];
+    while (IsSpace(c))
+      c = b[++pos];
+    if (c != '"' && c != '\'')
+      return Fail(XML_ERROR_XML_DECL);
+    size_t value = pos + 1;
+    const void* quote = memchr(b + value, c, close - value);
+    if (quote == NULL)
+      return Fail(XML_ERROR_XML_DECL);
+    pos = static_cast<const char*>(quote) - b;
+    b[pos] = '\0';
+    // The pseudo-attributes come in this order, each at most once.
+    while (next < ARRAY_SIZE(kNames) && strcmp(kNames[next], b + att) != 0)
+      ++next;
+    if (next == ARRAY_SIZE(kNames))
+      return Fail(XML_ERROR_XML_DECL);
+    values[next++] = b + value;
+    c = b[++pos];
+  }
+  int standalone = -1;
+  if (values[2] != NULL) {
+    if (strcmp(values[2], "yes") == 0)
+      standalone = 1;
+    else if (strcmp(values[2], "no") == 0)
+      standalone = 0;
+    else
+      return Fail(XML_ERROR_XML_DECL);
+  }
+  if (values[0] == NULL || (values[1] != NULL && !IsEncodingName(values[1])))
+    return Fail(XML_ERROR_XML_DECL);
+
+  SetEventEnd(end);
+  parser_->ExpatXmlDecl(values[0], values[1], standalone);
+  Consume(end);
+  return DONE;
+}
+
+bool XmlTokenizer::Rewrite(size_t from, size_t to, Scan scan, size_t* len) {
+  char* b = &buffer_[0];
+  size_t r = from;
+  size_t w = from;
+  for (;;) {
+    size_t n = PlainLength(b + r, to - r, scan);
+    if (w != r)
+      memmove(b + w, b + r, n);
+    r += n;
+    w += n;
+    if (r == to)
+      break;
+    unsigned char c = b[r];
+    if (c >= 0x80) {
+      n = Utf8Length(reinterpret_cast<unsigned char*>(b + r), to - r);
+      if (n == 0) {
+        Fail(XML_ERROR_INVALID_TOKEN);
+        return false;
+      }
+      if (w != r)
+        memmove(b + w, b + r, n);
+      r += n;
+      w += n;
+    } else if (c == '&') {
+      unsigned long value;
+      XML_Error error;
+      n = DecodeReference(b + r, to - r, &value, &error);
+      if (n == 0) {
+        Fail(error);
+        return false;
+      }
+      // No reference is shorter than the UTF-8 of what it stands for.
+      w += utf8_encode(b + w, n, value);
+      r += n;
+    } else if (c == ']') {
+      if (to - r >= 3 && b[r + 1] == ']' && b[r + 2] == '>') {
+        Fail(XML_ERROR_INVALID_TOKEN);
+        return false;
+      }
+      b[w++] = b[r++];
+    } else if (c == '\r') {
+      b[w++] = (scan == SCAN_ATTR) ? ' ' : '\n';
+      if (++r < to && b[r] == '\n')
+        ++r;
+    } else if (scan == SCAN_ATTR && (c == '\t' || c == '\n')) {
+      b[w++] = ' ';
+      ++r;
+    } else {
+      // A control character, or '<' in an attribute value.
+      Fail(XML_ERROR_INVALID_TOKEN);
+      return false;
+    }
+  }
+  *len = w - from;
+  return true;
+}
+
+void XmlTokenizer::Advance(size_t to) {
+  if (to <= mark_)
+    return;
+  const unsigned char* p =
+      reinterpret_cast<const unsigned char*>(&buffer_[0]) + mark_;
+  const unsigned char* end = p + (to - mark_);
+  mark_ = to;
+  while (p < end) {
+#if XML_TOKENIZE_SSE2
+    if (end - p >= 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      __m128i breaks = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                                    _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+      if (!_mm_movemask_epi8(breaks)) {
+        // Columns count characters, so continuation bytes are left out.
+        __m128i tails = _mm_cmpeq_epi8(
+            _mm_and_si128(v, _mm_set1_epi8(static_cast<char>(0xC0))),
+            _mm_set1_epi8(static_cast<char>(0x80)));
+        column_ += 16 - CountSetBits(
+            static_cast<uint64>(_mm_movemask_epi8(tails)));
+        after_cr_ = false;
+        p += 16;
+        continue;
+      }
+    }
+#elif XML_TOKENIZE_NEON
+    if (end - p >= 16) {
+      uint8x16_t v = vld1q_u8(p);
+      uint8x16_t breaks = vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')),
+                                   vceqq_u8(v, vdupq_n_u8('\r')));
+      if (!NarrowMask(breaks)) {
+        // Columns count characters, so continuation bytes are left out.
+        uint8x16_t tails = vceqq_u8(vandq_u8(v, vdupq_n_u8(0xC0)),
+                                    vdupq_n_u8(0x80));
+        column_ += 16 - CountSetBits(NarrowMask(tails)) / 4;
+        after_cr_ = false;
+        p += 16;
+        continue;
+      }
+    }
+#endif
+    const unsigned char* stop = _min(p + 16, end);
+    for (; p < stop; ++p) {
+      unsigned char c = *p;
+      if (c == '\n') {
+        if (!after_cr_)
+          ++line_;
+        column_ = 0;
+        after_cr_ = false;
+      } else if (c == '\r') {
+        ++line_;
+        column_ = 0;
+        after_cr_ = true;
+      } else {
+        if ((c & 0xC0) != 0x80)
+          ++column_;
+        after_cr_ = false;
+      }
+    }
+  }
+}
+
+void XmlTokenizer::StartEvent() {
+  Advance(begin_);
+  event_line_ = line_;
+  event_column_ = column_;
+  event_index_ = base_ + begin_;
+  event_count_ = 0;
+}
+
+void XmlTokenizer::SetEventEnd(size_t end) {
+  event_count_ = static_cast<int>(end - begin_);
+}
+
+XmlTokenizer::Result XmlTokenizer::Fail(XML_Error error) {
+  error_ = error;
+  event_count_ = 0;
+  return FAILED;
+}
+
+void XmlTokenizer::Consume(size_t end) {
+  begin_ = end;
+  scanned_ = 0;
+  quote_ = '\0';
+  decl_allowed_ = false;
+}
+
+}  // namespace txmpp
@@ -0,0 +1,152 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMLTOKENIZER_H_
+#define _TXMPP_XMLTOKENIZER_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <expat.h>
+
+#include "constructormagic.h"
+
+namespace txmpp {
+
+class XmlParser;
+
+// A tokenizer for the XML subset XMPP allows, used by XmlParser in place of
+// Expat when XMLPARSER_BUILTIN is set. It calls the same XmlParser methods
+// the Expat callbacks do, with the same positions, and fails where Expat
+// would on well-formedness errors, though at the start of the token that
+// is in error rather than inside it. Input must be UTF-8. Document type
+// declarations are rejected, and comments and processing instructions are
+// skipped. Names are checked for the ASCII name characters only; any valid
+// UTF-8 is taken as a name character beyond that.
+//
+// Input is copied into the tokenizer's own buffer, where text and attribute
+// values are unescaped in place, and scanned for markup 16 bytes at a time
+// where SSE2 or NEON is available. Not thread safe.
+class XmlTokenizer {
+ public:
+  explicit XmlTokenizer(XmlParser* parser);
+  ~XmlTokenizer();
+
+  // Like XML_Parse, XML_GetBuffer and XML_ParseBuffer.
+  XML_Status Parse(const char* data, size_t len, bool is_final);
+  char* GetBuffer(size_t len);
+  XML_Status ParseBuffer(size_t len, bool is_final);
+  // Starts over on a new document, keeping the buffer.
+  void Reset();
+
+  XML_Error ErrorCode() const { return error_; }
+  // The position of the event being reported, or of the token that failed,
+  // counted like Expat does: lines from 1 and columns in characters from 0.
+  XML_Size CurrentLineNumber() const { return event_line_; }
+  XML_Size CurrentColumnNumber() const { return event_column_; }
+  XML_Index CurrentByteIndex() const { return event_index_; }
+  int CurrentByteCount() const { return event_count_; }
+
+ private:
+  enum Result { DONE, MORE, FAILED };
+  // What ends a run of plain characters, besides invalid ones.
+  enum Scan { SCAN_TEXT, SCAN_ATTR, SCAN_CDATA };
+
+  XML_Status Run(bool is_final);
+  Result Space(bool is_final);
+  Result Text(bool is_final);
+  Result Markup(bool is_final);
+  Result StartTag(size_t end);
+  Result EndTag(size_t end);
+  Result Declaration(size_t end);
+
+  // The first byte in [p, p + n) that ends a run of plain characters.
+  static size_t PlainLength(const char* p, size_t n, Scan scan);
+  // The end of the text before |end| that can be unescaped without seeing
+  // what follows |end|.
+  size_t CompleteText(size_t end) const;
+
+  // Finds the '>' closing the tag at begin_, or a '<' that shows the tag is
+  // malformed, or returns 0 if neither is in the buffer yet.
+  size_t FindTagEnd();
+  // Finds |pattern| from |from| on, or returns 0.
+  size_t FindSequence(size_t from, const char* pattern, size_t len);
+  // The end of the name at |pos|, or |pos| if there is none there.
+  size_t NameEnd(size_t pos) const;
+  // Unescapes and normalizes [from, to) in place, checking its characters,
+  // and stores the new length in |len|.
+  bool Rewrite(size_t from, size_t to, Scan scan, size_t* len);
+
+  // Moves the line and column from mark_ up to |to|.
+  void Advance(size_t to);
+  // Reports on the token at begin_; SetEventEnd gives where it ends.
+  void StartEvent();
+  void SetEventEnd(size_t end);
+  Result Fail(XML_Error error);
+  void Consume(size_t end);
+
+  XmlParser* const parser_;
+  // The unparsed input is [begin_, end_) of the buffer, which holds the
+  // stream from byte index base_ on.
+  std::vector<char> buffer_;
+  size_t begin_;
+  size_t end_;
+  XML_Index base_;
+  // The bytes of the token at begin_ scanned by FindTagEnd so far, and the
+  // quote they end in, if any.
+  size_t scanned_;
+  char quote_;
+  // The line and column of buffer offset mark_.
+  size_t mark_;
+  XML_Size line_;
+  XML_Size column_;
+  bool after_cr_;
+
+  // The names of the open elements, end to end, and where each ends.
+  std::string open_names_;
+  std::vector<size_t> open_ends_;
+  std::vector<const char*> atts_;
+  bool seen_root_;
+  bool decl_allowed_;
+  bool finished_;
+  XML_Error error_;
+
+  XML_Size event_line_;
+  XML_Size event_column_;
+  XML_Index event_index_;
+  int event_count_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(XmlTokenizer);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMLTOKENIZER_H_
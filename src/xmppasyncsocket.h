@@ -32,12 +32,15 @@
 #include "config.h"
 #endif
 
+#include <vector>
+
+#include "basictypes.h"
+#include "chainbuffer.h"
 #include "sigslot.h"
+#include "socketaddress.h"
 
 namespace txmpp {
 
-class SocketAddress;
-
 class XmppAsyncSocket {
 public:
   enum State {
@@ -67,20 +70,70 @@ public:
   virtual int GetError() = 0;    // winsock error code
 
   virtual bool Connect(const SocketAddress& addr) = 0;
+  // Connects to whichever of |addrs|, in order of preference, answers
+  // first, starting an attempt on the next one every |stagger| milliseconds
+  // until one does.  The default connects to the first only.
+  virtual bool ConnectAny(const std::vector<SocketAddress>& addrs,
+                          int stagger) {
+    return !addrs.empty() && Connect(addrs[0]);
+  }
   virtual bool Read(char * data, size_t len, size_t* len_read) = 0;
   virtual bool Write(const char * data, size_t len) = 0;
+  // Writes the bytes in |data|, taking them all. The default passes each
+  // block to Write.
+  virtual bool WriteChain(ChainBuffer * data) {
+    bool result = true;
+    for (size_t i = 0; i < data->BlockCount(); ++i) {
+      IoVec block = data->Block(i);
+      if (!Write(static_cast<const char *>(block.data), block.len))
+        result = false;
+    }
+    data->Clear();
+    return result;
+  }
   virtual bool Close() = 0;
+
+  // The address connected to, once connected, as of the connect attempts
+  // that ConnectAny raced, the one that answered.  Nil if it can't tell.
+  virtual SocketAddress GetRemoteAddress() const { return SocketAddress(); }
+
+  // The bytes written that the socket has yet to send.
+  virtual size_t QueuedBytes() { return 0; }
+  // The bytes sent and received on the network so far, after TLS and
+  // compression.  0 if the socket can't tell.
+  virtual uint64 WireBytesSent() { return 0; }
+  virtual uint64 WireBytesReceived() { return 0; }
+  // The round trip time the kernel has measured for the connection, and
+  // its mean deviation, in microseconds.  Returns false if it can't tell.
+  virtual bool GetKernelRtt(uint32* rtt_us, uint32* rttvar_us) {
+    return false;
+  }
+  // Once QueuedBytes reaches |high|, SignalWriteBlocked is raised, and
+  // SignalWritable when it is back down to |low|. Writes are still taken
+  // while blocked; they are a hint for the writer to hold off.
+  virtual void SetWriteWatermarks(size_t high, size_t low) {}
 #if defined(FEATURE_ENABLE_SSL)
   // We allow matching any passed domain.
   // If both names are passed as empty, we do not require a match.
   virtual bool StartTls(const std::string & domainname) = 0;
 #endif
+  // Compresses the bytes each way from here on with zlib, for XEP-0138.
+  // |level| and |window_bits| are as for deflateInit2. Returns false if
+  // the socket can't.
+  virtual bool StartCompression(int level, int window_bits) { return false; }
+
+  // Frees what the socket keeps for the next write and the next TLS record,
+  // as for a connection gone idle, without affecting the stream. Returns
+  // the bytes freed, as far as it can tell.
+  virtual size_t TrimMemory() { return 0; }
 
   signal0<> SignalConnected;
   signal0<> SignalSSLConnected;
   signal0<> SignalClosed;
   signal0<> SignalRead;
   signal0<> SignalError;
+  signal0<> SignalWriteBlocked;
+  signal0<> SignalWritable;
 };
 
 }  // namespace txmpp
@@ -33,6 +33,7 @@
 #include <errno.h>
 #include "basicdefs.h"
 #include "logging.h"
+#include "socketadapters.h"
 #ifdef FEATURE_ENABLE_SSL
 #include "ssladapter.h"
 #endif
@@ -41,19 +42,28 @@
 #ifdef FEATURE_ENABLE_SSL
 #include "sslstreamadapter.h"
 #endif  // FEATURE_ENABLE_SSL
+#include "zlibstream.h"
 #endif  // USE_SSLSTREAM
 #include "thread.h"
 
 namespace txmpp {
 
-XmppAsyncSocketImpl::XmppAsyncSocketImpl(bool tls) : tls_(tls) {
+const size_t XmppAsyncSocketImpl::kMaxWriteBlocks;
+const size_t XmppAsyncSocketImpl::kDefaultHighWater;
+const size_t XmppAsyncSocketImpl::kDefaultLowWater;
+
+XmppAsyncSocketImpl::XmppAsyncSocketImpl(bool tls)
+    : high_water_(kDefaultHighWater),
+      low_water_(kDefaultLowWater),
+      write_blocked_(false),
+      tls_(tls) {
   Thread* pth = Thread::Current();
-  AsyncSocket* socket = pth->socketserver()->CreateAsyncSocket(SOCK_STREAM);
+  racing_socket_ = new RacingSocketAdapter(pth->socketserver());
+  AsyncSocket* socket = racing_socket_;
 #ifndef USE_SSLSTREAM
 #ifdef FEATURE_ENABLE_SSL
   if (tls_) {
     socket = SSLAdapter::Create(socket);
-    InitializeSSL();
   }
 #endif  // FEATURE_ENABLE_SSL
   cricket_socket_ = socket;
@@ -68,12 +78,13 @@ XmppAsyncSocketImpl::XmppAsyncSocketImpl(bool tls) : tls_(tls) {
 #else  // USE_SSLSTREAM
   cricket_socket_ = socket;
   stream_ = new SocketStream(cricket_socket_);
+  zlib_stream_ = NULL;
 #ifdef FEATURE_ENABLE_SSL
   if (tls_) {
     stream_ = SSLStreamAdapter::Create(stream_);
-    InitializeSSL();
   }
 #endif  // FEATURE_ENABLE_SSL
+  tls_stream_ = stream_;
   stream_->SignalEvent.connect(this, &XmppAsyncSocketImpl::OnEvent);
 #endif  // USE_SSLSTREAM
 
@@ -81,7 +92,6 @@ XmppAsyncSocketImpl::XmppAsyncSocketImpl(bool tls) : tls_(tls) {
 }
 
 XmppAsyncSocketImpl::~XmppAsyncSocketImpl() {
-  CleanupSSL();
   Close();
 #ifndef USE_SSLSTREAM
   delete cricket_socket_;
@@ -96,17 +106,7 @@ void XmppAsyncSocketImpl::OnReadEvent(AsyncSocket * socket) {
 }
 
 void XmppAsyncSocketImpl::OnWriteEvent(AsyncSocket * socket) {
-  // Write bytes if there are any
-  while (buffer_.Length() != 0) {
-    int written = cricket_socket_->Send(buffer_.Data(), buffer_.Length());
-    if (written > 0) {
-      buffer_.Shift(written);
-      continue;
-    }
-    if (!cricket_socket_->IsBlocking())
-      LOG(LS_ERROR) << "Send error: " << cricket_socket_->GetError();
-    return;
-  }
+  WriteBuffered();
 }
 
 void XmppAsyncSocketImpl::OnConnectEvent(AsyncSocket * socket) {
@@ -145,29 +145,73 @@ void XmppAsyncSocketImpl::OnEvent(StreamInterface* stream,
   }
   if ((events & SE_READ))
     SignalRead();
-  if ((events & SE_WRITE)) {
-    // Write bytes if there are any
-    while (buffer_.Length() != 0) {
+  if ((events & SE_WRITE))
+    WriteBuffered();
+  if ((events & SE_CLOSE))
+    SignalCloseEvent(err);
+}
+#endif  // USE_SSLSTREAM
+
+void XmppAsyncSocketImpl::SetWriteWatermarks(size_t high, size_t low) {
+  high_water_ = high;
+  low_water_ = _min(low, high);
+  CheckWatermarks();
+}
+
+void XmppAsyncSocketImpl::CheckWatermarks() {
+  if (!write_blocked_ && high_water_ > 0 &&
+      buffer_.Length() >= high_water_) {
+    write_blocked_ = true;
+    SignalWriteBlocked();
+  } else if (write_blocked_ && buffer_.Length() <= low_water_) {
+    write_blocked_ = false;
+    SignalWritable();
+  }
+}
+
+void XmppAsyncSocketImpl::WriteBuffered() {
+  WriteQueued();
+  CheckWatermarks();
+}
+
+void XmppAsyncSocketImpl::WriteQueued() {
+  // Write bytes if there are any
+  while (!buffer_.IsEmpty()) {
+#ifdef USE_SSLSTREAM
+    if (state_ != XmppAsyncSocket::STATE_OPEN ||
+        (zlib_stream_ && zlib_stream_->active())) {
+      IoVec block = buffer_.Block(0);
       StreamResult result;
       size_t written;
       int error;
-      result = stream_->Write(buffer_.Data(), buffer_.Length(),
-                              &written, &error);
+      result = stream_->Write(block.data, block.len, &written, &error);
       if (result == SR_ERROR) {
-        LOG(LS_ERROR) << "Send error: " << error;
+        LOG_EVERY_T(LS_ERROR, 1000) << "Send error: " << error;
         return;
       }
       if (result == SR_BLOCK)
         return;
       ASSERT(result == SR_SUCCESS);
       ASSERT(written > 0);
-      buffer_.Shift(written);
+      buffer_.Consume(written);
+      continue;
+    }
+    // Without TLS or compression the stream passes writes straight on to
+    // the socket, so the blocks can be gathered into one send there.
+#endif  // USE_SSLSTREAM
+    IoVec vec[kMaxWriteBlocks];
+    size_t count = buffer_.Peek(vec, kMaxWriteBlocks);
+    int written = cricket_socket_->SendV(vec, count);
+    if (written > 0) {
+      buffer_.Consume(written);
+      continue;
     }
+    if (!cricket_socket_->IsBlocking())
+      LOG_EVERY_T(LS_ERROR, 1000) << "Send error: "
+                                  << cricket_socket_->GetError();
+    return;
   }
-  if ((events & SE_CLOSE))
-    SignalCloseEvent(err);
 }
-#endif  // USE_SSLSTREAM
 
 XmppAsyncSocket::State XmppAsyncSocketImpl::state() {
   return state_;
@@ -182,12 +226,53 @@ int XmppAsyncSocketImpl::GetError() {
 }
 
 bool XmppAsyncSocketImpl::Connect(const SocketAddress& addr) {
+  racing_socket_->ClearAddresses();
   if (cricket_socket_->Connect(addr) < 0) {
     return cricket_socket_->IsBlocking();
   }
   return true;
 }
 
+bool XmppAsyncSocketImpl::ConnectAny(const std::vector<SocketAddress>& addrs,
+                                     int stagger) {
+  if (addrs.empty())
+    return false;
+  racing_socket_->ClearAddresses();
+  for (size_t i = 1; i < addrs.size(); ++i)
+    racing_socket_->AddAddress(addrs[i]);
+  racing_socket_->set_stagger(stagger);
+  if (cricket_socket_->Connect(addrs[0]) < 0) {
+    return cricket_socket_->IsBlocking();
+  }
+  return true;
+}
+
+SocketAddress XmppAsyncSocketImpl::GetRemoteAddress() const {
+  return racing_socket_->GetRemoteAddress();
+}
+
+uint64 XmppAsyncSocketImpl::WireBytesSent() {
+  return racing_socket_->bytes_sent();
+}
+
+uint64 XmppAsyncSocketImpl::WireBytesReceived() {
+  return racing_socket_->bytes_received();
+}
+
+bool XmppAsyncSocketImpl::GetKernelRtt(uint32* rtt_us, uint32* rttvar_us) {
+  // Detached until connected.
+  if (racing_socket_->GetState() != Socket::CS_CONNECTED)
+    return false;
+  int rtt, rttvar;
+  if (racing_socket_->GetOption(Socket::OPT_RTT, &rtt) != 0 ||
+      racing_socket_->GetOption(Socket::OPT_RTTVAR, &rttvar) != 0 ||
+      rtt <= 0)
+    return false;
+  *rtt_us = static_cast<uint32>(rtt);
+  *rttvar_us = static_cast<uint32>(rttvar);
+  return true;
+}
+
 bool XmppAsyncSocketImpl::Read(char * data, size_t len, size_t* len_read) {
 #ifndef USE_SSLSTREAM
   int read = cricket_socket_->Recv(data, len);
@@ -204,12 +289,21 @@ bool XmppAsyncSocketImpl::Read(char * data, size_t len, size_t* len_read) {
 }
 
 bool XmppAsyncSocketImpl::Write(const char * data, size_t len) {
-  buffer_.WriteBytes(data, len);
-#ifndef USE_SSLSTREAM
-  OnWriteEvent(cricket_socket_);
-#else  // USE_SSLSTREAM
-  OnEvent(stream_, SE_WRITE, 0);
-#endif  // USE_SSLSTREAM
+  buffer_.Append(data, len);
+  WriteBuffered();
+  return true;
+}
+
+bool XmppAsyncSocketImpl::WriteChain(ChainBuffer * data) {
+  // What can be sent goes straight from |data|, which keeps its drained
+  // blocks for reuse, and only the rest is queued.
+  if (buffer_.IsEmpty()) {
+    buffer_.Swap(data);
+    WriteQueued();
+    buffer_.Swap(data);
+  }
+  buffer_.Append(data);
+  CheckWatermarks();
   return true;
 }
 
@@ -225,6 +319,8 @@ bool XmppAsyncSocketImpl::Close() {
   return false;
 #else  // USE_SSLSTREAM
   state_ = XmppAsyncSocket::STATE_CLOSED;
+  if (zlib_stream_)
+    zlib_stream_->Stop();
   stream_->Close();
   SignalClosed();
   return true;
@@ -243,7 +339,7 @@ bool XmppAsyncSocketImpl::StartTls(const std::string & domainname) {
     return false;
 #else  // USE_SSLSTREAM
   SSLStreamAdapter* ssl_stream =
-    static_cast<SSLStreamAdapter *>(stream_);
+    static_cast<SSLStreamAdapter *>(tls_stream_);
   ssl_stream->set_ignore_bad_cert(true);
   if (ssl_stream->StartSSLWithServer(domainname.c_str()) != 0)
     return false;
@@ -255,4 +351,38 @@ bool XmppAsyncSocketImpl::StartTls(const std::string & domainname) {
 #endif  // !defined(FEATURE_ENABLE_SSL)
 }
 
+bool XmppAsyncSocketImpl::StartCompression(int level, int window_bits) {
+#ifdef USE_SSLSTREAM
+  // What was queued before must go out as it is.
+  if (!buffer_.IsEmpty()) {
+    LOG(LS_WARNING) << "Output still queued; can't start compression";
+    return false;
+  }
+  if (!zlib_stream_) {
+    stream_->SignalEvent.disconnect(this);
+    zlib_stream_ = new ZlibStream(stream_);
+    stream_ = zlib_stream_;
+    stream_->SignalEvent.connect(this, &XmppAsyncSocketImpl::OnEvent);
+  }
+  return zlib_stream_->Start(level, window_bits);
+#else  // !USE_SSLSTREAM
+  return false;
+#endif  // !USE_SSLSTREAM
+}
+
+size_t XmppAsyncSocketImpl::TrimMemory() {
+  size_t freed = buffer_.Trim();
+#if defined(FEATURE_ENABLE_SSL)
+  // The adapters leave buffers alone until the handshake is done.
+  if (tls_) {
+#ifndef USE_SSLSTREAM
+    freed += static_cast<SSLAdapter *>(cricket_socket_)->TrimMemory();
+#else  // USE_SSLSTREAM
+    freed += static_cast<SSLStreamAdapter *>(tls_stream_)->TrimMemory();
+#endif  // USE_SSLSTREAM
+  }
+#endif  // FEATURE_ENABLE_SSL
+  return freed;
+}
+
 }  // namespace txmpp
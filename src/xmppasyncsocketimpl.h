@@ -33,7 +33,7 @@
 #endif
 
 #include "asyncsocket.h"
-#include "bytebuffer.h"
+#include "chainbuffer.h"
 #include "sigslot.h"
 #include "xmppasyncsocket.h"
 
@@ -43,7 +43,9 @@
 
 namespace txmpp {
 
+class RacingSocketAdapter;
 class StreamInterface;
+class ZlibStream;
 
 extern AsyncSocket* cricket_socket_;
 
@@ -57,10 +59,21 @@ class XmppAsyncSocketImpl : public XmppAsyncSocket, public has_slots<> {
     virtual int GetError();
 
     virtual bool Connect(const SocketAddress& addr);
+    virtual bool ConnectAny(const std::vector<SocketAddress>& addrs,
+                            int stagger);
     virtual bool Read(char * data, size_t len, size_t* len_read);
     virtual bool Write(const char * data, size_t len);
+    virtual bool WriteChain(ChainBuffer * data);
     virtual bool Close();
+    virtual SocketAddress GetRemoteAddress() const;
+    virtual size_t QueuedBytes() { return buffer_.Length(); }
+    virtual uint64 WireBytesSent();
+    virtual uint64 WireBytesReceived();
+    virtual bool GetKernelRtt(uint32* rtt_us, uint32* rttvar_us);
+    virtual void SetWriteWatermarks(size_t high, size_t low);
     virtual bool StartTls(const std::string & domainname);
+    virtual bool StartCompression(int level, int window_bits);
+    virtual size_t TrimMemory();
 
     signal1<int> SignalCloseEvent;
 
@@ -73,13 +86,35 @@ class XmppAsyncSocketImpl : public XmppAsyncSocket, public has_slots<> {
 #else  // USE_SSLSTREAM
     void OnEvent(StreamInterface* stream, int events, int err);
 #endif  // USE_SSLSTREAM
+    // Sends what is in buffer_ until the socket blocks, and checks the
+    // watermarks after.
+    void WriteBuffered();
+    void WriteQueued();
+    // Raises SignalWriteBlocked or SignalWritable if buffer_ has crossed a
+    // watermark.
+    void CheckWatermarks();
+
+    // The most blocks of buffer_ given to one SendV.
+    static const size_t kMaxWriteBlocks = 16;
+    static const size_t kDefaultHighWater = 256 * 1024;
+    static const size_t kDefaultLowWater = 64 * 1024;
 
     AsyncSocket * cricket_socket_;
+    // Under cricket_socket_, and any TLS on it.
+    RacingSocketAdapter * racing_socket_;
 #ifdef USE_SSLSTREAM
     StreamInterface *stream_;
+    // The stream StartTls starts TLS on, under any zlib_stream_.
+    StreamInterface *tls_stream_;
+    // Made by the first StartCompression, on top of the rest of stream_,
+    // and kept for the next connection.
+    ZlibStream *zlib_stream_;
 #endif  // USE_SSLSTREAM
     XmppAsyncSocket::State state_;
-    ByteBuffer buffer_;
+    ChainBuffer buffer_;
+    size_t high_water_;
+    size_t low_water_;
+    bool write_blocked_;
     bool tls_;
 };
 
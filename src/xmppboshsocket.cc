@@ -0,0 +1,514 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmppboshsocket.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "constants.h"
+#include "helpers.h"
+#include "httpclient.h"
+#include "logging.h"
+#include "socketpool.h"
+#include "stream.h"
+#include "stringencode.h"
+#include "stringutils.h"
+#include "thread.h"
+#include "time.h"
+#include "xmlelement.h"
+
+namespace txmpp {
+
+namespace {
+
+const char kNsHttpBind[] = "http://jabber.org/protocol/httpbind";
+const char kNsXBosh[] = "urn:xmpp:xbosh";
+const char kContentType[] = "text/xml; charset=utf-8";
+
+// How often outstanding requests are checked for having taken too long.
+const int kCheckIntervalMs = 5 * 1000;
+
+enum { MSG_CONNECTED, MSG_SEND, MSG_POLL, MSG_CHECK, MSG_CLOSED };
+
+std::string EscapeAttr(const std::string& value) {
+  std::string escaped;
+  for (size_t i = 0; i < value.size(); ++i) {
+    switch (value[i]) {
+    case '<': escaped.append("&lt;"); break;
+    case '>': escaped.append("&gt;"); break;
+    case '&': escaped.append("&amp;"); break;
+    case '"': escaped.append("&quot;"); break;
+    default: escaped.push_back(value[i]); break;
+    }
+  }
+  return escaped;
+}
+
+const std::string& BodyAttr(const XmlElement* body, const char* name) {
+  return body->Attr(QName(STR_EMPTY, name));
+}
+
+int BodyAttrInt(const XmlElement* body, const char* name, int fallback) {
+  const std::string& value = BodyAttr(body, name);
+  return value.empty() ? fallback : atoi(value.c_str());
+}
+
+}  // anonymous namespace
+
+XmppBoshSocket::XmppBoshSocket(SocketFactory* factory,
+                               const std::string& url,
+                               const std::string& agent)
+    : thread_(Thread::Current()), factory_(factory), url_(url),
+      agent_(agent), http2_(NULL), pool_(new ConnectionPool(factory)),
+      state_(STATE_CLOSED), error_(ERROR_NONE), socket_error_(0),
+      hold_(kDefaultHold), wait_(kDefaultWait), requests_(kDefaultRequests),
+      polling_(0), next_rid_(0), deliver_rid_(0), create_pending_(false),
+      creating_(false), restart_pending_(false), restart_rid_(0),
+      terminate_pending_(false), terminated_(false), send_posted_(false),
+      check_posted_(false), poll_posted_(false) {
+}
+
+XmppBoshSocket::~XmppBoshSocket() {
+  thread_->Clear(this);
+  for (RequestList::iterator it = outstanding_.begin();
+       it != outstanding_.end(); ++it) {
+    delete (*it)->client;
+    delete *it;
+  }
+  for (size_t i = 0; i < idle_clients_.size(); ++i)
+    delete idle_clients_[i];
+  for (std::map<uint64, XmlElement*>::iterator it = received_.begin();
+       it != received_.end(); ++it) {
+    delete it->second;
+  }
+}
+
+bool XmppBoshSocket::Connect(const SocketAddress& addr) {
+  if (state_ != STATE_CLOSED) {
+    error_ = ERROR_WRONGSTATE;
+    return false;
+  }
+  state_ = STATE_CONNECTING;
+  error_ = ERROR_NONE;
+  socket_error_ = 0;
+  splitter_.Reset();
+  sid_.clear();
+  payload_.clear();
+  input_.clear();
+  create_pending_ = creating_ = restart_pending_ = false;
+  terminate_pending_ = terminated_ = false;
+  restart_rid_ = 0;
+  requests_ = kDefaultRequests;
+  // The first rid is random, leaving room below 2^53 for the session.
+  next_rid_ = deliver_rid_ = CreateRandomNonZeroId();
+  // Nothing is sent until the engine writes its stream header.
+  thread_->Post(this, MSG_CONNECTED);
+  return true;
+}
+
+bool XmppBoshSocket::ConnectAny(const std::vector<SocketAddress>& addrs,
+                                int stagger) {
+  return Connect(SocketAddress());
+}
+
+bool XmppBoshSocket::Read(char* data, size_t len, size_t* len_read) {
+  *len_read = _min(len, input_.size());
+  memcpy(data, input_.data(), *len_read);
+  input_.erase(0, *len_read);
+  return true;
+}
+
+bool XmppBoshSocket::Write(const char* data, size_t len) {
+  if (state_ != STATE_OPEN) {
+    error_ = ERROR_WRONGSTATE;
+    return false;
+  }
+  splitter_.Write(data, len);
+  std::string text;
+  XmppStreamSplitter::Token token;
+  while ((token = splitter_.Next(&text)) != XmppStreamSplitter::TOKEN_NONE) {
+    switch (token) {
+    case XmppStreamSplitter::TOKEN_HEADER:
+      to_ = XmppStreamSplitter::GetAttr(text, "to");
+      lang_ = XmppStreamSplitter::GetAttr(text, "xml:lang");
+      if (sid_.empty() && !creating_) {
+        create_pending_ = true;
+      } else {
+        restart_pending_ = true;
+      }
+      break;
+    case XmppStreamSplitter::TOKEN_ELEMENT:
+      XmppStreamSplitter::AddDefaultNamespace(&text, NS_CLIENT);
+      payload_.append(text);
+      break;
+    case XmppStreamSplitter::TOKEN_CLOSE:
+      terminate_pending_ = true;
+      break;
+    default:
+      break;
+    }
+  }
+  // Stanzas written in the same pass of the message loop share a body.
+  if (!send_posted_) {
+    send_posted_ = true;
+    thread_->Post(this, MSG_SEND);
+  }
+  return true;
+}
+
+bool XmppBoshSocket::Close() {
+  if (state_ == STATE_CLOSED)
+    return false;
+  if (terminate_pending_ && !sid_.empty() && !terminated_) {
+    // Sent on the way out; if it doesn't get there, the session times out.
+    terminated_ = true;
+    SendBody(" type=\"terminate\"", true);
+  }
+  state_ = STATE_CLOSED;
+  SignalClosed();
+  return true;
+}
+
+#if defined(FEATURE_ENABLE_SSL)
+bool XmppBoshSocket::StartTls(const std::string& domainname) {
+  // An https url has TLS already; XEP-0206 servers don't offer STARTTLS.
+  return false;
+}
+#endif
+
+void XmppBoshSocket::OnMessage(Message* msg) {
+  switch (msg->message_id) {
+  case MSG_CONNECTED:
+    if (state_ == STATE_CONNECTING) {
+      state_ = STATE_OPEN;
+      SignalConnected();
+    }
+    break;
+  case MSG_SEND:
+    send_posted_ = false;
+    SendRequests();
+    break;
+  case MSG_POLL:
+    poll_posted_ = false;
+    if ((state_ == STATE_OPEN) && outstanding_.empty())
+      SendBody("", true);
+    break;
+  case MSG_CHECK: {
+    check_posted_ = false;
+    std::vector<Request*> late;
+    for (RequestList::iterator it = outstanding_.begin();
+         it != outstanding_.end();) {
+      if (TimeSince((*it)->sent_at) > wait_ * 1000 + kRequestSlackMs) {
+        late.push_back(*it);
+        it = outstanding_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    for (size_t i = 0; i < late.size(); ++i) {
+      LOG(LS_INFO) << "XmppBoshSocket: request " << late[i]->rid
+                   << " timed out";
+      late[i]->client->reset();
+      Retry(late[i]);
+    }
+    ScheduleCheck();
+    break;
+  }
+  case MSG_CLOSED:
+    SignalClosed();
+    break;
+  }
+}
+
+void XmppBoshSocket::SendRequests() {
+  if ((state_ != STATE_OPEN) || terminated_)
+    return;
+  if (create_pending_) {
+    create_pending_ = false;
+    creating_ = true;
+    std::string body("<body content=\"");
+    body.append(kContentType);
+    body.append("\" hold=\"" + ToString(hold_));
+    body.append("\" rid=\"" + ToString(next_rid_));
+    body.append("\" to=\"" + EscapeAttr(to_));
+    body.append("\" ver=\"1.6\" wait=\"" + ToString(wait_));
+    if (!lang_.empty() && (lang_ != "*"))
+      body.append("\" xml:lang=\"" + EscapeAttr(lang_));
+    body.append("\" xmpp:version=\"1.0\" xmlns=\"");
+    body.append(kNsHttpBind);
+    body.append("\" xmlns:xmpp=\"");
+    body.append(kNsXBosh);
+    body.append("\"/>");
+    Request* request = new Request;
+    request->rid = next_rid_++;
+    request->body = body;
+    request->client = NULL;
+    request->attempts = 0;
+    StartRequest(request);
+    return;
+  }
+  if (creating_ || sid_.empty())
+    return;
+  while ((state_ == STATE_OPEN) && !terminated_
+         && (outstanding_.size() < static_cast<size_t>(requests_))) {
+    if (restart_pending_) {
+      // XEP-0206 restarts the stream with an empty body of its own.
+      restart_pending_ = false;
+      restart_rid_ = next_rid_;
+      std::string attrs(" xmpp:restart=\"true\" xmlns:xmpp=\"");
+      attrs.append(kNsXBosh);
+      attrs.append("\"");
+      SendBody(attrs, false);
+    } else if (terminate_pending_) {
+      terminated_ = true;
+      SendBody(" type=\"terminate\"", true);
+    } else if (!payload_.empty()) {
+      SendBody("", true);
+    } else if (outstanding_.size() < static_cast<size_t>(hold_)) {
+      // For the server to hold until it has something for us.
+      SendBody("", false);
+    } else {
+      break;
+    }
+  }
+  if ((0 == hold_) && (polling_ > 0) && outstanding_.empty()
+      && !poll_posted_ && !terminated_) {
+    // A polling session; ask again after the interval.
+    poll_posted_ = true;
+    thread_->PostDelayed(polling_ * 1000, this, MSG_POLL);
+  }
+}
+
+void XmppBoshSocket::SendBody(const std::string& attrs, bool payload) {
+  std::string body("<body rid=\"" + ToString(next_rid_));
+  body.append("\" sid=\"" + EscapeAttr(sid_));
+  body.append("\" xmlns=\"");
+  body.append(kNsHttpBind);
+  body.append("\"");
+  body.append(attrs);
+  if (payload && !payload_.empty()) {
+    body.append(">");
+    body.append(payload_);
+    body.append("</body>");
+    payload_.clear();
+  } else {
+    body.append("/>");
+  }
+  Request* request = new Request;
+  request->rid = next_rid_++;
+  request->body.swap(body);
+  request->client = NULL;
+  request->attempts = 0;
+  StartRequest(request);
+}
+
+void XmppBoshSocket::StartRequest(Request* request) {
+  if (!request->client) {
+    if (!idle_clients_.empty()) {
+      request->client = idle_clients_.back();
+      idle_clients_.pop_back();
+    } else {
+      request->client = new HttpClient(agent_, pool_.get());
+      request->client->SignalHttpClientComplete.connect(
+          this, &XmppBoshSocket::OnRequestComplete);
+    }
+  }
+  HttpClient* client = request->client;
+  client->prepare_post(url_, kContentType,
+                       new MemoryStream(request->body.data(),
+                                        request->body.size()));
+  client->set_proxy(proxy_);
+  client->set_http2(http2_);
+  client->response().document.reset(new MemoryStream);
+  request->sent_at = Time();
+  ++request->attempts;
+  outstanding_.push_back(request);
+  ScheduleCheck();
+  // May complete at once, if the connection can't be made.
+  client->start();
+}
+
+void XmppBoshSocket::OnRequestComplete(HttpClient* client, int err) {
+  RequestList::iterator it = outstanding_.begin();
+  while ((it != outstanding_.end()) && ((*it)->client != client))
+    ++it;
+  if (it == outstanding_.end())
+    return;
+  Request* request = *it;
+  outstanding_.erase(it);
+  if (state_ == STATE_CLOSED) {
+    idle_clients_.push_back(client);
+    delete request;
+    return;
+  }
+
+  uint32 scode = client->response().scode;
+  if ((HE_NONE != err) || (HC_OK != scode)) {
+    LOG(LS_WARNING) << "XmppBoshSocket: request " << request->rid
+                    << " failed: " << err << " " << scode;
+    // HTTP errors are the server ending the session; anything else may
+    // not have arrived.
+    if ((HE_NONE == err) && !HttpCodeIsServerError(scode)) {
+      idle_clients_.push_back(client);
+      delete request;
+      Fail(ECONNRESET);
+    } else {
+      Retry(request);
+    }
+    return;
+  }
+
+  std::string text;
+  MemoryStream* document =
+      static_cast<MemoryStream*>(client->response().document.get());
+  size_t size = 0;
+  if (document && document->GetSize(&size))
+    text.assign(document->GetBuffer(), size);
+  idle_clients_.push_back(client);
+  uint64 rid = request->rid;
+  delete request;
+
+  XmlElement* body = XmlElement::ForStr(text);
+  if (!body || (body->Name() != QName(kNsHttpBind, "body"))) {
+    LOG(LS_WARNING) << "XmppBoshSocket: not a body: " << text;
+    delete body;
+    Fail(ECONNRESET);
+    return;
+  }
+  received_[rid] = body;
+  Deliver();
+  if ((state_ == STATE_OPEN) && !send_posted_) {
+    send_posted_ = true;
+    thread_->Post(this, MSG_SEND);
+  }
+}
+
+void XmppBoshSocket::Retry(Request* request) {
+  if (state_ == STATE_CLOSED) {
+    idle_clients_.push_back(request->client);
+    delete request;
+  } else if (request->attempts < kMaxAttempts) {
+    // XEP-0124 has a request that may not have arrived sent again as it
+    // was, rid and all.
+    StartRequest(request);
+  } else {
+    idle_clients_.push_back(request->client);
+    delete request;
+    Fail(ECONNRESET);
+  }
+}
+
+void XmppBoshSocket::Deliver() {
+  size_t before = input_.size();
+  std::map<uint64, XmlElement*>::iterator it;
+  while ((state_ == STATE_OPEN)
+         && ((it = received_.find(deliver_rid_)) != received_.end())) {
+    XmlElement* body = it->second;
+    received_.erase(it);
+    ProcessBody(deliver_rid_++, body);
+    delete body;
+  }
+  if (input_.size() > before)
+    SignalRead();
+}
+
+void XmppBoshSocket::ProcessBody(uint64 rid, const XmlElement* body) {
+  bool terminate = (BodyAttr(body, "type") == "terminate");
+  if (creating_) {
+    creating_ = false;
+    sid_ = BodyAttr(body, "sid");
+    if (sid_.empty() && !terminate) {
+      LOG(LS_WARNING) << "XmppBoshSocket: no session created";
+      Fail(ECONNREFUSED);
+      return;
+    }
+    // The server may lower what was asked for.
+    hold_ = BodyAttrInt(body, "hold", hold_);
+    wait_ = BodyAttrInt(body, "wait", wait_);
+    requests_ = _max(BodyAttrInt(body, "requests", hold_ + 1), 1);
+    polling_ = BodyAttrInt(body, "polling", 0);
+    from_ = BodyAttr(body, "from");
+    if (from_.empty())
+      from_ = to_;
+    if (!terminate)
+      AppendStreamHeader();
+  } else if (rid == restart_rid_) {
+    restart_rid_ = 0;
+    AppendStreamHeader();
+  }
+  for (const XmlElement* child = body->FirstElement(); child;
+       child = child->NextElement()) {
+    input_.append(child->Str());
+  }
+  if (terminate) {
+    const std::string& condition = BodyAttr(body, "condition");
+    LOG(LS_INFO) << "XmppBoshSocket: session terminated " << condition;
+    if (!sid_.empty())
+      input_.append("</stream:stream>");
+    Fail(condition.empty() ? 0 : ECONNRESET);
+  }
+}
+
+void XmppBoshSocket::AppendStreamHeader() {
+  input_.append("<stream:stream xmlns=\"");
+  input_.append(NS_CLIENT);
+  input_.append("\" xmlns:stream=\"");
+  input_.append(NS_STREAM);
+  input_.append("\" version=\"1.0\" from=\"");
+  input_.append(EscapeAttr(from_));
+  input_.append("\" id=\"");
+  input_.append(EscapeAttr(sid_));
+  input_.append("\">");
+}
+
+void XmppBoshSocket::Fail(int error) {
+  if (state_ == STATE_CLOSED)
+    return;
+  state_ = STATE_CLOSED;
+  socket_error_ = error;
+  error_ = error ? ERROR_WINSOCK : ERROR_NONE;
+  // Taken off the list first, so that the clients finishing aren't heard.
+  RequestList dropped;
+  dropped.swap(outstanding_);
+  for (RequestList::iterator it = dropped.begin(); it != dropped.end();
+       ++it) {
+    (*it)->client->reset();
+    idle_clients_.push_back((*it)->client);
+    delete *it;
+  }
+  thread_->Post(this, MSG_CLOSED);
+}
+
+void XmppBoshSocket::ScheduleCheck() {
+  if (!check_posted_ && !outstanding_.empty()) {
+    check_posted_ = true;
+    thread_->PostDelayed(kCheckIntervalMs, this, MSG_CHECK);
+  }
+}
+
+}  // namespace txmpp
@@ -0,0 +1,186 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMPPBOSHSOCKET_H_
+#define _TXMPP_XMPPBOSHSOCKET_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "messagehandler.h"
+#include "proxyinfo.h"
+#include "scoped_ptr.h"
+#include "sigslot.h"
+#include "xmppasyncsocket.h"
+#include "xmppstreamsplitter.h"
+
+namespace txmpp {
+
+class ConnectionPool;
+class Http2Pool;
+class HttpClient;
+class SocketFactory;
+class Thread;
+class XmlElement;
+
+// Carries an XMPP stream over HTTP, by BOSH (XEP-0124 and XEP-0206), for
+// networks that let nothing else through. What the engine writes is split
+// into stanzas, and those written together are sent in one request body;
+// the stanzas the server returns are handed to the engine as a stream,
+// with the stream headers it expects made up from the session. The server
+// is kept holding `hold' requests, which it answers as soon as it has
+// something to send, so that it can push stanzas at any time. Requests
+// go out on kept-alive connections from a pool of the socket's own, or
+// as streams of a shared HTTP/2 connection.
+//
+// The address given to Connect is ignored; the connection manager at the
+// url is used. TLS, if any, is that of an https url, so the client must
+// not ask for StartTls, and compression is left to HTTP.
+class XmppBoshSocket : public XmppAsyncSocket, public MessageHandler,
+                       public has_slots<> {
+ public:
+  // The hold and wait asked for, and the most requests outstanding until
+  // the server says how many it allows.
+  static const int kDefaultHold = 1;
+  static const int kDefaultWait = 60;
+  static const int kDefaultRequests = 2;
+  // A request gets this long beyond the wait before it is given up on and
+  // sent again.
+  static const int kRequestSlackMs = 10 * 1000;
+  // The times a request is sent before the session is given up on.
+  static const int kMaxAttempts = 3;
+
+  XmppBoshSocket(SocketFactory* factory, const std::string& url,
+                 const std::string& agent);
+  virtual ~XmppBoshSocket();
+
+  void set_proxy(const ProxyInfo& proxy) { proxy_ = proxy; }
+  const ProxyInfo& proxy() const { return proxy_; }
+  // The requests the server is asked to hold, and how long it may hold
+  // each, in seconds. Must be set before connecting.
+  void set_hold(int hold) { hold_ = hold; }
+  int hold() const { return hold_; }
+  void set_wait(int wait) { wait_ = wait; }
+  int wait() const { return wait_; }
+  // Sends requests as HTTP/2 streams where the server speaks it.
+  void set_http2(Http2Pool* http2) { http2_ = http2; }
+
+  // The session's id, once the server has created it.
+  const std::string& sid() const { return sid_; }
+  // The requests outstanding.
+  size_t outstanding() const { return outstanding_.size(); }
+
+  // XmppAsyncSocket
+  virtual State state() { return state_; }
+  virtual Error error() { return error_; }
+  virtual int GetError() { return socket_error_; }
+  virtual bool Connect(const SocketAddress& addr);
+  virtual bool ConnectAny(const std::vector<SocketAddress>& addrs,
+                          int stagger);
+  virtual bool Read(char* data, size_t len, size_t* len_read);
+  virtual bool Write(const char* data, size_t len);
+  virtual bool Close();
+  virtual size_t QueuedBytes() { return payload_.size(); }
+#if defined(FEATURE_ENABLE_SSL)
+  virtual bool StartTls(const std::string& domainname);
+#endif
+
+ private:
+  struct Request {
+    uint64 rid;
+    std::string body;
+    HttpClient* client;
+    uint32 sent_at;
+    int attempts;
+  };
+  typedef std::list<Request*> RequestList;
+
+  virtual void OnMessage(Message* msg);
+  void OnRequestComplete(HttpClient* client, int err);
+
+  // Sends what waits, and empty requests for the server to hold, as far as
+  // the limit on outstanding requests allows.
+  void SendRequests();
+  // Sends a body with |attrs| and the stanzas waiting, if |payload|.
+  void SendBody(const std::string& attrs, bool payload);
+  void StartRequest(Request* request);
+  // Sends a request that went unanswered again, or gives up the session.
+  void Retry(Request* request);
+  // Hands the stanzas of the bodies received to the reader, in rid order.
+  void Deliver();
+  void ProcessBody(uint64 rid, const XmlElement* body);
+  // Appends the stream header the engine expects on a new or restarted
+  // stream.
+  void AppendStreamHeader();
+  // Ends the session, with an error unless |error| is 0.
+  void Fail(int error);
+  void ScheduleCheck();
+
+  Thread* thread_;
+  SocketFactory* factory_;
+  std::string url_, agent_;
+  ProxyInfo proxy_;
+  Http2Pool* http2_;
+  scoped_ptr<ConnectionPool> pool_;
+  State state_;
+  Error error_;
+  int socket_error_;
+  int hold_, wait_, requests_, polling_;
+  XmppStreamSplitter splitter_;
+  // From the engine's stream header.
+  std::string to_, lang_;
+  std::string sid_, from_;
+  uint64 next_rid_, deliver_rid_;
+  // Stanzas waiting to be sent, and what else the next body says.
+  std::string payload_;
+  bool create_pending_, creating_, restart_pending_;
+  // The request that restarted the stream, whose response begins the new
+  // one.
+  uint64 restart_rid_;
+  bool terminate_pending_, terminated_;
+  RequestList outstanding_;
+  std::vector<HttpClient*> idle_clients_;
+  // Bodies received ahead of one still outstanding.
+  std::map<uint64, XmlElement*> received_;
+  // What the reader is yet to take.
+  std::string input_;
+  bool send_posted_, check_posted_, poll_posted_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(XmppBoshSocket);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMPPBOSHSOCKET_H_
@@ -27,13 +27,24 @@
 
 #include "xmppclient.h"
 
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
 #include "xmpptask.h"
 #include "constants.h"
+#include "keepalivescheduler.h"
+#include "logging.h"
+#include "nethelpers.h"
 #include "sigslot.h"
 #include "saslplainmechanism.h"
 #include "prexmppauth.h"
 #include "scoped_ptr.h"
 #include "plainsaslhandler.h"
+#include "socket.h"
+#include "thread.h"
+#include "time.h"
+#include "xmppstats.h"
 
 namespace txmpp {
 
@@ -47,7 +58,10 @@ TaskParent* XmppClient::GetParent(int code) {
 class XmppClient::Private :
     public has_slots<>,
     public XmppSessionHandler,
-    public XmppOutputHandler {
+    public XmppOutputHandler,
+    public XmppIqHandler,
+    public KeepAliveScheduler::Connection,
+    public MessageHandler {
 public:
 
   Private(XmppClient * client) :
@@ -58,7 +72,51 @@ public:
     pre_engine_error_(XmppEngine::ERROR_NONE),
     pre_engine_subcode_(0),
     signal_closed_(false),
-    allow_plain_(false) {}
+    allow_plain_(false),
+    read_size_(kMinReadSize),
+    thread_(NULL),
+    corked_(false),
+    cork_delay_ms_(0),
+    watermarks_set_(false),
+    high_water_(0),
+    low_water_(0),
+    stream_management_(false),
+    ack_interval_(0),
+    compression_(false),
+    compression_level_(-1),
+    compression_window_bits_(15),
+    binary_xml_(false),
+    prioritize_input_(false),
+    presence_coalescing_(-1),
+    offload_pool_(NULL),
+    offload_size_(0),
+    handler_pool_(NULL),
+    stanza_stats_(NULL),
+    text_sink_(NULL),
+    use_srv_(false),
+    connect_stagger_(0),
+    srv_resolver_(NULL),
+    srv_done_(false),
+    idle_trim_ms_(0),
+    trim_pending_(false),
+    last_active_(0),
+    keepalive_(NULL),
+    keepalive_added_(false),
+    last_write_(0),
+    ping_cookie_(NULL),
+    bytes_in_(0),
+    bytes_out_(0),
+    reconnects_(0),
+    state_(XmppEngine::STATE_NONE),
+    state_start_(0) {
+    memset(state_us_, 0, sizeof(state_us_));
+  }
+
+  ~Private() {
+    StopKeepAlive();
+    if (srv_resolver_)
+      srv_resolver_->Destroy(false);
+  }
 
   // the owner
   XmppClient * const client_;
@@ -78,16 +136,125 @@ public:
   bool signal_closed_;
   bool allow_plain_;
 
+  // OnSocketRead asks for read_size_ bytes at a time. This doubles while
+  // reads fill it, up to kMaxReadSize, and halves again when they come in
+  // well under it. Once kReadBudget bytes have been read for one event,
+  // the rest is left to a MSG_READ, so other sockets get their turn.
+  enum {
+    kMinReadSize = 4096,
+    kMaxReadSize = 64 * 1024,
+    kReadBudget = 256 * 1024,
+  };
+  enum { MSG_READ, MSG_FLUSH, MSG_TRIM };
+  size_t read_size_;
+
+  // The thread the socket runs on, taken once at Connect for the posts on
+  // every read and every output.  NULL without one, and then there are no
+  // timers.
+  Thread * thread_;
+
+  // With corked_, the engine's output is flushed by a MSG_FLUSH, posted
+  // cork_delay_ms_ after the engine starts holding it.
+  bool corked_;
+  int cork_delay_ms_;
+
+  // The shaping for each engine.
+  XmppShaping shaping_;
+
+  // The watermarks for the socket, if SetWriteWatermarks came first.
+  bool watermarks_set_;
+  size_t high_water_;
+  size_t low_water_;
+
+  // Stream management for the next engine, and the stream it is to resume.
+  bool stream_management_;
+  int ack_interval_;
+  scoped_ptr<XmppResumeState> resume_state_;
+
+  // Compression for the next engine.
+  bool compression_;
+  int compression_level_;
+  int compression_window_bits_;
+  bool binary_xml_;
+  bool prioritize_input_;
+  int presence_coalescing_;
+  ThreadPool* offload_pool_;
+  size_t offload_size_;
+  ThreadPool* handler_pool_;
+  StanzaStats* stanza_stats_;
+  XmppTextSink* text_sink_;
+
+  // The SRV lookup for the connection, while use_srv_, and the targets it
+  // found once srv_done_.
+  bool use_srv_;
+  std::string srv_domain_;
+  int connect_stagger_;
+  AsyncSrvResolver * srv_resolver_;
+  bool srv_done_;
+  std::vector<SrvRecord> srv_records_;
+  // The servers to race instead, if SetServers gave any, or else the
+  // settings' endpoints.
+  std::vector<SocketAddress> servers_;
+  std::vector<XmppEndpoint> endpoints_;
+
+  // With idle_trim_ms_, a MSG_TRIM is pending while trim_pending_, to trim
+  // once idle_trim_ms_ have passed since last_active_. It is posted by the
+  // first read or write after a trim, so an idle connection has no timer.
+  int idle_trim_ms_;
+  bool trim_pending_;
+  uint32 last_active_;
+  void NoteActivity();
+  size_t TrimMemory();
+
+  // The scheduler keeping the stream alive, which has this connection
+  // while keepalive_added_: from STATE_OPEN until it closes.
+  KeepAliveScheduler * keepalive_;
+  bool keepalive_added_;
+  uint32 last_write_;
+  XmppIqCookie ping_cookie_;
+  void StartKeepAlive();
+  void StopKeepAlive();
+
+  // What GetStats reports besides the socket's and the engine's own
+  // figures. The engine's state_ began at state_start_, in TimeMicros().
+  XmppEngineCounters counters_;
+  uint64 bytes_in_;
+  uint64 bytes_out_;
+  uint32 reconnects_;
+  XmppEngine::State state_;
+  uint64 state_start_;
+  uint64 state_us_[XmppEngine::STATE_CLOSED + 1];
+  void SetState(XmppEngine::State state);
+
+  // KeepAliveScheduler::Connection
+  virtual uint32 LastWriteTime() { return last_write_; }
+  virtual void SendWhitespace();
+  virtual bool SendPing();
+  virtual void OnPingTimeout();
+  virtual int RetransmitTimeoutMs();
+
+  // the reply to a ping
+  virtual void IqResponse(XmppIqCookie cookie, const XmlElement * stanza);
+
   // implementations of interfaces
   void OnStateChange(int state);
   void WriteOutput(const char * bytes, size_t len);
+  void WriteOutputChain(ChainBuffer * output);
   void StartTls(const std::string & domainname);
+  bool StartCompression(int level, int window_bits);
   void CloseConnection();
+  void OutputPending();
+  void OutputDelayed(int delay_ms);
 
   // slots for socket signals
   void OnSocketConnected();
   void OnSocketRead();
   void OnSocketClosed();
+  void OnSocketWriteBlocked() { client_->SignalWriteBlocked(); }
+  void OnSocketWritable() { client_->SignalWritable(); }
+  void OnSrvResolved(SignalThread * thread);
+
+  virtual void OnMessage(Message * msg);
 };
 
 XmppReturnStatus
@@ -98,10 +265,16 @@ XmppClient::Connect(const XmppClientSettings & settings, const std::string & lan
     return XMPP_RETURN_BADSTATE;
 
   d_->socket_.reset(socket);
+  d_->thread_ = Thread::Current();
 
   d_->socket_->SignalConnected.connect(d_.get(), &Private::OnSocketConnected);
   d_->socket_->SignalRead.connect(d_.get(), &Private::OnSocketRead);
   d_->socket_->SignalClosed.connect(d_.get(), &Private::OnSocketClosed);
+  d_->socket_->SignalWriteBlocked.connect(d_.get(),
+                                          &Private::OnSocketWriteBlocked);
+  d_->socket_->SignalWritable.connect(d_.get(), &Private::OnSocketWritable);
+  if (d_->watermarks_set_)
+    d_->socket_->SetWriteWatermarks(d_->high_water_, d_->low_water_);
 
   d_->engine_.reset(XmppEngine::Create());
   d_->engine_->SetSessionHandler(d_.get());
@@ -109,7 +282,33 @@ XmppClient::Connect(const XmppClientSettings & settings, const std::string & lan
   if (!settings.resource().empty()) {
     d_->engine_->SetRequestedResource(settings.resource());
   }
-  d_->engine_->SetUseTls(settings.use_tls());
+  // A trusted local socket needs no TLS.
+  bool trusted = settings.trust_local_socket() && settings.server().IsUnix();
+  d_->engine_->SetUseTls(settings.use_tls() && !trusted);
+  d_->engine_->SetSkipTls(trusted);
+  d_->engine_->SetPipelinedLogin(settings.pipelined_login());
+  d_->engine_->SetCorked(d_->corked_);
+  d_->engine_->SetShaping(d_->shaping_);
+  d_->engine_->SetCompression(d_->compression_, d_->compression_level_,
+                              d_->compression_window_bits_);
+  d_->engine_->SetBinaryXml(d_->binary_xml_);
+  d_->engine_->SetPrioritizeInput(d_->prioritize_input_);
+  d_->engine_->SetPresenceCoalescing(d_->presence_coalescing_);
+  d_->engine_->SetStanzaOffload(d_->offload_pool_, d_->offload_size_);
+  d_->engine_->SetHandlerPool(d_->handler_pool_);
+  d_->engine_->SetStanzaStats(d_->stanza_stats_);
+  d_->engine_->SetTextSink(d_->text_sink_);
+  // The round trip is the connection's own, unlike the counts.
+  d_->counters_.rtt.Reset();
+  d_->engine_->SetCounters(&d_->counters_);
+  d_->engine_->SetStreamManagement(d_->stream_management_,
+                                   d_->ack_interval_);
+  if (d_->resume_state_.get()) {
+    d_->engine_->SetResumeState(*d_->resume_state_);
+    d_->reconnects_ = d_->resume_state_->reconnects;
+    d_->resume_state_.reset();
+  }
+  d_->SetState(XmppEngine::STATE_START);
 
   //
   // The talk.google.com server expects you to use "gmail.com" in the
@@ -135,9 +334,15 @@ XmppClient::Connect(const XmppClientSettings & settings, const std::string & lan
   d_->pass_ = settings.pass();
   d_->auth_cookie_ = settings.auth_cookie();
   d_->server_ = settings.server();
+  d_->use_srv_ = settings.use_srv();
+  d_->srv_domain_ = settings.host();
+  d_->connect_stagger_ = settings.connect_stagger();
+  d_->srv_done_ = false;
+  d_->srv_records_.clear();
+  d_->endpoints_ = settings.endpoints();
   d_->proxy_host_ = settings.proxy_host();
   d_->proxy_port_ = settings.proxy_port();
-  d_->allow_plain_ = settings.allow_plain();
+  d_->allow_plain_ = settings.allow_plain() || trusted;
   d_->pre_auth_.reset(pre_auth);
 
   return XMPP_RETURN_OK;
@@ -248,8 +453,48 @@ XmppClient::ProcessCookieLogin() {
 
 int
 XmppClient::ProcessStartXmppLogin() {
-  // Done with pre-connect tasks - connect!
-  if (!d_->socket_->Connect(d_->server_)) {
+  // A socket opened ahead goes straight to the stream header.
+  if (d_->socket_->state() == XmppAsyncSocket::STATE_OPEN) {
+    d_->engine_->Connect();
+    return STATE_RESPONSE;
+  }
+
+  // Done with pre-connect tasks - look up the servers, if asked to.
+  if (d_->servers_.empty() && d_->endpoints_.empty() &&
+      d_->use_srv_ && !d_->srv_done_) {
+    if (!d_->srv_resolver_) {
+      d_->srv_resolver_ = new AsyncSrvResolver();
+      d_->srv_resolver_->set_name("_xmpp-client._tcp." + d_->srv_domain_);
+      d_->srv_resolver_->SignalWorkDone.connect(d_.get(),
+                                                &Private::OnSrvResolved);
+      d_->srv_resolver_->Start();
+    }
+    return STATE_BLOCKED;
+  }
+
+  // Connect!  The SRV targets are raced in their order, then the server.
+  // Endpoints are raced in a random order weighted as SRV targets are.
+  std::vector<SocketAddress> servers(d_->servers_);
+  if (servers.empty() && !d_->endpoints_.empty()) {
+    std::vector<SrvRecord> records(d_->endpoints_.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+      records[i].weight = d_->endpoints_[i].weight;
+      records[i].port = d_->endpoints_[i].address.port();
+      records[i].target = d_->endpoints_[i].address.IPAsString();
+    }
+    SortSrvRecords(&records);
+    for (size_t i = 0; i < records.size(); ++i)
+      servers.push_back(SocketAddress(records[i].target, records[i].port));
+  } else if (servers.empty()) {
+    for (size_t i = 0; i < d_->srv_records_.size(); ++i) {
+      const SrvRecord & record = d_->srv_records_[i];
+      servers.push_back(SocketAddress(record.target, record.port));
+    }
+    if (!d_->server_.IsNil() &&
+        std::find(servers.begin(), servers.end(), d_->server_) == servers.end())
+      servers.push_back(d_->server_);
+  }
+  if (!d_->socket_->ConnectAny(servers, d_->connect_stagger_)) {
     EnsureClosed();
     return STATE_ERROR;
   }
@@ -275,6 +520,17 @@ XmppClient::Disconnect() {
   return XMPP_RETURN_OK;
 }
 
+void
+XmppClient::OnNetworksChanged() {
+  if (d_->socket_.get() == NULL || d_->engine_.get() == NULL)
+    return;
+  XmppEngine::State state = d_->engine_->GetState();
+  if (state == XmppEngine::STATE_NONE || state == XmppEngine::STATE_CLOSED)
+    return;
+  LOG(LS_INFO) << "XmppClient dropping its connection as the networks changed";
+  d_->engine_->ConnectionClosed(ENETDOWN);
+}
+
 XmppClient::XmppClient(TaskParent * parent)
     : Task(parent),
       delivering_signal_(false),
@@ -293,7 +549,7 @@ XmppClient::jid() {
 }
 
 
-std::string
+XmppId
 XmppClient::NextId() {
   return d_->engine_->NextId();
 }
@@ -303,6 +559,13 @@ XmppClient::SendStanza(const XmlElement * stanza) {
   return d_->engine_->SendStanza(stanza);
 }
 
+XmppReturnStatus
+XmppClient::SendPreparedStanza(const PreparedStanza * stanza,
+                               const std::string & to,
+                               const std::string & id) {
+  return d_->engine_->SendPreparedStanza(stanza, to, id);
+}
+
 XmppReturnStatus
 XmppClient::SendStanzaError(const XmlElement * old_stanza, XmppStanzaError xse, const std::string & message) {
   return d_->engine_->SendStanzaError(old_stanza, xse, message);
@@ -313,11 +576,215 @@ XmppClient::SendRaw(const std::string & text) {
   return d_->engine_->SendRaw(text);
 }
 
+XmppReturnStatus
+XmppClient::SendStanzaText(std::string * text) {
+  return d_->engine_->SendStanzaText(text);
+}
+
+void
+XmppClient::SetCorked(bool corked, int delay_us) {
+  d_->corked_ = corked;
+  // Delayed messages are timed in milliseconds.
+  d_->cork_delay_ms_ = (delay_us > 0) ? (delay_us + 999) / 1000 : 0;
+  if (d_->engine_.get())
+    d_->engine_->SetCorked(corked);
+}
+
+size_t
+XmppClient::TrimMemory() {
+  if (!d_->socket_.get() || !d_->engine_.get())
+    return 0;
+  return d_->TrimMemory();
+}
+
+void
+XmppClient::SetIdleTrim(int idle_ms) {
+  d_->idle_trim_ms_ = idle_ms;
+  if (d_->engine_.get())
+    d_->NoteActivity();
+}
+
+XmppReturnStatus
+XmppClient::Flush() {
+  if (!d_->engine_.get())
+    return XMPP_RETURN_BADSTATE;
+  return d_->engine_->Flush();
+}
+
+void
+XmppClient::SetShaping(const XmppShaping& shaping) {
+  d_->shaping_ = shaping;
+  if (d_->engine_.get())
+    d_->engine_->SetShaping(shaping);
+}
+
+size_t
+XmppClient::ShapedStanzaCount() {
+  if (!d_->engine_.get())
+    return 0;
+  return d_->engine_->GetShapedStanzaCount();
+}
+
+size_t
+XmppClient::QueuedBytes() {
+  if (!d_->socket_.get())
+    return 0;
+  return d_->socket_->QueuedBytes();
+}
+
+void
+XmppClient::GetStats(XmppClientStats* stats) {
+  *stats = XmppClientStats();
+  stats->bytes_in = d_->bytes_in_;
+  stats->bytes_out = d_->bytes_out_;
+  if (d_->socket_.get()) {
+    stats->wire_bytes_in = d_->socket_->WireBytesReceived();
+    stats->wire_bytes_out = d_->socket_->WireBytesSent();
+    stats->queued_bytes = d_->socket_->QueuedBytes();
+  }
+  for (int kind = 0; kind < XMPP_STANZA_KIND_COUNT; ++kind) {
+    stats->stanzas_in[kind] = d_->counters_.stanzas_in[kind];
+    stats->stanzas_out[kind] = d_->counters_.stanzas_out[kind];
+  }
+  stats->presence_coalesced = d_->counters_.presence_coalesced;
+  d_->counters_.iq_latency.GetSnapshot(&stats->iq_latency);
+  const RttEstimator& rtt = d_->counters_.rtt;
+  if (rtt.HasEstimate()) {
+    stats->srtt_us = rtt.srtt_us();
+    stats->rttvar_us = rtt.rttvar_us();
+    stats->rto_ms = rtt.RtoMs();
+  }
+  if (d_->engine_.get())
+    stats->parser_bytes = d_->engine_->GetParserBufferSize();
+  stats->reconnects = d_->reconnects_;
+  memcpy(stats->state_us, d_->state_us_, sizeof(stats->state_us));
+  if (d_->state_ != XmppEngine::STATE_NONE)
+    stats->state_us[d_->state_] += TimeMicros() - d_->state_start_;
+}
+
+const RttEstimator&
+XmppClient::Rtt() const {
+  return d_->counters_.rtt;
+}
+
+void
+XmppClient::SetWriteWatermarks(size_t high, size_t low) {
+  d_->watermarks_set_ = true;
+  d_->high_water_ = high;
+  d_->low_water_ = low;
+  if (d_->socket_.get())
+    d_->socket_->SetWriteWatermarks(high, low);
+}
+
+void
+XmppClient::SetCompression(bool enable, int level, int window_bits) {
+  d_->compression_ = enable;
+  d_->compression_level_ = level;
+  d_->compression_window_bits_ = window_bits;
+}
+
+void
+XmppClient::SetBinaryXml(bool enable) {
+  d_->binary_xml_ = enable;
+}
+
+void
+XmppClient::SetPrioritizeInput(bool prioritize) {
+  d_->prioritize_input_ = prioritize;
+  if (d_->engine_.get())
+    d_->engine_->SetPrioritizeInput(prioritize);
+}
+
+void
+XmppClient::SetPresenceCoalescing(int window_ms) {
+  d_->presence_coalescing_ = window_ms;
+  if (d_->engine_.get())
+    d_->engine_->SetPresenceCoalescing(window_ms);
+}
+
+void
+XmppClient::SetStanzaOffload(ThreadPool* pool, size_t size) {
+  d_->offload_pool_ = pool;
+  d_->offload_size_ = size;
+}
+
+void
+XmppClient::SetHandlerPool(ThreadPool* pool) {
+  d_->handler_pool_ = pool;
+}
+
+void
+XmppClient::SetStanzaStats(StanzaStats* stats) {
+  d_->stanza_stats_ = stats;
+}
+
+void
+XmppClient::SetTextSink(XmppTextSink* sink) {
+  d_->text_sink_ = sink;
+  if (d_->engine_.get())
+    d_->engine_->SetTextSink(sink);
+}
+
+void
+XmppClient::SetStreamManagement(bool enable, int ack_interval) {
+  d_->stream_management_ = enable;
+  d_->ack_interval_ = ack_interval;
+}
+
+void
+XmppClient::SetResumeState(const XmppResumeState & state) {
+  d_->resume_state_.reset(new XmppResumeState(state));
+}
+
+bool
+XmppClient::GetResumeState(XmppResumeState * state) {
+  if (!d_->engine_.get() || !d_->engine_->GetResumeState(state))
+    return false;
+  state->reconnects = d_->reconnects_ + 1;
+  return true;
+}
+
+SocketAddress
+XmppClient::GetRemoteAddress() {
+  if (d_->socket_.get() == NULL)
+    return SocketAddress();
+  return d_->socket_->GetRemoteAddress();
+}
+
+void
+XmppClient::SetServers(const std::vector<SocketAddress> & servers) {
+  d_->servers_ = servers;
+}
+
+void
+XmppClient::SetKeepAlive(KeepAliveScheduler* scheduler) {
+  if (scheduler == d_->keepalive_)
+    return;
+  d_->StopKeepAlive();
+  d_->keepalive_ = scheduler;
+  if (d_->engine_.get() && d_->engine_->GetState() == XmppEngine::STATE_OPEN)
+    d_->StartKeepAlive();
+}
+
 XmppEngine*
 XmppClient::engine() {
   return d_->engine_.get();
 }
 
+void
+XmppClient::Private::OnSrvResolved(SignalThread * thread) {
+  ASSERT(thread == srv_resolver_);
+  srv_records_ = srv_resolver_->records();
+  if (srv_records_.empty()) {
+    LOG(LS_INFO) << "No SRV records for " << srv_resolver_->name()
+                 << ", error " << srv_resolver_->error();
+  }
+  srv_resolver_->Release();
+  srv_resolver_ = NULL;
+  srv_done_ = true;
+  client_->Wake();
+}
+
 void
 XmppClient::Private::OnSocketConnected() {
   engine_->Connect();
@@ -325,25 +792,115 @@ XmppClient::Private::OnSocketConnected() {
 
 void
 XmppClient::Private::OnSocketRead() {
-  char bytes[4096];
-  size_t bytes_read;
+  char buffer[kMinReadSize];
+  size_t budget = kReadBudget;
   for (;;) {
-    if (!socket_->Read(bytes, sizeof(bytes), &bytes_read)) {
+    // Reads straight into the parser's buffer when the engine can take
+    // input, so that the bytes aren't copied again to be parsed.
+    size_t size = read_size_;
+    char * bytes = engine_->GetInputBuffer(size);
+    if (!bytes) {
+      bytes = buffer;
+      size = sizeof(buffer);
+    }
+    size_t bytes_read;
+    if (!socket_->Read(bytes, size, &bytes_read)) {
       // TODO: deal with error information
       return;
     }
 
     if (bytes_read == 0)
       return;
+    NoteActivity();
+    bytes_in_ += bytes_read;
 
 //#ifdef _DEBUG
     client_->SignalLogInput(bytes, bytes_read);
 //#endif
 
-    engine_->HandleInput(bytes, bytes_read);
+    if (bytes == buffer)
+      engine_->HandleInput(bytes, bytes_read);
+    else
+      engine_->HandleInputBuffer(bytes_read);
+
+    if (bytes_read == size && bytes != buffer) {
+      read_size_ = _min(read_size_ * 2, static_cast<size_t>(kMaxReadSize));
+    } else if (bytes_read < size / 4) {
+      read_size_ = _max(read_size_ / 2, static_cast<size_t>(kMinReadSize));
+    }
+
+    if (bytes_read < budget) {
+      budget -= bytes_read;
+    } else if (thread_) {
+      thread_->Post(this, MSG_READ);
+      return;
+    }
+  }
+}
+
+void
+XmppClient::Private::OnMessage(Message * msg) {
+  if (msg->message_id == MSG_TRIM)
+    trim_pending_ = false;
+  if (!socket_.get() || !engine_.get())
+    return;
+  if (msg->message_id == MSG_FLUSH) {
+    engine_->Flush();
+  } else if (msg->message_id == MSG_TRIM) {
+    if (idle_trim_ms_ <= 0)
+      return;
+    int32 idle = TimeSince(last_active_);
+    if (idle >= idle_trim_ms_) {
+      client_->SignalMemoryTrimmed(TrimMemory());
+    } else {
+      thread_->PostDelayed(idle_trim_ms_ - idle, this, MSG_TRIM);
+      trim_pending_ = true;
+    }
+  } else {
+    ASSERT(msg->message_id == MSG_READ);
+    OnSocketRead();
   }
 }
 
+void
+XmppClient::Private::NoteActivity() {
+  if (idle_trim_ms_ <= 0)
+    return;
+  last_active_ = Time();
+  if (!trim_pending_) {
+    if (thread_) {
+      thread_->PostDelayed(idle_trim_ms_, this, MSG_TRIM);
+      trim_pending_ = true;
+    }
+  }
+}
+
+size_t
+XmppClient::Private::TrimMemory() {
+  // The next read asks the engine for a small buffer again.
+  read_size_ = kMinReadSize;
+  return engine_->TrimMemory() + socket_->TrimMemory();
+}
+
+void
+XmppClient::Private::OutputPending() {
+  if (thread_ == NULL) {
+    engine_->Flush();
+  } else if (cork_delay_ms_ > 0) {
+    thread_->PostDelayed(cork_delay_ms_, this, MSG_FLUSH);
+  } else {
+    thread_->Post(this, MSG_FLUSH);
+  }
+}
+
+void
+XmppClient::Private::OutputDelayed(int delay_ms) {
+  // Without a thread there are no timers, and the stanzas wait for the
+  // next Flush.
+  if (thread_)
+    thread_->PostDelayed(delay_ms, this, MSG_FLUSH);
+}
+
 void
 XmppClient::Private::OnSocketClosed() {
   int code = socket_->GetError();
@@ -352,6 +909,18 @@ XmppClient::Private::OnSocketClosed() {
 
 void
 XmppClient::Private::OnStateChange(int state) {
+  SetState(static_cast<XmppEngine::State>(state));
+  if (state == XmppEngine::STATE_OPEN) {
+    // By now the kernel has timed the handshakes, and the iqs answered
+    // refine it from here.
+    uint32 rtt_us, rttvar_us;
+    if (socket_->GetKernelRtt(&rtt_us, &rttvar_us))
+      counters_.rtt.Seed(rtt_us, rttvar_us);
+    StartKeepAlive();
+  } else if (state == XmppEngine::STATE_CLOSED) {
+    StopKeepAlive();
+  }
+
   if (state == XmppEngine::STATE_CLOSED) {
     client_->EnsureClosed();
   }
@@ -368,10 +937,107 @@ XmppClient::Private::WriteOutput(const char * bytes, size_t len) {
   client_->SignalLogOutput(bytes, len);
 //#endif
 
+  NoteActivity();
+  last_write_ = CachedTime();
+  bytes_out_ += len;
   socket_->Write(bytes, len);
   // TODO: deal with error information
 }
 
+void
+XmppClient::Private::WriteOutputChain(ChainBuffer * output) {
+
+//#ifdef _DEBUG
+  for (size_t i = 0; i < output->BlockCount(); ++i) {
+    IoVec block = output->Block(i);
+    client_->SignalLogOutput(static_cast<const char *>(block.data),
+                             static_cast<int>(block.len));
+  }
+//#endif
+
+  NoteActivity();
+  last_write_ = CachedTime();
+  bytes_out_ += output->Length();
+  socket_->WriteChain(output);
+  // TODO: deal with error information
+}
+
+void
+XmppClient::Private::SetState(XmppEngine::State state) {
+  uint64 now = TimeMicros();
+  if (state_ != XmppEngine::STATE_NONE)
+    state_us_[state_] += now - state_start_;
+  state_ = state;
+  state_start_ = now;
+}
+
+void
+XmppClient::Private::StartKeepAlive() {
+  if (keepalive_ && !keepalive_added_) {
+    last_write_ = CachedTime();
+    keepalive_added_ = true;
+    keepalive_->Add(this);
+  }
+}
+
+void
+XmppClient::Private::StopKeepAlive() {
+  if (keepalive_added_) {
+    keepalive_added_ = false;
+    keepalive_->Remove(this);
+  }
+  // The engine's iq handlers go with it; only the cookie is dropped.
+  ping_cookie_ = NULL;
+}
+
+void
+XmppClient::Private::SendWhitespace() {
+  if (engine_.get())
+    engine_->SendRaw(" ");
+}
+
+bool
+XmppClient::Private::SendPing() {
+  if (!engine_.get())
+    return false;
+  if (ping_cookie_) {
+    engine_->RemoveIqHandler(ping_cookie_, NULL);
+    ping_cookie_ = NULL;
+  }
+  XmlElement iq(QN_IQ);
+  iq.AddAttr(QN_TYPE, STR_GET);
+  iq.AddAttr(QN_TO, engine_->FullJid().domain());
+  iq.AddAttr(QN_ID, engine_->NextId());
+  iq.AddElement(new XmlElement(QN_PING, true));
+  return engine_->SendIq(&iq, this, &ping_cookie_) == XMPP_RETURN_OK;
+}
+
+void
+XmppClient::Private::OnPingTimeout() {
+  // The scheduler has dropped this connection already.
+  keepalive_added_ = false;
+  if (!engine_.get())
+    return;
+  LOG(LS_INFO) << "XmppClient dropping its connection as a ping was lost";
+  engine_->ConnectionClosed(ETIMEDOUT);
+}
+
+int
+XmppClient::Private::RetransmitTimeoutMs() {
+  return counters_.rtt.HasEstimate() ? counters_.rtt.RtoMs() : 0;
+}
+
+void
+XmppClient::Private::IqResponse(XmppIqCookie cookie,
+                                const XmlElement * stanza) {
+  if (cookie != ping_cookie_)
+    return;
+  ping_cookie_ = NULL;
+  // An error reply says the server is there just as well as a result.
+  if (keepalive_added_)
+    keepalive_->OnPingReply(this);
+}
+
 void
 XmppClient::Private::StartTls(const std::string & domain) {
 #if defined(FEATURE_ENABLE_SSL)
@@ -379,6 +1045,11 @@ XmppClient::Private::StartTls(const std::string & domain) {
 #endif
 }
 
+bool
+XmppClient::Private::StartCompression(int level, int window_bits) {
+  return socket_->StartCompression(level, window_bits);
+}
+
 void
 XmppClient::Private::CloseConnection() {
   socket_->Close();
@@ -394,6 +1065,13 @@ XmppClient::RemoveXmppTask(XmppTask * task) {
   d_->engine_->RemoveStanzaHandler(task);
 }
 
+XmlElement *
+XmppClient::TakeIncomingStanza(const XmlElement * stanza, XmlArena ** arena) {
+  if (d_->engine_.get() == NULL)
+    return NULL;
+  return d_->engine_->TakeIncomingStanza(stanza, arena);
+}
+
 void
 XmppClient::EnsureClosed() {
   if (!d_->signal_closed_) {
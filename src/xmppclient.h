@@ -33,6 +33,7 @@
 #endif
 
 #include <string>
+#include <vector>
 #include "basicdefs.h"
 #include "sigslot.h"
 #include "xmppengine.h"
@@ -43,8 +44,11 @@
 namespace txmpp {
 
 class XmppTask;
+class KeepAliveScheduler;
 class PreXmppAuth;
 class CaptchaChallenge;
+class RttEstimator;
+struct XmppClientStats;
 
 // Just some non-colliding number.  Could have picked "1".
 #define XMPP_CLIENT_TASK_CODE 0x366c1e47
@@ -78,6 +82,9 @@ public:
   explicit XmppClient(TaskParent * parent);
   ~XmppClient();
 
+  // Logs in on |socket|.  A socket that is already open, as from
+  // XmppWarmStandby, is used as it is, and the login starts at the stream
+  // header.
   XmppReturnStatus Connect(const XmppClientSettings & settings,
                            const std::string & lang,
                            XmppAsyncSocket * socket,
@@ -105,13 +112,114 @@ public:
   // (if we used GAIA authentication)
   std::string GetAuthCookie();
 
-  std::string NextId();
+  XmppId NextId();
   XmppReturnStatus SendStanza(const XmlElement *stanza);
+  XmppReturnStatus SendPreparedStanza(const PreparedStanza *stanza,
+                                      const std::string & to,
+                                      const std::string & id);
   XmppReturnStatus SendRaw(const std::string & text);
+  // See XmppEngine::SendStanzaText.
+  XmppReturnStatus SendStanzaText(std::string * text);
   XmppReturnStatus SendStanzaError(const XmlElement * pelOriginal,
                        XmppStanzaError code,
                        const std::string & text);
 
+  // Holds output back so that stanzas sent in a burst go out in one write:
+  // once the messages already queued on the thread are handled, or after
+  // |delay_us| microseconds if it is not 0.  The delay is rounded up to the
+  // millisecond.  Uncorking writes what is held.
+  void SetCorked(bool corked, int delay_us = 0);
+  // Writes the output held back while corked.
+  XmppReturnStatus Flush();
+
+  // Frees what the connection keeps for the next read, stanza and TLS
+  // record, as when it has gone idle or memory is short, without closing
+  // the stream.  Returns the bytes freed, as far as can be told.  Expat's
+  // buffer and the zlib state stay as they are.
+  size_t TrimMemory();
+  // Trims once nothing has been read or written for |idle_ms|
+  // milliseconds, raising SignalMemoryTrimmed with the bytes freed.  0, the
+  // default, turns it off.  Uses the thread's timers.
+  void SetIdleTrim(int idle_ms);
+  signal1<size_t> SignalMemoryTrimmed;
+
+  // Shapes the stanzas sent, now and on each Connect, with the thread's
+  // timers sending those held back; see XmppEngine::SetShaping.
+  void SetShaping(const XmppShaping& shaping);
+  // The stanzas held back by shaping.
+  size_t ShapedStanzaCount();
+
+  // The bytes written that the socket has yet to send.
+  size_t QueuedBytes();
+  // Fills in |stats| with what has been counted since Connect.
+  void GetStats(XmppClientStats* stats);
+  // The connection's round trip estimate, for timeouts to adapt to it,
+  // as RttEstimator::TimeoutMs gives them.  It starts from the kernel's
+  // own when the session opens, where the socket can tell, and takes in
+  // the iqs the server answers.
+  const RttEstimator& Rtt() const;
+  // Once QueuedBytes reaches |high|, SignalWriteBlocked is raised, and
+  // SignalWritable when it is back to |low|; a sender can use them to
+  // hold off.  Output is still queued while blocked.
+  void SetWriteWatermarks(size_t high, size_t low);
+  signal0<> SignalWriteBlocked;
+  signal0<> SignalWritable;
+
+  // Has each Connect ask for XEP-0138 zlib compression; see
+  // XmppEngine::SetCompression.
+  void SetCompression(bool enable, int level = -1, int window_bits = 15);
+  // Has each Connect ask for the binary XML encoding; see
+  // XmppEngine::SetBinaryXml.
+  void SetBinaryXml(bool enable);
+  // Hands the iqs of each read to the tasks before its messages and
+  // presence, now and on each Connect; see XmppEngine::SetPrioritizeInput.
+  void SetPrioritizeInput(bool prioritize);
+  // Hands the tasks only the last presence each full JID sends within
+  // |window_ms|, now and on each Connect; see
+  // XmppEngine::SetPresenceCoalescing.
+  void SetPresenceCoalescing(int window_ms);
+  // Has each Connect build large stanzas on |pool|; see
+  // XmppEngine::SetStanzaOffload.
+  void SetStanzaOffload(ThreadPool* pool, size_t size);
+  // Has each Connect call the handlers that aren't HC_INLINE on |pool|;
+  // see XmppEngine::SetHandlerPool.
+  void SetHandlerPool(ThreadPool* pool);
+  // Has each Connect time stanzas for |stats|; see
+  // XmppEngine::SetStanzaStats.
+  void SetStanzaStats(StanzaStats* stats);
+  // Streams the character data of the stanza children |sink| wants to it,
+  // now and on each Connect; see XmppEngine::SetTextSink.
+  void SetTextSink(XmppTextSink* sink);
+
+  // Has each Connect turn on XEP-0198 stream management; see
+  // XmppEngine::SetStreamManagement.
+  void SetStreamManagement(bool enable, int ack_interval);
+  // Has the next Connect resume the stream in |state|, once the server
+  // allows it, instead of starting a new session.
+  void SetResumeState(const XmppResumeState & state);
+  // Fills in |state| and returns true if the last stream can be resumed,
+  // as by a new XmppClient after this one closed.
+  bool GetResumeState(XmppResumeState * state);
+
+  // Has the next Connect race |servers| in order, as XmppWarmStandby keeps
+  // them resolved, in place of the settings' server and SRV lookup.
+  void SetServers(const std::vector<SocketAddress> & servers);
+  // The server the socket connected to, or nil before it has.
+  SocketAddress GetRemoteAddress();
+
+  // Drops the connection at once with ERROR_SOCKET and ENETDOWN, as when
+  // NetworkMonitor says the networks changed, rather than waiting for TCP
+  // to notice that the interface under it is gone. The owner can then
+  // reconnect, resuming the stream by GetResumeState if it was managed.
+  void OnNetworksChanged();
+
+  // Has |scheduler| keep the stream alive, from when it opens until it
+  // closes, with whitespace or pings as the scheduler is set up to send.
+  // A lost ping drops the connection with ERROR_SOCKET and ETIMEDOUT.
+  // NULL, the default, turns it off.  The scheduler must outlive the
+  // client or be replaced first.
+  void SetKeepAlive(KeepAliveScheduler* scheduler);
+
   XmppEngine* engine();
 
   signal2<const char *, int> SignalLogInput;
@@ -125,6 +233,9 @@ private:
   // managed tasks and dispatching
   void AddXmppTask(XmppTask *, XmppEngine::HandlerLevel);
   void RemoveXmppTask(XmppTask *);
+  // See XmppEngine::TakeIncomingStanza.
+  XmlElement * TakeIncomingStanza(const XmlElement * stanza,
+                                  XmlArena ** arena);
 
   signal0<> SignalDisconnected;
 
@@ -0,0 +1,344 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmppclientmanager.h"
+
+#include "common.h"
+#include "logging.h"
+#include "prexmppauth.h"
+#include "thread.h"
+#include "time.h"
+#include "xmppasyncsocket.h"
+#include "xmppendpointbalancer.h"
+
+namespace txmpp {
+
+namespace {
+
+enum {
+  MSG_RUN_TASKS = 1,
+  MSG_TIMEOUT,
+  MSG_LOGIN,
+  MSG_REAP
+};
+
+// 100ns units in a millisecond, as TaskRunner::CurrentTime counts.
+const int64 kTicksPerMs = 10000;
+
+}  // namespace
+
+struct XmppClientManager::Session : public has_slots<> {
+  enum Phase { PENDING, LOGGING_IN, OPEN, CLOSED };
+
+  Session(XmppClientManager* manager, XmppClient* client)
+      : manager(manager), client(client), phase(PENDING), socket(NULL),
+        preauth(NULL), login_start_ms(0), balancer(NULL), picked(0),
+        counted(kNoEndpoint) {}
+
+  static const size_t kNoEndpoint = static_cast<size_t>(-1);
+
+  void OnStateChange(XmppEngine::State state) {
+    manager->OnSessionStateChange(this, state);
+  }
+
+  XmppClientManager* manager;
+  XmppClient* client;
+  Phase phase;
+  // Held until the session's turn to connect.
+  XmppClientSettings settings;
+  std::string lang;
+  XmppAsyncSocket* socket;
+  PreXmppAuth* preauth;
+  int64 login_start_ms;
+  // The balancer that picked the endpoint |picked| for the session, and
+  // the one the connection counts against once it is made.
+  XmppEndpointBalancer* balancer;
+  size_t picked;
+  size_t counted;
+};
+
+XmppClientManager::XmppClientManager(Thread* thread)
+    : thread_(thread ? thread : Thread::Current()),
+      keepalive_(NULL),
+      balancer_(NULL),
+      max_in_flight_(64),
+      login_interval_ms_(10),
+      next_login_ms_(0),
+      login_posted_(false),
+      wake_posted_(false),
+      reap_posted_(false),
+      timeout_at_(0),
+      logging_in_(0),
+      open_(0),
+      logins_(0),
+      login_failures_(0),
+      closes_(0),
+      login_ms_total_(0) {
+}
+
+XmppClientManager::~XmppClientManager() {
+  thread_->Clear(this);
+  // Drop the sessions' slots first, so that disconnecting does not call
+  // back into a manager being destroyed.  The runner's destructor then
+  // aborts and deletes the clients that were started.
+  SessionMap sessions;
+  sessions.swap(sessions_);
+  for (SessionMap::iterator it = sessions.begin(); it != sessions.end();
+       ++it) {
+    Session* session = it->second;
+    XmppClient* client = session->client;
+    if (session->phase == Session::PENDING) {
+      delete session->socket;
+      delete session->preauth;
+      delete session;
+      // Never started, so the runner will not delete it.
+      delete client;
+    } else {
+      ReleaseEndpoint(session);
+      delete session;
+      client->Disconnect();
+    }
+  }
+  for (size_t i = 0; i < closed_.size(); ++i)
+    delete closed_[i];
+}
+
+void XmppClientManager::SetLoginPacing(int max_in_flight, int interval_ms) {
+  max_in_flight_ = max_in_flight;
+  login_interval_ms_ = interval_ms;
+  ScheduleLogins();
+}
+
+XmppClient* XmppClientManager::AddSession(const XmppClientSettings& settings,
+                                          const std::string& lang,
+                                          XmppAsyncSocket* socket,
+                                          PreXmppAuth* preauth) {
+  if (socket == NULL)
+    return NULL;
+  XmppClient* client = new XmppClient(this);
+  client->SetKeepAlive(keepalive_);
+  Session* session = new Session(this, client);
+  session->settings = settings;
+  session->lang = lang;
+  session->socket = socket;
+  session->preauth = preauth;
+  client->SignalStateChange.connect(session, &Session::OnStateChange);
+  sessions_[client] = session;
+  pending_.push_back(session);
+  ScheduleLogins();
+  return client;
+}
+
+void XmppClientManager::RemoveSession(XmppClient* client) {
+  SessionMap::iterator it = sessions_.find(client);
+  if (it == sessions_.end())
+    return;
+  Session* session = it->second;
+  if (session->phase != Session::PENDING) {
+    // Closing raises STATE_CLOSED, which drops the session.
+    client->Disconnect();
+    return;
+  }
+  sessions_.erase(it);
+  for (std::deque<Session*>::iterator p = pending_.begin();
+       p != pending_.end(); ++p) {
+    if (*p == session) {
+      pending_.erase(p);
+      break;
+    }
+  }
+  delete session->socket;
+  delete session->preauth;
+  delete session;
+  delete client;
+}
+
+void XmppClientManager::GetStats(Stats* stats) const {
+  stats->pending = pending_.size();
+  stats->logging_in = logging_in_;
+  stats->open = open_;
+  stats->logins = logins_;
+  stats->login_failures = login_failures_;
+  stats->closes = closes_;
+  stats->login_ms_total = login_ms_total_;
+  stats->queued_bytes = 0;
+  for (SessionMap::const_iterator it = sessions_.begin();
+       it != sessions_.end(); ++it) {
+    if (it->second->phase == Session::OPEN)
+      stats->queued_bytes += it->first->QueuedBytes();
+  }
+}
+
+void XmppClientManager::WakeTasks() {
+  // However many tasks wake before the next run, one message runs them.
+  if (wake_posted_)
+    return;
+  wake_posted_ = true;
+  thread_->Post(this, MSG_RUN_TASKS);
+}
+
+void XmppClientManager::OnTimeoutChange() {
+  ScheduleTimeout();
+}
+
+void XmppClientManager::OnMessage(Message* msg) {
+  switch (msg->message_id) {
+    case MSG_RUN_TASKS:
+      wake_posted_ = false;
+      RunTasks();
+      break;
+    case MSG_TIMEOUT:
+      timeout_at_ = 0;
+      PollTasks();
+      // A later timeout does not call OnTimeoutChange; look for it here.
+      ScheduleTimeout();
+      break;
+    case MSG_LOGIN:
+      login_posted_ = false;
+      StartLogins();
+      break;
+    case MSG_REAP:
+      reap_posted_ = false;
+      for (size_t i = 0; i < closed_.size(); ++i)
+        delete closed_[i];
+      closed_.clear();
+      break;
+  }
+}
+
+void XmppClientManager::ScheduleLogins() {
+  if (login_posted_ || pending_.empty())
+    return;
+  login_posted_ = true;
+  thread_->Post(this, MSG_LOGIN);
+}
+
+void XmppClientManager::StartLogins() {
+  while (!pending_.empty()) {
+    if (max_in_flight_ > 0 &&
+        logging_in_ >= static_cast<size_t>(max_in_flight_))
+      return;  // A login that ends starts the next.
+    if (login_interval_ms_ > 0) {
+      int64 now = CachedTimeMillis();
+      if (now < next_login_ms_) {
+        login_posted_ = true;
+        thread_->PostDelayed(static_cast<int>(next_login_ms_ - now), this,
+                             MSG_LOGIN);
+        return;
+      }
+      next_login_ms_ = now + login_interval_ms_;
+    }
+    Session* session = pending_.front();
+    pending_.pop_front();
+    StartSession(session);
+  }
+}
+
+void XmppClientManager::StartSession(Session* session) {
+  session->phase = Session::LOGGING_IN;
+  session->login_start_ms = CachedTimeMillis();
+  ++logging_in_;
+  if (balancer_ && balancer_->endpoint_count() > 0) {
+    std::vector<SocketAddress> servers;
+    session->balancer = balancer_;
+    session->picked = balancer_->Pick(&servers);
+    session->client->SetServers(servers);
+  }
+  // AddSession turned away a NULL socket, the only way Connect can fail.
+  VERIFY(session->client->Connect(session->settings, session->lang,
+                                  session->socket, session->preauth) ==
+         XMPP_RETURN_OK);
+  session->socket = NULL;
+  session->preauth = NULL;
+  // Done with the password.
+  session->settings = XmppClientSettings();
+  session->client->Start();
+}
+
+void XmppClientManager::ScheduleTimeout() {
+  int64 next = next_task_timeout();
+  if (next == 0 || (timeout_at_ != 0 && timeout_at_ <= next))
+    return;
+  timeout_at_ = next;
+  int64 delay = (next - CurrentTime() + kTicksPerMs - 1) / kTicksPerMs;
+  thread_->Reschedule(delay > 0 ? static_cast<int>(delay) : 0, this,
+                      MSG_TIMEOUT);
+}
+
+void XmppClientManager::OnSessionStateChange(Session* session,
+                                             XmppEngine::State state) {
+  XmppClient* client = session->client;
+  if (state == XmppEngine::STATE_OPENING && session->balancer &&
+      session->counted == Session::kNoEndpoint) {
+    // The socket is connected.
+    session->counted = session->balancer->OnConnected(
+        session->picked, client->GetRemoteAddress(),
+        static_cast<int>(CachedTimeMillis() - session->login_start_ms));
+  }
+  if (state == XmppEngine::STATE_OPEN &&
+      session->phase == Session::LOGGING_IN) {
+    session->phase = Session::OPEN;
+    --logging_in_;
+    ++open_;
+    ++logins_;
+    login_ms_total_ += CachedTimeMillis() - session->login_start_ms;
+    ScheduleLogins();
+  } else if (state == XmppEngine::STATE_CLOSED &&
+             session->phase != Session::CLOSED) {
+    if (session->phase == Session::OPEN) {
+      --open_;
+      ++closes_;
+    } else {
+      --logging_in_;
+      ++login_failures_;
+      LOG(LS_INFO) << "XmppClientManager: a login failed";
+      ScheduleLogins();
+    }
+    ReleaseEndpoint(session);
+    session->phase = Session::CLOSED;
+    sessions_.erase(client);
+    // The client is still raising the signal this came from.
+    closed_.push_back(session);
+    if (!reap_posted_) {
+      reap_posted_ = true;
+      thread_->Post(this, MSG_REAP);
+    }
+  }
+  SignalSessionStateChange(client, state);
+}
+
+void XmppClientManager::ReleaseEndpoint(Session* session) {
+  if (!session->balancer)
+    return;
+  if (session->counted != Session::kNoEndpoint)
+    session->balancer->OnClosed(session->counted);
+  else
+    session->balancer->OnConnectFailed(session->picked);
+  session->balancer = NULL;
+}
+
+}  // namespace txmpp
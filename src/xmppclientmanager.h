@@ -0,0 +1,172 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMPPCLIENTMANAGER_H_
+#define _TXMPP_XMPPCLIENTMANAGER_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "messagehandler.h"
+#include "sigslot.h"
+#include "taskrunner.h"
+#include "xmppclient.h"
+#include "xmppclientsettings.h"
+#include "xmppengine.h"
+
+namespace txmpp {
+
+class KeepAliveScheduler;
+class PreXmppAuth;
+class Thread;
+class XmppAsyncSocket;
+class XmppEndpointBalancer;
+
+// Runs many XmppClient sessions on one thread with one TaskRunner, in
+// place of a runner and a message handler for each.  The tasks of every
+// session share one wake message and one timer, and logins are paced so
+// that thousands of sessions added at once do not all connect at once.
+//
+// The manager is the TaskParent of its clients and, like any TaskRunner,
+// deletes each when it is done.  A client must not be used after
+// SignalSessionStateChange has given STATE_CLOSED for it.
+class XmppClientManager : public MessageHandler, public TaskRunner {
+ public:
+  struct Stats {
+    Stats()
+        : pending(0), logging_in(0), open(0), logins(0), login_failures(0),
+          closes(0), login_ms_total(0), queued_bytes(0) {}
+
+    // Sessions waiting for their turn to log in, logging in, and open.
+    size_t pending;
+    size_t logging_in;
+    size_t open;
+    // Logins that reached STATE_OPEN and that closed before it, and open
+    // sessions that closed since.
+    uint64 logins;
+    uint64 login_failures;
+    uint64 closes;
+    // The time the successful logins took, from their turn to STATE_OPEN.
+    int64 login_ms_total;
+    // What the open sessions have yet to write.
+    size_t queued_bytes;
+  };
+
+  // Runs on |thread|, or the current thread if it is NULL.
+  explicit XmppClientManager(Thread* thread = NULL);
+  // Disconnects the sessions still open and drops those still waiting.
+  virtual ~XmppClientManager();
+
+  // Lets at most |max_in_flight| sessions log in at a time, and starts one
+  // every |interval_ms| at most.  0 for either is no limit.  The default
+  // is 64 at a time, 10 ms apart.
+  void SetLoginPacing(int max_in_flight, int interval_ms);
+  // Has |scheduler| keep alive the sessions added from now on; see
+  // XmppClient::SetKeepAlive.
+  void SetKeepAlive(KeepAliveScheduler* scheduler) { keepalive_ = scheduler; }
+  // Has |balancer| pick the server for each session started from now on,
+  // in place of its settings' servers, and tells it how each connect went
+  // and when each connection closes.  The balancer must outlive the
+  // manager or be replaced first.  NULL, the default, turns it off.
+  void SetBalancer(XmppEndpointBalancer* balancer) { balancer_ = balancer; }
+
+  // Adds a session, which connects with |socket| and |preauth| when its
+  // turn comes.  The manager owns both until then, and the client after.
+  // The returned client may have its signals connected right away, but
+  // its child tasks should wait for STATE_OPEN.  Returns NULL, and takes
+  // nothing, if |socket| is NULL.
+  XmppClient* AddSession(const XmppClientSettings& settings,
+                         const std::string& lang,
+                         XmppAsyncSocket* socket,
+                         PreXmppAuth* preauth);
+  // Disconnects |client|, or drops it if it has not had its turn yet; it
+  // is deleted either way.
+  void RemoveSession(XmppClient* client);
+
+  size_t session_count() const { return sessions_.size(); }
+  void GetStats(Stats* stats) const;
+
+  // Every state change of every session, STATE_CLOSED last.
+  signal2<XmppClient*, XmppEngine::State> SignalSessionStateChange;
+
+  virtual void WakeTasks();
+  virtual void OnMessage(Message* msg);
+
+ protected:
+  virtual void OnTimeoutChange();
+
+ private:
+  struct Session;
+
+  void ScheduleLogins();
+  void StartLogins();
+  void StartSession(Session* session);
+  void ScheduleTimeout();
+  void OnSessionStateChange(Session* session, XmppEngine::State state);
+  // Tells the balancer the session's connection is gone.
+  void ReleaseEndpoint(Session* session);
+
+  typedef std::map<XmppClient*, Session*> SessionMap;
+
+  Thread* thread_;
+  KeepAliveScheduler* keepalive_;
+  XmppEndpointBalancer* balancer_;
+  SessionMap sessions_;
+  // The sessions waiting for their turn, oldest first.
+  std::deque<Session*> pending_;
+  // Closed sessions, deleted once their signal has returned.
+  std::vector<Session*> closed_;
+
+  int max_in_flight_;
+  int login_interval_ms_;
+  int64 next_login_ms_;
+  bool login_posted_;
+  bool wake_posted_;
+  bool reap_posted_;
+  // When the posted timeout fires, in 100ns units, or 0 if none is.
+  int64 timeout_at_;
+
+  size_t logging_in_;
+  size_t open_;
+  uint64 logins_;
+  uint64 login_failures_;
+  uint64 closes_;
+  int64 login_ms_total_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(XmppClientManager);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMPPCLIENTMANAGER_H_
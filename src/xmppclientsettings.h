@@ -32,16 +32,28 @@
 #include "config.h"
 #endif
 
+#include <vector>
 #include "cryptstring.h"
 #include "proxyinfo.h"
 
 namespace txmpp {
 
+// One of several servers that a client may connect to, taking a share of
+// the connections in proportion to its weight.
+struct XmppEndpoint {
+  XmppEndpoint() : weight(1) {}
+  XmppEndpoint(const SocketAddress & address, int weight)
+      : address(address), weight(weight) {}
+  SocketAddress address;
+  int weight;
+};
+
 class XmppUserSettings {
  public:
   XmppUserSettings()
     : use_tls_(false), 
-      allow_plain_(false) {
+      allow_plain_(false),
+      pipelined_login_(false) {
   }
 
   void set_user(const std::string & user) { user_ = user; }
@@ -51,6 +63,7 @@ class XmppUserSettings {
   void set_resource(const std::string & resource) { resource_ = resource; }
   void set_use_tls(bool use_tls) { use_tls_ = use_tls; }
   void set_allow_plain(bool f) { allow_plain_ = f; }
+  void set_pipelined_login(bool f) { pipelined_login_ = f; }
   void set_token_service(const std::string & token_service) {
     token_service_ = token_service;
   }
@@ -62,6 +75,7 @@ class XmppUserSettings {
   const std::string & resource() const { return resource_; }
   bool use_tls() const { return use_tls_; }
   bool allow_plain() const { return allow_plain_; }
+  bool pipelined_login() const { return pipelined_login_; }
   const std::string & token_service() const { return token_service_; }
 
  private:
@@ -72,13 +86,17 @@ class XmppUserSettings {
   std::string resource_;
   bool use_tls_;
   bool allow_plain_;
+  bool pipelined_login_;
   std::string token_service_;
 };
 
 class XmppClientSettings : public XmppUserSettings {
  public:
   XmppClientSettings()
-    : proxy_(PROXY_NONE),
+    : use_srv_(false),
+      connect_stagger_(250),
+      trust_local_socket_(false),
+      proxy_(PROXY_NONE),
       proxy_port_(80),
       use_proxy_auth_(false) {
   }
@@ -86,6 +104,23 @@ class XmppClientSettings : public XmppUserSettings {
   void set_server(const SocketAddress & server) { 
       server_ = server; 
   }
+  // Looks up the _xmpp-client._tcp SRV records of host() before connecting,
+  // racing connects to their targets by priority and weight, and to
+  // server() after them.
+  void set_use_srv(bool f) { use_srv_ = f; }
+  // How long each connect attempt gets before the next is started with it.
+  void set_connect_stagger(int ms) { connect_stagger_ = ms; }
+  // Adds a server to connect to in place of server() and SRV, for a
+  // cluster: a client races them in a random order weighted by |weight|,
+  // and XmppEndpointBalancer spreads many clients over them.
+  void add_endpoint(const SocketAddress & address, int weight = 1) {
+    endpoints_.push_back(XmppEndpoint(address, weight));
+  }
+  void clear_endpoints() { endpoints_.clear(); }
+  // With a Unix domain server(), which only processes on this host can
+  // reach, logs in without TLS even if the server offers it, and allows
+  // PLAIN.
+  void set_trust_local_socket(bool f) { trust_local_socket_ = f; }
   void set_proxy(ProxyType f) { proxy_ = f; }
   void set_proxy_host(const std::string & host) { proxy_host_ = host; }
   void set_proxy_port(int port) { proxy_port_ = port; };
@@ -94,6 +129,10 @@ class XmppClientSettings : public XmppUserSettings {
   void set_proxy_pass(const CryptString & pass) { proxy_pass_ = pass; }
 
   const SocketAddress & server() const { return server_; }
+  bool use_srv() const { return use_srv_; }
+  int connect_stagger() const { return connect_stagger_; }
+  const std::vector<XmppEndpoint> & endpoints() const { return endpoints_; }
+  bool trust_local_socket() const { return trust_local_socket_; }
   ProxyType proxy() const { return proxy_; }
   const std::string & proxy_host() const { return proxy_host_; }
   int proxy_port() const { return proxy_port_; }
@@ -103,6 +142,10 @@ class XmppClientSettings : public XmppUserSettings {
 
  private:
   SocketAddress server_;
+  bool use_srv_;
+  int connect_stagger_;
+  std::vector<XmppEndpoint> endpoints_;
+  bool trust_local_socket_;
   ProxyType proxy_;
   std::string proxy_host_;
   int proxy_port_;
@@ -0,0 +1,302 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmppconcurrentdispatch.h"
+
+#include <deque>
+
+#include "criticalsection.h"
+#include "event.h"
+#include "thread.h"
+#include "threadpool.h"
+#include "xmlarena.h"
+#include "xmlelement.h"
+
+namespace txmpp {
+
+namespace {
+
+// An ordered handler is handed at most this many stanzas in one task
+// before the rest go back to the pool, so that a busy handler doesn't keep
+// a pool thread from the other tasks.
+const size_t kMaxDrain = 64;
+
+}  // namespace
+
+// A stanza shared by the calls it is handed to, freed after the last.
+class XmppConcurrentDispatch::Input {
+ public:
+  Input(XmlElement* stanza, XmlArena* arena)
+      : refs_(1), stanza_(stanza), arena_(arena) {
+  }
+
+  void AddRef() { AtomicOps::Increment(&refs_); }
+  void Release() {
+    if (!AtomicOps::Decrement(&refs_))
+      delete this;
+  }
+
+  const XmlElement* stanza() const { return stanza_; }
+
+ private:
+  ~Input() {
+    delete stanza_;
+    delete arena_;
+  }
+
+  volatile int refs_;
+  XmlElement* stanza_;
+  XmlArena* arena_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(Input);
+};
+
+// A handler and the state of its calls, shared with the tasks posted for
+// it. On the engine's thread it stands in for the handler as its proxy.
+class XmppConcurrentDispatch::Lane : public XmppStanzaHandler {
+ public:
+  Lane(XmppConcurrentDispatch* dispatch, XmppStanzaHandler* handler)
+      : dispatch_(dispatch),
+        handler_(handler),
+        ordered_(handler->GetConcurrency() == HC_ORDERED),
+        refs_(1),
+        stopped_(false),
+        draining_(false),
+        running_(0),
+        idle_(true, true) {
+  }
+
+  virtual bool HandleStanza(const XmlElement* stanza) {
+    dispatch_->Offer(this);
+    return false;
+  }
+  virtual bool WantsStanza(const XmppStanzaStart& start) {
+    return handler_->WantsStanza(start);
+  }
+  virtual bool GetStanzaMatch(XmppStanzaMatch* match) const {
+    return handler_->GetStanzaMatch(match);
+  }
+
+  XmppStanzaHandler* handler() const { return handler_; }
+  bool ordered() const { return ordered_; }
+
+  void AddRef() { AtomicOps::Increment(&refs_); }
+  void Release() {
+    if (!AtomicOps::Decrement(&refs_))
+      delete this;
+  }
+
+  // Queues |input| for an ordered handler. Returns true if a Drain has to
+  // be posted to hand it on, as none is under way.
+  bool Enqueue(Input* input) {
+    CritScope cs(&crit_);
+    if (stopped_)
+      return false;
+    input->AddRef();
+    queue_.push_back(input);
+    if (draining_)
+      return false;
+    draining_ = true;
+    return true;
+  }
+
+  // Hands the handler up to |max| of the stanzas queued. Returns true if
+  // more are left, for the Drain to go on with.
+  bool DrainQueue(size_t max) {
+    for (size_t i = 0; i < max; ++i) {
+      Input* input;
+      {
+        CritScope cs(&crit_);
+        if (queue_.empty()) {
+          draining_ = false;
+          return false;
+        }
+        input = queue_.front();
+        queue_.pop_front();
+      }
+      Deliver(input);
+      input->Release();
+    }
+    return true;
+  }
+
+  // Calls the handler with |input|, unless it has been stopped.
+  void Deliver(Input* input) {
+    {
+      CritScope cs(&crit_);
+      if (stopped_)
+        return;
+      if (running_++ == 0)
+        idle_.Reset();
+    }
+    handler_->HandleStanza(input->stanza());
+    {
+      CritScope cs(&crit_);
+      if (--running_ == 0)
+        idle_.Set();
+    }
+  }
+
+  // Drops the stanzas queued and waits for the calls under way. No call
+  // starts after this.
+  void Stop() {
+    std::deque<Input*> dropped;
+    {
+      CritScope cs(&crit_);
+      stopped_ = true;
+      dropped.swap(queue_);
+    }
+    for (size_t i = 0; i < dropped.size(); ++i)
+      dropped[i]->Release();
+    idle_.Wait(kForever);
+  }
+
+ private:
+  virtual ~Lane() {
+    ASSERT(queue_.empty());
+  }
+
+  XmppConcurrentDispatch* dispatch_;
+  XmppStanzaHandler* handler_;
+  bool ordered_;
+  volatile int refs_;
+  CriticalSection crit_;
+  bool stopped_;
+  bool draining_;  // a Drain is posted or running
+  int running_;
+  Event idle_;     // set while no call is under way
+  std::deque<Input*> queue_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(Lane);
+};
+
+// Hands one stanza to a handler that is HC_CONCURRENT.
+class XmppConcurrentDispatch::Call : public Runnable {
+ public:
+  Call(Lane* lane, Input* input) : lane_(lane), input_(input) {
+    lane_->AddRef();
+    input_->AddRef();
+  }
+
+  virtual void Run(Thread* thread) {
+    lane_->Deliver(input_);
+    input_->Release();
+    lane_->Release();
+    delete this;
+  }
+
+ private:
+  Lane* lane_;
+  Input* input_;
+};
+
+// Hands a handler that is HC_ORDERED the stanzas queued for it, in turn.
+class XmppConcurrentDispatch::Drain : public Runnable {
+ public:
+  Drain(Lane* lane, ThreadPool* pool) : lane_(lane), pool_(pool) {
+    lane_->AddRef();
+  }
+
+  virtual void Run(Thread* thread) {
+    if (lane_->DrainQueue(kMaxDrain)) {
+      pool_->Post(this);
+      return;
+    }
+    lane_->Release();
+    delete this;
+  }
+
+ private:
+  Lane* lane_;
+  ThreadPool* pool_;
+};
+
+XmppConcurrentDispatch::XmppConcurrentDispatch(ThreadPool* pool)
+    : pool_(pool) {
+}
+
+XmppConcurrentDispatch::~XmppConcurrentDispatch() {
+  for (size_t i = 0; i < pending_.size(); ++i)
+    pending_[i]->Release();
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    lanes_[i]->Stop();
+    lanes_[i]->Release();
+  }
+}
+
+XmppStanzaHandler* XmppConcurrentDispatch::Add(XmppStanzaHandler* handler) {
+  XmppStanzaHandler* proxy = Find(handler);
+  if (proxy)
+    return proxy;
+  Lane* lane = new Lane(this, handler);
+  lanes_.push_back(lane);
+  return lane;
+}
+
+XmppStanzaHandler*
+XmppConcurrentDispatch::Find(XmppStanzaHandler* handler) const {
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    if (lanes_[i]->handler() == handler)
+      return lanes_[i];
+  }
+  return NULL;
+}
+
+bool XmppConcurrentDispatch::Remove(XmppStanzaHandler* handler) {
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    Lane* lane = lanes_[i];
+    if (lane->handler() != handler)
+      continue;
+    lanes_.erase(lanes_.begin() + i);
+    lane->Stop();
+    lane->Release();
+    return true;
+  }
+  return false;
+}
+
+void XmppConcurrentDispatch::Offer(Lane* lane) {
+  lane->AddRef();
+  pending_.push_back(lane);
+}
+
+void XmppConcurrentDispatch::Flush(XmlElement* stanza, XmlArena* arena) {
+  Input* input = new Input(stanza, arena);
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    Lane* lane = pending_[i];
+    if (!lane->ordered()) {
+      pool_->Post(new Call(lane, input));
+    } else if (lane->Enqueue(input)) {
+      pool_->Post(new Drain(lane, pool_));
+    }
+    lane->Release();
+  }
+  pending_.clear();
+  input->Release();
+}
+
+}  // namespace txmpp
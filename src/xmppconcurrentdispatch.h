@@ -0,0 +1,101 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMPPCONCURRENTDISPATCH_H_
+#define _TXMPP_XMPPCONCURRENTDISPATCH_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <vector>
+
+#include "constructormagic.h"
+#include "xmppengine.h"
+
+namespace txmpp {
+
+class ThreadPool;
+class XmlArena;
+class XmlElement;
+
+// The stanza handlers of an XmppEngine that are called on a ThreadPool
+// rather than on the engine's thread. Each is added to the engine's
+// HL_PEEK dispatch through a proxy, which only notes that the handler was
+// offered the stanza; once the engine is done with it, Flush shares one
+// copy of the stanza among the handlers noted and posts their calls.
+//
+// A handler that is HC_ORDERED has its stanzas queued and handed to it one
+// at a time, in the order they came. One that is HC_CONCURRENT has a call
+// posted for each stanza, which may run alongside the others.
+//
+// Apart from the calls it posts, it is used only on the engine's thread.
+class XmppConcurrentDispatch {
+ public:
+  explicit XmppConcurrentDispatch(ThreadPool* pool);
+  // Stops every handler, as Remove does.
+  ~XmppConcurrentDispatch();
+
+  // Returns the proxy to add to the engine's dispatch in |handler|'s
+  // place. Adding a handler again returns the same proxy.
+  XmppStanzaHandler* Add(XmppStanzaHandler* handler);
+  // The proxy for |handler|, or NULL if it isn't added.
+  XmppStanzaHandler* Find(XmppStanzaHandler* handler) const;
+  // Stops |handler|, once its proxy is out of the engine's dispatch: the
+  // stanzas queued for it are dropped, and the calls under way waited for,
+  // so that it may be deleted once this returns. Returns false if it wasn't
+  // added. Not to be called from the handler itself.
+  bool Remove(XmppStanzaHandler* handler);
+
+  bool empty() const { return lanes_.empty(); }
+
+  // Whether any handler was offered a stanza since the last Flush.
+  bool HasPending() const { return !pending_.empty(); }
+  // Hands |stanza| to the handlers offered it since the last Flush. Takes
+  // |stanza| and |arena|, if any, and frees them once the last is done.
+  void Flush(XmlElement* stanza, XmlArena* arena);
+
+ private:
+  class Input;
+  class Lane;
+  class Call;
+  class Drain;
+  friend class Lane;
+
+  // Called by a proxy when its handler is offered a stanza.
+  void Offer(Lane* lane);
+
+  ThreadPool* pool_;
+  std::vector<Lane*> lanes_;
+  std::vector<Lane*> pending_;  // each holding a reference
+
+  DISALLOW_EVIL_CONSTRUCTORS(XmppConcurrentDispatch);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMPPCONCURRENTDISPATCH_H_
@@ -0,0 +1,168 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmppendpointbalancer.h"
+
+#include <algorithm>
+#include <utility>
+#include "common.h"
+#include "logging.h"
+#include "time.h"
+
+namespace txmpp {
+
+const uint32 XmppEndpointBalancer::kMaxFailures;
+const int XmppEndpointBalancer::kRetryMs;
+const int XmppEndpointBalancer::kMaxRetryMs;
+const int XmppEndpointBalancer::kConnectFloorMs;
+
+XmppEndpointBalancer::XmppEndpointBalancer(
+    const std::vector<XmppEndpoint>& endpoints)
+    : endpoints_(endpoints.size()) {
+  for (size_t i = 0; i < endpoints.size(); ++i) {
+    endpoints_[i].endpoint = endpoints[i];
+    endpoints_[i].retry_at = 0;
+  }
+}
+
+XmppEndpointBalancer::~XmppEndpointBalancer() {
+}
+
+int XmppEndpointBalancer::RetryDelay(uint32 failures) {
+  ASSERT(failures >= kMaxFailures);
+  uint32 doublings = _min(failures - kMaxFailures, static_cast<uint32>(16));
+  return _min(kRetryMs << doublings, kMaxRetryMs);
+}
+
+bool XmppEndpointBalancer::IsHealthy(size_t index) const {
+  return IsHealthyAt(endpoints_[index], Time());
+}
+
+bool XmppEndpointBalancer::IsHealthyAt(const Entry& entry, uint32 now) const {
+  return entry.stats.failures < kMaxFailures ||
+         TimeIsLaterOrEqual(entry.retry_at, now);
+}
+
+double XmppEndpointBalancer::Score(const Entry& entry) const {
+  double load = static_cast<double>(entry.stats.connecting +
+                                    entry.stats.active + 1);
+  load *= _max(entry.stats.connect_ms, static_cast<int>(kConnectFloorMs));
+  // An endpoint of weight 0 takes connections only when nothing else can.
+  if (entry.endpoint.weight <= 0)
+    return load * 1e12;
+  return load / entry.endpoint.weight;
+}
+
+size_t XmppEndpointBalancer::Pick(std::vector<SocketAddress>* order) {
+  ASSERT(!endpoints_.empty());
+  uint32 now = Time();
+  std::vector<std::pair<double, size_t> > healthy;
+  std::vector<std::pair<uint32, size_t> > left_out;
+  for (size_t i = 0; i < endpoints_.size(); ++i) {
+    const Entry& entry = endpoints_[i];
+    if (IsHealthyAt(entry, now)) {
+      healthy.push_back(std::make_pair(Score(entry), i));
+    } else {
+      // Soonest to be tried again first.
+      left_out.push_back(std::make_pair(TimeDiff(entry.retry_at, now), i));
+    }
+  }
+  std::stable_sort(healthy.begin(), healthy.end());
+  std::stable_sort(left_out.begin(), left_out.end());
+
+  order->clear();
+  for (size_t i = 0; i < healthy.size(); ++i)
+    order->push_back(endpoints_[healthy[i].second].endpoint.address);
+  for (size_t i = 0; i < left_out.size(); ++i)
+    order->push_back(endpoints_[left_out[i].second].endpoint.address);
+
+  size_t picked = healthy.empty() ? left_out[0].second : healthy[0].second;
+  Entry& entry = endpoints_[picked];
+  ++entry.stats.connecting;
+  // An endpoint being tried again after its failures gets one connection
+  // until that one's outcome.
+  if (entry.stats.failures >= kMaxFailures)
+    entry.retry_at = now + RetryDelay(entry.stats.failures);
+  return picked;
+}
+
+size_t XmppEndpointBalancer::OnConnected(size_t picked,
+                                         const SocketAddress& remote,
+                                         int connect_ms) {
+  ASSERT(picked < endpoints_.size());
+  Entry& entry = endpoints_[picked];
+  if (entry.stats.connecting > 0)
+    --entry.stats.connecting;
+
+  size_t index = picked;
+  if (!remote.IsNil() && !(entry.endpoint.address.EqualIPs(remote) &&
+                           entry.endpoint.address.EqualPorts(remote))) {
+    for (size_t i = 0; i < endpoints_.size(); ++i) {
+      const SocketAddress& address = endpoints_[i].endpoint.address;
+      if (address.EqualIPs(remote) && address.EqualPorts(remote)) {
+        index = i;
+        break;
+      }
+    }
+  }
+
+  EndpointStats& stats = endpoints_[index].stats;
+  ++stats.active;
+  ++stats.connects;
+  stats.failures = 0;
+  connect_ms = _max(connect_ms, 0);
+  if (stats.connects == 1)
+    stats.connect_ms = connect_ms;
+  else
+    stats.connect_ms = (stats.connect_ms * 7 + connect_ms) / 8;
+  return index;
+}
+
+void XmppEndpointBalancer::OnConnectFailed(size_t picked) {
+  ASSERT(picked < endpoints_.size());
+  Entry& entry = endpoints_[picked];
+  if (entry.stats.connecting > 0)
+    --entry.stats.connecting;
+  ++entry.stats.connect_failures;
+  if (++entry.stats.failures < kMaxFailures)
+    return;
+  entry.retry_at = Time() + RetryDelay(entry.stats.failures);
+  if (entry.stats.failures == kMaxFailures) {
+    LOG(LS_WARNING) << "XmppEndpointBalancer leaving out "
+                    << entry.endpoint.address.ToString() << " after "
+                    << entry.stats.failures << " failed connects";
+  }
+}
+
+void XmppEndpointBalancer::OnClosed(size_t index) {
+  ASSERT(index < endpoints_.size());
+  EndpointStats& stats = endpoints_[index].stats;
+  if (stats.active > 0)
+    --stats.active;
+}
+
+}  // namespace txmpp
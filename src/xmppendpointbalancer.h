@@ -0,0 +1,132 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMPPENDPOINTBALANCER_H_
+#define _TXMPP_XMPPENDPOINTBALANCER_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+#include <vector>
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "socketaddress.h"
+#include "xmppclientsettings.h"
+
+namespace txmpp {
+
+// Spreads the connections of many clients over several servers of a
+// cluster.  Each new connection goes to the healthy endpoint with the
+// least load for its weight, counting the connections still being made,
+// so that a burst of reconnects is spread as it starts rather than piling
+// onto whichever server answers DNS first.  An endpoint's load is scaled
+// by its average connect time, so a slow one takes fewer.
+//
+// An endpoint that fails kMaxFailures connects in a row is left out for a
+// while, doubling with each further failure up to kMaxRetryMs, after which
+// one connection at a time is let through to try it again.
+//
+// XmppClientManager::SetBalancer reports the outcomes; other owners call
+// the On methods themselves.  Context: one thread.
+class XmppEndpointBalancer {
+ public:
+  static const uint32 kMaxFailures = 3;
+  static const int kRetryMs = 5 * 1000;
+  static const int kMaxRetryMs = 5 * 60 * 1000;
+  // Connect times under this count as this, so that a few milliseconds
+  // either way on a LAN don't shift the load.
+  static const int kConnectFloorMs = 50;
+
+  struct EndpointStats {
+    EndpointStats()
+        : connecting(0), active(0), connect_ms(0), failures(0), connects(0),
+          connect_failures(0) {}
+
+    // Connections picked for it and still being made, and those made.
+    size_t connecting;
+    size_t active;
+    // The average connect time, weighting the latest by an eighth; 0
+    // before the first.
+    int connect_ms;
+    // Failed connects since the last that was made.
+    uint32 failures;
+    uint64 connects;
+    uint64 connect_failures;
+  };
+
+  explicit XmppEndpointBalancer(const std::vector<XmppEndpoint>& endpoints);
+  ~XmppEndpointBalancer();
+
+  size_t endpoint_count() const { return endpoints_.size(); }
+  const XmppEndpoint& endpoint(size_t index) const {
+    return endpoints_[index].endpoint;
+  }
+  const EndpointStats& stats(size_t index) const {
+    return endpoints_[index].stats;
+  }
+  // Whether |index| is being left out after its failures.
+  bool IsHealthy(size_t index) const;
+
+  // Picks the endpoint for a new connection, and counts it as connecting.
+  // Fills |order| with the servers to race: that one first, then the other
+  // healthy ones best first, and those left out last.  Returns its index.
+  size_t Pick(std::vector<SocketAddress>* order);
+
+  // The connection picked for |picked| was made to |remote| in
+  // |connect_ms|.  Returns the endpoint it counts against until OnClosed:
+  // the one |remote| is, if it was raced to another, or else |picked|.
+  size_t OnConnected(size_t picked, const SocketAddress& remote,
+                     int connect_ms);
+  // The connection picked for |picked| was never made.
+  void OnConnectFailed(size_t picked);
+  // A connection counted against |index| by OnConnected has closed.
+  void OnClosed(size_t index);
+
+ private:
+  struct Entry {
+    XmppEndpoint endpoint;
+    EndpointStats stats;
+    // While failures >= kMaxFailures, it is left out until then.
+    uint32 retry_at;
+  };
+
+  // How long an endpoint with |failures| in a row is left out.
+  static int RetryDelay(uint32 failures);
+  bool IsHealthyAt(const Entry& entry, uint32 now) const;
+  // The load for the weight, lower is better.
+  double Score(const Entry& entry) const;
+
+  std::vector<Entry> endpoints_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(XmppEndpointBalancer);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMPPENDPOINTBALANCER_H_
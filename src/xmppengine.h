@@ -32,7 +32,11 @@
 #include "config.h"
 #endif
 
+#include <string>
+#include <vector>
+
 // also part of the API
+#include "chainbuffer.h"
 #include "jid.h"
 #include "qname.h"
 #include "xmlelement.h"
@@ -41,8 +45,35 @@ namespace txmpp {
 
 class XmppEngine;
 class SaslHandler;
+class XmppStanzaStart;
+class PreparedStanza;
+class SharedStanza;
+class StanzaStats;
+class ThreadPool;
+struct XmppEngineCounters;
 typedef void * XmppIqCookie;
 
+//! A stanza id made by XmppEngine::NextId. It is kept inline, so that
+//! making one doesn't allocate, and converts to std::string for use as an
+//! attribute value.
+class XmppId {
+public:
+  enum { kMaxLength = 23 };
+
+  XmppId() : length_(0) { data_[0] = '\0'; }
+
+  const char * c_str() const { return data_; }
+  size_t length() const { return length_; }
+  std::string Str() const { return std::string(data_, length_); }
+  operator std::string() const { return Str(); }
+
+private:
+  friend class XmppEngineImpl;
+
+  char data_[kMaxLength + 1];
+  size_t length_;
+};
+
 //! XMPP stanza error codes.
 //! Used in XmppEngine.SendStanzaError().
 enum XmppStanzaError {
@@ -91,13 +122,40 @@ public:
   //! Deliver the specified bytes to the XMPP socket.
   virtual void WriteOutput(const char * bytes, size_t len) = 0;
 
+  //! Deliver the bytes in |output| to the XMPP socket, taking them all.
+  //! The engine hands its output over this way. The default passes each
+  //! block to WriteOutput; a handler that can queue the blocks themselves
+  //! saves copying them.
+  virtual void WriteOutputChain(ChainBuffer * output) {
+    for (size_t i = 0; i < output->BlockCount(); ++i) {
+      IoVec block = output->Block(i);
+      WriteOutput(static_cast<const char *>(block.data), block.len);
+    }
+    output->Clear();
+  }
+
   //! Initiate TLS encryption on the socket.
   //! The implementation must verify that the SSL
   //! certificate matches the given domainname.
   virtual void StartTls(const std::string & domainname) = 0;
 
+  //! Compress the socket's bytes each way with zlib from here on, as
+  //! negotiated by XEP-0138.  Returns false if it can't.
+  virtual bool StartCompression(int level, int window_bits) { return false; }
+
   //! Called when engine wants the connecton closed.
   virtual void CloseConnection() = 0;
+
+  //! Called when the engine is corked and starts holding output back.
+  //! The handler should arrange for XmppEngine.Flush to be called soon.
+  virtual void OutputPending() {}
+
+  //! Called when shaping holds stanzas back, and for the other work the
+  //! engine puts off: coalesced presence and iq batch timeouts. The
+  //! handler should arrange for XmppEngine.Flush to be called in
+  //! |delay_ms|, which does what is due by then. A handler that turns any
+  //! of these on must do so.
+  virtual void OutputDelayed(int delay_ms) {}
 };
 
 //! Callback to deliver engine state change notifications
@@ -109,6 +167,53 @@ public:
   virtual void OnStateChange(int state) = 0;
 };
 
+//! What a new XmppEngine needs to resume a stream with XEP-0198 stream
+//! management: the stream's id and bound JID, the counts of stanzas each
+//! way, and the text of the stanzas sent that the server hasn't acked.
+struct XmppResumeState {
+  XmppResumeState() : handled(0), sent(0), binary(false), reconnects(0) {}
+  std::string id;
+  Jid jid;
+  //! The stanzas handled from the server, mod 2^32.
+  uint32 handled;
+  //! The stanzas sent, mod 2^32, the last unacked.size() of them unacked.
+  uint32 sent;
+  std::vector<std::string> unacked;
+  //! Whether |unacked| is in the binary XML encoding, which only a stream
+  //! in that encoding can resend.
+  bool binary;
+  //! The connections the stream has had before the one resuming it, as
+  //! XmppClient counts them.  Not used by the engine.
+  uint32 reconnects;
+};
+
+//! The stanzas a handler may handle, so that the engine need not offer
+//! it the others. Empty fields match anything, but a match without a name
+//! is not used.
+struct XmppStanzaMatch {
+  XmppStanzaMatch() : name(QN_EMPTY) {}
+  //! The name of the stanza, such as QN_IQ.
+  QName name;
+  //! The value of its type attribute.
+  std::string type;
+  //! The namespace of one of its child elements.
+  std::string child_ns;
+};
+
+//! Outbound stanza shaping. A stanza waits for a token from a bucket all
+//! stanzas share, holding |burst| and refilled at |per_second| a second,
+//! and from one for the JID it is to, holding |jid_burst| and refilled at
+//! |jid_per_second|. A burst of 0 leaves that bucket out. The stanzas that
+//! wait go out iq results and errors first, then messages and other iqs,
+//! then presence.
+struct XmppShaping {
+  XmppShaping() : burst(0), per_second(0), jid_burst(0), jid_per_second(0) {}
+  int burst;
+  double per_second;
+  int jid_burst;
+  double jid_per_second;
+};
+
 //! Callback to deliver stanzas to an Xmpp application module.
 //! Register via XmppEngine.SetDefaultSessionHandler or via
 //! XmppEngine.AddSessionHAndler.  
@@ -120,6 +225,49 @@ public:
   //! A false return value causes the stanza to be passed on to
   //! the next registered handler.
   virtual bool HandleStanza(const XmlElement * stanza) = 0;
+
+  //! Called at the start tag of each incoming stanza other than an iq,
+  //! before it is built. If no handler wants it, the stanza is skipped
+  //! without being built. The default wants them all.
+  virtual bool WantsStanza(const XmppStanzaStart & start) { return true; }
+
+  //! Fills in |match| and returns true if the handler only handles stanzas
+  //! that fit it, which lets the engine find the handler by the stanza's
+  //! name, type and child namespaces instead of asking every handler. It is
+  //! read once, when the handler is added. The default offers the handler
+  //! every stanza.
+  virtual bool GetStanzaMatch(XmppStanzaMatch * match) const { return false; }
+
+  //! Where the handler is called. HC_INLINE, the default, calls it on the
+  //! engine's thread as each stanza is handled. A handler that only reads
+  //! the stanzas, such as for archiving or indexing, and touches nothing
+  //! the engine's thread does, can be called on the pool given to
+  //! XmppEngine.SetHandlerPool instead, so that the engine goes on with its
+  //! input meanwhile: HC_ORDERED hands it the stanzas one at a time, in the
+  //! order they came, and HC_CONCURRENT lets its calls run alongside each
+  //! other. There it is handed a copy of the stanza shared with the other
+  //! such handlers, which must not be changed and lives until HandleStanza
+  //! returns, and whose return is ignored. WantsStanza and GetStanzaMatch
+  //! are still called on the engine's thread. Read once, when the handler
+  //! is added, and only for a handler added at HL_PEEK.
+  enum Concurrency { HC_INLINE, HC_ORDERED, HC_CONCURRENT };
+  virtual Concurrency GetConcurrency() const { return HC_INLINE; }
+};
+
+//! Takes the character data of chosen children of incoming stanzas as it
+//! is parsed, instead of it being built into the stanza, for payloads too
+//! large to hold at once, such as in-band bytestream blocks. The stanza is
+//! still built and handled, with those children empty, after their text.
+class XmppTextSink {
+public:
+  virtual ~XmppTextSink() {}
+  //! Called at the start tag of each child of a stanza that isn't
+  //! skipped. Returns true to be passed the child's character data.
+  virtual bool WantText(const XmppStanzaStart & start) = 0;
+  //! A piece of the character data, unescaped, in the order it comes.
+  virtual void Text(const char * text, size_t len) = 0;
+  //! Called at the end tag of a child it wanted.
+  virtual void EndText() = 0;
 };
 
 //! Callback to deliver iq responses (results and errors).
@@ -137,6 +285,27 @@ public:
   virtual void IqResponse(XmppIqCookie cookie, const XmlElement * pelStanza) = 0;
 };
 
+//! The outcome of one iq of a batch sent with XmppEngine.SendIqBatch.
+struct XmppIqBatchResult {
+  XmppIqBatchResult() : response(NULL) {}
+  std::string id;
+  //! The result or error that came for it, or NULL if none came before the
+  //! batch timed out.
+  const XmlElement * response;
+};
+
+//! Callback to deliver the responses to a batch of iqs at once.
+class XmppIqBatchHandler {
+public:
+  virtual ~XmppIqBatchHandler() {}
+  //! Called once every iq of the batch has a response, or once it times
+  //! out, with a result for each iq in the order they were sent.  The
+  //! responses live until this returns.  Called no more than once; the
+  //! batch is then unregistered.
+  virtual void IqBatchDone(XmppIqCookie cookie,
+                           const std::vector<XmppIqBatchResult> & results) = 0;
+};
+
 //! The XMPP connection engine.
 //! This engine implements the client side of the 'core' XMPP protocol.
 //! To use it, register an XmppOutputHandler to handle socket output
@@ -150,6 +319,10 @@ public:
   static XmppEngine * Create();
   virtual ~XmppEngine() {}
 
+  //! Prints |stanza| for SendSharedStanza, as engines print what they
+  //! send.  The result has one reference, and any engine may send it.
+  static SharedStanza * CreateSharedStanza(const XmlElement * stanza);
+
   //! Error codes. See GetError().
   enum Error {
     ERROR_NONE = 0,         //!< No error
@@ -164,7 +337,8 @@ public:
     ERROR_DOCUMENT_CLOSED,  //!< Closed by </stream:stream>
     ERROR_SOCKET,           //!< Socket error
     ERROR_NETWORK_TIMEOUT,  //!< Some sort of timeout (eg., we never got the roster)
-    ERROR_MISSING_USERNAME  //!< User has a Google Account but no nickname
+    ERROR_MISSING_USERNAME, //!< User has a Google Account but no nickname
+    ERROR_COMPRESSION,      //!< Stream compression could not be started
   };
 
   //! States.  See GetState().
@@ -184,6 +358,20 @@ public:
   //! Provides socket input to the engine
   virtual XmppReturnStatus HandleInput(const char * bytes, size_t len) = 0;
 
+  //! Returns a buffer of |len| bytes for reading socket input into, or NULL
+  //! if the engine can't take input. Pass the number of bytes read to
+  //! HandleInputBuffer, which parses them in place, unlike HandleInput.
+  virtual char * GetInputBuffer(size_t len) = 0;
+  virtual XmppReturnStatus HandleInputBuffer(size_t len) = 0;
+
+  //! Frees what the engine keeps for the next stanza each way, as for a
+  //! connection gone idle, without affecting the stream. Returns the bytes
+  //! freed.
+  virtual size_t TrimMemory() = 0;
+  //! The bytes the parser holds for input and the stanza being built,
+  //! besides Expat's own buffer.
+  virtual size_t GetParserBufferSize() = 0;
+
   //! Advises the engine that the socket has closed
   virtual XmppReturnStatus ConnectionClosed(int subcode) = 0;
 
@@ -202,6 +390,46 @@ public:
   //! Sets whether TLS will be used within the connection (default true).
   virtual XmppReturnStatus SetUseTls(bool useTls) = 0;
 
+  //! Sets whether TLS is declined even when the server offers it, as on a
+  //! Unix domain socket that only this host can reach (default false).
+  //! SetUseTls(true) still requires it.
+  virtual XmppReturnStatus SetSkipTls(bool skip) = 0;
+
+  //! Sets whether the login sends the steps it can predict without
+  //! waiting for the server's answer to the one before (default false).
+  //! After an <auth/> that needs no challenge, the stream restart and the
+  //! bind go out with it, and the session request goes out with the bind.
+  //! The server must take input it hasn't asked for yet, as most do.
+  virtual XmppReturnStatus SetPipelinedLogin(bool pipelined) = 0;
+
+  //! Sets whether the login asks for XEP-0138 zlib stream compression
+  //! where the server offers it, after authenticating (default false).
+  //! |level| is 0 to 9, or -1 for zlib's default, and |window_bits| 9 to
+  //! 15; lower ones save CPU and memory for fewer bytes saved.  The output
+  //! handler's StartCompression must be able to do it.
+  virtual XmppReturnStatus SetCompression(bool enable, int level,
+                                          int window_bits) = 0;
+
+  //! Sets whether the login asks for the binary XML encoding, as the
+  //! XEP-0138 method kBinaryXmlMethod, where the server offers it after
+  //! authenticating (default false). It is asked for before zlib, and the
+  //! stream then goes on in it rather than in XML; see BinaryXmlWriter.
+  virtual XmppReturnStatus SetBinaryXml(bool enable) = 0;
+
+  //! Sets whether the engine connects as a XEP-0114 component rather than
+  //! a client (default false).  The stream is then in
+  //! jabber:component:accept, to the domain of the user JID, and the login
+  //! is a handshake on |secret|, with no TLS, SASL or bind.  Once logged
+  //! in, FullJid is the domain, and each stanza sent says which identity
+  //! in it it is from, so that one connection carries any number of them:
+  //! SendStanza refuses one whose "from" is not in the domain with
+  //! XMPP_RETURN_BADARGUMENT, as the server would close the stream over
+  //! it.  Stanzas received are read as jabber:client, so that handlers and
+  //! the QN_ constants work as they do for a client.  The handshake needs
+  //! SHA-1, which only builds with OpenSSL.
+  virtual XmppReturnStatus SetComponentMode(bool enable,
+                                            const std::string & secret) = 0;
+
   //! Sets an alternate domain from which we allows TLS certificates.
   //! This is for use in the case where a we want to allow a proxy to
   //! serve up its own certificate rather than one owned by the underlying
@@ -274,12 +502,166 @@ public:
   //! Removes a listener for session events.
   virtual XmppReturnStatus RemoveStanzaHandler(XmppStanzaHandler* handler) = 0;
 
+  //! Lets a stanza handler keep the incoming stanza it is given without a
+  //! copy. If |stanza| is that stanza and no handler took it yet, returns
+  //! it and sets |arena| to the arena it was parsed into; the caller
+  //! deletes the stanza and then the arena once done. The stanza still
+  //! lives until the handlers after the taker have had it. Returns NULL
+  //! otherwise, when the handler has to copy the stanza to keep it.
+  virtual XmlElement * TakeIncomingStanza(const XmlElement * stanza,
+                                          XmlArena ** arena) = 0;
+
   //! Sends a stanza to the server.
   virtual XmppReturnStatus SendStanza(const XmlElement * pelStanza) = 0;
 
+  //! Sends a prepared stanza to the server, from its kept bytes once the
+  //! handshake is done.  |to| and |id| fill its slots when not empty.
+  virtual XmppReturnStatus SendPreparedStanza(const PreparedStanza * stanza,
+                                              const std::string & to,
+                                              const std::string & id) = 0;
+
+  //! Sends a shared stanza to the server, with "to" and "id" set to |to|
+  //! and |id| where they are not empty.  Once it is written, the output
+  //! holds a reference to the stanza's bytes until they are sent, rather
+  //! than a copy; with stream management on they are copied, to be kept
+  //! until acked.  Fails with XMPP_RETURN_BADSTATE until the handshake is
+  //! done.
+  virtual XmppReturnStatus SendSharedStanza(const SharedStanza * stanza,
+                                            const std::string & to,
+                                            const std::string & id) = 0;
+
   //! Sends raw text to the server
   virtual XmppReturnStatus SendRaw(const std::string & text) = 0;
 
+  //! Sends a stanza the caller has printed in |text|, as XML with
+  //! jabber:client as the default namespace, counted as SendStanza counts
+  //! them. Its bytes are taken from |text| without a copy, unless stream
+  //! management keeps them until acked. Fails with XMPP_RETURN_BADSTATE
+  //! until the handshake is done.
+  virtual XmppReturnStatus SendStanzaText(std::string * text) = 0;
+
+  //! Passes the character data of the children of incoming stanzas that
+  //! |sink| wants to it as they are parsed, instead of building it, so that
+  //! a large payload need never be held whole. |sink| must outlive the
+  //! engine or be replaced first. NULL, the default, builds it all.
+  //! Stanzas kept raw, offloaded or with lazy children still hold their
+  //! input.
+  virtual void SetTextSink(XmppTextSink * sink) = 0;
+
+  //! Keeps the bytes of each incoming stanza while it is handled, so that
+  //! ForwardRaw can send them on.  Off by default.
+  virtual void SetKeepRawStanzas(bool keep) = 0;
+
+  //! Builds only incoming stanzas and their children up front, parsing
+  //! what is under the children the first time a handler looks at it.
+  //! Off by default.
+  virtual void SetLazyStanzaChildren(bool lazy) = 0;
+
+  //! Drops the whitespace between the elements of incoming stanzas, which
+  //! pretty printed input is full of, rather than building it as text.
+  //! Elements with no children keep their text, and message bodies all of
+  //! theirs.  Off by default.
+  virtual void SetStripWhitespace(bool strip) = 0;
+
+  //! Times a sample of the stanzas each way through the engine, from the
+  //! socket event they were read in to their handlers returning, and from
+  //! SendStanza to the output handler's write, for |stats|, which must
+  //! outlive the engine or be replaced first.  NULL, the default, turns it
+  //! off.
+  virtual void SetStanzaStats(StanzaStats * stats) = 0;
+
+  //! Counts the stanzas each way once the session is open, and times the
+  //! iqs sent with SendIq, in |counters|, which must outlive the engine or
+  //! be replaced first.  NULL, the default, turns it off.
+  virtual void SetCounters(XmppEngineCounters * counters) = 0;
+
+  //! Builds incoming stanzas that grow past |size| bytes on |pool| rather
+  //! than as they are parsed, so that one large stanza doesn't hold up the
+  //! engine's thread, and the other engines on it, while its tree is
+  //! built. Stanzas are still handled in the order they came, the ones
+  //! after a large stanza waiting for it. The engine's thread must be a
+  //! Thread, and |pool| must outlive the engine. A NULL |pool| or a |size|
+  //! of 0, the default, builds every stanza in place. Only before Connect,
+  //! as the input is kept from the start of the stream for it.
+  virtual XmppReturnStatus SetStanzaOffload(ThreadPool * pool,
+                                            size_t size) = 0;
+
+  //! Calls the HL_PEEK handlers added from now on that aren't HC_INLINE
+  //! on |pool|; see XmppStanzaHandler.GetConcurrency. Removing such a
+  //! handler waits for its calls under way, and drops the stanzas it has
+  //! yet to be handed, as does deleting the engine. |pool| must outlive
+  //! the engine. NULL, the default, calls every handler on the engine's
+  //! thread. Fails with XMPP_RETURN_BADSTATE while handlers are added to
+  //! the pool set before.
+  virtual XmppReturnStatus SetHandlerPool(ThreadPool * pool) = 0;
+
+  //! Hands the stanzas of each read to the handlers by kind: iqs as they
+  //! are parsed, then messages, then presence, so that a flood of presence,
+  //! as from a large room, doesn't hold up the iq responses read with it.
+  //! A stanza from a sender with one held back goes after it, so each
+  //! sender's stanzas keep their order, and any other stanza, such as a
+  //! stream management request, is handled after all that came before it.
+  //! Off by default.
+  virtual void SetPrioritizeInput(bool prioritize) = 0;
+
+  //! Coalesces the presence each full JID sends: an available or
+  //! unavailable presence is held back for up to |window_ms|, and a later
+  //! one from the same JID replaces it, so that the handlers see only the
+  //! last of a burst, as at login or on joining a room. 0 holds them to the
+  //! end of the read; they are otherwise handed on from Flush, which the
+  //! output handler's OutputDelayed asks for.  A sender's other stanzas,
+  //! and any stanza that isn't a message or an iq, go after what is held.
+  //! The presence replaced is counted in XmppEngineCounters as coalesced.
+  //! Negative, the default, turns it off.
+  virtual void SetPresenceCoalescing(int window_ms) = 0;
+
+  //! While corked, output made once the session is open is held back when
+  //! the engine returns instead of being written, so that a burst of
+  //! stanzas goes out in one write.  The output handler's OutputPending
+  //! tells it when there is some to Flush.  Uncorking flushes.  Off by
+  //! default.
+  virtual void SetCorked(bool corked) = 0;
+
+  //! Writes the output held back while corked, and the shaped stanzas
+  //! whose time has come, then hands on the coalesced presence and times
+  //! out the iq batches that are due.  Called from within the engine, the
+  //! output is written when the engine returns.
+  virtual XmppReturnStatus Flush() = 0;
+
+  //! Shapes the stanzas sent once the session is open, as |shaping| says.
+  //! Stanzas held back are sent by Flush, which the output handler's
+  //! OutputDelayed tells it when to call.  Shaping with no buckets turns
+  //! it off, sending the stanzas waiting.  Off by default.
+  virtual void SetShaping(const XmppShaping & shaping) = 0;
+
+  //! The stanzas held back by shaping.
+  virtual size_t GetShapedStanzaCount() = 0;
+
+  //! Turns on XEP-0198 stream management, where the server offers it.
+  //! Stanzas each way are then acked, and those sent are kept until they
+  //! are, so that a later engine given GetResumeState can resume the
+  //! stream instead of binding a new one, and send them again.  An ack is
+  //! asked for after every |ack_interval| stanzas sent, if it is not 0.
+  //! Must be set before Connect.  Off by default.
+  virtual XmppReturnStatus SetStreamManagement(bool enable,
+                                               int ack_interval) = 0;
+
+  //! Has the login resume the stream in |state|, if the server allows it.
+  //! Must be set before Connect.
+  virtual XmppReturnStatus SetResumeState(const XmppResumeState & state) = 0;
+
+  //! Fills in |state| and returns true if the stream can be resumed.
+  //! Usually called once the engine is closed.
+  virtual bool GetResumeState(XmppResumeState * state) = 0;
+
+  //! Asks the server to ack the stanzas sent so far.
+  virtual XmppReturnStatus RequestAck() = 0;
+
+  //! Sends |pelStanza| to the server.  If it is the incoming stanza being
+  //! handled and its bytes are kept, they are sent as they were received
+  //! instead of printing the stanza again; otherwise this is SendStanza.
+  virtual XmppReturnStatus ForwardRaw(const XmlElement * pelStanza) = 0;
+
   //! Sends an iq to the server, and registers a callback for the result.
   //! Returns the cookie passed to the result handler.
   virtual XmppReturnStatus SendIq(const XmlElement* pelStanza,
@@ -291,6 +673,19 @@ public:
   virtual XmppReturnStatus RemoveIqHandler(XmppIqCookie cookie,
                                       XmppIqHandler** iq_handler) = 0;
 
+  //! Sends the iqs in |stanzas| in one write and tracks them together, as
+  //! for a disco#info to each contact, calling |handler| once when each
+  //! has a response, or when |timeout_ms| has passed if it is not 0.  The
+  //! timeout is kept by Flush, which the output handler's OutputDelayed
+  //! tells it when to call.  Each iq must be a get or a set with an id.
+  //! Returns the cookie passed to the handler.
+  virtual XmppReturnStatus SendIqBatch(
+      const std::vector<const XmlElement *> & stanzas, int timeout_ms,
+      XmppIqBatchHandler * handler, XmppIqCookie * cookie) = 0;
+
+  //! Unregisters a batch given its cookie.  Its handler is not called.
+  virtual XmppReturnStatus RemoveIqBatch(XmppIqCookie cookie) = 0;
+
 
   //! Forms and sends an error in response to the given stanza.
   //! Swaps to and from, sets type to "error", and adds error information
@@ -306,8 +701,9 @@ public:
 
   //! The next unused iq id for this connection.
   //! Call this when building iq stanzas, to ensure that each iq
-  //! gets its own unique id.
-  virtual std::string NextId() = 0;
+  //! gets its own unique id.  Ids start with a prefix picked at random
+  //! for the engine, so that they don't repeat those of another session.
+  virtual XmppId NextId() = 0;
 
 };
 
@@ -29,16 +29,26 @@
 
 #define TRACK_ARRAY_ALLOC_PROBLEM
 
+#include <string.h>
 #include <vector>
-#include <sstream>
 #include <algorithm>
 #include "xmlelement.h"
+#include "allocstats.h"
 #include "common.h"
 #include "xmpplogintask.h"
 #include "constants.h"
 #include "xmlprinter.h"
+#include "preparedstanza.h"
 #include "saslhandler.h"
 #include "logging.h"
+#include "metrics.h"
+#include "helpers.h"
+#include "stringencode.h"
+#include "thread.h"
+#include "threadpool.h"
+#include "time.h"
+#include "tracepoints.h"
+#include "xmppstats.h"
 
 namespace txmpp {
 
@@ -53,36 +63,58 @@ XmppEngine * XmppEngine::Create() {
   return new XmppEngineImpl();
 }
 
+SharedStanza * XmppEngine::CreateSharedStanza(const XmlElement * stanza) {
+  return SharedStanza::Create(stanza, XMPP_CLIENT_NAMESPACES,
+                              XMPP_CLIENT_NAMESPACES_LEN);
+}
+
 
 XmppEngineImpl::XmppEngineImpl() :
     stanzaParseHandler_(this),
     stanzaParser_(&stanzaParseHandler_),
     engine_entered_(0),
+    state_(STATE_START),
     user_jid_(JID_EMPTY),
-    password_(),
-    requested_resource_(STR_EMPTY),
     tls_needed_(true),
+    tls_skipped_(false),
+    encrypted_(false),
+    pipelined_login_(false),
+    component_(false),
+    compression_(false),
+    binary_xml_(false),
+    binary_(false),
     login_task_(new XmppLoginTask(this)),
     next_id_(0),
     bound_jid_(JID_EMPTY),
-    state_(STATE_START),
-    encrypted_(false),
     error_code_(ERROR_NONE),
     subcode_(0),
     stream_error_(NULL),
     raised_reset_(false),
+    stream_management_enabled_(false),
+    corked_(false),
+    output_pending_(false),
+    flush_requested_(false),
     output_handler_(NULL),
     session_handler_(NULL),
-    iq_entries_(new IqEntryVector()),
+    shaper_wait_(false),
+    shaper_due_(0),
+    offload_pool_(NULL),
+    counters_(NULL),
     sasl_handler_(NULL),
-    output_(new std::stringstream()) {
-  for (int i = 0; i < HL_COUNT; i+= 1) {
-    stanza_handlers_[i].reset(new StanzaHandlerVector());
+    output_() {
+  static const char kIdChars[] = "abcdefghijklmnopqrstuvwxyzABCDEF";
+  uint32 random = CreateRandomId();
+  for (int i = 0; i < kIdPrefixLength; i += 1) {
+    id_prefix_[i] = kIdChars[random & 31];
+    random >>= 5;
   }
+  LibraryMetrics::Add(LibraryMetrics::LM_XMPP_ENGINES);
 }
 
 XmppEngineImpl::~XmppEngineImpl() {
+  LibraryMetrics::Add(LibraryMetrics::LM_XMPP_ENGINES, -1);
   DeleteIqCookies();
+  DeleteHeldInput();
 }
 
 XmppReturnStatus
@@ -112,12 +144,58 @@ XmppEngineImpl::HandleInput(const char * bytes, size_t len) {
 
   EnterExit ee(this);
 
+  if (stanza_sampler_.get())
+    stanza_sampler_->InputStart();
   // TODO(jliaw): The return value of the xml parser is not checked.
   stanzaParser_.Parse(bytes, len, false);
+  HandleDeferredInput();
 
   return XMPP_RETURN_OK;
 }
 
+char *
+XmppEngineImpl::GetInputBuffer(size_t len) {
+  if (state_ < STATE_OPENING || state_ > STATE_OPEN)
+    return NULL;
+
+  return stanzaParser_.GetBuffer(len);
+}
+
+XmppReturnStatus
+XmppEngineImpl::HandleInputBuffer(size_t len) {
+  if (state_ < STATE_OPENING || state_ > STATE_OPEN)
+    return XMPP_RETURN_BADSTATE;
+
+  EnterExit ee(this);
+
+  if (stanza_sampler_.get())
+    stanza_sampler_->InputStart();
+  stanzaParser_.ParseBuffer(len, false);
+  HandleDeferredInput();
+
+  return XMPP_RETURN_OK;
+}
+
+size_t
+XmppEngineImpl::TrimMemory() {
+  // Within the engine, the buffers may be in use.
+  if (engine_entered_)
+    return 0;
+
+  size_t freed = stanzaParser_.Trim();
+  if (output_.empty() && output_.capacity() > std::string().capacity()) {
+    freed += output_.capacity();
+    std::string().swap(output_);
+  }
+  freed += output_chain_.Trim();
+  return freed;
+}
+
+size_t
+XmppEngineImpl::GetParserBufferSize() {
+  return stanzaParser_.BufferSize();
+}
+
 XmppReturnStatus
 XmppEngineImpl::ConnectionClosed(int subcode) {
   if (state_ != STATE_CLOSED) {
@@ -143,14 +221,80 @@ XmppEngineImpl::SetUseTls(bool useTls) {
   return XMPP_RETURN_OK;
 }
 
+XmppReturnStatus
+XmppEngineImpl::SetSkipTls(bool skip) {
+  if (state_ != STATE_START)
+    return XMPP_RETURN_BADSTATE;
+
+  tls_skipped_ = skip;
+
+  return XMPP_RETURN_OK;
+}
+
+XmppReturnStatus
+XmppEngineImpl::SetPipelinedLogin(bool pipelined) {
+  if (state_ != STATE_START)
+    return XMPP_RETURN_BADSTATE;
+
+  pipelined_login_ = pipelined;
+
+  return XMPP_RETURN_OK;
+}
+
+XmppReturnStatus
+XmppEngineImpl::SetCompression(bool enable, int level, int window_bits) {
+  if (state_ != STATE_START)
+    return XMPP_RETURN_BADSTATE;
+
+  compression_ = enable;
+  if (enable) {
+    Settings & settings = MutableSettings();
+    settings.compression_level = level;
+    settings.compression_window_bits = window_bits;
+  }
+
+  return XMPP_RETURN_OK;
+}
+
+XmppReturnStatus
+XmppEngineImpl::SetBinaryXml(bool enable) {
+  if (state_ != STATE_START)
+    return XMPP_RETURN_BADSTATE;
+
+  binary_xml_ = enable;
+
+  return XMPP_RETURN_OK;
+}
+
+XmppReturnStatus
+XmppEngineImpl::SetComponentMode(bool enable, const std::string & secret) {
+  if (state_ != STATE_START)
+    return XMPP_RETURN_BADSTATE;
+
+  component_ = enable;
+  if (enable || settings_.get())
+    MutableSettings().component_secret = enable ? secret : STR_EMPTY;
+  stanzaParser_.SetNamespaceAlias(enable ? NS_COMPONENT_ACCEPT : STR_EMPTY,
+                                  NS_CLIENT);
+
+  return XMPP_RETURN_OK;
+}
+
+bool
+XmppEngineImpl::IsComponentFrom(const XmlElement * element) const {
+  Jid from(element->Attr(QN_FROM));
+  return from.IsValid() && from.domain() == user_jid_.domain();
+}
+
 XmppReturnStatus
 XmppEngineImpl::SetTlsServer(const std::string & tls_server_hostname,
                              const std::string & tls_server_domain) {
   if (state_ != STATE_START)
     return XMPP_RETURN_BADSTATE;
 
-  tls_server_hostname_ = tls_server_hostname;
-  tls_server_domain_= tls_server_domain;
+  Settings & settings = MutableSettings();
+  settings.tls_server_hostname = tls_server_hostname;
+  settings.tls_server_domain = tls_server_domain;
 
   return XMPP_RETURN_OK;
 }
@@ -189,14 +333,26 @@ XmppEngineImpl::SetRequestedResource(const std::string & resource) {
   if (state_ != STATE_START)
     return XMPP_RETURN_BADSTATE;
 
-  requested_resource_ = resource;
+  MutableSettings().requested_resource = resource;
 
   return XMPP_RETURN_OK;
 }
 
 const std::string &
 XmppEngineImpl::GetRequestedResource() {
-  return requested_resource_;
+  return RequestedResource();
+}
+
+void
+XmppEngineImpl::SetLanguage(const std::string & lang) {
+  MutableSettings().lang = lang;
+}
+
+XmppEngineImpl::Settings &
+XmppEngineImpl::MutableSettings() {
+  if (!settings_.get())
+    settings_.reset(new Settings());
+  return *settings_;
 }
 
 XmppReturnStatus
@@ -205,7 +361,14 @@ XmppEngineImpl::AddStanzaHandler(XmppStanzaHandler * stanza_handler,
   if (state_ == STATE_CLOSED)
     return XMPP_RETURN_BADSTATE;
 
-  stanza_handlers_[level]->push_back(stanza_handler);
+  XmppConcurrentDispatch * concurrent = ConcurrentHandlers();
+  if (concurrent && level == HL_PEEK &&
+      stanza_handler->GetConcurrency() != XmppStanzaHandler::HC_INLINE)
+    stanza_handler = concurrent->Add(stanza_handler);
+
+  if (!stanza_handlers_[level].get())
+    stanza_handlers_[level].reset(new XmppStanzaDispatch());
+  stanza_handlers_[level]->Add(stanza_handler);
 
   return XMPP_RETURN_OK;
 }
@@ -215,17 +378,21 @@ XmppEngineImpl::RemoveStanzaHandler(XmppStanzaHandler * stanza_handler) {
 
   bool found = false;
 
-  for (int level = 0; level < HL_COUNT; level += 1) {
-    StanzaHandlerVector::iterator new_end =
-      std::remove(stanza_handlers_[level]->begin(),
-      stanza_handlers_[level]->end(),
-      stanza_handler);
+  // A handler called on the pool is out of the dispatch before it stops.
+  XmppConcurrentDispatch * concurrent = ConcurrentHandlers();
+  XmppStanzaHandler * proxy =
+      concurrent ? concurrent->Find(stanza_handler) : NULL;
 
-    if (new_end != stanza_handlers_[level]->end()) {
-      stanza_handlers_[level]->erase(new_end, stanza_handlers_[level]->end());
+  for (int level = 0; level < HL_COUNT; level += 1) {
+    if (stanza_handlers_[level].get() &&
+        stanza_handlers_[level]->Remove(stanza_handler))
+      found = true;
+    if (proxy && stanza_handlers_[level].get() &&
+        stanza_handlers_[level]->Remove(proxy))
       found = true;
-    }
   }
+  if (proxy)
+    concurrent->Remove(stanza_handler);
 
   if (!found) {
     return XMPP_RETURN_BADARGUMENT;
@@ -234,6 +401,12 @@ XmppEngineImpl::RemoveStanzaHandler(XmppStanzaHandler * stanza_handler) {
   return XMPP_RETURN_OK;
 }
 
+XmlElement *
+XmppEngineImpl::TakeIncomingStanza(const XmlElement * stanza,
+                                   XmlArena ** arena) {
+  return stanzaParser_.TakeStanza(stanza, arena);
+}
+
 XmppReturnStatus
 XmppEngineImpl::Connect() {
   if (state_ != STATE_START)
@@ -261,19 +434,364 @@ XmppEngineImpl::SendStanza(const XmlElement * element) {
   LOG(LS_SENSITIVE) << "SEND: " << element->Str();
 #endif
 
+  if (component_ && !IsComponentFrom(element))
+    return XMPP_RETURN_BADARGUMENT;
+
+  TXMPP_TRACE2(xmpp_stanza_out, this, element->Name().LocalPart().c_str());
   EnterExit ee(this);
 
   if (login_task_.get()) {
     // still handshaking - then outbound stanzas are queued
     login_task_->OutgoingStanza(element);
+  } else if (shaper_.get() && !shaper_->Admit(element, CachedTime())) {
+    // held back by shaping - send what may go instead
+    SendShaped();
   } else {
     // handshake done - send straight through
-    InternalSendStanza(element);
+    if (stanza_sampler_.get())
+      stanza_sampler_->SendStart(element->Name());
+    InternalSendCountedStanza(element);
+  }
+
+  return XMPP_RETURN_OK;
+}
+
+XmppReturnStatus
+XmppEngineImpl::SendPreparedStanza(const PreparedStanza * stanza,
+                                   const std::string & to,
+                                   const std::string & id) {
+  if (state_ == STATE_CLOSED)
+    return XMPP_RETURN_BADSTATE;
+
+  EnterExit ee(this);
+
+  if (login_task_.get()) {
+    // still handshaking - queue a copy with the slots filled in
+    scoped_ptr<XmlElement> element(stanza->CreateElement(to, id));
+    login_task_->OutgoingStanza(element.get());
+  } else {
+    ASSERT(!stanza->stanza()->HasAttr(QN_FROM));
+    if (binary_) {
+      scoped_ptr<XmlElement> element(stanza->CreateElement(to, id));
+      InternalSendCountedStanza(element.get());
+      return XMPP_RETURN_OK;
+    }
+    if (counters_)
+      counters_->stanzas_out[XmppStanzaKindOf(stanza->stanza()->Name())] += 1;
+    LibraryMetrics::Add(LibraryMetrics::LM_XMPP_STANZAS_OUT);
+    size_t start = output_.size();
+    stanza->Print(&output_, to, id,
+                  XMPP_CLIENT_NAMESPACES, XMPP_CLIENT_NAMESPACES_LEN);
+#ifdef _DEBUG
+    LOG(LS_SENSITIVE) << "SEND: " << output_.substr(start);
+#endif
+    CountSentStanza(start);
   }
 
   return XMPP_RETURN_OK;
 }
 
+XmppReturnStatus
+XmppEngineImpl::SendSharedStanza(const SharedStanza * stanza,
+                                 const std::string & to,
+                                 const std::string & id) {
+  if (state_ == STATE_CLOSED || login_task_.get())
+    return XMPP_RETURN_BADSTATE;
+
+  EnterExit ee(this);
+
+  const std::string & bytes = stanza->data();
+  if (counters_)
+    counters_->stanzas_out[XmppStanzaKindOf(bytes.data() + 1,
+                                            stanza->slot() - 1)] += 1;
+  LibraryMetrics::Add(LibraryMetrics::LM_XMPP_STANZAS_OUT);
+  if (binary_) {
+    // The bytes are XML, so there is nothing to share.
+    std::string text;
+    stanza->PrintHead(&text, to, id);
+    text.append(bytes, stanza->slot(), std::string::npos);
+    AppendXmlAsBinary(text, true);
+    return XMPP_RETURN_OK;
+  }
+
+  size_t start = output_.size();
+  stanza->PrintHead(&output_, to, id);
+  if (stream_management_.sending()) {
+    // The bytes are kept until acked, so they are copied anyway.
+    output_.append(bytes, stanza->slot(), std::string::npos);
+    CountSentStanza(start);
+  } else {
+    output_chain_.AppendString(&output_);
+    output_chain_.AppendShared(stanza, stanza->slot(),
+                               bytes.size() - stanza->slot());
+  }
+#ifdef _DEBUG
+  LOG(LS_SENSITIVE) << "SEND: shared stanza to " << to;
+#endif
+
+  return XMPP_RETURN_OK;
+}
+
+void
+XmppEngineImpl::SetKeepRawStanzas(bool keep) {
+  stanzaParser_.SetKeepRaw(keep);
+}
+
+void
+XmppEngineImpl::SetCorked(bool corked) {
+  corked_ = corked;
+  if (!corked)
+    Flush();
+}
+
+XmppReturnStatus
+XmppEngineImpl::Flush() {
+  if (state_ == STATE_CLOSED)
+    return XMPP_RETURN_BADSTATE;
+
+  // EnterExit writes the output on the way out of the engine.
+  EnterExit ee(this);
+  SendShaped();
+  HandleDeferredInput();
+  ExpireIqBatches();
+  flush_requested_ = true;
+  return XMPP_RETURN_OK;
+}
+
+void
+XmppEngineImpl::SetShaping(const XmppShaping & shaping) {
+  EnterExit ee(this);
+  scoped_ptr<XmppShaper> old_shaper(shaper_.release());
+  if (shaping.burst > 0 || shaping.jid_burst > 0)
+    shaper_.reset(new XmppShaper(shaping));
+  shaper_wait_ = false;
+  if (!old_shaper.get())
+    return;
+
+  // The stanzas the old shaper held go through the new one, or straight
+  // out without one.
+  uint32 now = CachedTime();
+  for (;;) {
+    scoped_ptr<XmlElement> stanza(old_shaper->Pop());
+    if (!stanza.get())
+      break;
+    if (state_ == STATE_OPEN &&
+        (!shaper_.get() || shaper_->Admit(stanza.get(), now)))
+      InternalSendCountedStanza(stanza.get());
+  }
+  SendShaped();
+}
+
+size_t
+XmppEngineImpl::GetShapedStanzaCount() {
+  return shaper_.get() ? shaper_->queued() : 0;
+}
+
+void
+XmppEngineImpl::SendShaped() {
+  if (!shaper_.get() || state_ != STATE_OPEN || login_task_.get())
+    return;
+
+  uint32 now = CachedTime();
+  if (shaper_wait_ && TimeDiff(now, shaper_due_) >= 0)
+    shaper_wait_ = false;
+  for (;;) {
+    scoped_ptr<XmlElement> stanza(shaper_->Next(now));
+    if (!stanza.get())
+      break;
+    InternalSendCountedStanza(stanza.get());
+  }
+
+  int delay = shaper_->TimeUntilNext(now);
+  if (delay == kForever || !output_handler_)
+    return;
+  // A Flush already due by then will do.
+  if (shaper_wait_ && TimeDiff(shaper_due_, now + delay) <= 0)
+    return;
+  shaper_wait_ = true;
+  shaper_due_ = now + delay;
+  output_handler_->OutputDelayed(delay);
+}
+
+void
+XmppEngineImpl::SetLazyStanzaChildren(bool lazy) {
+  stanzaParser_.SetLazyChildren(lazy);
+}
+
+void
+XmppEngineImpl::SetStripWhitespace(bool strip) {
+  stanzaParser_.SetStripWhitespace(strip);
+}
+
+void
+XmppEngineImpl::SetTextSink(XmppTextSink * sink) {
+  if (!sink && !settings_.get())
+    return;
+  MutableSettings().text_sink = sink;
+  stanzaParser_.SetTextStreaming(sink != NULL);
+}
+
+void
+XmppEngineImpl::SetStanzaStats(StanzaStats * stats) {
+  stanza_sampler_.reset(stats ? new StanzaSampler(stats) : NULL);
+}
+
+void
+XmppEngineImpl::SetCounters(XmppEngineCounters * counters) {
+  counters_ = counters;
+}
+
+// Builds a large stanza on the offload pool. The job is posted with itself
+// as the reply, so OnMessage runs first on a pool thread and then on the
+// engine's. An engine that goes away in between orphans the job, which then
+// frees itself.
+class XmppEngineImpl::OffloadJob : public MessageHandler {
+ public:
+  OffloadJob(XmppEngineImpl * engine, std::string * xml,
+             bool strip_whitespace)
+    : engine_(engine), strip_whitespace_(strip_whitespace), ran_(false),
+      done_(false) {
+    xml_.swap(*xml);
+  }
+
+  void Orphan() { engine_ = NULL; }
+  bool done() const { return done_; }
+  // The stanza, once done, or NULL if it could not be built.
+  XmlElement * stanza() {
+    return wrapper_.get() ? wrapper_->FirstElement() : NULL;
+  }
+
+  virtual void OnMessage(Message * msg) {
+    if (!ran_) {
+      ran_ = true;
+      wrapper_.reset(XmlElement::ForStr(xml_, strip_whitespace_));
+      std::string().swap(xml_);
+      return;
+    }
+    if (engine_) {
+      done_ = true;
+      // May delete this job.
+      engine_->ReleaseHeldInput();
+    } else {
+      delete this;
+    }
+  }
+
+ private:
+  XmppEngineImpl * engine_;
+  bool strip_whitespace_;
+  std::string xml_;
+  scoped_ptr<XmlElement> wrapper_;
+  bool ran_;
+  bool done_;
+};
+
+XmppReturnStatus
+XmppEngineImpl::SetStanzaOffload(ThreadPool * pool, size_t size) {
+  if (state_ != STATE_START)
+    return XMPP_RETURN_BADSTATE;
+
+  offload_pool_ = size ? pool : NULL;
+  stanzaParser_.SetOffloadSize(pool ? size : 0);
+
+  return XMPP_RETURN_OK;
+}
+
+XmppReturnStatus
+XmppEngineImpl::SetHandlerPool(ThreadPool * pool) {
+  XmppConcurrentDispatch * concurrent = ConcurrentHandlers();
+  if (concurrent && !concurrent->empty())
+    return XMPP_RETURN_BADSTATE;
+  if (!pool && !concurrent)
+    return XMPP_RETURN_OK;
+
+  MutableSettings().concurrent_handlers.reset(
+      pool ? new XmppConcurrentDispatch(pool) : NULL);
+
+  return XMPP_RETURN_OK;
+}
+
+void
+XmppEngineImpl::SetPrioritizeInput(bool prioritize) {
+  if (!prioritize && !GetDeferredInput())
+    return;
+  // Kept once made, as it may be in use, and the stanzas held back are
+  // still handled at the end of the read.
+  Settings & settings = MutableSettings();
+  if (!settings.deferred_input.get())
+    settings.deferred_input.reset(new DeferredInput());
+  settings.deferred_input->prioritize = prioritize;
+}
+
+void
+XmppEngineImpl::SetPresenceCoalescing(int window_ms) {
+  if (window_ms < 0 && !GetDeferredInput())
+    return;
+  EnterExit ee(this);
+  Settings & settings = MutableSettings();
+  if (!settings.deferred_input.get())
+    settings.deferred_input.reset(new DeferredInput());
+  DeferredInput * deferred = settings.deferred_input.get();
+  deferred->coalesce_ms = window_ms;
+  // What is held goes on now rather than wait on the old window.
+  ReleaseCoalesced(deferred, true);
+  HandleDeferredInput();
+}
+
+XmppReturnStatus
+XmppEngineImpl::ForwardRaw(const XmlElement * element) {
+  const char * data;
+  size_t len;
+  if (state_ == STATE_CLOSED || login_task_.get() ||
+      !stanzaParser_.RawStanza(element, &data, &len))
+    return SendStanza(element);
+
+  EnterExit ee(this);
+  size_t start = output_.size();
+  output_.append(data, len);
+  CountSentStanza(start);
+
+  return XMPP_RETURN_OK;
+}
+
+XmppReturnStatus
+XmppEngineImpl::SetStreamManagement(bool enable, int ack_interval) {
+  if (state_ != STATE_START)
+    return XMPP_RETURN_BADSTATE;
+
+  stream_management_enabled_ = enable;
+  stream_management_.set_ack_interval(ack_interval);
+
+  return XMPP_RETURN_OK;
+}
+
+XmppReturnStatus
+XmppEngineImpl::SetResumeState(const XmppResumeState & state) {
+  if (state_ != STATE_START)
+    return XMPP_RETURN_BADSTATE;
+
+  stream_management_.SetResumeState(state);
+
+  return XMPP_RETURN_OK;
+}
+
+bool
+XmppEngineImpl::GetResumeState(XmppResumeState * state) {
+  return stream_management_enabled_ &&
+         stream_management_.GetResumeState(state);
+}
+
+XmppReturnStatus
+XmppEngineImpl::RequestAck() {
+  if (state_ != STATE_OPEN || !stream_management_.sending())
+    return XMPP_RETURN_BADSTATE;
+
+  EnterExit ee(this);
+  SendAckRequest();
+
+  return XMPP_RETURN_OK;
+}
+
 XmppReturnStatus
 XmppEngineImpl::SendRaw(const std::string & text) {
   if (state_ == STATE_CLOSED || login_task_.get())
@@ -285,16 +803,75 @@ XmppEngineImpl::SendRaw(const std::string & text) {
 
   EnterExit ee(this);
 
-  (*output_) << text;
+  if (binary_)
+    AppendXmlAsBinary(text, false);
+  else
+    output_.append(text);
 
   return XMPP_RETURN_OK;
 }
 
-std::string
+XmppReturnStatus
+XmppEngineImpl::SendStanzaText(std::string * text) {
+  if (state_ == STATE_CLOSED || login_task_.get())
+    return XMPP_RETURN_BADSTATE;
+  if (text->size() < 2 || (*text)[0] != '<')
+    return XMPP_RETURN_BADARGUMENT;
+
+  EnterExit ee(this);
+
+  size_t name_len = strcspn(text->c_str() + 1, " \t\r\n/>");
+  if (counters_)
+    counters_->stanzas_out[XmppStanzaKindOf(text->data() + 1, name_len)] += 1;
+  LibraryMetrics::Add(LibraryMetrics::LM_XMPP_STANZAS_OUT);
+#ifdef _DEBUG
+  LOG(LS_SENSITIVE) << "SEND: " << *text;
+#endif
+  if (binary_) {
+    AppendXmlAsBinary(*text, true);
+  } else if (stream_management_.sending()) {
+    // The bytes are kept until acked, so they are copied anyway.
+    size_t start = output_.size();
+    output_.append(*text);
+    CountSentStanza(start);
+  } else {
+    output_chain_.AppendString(&output_);
+    output_chain_.AppendString(text);
+  }
+  text->clear();
+
+  return XMPP_RETURN_OK;
+}
+
+XmppId
 XmppEngineImpl::NextId() {
-  std::stringstream ss;
-  ss << next_id_++;
-  return ss.str();
+  XmppId id;
+  memcpy(id.data_, id_prefix_, kIdPrefixLength);
+
+  // The counter's digits come out last first.
+  char digits[10];
+  size_t count = 0;
+  uint32 value = next_id_++;
+  do {
+    digits[count++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+  for (size_t i = 0; i < count; ++i)
+    id.data_[kIdPrefixLength + i] = digits[count - 1 - i];
+
+  id.length_ = kIdPrefixLength + count;
+  id.data_[id.length_] = '\0';
+  return id;
+}
+
+XmppReturnStatus
+XmppEngineImpl::SetIdPrefix(const std::string & prefix) {
+  if (state_ != STATE_START)
+    return XMPP_RETURN_BADSTATE;
+  if (prefix.size() != kIdPrefixLength)
+    return XMPP_RETURN_BADARGUMENT;
+  memcpy(id_prefix_, prefix.data(), kIdPrefixLength);
+  return XMPP_RETURN_OK;
 }
 
 XmppReturnStatus
@@ -302,8 +879,10 @@ XmppEngineImpl::Disconnect() {
 
   if (state_ != STATE_CLOSED) {
     EnterExit ee(this);
-    if (state_ == STATE_OPEN)
-      *output_ << "</stream:stream>";
+    if (state_ == STATE_OPEN && binary_)
+      binary_writer_->WriteStreamEnd(&output_);
+    else if (state_ == STATE_OPEN)
+      output_.append("</stream:stream>");
     state_ = STATE_CLOSED;
   }
 
@@ -327,11 +906,347 @@ XmppEngineImpl::IncomingStart(const XmlElement * pelStart) {
   }
 }
 
+bool
+XmppEngineImpl::WantIncomingStanza(const XmppStanzaStart & start) {
+  if (!IsStanzaWanted(start)) {
+    // A stanza nobody wants is handled all the same.
+    stream_management_.StanzaHandled();
+    if (counters_)
+      counters_->stanzas_in[XmppStanzaKindOf(start.Name())] += 1;
+    LibraryMetrics::Add(LibraryMetrics::LM_XMPP_STANZAS_IN);
+    return false;
+  }
+
+  if (stanza_sampler_.get())
+    stanza_sampler_->StanzaStart(start.Name(),
+                                 held_input_.get() && !held_input_->empty());
+  return true;
+}
+
+bool
+XmppEngineImpl::IsStanzaWanted(const XmppStanzaStart & start) {
+  // Everything IncomingStanza handles itself is built, and so are iqs,
+  // which may need an error reply when nobody handles them.
+  if (HasError() || raised_reset_ || login_task_.get() ||
+      start.Name() == QN_STREAM_ERROR || start.Name() == QN_IQ ||
+      start.Name().Namespace() == NS_SM)
+    return true;
+
+  for (int level = HL_PEEK; level <= HL_ALL; level += 1) {
+    if (stanza_handlers_[level].get() &&
+        stanza_handlers_[level]->Wants(start))
+      return true;
+  }
+  return false;
+}
+
 void
 XmppEngineImpl::IncomingStanza(const XmlElement * stanza) {
+  TXMPP_TRACE2(xmpp_stanza_in, this, stanza->Name().LocalPart().c_str());
+  if (stanza_sampler_.get())
+    stanza_sampler_->StanzaParsed();
+  if (!held_input_.get() || held_input_->empty()) {
+    DeferredInput * deferred = GetDeferredInput();
+    if (!deferred || !DeferStanza(deferred, stanza))
+      HandleStanza(stanza);
+    return;
+  }
+
+  // Behind a large stanza - keep it, without a copy if it can be taken.
+  HeldInput held;
+  held.stanza = stanzaParser_.TakeStanza(stanza, &held.arena);
+  if (!held.stanza)
+    held.stanza = new XmlElement(*stanza);
+  HoldInput(held);
+}
+
+XmppEngineImpl::DeferredInput::DeferredInput()
+  : prioritize(false),
+    coalesce_ms(-1),
+    coalesce_wait(false),
+    coalesce_due(0) {
+  memset(senders, 0, sizeof(senders));
+  memset(coalesced_senders, 0, sizeof(coalesced_senders));
+}
+
+XmppEngineImpl::DeferredInput::~DeferredInput() {
+  for (int lane = 0; lane < kLanes; ++lane) {
+    for (size_t i = 0; i < lanes[lane].size(); ++i) {
+      delete lanes[lane][i].stanza;
+      delete lanes[lane][i].arena;
+    }
+  }
+  for (size_t i = 0; i < coalesced.size(); ++i) {
+    delete coalesced[i].stanza;
+    delete coalesced[i].arena;
+  }
+}
+
+static uint32
+SenderBit(const std::string & from, uint32 bits) {
+  // FNV-1a
+  uint32 hash = 2166136261U;
+  for (size_t i = 0; i < from.size(); ++i)
+    hash = (hash ^ static_cast<unsigned char>(from[i])) * 16777619U;
+  return hash % bits;
+}
+
+bool
+XmppEngineImpl::DeferStanza(DeferredInput * deferred,
+                            const XmlElement * stanza) {
+  bool coalesce = deferred->coalesce_ms >= 0;
+  if ((!deferred->prioritize && !coalesce) || login_task_.get())
+    return false;
+
+  int lane;
+  if (stanza->Name() == QN_IQ) {
+    lane = -1;
+  } else if (stanza->Name() == QN_MESSAGE) {
+    lane = DeferredInput::kMessages;
+  } else if (stanza->Name() == QN_PRESENCE) {
+    lane = DeferredInput::kPresence;
+  } else {
+    // Anything else, such as a stream management request, which counts
+    // what has been handled, goes after all that came before it.
+    ReleaseCoalesced(deferred, true);
+    HandleDeferredInput();
+    return false;
+  }
+
+  const std::string & from = stanza->Attr(QN_FROM);
+  uint32 bit = SenderBit(from, DeferredInput::kSenderBits);
+
+  if (coalesce) {
+    if (lane == DeferredInput::kPresence &&
+        CoalescePresence(deferred, stanza, bit))
+      return true;
+    // The sender's other stanzas go after the presence it has held.
+    if (deferred->coalesced_senders[bit / 32] & (1u << (bit % 32)))
+      ReleaseCoalesced(deferred, from);
+  }
+  if (!deferred->prioritize)
+    return false;
+
+  // Behind the sender's stanzas in the last lane that has any.
+  for (int i = DeferredInput::kLanes - 1; i > lane; --i) {
+    if (deferred->senders[i][bit / 32] & (1u << (bit % 32))) {
+      lane = i;
+      break;
+    }
+  }
+  if (lane < 0)
+    return false;
+
+  HeldInput held;
+  held.stanza = stanzaParser_.TakeStanza(stanza, &held.arena);
+  if (!held.stanza)
+    held.stanza = new XmlElement(*stanza);
+  deferred->lanes[lane].push_back(held);
+  deferred->senders[lane][bit / 32] |= 1u << (bit % 32);
+  return true;
+}
+
+bool
+XmppEngineImpl::CoalescePresence(DeferredInput * deferred,
+                                 const XmlElement * stanza, uint32 bit) {
+  // Only presence that states availability is replaced by the next;
+  // subscription requests and errors each need handling.
+  const std::string & from = stanza->Attr(QN_FROM);
+  const std::string & type = stanza->Attr(QN_TYPE);
+  if (from.empty() || (!type.empty() && type != STR_UNAVAILABLE))
+    return false;
+
+  HeldInput held;
+  held.stanza = stanzaParser_.TakeStanza(stanza, &held.arena);
+  if (!held.stanza)
+    held.stanza = new XmlElement(*stanza);
+
+  std::pair<std::map<std::string, size_t>::iterator, bool> inserted =
+      deferred->coalesced_index.insert(
+          std::make_pair(from, deferred->coalesced.size()));
+  if (!inserted.second) {
+    // The one it replaces is never handled, but counts as handled for
+    // stream management, as the server sent it.
+    HeldInput & old = deferred->coalesced[inserted.first->second];
+    delete old.stanza;
+    delete old.arena;
+    old = held;
+    stream_management_.StanzaHandled();
+    if (counters_)
+      counters_->presence_coalesced += 1;
+    LibraryMetrics::Add(LibraryMetrics::LM_XMPP_PRESENCE_COALESCED);
+    return true;
+  }
+  deferred->coalesced.push_back(held);
+  deferred->coalesced_senders[bit / 32] |= 1u << (bit % 32);
+
+  if (deferred->coalesce_ms > 0 && !deferred->coalesce_wait &&
+      output_handler_) {
+    deferred->coalesce_wait = true;
+    deferred->coalesce_due = CachedTime() + deferred->coalesce_ms;
+    output_handler_->OutputDelayed(deferred->coalesce_ms);
+  }
+  return true;
+}
+
+void
+XmppEngineImpl::ReleaseCoalesced(DeferredInput * deferred,
+                                 const std::string & from) {
+  std::map<std::string, size_t>::iterator it =
+      deferred->coalesced_index.find(from);
+  if (it == deferred->coalesced_index.end())
+    return;  // another sender with the same bit
+
+  // Its slot is left empty for ReleaseCoalesced to skip.
+  HeldInput held = deferred->coalesced[it->second];
+  deferred->coalesced[it->second] = HeldInput();
+  deferred->coalesced_index.erase(it);
+  PassCoalesced(deferred, held, SenderBit(from, DeferredInput::kSenderBits));
+}
+
+void
+XmppEngineImpl::ReleaseCoalesced(DeferredInput * deferred, bool all) {
+  if (deferred->coalesced.empty())
+    return;
+  // Within the window, the Flush asked for when it opened hands them on.
+  if (!all && deferred->coalesce_wait &&
+      TimeDiff(CachedTime(), deferred->coalesce_due) < 0)
+    return;
+
+  // Taken out first, as the handlers may reenter the engine.
+  std::vector<HeldInput> coalesced;
+  coalesced.swap(deferred->coalesced);
+  deferred->coalesced_index.clear();
+  memset(deferred->coalesced_senders, 0,
+         sizeof(deferred->coalesced_senders));
+  deferred->coalesce_wait = false;
+  for (size_t i = 0; i < coalesced.size(); ++i) {
+    if (!coalesced[i].stanza)
+      continue;
+    PassCoalesced(deferred, coalesced[i],
+                  SenderBit(coalesced[i].stanza->Attr(QN_FROM),
+                            DeferredInput::kSenderBits));
+  }
+}
+
+void
+XmppEngineImpl::PassCoalesced(DeferredInput * deferred,
+                              const HeldInput & held, uint32 bit) {
+  if (deferred->prioritize) {
+    deferred->lanes[DeferredInput::kPresence].push_back(held);
+    deferred->senders[DeferredInput::kPresence][bit / 32] |=
+        1u << (bit % 32);
+    return;
+  }
+  HandleStanza(held.stanza);
+  delete held.stanza;
+  delete held.arena;
+}
+
+void
+XmppEngineImpl::HandleDeferredInput() {
+  DeferredInput * deferred = GetDeferredInput();
+  if (!deferred)
+    return;
+  ReleaseCoalesced(deferred, false);
+  for (int lane = 0; lane < DeferredInput::kLanes; ++lane) {
+    std::deque<HeldInput> & queue = deferred->lanes[lane];
+    if (queue.empty())
+      continue;
+    while (!queue.empty()) {
+      HeldInput held = queue.front();
+      queue.pop_front();
+      HandleStanza(held.stanza);
+      delete held.stanza;
+      delete held.arena;
+    }
+    memset(deferred->senders[lane], 0, sizeof(deferred->senders[lane]));
+  }
+}
+
+void
+XmppEngineImpl::IncomingLargeStanza(std::string * xml) {
+  if (HasError() || raised_reset_)
+    return;
+
+  if (stanza_sampler_.get())
+    stanza_sampler_->StanzaParsed();
+  if (!offload_pool_ || !Thread::Current()) {
+    scoped_ptr<XmlElement> wrapper(
+        XmlElement::ForStr(*xml, stanzaParser_.StripWhitespace()));
+    if (wrapper.get() && wrapper->FirstElement())
+      IncomingStanza(wrapper->FirstElement());
+    else
+      IncomingEnd(true);
+    return;
+  }
+
+  HeldInput held;
+  held.job = new OffloadJob(this, xml, stanzaParser_.StripWhitespace());
+  HoldInput(held);
+  offload_pool_->Post(held.job, 0, NULL, held.job);
+}
+
+void
+XmppEngineImpl::HoldInput(const HeldInput & held) {
+  if (!held_input_.get())
+    held_input_.reset(new std::deque<HeldInput>());
+  held_input_->push_back(held);
+}
+
+void
+XmppEngineImpl::ReleaseHeldInput() {
+  EnterExit ee(this);
+
+  while (!held_input_->empty()) {
+    HeldInput held = held_input_->front();
+    if (held.job && !held.job->done())
+      break;
+    held_input_->pop_front();
+
+    if (held.job) {
+      if (held.job->stanza())
+        HandleStanza(held.job->stanza());
+      else if (!HasError() && !raised_reset_)
+        SignalError(ERROR_XML, 0);
+      delete held.job;
+    } else if (held.stanza) {
+      HandleStanza(held.stanza);
+      delete held.stanza;
+      delete held.arena;
+    } else if (!HasError() && !raised_reset_) {
+      SignalError(held.error ? ERROR_XML : ERROR_DOCUMENT_CLOSED, 0);
+    }
+  }
+}
+
+void
+XmppEngineImpl::DeleteHeldInput() {
+  if (!held_input_.get())
+    return;
+  for (size_t i = 0; i < held_input_->size(); ++i) {
+    HeldInput & held = (*held_input_)[i];
+    if (held.job && held.job->done()) {
+      delete held.job;
+    } else if (held.job) {
+      held.job->Orphan();
+    } else {
+      delete held.stanza;
+      delete held.arena;
+    }
+  }
+  held_input_->clear();
+}
+
+void
+XmppEngineImpl::HandleStanza(const XmlElement * stanza) {
   if (HasError() || raised_reset_)
     return;
 
+  AllocStats::RecordStanza();
+  if (stanza_sampler_.get())
+    stanza_sampler_->HandleStart();
+
 #ifdef _DEBUG
   LOG(LS_SENSITIVE) << "RECV: " << stanza->Str();
 #endif
@@ -344,20 +1259,25 @@ XmppEngineImpl::IncomingStanza(const XmlElement * stanza) {
     login_task_->IncomingStanza(stanza, false);
     if (login_task_->IsDone())
       login_task_.reset();
-  } else if (HandleIqResponse(stanza)) {
-    // iq is handled by above call
+  } else if (stanza->Name().Namespace() == NS_SM) {
+    IncomingStreamManagement(stanza);
   } else {
-    // give every "peek" handler a shot at all stanzas
-    for (size_t i = 0; i < stanza_handlers_[HL_PEEK]->size(); i += 1) {
-      (*stanza_handlers_[HL_PEEK])[i]->HandleStanza(stanza);
-    }
+    stream_management_.StanzaHandled();
+    if (counters_)
+      counters_->stanzas_in[XmppStanzaKindOf(stanza->Name())] += 1;
+    LibraryMetrics::Add(LibraryMetrics::LM_XMPP_STANZAS_IN);
+    if (HandleIqResponse(stanza))
+      goto Handled;  // iq is handled by above call
+
+    // give every "peek" handler a shot at all stanzas it may match
+    if (stanza_handlers_[HL_PEEK].get())
+      stanza_handlers_[HL_PEEK]->Dispatch(stanza, false);
 
     // give other handlers a shot in precedence order, stopping after handled
     for (int level = HL_SINGLE; level <= HL_ALL; level += 1) {
-      for (size_t i = 0; i < stanza_handlers_[level]->size(); i += 1) {
-        if ((*stanza_handlers_[level])[i]->HandleStanza(stanza))
-          goto Handled;
-      }
+      if (stanza_handlers_[level].get() &&
+          stanza_handlers_[level]->Dispatch(stanza, true))
+        goto Handled;
     }
 
     // If nobody wants to handle a stanza then send back an error.
@@ -370,11 +1290,29 @@ XmppEngineImpl::IncomingStanza(const XmlElement * stanza) {
     }
   }
   Handled:
-    ; // handled - we're done
+  XmppConcurrentDispatch * concurrent = ConcurrentHandlers();
+  if (concurrent && concurrent->HasPending()) {
+    // Shared without a copy unless a handler took it already.
+    XmlArena * arena = NULL;
+    XmlElement * shared = stanzaParser_.TakeStanza(stanza, &arena);
+    if (!shared)
+      shared = new XmlElement(*stanza);
+    concurrent->Flush(shared, arena);
+  }
+  if (stanza_sampler_.get())
+    stanza_sampler_->HandleEnd();
 }
 
 void
 XmppEngineImpl::IncomingEnd(bool isError) {
+  if (held_input_.get() && !held_input_->empty()) {
+    HeldInput held;
+    held.end = true;
+    held.error = isError;
+    HoldInput(held);
+    return;
+  }
+
   if (HasError() || raised_reset_)
     return;
 
@@ -383,24 +1321,55 @@ XmppEngineImpl::IncomingEnd(bool isError) {
 
 void
 XmppEngineImpl::InternalSendStart(const std::string & to) {
-  std::string hostname = tls_server_hostname_;
+  if (component_) {
+    // A component's stream has no version, and so no features, and is
+    // addressed to the component's own domain.
+    output_.append("<stream:stream to=\"");
+    output_.append(to);
+    output_.append("\" xmlns:stream=\"http://etherx.jabber.org/streams\" "
+                   "xmlns=\"jabber:component:accept\">\r\n");
+#ifdef _DEBUG
+    LOG(LS_SENSITIVE) << "<stream:stream to=\"" << to << "\" "
+                      << "xmlns:stream=\"http://etherx.jabber.org/streams\" "
+                      << "xmlns=\"jabber:component:accept\">";
+#endif
+    return;
+  }
+
+  std::string hostname;
+  std::string lang;
+  if (settings_.get()) {
+    hostname = settings_->tls_server_hostname;
+    lang = settings_->lang;
+  }
   if (hostname.empty()) {
     hostname = to;
   }
 
   // If not language is specified, the spec says use *
-  std::string lang = lang_;
   if (lang.length() == 0)
     lang = "*";
 
+  if (binary_) {
+    XmlElement stream(QN_STREAM_STREAM);
+    stream.AddAttr(QN_TO, hostname);
+    stream.AddAttr(QN_XML_LANG, lang);
+    stream.AddAttr(QN_VERSION, "1.0");
+    stream.AddAttr(QN_XMLNS, NS_CLIENT);
+    binary_writer_->WriteStreamStart(&stream, &output_);
+    return;
+  }
+
   // send stream-beginning
   // note, we put a \r\n at tne end fo the first line to cause non-XMPP
   // line-oriented servers (e.g., Apache) to reveal themselves more quickly.
-  *output_ << "<stream:stream to=\"" << hostname << "\" "
-           << "xml:lang=\"" << lang << "\" "
-           << "version=\"1.0\" "
-           << "xmlns:stream=\"http://etherx.jabber.org/streams\" "
-           << "xmlns=\"jabber:client\">\r\n";
+  output_.append("<stream:stream to=\"");
+  output_.append(hostname);
+  output_.append("\" xml:lang=\"");
+  output_.append(lang);
+  output_.append("\" version=\"1.0\" "
+                 "xmlns:stream=\"http://etherx.jabber.org/streams\" "
+                 "xmlns=\"jabber:client\">\r\n");
 #ifdef _DEBUG
   LOG(LS_SENSITIVE) << "<stream:stream to=\"" << hostname << "\" "
                     << "xml:lang=\"" << lang << "\" "
@@ -415,13 +1384,93 @@ XmppEngineImpl::InternalSendStanza(const XmlElement * element) {
   // It should really never be necessary to set a FROM attribute on a stanza.
   // It is implied by the bind on the stream and if you get it wrong
   // (by flipping from/to on a message?) the server will close the stream.
-  ASSERT(!element->HasAttr(QN_FROM));
+  // A component is the exception, whose stanzas must each say who in its
+  // domain they are from.
+  ASSERT(component_ || !element->HasAttr(QN_FROM));
+
+  if (binary_) {
+    binary_writer_->WriteElement(element, &output_);
+    return;
+  }
 
   // TODO: consider caching the XmlPrinter
-  XmlPrinter::PrintXml(output_.get(), element,
+  XmlPrinter::PrintXml(&output_, element,
             XMPP_CLIENT_NAMESPACES, XMPP_CLIENT_NAMESPACES_LEN);
 }
 
+void
+XmppEngineImpl::InternalSendCountedStanza(const XmlElement * element) {
+  if (counters_)
+    counters_->stanzas_out[XmppStanzaKindOf(element->Name())] += 1;
+  LibraryMetrics::Add(LibraryMetrics::LM_XMPP_STANZAS_OUT);
+  size_t start = output_.size();
+  InternalSendStanza(element);
+  CountSentStanza(start);
+}
+
+void
+XmppEngineImpl::CountSentStanza(size_t start) {
+  if (stream_management_.StanzaSent(output_.data() + start,
+                                    output_.size() - start))
+    SendAckRequest();
+}
+
+void
+XmppEngineImpl::SendAckRequest() {
+  XmlElement request(QN_SM_R, true);
+  InternalSendStanza(&request);
+}
+
+void
+XmppEngineImpl::IncomingStreamManagement(const XmlElement * element) {
+  if (element->Name() == QN_SM_R) {
+    if (!stream_management_.sending())
+      return;
+    XmlElement ack(QN_SM_A, true);
+    ack.AddAttr(QN_H, ToString(stream_management_.handled()));
+    InternalSendStanza(&ack);
+  } else if (element->Name() == QN_SM_A) {
+    uint32 handled;
+    if (!FromString(element->Attr(QN_H), &handled) ||
+        !stream_management_.Acked(handled))
+      SignalError(ERROR_XML, 0);
+  } else if (element->Name() == QN_SM_ENABLED) {
+    std::string resume = element->Attr(QN_RESUME);
+    if ((resume == "true" || resume == "1") && element->HasAttr(QN_ID))
+      stream_management_.SetResumable(element->Attr(QN_ID), bound_jid_);
+    stream_management_.StartHandling();
+  } else if (element->Name() == QN_SM_FAILED) {
+    LOG(LS_WARNING) << "Server refused stream management";
+    stream_management_.Reset();
+  }
+}
+
+void
+XmppEngineImpl::EnableStreamManagement() {
+  XmlElement enable(QN_SM_ENABLE, true);
+  enable.AddAttr(QN_RESUME, "true");
+  InternalSendStanza(&enable);
+  stream_management_.StartSending(binary_);
+}
+
+bool
+XmppEngineImpl::ResumeStream(const XmlElement * resumed) {
+  uint32 handled;
+  if (!FromString(resumed->Attr(QN_H), &handled) ||
+      !stream_management_.Acked(handled))
+    return false;
+
+  if (resumed->HasAttr(QN_PREVID) &&
+      resumed->Attr(QN_PREVID) != stream_management_.id())
+    return false;
+
+  SignalBound(stream_management_.jid());
+  stream_management_.StartHandling();
+  stream_management_.StartSending(binary_);
+  stream_management_.AppendUnacked(&output_);
+  return true;
+}
+
 std::string
 XmppEngineImpl::ChooseBestSaslMechanism(const std::vector<std::string> & mechanisms, bool encrypted) {
   return sasl_handler_->ChooseBestSaslMechanism(mechanisms, encrypted);
@@ -466,11 +1515,87 @@ void
 XmppEngineImpl::StartTls(const std::string & domain) {
   if (output_handler_) {
     output_handler_->StartTls(
-      tls_server_domain_.empty() ? domain : tls_server_domain_);
+      settings_.get() && !settings_->tls_server_domain.empty() ?
+          settings_->tls_server_domain : domain);
     encrypted_ = true;
   }
 }
 
+bool
+XmppEngineImpl::StartCompression() {
+  if (!output_handler_)
+    return false;
+
+  // Anything waiting was written before <compressed/> came, and goes out
+  // as it is.
+  FlushOutput();
+  const Settings & settings = MutableSettings();
+  return output_handler_->StartCompression(settings.compression_level,
+                                           settings.compression_window_bits);
+}
+
+void
+XmppEngineImpl::StartBinaryXml() {
+  // As with compression, what was written before <compressed/> came goes
+  // out as XML.
+  FlushOutput();
+  binary_ = true;
+  if (!binary_writer_.get())
+    binary_writer_.reset(new BinaryXmlWriter);
+  stanzaParser_.SetBinary(true);
+}
+
+void
+XmppEngineImpl::AppendXmlAsBinary(const std::string & text, bool counted) {
+  // The text may use the stream's prefixes, so it is read in an element
+  // declaring them.
+  std::string xml("<w xmlns=\"jabber:client\" "
+                  "xmlns:stream=\"http://etherx.jabber.org/streams\">");
+  xml.append(text);
+  xml.append("</w>");
+  scoped_ptr<XmlElement> wrapper(XmlElement::ForStr(xml));
+  if (!wrapper.get()) {
+    LOG(LS_WARNING) << "Dropped XML that could not be encoded";
+    return;
+  }
+  for (const XmlChild * child = wrapper->FirstChild(); child;
+       child = child->NextChild()) {
+    if (child->IsText()) {
+      binary_writer_->WriteStreamText(child->AsText()->Text(), &output_);
+    } else {
+      size_t start = output_.size();
+      binary_writer_->WriteElement(child->AsElement(), &output_);
+      if (counted)
+        CountSentStanza(start);
+    }
+  }
+}
+
+void
+XmppEngineImpl::FlushOutput() {
+  flush_requested_ = false;
+  output_pending_ = false;
+  if (!HasOutput())
+    return;
+
+  // The output string is handed over in a chain rather than copied, and
+  // the chain is a local one, so that the handler can reenter the engine
+  // while it writes. The chain's spare block, which gives output_ a
+  // buffer back, is kept for the next time, behind any shared stanzas
+  // sent from within the handler.
+  ChainBuffer output;
+  output.Swap(&output_chain_);
+  output.AppendString(&output_);
+  if (stanza_sampler_.get())
+    stanza_sampler_->OutputStart();
+  output_handler_->WriteOutputChain(&output);
+  if (stanza_sampler_.get())
+    stanza_sampler_->OutputEnd();
+  output.Clear();
+  output.Append(&output_chain_);
+  output_chain_.Swap(&output);
+}
+
 XmppEngineImpl::EnterExit::EnterExit(XmppEngineImpl* engine)
   : engine_(engine),
   state_(engine->state_),
@@ -488,10 +1613,12 @@ XmppEngineImpl::EnterExit::~EnterExit()  {
  bool flushing = closing || (engine->engine_entered_ == 0);
 
  if (engine->output_handler_ && flushing) {
-   std::string output = engine->output_->str();
-   if (output.length() > 0)
-     engine->output_handler_->WriteOutput(output.c_str(), output.length());
-   engine->output_->str("");
+   if (closing || !engine->HoldsOutput()) {
+     engine->FlushOutput();
+   } else if (engine->HasOutput() && !engine->output_pending_) {
+     engine->output_pending_ = true;
+     engine->output_handler_->OutputPending();
+   }
 
    if (closing) {
      engine->output_handler_->CloseConnection();
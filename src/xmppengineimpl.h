@@ -32,15 +32,23 @@
 #include "config.h"
 #endif
 
-#include <sstream>
+#include <deque>
+#include <map>
 #include <vector>
+#include "binaryxml.h"
+#include "stanzastats.h"
+#include "xmppconcurrentdispatch.h"
 #include "xmppengine.h"
+#include "xmppshaper.h"
+#include "xmppstanzadispatch.h"
 #include "xmppstanzaparser.h"
+#include "xmppstreammanagement.h"
 
 namespace txmpp {
 
 class XmppLoginTask;
 class XmppEngine;
+class XmppIqBatch;
 class XmppIqEntry;
 class SaslHandler;
 class SaslMechanism;
@@ -54,6 +62,10 @@ class SaslMechanism;
 //! and then call Connect() to initiate the connection.
 //! An application can listen for events and receive stanzas by
 //! registering an XmppStanzaHandler via AddStanzaHandler().
+//! An engine is kept for every connection, most of them idle, so what it
+//! holds matters: once logged in with no handlers or iqs outstanding, it
+//! should take at most 6 KB of heap besides its expat parser, and 2 KB
+//! after TrimMemory.  txmpp-bench checks this with xmpp/login_idle.
 class XmppEngineImpl : public XmppEngine {
 public:
   XmppEngineImpl();
@@ -66,6 +78,12 @@ public:
 
   //! Provides socket input to the engine
   virtual XmppReturnStatus HandleInput(const char * bytes, size_t len);
+  virtual char * GetInputBuffer(size_t len);
+  virtual XmppReturnStatus HandleInputBuffer(size_t len);
+
+  //! Frees what the engine keeps for the next stanza each way.
+  virtual size_t TrimMemory();
+  virtual size_t GetParserBufferSize();
 
   //! Advises the engine that the socket has closed
   virtual XmppReturnStatus ConnectionClosed(int subcode);
@@ -84,6 +102,23 @@ public:
   //! Sets whether TLS will be used within the connection (default true).
   virtual XmppReturnStatus SetUseTls(bool useTls);
 
+  //! Sets whether TLS is declined when only offered.
+  virtual XmppReturnStatus SetSkipTls(bool skip);
+
+  //! Sets whether the login sends predictable steps without waiting.
+  virtual XmppReturnStatus SetPipelinedLogin(bool pipelined);
+
+  //! Sets whether the login asks for zlib stream compression.
+  virtual XmppReturnStatus SetCompression(bool enable, int level,
+                                          int window_bits);
+
+  //! Sets whether the login asks for the binary XML encoding.
+  virtual XmppReturnStatus SetBinaryXml(bool enable);
+
+  //! Sets whether the engine connects as a XEP-0114 component.
+  virtual XmppReturnStatus SetComponentMode(bool enable,
+                                            const std::string & secret);
+
   //! Sets an alternate domain from which we allows TLS certificates.
   //! This is for use in the case where a we want to allow a proxy to
   //! serve up its own certificate rather than one owned by the underlying
@@ -103,9 +138,7 @@ public:
   virtual const std::string & GetRequestedResource();
 
   //! Sets language
-  virtual void SetLanguage(const std::string & lang) {
-    lang_ = lang;
-  }
+  virtual void SetLanguage(const std::string & lang);
 
   // SESSION MANAGEMENT ---------------------------------------------------
 
@@ -154,12 +187,79 @@ public:
   //! Removes a listener for session events.
   virtual XmppReturnStatus RemoveStanzaHandler(XmppStanzaHandler* handler);
 
+  //! Takes the stanza from the parser; see XmppStanzaParser::TakeStanza.
+  virtual XmlElement * TakeIncomingStanza(const XmlElement * stanza,
+                                          XmlArena ** arena);
+
   //! Sends a stanza to the server.
   virtual XmppReturnStatus SendStanza(const XmlElement * pelStanza);
 
+  //! Sends a prepared stanza to the server.
+  virtual XmppReturnStatus SendPreparedStanza(const PreparedStanza * stanza,
+                                              const std::string & to,
+                                              const std::string & id);
+
+  //! Sends a shared stanza to the server.
+  virtual XmppReturnStatus SendSharedStanza(const SharedStanza * stanza,
+                                            const std::string & to,
+                                            const std::string & id);
+
   //! Sends raw text to the server
   virtual XmppReturnStatus SendRaw(const std::string & text);
 
+  //! Sends a stanza printed by the caller, taking its bytes.
+  virtual XmppReturnStatus SendStanzaText(std::string * text);
+
+  //! Streams the character data of chosen stanza children to |sink|.
+  virtual void SetTextSink(XmppTextSink * sink);
+
+  //! Keeps the bytes of incoming stanzas for ForwardRaw.
+  virtual void SetKeepRawStanzas(bool keep);
+
+  //! Defers building what is under the children of incoming stanzas.
+  virtual void SetLazyStanzaChildren(bool lazy);
+
+  virtual void SetStripWhitespace(bool strip);
+
+  virtual void SetStanzaStats(StanzaStats * stats);
+  virtual void SetCounters(XmppEngineCounters * counters);
+
+  //! Builds stanzas past |size| bytes on |pool|.
+  virtual XmppReturnStatus SetStanzaOffload(ThreadPool * pool, size_t size);
+
+  virtual XmppReturnStatus SetHandlerPool(ThreadPool * pool);
+
+  //! Handles the iqs of each read before its messages and presence.
+  virtual void SetPrioritizeInput(bool prioritize);
+
+  //! Hands on only the last presence each full JID sends in |window_ms|.
+  virtual void SetPresenceCoalescing(int window_ms);
+
+  //! Holds output back until Flush once the session is open.
+  virtual void SetCorked(bool corked);
+
+  //! Writes the output held back while corked.
+  virtual XmppReturnStatus Flush();
+
+  virtual void SetShaping(const XmppShaping & shaping);
+
+  virtual size_t GetShapedStanzaCount();
+
+  //! Turns on XEP-0198 stream management, where the server offers it.
+  virtual XmppReturnStatus SetStreamManagement(bool enable, int ack_interval);
+
+  //! Has the login resume the stream in |state|.
+  virtual XmppReturnStatus SetResumeState(const XmppResumeState & state);
+
+  //! Fills in |state| if the stream can be resumed.
+  virtual bool GetResumeState(XmppResumeState * state);
+
+  //! Asks the server to ack the stanzas sent so far.
+  virtual XmppReturnStatus RequestAck();
+
+  //! Sends a stanza, as received if it is the incoming one.
+  virtual XmppReturnStatus ForwardRaw(const XmlElement * pelStanza);
+
   //! Sends an iq to the server, and registers a callback for the result.
   //! Returns the cookie passed to the result handler.
   virtual XmppReturnStatus SendIq(const XmlElement* pelStanza,
@@ -171,6 +271,14 @@ public:
   virtual XmppReturnStatus RemoveIqHandler(XmppIqCookie cookie,
                                       XmppIqHandler** iq_handler);
 
+  //! Sends |stanzas| in one write and calls |handler| once for them all.
+  virtual XmppReturnStatus SendIqBatch(
+      const std::vector<const XmlElement *> & stanzas, int timeout_ms,
+      XmppIqBatchHandler * handler, XmppIqCookie * cookie);
+
+  //! Unregisters a batch given its cookie.
+  virtual XmppReturnStatus RemoveIqBatch(XmppIqCookie cookie);
+
   //! Forms and sends an error in response to the given stanza.
   //! Swaps to and from, sets type to "error", and adds error information
   //! based on the passed code.  Text is optional and may be STR_EMPTY.
@@ -186,18 +294,100 @@ public:
   //! The next unused iq id for this connection.
   //! Call this when building iq stanzas, to ensure that each iq
   //! gets its own unique id.
-  virtual std::string NextId();
+  virtual XmppId NextId();
+
+  //! Makes NextId use |prefix|, of 4 characters, instead of a random one,
+  //! as when replaying a capture whose input answers the ids sent then.
+  //! Only before Connect.
+  XmppReturnStatus SetIdPrefix(const std::string & prefix);
 
 private:
   friend class XmppLoginTask;
+  friend class XmppIqBatch;
   friend class XmppIqEntry;
 
+  bool WantIncomingStanza(const XmppStanzaStart & start);
+  bool IsStanzaWanted(const XmppStanzaStart & start);
   void IncomingStanza(const XmlElement *pelStanza);
+  void IncomingLargeStanza(std::string * xml);
   void IncomingStart(const XmlElement *pelStanza);
   void IncomingEnd(bool isError);
+  void HandleStanza(const XmlElement *pelStanza);
+
+  // What came in after a stanza being built on the offload pool, held so
+  // that it is handled after it.
+  class OffloadJob;
+  friend class OffloadJob;
+  struct HeldInput {
+    HeldInput() : job(NULL), stanza(NULL), arena(NULL), end(false),
+                  error(false) {}
+    // A stanza being built, a stanza, or the end of the stream.
+    OffloadJob * job;
+    XmlElement * stanza;
+    XmlArena * arena;
+    bool end;
+    bool error;
+  };
+  void HoldInput(const HeldInput & held);
+  // Handles what is held, up to the next stanza still being built.
+  void ReleaseHeldInput();
+  void DeleteHeldInput();
+
+  // The messages and presence of a read held back for SetPrioritizeInput,
+  // a lane each, with a bit for each sender in a lane, by hash, so that a
+  // sender's later stanzas can go behind them.  The presence held for
+  // SetPresenceCoalescing is kept apart, in the order the JIDs first sent
+  // it, with their bits in |coalesced_senders|.
+  struct DeferredInput {
+    enum { kMessages, kPresence, kLanes };
+    enum { kSenderBits = 1024 };
+    DeferredInput();
+    ~DeferredInput();
+    bool prioritize;
+    std::deque<HeldInput> lanes[kLanes];
+    uint32 senders[kLanes][kSenderBits / 32];
+    int coalesce_ms;
+    bool coalesce_wait;
+    uint32 coalesce_due;
+    std::vector<HeldInput> coalesced;
+    std::map<std::string, size_t> coalesced_index;
+    uint32 coalesced_senders[kSenderBits / 32];
+  };
+  // Holds |stanza| back to the end of the read and returns true, or returns
+  // false for it to be handled now.
+  bool DeferStanza(DeferredInput * deferred, const XmlElement * stanza);
+  // Holds the presence |stanza| in place of any from its JID and returns
+  // true, or returns false if it isn't one to coalesce.
+  bool CoalescePresence(DeferredInput * deferred, const XmlElement * stanza,
+                        uint32 bit);
+  // Hands on the presence held from |from|, if any.
+  void ReleaseCoalesced(DeferredInput * deferred, const std::string & from);
+  // Hands on all the presence held, if |all| or its window is over.
+  void ReleaseCoalesced(DeferredInput * deferred, bool all);
+  // Hands a held presence to the handlers, or to the presence lane when
+  // prioritizing.
+  void PassCoalesced(DeferredInput * deferred, const HeldInput & held,
+                     uint32 bit);
+  // Handles the stanzas held back, messages first, and the presence
+  // coalesced if its window is over.
+  void HandleDeferredInput();
+  DeferredInput * GetDeferredInput() const {
+    return settings_.get() ? settings_->deferred_input.get() : NULL;
+  }
 
   void InternalSendStart(const std::string & domainName);
   void InternalSendStanza(const XmlElement * pelStanza);
+  // Like InternalSendStanza, counting the stanza for stream management.
+  void InternalSendCountedStanza(const XmlElement * pelStanza);
+  // Counts the stanza appended to the output from |start| on.
+  void CountSentStanza(size_t start);
+  void SendAckRequest();
+  void IncomingStreamManagement(const XmlElement * pelStanza);
+  // Sends <enable/> once the session is bound.
+  void EnableStreamManagement();
+  // Takes up the stream resumed as <resumed/> says, sending again what it
+  // hasn't had.
+  bool ResumeStream(const XmlElement * pelResumed);
   std::string ChooseBestSaslMechanism(const std::vector<std::string> & mechanisms, bool encrypted);
   SaslMechanism * GetSaslMechanism(const std::string & name);
   void SignalBound(const Jid & fullJid);
@@ -205,8 +395,32 @@ private:
   void SignalError(Error errorCode, int subCode);
   bool HasError();
   void DeleteIqCookies();
+  // Hands |pelStanza| to the batch waiting for it, if any.
+  bool HandleIqBatchResponse(const XmlElement * pelStanza, uint32 hash);
+  // Unregisters |batch|, and calls its handler unless |notify| is false.
+  void FinishIqBatch(XmppIqBatch * batch, bool notify);
+  // Finishes the batches whose timeout has passed.
+  void ExpireIqBatches();
+  bool HasOutput() const {
+    return !output_.empty() || !output_chain_.IsEmpty();
+  }
+  // Whether output is being held back for Flush.
+  bool HoldsOutput() const {
+    return corked_ && state_ == STATE_OPEN && !flush_requested_;
+  }
+  // Hands the output to the output handler.
+  void FlushOutput();
+  // Sends the shaped stanzas that may go now, and asks the output handler
+  // for a Flush when the next may.
+  void SendShaped();
   bool HandleIqResponse(const XmlElement * element);
   void StartTls(const std::string & domain);
+  bool StartCompression();
+  // Goes on in the binary XML encoding, from the stream restart on.
+  void StartBinaryXml();
+  // Appends the XML |text|, one or more stanzas, in the binary encoding,
+  // counting them for stream management if |counted|.
+  void AppendXmlAsBinary(const std::string & text, bool counted);
   void RaiseReset() { raised_reset_ = true; }
 
   class StanzaParseHandler : public XmppStanzaParseHandler {
@@ -215,8 +429,19 @@ private:
     virtual ~StanzaParseHandler() {}
     virtual void StartStream(const XmlElement * pelStream)
       { outer_->IncomingStart(pelStream); }
+    virtual bool WantStanza(const XmppStanzaStart & start)
+      { return outer_->WantIncomingStanza(start); }
     virtual void Stanza(const XmlElement * pelStanza)
       { outer_->IncomingStanza(pelStanza); }
+    virtual void LargeStanza(std::string * xml)
+      { outer_->IncomingLargeStanza(xml); }
+    // Only called while a text sink is set.
+    virtual bool WantText(const XmppStanzaStart & start)
+      { return outer_->settings_->text_sink->WantText(start); }
+    virtual void StanzaText(const char * text, size_t len)
+      { outer_->settings_->text_sink->Text(text, len); }
+    virtual void EndText()
+      { outer_->settings_->text_sink->EndText(); }
     virtual void EndStream()
       { outer_->IncomingEnd(false); }
     virtual void XmlError()
@@ -243,37 +468,117 @@ private:
   XmppStanzaParser stanzaParser_;
 
 
+  // The settings most connections leave empty, kept apart so that they
+  // take no room until one is set.
+  struct Settings {
+    Settings() : compression_level(-1), compression_window_bits(15),
+                 text_sink(NULL) {}
+    std::string requested_resource;
+    std::string tls_server_hostname;
+    std::string tls_server_domain;
+    std::string lang;
+    std::string component_secret;
+    int compression_level;
+    int compression_window_bits;
+    XmppTextSink * text_sink;
+    scoped_ptr<DeferredInput> deferred_input;
+    // The handlers called on the pool given to SetHandlerPool.
+    scoped_ptr<XmppConcurrentDispatch> concurrent_handlers;
+    // The batches sent with SendIqBatch, and each of their iqs waiting for
+    // a response, by a hash of its id, as the batch and its index.
+    std::vector<XmppIqBatch *> iq_batches;
+    typedef std::multimap<uint32, std::pair<XmppIqBatch *, size_t> >
+        IqBatchMap;
+    IqBatchMap iq_batch_entries;
+  };
+  Settings & MutableSettings();
+  XmppConcurrentDispatch * ConcurrentHandlers() const {
+    return settings_.get() ? settings_->concurrent_handlers.get() : NULL;
+  }
+  const std::string & RequestedResource() const {
+    return settings_.get() ? settings_->requested_resource : STR_EMPTY;
+  }
+  const std::string & ComponentSecret() const {
+    return settings_.get() ? settings_->component_secret : STR_EMPTY;
+  }
+  // Whether a component may send |pelStanza|: whether its "from" is in the
+  // component's domain.
+  bool IsComponentFrom(const XmlElement * pelStanza) const;
+
   // state
   int engine_entered_;
+  State state_;
   Jid user_jid_;
-  std::string password_;
-  std::string requested_resource_;
   bool tls_needed_;
-  std::string tls_server_hostname_;
-  std::string tls_server_domain_;
+  bool tls_skipped_;
+  bool encrypted_;
+  bool pipelined_login_;
+  bool component_;
+  bool compression_;
+  bool binary_xml_;
+  bool binary_;
+  // binary_xml_ is whether the login asks for the binary encoding, and
+  // binary_ whether the stream is in it, written by binary_writer_, which is
+  // made only then.
+  scoped_ptr<BinaryXmlWriter> binary_writer_;
+  scoped_ptr<Settings> settings_;
   scoped_ptr<XmppLoginTask> login_task_;
-  std::string lang_;
 
-  int next_id_;
+  // NextId makes ids from id_prefix_ and next_id_.
+  enum { kIdPrefixLength = 4 };
+  char id_prefix_[kIdPrefixLength];
+  uint32 next_id_;
   Jid bound_jid_;
-  State state_;
-  bool encrypted_;
   Error error_code_;
   int subcode_;
   scoped_ptr<XmlElement> stream_error_;
   bool raised_reset_;
+  bool stream_management_enabled_;
+  // With corked_, output is only written by Flush or when it closes the
+  // connection. output_pending_ is set once OutputPending has been called
+  // for it, and flush_requested_ when Flush was called within the engine.
+  bool corked_;
+  bool output_pending_;
+  bool flush_requested_;
   XmppOutputHandler* output_handler_;
   XmppSessionHandler* session_handler_;
 
-  typedef std::vector<XmppStanzaHandler*> StanzaHandlerVector;
-  scoped_ptr<StanzaHandlerVector> stanza_handlers_[HL_COUNT];
+  // With shaper_, shaper_wait_ is set while a Flush is due at shaper_due_,
+  // as asked for by OutputDelayed.
+  scoped_ptr<XmppShaper> shaper_;
+  bool shaper_wait_;
+  uint32 shaper_due_;
+
+  XmppStreamManagement stream_management_;
+
+  // The pool large stanzas are built on, and what is held behind them,
+  // made by the first, as most engines never see one.
+  ThreadPool * offload_pool_;
+  scoped_ptr<std::deque<HeldInput> > held_input_;
+
+  // Times stanzas for the stats given to SetStanzaStats.
+  scoped_ptr<StanzaSampler> stanza_sampler_;
+  // The counts given to SetCounters, or NULL.
+  XmppEngineCounters * counters_;
+
+  // Made by the first AddStanzaHandler for their level, as most levels
+  // never get a handler.
+  scoped_ptr<XmppStanzaDispatch> stanza_handlers_[HL_COUNT];
 
-  typedef std::vector<XmppIqEntry*> IqEntryVector;
-  scoped_ptr<IqEntryVector> iq_entries_;
+  // The iqs waiting for a response, by a hash of their id, and where each
+  // cookie is in there.
+  typedef std::multimap<uint32, XmppIqEntry*> IqEntryMap;
+  IqEntryMap iq_entries_;
+  typedef std::map<XmppIqEntry*, IqEntryMap::iterator> IqCookieMap;
+  IqCookieMap iq_cookies_;
 
   scoped_ptr<SaslHandler> sasl_handler_;
 
-  scoped_ptr<std::stringstream> output_;
+  // Output waiting for EnterExit to hand it to the output handler, and
+  // the chain it is handed over in, which holds the output before output_
+  // where shared stanzas have been sent, and is otherwise empty.
+  std::string output_;
+  ChainBuffer output_chain_;
 };
 
 }  // namespace tyrion
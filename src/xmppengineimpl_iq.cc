@@ -27,10 +27,14 @@
 
 #include "xmppengineimpl.h"
 
+#include <map>
 #include <vector>
 #include <algorithm>
 #include "common.h"
 #include "constants.h"
+#include "time.h"
+#include "xmlarena.h"
+#include "xmppstats.h"
 
 namespace txmpp {
 
@@ -40,16 +44,62 @@ class XmppIqEntry {
     id_(id),
     to_(to),
     engine_(pxce),
-    iq_handler_(iq_handler) {
+    iq_handler_(iq_handler),
+    sent_(0) {
   }
 
 private:
   friend class XmppEngineImpl;
 
+  static uint32 HashId(const std::string & id) {
+    uint32 result = 2166136261U;
+    for (size_t i = 0; i < id.size(); ++i) {
+      result ^= static_cast<unsigned char>(id[i]);
+      result *= 16777619U;
+    }
+    return result;
+  }
+
   const std::string id_;
   const std::string to_;
   XmppEngine * const engine_;
   XmppIqHandler * const iq_handler_;
+  // The TimeMicros() it was sent at, if the engine has counters.
+  uint64 sent_;
+};
+
+class XmppIqBatch {
+  XmppIqBatch(XmppIqBatchHandler * handler, size_t size) :
+    handler_(handler),
+    results_(size),
+    to_(size),
+    pending_(size),
+    due_(0),
+    timed_(false),
+    sent_(0) {
+  }
+
+  ~XmppIqBatch() {
+    for (size_t i = 0; i < kept_.size(); ++i) {
+      delete kept_[i].first;
+      delete kept_[i].second;
+    }
+  }
+
+private:
+  friend class XmppEngineImpl;
+
+  XmppIqBatchHandler * const handler_;
+  std::vector<XmppIqBatchResult> results_;
+  std::vector<std::string> to_;
+  // The iqs still waiting for a response.
+  size_t pending_;
+  // The CachedTime() it times out at, if |timed_|.
+  uint32 due_;
+  bool timed_;
+  uint64 sent_;
+  // The responses kept until the handler is called, and their arenas.
+  std::vector<std::pair<XmlElement *, XmlArena *> > kept_;
 };
 
 
@@ -74,7 +124,11 @@ XmppEngineImpl::SendIq(const XmlElement * element, XmppIqHandler * iq_handler,
   XmppIqEntry * iq_entry = new XmppIqEntry(id,
                                               element->Attr(QN_TO),
                                               this, iq_handler);
-  iq_entries_->push_back(iq_entry);
+  if (counters_)
+    iq_entry->sent_ = TimeMicros();
+  IqEntryMap::iterator pos =
+      iq_entries_.insert(std::make_pair(XmppIqEntry::HashId(id), iq_entry));
+  iq_cookies_.insert(std::make_pair(iq_entry, pos));
   SendStanza(element);
 
   if (cookie)
@@ -88,17 +142,16 @@ XmppReturnStatus
 XmppEngineImpl::RemoveIqHandler(XmppIqCookie cookie,
     XmppIqHandler ** iq_handler) {
 
-  std::vector<XmppIqEntry*, std::allocator<XmppIqEntry*> >::iterator pos;
+  // The cookie is only looked up, as it may be stale.
+  IqCookieMap::iterator pos =
+      iq_cookies_.find(reinterpret_cast<XmppIqEntry*>(cookie));
 
-  pos = std::find(iq_entries_->begin(),
-                  iq_entries_->end(),
-                  reinterpret_cast<XmppIqEntry*>(cookie));
-
-  if (pos == iq_entries_->end())
+  if (pos == iq_cookies_.end())
     return XMPP_RETURN_BADARGUMENT;
 
-  XmppIqEntry* entry = *pos;
-  iq_entries_->erase(pos);
+  XmppIqEntry* entry = pos->first;
+  iq_entries_.erase(pos->second);
+  iq_cookies_.erase(pos);
   if (iq_handler)
     *iq_handler = entry->iq_handler_;
   delete entry;
@@ -108,12 +161,174 @@ XmppEngineImpl::RemoveIqHandler(XmppIqCookie cookie,
 
 void
 XmppEngineImpl::DeleteIqCookies() {
-  for (size_t i = 0; i < iq_entries_->size(); i += 1) {
-    XmppIqEntry * iq_entry_ = (*iq_entries_)[i];
-    (*iq_entries_)[i] = NULL;
-    delete iq_entry_;
+  for (IqEntryMap::iterator it = iq_entries_.begin();
+       it != iq_entries_.end(); ++it) {
+    delete it->second;
+  }
+  iq_cookies_.clear();
+  iq_entries_.clear();
+  if (settings_.get()) {
+    for (size_t i = 0; i < settings_->iq_batches.size(); ++i)
+      delete settings_->iq_batches[i];
+    settings_->iq_batches.clear();
+    settings_->iq_batch_entries.clear();
   }
-  iq_entries_->clear();
+}
+
+
+XmppReturnStatus
+XmppEngineImpl::SendIqBatch(const std::vector<const XmlElement *> & stanzas,
+                            int timeout_ms, XmppIqBatchHandler * handler,
+                            XmppIqCookie * cookie) {
+  if (state_ == STATE_CLOSED)
+    return XMPP_RETURN_BADSTATE;
+  if (NULL == handler || stanzas.empty() || timeout_ms < 0)
+    return XMPP_RETURN_BADARGUMENT;
+
+  // All are checked before any is sent.
+  for (size_t i = 0; i < stanzas.size(); ++i) {
+    const XmlElement * element = stanzas[i];
+    if (!element || element->Name() != QN_IQ || !element->HasAttr(QN_ID))
+      return XMPP_RETURN_BADARGUMENT;
+    const std::string& type = element->Attr(QN_TYPE);
+    if (type != "get" && type != "set")
+      return XMPP_RETURN_BADARGUMENT;
+  }
+
+  XmppIqBatch * batch = new XmppIqBatch(handler, stanzas.size());
+  if (counters_)
+    batch->sent_ = TimeMicros();
+  Settings & settings = MutableSettings();
+  settings.iq_batches.push_back(batch);
+  for (size_t i = 0; i < stanzas.size(); ++i) {
+    batch->results_[i].id = stanzas[i]->Attr(QN_ID);
+    batch->to_[i] = stanzas[i]->Attr(QN_TO);
+    settings.iq_batch_entries.insert(
+        std::make_pair(XmppIqEntry::HashId(batch->results_[i].id),
+                       std::make_pair(batch, i)));
+  }
+  if (cookie)
+    *cookie = batch;
+
+  // The output is written once, as the engine returns.
+  EnterExit ee(this);
+  for (size_t i = 0; i < stanzas.size(); ++i)
+    SendStanza(stanzas[i]);
+
+  if (timeout_ms > 0 && output_handler_) {
+    batch->timed_ = true;
+    batch->due_ = CachedTime() + timeout_ms;
+    output_handler_->OutputDelayed(timeout_ms);
+  }
+  return XMPP_RETURN_OK;
+}
+
+
+XmppReturnStatus
+XmppEngineImpl::RemoveIqBatch(XmppIqCookie cookie) {
+  // The cookie is only looked up, as it may be stale.
+  if (!settings_.get())
+    return XMPP_RETURN_BADARGUMENT;
+  std::vector<XmppIqBatch *> & batches = settings_->iq_batches;
+  std::vector<XmppIqBatch *>::iterator pos =
+      std::find(batches.begin(), batches.end(),
+                reinterpret_cast<XmppIqBatch *>(cookie));
+  if (pos == batches.end())
+    return XMPP_RETURN_BADARGUMENT;
+
+  FinishIqBatch(*pos, false);
+  return XMPP_RETURN_OK;
+}
+
+
+void
+XmppEngineImpl::FinishIqBatch(XmppIqBatch * batch, bool notify) {
+  std::vector<XmppIqBatch *> & batches = settings_->iq_batches;
+  batches.erase(std::find(batches.begin(), batches.end(), batch));
+  if (batch->pending_) {
+    Settings::IqBatchMap & entries = settings_->iq_batch_entries;
+    for (size_t i = 0; i < batch->results_.size(); ++i) {
+      if (batch->results_[i].response)
+        continue;
+      std::pair<Settings::IqBatchMap::iterator,
+                Settings::IqBatchMap::iterator> range =
+          entries.equal_range(XmppIqEntry::HashId(batch->results_[i].id));
+      for (Settings::IqBatchMap::iterator it = range.first;
+           it != range.second; ++it) {
+        if (it->second.first == batch && it->second.second == i) {
+          entries.erase(it);
+          break;
+        }
+      }
+    }
+  }
+
+  // Unregistered first, as the handler may reenter the engine.
+  if (notify)
+    batch->handler_->IqBatchDone(batch, batch->results_);
+  delete batch;
+}
+
+
+void
+XmppEngineImpl::ExpireIqBatches() {
+  if (!settings_.get() || settings_->iq_batches.empty())
+    return;
+  uint32 now = CachedTime();
+  std::vector<XmppIqBatch *> expired;
+  for (size_t i = 0; i < settings_->iq_batches.size(); ++i) {
+    XmppIqBatch * batch = settings_->iq_batches[i];
+    if (batch->timed_ && TimeDiff(now, batch->due_) >= 0)
+      expired.push_back(batch);
+  }
+  // Each is looked up again, as an earlier handler may have removed it.
+  for (size_t i = 0; i < expired.size(); ++i) {
+    std::vector<XmppIqBatch *> & batches = settings_->iq_batches;
+    if (std::find(batches.begin(), batches.end(), expired[i]) !=
+        batches.end())
+      FinishIqBatch(expired[i], true);
+  }
+}
+
+
+bool
+XmppEngineImpl::HandleIqBatchResponse(const XmlElement * element,
+                                      uint32 hash) {
+  const std::string & id = element->Attr(QN_ID);
+  const std::string & from = element->Attr(QN_FROM);
+  Settings::IqBatchMap & entries = settings_->iq_batch_entries;
+  std::pair<Settings::IqBatchMap::iterator,
+            Settings::IqBatchMap::iterator> range = entries.equal_range(hash);
+  for (Settings::IqBatchMap::iterator it = range.first;
+       it != range.second; ++it) {
+    XmppIqBatch * batch = it->second.first;
+    size_t index = it->second.second;
+    if (batch->results_[index].id != id || batch->to_[index] != from)
+      continue;
+    entries.erase(it);
+    if (counters_ && batch->sent_) {
+      uint64 latency = TimeMicros() - batch->sent_;
+      counters_->iq_latency.Add(static_cast<uint32>(
+          _min(latency, static_cast<uint64>(0xFFFFFFFF))));
+    }
+
+    // The last response is passed as it is, while it is being handled;
+    // the others are taken from the parser, or copied, to keep.
+    batch->pending_ -= 1;
+    if (batch->pending_ == 0) {
+      batch->results_[index].response = element;
+      FinishIqBatch(batch, true);
+      return true;
+    }
+    XmlArena * arena = NULL;
+    XmlElement * kept = stanzaParser_.TakeStanza(element, &arena);
+    if (!kept)
+      kept = new XmlElement(*element);
+    batch->kept_.push_back(std::make_pair(kept, arena));
+    batch->results_[index].response = kept;
+    return true;
+  }
+  return false;
 }
 
 static void
@@ -249,7 +464,8 @@ XmppEngineImpl::SendStanzaError(const XmlElement * element_original,
 
 bool
 XmppEngineImpl::HandleIqResponse(const XmlElement * element) {
-  if (iq_entries_->empty())
+  bool batches = settings_.get() && !settings_->iq_batch_entries.empty();
+  if (iq_entries_.empty() && !batches)
     return false;
   if (element->Name() != QN_IQ)
     return false;
@@ -258,21 +474,34 @@ XmppEngineImpl::HandleIqResponse(const XmlElement * element) {
     return false;
   if (!element->HasAttr(QN_ID))
     return false;
-  std::string id = element->Attr(QN_ID);
-  std::string from = element->Attr(QN_FROM);
-
-  for (std::vector<XmppIqEntry *>::iterator it = iq_entries_->begin();
-       it != iq_entries_->end(); it += 1) {
-    XmppIqEntry * iq_entry = *it;
+  const std::string & id = element->Attr(QN_ID);
+  const std::string & from = element->Attr(QN_FROM);
+
+  // The id picks the entries and the sender is checked after. If several
+  // iqs went to the responder with the same id, the first sent gets it.
+  uint32 hash = XmppIqEntry::HashId(id);
+  std::pair<IqEntryMap::iterator, IqEntryMap::iterator> range =
+      iq_entries_.equal_range(hash);
+  for (IqEntryMap::iterator it = range.first; it != range.second; ++it) {
+    XmppIqEntry * iq_entry = it->second;
     if (iq_entry->id_ == id && iq_entry->to_ == from) {
-      iq_entries_->erase(it);
+      iq_entries_.erase(it);
+      iq_cookies_.erase(iq_entry);
+      if (counters_ && iq_entry->sent_) {
+        uint64 latency = TimeMicros() - iq_entry->sent_;
+        uint32 latency_us = static_cast<uint32>(
+            _min(latency, static_cast<uint64>(0xFFFFFFFF)));
+        counters_->iq_latency.Add(latency_us);
+        if (iq_entry->to_.empty() || iq_entry->to_ == bound_jid_.domain())
+          counters_->rtt.AddSample(latency_us);
+      }
       iq_entry->iq_handler_->IqResponse(iq_entry, element);
       delete iq_entry;
       return true;
     }
   }
 
-  return false;
+  return batches && HandleIqBatchResponse(element, hash);
 }
 
 }  // namespace txmpp
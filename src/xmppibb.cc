@@ -0,0 +1,433 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmppibb.h"
+
+#include <cstdlib>
+
+#include "constants.h"
+#include "logging.h"
+#include "scoped_ptr.h"
+#include "stringencode.h"
+#include "stringutils.h"
+#include "xmlprinter.h"
+#include "xmppclient.h"
+#include "xmppstanzaparser.h"
+
+namespace txmpp {
+
+// Reads a decimal attribute value as a number no larger than |max|.
+static bool ParseNumber(const std::string& value, unsigned long max,
+                        unsigned long* number) {
+  if (value.empty() || value[0] < '0' || value[0] > '9')
+    return false;
+  char* end = NULL;
+  *number = strtoul(value.c_str(), &end, 10);
+  return *end == '\0' && *number <= max;
+}
+
+//------------------------------------------------------------------
+// IbbSendTask
+
+IbbSendTask::IbbSendTask(TaskParent* parent, const Jid& to,
+                         const std::string& sid, StreamInterface* source,
+                         size_t block_size)
+    : XmppTask(parent, XmppEngine::HL_SINGLE),
+      to_(to), sid_(sid), source_(source), block_size_(block_size),
+      in_flight_(0), bytes_sent_(0), seq_(0), waiting_source_(false) {
+  set_timeout_seconds(kTimeoutSeconds);
+}
+
+IbbSendTask::~IbbSendTask() {
+}
+
+int IbbSendTask::ProcessStart() {
+  scoped_ptr<XmlElement> iq(MakeIq(STR_SET, to_, task_id()));
+  XmlElement* open = new XmlElement(QN_IBB_OPEN, true);
+  open->AddAttr(QN_IBB_BLOCK_SIZE, ToString(block_size_));
+  open->AddAttr(QN_IBB_SID, sid_);
+  open->AddAttr(QN_IBB_STANZA, "iq");
+  iq->AddElement(open);
+  if (SendStanza(iq.get()) != XMPP_RETURN_OK) {
+    SignalError(NULL);
+    return STATE_ERROR;
+  }
+  buffer_.resize(block_size_);
+  return STATE_RESPONSE;
+}
+
+int IbbSendTask::ProcessResponse() {
+  const XmlElement* stanza = NextStanza();
+  if (stanza == NULL)
+    return STATE_BLOCKED;
+
+  if (stanza->Attr(QN_TYPE) == STR_ERROR) {
+    SignalError(stanza->FirstNamed(QN_ERROR));
+    return STATE_DONE;
+  }
+  bytes_sent_ += in_flight_;
+  in_flight_ = 0;
+  return STATE_SEND;
+}
+
+int IbbSendTask::ProcessSend() {
+  size_t read = 0;
+  int error = 0;
+  StreamResult result = source_->Read(&buffer_[0], block_size_, &read,
+                                      &error);
+  if (result == SR_BLOCK) {
+    if (!waiting_source_) {
+      source_->SignalEvent.connect(this, &IbbSendTask::OnSourceEvent);
+      waiting_source_ = true;
+    }
+    // Only the peer's responses are timed.
+    SuspendTimeout();
+    return STATE_BLOCKED;
+  }
+  ResumeTimeout();
+
+  if (result == SR_EOS) {
+    if (SendClose() != XMPP_RETURN_OK) {
+      SignalError(NULL);
+      return STATE_ERROR;
+    }
+    return STATE_CLOSING;
+  }
+  if (result != SR_SUCCESS || SendBlock(buffer_.data(), read) !=
+                              XMPP_RETURN_OK) {
+    LOG(LS_WARNING) << "IBB " << sid_ << " failed reading or sending: "
+                    << error;
+    SendClose();
+    SignalError(NULL);
+    return STATE_ERROR;
+  }
+  in_flight_ = read;
+  seq_ += 1;  // Wraps to 0 after 65535, as XEP-0047 has it.
+  return STATE_RESPONSE;
+}
+
+int IbbSendTask::ProcessClosing() {
+  // Any answer ends the stream; every block was acknowledged.
+  if (NextStanza() == NULL)
+    return STATE_BLOCKED;
+  SignalDone();
+  return STATE_DONE;
+}
+
+XmppReturnStatus IbbSendTask::SendBlock(const char* data, size_t len) {
+  char seq[8];
+  sprintfn(seq, sizeof(seq), "%u", static_cast<unsigned>(seq_));
+
+  std::string text;
+  text.reserve(128 + to_.Str().size() + sid_.size() +
+               Base64Encoder::MaxEncodedSize(len));
+  text.append("<iq type=\"set\" to=\"");
+  XmlPrinter::PrintQuotedValue(&text, to_.Str());
+  text.append("\" id=\"");
+  XmlPrinter::PrintQuotedValue(&text, task_id());
+  text.append("\"><data xmlns=\"");
+  text.append(NS_IBB);
+  text.append("\" seq=\"");
+  text.append(seq);
+  text.append("\" sid=\"");
+  XmlPrinter::PrintQuotedValue(&text, sid_);
+  text.append("\">");
+
+  // The base64 goes straight into the stanza's text.
+  size_t start = text.size();
+  text.resize(start + Base64Encoder::MaxEncodedSize(len) + 4);
+  Base64Encoder encoder;
+  size_t encoded = encoder.Update(data, len, &text[start]);
+  encoded += encoder.Finish(&text[start + encoded]);
+  text.resize(start + encoded);
+  text.append("</data></iq>");
+
+  XmppClient* client = GetClient();
+  if (client == NULL)
+    return XMPP_RETURN_BADSTATE;
+  return client->SendStanzaText(&text);
+}
+
+XmppReturnStatus IbbSendTask::SendClose() {
+  scoped_ptr<XmlElement> iq(MakeIq(STR_SET, to_, task_id()));
+  XmlElement* close = new XmlElement(QN_IBB_CLOSE, true);
+  close->AddAttr(QN_IBB_SID, sid_);
+  iq->AddElement(close);
+  return SendStanza(iq.get());
+}
+
+void IbbSendTask::OnSourceEvent(StreamInterface* stream, int events,
+                                int error) {
+  if (events & (SE_READ | SE_CLOSE))
+    Wake();
+}
+
+bool IbbSendTask::HandleStanza(const XmlElement* stanza) {
+  if (!MatchResponseIq(stanza, to_, task_id()))
+    return false;
+  QueueStanza(stanza);
+  return true;
+}
+
+int IbbSendTask::OnTimeout() {
+  SignalError(NULL);
+  return XmppTask::OnTimeout();
+}
+
+//------------------------------------------------------------------
+// IbbReceiveTask
+
+IbbReceiveTask::IbbReceiveTask(TaskParent* parent)
+    : XmppTask(parent, XmppEngine::HL_TYPE),
+      sink_set_(false), parsing_limit_(0) {
+}
+
+IbbReceiveTask::~IbbReceiveTask() {
+}
+
+void IbbReceiveTask::Accept(const std::string& sid, StreamInterface* sink) {
+  StreamMap::iterator it = streams_.find(sid);
+  if (it != streams_.end())
+    it->second.sink = sink;
+}
+
+bool IbbReceiveTask::WantText(const XmppStanzaStart& start) {
+  if (start.Name() != QN_IBB_DATA)
+    return false;
+  // The text of a block is taken even for a stream that isn't open, so
+  // that it isn't built only to be refused.
+  parsing_.streamed = true;
+  parsing_.ok = false;
+  parsing_.data.clear();
+  const char* sid = start.Attr(QN_IBB_SID);
+  StreamMap::iterator it = sid ? streams_.find(sid) : streams_.end();
+  if (it == streams_.end() || it->second.sink == NULL)
+    return true;
+  parsing_.ok = true;
+  parsing_limit_ = it->second.block_size;
+  decoder_ = Base64Decoder();
+  return true;
+}
+
+void IbbReceiveTask::Text(const char* text, size_t len) {
+  if (!parsing_.ok)
+    return;
+  std::string& data = parsing_.data;
+  size_t start = data.size();
+  data.resize(start + Base64Decoder::MaxDecodedSize(len));
+  size_t decoded = 0;
+  parsing_.ok = decoder_.Update(text, len, &data[start], &decoded);
+  data.resize(start + decoded);
+  if (data.size() > parsing_limit_)
+    parsing_.ok = false;
+}
+
+void IbbReceiveTask::EndText() {
+  if (!parsing_.ok)
+    return;
+  char tail[2];
+  size_t decoded = 0;
+  parsing_.ok = decoder_.Finish(tail, &decoded);
+  parsing_.data.append(tail, decoded);
+  if (parsing_.data.size() > parsing_limit_)
+    parsing_.ok = false;
+}
+
+int IbbReceiveTask::ProcessStart() {
+  GetClient()->SetTextSink(this);
+  sink_set_ = true;
+  return STATE_RESPONSE;
+}
+
+int IbbReceiveTask::ProcessResponse() {
+  const XmlElement* stanza = NextStanza();
+  if (stanza == NULL)
+    return STATE_BLOCKED;
+
+  const XmlElement* child = stanza->FirstElement();
+  if (child->Name() == QN_IBB_OPEN) {
+    ProcessOpen(stanza, child);
+  } else if (child->Name() == QN_IBB_CLOSE) {
+    ProcessClose(stanza, child);
+  } else {
+    // Blocks are queued in the order of their stanzas.
+    ProcessData(stanza, child, &blocks_.front());
+    blocks_.front().data.clear();
+    spare_.splice(spare_.begin(), blocks_, blocks_.begin());
+  }
+  return STATE_RESPONSE;
+}
+
+void IbbReceiveTask::ProcessOpen(const XmlElement* stanza,
+                                 const XmlElement* open) {
+  const std::string& sid = open->Attr(QN_IBB_SID);
+  const std::string& kind = open->Attr(QN_IBB_STANZA);
+  unsigned long block_size = 0;
+  if (sid.empty() ||
+      !ParseNumber(open->Attr(QN_IBB_BLOCK_SIZE), ~0UL, &block_size) ||
+      block_size == 0) {
+    Fail(stanza, XSE_BAD_REQUEST, "");
+    return;
+  }
+  if (block_size > kMaxBlockSize) {
+    Fail(stanza, XSE_RESOURCE_CONSTRAINT, "");
+    return;
+  }
+  if (!kind.empty() && kind != "iq") {
+    Fail(stanza, XSE_FEATURE_NOT_IMPLEMENTED, "");
+    return;
+  }
+  if (streams_.find(sid) != streams_.end()) {
+    Fail(stanza, XSE_NOT_ACCEPTABLE, "");
+    return;
+  }
+
+  Stream& stream = streams_[sid];
+  stream.peer = Jid(stanza->Attr(QN_FROM));
+  stream.sink = NULL;
+  stream.block_size = block_size;
+  stream.seq = 0;
+  SignalOpen(stream.peer, sid, block_size);
+
+  StreamMap::iterator it = streams_.find(sid);
+  if (it == streams_.end() || it->second.sink == NULL) {
+    if (it != streams_.end())
+      streams_.erase(it);
+    SendStanzaError(stanza, XSE_NOT_ACCEPTABLE, "");
+    return;
+  }
+  SendResult(stanza);
+}
+
+void IbbReceiveTask::ProcessData(const XmlElement* stanza,
+                                 const XmlElement* data, Block* block) {
+  const std::string& sid = data->Attr(QN_IBB_SID);
+  StreamMap::iterator it = streams_.find(sid);
+  if (it == streams_.end() || it->second.sink == NULL ||
+      Jid(stanza->Attr(QN_FROM)) != it->second.peer) {
+    // Not for a stream of ours, which goes on.
+    Fail(stanza, XSE_ITEM_NOT_FOUND, "");
+    return;
+  }
+  Stream& stream = it->second;
+
+  unsigned long seq = 0;
+  if (!ParseNumber(data->Attr(QN_IBB_SEQ), 65535, &seq) ||
+      seq != stream.seq) {
+    Fail(stanza, XSE_UNEXPECTED_REQUEST, sid);
+    return;
+  }
+  if (!block->streamed) {
+    block->ok = Base64::Decode(data->BodyText(),
+                               Base64::DO_PARSE_WHITE | Base64::DO_PAD_ANY |
+                               Base64::DO_TERM_BUFFER, &block->data, NULL) &&
+                block->data.size() <= stream.block_size;
+  }
+  if (!block->ok) {
+    Fail(stanza, XSE_BAD_REQUEST, sid);
+    return;
+  }
+  if (!block->data.empty()) {
+    size_t written = 0;
+    int error = 0;
+    if (stream.sink->WriteAll(block->data.data(), block->data.size(),
+                              &written, &error) != SR_SUCCESS) {
+      LOG(LS_WARNING) << "IBB " << sid << " failed writing: " << error;
+      Fail(stanza, XSE_RESOURCE_CONSTRAINT, sid);
+      return;
+    }
+  }
+  stream.seq += 1;
+  SendResult(stanza);
+}
+
+void IbbReceiveTask::ProcessClose(const XmlElement* stanza,
+                                  const XmlElement* close) {
+  const std::string& sid = close->Attr(QN_IBB_SID);
+  StreamMap::iterator it = streams_.find(sid);
+  if (it == streams_.end() || Jid(stanza->Attr(QN_FROM)) != it->second.peer) {
+    Fail(stanza, XSE_ITEM_NOT_FOUND, "");
+    return;
+  }
+  // Keeps the sid, which the erase would free.
+  std::string closed(sid);
+  streams_.erase(it);
+  SendResult(stanza);
+  SignalClosed(closed, false);
+}
+
+void IbbReceiveTask::SendResult(const XmlElement* stanza) {
+  scoped_ptr<XmlElement> result(MakeIqResult(stanza));
+  SendStanza(result.get());
+}
+
+void IbbReceiveTask::Fail(const XmlElement* stanza, XmppStanzaError code,
+                          const std::string& sid) {
+  SendStanzaError(stanza, code, "");
+  if (sid.empty())
+    return;
+  StreamMap::iterator it = streams_.find(sid);
+  if (it == streams_.end())
+    return;
+  std::string failed(sid);
+  streams_.erase(it);
+  SignalClosed(failed, true);
+}
+
+bool IbbReceiveTask::HandleStanza(const XmlElement* stanza) {
+  if (stanza->Name() != QN_IQ || stanza->Attr(QN_TYPE) != STR_SET)
+    return false;
+  const XmlElement* child = stanza->FirstElement();
+  if (child == NULL)
+    return false;
+  if (child->Name() == QN_IBB_DATA) {
+    // Takes the block just parsed, if it was, leaving parsing_ a spare
+    // buffer.
+    if (spare_.empty())
+      spare_.push_back(Block());
+    blocks_.splice(blocks_.end(), spare_, spare_.begin());
+    Block& block = blocks_.back();
+    block.streamed = parsing_.streamed;
+    block.ok = parsing_.ok;
+    block.data.swap(parsing_.data);
+    parsing_.streamed = false;
+    parsing_.ok = false;
+  } else if (child->Name() != QN_IBB_OPEN && child->Name() != QN_IBB_CLOSE) {
+    return false;
+  }
+  QueueStanza(stanza);
+  return true;
+}
+
+void IbbReceiveTask::Stop() {
+  if (sink_set_ && GetClient())
+    GetClient()->SetTextSink(NULL);
+  sink_set_ = false;
+  XmppTask::Stop();
+}
+
+}  // namespace txmpp
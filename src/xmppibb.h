@@ -0,0 +1,195 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMPPIBB_H_
+#define _TXMPP_XMPPIBB_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "base64.h"
+#include "jid.h"
+#include "stream.h"
+#include "xmpptask.h"
+
+namespace txmpp {
+
+// In-band bytestreams (XEP-0047), carried in iq stanzas.  Each block is
+// base64 printed straight into the text of its stanza, which is sent
+// without building it, and on the receiving side decoded as it is parsed,
+// so neither side holds more than a block of a transfer or builds its text
+// into an XmlElement.  Only one block of a stream is in flight at a time.
+
+// Sends what |source| reads, until its end, to |to| over the bytestream
+// |sid|, which the two sides have agreed on, such as by stream initiation.
+// |source| is not owned and must outlive the task.  It may block; the task
+// waits for its SE_READ.
+class IbbSendTask : public XmppTask {
+ public:
+  static const size_t kDefaultBlockSize = 4096;
+  // A response not back within this fails the transfer.
+  static const int kTimeoutSeconds = 60;
+
+  IbbSendTask(TaskParent* parent, const Jid& to, const std::string& sid,
+              StreamInterface* source, size_t block_size = kDefaultBlockSize);
+  virtual ~IbbSendTask();
+
+  // The bytes the receiver has acknowledged.
+  size_t bytes_sent() const { return bytes_sent_; }
+
+  // Raised once the stream is closed after its last block.
+  signal0<> SignalDone;
+  // Raised with the <error> of the response that refused the stream or a
+  // block, or with NULL if the source failed or a response never came.
+  signal1<const XmlElement*> SignalError;
+
+ protected:
+  virtual int ProcessStart();
+  virtual int ProcessResponse();
+  virtual bool HandleStanza(const XmlElement* stanza);
+  virtual int OnTimeout();
+
+ private:
+  enum {
+    STATE_SEND = STATE_NEXT,  // Reads and sends the next block.
+    STATE_CLOSING,            // Waits for the response to <close>.
+  };
+  int Process(int state) {
+    if (state == STATE_SEND)
+      return ProcessSend();
+    if (state == STATE_CLOSING && !TimedOut())
+      return ProcessClosing();
+    return XmppTask::Process(state);
+  }
+
+  int ProcessSend();
+  int ProcessClosing();
+  // Prints and sends the <data> stanza for |len| bytes of |data|.
+  XmppReturnStatus SendBlock(const char* data, size_t len);
+  XmppReturnStatus SendClose();
+  void OnSourceEvent(StreamInterface* stream, int events, int error);
+
+  const Jid to_;
+  const std::string sid_;
+  StreamInterface* source_;
+  const size_t block_size_;
+  std::string buffer_;
+  // The bytes of the block awaiting its response.
+  size_t in_flight_;
+  size_t bytes_sent_;
+  uint16 seq_;
+  bool waiting_source_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(IbbSendTask);
+};
+
+// Receives the in-band bytestreams opened to this client.  Each is offered
+// to SignalOpen, whose slots take it by calling Accept with a stream for
+// its bytes; one not accepted is declined.  The task becomes the client's
+// XmppTextSink while it runs, so only one can run on a client, and the
+// <data> of each block is decoded as it is parsed.  Blocks are only taken
+// from iq stanzas.
+class IbbReceiveTask : public XmppTask, public XmppTextSink {
+ public:
+  // The largest block-size accepted.
+  static const size_t kMaxBlockSize = 65535;
+
+  explicit IbbReceiveTask(TaskParent* parent);
+  virtual ~IbbReceiveTask();
+
+  // Takes the stream |sid|, being offered to SignalOpen, writing its bytes
+  // to |sink|, which is not owned and must outlive the stream.  Writes to
+  // |sink| that don't complete at once fail the stream.
+  void Accept(const std::string& sid, StreamInterface* sink);
+
+  // The peer, sid and block-size of a stream being opened.
+  signal3<const Jid&, const std::string&, size_t> SignalOpen;
+  // Raised as a stream ends, with true if it failed rather than being
+  // closed by the peer.
+  signal2<const std::string&, bool> SignalClosed;
+
+  // XmppTextSink
+  virtual bool WantText(const XmppStanzaStart& start);
+  virtual void Text(const char* text, size_t len);
+  virtual void EndText();
+
+ protected:
+  virtual int ProcessStart();
+  virtual int ProcessResponse();
+  virtual bool HandleStanza(const XmlElement* stanza);
+  virtual void Stop();
+
+ private:
+  struct Stream {
+    Jid peer;
+    StreamInterface* sink;
+    size_t block_size;
+    uint16 seq;  // Of the next block.
+  };
+  typedef std::map<std::string, Stream> StreamMap;
+
+  // A decoded block, queued with its stanza.  One that wasn't streamed,
+  // as when the parser kept the stanza whole, is decoded from its text.
+  struct Block {
+    Block() : streamed(false), ok(false) {}
+    bool streamed;
+    bool ok;
+    std::string data;
+  };
+
+  void ProcessOpen(const XmlElement* stanza, const XmlElement* open);
+  void ProcessData(const XmlElement* stanza, const XmlElement* data,
+                   Block* block);
+  void ProcessClose(const XmlElement* stanza, const XmlElement* close);
+  void SendResult(const XmlElement* stanza);
+  // Answers |stanza| with |code|, and ends the stream |sid| as failed if it
+  // is open.
+  void Fail(const XmlElement* stanza, XmppStanzaError code,
+            const std::string& sid);
+
+  StreamMap streams_;
+  bool sink_set_;
+  // The block of the <data> last parsed, until its stanza is queued.  Any
+  // bytes beyond the stream's block-size fail it.
+  Block parsing_;
+  size_t parsing_limit_;
+  Base64Decoder decoder_;
+  std::list<Block> blocks_;
+  // Blocks' buffers kept for reuse.
+  std::list<Block> spare_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(IbbReceiveTask);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMPPIBB_H_
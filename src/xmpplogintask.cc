@@ -34,6 +34,8 @@
 #include "constants.h"
 #include "jid.h"
 #include "saslmechanism.h"
+#include "stringdigest.h"
+#include "stringencode.h"
 #include "xmppengineimpl.h"
 
 namespace txmpp {
@@ -47,9 +49,13 @@ const ConstantLabel XmppLoginTask::LOGINTASK_STATES[] = {
   KLABEL(LOGINSTATE_AUTH_INIT),
   KLABEL(LOGINSTATE_BIND_INIT),
   KLABEL(LOGINSTATE_TLS_REQUESTED),
+  KLABEL(LOGINSTATE_COMPRESS_INIT),
+  KLABEL(LOGINSTATE_COMPRESS_REQUESTED),
   KLABEL(LOGINSTATE_SASL_RUNNING),
   KLABEL(LOGINSTATE_BIND_REQUESTED),
   KLABEL(LOGINSTATE_SESSION_REQUESTED),
+  KLABEL(LOGINSTATE_RESUME_REQUESTED),
+  KLABEL(LOGINSTATE_HANDSHAKE_REQUESTED),
   KLABEL(LOGINSTATE_DONE),
   LASTLABEL
 };
@@ -62,6 +68,13 @@ XmppLoginTask::XmppLoginTask(XmppEngineImpl * pctx) :
   pelStanza_(NULL),
   isStart_(false),
   iqId_(STR_EMPTY),
+  sessionIqId_(STR_EMPTY),
+  restartSent_(false),
+  bindSent_(false),
+  sessionSent_(false),
+  sessionNeeded_(false),
+  compressionTried_(false),
+  compressionMethod_(NULL),
   pelFeatures_(NULL),
   fullJid_(STR_EMPTY),
   streamId_(STR_EMPTY),
@@ -125,10 +138,34 @@ XmppLoginTask::Advance() {
         if (!isStart_ || !HandleStartStream(element))
           return Failure(XmppEngine::ERROR_VERSION);
 
+        // A component has no features to wait for, and goes straight to
+        // its handshake
+        if (pctx_->component_) {
+          if (!SendHandshake())
+            return Failure(XmppEngine::ERROR_AUTH);
+          state_ = LOGINSTATE_HANDSHAKE_REQUESTED;
+          return true;
+        }
+
         state_ = LOGINSTATE_STARTED_XMPP;
         return true;
       }
 
+      case LOGINSTATE_HANDSHAKE_REQUESTED: {
+        if (NULL == (element = NextStanza()))
+          return true;
+
+        // A wrong secret gets a stream error, which the engine takes
+        if (element->Name() != QN_COMPONENT_HANDSHAKE)
+          return Failure(XmppEngine::ERROR_UNAUTHORIZED);
+
+        fullJid_ = Jid(STR_EMPTY, pctx_->user_jid_.domain(), STR_EMPTY);
+        pctx_->SignalBound(fullJid_);
+        FlushQueuedStanzas();
+        state_ = LOGINSTATE_DONE;
+        return true;
+      }
+
       case LOGINSTATE_STARTED_XMPP: {
         if (NULL == (element = NextStanza()))
           return true;
@@ -136,8 +173,9 @@ XmppLoginTask::Advance() {
         if (!HandleFeatures(element))
           return Failure(XmppEngine::ERROR_VERSION);
 
-        // Use TLS if forced, or if available
-        if (pctx_->tls_needed_ || GetFeature(QN_TLS_STARTTLS) != NULL) {
+        // Use TLS if forced, or if available and not declined
+        if (pctx_->tls_needed_ ||
+            (!pctx_->tls_skipped_ && GetFeature(QN_TLS_STARTTLS) != NULL)) {
           state_ = LOGINSTATE_TLS_INIT;
           continue;
         }
@@ -147,10 +185,50 @@ XmppLoginTask::Advance() {
           continue;
         }
 
+        // Compress once authenticated, unless the bind has already gone
+        // out uncompressed
+        if (!compressionTried_ && !bindSent_ &&
+            (compressionMethod_ = CompressionMethod()) != NULL) {
+          compressionTried_ = true;
+          state_ = LOGINSTATE_COMPRESS_INIT;
+          continue;
+        }
+
         state_ = LOGINSTATE_BIND_INIT;
         continue;
       }
 
+      case LOGINSTATE_COMPRESS_INIT: {
+        XmlElement compress(QN_COMPRESS_COMPRESS, true);
+        compress.AddElement(new XmlElement(QN_COMPRESS_METHOD));
+        compress.AddText(compressionMethod_, 1);
+        pctx_->InternalSendStanza(&compress);
+        state_ = LOGINSTATE_COMPRESS_REQUESTED;
+        continue;
+      }
+
+      case LOGINSTATE_COMPRESS_REQUESTED: {
+        if (NULL == (element = NextStanza()))
+          return true;
+
+        if (element->Name() == QN_COMPRESS_FAILURE) {
+          // Go on without it
+          LOG(LS_INFO) << "Server would not compress the stream";
+          state_ = LOGINSTATE_BIND_INIT;
+          continue;
+        }
+        if (element->Name() != QN_COMPRESS_COMPRESSED)
+          return Failure(XmppEngine::ERROR_COMPRESSION);
+        if (compressionMethod_ == kBinaryXmlMethod)
+          pctx_->StartBinaryXml();
+        else if (!pctx_->StartCompression())
+          return Failure(XmppEngine::ERROR_COMPRESSION);
+
+        // The stream starts over, compressed or encoded
+        state_ = LOGINSTATE_INIT;
+        continue;
+      }
+
       case LOGINSTATE_TLS_INIT: {
         const XmlElement * pelTls = GetFeature(QN_TLS_STARTTLS);
         if (!pelTls)
@@ -215,6 +293,17 @@ XmppLoginTask::Advance() {
 
         pctx_->InternalSendStanza(auth);
         delete auth;
+
+        // If the answer can only be success, restart the stream and bind
+        // without waiting for it
+        if (pctx_->pipelined_login_ && !sasl_mech_->ExpectsChallenge()) {
+          pctx_->InternalSendStart(pctx_->user_jid_.domain());
+          restartSent_ = true;
+          if (!CanResume()) {
+            SendBind();
+            bindSent_ = true;
+          }
+        }
         state_ = LOGINSTATE_SASL_RUNNING;
         continue;
       }
@@ -235,33 +324,56 @@ XmppLoginTask::Advance() {
           continue;
         }
         if (element->Name() != QN_SASL_SUCCESS) {
+          sasl_mech_->HandleSaslFailure(element);
           return Failure(XmppEngine::ERROR_UNAUTHORIZED);
         }
+        if (!sasl_mech_->VerifySaslSuccess(element)) {
+          return Failure(XmppEngine::ERROR_AUTH);
+        }
+        sasl_mech_->HandleSaslSuccess(element);
 
         // Authenticated!
         authNeeded_ = false;
+        if (restartSent_) {
+          pctx_->RaiseReset();
+          pelFeatures_.reset(NULL);
+          restartSent_ = false;
+          state_ = LOGINSTATE_STREAMSTART_SENT;
+          return true;
+        }
         state_ = LOGINSTATE_INIT;
         continue;
       }
 
       case LOGINSTATE_BIND_INIT: {
+        // Resume the last stream instead of binding, if it can be
+        if (!bindSent_ && CanResume() && GetFeature(QN_SM_SM) != NULL) {
+          XmlElement resume(QN_SM_RESUME, true);
+          resume.AddAttr(QN_H,
+                         ToString(pctx_->stream_management_.handled()));
+          resume.AddAttr(QN_PREVID, pctx_->stream_management_.id());
+          pctx_->InternalSendStanza(&resume);
+          state_ = LOGINSTATE_RESUME_REQUESTED;
+          continue;
+        }
+
         const XmlElement * pelBindFeature = GetFeature(QN_BIND_BIND);
-        const XmlElement * pelSessionFeature = GetFeature(QN_SESSION_SESSION);
-        if (!pelBindFeature || !pelSessionFeature)
+        if (!pelBindFeature)
           return Failure(XmppEngine::ERROR_BIND);
 
-        XmlElement iq(QN_IQ);
-        iq.AddAttr(QN_TYPE, "set");
-
-        iqId_ = pctx_->NextId();
-        iq.AddAttr(QN_ID, iqId_);
-        iq.AddElement(new XmlElement(QN_BIND_BIND, true));
-
-        if (pctx_->requested_resource_ != STR_EMPTY) {
-          iq.AddElement(new XmlElement(QN_BIND_RESOURCE), 1);
-          iq.AddText(pctx_->requested_resource_, 2);
+        // Servers following RFC 6120 may not offer a session at all, or
+        // mark it optional
+        const XmlElement * pelSessionFeature = GetFeature(QN_SESSION_SESSION);
+        sessionNeeded_ = pelSessionFeature != NULL &&
+            pelSessionFeature->FirstNamed(QN_SESSION_OPTIONAL) == NULL;
+
+        if (!bindSent_)
+          SendBind();
+        bindSent_ = false;
+        if (pctx_->pipelined_login_ && sessionNeeded_) {
+          SendSession();
+          sessionSent_ = true;
         }
-        pctx_->InternalSendStanza(&iq);
         state_ = LOGINSTATE_BIND_REQUESTED;
         continue;
       }
@@ -283,15 +395,15 @@ XmppLoginTask::Advance() {
           return Failure(XmppEngine::ERROR_BIND);
         }
 
-        // now request session
-        XmlElement iq(QN_IQ);
-        iq.AddAttr(QN_TYPE, "set");
-
-        iqId_ = pctx_->NextId();
-        iq.AddAttr(QN_ID, iqId_);
-        iq.AddElement(new XmlElement(QN_SESSION_SESSION, true));
-        pctx_->InternalSendStanza(&iq);
+        if (!sessionNeeded_) {
+          Bound();
+          return true;
+        }
 
+        // now request session, unless it already was
+        if (!sessionSent_)
+          SendSession();
+        sessionSent_ = false;
         state_ = LOGINSTATE_SESSION_REQUESTED;
         continue;
       }
@@ -299,14 +411,33 @@ XmppLoginTask::Advance() {
       case LOGINSTATE_SESSION_REQUESTED: {
         if (NULL == (element = NextStanza()))
           return true;
-        if (element->Name() != QN_IQ || element->Attr(QN_ID) != iqId_ ||
+        if (element->Name() != QN_IQ || element->Attr(QN_ID) != sessionIqId_ ||
             element->Attr(QN_TYPE) == "get" || element->Attr(QN_TYPE) == "set")
           return false;
 
         if (element->Attr(QN_TYPE) != "result")
           return Failure(XmppEngine::ERROR_BIND);
 
-        pctx_->SignalBound(fullJid_);
+        Bound();
+        return true;
+      }
+
+      case LOGINSTATE_RESUME_REQUESTED: {
+        if (NULL == (element = NextStanza()))
+          return true;
+
+        if (element->Name() == QN_SM_FAILED) {
+          // Start over on a new session; what the old one hadn't sent
+          // is lost
+          LOG(LS_INFO) << "Server would not resume the stream";
+          pctx_->stream_management_.Reset();
+          state_ = LOGINSTATE_BIND_INIT;
+          continue;
+        }
+
+        if (element->Name() != QN_SM_RESUMED || !pctx_->ResumeStream(element))
+          return Failure(XmppEngine::ERROR_BIND);
+
         FlushQueuedStanzas();
         state_ = LOGINSTATE_DONE;
         return true;
@@ -324,11 +455,16 @@ XmppLoginTask::HandleStartStream(const XmlElement *element) {
   if (element->Name() != QN_STREAM_STREAM)
     return false;
 
-  if (element->Attr(QN_XMLNS) != "jabber:client")
-    return false;
+  if (pctx_->component_) {
+    if (element->Attr(QN_XMLNS) != NS_COMPONENT_ACCEPT)
+      return false;
+  } else {
+    if (element->Attr(QN_XMLNS) != "jabber:client")
+      return false;
 
-  if (element->Attr(QN_VERSION) != "1.0")
-    return false;
+    if (element->Attr(QN_VERSION) != "1.0")
+      return false;
+  }
 
   if (!element->HasAttr(QN_ID))
     return false;
@@ -365,10 +501,93 @@ XmppLoginTask::OutgoingStanza(const XmlElement * element) {
   pvecQueuedStanzas_->push_back(pelCopy);
 }
 
+bool
+XmppLoginTask::CanResume() {
+  // The stanzas to resend must be in the stream's encoding.
+  return pctx_->stream_management_enabled_ &&
+         pctx_->stream_management_.resumable() &&
+         (pctx_->stream_management_.unacked_count() == 0 ||
+          pctx_->stream_management_.binary() == pctx_->binary_);
+}
+
+const char *
+XmppLoginTask::CompressionMethod() {
+  if (pctx_->binary_xml_ && CompressionOffered(kBinaryXmlMethod))
+    return kBinaryXmlMethod;
+  if (pctx_->compression_ && CompressionOffered("zlib"))
+    return "zlib";
+  return NULL;
+}
+
+bool
+XmppLoginTask::CompressionOffered(const char * method) {
+  const XmlElement * pelCompression =
+      GetFeature(QN_COMPRESS_FEATURE_COMPRESSION);
+  if (!pelCompression)
+    return false;
+  for (const XmlElement * pelMethod =
+       pelCompression->FirstNamed(QN_COMPRESS_FEATURE_METHOD);
+       pelMethod;
+       pelMethod = pelMethod->NextNamed(QN_COMPRESS_FEATURE_METHOD)) {
+    if (pelMethod->BodyText() == method)
+      return true;
+  }
+  return false;
+}
+
+void
+XmppLoginTask::SendBind() {
+  XmlElement iq(QN_IQ);
+  iq.AddAttr(QN_TYPE, "set");
+
+  iqId_ = pctx_->NextId();
+  iq.AddAttr(QN_ID, iqId_);
+  iq.AddElement(new XmlElement(QN_BIND_BIND, true));
+
+  if (pctx_->RequestedResource() != STR_EMPTY) {
+    iq.AddElement(new XmlElement(QN_BIND_RESOURCE), 1);
+    iq.AddText(pctx_->RequestedResource(), 2);
+  }
+  pctx_->InternalSendStanza(&iq);
+}
+
+void
+XmppLoginTask::SendSession() {
+  XmlElement iq(QN_IQ);
+  iq.AddAttr(QN_TYPE, "set");
+
+  sessionIqId_ = pctx_->NextId();
+  iq.AddAttr(QN_ID, sessionIqId_);
+  iq.AddElement(new XmlElement(QN_SESSION_SESSION, true));
+  pctx_->InternalSendStanza(&iq);
+}
+
+bool
+XmppLoginTask::SendHandshake() {
+#if SSL_USE_OPENSSL
+  XmlElement handshake(QN_COMPONENT_HANDSHAKE);
+  handshake.AddText(SHA1(streamId_ + pctx_->ComponentSecret()));
+  pctx_->InternalSendStanza(&handshake);
+  return true;
+#else
+  LOG(LS_ERROR) << "Component handshake needs SHA-1, from OpenSSL";
+  return false;
+#endif
+}
+
+void
+XmppLoginTask::Bound() {
+  pctx_->SignalBound(fullJid_);
+  if (pctx_->stream_management_enabled_ && GetFeature(QN_SM_SM) != NULL)
+    pctx_->EnableStreamManagement();
+  FlushQueuedStanzas();
+  state_ = LOGINSTATE_DONE;
+}
+
 void
 XmppLoginTask::FlushQueuedStanzas() {
   for (size_t i = 0; i < pvecQueuedStanzas_->size(); i += 1) {
-    pctx_->InternalSendStanza((*pvecQueuedStanzas_)[i]);
+    pctx_->InternalSendCountedStanza((*pvecQueuedStanzas_)[i]);
     delete (*pvecQueuedStanzas_)[i];
   }
   pvecQueuedStanzas_->clear();
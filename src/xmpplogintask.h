@@ -65,9 +65,13 @@ private:
     LOGINSTATE_AUTH_INIT,
     LOGINSTATE_BIND_INIT,
     LOGINSTATE_TLS_REQUESTED,
+    LOGINSTATE_COMPRESS_INIT,
+    LOGINSTATE_COMPRESS_REQUESTED,
     LOGINSTATE_SASL_RUNNING,
     LOGINSTATE_BIND_REQUESTED,
     LOGINSTATE_SESSION_REQUESTED,
+    LOGINSTATE_RESUME_REQUESTED,
+    LOGINSTATE_HANDSHAKE_REQUESTED,
     LOGINSTATE_DONE,
   };
 
@@ -78,6 +82,18 @@ private:
   const XmlElement * GetFeature(const QName & name);
   bool Failure(XmppEngine::Error reason);
   void FlushQueuedStanzas();
+  // Whether the login will resume a stream rather than bind a new one.
+  bool CanResume();
+  // The XEP-0138 method to ask for, of those the engine wants and the
+  // server offers, or NULL: the binary XML encoding before zlib.
+  const char * CompressionMethod();
+  bool CompressionOffered(const char * method);
+  void SendBind();
+  void SendSession();
+  // Sends a component's XEP-0114 handshake on the stream id.
+  bool SendHandshake();
+  // Marks the session bound, and sends what was waiting for it.
+  void Bound();
 
   XmppEngineImpl * pctx_;
   bool authNeeded_;
@@ -85,6 +101,15 @@ private:
   const XmlElement * pelStanza_;
   bool isStart_;
   std::string iqId_;
+  std::string sessionIqId_;
+  // With a pipelined login, what has been sent before the server's
+  // answer to the step before.
+  bool restartSent_;
+  bool bindSent_;
+  bool sessionSent_;
+  bool sessionNeeded_;
+  bool compressionTried_;
+  const char * compressionMethod_;
   scoped_ptr<XmlElement> pelFeatures_;
   Jid fullJid_;
   std::string streamId_;
@@ -0,0 +1,225 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmppreplay.h"
+
+#include <map>
+
+#include "constants.h"
+#include "jid.h"
+#include "saslhandler.h"
+#include "saslmechanism.h"
+#include "stream.h"
+#include "thread.h"
+#include "time.h"
+#include "xmlelement.h"
+#include "xmppclient.h"
+#include "xmppengineimpl.h"
+
+namespace txmpp {
+
+XmppCaptureTap::XmppCaptureTap(XmppClient* client, WireCapture* capture,
+                               const std::string& label)
+    : capture_(capture), connection_(capture->AddConnection(label)) {
+  client->SignalLogInput.connect(this, &XmppCaptureTap::OnInput);
+  client->SignalLogOutput.connect(this, &XmppCaptureTap::OnOutput);
+}
+
+void XmppCaptureTap::OnInput(const char* bytes, int len) {
+  capture_->Write(connection_, WireCapture::WR_INPUT, bytes, len);
+}
+
+void XmppCaptureTap::OnOutput(const char* bytes, int len) {
+  capture_->Write(connection_, WireCapture::WR_OUTPUT, bytes, len);
+}
+
+// Throws the output away, and goes along with TLS and compression, which
+// the captured input is already past.
+class XmppReplay::Output : public XmppOutputHandler {
+ public:
+  virtual void WriteOutput(const char* bytes, size_t len) {}
+  virtual void WriteOutputChain(ChainBuffer* output) { output->Clear(); }
+  virtual void StartTls(const std::string& domainname) {}
+  virtual bool StartCompression(int level, int window_bits) { return true; }
+  virtual void CloseConnection() {}
+};
+
+class XmppReplay::StanzaCounter : public XmppStanzaHandler {
+ public:
+  StanzaCounter() : count(0) {}
+  virtual bool HandleStanza(const XmlElement* stanza) {
+    ++count;
+    return false;
+  }
+  size_t count;
+};
+
+// Takes whatever challenges and success the capture holds.
+class XmppReplay::ReplaySaslHandler : public SaslHandler {
+ public:
+  virtual std::string ChooseBestSaslMechanism(
+      const std::vector<std::string>& mechanisms, bool encrypted) {
+    return mechanisms.empty() ? std::string() : mechanisms[0];
+  }
+
+  virtual SaslMechanism* CreateSaslMechanism(const std::string& mechanism) {
+    return new Mechanism(mechanism);
+  }
+
+ private:
+  class Mechanism : public SaslMechanism {
+   public:
+    explicit Mechanism(const std::string& name) : name_(name) {}
+    virtual std::string GetMechanismName() { return name_; }
+    virtual XmlElement* StartSaslAuth() {
+      XmlElement* auth = new XmlElement(QN_SASL_AUTH, true);
+      auth->AddAttr(QN_MECHANISM, name_);
+      return auth;
+    }
+    virtual XmlElement* HandleSaslChallenge(const XmlElement* challenge) {
+      return new XmlElement(QN_SASL_RESPONSE, true);
+    }
+
+   private:
+    std::string name_;
+  };
+};
+
+// Finds the value of attribute |name| in the tag that starts at |start| in
+// |text|.
+static bool XmppReplay_TagAttr(const std::string& text, size_t start,
+                               const std::string& name, std::string* value) {
+  size_t end = text.find('>', start);
+  if (start == std::string::npos || end == std::string::npos)
+    return false;
+  std::string tag = text.substr(start, end - start);
+  for (size_t pos = tag.find(name); pos != std::string::npos;
+       pos = tag.find(name, pos + 1)) {
+    size_t quote = pos + name.size() + 1;
+    if (pos == 0 || tag[pos - 1] != ' ' || quote >= tag.size() ||
+        tag[quote - 1] != '=' || (tag[quote] != '\'' && tag[quote] != '"'))
+      continue;
+    size_t close = tag.find(tag[quote], quote + 1);
+    if (close == std::string::npos)
+      return false;
+    *value = tag.substr(quote + 1, close - quote - 1);
+    return true;
+  }
+  return false;
+}
+
+XmppReplay::XmppReplay() : use_tls_(false), compression_(false) {
+}
+
+XmppReplay::~XmppReplay() {
+}
+
+bool XmppReplay::Load(StreamInterface* capture, uint32 connection) {
+  inputs_.clear();
+  if (!WireCapture::ReadStart(capture))
+    return false;
+  // The output of every connection is kept until the first input says
+  // which is wanted.
+  std::map<uint32, std::string> outputs;
+  WireCapture::Record record;
+  StreamResult result;
+  while ((result = WireCapture::ReadRecord(capture, &record)) ==
+         SR_SUCCESS) {
+    if (connection == kFirstConnection && record.type == WireCapture::WR_INPUT)
+      connection = record.connection;
+    if (connection != kFirstConnection && record.connection != connection)
+      continue;
+    if (record.type == WireCapture::WR_INPUT) {
+      inputs_.push_back(Input());
+      inputs_.back().time = record.time;
+      inputs_.back().data.swap(record.data);
+    } else if (record.type == WireCapture::WR_OUTPUT) {
+      outputs[record.connection].append(record.data);
+    }
+  }
+  if (result != SR_EOS || inputs_.empty())
+    return false;
+  const std::string& output = outputs[connection];
+
+  // What the captured client asked for is in what it sent.
+  domain_.clear();
+  id_prefix_.clear();
+  XmppReplay_TagAttr(output, output.find("<stream:stream"), "to", &domain_);
+  std::string id;
+  if (XmppReplay_TagAttr(output, output.find("<iq"), "id", &id) &&
+      id.size() >= 4) {
+    id_prefix_ = id.substr(0, 4);
+  }
+  use_tls_ = output.find("<starttls") != std::string::npos;
+  compression_ = output.find("<compress") != std::string::npos;
+  return true;
+}
+
+bool XmppReplay::Run(bool paced, Stats* stats) {
+  if (inputs_.empty())
+    return false;
+
+  Output output;
+  StanzaCounter counter;
+  XmppEngineImpl engine;
+  engine.SetOutputHandler(&output);
+  engine.SetSaslHandler(new ReplaySaslHandler());
+  engine.SetUser(Jid("replay", domain_.empty() ? "replay" : domain_, ""));
+  engine.SetUseTls(use_tls_);
+  engine.SetCompression(compression_, -1, 15);
+  if (!id_prefix_.empty())
+    engine.SetIdPrefix(id_prefix_);
+  engine.AddStanzaHandler(&counter, XmppEngine::HL_PEEK);
+  SignalEngineCreated(&engine);
+  if (engine.Connect() != XMPP_RETURN_OK)
+    return false;
+
+  uint64 start = TimeMicros();
+  for (size_t i = 0; i < inputs_.size(); ++i) {
+    const Input& input = inputs_[i];
+    if (paced) {
+      uint64 due = start + (input.time - inputs_[0].time);
+      uint64 now = TimeMicros();
+      if (due > now + 1000)
+        Thread::SleepMs(static_cast<int>((due - now) / 1000));
+    }
+    uint64 before = TimeMicros();
+    engine.HandleInput(input.data.data(), input.data.size());
+    uint64 elapsed = TimeMicros() - before;
+    stats->inputs += 1;
+    stats->bytes += input.data.size();
+    stats->elapsed_us += elapsed;
+    stats->max_input_us = _max(stats->max_input_us, elapsed);
+    if (engine.GetState() == XmppEngine::STATE_CLOSED)
+      break;
+  }
+  stats->stanzas += counter.count;
+  engine.RemoveStanzaHandler(&counter);
+  return engine.GetError(NULL) == XmppEngine::ERROR_NONE;
+}
+
+}  // namespace txmpp
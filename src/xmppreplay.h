@@ -0,0 +1,134 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMPPREPLAY_H_
+#define _TXMPP_XMPPREPLAY_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "sigslot.h"
+#include "wirecapture.h"
+
+namespace txmpp {
+
+class StreamInterface;
+class XmppClient;
+class XmppEngineImpl;
+
+// Records what an XmppClient's engine reads and writes, which is the stream
+// as it is above TLS and compression, as a connection of |capture|.  A
+// socket level capture from LoggingSocketAdapter can't be replayed through
+// TLS; this one can, by XmppReplay.
+class XmppCaptureTap : public has_slots<> {
+ public:
+  XmppCaptureTap(XmppClient* client, WireCapture* capture,
+                 const std::string& label);
+
+  uint32 connection() const { return connection_; }
+
+ private:
+  void OnInput(const char* bytes, int len);
+  void OnOutput(const char* bytes, int len);
+
+  WireCapture* capture_;
+  uint32 connection_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(XmppCaptureTap);
+};
+
+// Feeds the input of one captured connection into a new XmppEngineImpl, as
+// fast as it will go or at the pace it was captured, and times each
+// HandleInput, so that parsing and dispatch can be profiled over real
+// traffic without a server.
+//
+// The engine logs in as the captured one did: it goes through TLS and
+// compression if the capture did, with those left to a no-op output
+// handler; it accepts whatever SASL exchange the capture holds; and its ids
+// have the captured prefix, so that the captured responses match them.
+// Its output is thrown away.
+class XmppReplay {
+ public:
+  // Picks the first connection with input.
+  static const uint32 kFirstConnection = static_cast<uint32>(-1);
+
+  struct Stats {
+    Stats() : inputs(0), bytes(0), stanzas(0), elapsed_us(0),
+              max_input_us(0) {}
+
+    size_t inputs;         // HandleInput calls, one per captured read.
+    size_t bytes;
+    size_t stanzas;        // Stanzas dispatched, the login's included.
+    uint64 elapsed_us;     // Time spent in HandleInput.
+    uint64 max_input_us;   // The longest HandleInput.
+  };
+
+  XmppReplay();
+  ~XmppReplay();
+
+  // Reads |connection|'s records from |capture|.  Returns false if the
+  // capture is corrupt or has no input for the connection.
+  bool Load(StreamInterface* capture, uint32 connection = kFirstConnection);
+
+  // Raised with each new engine before it connects, to add the stanza
+  // handlers whose cost is to be measured.
+  signal1<XmppEngineImpl*> SignalEngineCreated;
+
+  // Replays the loaded input once, adding to |stats|.  Returns false if the
+  // engine fails, as when the capture isn't of a client connection.
+  bool Run(bool paced, Stats* stats);
+
+  const std::string& domain() const { return domain_; }
+
+ private:
+  class Output;
+  class StanzaCounter;
+  class ReplaySaslHandler;
+
+  struct Input {
+    uint64 time;
+    std::string data;
+  };
+
+  std::vector<Input> inputs_;
+  std::string domain_;
+  std::string id_prefix_;
+  bool use_tls_;
+  bool compression_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(XmppReplay);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMPPREPLAY_H_
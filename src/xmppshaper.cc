@@ -0,0 +1,152 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmppshaper.h"
+
+#include "common.h"
+#include "constants.h"
+#include "xmlelement.h"
+
+namespace txmpp {
+
+XmppShaper::XmppShaper(const XmppShaping& shaping)
+    : shaping_(shaping), queued_(0) {
+  if (shaping_.burst > 0)
+    global_.reset(new TokenBucket(shaping_.burst, shaping_.per_second));
+}
+
+XmppShaper::~XmppShaper() {
+  Clear();
+}
+
+XmppShaper::Priority XmppShaper::PriorityOf(const XmlElement* stanza) {
+  if (stanza->Name() == QN_PRESENCE)
+    return PRIORITY_LOW;
+  if (stanza->Name() == QN_IQ) {
+    const std::string& type = stanza->Attr(QN_TYPE);
+    if (type == STR_RESULT || type == STR_ERROR)
+      return PRIORITY_HIGH;
+  }
+  return PRIORITY_NORMAL;
+}
+
+TokenBucket* XmppShaper::DestinationOf(const XmlElement* stanza) {
+  if (shaping_.jid_burst <= 0)
+    return NULL;
+  // Stanzas without a to go to the server, and share the empty name.
+  return destinations_.GetLimiter(stanza->Attr(QN_TO), shaping_.jid_burst,
+                                  shaping_.jid_per_second);
+}
+
+int XmppShaper::TimeUntil(const Entry& entry, uint32 now) const {
+  int wait = global_.get() ? global_->TimeUntil(now) : 0;
+  if (entry.destination && wait != kForever) {
+    int destination_wait = entry.destination->TimeUntil(now);
+    wait = (destination_wait == kForever) ? kForever
+                                          : _max(wait, destination_wait);
+  }
+  return wait;
+}
+
+bool XmppShaper::Admit(const XmlElement* stanza, uint32 now) {
+  Entry entry;
+  entry.stanza = NULL;
+  entry.destination = DestinationOf(stanza);
+  // Stanzas already waiting go first.
+  if (queued_ == 0 && TimeUntil(entry, now) == 0) {
+    if (global_.get())
+      global_->Take(now);
+    if (entry.destination)
+      entry.destination->Take(now);
+    return true;
+  }
+  entry.stanza = new XmlElement(*stanza);
+  queues_[PriorityOf(stanza)].push_back(entry);
+  ++queued_;
+  return false;
+}
+
+XmlElement* XmppShaper::Next(uint32 now) {
+  if (queued_ == 0 || (global_.get() && global_->TimeUntil(now) != 0))
+    return NULL;
+  for (int priority = 0; priority < PRIORITY_COUNT; ++priority) {
+    std::deque<Entry>& queue = queues_[priority];
+    size_t scan = _min(queue.size(), static_cast<size_t>(kMaxScan));
+    for (size_t i = 0; i < scan; ++i) {
+      if (queue[i].destination && queue[i].destination->TimeUntil(now) != 0)
+        continue;
+      XmlElement* stanza = queue[i].stanza;
+      if (global_.get())
+        global_->Take(now);
+      if (queue[i].destination)
+        queue[i].destination->Take(now);
+      queue.erase(queue.begin() + i);
+      --queued_;
+      return stanza;
+    }
+  }
+  return NULL;
+}
+
+XmlElement* XmppShaper::Pop() {
+  for (int priority = 0; priority < PRIORITY_COUNT; ++priority) {
+    std::deque<Entry>& queue = queues_[priority];
+    if (!queue.empty()) {
+      XmlElement* stanza = queue.front().stanza;
+      queue.pop_front();
+      --queued_;
+      return stanza;
+    }
+  }
+  return NULL;
+}
+
+int XmppShaper::TimeUntilNext(uint32 now) const {
+  int wait = kForever;
+  for (int priority = 0; priority < PRIORITY_COUNT; ++priority) {
+    const std::deque<Entry>& queue = queues_[priority];
+    size_t scan = _min(queue.size(), static_cast<size_t>(kMaxScan));
+    for (size_t i = 0; i < scan; ++i) {
+      int entry_wait = TimeUntil(queue[i], now);
+      if (entry_wait != kForever && (wait == kForever || entry_wait < wait))
+        wait = entry_wait;
+    }
+  }
+  return wait;
+}
+
+void XmppShaper::Clear() {
+  for (int priority = 0; priority < PRIORITY_COUNT; ++priority) {
+    std::deque<Entry>& queue = queues_[priority];
+    for (size_t i = 0; i < queue.size(); ++i)
+      delete queue[i].stanza;
+    queue.clear();
+  }
+  queued_ = 0;
+}
+
+}  // namespace txmpp
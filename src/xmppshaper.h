@@ -0,0 +1,111 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMPPSHAPER_H_
+#define _TXMPP_XMPPSHAPER_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <deque>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "ratelimitmanager.h"
+#include "scoped_ptr.h"
+#include "xmppengine.h"
+
+namespace txmpp {
+
+class XmlElement;
+
+// The outbound traffic shaping of an XmppEngineImpl: the token bucket all
+// stanzas share, one per destination JID from a RateLimitManager, and the
+// queues, by priority, of the stanzas waiting for them. The engine hands
+// in the stanzas it sends and writes those that come out; this only keeps
+// the queues and the buckets.
+class XmppShaper {
+ public:
+  enum Priority {
+    PRIORITY_HIGH,    // iq results and errors
+    PRIORITY_NORMAL,  // messages and the other iqs
+    PRIORITY_LOW,     // presence
+    PRIORITY_COUNT
+  };
+
+  explicit XmppShaper(const XmppShaping& shaping);
+  ~XmppShaper();
+
+  static Priority PriorityOf(const XmlElement* stanza);
+
+  // Returns true if |stanza| may be sent at |now|, taking its tokens.
+  // Otherwise keeps a copy, for Next, and returns false.
+  bool Admit(const XmlElement* stanza, uint32 now);
+  // Returns the first waiting stanza, in priority order, that may be sent
+  // at |now|, taking its tokens, or NULL.  The caller owns it.
+  XmlElement* Next(uint32 now);
+  // Returns the first waiting stanza in priority order, tokens or not, or
+  // NULL.  The caller owns it.
+  XmlElement* Pop();
+  // The milliseconds from |now| until Next may return a stanza, or
+  // kForever if none is waiting.
+  int TimeUntilNext(uint32 now) const;
+
+  size_t queued() const { return queued_; }
+  size_t queued(Priority priority) const {
+    return queues_[priority].size();
+  }
+  // Drops the waiting stanzas.
+  void Clear();
+
+ private:
+  struct Entry {
+    XmlElement* stanza;
+    TokenBucket* destination;  // NULL without per-JID shaping.
+  };
+
+  // Each queue is looked through this far for a stanza whose destination
+  // has a token, so that one busy JID does not hold up the others.
+  enum { kMaxScan = 64 };
+
+  TokenBucket* DestinationOf(const XmlElement* stanza);
+  // The milliseconds from |now| until |entry| has its tokens.
+  int TimeUntil(const Entry& entry, uint32 now) const;
+
+  XmppShaping shaping_;
+  scoped_ptr<TokenBucket> global_;
+  RateLimitManager destinations_;
+  std::deque<Entry> queues_[PRIORITY_COUNT];
+  size_t queued_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(XmppShaper);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMPPSHAPER_H_
@@ -0,0 +1,230 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmppstanzadispatch.h"
+
+#include <algorithm>
+
+#include "constants.h"
+#include "xmlconstants.h"
+#include "xmlelement.h"
+#include "xmppstanzaparser.h"
+
+namespace txmpp {
+
+namespace {
+
+// Continues the FNV-1a hash |hash| over |s| and a terminating zero.
+uint32 HashOn(uint32 hash, const std::string& s) {
+  for (size_t i = 0; i < s.size(); ++i) {
+    hash ^= static_cast<unsigned char>(s[i]);
+    hash *= 16777619U;
+  }
+  return hash * 16777619U;
+}
+
+void AddKey(uint32 key, std::vector<uint32>* keys) {
+  if (std::find(keys->begin(), keys->end(), key) == keys->end())
+    keys->push_back(key);
+}
+
+}  // namespace
+
+XmppStanzaDispatch::XmppStanzaDispatch()
+    : has_removed_(false),
+      dispatching_(0),
+      next_seq_(0) {
+}
+
+XmppStanzaDispatch::~XmppStanzaDispatch() {
+  for (size_t i = 0; i < all_.size(); ++i)
+    delete all_[i];
+}
+
+void XmppStanzaDispatch::Add(XmppStanzaHandler* handler) {
+  Entry* entry = new Entry;
+  entry->handler = handler;
+  entry->seq = next_seq_++;
+  entry->has_match = handler->GetStanzaMatch(&entry->match) &&
+                     entry->match.name != QN_EMPTY;
+  all_.push_back(entry);
+  if (entry->has_match) {
+    indexed_[Key(entry->match.name, entry->match.type,
+                 entry->match.child_ns)].push_back(entry);
+  } else {
+    generic_.push_back(entry);
+  }
+}
+
+bool XmppStanzaDispatch::Remove(XmppStanzaHandler* handler) {
+  bool found = false;
+  for (size_t i = 0; i < all_.size(); ++i) {
+    if (all_[i]->handler == handler) {
+      all_[i]->handler = NULL;
+      found = true;
+    }
+  }
+  if (found) {
+    has_removed_ = true;
+    if (dispatching_ == 0)
+      Purge();
+  }
+  return found;
+}
+
+bool XmppStanzaDispatch::Dispatch(const XmlElement* stanza,
+                                  bool until_handled) {
+  bool handled = false;
+  ++dispatching_;
+
+  if (indexed_.empty()) {
+    // Nothing to look up, so just go through the handlers as they are.
+    for (size_t i = 0; i < generic_.size(); ++i) {
+      XmppStanzaHandler* handler = generic_[i]->handler;
+      if (handler != NULL && handler->HandleStanza(stanza)) {
+        handled = true;
+        if (until_handled)
+          break;
+      }
+    }
+  } else {
+    const QName& name = stanza->Name();
+    const std::string& type = stanza->Attr(QN_TYPE);
+    std::vector<uint32> keys;
+    AddKey(Key(name, type, STR_EMPTY), &keys);
+    AddKey(Key(name, STR_EMPTY, STR_EMPTY), &keys);
+    for (const XmlElement* child = stanza->FirstElement(); child != NULL;
+         child = child->NextElement()) {
+      AddKey(Key(name, type, child->Name().Namespace()), &keys);
+      AddKey(Key(name, STR_EMPTY, child->Name().Namespace()), &keys);
+    }
+
+    EntryList candidates(generic_);
+    for (size_t i = 0; i < keys.size(); ++i)
+      Collect(keys[i], &candidates);
+    std::sort(candidates.begin(), candidates.end(), SeqLess);
+    candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                     candidates.end());
+
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      const Entry* entry = candidates[i];
+      // The hashes may collide, so the match is checked in full.
+      if (entry->handler == NULL ||
+          (entry->has_match && !Matches(entry->match, stanza)))
+        continue;
+      if (entry->handler->HandleStanza(stanza)) {
+        handled = true;
+        if (until_handled)
+          break;
+      }
+    }
+  }
+
+  if (--dispatching_ == 0 && has_removed_)
+    Purge();
+  return handled;
+}
+
+bool XmppStanzaDispatch::Wants(const XmppStanzaStart& start) {
+  const char* type = NULL;
+  bool type_read = false;
+  for (size_t i = 0; i < all_.size(); ++i) {
+    const Entry* entry = all_[i];
+    if (entry->handler == NULL)
+      continue;
+    if (entry->has_match) {
+      if (entry->match.name != start.Name())
+        continue;
+      if (!entry->match.type.empty()) {
+        if (!type_read) {
+          type = start.Attr(QN_TYPE);
+          type_read = true;
+        }
+        if (type == NULL || entry->match.type != type)
+          continue;
+      }
+    }
+    if (entry->handler->WantsStanza(start))
+      return true;
+  }
+  return false;
+}
+
+uint32 XmppStanzaDispatch::Key(const QName& name, const std::string& type,
+                               const std::string& child_ns) {
+  uint32 hash = QName::HashNamespace(name.Namespace()) * 16777619U;
+  hash = HashOn(hash, name.LocalPart());
+  hash = HashOn(hash, type);
+  return HashOn(hash, child_ns);
+}
+
+bool XmppStanzaDispatch::Matches(const XmppStanzaMatch& match,
+                                 const XmlElement* stanza) {
+  if (match.name != stanza->Name())
+    return false;
+  if (!match.type.empty() && match.type != stanza->Attr(QN_TYPE))
+    return false;
+  if (match.child_ns.empty())
+    return true;
+  for (const XmlElement* child = stanza->FirstElement(); child != NULL;
+       child = child->NextElement()) {
+    if (child->Name().Namespace() == match.child_ns)
+      return true;
+  }
+  return false;
+}
+
+void XmppStanzaDispatch::Collect(uint32 key, EntryList* list) const {
+  EntryMap::const_iterator it = indexed_.find(key);
+  if (it != indexed_.end())
+    list->insert(list->end(), it->second.begin(), it->second.end());
+}
+
+void XmppStanzaDispatch::Purge() {
+  has_removed_ = false;
+  generic_.erase(std::remove_if(generic_.begin(), generic_.end(), IsRemoved),
+                 generic_.end());
+  for (EntryMap::iterator it = indexed_.begin(); it != indexed_.end();) {
+    EntryList& list = it->second;
+    list.erase(std::remove_if(list.begin(), list.end(), IsRemoved),
+               list.end());
+    if (list.empty())
+      indexed_.erase(it++);
+    else
+      ++it;
+  }
+  EntryList::iterator kept = all_.begin();
+  for (EntryList::iterator it = all_.begin(); it != all_.end(); ++it) {
+    if (IsRemoved(*it))
+      delete *it;
+    else
+      *kept++ = *it;
+  }
+  all_.erase(kept, all_.end());
+}
+
+}  // namespace txmpp
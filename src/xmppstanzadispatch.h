@@ -0,0 +1,106 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMPPSTANZADISPATCH_H_
+#define _TXMPP_XMPPSTANZADISPATCH_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <map>
+#include <vector>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "xmppengine.h"
+
+namespace txmpp {
+
+class XmlElement;
+class XmppStanzaStart;
+
+// The stanza handlers added at one level of an XmppEngine. Handlers that
+// give an XmppStanzaMatch are indexed by a hash of it, so that a stanza is
+// only offered to those whose match it may fit and to the handlers without
+// one, still in the order they were added.
+//
+// Handlers may be added and removed while a stanza is being dispatched. A
+// removed handler is not called again, and one added is offered the next
+// stanza on.
+class XmppStanzaDispatch {
+ public:
+  XmppStanzaDispatch();
+  ~XmppStanzaDispatch();
+
+  void Add(XmppStanzaHandler* handler);
+  // Removes every time |handler| was added. Returns false if it never was.
+  bool Remove(XmppStanzaHandler* handler);
+
+  // Offers |stanza| to the handlers whose match it fits. Stops at the first
+  // that handles it if |until_handled|, and returns whether any did.
+  bool Dispatch(const XmlElement* stanza, bool until_handled);
+
+  // Whether a handler whose match the start tag may fit wants the stanza.
+  bool Wants(const XmppStanzaStart& start);
+
+ private:
+  struct Entry {
+    XmppStanzaHandler* handler;  // NULL once removed
+    uint32 seq;
+    bool has_match;
+    XmppStanzaMatch match;
+  };
+  typedef std::vector<Entry*> EntryList;
+  typedef std::map<uint32, EntryList> EntryMap;
+
+  static uint32 Key(const QName& name, const std::string& type,
+                    const std::string& child_ns);
+  static bool Matches(const XmppStanzaMatch& match, const XmlElement* stanza);
+  static bool SeqLess(const Entry* a, const Entry* b) {
+    return a->seq < b->seq;
+  }
+  static bool IsRemoved(const Entry* entry) { return entry->handler == NULL; }
+
+  // Appends the entries indexed under |key| to |list|.
+  void Collect(uint32 key, EntryList* list) const;
+  // Frees the removed entries, once no dispatch is under way.
+  void Purge();
+
+  EntryList all_;      // in the order added
+  EntryList generic_;  // the entries without a match, in order
+  EntryMap indexed_;   // the others, in order under each key
+  bool has_removed_;
+  int dispatching_;
+  uint32 next_seq_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(XmppStanzaDispatch);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMPPSTANZADISPATCH_H_
@@ -27,9 +27,13 @@
 
 #include "xmppstanzaparser.h"
 
+#include <string.h>
+
 #include "xmlelement.h"
 #include "common.h"
 #include "constants.h"
+#include "xmlconstants.h"
+#include "xmlprinter.h"
 #include <expat.h>
 
 namespace txmpp {
@@ -39,14 +43,160 @@ XmppStanzaParser::XmppStanzaParser(XmppStanzaParseHandler *psph) :
   innerHandler_(this),
   parser_(&innerHandler_),
   depth_(0),
-  builder_() {
+  binary_(false),
+  skipping_(false),
+  stream_text_(false),
+  streaming_(false),
+  arena_(new XmlArena),
+  builder_(arena_),
+  dispatching_(NULL),
+  taken_(false),
+  keep_raw_(false),
+  raw_base_(0),
+  raw_stanza_(NULL),
+  raw_len_(0),
+  input_buffer_(NULL),
+  lazy_children_(false),
+  deferring_(false),
+  offloading_(false),
+  lazy_start_(0),
+  stream_xmlns_(0),
+  stanza_xmlns_(0),
+  offload_size_(0),
+  stanza_start_(0) {
+}
+
+XmppStanzaParser::~XmppStanzaParser() {
+  // The tree goes before its arena.
+  builder_.Reset();
+  delete arena_;
+}
+
+bool
+XmppStanzaParser::Parse(const char * data, size_t len, bool isFinal) {
+  if (binary_)
+    return binary_input_->reader.Parse(data, len);
+  if (KeepsInput())
+    raw_.append(data, len);
+  return parser_.Parse(data, len, isFinal);
+}
+
+char *
+XmppStanzaParser::GetBuffer(size_t len) {
+  if (binary_) {
+    std::vector<char> & buffer = binary_input_->buffer;
+    buffer.resize(_max(len, static_cast<size_t>(1)));
+    input_buffer_ = &buffer[0];
+    return input_buffer_;
+  }
+  input_buffer_ = parser_.GetBuffer(len);
+  return input_buffer_;
+}
+
+bool
+XmppStanzaParser::ParseBuffer(size_t len, bool isFinal) {
+  if (KeepsInput() && input_buffer_)
+    raw_.append(input_buffer_, len);
+  input_buffer_ = NULL;
+  if (binary_)
+    return binary_input_->reader.Parse(&binary_input_->buffer[0], len);
+  return parser_.ParseBuffer(len, isFinal);
 }
 
 void
 XmppStanzaParser::Reset() {
   parser_.Reset();
+  if (binary_input_.get())
+    binary_input_->reader.Reset();
   depth_ = 0;
+  skipping_ = false;
+  streaming_ = false;
+  // Destroys any half built stanza before its arena goes, but a taken one
+  // belongs to its taker.
+  if (taken_)
+    DetachArena();
+  dispatching_ = NULL;
   builder_.Reset();
+  arena_->Reset();
+  raw_.clear();
+  raw_base_ = 0;
+  input_buffer_ = NULL;
+  deferring_ = false;
+  offloading_ = false;
+  xmlns_.clear();
+}
+
+void
+XmppStanzaParser::SetKeepRaw(bool keep_raw) {
+  keep_raw_ = keep_raw;
+  if (!KeepsInput())
+    std::string().swap(raw_);
+}
+
+void
+XmppStanzaParser::SetOffloadSize(size_t size) {
+  offload_size_ = size;
+  if (!KeepsInput())
+    std::string().swap(raw_);
+}
+
+void
+XmppStanzaParser::SetBinary(bool binary) {
+  binary_ = binary;
+  if (binary_ && !binary_input_.get())
+    binary_input_.reset(new BinaryInput(&innerHandler_));
+  if (!KeepsInput())
+    std::string().swap(raw_);
+}
+
+void
+XmppStanzaParser::SetNamespaceAlias(const std::string & ns,
+                                    const std::string & alias) {
+  alias_ns_ = ns;
+  alias_ = alias;
+  parser_.SetNamespaceAlias(ns, alias);
+}
+
+void
+XmppStanzaParser::SetLazyChildren(bool lazy_children) {
+  lazy_children_ = lazy_children;
+  if (!KeepsInput())
+    std::string().swap(raw_);
+}
+
+bool
+XmppStanzaParser::RawStanza(const XmlElement * pelStanza,
+                            const char ** data, size_t * len) const {
+  if (!keep_raw_ || pelStanza == NULL || pelStanza != raw_stanza_)
+    return false;
+  *data = raw_.data();
+  *len = raw_len_;
+  return true;
+}
+
+XmlElement *
+XmppStanzaParser::TakeStanza(const XmlElement * pelStanza, XmlArena ** arena) {
+  if (pelStanza == NULL || pelStanza != dispatching_ || taken_)
+    return NULL;
+  taken_ = true;
+  *arena = arena_;
+  return const_cast<XmlElement *>(pelStanza);
+}
+
+void
+XmppStanzaParser::DetachArena() {
+  taken_ = false;
+  arena_ = new XmlArena;
+  builder_.ReleaseElement(arena_);
+}
+
+void
+XmppStanzaParser::DropRawBefore(unsigned long end) {
+  if (!KeepsInput())
+    return;
+  size_t count = _min(static_cast<size_t>(end - raw_base_), raw_.size());
+  raw_.erase(0, count);
+  raw_base_ += count;
 }
 
 void
@@ -60,17 +210,59 @@ XmppStanzaParser::IncomingStartElement(
     }
     psph_->StartStream(pelStream);
     delete pelStream;
+    if (KeepsInput()) {
+      unsigned long index;
+      pctx->GetPosition(NULL, NULL, &index);
+      DropRawBefore(index + pctx->GetByteCount());
+    }
+    if (LazyChildren() || KeepsInput()) {
+      xmlns_.clear();
+      AddXmlns(atts);
+      stream_xmlns_ = xmlns_.size();
+    }
     return;
   }
 
-  builder_.StartElement(pctx, name, atts);
+  if (depth_ == 2) {
+    skipping_ = !psph_->WantStanza(XmppStanzaStart(pctx, name, atts));
+    if (KeepsInput()) {
+      pctx->GetPosition(NULL, NULL, &stanza_start_);
+      DropRawBefore(stanza_start_);
+    }
+    if (LazyChildren()) {
+      xmlns_.resize(stream_xmlns_);
+      AddXmlns(atts);
+      stanza_xmlns_ = xmlns_.size() - stream_xmlns_;
+    }
+  } else if (depth_ == 3 && stream_text_ && !skipping_) {
+    streaming_ = psph_->WantText(XmppStanzaStart(pctx, name, atts));
+  }
+  if (depth_ > 2 && LazyChildren() && !skipping_) {
+    if (depth_ == 3) {
+      xmlns_.resize(stream_xmlns_ + stanza_xmlns_);
+      AddXmlns(atts);
+    } else if (!deferring_) {
+      deferring_ = true;
+      pctx->GetPosition(NULL, NULL, &lazy_start_);
+    }
+  }
+
+  CheckOffload(pctx);
+  if (!skipping_ && !deferring_ && !offloading_)
+    builder_.StartElement(pctx, name, atts);
 }
 
 void
 XmppStanzaParser::IncomingCharacterData(
     XmlParseContext * pctx, const char * text, int len) {
-  if (depth_ > 1) {
-    builder_.CharacterData(pctx, text, len);
+  if (streaming_ && depth_ == 3) {
+    psph_->StanzaText(text, len);
+    return;
+  }
+  if (depth_ > 1 && !skipping_) {
+    CheckOffload(pctx);
+    if (!deferring_ && !offloading_)
+      builder_.CharacterData(pctx, text, len);
   }
 }
 
@@ -82,13 +274,211 @@ XmppStanzaParser::IncomingEndElement(
     return;
   }
 
+  if (streaming_ && depth_ == 2) {
+    streaming_ = false;
+    psph_->EndText();
+  }
+
+  if (deferring_) {
+    if (depth_ > 2)
+      return;
+    // The end of the child: its end tag starts where the deferred input
+    // stops.
+    unsigned long index;
+    pctx->GetPosition(NULL, NULL, &index);
+    DeferChildren(index);
+    deferring_ = false;
+  }
+
+  unsigned long end = 0;
+  if (KeepsInput() && depth_ == 1) {
+    pctx->GetPosition(NULL, NULL, &end);
+    end += pctx->GetByteCount();
+  }
+
+  if (skipping_) {
+    if (depth_ == 1) {
+      skipping_ = false;
+      DropRawBefore(end);
+    }
+    return;
+  }
+
+  // A stanza built to its end is kept.
+  if (depth_ > 1)
+    CheckOffload(pctx);
+  if (offloading_) {
+    if (depth_ == 1) {
+      offloading_ = false;
+      OffloadStanza(end);
+      DropRawBefore(end);
+    }
+    return;
+  }
+
   builder_.EndElement(pctx, name);
 
   if (depth_ == 1) {
-    XmlElement *element = builder_.CreateElement();
-    psph_->Stanza(element);
-    delete element;
+    const XmlElement * stanza = builder_.BuiltElement();
+    if (keep_raw_ && !binary_) {
+      raw_stanza_ = stanza;
+      raw_len_ = _min(static_cast<size_t>(end - raw_base_), raw_.size());
+    }
+    dispatching_ = stanza;
+    psph_->Stanza(stanza);
+    dispatching_ = NULL;
+    raw_stanza_ = NULL;
+    raw_len_ = 0;
+    if (taken_)
+      DetachArena();
+    builder_.Reset();
+    arena_->Reset();
+    DropRawBefore(end);
+  }
+}
+
+size_t
+XmppStanzaParser::Trim() {
+  if (depth_ > 1)
+    return 0;
+  size_t freed = arena_->Trim();
+  if (raw_.empty() && raw_.capacity() > std::string().capacity()) {
+    freed += raw_.capacity();
+    std::string().swap(raw_);
+  }
+  if (binary_input_.get() && !binary_input_->buffer.empty() &&
+      !input_buffer_) {
+    freed += binary_input_->buffer.capacity();
+    std::vector<char>().swap(binary_input_->buffer);
+  }
+  return freed;
+}
+
+size_t
+XmppStanzaParser::BufferSize() const {
+  size_t size = arena_->ChunkBytes() + raw_.capacity();
+  if (binary_input_.get())
+    size += binary_input_->buffer.capacity();
+  return size;
+}
+
+void
+XmppStanzaParser::AddXmlns(const char ** atts) {
+  for (; *atts; atts += 2) {
+    const char * att = *atts;
+    if (strncmp(att, "xmlns", 5) != 0 || (att[5] != '\0' && att[5] != ':'))
+      continue;
+    xmlns_.push_back(att[5] ? std::string(att + 6) : STR_EMPTY);
+    xmlns_.push_back(!alias_ns_.empty() && alias_ns_ == atts[1] ?
+                     alias_ : std::string(atts[1]));
+  }
+}
+
+void
+XmppStanzaParser::DeferChildren(unsigned long end) {
+  XmlElement * element = builder_.CurrentElement();
+  size_t begin = static_cast<size_t>(lazy_start_ - raw_base_);
+  size_t count = static_cast<size_t>(end - lazy_start_);
+  if (element == NULL || begin + count > raw_.size())
+    return;
+
+  // Wraps the children in an element declaring the namespaces in scope.
+  std::string xml;
+  AppendWrapperStart("lazy", xmlns_.size(), &xml);
+  xml.append(raw_, begin, count);
+  xml.append("</lazy>");
+
+  char * copy = static_cast<char *>(arena_->Allocate(xml.size()));
+  memcpy(copy, xml.data(), xml.size());
+  element->SetLazyChildren(copy, xml.size());
+}
+
+void
+XmppStanzaParser::AppendWrapperStart(const char * name, size_t xmlns_count,
+                                     std::string * xml) const {
+  xml->push_back('<');
+  xml->append(name);
+  for (size_t i = 0; i < xmlns_count; i += 2) {
+    size_t j;
+    for (j = i + 2; j < xmlns_count; j += 2) {
+      if (xmlns_[j] == xmlns_[i])
+        break;
+    }
+    if (j < xmlns_count)
+      continue;
+    if (xmlns_[i].empty()) {
+      xml->append(" xmlns=\"");
+    } else {
+      xml->append(" xmlns:");
+      xml->append(xmlns_[i]);
+      xml->append("=\"");
+    }
+    XmlPrinter::PrintQuotedValue(xml, xmlns_[i + 1]);
+    xml->push_back('"');
+  }
+  xml->push_back('>');
+}
+
+void
+XmppStanzaParser::CheckOffload(XmlParseContext * pctx) {
+  if (offload_size_ == 0 || offloading_ || skipping_ || !KeepsInput() ||
+      depth_ < 2)
+    return;
+  unsigned long index;
+  pctx->GetPosition(NULL, NULL, &index);
+  if (index - stanza_start_ < offload_size_)
+    return;
+
+  // What was built so far is dropped; the whole stanza is in raw_.
+  offloading_ = true;
+  deferring_ = false;
+  builder_.Reset();
+  arena_->Reset();
+}
+
+void
+XmppStanzaParser::OffloadStanza(unsigned long end) {
+  size_t begin = static_cast<size_t>(stanza_start_ - raw_base_);
+  size_t count = static_cast<size_t>(end - stanza_start_);
+  if (begin + count > raw_.size())
+    return;
+
+  std::string xml;
+  AppendWrapperStart("stanza", stream_xmlns_, &xml);
+  xml.append(raw_, begin, count);
+  xml.append("</stanza>");
+  psph_->LargeStanza(&xml);
+}
+
+void
+XmppStanzaParseHandler::LargeStanza(std::string * xml) {
+  scoped_ptr<XmlElement> wrapper(XmlElement::ForStr(*xml));
+  const XmlElement * stanza = wrapper.get() ? wrapper->FirstElement() : NULL;
+  if (stanza)
+    Stanza(stanza);
+  else
+    XmlError();
+}
+
+XmppStanzaStart::XmppStanzaStart(XmlParseContext * pctx, const char * name,
+                                 const char ** atts) :
+  pctx_(pctx),
+  name_(pctx->ResolveQName(name, false)),
+  atts_(atts) {
+}
+
+const char *
+XmppStanzaStart::Attr(const QName & name) const {
+  // Compares unprefixed attribute names as they are, so that looking up
+  // the usual stanza attributes needs no QName.
+  bool local = name.Namespace().empty();
+  for (const char ** att = atts_; *att; att += 2) {
+    bool prefixed = strchr(*att, ':') != NULL;
+    if (local ? (!prefixed && name.LocalPart() == *att)
+              : (prefixed && pctx_->ResolveQName(*att, true) == name))
+      return att[1];
   }
+  return NULL;
 }
 
 void
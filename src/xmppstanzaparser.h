@@ -32,6 +32,11 @@
 #include "config.h"
 #endif
 
+#include <string>
+#include <vector>
+#include "binaryxml.h"
+#include "scoped_ptr.h"
+#include "xmlarena.h"
 #include "xmlbuilder.h"
 #include "xmlparser.h"
 
@@ -39,11 +44,47 @@ namespace txmpp {
 
 class XmlElement;
 
+// The start tag of a stanza, as seen before the stanza is built.
+class XmppStanzaStart {
+public:
+  XmppStanzaStart(XmlParseContext * pctx, const char * name,
+                  const char ** atts);
+
+  // QN_EMPTY if the name can't be resolved.
+  const QName & Name() const { return name_; }
+  // Returns the value of the attribute, or NULL if the tag doesn't have it.
+  const char * Attr(const QName & name) const;
+
+private:
+  XmlParseContext * pctx_;
+  QName name_;
+  const char ** atts_;
+};
+
 class XmppStanzaParseHandler {
 public:
   virtual ~XmppStanzaParseHandler() {}
   virtual void StartStream(const XmlElement * pelStream) = 0;
+  // Called at the start tag of each stanza. If it returns false, the rest
+  // of the stanza is parsed without being built, and Stanza isn't called.
+  virtual bool WantStanza(const XmppStanzaStart & start) { return true; }
+  // With SetTextStreaming, called at the start tag of each child of a
+  // stanza that isn't skipped. If it returns true, the child's character
+  // data is passed to StanzaText as it comes, instead of being built, and
+  // EndText is called at its end tag.
+  virtual bool WantText(const XmppStanzaStart & start) { return false; }
+  virtual void StanzaText(const char * text, size_t len) {}
+  virtual void EndText() {}
+  // |pelStanza| only lives until Stanza returns, and its nodes may be in an
+  // arena; copy it with new XmlElement(*pelStanza) to keep it, or take it
+  // with XmppStanzaParser::TakeStanza.
   virtual void Stanza(const XmlElement * pelStanza) = 0;
+  // Called instead of Stanza for a stanza that grew past the parser's
+  // offload size, which was not built: |xml| is its text, as the only child
+  // of an element declaring the stream's namespaces, for the handler to
+  // build where it likes, such as on another thread. The handler may swap
+  // the text out. By default it is built here and passed to Stanza.
+  virtual void LargeStanza(std::string * xml);
   virtual void EndStream() = 0;
   virtual void XmlError() = 0;
 };
@@ -51,10 +92,69 @@ public:
 class XmppStanzaParser {
 public:
   XmppStanzaParser(XmppStanzaParseHandler *psph);
-  bool Parse(const char * data, size_t len, bool isFinal)
-    { return parser_.Parse(data, len, isFinal); }
+  ~XmppStanzaParser();
+  bool Parse(const char * data, size_t len, bool isFinal);
+  char * GetBuffer(size_t len);
+  bool ParseBuffer(size_t len, bool isFinal);
+  // Starts over on a new stream, as after STARTTLS or SASL. The Expat
+  // parser, the arena's chunk and the buffers are kept for the new stream.
   void Reset();
 
+  // Frees what is kept for the next stanza, as for a connection gone idle,
+  // if no stanza is part way in. Returns the bytes freed. The Expat parser
+  // keeps its buffer, which it has no way to give back.
+  size_t Trim();
+  // The bytes held for input and the stanza being built, most of which
+  // Trim frees, besides Expat's buffer.
+  size_t BufferSize() const;
+
+  // Keeps the input bytes of each stanza while it is passed to Stanza, for
+  // RawStanza. Off by default, as it costs a copy of the input.
+  void SetKeepRaw(bool keep_raw);
+  // If |pelStanza| is the stanza being passed to Stanza and its bytes are
+  // kept, points |data| and |len| at them and returns true. The bytes are
+  // as received, so any prefixes in them are those of the stream header.
+  bool RawStanza(const XmlElement * pelStanza,
+                 const char ** data, size_t * len) const;
+
+  // If |pelStanza| is the stanza being passed to Stanza and nobody took it
+  // yet, hands it over without a copy: the caller gets the stanza and the
+  // arena it is in, to delete in that order once done. It still lives
+  // until Stanza returns for the handlers after the taker. Returns NULL
+  // otherwise, when a copy is the way to keep it.
+  XmlElement * TakeStanza(const XmlElement * pelStanza, XmlArena ** arena);
+
+  // Builds only each stanza and its children. What is under the children
+  // is kept as text and parsed when first looked at, which saves building
+  // large payloads that nobody reads.
+  void SetLazyChildren(bool lazy_children);
+
+  // Drops the whitespace between the elements of each stanza, as
+  // XmlBuilder::SetStripWhitespace. Children left for later by
+  // SetLazyChildren keep theirs.
+  void SetStripWhitespace(bool strip) { builder_.SetStripWhitespace(strip); }
+  bool StripWhitespace() const { return builder_.StripWhitespace(); }
+
+  // Stops building a stanza once |size| bytes of it have come in, and
+  // passes its text to LargeStanza at its end instead, so that the handler
+  // can build it off the input's thread. 0, the default, builds them all.
+  // The input is kept while it is set, as for SetKeepRaw; raw stanzas are
+  // not kept for the large ones. Set it before the stream starts, whose
+  // namespaces the text is given.
+  void SetOffloadSize(size_t size);
+
+  // Reads the binary XML encoding instead of XML, from the next Reset on,
+  // as the stream starts over once the encoding is agreed. Raw stanzas and
+  // lazy children are XML only, and are off while it is set.
+  void SetBinary(bool binary);
+
+  // Offers the children of each stanza to WantText, for their character
+  // data to be streamed to the handler. Off by default.
+  void SetTextStreaming(bool stream_text) { stream_text_ = stream_text; }
+
+  // Reads the namespace |ns| as |alias|, as XmlParser::SetNamespaceAlias.
+  void SetNamespaceAlias(const std::string & ns, const std::string & alias);
+
 private:
   class ParseHandler : public XmlParseHandler {
   public:
@@ -85,12 +185,86 @@ private:
                const char * text, int len);
   void IncomingError(XmlParseContext * pctx,
                XML_Error errCode);
+  // Drops the kept input before the stream byte index |end|.
+  void DropRawBefore(unsigned long end);
+  bool KeepsInput() const {
+    return !binary_ && (keep_raw_ || lazy_children_ || offload_size_ != 0);
+  }
+  bool LazyChildren() const { return lazy_children_ && !binary_; }
+  // Keeps the namespaces declared in |atts|, for the lazy children.
+  void AddXmlns(const char ** atts);
+  // Hands the input since lazy_start_ to the element being built, up to the
+  // stream byte index |end|.
+  void DeferChildren(unsigned long end);
+  // Appends the start tag of an element |name| declaring the first
+  // |xmlns_count| strings of xmlns_, the last declaration of each prefix
+  // winning.
+  void AppendWrapperStart(const char * name, size_t xmlns_count,
+                          std::string * xml) const;
+  // Stops building the stanza if it has grown past offload_size_.
+  void CheckOffload(XmlParseContext * pctx);
+  // Passes the stanza being offloaded to LargeStanza, up to the stream
+  // byte index |end|.
+  void OffloadStanza(unsigned long end);
+  // Leaves the taken stanza and its arena to the taker, and builds in a
+  // new arena from then on.
+  void DetachArena();
 
   XmppStanzaParseHandler * psph_;
   ParseHandler innerHandler_;
   XmlParser parser_;
+  // Reads the stream instead of parser_ while binary_ is set, from its
+  // buffer for GetBuffer. Made by the first SetBinary, as most streams
+  // never use it.
+  struct BinaryInput {
+    explicit BinaryInput(XmlParseHandler * handler) : reader(handler) {}
+    BinaryXmlReader reader;
+    std::vector<char> buffer;
+  };
+  scoped_ptr<BinaryInput> binary_input_;
   int depth_;
+  bool binary_;
+  // Set while the current stanza is being skipped.
+  bool skipping_;
+  // With stream_text_, streaming_ is set within a child of the stanza whose
+  // character data goes to StanzaText.
+  bool stream_text_;
+  bool streaming_;
+  // Holds the stanza being built, and is reset after each one, unless the
+  // stanza was taken with it. dispatching_ is the stanza being passed to
+  // Stanza, and taken_ is set once TakeStanza has given it away.
+  XmlArena * arena_;
   XmlBuilder builder_;
+  const XmlElement * dispatching_;
+  bool taken_;
+  // The input from the stream byte index raw_base_ on, while keep_raw_ is
+  // set, and the stanza whose first raw_len_ bytes it starts with while
+  // the stanza is passed to Stanza.
+  bool keep_raw_;
+  std::string raw_;
+  unsigned long raw_base_;
+  const XmlElement * raw_stanza_;
+  size_t raw_len_;
+  char * input_buffer_;
+  // With lazy_children_, deferring_ is set from the first element under a
+  // child of the stanza, at stream byte index lazy_start_, until the end of
+  // the child. xmlns_ holds the namespace declarations in scope there, as
+  // prefix and namespace pairs; the first stream_xmlns_ are the stream's
+  // and the next stanza_xmlns_ the stanza's.
+  bool lazy_children_;
+  bool deferring_;
+  bool offloading_;
+  unsigned long lazy_start_;
+  std::vector<std::string> xmlns_;
+  size_t stream_xmlns_;
+  size_t stanza_xmlns_;
+  // With offload_size_, the stream byte index the stanza starts at.
+  // offloading_, above, is set once it is past the size and not being built.
+  size_t offload_size_;
+  unsigned long stanza_start_;
+  // The namespace read as alias_, if not empty.
+  std::string alias_ns_;
+  std::string alias_;
 
  };
 
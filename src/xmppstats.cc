@@ -0,0 +1,82 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmppstats.h"
+
+#include <string.h>
+
+#include "constants.h"
+#include "qname.h"
+
+namespace txmpp {
+
+XmppStanzaKind XmppStanzaKindOf(const QName& name) {
+  if (name == QN_MESSAGE)
+    return XMPP_STANZA_MESSAGE;
+  if (name == QN_PRESENCE)
+    return XMPP_STANZA_PRESENCE;
+  if (name == QN_IQ)
+    return XMPP_STANZA_IQ;
+  return XMPP_STANZA_OTHER;
+}
+
+XmppStanzaKind XmppStanzaKindOf(const char* name, size_t len) {
+  if (len == 7 && memcmp(name, "message", 7) == 0)
+    return XMPP_STANZA_MESSAGE;
+  if (len == 8 && memcmp(name, "presence", 8) == 0)
+    return XMPP_STANZA_PRESENCE;
+  if (len == 2 && memcmp(name, "iq", 2) == 0)
+    return XMPP_STANZA_IQ;
+  return XMPP_STANZA_OTHER;
+}
+
+const char* XmppStanzaKindName(XmppStanzaKind kind) {
+  switch (kind) {
+    case XMPP_STANZA_MESSAGE: return "message";
+    case XMPP_STANZA_PRESENCE: return "presence";
+    case XMPP_STANZA_IQ: return "iq";
+    default: return "other";
+  }
+}
+
+XmppEngineCounters::XmppEngineCounters() {
+  Reset();
+}
+
+void XmppEngineCounters::Reset() {
+  memset(stanzas_in, 0, sizeof(stanzas_in));
+  memset(stanzas_out, 0, sizeof(stanzas_out));
+  presence_coalesced = 0;
+  iq_latency.Reset();
+  rtt.Reset();
+}
+
+XmppClientStats::XmppClientStats() {
+  memset(this, 0, sizeof(*this));
+}
+
+}  // namespace txmpp
@@ -0,0 +1,122 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMPPSTATS_H_
+#define _TXMPP_XMPPSTATS_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "dispatchstats.h"
+#include "rttestimator.h"
+#include "xmppengine.h"
+
+namespace txmpp {
+
+class QName;
+
+// The kinds of stanza counted apart.
+enum XmppStanzaKind {
+  XMPP_STANZA_MESSAGE,
+  XMPP_STANZA_PRESENCE,
+  XMPP_STANZA_IQ,
+  XMPP_STANZA_OTHER,
+  XMPP_STANZA_KIND_COUNT
+};
+
+// The kind of a stanza named |name|.
+XmppStanzaKind XmppStanzaKindOf(const QName& name);
+// The kind of a stanza whose local name is the |len| bytes at |name|, as
+// a printed stanza has it after its '<'.
+XmppStanzaKind XmppStanzaKindOf(const char* name, size_t len);
+const char* XmppStanzaKindName(XmppStanzaKind kind);
+
+// What an XmppEngine counts of the stanzas through it once the session is
+// open, enabled by passing one to XmppEngine::SetCounters.  Written on the
+// engine's thread; only iq_latency may be read from another.
+struct XmppEngineCounters {
+  XmppEngineCounters();
+
+  void Reset();
+
+  // The stanzas handled and sent, by kind, leaving out stream management.
+  uint64 stanzas_in[XMPP_STANZA_KIND_COUNT];
+  uint64 stanzas_out[XMPP_STANZA_KIND_COUNT];
+  // The presence dropped for a later one from the same JID; see
+  // XmppEngine::SetPresenceCoalescing.
+  uint64 presence_coalesced;
+  // The microseconds from each SendIq to its response.
+  Histogram iq_latency;
+  // The round trip of the iqs the server answers itself, those sent to
+  // its domain or with no "to", which leaves out the time other entities
+  // take.  Reset by the owner for each connection.
+  RttEstimator rtt;
+
+ private:
+  DISALLOW_EVIL_CONSTRUCTORS(XmppEngineCounters);
+};
+
+// A connection's statistics, as XmppClient::GetStats fills them in.
+struct XmppClientStats {
+  XmppClientStats();
+
+  // The stream's bytes each way, as the engine reads and writes them.
+  uint64 bytes_in;
+  uint64 bytes_out;
+  // The bytes on the network each way, after TLS and compression.  0 if
+  // the socket can't tell.
+  uint64 wire_bytes_in;
+  uint64 wire_bytes_out;
+  uint64 stanzas_in[XMPP_STANZA_KIND_COUNT];
+  uint64 stanzas_out[XMPP_STANZA_KIND_COUNT];
+  uint64 presence_coalesced;
+  Histogram::Snapshot iq_latency;
+  // The connection's round trip estimate, from the iqs the server
+  // answered and the kernel's own, and the RTO that comes of it.  0 until
+  // there is one.
+  uint32 srtt_us;
+  uint32 rttvar_us;
+  int rto_ms;
+  // The bytes written that the socket has yet to send.
+  size_t queued_bytes;
+  // The bytes the parser holds for input and the stanza being built,
+  // besides Expat's own buffer.
+  size_t parser_bytes;
+  // The connections the stream had before this one, as counted through
+  // XmppClient::GetResumeState and SetResumeState.
+  uint32 reconnects;
+  // The microseconds spent in each XmppEngine::State, the current one up
+  // to now.
+  uint64 state_us[XmppEngine::STATE_CLOSED + 1];
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMPPSTATS_H_
@@ -0,0 +1,127 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmppstreammanagement.h"
+
+#include "constants.h"
+#include "logging.h"
+
+namespace txmpp {
+
+XmppStreamManagement::XmppStreamManagement()
+    : ack_interval_(0),
+      sending_(false),
+      binary_(false),
+      sent_(0),
+      sent_since_request_(0),
+      handling_(false),
+      handled_(0),
+      jid_(JID_EMPTY) {
+}
+
+void XmppStreamManagement::StartSending(bool binary) {
+  sending_ = true;
+  binary_ = binary;
+  sent_since_request_ = 0;
+}
+
+bool XmppStreamManagement::StanzaSent(const char* data, size_t len) {
+  if (!sending_)
+    return false;
+  ++sent_;
+  if (!unacked_.get())
+    unacked_.reset(new std::deque<std::string>());
+  unacked_->push_back(std::string());
+  unacked_->back().assign(data, len);
+  if (ack_interval_ <= 0 || ++sent_since_request_ < ack_interval_)
+    return false;
+  sent_since_request_ = 0;
+  return true;
+}
+
+bool XmppStreamManagement::Acked(uint32 handled) {
+  // The counts wrap, so the difference is what is meaningful.
+  uint32 acked = sent_ - static_cast<uint32>(unacked_count());
+  uint32 newly_acked = handled - acked;
+  if (newly_acked > unacked_count()) {
+    LOG(LS_WARNING) << "Server acked " << handled << " stanzas of " << sent_;
+    return false;
+  }
+  if (newly_acked)
+    unacked_->erase(unacked_->begin(), unacked_->begin() + newly_acked);
+  return true;
+}
+
+void XmppStreamManagement::AppendUnacked(std::string* output) const {
+  for (size_t i = 0; i < unacked_count(); ++i)
+    output->append((*unacked_)[i]);
+}
+
+void XmppStreamManagement::SetResumable(const std::string& id,
+                                        const Jid& jid) {
+  id_ = id;
+  jid_ = jid;
+}
+
+void XmppStreamManagement::SetResumeState(const XmppResumeState& state) {
+  id_ = state.id;
+  jid_ = state.jid;
+  handled_ = state.handled;
+  sent_ = state.sent;
+  binary_ = state.binary;
+  unacked_.reset(new std::deque<std::string>(state.unacked.begin(),
+                                             state.unacked.end()));
+}
+
+bool XmppStreamManagement::GetResumeState(XmppResumeState* state) const {
+  if (!resumable())
+    return false;
+  state->id = id_;
+  state->jid = jid_;
+  state->handled = handled_;
+  state->sent = sent_;
+  state->binary = binary_;
+  if (unacked_.get())
+    state->unacked.assign(unacked_->begin(), unacked_->end());
+  else
+    state->unacked.clear();
+  return true;
+}
+
+void XmppStreamManagement::Reset() {
+  sending_ = false;
+  binary_ = false;
+  sent_ = 0;
+  sent_since_request_ = 0;
+  unacked_.reset();
+  handling_ = false;
+  handled_ = 0;
+  id_.clear();
+  jid_ = JID_EMPTY;
+}
+
+}  // namespace txmpp
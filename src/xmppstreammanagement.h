@@ -0,0 +1,109 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMPPSTREAMMANAGEMENT_H_
+#define _TXMPP_XMPPSTREAMMANAGEMENT_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <deque>
+#include <string>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "jid.h"
+#include "scoped_ptr.h"
+#include "xmppengine.h"
+
+namespace txmpp {
+
+// The counting side of XEP-0198 stream management for an XmppEngineImpl:
+// the stanzas each way, the text of those sent and not yet acked, and what
+// the server said about resuming. The engine and its login task send and
+// read the protocol's elements; this only keeps the books.
+class XmppStreamManagement {
+ public:
+  XmppStreamManagement();
+
+  void set_ack_interval(int ack_interval) { ack_interval_ = ack_interval; }
+
+  // Starts counting the stanzas sent, as <enable/> or <resume/> goes out,
+  // on a stream in the binary XML encoding if |binary|.
+  void StartSending(bool binary);
+  bool sending() const { return sending_; }
+  // Whether the stanzas kept are in the binary XML encoding.
+  bool binary() const { return binary_; }
+  // Keeps the text of a stanza sent. Returns true if it is time to ask for
+  // an ack.
+  bool StanzaSent(const char* data, size_t len);
+  // Drops the stanzas the server has acked, |handled| being its count of
+  // them. Returns false if that is more than were sent.
+  bool Acked(uint32 handled);
+  size_t unacked_count() const {
+    return unacked_.get() ? unacked_->size() : 0;
+  }
+  // Appends the text of the stanzas not yet acked to |output|.
+  void AppendUnacked(std::string* output) const;
+
+  // Starts counting the stanzas handled, as <enabled/> or <resumed/> comes
+  // in.
+  void StartHandling() { handling_ = true; }
+  void StanzaHandled() { if (handling_) ++handled_; }
+  uint32 handled() const { return handled_; }
+
+  // The id and JID of a stream the server will let be resumed.
+  void SetResumable(const std::string& id, const Jid& jid);
+  bool resumable() const { return !id_.empty(); }
+  const std::string& id() const { return id_; }
+  const Jid& jid() const { return jid_; }
+
+  void SetResumeState(const XmppResumeState& state);
+  bool GetResumeState(XmppResumeState* state) const;
+  // Forgets the stream, as when the server won't resume it.
+  void Reset();
+
+ private:
+  int ack_interval_;
+  bool sending_;
+  bool binary_;
+  uint32 sent_;
+  int sent_since_request_;
+  // Made by the first stanza kept, as most streams never enable this.
+  scoped_ptr<std::deque<std::string> > unacked_;
+  bool handling_;
+  uint32 handled_;
+  std::string id_;
+  Jid jid_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(XmppStreamManagement);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMPPSTREAMMANAGEMENT_H_
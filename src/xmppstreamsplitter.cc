@@ -0,0 +1,291 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmppstreamsplitter.h"
+
+#include <string.h>
+
+#include "basictypes.h"
+#include "common.h"
+
+namespace txmpp {
+
+namespace {
+
+const char kStreamHeader[] = "<stream:stream";
+const char kStreamClose[] = "</stream:stream>";
+
+inline bool IsSpace(char c) {
+  return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+inline bool IsNameEnd(char c) {
+  return IsSpace(c) || (c == '>') || (c == '/') || (c == '=');
+}
+
+// Whether |text| at |pos| starts with |prefix|; false, too, if it might
+// but isn't long enough yet to tell.
+bool HasPrefix(const std::string& text, size_t pos, const char* prefix) {
+  size_t len = strlen(prefix);
+  return (text.size() - pos >= len) && (text.compare(pos, len, prefix) == 0);
+}
+
+// Whether |text| at |pos| could still turn out to start with |prefix|.
+bool MayHavePrefix(const std::string& text, size_t pos, const char* prefix) {
+  size_t len = _min(strlen(prefix), text.size() - pos);
+  return text.compare(pos, len, prefix, len) == 0;
+}
+
+// The end of the start or end tag at |pos|, past the '>', skipping quoted
+// attribute values; npos if it isn't all there.
+size_t FindTagEnd(const std::string& text, size_t pos) {
+  char quote = 0;
+  for (size_t i = pos + 1; i < text.size(); ++i) {
+    char c = text[i];
+    if (quote) {
+      if (c == quote)
+        quote = 0;
+    } else if ((c == '"') || (c == '\'')) {
+      quote = c;
+    } else if (c == '>') {
+      return i + 1;
+    }
+  }
+  return std::string::npos;
+}
+
+void Unescape(const std::string& text, std::string* out) {
+  static const struct {
+    const char* entity;
+    char c;
+  } kEntities[] = {
+    { "&lt;", '<' }, { "&gt;", '>' }, { "&amp;", '&' }, { "&quot;", '"' },
+    { "&apos;", '\'' },
+  };
+  for (size_t i = 0; i < text.size(); ++i) {
+    bool found = false;
+    if (text[i] == '&') {
+      for (size_t j = 0; j < ARRAY_SIZE(kEntities); ++j) {
+        if (HasPrefix(text, i, kEntities[j].entity)) {
+          out->push_back(kEntities[j].c);
+          i += strlen(kEntities[j].entity) - 1;
+          found = true;
+          break;
+        }
+      }
+    }
+    if (!found)
+      out->push_back(text[i]);
+  }
+}
+
+}  // anonymous namespace
+
+XmppStreamSplitter::XmppStreamSplitter() : start_(0), scan_(0), depth_(0) {
+}
+
+void XmppStreamSplitter::Write(const char* data, size_t len) {
+  if (start_ > 0) {
+    buffer_.erase(0, start_);
+    scan_ -= start_;
+    start_ = 0;
+  }
+  buffer_.append(data, len);
+}
+
+void XmppStreamSplitter::Reset() {
+  buffer_.clear();
+  start_ = scan_ = 0;
+  depth_ = 0;
+}
+
+XmppStreamSplitter::Token XmppStreamSplitter::Next(std::string* text) {
+  for (;;) {
+    if (0 == depth_) {
+      // Between tokens.
+      while ((start_ < buffer_.size()) && (buffer_[start_] != '<'))
+        ++start_;
+      scan_ = start_;
+      if (start_ == buffer_.size())
+        return TOKEN_NONE;
+      if (MayHavePrefix(buffer_, start_, kStreamClose)) {
+        if (!HasPrefix(buffer_, start_, kStreamClose))
+          return TOKEN_NONE;
+        text->assign(kStreamClose);
+        start_ = scan_ = start_ + strlen(kStreamClose);
+        return TOKEN_CLOSE;
+      }
+      if (MayHavePrefix(buffer_, start_, kStreamHeader)) {
+        size_t name_end = start_ + strlen(kStreamHeader);
+        if (buffer_.size() <= name_end)
+          return TOKEN_NONE;
+        if (IsNameEnd(buffer_[name_end])) {
+          size_t end = FindTagEnd(buffer_, start_);
+          if (std::string::npos == end)
+            return TOKEN_NONE;
+          text->assign(buffer_, start_, end - start_);
+          start_ = scan_ = end;
+          return TOKEN_HEADER;
+        }
+      }
+    }
+    // Within an element, or at the start of one.
+    bool element = false;
+    while (scan_ < buffer_.size()) {
+      if (buffer_[scan_] != '<') {
+        size_t next = buffer_.find('<', scan_);
+        scan_ = (std::string::npos == next) ? buffer_.size() : next;
+        continue;
+      }
+      int depth = depth_;
+      size_t markup = scan_;
+      if (!ScanMarkup())
+        return TOKEN_NONE;
+      if (0 == depth) {
+        if (0 == depth_) {
+          // A declaration, comment or empty element at the top.
+          if ((buffer_[markup + 1] == '?') || (buffer_[markup + 1] == '!')) {
+            start_ = scan_;
+            break;
+          }
+          element = true;
+          break;
+        }
+      } else if (0 == depth_) {
+        element = true;
+        break;
+      }
+    }
+    if (element) {
+      text->assign(buffer_, start_, scan_ - start_);
+      start_ = scan_;
+      return TOKEN_ELEMENT;
+    }
+    if (start_ != scan_)
+      return TOKEN_NONE;
+    // A declaration or comment was skipped; go on to what follows.
+  }
+}
+
+bool XmppStreamSplitter::ScanMarkup() {
+  size_t end;
+  if (MayHavePrefix(buffer_, scan_, "<!--")) {
+    if (buffer_.size() - scan_ < 4)
+      return false;
+    end = buffer_.find("-->", scan_ + 4);
+    if (std::string::npos == end)
+      return false;
+    scan_ = end + 3;
+    return true;
+  }
+  if (MayHavePrefix(buffer_, scan_, "<![CDATA[")) {
+    if (buffer_.size() - scan_ < 9)
+      return false;
+    end = buffer_.find("]]>", scan_ + 9);
+    if (std::string::npos == end)
+      return false;
+    scan_ = end + 3;
+    return true;
+  }
+  if (HasPrefix(buffer_, scan_, "<?")) {
+    end = buffer_.find("?>", scan_ + 2);
+    if (std::string::npos == end)
+      return false;
+    scan_ = end + 2;
+    return true;
+  }
+  end = FindTagEnd(buffer_, scan_);
+  if (std::string::npos == end)
+    return false;
+  if (buffer_[scan_ + 1] == '/') {
+    --depth_;
+  } else if (buffer_[end - 2] != '/') {
+    ++depth_;
+  }
+  scan_ = end;
+  return true;
+}
+
+std::string XmppStreamSplitter::GetAttr(const std::string& tag,
+                                        const std::string& name) {
+  size_t end = FindTagEnd(tag, 0);
+  if (std::string::npos == end)
+    end = tag.size();
+  // Past the element's name.
+  size_t pos = 1;
+  while ((pos < end) && !IsNameEnd(tag[pos]))
+    ++pos;
+  while (pos < end) {
+    while ((pos < end) && IsSpace(tag[pos]))
+      ++pos;
+    size_t name_begin = pos;
+    while ((pos < end) && !IsNameEnd(tag[pos]))
+      ++pos;
+    size_t name_end = pos;
+    while ((pos < end) && IsSpace(tag[pos]))
+      ++pos;
+    if ((pos >= end) || (tag[pos] != '='))
+      break;
+    ++pos;
+    while ((pos < end) && IsSpace(tag[pos]))
+      ++pos;
+    if ((pos >= end) || ((tag[pos] != '"') && (tag[pos] != '\'')))
+      break;
+    size_t value_end = tag.find(tag[pos], pos + 1);
+    if (std::string::npos == value_end)
+      break;
+    if (tag.compare(name_begin, name_end - name_begin, name) == 0) {
+      std::string value;
+      Unescape(tag.substr(pos + 1, value_end - pos - 1), &value);
+      return value;
+    }
+    pos = value_end + 1;
+  }
+  return std::string();
+}
+
+void XmppStreamSplitter::AddDefaultNamespace(std::string* element,
+                                             const std::string& ns) {
+  size_t end = FindTagEnd(*element, 0);
+  if (std::string::npos == end)
+    return;
+  size_t xmlns = element->find("xmlns", 0);
+  while ((xmlns != std::string::npos) && (xmlns < end)) {
+    size_t after = xmlns + 5;
+    while ((after < end) && IsSpace((*element)[after]))
+      ++after;
+    if (IsSpace((*element)[xmlns - 1]) && ((*element)[after] == '='))
+      return;
+    xmlns = element->find("xmlns", xmlns + 5);
+  }
+  size_t name_end = 1;
+  while ((name_end < end) && !IsNameEnd((*element)[name_end]))
+    ++name_end;
+  element->insert(name_end, " xmlns=\"" + ns + "\"");
+}
+
+}  // namespace txmpp
@@ -0,0 +1,89 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMPPSTREAMSPLITTER_H_
+#define _TXMPP_XMPPSTREAMSPLITTER_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+
+#include "constructormagic.h"
+
+namespace txmpp {
+
+// Splits the bytes an XmppEngine writes into the stream header, each
+// top-level element and the stream's close, for transports that carry
+// elements one at a time instead of as a byte stream, like BOSH and
+// WebSocket. Whitespace between elements, such as keepalives, and any XML
+// declaration are dropped. Only the engine's own well-formed output is
+// expected; nothing is validated.
+class XmppStreamSplitter {
+ public:
+  enum Token {
+    TOKEN_NONE,     // More bytes are needed.
+    TOKEN_HEADER,   // The <stream:stream> start tag.
+    TOKEN_ELEMENT,  // A whole top-level element.
+    TOKEN_CLOSE,    // </stream:stream>
+  };
+
+  XmppStreamSplitter();
+
+  void Write(const char* data, size_t len);
+  // Takes the next token, and its text, from what has been written.
+  Token Next(std::string* text);
+  // Drops everything written.
+  void Reset();
+
+  // The value of attribute |name| of the start tag at the front of |tag|,
+  // unescaped, or empty if it has none.
+  static std::string GetAttr(const std::string& tag, const std::string& name);
+  // Declares |ns| as the default namespace of |element| unless its start
+  // tag declares one; elements written within the stream inherit
+  // jabber:client, which they lose when carried on their own.
+  static void AddDefaultNamespace(std::string* element,
+                                  const std::string& ns);
+
+ private:
+  // Moves scan_ past the markup at scan_, adjusting depth_. Returns false
+  // if it isn't all there yet.
+  bool ScanMarkup();
+
+  std::string buffer_;
+  // The token being scanned begins at start_; scan_ is how far it has
+  // been, at depth_ elements deep.
+  size_t start_, scan_;
+  int depth_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(XmppStreamSplitter);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMPPSTREAMSPLITTER_H_
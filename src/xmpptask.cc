@@ -31,6 +31,10 @@
 #include "xmppengine.h"
 #include "constants.h"
 #include "ratelimitmanager.h"
+#include "rttestimator.h"
+#include "taskrunner.h"
+#include "taskstats.h"
+#include "time.h"
 
 namespace txmpp {
 
@@ -55,7 +59,14 @@ XmppTask::~XmppTask() {
 }
 
 void XmppTask::StopImpl() {
-  while (NextStanza() != NULL) {}
+  // The stanzas dropped unprocessed are not timed.
+  while (!stanza_queue_.empty()) {
+    delete stanza_queue_.front().stanza;
+    delete stanza_queue_.front().arena;
+    stanza_queue_.pop_front();
+  }
+  next_stanza_.reset();
+  next_arena_.reset();
   if (client_) {
     client_->RemoveXmppTask(this);
     client_->SignalDisconnected.disconnect(this);
@@ -69,6 +80,14 @@ XmppReturnStatus XmppTask::SendStanza(const XmlElement* stanza) {
   return client_->SendStanza(stanza);
 }
 
+XmppReturnStatus XmppTask::SendPreparedStanza(const PreparedStanza* stanza,
+                                              const std::string& to,
+                                              const std::string& id) {
+  if (client_ == NULL)
+    return XMPP_RETURN_BADSTATE;
+  return client_->SendPreparedStanza(stanza, to, id);
+}
+
 XmppReturnStatus XmppTask::SendStanzaError(const XmlElement* element_original,
                                            XmppStanzaError code,
                                            const std::string& text) {
@@ -92,17 +111,35 @@ void XmppTask::QueueStanza(const XmlElement* stanza) {
     return;
 #endif
 
-  stanza_queue_.push_back(new XmlElement(*stanza));
+  // The first task to queue a stanza takes it from the parser as it is;
+  // any others copy it.
+  QueuedStanza queued;
+  queued.arena = NULL;
+  queued.stanza = client_ ? client_->TakeIncomingStanza(stanza, &queued.arena)
+                          : NULL;
+  if (!queued.stanza)
+    queued.stanza = new XmlElement(*stanza);
+  queued.queued_time = GetRunner()->task_stats() ? TimeMicros() : 0;
+  stanza_queue_.push_back(queued);
   Wake();
 }
 
 const XmlElement* XmppTask::NextStanza() {
   XmlElement* result = NULL;
+  XmlArena* arena = NULL;
   if (!stanza_queue_.empty()) {
-    result = stanza_queue_.front();
+    result = stanza_queue_.front().stanza;
+    arena = stanza_queue_.front().arena;
+    uint64 queued_time = stanza_queue_.front().queued_time;
     stanza_queue_.pop_front();
+    TaskStats* stats = GetRunner()->task_stats();
+    if (queued_time && stats) {
+      stats->RecordStanza(this, static_cast<uint32>(
+          _min<uint64>(TimeMicros() - queued_time, 0xFFFFFFFF)));
+    }
   }
   next_stanza_.reset(result);
+  next_arena_.reset(arena);
   return result;
 }
 
@@ -173,7 +210,16 @@ bool XmppTask::MatchRequestIq(const XmlElement* stanza,
   return true;
 }
 
-bool XmppTask::VerifyTaskRateLimit(const std::string task_name, int max_count, 
+void XmppTask::SetAdaptiveTimeout(int rtos, int min_seconds,
+                                  int max_seconds) {
+  int timeout_ms = max_seconds * 1000;
+  if (client_)
+    timeout_ms = client_->Rtt().TimeoutMs(rtos, min_seconds * 1000,
+                                          max_seconds * 1000);
+  set_timeout_seconds((timeout_ms + 999) / 1000);
+}
+
+bool XmppTask::VerifyTaskRateLimit(const std::string& task_name, int max_count,
                                    int per_x_seconds) {
   return task_rate_manager.VerifyRateLimit(task_name, max_count, 
                                            per_x_seconds);
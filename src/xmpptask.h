@@ -33,7 +33,7 @@
 #endif
 
 #include <string>
-#include <deque>
+#include <list>
 #include "sigslot.h"
 #include "xmppengine.h"
 #include "task.h"
@@ -89,6 +89,9 @@ class XmppTask :
   friend class XmppClient;
 
   XmppReturnStatus SendStanza(const XmlElement* stanza);
+  XmppReturnStatus SendPreparedStanza(const PreparedStanza* stanza,
+                                      const std::string& to,
+                                      const std::string& id);
   XmppReturnStatus SetResult(const std::string& code);
   XmppReturnStatus SendStanzaError(const XmlElement* element_original,
                                    XmppStanzaError code,
@@ -113,16 +116,36 @@ class XmppTask :
   static XmlElement *MakeIq(const std::string& type,
                             const Jid& to, const std::string& task_id);
 
+  // Sets the timeout to |rtos| of the client's retransmission timeouts,
+  // rounded up to whole seconds within [|min_seconds|, |max_seconds|], or
+  // to |max_seconds| until the client has a round trip estimate.  Suits a
+  // request the server answers itself; see XmppClient::Rtt.
+  void SetAdaptiveTimeout(int rtos, int min_seconds, int max_seconds);
+
   // Returns true if the task is under the specified rate limit and updates the
   // rate limit accordingly
-  bool VerifyTaskRateLimit(const std::string task_name, int max_count,
+  bool VerifyTaskRateLimit(const std::string& task_name, int max_count,
                            int per_x_seconds);
 
 private:
   void StopImpl();
 
   XmppClient* client_;
-  std::deque<XmlElement*> stanza_queue_;
+  struct QueuedStanza {
+    XmlElement* stanza;
+    // The arena the stanza was parsed into, if it was taken from the
+    // parser rather than copied, to delete after it.
+    XmlArena* arena;
+    // The TimeMicros() it was queued at while the runner has TaskStats,
+    // or 0.
+    uint64 queued_time;
+  };
+
+  // A list, unlike a deque, allocates nothing while it is empty, and most
+  // tasks only ever receive a stanza or two.
+  std::list<QueuedStanza> stanza_queue_;
+  // Declared first so that it goes after the stanza in it.
+  scoped_ptr<XmlArena> next_arena_;
   scoped_ptr<XmlElement> next_stanza_;
   std::string id_;
 
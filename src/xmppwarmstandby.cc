@@ -0,0 +1,241 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmppwarmstandby.h"
+
+#include <algorithm>
+#include "common.h"
+#include "logging.h"
+#include "nethelpers.h"
+#include "signalthread.h"
+#include "thread.h"
+#include "xmppasyncsocketimpl.h"
+#include "xmppclientsettings.h"
+
+namespace txmpp {
+
+namespace {
+
+enum { MSG_REFRESH, MSG_RETRY };
+
+}  // namespace
+
+// Looks up the SRV targets and then the address of each, on HostResolver's
+// pool, so that the addresses it gives need no lookup to connect.  Started
+// again for each refresh.
+class XmppWarmStandby::Resolver : public SignalThread {
+ public:
+  Resolver(const std::string& srv_name, const SocketAddress& server)
+      : srv_name_(srv_name), server_(server) {
+    SetPool(HostResolver::Instance()->pool());
+  }
+
+  const std::vector<SocketAddress>& servers() const { return servers_; }
+
+ protected:
+  virtual ~Resolver() {}
+
+  virtual void DoWork() {
+    std::vector<SocketAddress> servers;
+    if (!srv_name_.empty()) {
+      std::vector<SrvRecord> records;
+      int error;
+      if (SafeGetSrvRecords(srv_name_, &records, &error)) {
+        SortSrvRecords(&records);
+        for (size_t i = 0; i < records.size(); ++i)
+          servers.push_back(SocketAddress(records[i].target, records[i].port));
+      }
+    }
+    if (!server_.IsNil() &&
+        std::find(servers.begin(), servers.end(), server_) == servers.end())
+      servers.push_back(server_);
+
+    servers_.clear();
+    for (size_t i = 0; i < servers.size(); ++i) {
+      SocketAddress& addr = servers[i];
+      if (addr.IsUnresolvedIP()) {
+        uint32 ip;
+        if (HostResolver::Instance()->Resolve(addr.hostname(), &ip) != 0)
+          continue;
+        addr.SetResolvedIP(ip);
+      }
+      servers_.push_back(addr);
+    }
+  }
+
+ private:
+  std::string srv_name_;
+  SocketAddress server_;
+  std::vector<SocketAddress> servers_;
+};
+
+XmppWarmStandby::XmppWarmStandby()
+    : thread_(Thread::Current()),
+      tls_(false),
+      refresh_ms_(kDefaultRefreshMs),
+      resolver_(NULL),
+      resolved_(false),
+      connect_stagger_(0),
+      warm_wanted_(false),
+      spare_(NULL),
+      spare_open_(false),
+      retry_pending_(false) {
+}
+
+XmppWarmStandby::~XmppWarmStandby() {
+  Stop();
+}
+
+void XmppWarmStandby::Start(const XmppClientSettings& settings,
+                            int refresh_ms) {
+  Stop();
+  tls_ = settings.use_tls();
+  refresh_ms_ = refresh_ms;
+  connect_stagger_ = settings.connect_stagger();
+  std::string srv_name;
+  if (settings.use_srv())
+    srv_name = "_xmpp-client._tcp." + settings.host();
+  resolver_ = new Resolver(srv_name, settings.server());
+  resolver_->SignalWorkDone.connect(this, &XmppWarmStandby::OnResolved);
+  resolver_->Start();
+}
+
+void XmppWarmStandby::Stop() {
+  warm_wanted_ = false;
+  retry_pending_ = false;
+  if (thread_)
+    thread_->Clear(this);
+  if (resolver_) {
+    resolver_->Destroy(false);
+    resolver_ = NULL;
+  }
+  resolved_ = false;
+  servers_.clear();
+  DropSpare();
+}
+
+void XmppWarmStandby::Warm() {
+  warm_wanted_ = true;
+  if (!spare_ && !retry_pending_)
+    OpenSpare();
+}
+
+bool XmppWarmStandby::IsWarm() const {
+  return spare_open_;
+}
+
+XmppAsyncSocket* XmppWarmStandby::TakeSocket() {
+  if (!spare_open_)
+    return NULL;
+  XmppAsyncSocketImpl* socket = spare_;
+  socket->SignalConnected.disconnect(this);
+  socket->SignalClosed.disconnect(this);
+  socket->SignalCloseEvent.disconnect(this);
+  spare_ = NULL;
+  spare_open_ = false;
+  warm_wanted_ = false;
+  return socket;
+}
+
+void XmppWarmStandby::OnResolved(SignalThread* thread) {
+  ASSERT(thread == resolver_);
+  servers_ = resolver_->servers();
+  if (servers_.empty())
+    LOG(LS_INFO) << "XmppWarmStandby found no servers";
+  resolved_ = true;
+  if (thread_ && refresh_ms_ > 0)
+    thread_->PostDelayed(refresh_ms_, this, MSG_REFRESH);
+  SignalResolved();
+  if (warm_wanted_ && !spare_ && !retry_pending_)
+    OpenSpare();
+}
+
+void XmppWarmStandby::OpenSpare() {
+  // Opened once the servers are known.
+  if (!resolved_)
+    return;
+  if (servers_.empty() || !thread_) {
+    retry_pending_ = (thread_ != NULL);
+    if (retry_pending_)
+      thread_->PostDelayed(kRetryMs, this, MSG_RETRY);
+    return;
+  }
+  spare_ = new XmppAsyncSocketImpl(tls_);
+  spare_->SignalConnected.connect(this, &XmppWarmStandby::OnSpareConnected);
+  spare_->SignalClosed.connect(this, &XmppWarmStandby::OnSpareClosed);
+  spare_->SignalCloseEvent.connect(this, &XmppWarmStandby::OnSpareCloseEvent);
+  if (!spare_->ConnectAny(servers_, connect_stagger_))
+    OnSpareClosed();
+}
+
+void XmppWarmStandby::DropSpare() {
+  if (!spare_)
+    return;
+  spare_->SignalConnected.disconnect(this);
+  spare_->SignalClosed.disconnect(this);
+  spare_->SignalCloseEvent.disconnect(this);
+  spare_->Close();
+  // This may be in one of its signals.
+  if (thread_)
+    thread_->Dispose(spare_);
+  else
+    delete spare_;
+  spare_ = NULL;
+  spare_open_ = false;
+}
+
+void XmppWarmStandby::OnSpareConnected() {
+  spare_open_ = true;
+  SignalWarm();
+}
+
+void XmppWarmStandby::OnSpareClosed() {
+  DropSpare();
+  if (warm_wanted_ && thread_ && !retry_pending_) {
+    retry_pending_ = true;
+    thread_->PostDelayed(kRetryMs, this, MSG_RETRY);
+  }
+}
+
+void XmppWarmStandby::OnSpareCloseEvent(int error) {
+  LOG(LS_INFO) << "XmppWarmStandby spare closed, error " << error;
+  OnSpareClosed();
+}
+
+void XmppWarmStandby::OnMessage(Message* msg) {
+  if (msg->message_id == MSG_REFRESH) {
+    if (resolver_)
+      resolver_->Start();
+  } else {
+    ASSERT(msg->message_id == MSG_RETRY);
+    retry_pending_ = false;
+    if (warm_wanted_ && !spare_)
+      OpenSpare();
+  }
+}
+
+}  // namespace txmpp
@@ -0,0 +1,129 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMPPWARMSTANDBY_H_
+#define _TXMPP_XMPPWARMSTANDBY_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+#include <vector>
+#include "constructormagic.h"
+#include "messagehandler.h"
+#include "sigslot.h"
+#include "socketaddress.h"
+
+namespace txmpp {
+
+class SignalThread;
+class Thread;
+class XmppAsyncSocket;
+class XmppAsyncSocketImpl;
+class XmppClientSettings;
+
+// Keeps what a reconnect needs ready ahead of it, so that a dropped
+// connection doesn't start over with DNS and a TCP connect.  The server's
+// SRV targets and addresses are looked up once and again every refresh
+// interval, and Warm opens a spare socket to them in the background, as
+// after a disconnect or before sessions are moved on purpose.
+//
+// The spare socket is given to XmppClient::Connect, which starts at the
+// stream header with a socket that is already open.  TLS can't be started
+// ahead: STARTTLS has to follow the stream features.  Without a spare,
+// XmppClient::SetServers takes servers() in place of its own lookup.
+//
+// Context: the thread it is made on, which its sockets belong to.
+class XmppWarmStandby : public MessageHandler, public has_slots<> {
+ public:
+  // Under HostResolver's positive TTL, so the addresses stay cached.
+  static const int kDefaultRefreshMs = 50 * 1000;
+  // How long after a spare fails to connect, or closes, it is tried again.
+  static const int kRetryMs = 5 * 1000;
+
+  XmppWarmStandby();
+  virtual ~XmppWarmStandby();
+
+  // Looks up the servers for |settings|: the SRV targets of its host if it
+  // uses SRV, then its server, and again every |refresh_ms|.
+  void Start(const XmppClientSettings& settings,
+             int refresh_ms = kDefaultRefreshMs);
+  // Stops the lookups and closes the spare.
+  void Stop();
+
+  // The servers to try, in order, with their addresses, once resolved.
+  bool resolved() const { return resolved_; }
+  const std::vector<SocketAddress>& servers() const { return servers_; }
+
+  // Opens a spare socket once the servers are resolved, if there isn't
+  // one, and opens another whenever it fails or the server closes it,
+  // until TakeSocket.
+  void Warm();
+  // True once the spare is connected.
+  bool IsWarm() const;
+  // Gives up the spare for XmppClient::Connect, if it is connected, and
+  // returns NULL otherwise.
+  XmppAsyncSocket* TakeSocket();
+
+  // The servers were looked up, whether or not any were found.
+  signal0<> SignalResolved;
+  // The spare is connected.
+  signal0<> SignalWarm;
+
+  virtual void OnMessage(Message* msg);
+
+ private:
+  class Resolver;
+
+  void OnResolved(SignalThread* thread);
+  void OpenSpare();
+  void DropSpare();
+  void OnSpareConnected();
+  void OnSpareClosed();
+  void OnSpareCloseEvent(int error);
+
+  Thread* thread_;
+  bool tls_;
+  int refresh_ms_;
+  Resolver* resolver_;
+  bool resolved_;
+  std::vector<SocketAddress> servers_;
+  int connect_stagger_;
+
+  // Warm was called and the spare hasn't been taken.
+  bool warm_wanted_;
+  XmppAsyncSocketImpl* spare_;
+  bool spare_open_;
+  bool retry_pending_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(XmppWarmStandby);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMPPWARMSTANDBY_H_
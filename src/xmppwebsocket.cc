@@ -0,0 +1,504 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xmppwebsocket.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "base64.h"
+#include "constants.h"
+#include "helpers.h"
+#include "httpclient.h"
+#include "logging.h"
+#include "socketpool.h"
+#include "stream.h"
+#include "stringdigest.h"
+#include "stringutils.h"
+#include "thread.h"
+
+namespace txmpp {
+
+namespace {
+
+const char kNsFraming[] = "urn:ietf:params:xml:ns:xmpp-framing";
+const char kWebSocketGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+const char kSubprotocol[] = "xmpp";
+
+const size_t kReadSize = 16 * 1024;
+
+enum { MSG_CLOSED };
+
+std::string EscapeAttr(const std::string& value) {
+  std::string escaped;
+  for (size_t i = 0; i < value.size(); ++i) {
+    switch (value[i]) {
+    case '<': escaped.append("&lt;"); break;
+    case '>': escaped.append("&gt;"); break;
+    case '&': escaped.append("&amp;"); break;
+    case '"': escaped.append("&quot;"); break;
+    default: escaped.push_back(value[i]); break;
+    }
+  }
+  return escaped;
+}
+
+// Whether |element| is the framing element |name|.
+bool IsFraming(const std::string& element, const char* name) {
+  size_t len = strlen(name);
+  if ((element.size() < len + 2) || (element[0] != '<')
+      || (element.compare(1, len, name) != 0))
+    return false;
+  char after = element[len + 1];
+  return ((after == '/') || (after == '>') || isspace(
+              static_cast<unsigned char>(after)))
+         && (element.find(kNsFraming) != std::string::npos);
+}
+
+// A stanza stands alone in its message, so the stream prefix the engine
+// declared on its stream header must be declared on the stanza.
+void DeclareStreamPrefix(std::string* element) {
+  static const char kPrefix[] = "<stream:";
+  if ((element->compare(0, sizeof(kPrefix) - 1, kPrefix) != 0)
+      || (element->find("xmlns:stream") != std::string::npos))
+    return;
+  size_t name_end = element->find_first_of(" \t\r\n/>");
+  if (name_end == std::string::npos)
+    return;
+  std::string decl(" xmlns:stream=\"");
+  decl.append(NS_STREAM);
+  decl.append("\"");
+  element->insert(name_end, decl);
+}
+
+}  // anonymous namespace
+
+const size_t XmppWebSocket::kDefaultHighWater;
+const size_t XmppWebSocket::kDefaultLowWater;
+
+XmppWebSocket::XmppWebSocket(SocketFactory* factory, const std::string& url,
+                             const std::string& agent)
+    : thread_(Thread::Current()), url_(url), agent_(agent), deflate_(true),
+      pool_(new ConnectionPool(factory)), state_(STATE_CLOSED),
+      error_(ERROR_NONE), socket_error_(0), close_sent_(false),
+      stream_ended_(false), output_start_(0),
+      high_water_(kDefaultHighWater), low_water_(kDefaultLowWater),
+      write_blocked_(false) {
+}
+
+XmppWebSocket::~XmppWebSocket() {
+  thread_->Clear(this);
+  if (stream_.get())
+    stream_->SignalEvent.disconnect(this);
+}
+
+bool XmppWebSocket::Connect(const SocketAddress& addr) {
+  if (state_ != STATE_CLOSED) {
+    error_ = ERROR_WRONGSTATE;
+    return false;
+  }
+  state_ = STATE_CONNECTING;
+  error_ = ERROR_NONE;
+  socket_error_ = 0;
+  splitter_.Reset();
+  close_sent_ = stream_ended_ = false;
+  output_.clear();
+  output_start_ = 0;
+  write_blocked_ = false;
+  input_.clear();
+  if (stream_.get()) {
+    stream_->SignalEvent.disconnect(this);
+    stream_.reset();
+  }
+
+  // HttpClient knows the schemes as http and https.
+  std::string url(url_);
+  if (_strnicmp(url.c_str(), "ws", 2) == 0)
+    url.replace(0, 2, "http");
+  if (!client_.get()) {
+    client_.reset(new HttpClient(agent_, pool_.get()));
+    client_->SignalHttpClientComplete.connect(
+        this, &XmppWebSocket::OnUpgradeComplete);
+  }
+  client_->prepare_get(url);
+  client_->set_proxy(proxy_);
+
+  char nonce[16];
+  for (size_t i = 0; i < sizeof(nonce); i += sizeof(uint32)) {
+    uint32 id = CreateRandomId();
+    memcpy(nonce + i, &id, sizeof(id));
+  }
+  key_.clear();
+  Base64::EncodeFromArray(nonce, sizeof(nonce), &key_);
+  HttpRequestData& request = client_->request();
+  request.setHeader(HH_UPGRADE, "websocket");
+  request.setHeader(HH_CONNECTION, "Upgrade");
+  request.setHeader("Sec-WebSocket-Key", key_);
+  request.setHeader("Sec-WebSocket-Version", "13");
+  request.setHeader("Sec-WebSocket-Protocol", kSubprotocol);
+  if (deflate_)
+    request.setHeader("Sec-WebSocket-Extensions",
+                      WebSocketCodec::kDeflateOffer);
+  client_->start();
+  return true;
+}
+
+bool XmppWebSocket::ConnectAny(const std::vector<SocketAddress>& addrs,
+                               int stagger) {
+  return Connect(SocketAddress());
+}
+
+void XmppWebSocket::OnUpgradeComplete(HttpClient* client, int err) {
+  if (state_ != STATE_CONNECTING)
+    return;
+  if (HE_NONE != err) {
+    LOG(LS_WARNING) << "XmppWebSocket: upgrade failed: " << err;
+    Fail(ECONNREFUSED);
+    return;
+  }
+  if (!CheckUpgrade()) {
+    Fail(ECONNREFUSED);
+    return;
+  }
+  std::string pending;
+  stream_.reset(client->DetachUpgradedStream(&pending));
+  if (!stream_.get()) {
+    Fail(ECONNREFUSED);
+    return;
+  }
+  stream_->SignalEvent.connect(this, &XmppWebSocket::OnStreamEvent);
+  state_ = STATE_OPEN;
+  SignalConnected();
+  if (!pending.empty() && (state_ == STATE_OPEN))
+    ProcessInput(pending.data(), pending.size());
+}
+
+bool XmppWebSocket::CheckUpgrade() {
+  const HttpResponseData& response = client_->response();
+  if (HC_SWITCHING_PROTOCOLS != response.scode) {
+    LOG(LS_WARNING) << "XmppWebSocket: not upgraded: " << response.scode;
+    return false;
+  }
+  std::string value;
+  if (!response.hasHeader(HH_UPGRADE, &value)
+      || (_stricmp(value.c_str(), "websocket") != 0)) {
+    LOG(LS_WARNING) << "XmppWebSocket: upgraded to " << value;
+    return false;
+  }
+#if SSL_USE_OPENSSL
+  std::string accept(key_ + kWebSocketGuid);
+  unsigned char digest[kMaxDigestSize];
+  size_t len = ComputeDigest(DIGEST_SHA1, accept.data(), accept.size(),
+                             digest);
+  accept.clear();
+  Base64::EncodeFromArray(digest, len, &accept);
+  if (!response.hasHeader("Sec-WebSocket-Accept", &value)
+      || (value != accept)) {
+    LOG(LS_WARNING) << "XmppWebSocket: bad Sec-WebSocket-Accept: " << value;
+    return false;
+  }
+#endif  // SSL_USE_OPENSSL
+  if (!response.hasHeader("Sec-WebSocket-Protocol", &value)
+      || (value != kSubprotocol)) {
+    LOG(LS_WARNING) << "XmppWebSocket: no xmpp subprotocol";
+    return false;
+  }
+  value.clear();
+  response.hasHeader("Sec-WebSocket-Extensions", &value);
+  if ((!deflate_ && !value.empty()) || !codec_.Negotiate(value))
+    return false;
+  LOG(LS_INFO) << "XmppWebSocket: connected"
+               << (codec_.deflate() ? ", with permessage-deflate" : "");
+  return true;
+}
+
+bool XmppWebSocket::Read(char* data, size_t len, size_t* len_read) {
+  *len_read = _min(len, input_.size());
+  memcpy(data, input_.data(), *len_read);
+  input_.erase(0, *len_read);
+  return true;
+}
+
+bool XmppWebSocket::Write(const char* data, size_t len) {
+  if (state_ != STATE_OPEN) {
+    error_ = ERROR_WRONGSTATE;
+    return false;
+  }
+  splitter_.Write(data, len);
+  std::string text;
+  XmppStreamSplitter::Token token;
+  while ((token = splitter_.Next(&text)) != XmppStreamSplitter::TOKEN_NONE) {
+    switch (token) {
+    case XmppStreamSplitter::TOKEN_HEADER: {
+      std::string open("<open xmlns=\"");
+      open.append(kNsFraming);
+      open.append("\" to=\"");
+      open.append(EscapeAttr(XmppStreamSplitter::GetAttr(text, "to")));
+      open.append("\" version=\"1.0\"");
+      std::string lang = XmppStreamSplitter::GetAttr(text, "xml:lang");
+      if (!lang.empty() && (lang != "*"))
+        open.append(" xml:lang=\"" + EscapeAttr(lang) + "\"");
+      open.append("/>");
+      Send(WS_TEXT, open);
+      break;
+    }
+    case XmppStreamSplitter::TOKEN_ELEMENT:
+      XmppStreamSplitter::AddDefaultNamespace(&text, NS_CLIENT);
+      DeclareStreamPrefix(&text);
+      Send(WS_TEXT, text);
+      break;
+    case XmppStreamSplitter::TOKEN_CLOSE: {
+      std::string close("<close xmlns=\"");
+      close.append(kNsFraming);
+      close.append("\"/>");
+      Send(WS_TEXT, close);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  WriteOutput();
+  return true;
+}
+
+bool XmppWebSocket::Close() {
+  if (state_ == STATE_CLOSED)
+    return false;
+  if ((state_ == STATE_OPEN) && !close_sent_) {
+    // Best effort; the server sees the connection close either way.
+    SendClose(WS_CLOSE_NORMAL);
+    WriteOutput();
+  }
+  state_ = STATE_CLOSED;
+  if (stream_.get())
+    stream_->Close();
+  if (client_.get())
+    client_->reset();
+  SignalClosed();
+  return true;
+}
+
+void XmppWebSocket::SetWriteWatermarks(size_t high, size_t low) {
+  high_water_ = high;
+  low_water_ = _min(low, high);
+  CheckWatermarks();
+}
+
+#if defined(FEATURE_ENABLE_SSL)
+bool XmppWebSocket::StartTls(const std::string& domainname) {
+  // A wss url has TLS already; RFC 7395 servers don't offer STARTTLS.
+  return false;
+}
+#endif
+
+void XmppWebSocket::OnMessage(Message* msg) {
+  if (MSG_CLOSED == msg->message_id)
+    SignalClosed();
+}
+
+void XmppWebSocket::OnStreamEvent(StreamInterface* stream, int events,
+                                  int err) {
+  if (events & SE_READ) {
+    char buffer[kReadSize];
+    while (state_ == STATE_OPEN) {
+      size_t read;
+      int error;
+      StreamResult result = stream_->Read(buffer, sizeof(buffer), &read,
+                                          &error);
+      if (result == SR_SUCCESS) {
+        ProcessInput(buffer, read);
+      } else if (result == SR_BLOCK) {
+        break;
+      } else {
+        // The end of the stream is only clean after the closing handshake.
+        Fail(((result == SR_EOS) && close_sent_) ? 0
+             : ((result == SR_ERROR) ? error : ECONNRESET));
+        return;
+      }
+    }
+  }
+  if ((events & SE_WRITE) && (state_ == STATE_OPEN))
+    WriteOutput();
+  if ((events & SE_CLOSE) && (state_ == STATE_OPEN))
+    Fail(close_sent_ ? 0 : (err ? err : ECONNRESET));
+}
+
+void XmppWebSocket::ProcessInput(const char* data, size_t len) {
+  size_t before = input_.size();
+  codec_.Write(data, len);
+  WebSocketOpcode opcode;
+  std::string payload;
+  while (state_ == STATE_OPEN) {
+    WebSocketCodec::Result result = codec_.Next(&opcode, &payload);
+    if (result == WebSocketCodec::RESULT_NONE)
+      break;
+    if (result == WebSocketCodec::RESULT_ERROR) {
+      SendClose(codec_.close_code());
+      WriteOutput();
+      Fail(ECONNRESET);
+      break;
+    }
+    switch (opcode) {
+    case WS_TEXT:
+      ProcessElement(payload);
+      break;
+    case WS_PING:
+      Send(WS_PONG, payload);
+      break;
+    case WS_PONG:
+      break;
+    case WS_CLOSE: {
+      uint16 code;
+      std::string reason;
+      WebSocketCodec::ParseClose(payload, &code, &reason);
+      LOG(LS_INFO) << "XmppWebSocket: closed by server: " << code << " "
+                   << reason;
+      if (!close_sent_)
+        SendClose(code == 1005 ? static_cast<uint16>(WS_CLOSE_NORMAL)
+                               : code);
+      WriteOutput();
+      if (!stream_ended_) {
+        stream_ended_ = true;
+        input_.append("</stream:stream>");
+      }
+      Fail((code == WS_CLOSE_NORMAL) || (code == 1005) ? 0 : ECONNRESET);
+      break;
+    }
+    default:
+      // RFC 7395 has no binary messages.
+      SendClose(WS_CLOSE_UNSUPPORTED);
+      WriteOutput();
+      Fail(ECONNRESET);
+      break;
+    }
+  }
+  WriteOutput();
+  if (input_.size() > before)
+    SignalRead();
+}
+
+void XmppWebSocket::ProcessElement(const std::string& text) {
+  size_t start = text.find('<');
+  if (start == std::string::npos)
+    return;
+  std::string element(text, start);
+  if (IsFraming(element, "open")) {
+    input_.append("<stream:stream xmlns=\"");
+    input_.append(NS_CLIENT);
+    input_.append("\" xmlns:stream=\"");
+    input_.append(NS_STREAM);
+    input_.append("\" version=\"1.0\" from=\"");
+    input_.append(EscapeAttr(XmppStreamSplitter::GetAttr(element, "from")));
+    input_.append("\" id=\"");
+    input_.append(EscapeAttr(XmppStreamSplitter::GetAttr(element, "id")));
+    std::string lang = XmppStreamSplitter::GetAttr(element, "xml:lang");
+    if (!lang.empty())
+      input_.append("\" xml:lang=\"" + EscapeAttr(lang));
+    input_.append("\">");
+    stream_ended_ = false;
+  } else if (IsFraming(element, "close")) {
+    if (!stream_ended_) {
+      stream_ended_ = true;
+      input_.append("</stream:stream>");
+    }
+  } else {
+    input_.append(element);
+  }
+}
+
+void XmppWebSocket::Send(WebSocketOpcode opcode,
+                         const std::string& payload) {
+  if (close_sent_)
+    return;
+  if (output_start_ == output_.size()) {
+    output_.clear();
+    output_start_ = 0;
+  }
+  codec_.Encode(opcode, payload.data(), payload.size(), &output_);
+}
+
+void XmppWebSocket::SendClose(uint16 code) {
+  if (close_sent_)
+    return;
+  if (output_start_ == output_.size()) {
+    output_.clear();
+    output_start_ = 0;
+  }
+  codec_.EncodeClose(code, std::string(), &output_);
+  close_sent_ = true;
+}
+
+void XmppWebSocket::WriteOutput() {
+  while (stream_.get() && (output_start_ < output_.size())) {
+    size_t written;
+    int error;
+    StreamResult result = stream_->Write(output_.data() + output_start_,
+                                         output_.size() - output_start_,
+                                         &written, &error);
+    if (result != SR_SUCCESS) {
+      if (result == SR_ERROR)
+        LOG_EVERY_T(LS_ERROR, 1000) << "Send error: " << error;
+      break;
+    }
+    output_start_ += written;
+  }
+  if (output_start_ == output_.size()) {
+    output_.clear();
+    output_start_ = 0;
+  } else if (output_start_ > kReadSize) {
+    output_.erase(0, output_start_);
+    output_start_ = 0;
+  }
+  CheckWatermarks();
+}
+
+void XmppWebSocket::CheckWatermarks() {
+  size_t queued = QueuedBytes();
+  if (!write_blocked_ && (high_water_ > 0) && (queued >= high_water_)) {
+    write_blocked_ = true;
+    SignalWriteBlocked();
+  } else if (write_blocked_ && (queued <= low_water_)) {
+    write_blocked_ = false;
+    SignalWritable();
+  }
+}
+
+void XmppWebSocket::Fail(int error) {
+  if (state_ == STATE_CLOSED)
+    return;
+  state_ = STATE_CLOSED;
+  socket_error_ = error;
+  error_ = error ? ERROR_WINSOCK : ERROR_NONE;
+  if (stream_.get())
+    stream_->Close();
+  // The reader hears after what was delivered, and outside any callback of
+  // the stream or the client.
+  thread_->Post(this, MSG_CLOSED);
+}
+
+}  // namespace txmpp
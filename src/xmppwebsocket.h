@@ -0,0 +1,151 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_XMPPWEBSOCKET_H_
+#define _TXMPP_XMPPWEBSOCKET_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+#include "constructormagic.h"
+#include "messagehandler.h"
+#include "proxyinfo.h"
+#include "scoped_ptr.h"
+#include "sigslot.h"
+#include "websocket.h"
+#include "xmppasyncsocket.h"
+#include "xmppstreamsplitter.h"
+
+namespace txmpp {
+
+class ConnectionPool;
+class HttpClient;
+class SocketFactory;
+class StreamInterface;
+class Thread;
+
+// Carries an XMPP stream over a WebSocket (RFC 7395), for networks that
+// only let HTTP through but, unlike for BOSH, let it be upgraded.  The
+// connection is opened and upgraded by an HttpClient, which then hands the
+// stream over.  Each stanza is a message of its own, both ways: what the
+// engine writes is split into stanzas, its stream header and close become
+// <open/> and <close/>, and the reverse is done for what the server sends,
+// so the engine sees the stream it expects.  Messages are compressed with
+// permessage-deflate where the server agrees to it.
+//
+// The address given to Connect is ignored; the url, ws: or wss:, is used.
+// TLS, if any, is that of a wss url, so the client must not ask for
+// StartTls, and compression is left to the WebSocket.
+class XmppWebSocket : public XmppAsyncSocket, public MessageHandler,
+                      public has_slots<> {
+ public:
+  XmppWebSocket(SocketFactory* factory, const std::string& url,
+                const std::string& agent);
+  virtual ~XmppWebSocket();
+
+  void set_proxy(const ProxyInfo& proxy) { proxy_ = proxy; }
+  const ProxyInfo& proxy() const { return proxy_; }
+  // Offers permessage-deflate.  On by default; must be set before
+  // connecting.
+  void set_deflate(bool deflate) { deflate_ = deflate; }
+  bool deflate() const { return deflate_; }
+
+  // The framing of the connection, for its compression figures.
+  const WebSocketCodec& codec() const { return codec_; }
+
+  // XmppAsyncSocket
+  virtual State state() { return state_; }
+  virtual Error error() { return error_; }
+  virtual int GetError() { return socket_error_; }
+  virtual bool Connect(const SocketAddress& addr);
+  virtual bool ConnectAny(const std::vector<SocketAddress>& addrs,
+                          int stagger);
+  virtual bool Read(char* data, size_t len, size_t* len_read);
+  virtual bool Write(const char* data, size_t len);
+  virtual bool Close();
+  virtual size_t QueuedBytes() { return output_.size() - output_start_; }
+  virtual void SetWriteWatermarks(size_t high, size_t low);
+#if defined(FEATURE_ENABLE_SSL)
+  virtual bool StartTls(const std::string& domainname);
+#endif
+
+ private:
+  virtual void OnMessage(Message* msg);
+  void OnUpgradeComplete(HttpClient* client, int err);
+  void OnStreamEvent(StreamInterface* stream, int events, int err);
+
+  // Checks the server's answer to the upgrade.
+  bool CheckUpgrade();
+  // Frames what the server sent, and hands it to the reader.
+  void ProcessInput(const char* data, size_t len);
+  void ProcessElement(const std::string& element);
+  void Send(WebSocketOpcode opcode, const std::string& payload);
+  void SendClose(uint16 code);
+  void WriteOutput();
+  void CheckWatermarks();
+  // Ends the connection, with an error unless |error| is 0.
+  void Fail(int error);
+
+  static const size_t kDefaultHighWater = 256 * 1024;
+  static const size_t kDefaultLowWater = 64 * 1024;
+
+  Thread* thread_;
+  std::string url_, agent_;
+  ProxyInfo proxy_;
+  bool deflate_;
+  scoped_ptr<ConnectionPool> pool_;
+  scoped_ptr<HttpClient> client_;
+  // The Sec-WebSocket-Key sent.
+  std::string key_;
+  scoped_ptr<StreamInterface> stream_;
+  WebSocketCodec codec_;
+  State state_;
+  Error error_;
+  int socket_error_;
+  XmppStreamSplitter splitter_;
+  // Set once a close frame has gone out, and once the stream the reader
+  // sees has ended.
+  bool close_sent_, stream_ended_;
+  // Framed bytes to send, from output_start_ on.
+  std::string output_;
+  size_t output_start_;
+  size_t high_water_, low_water_;
+  bool write_blocked_;
+  // What the reader is yet to take.
+  std::string input_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(XmppWebSocket);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_XMPPWEBSOCKET_H_
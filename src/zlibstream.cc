@@ -0,0 +1,308 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "zlibstream.h"
+
+#include <string.h>
+
+#include "basictypes.h"
+#include "logging.h"
+
+namespace txmpp {
+
+const size_t ZlibStream::kInputSize;
+const size_t ZlibStream::kOutputChunk;
+const size_t ZlibInflater::kOutputSize;
+
+ZlibStream::ZlibStream(StreamInterface* stream, bool owned)
+    : StreamAdapterInterface(stream, owned),
+      active_(false),
+      initialized_(false),
+      window_bits_(0),
+      output_begin_(0),
+      output_end_(0) {
+  memset(&deflate_, 0, sizeof(deflate_));
+  memset(&inflate_, 0, sizeof(inflate_));
+}
+
+ZlibStream::~ZlibStream() {
+  EndContexts();
+}
+
+void ZlibStream::EndContexts() {
+  if (initialized_) {
+    deflateEnd(&deflate_);
+    inflateEnd(&inflate_);
+    initialized_ = false;
+  }
+}
+
+bool ZlibStream::Start(int level, int window_bits) {
+  window_bits = _max(9, _min(window_bits, MAX_WBITS));
+  if (initialized_ && window_bits != window_bits_)
+    EndContexts();
+
+  if (initialized_) {
+    // deflateParams right after a reset only records the level.
+    if (deflateReset(&deflate_) != Z_OK ||
+        deflateParams(&deflate_, level, Z_DEFAULT_STRATEGY) != Z_OK ||
+        inflateReset(&inflate_) != Z_OK) {
+      EndContexts();
+    }
+  }
+
+  if (!initialized_) {
+    if (deflateInit2(&deflate_, level, Z_DEFLATED, window_bits, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      LOG(LS_ERROR) << "deflateInit2 failed: " << deflate_.msg;
+      return false;
+    }
+    // The peer picks its own window, so take the largest.
+    if (inflateInit2(&inflate_, MAX_WBITS) != Z_OK) {
+      LOG(LS_ERROR) << "inflateInit2 failed: " << inflate_.msg;
+      deflateEnd(&deflate_);
+      return false;
+    }
+    initialized_ = true;
+    window_bits_ = window_bits;
+  }
+
+  if (!input_.get())
+    input_.reset(new char[kInputSize]);
+  inflate_.avail_in = 0;
+  output_begin_ = output_end_ = 0;
+  active_ = true;
+  return true;
+}
+
+void ZlibStream::Stop() {
+  active_ = false;
+  inflate_.avail_in = 0;
+  output_begin_ = output_end_ = 0;
+}
+
+size_t ZlibStream::bytes_written() const {
+  return initialized_ ? deflate_.total_in : 0;
+}
+
+size_t ZlibStream::compressed_bytes_written() const {
+  return initialized_ ? deflate_.total_out : 0;
+}
+
+StreamResult ZlibStream::Read(void* buffer, size_t buffer_len,
+                              size_t* read, int* error) {
+  if (!active_)
+    return StreamAdapterInterface::Read(buffer, buffer_len, read, error);
+
+  inflate_.next_out = static_cast<Bytef*>(buffer);
+  inflate_.avail_out = static_cast<uInt>(buffer_len);
+  for (;;) {
+    if (inflate_.avail_in == 0) {
+      size_t input_len;
+      StreamResult result = StreamAdapterInterface::Read(
+          input_.get(), kInputSize, &input_len, error);
+      if (result != SR_SUCCESS) {
+        if (inflate_.avail_out < buffer_len)
+          break;
+        return result;
+      }
+      inflate_.next_in = reinterpret_cast<Bytef*>(input_.get());
+      inflate_.avail_in = static_cast<uInt>(input_len);
+    }
+
+    int status = inflate(&inflate_, Z_SYNC_FLUSH);
+    if (status == Z_STREAM_END)
+      return SR_EOS;
+    if (status != Z_OK &&
+        !(status == Z_BUF_ERROR && inflate_.avail_in == 0)) {
+      LOG(LS_ERROR) << "inflate failed: " << status;
+      if (error)
+        *error = status;
+      return SR_ERROR;
+    }
+    // What has come out is returned now rather than waiting for more.
+    if (inflate_.avail_out < buffer_len)
+      break;
+  }
+
+  if (read)
+    *read = buffer_len - inflate_.avail_out;
+  return SR_SUCCESS;
+}
+
+StreamResult ZlibStream::Write(const void* data, size_t data_len,
+                               size_t* written, int* error) {
+  if (!active_)
+    return StreamAdapterInterface::Write(data, data_len, written, error);
+
+  // Only take more once what was compressed before has been written.
+  StreamResult result = WriteOutput(error);
+  if (result != SR_SUCCESS)
+    return result;
+
+  deflate_.next_in = static_cast<Bytef*>(const_cast<void*>(data));
+  deflate_.avail_in = static_cast<uInt>(data_len);
+  do {
+    if (output_.size() - output_end_ < kOutputChunk)
+      output_.resize(output_end_ + kOutputChunk);
+    deflate_.next_out = reinterpret_cast<Bytef*>(&output_[output_end_]);
+    deflate_.avail_out = static_cast<uInt>(output_.size() - output_end_);
+    int status = deflate(&deflate_, Z_SYNC_FLUSH);
+    if (status != Z_OK && status != Z_BUF_ERROR) {
+      LOG(LS_ERROR) << "deflate failed: " << status;
+      if (error)
+        *error = status;
+      return SR_ERROR;
+    }
+    output_end_ = output_.size() - deflate_.avail_out;
+  } while (deflate_.avail_out == 0);
+
+  if (written)
+    *written = data_len;
+  // The input is taken even if the stream under blocks; the rest of it
+  // goes out on its next SE_WRITE.
+  result = WriteOutput(error);
+  return (result == SR_ERROR) ? SR_ERROR : SR_SUCCESS;
+}
+
+StreamResult ZlibStream::WriteOutput(int* error) {
+  while (output_begin_ < output_end_) {
+    size_t written;
+    StreamResult result = StreamAdapterInterface::Write(
+        &output_[output_begin_], output_end_ - output_begin_,
+        &written, error);
+    if (result != SR_SUCCESS)
+      return result;
+    output_begin_ += written;
+  }
+  output_begin_ = output_end_ = 0;
+  return SR_SUCCESS;
+}
+
+void ZlibStream::Close() {
+  Stop();
+  StreamAdapterInterface::Close();
+}
+
+void ZlibStream::OnEvent(StreamInterface* stream, int events, int err) {
+  if (active_ && (events & SE_WRITE)) {
+    int error = 0;
+    StreamResult result = WriteOutput(&error);
+    if (result == SR_BLOCK) {
+      events &= ~SE_WRITE;
+    } else if (result != SR_SUCCESS) {
+      events = (events & ~SE_WRITE) | SE_CLOSE;
+      err = error;
+    }
+  }
+  if (events)
+    StreamAdapterInterface::OnEvent(stream, events, err);
+}
+
+ZlibInflater::ZlibInflater()
+    : initialized_(false),
+      raw_(false),
+      finished_(false),
+      output_begin_(0),
+      output_end_(0) {
+  memset(&inflate_, 0, sizeof(inflate_));
+}
+
+ZlibInflater::~ZlibInflater() {
+  if (initialized_)
+    inflateEnd(&inflate_);
+}
+
+bool ZlibInflater::Init(int window_bits) {
+  if (initialized_) {
+    inflateEnd(&inflate_);
+    initialized_ = false;
+  }
+  if (inflateInit2(&inflate_, window_bits) != Z_OK) {
+    LOG(LS_ERROR) << "inflateInit2 failed: " << inflate_.msg;
+    return false;
+  }
+  initialized_ = true;
+  return true;
+}
+
+bool ZlibInflater::Start() {
+  // A gzip or zlib header is detected; data without one is taken as raw
+  // deflate once the first bytes fail to parse.
+  if (!initialized_ || raw_ || inflateReset(&inflate_) != Z_OK) {
+    if (!Init(MAX_WBITS + 32))
+      return false;
+  }
+  if (!output_.get())
+    output_.reset(new char[kOutputSize]);
+  raw_ = finished_ = false;
+  output_begin_ = output_end_ = 0;
+  return true;
+}
+
+bool ZlibInflater::Inflate(const char* data, size_t len, size_t* used) {
+  ASSERT(initialized_);
+  *used = 0;
+  if (finished_)
+    return true;
+  ASSERT(output_begin_ == output_end_);
+  output_begin_ = output_end_ = 0;
+
+  for (;;) {
+    uLong total_in = inflate_.total_in;
+    inflate_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    inflate_.avail_in = static_cast<uInt>(len);
+    inflate_.next_out = reinterpret_cast<Bytef*>(output_.get());
+    inflate_.avail_out = static_cast<uInt>(kOutputSize);
+    int status = inflate(&inflate_, Z_SYNC_FLUSH);
+    if ((status == Z_DATA_ERROR) && !raw_ && (total_in == 0)
+        && (inflate_.total_out == 0)) {
+      // Some servers send "deflate" without the zlib header.
+      if (!Init(-MAX_WBITS))
+        return false;
+      raw_ = true;
+      continue;
+    }
+    if (status == Z_STREAM_END) {
+      finished_ = true;
+    } else if (status != Z_OK) {
+      // With input and room for output, even Z_BUF_ERROR means it's stuck.
+      LOG(LS_ERROR) << "inflate failed: " << status;
+      return false;
+    }
+    *used = len - inflate_.avail_in;
+    output_end_ = kOutputSize - inflate_.avail_out;
+    return true;
+  }
+}
+
+void ZlibInflater::Consume(size_t len) {
+  ASSERT(len <= output_len());
+  output_begin_ += len;
+}
+
+}  // namespace txmpp
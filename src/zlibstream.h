@@ -0,0 +1,141 @@
+/*
+ * txmpp
+ * Copyright 2010, Silas Sewell
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXMPP_ZLIBSTREAM_H_
+#define _TXMPP_ZLIBSTREAM_H_
+
+#ifndef NO_CONFIG_H
+#include "config.h"
+#endif
+
+#include <vector>
+#include <zlib.h>
+
+#include "scoped_ptr.h"
+#include "stream.h"
+
+namespace txmpp {
+
+// Compresses what is written to the stream under it and decompresses what
+// is read from it, with zlib, once Start is called; until then, and after
+// Stop, it passes bytes through. Each write is flushed to a byte boundary,
+// so the other side can parse all of it. The zlib contexts are kept from
+// one Start to the next and only reset, which saves allocating them on
+// every connection.
+class ZlibStream : public StreamAdapterInterface {
+ public:
+  explicit ZlibStream(StreamInterface* stream, bool owned = true);
+
+  // |level| is 0 to 9, or Z_DEFAULT_COMPRESSION, and |window_bits| is 9 to
+  // 15; lower ones cost less memory and CPU for a worse ratio. Returns
+  // false if zlib couldn't be set up.
+  bool Start(int level, int window_bits);
+  void Stop();
+  bool active() const { return active_; }
+
+  // The bytes written to the stream, and what they came to compressed,
+  // since Start.
+  size_t bytes_written() const;
+  size_t compressed_bytes_written() const;
+
+  virtual StreamResult Read(void* buffer, size_t buffer_len,
+                            size_t* read, int* error);
+  virtual StreamResult Write(const void* data, size_t data_len,
+                             size_t* written, int* error);
+  virtual void Close();
+
+ protected:
+  virtual ~ZlibStream();
+  virtual void OnEvent(StreamInterface* stream, int events, int err);
+
+ private:
+  // Writes the compressed bytes waiting in output_ to the stream under.
+  StreamResult WriteOutput(int* error);
+  void EndContexts();
+
+  static const size_t kInputSize = 16 * 1024;
+  static const size_t kOutputChunk = 4 * 1024;
+
+  bool active_;
+  bool initialized_;
+  int window_bits_;
+  z_stream deflate_;
+  z_stream inflate_;
+  // Input read from the stream under, for inflate_.
+  scoped_array<char> input_;
+  // The compressed bytes from output_begin_ to output_end_ are still to
+  // be written.
+  std::vector<char> output_;
+  size_t output_begin_;
+  size_t output_end_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(ZlibStream);
+};
+
+// Inflates gzip, zlib or raw deflate data pushed to it a piece at a time,
+// into an output buffer of a fixed size. The inflated bytes must be taken
+// before more input is, so memory use doesn't grow with the data.
+class ZlibInflater {
+ public:
+  ZlibInflater();
+  ~ZlibInflater();
+
+  // Readies it for new data, keeping the zlib context. Returns false if
+  // zlib couldn't be set up.
+  bool Start();
+  // Inflates from |data| until it is used up, the output buffer is full or
+  // the compressed data ends, setting |used| to the bytes taken. The output
+  // from the last call must have been taken. Returns false if the data is
+  // corrupt.
+  bool Inflate(const char* data, size_t len, size_t* used);
+  // Set once the end of the compressed data has been inflated.
+  bool finished() const { return finished_; }
+
+  // The inflated bytes not yet taken.
+  const char* output() const { return output_.get() + output_begin_; }
+  size_t output_len() const { return output_end_ - output_begin_; }
+  void Consume(size_t len);
+
+ private:
+  bool Init(int window_bits);
+
+  static const size_t kOutputSize = 16 * 1024;
+
+  bool initialized_;
+  bool raw_;
+  bool finished_;
+  z_stream inflate_;
+  scoped_array<char> output_;
+  size_t output_begin_;
+  size_t output_end_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(ZlibInflater);
+};
+
+}  // namespace txmpp
+
+#endif  // _TXMPP_ZLIBSTREAM_H_